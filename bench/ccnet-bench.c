@@ -0,0 +1,457 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Microbenchmarks of the hot primitives of the daemon.
+ *
+ * Each benchmark is run for at least the minimum time and reported as
+ * one JSON object per line on stdout, e.g.
+ *
+ *   {"bench": "hex_to_rawdata", "iterations": 4194304,
+ *    "ns_per_op": 31.2, "mb_per_sec": 610.4}
+ *
+ * so the results of two releases can be compared by a script.
+ *
+ * The rpc_generic_* and rpc_fast_* pairs compare searpc's marshalling
+ * with the generated one of rpc-fast-marshal.h for each signature.
+ *
+ * Usage: ccnet-bench [-t min-ms] [pattern]
+ */
+
+#include "common.h"
+
+#include <sys/socket.h>
+#include <event.h>
+
+#include "utils.h"
+#include "bloom-filter.h"
+#include "packet-io.h"
+#include "message.h"
+#include "session.h"
+
+#include <searpc-server.h>
+#include "searpc-signature.h"
+#include "searpc-marshal.h"
+#define CCNET_RPC_FAST_BENCH
+#include "rpc-fast-marshal.h"
+
+#define DEFAULT_MIN_MS  200
+
+typedef void (*BenchFunc) (long n, void *data);
+
+typedef struct Bench {
+    const char  *name;
+    BenchFunc    func;
+    void        *data;
+    size_t       bytes;     /* per operation, 0 if not throughput */
+} Bench;
+
+static volatile int sink;
+
+/* Packet framing */
+
+#define FRAME_PAYLOAD   128
+
+typedef struct FramingState {
+    CcnetPacketIO  *reader;
+    CcnetPacketIO  *writer;
+    long            received;
+    long            target;
+} FramingState;
+
+static CcnetSession fake_session;
+
+static void
+framing_can_read (ccnet_packet *packet, void *vstate)
+{
+    FramingState *st = vstate;
+
+    if (++st->received == st->target)
+        event_loopbreak ();
+}
+
+static void
+bench_framing (long n, void *data)
+{
+    FramingState *st = data;
+    char buf[CCNET_PACKET_LENGTH_HEADER + FRAME_PAYLOAD];
+    ccnet_packet *packet = (ccnet_packet *)buf;
+    long i;
+
+    st->received = 0;
+    st->target = n;
+    for (i = 0; i < n; ++i) {
+        packet->header.version = 1;
+        packet->header.type = CCNET_MSG_UPDATE;
+        packet->header.length = FRAME_PAYLOAD;
+        packet->header.id = 1;
+        memset (packet->data, 'x', FRAME_PAYLOAD);
+        ccnet_packet_io_write_packet (st->writer, packet);
+    }
+    event_dispatch ();
+}
+
+static FramingState *
+framing_setup (void)
+{
+    FramingState *st = g_new0 (FramingState, 1);
+    int sv[2];
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror ("socketpair");
+        exit (1);
+    }
+    evutil_make_socket_nonblocking (sv[0]);
+    evutil_make_socket_nonblocking (sv[1]);
+
+    /* The packet io only reads the watermarks from the session. */
+    fake_session.out_high_wm = 1 << 30;
+    fake_session.out_low_wm = 0;
+
+    st->reader = ccnet_packet_io_new_incoming (&fake_session, NULL, sv[0]);
+    st->writer = ccnet_packet_io_new_incoming (&fake_session, NULL, sv[1]);
+    ccnet_packet_io_set_iofuncs (st->reader, framing_can_read,
+                                 NULL, NULL, st);
+    return st;
+}
+
+/* Encryption */
+
+typedef struct CryptState {
+    int             cipher;
+    int             len;
+    EVP_CIPHER_CTX *enc;
+    unsigned char   key[32];
+    unsigned char   iv[16];
+    char           *in;
+    char           *out;
+} CryptState;
+
+static CryptState *
+crypt_setup (int cipher, int len)
+{
+    CryptState *st = g_new0 (CryptState, 1);
+
+    st->cipher = cipher;
+    st->len = len;
+    ccnet_generate_cipher ("bench", 5, st->key, st->iv);
+    st->in = g_malloc (len);
+    memset (st->in, 'x', len);
+    st->out = g_malloc (len + CCNET_CIPHER_BLOCK_SIZE);
+    if (cipher >= 0)
+        st->enc = ccnet_cipher_ctx_new (cipher, 1, st->key, st->iv);
+    return st;
+}
+
+/* The allocating calls, as used for session key exchange. */
+static void
+bench_encrypt_with_key (long n, void *data)
+{
+    CryptState *st = data;
+    char *out;
+    int out_len;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        ccnet_encrypt_with_key (&out, &out_len, st->in, st->len,
+                                st->key, st->iv);
+        sink += out[0];
+        g_free (out);
+    }
+}
+
+static void
+bench_decrypt_with_key (long n, void *data)
+{
+    CryptState *st = data;
+    char *enc, *out;
+    int enc_len, out_len;
+    long i;
+
+    ccnet_encrypt_with_key (&enc, &enc_len, st->in, st->len, st->key, st->iv);
+    for (i = 0; i < n; ++i) {
+        ccnet_decrypt_with_key (&out, &out_len, enc, enc_len, st->key, st->iv);
+        sink += out[0];
+        g_free (out);
+    }
+    g_free (enc);
+}
+
+/* The persistent contexts of encrypted channels. */
+static void
+bench_encrypt_with_ctx (long n, void *data)
+{
+    CryptState *st = data;
+    unsigned char nonce[CCNET_AEAD_NONCE_SIZE] = { 0 };
+    int out_len;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        if (CCNET_CIPHER_IS_AEAD (st->cipher)) {
+            memcpy (nonce, &i, sizeof(i));
+            ccnet_aead_encrypt_with_ctx (st->enc, nonce, st->out, &out_len,
+                                         st->in, st->len);
+        } else
+            ccnet_encrypt_with_ctx (st->enc, st->iv, st->out, &out_len,
+                                    st->in, st->len);
+        sink += st->out[0];
+    }
+}
+
+/* Message parsing */
+
+static void
+bench_message_from_string (long n, void *data)
+{
+    GString *str = data;
+    char *buf = g_malloc (str->len + 1);
+    CcnetMessage *msg;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        /* The parser works in place. */
+        memcpy (buf, str->str, str->len + 1);
+        msg = ccnet_message_from_string (buf, str->len);
+        ccnet_message_unref (msg);
+    }
+    g_free (buf);
+}
+
+static GString *
+message_setup (void)
+{
+    GString *str = g_string_new (NULL);
+    CcnetMessage *msg;
+    char *body = g_strnfill (200, 'b');
+
+    msg = ccnet_message_new ("8e4b13b49ca79f35732d9f44a0804940d985627c",
+                             "fb5b7a8d4fd5ac7bc9c8e2bd8a1b5e5bffd73d5e",
+                             "bench-app", body, 0);
+    ccnet_message_to_string_buf (msg, str);
+    ccnet_message_unref (msg);
+    g_free (body);
+    return str;
+}
+
+/* Bloom filters */
+
+#define BLOOM_KEYS  1024
+
+static char **
+bloom_keys (void)
+{
+    char **keys = g_new (char *, BLOOM_KEYS);
+    int i;
+
+    for (i = 0; i < BLOOM_KEYS; ++i)
+        keys[i] = g_strdup_printf ("%040x", i * 2654435761u);
+    return keys;
+}
+
+static void
+bench_bloom_test (long n, void *data)
+{
+    char **keys = data;
+    Bloom *bloom = bloom_create (1 << 16, 3, 0);
+    long i;
+
+    for (i = 0; i < BLOOM_KEYS; i += 2)
+        bloom_add (bloom, keys[i]);
+    for (i = 0; i < n; ++i)
+        sink += bloom_test (bloom, keys[i & (BLOOM_KEYS - 1)]);
+    bloom_destroy (bloom);
+}
+
+static void
+bench_blocked_bloom_test (long n, void *data)
+{
+    char **keys = data;
+    BlockedBloom *bloom = blocked_bloom_create (1 << 16, 3);
+    long i;
+
+    for (i = 0; i < BLOOM_KEYS; i += 2)
+        blocked_bloom_add (bloom, keys[i]);
+    for (i = 0; i < n; ++i)
+        sink += blocked_bloom_test (bloom, keys[i & (BLOOM_KEYS - 1)]);
+    blocked_bloom_destroy (bloom);
+}
+
+/* Hex conversion of 20 byte ids */
+
+static void
+bench_rawdata_to_hex (long n, void *data)
+{
+    unsigned char raw[20];
+    char hex[41];
+    long i;
+
+    memset (raw, 0xa5, sizeof(raw));
+    for (i = 0; i < n; ++i) {
+        raw[0] = i;
+        rawdata_to_hex (raw, hex, 20);
+        sink += hex[0];
+    }
+}
+
+static void
+bench_hex_to_rawdata (long n, void *data)
+{
+    const char *hex = "8e4b13b49ca79f35732d9f44a0804940d985627c";
+    unsigned char raw[20];
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        hex_to_rawdata (hex, raw, 20);
+        sink += raw[i % 20];
+    }
+}
+
+/* RPC marshalling, searpc's generic path against the generated one,
+ * for every signature in rpc-fast-marshal.h. */
+
+#define RPC_BENCH_SERVICE   "bench"
+
+static void
+rpc_setup (void)
+{
+    CcnetFastMarshalEntry *e;
+    int i;
+
+    searpc_server_init (register_marshals);
+    searpc_create_service (RPC_BENCH_SERVICE);
+    for (i = 0; i < G_N_ELEMENTS (ccnet_fast_marshals); ++i) {
+        e = &ccnet_fast_marshals[i];
+        searpc_server_register_function (RPC_BENCH_SERVICE, e->bench_func,
+                                         g_strconcat ("bench_", e->name, NULL),
+                                         e->signature ());
+    }
+}
+
+static void
+bench_rpc_generic (long n, void *data)
+{
+    CcnetFastMarshalEntry *e = data;
+    gsize len = strlen (e->bench_call), ret_len;
+    long i;
+
+    for (i = 0; i < n; ++i)
+        g_free (searpc_server_call_function (RPC_BENCH_SERVICE,
+                                             (char *)e->bench_call, len,
+                                             &ret_len));
+}
+
+static void
+bench_rpc_fast (long n, void *data)
+{
+    CcnetFastMarshalEntry *e = data;
+    gsize len = strlen (e->bench_call), ret_len;
+    CcnetJsonArgs args;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        if (ccnet_json_args_init (&args, e->bench_call, len) < 0)
+            continue;
+        g_free (e->marshal (e->bench_func, &args, &ret_len));
+        ccnet_json_args_free (&args);
+    }
+}
+
+/* Driver */
+
+static void
+run_bench (Bench *b, int min_ms)
+{
+    gint64 start, usec;
+    long n = 1;
+    double ns;
+
+    /* Double the iterations until one run takes long enough. */
+    for (;;) {
+        start = g_get_monotonic_time ();
+        b->func (n, b->data);
+        usec = g_get_monotonic_time () - start;
+        if (usec >= min_ms * 1000 || n >= (1L << 32))
+            break;
+        n *= 2;
+    }
+
+    ns = usec * 1000.0 / n;
+    printf ("{\"bench\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f",
+            b->name, n, ns);
+    if (b->bytes)
+        printf (", \"mb_per_sec\": %.1f", b->bytes * 1000.0 / ns);
+    printf ("}\n");
+    fflush (stdout);
+}
+
+int
+main (int argc, char **argv)
+{
+    int min_ms = DEFAULT_MIN_MS;
+    const char *pattern = NULL;
+    char **keys;
+    int c, i;
+
+    g_type_init ();
+
+    while ((c = getopt (argc, argv, "t:")) != -1) {
+        switch (c) {
+        case 't':
+            min_ms = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-t min-ms] [pattern]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        pattern = argv[optind];
+
+    event_init ();
+    keys = bloom_keys ();
+
+    Bench benches[] = {
+        { "packet_framing", bench_framing, framing_setup (),
+          CCNET_PACKET_LENGTH_HEADER + FRAME_PAYLOAD },
+        { "encrypt_with_key_1k", bench_encrypt_with_key,
+          crypt_setup (-1, 1024), 1024 },
+        { "decrypt_with_key_1k", bench_decrypt_with_key,
+          crypt_setup (-1, 1024), 1024 },
+        { "encrypt_cbc_ctx_1k", bench_encrypt_with_ctx,
+          crypt_setup (CCNET_CIPHER_AES_256_CBC, 1024), 1024 },
+        { "encrypt_cbc_ctx_64k", bench_encrypt_with_ctx,
+          crypt_setup (CCNET_CIPHER_AES_256_CBC, 65536), 65536 },
+        { "encrypt_gcm_ctx_1k", bench_encrypt_with_ctx,
+          crypt_setup (CCNET_CIPHER_AES_256_GCM, 1024), 1024 },
+        { "encrypt_gcm_ctx_64k", bench_encrypt_with_ctx,
+          crypt_setup (CCNET_CIPHER_AES_256_GCM, 65536), 65536 },
+        { "message_from_string", bench_message_from_string,
+          message_setup (), 0 },
+        { "bloom_test", bench_bloom_test, keys, 0 },
+        { "blocked_bloom_test", bench_blocked_bloom_test, keys, 0 },
+        { "rawdata_to_hex", bench_rawdata_to_hex, NULL, 20 },
+        { "hex_to_rawdata", bench_hex_to_rawdata, NULL, 20 },
+    };
+
+    for (i = 0; i < G_N_ELEMENTS (benches); ++i) {
+        if (pattern && !strstr (benches[i].name, pattern))
+            continue;
+        run_bench (&benches[i], min_ms);
+    }
+
+    rpc_setup ();
+    for (i = 0; i < G_N_ELEMENTS (ccnet_fast_marshals); ++i) {
+        Bench generic = { NULL, bench_rpc_generic, &ccnet_fast_marshals[i], 0 };
+        Bench fast = { NULL, bench_rpc_fast, &ccnet_fast_marshals[i], 0 };
+
+        generic.name = g_strconcat ("rpc_generic_",
+                                    ccnet_fast_marshals[i].name, NULL);
+        fast.name = g_strconcat ("rpc_fast_",
+                                 ccnet_fast_marshals[i].name, NULL);
+        if (!pattern || strstr (generic.name, pattern))
+            run_bench (&generic, min_ms);
+        if (!pattern || strstr (fast.name, pattern))
+            run_bench (&fast, min_ms);
+    }
+
+    return 0;
+}
@@ -0,0 +1,973 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Simulates many peers in one process against a running ccnet-server,
+ * to measure how the server scales with the number of connections.
+ *
+ * Each simulated peer has its own RSA key and speaks the real protocol:
+ * the handshake, keepalive2 in both directions (including the pubkey
+ * and challenge exchange), put-pubinfo, and the receive-skey2 session
+ * key exchange in whichever direction the peer ids require. With -e
+ * the channel is encrypted afterwards (AES-256-CBC).
+ *
+ * The run goes through three phases:
+ *
+ *   ramp     connect -n peers at -r per second and time their setup
+ *   steady   hold them for -s seconds, sending keepalives every -k
+ *   storm    drop every connection at once and time the recovery
+ *
+ * With -p <server pid> the server's CPU time and resident memory are
+ * read from /proc to get the cost per peer. The results are printed
+ * as one JSON object per phase, like ccnet-bench.
+ *
+ * Generating RSA keys is slow, so they are kept in -K (default
+ * ./peersim-keys) and reused by later runs.
+ */
+
+#include "common.h"
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <event.h>
+
+#include "utils.h"
+#include "rsa.h"
+#include "packet-io.h"
+#include "session.h"
+
+#define TICK_MS             100
+
+enum {
+    SIM_DOWN,
+    SIM_HANDSHAKE,
+    SIM_CONNECTED,
+    SIM_UP,                 /* verified both ways and has a session key */
+};
+
+/* Our keepalive2 master */
+enum {
+    KA_INIT,
+    KA_WAIT_PUBKEY,
+    KA_WAIT_CHALLENGE,
+    KA_FULL,
+};
+
+/* Processors the server started on us */
+enum {
+    SLAVE_KEEPALIVE = 1,
+    SLAVE_SKEY,
+    SLAVE_SKEY_ENC,         /* receive-skey2 --enc-channel */
+};
+
+typedef struct SimPeer {
+    int             index;
+    RSA            *privkey;
+    RSA            *pubkey;
+    char           *id;
+    GString        *pubinfo;
+    GString        *pubkey_str;
+
+    int             state;
+    CcnetPacketIO  *io;
+    gint64          t_connect;
+    gint64          retry_at;
+    int             next_req_id;
+    GHashTable     *slaves;         /* request id -> SLAVE_* */
+
+    char            server_id[41];
+    RSA            *server_pubkey;
+
+    int             ka_id;
+    int             ka_state;
+    int             ka_count;
+    unsigned char   challenge[40];
+    gint64          next_keepalive;
+
+    int             skey_id;
+    char            session_key[41];
+    unsigned int    verified_server : 1;
+    unsigned int    verified_by_server : 1;
+    unsigned int    have_key : 1;
+    unsigned int    encrypted : 1;
+    EVP_CIPHER_CTX *enc_ctx;
+    EVP_CIPHER_CTX *dec_ctx;
+    unsigned char   key[32];
+    unsigned char   iv[16];
+} SimPeer;
+
+static char *server_addr = "127.0.0.1";
+static int server_port = 10001;
+static int n_peers = 100;
+static int connect_rate = 200;
+static int steady_secs = 30;
+static int keepalive_secs = 10;
+static int do_storm = 1;
+static int do_encrypt;
+static int server_pid;
+static int key_bits = 2048;
+static char *key_dir = "peersim-keys";
+static int phase_timeout = 300;
+
+static SimPeer *peers;
+static CcnetSession fake_session;
+
+enum {
+    PHASE_RAMP,
+    PHASE_STEADY,
+    PHASE_STORM,
+    PHASE_DONE,
+};
+
+static int phase;
+static gint64 t_phase;
+static int n_up;
+static int n_started;           /* peers connected at least once */
+static guint64 n_connects;
+static guint64 n_failures;      /* connections lost before or after setup */
+static GArray *setup_usecs;     /* of the current phase */
+
+static void sim_connect (SimPeer *p);
+static void sim_disconnect (SimPeer *p, gboolean failed);
+
+/* ---- keys ---- */
+
+static RSA *
+load_or_create_key (int index)
+{
+    char *path;
+    FILE *fp;
+    RSA *key = NULL;
+
+    path = g_strdup_printf ("%s/peer-%05d.pem", key_dir, index);
+    if ((fp = g_fopen (path, "r")) != NULL) {
+        key = PEM_read_RSAPrivateKey (fp, NULL, NULL, NULL);
+        fclose (fp);
+    }
+    if (!key) {
+        key = generate_private_key (key_bits);
+        if ((fp = g_fopen (path, "w")) != NULL) {
+            PEM_write_RSAPrivateKey (fp, key, NULL, NULL, 0, NULL, NULL);
+            fclose (fp);
+        }
+    }
+    g_free (path);
+    return key;
+}
+
+static void
+init_peer (SimPeer *p, int index)
+{
+    p->index = index;
+    p->privkey = load_or_create_key (index);
+    p->pubkey = private_key_to_pub (p->privkey);
+    p->id = id_from_pubkey (p->pubkey);
+    p->pubkey_str = public_key_to_gstring (p->pubkey);
+
+    p->pubinfo = g_string_new (NULL);
+    g_string_append_printf (p->pubinfo, "peer/%s\nname peersim-%d\npubkey %s\n",
+                            p->id, index, p->pubkey_str->str);
+}
+
+/* ---- sending ---- */
+
+static void
+sim_write (SimPeer *p, int type, int id, const char *payload, int len)
+{
+    char *buf = g_malloc (CCNET_PACKET_LENGTH_HEADER + len);
+    ccnet_packet *packet = (ccnet_packet *)buf;
+    ccnet_header enc_header;
+    int enc_len;
+
+    packet->header.version = 1;
+    packet->header.type = type;
+    packet->header.length = htons (len);
+    packet->header.id = htonl (id);
+    memcpy (packet->data, payload, len);
+
+    if (!p->encrypted) {
+        bufferevent_write (p->io->bufev, buf, CCNET_PACKET_LENGTH_HEADER + len);
+        g_free (buf);
+        return;
+    }
+
+    enc_header.version = 1;
+    enc_header.type = CCNET_MSG_ENCPACKET;
+    enc_header.length = 0;
+    {
+        char *out = g_malloc (CCNET_PACKET_LENGTH_HEADER + len
+                              + CCNET_CIPHER_BLOCK_SIZE * 2);
+
+        if (ccnet_encrypt_with_ctx (p->enc_ctx, p->iv,
+                                    out + CCNET_PACKET_LENGTH_HEADER, &enc_len,
+                                    buf, CCNET_PACKET_LENGTH_HEADER + len) < 0) {
+            g_free (out);
+            g_free (buf);
+            sim_disconnect (p, TRUE);
+            return;
+        }
+        enc_header.id = htonl (enc_len);
+        memcpy (out, &enc_header, sizeof(enc_header));
+        bufferevent_write (p->io->bufev, out,
+                           CCNET_PACKET_LENGTH_HEADER + enc_len);
+        g_free (out);
+    }
+    g_free (buf);
+}
+
+/* Responses and updates: "<code> <reason>\n<content>" */
+static void
+sim_send_reply (SimPeer *p, int type, int id, const char *code,
+                const char *reason, const char *content, int clen)
+{
+    GString *buf = g_string_new (code);
+
+    if (reason) {
+        g_string_append_c (buf, ' ');
+        g_string_append (buf, reason);
+    }
+    g_string_append_c (buf, '\n');
+    if (content)
+        g_string_append_len (buf, content, clen);
+
+    sim_write (p, type, id, buf->str, buf->len);
+    g_string_free (buf, TRUE);
+}
+
+#define send_response(p, id, code, reason, content, clen) \
+    sim_send_reply ((p), CCNET_MSG_RESPONSE, (id), (code), (reason), \
+                    (content), (clen))
+#define send_update(p, id, code, reason, content, clen) \
+    sim_send_reply ((p), CCNET_MSG_UPDATE, (id), (code), (reason), \
+                    (content), (clen))
+
+static int
+send_request (SimPeer *p, const char *req)
+{
+    int id = ++p->next_req_id;
+
+    sim_write (p, CCNET_MSG_REQUEST, id, req, strlen (req));
+    return id;
+}
+
+/* ---- state ---- */
+
+static void
+enable_encryption (SimPeer *p)
+{
+    ccnet_generate_cipher (p->session_key, strlen (p->session_key),
+                           p->key, p->iv);
+    p->enc_ctx = ccnet_cipher_ctx_new (CCNET_CIPHER_AES_256_CBC, 1,
+                                       p->key, p->iv);
+    p->dec_ctx = ccnet_cipher_ctx_new (CCNET_CIPHER_AES_256_CBC, 0,
+                                       p->key, p->iv);
+    p->encrypted = 1;
+}
+
+static void
+check_up (SimPeer *p)
+{
+    gint64 usec;
+
+    if (p->state != SIM_CONNECTED || !p->verified_server ||
+        !p->verified_by_server || !p->have_key)
+        return;
+
+    p->state = SIM_UP;
+    n_up++;
+    usec = g_get_monotonic_time () - p->t_connect;
+    g_array_append_val (setup_usecs, usec);
+}
+
+static void
+start_session_key (SimPeer *p)
+{
+    p->skey_id = send_request (p, do_encrypt ? "receive-skey2 --enc-channel"
+                                             : "receive-skey2");
+}
+
+static void
+send_challenge (SimPeer *p)
+{
+    unsigned char *buf;
+    int len;
+
+    RAND_bytes (p->challenge, sizeof(p->challenge));
+    buf = public_key_encrypt (p->server_pubkey, p->challenge,
+                              sizeof(p->challenge), &len);
+    if (len <= 0) {
+        g_free (buf);
+        sim_disconnect (p, TRUE);
+        return;
+    }
+    send_update (p, p->ka_id, "311", NULL, (char *)buf, len);
+    g_free (buf);
+    p->ka_state = KA_WAIT_CHALLENGE;
+}
+
+static void
+send_keepalive (SimPeer *p)
+{
+    char cnt[32];
+
+    g_snprintf (cnt, sizeof(cnt), "%d", p->ka_count++);
+    send_update (p, p->ka_id, "300", cnt, NULL, 0);
+    p->next_keepalive = g_get_monotonic_time ()
+        + (gint64)keepalive_secs * G_USEC_PER_SEC;
+}
+
+/* ---- our keepalive2 and send-skey2 ---- */
+
+static void
+keepalive_response (SimPeer *p, char *code, char *content, int clen)
+{
+    char *id;
+
+    if (strcmp (code, "200") == 0 && p->ka_state == KA_INIT) {
+        if (p->server_pubkey)
+            send_challenge (p);
+        else {
+            send_update (p, p->ka_id, "310", NULL, NULL, 0);
+            p->ka_state = KA_WAIT_PUBKEY;
+        }
+    } else if (strcmp (code, "310") == 0 && p->ka_state == KA_WAIT_PUBKEY) {
+        if (clen == 0 || content[clen-1] != '\0' ||
+            !(p->server_pubkey = public_key_from_string (content))) {
+            sim_disconnect (p, TRUE);
+            return;
+        }
+        id = id_from_pubkey (p->server_pubkey);
+        if (g_strcmp0 (id, p->server_id) != 0) {
+            g_free (id);
+            sim_disconnect (p, TRUE);
+            return;
+        }
+        g_free (id);
+        send_challenge (p);
+    } else if (strcmp (code, "311") == 0 && p->ka_state == KA_WAIT_CHALLENGE) {
+        if (clen != sizeof(p->challenge) ||
+            memcmp (content, p->challenge, clen) != 0) {
+            sim_disconnect (p, TRUE);
+            return;
+        }
+        p->verified_server = 1;
+        /* The peer with the smaller id sends the session key. */
+        if (strcmp (p->id, p->server_id) < 0 && !p->have_key)
+            start_session_key (p);
+        p->ka_state = KA_FULL;
+        send_keepalive (p);
+        check_up (p);
+    } else if (strcmp (code, "300") == 0) {
+        /* keepalive answer */
+    } else {
+        sim_disconnect (p, TRUE);
+    }
+}
+
+static void
+skey_response (SimPeer *p, char *code, char *code_msg)
+{
+    unsigned char raw[20], *enc;
+    int len;
+
+    if (strcmp (code, "300") == 0) {
+        RAND_bytes (raw, sizeof(raw));
+        rawdata_to_hex (raw, p->session_key, sizeof(raw));
+        enc = public_key_encrypt (p->server_pubkey,
+                                  (unsigned char *)p->session_key, 40, &len);
+        if (len <= 0) {
+            g_free (enc);
+            sim_disconnect (p, TRUE);
+            return;
+        }
+        send_update (p, p->skey_id, "300", "session key", (char *)enc, len);
+        g_free (enc);
+        return;
+    }
+
+    if (strcmp (code, "200") == 0) {
+        p->have_key = 1;
+        if (do_encrypt)
+            enable_encryption (p);
+    } else if (strcmp (code, "301") == 0 || strcmp (code, "303") == 0) {
+        /* already has a key, or won't encrypt */
+        p->have_key = 1;
+    } else {
+        sim_disconnect (p, TRUE);
+        return;
+    }
+    p->skey_id = 0;
+    check_up (p);
+}
+
+/* ---- processors of the server ---- */
+
+static void
+handle_request (SimPeer *p, int id, char *data, int len)
+{
+    char *req = g_strndup (data, len);
+
+    if (strcmp (req, "keepalive2") == 0) {
+        g_hash_table_insert (p->slaves, GINT_TO_POINTER(id),
+                             GINT_TO_POINTER(SLAVE_KEEPALIVE));
+        send_response (p, id, "200", "OK", NULL, 0);
+    } else if (strcmp (req, "put-pubinfo") == 0) {
+        send_response (p, id, "200", "OK", p->pubinfo->str,
+                       p->pubinfo->len + 1);
+    } else if (g_str_has_prefix (req, "receive-skey2")) {
+        if (p->have_key) {
+            send_response (p, id, "301", "already has your session key",
+                           NULL, 0);
+        } else {
+            g_hash_table_insert (
+                p->slaves, GINT_TO_POINTER(id),
+                GINT_TO_POINTER(strstr (req, "--enc-channel") ?
+                                SLAVE_SKEY_ENC : SLAVE_SKEY));
+            send_response (p, id, "300", "session key", NULL, 0);
+        }
+    } else {
+        send_response (p, id, "511", "Unknown service", NULL, 0);
+    }
+    g_free (req);
+}
+
+static void
+slave_keepalive_update (SimPeer *p, int id, char *code, char *code_msg,
+                        char *content, int clen)
+{
+    unsigned char *buf;
+    int len;
+
+    if (strcmp (code, "300") == 0) {
+        /* Only sent once the server has verified us. */
+        send_response (p, id, "300", code_msg, NULL, 0);
+        p->verified_by_server = 1;
+        check_up (p);
+    } else if (strcmp (code, "310") == 0) {
+        send_response (p, id, "310", "", p->pubkey_str->str,
+                       p->pubkey_str->len + 1);
+    } else if (strcmp (code, "311") == 0) {
+        buf = private_key_decrypt (p->privkey, (unsigned char *)content,
+                                   clen, &len);
+        if (len < 0)
+            send_response (p, id, "412", "Decrypt error", NULL, 0);
+        else
+            send_response (p, id, "311", "", (char *)buf, len);
+        g_free (buf);
+    } else if (strcmp (code, "312") == 0) {
+        send_response (p, id, "313", "Can not resume", NULL, 0);
+    }
+}
+
+static void
+slave_skey_update (SimPeer *p, int id, int kind, char *code,
+                   char *content, int clen)
+{
+    unsigned char *buf;
+    int len;
+
+    if (strcmp (code, "304") == 0) {
+        send_response (p, id, "305", "can not resume session key", NULL, 0);
+        return;
+    }
+    if (strcmp (code, "300") != 0)
+        return;
+
+    buf = private_key_decrypt (p->privkey, (unsigned char *)content,
+                               clen, &len);
+    if (len <= 0 || len > 40) {
+        g_free (buf);
+        send_response (p, id, "400", "bad session key", NULL, 0);
+        g_hash_table_remove (p->slaves, GINT_TO_POINTER(id));
+        return;
+    }
+    memcpy (p->session_key, buf, len);
+    p->session_key[len] = '\0';
+    g_free (buf);
+    p->have_key = 1;
+    g_hash_table_remove (p->slaves, GINT_TO_POINTER(id));
+
+    if (kind == SLAVE_SKEY_ENC && do_encrypt) {
+        send_response (p, id, "200", "OK", NULL, 0);
+        enable_encryption (p);
+    } else if (kind == SLAVE_SKEY_ENC)
+        send_response (p, id, "303", "Donot encrypt channel", NULL, 0);
+    else
+        send_response (p, id, "200", "OK", NULL, 0);
+    check_up (p);
+}
+
+/* Split "<code> <reason>\n<content>". */
+static int
+parse_reply (char *data, int len, char **code, char **code_msg,
+             char **content, int *clen)
+{
+    char *ptr, *end = data + len;
+
+    if (len < 4)
+        return -1;
+    *code = data;
+    *code_msg = NULL;
+    if (data[3] == '\n') {
+        data[3] = '\0';
+        *content = data + 4;
+    } else if (data[3] == ' ') {
+        data[3] = '\0';
+        *code_msg = data + 4;
+        for (ptr = *code_msg; ptr < end && *ptr != '\n'; ++ptr)
+            ;
+        if (ptr == end)
+            return -1;
+        *ptr = '\0';
+        *content = ptr + 1;
+    } else
+        return -1;
+    *clen = end - *content;
+    return 0;
+}
+
+static void
+handle_packet (SimPeer *p, ccnet_packet *packet)
+{
+    char *data = packet->data;
+    int len = packet->header.length;
+    int id = packet->header.id;
+    char *code, *code_msg, *content;
+    int clen, kind;
+
+    switch (packet->header.type) {
+    case CCNET_MSG_REQUEST:
+        handle_request (p, id, data, len);
+        return;
+    case CCNET_MSG_RESPONSE:
+    case CCNET_MSG_UPDATE:
+        break;
+    default:
+        return;
+    }
+
+    if (parse_reply (data, len, &code, &code_msg, &content, &clen) < 0) {
+        sim_disconnect (p, TRUE);
+        return;
+    }
+
+    if (packet->header.type == CCNET_MSG_RESPONSE) {
+        if (id == p->ka_id)
+            keepalive_response (p, code, content, clen);
+        else if (id == p->skey_id && p->skey_id)
+            skey_response (p, code, code_msg);
+        return;
+    }
+
+    kind = GPOINTER_TO_INT (g_hash_table_lookup (p->slaves,
+                                                 GINT_TO_POINTER(id)));
+    if (code[0] == '1') {
+        /* the master is done or dead */
+        g_hash_table_remove (p->slaves, GINT_TO_POINTER(id));
+        return;
+    }
+    if (kind == SLAVE_KEEPALIVE)
+        slave_keepalive_update (p, id, code, code_msg, content, clen);
+    else if (kind == SLAVE_SKEY || kind == SLAVE_SKEY_ENC)
+        slave_skey_update (p, id, kind, code, content, clen);
+}
+
+static void
+can_read (ccnet_packet *packet, void *vpeer)
+{
+    SimPeer *p = vpeer;
+    ccnet_packet *inner;
+    int len;
+
+    if (p->state == SIM_HANDSHAKE) {
+        ccnet_packet ack;
+
+        if (packet->header.type != CCNET_MSG_HANDSHAKE ||
+            packet->header.length != 40) {
+            sim_disconnect (p, TRUE);
+            return;
+        }
+        memcpy (p->server_id, packet->data, 40);
+        p->server_id[40] = '\0';
+
+        ack.header.version = 1;
+        ack.header.type = CCNET_MSG_OK;
+        ack.header.length = 0;
+        ack.header.id = 0;
+        bufferevent_write (p->io->bufev, &ack, CCNET_PACKET_LENGTH_HEADER);
+
+        p->state = SIM_CONNECTED;
+        p->ka_state = KA_INIT;
+        p->ka_id = send_request (p, "keepalive2");
+        return;
+    }
+
+    if (packet->header.type != CCNET_MSG_ENCPACKET) {
+        handle_packet (p, packet);
+        return;
+    }
+
+    if (!p->dec_ctx ||
+        ccnet_decrypt_with_ctx (p->dec_ctx, p->iv, packet->data, &len,
+                                packet->data, packet->header.id) < 0 ||
+        len < CCNET_PACKET_LENGTH_HEADER) {
+        sim_disconnect (p, TRUE);
+        return;
+    }
+    inner = (ccnet_packet *)packet->data;
+    inner->header.length = ntohs (inner->header.length);
+    inner->header.id = ntohl (inner->header.id);
+    handle_packet (p, inner);
+}
+
+static void
+got_error (struct bufferevent *bev, short what, void *vpeer)
+{
+    sim_disconnect ((SimPeer *)vpeer, TRUE);
+}
+
+/* ---- connections ---- */
+
+static void
+sim_connect (SimPeer *p)
+{
+    char buf[CCNET_PACKET_LENGTH_HEADER + 40];
+    ccnet_packet *packet = (ccnet_packet *)buf;
+
+    p->io = ccnet_packet_io_new_outgoing (&fake_session, server_addr,
+                                          server_port);
+    if (!p->io) {
+        n_failures++;
+        p->retry_at = g_get_monotonic_time () + G_USEC_PER_SEC;
+        return;
+    }
+    ccnet_packet_io_set_iofuncs (p->io, can_read, NULL, got_error, p);
+
+    p->state = SIM_HANDSHAKE;
+    p->t_connect = g_get_monotonic_time ();
+    p->next_req_id = 0;
+    p->slaves = g_hash_table_new (g_direct_hash, g_direct_equal);
+    n_connects++;
+
+    /* No jumbo packets nor batches, so one packet per ENCPACKET. */
+    packet->header.version = 1;
+    packet->header.type = CCNET_MSG_HANDSHAKE;
+    packet->header.length = htons (40);
+    packet->header.id = 0;
+    memcpy (packet->data, p->id, 40);
+    bufferevent_write (p->io->bufev, buf, sizeof(buf));
+}
+
+static void
+sim_disconnect (SimPeer *p, gboolean failed)
+{
+    if (p->state == SIM_DOWN)
+        return;
+
+    if (p->state == SIM_UP)
+        n_up--;
+    if (failed)
+        n_failures++;
+
+    ccnet_packet_io_free (p->io);
+    p->io = NULL;
+    g_hash_table_destroy (p->slaves);
+    p->slaves = NULL;
+    ccnet_cipher_ctx_free (p->enc_ctx);
+    ccnet_cipher_ctx_free (p->dec_ctx);
+    p->enc_ctx = p->dec_ctx = NULL;
+
+    p->state = SIM_DOWN;
+    p->ka_id = p->skey_id = 0;
+    p->verified_server = p->verified_by_server = 0;
+    p->have_key = p->encrypted = 0;
+    p->retry_at = g_get_monotonic_time () + (failed ? G_USEC_PER_SEC : 0);
+}
+
+/* ---- measurements ---- */
+
+/* utime + stime of the server in seconds, -1 if unknown. */
+static double
+server_cpu_secs (void)
+{
+    char path[64], *contents, *ptr;
+    unsigned long utime, stime;
+    int i;
+
+    if (!server_pid)
+        return -1;
+    g_snprintf (path, sizeof(path), "/proc/%d/stat", server_pid);
+    if (!g_file_get_contents (path, &contents, NULL, NULL))
+        return -1;
+
+    /* Fields 14 and 15, counted after the command name. */
+    ptr = strrchr (contents, ')');
+    for (i = 0; ptr && i < 12; ++i)
+        ptr = strchr (ptr + 1, ' ');
+    if (!ptr || sscanf (ptr, " %lu %lu", &utime, &stime) != 2) {
+        g_free (contents);
+        return -1;
+    }
+    g_free (contents);
+    return (utime + stime) / (double)sysconf (_SC_CLK_TCK);
+}
+
+/* Resident memory of the server in KB, -1 if unknown. */
+static long
+server_rss_kb (void)
+{
+    char path[64], *contents, *ptr;
+    long kb = -1;
+
+    if (!server_pid)
+        return -1;
+    g_snprintf (path, sizeof(path), "/proc/%d/status", server_pid);
+    if (!g_file_get_contents (path, &contents, NULL, NULL))
+        return -1;
+    if ((ptr = strstr (contents, "VmRSS:")) != NULL)
+        kb = atol (ptr + strlen ("VmRSS:"));
+    g_free (contents);
+    return kb;
+}
+
+static double
+own_cpu_secs (void)
+{
+    struct rusage ru;
+
+    getrusage (RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+        + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int
+cmp_usec (const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static gint64
+percentile (GArray *a, double p)
+{
+    if (a->len == 0)
+        return 0;
+    return g_array_index (a, gint64, MIN ((guint)(a->len * p), a->len - 1));
+}
+
+static long rss_before;
+static double cpu_steady, own_cpu_steady;
+
+static void
+report_setup (const char *name)
+{
+    double secs = (g_get_monotonic_time () - t_phase) / 1e6;
+
+    g_array_sort (setup_usecs, cmp_usec);
+    printf ("{\"phase\": \"%s\", \"peers\": %d, \"up\": %d, \"seconds\": %.3f, "
+            "\"setups_per_sec\": %.1f, \"setup_p50_us\": %" G_GINT64_FORMAT
+            ", \"setup_p99_us\": %" G_GINT64_FORMAT
+            ", \"setup_max_us\": %" G_GINT64_FORMAT
+            ", \"connects\": %" G_GUINT64_FORMAT
+            ", \"failures\": %" G_GUINT64_FORMAT "}\n",
+            name, n_peers, n_up, secs, setup_usecs->len / secs,
+            percentile (setup_usecs, 0.5), percentile (setup_usecs, 0.99),
+            percentile (setup_usecs, 1.0), n_connects, n_failures);
+    fflush (stdout);
+    g_array_set_size (setup_usecs, 0);
+    n_connects = n_failures = 0;
+}
+
+static void
+report_steady (void)
+{
+    double secs = (g_get_monotonic_time () - t_phase) / 1e6;
+    double cpu = server_cpu_secs ();
+    long rss = server_rss_kb ();
+
+    printf ("{\"phase\": \"steady\", \"peers\": %d, \"up\": %d, "
+            "\"seconds\": %.3f, \"keepalive_secs\": %d, \"encrypt\": %s, "
+            "\"failures\": %" G_GUINT64_FORMAT,
+            n_peers, n_up, secs, keepalive_secs,
+            do_encrypt ? "true" : "false", n_failures);
+    if (cpu >= 0)
+        printf (", \"server_cpu_percent\": %.2f, "
+                "\"server_cpu_us_per_peer_sec\": %.3f",
+                (cpu - cpu_steady) * 100 / secs,
+                (cpu - cpu_steady) * 1e6 / secs / n_peers);
+    if (rss >= 0)
+        printf (", \"server_rss_kb\": %ld, \"server_kb_per_peer\": %.2f",
+                rss, (rss - rss_before) / (double)n_peers);
+    printf (", \"sim_cpu_percent\": %.2f}\n",
+            (own_cpu_secs () - own_cpu_steady) * 100 / secs);
+    fflush (stdout);
+    n_failures = 0;
+}
+
+/* ---- driver ---- */
+
+static void
+start_phase (int next)
+{
+    int i;
+
+    phase = next;
+    t_phase = g_get_monotonic_time ();
+
+    switch (phase) {
+    case PHASE_STEADY:
+        cpu_steady = server_cpu_secs ();
+        own_cpu_steady = own_cpu_secs ();
+        break;
+    case PHASE_STORM:
+        /* Everyone at once, as after a network outage. */
+        for (i = 0; i < n_peers; ++i) {
+            sim_disconnect (&peers[i], FALSE);
+            peers[i].retry_at = 0;
+        }
+        for (i = 0; i < n_peers; ++i)
+            sim_connect (&peers[i]);
+        break;
+    case PHASE_DONE:
+        event_loopbreak ();
+        break;
+    }
+}
+
+static void
+tick (int fd, short event, void *vev)
+{
+    struct timeval tv = { 0, TICK_MS * 1000 };
+    gint64 now = g_get_monotonic_time ();
+    gint64 elapsed = now - t_phase;
+    int i, want;
+
+    /* Start new peers at the connect rate while ramping up. */
+    if (phase == PHASE_RAMP) {
+        want = MIN (n_peers, (int)(elapsed * connect_rate / G_USEC_PER_SEC) + 1);
+        for (; n_started < want; ++n_started)
+            sim_connect (&peers[n_started]);
+    }
+
+    for (i = 0; i < n_started; ++i) {
+        SimPeer *p = &peers[i];
+
+        if (p->state == SIM_DOWN && now >= p->retry_at)
+            sim_connect (p);
+        else if (p->state >= SIM_CONNECTED && p->ka_state == KA_FULL &&
+                 now >= p->next_keepalive)
+            send_keepalive (p);
+    }
+
+    switch (phase) {
+    case PHASE_RAMP:
+        if (n_up == n_peers || elapsed > (gint64)phase_timeout * G_USEC_PER_SEC) {
+            report_setup ("ramp");
+            start_phase (steady_secs > 0 ? PHASE_STEADY :
+                         do_storm ? PHASE_STORM : PHASE_DONE);
+        }
+        break;
+    case PHASE_STEADY:
+        if (elapsed >= (gint64)steady_secs * G_USEC_PER_SEC) {
+            report_steady ();
+            start_phase (do_storm ? PHASE_STORM : PHASE_DONE);
+        }
+        break;
+    case PHASE_STORM:
+        if (n_up == n_peers || elapsed > (gint64)phase_timeout * G_USEC_PER_SEC) {
+            report_setup ("storm");
+            start_phase (PHASE_DONE);
+        }
+        break;
+    }
+
+    if (phase != PHASE_DONE)
+        evtimer_add ((struct event *)vev, &tv);
+}
+
+static gboolean no_storm;
+
+static GOptionEntry entries[] = {
+    { "server", 'a', 0, G_OPTION_ARG_STRING, &server_addr,
+      "server address (127.0.0.1)", NULL },
+    { "port", 'P', 0, G_OPTION_ARG_INT, &server_port,
+      "server port (10001)", NULL },
+    { "peers", 'n', 0, G_OPTION_ARG_INT, &n_peers,
+      "number of simulated peers (100)", NULL },
+    { "rate", 'r', 0, G_OPTION_ARG_INT, &connect_rate,
+      "new connections per second while ramping up (200)", NULL },
+    { "steady", 's', 0, G_OPTION_ARG_INT, &steady_secs,
+      "seconds of steady state (30)", NULL },
+    { "keepalive", 'k', 0, G_OPTION_ARG_INT, &keepalive_secs,
+      "keepalive interval of the peers (10)", NULL },
+    { "no-storm", 0, 0, G_OPTION_ARG_NONE, &no_storm,
+      "skip the reconnect storm", NULL },
+    { "encrypt", 'e', 0, G_OPTION_ARG_NONE, &do_encrypt,
+      "ask for encrypted channels", NULL },
+    { "server-pid", 'p', 0, G_OPTION_ARG_INT, &server_pid,
+      "pid of ccnet-server, for its cpu and memory use", NULL },
+    { "key-dir", 'K', 0, G_OPTION_ARG_STRING, &key_dir,
+      "where the peer keys are kept (peersim-keys)", NULL },
+    { "key-bits", 'b', 0, G_OPTION_ARG_INT, &key_bits,
+      "size of new peer keys (2048)", NULL },
+    { "timeout", 't', 0, G_OPTION_ARG_INT, &phase_timeout,
+      "seconds to wait for all peers to come up (300)", NULL },
+    { NULL },
+};
+
+int
+main (int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    struct event tick_ev;
+    struct timeval tv = { 0, TICK_MS * 1000 };
+    int i;
+
+    g_type_init ();
+
+    context = g_option_context_new (NULL);
+    g_option_context_set_summary (context,
+        "Simulate many peers connecting to ccnet-server.");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        fprintf (stderr, "option parsing failed: %s\n", error->message);
+        return 1;
+    }
+    if (n_peers <= 0 || connect_rate <= 0 || keepalive_secs <= 0) {
+        fprintf (stderr, "Bad options\n");
+        return 1;
+    }
+    do_storm = !no_storm;
+
+    /* One descriptor per peer. */
+    {
+        struct rlimit rl;
+
+        if (getrlimit (RLIMIT_NOFILE, &rl) == 0 &&
+            rl.rlim_cur < (rlim_t)n_peers + 64) {
+            rl.rlim_cur = MIN (rl.rlim_max, (rlim_t)n_peers + 64);
+            setrlimit (RLIMIT_NOFILE, &rl);
+        }
+    }
+
+    g_mkdir_with_parents (key_dir, 0700);
+    peers = g_new0 (SimPeer, n_peers);
+    for (i = 0; i < n_peers; ++i)
+        init_peer (&peers[i], i);
+
+    event_init ();
+    /* The packet io only reads the watermarks from the session. */
+    fake_session.out_high_wm = 1 << 30;
+    fake_session.out_low_wm = 0;
+
+    setup_usecs = g_array_new (FALSE, FALSE, sizeof(gint64));
+    rss_before = server_rss_kb ();
+
+    start_phase (PHASE_RAMP);
+    evtimer_set (&tick_ev, tick, &tick_ev);
+    evtimer_add (&tick_ev, &tv);
+    event_dispatch ();
+
+    return n_up == n_peers ? 0 : 1;
+}
@@ -0,0 +1,379 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Drives a mix of rpc calls against ccnet-server from many threads
+ * through the client pool and reports throughput and latency.
+ *
+ *   ccnet-loadgen -c CONF -t 32 -d 30 -w 5 -r 2000 \
+ *       -m get_emailuser=4,get_groups=2,is_group_user=2,get_peer=1
+ */
+
+#include <config.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include <ccnet.h>
+#include <ccnet/ccnetrpc-transport.h>
+
+/*
+ * Latencies are kept in a log-linear histogram: 32 sub-buckets per
+ * power of two of microseconds, so a percentile is within 3%.
+ */
+#define SUB_BITS            5
+#define SUB_BUCKETS         (1 << SUB_BITS)
+#define N_BUCKETS           ((64 - SUB_BITS) * SUB_BUCKETS)
+
+enum {
+    CALL_GET_EMAILUSER,
+    CALL_GET_GROUPS,
+    CALL_IS_GROUP_USER,
+    CALL_GET_PEER,
+    N_CALLS,
+};
+
+static const char *call_names[N_CALLS] = {
+    "get_emailuser", "get_groups", "is_group_user", "get_peer",
+};
+
+typedef struct Histogram {
+    guint64     buckets[N_BUCKETS];
+    guint64     count;
+    gint64      max;
+} Histogram;
+
+typedef struct Worker {
+    pthread_t   tid;
+    int         index;
+    GRand      *rand;
+    Histogram   hist[N_CALLS];
+    guint64     errors[N_CALLS];
+} Worker;
+
+static char *config_dir;
+static int n_threads = 8;
+static int duration = 10;
+static int warmup = 2;
+static int rate;
+static char *mix = "get_emailuser=4,get_groups=2,is_group_user=2,get_peer=1";
+static char *email = "loadgen@example.com";
+static int group_id = 1;
+
+static GOptionEntry entries[] = {
+    { "config-file", 'c', 0, G_OPTION_ARG_STRING, &config_dir,
+      "ccnet configuration directory", NULL },
+    { "threads", 't', 0, G_OPTION_ARG_INT, &n_threads,
+      "number of client threads (8)", NULL },
+    { "duration", 'd', 0, G_OPTION_ARG_INT, &duration,
+      "seconds to measure (10)", NULL },
+    { "warmup", 'w', 0, G_OPTION_ARG_INT, &warmup,
+      "seconds to run before measuring (2)", NULL },
+    { "rate", 'r', 0, G_OPTION_ARG_INT, &rate,
+      "calls per second over all threads, 0 for no limit", NULL },
+    { "mix", 'm', 0, G_OPTION_ARG_STRING, &mix,
+      "weights of the calls, name=weight,...", NULL },
+    { "email", 'e', 0, G_OPTION_ARG_STRING, &email,
+      "user to look up", NULL },
+    { "group", 'g', 0, G_OPTION_ARG_INT, &group_id,
+      "group for is_group_user (1)", NULL },
+    { NULL },
+};
+
+static int weights[N_CALLS];
+static int total_weight;
+
+static char *fcalls[N_CALLS];
+static size_t fcall_lens[N_CALLS];
+static CcnetrpcTransportParam *params[N_CALLS];
+
+static gint64 t_measure;        /* end of the warm up */
+static gint64 t_end;
+
+static int
+parse_mix (const char *str)
+{
+    char **items, **kv;
+    int i, j;
+
+    items = g_strsplit (str, ",", 0);
+    for (i = 0; items[i]; ++i) {
+        kv = g_strsplit (items[i], "=", 2);
+        for (j = 0; j < N_CALLS; ++j)
+            if (strcmp (kv[0], call_names[j]) == 0)
+                break;
+        if (j == N_CALLS || !kv[1] || atoi (kv[1]) < 0) {
+            fprintf (stderr, "Bad call in mix: %s\n", items[i]);
+            g_strfreev (kv);
+            g_strfreev (items);
+            return -1;
+        }
+        weights[j] = atoi (kv[1]);
+        g_strfreev (kv);
+    }
+    g_strfreev (items);
+
+    for (j = 0; j < N_CALLS; ++j)
+        total_weight += weights[j];
+    if (total_weight == 0) {
+        fprintf (stderr, "Empty call mix\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* The calls are fixed, so they are serialized once. */
+static void
+prepare_calls (CcnetClientPool *pool, const char *peer_id)
+{
+    CcnetrpcTransportParam *rpc, *threaded;
+    char *user = g_strescape (email, NULL);
+    int i;
+
+    rpc = g_new0 (CcnetrpcTransportParam, 1);
+    rpc->pool = pool;
+    rpc->service = "ccnet-rpcserver";
+    threaded = g_new0 (CcnetrpcTransportParam, 1);
+    threaded->pool = pool;
+    threaded->service = "ccnet-threaded-rpcserver";
+
+    fcalls[CALL_GET_EMAILUSER] =
+        g_strdup_printf ("[\"get_emailuser\", \"%s\"]", user);
+    fcalls[CALL_GET_GROUPS] =
+        g_strdup_printf ("[\"get_groups\", \"%s\"]", user);
+    fcalls[CALL_IS_GROUP_USER] =
+        g_strdup_printf ("[\"is_group_user\", %d, \"%s\"]", group_id, user);
+    fcalls[CALL_GET_PEER] =
+        g_strdup_printf ("[\"get_peer\", \"%s\"]", peer_id);
+
+    for (i = 0; i < N_CALLS; ++i) {
+        fcall_lens[i] = strlen (fcalls[i]);
+        params[i] = (i == CALL_GET_PEER) ? rpc : threaded;
+    }
+    g_free (user);
+}
+
+static int
+bucket_of (gint64 usec)
+{
+    int msb;
+
+    if (usec < SUB_BUCKETS)
+        return usec;
+    msb = 63 - __builtin_clzll ((guint64)usec);
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS
+        + ((usec >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* The upper bound of a bucket, in usec. */
+static gint64
+bucket_value (int bucket)
+{
+    int shift = bucket / SUB_BUCKETS - 1;
+
+    if (shift < 0)
+        return bucket;
+    return ((gint64)(SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void
+histogram_add (Histogram *h, gint64 usec)
+{
+    h->buckets[bucket_of (usec)]++;
+    h->count++;
+    if (usec > h->max)
+        h->max = usec;
+}
+
+static void
+histogram_merge (Histogram *dst, const Histogram *src)
+{
+    int i;
+
+    for (i = 0; i < N_BUCKETS; ++i)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+static gint64
+histogram_percentile (const Histogram *h, double p)
+{
+    guint64 rank = (guint64)(h->count * p), seen = 0;
+    int i;
+
+    for (i = 0; i < N_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return MIN (bucket_value (i), h->max);
+    }
+    return h->max;
+}
+
+static int
+pick_call (Worker *w)
+{
+    int r = g_rand_int_range (w->rand, 0, total_weight);
+    int i;
+
+    for (i = 0; i < N_CALLS - 1; ++i) {
+        if (r < weights[i])
+            return i;
+        r -= weights[i];
+    }
+    return N_CALLS - 1;
+}
+
+static void *
+worker_thread (void *vw)
+{
+    Worker *w = vw;
+    gint64 interval = 0, next, start, now;
+    char *ret;
+    size_t ret_len;
+    int call;
+
+    /* Each thread sends its share of the rate, at even intervals. */
+    if (rate > 0)
+        interval = (gint64)G_USEC_PER_SEC * n_threads / rate;
+    next = g_get_monotonic_time () + (interval * w->index) / n_threads;
+
+    while ((now = g_get_monotonic_time ()) < t_end) {
+        if (interval) {
+            if (now < next)
+                g_usleep (next - now);
+            next += interval;
+        }
+
+        call = pick_call (w);
+        start = g_get_monotonic_time ();
+        ret = ccnetrpc_transport_send (params[call], fcalls[call],
+                                       fcall_lens[call], &ret_len);
+        now = g_get_monotonic_time ();
+        if (start < t_measure)
+            continue;
+
+        if (!ret || strstr (ret, "\"err_code\""))
+            w->errors[call]++;
+        else
+            histogram_add (&w->hist[call], now - start);
+        g_free (ret);
+    }
+    return NULL;
+}
+
+static void
+print_line (const char *name, const Histogram *h, guint64 errors)
+{
+    printf ("%-14s %10" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT
+            " %10.1f %8" G_GINT64_FORMAT " %8" G_GINT64_FORMAT
+            " %8" G_GINT64_FORMAT " %8" G_GINT64_FORMAT "\n",
+            name, h->count, errors, h->count / (double)duration,
+            histogram_percentile (h, 0.5), histogram_percentile (h, 0.99),
+            histogram_percentile (h, 0.999), h->max);
+}
+
+static void
+report (Worker *workers)
+{
+    Histogram *total = g_new0 (Histogram, 1);
+    Histogram *call = g_new0 (Histogram, 1);
+    guint64 errors, total_errors = 0;
+    int i, j;
+
+    printf ("%-14s %10s %8s %10s %8s %8s %8s %8s\n", "call", "ok", "errors",
+            "calls/s", "p50_us", "p99_us", "p999_us", "max_us");
+    for (i = 0; i < N_CALLS; ++i) {
+        if (!weights[i])
+            continue;
+        memset (call, 0, sizeof(Histogram));
+        errors = 0;
+        for (j = 0; j < n_threads; ++j) {
+            histogram_merge (call, &workers[j].hist[i]);
+            errors += workers[j].errors[i];
+        }
+        print_line (call_names[i], call, errors);
+        histogram_merge (total, call);
+        total_errors += errors;
+    }
+    print_line ("total", total, total_errors);
+
+    g_free (call);
+    g_free (total);
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    CcnetClientPool *pool;
+    CcnetClient *client;
+    Worker *workers;
+    char *peer_id;
+    int i;
+
+    g_type_init ();
+    config_dir = DEFAULT_CONFIG_DIR;
+
+    context = g_option_context_new (NULL);
+    g_option_context_set_summary (context,
+        "Drive rpc calls against ccnet-server and report latency.");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        fprintf (stderr, "option parsing failed: %s\n", error->message);
+        exit (1);
+    }
+    if (n_threads <= 0 || duration <= 0 || warmup < 0 || rate < 0) {
+        fprintf (stderr, "Bad options\n");
+        exit (1);
+    }
+    if (parse_mix (mix) < 0)
+        exit (1);
+
+    pool = ccnet_client_pool_new (config_dir);
+    if (!pool) {
+        fprintf (stderr, "Read config dir error\n");
+        exit (1);
+    }
+    ccnet_client_pool_set_limits (pool, n_threads, n_threads, 0);
+
+    /* get_peer looks up the server itself. */
+    client = ccnet_client_pool_get_client (pool);
+    if (!client) {
+        fprintf (stderr, "Connect to server failed\n");
+        exit (1);
+    }
+    peer_id = g_strdup (client->base.id);
+    ccnet_client_pool_return_client (pool, client);
+
+    prepare_calls (pool, peer_id);
+
+    t_measure = g_get_monotonic_time () + (gint64)warmup * G_USEC_PER_SEC;
+    t_end = t_measure + (gint64)duration * G_USEC_PER_SEC;
+
+    workers = g_new0 (Worker, n_threads);
+    for (i = 0; i < n_threads; ++i) {
+        workers[i].index = i;
+        workers[i].rand = g_rand_new ();
+        if (pthread_create (&workers[i].tid, NULL, worker_thread,
+                            &workers[i]) != 0) {
+            fprintf (stderr, "Failed to start thread %d\n", i);
+            exit (1);
+        }
+    }
+    for (i = 0; i < n_threads; ++i)
+        pthread_join (workers[i].tid, NULL);
+
+    printf ("threads %d duration %ds warmup %ds rate %d\n",
+            n_threads, duration, warmup, rate);
+    report (workers);
+
+    return 0;
+}
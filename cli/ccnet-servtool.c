@@ -57,6 +57,8 @@ static int add_peer       (int argc, char **argv);
 static int redirect_peer   (int, char **);
 static int add_member     (int argc, char **argv);
 static int add_master     (int argc, char **argv);
+static int show_stats     (int argc, char **argv);
+static int show_memory    (int argc, char **argv);
 
 static struct cmd cmdtab[] =  {
     { "add-client",     add_client  },
@@ -64,6 +66,8 @@ static struct cmd cmdtab[] =  {
     { "redirect-peer",  redirect_peer  },
     { "add-member",     add_member  },
     { "add-master",     add_master  },
+    { "stats",          show_stats  },
+    { "memory",         show_memory },
     { 0 },
 };
 
@@ -107,6 +111,8 @@ void usage()
 "  add-peer      Add a peer\n"
 "  redirect-peer Redirector a peer\n"
 "  add-member    Add a cluster member peer\n"
+"  stats         Show traffic of peers and processors\n"
+"  memory        Show memory use by subsystem and processor class\n"
     ,stderr);
 }
 
@@ -303,3 +309,56 @@ static int add_master (int argc, char **argv)
 
     return 0;
 }
+
+static int
+show_stats (int argc, char **argv)
+{
+    SearpcClient *rpc;
+    GError *error = NULL;
+    char *stats;
+
+    if (argc != 0) {
+        fputs ("stats\n", stderr);
+        return -1;
+    }
+
+    rpc = ccnet_create_rpc_client (client, NULL, "ccnet-rpcserver");
+    stats = searpc_client_call__string (rpc, "get_traffic_stats", &error, 0);
+    ccnet_rpc_client_free (rpc);
+    if (error) {
+        fprintf (stderr, "Error: %s\n", error->message);
+        g_error_free (error);
+        return -1;
+    }
+
+    fputs (stats, stdout);
+    g_free (stats);
+    return 0;
+}
+
+static int
+show_memory (int argc, char **argv)
+{
+    SearpcClient *rpc;
+    GError *error = NULL;
+    char *stats;
+
+    if (argc != 0) {
+        fputs ("memory\n", stderr);
+        return -1;
+    }
+
+    rpc = ccnet_create_rpc_client (client, NULL, "ccnet-rpcserver");
+    stats = searpc_client_call__string (rpc, "get_memory_stats", &error, 0);
+    ccnet_rpc_client_free (rpc);
+    if (error) {
+        fprintf (stderr, "Error: %s\n", error->message);
+        g_error_free (error);
+        return -1;
+    }
+
+    fputs ("what\tcount\tbytes\n", stdout);
+    fputs (stats, stdout);
+    g_free (stats);
+    return 0;
+}
@@ -51,13 +51,48 @@ typedef struct CcnetClientPool CcnetClientPool;
 struct CcnetClientPool *
 ccnet_client_pool_new (const char *conf_dir);
 
+/* Blocks while the pool is at its maximum size. */
 CcnetClient *
 ccnet_client_pool_get_client (struct CcnetClientPool *cpool);
 
+/* @timeout_ms: 0 to fail at once, -1 to wait forever. */
+CcnetClient *
+ccnet_client_pool_get_client_timeout (struct CcnetClientPool *cpool,
+                                      int timeout_ms);
+
 void
 ccnet_client_pool_return_client (struct CcnetClientPool *cpool,
                                  CcnetClient *client);
 
+/* For a client which stopped working, instead of returning it. */
+void
+ccnet_client_pool_discard_client (struct CcnetClientPool *cpool,
+                                  CcnetClient *client);
+
+/*
+ * Keep at most @max_size clients (0 for no limit), connecting
+ * @min_size of them right away. Idle clients above @min_size are
+ * closed after @idle_timeout seconds (0 to keep them).
+ */
+void
+ccnet_client_pool_set_limits (struct CcnetClientPool *cpool,
+                              int min_size, int max_size, int idle_timeout);
+
+typedef struct CcnetClientPoolStats {
+    int      n_clients;         /* idle and in use */
+    int      n_idle;
+    guint64  n_waits;           /* takers blocked by max_size */
+    guint64  n_timeouts;
+    guint64  n_created;
+    guint64  n_failures;        /* failed connects */
+    guint64  n_broken;          /* found dead or discarded */
+    guint64  n_reaped;
+} CcnetClientPoolStats;
+
+void
+ccnet_client_pool_get_stats (struct CcnetClientPool *cpool,
+                             CcnetClientPoolStats *stats);
+
 /* rpc wrapper */
 
 /* Create rpc client using a single client for transport. */
@@ -78,6 +113,24 @@ ccnet_create_async_rpc_client (CcnetClient *cclient, const char *peer_id,
 void ccnet_rpc_client_free (SearpcClient *client);
 void ccnet_async_rpc_client_free (SearpcClient *client);
 
+/*
+ * A client whose async calls are queued rather than sent. The calls
+ * are made with the usual *_async() functions, and
+ * ccnet_async_rpc_batch_flush() sends the queue to the server of
+ * @async_client in one update per RPC_BATCH_MAX calls. Every call's
+ * callback gets its result, or an error if the batch failed, then
+ * @done is called once. Servers without batch calls get the calls one
+ * by one. Returns -1, keeping the queue, if the client isn't
+ * connected. The batch may be flushed again after that.
+ */
+typedef void (*CcnetAsyncBatchDone) (gboolean success, void *user_data);
+
+SearpcClient *ccnet_create_async_rpc_batch (SearpcClient *async_client);
+int ccnet_async_rpc_batch_flush (SearpcClient *batch,
+                                 CcnetAsyncBatchDone done, void *user_data);
+/* The calls still queued fail. */
+void ccnet_async_rpc_batch_free (SearpcClient *batch);
+
 CcnetPeer *ccnet_get_peer (SearpcClient *client, const char *peer_id);
 CcnetPeer *ccnet_get_peer_by_idname (SearpcClient *client, const char *idname);
 int ccnet_get_peer_net_state (SearpcClient *client, const char *peer_id);
@@ -88,20 +141,52 @@ GList *ccnet_get_peers_by_role (SearpcClient *client, const char *role);
 
 char *ccnet_get_binding_email (SearpcClient *client, const char *peer_id);
 GList *ccnet_get_groups_by_user (SearpcClient *client, const char *user);
+/* Map from each of @users to its GList of CcnetGroupUser. */
+GHashTable *ccnet_get_groups_by_users (SearpcClient *client, GList *users);
+/* @users is newline separated; the callback gets the GroupUser list. */
+int
+ccnet_get_groups_by_users_async (SearpcClient *client, const char *users,
+                                 AsyncCallback callback, void *user_data);
 GList *
 ccnet_get_group_members (SearpcClient *client, int group_id);
 int
+ccnet_is_group_user (SearpcClient *client, int group_id, const char *user);
+
+/* These and ccnet_get_peer(), ccnet_get_groups_by_user() and
+ * ccnet_is_group_user() use the binary encoding when the server has it. */
+GObject *
+ccnet_get_emailuser (SearpcClient *client, const char *email);
+GObject *
+ccnet_get_org_by_url_prefix (SearpcClient *client, const char *url_prefix);
+int
 ccnet_org_user_exists (SearpcClient *client, int org_id, const char *user);
 
+int
+ccnet_get_groups_by_user_async (SearpcClient *client, const char *user,
+                                AsyncCallback callback, void *user_data);
+int
+ccnet_get_group_members_async (SearpcClient *client, int group_id,
+                               AsyncCallback callback, void *user_data);
+int
+ccnet_org_user_exists_async (SearpcClient *client, int org_id,
+                             const char *user,
+                             AsyncCallback callback, void *user_data);
+
 int
 ccnet_get_binding_email_async (SearpcClient *client, const char *peer_id,
                                AsyncCallback callback, void *user_data);
 
+/* On a server, a client of "ccnet-threaded-rpcserver" signs off the
+ * main loop. */
 char *ccnet_sign_message (SearpcClient *client, const char *message);
 int ccnet_verify_message (SearpcClient *client,
                           const char *message,
                           const char *sig_base64,
                           const char *peer_id);
+/* @messages has a line "<peer_id> <sig_base64> <message>" per message.
+ * Returns a '1' (valid) or '0' per line, verified on the server's
+ * crypto threads. */
+char *ccnet_verify_messages (SearpcClient *client, const char *messages);
 
 char *ccnet_get_config (SearpcClient *client, const char *key);
 int ccnet_set_config (SearpcClient *client, const char *key, const char *value);
@@ -31,5 +31,24 @@ void ccnet_async_rpc_proc_set_rpc (CcnetAsyncRpcProc *proc,
                                    char *fcall_str,
                                    size_t fcall_len,
                                    void *rpc_priv);
+
+/* A call queued on a batch client, see ccnet_create_async_rpc_batch(). */
+typedef struct {
+    char   *fcall_str;
+    size_t  fcall_len;
+    void   *rpc_priv;
+} CcnetAsyncRpcCall;
+
+/* Send @calls, a GPtrArray of CcnetAsyncRpcCall owned by the processor
+ * from now on, in one SC_CLIENT_BATCH (at most RPC_BATCH_MAX calls). */
+void ccnet_async_rpc_proc_set_batch (CcnetAsyncRpcProc *proc,
+                                     const char *service,
+                                     GPtrArray *calls);
+
+/* The calls which got no result yet, or NULL. The caller owns them. */
+GPtrArray *ccnet_async_rpc_proc_take_calls (CcnetAsyncRpcProc *proc);
+
+/* Run the callbacks of @calls with @error, and free them. */
+void ccnet_async_rpc_fail_calls (GPtrArray *calls, const char *error);
 #endif
 
@@ -62,6 +62,7 @@ struct CcnetResponse {
 };
 
 typedef struct CcnetClientPriv CcnetClientPriv;
+struct CcnetClientLoop;
 
 
 /**
@@ -84,8 +85,10 @@ struct _CcnetClient
     char                        *config_file;
 
     int                         daemon_port;
+    char                       *un_path;   /* unix socket of the daemon */
 
     int                         connected : 1;
+    int                         shm_transport : 1; /* [Client] SHM_TRANSPORT */
 
     struct _CcnetProcFactory   *proc_factory;
     struct _CcnetGroupManager  *group_mgr;
@@ -102,9 +105,10 @@ struct _CcnetClient
     struct CcnetPacketIO       *io;
 
     GHashTable                 *processors;
-    GList                      *rpc_pool;
+    GHashTable                 *rpc_pool; /* "peer_id service" -> item */
 
     CcnetClientPriv            *priv;
+    struct CcnetClientLoop     *loop; /* see ccnet_client_attach_event_base */
 };
 
 struct _CcnetClientClass
@@ -117,6 +121,22 @@ GType ccnet_client_get_type (void);
 CcnetClient* ccnet_client_new (void);
 int ccnet_client_load_confdir (CcnetClient *client, const char *confdir);
 
+/*
+ * The parsed ccnet.conf of a config dir, cached per process so that
+ * making a client doesn't read the file again. It is reloaded for the
+ * clients made after the file changes. Thread safe.
+ */
+typedef struct CcnetClientConf CcnetClientConf;
+
+/* A new reference on the conf of @confdir, or NULL if it can't be
+ * loaded. */
+CcnetClientConf *ccnet_client_conf_get (const char *confdir);
+CcnetClientConf *ccnet_client_conf_ref (CcnetClientConf *conf);
+void ccnet_client_conf_unref (CcnetClientConf *conf);
+
+/* What ccnet_client_load_confdir() does, from a loaded conf. */
+void ccnet_client_load_conf (CcnetClient *client, CcnetClientConf *conf);
+
 /*
 void ccnet_client_add_alias (CcnetClient *client, const char *alias_str);
 void ccnet_client_del_alias (CcnetClient *client, const char *alias_str);
@@ -141,8 +161,39 @@ void ccnet_client_remove_processor (CcnetClient *client,
 CcnetProcessor *
      ccnet_client_get_processor (CcnetClient *client, int id);
 
+/*
+ * Read and handle the packets available on client->connfd. Returns 0
+ * or less if the connection is lost. Event loops other than libevent
+ * can watch connfd for reading and call this when it is ready.
+ */
 int ccnet_client_read_input (CcnetClient *client);
 
+/*
+ * With the shared memory transport, packets arrive without connfd
+ * becoming readable. Event loops have to watch this fd as well and call
+ * ccnet_client_read_input() for both. -1 if the socket is used.
+ */
+evutil_socket_t ccnet_client_get_shm_fd (CcnetClient *client);
+
+struct event_base;
+typedef void (*CcnetClientDownCB) (CcnetClient *client, void *user_data);
+
+/*
+ * Serve an async client from @base, so that many clients can share one
+ * event loop with the application. @base may be NULL for the global
+ * base set up by event_init(). @down_cb is called after the client has
+ * been disconnected because the daemon went away.
+ *
+ * Processor timers, and the jobs of client->job_mgr, also run in @base
+ * from now on. The timer base is global, so clients sharing a process
+ * should share a base.
+ */
+int  ccnet_client_attach_event_base (CcnetClient *client,
+                                     struct event_base *base,
+                                     CcnetClientDownCB down_cb,
+                                     void *user_data);
+void ccnet_client_detach_event_base (CcnetClient *client);
+
 /* sync mode */
 int ccnet_client_read_response (CcnetClient *client);
 
@@ -160,6 +211,18 @@ void ccnet_client_send_response (CcnetClient *client, int req_id,
 const char *ccnet_client_send_cmd (CcnetClient *client,
                                    const char *cmd, GError **error);
 
+/* For a sync client to run many commands on one daemon processor,
+   1. call ccnet_client_open_cmd() to get the request id
+   2. call ccnet_client_run_cmd() for each command
+   3. call ccnet_client_close_cmd() when done
+ */
+int ccnet_client_open_cmd (CcnetClient *client, GError **error);
+
+const char *ccnet_client_run_cmd (CcnetClient *client, int req_id,
+                                  const char *cmd, GError **error);
+
+void ccnet_client_close_cmd (CcnetClient *client, int req_id);
+
 int ccnet_client_send_message (CcnetClient *client,
                                CcnetMessage *message);
 
@@ -181,6 +244,45 @@ ccnet_client_get_rpc_request_id (CcnetClient *client, const char *peer_id,
 void
 ccnet_client_clean_rpc_request (CcnetClient *client, uint32_t req_id);
 
+/*
+ * Daemon side rpc processors time out when they see no packet for a
+ * while. Send a keepalive on the pooled requests idle for more than a
+ * minute. Called on every ccnet_client_get_rpc_request_id(); call it
+ * for clients which may sit unused, e.g. in a client pool.
+ */
+void
+ccnet_client_rpc_keepalive (CcnetClient *client);
+
+/*
+ * Pipelined sync mode. After ccnet_client_enable_pipeline() several
+ * threads may use the client at once, each with its own requests:
+ * responses are told apart by request id instead of being read in
+ * order. Only the ccnet_client_pipeline_ functions and the rpc
+ * transport may then be used on the client.
+ */
+int ccnet_client_enable_pipeline (CcnetClient *client);
+gboolean ccnet_client_is_pipelined (CcnetClient *client);
+
+uint32_t ccnet_client_pipeline_new_request (CcnetClient *client,
+                                            const char *req);
+void ccnet_client_pipeline_send_update (CcnetClient *client, uint32_t req_id,
+                                        const char *code, const char *reason,
+                                        const char *content, int clen);
+/* Tell the daemon to drop the processor and forget the request. */
+void ccnet_client_pipeline_end_request (CcnetClient *client, uint32_t req_id);
+
+/* Blocks until a response to @req_id comes in. Free it with g_free(). */
+struct CcnetResponse *
+ccnet_client_pipeline_read_response (CcnetClient *client, uint32_t req_id);
+
+/* Take an idle rpc processor for @service, starting one if needed. Give
+ * it back with put after a call, or end it after an error. */
+uint32_t ccnet_client_pipeline_get_rpc_request (CcnetClient *client,
+                                                const char *peer_id,
+                                                const char *service);
+void ccnet_client_pipeline_put_rpc_request (CcnetClient *client,
+                                            uint32_t req_id);
+
 /* void ccnet_client_send_event (CcnetClient *client, GObject *event); */
 
 #endif
@@ -4,11 +4,13 @@
 #include <ccnet.h>
 
 typedef struct {
-    /* either session or pool will be set. */
+    /* either session or pool will be set. A pipelined session
+     * (ccnet_client_enable_pipeline) can be shared by threads. */
     CcnetClient *session;
     CcnetClientPool *pool;
     char  *peer_id;       /* NULL if local */
     char  *service;
+    gboolean no_binary;   /* server lacks SC_CLIENT_BINARY */
 } CcnetrpcTransportParam;        /* this structure will be parsed to
                                   * ccnet_transport_send ()
                                   */
@@ -24,7 +26,39 @@ typedef struct {
 char *ccnetrpc_transport_send (void *arg,
         const gchar *fcall_str, size_t fcall_len, size_t *ret_len);
 
+/*
+ * Send @n_calls (at most 64) independent function calls in one round
+ * trip. @arg is a CcnetrpcTransportParam. On success @rets and
+ * @ret_lens hold the result of each call, to be freed with g_free().
+ * Falls back to one call at a time on servers without batch support.
+ */
+int ccnetrpc_transport_send_batch (void *arg, int n_calls,
+                                   char **fcall_strs, size_t *fcall_lens,
+                                   char **rets, size_t *ret_lens);
+
+/*
+ * Send a call in the binary encoding of rpc-binary.h. Returns NULL if
+ * the call failed or the server does not take binary calls; the caller
+ * should then use the JSON call.
+ */
+char *ccnetrpc_transport_send_binary (void *arg, const char *fcall_str,
+                                      size_t fcall_len, size_t *ret_len);
+
 int ccnetrpc_async_transport_send (void *arg, gchar *fcall_str,
                                  size_t fcall_len, void *rpc_priv);
 
+typedef struct {
+    CcnetrpcAsyncTransportParam *target;  /* of the async client */
+    GPtrArray *calls;                   /* of CcnetAsyncRpcCall */
+} CcnetrpcAsyncBatchParam;              /* the async_arg of a batch client */
+
+/* Queue a call on a batch client instead of sending it. */
+int ccnetrpc_async_batch_queue (void *arg, gchar *fcall_str,
+                                size_t fcall_len, void *rpc_priv);
+
+/* Send the queued calls, RPC_BATCH_MAX at a time, see
+ * ccnet_async_rpc_batch_flush(). */
+int ccnetrpc_async_batch_flush (CcnetrpcAsyncBatchParam *batch,
+                                CcnetAsyncBatchDone done, void *user_data);
+
 #endif /* SEARPC_TRANPORT_H */
@@ -29,14 +29,17 @@ struct CEvent {
 
 typedef struct CEventManager CEventManager;
 
+struct CEventNode;
+
 struct CEventManager {
     
     ccnet_pipe_t  pipefd[2];
     struct event  event;
-    GHashTable   *handler_table;
-    uint32_t      next_id;
-    
-    pthread_mutex_t  mutex;
+    GPtrArray    *handlers;     /* indexed by id */
+    GArray       *free_ids;
+
+    /* pushed by any thread, taken whole by the main loop */
+    struct CEventNode * volatile queue;
 };
 
 CEventManager* cevent_manager_new ();
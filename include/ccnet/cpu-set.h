@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_CPU_SET_H
+#define CCNET_CPU_SET_H
+
+#include <glib.h>
+#include <pthread.h>
+
+/*
+ * Sets of cpus for pinning threads, given in ccnet.conf as lists like
+ * "0-7,16-23". Pinning only works on Linux, elsewhere it is a no-op.
+ *
+ * Memory is placed on the NUMA node of the thread which touches it
+ * first, so a thread pinned before it sets up its buffers gets them
+ * from its own node.
+ */
+
+#define CCNET_CPU_SET_MAX 256
+
+typedef struct CcnetCpuSet {
+    int     n;                  /* 0 for no pinning */
+    guint16 cpus[CCNET_CPU_SET_MAX];
+} CcnetCpuSet;
+
+/* Returns -1 if @str is not a list of cpus, leaving @set empty. */
+int ccnet_cpu_set_parse (CcnetCpuSet *set, const char *str);
+
+/* Load the list at @group/@key of @keyf, if any. */
+void ccnet_cpu_set_load (CcnetCpuSet *set, GKeyFile *keyf,
+                         const char *group, const char *key);
+
+/* Pin @thread to the whole set if @index < 0, or to its cpu number
+ * @index % n. An empty set with @index < 0 lets it run anywhere again.
+ * Returns -1 on failure. */
+int ccnet_cpu_set_pin (pthread_t thread, const CcnetCpuSet *set, int index);
+
+/* "0-3,8", or "any" for an empty set. */
+void ccnet_cpu_set_format (const CcnetCpuSet *set, GString *buf);
+
+/* Remember where the threads called @name are placed, for
+ * ccnet_cpu_set_get_placement(). */
+void ccnet_cpu_set_record (const char *name, const CcnetCpuSet *set);
+
+/* A line "<name> cpus <list> nodes <list>" per recorded placement. */
+char *ccnet_cpu_set_get_placement (void);
+
+#endif
@@ -8,10 +8,20 @@
 #ifndef JOB_MGR_H
 #define JOB_MGR_H
 
+#include <event.h>
 #include <glib.h>
 #include <pthread.h>
 
+#include "cpu-set.h"
+
+#ifdef WIN32
+#define ccnet_pipe_t intptr_t
+#else
+#define ccnet_pipe_t int
+#endif
+
 struct _CcnetSession;
+struct CcnetJobPool;
 
 typedef struct _CcnetJob CcnetJob;
 typedef struct _CcnetJobManager CcnetJobManager;
@@ -30,9 +40,22 @@ struct _CcnetJobManager {
 
 #ifndef WIN32
     GThreadPool     *thread_pool;
+    struct CcnetJobPool *job_pool; /* used instead if work stealing is on */
 #endif
 
+    CcnetCpuSet      cpus;      /* the job threads run on these */
+
     int              next_job_id;
+
+    /* Worker threads push finished jobs onto done_jobs and wake up
+     * the main loop through a single pipe shared by all jobs.
+     */
+    ccnet_pipe_t     pipefd[2];
+    struct event     done_event;
+    gboolean         done_event_added;
+    CcnetJob        *done_jobs;
+
+    struct event_base *evbase;  /* NULL for the libevent global base */
 };
 
 void
@@ -41,9 +64,40 @@ ccnet_job_cancel (CcnetJob *job);
 CcnetJobManager *
 ccnet_job_manager_new (int max_threads);
 
+/*
+ * Options of the job threads. Only max_threads and cpus are used by the
+ * default pool, a GThreadPool with one queue. With work_stealing, every
+ * thread has its own queue and takes jobs from the others when it
+ * runs out, see job-pool.h. Not supported on Windows, where each job
+ * gets a new thread.
+ */
+typedef struct CcnetJobManagerOptions {
+    int      max_threads;
+    int      min_threads;       /* kept running when idle */
+    int      max_idle_threads;  /* idle threads kept above min_threads */
+    int      idle_timeout;      /* ms before a spare idle thread exits */
+    gboolean work_stealing;
+    gboolean cpu_affinity;      /* pin the threads to cpus, Linux only */
+    CcnetCpuSet cpus;           /* CPUS, the cpus to run on, all if empty */
+} CcnetJobManagerOptions;
+
+CcnetJobManager *
+ccnet_job_manager_new_full (const CcnetJobManagerOptions *options);
+
+/* Options from @group of @keyf, keys are upper case names of the
+ * fields, e.g. MAX_THREADS. Fields not set are left alone. */
+void
+ccnet_job_manager_options_load (CcnetJobManagerOptions *options,
+                                GKeyFile *keyf, const char *group);
+
 void
 ccnet_job_manager_free (CcnetJobManager *mgr);
 
+/* Run the done callbacks of the jobs from @base. */
+void
+ccnet_job_manager_set_event_base (CcnetJobManager *mgr,
+                                  struct event_base *base);
+
 int
 ccnet_job_manager_schedule_job (CcnetJobManager *mgr,
                                 JobThreadFunc func,
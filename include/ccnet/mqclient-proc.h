@@ -25,8 +25,16 @@ struct _CcnetMqclientProc {
     
     MessageGotCB  message_got_cb;
     void         *cb_data;
+
+    struct CcnetMqFilter *filter;
+    /* the server takes batches from us */
+    gboolean      server_batch;
 };
 
+/* The processor is started with the names of the apps to subscribe
+ * to. A name ending with '*' matches every app with that prefix.
+ * With a "--batch" argument the messages arrive several per packet,
+ * servers which don't know it simply send them one by one. */
 struct _CcnetMqclientProcClass {
     CcnetProcessorClass parent_class;
 };
@@ -39,6 +47,17 @@ GType ccnet_mqclient_proc_get_type ();
 void ccnet_mqclient_proc_put_message (CcnetMqclientProc *proc,
                                       CcnetMessage *message);
 
+/* Sent in one packet if the server supports it. */
+void ccnet_mqclient_proc_put_messages (CcnetMqclientProc *proc,
+                                       GList *messages);
+
+/* Only receive the messages matching @expr, see mq-filter.h, or all
+ * of them if @expr is NULL. The server drops the others before they
+ * are sent, and they are dropped here too in case it can't filter.
+ * Returns -1 if @expr is not a valid filter. */
+int ccnet_mqclient_proc_set_filter (CcnetMqclientProc *proc,
+                                    const char *expr);
+
 void ccnet_mqclient_proc_unsubscribe_apps (CcnetMqclientProc *proc);
 
 #endif
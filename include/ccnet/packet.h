@@ -10,6 +10,15 @@
 #define CCNET_MSG_UPDATE     4
 #define CCNET_MSG_RELAY      5  /* NOT USED NOW */
 #define CCNET_MSG_ENCPACKET  6  /* an encrypt packet */
+/* Sent instead of the handshake by an overloaded server, which then
+ * closes the connection. The id is the seconds to wait before
+ * retrying, the optional payload "addr:port" a server to try
+ * instead. */
+#define CCNET_MSG_BUSY       7
+
+/* Set in the type of a packet whose payload is compressed, see
+ * net/common/compress.h. */
+#define CCNET_MSG_COMPRESSED 0x80
 
 typedef struct ccnet_header    ccnet_header;
 
@@ -31,4 +40,49 @@ struct ccnet_packet {
 #define CCNET_PACKET_LENGTH_HEADER       8
 #define CCNET_USER_ID_START           1000
 
+/*
+ * Jumbo packets carry a 32-bit payload length right after the normal
+ * header, whose version is CCNET_PACKET_VERSION_JUMBO and whose length
+ * field is unused. They are only sent to peers which announced
+ * CCNET_CAP_JUMBO_PACKET (in the id field of the handshake packets).
+ */
+#define CCNET_PACKET_VERSION_JUMBO            2
+#define CCNET_PACKET_LENGTH_JUMBO_HEADER     12
+#define CCNET_PACKET_MAX_JUMBO_PAYLOAD_LEN   (16 * 1024 * 1024)
+
+#define CCNET_CAP_JUMBO_PACKET             0x01
+#define CCNET_CAP_BATCH_ENCPACKET          0x02 /* several packets in
+                                                 * one ENCPACKET */
+#define CCNET_CAP_FAST_SETUP               0x04 /* see fast-setup.h */
+#define CCNET_CAP_COMPRESS_LZ4             0x08 /* decompresses these */
+#define CCNET_CAP_COMPRESS_ZSTD            0x10
+#define CCNET_CAP_TLS                      0x20 /* see tls.h */
+#define CCNET_CAP_SHM_RING                 0x40 /* see shm-ring.h */
+#define CCNET_CAP_TRACE                    0x80 /* takes trace tokens in
+                                                 * requests, see trace.h */
+
+typedef struct ccnet_jumbo_header    ccnet_jumbo_header;
+
+struct ccnet_jumbo_header {
+    struct ccnet_header header;
+    uint32_t length;            /* length of payload */
+};
+
+/* Payload length and start of a received packet, for both framings. */
+static inline uint32_t
+ccnet_packet_get_length (const ccnet_packet *packet)
+{
+    if (packet->header.version == CCNET_PACKET_VERSION_JUMBO)
+        return ((const ccnet_jumbo_header *)packet)->length;
+    return packet->header.length;
+}
+
+static inline char *
+ccnet_packet_get_data (ccnet_packet *packet)
+{
+    if (packet->header.version == CCNET_PACKET_VERSION_JUMBO)
+        return (char *)packet + CCNET_PACKET_LENGTH_JUMBO_HEADER;
+    return packet->data;
+}
+
 #endif
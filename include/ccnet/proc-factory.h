@@ -70,5 +70,17 @@ ccnet_proc_factory_create_slave_processor (CcnetProcFactory *factory,
 void ccnet_proc_factory_recycle(CcnetProcFactory *factory,
                                 CcnetProcessor *processor);
 
+/* Drop a reference to a finished processor. The last one puts a
+ * reusable processor back in its pool instead of finalizing it. */
+void ccnet_proc_factory_release (CcnetProcFactory *factory,
+                                 CcnetProcessor *processor);
+
+/* Released processors kept per reusable type, [Client] PROC_POOL_SIZE
+ * in ccnet.conf. 0 disables pooling. */
+void ccnet_proc_factory_set_pool_size (CcnetProcFactory *factory, int size);
+
+/* One line per pooled type: "name free reused created dropped". */
+char *ccnet_proc_factory_get_pool_stats (CcnetProcFactory *factory);
+
 
 #endif
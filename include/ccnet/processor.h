@@ -103,6 +103,10 @@ struct _CcnetProcessorClass {
     void      (*shutdown)        (CcnetProcessor *processor);
 
     void      (*release_resource) (CcnetProcessor *processor);
+
+    /* Set if release_resource() leaves the instance as new, so that
+     * the factory may hand it out again instead of finalizing it. */
+    gboolean       reusable;
 };
 
 GType ccnet_processor_get_type ();
@@ -14,6 +14,8 @@ typedef struct CcnetTimer CcnetTimer;
  * Calls timer_func(user_data) after the specified interval.
  * The timer is freed if timer_func returns zero.
  * Otherwise, it's called again after the same interval.
+ * Timers may fire up to 10ms late, so that close ones run together;
+ * a 0ms timer runs in the next loop iteration.
  */
 CcnetTimer* ccnet_timer_new (TimerCB           func,
                              void             *user_data,
@@ -24,5 +26,28 @@ CcnetTimer* ccnet_timer_new (TimerCB           func,
  */
 void ccnet_timer_free (CcnetTimer **timer);
 
+struct event_base;
+
+/**
+ * Timers created from now on run in @base instead of the libevent
+ * global base. NULL goes back to the global base.
+ */
+void ccnet_timer_set_event_base (struct event_base *base);
+
+/**
+ * Called after a timer callback or a job done callback @func ran for
+ * @usec microseconds, when that is at least the hook's threshold.
+ * @what is "timer" or "job".
+ */
+typedef void (*CcnetSlowCallbackHook) (const char *what, void *func,
+                                       int64_t usec);
+
+void ccnet_set_slow_callback_hook (CcnetSlowCallbackHook hook,
+                                   int64_t threshold_usec);
+
+/* Used around the callbacks: begin returns 0 if no hook is set. */
+int64_t ccnet_slow_callback_begin (void);
+void ccnet_slow_callback_end (const char *what, void *func, int64_t start);
+
 
 #endif
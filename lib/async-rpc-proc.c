@@ -1,5 +1,6 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
+#include <stdio.h>
 #include <string.h>
 
 #include <ccnet.h>
@@ -15,6 +16,10 @@ typedef struct {
     size_t fcall_len;
     void *rpc_priv;
     GString *buf;
+    int consumed;               /* stream chunks not yet credited back */
+    /* In batch mode fcall_str holds the encoded calls, and these are
+     * the CcnetAsyncRpcCall waiting for their result. */
+    GPtrArray *calls;
 } CcnetAsyncRpcProcPriv;
 
 #define GET_PRIV(o) \
@@ -33,6 +38,9 @@ release_resource(CcnetProcessor *processor)
     CcnetAsyncRpcProcPriv *priv = GET_PRIV (processor);
     g_free (priv->fcall_str);
     g_assert (priv->buf == NULL);
+    if (priv->calls)
+        ccnet_async_rpc_fail_calls (priv->calls, "Batch call failed");
+    memset (priv, 0, sizeof(*priv));
 
     CCNET_PROCESSOR_CLASS (ccnet_async_rpc_proc_parent_class)->release_resource (processor);
 }
@@ -47,6 +55,7 @@ ccnet_async_rpc_proc_class_init (CcnetAsyncRpcProcClass *klass)
     proc_class->handle_response = handle_response;
     proc_class->release_resource = release_resource;
     proc_class->name = "async-rpc-proc";
+    proc_class->reusable = TRUE;
 
     g_type_class_add_private (klass, sizeof(CcnetAsyncRpcProcPriv));
 }
@@ -72,6 +81,96 @@ ccnet_async_rpc_proc_set_rpc (CcnetAsyncRpcProc *proc,
 }
 
 
+void
+ccnet_async_rpc_proc_set_batch (CcnetAsyncRpcProc *proc,
+                                const char *service,
+                                GPtrArray *calls)
+{
+    CcnetAsyncRpcProcPriv *priv = GET_PRIV (proc);
+    GString *buf = g_string_new (NULL);
+    guint i;
+
+    for (i = 0; i < calls->len; i++) {
+        CcnetAsyncRpcCall *call = g_ptr_array_index (calls, i);
+        rpc_batch_append (buf, call->fcall_str, call->fcall_len);
+    }
+
+    priv->service = service;
+    priv->fcall_len = buf->len;
+    priv->fcall_str = g_string_free (buf, FALSE);
+    priv->calls = calls;
+}
+
+GPtrArray *
+ccnet_async_rpc_proc_take_calls (CcnetAsyncRpcProc *proc)
+{
+    CcnetAsyncRpcProcPriv *priv = GET_PRIV (proc);
+    GPtrArray *calls = priv->calls;
+
+    priv->calls = NULL;
+    return calls;
+}
+
+void
+ccnet_async_rpc_fail_calls (GPtrArray *calls, const char *error)
+{
+    guint i;
+
+    for (i = 0; i < calls->len; i++) {
+        CcnetAsyncRpcCall *call = g_ptr_array_index (calls, i);
+        if (call->rpc_priv)
+            searpc_client_generic_callback (NULL, 0, call->rpc_priv, error);
+        g_free (call->fcall_str);
+        g_free (call);
+    }
+    g_ptr_array_free (calls, TRUE);
+}
+
+/* Hand each call of the batch its part of @ret. */
+static gboolean
+dispatch_batch (CcnetAsyncRpcProcPriv *priv, const char *ret, size_t len)
+{
+    const char *ptr = ret, *end = ret + len, *data;
+    gsize dlen;
+    guint i;
+
+    for (i = 0; i < priv->calls->len; i++) {
+        CcnetAsyncRpcCall *call = g_ptr_array_index (priv->calls, i);
+        char *item;
+
+        if (rpc_batch_next (&ptr, end, &data, &dlen) < 0) {
+            g_warning ("[async-rpc] Bad batch result.\n");
+            return FALSE;
+        }
+
+        item = g_strndup (data, dlen);
+        searpc_client_generic_callback (item, dlen, call->rpc_priv, NULL);
+        g_free (item);
+        /* answered, so release_resource() won't fail it */
+        call->rpc_priv = NULL;
+    }
+
+    for (i = 0; i < priv->calls->len; i++) {
+        CcnetAsyncRpcCall *call = g_ptr_array_index (priv->calls, i);
+        g_free (call->fcall_str);
+        g_free (call);
+    }
+    g_ptr_array_free (priv->calls, TRUE);
+    priv->calls = NULL;
+    return TRUE;
+}
+
+/* The whole return value of the call, or of all calls in batch mode. */
+static gboolean
+handle_return (CcnetAsyncRpcProcPriv *priv, const char *ret, size_t len)
+{
+    if (priv->calls)
+        return dispatch_batch (priv, ret, len);
+
+    searpc_client_generic_callback ((char *)ret, len, priv->rpc_priv, NULL);
+    return TRUE;
+}
+
 static int
 start (CcnetProcessor *processor, int argc, char **argv)
 {
@@ -101,24 +200,32 @@ handle_response (CcnetProcessor *processor,
     CcnetAsyncRpcProcPriv *priv = GET_PRIV (processor);
     
     if (memcmp (code, SC_OK, 3) == 0) {
-        ccnet_processor_send_update (processor, SC_CLIENT_CALL, SS_CLIENT_CALL,
+        char reason[64];
+        snprintf (reason, sizeof(reason), "%s %d",
+                  SS_CLIENT_CALL_STREAM, RPC_STREAM_WINDOW);
+        ccnet_processor_send_update (processor,
+                                     priv->calls ? SC_CLIENT_BATCH
+                                                 : SC_CLIENT_CALL,
+                                     reason,
                                      priv->fcall_str,
                                      priv->fcall_len);
         return;
     }
 
     if (memcmp (code, SC_SERVER_RET, 3) == 0) {
+        gboolean ok;
+
         if (priv->buf == NULL)
-            searpc_client_generic_callback (content, clen, priv->rpc_priv, NULL);
+            ok = handle_return (priv, content, clen);
         else {
             g_string_append_len (priv->buf, content, clen);
-            searpc_client_generic_callback (priv->buf->str, priv->buf->len,
-                                            priv->rpc_priv, NULL);
+            ok = handle_return (priv, priv->buf->str, priv->buf->len);
             g_string_free (priv->buf, TRUE);
             priv->buf = NULL;
         }
-        ccnet_processor_done (processor, TRUE);
-    } else if (memcmp (code, SC_SERVER_MORE, 3) == 0) {
+        ccnet_processor_done (processor, ok);
+    } else if (memcmp (code, SC_SERVER_MORE, 3) == 0 ||
+               memcmp (code, SC_SERVER_STREAM, 3) == 0) {
         if (priv->buf == NULL)
             priv->buf = g_string_new (NULL);
         g_string_append_len (priv->buf, content, clen);
@@ -130,9 +237,16 @@ handle_response (CcnetProcessor *processor,
             ccnet_processor_send_update (processor, "400",
                                          "Too many data", NULL, 0);
             ccnet_processor_done (processor, FALSE);
-        } else
+        } else if (memcmp (code, SC_SERVER_MORE, 3) == 0)
             ccnet_processor_send_update (
                 processor, SC_CLIENT_MORE, SS_CLIENT_MORE, NULL, 0);
+        else if (++priv->consumed == RPC_STREAM_WINDOW / 2) {
+            char credit[16];
+            snprintf (credit, sizeof(credit), "%d", priv->consumed);
+            ccnet_processor_send_update (
+                processor, SC_CLIENT_CREDIT, credit, NULL, 0);
+            priv->consumed = 0;
+        }
     }
 
 }
@@ -3,9 +3,25 @@
 #include <limits.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
 #include <openssl/sha.h>
 #include <assert.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 #include "bloom-filter.h"
 
 #define SETBIT(a, n) (a[n/CHAR_BIT] |= (1<<(n%CHAR_BIT)))
@@ -180,3 +196,479 @@ int bloom_test(Bloom *bloom, const char *s)
 
     return 1;
 }
+
+/* ---------------- Blocked Bloom filter ---------------- */
+
+#define BLOCK_WORDS  8                  /* 512 bits */
+#define BLOCK_BITS   (BLOCK_WORDS * 64)
+
+static inline uint64_t
+rotl64 (uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+fmix64 (uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* MurmurHash3 x64 128-bit, seed 0 */
+static void
+murmur3_128 (const void *key, size_t len, uint64_t *h1_out, uint64_t *h2_out)
+{
+    const uint8_t *data = key;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    const uint8_t *tail;
+    size_t i, nblocks = len / 16;
+
+    for (i = 0; i < nblocks; i++) {
+        memcpy (&k1, data + i * 16, 8);
+        memcpy (&k2, data + i * 16 + 8, 8);
+
+        k1 *= c1; k1 = rotl64 (k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64 (h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64 (k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64 (h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    tail = data + nblocks * 16;
+    k1 = k2 = 0;
+    switch (len & 15) {
+    case 15: k2 ^= (uint64_t)tail[14] << 48;
+    case 14: k2 ^= (uint64_t)tail[13] << 40;
+    case 13: k2 ^= (uint64_t)tail[12] << 32;
+    case 12: k2 ^= (uint64_t)tail[11] << 24;
+    case 11: k2 ^= (uint64_t)tail[10] << 16;
+    case 10: k2 ^= (uint64_t)tail[9] << 8;
+    case  9: k2 ^= (uint64_t)tail[8];
+             k2 *= c2; k2 = rotl64 (k2, 33); k2 *= c1; h2 ^= k2;
+    case  8: k1 ^= (uint64_t)tail[7] << 56;
+    case  7: k1 ^= (uint64_t)tail[6] << 48;
+    case  6: k1 ^= (uint64_t)tail[5] << 40;
+    case  5: k1 ^= (uint64_t)tail[4] << 32;
+    case  4: k1 ^= (uint64_t)tail[3] << 24;
+    case  3: k1 ^= (uint64_t)tail[2] << 16;
+    case  2: k1 ^= (uint64_t)tail[1] << 8;
+    case  1: k1 ^= (uint64_t)tail[0];
+             k1 *= c1; k1 = rotl64 (k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64 (h1); h2 = fmix64 (h2);
+    h1 += h2; h2 += h1;
+
+    *h1_out = h1;
+    *h2_out = h2;
+}
+
+BlockedBloom *
+blocked_bloom_create (size_t size, int k)
+{
+    BlockedBloom *bloom;
+    size_t nblocks;
+
+    if (k <= 0 || k > 16 || size == 0) return NULL;
+
+    nblocks = (size + BLOCK_BITS - 1) / BLOCK_BITS;
+    if ( !(bloom = malloc (sizeof(BlockedBloom))) ) return NULL;
+
+    /* over-allocate to align the blocks on cache lines */
+    bloom->mem = calloc (nblocks * BLOCK_WORDS + BLOCK_WORDS,
+                         sizeof(uint64_t));
+    if (!bloom->mem) {
+        free (bloom);
+        return NULL;
+    }
+    bloom->blocks = (uint64_t *)(((uintptr_t)bloom->mem + 63) & ~(uintptr_t)63);
+    bloom->nblocks = nblocks;
+    bloom->k = k;
+
+    return bloom;
+}
+
+void
+blocked_bloom_destroy (BlockedBloom *bloom)
+{
+    free (bloom->mem);
+    free (bloom);
+}
+
+/*
+ * One 128-bit hash per key: the high half picks the block, the low
+ * half gives the k bit positions in it by double hashing.
+ */
+static uint64_t *
+key_block (BlockedBloom *bloom, const char *s, uint64_t *mask)
+{
+    uint64_t h1, h2;
+    uint32_t a, b, bit;
+    int i;
+
+    murmur3_128 (s, strlen(s), &h1, &h2);
+
+    a = (uint32_t)h2;
+    b = (uint32_t)(h2 >> 32) | 1;
+    memset (mask, 0, BLOCK_WORDS * sizeof(uint64_t));
+    for (i = 0; i < bloom->k; ++i) {
+        bit = (a + i * b) % BLOCK_BITS;
+        mask[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+
+    return bloom->blocks + (h1 % bloom->nblocks) * BLOCK_WORDS;
+}
+
+int
+blocked_bloom_add (BlockedBloom *bloom, const char *s)
+{
+    uint64_t mask[BLOCK_WORDS], *block;
+    int i;
+
+    assert (s && *s);
+
+    block = key_block (bloom, s, mask);
+    for (i = 0; i < BLOCK_WORDS; ++i)
+        block[i] |= mask[i];
+
+    return 0;
+}
+
+int
+blocked_bloom_test (BlockedBloom *bloom, const char *s)
+{
+    uint64_t mask[BLOCK_WORDS], *block;
+
+    assert (s && *s);
+
+    block = key_block (bloom, s, mask);
+
+#if defined(__SSE2__)
+    {
+        __m128i miss = _mm_setzero_si128 ();
+        __m128i m, v;
+        int i;
+
+        /* bits of the mask which are not set in the block */
+        for (i = 0; i < BLOCK_WORDS; i += 2) {
+            m = _mm_loadu_si128 ((const __m128i *)(mask + i));
+            v = _mm_load_si128 ((const __m128i *)(block + i));
+            miss = _mm_or_si128 (miss, _mm_andnot_si128 (v, m));
+        }
+        return _mm_movemask_epi8 (_mm_cmpeq_epi8 (miss,
+                                                  _mm_setzero_si128 ()))
+            == 0xFFFF;
+    }
+#else
+    {
+        uint64_t miss = 0;
+        int i;
+
+        for (i = 0; i < BLOCK_WORDS; ++i)
+            miss |= mask[i] & ~block[i];
+        return miss == 0;
+    }
+#endif
+}
+
+/* ---------------- Set operations ---------------- */
+
+#define SAME_GEOMETRY(a, b) ((a)->nblocks == (b)->nblocks && (a)->k == (b)->k)
+
+/* Blocks are 64-byte aligned and 8 words long, so aligned vector
+ * loads never run past a block. */
+static void
+words_or (uint64_t *dst, const uint64_t *src, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 4 <= n; i += 4) {
+        __m256i d = _mm256_load_si256 ((const __m256i *)(dst + i));
+        __m256i s = _mm256_load_si256 ((const __m256i *)(src + i));
+        _mm256_store_si256 ((__m256i *)(dst + i), _mm256_or_si256 (d, s));
+    }
+#elif defined(__SSE2__)
+    for (; i + 2 <= n; i += 2) {
+        __m128i d = _mm_load_si128 ((const __m128i *)(dst + i));
+        __m128i s = _mm_load_si128 ((const __m128i *)(src + i));
+        _mm_store_si128 ((__m128i *)(dst + i), _mm_or_si128 (d, s));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 2 <= n; i += 2)
+        vst1q_u64 (dst + i, vorrq_u64 (vld1q_u64 (dst + i),
+                                       vld1q_u64 (src + i)));
+#endif
+    for (; i < n; ++i)
+        dst[i] |= src[i];
+}
+
+static void
+words_and (uint64_t *dst, const uint64_t *src, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 4 <= n; i += 4) {
+        __m256i d = _mm256_load_si256 ((const __m256i *)(dst + i));
+        __m256i s = _mm256_load_si256 ((const __m256i *)(src + i));
+        _mm256_store_si256 ((__m256i *)(dst + i), _mm256_and_si256 (d, s));
+    }
+#elif defined(__SSE2__)
+    for (; i + 2 <= n; i += 2) {
+        __m128i d = _mm_load_si128 ((const __m128i *)(dst + i));
+        __m128i s = _mm_load_si128 ((const __m128i *)(src + i));
+        _mm_store_si128 ((__m128i *)(dst + i), _mm_and_si128 (d, s));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 2 <= n; i += 2)
+        vst1q_u64 (dst + i, vandq_u64 (vld1q_u64 (dst + i),
+                                       vld1q_u64 (src + i)));
+#endif
+    for (; i < n; ++i)
+        dst[i] &= src[i];
+}
+
+static inline size_t
+popcount64 (uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll (x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+/* Bits set in @a, or in @a | @b if @b is not NULL. */
+static size_t
+words_popcount (const uint64_t *a, const uint64_t *b, size_t n)
+{
+    size_t i = 0, count = 0;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    /* per-byte counts, widened into 16-bit lanes and summed every
+     * 1024 words, well before those can overflow */
+    while (i + 2 <= n) {
+        uint16x8_t acc = vdupq_n_u16 (0);
+        size_t end = i + 1024;
+        for (; i + 2 <= n && i < end; i += 2) {
+            uint64x2_t v = vld1q_u64 (a + i);
+            if (b)
+                v = vorrq_u64 (v, vld1q_u64 (b + i));
+            acc = vpadalq_u8 (acc, vcntq_u8 (vreinterpretq_u8_u64 (v)));
+        }
+        count += vaddvq_u32 (vpaddlq_u16 (acc));
+    }
+#endif
+    for (; i < n; ++i)
+        count += popcount64 (b ? a[i] | b[i] : a[i]);
+    return count;
+}
+
+int
+blocked_bloom_union (BlockedBloom *dst, const BlockedBloom *src)
+{
+    if (!SAME_GEOMETRY (dst, src))
+        return -1;
+    words_or (dst->blocks, src->blocks, dst->nblocks * BLOCK_WORDS);
+    return 0;
+}
+
+int
+blocked_bloom_intersect (BlockedBloom *dst, const BlockedBloom *src)
+{
+    if (!SAME_GEOMETRY (dst, src))
+        return -1;
+    words_and (dst->blocks, src->blocks, dst->nblocks * BLOCK_WORDS);
+    return 0;
+}
+
+size_t
+blocked_bloom_popcount (const BlockedBloom *bloom)
+{
+    return words_popcount (bloom->blocks, NULL, bloom->nblocks * BLOCK_WORDS);
+}
+
+/* n = -m/k ln(1 - X/m), X bits set out of m (Swamidass & Baldi). */
+static double
+estimate_from_bits (size_t bits, size_t m, int k)
+{
+    if (bits >= m)
+        bits = m - 1;
+    return -((double)m / k) * log (1.0 - (double)bits / m);
+}
+
+double
+blocked_bloom_estimate (const BlockedBloom *bloom)
+{
+    return estimate_from_bits (blocked_bloom_popcount (bloom),
+                               bloom->nblocks * BLOCK_BITS, bloom->k);
+}
+
+double
+blocked_bloom_estimate_intersection (const BlockedBloom *a,
+                                     const BlockedBloom *b)
+{
+    size_t m = a->nblocks * BLOCK_BITS, n = a->nblocks * BLOCK_WORDS;
+    double ea, eb, eu;
+
+    if (!SAME_GEOMETRY (a, b))
+        return -1;
+
+    ea = estimate_from_bits (words_popcount (a->blocks, NULL, n), m, a->k);
+    eb = estimate_from_bits (words_popcount (b->blocks, NULL, n), m, a->k);
+    eu = estimate_from_bits (words_popcount (a->blocks, b->blocks, n),
+                             m, a->k);
+    return MAX (ea + eb - eu, 0.0);
+}
+
+/* ---------------- Encoding ---------------- */
+
+#define ENC_HEADER    7
+#define ENC_FULL      0
+#define ENC_SPARSE    1
+
+static void
+put_u32 (unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t
+get_u32 (const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+        (uint32_t)p[2] << 8 | p[3];
+}
+
+static void
+put_u64 (unsigned char *p, uint64_t v)
+{
+    put_u32 (p, v >> 32);
+    put_u32 (p + 4, (uint32_t)v);
+}
+
+static uint64_t
+get_u64 (const unsigned char *p)
+{
+    return (uint64_t)get_u32 (p) << 32 | get_u32 (p + 4);
+}
+
+static size_t
+nonzero_words (const BlockedBloom *bloom)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < bloom->nblocks * BLOCK_WORDS; ++i)
+        n += bloom->blocks[i] != 0;
+    return n;
+}
+
+static size_t
+full_size (const BlockedBloom *bloom)
+{
+    return ENC_HEADER + bloom->nblocks * BLOCK_WORDS * 8;
+}
+
+static size_t
+sparse_size (size_t nonzero)
+{
+    return ENC_HEADER + 4 + nonzero * 12;
+}
+
+size_t
+blocked_bloom_encoded_size (const BlockedBloom *bloom)
+{
+    return MIN (full_size (bloom), sparse_size (nonzero_words (bloom)));
+}
+
+size_t
+blocked_bloom_encode (const BlockedBloom *bloom, unsigned char *buf)
+{
+    size_t nonzero = nonzero_words (bloom);
+    size_t i, n = bloom->nblocks * BLOCK_WORDS;
+    unsigned char *p = buf + ENC_HEADER;
+    int sparse = sparse_size (nonzero) < full_size (bloom);
+
+    buf[0] = BLOCKED_BLOOM_VERSION;
+    buf[1] = bloom->k;
+    buf[2] = sparse ? ENC_SPARSE : ENC_FULL;
+    put_u32 (buf + 3, bloom->nblocks);
+
+    if (sparse) {
+        put_u32 (p, nonzero);
+        p += 4;
+        for (i = 0; i < n; ++i) {
+            if (!bloom->blocks[i])
+                continue;
+            put_u32 (p, i);
+            put_u64 (p + 4, bloom->blocks[i]);
+            p += 12;
+        }
+    } else {
+        for (i = 0; i < n; ++i, p += 8)
+            put_u64 (p, bloom->blocks[i]);
+    }
+
+    return p - buf;
+}
+
+BlockedBloom *
+blocked_bloom_decode (const unsigned char *buf, size_t len)
+{
+    BlockedBloom *bloom;
+    uint32_t nblocks, count, idx;
+    size_t i, n;
+    const unsigned char *p = buf + ENC_HEADER;
+
+    if (len < ENC_HEADER || buf[0] != BLOCKED_BLOOM_VERSION)
+        return NULL;
+    nblocks = get_u32 (buf + 3);
+    if (nblocks == 0 || nblocks > (1 << 24))
+        return NULL;
+    n = (size_t)nblocks * BLOCK_WORDS;
+
+    if (buf[2] == ENC_FULL) {
+        if (len != ENC_HEADER + n * 8)
+            return NULL;
+    } else if (buf[2] == ENC_SPARSE) {
+        if (len < ENC_HEADER + 4)
+            return NULL;
+        count = get_u32 (p);
+        if (count > n || len != sparse_size (count))
+            return NULL;
+    } else
+        return NULL;
+
+    bloom = blocked_bloom_create ((size_t)nblocks * BLOCK_BITS, buf[1]);
+    if (!bloom)
+        return NULL;
+
+    if (buf[2] == ENC_FULL) {
+        for (i = 0; i < n; ++i, p += 8)
+            bloom->blocks[i] = get_u64 (p);
+    } else {
+        p += 4;
+        for (i = 0; i < count; ++i, p += 12) {
+            idx = get_u32 (p);
+            if (idx >= n) {
+                blocked_bloom_destroy (bloom);
+                return NULL;
+            }
+            bloom->blocks[idx] = get_u64 (p + 4);
+        }
+    }
+
+    return bloom;
+}
@@ -60,6 +60,10 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifndef WIN32
+#include <sys/uio.h>
+#include <pthread.h>
+#endif
 
 #include "buffer.h"
 
@@ -394,3 +398,453 @@ void buffer_setcb(struct buffer *buffer,
 	buffer->cb = cb;
 	buffer->cbarg = cbarg;
 }
+
+
+/*
+ * Chained buffers.
+ */
+
+#define CHAIN_CACHE_MAX	64
+
+#ifndef WIN32
+/* Free segments of the standard size, per thread so that taking and
+ * returning one needs no lock. */
+struct seg_cache {
+	struct chain_seg *free;
+	int n;
+};
+
+static pthread_key_t seg_cache_key;
+static pthread_once_t seg_cache_once = PTHREAD_ONCE_INIT;
+
+static void
+seg_cache_destroy(void *arg)
+{
+	struct seg_cache *cache = arg;
+	struct chain_seg *seg;
+
+	while ((seg = cache->free) != NULL) {
+		cache->free = seg->next;
+		free(seg);
+	}
+	free(cache);
+}
+
+static void
+seg_cache_init(void)
+{
+	pthread_key_create(&seg_cache_key, seg_cache_destroy);
+}
+
+static struct seg_cache *
+seg_cache_get(void)
+{
+	struct seg_cache *cache;
+
+	pthread_once(&seg_cache_once, seg_cache_init);
+	cache = pthread_getspecific(seg_cache_key);
+	if (cache == NULL) {
+		cache = calloc(1, sizeof(struct seg_cache));
+		if (cache != NULL && pthread_setspecific(seg_cache_key, cache) != 0) {
+			free(cache);
+			cache = NULL;
+		}
+	}
+	return (cache);
+}
+#endif
+
+/* A segment of at least @size bytes. Only segments of the standard size
+ * come from the cache, bigger ones are made by chain_buffer_pullup(). */
+static struct chain_seg *
+seg_new(size_t size)
+{
+	struct chain_seg *seg = NULL;
+
+	if (size <= CHAIN_SEG_SIZE) {
+#ifndef WIN32
+		struct seg_cache *cache = seg_cache_get();
+
+		if (cache != NULL && cache->free != NULL) {
+			seg = cache->free;
+			cache->free = seg->next;
+			cache->n--;
+		}
+#endif
+		if (seg == NULL)
+			seg = malloc(CHAIN_SEG_ALLOC);
+		size = CHAIN_SEG_SIZE;
+	} else
+		seg = malloc(sizeof(struct chain_seg) + size);
+
+	if (seg == NULL)
+		return (NULL);
+
+	seg->next = NULL;
+	seg->size = size;
+	seg->misalign = 0;
+	seg->off = 0;
+	return (seg);
+}
+
+static void
+seg_free(struct chain_seg *seg)
+{
+#ifndef WIN32
+	if (seg->size == CHAIN_SEG_SIZE) {
+		struct seg_cache *cache = seg_cache_get();
+
+		if (cache != NULL && cache->n < CHAIN_CACHE_MAX) {
+			seg->next = cache->free;
+			cache->free = seg;
+			cache->n++;
+			return;
+		}
+	}
+#endif
+	free(seg);
+}
+
+#define SEG_SPACE(seg)	((seg)->size - (seg)->misalign - (seg)->off)
+#define SEG_TAIL(seg)	((seg)->data + (seg)->misalign + (seg)->off)
+
+static void
+chain_append_seg(struct chain_buffer *buf, struct chain_seg *seg)
+{
+	if (buf->last != NULL)
+		buf->last->next = seg;
+	else
+		buf->first = seg;
+	buf->last = seg;
+}
+
+struct chain_buffer *
+chain_buffer_new(void)
+{
+	return (calloc(1, sizeof(struct chain_buffer)));
+}
+
+void
+chain_buffer_free(struct chain_buffer *buf)
+{
+	struct chain_seg *seg, *next;
+
+	for (seg = buf->first; seg != NULL; seg = next) {
+		next = seg->next;
+		seg_free(seg);
+	}
+	free(buf);
+}
+
+int
+chain_buffer_add(struct chain_buffer *buf, const void *data, size_t datlen)
+{
+	const u_char *p = data;
+	struct chain_seg *seg = buf->last;
+	size_t n;
+
+	while (datlen > 0) {
+		if (seg == NULL || SEG_SPACE(seg) == 0) {
+			if ((seg = seg_new(datlen)) == NULL)
+				return (-1);
+			chain_append_seg(buf, seg);
+		}
+
+		n = SEG_SPACE(seg);
+		if (n > datlen)
+			n = datlen;
+		memcpy(SEG_TAIL(seg), p, n);
+		seg->off += n;
+		buf->total += n;
+		p += n;
+		datlen -= n;
+	}
+
+	return (0);
+}
+
+int
+chain_buffer_add_vprintf(struct chain_buffer *buf, const char *fmt, va_list ap)
+{
+	struct chain_seg *seg = buf->last;
+	size_t space = seg != NULL ? SEG_SPACE(seg) : 0;
+	va_list aq;
+	char *tmp;
+	int n;
+
+	/* Try the free space of the last segment first. */
+	va_copy(aq, ap);
+	n = vsnprintf(space ? (char *)SEG_TAIL(seg) : NULL, space, fmt, aq);
+	va_end(aq);
+	if (n < 0)
+		return (-1);
+
+	if ((size_t)n < space) {
+		seg->off += n;
+		buf->total += n;
+		return (n);
+	}
+
+	if ((size_t)n < CHAIN_SEG_SIZE) {
+		if ((seg = seg_new(n + 1)) == NULL)
+			return (-1);
+		va_copy(aq, ap);
+		vsnprintf((char *)seg->data, seg->size, fmt, aq);
+		va_end(aq);
+		seg->off = n;
+		chain_append_seg(buf, seg);
+		buf->total += n;
+		return (n);
+	}
+
+	if ((tmp = malloc(n + 1)) == NULL)
+		return (-1);
+	va_copy(aq, ap);
+	vsnprintf(tmp, n + 1, fmt, aq);
+	va_end(aq);
+	if (chain_buffer_add(buf, tmp, n) < 0)
+		n = -1;
+	free(tmp);
+
+	return (n);
+}
+
+int
+chain_buffer_add_printf(struct chain_buffer *buf, const char *fmt, ...)
+{
+	va_list ap;
+	int res;
+
+	va_start(ap, fmt);
+	res = chain_buffer_add_vprintf(buf, fmt, ap);
+	va_end(ap);
+
+	return (res);
+}
+
+void
+chain_buffer_add_buffer(struct chain_buffer *outbuf, struct chain_buffer *inbuf)
+{
+	if (inbuf->first == NULL)
+		return;
+
+	/* Small moves are copied to keep the chain of outbuf short. */
+	if (outbuf->last != NULL && inbuf->total <= SEG_SPACE(outbuf->last)) {
+		size_t len = inbuf->total;
+
+		chain_buffer_remove(inbuf, SEG_TAIL(outbuf->last), len);
+		outbuf->last->off += len;
+		outbuf->total += len;
+		return;
+	}
+
+	chain_append_seg(outbuf, inbuf->first);
+	outbuf->last = inbuf->last;
+	outbuf->total += inbuf->total;
+
+	inbuf->first = inbuf->last = NULL;
+	inbuf->total = 0;
+}
+
+void
+chain_buffer_drain(struct chain_buffer *buf, size_t len)
+{
+	struct chain_seg *seg;
+
+	if (len > buf->total)
+		len = buf->total;
+	buf->total -= len;
+
+	while (len > 0 && (seg = buf->first) != NULL) {
+		if (len < seg->off) {
+			seg->misalign += len;
+			seg->off -= len;
+			return;
+		}
+
+		len -= seg->off;
+		buf->first = seg->next;
+		if (buf->first == NULL)
+			buf->last = NULL;
+		seg_free(seg);
+	}
+}
+
+int
+chain_buffer_remove(struct chain_buffer *buf, void *data, size_t datlen)
+{
+	u_char *p = data;
+	struct chain_seg *seg;
+	size_t nread = 0, n;
+
+	for (seg = buf->first; seg != NULL && nread < datlen; seg = seg->next) {
+		n = seg->off;
+		if (n > datlen - nread)
+			n = datlen - nread;
+		memcpy(p + nread, seg->data + seg->misalign, n);
+		nread += n;
+	}
+	chain_buffer_drain(buf, nread);
+
+	return (nread);
+}
+
+u_char *
+chain_buffer_pullup(struct chain_buffer *buf, size_t size)
+{
+	struct chain_seg *seg = buf->first, *next;
+	size_t n;
+
+	if (size > buf->total || seg == NULL)
+		return (NULL);
+	if (seg->off >= size)
+		return (seg->data + seg->misalign);
+
+	if (seg->size >= size) {
+		/* Make room at the end of the first segment. */
+		if (seg->misalign + size > seg->size) {
+			memmove(seg->data, seg->data + seg->misalign, seg->off);
+			seg->misalign = 0;
+		}
+	} else {
+		if ((seg = seg_new(size)) == NULL)
+			return (NULL);
+		seg->next = buf->first;
+		buf->first = seg;
+	}
+
+	while (seg->off < size) {
+		next = seg->next;
+		n = size - seg->off;
+		if (n > next->off)
+			n = next->off;
+		memcpy(SEG_TAIL(seg), next->data + next->misalign, n);
+		seg->off += n;
+		next->misalign += n;
+		next->off -= n;
+
+		if (next->off == 0) {
+			seg->next = next->next;
+			if (buf->last == next)
+				buf->last = seg;
+			seg_free(next);
+		}
+	}
+
+	return (seg->data + seg->misalign);
+}
+
+#ifndef WIN32
+int
+chain_buffer_peek(struct chain_buffer *buf, struct iovec *iov, int n_iov)
+{
+	struct chain_seg *seg;
+	int i = 0;
+
+	for (seg = buf->first; seg != NULL && i < n_iov; seg = seg->next) {
+		iov[i].iov_base = seg->data + seg->misalign;
+		iov[i].iov_len = seg->off;
+		i++;
+	}
+
+	return (i);
+}
+#endif
+
+int
+chain_buffer_write(struct chain_buffer *buf, int fd)
+{
+#ifndef WIN32
+	struct iovec iov[CHAIN_BUFFER_MAX_IOV];
+#endif
+	int n;
+
+	if (buf->first == NULL)
+		return (0);
+
+#ifndef WIN32
+	n = writev(fd, iov, chain_buffer_peek(buf, iov, CHAIN_BUFFER_MAX_IOV));
+#else
+	n = send(fd, (char *)buf->first->data + buf->first->misalign,
+	    buf->first->off, 0);
+#endif
+	if (n == -1)
+		return (-1);
+	if (n == 0)
+		return (0);
+	chain_buffer_drain(buf, n);
+
+	return (n);
+}
+
+int
+chain_buffer_read(struct chain_buffer *buf, int fd, int howmuch)
+{
+	struct chain_seg *tail = buf->last, *extra;
+	size_t space = tail != NULL ? SEG_SPACE(tail) : 0;
+	size_t want;
+#ifndef WIN32
+	struct iovec iov[2];
+	int iovcnt = 0;
+#endif
+	int n;
+
+	want = howmuch < 0 ? space + CHAIN_SEG_SIZE : (size_t)howmuch;
+	if (want == 0)
+		return (0);
+
+	/* Only fill the last segment if it has all the room. */
+	if (want <= space) {
+#ifndef WIN32
+		n = read(fd, SEG_TAIL(tail), want);
+#else
+		n = recv(fd, (char *)SEG_TAIL(tail), want, 0);
+#endif
+		if (n <= 0)
+			return (n);
+		tail->off += n;
+		buf->total += n;
+		return (n);
+	}
+
+	if ((extra = seg_new(CHAIN_SEG_SIZE)) == NULL)
+		return (-1);
+	if (want - space < extra->size)
+		extra->size = want - space;
+
+#ifndef WIN32
+	if (space > 0) {
+		iov[iovcnt].iov_base = SEG_TAIL(tail);
+		iov[iovcnt].iov_len = space;
+		iovcnt++;
+	}
+	iov[iovcnt].iov_base = extra->data;
+	iov[iovcnt].iov_len = extra->size;
+	iovcnt++;
+
+	n = readv(fd, iov, iovcnt);
+#else
+	/* No readv, the free space of the tail is left for the next call. */
+	space = 0;
+	n = recv(fd, (char *)extra->data, extra->size, 0);
+#endif
+	/* A clipped segment can't go back to the cache. */
+	extra->size = CHAIN_SEG_SIZE;
+	if (n <= 0) {
+		seg_free(extra);
+		return (n);
+	}
+
+	if ((size_t)n <= space) {
+		tail->off += n;
+		seg_free(extra);
+	} else {
+		if (space > 0)
+			tail->off += space;
+		extra->off = n - space;
+		chain_append_seg(buf, extra);
+	}
+	buf->total += n;
+
+	return (n);
+}
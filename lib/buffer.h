@@ -190,4 +190,122 @@ u_char *buffer_find(struct buffer *, const u_char *, size_t);
 void buffer_setcb(struct buffer *, void (*)(struct buffer *, size_t, size_t, void *), void *);
 
 
+/*
+ * A chained buffer keeps its data in a list of fixed size segments
+ * instead of one contiguous array. Appending never moves the data
+ * already in the buffer, draining frees whole segments, and moving a
+ * buffer into another one only relinks the segments. Free segments are
+ * kept in a per-thread cache.
+ *
+ * The data is contiguous only a segment at a time; use
+ * chain_buffer_pullup() to get a contiguous view of a prefix.
+ */
+
+#define CHAIN_SEG_ALLOC		4096
+#define CHAIN_BUFFER_MAX_IOV	64
+
+struct chain_seg {
+	struct chain_seg *next;
+
+	size_t size;		/* bytes of data */
+	size_t misalign;	/* bytes already drained from the front */
+	size_t off;		/* bytes in use after misalign */
+
+	u_char data[];
+};
+
+#define CHAIN_SEG_SIZE		(CHAIN_SEG_ALLOC - sizeof(struct chain_seg))
+
+struct chain_buffer {
+	struct chain_seg *first;
+	struct chain_seg *last;
+
+	size_t total;
+};
+
+#define CHAIN_BUFFER_LENGTH(x)	(x)->total
+
+struct chain_buffer *chain_buffer_new(void);
+
+void chain_buffer_free(struct chain_buffer *);
+
+/**
+  Append data to the end of a chained buffer.
+
+  @return 0 if successful, or -1 if an error occurred
+ */
+int chain_buffer_add(struct chain_buffer *, const void *, size_t);
+
+/**
+  Append a formatted string to the end of a chained buffer.
+
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+int chain_buffer_add_printf(struct chain_buffer *, const char *fmt, ...)
+#ifdef __GNUC__
+  __attribute__((format(printf, 2, 3)))
+#endif
+;
+
+int chain_buffer_add_vprintf(struct chain_buffer *, const char *fmt, va_list ap);
+
+/**
+  Move all data from inbuf to the end of outbuf. The segments are
+  relinked, not copied, unless inbuf is small enough to fit into the
+  last segment of outbuf.
+ */
+void chain_buffer_add_buffer(struct chain_buffer *outbuf,
+			     struct chain_buffer *inbuf);
+
+/**
+  Remove len bytes from the beginning of a chained buffer.
+ */
+void chain_buffer_drain(struct chain_buffer *, size_t);
+
+/**
+  Copy at most datlen bytes out of a chained buffer and drain them.
+
+  @return the number of bytes read
+ */
+int chain_buffer_remove(struct chain_buffer *, void *, size_t);
+
+/**
+  Make the first size bytes of a chained buffer contiguous.
+
+  @return a pointer to the first byte, or NULL if the buffer holds less
+          than size bytes or an error occurred
+ */
+u_char *chain_buffer_pullup(struct chain_buffer *, size_t);
+
+#ifndef WIN32
+struct iovec;
+
+/**
+  Fill iov with the segments of a chained buffer, in order, without
+  draining them.
+
+  @return the number of iovecs used
+ */
+int chain_buffer_peek(struct chain_buffer *, struct iovec *iov, int n_iov);
+#endif
+
+/**
+  Write as much of a chained buffer as one writev(2) takes, and drain
+  what was written.
+
+  @return the number of bytes written, or -1 if an error occurred
+ */
+int chain_buffer_write(struct chain_buffer *, int);
+
+/**
+  Read from a file descriptor into a chained buffer with one readv(2),
+  filling the free space of the last segment first.
+
+  @param howmuch the most bytes to read, or -1 for a segment more than
+         the free space
+  @return the number of bytes read, or -1 if an error occurred
+ */
+int chain_buffer_read(struct chain_buffer *, int, int);
+
+
 #endif
@@ -7,6 +7,10 @@
 #include <signal.h>
 #include <dirent.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <glib/gstdio.h>
 
 #ifdef WIN32
     #include <inttypes.h>
@@ -17,6 +21,7 @@
     #include <sys/socket.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
+    #include <sys/un.h>
 #endif
 
 #include "message.h"
@@ -51,6 +56,7 @@ G_DEFINE_TYPE (CcnetClient, ccnet_client, CCNET_TYPE_SESSION_BASE);
 static void handle_packet (ccnet_packet *packet, void *vclient);
 static void ccnet_client_free (GObject *object);
 static void free_rpc_pool (CcnetClient *client);
+static void free_pipeline (CcnetClient *client);
 
 
 static void
@@ -117,6 +123,7 @@ ccnet_client_free (GObject *object)
     if (client->config_dir)
         free (client->config_dir);
     g_free (client->config_file);
+    g_free (client->un_path);
     if (client->proc_factory)
         g_object_unref (client->proc_factory);
     if (client->job_mgr)
@@ -125,91 +132,278 @@ ccnet_client_free (GObject *object)
         g_hash_table_destroy (client->processors);
 
     free_rpc_pool (client);
+    free_pipeline (client);
 
     G_OBJECT_CLASS(ccnet_client_parent_class)->finalize (object);
 }
 
-int
-ccnet_client_load_confdir (CcnetClient *client, const char *config_dir_r)
+/*
+ * Parsed ccnet.conf, shared by all the clients made from one config dir.
+ * A conf never changes once loaded. When the file changes a new one is
+ * loaded for the clients made from then on; the file is looked at no
+ * more than once every CONF_CHECK_INTERVAL.
+ */
+
+#define CONF_CHECK_INTERVAL  1000000 /* usec */
+
+struct CcnetClientConf {
+    gint        ref;
+    char       *config_dir;
+    char       *config_file;
+    char        id[41];
+    unsigned char id_sha1[20];
+    char       *user_name;
+    char       *name;
+    char       *service_url;
+    int         daemon_port;
+    char       *un_path;
+    int         proc_pool_size;         /* -1 if not set */
+    int         shm_transport;          /* -1 if not set */
+
+    /* of the file, to notice changes */
+    time_t      mtime;
+    off_t       size;
+    ino_t       ino;
+    gint64      checked;
+};
+
+G_LOCK_DEFINE_STATIC (confs);
+static GHashTable *confs;       /* config dir as given -> CcnetClientConf */
+
+static void
+conf_unref (CcnetClientConf *conf)
 {
-    char *config_file, *config_dir;
-    char *id = NULL, *name = NULL, *port_str = NULL, 
-        *user_name = NULL, *service_url = NULL;
-    unsigned char sha1[20];
+    if (!conf || !g_atomic_int_dec_and_test (&conf->ref))
+        return;
+
+    free (conf->config_dir);
+    g_free (conf->config_file);
+    g_free (conf->user_name);
+    g_free (conf->name);
+    g_free (conf->service_url);
+    g_free (conf->un_path);
+    g_free (conf);
+}
+
+static CcnetClientConf *
+load_conf (const char *config_dir_r)
+{
+    CcnetClientConf *conf;
+    char *config_dir, *config_file;
+    char *id = NULL, *port_str = NULL, *un_path = NULL;
     GKeyFile *key_file;
-    CcnetSessionBase *base = CCNET_SESSION_BASE(client);
+    struct stat st;
 
     config_dir = ccnet_util_expand_path (config_dir_r);
 
     if (ccnet_util_checkdir(config_dir) < 0) {
         g_warning ("Config dir %s does not exist or is not "
                    "a directory.\n", config_dir);
-        return -1;
+        free (config_dir);
+        return NULL;
     }
 
     config_file = g_strconcat (config_dir, "/", SESSION_CONFIG_FILENAME, NULL); 
+    conf = g_new0 (CcnetClientConf, 1);
+    conf->ref = 1;
+    conf->config_dir = config_dir;
+    conf->config_file = config_file;
+    conf->checked = g_get_monotonic_time ();
+    /* stat before reading, so a change while reading is seen next time */
+    if (g_stat (config_file, &st) == 0) {
+        conf->mtime = st.st_mtime;
+        conf->size = st.st_size;
+        conf->ino = st.st_ino;
+    }
+
     key_file = g_key_file_new ();
     if (!g_key_file_load_from_file (key_file, config_file,
                                     G_KEY_FILE_KEEP_COMMENTS, NULL))
     {
         g_warning ("Can't load config file %s.\n", config_file);
-        goto onerror;
+        g_key_file_free (key_file);
+        conf_unref (conf);
+        return NULL;
     }
 
     id = ccnet_util_key_file_get_string (key_file, "General", "ID");
-    user_name = ccnet_util_key_file_get_string (key_file, "General", "USER_NAME");
-    name = ccnet_util_key_file_get_string (key_file, "General", "NAME");
-    service_url = ccnet_util_key_file_get_string (key_file, "General", "SERVICE_URL");
+    conf->user_name = ccnet_util_key_file_get_string (key_file, "General", "USER_NAME");
+    conf->name = ccnet_util_key_file_get_string (key_file, "General", "NAME");
+    conf->service_url = ccnet_util_key_file_get_string (key_file, "General", "SERVICE_URL");
     port_str = ccnet_util_key_file_get_string (key_file, "Client", "PORT");
+    un_path = ccnet_util_key_file_get_string (key_file, "Client", "UNIX_SOCKET");
+    conf->proc_pool_size = -1;
+    if (g_key_file_has_key (key_file, "Client", "PROC_POOL_SIZE", NULL))
+        conf->proc_pool_size =
+            g_key_file_get_integer (key_file, "Client", "PROC_POOL_SIZE", NULL);
+    conf->shm_transport = -1;
+    if (g_key_file_has_key (key_file, "Client", "SHM_TRANSPORT", NULL))
+        conf->shm_transport =
+            g_key_file_get_boolean (key_file, "Client", "SHM_TRANSPORT", NULL);
+    g_key_file_free (key_file);
 
     if ( (id == NULL) || (strlen (id) != SESSION_ID_LENGTH) 
-         || (ccnet_util_hex_to_sha1 (id, sha1) < 0) ) 
+         || (ccnet_util_hex_to_sha1 (id, conf->id_sha1) < 0) ) 
     {
         ccnet_error ("Wrong ID\n");
-        g_key_file_free (key_file);
-        goto onerror;
+        g_free (id);
+        g_free (port_str);
+        g_free (un_path);
+        conf_unref (conf);
+        return NULL;
     }
-
-   
-    memcpy (base->id, id, 40);
-    base->id[40] = '\0';
-    base->user_name = g_strdup(user_name);
-    base->name = g_strdup(name);
-    memcpy (base->id_sha1, sha1, 20);
-    if (service_url)
-        base->service_url = g_strdup(service_url);
-
-    client->config_file = g_strdup(config_file);
-    client->config_dir = config_dir;
+    memcpy (conf->id, id, 40);
+    conf->id[40] = '\0';
 
     if (port_str)
-        client->daemon_port = atoi (port_str);
+        conf->daemon_port = atoi (port_str);
 
-    g_free (id);
-    g_free (name);
-    g_free (user_name);
-    g_free (port_str);
-    g_free (config_file);
-    g_free (service_url);
-    g_key_file_free (key_file);
-    return 0;
+    if (un_path) {
+        if (g_path_is_absolute (un_path))
+            conf->un_path = g_strdup (un_path);
+        else
+            conf->un_path = g_build_filename (config_dir, un_path, NULL);
+    }
 
-onerror:
     g_free (id);
-    g_free (name);
-    g_free (user_name);
     g_free (port_str);
-    g_free (config_file);
-    g_free (service_url);
-    return -1;
+    g_free (un_path);
+    return conf;
+}
+
+/* Called with the lock held. */
+static gboolean
+conf_changed (CcnetClientConf *conf)
+{
+    gint64 now = g_get_monotonic_time ();
+    struct stat st;
+
+    if (now - conf->checked < CONF_CHECK_INTERVAL)
+        return FALSE;
+    conf->checked = now;
+
+    if (g_stat (conf->config_file, &st) < 0)
+        return TRUE;
+    return st.st_mtime != conf->mtime || st.st_size != conf->size ||
+        st.st_ino != conf->ino;
+}
+
+CcnetClientConf *
+ccnet_client_conf_get (const char *config_dir)
+{
+    CcnetClientConf *conf;
+
+    G_LOCK (confs);
+    if (!confs)
+        confs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)conf_unref);
+    conf = g_hash_table_lookup (confs, config_dir);
+    if (conf && !conf_changed (conf)) {
+        g_atomic_int_inc (&conf->ref);
+        G_UNLOCK (confs);
+        return conf;
+    }
+    G_UNLOCK (confs);
+
+    /* Parse without the lock; two threads may both load a changed file,
+     * the last one is kept. */
+    conf = load_conf (config_dir);
+    if (!conf)
+        return NULL;
+
+    G_LOCK (confs);
+    g_atomic_int_inc (&conf->ref);
+    g_hash_table_replace (confs, g_strdup (config_dir), conf);
+    G_UNLOCK (confs);
+    return conf;
 }
 
+CcnetClientConf *
+ccnet_client_conf_ref (CcnetClientConf *conf)
+{
+    g_atomic_int_inc (&conf->ref);
+    return conf;
+}
+
+void
+ccnet_client_conf_unref (CcnetClientConf *conf)
+{
+    conf_unref (conf);
+}
+
+void
+ccnet_client_load_conf (CcnetClient *client, CcnetClientConf *conf)
+{
+    CcnetSessionBase *base = CCNET_SESSION_BASE(client);
+
+    memcpy (base->id, conf->id, 41);
+    memcpy (base->id_sha1, conf->id_sha1, 20);
+    base->user_name = g_strdup(conf->user_name);
+    base->name = g_strdup(conf->name);
+    if (conf->service_url)
+        base->service_url = g_strdup(conf->service_url);
+
+    if (conf->proc_pool_size >= 0)
+        ccnet_proc_factory_set_pool_size (client->proc_factory,
+                                          conf->proc_pool_size);
+    if (conf->shm_transport >= 0)
+        client->shm_transport = conf->shm_transport;
+
+    client->config_file = g_strdup(conf->config_file);
+    client->config_dir = strdup(conf->config_dir);
+    client->daemon_port = conf->daemon_port;
+    client->un_path = g_strdup(conf->un_path);
+}
 
 int
-ccnet_client_connect_daemon (CcnetClient *client, CcnetClientMode mode)
+ccnet_client_load_confdir (CcnetClient *client, const char *config_dir_r)
+{
+    CcnetClientConf *conf;
+
+    conf = ccnet_client_conf_get (config_dir_r);
+    if (!conf)
+        return -1;
+
+    ccnet_client_load_conf (client, conf);
+    ccnet_client_conf_unref (conf);
+    return 0;
+}
+
+
+#ifndef WIN32
+static evutil_socket_t
+connect_unix_socket (const char *path)
 {
     evutil_socket_t sockfd;
+    struct sockaddr_un servaddr;
+
+    if (strlen(path) >= sizeof(servaddr.sun_path))
+        return -1;
+
+    sockfd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0)
+        return -1;
+
+    memset (&servaddr, 0, sizeof(servaddr));
+    servaddr.sun_family = AF_UNIX;
+    strcpy (servaddr.sun_path, path);
+
+    if (connect (sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+        close (sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+#endif
+
+int
+ccnet_client_connect_daemon (CcnetClient *client, CcnetClientMode mode)
+{
+    evutil_socket_t sockfd = -1;
     struct sockaddr_in servaddr;
+    gboolean local = FALSE;
+    guint32 caps = CCNET_CAP_JUMBO_PACKET;
     /* CcnetProcessor *processor; */
 
 #ifdef WIN32
@@ -225,15 +419,24 @@ ccnet_client_connect_daemon (CcnetClient *client, CcnetClientMode mode)
 
     client->mode = mode;
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    
-    memset (&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons (client->daemon_port);
-    ccnet_util_inet_pton (AF_INET, "127.0.0.1", &servaddr.sin_addr);
-    
-    if (connect (sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0)
-        return -1;
+#ifndef WIN32
+    /* Prefer the unix socket, the daemon may not have it enabled. */
+    if (client->un_path)
+        sockfd = connect_unix_socket (client->un_path);
+    local = (sockfd >= 0);
+#endif
+
+    if (sockfd < 0) {
+        sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+        memset (&servaddr, 0, sizeof(servaddr));
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_port = htons (client->daemon_port);
+        ccnet_util_inet_pton (AF_INET, "127.0.0.1", &servaddr.sin_addr);
+
+        if (connect (sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0)
+            return -1;
+    }
 
     client->connfd = sockfd;
     client->io = ccnet_packet_io_new (client->connfd);
@@ -243,6 +446,18 @@ ccnet_client_connect_daemon (CcnetClient *client, CcnetClientMode mode)
 
     client->connected = 1;
 
+    /* Tell the daemon we can read jumbo packets. Older daemons just
+     * log the unknown packet type.
+     */
+    if (local && client->shm_transport)
+        caps |= CCNET_CAP_SHM_RING;
+    ccnet_packet_prepare (client->io, CCNET_MSG_HANDSHAKE, caps);
+    ccnet_packet_finish_send (client->io);
+
+    if ((caps & CCNET_CAP_SHM_RING) &&
+        ccnet_packet_io_start_shm (client->io) < 0)
+        g_debug ("shared memory transport not used\n");
+
     g_debug ("connected to daemon\n");
 
     return client->connfd;
@@ -259,11 +474,13 @@ int
 ccnet_client_disconnect_daemon (CcnetClient *client)
 {
     g_assert (client->io);
+    ccnet_client_detach_event_base (client);
     ccnet_packet_io_free (client->io);
     client->io = NULL;
     client->connfd = -1;
     client->connected = 0;
     free_rpc_pool (client);
+    free_pipeline (client);
 
     return 0;
 }
@@ -274,44 +491,77 @@ ccnet_client_get_request_id (CcnetClient *client)
     return (++client->req_id);
 }
 
+/* Keepalive well within the daemon's processor timeout. */
+#define RPC_KEEPALIVE_INTERVAL 60
+
 typedef struct RpcPoolItem {
     uint32_t   req_id;
-    char      *peer_id;
-    char      *service;
+    time_t     last_used;
 } RpcPoolItem;
 
 static void
-free_rpc_pool_item (RpcPoolItem *item)
+free_rpc_pool (CcnetClient *client)
 {
-    g_free (item->peer_id);
-    g_free (item->service);
-    g_free (item);
+    if (client->rpc_pool)
+        g_hash_table_destroy (client->rpc_pool);
+    client->rpc_pool = NULL;
 }
 
-static void
-free_rpc_pool (CcnetClient *client)
+static char *
+rpc_pool_key (const char *peer_id, const char *service)
 {
-    GList *ptr;
-    for (ptr = client->rpc_pool; ptr; ptr = ptr->next) {
-        RpcPoolItem *item = ptr->data;
-        free_rpc_pool_item (item);
-    }
-    g_list_free (client->rpc_pool);
-    client->rpc_pool = NULL;
+    return g_strconcat (peer_id ? peer_id : "", " ", service, NULL);
 }
 
 static RpcPoolItem *
 get_pool_item (CcnetClient *client, const char *peer_id,
                const char *service)
 {
-    GList *ptr;
-    for (ptr = client->rpc_pool; ptr; ptr = ptr->next) {
-        RpcPoolItem *item = ptr->data;
-        if (g_strcmp0(peer_id, item->peer_id) == 0 &&
-            g_strcmp0(service, item->service) == 0)
-            return item;
+    RpcPoolItem *item;
+    char *key;
+
+    if (!client->rpc_pool)
+        return NULL;
+
+    key = rpc_pool_key (peer_id, service);
+    item = g_hash_table_lookup (client->rpc_pool, key);
+    g_free (key);
+    return item;
+}
+
+/*
+ * The answer is read right away, so that it can't be mistaken for the
+ * response to a later call. A processor found dead is dropped from
+ * the pool, the next call on the service starts a new one.
+ */
+void
+ccnet_client_rpc_keepalive (CcnetClient *client)
+{
+    GHashTableIter iter;
+    RpcPoolItem *item;
+    time_t now;
+
+    if (!client->rpc_pool || !client->connected || client->priv)
+        return;
+
+    now = time (NULL);
+    g_hash_table_iter_init (&iter, client->rpc_pool);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&item)) {
+        if (now - item->last_used < RPC_KEEPALIVE_INTERVAL)
+            continue;
+        ccnet_client_send_update (client, item->req_id,
+                                  SC_PROC_KEEPALIVE, SS_PROC_KEEPALIVE,
+                                  NULL, 0);
+        if (ccnet_client_read_response (client) < 0)
+            return;
+        if (memcmp (client->response.code, SC_PROC_ALIVE, 3) != 0) {
+            g_debug ("[RPC] pooled processor %u is gone: %s\n",
+                     item->req_id, client->response.code);
+            g_hash_table_iter_remove (&iter);
+            continue;
+        }
+        item->last_used = now;
     }
-    return NULL;
 }
 
 static uint32_t
@@ -345,37 +595,43 @@ uint32_t
 ccnet_client_get_rpc_request_id (CcnetClient *client, const char *peer_id,
                                  const char *service)
 {
-    RpcPoolItem *item = get_pool_item (client, peer_id, service);
-    if (item)
+    RpcPoolItem *item;
+
+    ccnet_client_rpc_keepalive (client);
+
+    item = get_pool_item (client, peer_id, service);
+    if (item) {
+        item->last_used = time (NULL);
         return item->req_id;
+    }
 
     uint32_t req_id = start_request (client, peer_id, service);
     if (req_id == 0)
         return 0;
 
+    if (!client->rpc_pool)
+        client->rpc_pool = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
     item = g_new0 (RpcPoolItem, 1);
     item->req_id = req_id;
-    item->peer_id = g_strdup (peer_id);
-    item->service = g_strdup (service);
-    client->rpc_pool = g_list_prepend (client->rpc_pool, item);
+    item->last_used = time (NULL);
+    g_hash_table_insert (client->rpc_pool,
+                         rpc_pool_key (peer_id, service), item);
     return req_id;
 }
 
+static gboolean
+item_has_id (gpointer key, gpointer value, gpointer req_id)
+{
+    return ((RpcPoolItem *)value)->req_id == GPOINTER_TO_UINT(req_id);
+}
+
 void
 ccnet_client_clean_rpc_request (CcnetClient *client, uint32_t req_id)
 {
-    GList *ptr;
-    RpcPoolItem *target = NULL;
-
-    for (ptr = client->rpc_pool; ptr; ptr = ptr->next) {
-        RpcPoolItem *item = ptr->data;
-        if (req_id == item->req_id)
-            target = item;
-    }
-    if (!target) return;
-
-    client->rpc_pool = g_list_remove (client->rpc_pool, target);
-    free_rpc_pool_item (target);
+    if (client->rpc_pool)
+        g_hash_table_foreach_remove (client->rpc_pool, item_has_id,
+                                     GUINT_TO_POINTER(req_id));
 }
 
 
@@ -411,6 +667,14 @@ ccnet_client_read_input (CcnetClient *client)
     return ccnet_packet_io_read(client->io);
 }
 
+evutil_socket_t
+ccnet_client_get_shm_fd (CcnetClient *client)
+{
+    if (!client->io)
+        return -1;
+    return ccnet_packet_io_get_shm_fd (client->io);
+}
+
 static void create_processor (CcnetClient *client, int req_id,
                              int argc, char **argv)
 {
@@ -617,15 +881,21 @@ static void handle_packet (ccnet_packet *packet, void *vclient)
     switch (packet->header.type) {
     case CCNET_MSG_REQUEST:
         handle_request (client, packet->header.id,
-                        packet->data, packet->header.length);
+                        ccnet_packet_get_data (packet),
+                        ccnet_packet_get_length (packet));
         break;
     case CCNET_MSG_RESPONSE:
         handle_response (client, packet->header.id, 
-                         packet->data, packet->header.length);
+                         ccnet_packet_get_data (packet),
+                         ccnet_packet_get_length (packet));
         break;
     case CCNET_MSG_UPDATE:
         handle_update (client, packet->header.id, 
-                         packet->data, packet->header.length);
+                       ccnet_packet_get_data (packet),
+                       ccnet_packet_get_length (packet));
+        break;
+    case CCNET_MSG_HANDSHAKE:
+        /* A late answer to a shared memory request. */
         break;
     default:
         g_assert (0);
@@ -668,10 +938,9 @@ ccnet_client_send_update (CcnetClient *client, int req_id,
         ccnet_packet_write_string (client->io, reason);
     }
     ccnet_packet_add (client->io, "\n", 1);
-    if (content)
-        ccnet_packet_add (client->io, content, clen);
 
-    ccnet_packet_finish_send (client->io);
+    ccnet_packet_finish_send_content (client->io, content,
+                                      content ? clen : 0);
 
     /* g_debug ("[client] Send an update: id %d: %s %s len=%d\n", */
     /*          req_id, code, reason, clen); */
@@ -693,10 +962,9 @@ ccnet_client_send_response (CcnetClient *client, int req_id,
         ccnet_packet_write_string (client->io, reason);
     }
     ccnet_packet_add (client->io, "\n", 1);
-    if (content)
-        ccnet_packet_add (client->io, content, clen);
 
-    ccnet_packet_finish_send (client->io);
+    ccnet_packet_finish_send_content (client->io, content,
+                                      content ? clen : 0);
 
     /* g_debug ("[client] Send an response: id %d: %s %s len=%d\n", */
     /*          req_id, code, reason, clen); */
@@ -714,27 +982,16 @@ ccnet_client_send_response (CcnetClient *client, int req_id,
  *
  * Returns: -1 if io error, -2 if response packet format error
  */
-int
-ccnet_client_read_response (CcnetClient *client)
+static int
+parse_response (char *data, int len, struct CcnetResponse *rsp)
 {
-    ccnet_packet *packet;
-    char *data;
-    int len, clen;
+    int clen;
     char *code, *code_msg = 0, *content = 0;
     char *ptr, *end;
 
-restart:
-    if ( (packet = ccnet_packet_io_read_packet (client->io)) == NULL)
+    if (len < 4)
         return -1;
     
-    if (packet->header.type != CCNET_MSG_RESPONSE)
-        goto error;
-
-    data = packet->data;
-    len = packet->header.length;
-
-    g_assert (len >= 4);
-    
     code = data;
     
     ptr = data + 3;
@@ -764,9 +1021,38 @@ restart:
     content = ptr;
     clen = len - (ptr - data);
 
+parsed:
+    rsp->code = code;
+    rsp->code_msg = code_msg;
+    rsp->content = content;
+    rsp->clen = clen;
+    return 0;
+
+error:
+    return -1;
+}
+
+int
+ccnet_client_read_response (CcnetClient *client)
+{
+    ccnet_packet *packet;
+
+restart:
+    if ( (packet = ccnet_packet_io_read_packet (client->io)) == NULL)
+        return -1;
+    
+    if (packet->header.type != CCNET_MSG_RESPONSE)
+        goto error;
+
+    if (parse_response (ccnet_packet_get_data (packet),
+                        ccnet_packet_get_length (packet),
+                        &client->response) < 0)
+        goto error;
+
     /* In synchronized mode, we only have one processor at a
        time.  The processor id is client->req_id, other
-       processors are all treat as dead. */
+       processors are all treat as dead. See the pipelined mode
+       below for several requests in flight. */
 
     /*
     if (packet->header.id != client->req_id) {
@@ -781,18 +1067,12 @@ restart:
     */
     
     /* handle processor keep alive response */
-    if (strncmp(code, SC_PROC_KEEPALIVE, 3) == 0) {
+    if (strncmp(client->response.code, SC_PROC_KEEPALIVE, 3) == 0) {
         ccnet_client_send_update(client, packet->header.id,
                 SC_PROC_ALIVE, SS_PROC_ALIVE, NULL, 0);
         goto restart;
     }
 
-    
-parsed:
-    client->response.code = code;
-    client->response.code_msg = code_msg;
-    client->response.content = content;
-    client->response.clen = clen;
     return 0;
 
 error:
@@ -827,8 +1107,8 @@ check_response_error (CcnetClient *client, GError **error)
 }
 
 
-const char *
-ccnet_client_send_cmd (CcnetClient *client, const char *cmd, GError **error)
+static const char *
+send_cmd_compat (CcnetClient *client, const char *cmd, GError **error)
 {
     int req_id = ccnet_client_get_request_id (client);
     ccnet_client_send_request (client, req_id, "receive-cmd");
@@ -861,6 +1141,76 @@ on_error:
     return NULL;
 }
 
+const char *
+ccnet_client_send_cmd (CcnetClient *client, const char *cmd, GError **error)
+{
+    int req_id = ccnet_client_get_request_id (client);
+    char *req;
+
+    /* The command goes in the request and the daemon is done after
+     * the first response, so there is nothing else to send. Daemons
+     * without run-cmd get the command the old way.
+     */
+    req = g_strconcat ("run-cmd ", cmd, NULL);
+    ccnet_client_send_request (client, req_id, req);
+    g_free (req);
+
+    if (ccnet_client_read_response(client) < 0) {
+        g_set_error (error, CCNET_DOMAIN, EC_NETWORK_ERR, "%s", ES_NETWORK_ERR);
+        return NULL;
+    }
+
+    if (memcmp (client->response.code, SC_UNKNOWN_SERVICE, 3) == 0)
+        return send_cmd_compat (client, cmd, error);
+
+    if (check_response_error(client, error))
+        return NULL;
+
+    return client->response.content;
+}
+
+int
+ccnet_client_open_cmd (CcnetClient *client, GError **error)
+{
+    int req_id = ccnet_client_get_request_id (client);
+    ccnet_client_send_request (client, req_id, "receive-cmd -p");
+
+    if (ccnet_client_read_response(client) < 0) {
+        g_set_error (error, CCNET_DOMAIN, EC_NETWORK_ERR, "%s", ES_NETWORK_ERR);
+        return -1;
+    }
+
+    if (check_response_error(client, error))
+        return -1;
+
+    return req_id;
+}
+
+const char *
+ccnet_client_run_cmd (CcnetClient *client, int req_id,
+                      const char *cmd, GError **error)
+{
+    ccnet_client_send_update (client, req_id,
+                              "200", NULL, cmd, strlen(cmd) + 1);
+    if (ccnet_client_read_response(client) < 0) {
+        g_set_error (error, CCNET_DOMAIN, EC_NETWORK_ERR, "%s", ES_NETWORK_ERR);
+        return NULL;
+    }
+
+    if (check_response_error(client, error))
+        return NULL;
+
+    return client->response.content;
+}
+
+void
+ccnet_client_close_cmd (CcnetClient *client, int req_id)
+{
+    ccnet_client_send_update (client, req_id,
+                              SC_PROC_DONE, SS_PROC_DONE,
+                              NULL, 0);
+}
+
 
 #define SC_MSG "300"
 
@@ -918,3 +1268,302 @@ ccnet_client_receive_message (CcnetClient *client)
                                          client->response.clen);
     return message;
 }
+
+
+/* Pipelined sync mode */
+
+typedef struct PipelineSlot {
+    uint32_t  req_id;
+    GQueue   *responses;        /* struct CcnetResponse * */
+    char     *peer_id;          /* for idle rpc requests */
+    char     *service;
+} PipelineSlot;
+
+/*
+ * One thread at a time reads from the connection and files every
+ * response under its request id; the others wait on @cond for a
+ * response to show up in their slot, or for the reader to leave.
+ */
+struct CcnetClientPriv {
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    pthread_mutex_t  send_lock;
+
+    GHashTable      *slots;     /* req_id -> PipelineSlot */
+    GList           *idle_rpc;  /* PipelineSlot of finished rpc calls */
+
+    gboolean         reading;
+    gboolean         broken;
+};
+
+static void
+free_slot (PipelineSlot *slot)
+{
+    struct CcnetResponse *rsp;
+
+    while ((rsp = g_queue_pop_head (slot->responses)) != NULL)
+        g_free (rsp);
+    g_queue_free (slot->responses);
+    g_free (slot->peer_id);
+    g_free (slot->service);
+    g_free (slot);
+}
+
+static void
+free_pipeline (CcnetClient *client)
+{
+    CcnetClientPriv *priv = client->priv;
+
+    if (!priv)
+        return;
+    g_hash_table_destroy (priv->slots);
+    g_list_free (priv->idle_rpc);
+    pthread_mutex_destroy (&priv->lock);
+    pthread_mutex_destroy (&priv->send_lock);
+    pthread_cond_destroy (&priv->cond);
+    g_free (priv);
+    client->priv = NULL;
+}
+
+int
+ccnet_client_enable_pipeline (CcnetClient *client)
+{
+    CcnetClientPriv *priv;
+
+    g_return_val_if_fail (client->connected &&
+                          client->mode == CCNET_CLIENT_SYNC, -1);
+    if (client->priv)
+        return 0;
+
+    priv = g_new0 (CcnetClientPriv, 1);
+    pthread_mutex_init (&priv->lock, NULL);
+    pthread_mutex_init (&priv->send_lock, NULL);
+    pthread_cond_init (&priv->cond, NULL);
+    priv->slots = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                         NULL, (GDestroyNotify)free_slot);
+    client->priv = priv;
+    return 0;
+}
+
+gboolean
+ccnet_client_is_pipelined (CcnetClient *client)
+{
+    return client->priv != NULL;
+}
+
+/* Must be called with priv->lock held. */
+static PipelineSlot *
+add_slot (CcnetClientPriv *priv, uint32_t req_id)
+{
+    PipelineSlot *slot = g_new0 (PipelineSlot, 1);
+
+    slot->req_id = req_id;
+    slot->responses = g_queue_new ();
+    g_hash_table_replace (priv->slots, GUINT_TO_POINTER(req_id), slot);
+    return slot;
+}
+
+uint32_t
+ccnet_client_pipeline_new_request (CcnetClient *client, const char *req)
+{
+    CcnetClientPriv *priv = client->priv;
+    uint32_t req_id;
+
+    pthread_mutex_lock (&priv->lock);
+    req_id = ccnet_client_get_request_id (client);
+    add_slot (priv, req_id);
+    pthread_mutex_unlock (&priv->lock);
+
+    pthread_mutex_lock (&priv->send_lock);
+    ccnet_client_send_request (client, req_id, req);
+    pthread_mutex_unlock (&priv->send_lock);
+
+    return req_id;
+}
+
+void
+ccnet_client_pipeline_send_update (CcnetClient *client, uint32_t req_id,
+                                   const char *code, const char *reason,
+                                   const char *content, int clen)
+{
+    CcnetClientPriv *priv = client->priv;
+
+    pthread_mutex_lock (&priv->send_lock);
+    ccnet_client_send_update (client, req_id, code, reason, content, clen);
+    pthread_mutex_unlock (&priv->send_lock);
+}
+
+void
+ccnet_client_pipeline_end_request (CcnetClient *client, uint32_t req_id)
+{
+    CcnetClientPriv *priv = client->priv;
+    PipelineSlot *slot;
+
+    pthread_mutex_lock (&priv->lock);
+    slot = g_hash_table_lookup (priv->slots, GUINT_TO_POINTER(req_id));
+    if (slot) {
+        priv->idle_rpc = g_list_remove (priv->idle_rpc, slot);
+        g_hash_table_remove (priv->slots, GUINT_TO_POINTER(req_id));
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    if (slot && !priv->broken)
+        ccnet_client_pipeline_send_update (client, req_id,
+                                           SC_PROC_DEAD, SS_PROC_DEAD,
+                                           NULL, 0);
+}
+
+/* Copy the packet into one block which the caller frees. */
+static struct CcnetResponse *
+copy_response (ccnet_packet *packet)
+{
+    struct CcnetResponse *rsp;
+    int len = ccnet_packet_get_length (packet);
+    char *data;
+
+    if (packet->header.type != CCNET_MSG_RESPONSE)
+        return NULL;
+
+    rsp = g_malloc (sizeof(struct CcnetResponse) + len + 1);
+    data = (char *)(rsp + 1);
+    memcpy (data, ccnet_packet_get_data (packet), len);
+    data[len] = '\0';
+    if (parse_response (data, len, rsp) < 0) {
+        g_free (rsp);
+        return NULL;
+    }
+    return rsp;
+}
+
+/* Read one packet and file it. Called without priv->lock. */
+static void
+read_one_response (CcnetClient *client)
+{
+    CcnetClientPriv *priv = client->priv;
+    ccnet_packet *packet;
+    struct CcnetResponse *rsp = NULL;
+    PipelineSlot *slot;
+    uint32_t id = 0;
+
+    packet = ccnet_packet_io_read_packet (client->io);
+    if (packet) {
+        id = packet->header.id;
+        rsp = copy_response (packet);
+        if (!rsp)
+            g_warning ("Bad response format from daemon\n");
+        else if (strncmp (rsp->code, SC_PROC_KEEPALIVE, 3) == 0) {
+            g_free (rsp);
+            rsp = NULL;
+            ccnet_client_pipeline_send_update (client, id, SC_PROC_ALIVE,
+                                               SS_PROC_ALIVE, NULL, 0);
+        }
+    }
+
+    pthread_mutex_lock (&priv->lock);
+    priv->reading = FALSE;
+    if (!packet) {
+        priv->broken = TRUE;
+    } else if (rsp) {
+        slot = g_hash_table_lookup (priv->slots, GUINT_TO_POINTER(id));
+        if (slot)
+            g_queue_push_tail (slot->responses, rsp);
+        else {
+            g_debug ("Drop response for unknown request %u\n", id);
+            g_free (rsp);
+        }
+    }
+    pthread_cond_broadcast (&priv->cond);
+}
+
+struct CcnetResponse *
+ccnet_client_pipeline_read_response (CcnetClient *client, uint32_t req_id)
+{
+    CcnetClientPriv *priv = client->priv;
+    PipelineSlot *slot;
+    struct CcnetResponse *rsp = NULL;
+
+    pthread_mutex_lock (&priv->lock);
+    while (!priv->broken) {
+        slot = g_hash_table_lookup (priv->slots, GUINT_TO_POINTER(req_id));
+        if (!slot)
+            break;
+        if ((rsp = g_queue_pop_head (slot->responses)) != NULL)
+            break;
+
+        if (priv->reading) {
+            pthread_cond_wait (&priv->cond, &priv->lock);
+            continue;
+        }
+        priv->reading = TRUE;
+        pthread_mutex_unlock (&priv->lock);
+        read_one_response (client); /* returns with the lock held */
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    return rsp;
+}
+
+uint32_t
+ccnet_client_pipeline_get_rpc_request (CcnetClient *client,
+                                       const char *peer_id,
+                                       const char *service)
+{
+    CcnetClientPriv *priv = client->priv;
+    PipelineSlot *slot;
+    struct CcnetResponse *rsp;
+    uint32_t req_id;
+    char buf[512];
+    GList *ptr;
+
+    pthread_mutex_lock (&priv->lock);
+    for (ptr = priv->idle_rpc; ptr; ptr = ptr->next) {
+        slot = ptr->data;
+        if (g_strcmp0(peer_id, slot->peer_id) == 0 &&
+            g_strcmp0(service, slot->service) == 0) {
+            priv->idle_rpc = g_list_delete_link (priv->idle_rpc, ptr);
+            pthread_mutex_unlock (&priv->lock);
+            return slot->req_id;
+        }
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    if (!peer_id)
+        snprintf (buf, 512, "%s", service);
+    else
+        snprintf (buf, 512, "remote %s %s", peer_id, service);
+    req_id = ccnet_client_pipeline_new_request (client, buf);
+
+    rsp = ccnet_client_pipeline_read_response (client, req_id);
+    if (!rsp || memcmp (rsp->code, "200", 3) != 0) {
+        if (rsp)
+            g_warning ("[RPC] failed to start rpc server: %s %s.\n",
+                       rsp->code, rsp->code_msg);
+        else
+            g_warning ("[RPC] failed to read response.\n");
+        g_free (rsp);
+        ccnet_client_pipeline_end_request (client, req_id);
+        return 0;
+    }
+    g_free (rsp);
+
+    pthread_mutex_lock (&priv->lock);
+    slot = g_hash_table_lookup (priv->slots, GUINT_TO_POINTER(req_id));
+    slot->peer_id = g_strdup (peer_id);
+    slot->service = g_strdup (service);
+    pthread_mutex_unlock (&priv->lock);
+
+    return req_id;
+}
+
+void
+ccnet_client_pipeline_put_rpc_request (CcnetClient *client, uint32_t req_id)
+{
+    CcnetClientPriv *priv = client->priv;
+    PipelineSlot *slot;
+
+    pthread_mutex_lock (&priv->lock);
+    slot = g_hash_table_lookup (priv->slots, GUINT_TO_POINTER(req_id));
+    if (slot)
+        priv->idle_rpc = g_list_prepend (priv->idle_rpc, slot);
+    pthread_mutex_unlock (&priv->lock);
+}
@@ -6,6 +6,8 @@
 #include <ccnet-object.h>
 #include <searpc-client.h>
 #include <ccnet/ccnetrpc-transport.h>
+#include <ccnet/async-rpc-proc.h>
+#include "rpc-binary.h"
 
 
 SearpcClient *
@@ -86,10 +88,49 @@ ccnet_rpc_client_free (SearpcClient *client)
     searpc_client_free (client);
 }
 
+SearpcClient *
+ccnet_create_async_rpc_batch (SearpcClient *async_client)
+{
+    SearpcClient *rpc_client;
+    CcnetrpcAsyncBatchParam *batch;
+
+    batch = g_new0 (CcnetrpcAsyncBatchParam, 1);
+    batch->target = async_client->async_arg;
+    batch->calls = g_ptr_array_new ();
+
+    rpc_client = searpc_client_new ();
+    rpc_client->async_send = ccnetrpc_async_batch_queue;
+    rpc_client->async_arg = batch;
+
+    return rpc_client;
+}
+
+int
+ccnet_async_rpc_batch_flush (SearpcClient *batch,
+                             CcnetAsyncBatchDone done, void *user_data)
+{
+    return ccnetrpc_async_batch_flush (batch->async_arg, done, user_data);
+}
+
+void
+ccnet_async_rpc_batch_free (SearpcClient *client)
+{
+    CcnetrpcAsyncBatchParam *batch;
+
+    if (!client)
+        return;
+
+    batch = client->async_arg;
+    ccnet_async_rpc_fail_calls (batch->calls, "Batch freed before flush");
+    g_free (batch);
+
+    searpc_client_free (client);
+}
+
 void
 ccnet_async_rpc_client_free (SearpcClient *client)
 {
-    CcnetrpcAsyncTransportParam *priv = client->arg;
+    CcnetrpcAsyncTransportParam *priv = client->async_arg;
 
     g_free (priv->peer_id);
     g_free (priv->service);
@@ -98,12 +139,152 @@ ccnet_async_rpc_client_free (SearpcClient *client)
     searpc_client_free (client);
 }
 
+/*
+ * Binary calls, see rpc-binary.h. Each helper takes over @fcall and
+ * returns FALSE if the call has to be made through JSON instead.
+ */
+
+static char *
+call_binary (SearpcClient *client, GString *fcall, size_t *ret_len)
+{
+    char *ret = NULL;
+
+    if (client->send == ccnetrpc_transport_send)
+        ret = ccnetrpc_transport_send_binary (client->arg, fcall->str,
+                                              fcall->len, ret_len);
+    g_string_free (fcall, TRUE);
+    return ret;
+}
+
+/* Errors sent by the server are the call's result, unless it has no
+ * binary version of the function. */
+static gboolean
+binary_result_done (int res, int error_code)
+{
+    if (res == 0)
+        return TRUE;
+    if (error_code == -1) {
+        g_warning ("[Sea RPC] Bad binary result.\n");
+        return FALSE;
+    }
+    return error_code != RPC_BIN_ERR_NO_FUNCTION;
+}
+
+static gboolean
+call_binary_object (SearpcClient *client, GString *fcall,
+                    RpcBinGetObjFunc get, GObject **obj)
+{
+    size_t len;
+    char *ret;
+    int res, error_code = 0;
+
+    if (!(ret = call_binary (client, fcall, &len)))
+        return FALSE;
+    res = rpc_bin_get_object_result (ret, len, get, obj, &error_code);
+    g_free (ret);
+    return binary_result_done (res, error_code);
+}
+
+static gboolean
+call_binary_objlist (SearpcClient *client, GString *fcall,
+                     RpcBinGetObjFunc get, GList **list)
+{
+    size_t len;
+    char *ret;
+    int res, error_code = 0;
+
+    if (!(ret = call_binary (client, fcall, &len)))
+        return FALSE;
+    res = rpc_bin_get_objlist_result (ret, len, get, list, &error_code);
+    g_free (ret);
+    return binary_result_done (res, error_code);
+}
+
+static gboolean
+call_binary_int (SearpcClient *client, GString *fcall, int error_ret,
+                 int *value)
+{
+    size_t len;
+    char *ret;
+    gint64 v;
+    int res, error_code = 0;
+
+    if (!(ret = call_binary (client, fcall, &len)))
+        return FALSE;
+    res = rpc_bin_get_int_result (ret, len, &v, &error_code);
+    g_free (ret);
+    *value = (res == 0) ? (int)v : error_ret;
+    return binary_result_done (res, error_code);
+}
+
+static GString *
+binary_fcall_new (const char *fname)
+{
+    GString *fcall = g_string_new (NULL);
+
+    rpc_bin_put_string (fcall, fname);
+    return fcall;
+}
+
+static GObject *
+get_peer (RpcBinReader *r)
+{
+    const char *id = rpc_bin_get_string (r);
+    const char *name = rpc_bin_get_string (r);
+    const char *public_addr = rpc_bin_get_string (r);
+    int public_port = (int) rpc_bin_get_uint (r);
+    const char *service_url = rpc_bin_get_string (r);
+    const char *ip = rpc_bin_get_string (r);
+    int port = (int) rpc_bin_get_uint (r);
+    int net_state = (int) rpc_bin_get_int (r);
+    guint flags = (guint) rpc_bin_get_uint (r);
+    const char *role_list = rpc_bin_get_string (r);
+    const char *myrole_list = rpc_bin_get_string (r);
+    const char *session_key = rpc_bin_get_string (r);
+
+    if (r->error || !id || strlen(id) != 40) {
+        r->error = TRUE;
+        return NULL;
+    }
+
+    return g_object_new (CCNET_TYPE_PEER,
+                         "id", id,
+                         "name", name,
+                         "public-addr", public_addr,
+                         "public-port", public_port,
+                         "service-url", service_url,
+                         "ip", ip,
+                         "port", port,
+                         "net-state", net_state,
+                         "is-self", (flags & RPC_BIN_PEER_IS_SELF) != 0,
+                         "can-connect", (flags & RPC_BIN_PEER_CAN_CONNECT) != 0,
+                         "in-local-network",
+                         (flags & RPC_BIN_PEER_IN_LOCAL_NETWORK) != 0,
+                         "in-connection",
+                         (flags & RPC_BIN_PEER_IN_CONNECTION) != 0,
+                         "is_ready", (flags & RPC_BIN_PEER_IS_READY) != 0,
+                         "role-list", role_list,
+                         "myrole-list", myrole_list,
+                         "session-key", session_key,
+                         "encrypt-channel",
+                         (flags & RPC_BIN_PEER_ENCRYPT_CHANNEL) != 0,
+                         NULL);
+}
+
 CcnetPeer *
 ccnet_get_peer (SearpcClient *client, const char *peer_id)
 {
+    GString *fcall;
+    GObject *peer;
+
     if (!peer_id)
         return NULL;
 
+    fcall = binary_fcall_new ("get_peer");
+    rpc_bin_put_string (fcall, peer_id);
+    if (call_binary_object (client, fcall, get_peer, &peer))
+        return (CcnetPeer *)peer;
+
     return (CcnetPeer *) searpc_client_call__object(
         client, "get_peer",CCNET_TYPE_PEER, NULL,
         1, "string", peer_id);
@@ -185,17 +366,157 @@ ccnet_get_binding_email (SearpcClient *client, const char *peer_id)
 GList *
 ccnet_get_groups_by_user (SearpcClient *client, const char *user)
 {
+    GString *fcall;
+    GList *groups;
+
     if (!user)
         return NULL;
 
+    fcall = binary_fcall_new ("get_groups");
+    rpc_bin_put_string (fcall, user);
+    if (call_binary_objlist (client, fcall, rpc_bin_get_group, &groups))
+        return groups;
+
     return searpc_client_call__objlist (
         client, "get_groups", CCNET_TYPE_GROUP, NULL,
         1, "string", user);
 }
 
+static void
+free_group_user_list (gpointer data)
+{
+    GList *list = data, *ptr;
+
+    for (ptr = list; ptr; ptr = ptr->next)
+        g_object_unref (ptr->data);
+    g_list_free (list);
+}
+
+GHashTable *
+ccnet_get_groups_by_users (SearpcClient *client, GList *users)
+{
+    GHashTable *map;
+    GString *buf;
+    GList *result, *ptr;
+    GError *error = NULL;
+    gpointer key, list;
+    char *user;
+
+    buf = g_string_new (NULL);
+    for (ptr = users; ptr; ptr = ptr->next)
+        g_string_append_printf (buf, "%s\n", (char *)ptr->data);
+
+    result = searpc_client_call__objlist (
+        client, "get_groups_by_users", CCNET_TYPE_GROUP_USER, &error,
+        1, "string", buf->str);
+    g_string_free (buf, TRUE);
+    if (error) {
+        g_warning ("Failed to get groups of users: %s.\n", error->message);
+        g_error_free (error);
+        return NULL;
+    }
+
+    map = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                 g_free, free_group_user_list);
+    for (ptr = users; ptr; ptr = ptr->next)
+        if (!g_hash_table_lookup_extended (map, ptr->data, NULL, NULL))
+            g_hash_table_insert (map, g_strdup (ptr->data), NULL);
+
+    /* Keep the server's order within each user's list. */
+    result = g_list_reverse (result);
+    for (ptr = result; ptr; ptr = ptr->next) {
+        g_object_get (ptr->data, "user_name", &user, NULL);
+        if (g_hash_table_lookup_extended (map, user, &key, &list)) {
+            g_hash_table_steal (map, user);
+            g_free (user);
+        } else {
+            key = user;
+            list = NULL;
+        }
+        g_hash_table_insert (map, key, g_list_prepend (list, ptr->data));
+    }
+    g_list_free (result);
+
+    return map;
+}
+
+int
+ccnet_get_groups_by_users_async (SearpcClient *client, const char *users,
+                                 AsyncCallback callback, void *user_data)
+{
+    return searpc_client_async_call__objlist (
+        client, "get_groups_by_users", callback, CCNET_TYPE_GROUP_USER,
+        user_data, 1, "string", users);
+}
+
+int
+ccnet_is_group_user (SearpcClient *client, int group_id, const char *user)
+{
+    GString *fcall;
+    int ret;
+
+    if (!user)
+        return 0;
+
+    fcall = binary_fcall_new ("is_group_user");
+    rpc_bin_put_int (fcall, group_id);
+    rpc_bin_put_string (fcall, user);
+    if (call_binary_int (client, fcall, 0, &ret))
+        return ret;
+
+    return searpc_client_call__int (client, "is_group_user", NULL,
+                                    2, "int", group_id, "string", user);
+}
+
+GObject *
+ccnet_get_emailuser (SearpcClient *client, const char *email)
+{
+    GString *fcall;
+    GObject *user;
+
+    if (!email)
+        return NULL;
+
+    fcall = binary_fcall_new ("get_emailuser");
+    rpc_bin_put_string (fcall, email);
+    if (call_binary_object (client, fcall, rpc_bin_get_emailuser, &user))
+        return user;
+
+    return searpc_client_call__object (client, "get_emailuser",
+                                       CCNET_TYPE_EMAIL_USER, NULL,
+                                       1, "string", email);
+}
+
+GObject *
+ccnet_get_org_by_url_prefix (SearpcClient *client, const char *url_prefix)
+{
+    GString *fcall;
+    GObject *org;
+
+    if (!url_prefix)
+        return NULL;
+
+    fcall = binary_fcall_new ("get_org_by_url_prefix");
+    rpc_bin_put_string (fcall, url_prefix);
+    if (call_binary_object (client, fcall, rpc_bin_get_organization, &org))
+        return org;
+
+    return searpc_client_call__object (client, "get_org_by_url_prefix",
+                                       CCNET_TYPE_ORGANIZATION, NULL,
+                                       1, "string", url_prefix);
+}
+
 GList *
 ccnet_get_group_members (SearpcClient *client, int group_id)
 {
+    GString *fcall;
+    GList *members;
+
+    fcall = binary_fcall_new ("get_group_members");
+    rpc_bin_put_int (fcall, group_id);
+    if (call_binary_objlist (client, fcall, rpc_bin_get_groupuser, &members))
+        return members;
+
     return searpc_client_call__objlist (
         client, "get_group_members", CCNET_TYPE_GROUP_USER, NULL,
         1, "int", group_id);
@@ -208,6 +529,34 @@ ccnet_org_user_exists (SearpcClient *client, int org_id, const char *user)
                                     2, "int", org_id, "string", user);
 }
 
+int
+ccnet_get_groups_by_user_async (SearpcClient *client, const char *user,
+                                AsyncCallback callback, void *user_data)
+{
+    return searpc_client_async_call__objlist (
+        client, "get_groups", callback, CCNET_TYPE_GROUP,
+        user_data, 1, "string", user);
+}
+
+int
+ccnet_get_group_members_async (SearpcClient *client, int group_id,
+                               AsyncCallback callback, void *user_data)
+{
+    return searpc_client_async_call__objlist (
+        client, "get_group_members", callback, CCNET_TYPE_GROUP_USER,
+        user_data, 1, "int", group_id);
+}
+
+int
+ccnet_org_user_exists_async (SearpcClient *client, int org_id,
+                             const char *user,
+                             AsyncCallback callback, void *user_data)
+{
+    return searpc_client_async_call__int (
+        client, "org_user_exists", callback, user_data,
+        2, "int", org_id, "string", user);
+}
+
 #if 0
 int
 ccnet_get_peer_async (SearpcClient *client, const char *peer_id,
@@ -251,6 +600,17 @@ ccnet_verify_message (SearpcClient *client,
         3, "string", message, "string", sig_base64, "string", peer_id);
 }
 
+char *
+ccnet_verify_messages (SearpcClient *client, const char *messages)
+{
+    if (!messages)
+        return NULL;
+
+    return searpc_client_call__string (
+        client, "verify_messages", NULL,
+        1, "string", messages);
+}
+
 
 char *
 ccnet_get_config (SearpcClient *client, const char *key)
@@ -25,6 +25,9 @@ public class Proc : Object {
         set { _dtime = value; }
     }
 
+    // processor->failure when it finished, PROC_DONE on success
+    public int failure { get; set; }
+
 }
 
 public class EmailUser : Object {
@@ -0,0 +1,191 @@
+#!/usr/bin/env python
+"""
+Generate plain struct records and their encoders from ccnetobj.vala.
+
+For every class listed in `classes` this writes, to ccnetobj-codec.h and
+ccnetobj-codec.c:
+
+  CcnetXxxRec                      the fields as a plain struct
+  ccnet_xxx_rec_clear/array_free   release the strings of records
+  ccnet_xxx_rec_from_object        fill a record from the GObject
+  rpc_bin_put_xxx_rec              binary encoding of a record
+  rpc_bin_put_xxx, rpc_bin_get_xxx binary encoding of the GObject
+  ccnet_xxx_rec_to_json            the object searpc would serialize
+
+The binary layout is the fields in declaration order, see rpc-binary.h.
+
+usage: ccnetobj_codegen.py ccnetobj.vala [outdir]
+"""
+
+import os
+import re
+import sys
+
+classes = ["EmailUser", "Group", "GroupUser", "Organization", "PeerStat"]
+
+# vala type: C type, binary put, binary get
+types = {
+    "int":    ("int",      "rpc_bin_put_int (buf, %s)",
+               "(int) rpc_bin_get_int (r)"),
+    "int64":  ("gint64",   "rpc_bin_put_int (buf, %s)",
+               "rpc_bin_get_int (r)"),
+    "bool":   ("gboolean", "rpc_bin_put_uint (buf, (%s) ? 1 : 0)",
+               "rpc_bin_get_uint (r) != 0"),
+    "string": ("char *",   "rpc_bin_put_string (buf, %s)",
+               "rpc_bin_get_string (r)"),
+}
+
+def snake(name):
+    return re.sub(r"(?<!^)([A-Z])", r"_\1", name).lower()
+
+def parse(path):
+    text = open(path).read()
+    result = {}
+    for m in re.finditer(r"public class (\w+) : Object \{(.*?)\n\}", text,
+                         re.S):
+        props = re.findall(r"public (\w+) (\w+) \{ get; set; \}", m.group(2))
+        result[m.group(1)] = props
+    return result
+
+HEADER = "/* Generated by ccnetobj_codegen.py from ccnetobj.vala, do not edit. */\n"
+
+def gen_header(schema, out):
+    out.append(HEADER)
+    out.append("""
+#ifndef CCNETOBJ_CODEC_H
+#define CCNETOBJ_CODEC_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "rpc-binary.h"
+
+#ifndef CCNET_LIB
+#include "utils.h"
+#endif
+""")
+    for cls in classes:
+        props = schema[cls]
+        s = snake(cls)
+        low = cls.lower()
+        out.append("\ntypedef struct Ccnet%sRec {\n" % cls)
+        for vtype, name in props:
+            ctype = types[vtype][0]
+            star = "*" if ctype.endswith("*") else ""
+            out.append("    %-9s%s%s;\n" % (ctype.rstrip(" *"), star, name))
+        out.append("} Ccnet%sRec;\n\n" % cls)
+        out.append("void ccnet_%s_rec_clear (Ccnet%sRec *rec);\n" % (s, cls))
+        out.append("void ccnet_%s_rec_array_free (GArray *recs);\n" % s)
+        out.append("void ccnet_%s_rec_from_object (Ccnet%sRec *rec, "
+                   "GObject *obj);\n" % (s, cls))
+        out.append("void rpc_bin_put_%s_rec (GString *buf, const void *rec);\n"
+                   % low)
+        out.append("void rpc_bin_put_%s (GString *buf, GObject *obj);\n" % low)
+        out.append("GObject *rpc_bin_get_%s (RpcBinReader *r);\n" % low)
+        out.append("#ifndef CCNET_LIB\n")
+        out.append("void ccnet_%s_rec_to_json (CcnetJsonWriter *writer, "
+                   "const void *rec);\n" % s)
+        out.append("#endif\n")
+    out.append("\n#endif\n")
+
+def gen_source(schema, out):
+    out.append(HEADER)
+    out.append("""
+#include <string.h>
+
+#include "ccnet-object.h"
+#include "ccnetobj-codec.h"
+""")
+    for cls in classes:
+        props = schema[cls]
+        s = snake(cls)
+        low = cls.lower()
+        strings = [n for t, n in props if t == "string"]
+
+        out.append("\n/* %s */\n\n" % cls)
+
+        out.append("void\nccnet_%s_rec_clear (Ccnet%sRec *rec)\n{\n" % (s, cls))
+        for n in strings:
+            out.append("    g_free (rec->%s);\n" % n)
+        out.append("    memset (rec, 0, sizeof(*rec));\n}\n\n")
+
+        out.append("void\nccnet_%s_rec_array_free (GArray *recs)\n{\n" % s)
+        out.append("    guint i;\n\n    if (!recs)\n        return;\n")
+        out.append("    for (i = 0; i < recs->len; ++i)\n")
+        out.append("        ccnet_%s_rec_clear (&g_array_index (recs, "
+                   "Ccnet%sRec, i));\n" % (s, cls))
+        out.append("    g_array_free (recs, TRUE);\n}\n\n")
+
+        out.append("void\nccnet_%s_rec_from_object (Ccnet%sRec *rec, "
+                   "GObject *obj)\n{\n" % (s, cls))
+        out.append("    Ccnet%s *o = (Ccnet%s *)obj;\n\n" % (cls, cls))
+        for t, n in props:
+            getter = "ccnet_%s_get_%s (o)" % (s, n)
+            if t == "string":
+                getter = "g_strdup (%s)" % getter
+            out.append("    rec->%s = %s;\n" % (n, getter))
+        out.append("}\n\n")
+
+        out.append("void\nrpc_bin_put_%s_rec (GString *buf, const void *data)"
+                   "\n{\n" % low)
+        out.append("    const Ccnet%sRec *rec = data;\n\n" % cls)
+        for t, n in props:
+            out.append("    " + types[t][1] % ("rec->" + n) + ";\n")
+        out.append("}\n\n")
+
+        out.append("void\nrpc_bin_put_%s (GString *buf, GObject *obj)\n{\n"
+                   % low)
+        out.append("    Ccnet%s *o = (Ccnet%s *)obj;\n\n" % (cls, cls))
+        for t, n in props:
+            out.append("    " + types[t][1] % ("ccnet_%s_get_%s (o)" % (s, n))
+                       + ";\n")
+        out.append("}\n\n")
+
+        out.append("GObject *\nrpc_bin_get_%s (RpcBinReader *r)\n{\n" % low)
+        for t, n in props:
+            ctype = types[t][0]
+            if t == "string":
+                ctype = "const char *"
+            sep = "" if ctype.endswith("*") else " "
+            out.append("    %s%s%s = %s;\n" % (ctype, sep, n, types[t][2]))
+        out.append("\n    if (r->error)\n        return NULL;\n\n")
+        out.append("    return g_object_new (CCNET_TYPE_%s,\n" % s.upper())
+        for t, n in props:
+            out.append("                         \"%s\", %s,\n" % (n, n))
+        out.append("                         NULL);\n}\n\n")
+
+        out.append("#ifndef CCNET_LIB\n")
+        out.append("void\nccnet_%s_rec_to_json (CcnetJsonWriter *writer, "
+                   "const void *data)\n{\n" % s)
+        out.append("    const Ccnet%sRec *rec = data;\n\n" % cls)
+        out.append("    ccnet_json_begin_object (writer, NULL);\n")
+        for t, n in props:
+            # searpc uses the canonical property names.
+            key = n.replace("_", "-")
+            add = {"string": "string", "bool": "bool"}.get(t, "int")
+            out.append("    ccnet_json_add_%s (writer, \"%s\", rec->%s);\n"
+                       % (add, key, n))
+        out.append("    ccnet_json_end_object (writer);\n}\n")
+        out.append("#endif\n")
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write(__doc__)
+        sys.exit(1)
+    outdir = sys.argv[2] if len(sys.argv) > 2 else "."
+    schema = parse(sys.argv[1])
+    for cls in classes:
+        if cls not in schema:
+            sys.stderr.write("class %s not found in %s\n" % (cls, sys.argv[1]))
+            sys.exit(1)
+
+    for name, gen in (("ccnetobj-codec.h", gen_header),
+                      ("ccnetobj-codec.c", gen_source)):
+        out = []
+        gen(schema, out)
+        f = open(os.path.join(outdir, name), "w")
+        f.write("".join(out))
+        f.close()
+
+if __name__ == "__main__":
+    main()
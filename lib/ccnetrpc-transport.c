@@ -7,61 +7,202 @@
 #include "rpc-common.h"
 #include <ccnet/async-rpc-proc.h>
 
+/*
+ * One rpc call. On a pipelined client the responses are our own
+ * copies, freed on the next read, and the request is handed back to
+ * the client when the call is over.
+ */
+typedef struct RpcCall {
+    CcnetClient          *session;
+    uint32_t              req_id;
+    gboolean              pipelined;
+    struct CcnetResponse *rsp;
+} RpcCall;
+
+static void
+call_send_update (RpcCall *call, const char *code, const char *reason,
+                  const char *content, int clen)
+{
+    if (call->pipelined)
+        ccnet_client_pipeline_send_update (call->session, call->req_id,
+                                           code, reason, content, clen);
+    else
+        ccnet_client_send_update (call->session, call->req_id,
+                                  code, reason, content, clen);
+}
+
+static int
+call_read_response (RpcCall *call)
+{
+    if (!call->pipelined) {
+        if (ccnet_client_read_response (call->session) < 0)
+            return -1;
+        call->rsp = &call->session->response;
+        return 0;
+    }
+
+    g_free (call->rsp);
+    call->rsp = ccnet_client_pipeline_read_response (call->session,
+                                                     call->req_id);
+    return call->rsp ? 0 : -1;
+}
+
+/* @alive is FALSE if the rpc processor can not be used any more. */
+static void
+call_finish (RpcCall *call, gboolean alive)
+{
+    if (!call->pipelined) {
+        if (!alive)
+            ccnet_client_clean_rpc_request (call->session, call->req_id);
+        return;
+    }
+
+    g_free (call->rsp);
+    call->rsp = NULL;
+    if (alive)
+        ccnet_client_pipeline_put_rpc_request (call->session, call->req_id);
+    else
+        ccnet_client_pipeline_end_request (call->session, call->req_id);
+}
+
+/*
+ * Collect a streamed result. The server keeps sending SC_SERVER_STREAM
+ * chunks while it has credits; we hand back half of the window each
+ * time that many chunks have been consumed, so the pipe never drains.
+ */
+static char *
+read_stream (RpcCall *call, size_t *ret_len)
+{
+    struct CcnetResponse *rsp = call->rsp;
+    GString *buf;
+    int consumed = 0;
+    char credit[16];
+
+    buf = g_string_new_len (rsp->content, rsp->clen);
+    while (1) {
+        if (++consumed == RPC_STREAM_WINDOW / 2) {
+            snprintf (credit, sizeof(credit), "%d", consumed);
+            call_send_update (call, SC_CLIENT_CREDIT, credit, NULL, 0);
+            consumed = 0;
+        }
+
+        if (call_read_response (call) < 0) {
+            *ret_len = 0;
+            call_finish (call, FALSE);
+            g_string_free (buf, TRUE);
+            return NULL;
+        }
+        rsp = call->rsp;
+
+        if (memcmp (rsp->code, SC_SERVER_RET, 3) == 0) {
+            g_string_append_len (buf, rsp->content, rsp->clen);
+            *ret_len = buf->len;
+            call_finish (call, TRUE);
+            return g_string_free (buf, FALSE);
+        } else if (memcmp (rsp->code, SC_SERVER_STREAM, 3) == 0) {
+            g_string_append_len (buf, rsp->content, rsp->clen);
+        } else {
+            g_warning ("[Sea RPC] Bad response: %s %s.\n",
+                       rsp->code, rsp->code_msg);
+            *ret_len = 0;
+            call_finish (call, TRUE);
+            g_string_free (buf, TRUE);
+            return NULL;
+        }
+    }
+}
+
+/*
+ * @call_code is SC_CLIENT_CALL or SC_CLIENT_BATCH. @unsupported is set
+ * if the server does not know @call_code.
+ */
 static char *
 invoke_service (CcnetClient *session,
                 const char *peer_id,
                 const char *service,
+                const char *call_code,
                 const char *fcall_str,
                 size_t fcall_len,
-                size_t *ret_len)
+                size_t *ret_len,
+                gboolean *unsupported)
 {
     struct CcnetResponse *rsp;
-    uint32_t req_id;
+    RpcCall call = { session, 0, FALSE, NULL };
     GString *buf;
+    char reason[64];
+    char *ret;
+    int attempt = 0;
 
-    req_id = ccnet_client_get_rpc_request_id (session, peer_id, service);
-    if (req_id == 0) {
+    call.pipelined = ccnet_client_is_pipelined (session);
+    snprintf (reason, sizeof(reason), "%s %d",
+              SS_CLIENT_CALL_STREAM, RPC_STREAM_WINDOW);
+
+retry:
+    if (call.pipelined)
+        call.req_id = ccnet_client_pipeline_get_rpc_request (session,
+                                                             peer_id, service);
+    else
+        call.req_id = ccnet_client_get_rpc_request_id (session,
+                                                       peer_id, service);
+    if (call.req_id == 0) {
         *ret_len = 0;
         return NULL;
     }
 
-    ccnet_client_send_update (session, req_id,
-                              SC_CLIENT_CALL, SS_CLIENT_CALL,
-                              fcall_str, fcall_len);
+    call_send_update (&call, call_code, reason, fcall_str, fcall_len);
 
-    if (ccnet_client_read_response (session) < 0) {
+    if (call_read_response (&call) < 0) {
         *ret_len = 0;
-        ccnet_client_clean_rpc_request (session, req_id);
+        call_finish (&call, FALSE);
         return NULL;
     }
-    rsp = &session->response;
+    rsp = call.rsp;
+
+    /* The pooled processor was gone before the call reached it, so
+     * the call did not run. Start a new processor and call again. */
+    if ((memcmp (rsp->code, SC_PROC_DEAD, 3) == 0 ||
+         memcmp (rsp->code, SC_KEEPALIVE_TIMEOUT, 3) == 0) && attempt++ == 0) {
+        call_finish (&call, FALSE);
+        goto retry;
+    }
 
     if (memcmp (rsp->code, SC_SERVER_RET, 3) == 0) {
         *ret_len = (size_t) rsp->clen;
-        return g_strndup (rsp->content, rsp->clen);
+        ret = g_strndup (rsp->content, rsp->clen);
+        call_finish (&call, TRUE);
+        return ret;
+    } else if (memcmp (rsp->code, SC_SERVER_STREAM, 3) == 0) {
+        return read_stream (&call, ret_len);
+    } else if (memcmp (rsp->code, SC_BAD_UPDATE_CODE, 3) == 0) {
+        /* the server processor is gone */
+        *ret_len = 0;
+        *unsupported = TRUE;
+        call_finish (&call, FALSE);
+        return NULL;
     } else if (memcmp (rsp->code, SC_SERVER_MORE, 3) != 0) {
         g_warning ("[Sea RPC] Bad response: %s %s.\n", rsp->code, rsp->code_msg);
         *ret_len = 0;
+        call_finish (&call, TRUE);
         return NULL;
     }
 
     buf = g_string_new_len (rsp->content, rsp->clen);
     while (1) {
-        ccnet_client_send_update (session, req_id,
-                                  SC_CLIENT_MORE, SS_CLIENT_MORE,
-                                  fcall_str, fcall_len);
+        call_send_update (&call, SC_CLIENT_MORE, SS_CLIENT_MORE,
+                          fcall_str, fcall_len);
 
-        if (ccnet_client_read_response (session) < 0) {
+        if (call_read_response (&call) < 0) {
             *ret_len = 0;
-            ccnet_client_clean_rpc_request (session, req_id);
+            call_finish (&call, FALSE);
             g_string_free (buf, TRUE);
             return NULL;
         }
-        rsp = &session->response;
+        rsp = call.rsp;
 
         if (memcmp (rsp->code, SC_SERVER_RET, 3) == 0) {
             g_string_append_len (buf, rsp->content, rsp->clen);
             *ret_len = buf->len;
+            call_finish (&call, TRUE);
             return g_string_free (buf, FALSE);
         } else if (memcmp (rsp->code, SC_SERVER_MORE, 3) == 0) { 
             g_string_append_len (buf, rsp->content, rsp->clen);
@@ -69,6 +210,7 @@ invoke_service (CcnetClient *session,
             g_warning ("[Sea RPC] Bad response: %s %s.\n",
                        rsp->code, rsp->code_msg);
             *ret_len = 0;
+            call_finish (&call, TRUE);
             g_string_free (buf, TRUE);
             return NULL;
         }
@@ -79,41 +221,21 @@ invoke_service (CcnetClient *session,
     return NULL;
 }
 
-static CcnetClient *
-create_new_client (const char *conf_dir)
-{
-    CcnetClient *client;
-
-    client = ccnet_client_new ();
-    if (ccnet_client_load_confdir (client, conf_dir) < 0) {
-        g_warning ("[Sea RPC] Failed to load conf dir.\n");
-        g_object_unref (client);
-        return NULL;
-    }
-    if (ccnet_client_connect_daemon (client, CCNET_CLIENT_SYNC) < 0) {
-        g_warning ("[Sea RPC] Failed to connect ccnet.\n");
-        g_object_unref (client);
-        return NULL;
-    }
-
-    return client;
-}
-
-char *
-ccnetrpc_transport_send (void *arg, const gchar *fcall_str,
-                         size_t fcall_len, size_t *ret_len)
+static char *
+transport_invoke (CcnetrpcTransportParam *priv, const char *call_code,
+                  const gchar *fcall_str, size_t fcall_len, size_t *ret_len,
+                  gboolean *unsupported)
 {
-    CcnetrpcTransportParam *priv;
     CcnetClient *session, *new_session;
+    char *ret;
 
-    g_warn_if_fail (arg != NULL && fcall_str != NULL);
-
-    priv = (CcnetrpcTransportParam *)arg;
+    *unsupported = FALSE;
 
     if (priv->session != NULL) {
         /* Use single ccnet client as transport. */
         return invoke_service (priv->session, priv->peer_id, priv->service,
-                               fcall_str, fcall_len, ret_len);
+                               call_code, fcall_str, fcall_len, ret_len,
+                               unsupported);
     } else {
         /* Use client pool as transport. */
         g_assert (priv->pool != NULL);
@@ -125,39 +247,132 @@ ccnetrpc_transport_send (void *arg, const gchar *fcall_str,
             return NULL;
         }
 
-        char *ret = invoke_service (session, priv->peer_id, priv->service,
-                                    fcall_str, fcall_len, ret_len);
-        if (ret != NULL) {
+        ret = invoke_service (session, priv->peer_id, priv->service,
+                              call_code, fcall_str, fcall_len, ret_len,
+                              unsupported);
+        if (ret != NULL || *unsupported) {
             ccnet_client_pool_return_client (priv->pool, session);
             return ret;
         }
 
         /* If we failed to send data through the ccnet client returned by
          * client pool, ccnet may have been restarted.
-         * In this case, we create a new ccnet client and put it into
-         * the client pool after use.
+         * In this case, we drop the client and try once more with
+         * another one from the pool.
          */
 
         g_message ("[Sea RPC] Ccnet disconnected. Connect again.\n");
 
-        new_session = create_new_client (session->config_dir);
+        ccnet_client_pool_discard_client (priv->pool, session);
+        new_session = ccnet_client_pool_get_client (priv->pool);
         if (!new_session) {
             *ret_len = 0;
             return NULL;
         }
-        g_object_unref (session);
 
         ret = invoke_service (new_session, priv->peer_id, priv->service,
-                              fcall_str, fcall_len, ret_len);
-        if (ret != NULL)
+                              call_code, fcall_str, fcall_len, ret_len,
+                              unsupported);
+        if (ret != NULL || *unsupported)
             ccnet_client_pool_return_client (priv->pool, new_session);
         else
-            g_object_unref (new_session);
+            ccnet_client_pool_discard_client (priv->pool, new_session);
 
         return ret;
     }
 }
 
+char *
+ccnetrpc_transport_send (void *arg, const gchar *fcall_str,
+                         size_t fcall_len, size_t *ret_len)
+{
+    gboolean unsupported;
+
+    g_warn_if_fail (arg != NULL && fcall_str != NULL);
+
+    return transport_invoke ((CcnetrpcTransportParam *)arg, SC_CLIENT_CALL,
+                             fcall_str, fcall_len, ret_len, &unsupported);
+}
+
+int
+ccnetrpc_transport_send_batch (void *arg, int n_calls,
+                               char **fcall_strs, size_t *fcall_lens,
+                               char **rets, size_t *ret_lens)
+{
+    CcnetrpcTransportParam *priv = arg;
+    GString *batch;
+    gboolean unsupported;
+    const char *ptr, *end, *data;
+    char *result;
+    size_t result_len;
+    gsize len;
+    int i;
+
+    g_return_val_if_fail (n_calls > 0 && n_calls <= RPC_BATCH_MAX, -1);
+
+    batch = g_string_new (NULL);
+    for (i = 0; i < n_calls; i++)
+        rpc_batch_append (batch, fcall_strs[i], fcall_lens[i]);
+
+    result = transport_invoke (priv, SC_CLIENT_BATCH, batch->str, batch->len,
+                               &result_len, &unsupported);
+    g_string_free (batch, TRUE);
+
+    if (!result && unsupported) {
+        /* old server, one call at a time */
+        for (i = 0; i < n_calls; i++) {
+            rets[i] = transport_invoke (priv, SC_CLIENT_CALL,
+                                        fcall_strs[i], fcall_lens[i],
+                                        &ret_lens[i], &unsupported);
+            if (!rets[i])
+                goto error;
+        }
+        return 0;
+    }
+    if (!result)
+        return -1;
+
+    ptr = result;
+    end = result + result_len;
+    for (i = 0; i < n_calls; i++) {
+        if (rpc_batch_next (&ptr, end, &data, &len) < 0) {
+            g_warning ("[Sea RPC] Bad batch result.\n");
+            g_free (result);
+            goto error;
+        }
+        rets[i] = g_strndup (data, len);
+        ret_lens[i] = len;
+    }
+    g_free (result);
+    return 0;
+
+error:
+    while (--i >= 0) {
+        g_free (rets[i]);
+        rets[i] = NULL;
+    }
+    return -1;
+}
+
+char *
+ccnetrpc_transport_send_binary (void *arg, const char *fcall_str,
+                                size_t fcall_len, size_t *ret_len)
+{
+    CcnetrpcTransportParam *priv = arg;
+    gboolean unsupported;
+    char *ret;
+
+    if (priv->no_binary) {
+        *ret_len = 0;
+        return NULL;
+    }
+
+    ret = transport_invoke (priv, SC_CLIENT_BINARY, fcall_str, fcall_len,
+                            ret_len, &unsupported);
+    if (!ret && unsupported)
+        priv->no_binary = TRUE;
+    return ret;
+}
 
 int
 ccnetrpc_async_transport_send (void *arg, gchar *fcall_str,
@@ -184,3 +399,140 @@ ccnetrpc_async_transport_send (void *arg, gchar *fcall_str,
     ccnet_processor_start (proc, 0, NULL);
     return 0;
 }
+
+int
+ccnetrpc_async_batch_queue (void *arg, gchar *fcall_str,
+                            size_t fcall_len, void *rpc_priv)
+{
+    CcnetrpcAsyncBatchParam *batch = arg;
+    CcnetAsyncRpcCall *call = g_new0 (CcnetAsyncRpcCall, 1);
+
+    call->fcall_str = fcall_str;
+    call->fcall_len = fcall_len;
+    call->rpc_priv = rpc_priv;
+    g_ptr_array_add (batch->calls, call);
+    return 0;
+}
+
+/* The processors of one flush. */
+typedef struct {
+    CcnetClient        *session;
+    char               *peer_id;
+    char               *service;
+    CcnetAsyncBatchDone done;
+    void               *user_data;
+    int                 pending;
+    gboolean            success;
+} BatchFlush;
+
+static CcnetProcessor *
+create_async_proc (BatchFlush *flush)
+{
+    if (!flush->peer_id)
+        return ccnet_proc_factory_create_master_processor (
+            flush->session->proc_factory, "async-rpc");
+    else
+        return ccnet_proc_factory_create_remote_master_processor (
+            flush->session->proc_factory, "async-rpc", flush->peer_id);
+}
+
+static void on_flush_proc_done (CcnetProcessor *proc, gboolean success,
+                                void *vflush);
+
+static void
+start_flush_proc (BatchFlush *flush, CcnetProcessor *proc)
+{
+    flush->pending++;
+    g_signal_connect (proc, "done", G_CALLBACK(on_flush_proc_done), flush);
+    ccnet_processor_start (proc, 0, NULL);
+}
+
+static void
+on_flush_proc_done (CcnetProcessor *proc, gboolean success, void *vflush)
+{
+    BatchFlush *flush = vflush;
+    GPtrArray *calls;
+    guint i;
+
+    calls = ccnet_async_rpc_proc_take_calls ((CcnetAsyncRpcProc *)proc);
+    if (calls && proc->failure == PROC_BAD_RESP) {
+        /* an old server without SC_CLIENT_BATCH, one call at a time */
+        for (i = 0; i < calls->len; i++) {
+            CcnetAsyncRpcCall *call = g_ptr_array_index (calls, i);
+            CcnetProcessor *single = create_async_proc (flush);
+
+            ccnet_async_rpc_proc_set_rpc ((CcnetAsyncRpcProc *)single,
+                                          flush->service, call->fcall_str,
+                                          call->fcall_len, call->rpc_priv);
+            g_free (call);
+            start_flush_proc (flush, single);
+        }
+        g_ptr_array_free (calls, TRUE);
+    } else {
+        if (calls)
+            ccnet_async_rpc_fail_calls (calls, "Batch call failed");
+        if (!success)
+            flush->success = FALSE;
+    }
+
+    if (--flush->pending > 0)
+        return;
+
+    if (flush->done)
+        flush->done (flush->success, flush->user_data);
+    g_free (flush->peer_id);
+    g_free (flush->service);
+    g_free (flush);
+}
+
+int
+ccnetrpc_async_batch_flush (CcnetrpcAsyncBatchParam *batch,
+                            CcnetAsyncBatchDone done, void *user_data)
+{
+    CcnetrpcAsyncTransportParam *target = batch->target;
+    BatchFlush *flush;
+    guint i, n;
+
+    if (!target->session->connected)
+        return -1;
+
+    if (batch->calls->len == 0) {
+        if (done)
+            done (TRUE, user_data);
+        return 0;
+    }
+
+    flush = g_new0 (BatchFlush, 1);
+    flush->session = target->session;
+    flush->peer_id = g_strdup (target->peer_id);
+    flush->service = g_strdup (target->service);
+    flush->done = done;
+    flush->user_data = user_data;
+    flush->success = TRUE;
+
+    for (i = 0; i < batch->calls->len; i += n) {
+        CcnetProcessor *proc = create_async_proc (flush);
+
+        n = MIN (batch->calls->len - i, RPC_BATCH_MAX);
+        if (n == 1) {
+            /* a lone call needs no batch support */
+            CcnetAsyncRpcCall *call = g_ptr_array_index (batch->calls, i);
+            ccnet_async_rpc_proc_set_rpc ((CcnetAsyncRpcProc *)proc,
+                                          flush->service, call->fcall_str,
+                                          call->fcall_len, call->rpc_priv);
+            g_free (call);
+        } else {
+            GPtrArray *calls = g_ptr_array_sized_new (n);
+            guint j;
+
+            for (j = i; j < i + n; j++)
+                g_ptr_array_add (calls, g_ptr_array_index (batch->calls, j));
+            ccnet_async_rpc_proc_set_batch ((CcnetAsyncRpcProc *)proc,
+                                            flush->service, calls);
+        }
+        start_flush_proc (flush, proc);
+    }
+    /* the processors are done from the main loop, not before this */
+    g_ptr_array_set_size (batch->calls, 0);
+    return 0;
+}
@@ -1,9 +1,29 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
-#include "include.h"
+#ifdef CCNET_LIB
+    #include "include.h"
+    #define pipereadn       ccnet_util_pipereadn
+    #define pipewriten      ccnet_util_pipewriten
+    #define ccnet_pipe      ccnet_util_pipe
+#else
+    #include <string.h>
+    #include <errno.h>
+    #include "utils.h"
+#endif
+
 #include "cevent.h"
 
-#define CEVENT_SIZE  (sizeof(CEvent))
+/*
+ * Worker threads push events onto a lock-free stack. Only the push that
+ * finds the stack empty writes a byte to the pipe, so a burst of events
+ * costs one write and one wakeup; the main thread then takes the whole
+ * stack at once and dispatches it in posting order.
+ */
+
+struct CEventNode {
+    CEvent             event;
+    struct CEventNode *next;
+};
 
 typedef struct Handler {
     cevent_handler handler;
@@ -15,38 +35,60 @@ CEventManager* cevent_manager_new ()
     CEventManager *manager;
 
     manager = g_new0 (CEventManager, 1);
-    pthread_mutex_init (&manager->mutex, NULL);
-    manager->handler_table = g_hash_table_new_full (g_direct_hash,
-                                        g_direct_equal, NULL, g_free);
+    manager->handlers = g_ptr_array_new ();
+    manager->free_ids = g_array_new (FALSE, FALSE, sizeof(uint32_t));
     
     return manager;
 }
 
+static void
+dispatch_event (CEventManager *manager, CEvent *cevent)
+{
+    Handler *h = NULL;
+
+    if (cevent->id < manager->handlers->len)
+        h = g_ptr_array_index (manager->handlers, cevent->id);
+    if (h == NULL) {
+        g_warning ("no handler for event type %d\n", cevent->id);
+        return;
+    }
+
+    h->handler(cevent, h->handler_data);
+}
+
 void pipe_callback (int fd, short event, void *vmgr)
 {
     CEventManager *manager = (CEventManager *) vmgr;
-    CEvent *cevent;
-    char buf[CEVENT_SIZE];
+    struct CEventNode *list, *node, *prev = NULL;
+    char c;
     
-    if (ccnet_util_pipereadn(fd, buf, CEVENT_SIZE) != CEVENT_SIZE) {
+    /* One byte per empty to non-empty transition. */
+    if (pipereadn(fd, &c, 1) != 1) {
         g_warning ("read pipe error\n");
         return;
     }
 
-    cevent = (CEvent *)buf;
-    Handler *h = g_hash_table_lookup (manager->handler_table,
-                                      (gconstpointer)(long)cevent->id);
-    if (h == NULL) {
-        g_warning ("no handler for event type %d\n", cevent->id);
-        return;
+    list = __sync_lock_test_and_set (&manager->queue, NULL);
+
+    /* The stack is newest first. */
+    while (list) {
+        node = list->next;
+        list->next = prev;
+        prev = list;
+        list = node;
     }
 
-    h->handler(cevent, h->handler_data);
+    while (prev) {
+        node = prev;
+        prev = node->next;
+        dispatch_event (manager, &node->event);
+        g_slice_free (struct CEventNode, node);
+    }
 }
 
 int cevent_manager_start (CEventManager *manager)
 {
-    if (ccnet_util_pipe(manager->pipefd) < 0) {
+    if (ccnet_pipe(manager->pipefd) < 0) {
         g_warning ("pipe error: %s\n", strerror(errno));
         return -1;
     }
@@ -68,38 +110,48 @@ uint32_t cevent_manager_register (CEventManager *manager,
     h->handler = handler;
     h->handler_data = handler_data;
 
-    /* Since we're using 32-bit int for id, it may wrap around to 0.
-     * If some caller persistently use one id, it's handler may be
-     * overwritten by others.
-     */
-    do {
-        id = manager->next_id++;
-    } while (g_hash_table_lookup (manager->handler_table, (gpointer)(long)id));
-
-    g_hash_table_insert (manager->handler_table, (gpointer)(long)id, h);
+    /* Ids index the handler array, the ones unregistered are reused. */
+    if (manager->free_ids->len > 0) {
+        id = g_array_index (manager->free_ids, uint32_t,
+                            manager->free_ids->len - 1);
+        g_array_set_size (manager->free_ids, manager->free_ids->len - 1);
+        g_ptr_array_index (manager->handlers, id) = h;
+    } else {
+        id = manager->handlers->len;
+        g_ptr_array_add (manager->handlers, h);
+    }
 
     return id;
 }
 
 void cevent_manager_unregister (CEventManager *manager, uint32_t id)
 {
-    g_hash_table_remove (manager->handler_table, (gpointer)(long)id);
+    if (id >= manager->handlers->len ||
+        g_ptr_array_index (manager->handlers, id) == NULL)
+        return;
+
+    g_free (g_ptr_array_index (manager->handlers, id));
+    g_ptr_array_index (manager->handlers, id) = NULL;
+    g_array_append_val (manager->free_ids, id);
 }
 
 void
 cevent_manager_add_event (CEventManager *manager, uint32_t id,
                           void *data)
 {
-    pthread_mutex_lock (&manager->mutex);
+    struct CEventNode *node, *head;
 
-    struct CEvent cevent;
-    char *buf = (char *) &cevent;
+    node = g_slice_new (struct CEventNode);
+    node->event.id = id;
+    node->event.data = data;
 
-    cevent.id = id;
-    cevent.data = data;
-    if (ccnet_util_pipewriten(manager->pipefd[1], buf, CEVENT_SIZE) != CEVENT_SIZE) {
+    do {
+        head = manager->queue;
+        node->next = head;
+    } while (!__sync_bool_compare_and_swap (&manager->queue, head, node));
+
+    if (head == NULL &&
+        pipewriten(manager->pipefd[1], "", 1) != 1) {
         g_warning ("add event error\n");
     }
-
-    pthread_mutex_unlock (&manager->mutex);
 }
@@ -5,11 +5,39 @@
 
 #include <glib.h>
 #include <pthread.h>
+#include <sys/time.h>
 
+#ifdef WIN32
+    #include <winsock2.h>
+#else
+    #include <sys/select.h>
+    #include <sys/socket.h>
+#endif
+
+#include "packet-io.h"
+
+typedef struct IdleClient {
+    CcnetClient *client;
+    time_t       since;
+} IdleClient;
+
+/*
+ * Idle clients are used last in, first out, so the ones at the tail
+ * are those idle for longest and are reaped first. Reaping is done
+ * when clients are taken or given back, there is no timer.
+ */
 struct CcnetClientPool {
-    GQueue *clients;
+    GQueue *clients;            /* IdleClient */
     pthread_mutex_t lock;
+    pthread_cond_t  cond;
     const char *conf_dir;
+
+    int     min_size;
+    int     max_size;           /* 0 for no limit */
+    int     idle_timeout;       /* seconds, 0 to keep clients forever */
+    int     n_clients;          /* idle, in use or being created */
+
+    CcnetClientPoolStats stats;
 };
 
 struct CcnetClientPool *
@@ -19,43 +47,252 @@ ccnet_client_pool_new (const char *conf_dir)
 
     pool->clients = g_queue_new ();
     pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->cond, NULL);
     pool->conf_dir = g_strdup(conf_dir);
 
     return pool;
 }
 
-CcnetClient *
-ccnet_client_pool_get_client (struct CcnetClientPool *cpool)
+static CcnetClient *
+create_client (CcnetClientPool *cpool)
 {
     CcnetClient *client;
 
+    client = ccnet_client_new ();
+    if (ccnet_client_load_confdir (client, cpool->conf_dir) < 0) {
+        g_warning ("[client pool] Failed to load conf dir.\n");
+        g_object_unref (client);
+        return NULL;
+    }
+    if (ccnet_client_connect_daemon (client, CCNET_CLIENT_SYNC) < 0) {
+        g_warning ("[client pool] Failed to connect.\n");
+        g_object_unref (client);
+        return NULL;
+    }
+
+    return client;
+}
+
+/*
+ * An idle sync client has nothing to read. If its socket is readable
+ * the daemon has closed it, or left a stray response behind.
+ */
+static gboolean
+client_is_alive (CcnetClient *client)
+{
+    struct timeval tv = { 0, 0 };
+    fd_set fds;
+
+    if (!client->connected || client->connfd < 0)
+        return FALSE;
+    if (ccnet_packet_io_shm_pending (client->io))
+        return FALSE;
+
+    FD_ZERO (&fds);
+    FD_SET (client->connfd, &fds);
+    return select (client->connfd + 1, &fds, NULL, NULL, &tv) == 0;
+}
+
+/* Called with the lock held. Returns the clients to unref. */
+static GList *
+reap_idle_clients (CcnetClientPool *cpool)
+{
+    IdleClient *idle;
+    GList *reaped = NULL;
+    time_t now;
+
+    if (cpool->idle_timeout <= 0)
+        return NULL;
+
+    now = time (NULL);
+    while (cpool->n_clients > cpool->min_size &&
+           (idle = g_queue_peek_tail (cpool->clients)) != NULL &&
+           now - idle->since >= cpool->idle_timeout) {
+        g_queue_pop_tail (cpool->clients);
+        reaped = g_list_prepend (reaped, idle->client);
+        g_free (idle);
+        --cpool->n_clients;
+        ++cpool->stats.n_reaped;
+    }
+    return reaped;
+}
+
+static void
+free_clients (GList *clients)
+{
+    GList *ptr;
+
+    for (ptr = clients; ptr; ptr = ptr->next)
+        g_object_unref (ptr->data);
+    g_list_free (clients);
+}
+
+static void
+deadline_after (struct timespec *ts, int timeout_ms)
+{
+    struct timeval now;
+
+    gettimeofday (&now, NULL);
+    ts->tv_sec = now.tv_sec + timeout_ms / 1000;
+    ts->tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+CcnetClient *
+ccnet_client_pool_get_client_timeout (struct CcnetClientPool *cpool,
+                                      int timeout_ms)
+{
+    CcnetClient *client = NULL;
+    IdleClient *idle;
+    GList *dead = NULL, *reaped;
+    struct timespec deadline;
+    gboolean create = FALSE, waited = FALSE;
+
+    if (timeout_ms > 0)
+        deadline_after (&deadline, timeout_ms);
+
     pthread_mutex_lock (&cpool->lock);
-    client = g_queue_pop_head (cpool->clients);
-    pthread_mutex_unlock (&cpool->lock);
+    reaped = reap_idle_clients (cpool);
+    while (1) {
+        if ((idle = g_queue_pop_head (cpool->clients)) != NULL) {
+            client = idle->client;
+            g_free (idle);
+            if (client_is_alive (client))
+                break;
+            dead = g_list_prepend (dead, client);
+            client = NULL;
+            --cpool->n_clients;
+            ++cpool->stats.n_broken;
+            continue;
+        }
 
-    if (!client) {
-        client = ccnet_client_new ();
-        if (ccnet_client_load_confdir (client, cpool->conf_dir) < 0) {
-            g_warning ("[client pool] Failed to load conf dir.\n");
-            g_object_unref (client);
-            return NULL;
+        if (cpool->max_size <= 0 || cpool->n_clients < cpool->max_size) {
+            /* take the slot now, connect without the lock */
+            ++cpool->n_clients;
+            create = TRUE;
+            break;
         }
-        if (ccnet_client_connect_daemon (client, CCNET_CLIENT_SYNC) < 0) {
-            g_warning ("[client pool] Failed to connect.\n");
-            g_object_unref (client);
-            return NULL;
+
+        if (timeout_ms == 0) {
+            if (waited)
+                ++cpool->stats.n_timeouts;
+            break;
         }
+        if (!waited) {
+            waited = TRUE;
+            ++cpool->stats.n_waits;
+        }
+        if (timeout_ms < 0)
+            pthread_cond_wait (&cpool->cond, &cpool->lock);
+        else if (pthread_cond_timedwait (&cpool->cond, &cpool->lock,
+                                         &deadline) == ETIMEDOUT)
+            timeout_ms = 0;     /* one last look */
+    }
+    pthread_mutex_unlock (&cpool->lock);
+
+    free_clients (dead);
+    free_clients (reaped);
+
+    if (!create)
+        return client;
+
+    client = create_client (cpool);
+    pthread_mutex_lock (&cpool->lock);
+    if (client) {
+        ++cpool->stats.n_created;
+    } else {
+        --cpool->n_clients;
+        ++cpool->stats.n_failures;
+        pthread_cond_signal (&cpool->cond);
     }
+    pthread_mutex_unlock (&cpool->lock);
 
     return client;
 }
 
+CcnetClient *
+ccnet_client_pool_get_client (struct CcnetClientPool *cpool)
+{
+    return ccnet_client_pool_get_client_timeout (cpool, -1);
+}
+
 void
 ccnet_client_pool_return_client (struct CcnetClientPool *cpool,
                                  CcnetClient *client)
 {
+    IdleClient *idle = g_new0 (IdleClient, 1);
+    GList *reaped;
+
+    idle->client = client;
+    idle->since = time (NULL);
+
+    pthread_mutex_lock (&cpool->lock);
+    g_queue_push_head (cpool->clients, idle);
+    reaped = reap_idle_clients (cpool);
+    pthread_cond_signal (&cpool->cond);
+    pthread_mutex_unlock (&cpool->lock);
+
+    free_clients (reaped);
+}
+
+void
+ccnet_client_pool_discard_client (struct CcnetClientPool *cpool,
+                                  CcnetClient *client)
+{
+    g_object_unref (client);
+
+    pthread_mutex_lock (&cpool->lock);
+    --cpool->n_clients;
+    ++cpool->stats.n_broken;
+    pthread_cond_signal (&cpool->cond);
+    pthread_mutex_unlock (&cpool->lock);
+}
+
+void
+ccnet_client_pool_set_limits (struct CcnetClientPool *cpool,
+                              int min_size, int max_size, int idle_timeout)
+{
+    CcnetClient *client;
+    int n_new;
+
     pthread_mutex_lock (&cpool->lock);
-    g_queue_push_tail (cpool->clients, client);
+    cpool->max_size = max_size;
+    cpool->min_size = max_size > 0 ? MIN(min_size, max_size) : min_size;
+    cpool->idle_timeout = idle_timeout;
+    n_new = cpool->min_size - cpool->n_clients;
     pthread_mutex_unlock (&cpool->lock);
+
+    /* pre-warm */
+    while (n_new-- > 0) {
+        pthread_mutex_lock (&cpool->lock);
+        ++cpool->n_clients;
+        pthread_mutex_unlock (&cpool->lock);
+
+        client = create_client (cpool);
+        if (!client) {
+            pthread_mutex_lock (&cpool->lock);
+            --cpool->n_clients;
+            ++cpool->stats.n_failures;
+            pthread_mutex_unlock (&cpool->lock);
+            break;
+        }
+        pthread_mutex_lock (&cpool->lock);
+        ++cpool->stats.n_created;
+        pthread_mutex_unlock (&cpool->lock);
+        ccnet_client_pool_return_client (cpool, client);
+    }
 }
 
+void
+ccnet_client_pool_get_stats (struct CcnetClientPool *cpool,
+                             CcnetClientPoolStats *stats)
+{
+    pthread_mutex_lock (&cpool->lock);
+    *stats = cpool->stats;
+    stats->n_clients = cpool->n_clients;
+    stats->n_idle = g_queue_get_length (cpool->clients);
+    pthread_mutex_unlock (&cpool->lock);
+}
@@ -0,0 +1,249 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifdef __linux__
+/* for pthread_setaffinity_np */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "cpu-set.h"
+
+static void
+cpu_set_add (CcnetCpuSet *set, int cpu)
+{
+    int i;
+
+    for (i = 0; i < set->n; ++i)
+        if (set->cpus[i] == cpu)
+            return;
+    if (set->n < CCNET_CPU_SET_MAX)
+        set->cpus[set->n++] = cpu;
+}
+
+int
+ccnet_cpu_set_parse (CcnetCpuSet *set, const char *str)
+{
+    const char *p = str;
+    char *end;
+    long first, last, cpu;
+
+    set->n = 0;
+    if (!str)
+        return -1;
+
+    while (*p) {
+        while (*p == ' ' || *p == ',')
+            ++p;
+        if (!*p)
+            break;
+
+        first = strtol (p, &end, 10);
+        if (end == p || first < 0)
+            goto bad;
+        last = first;
+        p = end;
+        if (*p == '-') {
+            ++p;
+            last = strtol (p, &end, 10);
+            if (end == p || last < first)
+                goto bad;
+            p = end;
+        }
+        if (*p && *p != ',' && *p != ' ')
+            goto bad;
+
+        for (cpu = first; cpu <= last && cpu < 65536; ++cpu)
+            cpu_set_add (set, (int)cpu);
+    }
+    return set->n > 0 ? 0 : -1;
+
+bad:
+    set->n = 0;
+    return -1;
+}
+
+void
+ccnet_cpu_set_load (CcnetCpuSet *set, GKeyFile *keyf,
+                    const char *group, const char *key)
+{
+    char *value;
+
+    if (!keyf || !g_key_file_has_key (keyf, group, key, NULL))
+        return;
+    value = g_key_file_get_string (keyf, group, key, NULL);
+    if (ccnet_cpu_set_parse (set, value) < 0)
+        g_warning ("Bad cpu list for %s in [%s]: %s\n", key, group,
+                   value ? value : "");
+    g_free (value);
+}
+
+int
+ccnet_cpu_set_pin (pthread_t thread, const CcnetCpuSet *set, int index)
+{
+#ifdef __linux__
+    cpu_set_t mask;
+    int i;
+
+    CPU_ZERO (&mask);
+    if (set->n == 0) {
+        if (index >= 0)
+            return 0;
+        for (i = 0; i < CPU_SETSIZE; ++i)
+            CPU_SET (i, &mask);
+    } else if (index < 0) {
+        for (i = 0; i < set->n; ++i)
+            if (set->cpus[i] < CPU_SETSIZE)
+                CPU_SET (set->cpus[i], &mask);
+    } else if (set->cpus[index % set->n] < CPU_SETSIZE)
+        CPU_SET (set->cpus[index % set->n], &mask);
+
+    if (pthread_setaffinity_np (thread, sizeof(mask), &mask) != 0) {
+        g_warning ("Failed to pin a thread to cpus\n");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static int
+compare_ints (const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Collapse sorted @vals into "a-b,c". */
+static void
+format_ranges (int *vals, int n, GString *buf)
+{
+    int i, start;
+
+    qsort (vals, n, sizeof(int), compare_ints);
+    for (i = 0; i < n; ) {
+        start = i;
+        while (i + 1 < n && vals[i + 1] == vals[i] + 1)
+            ++i;
+        if (buf->len > 0)
+            g_string_append_c (buf, ',');
+        if (i > start)
+            g_string_append_printf (buf, "%d-%d", vals[start], vals[i]);
+        else
+            g_string_append_printf (buf, "%d", vals[i]);
+        ++i;
+    }
+}
+
+void
+ccnet_cpu_set_format (const CcnetCpuSet *set, GString *buf)
+{
+    GString *list;
+    int vals[CCNET_CPU_SET_MAX];
+    int i;
+
+    if (set->n == 0) {
+        g_string_append (buf, "any");
+        return;
+    }
+    for (i = 0; i < set->n; ++i)
+        vals[i] = set->cpus[i];
+    list = g_string_new (NULL);
+    format_ranges (vals, set->n, list);
+    g_string_append (buf, list->str);
+    g_string_free (list, TRUE);
+}
+
+/* The NUMA node of @cpu from sysfs, -1 if unknown. */
+static int
+cpu_node (int cpu)
+{
+#ifdef __linux__
+    char path[64];
+    GDir *dir;
+    const char *name;
+    int node = -1;
+
+    snprintf (path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = g_dir_open (path, 0, NULL);
+    if (!dir)
+        return -1;
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (strncmp (name, "node", 4) == 0 &&
+            g_ascii_isdigit (name[4])) {
+            node = atoi (name + 4);
+            break;
+        }
+    }
+    g_dir_close (dir);
+    return node;
+#else
+    return -1;
+#endif
+}
+
+G_LOCK_DEFINE_STATIC (placement);
+static GHashTable *placement;  /* name -> CcnetCpuSet */
+
+void
+ccnet_cpu_set_record (const char *name, const CcnetCpuSet *set)
+{
+    G_LOCK (placement);
+    if (!placement)
+        placement = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, g_free);
+    g_hash_table_replace (placement, g_strdup (name),
+                          g_memdup (set, sizeof(CcnetCpuSet)));
+    G_UNLOCK (placement);
+}
+
+static void
+append_placement (gpointer key, gpointer value, gpointer vbuf)
+{
+    CcnetCpuSet *set = value;
+    GString *buf = vbuf;
+    int nodes[CCNET_CPU_SET_MAX];
+    int i, j, node, n_nodes = 0;
+
+    g_string_append_printf (buf, "%s cpus ", (char *)key);
+    ccnet_cpu_set_format (set, buf);
+
+    for (i = 0; i < set->n; ++i) {
+        node = cpu_node (set->cpus[i]);
+        if (node < 0)
+            continue;
+        for (j = 0; j < n_nodes && nodes[j] != node; ++j)
+            ;
+        if (j == n_nodes)
+            nodes[n_nodes++] = node;
+    }
+    g_string_append (buf, " nodes ");
+    if (n_nodes == 0) {
+        g_string_append (buf, set->n ? "unknown" : "any");
+    } else {
+        GString *list = g_string_new (NULL);
+        format_ranges (nodes, n_nodes, list);
+        g_string_append (buf, list->str);
+        g_string_free (list, TRUE);
+    }
+    g_string_append_c (buf, '\n');
+}
+
+char *
+ccnet_cpu_set_get_placement (void)
+{
+    GString *buf = g_string_new (NULL);
+
+    G_LOCK (placement);
+    if (placement)
+        g_hash_table_foreach (placement, append_placement, buf);
+    G_UNLOCK (placement);
+
+    return g_string_free (buf, FALSE);
+}
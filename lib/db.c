@@ -1,6 +1,8 @@
 
 #include <glib.h>
 #include <unistd.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "db.h"
 
@@ -24,11 +26,182 @@ sqlite_open_db (const char *db_path, sqlite3 **db)
     return 0;
 }
 
+static void drop_statement_cache (sqlite3 *db);
+static void drop_read_pool (sqlite3 *db);
+
 int sqlite_close_db (sqlite3 *db)
 {
+    drop_read_pool (db);
+    drop_statement_cache (db);
     return sqlite3_close (db);
 }
 
+/*
+ * Read connections. Once a pool is enabled on a connection, SELECTs run
+ * from threads other than the one which enabled it go to read-only
+ * connections of their own, at most one query per connection at a
+ * time. The file is switched to WAL, so those readers see the last
+ * commit and neither wait for the writes of the owner nor hold them up.
+ * Everything else still goes to the connection itself.
+ */
+
+#define READER_BUSY_TIMEOUT 5000    /* msec, for checkpoints */
+
+typedef struct ReadPool {
+    pthread_t       owner;
+    char           *path;
+    GQueue         *idle;
+    int             n_open;
+    int             max_open;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} ReadPool;
+
+static GHashTable *read_pools;      /* sqlite3* -> ReadPool */
+G_LOCK_DEFINE_STATIC (read_pools);
+
+int
+sqlite_enable_read_pool (sqlite3 *db, int max_readers)
+{
+    const char *path = sqlite3_db_filename (db, "main");
+    ReadPool *pool;
+    char *mode;
+
+    if (max_readers <= 0 || !path || !*path)
+        return -1;
+
+    mode = sqlite_get_string (db, "PRAGMA journal_mode=WAL");
+    if (g_strcmp0 (mode, "wal") != 0) {
+        g_warning ("Cannot use WAL for %s, no read connections.\n", path);
+        g_free (mode);
+        return -1;
+    }
+    g_free (mode);
+    sqlite3_busy_timeout (db, READER_BUSY_TIMEOUT);
+
+    pool = g_new0 (ReadPool, 1);
+    pool->owner = pthread_self ();
+    pool->path = g_strdup (path);
+    pool->idle = g_queue_new ();
+    pool->max_open = max_readers;
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->cond, NULL);
+
+    G_LOCK (read_pools);
+    if (!read_pools)
+        read_pools = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_hash_table_insert (read_pools, db, pool);
+    G_UNLOCK (read_pools);
+
+    return 0;
+}
+
+static void
+drop_read_pool (sqlite3 *db)
+{
+    ReadPool *pool = NULL;
+    sqlite3 *conn;
+
+    G_LOCK (read_pools);
+    if (read_pools) {
+        pool = g_hash_table_lookup (read_pools, db);
+        g_hash_table_remove (read_pools, db);
+    }
+    G_UNLOCK (read_pools);
+    if (!pool)
+        return;
+
+    /* The owner closes it, readers are done by then. */
+    while ((conn = g_queue_pop_head (pool->idle)) != NULL) {
+        drop_statement_cache (conn);
+        sqlite3_close (conn);
+    }
+    g_queue_free (pool->idle);
+    pthread_mutex_destroy (&pool->lock);
+    pthread_cond_destroy (&pool->cond);
+    g_free (pool->path);
+    g_free (pool);
+}
+
+static gboolean
+is_select (const char *sql)
+{
+    while (g_ascii_isspace (*sql))
+        sql++;
+    return g_ascii_strncasecmp (sql, "SELECT", 6) == 0;
+}
+
+static sqlite3 *
+open_reader (ReadPool *pool)
+{
+    sqlite3 *conn;
+
+    if (sqlite3_open_v2 (pool->path, &conn,
+                         SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                         NULL) != SQLITE_OK) {
+        g_warning ("Couldn't open read connection to %s: %s\n",
+                   pool->path, sqlite3_errmsg (conn));
+        sqlite3_close (conn);
+        return NULL;
+    }
+    sqlite3_busy_timeout (conn, READER_BUSY_TIMEOUT);
+    return conn;
+}
+
+/* The connection to run @sql on, @db itself unless it's a read from a
+ * thread other than the owner of the pool of @db. */
+static sqlite3 *
+get_reader (sqlite3 *db, const char *sql)
+{
+    ReadPool *pool = NULL;
+    sqlite3 *conn = NULL;
+
+    if (!read_pools)
+        return db;
+    G_LOCK (read_pools);
+    if (read_pools)
+        pool = g_hash_table_lookup (read_pools, db);
+    G_UNLOCK (read_pools);
+    if (!pool || pthread_equal (pool->owner, pthread_self ()) ||
+        !is_select (sql))
+        return db;
+
+    pthread_mutex_lock (&pool->lock);
+    while (!(conn = g_queue_pop_head (pool->idle)) &&
+           pool->n_open >= pool->max_open)
+        pthread_cond_wait (&pool->cond, &pool->lock);
+    if (!conn)
+        pool->n_open++;
+    pthread_mutex_unlock (&pool->lock);
+
+    if (!conn && !(conn = open_reader (pool))) {
+        pthread_mutex_lock (&pool->lock);
+        pool->n_open--;
+        pthread_cond_signal (&pool->cond);
+        pthread_mutex_unlock (&pool->lock);
+        return db;
+    }
+    return conn;
+}
+
+static void
+put_reader (sqlite3 *db, sqlite3 *conn)
+{
+    ReadPool *pool;
+
+    if (conn == db)
+        return;
+
+    G_LOCK (read_pools);
+    pool = g_hash_table_lookup (read_pools, db);
+    G_UNLOCK (read_pools);
+
+    pthread_mutex_lock (&pool->lock);
+    g_queue_push_head (pool->idle, conn);
+    pthread_cond_signal (&pool->cond);
+    pthread_mutex_unlock (&pool->lock);
+}
+
 sqlite3_stmt *
 sqlite_query_prepare (sqlite3 *db, const char *sql)
 {
@@ -86,23 +259,28 @@ sqlite_end_transaction (sqlite3 *db)
 gboolean
 sqlite_check_for_existence (sqlite3 *db, const char *sql)
 {
+    sqlite3 *conn = get_reader (db, sql);
     sqlite3_stmt *stmt;
     int result;
 
-    stmt = sqlite_query_prepare (db, sql);
-    if (!stmt)
+    stmt = sqlite_query_prepare (conn, sql);
+    if (!stmt) {
+        put_reader (db, conn);
         return FALSE;
+    }
 
     result = sqlite3_step (stmt);
     if (result == SQLITE_ERROR) {
-        const gchar *str = sqlite3_errmsg (db);
+        const gchar *str = sqlite3_errmsg (conn);
 
         g_warning ("Couldn't execute query, error: %d->'%s'\n", 
                    result, str ? str : "no error given");
         sqlite3_finalize (stmt);
+        put_reader (db, conn);
         return FALSE;
     }
     sqlite3_finalize (stmt);
+    put_reader (db, conn);
 
     if (result == SQLITE_ROW)
         return TRUE;
@@ -113,12 +291,14 @@ int
 sqlite_foreach_selected_row (sqlite3 *db, const char *sql, 
                              SqliteRowFunc callback, void *data)
 {
+    sqlite3 *conn = get_reader (db, sql);
     sqlite3_stmt *stmt;
     int result;
     int n_rows = 0;
 
-    stmt = sqlite_query_prepare (db, sql);
+    stmt = sqlite_query_prepare (conn, sql);
     if (!stmt) {
+        put_reader (db, conn);
         return -1;
     }
 
@@ -132,92 +312,305 @@ sqlite_foreach_selected_row (sqlite3 *db, const char *sql,
     }
 
     if (result == SQLITE_ERROR) {
-        const gchar *s = sqlite3_errmsg (db);
+        const gchar *s = sqlite3_errmsg (conn);
 
         g_warning ("Couldn't execute query, error: %d->'%s'\n",
                    result, s ? s : "no error given");
         sqlite3_finalize (stmt);
+        put_reader (db, conn);
         return -1;
     }
 
     sqlite3_finalize (stmt);
+    put_reader (db, conn);
     return n_rows;
 }
 
-int sqlite_get_int (sqlite3 *db, const char *sql)
+/*
+ * Step @sql to its first row and hand it to @cb. Returns 1 if there
+ * was a row, 0 if not, -1 on error.
+ */
+static int
+get_first_row (sqlite3 *db, const char *sql, SqliteRowFunc cb, void *data)
 {
-    int ret = -1;
-    int result;
+    sqlite3 *conn = get_reader (db, sql);
     sqlite3_stmt *stmt;
+    int result, ret = 0;
 
-    if ( !(stmt = sqlite_query_prepare(db, sql)) )
-        return 0;
+    if (!(stmt = sqlite_query_prepare (conn, sql))) {
+        put_reader (db, conn);
+        return -1;
+    }
 
     result = sqlite3_step (stmt);
     if (result == SQLITE_ROW) {
-        ret = sqlite3_column_int (stmt, 0);
-        sqlite3_finalize (stmt);
-        return ret;
-    }
-
-    if (result == SQLITE_ERROR) {
-        const gchar *str = sqlite3_errmsg (db);
+        cb (stmt, data);
+        ret = 1;
+    } else if (result == SQLITE_ERROR) {
+        const gchar *str = sqlite3_errmsg (conn);
         g_warning ("Couldn't prepare query, error: %d->'%s'\n",
                    result, str ? str : "no error given");
-        sqlite3_finalize (stmt);
-        return 0;
+        ret = -1;
     }
+    sqlite3_finalize (stmt);
+    put_reader (db, conn);
+    return ret;
+}
+
+static gboolean
+get_int_cb (sqlite3_stmt *stmt, void *data)
+{
+    *(int *)data = sqlite3_column_int (stmt, 0);
+    return FALSE;
+}
+
+static gboolean
+get_int64_cb (sqlite3_stmt *stmt, void *data)
+{
+    *(gint64 *)data = sqlite3_column_int64 (stmt, 0);
+    return FALSE;
+}
+
+static gboolean
+get_string_cb (sqlite3_stmt *stmt, void *data)
+{
+    *(char **)data = g_strdup ((const char *)sqlite3_column_text (stmt, 0));
+    return FALSE;
+}
+
+int sqlite_get_int (sqlite3 *db, const char *sql)
+{
+    int ret = -1;
+
+    if (get_first_row (db, sql, get_int_cb, &ret) < 0)
+        return 0;
     return ret;
 }
 
 gint64 sqlite_get_int64 (sqlite3 *db, const char *sql)
 {
     gint64 ret = -1;
-    int result;
-    sqlite3_stmt *stmt;
 
-    if ( !(stmt = sqlite_query_prepare(db, sql)) )
+    if (get_first_row (db, sql, get_int64_cb, &ret) < 0)
         return 0;
+    return ret;
+}
 
-    result = sqlite3_step (stmt);
-    if (result == SQLITE_ROW) {
-        ret = sqlite3_column_int64 (stmt, 0);
-        sqlite3_finalize (stmt);
-        return ret;
+char *sqlite_get_string (sqlite3 *db, const char *sql)
+{
+    char *ret = NULL;
+
+    get_first_row (db, sql, get_string_cb, &ret);
+    return ret;
+}
+
+/*
+ * Statements with bound parameters. Prepared statements are cached per
+ * connection, keyed by the SQL text, so the SQL must not be built from
+ * the parameters. A statement is taken out of the cache while it runs,
+ * so threads sharing a connection never step the same one.
+ */
+
+#define MAX_CACHED_STATEMENTS 128
+
+static GHashTable *stmt_caches;     /* sqlite3* -> (sql -> sqlite3_stmt*) */
+G_LOCK_DEFINE_STATIC (stmt_caches);
+
+static void
+drop_statement_cache (sqlite3 *db)
+{
+    G_LOCK (stmt_caches);
+    if (stmt_caches)
+        g_hash_table_remove (stmt_caches, db);
+    G_UNLOCK (stmt_caches);
+}
+
+static sqlite3_stmt *
+get_statement (sqlite3 *db, const char *sql)
+{
+    GHashTable *cache;
+    gpointer key, stmt = NULL;
+
+    G_LOCK (stmt_caches);
+    if (stmt_caches && (cache = g_hash_table_lookup (stmt_caches, db)) &&
+        g_hash_table_lookup_extended (cache, sql, &key, &stmt)) {
+        g_hash_table_steal (cache, sql);
+        g_free (key);
     }
+    G_UNLOCK (stmt_caches);
 
-    if (result == SQLITE_ERROR) {
-        const gchar *str = sqlite3_errmsg (db);
-        g_warning ("Couldn't prepare query, error: %d->'%s'\n",
-                   result, str ? str : "no error given");
+    if (!stmt)
+        stmt = sqlite_query_prepare (db, sql);
+    return stmt;
+}
+
+static void
+put_statement (sqlite3 *db, const char *sql, sqlite3_stmt *stmt)
+{
+    GHashTable *cache;
+
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+
+    G_LOCK (stmt_caches);
+    if (!stmt_caches)
+        stmt_caches = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             NULL,
+                                             (GDestroyNotify)g_hash_table_destroy);
+    cache = g_hash_table_lookup (stmt_caches, db);
+    if (!cache) {
+        cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)sqlite3_finalize);
+        g_hash_table_insert (stmt_caches, db, cache);
+    }
+    if (g_hash_table_size (cache) < MAX_CACHED_STATEMENTS &&
+        !g_hash_table_lookup (cache, sql)) {
+        g_hash_table_insert (cache, g_strdup (sql), stmt);
+        stmt = NULL;
+    }
+    G_UNLOCK (stmt_caches);
+
+    if (stmt)
         sqlite3_finalize (stmt);
-        return 0;
+}
+
+static int
+bind_params (sqlite3_stmt *stmt, int n, va_list args)
+{
+    const char *type;
+    int i, rc = SQLITE_OK;
+
+    for (i = 0; i < n && rc == SQLITE_OK; i++) {
+        type = va_arg (args, const char *);
+        if (strcmp (type, "int") == 0)
+            rc = sqlite3_bind_int (stmt, i + 1, va_arg (args, int));
+        else if (strcmp (type, "int64") == 0)
+            rc = sqlite3_bind_int64 (stmt, i + 1, va_arg (args, gint64));
+        else if (strcmp (type, "string") == 0)
+            rc = sqlite3_bind_text (stmt, i + 1, va_arg (args, const char *),
+                                    -1, SQLITE_TRANSIENT);
+        else {
+            g_warning ("BUG: invalid parameter type %s.\n", type);
+            return -1;
+        }
     }
-    return ret;
+
+    if (rc != SQLITE_OK) {
+        g_warning ("Failed to bind parameter %d: %d.\n", i, rc);
+        return -1;
+    }
+    return 0;
 }
 
-char *sqlite_get_string (sqlite3 *db, const char *sql)
+static int
+statement_foreach_row (sqlite3 *db, const char *sql,
+                       SqliteRowFunc callback, void *data,
+                       int n, va_list args)
 {
-    const char *res = NULL;
-    int result;
+    sqlite3 *conn = get_reader (db, sql);
     sqlite3_stmt *stmt;
+    int result;
+    int n_rows = 0;
 
-    if ( !(stmt = sqlite_query_prepare(db, sql)) )
-        return NULL;
+    stmt = get_statement (conn, sql);
+    if (!stmt) {
+        put_reader (db, conn);
+        return -1;
+    }
 
-    result = sqlite3_step (stmt);
-    if (result == SQLITE_ROW) {
-        res = (const char *)sqlite3_column_text (stmt, 0);
+    if (bind_params (stmt, n, args) < 0) {
         sqlite3_finalize (stmt);
-        return g_strdup(res);
+        put_reader (db, conn);
+        return -1;
     }
 
-    if (result == SQLITE_ERROR) {
-        const gchar *str = sqlite3_errmsg (db);
-        g_warning ("Couldn't prepare query, error: %d->'%s'\n",
-                   result, str ? str : "no error given");
+    while (1) {
+        result = sqlite3_step (stmt);
+        if (result != SQLITE_ROW)
+            break;
+        n_rows++;
+        if (!callback || !callback (stmt, data))
+            break;
+    }
+
+    if (result != SQLITE_ROW && result != SQLITE_DONE) {
+        const gchar *s = sqlite3_errmsg (conn);
+
+        g_warning ("Couldn't execute query, error: %d->'%s'\n\t%s\n",
+                   result, s ? s : "no error given", sql);
         sqlite3_finalize (stmt);
-        return NULL;
+        put_reader (db, conn);
+        return -1;
     }
-    return NULL;
+
+    put_statement (conn, sql, stmt);
+    put_reader (db, conn);
+    return n_rows;
+}
+
+int
+sqlite_statement_query (sqlite3 *db, const char *sql, int n, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start (args, n);
+    ret = statement_foreach_row (db, sql, NULL, NULL, n, args);
+    va_end (args);
+
+    return ret < 0 ? -1 : 0;
+}
+
+gboolean
+sqlite_statement_exists (sqlite3 *db, const char *sql, int n, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start (args, n);
+    ret = statement_foreach_row (db, sql, NULL, NULL, n, args);
+    va_end (args);
+
+    return ret > 0;
+}
+
+int
+sqlite_statement_foreach_row (sqlite3 *db, const char *sql,
+                              SqliteRowFunc callback, void *data,
+                              int n, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start (args, n);
+    ret = statement_foreach_row (db, sql, callback, data, n, args);
+    va_end (args);
+
+    return ret;
+}
+
+int
+sqlite_statement_get_int (sqlite3 *db, const char *sql, int n, ...)
+{
+    va_list args;
+    int ret = -1;
+
+    va_start (args, n);
+    statement_foreach_row (db, sql, get_int_cb, &ret, n, args);
+    va_end (args);
+
+    return ret;
+}
+
+char *
+sqlite_statement_get_string (sqlite3 *db, const char *sql, int n, ...)
+{
+    va_list args;
+    char *ret = NULL;
+
+    va_start (args, n);
+    statement_foreach_row (db, sql, get_string_cb, &ret, n, args);
+    va_end (args);
+
+    return ret;
 }
@@ -9,6 +9,14 @@ int sqlite_open_db (const char *db_path, sqlite3 **db);
 
 int sqlite_close_db (sqlite3 *db);
 
+/*
+ * Switch @db to WAL and serve the SELECTs of threads other than the
+ * calling one from up to @max_readers read-only connections, opened as
+ * needed. The other threads wait when all of them are busy. The pool
+ * goes with sqlite_close_db(), once no other thread uses @db.
+ */
+int sqlite_enable_read_pool (sqlite3 *db, int max_readers);
+
 sqlite3_stmt *sqlite_query_prepare (sqlite3 *db, const char *sql);
 
 int sqlite_query_exec (sqlite3 *db, const char *sql);
@@ -29,5 +37,24 @@ gint64 sqlite_get_int64 (sqlite3 *db, const char *sql);
 
 char *sqlite_get_string (sqlite3 *db, const char *sql);
 
+/*
+ * Queries with '?' placeholders. The @n parameters follow as pairs of
+ * a type name ("int", "int64" or "string") and a value, e.g.
+ *
+ *   sqlite_statement_get_int (db, "SELECT id FROM T WHERE name=?",
+ *                             1, "string", name);
+ */
+int sqlite_statement_query (sqlite3 *db, const char *sql, int n, ...);
+
+gboolean sqlite_statement_exists (sqlite3 *db, const char *sql, int n, ...);
+
+int sqlite_statement_foreach_row (sqlite3 *db, const char *sql,
+                                  SqliteRowFunc callback, void *data,
+                                  int n, ...);
+
+int sqlite_statement_get_int (sqlite3 *db, const char *sql, int n, ...);
+
+char *sqlite_statement_get_string (sqlite3 *db, const char *sql, int n, ...);
+
 
 #endif
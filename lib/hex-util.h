@@ -0,0 +1,141 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_HEX_UTIL_H
+#define CCNET_HEX_UTIL_H
+
+/*
+ * Hex codec shared by utils.c and libccnet_utils.c. Ids are 20 bytes,
+ * so the SSE2 kernels handle the first 16 and the tables the rest.
+ * SSE2 is part of the x86-64 ABI, no runtime check is needed.
+ */
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* 0xff for characters which are not hex digits */
+static const unsigned char hex_values[256] = {
+#define HX16 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, \
+             0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff
+    HX16, HX16, HX16,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff, 10, 11, 12, 13, 14, 15, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    HX16,
+    0xff, 10, 11, 12, 13, 14, 15, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    HX16,
+    HX16, HX16, HX16, HX16, HX16, HX16, HX16, HX16
+#undef HX16
+};
+
+#if defined(__SSE2__)
+
+static inline void
+hex_encode_16 (const unsigned char *raw, char *hex)
+{
+    const __m128i mask = _mm_set1_epi8 (0x0f);
+    const __m128i nine = _mm_set1_epi8 (9);
+    const __m128i zero = _mm_set1_epi8 ('0');
+    const __m128i gap = _mm_set1_epi8 ('a' - '0' - 10);
+    __m128i v, hi, lo, a, b;
+
+    v = _mm_loadu_si128 ((const __m128i *)raw);
+    hi = _mm_and_si128 (_mm_srli_epi16 (v, 4), mask);
+    lo = _mm_and_si128 (v, mask);
+
+    /* the high nibble of each byte comes first */
+    a = _mm_unpacklo_epi8 (hi, lo);
+    b = _mm_unpackhi_epi8 (hi, lo);
+    a = _mm_add_epi8 (_mm_add_epi8 (a, zero),
+                      _mm_and_si128 (_mm_cmpgt_epi8 (a, nine), gap));
+    b = _mm_add_epi8 (_mm_add_epi8 (b, zero),
+                      _mm_and_si128 (_mm_cmpgt_epi8 (b, nine), gap));
+
+    _mm_storeu_si128 ((__m128i *)hex, a);
+    _mm_storeu_si128 ((__m128i *)(hex + 16), b);
+}
+
+/* Nibble values of 16 characters; *bad is non-zero for non hex ones. */
+static inline __m128i
+hex_nibbles_16 (const char *hex, int *bad)
+{
+    const __m128i c = _mm_loadu_si128 ((const __m128i *)hex);
+    __m128i d, l, is_digit, is_alpha;
+
+    d = _mm_sub_epi8 (c, _mm_set1_epi8 ('0'));
+    l = _mm_sub_epi8 (_mm_or_si128 (c, _mm_set1_epi8 (0x20)),
+                      _mm_set1_epi8 ('a'));
+    is_digit = _mm_cmpeq_epi8 (_mm_min_epu8 (d, _mm_set1_epi8 (9)), d);
+    is_alpha = _mm_cmpeq_epi8 (_mm_min_epu8 (l, _mm_set1_epi8 (5)), l);
+
+    *bad |= _mm_movemask_epi8 (_mm_or_si128 (is_digit, is_alpha)) ^ 0xffff;
+    return _mm_or_si128 (
+        _mm_and_si128 (is_digit, d),
+        _mm_and_si128 (is_alpha, _mm_add_epi8 (l, _mm_set1_epi8 (10))));
+}
+
+static inline int
+hex_decode_16 (const char *hex, unsigned char *raw)
+{
+    const __m128i low = _mm_set1_epi16 (0x00ff);
+    __m128i a, b;
+    int bad = 0;
+
+    a = hex_nibbles_16 (hex, &bad);
+    b = hex_nibbles_16 (hex + 16, &bad);
+    if (bad)
+        return -1;
+
+    /* each 16-bit lane holds <high nibble, low nibble> */
+    a = _mm_or_si128 (_mm_and_si128 (_mm_slli_epi16 (a, 4), low),
+                      _mm_srli_epi16 (a, 8));
+    b = _mm_or_si128 (_mm_and_si128 (_mm_slli_epi16 (b, 4), low),
+                      _mm_srli_epi16 (b, 8));
+    _mm_storeu_si128 ((__m128i *)raw, _mm_packus_epi16 (a, b));
+    return 0;
+}
+
+#endif  /* __SSE2__ */
+
+static inline void
+hex_encode (const unsigned char *raw, char *hex, int n_bytes)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= n_bytes; i += 16)
+        hex_encode_16 (raw + i, hex + 2 * i);
+#endif
+    for (; i < n_bytes; i++) {
+        hex[2 * i] = hex_digits[raw[i] >> 4];
+        hex[2 * i + 1] = hex_digits[raw[i] & 0xf];
+    }
+    hex[2 * n_bytes] = '\0';
+}
+
+/* Reads exactly 2 * @n_bytes characters. */
+static inline int
+hex_decode (const char *hex, unsigned char *raw, int n_bytes)
+{
+    unsigned int hi, lo;
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= n_bytes; i += 16)
+        if (hex_decode_16 (hex + 2 * i, raw + i) < 0)
+            return -1;
+#endif
+    for (; i < n_bytes; i++) {
+        hi = hex_values[(unsigned char)hex[2 * i]];
+        lo = hex_values[(unsigned char)hex[2 * i + 1]];
+        if ((hi | lo) & 0xf0)
+            return -1;
+        raw[i] = (hi << 4) | lo;
+    }
+    return 0;
+}
+
+#endif
@@ -8,12 +8,12 @@
 #include "htree.h"
 
 #define MAX_HEIGHT 7
-#define INDEX(hashid,depth)  (depth%2 ? (hashid[depth/2] && 0x0f):(hashid[depth/2] >> 4))
+#define INDEX(hashid,depth)  (depth%2 ? (hashid[depth/2] & 0x0f):(hashid[depth/2] >> 4))
 #define IS_NODE(n) (n->is_node)
 
 static const int g_index[] = {0, 1, 17, 273, 4369, 69905, 1118481, 17895697, 286331153};
 
-static inline void hashxor(char *hashid, char *id, int len)
+static inline void hashxor(unsigned char *hashid, const unsigned char *id, int len)
 {
     int i = 0;
     for (i = 0; i < len; ++i) {
@@ -40,19 +40,10 @@ static inline void ht_set_data (HTree *tree, HTNode *node, HTData *data)
     tree->datas[node - tree->nodes] = data;
 }
 
-static inline HTItem *create_item (unsigned char *hashid, void *data)
-{
-    HTItem *it = malloc (sizeof (HTItem));
-    it->hashid = hashid;
-    it->data = data;
-    it->next = NULL;
-}
-
 static inline void delete_item (HTree *tree, HTItem *it)
 {
     if (tree->item_free)
-        tree->item_free (it);
-    free (it);
+        tree->item_free (it->data);
 }
 
 
@@ -63,99 +54,107 @@ static void *load_node (HTree *tree, HTNode *node)
 
     data = malloc (sizeof(HTData));
     data->size = 0;
+    data->alloc = 0;
     data->hashid = malloc (tree->hashid_len);
     memset (data->hashid, 0, tree->hashid_len);
-    data->item_list = NULL;
+    data->items = NULL;
+    data->gen = 0;
     ht_set_data (tree, node, data);
     return data;
 }
 
 static void delete_data (HTree *tree, HTData *data)
 {
-    HTItem *p = NULL;;
+    int i;
     if (data) {
         if (data->hashid)
             free (data->hashid);
-        while (data->item_list) {
-            p = data->item_list;
-            data->item_list = p->next;
-            delete_item (tree, p);
-        }
+        for (i = 0; i < data->size; i++)
+            delete_item (tree, &data->items[i]);
+        free (data->items);
         free(data);
     }
 }
 
-static int add_item (HTree *tree, HTNode *node, unsigned char *hashid, void *data)
+static void append_item (HTData *htdata, unsigned char *hashid, void *data)
 {
-    if (node == NULL)
-        return 0;
-    int r = 0, i = 0;
-    HTData *htdata = NULL;
-    if (IS_NODE(node)) {
-        r = add_item (tree, 
-                      ht_get_child (tree, node, INDEX(hashid, node->depth)), 
-                      hashid,
-                      data);
-        if (r) {
-            htdata  = load_node(tree, node);
-            hashxor (htdata->hashid, hashid, tree->hashid_len);
-        }
-        return r;
+    if (htdata->size == htdata->alloc) {
+        htdata->alloc = htdata->alloc ? htdata->alloc * 2 : 4;
+        htdata->items = realloc (htdata->items,
+                                 htdata->alloc * sizeof(HTItem));
     }
-    
-    htdata  = load_node(tree, node);
-    HTItem *p = htdata->item_list;
-    for (i = 0; i < htdata->size; i++){
-        if (memcmp (hashid, p->hashid, tree->hashid_len) == 0) {
+    htdata->items[htdata->size].hashid = hashid;
+    htdata->items[htdata->size].data = data;
+    ++htdata->size;
+}
+
+static HTNode *get_leaf (HTree *tree, const unsigned char *hashid)
+{
+    HTNode *node = tree->nodes;
+    while (node && IS_NODE(node))
+        node = ht_get_child (tree, node, INDEX(hashid, node->depth));
+    return node;
+}
+
+/* Fold a change of @hashid under @node into the hashes above it. */
+static void update_ancestors (HTree *tree, HTNode *node,
+                              const unsigned char *hashid)
+{
+    HTData *data;
+    while ((node = ht_get_parent (tree, node)) != NULL) {
+        data = load_node (tree, node);
+        hashxor (data->hashid, hashid, tree->hashid_len);
+        data->gen = tree->gen;
+    }
+}
+
+static int add_item (HTree *tree, unsigned char *hashid, void *data)
+{
+    HTNode *leaf = get_leaf (tree, hashid);
+    HTData *htdata;
+    int i;
+
+    if (leaf == NULL)
+        return 0;
+
+    htdata = load_node (tree, leaf);
+    for (i = 0; i < htdata->size; i++) {
+        if (memcmp (hashid, htdata->items[i].hashid, tree->hashid_len) == 0)
             return 0;
-        }
-        p = p->next;
     }
-    HTItem *it = create_item (hashid, data);
-    it->next = htdata->item_list;
-    htdata->item_list = it;
-    ++htdata->size;
-    hashxor (htdata->hashid, it->hashid, tree->hashid_len);
+    append_item (htdata, hashid, data);
+
+    ++tree->gen;
+    hashxor (htdata->hashid, hashid, tree->hashid_len);
+    htdata->gen = tree->gen;
+    update_ancestors (tree, leaf, hashid);
     return 1;
 }
 
-static int remove_item (HTree *tree, HTNode *node, unsigned char *hashid)
+static int remove_item (HTree *tree, unsigned char *hashid)
 {
-    if (node == NULL)
+    HTNode *leaf = get_leaf (tree, hashid);
+    HTData *data;
+    int i;
+
+    if (leaf == NULL || (data = ht_get_data (tree, leaf)) == NULL)
         return 0;
-    int r = 0, i = 0;
-    HTData *data = NULL;
-    if (IS_NODE(node)) {
-        r = remove_item (tree, 
-                         ht_get_child (tree, node, INDEX(hashid, node->depth)), 
-                         hashid);
-        if (r) {
-            data  = load_node(tree, node);
-            hashxor (data->hashid, hashid, tree->hashid_len);
-        }
-        return r;
-    }
-    
-    data  = load_node(tree, node);
-    HTItem *p = data->item_list;
-    HTItem *pre = NULL;
-    for (i = 0; i < data->size; i++){
-        if (memcmp (hashid, p->hashid, tree->hashid_len) == 0) {
-            if (pre == NULL) {
-                data->item_list = p->next;
-            } else {
-                pre->next = p->next;
-            }
-            --data->size;
-            hashxor (data->hashid, hashid, tree->hashid_len);
-            delete_item (tree, p);
-            return 1;
-        }
-        pre = p;
-        p = p->next;
+
+    for (i = 0; i < data->size; i++) {
+        if (memcmp (hashid, data->items[i].hashid, tree->hashid_len) == 0)
+            break;
     }
-    
-    return 0;
+    if (i == data->size)
+        return 0;
+
+    ++tree->gen;
+    hashxor (data->hashid, hashid, tree->hashid_len);
+    data->gen = tree->gen;
+    update_ancestors (tree, leaf, hashid);
+
+    delete_item (tree, &data->items[i]);
+    data->items[i] = data->items[--data->size];
+    return 1;
 }
 
 HTree* ht_new (int size, int hashlen)
@@ -167,6 +166,7 @@ HTree* ht_new (int size, int hashlen)
     ht->height = height;
     ht->size = g_index[height];
     ht->hashid_len = hashlen;
+    ht->gen = 0;
     ht->item_free = NULL;
     ht->nodes = malloc (ht->size *sizeof(HTNode));
     ht->datas = malloc (ht->size *sizeof(HTData *));
@@ -182,17 +182,54 @@ HTree* ht_new (int size, int hashlen)
     for (j = g_index[height-1]; j < g_index[height]; ++j) {
         (ht->nodes[j]).is_node = 0;
     }
-    
+
+    return ht;
 }
 
 int ht_add (HTree *tree, unsigned char *hashid, void *data)
 {
-    return add_item (tree, tree->nodes, hashid, data);
+    return add_item (tree, hashid, data);
 }
 
 int ht_remove (HTree *tree, unsigned char *hashid)
 {
-    return remove_item (tree, tree->nodes, hashid);
+    return remove_item (tree, hashid);
+}
+
+int ht_build_sorted (HTree *tree, unsigned char **hashids, void **datas, int n)
+{
+    HTNode *leaf;
+    HTData *data, *pdata;
+    int i, added = 0;
+
+    if (ht_get_data (tree, tree->nodes) != NULL)
+        return -1;
+
+    ++tree->gen;
+    for (i = 0; i < n; i++) {
+        if (i > 0 && memcmp (hashids[i-1], hashids[i], tree->hashid_len) == 0)
+            continue;
+        leaf = get_leaf (tree, hashids[i]);
+        if (leaf == NULL)
+            continue;
+        data = load_node (tree, leaf);
+        append_item (data, hashids[i], datas ? datas[i] : NULL);
+        hashxor (data->hashid, hashids[i], tree->hashid_len);
+        data->gen = tree->gen;
+        ++added;
+    }
+
+    /* Children come after their parent in the node array, so a reverse
+     * pass sees every node complete before it is folded upwards. */
+    for (i = tree->size - 1; i > 0; i--) {
+        if ((data = tree->datas[i]) == NULL)
+            continue;
+        pdata = load_node (tree, ht_get_parent (tree, tree->nodes + i));
+        hashxor (pdata->hashid, data->hashid, tree->hashid_len);
+        pdata->gen = tree->gen;
+    }
+
+    return added;
 }
 
 void ht_resize (HTree *ht, int size)
@@ -254,7 +291,7 @@ HTNode *ht_get_parent (HTree *tree, HTNode *node)
 
 HTNode *ht_get_brother (HTree *tree, HTNode *node)
 {
-    if (get_pos(tree, node) & 0xff < 15)
+    if ((get_pos(tree, node) & 0x0f) < 15)
         return node + 1;
     return NULL;
 }
@@ -265,16 +302,13 @@ static void remove_node (HTree *tree, HTNode *node)
     if (data == NULL)
         return;
 
-    if (HTNODE_IS_LEAF(node)) {        
-        delete_data (tree, data);
-    } else {
+    if (!HTNODE_IS_LEAF(node)) {
         int i = 0;
-        HTNode *child = NULL;
-        for (i = 0; i < 16; ++i) {
-            child = ht_get_child (tree, node, i);
-            remove_node (tree, child);
-        }
+        for (i = 0; i < 16; ++i)
+            remove_node (tree, ht_get_child (tree, node, i));
     }
+    delete_data (tree, data);
+    ht_set_data (tree, node, NULL);
 }
 
 void ht_remove_node (HTree *tree, HTNode *node)
@@ -282,14 +316,430 @@ void ht_remove_node (HTree *tree, HTNode *node)
     HTData *data = ht_get_data (tree, node);
     if (data == NULL)
         return;
-    char *hash = data->hashid;
-    HTNode *parent = ht_get_parent (tree, node);
 
-    while (parent) {
-        char *phash = ht_get_node_hash (tree, parent);
-        hashxor (phash, hash, tree->hashid_len);
-        parent = ht_get_parent (tree, parent);
-    }
+    ++tree->gen;
+    update_ancestors (tree, node, data->hashid);
     remove_node (tree, node);
-    ht_set_data (tree, node, NULL);
+}
+
+void ht_foreach_changed (HTree *tree, HTNode *node, unsigned int since,
+                         HTLeafFunc func, void *user_data)
+{
+    HTData *data = ht_get_data (tree, node);
+    int i;
+
+    if (data == NULL || data->gen <= since)
+        return;
+
+    if (HTNODE_IS_LEAF(node)) {
+        func (tree, node, user_data);
+        return;
+    }
+    for (i = 0; i < 16; ++i)
+        ht_foreach_changed (tree, ht_get_child (tree, node, i), since,
+                            func, user_data);
+}
+
+/* -------- Wire Format and Diff ---------------- */
+
+/*
+ * A diff walks down the two trees level by level, asking the other side
+ * only for the nodes whose hashes differ. A request lists nodes of one
+ * level with the hash the asking side has for them; the reply gives,
+ * for every node whose hash is not the same there, the hashes of its
+ * non-empty children, or the ids in it for a leaf.
+ *
+ * Both start with a header: version, height, hashid length and depth,
+ * one byte each. Then
+ *
+ *   request record:  pos(4) present(1) hash(hashid_len)
+ *   reply record:    pos(4) kind(1)
+ *                    kind 1, node:  mask(2) hash(hashid_len) per bit
+ *                    kind 2, leaf:  count(4) id(hashid_len) * count
+ *                    kind 0, the node is empty there
+ *
+ * pos is the position of the node in its level, numbers are big endian
+ * and mask bit b is set for child b.
+ */
+
+#define HT_WIRE_VERSION  1
+#define HT_HEADER_LEN    4
+
+enum {
+    HT_KIND_EMPTY = 0,
+    HT_KIND_NODE,
+    HT_KIND_LEAF,
+};
+
+typedef struct {
+    unsigned char *data;
+    int len;
+    int alloc;
+} HTBuf;
+
+static void buf_reserve (HTBuf *buf, int len)
+{
+    if (buf->len + len <= buf->alloc)
+        return;
+    while (buf->len + len > buf->alloc)
+        buf->alloc = buf->alloc ? buf->alloc * 2 : 256;
+    buf->data = realloc (buf->data, buf->alloc);
+}
+
+static void buf_append (HTBuf *buf, const void *data, int len)
+{
+    buf_reserve (buf, len);
+    memcpy (buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void buf_append_u8 (HTBuf *buf, unsigned int v)
+{
+    unsigned char c = v;
+    buf_append (buf, &c, 1);
+}
+
+static void buf_append_u16 (HTBuf *buf, unsigned int v)
+{
+    unsigned char b[2] = { v >> 8, v };
+    buf_append (buf, b, 2);
+}
+
+static void buf_append_u32 (HTBuf *buf, unsigned int v)
+{
+    unsigned char b[4] = { v >> 24, v >> 16, v >> 8, v };
+    buf_append (buf, b, 4);
+}
+
+static inline unsigned int get_u16 (const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static inline unsigned int get_u32 (const unsigned char *p)
+{
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void buf_append_header (HTBuf *buf, HTree *tree, int depth)
+{
+    buf_append_u8 (buf, HT_WIRE_VERSION);
+    buf_append_u8 (buf, tree->height);
+    buf_append_u8 (buf, tree->hashid_len);
+    buf_append_u8 (buf, depth);
+}
+
+/* The depth in the header, or -1 if it is not for @tree. */
+static int check_header (HTree *tree, const unsigned char *p, int len)
+{
+    if (len < HT_HEADER_LEN || p[0] != HT_WIRE_VERSION ||
+        p[1] != tree->height || p[2] != tree->hashid_len ||
+        p[3] >= tree->height)
+        return -1;
+    return p[3];
+}
+
+static inline int level_size (int depth)
+{
+    return g_index[depth + 1] - g_index[depth];
+}
+
+static inline HTNode *node_at (HTree *tree, int depth, unsigned int pos)
+{
+    return tree->nodes + g_index[depth] + pos;
+}
+
+static void append_node_reply (HTBuf *buf, HTree *tree, HTNode *node)
+{
+    HTData *data = ht_get_data (tree, node);
+    unsigned int mask = 0;
+    int i, b;
+
+    if (data == NULL) {
+        buf_append_u8 (buf, HT_KIND_EMPTY);
+        return;
+    }
+
+    if (HTNODE_IS_LEAF(node)) {
+        buf_append_u8 (buf, HT_KIND_LEAF);
+        buf_append_u32 (buf, data->size);
+        buf_reserve (buf, data->size * tree->hashid_len);
+        for (i = 0; i < data->size; i++)
+            buf_append (buf, data->items[i].hashid, tree->hashid_len);
+        return;
+    }
+
+    buf_append_u8 (buf, HT_KIND_NODE);
+    for (b = 0; b < 16; b++)
+        if (ht_get_data (tree, ht_get_child (tree, node, b)))
+            mask |= 1 << b;
+    buf_append_u16 (buf, mask);
+    for (b = 0; b < 16; b++)
+        if (mask & (1 << b))
+            buf_append (buf, ht_get_node_hash (tree, ht_get_child (tree, node, b)),
+                        tree->hashid_len);
+}
+
+int ht_diff_answer (HTree *tree, const unsigned char *req, int req_len,
+                    unsigned char **reply, int *reply_len)
+{
+    int rec_len = 5 + tree->hashid_len;
+    const unsigned char *p;
+    HTBuf buf = { NULL, 0, 0 };
+    HTNode *node;
+    HTData *data;
+    unsigned int pos;
+    int depth;
+
+    depth = check_header (tree, req, req_len);
+    if (depth < 0 || (req_len - HT_HEADER_LEN) % rec_len != 0)
+        return -1;
+
+    buf_append_header (&buf, tree, depth);
+    for (p = req + HT_HEADER_LEN; p < req + req_len; p += rec_len) {
+        pos = get_u32 (p);
+        if (pos >= (unsigned int)level_size (depth)) {
+            free (buf.data);
+            return -1;
+        }
+        node = node_at (tree, depth, pos);
+        data = ht_get_data (tree, node);
+        if (data == NULL && !p[4])
+            continue;
+        if (data && p[4] &&
+            memcmp (data->hashid, p + 5, tree->hashid_len) == 0)
+            continue;
+
+        buf_append_u32 (&buf, pos);
+        append_node_reply (&buf, tree, node);
+    }
+
+    *reply = buf.data;
+    *reply_len = buf.len;
+    return 0;
+}
+
+/* Nodes to ask for, of one level. */
+typedef struct {
+    unsigned int *pos;
+    int n;
+    int alloc;
+} HTLevel;
+
+struct ht_diff {
+    HTree       *tree;
+    HTDiffFunc   func;
+    void        *user_data;
+    int          max_records;
+    HTLevel     *levels;        /* one per depth */
+    int          depth;         /* the level being asked for */
+    int          next;          /* first node of it not asked for yet */
+    int          outstanding;   /* requests without a reply */
+};
+
+static void level_add (HTLevel *level, unsigned int pos)
+{
+    if (level->n == level->alloc) {
+        level->alloc = level->alloc ? level->alloc * 2 : 16;
+        level->pos = realloc (level->pos,
+                              level->alloc * sizeof(unsigned int));
+    }
+    level->pos[level->n++] = pos;
+}
+
+HTDiff *ht_diff_new (HTree *tree, int max_len,
+                     HTDiffFunc func, void *user_data)
+{
+    HTDiff *diff = calloc (1, sizeof(HTDiff));
+    int node_reply = 7 + 16 * tree->hashid_len;
+
+    diff->tree = tree;
+    diff->func = func;
+    diff->user_data = user_data;
+    /* so that the replies about inner nodes fit in @max_len too */
+    diff->max_records = (max_len - HT_HEADER_LEN) / node_reply;
+    if (diff->max_records < 1)
+        diff->max_records = 1;
+    diff->levels = calloc (tree->height, sizeof(HTLevel));
+    level_add (&diff->levels[0], 0);
+    return diff;
+}
+
+void ht_diff_free (HTDiff *diff)
+{
+    int i;
+
+    for (i = 0; i < diff->tree->height; i++)
+        free (diff->levels[i].pos);
+    free (diff->levels);
+    free (diff);
+}
+
+/* Move to the next level once all of this one is asked for and all
+ * replies about it are in, since those are what fill the next one. */
+static void advance (HTDiff *diff)
+{
+    while (diff->depth < diff->tree->height &&
+           diff->next == diff->levels[diff->depth].n &&
+           diff->outstanding == 0) {
+        diff->depth++;
+        diff->next = 0;
+    }
+}
+
+int ht_diff_done (HTDiff *diff)
+{
+    advance (diff);
+    return diff->depth == diff->tree->height;
+}
+
+int ht_diff_next_request (HTDiff *diff, unsigned char **req, int *req_len)
+{
+    HTree *tree = diff->tree;
+    HTLevel *level;
+    HTBuf buf = { NULL, 0, 0 };
+    unsigned char *hash;
+    int n;
+
+    advance (diff);
+    if (diff->depth == tree->height ||
+        diff->next == diff->levels[diff->depth].n)
+        return 0;
+
+    level = &diff->levels[diff->depth];
+    buf_append_header (&buf, tree, diff->depth);
+    for (n = 0; n < diff->max_records && diff->next < level->n; n++) {
+        unsigned int pos = level->pos[diff->next++];
+
+        hash = ht_get_node_hash (tree, node_at (tree, diff->depth, pos));
+        buf_append_u32 (&buf, pos);
+        buf_append_u8 (&buf, hash != NULL);
+        if (hash)
+            buf_append (&buf, hash, tree->hashid_len);
+        else {
+            buf_reserve (&buf, tree->hashid_len);
+            memset (buf.data + buf.len, 0, tree->hashid_len);
+            buf.len += tree->hashid_len;
+        }
+    }
+    diff->outstanding++;
+
+    *req = buf.data;
+    *req_len = buf.len;
+    return 1;
+}
+
+/* Everything under @node is only here. */
+static void report_local (HTDiff *diff, HTNode *node)
+{
+    HTData *data = ht_get_data (diff->tree, node);
+    int i;
+
+    if (data == NULL)
+        return;
+    if (HTNODE_IS_LEAF(node)) {
+        for (i = 0; i < data->size; i++)
+            diff->func (data->items[i].hashid, 0, diff->user_data);
+        return;
+    }
+    for (i = 0; i < 16; i++)
+        report_local (diff, ht_get_child (diff->tree, node, i));
+}
+
+static int has_id (HTree *tree, HTData *data, const unsigned char *id)
+{
+    int i;
+
+    for (i = 0; data && i < data->size; i++)
+        if (memcmp (data->items[i].hashid, id, tree->hashid_len) == 0)
+            return 1;
+    return 0;
+}
+
+/* Report the ids of a leaf which are only on one side. Leaves are
+ * small, they are compared item by item. */
+static void diff_leaf (HTDiff *diff, HTNode *node,
+                       const unsigned char *ids, unsigned int count)
+{
+    HTree *tree = diff->tree;
+    HTData *data = ht_get_data (tree, node);
+    unsigned int i, j;
+    int found;
+
+    for (i = 0; i < count; i++)
+        if (!has_id (tree, data, ids + i * tree->hashid_len))
+            diff->func (ids + i * tree->hashid_len, 1, diff->user_data);
+
+    for (j = 0; data && j < (unsigned int)data->size; j++) {
+        found = 0;
+        for (i = 0; i < count && !found; i++)
+            found = memcmp (ids + i * tree->hashid_len, data->items[j].hashid,
+                            tree->hashid_len) == 0;
+        if (!found)
+            diff->func (data->items[j].hashid, 0, diff->user_data);
+    }
+}
+
+int ht_diff_handle_reply (HTDiff *diff, const unsigned char *reply, int len)
+{
+    HTree *tree = diff->tree;
+    const unsigned char *p = reply + HT_HEADER_LEN, *end = reply + len;
+    HTNode *node, *child;
+    unsigned int pos, mask, count;
+    unsigned char *hash;
+    int depth, b, hl = tree->hashid_len;
+
+    depth = check_header (tree, reply, len);
+    if (depth < 0 || diff->outstanding == 0)
+        return -1;
+    diff->outstanding--;
+
+    while (p < end) {
+        if (end - p < 5)
+            return -1;
+        pos = get_u32 (p);
+        if (pos >= (unsigned int)level_size (depth))
+            return -1;
+        node = node_at (tree, depth, pos);
+        p += 4;
+
+        switch (*p++) {
+        case HT_KIND_EMPTY:
+            report_local (diff, node);
+            break;
+        case HT_KIND_NODE:
+            if (HTNODE_IS_LEAF(node) || end - p < 2)
+                return -1;
+            mask = get_u16 (p);
+            p += 2;
+            for (b = 0; b < 16; b++) {
+                child = ht_get_child (tree, node, b);
+                hash = ht_get_node_hash (tree, child);
+                if (!(mask & (1 << b))) {
+                    report_local (diff, child);
+                    continue;
+                }
+                if (end - p < hl)
+                    return -1;
+                if (!hash || memcmp (hash, p, hl) != 0)
+                    level_add (&diff->levels[depth + 1],
+                               get_pos (tree, child));
+                p += hl;
+            }
+            break;
+        case HT_KIND_LEAF:
+            if (!HTNODE_IS_LEAF(node) || end - p < 4)
+                return -1;
+            count = get_u32 (p);
+            p += 4;
+            if ((unsigned int)(end - p) / hl < count)
+                return -1;
+            diff_leaf (diff, node, p, count);
+            p += count * hl;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
 }
@@ -8,13 +8,15 @@ typedef void (*ItemFreeFunc)(void *);
 struct ht_item {
     unsigned char *hashid;
     void *data;
-    struct ht_item *next;
 };
 
+/* Leaves keep their items in an array, in no particular order. */
 struct ht_data {
     int size;
+    int alloc;
     unsigned char *hashid;
-    struct ht_item *item_list;
+    struct ht_item *items;
+    unsigned int gen;        /* tree->gen of the last change below */
 };
 
 struct ht_node {
@@ -29,6 +31,7 @@ struct hash_tree {
     struct ht_node *nodes; /* an array of ht_node */
     struct ht_data **datas;  /*  an array of the pointer of ht_data*/
     int size;
+    unsigned int gen;        /* bumped on every change */
     ItemFreeFunc item_free;
 };
 
@@ -43,6 +46,13 @@ HTree* ht_new (int size, int hashlen);
 void ht_clear (HTree *tree);
 int ht_add (HTree *tree, unsigned char *hashid, void *data);
 int ht_remove (HTree *tree, unsigned char *hashid);
+
+/*
+ * Fill an empty tree from @n ids sorted in memcmp() order, computing
+ * every node hash once. Duplicated ids are added once. Returns the
+ * number of items added, or -1 if the tree is not empty.
+ */
+int ht_build_sorted (HTree *tree, unsigned char **hashids, void **datas, int n);
 void ht_resize (HTree *ht, int size);
 HTData* ht_get_data (HTree *tree, HTNode *node);
 unsigned char* ht_get_node_hash (HTree *tree, HTNode *node);
@@ -51,6 +61,58 @@ HTNode *ht_get_child (HTree *tree, HTNode *node, int b);
 HTNode *ht_get_brother (HTree *tree, HTNode *node);
 void ht_remove_node (HTree *tree, HTNode *node);
 
+/*
+ * Call @func on every leaf changed after generation @since, skipping
+ * unchanged subtrees. The leaf may have been emptied. Subtrees dropped by ht_remove_node()
+ * only mark their ancestors. Pass the generation of the previous round
+ * to get what changed since then.
+ */
+typedef void (*HTLeafFunc) (HTree *tree, HTNode *leaf, void *user_data);
+void ht_foreach_changed (HTree *tree, HTNode *node, unsigned int since,
+                         HTLeafFunc func, void *user_data);
+
+/*
+ * Finding what differs between the trees of two peers, asking the other
+ * side only for the subtrees whose hashes differ, one level at a time.
+ * Both trees must have the same size and hashid length. Messages are
+ * malloc()ed buffers to be freed by the caller; how they are carried is
+ * up to the caller, e.g. a processor sending one per packet.
+ *
+ * The asking side makes an HTDiff and sends what ht_diff_next_request()
+ * gives until it returns 0, then feeds the replies to
+ * ht_diff_handle_reply(), and so on until ht_diff_done(). The other
+ * side answers every request with ht_diff_answer().
+ */
+typedef struct ht_diff HTDiff;
+
+/* @remote is 1 for an id only in the other tree, 0 for one only here. */
+typedef void (*HTDiffFunc) (const unsigned char *hashid, int remote,
+                            void *user_data);
+
+/* Requests are made small enough that the replies about inner nodes fit
+ * in @max_len bytes. Replies about leaves may be larger. */
+HTDiff *ht_diff_new (HTree *tree, int max_len,
+                     HTDiffFunc func, void *user_data);
+void ht_diff_free (HTDiff *diff);
+
+/* 1 if @req is set, 0 if there is nothing to ask before more replies
+ * come in or the diff is done. */
+int ht_diff_next_request (HTDiff *diff, unsigned char **req, int *req_len);
+
+/* -1 if the reply is not well formed. */
+int ht_diff_handle_reply (HTDiff *diff, const unsigned char *reply, int len);
+
+int ht_diff_done (HTDiff *diff);
+
+/* The reply to @req, -1 if it is not well formed or for another tree. */
+int ht_diff_answer (HTree *tree, const unsigned char *req, int req_len,
+                    unsigned char **reply, int *reply_len);
+
+static inline unsigned int ht_get_generation (HTree *tree)
+{
+    return tree->gen;
+}
+
 static inline void ht_set_free_func (HTree *tree, ItemFreeFunc item_free)
 {
     tree->item_free = item_free;
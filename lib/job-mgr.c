@@ -12,6 +12,7 @@
 
 #ifdef CCNET_LIB
     #include "libccnet_utils.h"
+    #define piperead        ccnet_util_piperead
     #define pipereadn       ccnet_util_pipereadn
     #define pipewriten      ccnet_util_pipewriten
     #define pipeclose       ccnet_util_pipeclose
@@ -21,6 +22,10 @@
 #endif
 
 #include "job-mgr.h"
+#include "timer.h"
+#ifndef WIN32
+#include "job-pool.h"
+#endif
 
 struct _CcnetJob {
     CcnetJobManager *manager;
@@ -28,7 +33,6 @@ struct _CcnetJob {
     int             id;
     gboolean        thread_running;
     pthread_t       tid;
-    ccnet_pipe_t    pipefd[2];
 
     JobThreadFunc   thread_func;
     JobDoneCallback done_func;  /* called when the thread is done */
@@ -36,12 +40,82 @@ struct _CcnetJob {
 
     /* the done callback should only access this field */
     void           *result;
+
+    /* link in the manager's done_jobs list */
+    CcnetJob       *next;
 };
 
 
 void
 ccnet_job_manager_remove_job (CcnetJobManager *mgr, int job_id);
 
+/*
+ * Finished jobs are pushed onto mgr->done_jobs with a CAS loop, so
+ * worker threads never take a lock. Only the push that finds the list
+ * empty writes a wakeup byte to the pipe; the main loop detaches the
+ * whole list at once, so a burst of completions costs one wakeup.
+ */
+static void
+job_done_push (CcnetJob *job)
+{
+    CcnetJobManager *mgr = job->manager;
+    CcnetJob *head;
+
+    do {
+        head = g_atomic_pointer_get (&mgr->done_jobs);
+        job->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange ((gpointer *)&mgr->done_jobs,
+                                                     head, job));
+
+    if (head == NULL && pipewriten (mgr->pipefd[1], "a", 1) != 1) {
+        g_warning ("[Job Manager] write to pipe error: %s\n", strerror(errno));
+    }
+}
+
+/* Detach all finished jobs and return them in completion order. */
+static CcnetJob *
+job_done_pop_all (CcnetJobManager *mgr)
+{
+    CcnetJob *list, *job, *next, *ordered = NULL;
+
+    do {
+        list = g_atomic_pointer_get (&mgr->done_jobs);
+    } while (!g_atomic_pointer_compare_and_exchange ((gpointer *)&mgr->done_jobs,
+                                                     list, NULL));
+
+    for (job = list; job; job = next) {
+        next = job->next;
+        job->next = ordered;
+        ordered = job;
+    }
+
+    return ordered;
+}
+
+static void
+job_done (CcnetJob *job)
+{
+    if (job->done_func) {
+        int64_t start = ccnet_slow_callback_begin ();
+
+        job->done_func (job->result);
+        ccnet_slow_callback_end ("job", (void *)job->done_func, start);
+    }
+
+    ccnet_job_manager_remove_job (job->manager, job->id);
+}
+
+static void
+job_done_run_all (CcnetJobManager *mgr)
+{
+    CcnetJob *job, *next;
+
+    for (job = job_done_pop_all (mgr); job; job = next) {
+        next = job->next;
+        job_done (job);
+    }
+}
+
 #ifdef WIN32
 static void*
 job_thread_wrapper (void *vdata)
@@ -49,13 +123,33 @@ job_thread_wrapper (void *vdata)
     CcnetJob *job = vdata;
     
     job->result = job->thread_func (job->data);
-    if (pipewriten (job->pipefd[1], "a", 1) != 1) {
-        g_warning ("[Job Manager] write to pipe error: %s\n", strerror(errno));
-    }
+    job_done_push (job);
 
     return NULL;
 }
 #else
+/* The threads of GThreadPool are shared by all pools, so a thread is
+ * moved to the cpus of a manager when it runs a job of it. */
+static pthread_key_t placed_key;
+static pthread_once_t placed_once = PTHREAD_ONCE_INIT;
+
+static void
+placed_key_init (void)
+{
+    pthread_key_create (&placed_key, NULL);
+}
+
+static void
+place_thread (CcnetJobManager *mgr)
+{
+    pthread_once (&placed_once, placed_key_init);
+    if (pthread_getspecific (placed_key) == mgr)
+        return;
+    if (mgr->cpus.n > 0 || pthread_getspecific (placed_key) != NULL)
+        ccnet_cpu_set_pin (pthread_self (), &mgr->cpus, -1);
+    pthread_setspecific (placed_key, mgr);
+}
+
 static void
 job_thread_wrapper (void *vdata, void *unused)
 {
@@ -63,39 +157,83 @@ job_thread_wrapper (void *vdata, void *unused)
 
     job->tid = pthread_self ();
     job->thread_running = TRUE;
+    if (job->manager->thread_pool)
+        place_thread (job->manager);
     
     job->result = job->thread_func (job->data);
-    if (pipewriten (job->pipefd[1], "a", 1) != 1) {
-        g_warning ("[Job Manager] write to pipe error: %s\n", strerror(errno));
-    }
+    job_done_push (job);
+}
+
+static void
+job_pool_func (void *vdata)
+{
+    job_thread_wrapper (vdata, NULL);
 }
 #endif  /* WIN32 */
 
 static void
-job_done_cb (int fd, short event, void *vdata)
+job_done_cb (int fd, short event, void *vmgr)
 {
-    CcnetJob *job = vdata;
-    char buf[1];
+    CcnetJobManager *mgr = vmgr;
+    char buf[64];
 
-    if (pipereadn (job->pipefd[0], buf, 1) != 1) {
+    /* Consume the wakeup bytes before detaching the list, otherwise a
+     * job pushed in between could be left without a pending wakeup.
+     */
+    if (piperead (mgr->pipefd[0], buf, sizeof(buf)) < 0) {
         g_warning ("[Job Manager] read pipe error: %s\n", strerror(errno));
     }
-    pipeclose (job->pipefd[0]);
-    pipeclose (job->pipefd[1]);
-    if (job->done_func) {
-        job->done_func (job->result);
+
+    job_done_run_all (mgr);
+}
+
+static int
+job_manager_start (CcnetJobManager *mgr)
+{
+    if (ccnet_pipe (mgr->pipefd) < 0) {
+        g_warning ("pipe error: %s\n", strerror(errno));
+        return -1;
     }
 
-    ccnet_job_manager_remove_job (job->manager, job->id);
+    /* The event is added on the first schedule call, since the manager
+     * may be created before event_init().
+     */
+#ifndef UNIT_TEST
+    event_set (&mgr->done_event, mgr->pipefd[0], EV_READ | EV_PERSIST,
+               job_done_cb, mgr);
+    if (mgr->evbase)
+        event_base_set (mgr->evbase, &mgr->done_event);
+    event_add (&mgr->done_event, NULL);
+#endif
+    mgr->done_event_added = TRUE;
+
+    return 0;
+}
+
+void
+ccnet_job_manager_set_event_base (CcnetJobManager *mgr,
+                                  struct event_base *base)
+{
+    mgr->evbase = base;
+#ifndef UNIT_TEST
+    /* Move the event if it was added already. */
+    if (mgr->done_event_added) {
+        event_del (&mgr->done_event);
+        event_set (&mgr->done_event, mgr->pipefd[0], EV_READ | EV_PERSIST,
+                   job_done_cb, mgr);
+        if (base)
+            event_base_set (base, &mgr->done_event);
+        event_add (&mgr->done_event, NULL);
+    }
+#endif
 }
 
 int
 job_thread_create (CcnetJob *job)
 {
-    if (ccnet_pipe (job->pipefd) < 0) {
-        g_warning ("pipe error: %s\n", strerror(errno));
+    if (!job->manager->done_event_added &&
+        job_manager_start (job->manager) < 0)
         return -1;
-    }
 
 #ifdef WIN32
     if (pthread_create (&job->tid, NULL, job_thread_wrapper, job) != 0) {
@@ -107,13 +245,12 @@ job_thread_create (CcnetJob *job)
 
     pthread_detach (job->tid);
 #else
-    g_thread_pool_push (job->manager->thread_pool, job, NULL);
+    if (job->manager->job_pool)
+        ccnet_job_pool_push (job->manager->job_pool, job);
+    else
+        g_thread_pool_push (job->manager->thread_pool, job, NULL);
 #endif  /* WIN32 */
 
-#ifndef UNIT_TEST
-    event_once (job->pipefd[0], EV_READ, job_done_cb, job, NULL);
-#endif
-
     return 0;
 }
 
@@ -134,31 +271,91 @@ ccnet_job_free (CcnetJob *job)
 
 CcnetJobManager *
 ccnet_job_manager_new (int max_threads)
+{
+    CcnetJobManagerOptions options;
+
+    memset (&options, 0, sizeof(options));
+    options.max_threads = max_threads;
+
+    return ccnet_job_manager_new_full (&options);
+}
+
+CcnetJobManager *
+ccnet_job_manager_new_full (const CcnetJobManagerOptions *options)
 {
     CcnetJobManager *mgr;
 
     mgr = g_new0 (CcnetJobManager, 1);
     mgr->jobs = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                        NULL, (GDestroyNotify)ccnet_job_free);
+    mgr->cpus = options->cpus;
 #ifndef WIN32
+    if (options->work_stealing) {
+        mgr->job_pool = ccnet_job_pool_new (job_pool_func,
+                                            options->min_threads,
+                                            options->max_threads,
+                                            options->max_idle_threads,
+                                            options->idle_timeout,
+                                            options->cpu_affinity,
+                                            &options->cpus);
+        return mgr;
+    }
+
+    /* The unused threads of GThreadPool are shared by all pools, so
+     * max_idle_threads is not applied here.
+     */
     mgr->thread_pool = g_thread_pool_new (job_thread_wrapper,
                                           NULL,
-                                          max_threads,
+                                          options->max_threads,
                                           FALSE,
                                           NULL);
-    /* g_thread_pool_set_max_unused_threads (MAX_IDLE_THREADS); */
 #endif
 
     return mgr;
 }
 
+void
+ccnet_job_manager_options_load (CcnetJobManagerOptions *options,
+                                GKeyFile *keyf, const char *group)
+{
+    if (g_key_file_has_key (keyf, group, "MAX_THREADS", NULL))
+        options->max_threads = g_key_file_get_integer (keyf, group,
+                                                       "MAX_THREADS", NULL);
+    if (g_key_file_has_key (keyf, group, "MIN_THREADS", NULL))
+        options->min_threads = g_key_file_get_integer (keyf, group,
+                                                       "MIN_THREADS", NULL);
+    if (g_key_file_has_key (keyf, group, "MAX_IDLE_THREADS", NULL))
+        options->max_idle_threads = g_key_file_get_integer (
+            keyf, group, "MAX_IDLE_THREADS", NULL);
+    if (g_key_file_has_key (keyf, group, "IDLE_TIMEOUT", NULL))
+        options->idle_timeout = g_key_file_get_integer (keyf, group,
+                                                        "IDLE_TIMEOUT", NULL);
+    if (g_key_file_has_key (keyf, group, "WORK_STEALING", NULL))
+        options->work_stealing = g_key_file_get_boolean (
+            keyf, group, "WORK_STEALING", NULL);
+    if (g_key_file_has_key (keyf, group, "CPU_AFFINITY", NULL))
+        options->cpu_affinity = g_key_file_get_boolean (keyf, group,
+                                                        "CPU_AFFINITY", NULL);
+    ccnet_cpu_set_load (&options->cpus, keyf, group, "CPUS");
+}
+
 void
 ccnet_job_manager_free (CcnetJobManager *mgr)
 {
-    g_hash_table_destroy (mgr->jobs);
 #ifndef WIN32
-    g_thread_pool_free (mgr->thread_pool, TRUE, FALSE);
+    if (mgr->job_pool)
+        ccnet_job_pool_free (mgr->job_pool);
+    else
+        g_thread_pool_free (mgr->thread_pool, TRUE, FALSE);
+#endif
+    g_hash_table_destroy (mgr->jobs);
+    if (mgr->done_event_added) {
+#ifndef UNIT_TEST
+        event_del (&mgr->done_event);
 #endif
+        pipeclose (mgr->pipefd[0]);
+        pipeclose (mgr->pipefd[1]);
+    }
     g_free (mgr);
 }
 
@@ -192,10 +389,17 @@ ccnet_job_manager_remove_job (CcnetJobManager *mgr, int job_id)
 void
 ccnet_job_manager_wait_job (CcnetJobManager *mgr, int job_id)
 {
-    CcnetJob *job;
-    
-    job = g_hash_table_lookup (mgr->jobs, (gpointer)(long)job_id);
-    /* manually call job_done_cb */
-    job_done_cb (0, 0, (void *)job);
+    char buf[1];
+
+    /* Run the callbacks of finished jobs until job_id is among them. */
+    while (1) {
+        job_done_run_all (mgr);
+        if (!g_hash_table_lookup (mgr->jobs, (gpointer)(long)job_id))
+            break;
+        if (pipereadn (mgr->pipefd[0], buf, 1) != 1) {
+            g_warning ("[Job Manager] read pipe error: %s\n", strerror(errno));
+            break;
+        }
+    }
 }
 #endif
@@ -0,0 +1,317 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifdef __linux__
+/* for pthread_setaffinity_np */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#include "job-pool.h"
+
+typedef struct Worker {
+    CcnetJobPool   *pool;
+    int             index;
+
+    pthread_mutex_t lock;
+    GQueue          jobs;
+    volatile gint   len;        /* jobs.length, read without the lock */
+
+    gboolean        running;    /* protected by pool->lock */
+} Worker;
+
+/*
+ * n_idle and n_threads only change with pool->lock held, but are read
+ * without it by ccnet_job_pool_push(). A worker going idle bumps
+ * n_idle before looking at n_queued, and push bumps n_queued before
+ * looking at n_idle, so one of them always sees the other.
+ */
+struct CcnetJobPool {
+    CcnetJobPoolFunc func;
+    int              min_threads;
+    int              max_threads;
+    int              max_idle;
+    int              idle_timeout;
+    gboolean         cpu_affinity;
+    int              n_cpus;
+    CcnetCpuSet      cpus;
+
+    Worker          *workers;   /* max_threads deques */
+    unsigned int     next;      /* round robin for push */
+
+    volatile gint    n_queued;
+    volatile gint    n_threads;
+    volatile gint    n_idle;
+
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;      /* idle workers wait here */
+    pthread_cond_t   exit_cond;
+    gboolean         stopping;
+};
+
+static void *
+take_job (CcnetJobPool *pool, Worker *self)
+{
+    Worker *w;
+    void *job = NULL;
+    int i;
+
+    for (i = 0; i < pool->max_threads && !job; ++i) {
+        /* Our own deque first, then the others. */
+        w = &pool->workers[(self->index + i) % pool->max_threads];
+        if (g_atomic_int_get (&w->len) == 0)
+            continue;
+
+        pthread_mutex_lock (&w->lock);
+        if (w == self)
+            job = g_queue_pop_head (&w->jobs);
+        else
+            job = g_queue_pop_tail (&w->jobs);
+        g_atomic_int_set (&w->len, w->jobs.length);
+        pthread_mutex_unlock (&w->lock);
+    }
+
+    if (job)
+        g_atomic_int_add (&pool->n_queued, -1);
+    return job;
+}
+
+#ifdef __linux__
+static void
+set_cpu_affinity (int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO (&set);
+    CPU_SET (cpu, &set);
+    if (pthread_setaffinity_np (pthread_self (), sizeof(set), &set) != 0)
+        g_warning ("[Job Pool] Failed to set cpu affinity to %d\n", cpu);
+}
+#endif
+
+/* Wait for a job. Returns FALSE if the worker should exit, with
+ * pool->lock still held. */
+static gboolean
+wait_for_job (CcnetJobPool *pool)
+{
+    struct timeval now;
+    struct timespec deadline;
+    gboolean spare;
+    int rc = 0;
+
+    g_atomic_int_inc (&pool->n_idle);
+
+    spare = (pool->n_threads > pool->min_threads);
+    if (spare && pool->n_idle > pool->max_idle)
+        rc = ETIMEDOUT;
+
+    gettimeofday (&now, NULL);
+    deadline.tv_sec = now.tv_sec + pool->idle_timeout / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 +
+        (pool->idle_timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (g_atomic_int_get (&pool->n_queued) == 0 &&
+           !pool->stopping && rc != ETIMEDOUT) {
+        if (spare)
+            rc = pthread_cond_timedwait (&pool->cond, &pool->lock, &deadline);
+        else
+            pthread_cond_wait (&pool->cond, &pool->lock);
+    }
+
+    if (g_atomic_int_get (&pool->n_queued) == 0 &&
+        (pool->stopping || rc == ETIMEDOUT)) {
+        /* n_threads goes first, see ccnet_job_pool_push(). */
+        g_atomic_int_add (&pool->n_threads, -1);
+        g_atomic_int_add (&pool->n_idle, -1);
+        return FALSE;
+    }
+
+    g_atomic_int_add (&pool->n_idle, -1);
+    return TRUE;
+}
+
+static void *
+worker_thread (void *vworker)
+{
+    Worker *self = vworker;
+    CcnetJobPool *pool = self->pool;
+    void *job;
+
+    /* Before the worker allocates anything, see cpu-set.h. */
+    if (pool->cpus.n > 0)
+        ccnet_cpu_set_pin (pthread_self (), &pool->cpus,
+                           pool->cpu_affinity ? self->index : -1);
+#ifdef __linux__
+    else if (pool->cpu_affinity)
+        set_cpu_affinity (self->index % pool->n_cpus);
+#endif
+
+    while (1) {
+        job = take_job (pool, self);
+        if (job) {
+            pool->func (job);
+            continue;
+        }
+
+        pthread_mutex_lock (&pool->lock);
+        if (!wait_for_job (pool))
+            break;
+        pthread_mutex_unlock (&pool->lock);
+    }
+
+    self->running = FALSE;
+    pthread_cond_broadcast (&pool->exit_cond);
+    pthread_mutex_unlock (&pool->lock);
+
+    return NULL;
+}
+
+/* Called with pool->lock held. */
+static void
+start_worker (CcnetJobPool *pool)
+{
+    pthread_t tid;
+    Worker *w = NULL;
+    int i;
+
+    for (i = 0; i < pool->max_threads; ++i) {
+        if (!pool->workers[i].running) {
+            w = &pool->workers[i];
+            break;
+        }
+    }
+    if (!w)
+        return;
+
+    w->running = TRUE;
+    g_atomic_int_inc (&pool->n_threads);
+    if (pthread_create (&tid, NULL, worker_thread, w) != 0) {
+        g_warning ("[Job Pool] Failed to create thread: %s\n",
+                   strerror(errno));
+        w->running = FALSE;
+        g_atomic_int_add (&pool->n_threads, -1);
+        return;
+    }
+    pthread_detach (tid);
+}
+
+CcnetJobPool *
+ccnet_job_pool_new (CcnetJobPoolFunc func,
+                    int min_threads, int max_threads,
+                    int max_idle, int idle_timeout,
+                    gboolean cpu_affinity,
+                    const CcnetCpuSet *cpus)
+{
+    CcnetJobPool *pool;
+    int i;
+
+    if (max_threads <= 0)
+        max_threads = 1;
+    min_threads = CLAMP (min_threads, 0, max_threads);
+
+    pool = g_new0 (CcnetJobPool, 1);
+    pool->func = func;
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+    pool->max_idle = MAX (max_idle, 0);
+    pool->idle_timeout = idle_timeout > 0 ? idle_timeout : 1;
+    pool->cpu_affinity = cpu_affinity;
+    if (cpus)
+        pool->cpus = *cpus;
+    pool->n_cpus = 1;
+#ifdef __linux__
+    pool->n_cpus = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+#endif
+
+    pool->workers = g_new0 (Worker, max_threads);
+    for (i = 0; i < max_threads; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init (&pool->workers[i].lock, NULL);
+        g_queue_init (&pool->workers[i].jobs);
+    }
+
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->cond, NULL);
+    pthread_cond_init (&pool->exit_cond, NULL);
+
+    pthread_mutex_lock (&pool->lock);
+    for (i = 0; i < min_threads; ++i)
+        start_worker (pool);
+    pthread_mutex_unlock (&pool->lock);
+
+    return pool;
+}
+
+void
+ccnet_job_pool_push (CcnetJobPool *pool, void *data)
+{
+    int n = g_atomic_int_get (&pool->n_threads);
+    Worker *w;
+
+    w = &pool->workers[pool->next++ % MAX (n, 1)];
+
+    pthread_mutex_lock (&w->lock);
+    g_queue_push_tail (&w->jobs, data);
+    g_atomic_int_set (&w->len, w->jobs.length);
+    pthread_mutex_unlock (&w->lock);
+
+    g_atomic_int_inc (&pool->n_queued);
+
+    /* All workers are busy and no more may be started, one of them
+     * will pick the job up when it is done. A worker on its way out
+     * drops n_threads before n_idle, so we can't miss it here. */
+    if (g_atomic_int_get (&pool->n_idle) == 0 &&
+        g_atomic_int_get (&pool->n_threads) >= pool->max_threads)
+        return;
+
+    pthread_mutex_lock (&pool->lock);
+    if (pool->n_idle > 0)
+        pthread_cond_signal (&pool->cond);
+    else if (pool->n_threads < pool->max_threads)
+        start_worker (pool);
+    pthread_mutex_unlock (&pool->lock);
+}
+
+void
+ccnet_job_pool_free (CcnetJobPool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->max_threads; ++i) {
+        pthread_mutex_lock (&pool->workers[i].lock);
+        g_atomic_int_add (&pool->n_queued, -(int)pool->workers[i].jobs.length);
+        g_queue_clear (&pool->workers[i].jobs);
+        g_atomic_int_set (&pool->workers[i].len, 0);
+        pthread_mutex_unlock (&pool->workers[i].lock);
+    }
+
+    pthread_mutex_lock (&pool->lock);
+    pool->stopping = TRUE;
+    pthread_cond_broadcast (&pool->cond);
+    while (pool->n_threads > 0)
+        pthread_cond_wait (&pool->exit_cond, &pool->lock);
+    pthread_mutex_unlock (&pool->lock);
+
+    for (i = 0; i < pool->max_threads; ++i)
+        pthread_mutex_destroy (&pool->workers[i].lock);
+    pthread_mutex_destroy (&pool->lock);
+    pthread_cond_destroy (&pool->cond);
+    pthread_cond_destroy (&pool->exit_cond);
+    g_free (pool->workers);
+    g_free (pool);
+}
@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_JOB_POOL_H
+#define CCNET_JOB_POOL_H
+
+#include <glib.h>
+
+#include "cpu-set.h"
+
+/*
+ * A thread pool with a deque per worker, used by the job manager
+ * instead of GThreadPool when work stealing is asked for.
+ *
+ * Jobs are spread over the deques of the running workers. A worker
+ * takes jobs from the head of its own deque, and when that is empty it
+ * steals from the tail of the others. Submitting a job touches one
+ * deque lock, and the pool lock only when a worker has to be woken up
+ * or started.
+ *
+ * Up to @max_threads workers are started on demand. @min_threads stay
+ * for the life of the pool. Above that, a worker exits when it has
+ * been idle for @idle_timeout ms, or at once if @max_idle workers are
+ * idle already. The workers run on the cpus of @cpus if it isn't
+ * empty. With @cpu_affinity, worker i is pinned to cpu i % ncpus, of
+ * @cpus or of the machine (Linux only).
+ */
+
+typedef struct CcnetJobPool CcnetJobPool;
+
+typedef void (*CcnetJobPoolFunc) (void *data);
+
+CcnetJobPool *
+ccnet_job_pool_new (CcnetJobPoolFunc func,
+                    int min_threads, int max_threads,
+                    int max_idle, int idle_timeout,
+                    gboolean cpu_affinity,
+                    const CcnetCpuSet *cpus);
+
+/* Must not be called from more than one thread at a time. */
+void
+ccnet_job_pool_push (CcnetJobPool *pool, void *data);
+
+/* Drop the queued jobs and wait for the running ones. */
+void
+ccnet_job_pool_free (CcnetJobPool *pool);
+
+#endif
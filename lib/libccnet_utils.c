@@ -3,6 +3,7 @@
 #include <config.h>
 
 #include "libccnet_utils.h"
+#include "hex-util.h"
 
 #ifdef WIN32
     #include <winsock2.h>
@@ -448,31 +449,12 @@ ccnet_util_string_list_parse_sorted (const char *list_in_str, const char *sepera
     return g_list_sort (list, (GCompareFunc)g_strcmp0);
 }
 
-static unsigned hexval(char c)
-{
-    if (c >= '0' && c <= '9')
-        return c - '0';
-    if (c >= 'a' && c <= 'f')
-        return c - 'a' + 10;
-    if (c >= 'A' && c <= 'F')
-        return c - 'A' + 10;
-    return ~0;
-}
-
 int
 ccnet_util_hex_to_rawdata (const char *hex_str,
                            unsigned char *rawdata,
                            int n_bytes)
 {
-    int i;
-    for (i = 0; i < n_bytes; i++) {
-        unsigned int val = (hexval(hex_str[0]) << 4) | hexval(hex_str[1]);
-        if (val & ~0xff)
-            return -1;
-        *rawdata++ = val;
-        hex_str += 2;
-    }
-    return 0;
+    return hex_decode (hex_str, rawdata, n_bytes);
 }
 
 
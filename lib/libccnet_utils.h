@@ -29,10 +29,12 @@
 
     int ccnet_util_pgpipe (ccnet_pipe_t handles[2]);
     #define ccnet_util_pipe(a) ccnet_util_pgpipe((a))
+    #define ccnet_util_piperead(a,b,c) recv((a),(b),(c),0)
     #define ccnet_util_pipeclose(a) closesocket((a))
 #else
     #define ccnet_pipe_t int
     #define ccnet_util_pipe(a) pipe((a))
+    #define ccnet_util_piperead(a,b,c) read((a),(b),(c))
     #define ccnet_util_pipeclose(a) close((a))
 #endif
 
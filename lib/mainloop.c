@@ -5,6 +5,8 @@
 
 #include <event.h>
 
+#include "job-mgr.h"
+
 static int
 cmdrsp_cb (const char *code, char *content, int clen, void *data)
 {
@@ -42,16 +44,96 @@ ccnet_register_service (CcnetClient *client,
     ccnet_send_command (client, buf, cmdrsp_cb, cb);
 }
 
+struct CcnetClientLoop {
+    struct event       read_event;
+    struct event       shm_event;   /* packets in shared memory */
+    gboolean           has_shm;
+    CcnetClientDownCB  down_cb;
+    void              *user_data;
+};
+
 static void read_cb (int fd, short event, void *vclient)
 {
     CcnetClient *client = vclient;
+    CcnetClientDownCB down_cb = client->loop->down_cb;
+    void *user_data = client->loop->user_data;
 
     if (ccnet_client_read_input (client) <= 0) {
+        /* this also detaches the client */
         ccnet_client_disconnect_daemon (client);
-        exit (1);
+        if (down_cb)
+            down_cb (client, user_data);
     }
 }
 
+int
+ccnet_client_attach_event_base (CcnetClient *client,
+                                struct event_base *base,
+                                CcnetClientDownCB down_cb,
+                                void *user_data)
+{
+    struct CcnetClientLoop *loop;
+
+    g_return_val_if_fail (client->mode == CCNET_CLIENT_ASYNC, -1);
+    g_return_val_if_fail (client->connected, -1);
+
+    ccnet_client_detach_event_base (client);
+
+    loop = g_new0 (struct CcnetClientLoop, 1);
+    loop->down_cb = down_cb;
+    loop->user_data = user_data;
+    event_set (&loop->read_event, client->connfd, EV_READ | EV_PERSIST,
+               read_cb, client);
+    if (ccnet_client_get_shm_fd (client) >= 0) {
+        loop->has_shm = TRUE;
+        event_set (&loop->shm_event, ccnet_client_get_shm_fd (client),
+                   EV_READ | EV_PERSIST, read_cb, client);
+    }
+
+    if (base) {
+        event_base_set (base, &loop->read_event);
+        if (loop->has_shm)
+            event_base_set (base, &loop->shm_event);
+        ccnet_timer_set_event_base (base);
+        if (client->job_mgr)
+            ccnet_job_manager_set_event_base (client->job_mgr, base);
+    }
+
+    if (event_add (&loop->read_event, NULL) < 0) {
+        ccnet_warning ("Failed to watch the daemon connection\n");
+        g_free (loop);
+        return -1;
+    }
+    if (loop->has_shm && event_add (&loop->shm_event, NULL) < 0) {
+        ccnet_warning ("Failed to watch the daemon connection\n");
+        event_del (&loop->read_event);
+        g_free (loop);
+        return -1;
+    }
+
+    client->loop = loop;
+    return 0;
+}
+
+void
+ccnet_client_detach_event_base (CcnetClient *client)
+{
+    if (!client->loop)
+        return;
+
+    event_del (&client->loop->read_event);
+    if (client->loop->has_shm)
+        event_del (&client->loop->shm_event);
+    g_free (client->loop);
+    client->loop = NULL;
+}
+
+static void
+exit_on_down (CcnetClient *client, void *user_data)
+{
+    exit (1);
+}
+
 
 /**
  * Inititialize ccnet client structure, connect daemon and initialize
@@ -84,10 +166,7 @@ ccnet_init (const char *confdir)
 void
 ccnet_main (CcnetClient *client)
 {
-    struct event ev;
-
-    event_set (&ev, client->connfd, EV_READ | EV_PERSIST, read_cb, client);
-    event_add (&ev, NULL);
+    ccnet_client_attach_event_base (client, NULL, exit_on_down, NULL);
 
     event_dispatch ();
 }
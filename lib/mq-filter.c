@@ -0,0 +1,133 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <string.h>
+
+#include "mq-filter.h"
+
+enum {
+    FIELD_FROM,
+    FIELD_TO,
+    FIELD_APP,
+    FIELD_BODY,
+    N_FIELDS
+};
+
+static const char *field_names[N_FIELDS] = { "from", "to", "app", "body" };
+
+typedef struct {
+    int       field;
+    gboolean  prefix;
+    char     *value;
+    int       len;
+} Condition;
+
+struct CcnetMqFilter {
+    int        n_cond;
+    Condition *conds;
+};
+
+static int
+parse_condition (Condition *cond, const char *line)
+{
+    const char *op = strchr (line, '=');
+    int i, name_len;
+
+    if (!op || op == line)
+        return -1;
+
+    cond->prefix = op[-1] == '^';
+    name_len = op - line - (cond->prefix ? 1 : 0);
+
+    for (i = 0; i < N_FIELDS; ++i) {
+        if (strlen (field_names[i]) == name_len &&
+            strncmp (line, field_names[i], name_len) == 0)
+            break;
+    }
+    if (i == N_FIELDS)
+        return -1;
+
+    cond->field = i;
+    cond->value = g_strdup (op + 1);
+    cond->len = strlen (cond->value);
+    return 0;
+}
+
+CcnetMqFilter *
+ccnet_mq_filter_new (const char *expr)
+{
+    CcnetMqFilter *filter;
+    char **lines;
+    int i, n = 0;
+
+    if (!expr || !*expr)
+        return NULL;
+
+    lines = g_strsplit (expr, "\n", -1);
+    filter = g_new0 (CcnetMqFilter, 1);
+    filter->conds = g_new0 (Condition, g_strv_length (lines));
+
+    for (i = 0; lines[i]; ++i) {
+        if (lines[i][0] == '\0')
+            continue;
+        if (parse_condition (&filter->conds[n], lines[i]) < 0) {
+            g_warning ("Bad message filter condition: %s\n", lines[i]);
+            filter->n_cond = n;
+            ccnet_mq_filter_free (filter);
+            g_strfreev (lines);
+            return NULL;
+        }
+        ++n;
+    }
+    filter->n_cond = n;
+    g_strfreev (lines);
+
+    if (n == 0) {
+        ccnet_mq_filter_free (filter);
+        return NULL;
+    }
+    return filter;
+}
+
+void
+ccnet_mq_filter_free (CcnetMqFilter *filter)
+{
+    int i;
+
+    if (!filter)
+        return;
+
+    for (i = 0; i < filter->n_cond; ++i)
+        g_free (filter->conds[i].value);
+    g_free (filter->conds);
+    g_free (filter);
+}
+
+gboolean
+ccnet_mq_filter_match (const CcnetMqFilter *filter,
+                       const char *from, const char *to,
+                       const char *app, const char *body)
+{
+    const char *fields[N_FIELDS];
+    const Condition *cond;
+    const char *s;
+    int i;
+
+    if (!filter)
+        return TRUE;
+
+    fields[FIELD_FROM] = from;
+    fields[FIELD_TO] = to;
+    fields[FIELD_APP] = app;
+    fields[FIELD_BODY] = body;
+
+    for (i = 0; i < filter->n_cond; ++i) {
+        cond = &filter->conds[i];
+        s = fields[cond->field] ? fields[cond->field] : "";
+        if (cond->prefix) {
+            if (strncmp (s, cond->value, cond->len) != 0)
+                return FALSE;
+        } else if (strcmp (s, cond->value) != 0)
+            return FALSE;
+    }
+    return TRUE;
+}
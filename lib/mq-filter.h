@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_MQ_FILTER_H
+#define CCNET_MQ_FILTER_H
+
+#include <glib.h>
+
+/*
+ * A message filter of a subscriber, one condition per line:
+ *
+ *   from=<peer id>
+ *   app=<app>
+ *   body^=<prefix>
+ *
+ * '=' compares the whole field and '^=' its beginning. The fields are
+ * from, to, app and body, and a message matches if all conditions do.
+ */
+typedef struct CcnetMqFilter CcnetMqFilter;
+
+/* NULL if @expr is empty or not a valid filter. */
+CcnetMqFilter *ccnet_mq_filter_new (const char *expr);
+
+void ccnet_mq_filter_free (CcnetMqFilter *filter);
+
+/* A NULL filter matches everything. */
+gboolean ccnet_mq_filter_match (const CcnetMqFilter *filter,
+                                const char *from, const char *to,
+                                const char *app, const char *body);
+
+#endif
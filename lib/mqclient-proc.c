@@ -3,12 +3,19 @@
 #include <config.h>
 
 #include <stdio.h>
+#include <string.h>
 
 #include "ccnet-client.h"
 #include "mqclient-proc.h"
+#include "mq-filter.h"
 
 #define SC_MSG "300"
 #define SC_UNSUBSCRIBE "301"
+#define SC_FILTER "302"
+#define SC_MSG_BATCH "303"
+
+/* Keep batches well below the packet size. */
+#define MSG_BATCH_MAX_LEN (CCNET_PACKET_MAX_PAYLOAD_LEN / 2)
 
 enum {
     INIT,
@@ -28,6 +35,7 @@ static int mq_client_start (CcnetProcessor *processor, int argc, char **argv);
 static void handle_response (CcnetProcessor *processor,
                              char *code, char *code_msg,
                              char *content, int clen);
+static void release_resource (CcnetProcessor *processor);
 
 
 G_DEFINE_TYPE (CcnetMqclientProc, ccnet_mqclient_proc, CCNET_TYPE_PROCESSOR)
@@ -39,6 +47,7 @@ ccnet_mqclient_proc_class_init (CcnetMqclientProcClass *klass)
 
     proc_class->start = mq_client_start;
     proc_class->handle_response = handle_response;
+    proc_class->release_resource = release_resource;
     proc_class->name = "mqclient-proc";
 
     signals[RECV_MSG_SIG] = 
@@ -56,6 +65,17 @@ ccnet_mqclient_proc_init (CcnetMqclientProc *processor)
     CCNET_PROCESSOR (processor)->state = INIT;
 }
 
+static void
+release_resource (CcnetProcessor *processor)
+{
+    CcnetMqclientProc *proc = (CcnetMqclientProc *) processor;
+
+    ccnet_mq_filter_free (proc->filter);
+    proc->filter = NULL;
+
+    CCNET_PROCESSOR_CLASS (ccnet_mqclient_proc_parent_class)->release_resource (processor);
+}
+
 static int
 mq_client_start (CcnetProcessor *processor, int argc, char **argv)
 {
@@ -76,12 +96,55 @@ mq_client_start (CcnetProcessor *processor, int argc, char **argv)
     return 0;
 }
 
+static void
+deliver_message (CcnetMqclientProc *proc, char *content, int clen)
+{
+    CcnetMessage *msg;
+
+    if (clen <= 0 || content[clen-1] != '\0') {
+        g_warning ("receive bad message\n");
+        return;
+    }
+
+    msg = ccnet_message_from_string (content, clen);
+    if (!msg)
+        return;
+
+    if (ccnet_mq_filter_match (proc->filter, msg->from, msg->to,
+                               msg->app, msg->body)) {
+        if (proc->message_got_cb)
+            proc->message_got_cb (msg, proc->cb_data);
+        g_signal_emit (proc, signals[RECV_MSG_SIG], 0, msg);
+    }
+    ccnet_message_free (msg);
+}
+
+/* The messages of a batch are NUL terminated. */
+static void
+deliver_batch (CcnetMqclientProc *proc, char *content, int clen)
+{
+    char *p = content, *end = content + clen, *next;
+
+    /* The callbacks may unsubscribe. */
+    g_object_ref (proc);
+    while (p < end && CCNET_PROCESSOR(proc)->state == READY) {
+        next = memchr (p, '\0', end - p);
+        if (!next) {
+            g_warning ("receive bad message batch\n");
+            break;
+        }
+        ++next;
+        deliver_message (proc, p, next - p);
+        p = next;
+    }
+    g_object_unref (proc);
+}
+
 static void handle_response (CcnetProcessor *processor,
                              char *code, char *code_msg,
                              char *content, int clen)
 {
     CcnetMqclientProc *proc = (CcnetMqclientProc *) processor;
-    CcnetMessage *msg;
 
     switch (processor->state) {
     case REQUEST_SENT:
@@ -91,6 +154,7 @@ static void handle_response (CcnetProcessor *processor,
             return;
         }
 
+        proc->server_batch = code_msg && strstr (code_msg, "batch") != NULL;
         processor->state = READY;
         break;
     case READY:
@@ -100,13 +164,10 @@ static void handle_response (CcnetProcessor *processor,
         }
 
         /* message notification. */
-        if (code[0] == '3' && code[2] == '0') {
-            msg = ccnet_message_from_string (content, clen);
-            if (proc->message_got_cb)
-                proc->message_got_cb (msg, proc->cb_data);
-            g_signal_emit (proc, signals[RECV_MSG_SIG], 0, msg);
-            ccnet_message_free (msg);
-        }
+        if (code[0] == '3' && code[2] == '0')
+            deliver_message (proc, content, clen);
+        else if (code[0] == '3' && code[2] == '3')
+            deliver_batch (proc, content, clen);
 
         break;
     default:
@@ -136,6 +197,61 @@ void ccnet_mqclient_proc_put_message (CcnetMqclientProc *proc,
     g_string_free (msg_buf, TRUE);
 }
 
+void ccnet_mqclient_proc_put_messages (CcnetMqclientProc *proc,
+                                       GList *messages)
+{
+    CcnetProcessor *processor = (CcnetProcessor *) proc;
+    GString *batch, *msg_buf;
+    GList *ptr;
+
+    if (!proc->server_batch) {
+        for (ptr = messages; ptr; ptr = ptr->next)
+            ccnet_mqclient_proc_put_message (proc, ptr->data);
+        return;
+    }
+
+    batch = g_string_new (NULL);
+    msg_buf = g_string_new (NULL);
+    for (ptr = messages; ptr; ptr = ptr->next) {
+        ccnet_message_to_string_buf (ptr->data, msg_buf);
+        if (batch->len > 0 && batch->len + msg_buf->len + 1 > MSG_BATCH_MAX_LEN) {
+            ccnet_client_send_update (processor->session,
+                                      UPDATE_ID(processor->id),
+                                      SC_MSG_BATCH, NULL,
+                                      batch->str, batch->len);
+            g_string_truncate (batch, 0);
+        }
+        g_string_append_len (batch, msg_buf->str, msg_buf->len + 1);
+    }
+    if (batch->len > 0)
+        ccnet_client_send_update (processor->session, UPDATE_ID(processor->id),
+                                  SC_MSG_BATCH, NULL, batch->str, batch->len);
+
+    g_string_free (msg_buf, TRUE);
+    g_string_free (batch, TRUE);
+}
+
+int ccnet_mqclient_proc_set_filter (CcnetMqclientProc *proc,
+                                    const char *expr)
+{
+    CcnetProcessor *processor = (CcnetProcessor *) proc;
+    CcnetMqFilter *filter = NULL;
+
+    if (expr && *expr) {
+        filter = ccnet_mq_filter_new (expr);
+        if (!filter)
+            return -1;
+    }
+
+    ccnet_mq_filter_free (proc->filter);
+    proc->filter = filter;
+
+    ccnet_client_send_update (processor->session, UPDATE_ID(processor->id),
+                              SC_FILTER, NULL, filter ? expr : NULL,
+                              filter ? strlen(expr) + 1 : 0);
+    return 0;
+}
+
 void ccnet_mqclient_proc_unsubscribe_apps (CcnetMqclientProc *proc)
 {
     CcnetProcessor *processor = (CcnetProcessor *) proc;
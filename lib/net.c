@@ -1,5 +1,12 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
+#ifdef __linux__
+/* for struct ucred */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
 #include "include.h"
 
 #include <unistd.h>
@@ -443,6 +450,60 @@ ccnet_netSetTOS (evutil_socket_t s, int tos)
 #endif
 }
 
+static int
+set_int_opt (evutil_socket_t s, int level, int name, int value,
+             const char *what)
+{
+    if (setsockopt (s, level, name, (char *)&value, sizeof(value)) < 0) {
+        ccnet_warning ("setsockopt %s to %d failed: %s\n", what, value,
+                       evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+        return -1;
+    }
+    return 0;
+}
+
+int
+ccnet_net_set_sockopts (evutil_socket_t s, const CcnetSockOpts *opts)
+{
+    int ret = 0;
+
+    if (opts->nodelay)
+        ret |= set_int_opt (s, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (opts->sndbuf > 0)
+        ret |= set_int_opt (s, SOL_SOCKET, SO_SNDBUF, opts->sndbuf,
+                            "SO_SNDBUF");
+    if (opts->rcvbuf > 0)
+        ret |= set_int_opt (s, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf,
+                            "SO_RCVBUF");
+
+    if (opts->keepalive) {
+        ret |= set_int_opt (s, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+        if (opts->keepidle > 0)
+            ret |= set_int_opt (s, IPPROTO_TCP, TCP_KEEPIDLE, opts->keepidle,
+                                "TCP_KEEPIDLE");
+#endif
+#ifdef TCP_KEEPINTVL
+        if (opts->keepintvl > 0)
+            ret |= set_int_opt (s, IPPROTO_TCP, TCP_KEEPINTVL,
+                                opts->keepintvl, "TCP_KEEPINTVL");
+#endif
+#ifdef TCP_KEEPCNT
+        if (opts->keepcnt > 0)
+            ret |= set_int_opt (s, IPPROTO_TCP, TCP_KEEPCNT, opts->keepcnt,
+                                "TCP_KEEPCNT");
+#endif
+    }
+
+#ifdef TCP_USER_TIMEOUT
+    if (opts->user_timeout > 0)
+        ret |= set_int_opt (s, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                            opts->user_timeout, "TCP_USER_TIMEOUT");
+#endif
+
+    return ret ? -1 : 0;
+}
+
 static evutil_socket_t
 makeSocketNonBlocking (evutil_socket_t fd)
 {
@@ -521,30 +582,30 @@ ccnet_net_open_tcp (const struct sockaddr *sa, int nonblock)
     return s;
 }
 
-evutil_socket_t
-ccnet_net_bind_tcp (int port, int nonblock)
-{
 #ifndef WIN32
-    int sockfd, n;
+static evutil_socket_t
+bind_tcp_family (int family, int port, int nonblock)
+{
+    int sockfd = -1, n;
     struct addrinfo hints, *res, *ressave;
     char buf[10];
         
     memset (&hints, 0,sizeof (struct addrinfo));
     hints.ai_flags = AI_PASSIVE;
-    hints.ai_family = AF_UNSPEC;
+    hints.ai_family = family;
     hints.ai_socktype = SOCK_STREAM;
 
     snprintf (buf, sizeof(buf), "%d", port);
 
     if ( (n = getaddrinfo(NULL, buf, &hints, &res) ) != 0) {
-        ccnet_warning ("getaddrinfo fails: %s\n", gai_strerror(n));
+        ccnet_debug ("getaddrinfo fails: %s\n", gai_strerror(n));
         return -1;
     }
 
     ressave = res;
     
     do {
-        int on = 1;
+        int on = 1, off = 0;
 
         sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
         if (sockfd < 0)
@@ -552,9 +613,14 @@ ccnet_net_bind_tcp (int port, int nonblock)
 
 		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
 			ccnet_warning ("setsockopt of SO_REUSEADDR error\n");
+            close (sockfd);
             continue;
         }
 
+        /* Accept IPv4 too, as v4-mapped addresses. */
+        if (res->ai_family == AF_INET6)
+            setsockopt (sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
         if (nonblock)
             sockfd = makeSocketNonBlocking (sockfd);
         if (sockfd < 0)
@@ -568,7 +634,25 @@ ccnet_net_bind_tcp (int port, int nonblock)
 
     freeaddrinfo (ressave);
 
-    if (res == NULL) {
+    return res ? sockfd : -1;
+}
+#endif
+
+/*
+ * Listens on all addresses. Where IPv6 is available one dual-stack
+ * socket serves both families, otherwise it is IPv4 only.
+ */
+evutil_socket_t
+ccnet_net_bind_tcp (int port, int nonblock)
+{
+#ifndef WIN32
+    int sockfd;
+
+    sockfd = bind_tcp_family (AF_INET6, port, nonblock);
+    if (sockfd < 0)
+        sockfd = bind_tcp_family (AF_INET, port, nonblock);
+
+    if (sockfd < 0) {
         ccnet_warning ("bind fails: %s\n", strerror(errno));
         return -1;
     }
@@ -613,7 +697,17 @@ ccnet_net_accept (evutil_socket_t b, struct sockaddr_storage *cliaddr,
 {
     evutil_socket_t s;
     /* int nodelay = 1; */
-    
+
+#if defined(__linux__) && defined(SOCK_NONBLOCK)
+    /* Saves the fcntl() calls. */
+    if (nonblock) {
+        s = accept4 (b, (struct sockaddr *)cliaddr, len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (s >= 0 || errno != ENOSYS)
+            return s;
+    }
+#endif
+
     s = accept (b, (struct sockaddr *)cliaddr, len);
 
     /* setsockopt (s, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)); */
@@ -673,6 +767,60 @@ ccnet_net_bind_v4 (const char *ipaddr, int *port)
     return sockfd;
 }
 
+#ifndef WIN32
+evutil_socket_t
+ccnet_net_bind_unix (const char *path)
+{
+    evutil_socket_t sockfd;
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ccnet_warning ("Unix socket path too long: %s\n", path);
+        return -1;
+    }
+
+    sockfd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        ccnet_warning ("create socket failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset (&addr, 0, sizeof (struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+
+    /* A previous instance may have left the file behind. Running
+     * instances are detected by the tcp listener already.
+     */
+    unlink (path);
+
+    if ( bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ccnet_warning ("Bind %s error: %s\n", path, strerror (errno));
+        evutil_closesocket (sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+int
+ccnet_net_get_peer_uid (evutil_socket_t fd, uid_t *uid)
+{
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return -1;
+    *uid = cred.uid;
+    return 0;
+#else
+    gid_t gid;
+
+    return getpeereid (fd, uid, &gid);
+#endif
+}
+#endif
 
 
 char *
@@ -689,10 +837,17 @@ sock_ntop(const struct sockaddr *sa, socklen_t salen)
         return(str);
     }
 
-#ifdef  IPv6
+#ifdef  AF_INET6
     case AF_INET6: {
         struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) sa;
 
+        /* IPv4 peers of dual-stack sockets */
+        if (IN6_IS_ADDR_V4MAPPED (&sin6->sin6_addr)) {
+            if (inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12], str,
+                          sizeof(str)) == NULL)
+                return(NULL);
+            return(str);
+        }
         if (inet_ntop(AF_INET6, &sin6->sin6_addr, str, sizeof(str) - 1) == NULL)
             return(NULL);
         return (str);
@@ -769,7 +924,7 @@ sock_port (const struct sockaddr *sa)
         struct sockaddr_in  *sin = (struct sockaddr_in *) sa;
         return ntohs(sin->sin_port);
     }
-#ifdef  IPv6
+#ifdef  AF_INET6
     case AF_INET6: {
         struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) sa;
 
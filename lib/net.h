@@ -49,8 +49,31 @@ evutil_socket_t ccnet_net_accept (evutil_socket_t b,
 /* bind to an IPv4 address, if (*port == 0) the port number will be returned */
 evutil_socket_t ccnet_net_bind_v4 (const char *ipaddr, int *port);
 
+#ifndef WIN32
+/* bind to a unix domain socket, a stale socket file is removed first */
+evutil_socket_t ccnet_net_bind_unix (const char *path);
+
+/* get the uid of the process at the other end of a unix domain socket */
+int ccnet_net_get_peer_uid (evutil_socket_t fd, uid_t *uid);
+#endif
+
 int  ccnet_netSetTOS   ( evutil_socket_t s, int tos );
 
+/* Options of a TCP connection. 0 leaves the system default. */
+typedef struct CcnetSockOpts {
+    int     nodelay;        /* disable Nagle */
+    int     sndbuf;         /* bytes */
+    int     rcvbuf;
+    int     keepalive;      /* kernel keepalive probes */
+    int     keepidle;       /* seconds idle before the first probe */
+    int     keepintvl;      /* seconds between probes */
+    int     keepcnt;        /* probes lost before the connection drops */
+    int     user_timeout;   /* msec sent data may stay unacked */
+} CcnetSockOpts;
+
+/* Returns -1 if an option could not be set, the others are still set. */
+int  ccnet_net_set_sockopts (evutil_socket_t s, const CcnetSockOpts *opts);
+
 char *sock_ntop(const struct sockaddr *sa, socklen_t salen);
 uint16_t sock_port (const struct sockaddr *sa);
 
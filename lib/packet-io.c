@@ -8,6 +8,8 @@
     #include <winsock2.h>
 #else
     #include <netinet/in.h>
+    #include <sys/uio.h>
+    #include <poll.h>
 #endif
 
 #include <unistd.h>
@@ -26,66 +28,233 @@
 #include "packet.h"
 #include "packet-io.h"
 #include "buffer.h"
+#include "shm-ring.h"
 
+/* How long to look for a reply in shared memory before sleeping on the
+ * eventfd, the daemon usually answers a request faster than a wakeup. */
+#define SHM_SPIN_USEC 20
+
+/* An old daemon doesn't answer a handshake at all. */
+#define SHM_ANSWER_TIMEOUT_MS 5000
 
-static ssize_t						/* Write "n" bytes to a descriptor. */
-writen(evutil_socket_t fd, const void *vptr, size_t n)
-{
-	size_t		nleft;
-	ssize_t		nwritten;
-	const char	*ptr;
 
-	ptr = vptr;
-	nleft = n;
-	while (nleft > 0) {
 #ifndef WIN32
-		if ( (nwritten = write(fd, ptr, nleft)) <= 0) {
-#else
-		if ( (nwritten = send(fd, (char *)ptr, nleft, 0)) <= 0) {
-#endif
+static ssize_t				/* Write all the iovecs to a descriptor. */
+writevn(evutil_socket_t fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t		nwritten, total = 0;
+
+	while (iovcnt > 0) {
+		if ( (nwritten = writev(fd, iov, iovcnt)) <= 0) {
 			if (nwritten < 0 && errno == EINTR)
-				nwritten = 0;		/* and call write() again */
-			else
-				return(-1);			/* error */
+				continue;	/* and call writev() again */
+			return(-1);		/* error */
 		}
+		total += nwritten;
 
-		nleft -= nwritten;
-		ptr   += nwritten;
+		/* skip what has been written */
+		while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+			nwritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+	return(total);
+}
+#endif
+
+/*
+ * Read whatever is available with a single syscall. The free space of
+ * the buffer is filled first and the rest lands in a spill area, so
+ * several packets can arrive per call without asking the kernel how
+ * much is pending first.
+ */
+static ssize_t
+read_some(evutil_socket_t fd, struct buffer *buf)
+{
+#ifndef WIN32
+	char		spill[65536];
+	struct iovec	iov[2];
+	size_t		space;
+	ssize_t		n;
+
+	if (buffer_expand(buf, 4096) < 0)
+		return(-1);
+	space = buf->totallen - buf->misalign - buf->off;
+
+	iov[0].iov_base = buf->buffer + buf->off;
+	iov[0].iov_len = space;
+	iov[1].iov_base = spill;
+	iov[1].iov_len = sizeof(spill);
+
+	if ( (n = readv(fd, iov, 2)) <= 0)
+		return(n);
+
+	if ((size_t)n <= space)
+		buf->off += n;
+	else {
+		buf->off += space;
+		buffer_add(buf, spill, n - space);
 	}
 	return(n);
+#else
+	return buffer_read(buf, fd, -1);
+#endif
 }
 
-static ssize_t						/* Read "n" bytes from a descriptor. */
-readn(evutil_socket_t fd, struct buffer *buf, size_t n)
+#ifndef WIN32
+/*
+ * With shared memory the socket carries nothing after the handshake, so
+ * it only becomes readable when the daemon has closed it. Returns 1 if
+ * @efd was signalled, -1 if the daemon is gone.
+ */
+static int
+shm_wait (CcnetPacketIO *io, int efd, int timeout)
 {
-	size_t	nleft;
-	ssize_t	nread;
+    struct pollfd fds[2];
+    int n;
 
-	nleft = n;
-	while (nleft > 0) {
-		if ( (nread = buffer_read(buf, fd, nleft)) < 0) {
-			if (errno == EINTR)
-				nread = 0;		/* and call read() again */
-			else
-				return(-1);
-		} else if (nread == 0)
-			break;				/* EOF */
+    fds[0].fd = efd;
+    fds[0].events = POLLIN;
+    fds[1].fd = io->fd;
+    fds[1].events = POLLIN;
 
-		nleft -= nread;
-	}
-	return(n - nleft);		/* return >= 0 */
+    n = poll (fds, 2, timeout);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    if (fds[1].revents)
+        return -1;
+    return fds[0].revents ? 1 : 0;
+}
+
+/* Move everything in the receive ring to in_buf. */
+static ssize_t
+shm_drain (CcnetPacketIO *io)
+{
+    struct buffer *buf = io->in_buf;
+    ssize_t total = 0;
+    int n;
+
+    do {
+        if (buffer_expand (buf, 65536) < 0)
+            return -1;
+        n = ccnet_shm_read (io->shm, (char *)buf->buffer + buf->off,
+                            buf->totallen - buf->misalign - buf->off);
+        buf->off += n;
+        total += n;
+    } while (n > 0);
+
+    return total;
+}
+
+/* Like read_some(), waiting for data in shared memory. 0 if the daemon
+ * is gone. */
+static ssize_t
+shm_read_some (CcnetPacketIO *io)
+{
+    gint64 spin_until = 0;
+    ssize_t n;
+
+    for (;;) {
+        if ( (n = shm_drain (io)) != 0)
+            return n;
+
+        if (!spin_until)
+            spin_until = g_get_monotonic_time () + SHM_SPIN_USEC;
+        if (g_get_monotonic_time () < spin_until)
+            continue;
+
+        /* Clear before the last look, a write after it signals again. */
+        ccnet_shm_clear (io->shm->rx_data);
+        if (!ccnet_shm_rx_empty (io->shm))
+            continue;
+        if (shm_wait (io, io->shm->rx_data, -1) < 0)
+            return 0;
+    }
 }
 
+/* Copy the iovecs into the send ring, waiting while it's full. */
+static int
+shm_writev (CcnetPacketIO *io, struct iovec *iov, int iovcnt)
+{
+    size_t off;
+    int i, n;
+
+    for (i = 0; i < iovcnt; ++i) {
+        off = 0;
+        while (off < iov[i].iov_len) {
+            n = ccnet_shm_write (io->shm, (char *)iov[i].iov_base + off,
+                                 iov[i].iov_len - off);
+            if (n > 0) {
+                off += n;
+                continue;
+            }
+            if (n < 0 || shm_wait (io, io->shm->tx_space, -1) < 0)
+                return -1;
+            ccnet_shm_clear (io->shm->tx_space);
+        }
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Whether buf starts with a complete packet. Returns 1 and sets the
+ * header and payload length if so, 0 if more data is needed, and -1 on
+ * a bad length.
+ */
+static int
+complete_frame(struct buffer *buf, int *hdr_len, int *len)
+{
+    ccnet_packet *packet = (ccnet_packet *) BUFFER_DATA(buf);
+
+    if (BUFFER_LENGTH(buf) < CCNET_PACKET_LENGTH_HEADER)
+        return 0;
+
+    if (packet->header.version == CCNET_PACKET_VERSION_JUMBO) {
+        if (BUFFER_LENGTH(buf) < CCNET_PACKET_LENGTH_JUMBO_HEADER)
+            return 0;
+        *hdr_len = CCNET_PACKET_LENGTH_JUMBO_HEADER;
+        *len = ntohl (((ccnet_jumbo_header *)packet)->length);
+        if (*len < 0 || *len > CCNET_PACKET_MAX_JUMBO_PAYLOAD_LEN)
+            return -1;
+    } else {
+        *hdr_len = CCNET_PACKET_LENGTH_HEADER;
+        *len = ntohs (packet->header.length);
+    }
+
+    return BUFFER_LENGTH(buf) - *hdr_len >= (size_t)*len;
+}
+
+/* Convert a complete packet at the start of in_buf to host order. */
+static ccnet_packet *
+take_packet(CcnetPacketIO *io, int hdr_len, int len)
+{
+    ccnet_packet *packet = (ccnet_packet *) BUFFER_DATA(io->in_buf);
+
+    if (hdr_len == CCNET_PACKET_LENGTH_JUMBO_HEADER)
+        ((ccnet_jumbo_header *)packet)->length = len;
+    else
+        packet->header.length = len;
+    packet->header.id = ntohl (packet->header.id);
+
+    return packet;
+}
 
 CcnetPacketIO*
 ccnet_packet_io_new (evutil_socket_t fd)
 {
     CcnetPacketIO *io;
 
-    io = g_malloc (sizeof(CcnetPacketIO));
+    io = g_malloc0 (sizeof(CcnetPacketIO));
     io->fd = fd;
-    io->buffer = buffer_new ();
+    io->buffer = chain_buffer_new ();
     io->in_buf = buffer_new ();
+    io->consumed = 0;
    
     return io;
 }
@@ -94,7 +263,8 @@ void
 ccnet_packet_io_free (CcnetPacketIO *io)
 {
     evutil_closesocket(io->fd);
-    buffer_free (io->buffer);
+    ccnet_shm_free (io->shm);
+    chain_buffer_free (io->buffer);
     buffer_free (io->in_buf);
     g_free (io);
 }
@@ -103,13 +273,13 @@ void
 ccnet_packet_prepare (CcnetPacketIO *io, int type, int id)
 {
     ccnet_header header;
-    assert (io->buffer && BUFFER_LENGTH(io->buffer) == 0);
+    assert (io->buffer && CHAIN_BUFFER_LENGTH(io->buffer) == 0);
 
     header.version = 1;
     header.type = type;
     header.length = 0;
     header.id = htonl (id);
-    buffer_add (io->buffer, &header, sizeof (header));
+    chain_buffer_add (io->buffer, &header, sizeof (header));
 }
 
 
@@ -120,21 +290,24 @@ ccnet_packet_write_string (CcnetPacketIO *io, const char *str)
 
     assert (str);
     len = strlen(str);
-    buffer_add (io->buffer, str, len);
+    chain_buffer_add (io->buffer, str, len);
 }
 
 void
 ccnet_packet_add (CcnetPacketIO *io, const char *buf, int len)
 {
-    buffer_add (io->buffer, buf, len);
+    chain_buffer_add (io->buffer, buf, len);
 }
 
 void
 ccnet_packet_finish (CcnetPacketIO *io)
 {
     ccnet_header *header;
-    header = (ccnet_header *) BUFFER_DATA(io->buffer);
-    header->length = htons (BUFFER_LENGTH(io->buffer)
+
+    /* The header was the first append, so it is in the first segment. */
+    header = (ccnet_header *) chain_buffer_pullup (io->buffer,
+                                                   CCNET_PACKET_LENGTH_HEADER);
+    header->length = htons (CHAIN_BUFFER_LENGTH(io->buffer)
                             - CCNET_PACKET_LENGTH_HEADER);
 }
 
@@ -142,8 +315,71 @@ ccnet_packet_finish (CcnetPacketIO *io)
 void
 ccnet_packet_send (CcnetPacketIO *io)
 {
-    writen (io->fd, BUFFER_DATA (io->buffer), io->buffer->off);
-    buffer_drain (io->buffer, io->buffer->off); 
+    int n;
+
+#ifndef WIN32
+    if (io->shm) {
+        struct iovec iov[CHAIN_BUFFER_MAX_IOV];
+        int i, iovcnt;
+
+        while (CHAIN_BUFFER_LENGTH (io->buffer) > 0) {
+            iovcnt = chain_buffer_peek (io->buffer, iov, CHAIN_BUFFER_MAX_IOV);
+            if (shm_writev (io, iov, iovcnt) < 0)
+                break;
+            for (n = 0, i = 0; i < iovcnt; ++i)
+                n += iov[i].iov_len;
+            chain_buffer_drain (io->buffer, n);
+        }
+        chain_buffer_drain (io->buffer, CHAIN_BUFFER_LENGTH (io->buffer));
+        return;
+    }
+#endif
+
+    while (CHAIN_BUFFER_LENGTH (io->buffer) > 0) {
+        n = chain_buffer_write (io->buffer, io->fd);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+    }
+    chain_buffer_drain (io->buffer, CHAIN_BUFFER_LENGTH (io->buffer));
+}
+
+/*
+ * Finish the packet with content appended, sending it from where it
+ * is instead of copying it behind the header first.
+ */
+void
+ccnet_packet_finish_send_content (CcnetPacketIO *io,
+                                  const char *content, int clen)
+{
+#ifndef WIN32
+    ccnet_header *header;
+    struct iovec iov[CHAIN_BUFFER_MAX_IOV + 1];
+    int iovcnt;
+
+    header = (ccnet_header *) chain_buffer_pullup (io->buffer,
+                                                   CCNET_PACKET_LENGTH_HEADER);
+    header->length = htons (CHAIN_BUFFER_LENGTH(io->buffer)
+                            - CCNET_PACKET_LENGTH_HEADER + clen);
+
+    /* A packet is at most 64KB, which always fits in the iovecs. */
+    iovcnt = chain_buffer_peek (io->buffer, iov, CHAIN_BUFFER_MAX_IOV);
+    if (clen > 0) {
+        iov[iovcnt].iov_base = (char *)content;
+        iov[iovcnt].iov_len = clen;
+        iovcnt++;
+    }
+    if (io->shm)
+        shm_writev (io, iov, iovcnt);
+    else
+        writevn (io->fd, iov, iovcnt);
+    chain_buffer_drain (io->buffer, CHAIN_BUFFER_LENGTH (io->buffer));
+#else
+    if (clen > 0)
+        chain_buffer_add (io->buffer, content, clen);
+    ccnet_packet_finish_send (io);
+#endif
 }
 
 
@@ -157,27 +393,31 @@ ccnet_packet_finish_send (CcnetPacketIO *io)
 ccnet_packet *
 ccnet_packet_io_read_packet (CcnetPacketIO* io)
 {
-    ccnet_packet *packet;
-    int len;
+    int hdr_len, len, ret;
+    ssize_t n;
 
-    buffer_drain (io->in_buf, io->in_buf->off);
-
-    if (readn (io->fd, io->in_buf, CCNET_PACKET_LENGTH_HEADER) <= 0)
-        return NULL;
+    /* The packet returned last time is no longer used. Anything read
+     * beyond it is kept for the next calls. */
+    buffer_drain (io->in_buf, io->consumed);
+    io->consumed = 0;
 
-    packet = (ccnet_packet *) BUFFER_DATA(io->in_buf);
-    len = ntohs (packet->header.length);
-    if (len > 0) {
-        if (readn (io->fd, io->in_buf, len) <= 0)
+    while ( (ret = complete_frame (io->in_buf, &hdr_len, &len)) == 0) {
+#ifndef WIN32
+        if (io->shm)
+            n = shm_read_some (io);
+        else
+#endif
+        n = read_some (io->fd, io->in_buf);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
             return NULL;
     }
+    if (ret < 0)
+        return NULL;
 
-    /* Note: must reset packet since readn() may cause realloc of buffer */
-    packet = (ccnet_packet *) BUFFER_DATA(io->in_buf);
-    packet->header.length = len;
-    packet->header.id = ntohl (packet->header.id);
-
-    return packet;
+    io->consumed = hdr_len + len;
+    return take_packet (io, hdr_len, len);
 }
 
 void
@@ -193,12 +433,27 @@ ccnet_packet_io_set_callback (CcnetPacketIO *io,
 int
 ccnet_packet_io_read (CcnetPacketIO *io)
 {
-    int n;
+    ssize_t n;
     ccnet_packet *packet;
-    int len;
+    int hdr_len, len, ret;
+
+    buffer_drain (io->in_buf, io->consumed);
+    io->consumed = 0;
     
 again:
-    if ( (n = buffer_read(io->in_buf, io->fd, 1024)) < 0) {
+#ifndef WIN32
+    if (io->shm) {
+        /* Cleared first, so data written during the drain wakes us
+         * again. The socket is readable here only if the daemon closed
+         * it. */
+        ccnet_shm_clear (io->shm->rx_data);
+        if ( (n = shm_drain (io)) == 0) {
+            if (shm_wait (io, io->shm->rx_data, 0) >= 0)
+                return 1;
+        }
+    } else
+#endif
+    if ( (n = read_some(io->fd, io->in_buf)) < 0) {
         if (errno == EINTR)
             goto again;
         
@@ -212,24 +467,82 @@ again:
         return 0;
     }
     
-    while (BUFFER_LENGTH(io->in_buf) >= CCNET_PACKET_LENGTH_HEADER)
+    while ( (ret = complete_frame (io->in_buf, &hdr_len, &len)) > 0)
     {
-        packet = (ccnet_packet *) BUFFER_DATA(io->in_buf);
-        len = ntohs (packet->header.length);
+        packet = take_packet (io, hdr_len, len);
+        io->func (packet, io->user_data);
+        buffer_drain (io->in_buf, hdr_len + len);
+    }
 
-        if (BUFFER_LENGTH (io->in_buf) - CCNET_PACKET_LENGTH_HEADER < len)
-            break;
+    if (ret < 0) {
+        g_warning ("packet too large: %d bytes.\n", len);
+        return -1;
+    }
 
-        packet->header.length = len;
-        packet->header.id = ntohl (packet->header.id);
+    return 1;
+}
 
-        io->func (packet, io->user_data);
-        buffer_drain (io->in_buf, len + CCNET_PACKET_LENGTH_HEADER);
+
+#ifndef WIN32
+int
+ccnet_packet_io_start_shm (CcnetPacketIO *io)
+{
+    ccnet_header header;
+    int fds[CCNET_SHM_N_FDS];
+    struct pollfd pfd;
+    int i, nfds;
+
+    pfd.fd = io->fd;
+    pfd.events = POLLIN;
+    if (poll (&pfd, 1, SHM_ANSWER_TIMEOUT_MS) <= 0) {
+        g_warning ("The daemon didn't answer the shared memory request\n");
+        return -1;
     }
 
-    return 1;
+    if ( (nfds = ccnet_shm_recv_fds (io->fd, &header, sizeof(header), fds)) < 0)
+        return -1;
+    if (header.type != CCNET_MSG_HANDSHAKE ||
+        !(ntohl (header.id) & CCNET_CAP_SHM_RING) ||
+        nfds != CCNET_SHM_N_FDS) {
+        for (i = 0; i < nfds; ++i)
+            close (fds[i]);
+        return -1;
+    }
+
+    io->shm = ccnet_shm_open (fds);
+    return io->shm ? 0 : -1;
 }
 
+evutil_socket_t
+ccnet_packet_io_get_shm_fd (CcnetPacketIO *io)
+{
+    return io->shm ? io->shm->rx_data : -1;
+}
+
+gboolean
+ccnet_packet_io_shm_pending (CcnetPacketIO *io)
+{
+    return io->shm && !ccnet_shm_rx_empty (io->shm);
+}
+#else
+int
+ccnet_packet_io_start_shm (CcnetPacketIO *io)
+{
+    return -1;
+}
+
+evutil_socket_t
+ccnet_packet_io_get_shm_fd (CcnetPacketIO *io)
+{
+    return -1;
+}
+
+gboolean
+ccnet_packet_io_shm_pending (CcnetPacketIO *io)
+{
+    return FALSE;
+}
+#endif
 
 /* void */
 /* ccnet_send_request (int req_id, const char *req) */
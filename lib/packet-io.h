@@ -7,6 +7,8 @@
 #include <evutil.h>
 
 struct buffer;
+struct chain_buffer;
+struct CcnetShm;
 
 typedef struct CcnetPacketIO CcnetPacketIO;
 
@@ -15,12 +17,17 @@ typedef void (*got_packet_callback) (ccnet_packet *packet, void *user_data);
 struct CcnetPacketIO {
     evutil_socket_t fd;
     
-    struct buffer *buffer;
+    struct chain_buffer *buffer;    /* the packet being built */
     
     struct buffer *in_buf;
+    int            consumed;    /* bytes of the packet returned by
+                                 * ccnet_packet_io_read_packet() */
 
     got_packet_callback func;
     void                *user_data;
+
+    struct CcnetShm     *shm;   /* packets go through shared memory,
+                                 * see shm-ring.h */
 };
 
 CcnetPacketIO* ccnet_packet_io_new (evutil_socket_t fd);
@@ -33,6 +40,8 @@ void ccnet_packet_add (CcnetPacketIO *io, const char *buf, int len);
 void ccnet_packet_finish (CcnetPacketIO *io);
 void ccnet_packet_send (CcnetPacketIO *io);
 void ccnet_packet_finish_send (CcnetPacketIO *io);
+void ccnet_packet_finish_send_content (CcnetPacketIO *io,
+                                       const char *content, int clen);
 
 void ccnet_packet_io_set_callback (CcnetPacketIO *io,
                                    got_packet_callback func,
@@ -42,4 +51,16 @@ int ccnet_packet_io_read (CcnetPacketIO *io);
 
 ccnet_packet* ccnet_packet_io_read_packet (CcnetPacketIO* io);
 
+/* Wait for the daemon's answer to a handshake with CCNET_CAP_SHM_RING
+ * and switch to the rings it sent. -1 if it declined, the socket is
+ * used as before then. */
+int ccnet_packet_io_start_shm (CcnetPacketIO *io);
+
+/* The fd signalled when packets arrive in shared memory, -1 when not
+ * in use. */
+evutil_socket_t ccnet_packet_io_get_shm_fd (CcnetPacketIO *io);
+
+/* Whether unread data is waiting in shared memory. */
+gboolean ccnet_packet_io_shm_pending (CcnetPacketIO *io);
+
 #endif
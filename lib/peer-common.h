@@ -89,13 +89,21 @@ get_property (GObject *object, guint property_id,
         break;
     case P_ROLE_LIST:
         buf = g_string_new (NULL);
+#ifdef PEER_ROLES_INTERNED
+        ccnet_peer_get_roles_str (peer, buf);
+#else
         string_list_join (peer->role_list, buf, ",");
+#endif
         g_value_take_string (v, buf->str);
         g_string_free (buf, FALSE);
         break;
     case P_MY_ROLE_LIST:
         buf = g_string_new (NULL);
+#ifdef PEER_ROLES_INTERNED
+        ccnet_peer_get_myroles_str (peer, buf);
+#else
         string_list_join (peer->myrole_list, buf, ",");
+#endif
         g_value_take_string (v, buf->str);
         g_string_free (buf, FALSE);
         break;
@@ -117,10 +125,15 @@ set_roles (CcnetPeer *peer, const char *roles)
 {
     if (!roles)
         return;
+#ifdef PEER_ROLES_INTERNED
+    /* The daemon interns roles and indexes peers by role. */
+    ccnet_peer_set_roles (peer, roles);
+#else
     GList *role_list = string_list_parse_sorted (roles, ",");
     
     string_list_free (peer->role_list);
     peer->role_list = role_list;
+#endif
 }
 
 static void
@@ -128,10 +141,14 @@ set_my_roles (CcnetPeer *peer, const char *roles)
 {
     if (!roles)
         return;
+#ifdef PEER_ROLES_INTERNED
+    ccnet_peer_set_myroles (peer, roles);
+#else
     GList *role_list = string_list_parse_sorted (roles, ",");
     
     string_list_free (peer->myrole_list);
     peer->myrole_list = role_list;
+#endif
 }
 
 static void
@@ -1,14 +1,31 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include "include.h"
+
+#include <string.h>
+
 #include "processor.h"
 #include "ccnet-client.h"
 
 #include "peer.h"
 #include "proc-factory.h"
 
+#define DEFAULT_POOL_SIZE 16
+
+/* Released processors of one reusable type. */
+typedef struct {
+    const char *name;
+    GSList     *free;
+    guint       n_free;
+    guint64     reused;
+    guint64     created;
+    guint64     dropped;            /* finalized since the pool was full */
+} ProcPool;
+
 typedef struct {
     GHashTable *proc_type_table;
+    GHashTable *pools;              /* GType -> ProcPool */
+    guint       pool_size;
 } CcnetProcFactoryPriv;
 
 #define GET_PRIV(o)  \
@@ -36,6 +53,9 @@ ccnet_proc_factory_init (CcnetProcFactory *factory)
 
     priv->proc_type_table = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                    g_free, NULL);
+    priv->pools = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                         NULL, g_free);
+    priv->pool_size = DEFAULT_POOL_SIZE;
 }
 
 static void
@@ -43,6 +63,8 @@ ccnet_proc_factory_free (GObject *factory)
 {
     CcnetProcFactoryPriv *priv = GET_PRIV (factory);
 
+    ccnet_proc_factory_set_pool_size (CCNET_PROC_FACTORY(factory), 0);
+    g_hash_table_destroy (priv->pools);
     g_hash_table_destroy (priv->proc_type_table);
 }
 
@@ -100,6 +122,45 @@ static GType ccnet_proc_factory_get_proc_type (CcnetProcFactory *factory,
     return (GType) g_hash_table_lookup (priv->proc_type_table, serv_name);
 }
 
+static ProcPool *
+get_pool (CcnetProcFactory *factory, GType type)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    ProcPool *pool;
+
+    pool = g_hash_table_lookup (priv->pools, (gpointer)type);
+    if (!pool) {
+        pool = g_new0 (ProcPool, 1);
+        pool->name = g_type_name (type);
+        g_hash_table_insert (priv->pools, (gpointer)type, pool);
+    }
+    return pool;
+}
+
+static CcnetProcessor *
+new_processor (CcnetProcFactory *factory, GType type)
+{
+    CcnetProcessorClass *klass = g_type_class_peek (type);
+    CcnetProcessor *processor;
+    ProcPool *pool;
+
+    /* the class is not created until the first instance is */
+    if (!klass || !klass->reusable)
+        return g_object_new (type, NULL);
+
+    pool = get_pool (factory, type);
+    if (!pool->free) {
+        pool->created++;
+        return g_object_new (type, NULL);
+    }
+
+    processor = pool->free->data;
+    pool->free = g_slist_delete_link (pool->free, pool->free);
+    pool->n_free--;
+    pool->reused++;
+    return processor;
+}
+
 CcnetProcessor *
 ccnet_proc_factory_create_processor (CcnetProcFactory *factory,
                                      const char *serv_name,
@@ -115,7 +176,7 @@ ccnet_proc_factory_create_processor (CcnetProcFactory *factory,
         return NULL;
     }
 
-    processor = g_object_new (type, NULL);
+    processor = new_processor (factory, type);
     processor->session = factory->session;
     if (is_master) {
         if (req_id == 0)
@@ -160,7 +221,7 @@ ccnet_proc_factory_create_remote_master_processor (CcnetProcFactory *factory,
     }
 
 
-    processor = g_object_new (type, NULL);
+    processor = new_processor (factory, type);
     processor->peer_id = g_strdup(peer_id);
     processor->session = factory->session;
     processor->id = MASTER_ID (ccnet_client_get_request_id (factory->session));
@@ -191,7 +252,7 @@ ccnet_proc_factory_create_slave_processor (CcnetProcFactory *factory,
         return NULL;
     }
 
-    processor = g_object_new (type, NULL);
+    processor = new_processor (factory, type);
     processor->peer_id = g_strdup(peer_id);
     processor->session = factory->session;
     processor->id = SLAVE_ID (req_id);
@@ -212,5 +273,86 @@ ccnet_proc_factory_recycle (CcnetProcFactory *factory,
                             CcnetProcessor *processor)
 {
     ccnet_client_remove_processor (factory->session, processor);
-    g_object_unref (processor);
+
+    /* Done from its handler, which holds a reference and hands the
+     * processor to ccnet_proc_factory_release() when it returns. */
+    if (processor->is_active) {
+        g_object_unref (processor);
+        return;
+    }
+
+    ccnet_proc_factory_release (factory, processor);
+}
+
+void
+ccnet_proc_factory_release (CcnetProcFactory *factory,
+                            CcnetProcessor *processor)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    ProcPool *pool;
+
+    /* only ccnet_processor_done() releases the resources */
+    if (!CCNET_PROCESSOR_GET_CLASS (processor)->reusable ||
+        processor->state != STATE_IN_SHUTDOWN ||
+        G_OBJECT(processor)->ref_count != 1) {
+        g_object_unref (processor);
+        return;
+    }
+
+    pool = get_pool (factory, G_OBJECT_TYPE (processor));
+    if (pool->n_free >= priv->pool_size) {
+        pool->dropped++;
+        g_object_unref (processor);
+        return;
+    }
+
+    /* release_resource() has freed the name and timer, and reset the
+     * subclass. Clear the rest so it looks newly created. */
+    g_signal_handlers_destroy (processor);
+    memset ((char *)processor + sizeof(GObject), 0,
+            sizeof(CcnetProcessor) - sizeof(GObject));
+
+    pool->free = g_slist_prepend (pool->free, processor);
+    pool->n_free++;
+}
+
+void
+ccnet_proc_factory_set_pool_size (CcnetProcFactory *factory, int size)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    priv->pool_size = size > 0 ? size : 0;
+
+    /* trim pools which are now too large */
+    g_hash_table_iter_init (&iter, priv->pools);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        ProcPool *pool = value;
+        while (pool->n_free > priv->pool_size) {
+            g_object_unref (pool->free->data);
+            pool->free = g_slist_delete_link (pool->free, pool->free);
+            pool->n_free--;
+        }
+    }
+}
+
+char *
+ccnet_proc_factory_get_pool_stats (CcnetProcFactory *factory)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    GHashTableIter iter;
+    gpointer key, value;
+    GString *buf = g_string_new (NULL);
+
+    g_hash_table_iter_init (&iter, priv->pools);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        ProcPool *pool = value;
+        g_string_append_printf (buf, "%s\t%u\t%" G_GUINT64_FORMAT
+                                "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\n",
+                                pool->name, pool->n_free, pool->reused,
+                                pool->created, pool->dropped);
+    }
+
+    return g_string_free (buf, FALSE);
 }
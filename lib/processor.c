@@ -164,7 +164,7 @@ void ccnet_processor_handle_update (CcnetProcessor *processor,
             processor->failure = PROC_BAD_RESP;
 
         ccnet_processor_done (processor, FALSE);
-        return;
+        goto out;
     }
 
     if (strncmp (code, SC_PROC_KEEPALIVE, 3) == 0) {
@@ -184,8 +184,9 @@ void ccnet_processor_handle_update (CcnetProcessor *processor,
                                                               code, code_msg, 
                                                               content, clen);
     }
+out:
     processor->is_active = FALSE;
-    g_object_unref (processor);
+    ccnet_proc_factory_release (processor->session->proc_factory, processor);
 }
 
 void ccnet_processor_handle_response (CcnetProcessor *processor, 
@@ -209,7 +210,7 @@ void ccnet_processor_handle_response (CcnetProcessor *processor,
             processor->failure = PROC_BAD_RESP;
 
         ccnet_processor_done (processor, FALSE);
-        return;
+        goto out;
     }
 
     if (strncmp (code, SC_PROC_KEEPALIVE, 3) == 0) {
@@ -226,8 +227,9 @@ void ccnet_processor_handle_response (CcnetProcessor *processor,
                                                                 code, code_msg, 
                                                                 content, clen);
     }
+out:
     processor->is_active = FALSE;
-    g_object_unref (processor);
+    ccnet_proc_factory_release (processor->session->proc_factory, processor);
 }
 
 
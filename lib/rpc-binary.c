@@ -0,0 +1,237 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <string.h>
+
+#include "rpc-binary.h"
+
+void
+rpc_bin_reader_init (RpcBinReader *r, const char *data, gsize len)
+{
+    r->ptr = data;
+    r->end = data + len;
+    r->error = FALSE;
+}
+
+void
+rpc_bin_put_uint (GString *buf, guint64 v)
+{
+    char tmp[10];
+    int n = 0;
+
+    while (v >= 0x80) {
+        tmp[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    tmp[n++] = (char)v;
+    g_string_append_len (buf, tmp, n);
+}
+
+void
+rpc_bin_put_int (GString *buf, gint64 v)
+{
+    rpc_bin_put_uint (buf, ((guint64)v << 1) ^ (guint64)(v >> 63));
+}
+
+void
+rpc_bin_put_string (GString *buf, const char *s)
+{
+    size_t len;
+
+    if (!s) {
+        rpc_bin_put_uint (buf, 0);
+        return;
+    }
+    len = strlen (s) + 1;
+    rpc_bin_put_uint (buf, len);
+    g_string_append_len (buf, s, len);
+}
+
+guint64
+rpc_bin_get_uint (RpcBinReader *r)
+{
+    guint64 v = 0;
+    int shift = 0;
+    unsigned char c;
+
+    if (r->error)
+        return 0;
+
+    do {
+        if (r->ptr >= r->end || shift > 63) {
+            r->error = TRUE;
+            return 0;
+        }
+        c = (unsigned char) *r->ptr++;
+        v |= (guint64)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return v;
+}
+
+gint64
+rpc_bin_get_int (RpcBinReader *r)
+{
+    guint64 v = rpc_bin_get_uint (r);
+
+    return (gint64)(v >> 1) ^ -(gint64)(v & 1);
+}
+
+const char *
+rpc_bin_get_string (RpcBinReader *r)
+{
+    guint64 len = rpc_bin_get_uint (r);
+    const char *s;
+
+    if (r->error || len == 0)
+        return NULL;
+
+    if (len > (guint64)(r->end - r->ptr) || r->ptr[len - 1] != '\0') {
+        r->error = TRUE;
+        return NULL;
+    }
+    s = r->ptr;
+    r->ptr += len;
+    return s;
+}
+
+/* Results */
+
+void
+rpc_bin_put_error (GString *buf, int code, const char *message)
+{
+    rpc_bin_put_uint (buf, RPC_BIN_RET_ERROR);
+    rpc_bin_put_int (buf, code);
+    rpc_bin_put_string (buf, message);
+}
+
+void
+rpc_bin_put_int_result (GString *buf, gint64 v)
+{
+    rpc_bin_put_uint (buf, RPC_BIN_RET_INT);
+    rpc_bin_put_int (buf, v);
+}
+
+void
+rpc_bin_put_object_result (GString *buf, GObject *obj, RpcBinPutObjFunc put)
+{
+    rpc_bin_put_uint (buf, RPC_BIN_RET_OBJECT);
+    rpc_bin_put_uint (buf, obj ? 1 : 0);
+    if (obj)
+        put (buf, obj);
+}
+
+void
+rpc_bin_put_objlist_result (GString *buf, GList *objs, RpcBinPutObjFunc put)
+{
+    GList *ptr;
+
+    rpc_bin_put_uint (buf, RPC_BIN_RET_OBJLIST);
+    rpc_bin_put_uint (buf, g_list_length (objs));
+    for (ptr = objs; ptr; ptr = ptr->next)
+        put (buf, ptr->data);
+}
+
+void
+rpc_bin_put_reclist_result (GString *buf, GArray *recs, gsize size,
+                            RpcBinPutRecFunc put)
+{
+    guint i;
+
+    rpc_bin_put_uint (buf, RPC_BIN_RET_OBJLIST);
+    rpc_bin_put_uint (buf, recs ? recs->len : 0);
+    if (!recs)
+        return;
+    for (i = 0; i < recs->len; ++i)
+        put (buf, recs->data + i * size);
+}
+
+/* Read the tag, and the error if there is one. */
+static int
+get_result_tag (RpcBinReader *r, guint64 expected, int *error_code)
+{
+    guint64 tag = rpc_bin_get_uint (r);
+
+    if (!r->error && tag == expected)
+        return 0;
+
+    if (!r->error && tag == RPC_BIN_RET_ERROR) {
+        *error_code = (int) rpc_bin_get_int (r);
+        if (!r->error)
+            return -1;
+    }
+    *error_code = -1;
+    return -1;
+}
+
+int
+rpc_bin_get_int_result (const char *data, gsize len,
+                        gint64 *ret, int *error_code)
+{
+    RpcBinReader r;
+
+    rpc_bin_reader_init (&r, data, len);
+    if (get_result_tag (&r, RPC_BIN_RET_INT, error_code) < 0)
+        return -1;
+
+    *ret = rpc_bin_get_int (&r);
+    if (r.error) {
+        *error_code = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int
+rpc_bin_get_object_result (const char *data, gsize len,
+                           RpcBinGetObjFunc get, GObject **ret,
+                           int *error_code)
+{
+    RpcBinReader r;
+
+    *ret = NULL;
+    rpc_bin_reader_init (&r, data, len);
+    if (get_result_tag (&r, RPC_BIN_RET_OBJECT, error_code) < 0)
+        return -1;
+
+    if (rpc_bin_get_uint (&r) == 1)
+        *ret = get (&r);
+    if (r.error) {
+        *error_code = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int
+rpc_bin_get_objlist_result (const char *data, gsize len,
+                            RpcBinGetObjFunc get, GList **ret,
+                            int *error_code)
+{
+    RpcBinReader r;
+    GList *list = NULL, *ptr;
+    GObject *obj;
+    guint64 n;
+
+    *ret = NULL;
+    rpc_bin_reader_init (&r, data, len);
+    if (get_result_tag (&r, RPC_BIN_RET_OBJLIST, error_code) < 0)
+        return -1;
+
+    n = rpc_bin_get_uint (&r);
+    while (n-- > 0 && !r.error) {
+        obj = get (&r);
+        if (obj)
+            list = g_list_prepend (list, obj);
+    }
+    if (r.error) {
+        for (ptr = list; ptr; ptr = ptr->next)
+            g_object_unref (ptr->data);
+        g_list_free (list);
+        *error_code = -1;
+        return -1;
+    }
+
+    *ret = g_list_reverse (list);
+    return 0;
+}
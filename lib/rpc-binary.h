@@ -0,0 +1,103 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef RPC_BINARY_H
+#define RPC_BINARY_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+/*
+ * Compact encoding for the hot rpc functions, used in place of searpc
+ * JSON when both sides support it (see SC_CLIENT_BINARY).
+ *
+ * Integers are LEB128 varints, signed ones zigzag encoded. A string is
+ * a varint holding its length plus the terminating '\0', followed by
+ * the string and the '\0'; 0 stands for NULL. Objects are their fields
+ * in a fixed order, without names or types.
+ *
+ * A call is the function name followed by its arguments. A result is
+ * one of the RPC_BIN_RET_XXX tags followed by:
+ *
+ *   ERROR    int code, string message
+ *   INT      int
+ *   OBJECT   uint present, then the object if present is 1
+ *   OBJLIST  uint count, then count objects
+ */
+
+enum {
+    RPC_BIN_RET_ERROR = 0,
+    RPC_BIN_RET_INT,
+    RPC_BIN_RET_OBJECT,
+    RPC_BIN_RET_OBJLIST,
+};
+
+/* Error code of a result when the server has no binary version of the
+ * function. The client may call it through JSON instead. */
+#define RPC_BIN_ERR_NO_FUNCTION  404
+
+typedef struct RpcBinReader {
+    const char *ptr;
+    const char *end;
+    gboolean    error;          /* set on a truncated or malformed buffer */
+} RpcBinReader;
+
+void rpc_bin_reader_init (RpcBinReader *r, const char *data, gsize len);
+
+void rpc_bin_put_uint (GString *buf, guint64 v);
+void rpc_bin_put_int (GString *buf, gint64 v);
+void rpc_bin_put_string (GString *buf, const char *s);
+
+/* These return 0 or NULL once the reader has an error. */
+guint64 rpc_bin_get_uint (RpcBinReader *r);
+gint64  rpc_bin_get_int (RpcBinReader *r);
+/* Points into the buffer, valid as long as it is. */
+const char *rpc_bin_get_string (RpcBinReader *r);
+
+/* Marshallers of the ccnet objects, and of their plain struct records
+ * (CcnetXxxRec), which are sent the same way. The ones of ccnetobj.vala
+ * are generated into ccnetobj-codec.h. */
+typedef void (*RpcBinPutObjFunc) (GString *buf, GObject *obj);
+typedef GObject *(*RpcBinGetObjFunc) (RpcBinReader *r);
+typedef void (*RpcBinPutRecFunc) (GString *buf, const void *rec);
+
+/*
+ * The daemon and the library have their own CcnetPeer, so the peer
+ * marshallers live with them. A peer is sent as: string id, name,
+ * public_addr, uint public_port, string service_url, ip, uint port,
+ * int net_state, uint flags, string role_list, myrole_list,
+ * session_key.
+ */
+#define RPC_BIN_PEER_IS_SELF          (1 << 0)
+#define RPC_BIN_PEER_CAN_CONNECT      (1 << 1)
+#define RPC_BIN_PEER_IN_LOCAL_NETWORK (1 << 2)
+#define RPC_BIN_PEER_IN_CONNECTION    (1 << 3)
+#define RPC_BIN_PEER_IS_READY         (1 << 4)
+#define RPC_BIN_PEER_ENCRYPT_CHANNEL  (1 << 5)
+
+/* Results */
+void rpc_bin_put_error (GString *buf, int code, const char *message);
+void rpc_bin_put_int_result (GString *buf, gint64 v);
+void rpc_bin_put_object_result (GString *buf, GObject *obj,
+                                RpcBinPutObjFunc put);
+void rpc_bin_put_objlist_result (GString *buf, GList *objs,
+                                 RpcBinPutObjFunc put);
+/* An objlist result of a GArray of records of @size bytes. */
+void rpc_bin_put_reclist_result (GString *buf, GArray *recs, gsize size,
+                                 RpcBinPutRecFunc put);
+
+/*
+ * Decode a result. On error -1 is returned, and @error_code set to the
+ * code sent by the server, or to -1 for a malformed result.
+ */
+int rpc_bin_get_int_result (const char *data, gsize len,
+                            gint64 *ret, int *error_code);
+int rpc_bin_get_object_result (const char *data, gsize len,
+                               RpcBinGetObjFunc get, GObject **ret,
+                               int *error_code);
+int rpc_bin_get_objlist_result (const char *data, gsize len,
+                                RpcBinGetObjFunc get, GList **ret,
+                                int *error_code);
+
+#include "ccnetobj-codec.h"
+
+#endif
@@ -3,6 +3,8 @@
 #ifndef RPC_COMMON_H
 #define RPC_COMMON_H
 
+#include <glib.h>
+
 #include "packet.h"
 
 #define SC_CLIENT_CALL  "301"
@@ -13,13 +15,73 @@
 #define SS_SERVER_RET   "SERVER RET"
 #define SC_SERVER_MORE  "312"
 #define SS_SERVER_MORE  "HAS MORE"
+#define SC_CLIENT_BATCH "303"
+#define SC_CLIENT_CREDIT "304"
+#define SS_CLIENT_CREDIT "CREDIT"
+#define SC_CLIENT_BINARY "305"
+#define SC_SERVER_STREAM "313"
+#define SS_SERVER_STREAM "STREAM"
 #define SC_SERVER_ERR   "411"
 #define SS_SERVER_ERR   "Fail to invoke the function, check the function"
 
+/* err_code of the error result returned when the server has too many
+ * calls queued. The call was not run and may be tried again later. */
+#define RPC_ERR_BUSY    503
+#define RPC_ERR_BUSY_MSG "Server busy"
+
 /* MESSAGE_HEADER = SC_SERVER_RET(3) + " " + SS_SERVER_RET(10) + "\n"(1) + "\n"(1) */
 #define MESSAGE_HEADER 64                  /* leave enough space */
 #define MAX_TRANSFER_LENGTH (CCNET_PACKET_MAX_PAYLOAD_LEN - MESSAGE_HEADER)
 
+/* A client asks for a streamed result by sending SC_CLIENT_CALL with
+ * "CLIENT CALL STREAM <window>" as the reason. Old servers ignore the
+ * reason and answer with SC_SERVER_MORE as before.
+ */
+#define SS_CLIENT_CALL_STREAM "CLIENT CALL STREAM"
+#define RPC_STREAM_WINDOW       8
+#define RPC_STREAM_MAX_WINDOW  64
+
+/* SC_CLIENT_BATCH carries several function calls, each as "<len>\n"
+ * followed by <len> bytes. The result holds the returns in the same
+ * form and is sent like the result of a single call. Old servers
+ * answer SC_BAD_UPDATE_CODE.
+ */
+#define RPC_BATCH_MAX  64
+
+static inline void
+rpc_batch_append (GString *buf, const char *data, gsize len)
+{
+    g_string_append_printf (buf, "%" G_GSIZE_FORMAT "\n", len);
+    g_string_append_len (buf, data, len);
+}
+
+/* Returns -1 at the end or on a malformed record. */
+static inline int
+rpc_batch_next (const char **ptr, const char *end,
+                const char **data, gsize *len)
+{
+    const char *p = *ptr;
+    gsize n = 0;
+
+    if (p >= end)
+        return -1;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p)
+        n = n * 10 + (*p - '0');
+    if (p == *ptr || p >= end || *p != '\n' || n > (gsize)(end - p - 1))
+        return -1;
+
+    *data = p + 1;
+    *len = n;
+    *ptr = p + 1 + n;
+    return 0;
+}
+
+/* SC_CLIENT_BINARY carries a call in the encoding of rpc-binary.h, with
+ * the reason as for SC_CLIENT_CALL. The result is sent like the result
+ * of a single call. Old servers answer SC_BAD_UPDATE_CODE, and the
+ * client goes back to JSON.
+ */
+
 /* 
    Client                       Server
               <xxx>-rpcserver
@@ -36,6 +98,22 @@
          ---------------------->
             311 SERVER RET
         <-----------------------
+
+   Batch mode: 303 <reason as for 301> carries the calls, the result
+   comes back as for 301. Binary calls, 305, work the same way.
+
+   Streaming mode:
+
+     301 CLIENT CALL STREAM 8
+         ---------------------->
+            313  STREAM
+        <-----------------------   (at most <window> chunks
+            313  STREAM             without credit)
+        <-----------------------
+            304  CREDIT 4
+         ---------------------->
+            311 SERVER RET
+        <-----------------------
  */
 
 #endif
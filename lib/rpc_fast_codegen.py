@@ -0,0 +1,197 @@
+#!/usr/bin/env python
+"""
+Generate specialised JSON marshallers for the signatures of rpc_table.py.
+
+searpc's generic marshallers parse a call into a tree and check the type
+of each argument. The ones written to rpc-fast-marshal.h have a fixed
+number of arguments, read with CcnetJsonArgs: integers are parsed in
+place and strings point into the copy of the call. Results are written
+with CcnetJsonWriter, in the format searpc uses.
+
+Only int, int64 and string results are handled. Objects and object
+lists still go through searpc's GObject serializer.
+
+Built with CCNET_RPC_FAST_BENCH the header also has a dummy function
+and a sample call for each signature, for ccnet-bench to compare both
+paths.
+
+usage: rpc_fast_codegen.py rpc_table.py [outdir]
+"""
+
+import os
+import sys
+
+# result type: C type, how to write it
+ret_types = {
+    "int":    ("int",    "fast_ret_int"),
+    "int64":  ("gint64", "fast_ret_int"),
+    "string": ("char *", "fast_ret_string"),
+}
+
+# argument type: C type, how to read it, sample value
+arg_types = {
+    "int":    ("int",          "(int) ccnet_json_args_get_int (args)", "42"),
+    "int64":  ("gint64",       "ccnet_json_args_get_int (args)",
+               "1400000000000000"),
+    "string": ("const char *", "ccnet_json_args_get_string (args)",
+               '"user@example.com"'),
+}
+
+HEADER = "/* Generated by rpc_fast_codegen.py from rpc_table.py, do not edit. */\n"
+
+PRELUDE = """
+#ifndef RPC_FAST_MARSHAL_H
+#define RPC_FAST_MARSHAL_H
+
+#include <string.h>
+#include <glib.h>
+
+#include "utils.h"
+#include "searpc-signature.h"
+
+/* Returns NULL, without calling @func, if the arguments don't match. */
+typedef char *(*CcnetFastMarshal) (void *func, CcnetJsonArgs *args,
+                                   gsize *ret_len);
+
+typedef struct CcnetFastMarshalEntry {
+    gchar            *(*signature) (void);
+    CcnetFastMarshal  marshal;
+#ifdef CCNET_RPC_FAST_BENCH
+    const char       *name;
+    void             *bench_func;
+    const char       *bench_call;
+#endif
+} CcnetFastMarshalEntry;
+
+#ifdef CCNET_RPC_FAST_BENCH
+#define FAST_BENCH(name, func, call) , name, (void *)func, call
+#else
+#define FAST_BENCH(name, func, call)
+#endif
+
+static char *
+fast_ret_finish (CcnetJsonWriter *writer, GError *error, gsize *ret_len)
+{
+    if (error) {
+        ccnet_json_add_int (writer, "err_code", error->code);
+        ccnet_json_add_string (writer, "err_msg", error->message);
+        g_error_free (error);
+    }
+    ccnet_json_end_object (writer);
+
+    *ret_len = writer->buf->len;
+    return g_string_free (writer->buf, FALSE);
+}
+
+static char *
+fast_ret_int (gint64 ret, GError *error, gsize *ret_len)
+{
+    CcnetJsonWriter writer;
+
+    ccnet_json_writer_init (&writer, g_string_sized_new (64));
+    ccnet_json_begin_object (&writer, NULL);
+    ccnet_json_add_int (&writer, "ret", ret);
+    return fast_ret_finish (&writer, error, ret_len);
+}
+
+static char *
+fast_ret_string (char *ret, GError *error, gsize *ret_len)
+{
+    CcnetJsonWriter writer;
+
+    ccnet_json_writer_init (&writer,
+                            g_string_sized_new (ret ? strlen (ret) + 32 : 64));
+    ccnet_json_begin_object (&writer, NULL);
+    ccnet_json_add_string (&writer, "ret", ret);
+    g_free (ret);
+    return fast_ret_finish (&writer, error, ret_len);
+}
+"""
+
+def sig_name(ret, args):
+    return ret + "__" + ("_".join(args) or "void")
+
+def gen_marshal(ret, args, out):
+    name = sig_name(ret, args)
+    rtype, put = ret_types[ret]
+    protos = [arg_types[a][0] for a in args] + ["GError **"]
+    rsep = "" if rtype.endswith("*") else " "
+
+    out.append("\nstatic char *\nfast_marshal_%s (void *func, CcnetJsonArgs "
+               "*args, gsize *ret_len)\n{\n" % name)
+    out.append("    typedef %s%s(*Func) (%s);\n" % (rtype, rsep, ", ".join(protos)))
+    for i, a in enumerate(args):
+        ctype, get = arg_types[a][0], arg_types[a][1]
+        sep = "" if ctype.endswith("*") else " "
+        out.append("    %s%sparam%d = %s;\n" % (ctype, sep, i + 1, get))
+    out.append("    GError *error = NULL;\n")
+    out.append("    %s%sret;\n\n" % (rtype, rsep))
+    out.append("    if (!ccnet_json_args_end (args))\n        return NULL;\n")
+    params = ["param%d" % (i + 1) for i in range(len(args))] + ["&error"]
+    out.append("    ret = ((Func) func) (%s);\n" % ", ".join(params))
+    out.append("    return %s (ret, error, ret_len);\n}\n" % put)
+
+def gen_bench_func(ret, args, out):
+    name = sig_name(ret, args)
+    rtype = ret_types[ret][0]
+    rsep = "" if rtype.endswith("*") else " "
+    params = []
+    for i, a in enumerate(args):
+        ctype = arg_types[a][0]
+        sep = "" if ctype.endswith("*") else " "
+        params.append("%s%sarg%d" % (ctype, sep, i + 1))
+    params.append("GError **error")
+    out.append("\nstatic %s\nbench_%s (%s)\n{\n" % (rtype, name, ", ".join(params)))
+    if ret == "string":
+        out.append("    return g_strdup (\"ok\");\n}\n")
+    else:
+        out.append("    return 0;\n}\n")
+
+def bench_call(ret, args):
+    items = ['"bench_%s"' % sig_name(ret, args)] + \
+            [arg_types[a][2] for a in args]
+    text = "[" + ", ".join(items) + "]"
+    return '"%s"' % text.replace('"', '\\"')
+
+def generate(table):
+    sigs = [(r, a) for r, a in table if r in ret_types]
+    out = [HEADER, PRELUDE]
+
+    for ret, args in sigs:
+        gen_marshal(ret, args, out)
+
+    out.append("\n#ifdef CCNET_RPC_FAST_BENCH\n")
+    for ret, args in sigs:
+        gen_bench_func(ret, args, out)
+    out.append("#endif\n")
+
+    out.append("\nstatic CcnetFastMarshalEntry ccnet_fast_marshals[] = {\n")
+    for ret, args in sigs:
+        name = sig_name(ret, args)
+        out.append("    { searpc_signature_%s, fast_marshal_%s\n"
+                   "      FAST_BENCH (\"%s\", bench_%s,\n"
+                   "                  %s) },\n"
+                   % (name, name, name, name, bench_call(ret, args)))
+    out.append("};\n\n#endif\n")
+    return "".join(out)
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write(__doc__)
+        sys.exit(1)
+    outdir = sys.argv[2] if len(sys.argv) > 2 else "."
+
+    scope = {}
+    exec(open(sys.argv[1]).read(), scope)
+    for ret, args in scope["func_table"]:
+        for a in args:
+            if a not in arg_types:
+                sys.stderr.write("unknown argument type %s\n" % a)
+                sys.exit(1)
+
+    f = open(os.path.join(outdir, "rpc-fast-marshal.h"), "w")
+    f.write(generate(scope["func_table"]))
+    f.close()
+
+if __name__ == "__main__":
+    main()
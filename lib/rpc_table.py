@@ -32,6 +32,8 @@ func_table = [
     [ "int64", ["int", "string"]],
     [ "string", [] ],
     [ "string", ["int"] ],
+    [ "string", ["int64", "int"] ],
+    [ "string", ["int", "string", "string"] ],
     [ "string", ["string"] ],
     [ "string", ["string", "int"] ],
     [ "string", ["string", "string"] ],
@@ -4,6 +4,8 @@
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
 
 #include <string.h>
 #include <glib.h>
@@ -108,6 +110,48 @@ err:
     return NULL;
 }
 
+/* Peers keep sending the same keys, in pubinfo and multicast. */
+#define KEY_CACHE_MAX  4096
+
+G_LOCK_DEFINE_STATIC (key_cache);
+static GHashTable *key_cache;   /* encoded key -> RSA */
+
+RSA* public_key_from_string_cached(const char *str)
+{
+    RSA *key;
+    char *copy;
+
+    if (!str)
+        return NULL;
+
+    G_LOCK (key_cache);
+    if (!key_cache)
+        key_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                           (GDestroyNotify)RSA_free);
+    key = g_hash_table_lookup (key_cache, str);
+    if (key) {
+        RSA_up_ref (key);
+        G_UNLOCK (key_cache);
+        return key;
+    }
+    G_UNLOCK (key_cache);
+
+    copy = g_strdup (str);
+    key = public_key_from_string (copy);
+    if (!key) {
+        g_free (copy);
+        return NULL;
+    }
+
+    G_LOCK (key_cache);
+    if (g_hash_table_size (key_cache) >= KEY_CACHE_MAX)
+        g_hash_table_remove_all (key_cache);
+    RSA_up_ref (key);
+    g_hash_table_replace (key_cache, copy, key);
+    G_UNLOCK (key_cache);
+    return key;
+}
+
 unsigned char *
 private_key_decrypt(RSA *key, unsigned char *data, int len, int *decrypt_len)
 {
@@ -134,6 +178,33 @@ public_key_encrypt(RSA *key, unsigned char *data, int len, int *encrypt_len)
     return buf;
 }
 
+unsigned char *
+private_key_sign(RSA *key, const unsigned char *data, int len,
+                 unsigned int *sig_len)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned char *sig = g_malloc (RSA_size(key));
+
+    SHA256 (data, len, digest);
+    if (!RSA_sign (NID_sha256, digest, sizeof(digest), sig, sig_len, key)) {
+        g_free (sig);
+        return NULL;
+    }
+
+    return sig;
+}
+
+gboolean
+public_key_verify(RSA *key, const unsigned char *data, int len,
+                  const unsigned char *sig, unsigned int sig_len)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+
+    SHA256 (data, len, digest);
+    return RSA_verify (NID_sha256, digest, sizeof(digest),
+                       sig, sig_len, key) == 1;
+}
+
 char *
 id_from_pubkey (RSA *pubkey)
 {
@@ -159,3 +230,111 @@ generate_private_key(u_int bits)
 		g_error ("rsa_generate_private_key: key generation failed.");
 	return private;
 }
+
+#ifdef HAVE_X25519
+
+EVP_PKEY *
+x25519_generate_key (unsigned char *pub)
+{
+    EVP_PKEY_CTX *ctx;
+    EVP_PKEY *key = NULL;
+    size_t len = CCNET_X25519_KEY_LEN;
+
+    ctx = EVP_PKEY_CTX_new_id (EVP_PKEY_X25519, NULL);
+    if (!ctx)
+        return NULL;
+    if (EVP_PKEY_keygen_init (ctx) <= 0 || EVP_PKEY_keygen (ctx, &key) <= 0)
+        key = NULL;
+    EVP_PKEY_CTX_free (ctx);
+
+    if (key && EVP_PKEY_get_raw_public_key (key, pub, &len) <= 0) {
+        EVP_PKEY_free (key);
+        key = NULL;
+    }
+
+    return key;
+}
+
+int
+x25519_derive (EVP_PKEY *key, const unsigned char *peer_pub,
+               unsigned char *secret)
+{
+    EVP_PKEY_CTX *ctx;
+    EVP_PKEY *peer;
+    size_t len = CCNET_X25519_KEY_LEN;
+    int ret = -1;
+
+    peer = EVP_PKEY_new_raw_public_key (EVP_PKEY_X25519, NULL,
+                                        peer_pub, CCNET_X25519_KEY_LEN);
+    if (!peer)
+        return -1;
+
+    ctx = EVP_PKEY_CTX_new (key, NULL);
+    if (ctx &&
+        EVP_PKEY_derive_init (ctx) > 0 &&
+        EVP_PKEY_derive_set_peer (ctx, peer) > 0 &&
+        EVP_PKEY_derive (ctx, secret, &len) > 0 &&
+        len == CCNET_X25519_KEY_LEN)
+        ret = 0;
+
+    EVP_PKEY_CTX_free (ctx);
+    EVP_PKEY_free (peer);
+    return ret;
+}
+
+static void
+x25519_pub_digest (const unsigned char *pub, unsigned char *digest)
+{
+    SHA256_CTX s;
+
+    SHA256_Init (&s);
+    SHA256_Update (&s, "ccnet-x25519", strlen("ccnet-x25519"));
+    SHA256_Update (&s, pub, CCNET_X25519_KEY_LEN);
+    SHA256_Final (digest, &s);
+}
+
+unsigned char *
+x25519_sign_pub (RSA *priv, const unsigned char *pub, unsigned int *sig_len)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned char *sig = g_malloc (RSA_size(priv));
+
+    x25519_pub_digest (pub, digest);
+    if (!RSA_sign (NID_sha256, digest, sizeof(digest), sig, sig_len, priv)) {
+        g_free (sig);
+        return NULL;
+    }
+
+    return sig;
+}
+
+gboolean
+x25519_verify_pub (RSA *pubkey, const unsigned char *pub,
+                   const unsigned char *sig, unsigned int sig_len)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+
+    x25519_pub_digest (pub, digest);
+    return RSA_verify (NID_sha256, digest, sizeof(digest),
+                       sig, sig_len, pubkey) == 1;
+}
+
+void
+x25519_session_key (const unsigned char *secret,
+                    const unsigned char *pub_a,
+                    const unsigned char *pub_b,
+                    char *key)
+{
+    unsigned char sha1[20];
+    SHA_CTX s;
+
+    SHA1_Init (&s);
+    SHA1_Update (&s, secret, CCNET_X25519_KEY_LEN);
+    SHA1_Update (&s, pub_a, CCNET_X25519_KEY_LEN);
+    SHA1_Update (&s, pub_b, CCNET_X25519_KEY_LEN);
+    SHA1_Final (sha1, &s);
+
+    rawdata_to_hex (sha1, key, 20);
+}
+
+#endif  /* HAVE_X25519 */
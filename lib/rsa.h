@@ -7,7 +7,13 @@
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
 
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define HAVE_X25519 1
+#endif
+
+#define CCNET_X25519_KEY_LEN 32
  
 RSA* private_key_to_pub(RSA *priv);
 
@@ -15,6 +21,9 @@ GString* public_key_to_gstring(const RSA *rsa);
 void public_key_append_to_gstring(const RSA *rsa, GString *buf);
 
 RSA* public_key_from_string(char *str);
+/* The same, but keys seen before are shared rather than decoded again.
+ * The caller owns a reference, to be released with RSA_free(). */
+RSA* public_key_from_string_cached(const char *str);
 
 unsigned char* private_key_decrypt(RSA *key, unsigned char *data,
                                    int len, int *decrypt_len);
@@ -22,10 +31,42 @@ unsigned char* private_key_decrypt(RSA *key, unsigned char *data,
 unsigned char* public_key_encrypt(RSA *key, unsigned char *data,
                                   int len, int *encrypt_len);
 
+/* An RSA signature over the SHA256 of @data, NULL on error. */
+unsigned char* private_key_sign(RSA *key, const unsigned char *data,
+                                int len, unsigned int *sig_len);
+gboolean public_key_verify(RSA *key, const unsigned char *data, int len,
+                           const unsigned char *sig, unsigned int sig_len);
+
 
 char *id_from_pubkey (RSA *pubkey);
 
 RSA* generate_private_key(u_int bits);
 
+#ifdef HAVE_X25519
+
+/* A new X25519 key, its public half is written to @pub. */
+EVP_PKEY *x25519_generate_key (unsigned char *pub);
+
+/* The shared secret of @key and @peer_pub, CCNET_X25519_KEY_LEN bytes.
+ * Returns -1 on error, e.g. for a low order @peer_pub. */
+int x25519_derive (EVP_PKEY *key, const unsigned char *peer_pub,
+                   unsigned char *secret);
+
+/* An RSA signature over an X25519 public key, vouching that it belongs
+ * to the owner of @priv. */
+unsigned char *x25519_sign_pub (RSA *priv, const unsigned char *pub,
+                                unsigned int *sig_len);
+gboolean x25519_verify_pub (RSA *pubkey, const unsigned char *pub,
+                            const unsigned char *sig, unsigned int sig_len);
+
+/* The 40 hex digit session key both sides get from the shared @secret,
+ * the initiator's @pub_a and the responder's @pub_b. */
+void x25519_session_key (const unsigned char *secret,
+                         const unsigned char *pub_a,
+                         const unsigned char *pub_b,
+                         char *key);
+
+#endif
+
 
 #endif
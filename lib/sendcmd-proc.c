@@ -30,6 +30,18 @@ static void handle_response (CcnetProcessor *processor,
 
 G_DEFINE_TYPE (CcnetSendcmdProc, ccnet_sendcmd_proc, CCNET_TYPE_PROCESSOR);
 
+static void
+release_resource (CcnetProcessor *processor)
+{
+    CcnetSendcmdProc *proc = (CcnetSendcmdProc *) processor;
+
+    proc->rcvrsp_cb = NULL;
+    proc->cb_data = NULL;
+    GET_PRIV(processor)->persist = 0;
+
+    CCNET_PROCESSOR_CLASS (ccnet_sendcmd_proc_parent_class)->release_resource (processor);
+}
+
 static void
 ccnet_sendcmd_proc_class_init (CcnetSendcmdProcClass *klass)
 {
@@ -38,6 +50,8 @@ ccnet_sendcmd_proc_class_init (CcnetSendcmdProcClass *klass)
     proc_class->start = send_cmd_start;
     proc_class->name = "sendcmd-proc";
     proc_class->handle_response = handle_response;
+    proc_class->release_resource = release_resource;
+    proc_class->reusable = TRUE;
 
     g_type_class_add_private (klass, sizeof (CcnetSendcmdProcPriv));
 }
@@ -0,0 +1,354 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifdef __linux__
+/* for memfd_create */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#endif
+
+#include "shm-ring.h"
+
+#ifdef HAVE_MEMFD_CREATE
+
+#define CACHE_LINE 64
+
+/* The producer and the consumer fields are on cache lines of their
+ * own, so the two sides don't invalidate each other's. */
+struct CcnetShmRing {
+    guint32     head;               /* producer */
+    char        pad1[CACHE_LINE - 4];
+    guint32     tail;               /* consumer */
+    char        pad2[CACHE_LINE - 4];
+    guint32     want_space;         /* the producer found it full */
+    char        pad3[CACHE_LINE - 4];
+    char        data[CCNET_SHM_RING_SIZE];
+};
+
+#define MAP_SIZE (2 * sizeof(CcnetShmRing))
+
+static void
+signal_efd (int efd)
+{
+    guint64 one = 1;
+
+    /* Only fails if the counter is saturated, which wakes it anyway. */
+    if (write (efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        g_warning ("Failed to signal eventfd: %s\n", strerror(errno));
+}
+
+void
+ccnet_shm_clear (int efd)
+{
+    guint64 count;
+
+    if (read (efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        g_warning ("Failed to read eventfd: %s\n", strerror(errno));
+}
+
+static CcnetShm *
+shm_map (int *fds, gboolean daemon)
+{
+    CcnetShm *shm;
+    void *map;
+    CcnetShmRing *c2s, *s2c;
+
+    map = mmap (NULL, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fds[CCNET_SHM_FD_MEM], 0);
+    if (map == MAP_FAILED) {
+        g_warning ("Failed to map shared memory: %s\n", strerror(errno));
+        return NULL;
+    }
+    c2s = map;
+    s2c = c2s + 1;
+
+    shm = g_new0 (CcnetShm, 1);
+    shm->map = map;
+    memcpy (shm->fds, fds, sizeof(shm->fds));
+    if (daemon) {
+        shm->tx = s2c;
+        shm->rx = c2s;
+        shm->tx_data = fds[CCNET_SHM_FD_S2C_DATA];
+        shm->tx_space = fds[CCNET_SHM_FD_S2C_SPACE];
+        shm->rx_data = fds[CCNET_SHM_FD_C2S_DATA];
+        shm->rx_space = fds[CCNET_SHM_FD_C2S_SPACE];
+    } else {
+        shm->tx = c2s;
+        shm->rx = s2c;
+        shm->tx_data = fds[CCNET_SHM_FD_C2S_DATA];
+        shm->tx_space = fds[CCNET_SHM_FD_C2S_SPACE];
+        shm->rx_data = fds[CCNET_SHM_FD_S2C_DATA];
+        shm->rx_space = fds[CCNET_SHM_FD_S2C_SPACE];
+    }
+    return shm;
+}
+
+static void
+close_fds (int *fds)
+{
+    int i;
+
+    for (i = 0; i < CCNET_SHM_N_FDS; ++i)
+        if (fds[i] >= 0)
+            close (fds[i]);
+}
+
+CcnetShm *
+ccnet_shm_create (void)
+{
+    int fds[CCNET_SHM_N_FDS];
+    CcnetShm *shm;
+    int i;
+
+    for (i = 0; i < CCNET_SHM_N_FDS; ++i)
+        fds[i] = -1;
+
+    fds[CCNET_SHM_FD_MEM] = memfd_create ("ccnet-shm", MFD_CLOEXEC);
+    if (fds[CCNET_SHM_FD_MEM] < 0 ||
+        ftruncate (fds[CCNET_SHM_FD_MEM], MAP_SIZE) < 0)
+        goto error;
+    for (i = CCNET_SHM_FD_MEM + 1; i < CCNET_SHM_N_FDS; ++i)
+        if ((fds[i] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+            goto error;
+
+    /* A new memfd is zero filled, so the rings start empty. */
+    if ((shm = shm_map (fds, TRUE)) != NULL)
+        return shm;
+
+error:
+    g_warning ("Failed to set up shared memory transport: %s\n",
+               strerror(errno));
+    close_fds (fds);
+    return NULL;
+}
+
+CcnetShm *
+ccnet_shm_open (int *fds)
+{
+    CcnetShm *shm = NULL;
+    struct stat st;
+
+    /* A daemon of another version may lay the rings out differently. */
+    if (fstat (fds[CCNET_SHM_FD_MEM], &st) == 0 && st.st_size == MAP_SIZE)
+        shm = shm_map (fds, FALSE);
+    else
+        g_warning ("Shared memory of the daemon doesn't match\n");
+
+    if (!shm)
+        close_fds (fds);
+    return shm;
+}
+
+void
+ccnet_shm_free (CcnetShm *shm)
+{
+    if (!shm)
+        return;
+    munmap (shm->map, MAP_SIZE);
+    close_fds (shm->fds);
+    g_free (shm);
+}
+
+int
+ccnet_shm_write (CcnetShm *shm, const char *buf, int len)
+{
+    CcnetShmRing *r = shm->tx;
+    guint32 head = r->head;
+    guint32 tail, off, n, first;
+
+again:
+    tail = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+    n = MIN ((guint32)len, CCNET_SHM_RING_SIZE - (head - tail));
+    if (n == 0) {
+        if (r->want_space)
+            return 0;
+        /* Ask for a signal, then look again in case the consumer made
+         * room before it could see the flag. */
+        __atomic_store_n (&r->want_space, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&r->tail, __ATOMIC_SEQ_CST) != tail)
+            goto again;
+        return 0;
+    }
+
+    off = head & (CCNET_SHM_RING_SIZE - 1);
+    first = MIN (n, CCNET_SHM_RING_SIZE - off);
+    memcpy (r->data + off, buf, first);
+    memcpy (r->data, buf + first, n - first);
+    __atomic_store_n (&r->head, head + n, __ATOMIC_SEQ_CST);
+
+    /* The consumer had taken everything, it may be asleep. */
+    if (__atomic_load_n (&r->tail, __ATOMIC_SEQ_CST) == head)
+        signal_efd (shm->tx_data);
+    return n;
+}
+
+int
+ccnet_shm_read (CcnetShm *shm, char *buf, int len)
+{
+    CcnetShmRing *r = shm->rx;
+    guint32 tail = r->tail;
+    guint32 head, off, n, first;
+
+    head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+    n = MIN ((guint32)len, head - tail);
+    if (n == 0)
+        return 0;
+
+    off = tail & (CCNET_SHM_RING_SIZE - 1);
+    first = MIN (n, CCNET_SHM_RING_SIZE - off);
+    memcpy (buf, r->data + off, first);
+    memcpy (buf + first, r->data, n - first);
+    __atomic_store_n (&r->tail, tail + n, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n (&r->want_space, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n (&r->want_space, 0, __ATOMIC_SEQ_CST);
+        signal_efd (shm->rx_space);
+    }
+    return n;
+}
+
+gboolean
+ccnet_shm_rx_empty (CcnetShm *shm)
+{
+    CcnetShmRing *r = shm->rx;
+
+    return __atomic_load_n (&r->head, __ATOMIC_SEQ_CST) == r->tail;
+}
+
+int
+ccnet_shm_send_fds (int sock, const void *buf, int len, CcnetShm *shm)
+{
+    char control[CMSG_SPACE(sizeof(int) * CCNET_SHM_N_FDS)];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    memset (&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (shm) {
+        memset (control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR (&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * CCNET_SHM_N_FDS);
+        memcpy (CMSG_DATA(cmsg), shm->fds, sizeof(int) * CCNET_SHM_N_FDS);
+    }
+
+    do {
+        n = sendmsg (sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    return n == len ? 0 : -1;
+}
+
+int
+ccnet_shm_recv_fds (int sock, void *buf, int len, int *fds)
+{
+    char control[CMSG_SPACE(sizeof(int) * CCNET_SHM_N_FDS)];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+    int nfds = 0;
+
+    memset (&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+        n = recvmsg (sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n != len)
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (nfds > CCNET_SHM_N_FDS)
+            nfds = CCNET_SHM_N_FDS;
+        memcpy (fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+    }
+    return nfds;
+}
+
+#else
+
+CcnetShm *
+ccnet_shm_create (void)
+{
+    return NULL;
+}
+
+CcnetShm *
+ccnet_shm_open (int *fds)
+{
+    return NULL;
+}
+
+void
+ccnet_shm_free (CcnetShm *shm)
+{
+}
+
+int
+ccnet_shm_write (CcnetShm *shm, const char *buf, int len)
+{
+    return -1;
+}
+
+int
+ccnet_shm_read (CcnetShm *shm, char *buf, int len)
+{
+    return -1;
+}
+
+gboolean
+ccnet_shm_rx_empty (CcnetShm *shm)
+{
+    return TRUE;
+}
+
+void
+ccnet_shm_clear (int efd)
+{
+}
+
+int
+ccnet_shm_send_fds (int sock, const void *buf, int len, CcnetShm *shm)
+{
+    return -1;
+}
+
+int
+ccnet_shm_recv_fds (int sock, void *buf, int len, int *fds)
+{
+    return -1;
+}
+
+#endif  /* HAVE_MEMFD_CREATE */
@@ -0,0 +1,85 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_SHM_RING_H
+#define CCNET_SHM_RING_H
+
+#include <glib.h>
+
+/*
+ * Shared memory transport between the daemon and a local client, with
+ * [Client] SHM_TRANSPORT = true on both sides.
+ *
+ * A client on the unix socket announces CCNET_CAP_SHM_RING in its
+ * handshake packet and waits for the daemon's handshake in return. The
+ * daemon sends it with a memfd holding two single producer, single
+ * consumer byte rings (client to daemon, daemon to client) and their
+ * eventfds, as SCM_RIGHTS. From then on the packets, in the usual
+ * framing, only go through the rings. The socket stays open to tell
+ * when the other side is gone.
+ *
+ * Each ring has a data eventfd, signalled by the producer only when it
+ * writes into an empty ring, and a space eventfd, signalled by the
+ * consumer only after the producer found the ring full. A reader checks
+ * the ring again before it sleeps, so the rings usually pass a request
+ * and its reply without any syscall but the two wakeups.
+ */
+
+#define CCNET_SHM_RING_SIZE     (1 << 20)       /* a power of 2 */
+
+/* The eventfds and the memfd, in the order they are passed. */
+enum {
+    CCNET_SHM_FD_MEM = 0,
+    CCNET_SHM_FD_C2S_DATA,
+    CCNET_SHM_FD_C2S_SPACE,
+    CCNET_SHM_FD_S2C_DATA,
+    CCNET_SHM_FD_S2C_SPACE,
+    CCNET_SHM_N_FDS
+};
+
+typedef struct CcnetShmRing CcnetShmRing;
+typedef struct CcnetShm CcnetShm;
+
+struct CcnetShm {
+    void            *map;
+    int              fds[CCNET_SHM_N_FDS];
+
+    /* ours to write and to read */
+    CcnetShmRing    *tx;
+    CcnetShmRing    *rx;
+    int              tx_data;       /* we signal it */
+    int              tx_space;      /* we wait on it when tx is full */
+    int              rx_data;       /* we wait on it when rx is empty */
+    int              rx_space;      /* we signal it */
+};
+
+/* Daemon: a new memfd and eventfds. NULL if not supported. */
+CcnetShm *ccnet_shm_create (void);
+
+/* Client: map what the daemon sent, taking over @fds. */
+CcnetShm *ccnet_shm_open (int *fds);
+
+void      ccnet_shm_free (CcnetShm *shm);
+
+/* Copy up to @len bytes into tx. Returns 0 if it's full, and then the
+ * consumer will signal tx_space once it made room. */
+int       ccnet_shm_write (CcnetShm *shm, const char *buf, int len);
+
+/* Copy up to @len bytes out of rx, 0 if it's empty. */
+int       ccnet_shm_read (CcnetShm *shm, char *buf, int len);
+
+/* Whether rx is empty, to be checked after clearing rx_data and before
+ * waiting on it. */
+gboolean  ccnet_shm_rx_empty (CcnetShm *shm);
+
+/* Reset an eventfd after it woke us. */
+void      ccnet_shm_clear (int efd);
+
+/* Send @len bytes on @sock with the fds of @shm, if not NULL. */
+int       ccnet_shm_send_fds (int sock, const void *buf, int len,
+                              CcnetShm *shm);
+
+/* Receive exactly @len bytes from @sock, and the fds if they came
+ * along. Returns the number of fds, or -1. */
+int       ccnet_shm_recv_fds (int sock, void *buf, int len, int *fds);
+
+#endif
@@ -12,29 +12,315 @@
 
 #include "timer.h"
 
+/*
+ * Timers don't get a libevent event each. They sit in a hashed wheel of
+ * the event base's timer service, which has one event armed for the
+ * earliest deadline. Deadlines are rounded up to TIMER_TICK_MSEC, the
+ * slack, so timers due within a tick fire in one batch. Timers of 0ms
+ * are kept on a list of their own and all run in the next loop
+ * iteration.
+ */
+
+#define TIMER_TICK_MSEC     10
+#define WHEEL_SIZE          256         /* must be a power of 2 */
+
+typedef struct TimerList {
+    CcnetTimer    *head;
+    CcnetTimer   **tail;
+} TimerList;
+
+typedef struct TimerService TimerService;
+
 struct CcnetTimer
 {
-    struct event   event;
-    struct timeval tv;
+    CcnetTimer    *next;
+    CcnetTimer   **pprev;
+    TimerList     *list;
+    TimerService  *service;
+    int64_t        deadline;        /* in ticks */
+    uint64_t       interval;        /* msec */
     TimerCB        func;
     void          *user_data;
     uint8_t        inCallback;
+    uint8_t        cancelled;
 };
 
+struct TimerService
+{
+    struct event_base *base;
+    struct event   tick_event;
+    struct event   now_event;
+    TimerList      wheel[WHEEL_SIZE];
+    TimerList      now_list;        /* 0ms timers */
+    int64_t        cur_tick;        /* first tick not processed yet */
+    int64_t        armed_tick;      /* tick_event is set for, 0 if not */
+    int64_t        next_tick;       /* no deadline is earlier */
+    unsigned int   in_wheel;
+    TimerService  *next;
+};
+
+static TimerService *services;
+static TimerService *cur_service;
+
+static CcnetSlowCallbackHook slow_hook;
+static int64_t slow_threshold;
+
+void
+ccnet_set_slow_callback_hook (CcnetSlowCallbackHook hook,
+                              int64_t threshold_usec)
+{
+    slow_hook = hook;
+    slow_threshold = threshold_usec;
+}
+
+int64_t
+ccnet_slow_callback_begin (void)
+{
+    return slow_hook ? g_get_monotonic_time () : 0;
+}
+
+void
+ccnet_slow_callback_end (const char *what, void *func, int64_t start)
+{
+    int64_t usec;
+
+    if (!start || !slow_hook)
+        return;
+    usec = g_get_monotonic_time () - start;
+    if (usec >= slow_threshold)
+        slow_hook (what, func, usec);
+}
+
+static int64_t
+now_msec (void)
+{
+    return g_get_monotonic_time () / 1000;
+}
+
+static void
+list_init (TimerList *list)
+{
+    list->head = NULL;
+    list->tail = &list->head;
+}
+
+static void
+list_append (TimerList *list, CcnetTimer *timer)
+{
+    timer->next = NULL;
+    timer->pprev = list->tail;
+    *list->tail = timer;
+    list->tail = &timer->next;
+    timer->list = list;
+}
+
+/* O(1), whichever list the timer is on. */
+static void
+list_unlink (CcnetTimer *timer)
+{
+    TimerList *list = timer->list;
+    TimerService *service = timer->service;
+
+    if (!list)
+        return;
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    else
+        list->tail = timer->pprev;
+    timer->list = NULL;
+    if (list >= service->wheel && list < service->wheel + WHEEL_SIZE)
+        service->in_wheel--;
+}
+
+static void
+arm_tick (TimerService *service)
+{
+    struct timeval tv;
+    int64_t delay;
+
+    if (service->in_wheel == 0) {
+        if (service->armed_tick) {
+            evtimer_del (&service->tick_event);
+            service->armed_tick = 0;
+        }
+        return;
+    }
+    if (service->armed_tick && service->armed_tick <= service->next_tick)
+        return;
+
+    delay = service->next_tick * TIMER_TICK_MSEC - now_msec ();
+    tv = timeval_from_msec (delay > 0 ? delay : 0);
+    evtimer_del (&service->tick_event);
+    evtimer_add (&service->tick_event, &tv);
+    service->armed_tick = service->next_tick;
+}
+
+/* The earliest deadline in the wheel, looking at the slots from
+ * cur_tick on. Stops at the first deadline of this round. */
+static int64_t
+find_next_tick (TimerService *service)
+{
+    int64_t tick, best = G_MAXINT64;
+    CcnetTimer *timer;
+    int i;
+
+    for (i = 0; i < WHEEL_SIZE; ++i) {
+        tick = service->cur_tick + i;
+        for (timer = service->wheel[tick & (WHEEL_SIZE - 1)].head; timer;
+             timer = timer->next) {
+            if (timer->deadline <= tick)
+                return tick;
+            if (timer->deadline < best)
+                best = timer->deadline;
+        }
+    }
+    return best;
+}
+
 static void
-timer_callback (int fd, short event, void *vtimer)
+schedule (TimerService *service, CcnetTimer *timer)
+{
+    int64_t tick;
+
+    if (timer->interval == 0) {
+        list_append (&service->now_list, timer);
+        if (!evtimer_pending (&service->now_event, NULL)) {
+            struct timeval tv = { 0, 0 };
+            evtimer_add (&service->now_event, &tv);
+        }
+        return;
+    }
+
+    /* Rounded up, a timer never fires early. */
+    tick = (now_msec () + timer->interval + TIMER_TICK_MSEC - 1)
+        / TIMER_TICK_MSEC;
+    if (tick < service->cur_tick)
+        tick = service->cur_tick;
+    timer->deadline = tick;
+    list_append (&service->wheel[tick & (WHEEL_SIZE - 1)], timer);
+    if (service->in_wheel++ == 0 || tick < service->next_tick)
+        service->next_tick = tick;
+    arm_tick (service);
+}
+
+static void
+run_timer (CcnetTimer *timer)
 {
     int more;
-    struct CcnetTimer *timer = vtimer;
+    int64_t start = ccnet_slow_callback_begin ();
 
     timer->inCallback = 1;
     more = (*timer->func) (timer->user_data);
     timer->inCallback = 0;
+    ccnet_slow_callback_end ("timer", (void *)timer->func, start);
 
-    if (more)
-        evtimer_add (&timer->event, &timer->tv);
+    if (more && !timer->cancelled)
+        schedule (timer->service, timer);
     else
-        ccnet_timer_free (&timer);
+        g_free (timer);
+}
+
+/* The batch is a list of its own, so timers freed by the callbacks
+ * before their turn are simply unlinked. */
+static void
+process_batch (TimerService *service, TimerList *batch)
+{
+    CcnetTimer *timer;
+
+    while ((timer = batch->head) != NULL) {
+        list_unlink (timer);
+        run_timer (timer);
+    }
+}
+
+static void
+on_tick (int fd, short event, void *vservice)
+{
+    TimerService *service = vservice;
+    TimerList batch, *slot;
+    CcnetTimer *timer, *next;
+    int64_t now_tick, tick, last;
+
+    service->armed_tick = 0;
+    now_tick = now_msec () / TIMER_TICK_MSEC;
+    list_init (&batch);
+
+    /* After a long stall every slot is looked at once. */
+    last = now_tick;
+    if (last - service->cur_tick >= WHEEL_SIZE)
+        last = service->cur_tick + WHEEL_SIZE - 1;
+    for (tick = service->cur_tick; tick <= last; ++tick) {
+        slot = &service->wheel[tick & (WHEEL_SIZE - 1)];
+        for (timer = slot->head; timer; timer = next) {
+            next = timer->next;
+            if (timer->deadline <= now_tick) {
+                list_unlink (timer);
+                list_append (&batch, timer);
+            }
+        }
+    }
+    if (service->cur_tick <= now_tick)
+        service->cur_tick = now_tick + 1;
+
+    process_batch (service, &batch);
+
+    if (service->in_wheel > 0)
+        service->next_tick = find_next_tick (service);
+    arm_tick (service);
+}
+
+static void
+on_now (int fd, short event, void *vservice)
+{
+    TimerService *service = vservice;
+    TimerList batch;
+    CcnetTimer *timer;
+
+    /* Timers added by the callbacks run in the next iteration. */
+    list_init (&batch);
+    if (service->now_list.head) {
+        batch.head = service->now_list.head;
+        batch.tail = service->now_list.tail;
+        batch.head->pprev = &batch.head;
+        for (timer = batch.head; timer; timer = timer->next)
+            timer->list = &batch;
+        list_init (&service->now_list);
+    }
+    process_batch (service, &batch);
+}
+
+static TimerService *
+get_service (struct event_base *base)
+{
+    TimerService *service;
+    int i;
+
+    for (service = services; service; service = service->next)
+        if (service->base == base)
+            return service;
+
+    service = g_new0 (TimerService, 1);
+    service->base = base;
+    for (i = 0; i < WHEEL_SIZE; ++i)
+        list_init (&service->wheel[i]);
+    list_init (&service->now_list);
+    service->cur_tick = now_msec () / TIMER_TICK_MSEC;
+    evtimer_set (&service->tick_event, on_tick, service);
+    evtimer_set (&service->now_event, on_now, service);
+    if (base) {
+        event_base_set (base, &service->tick_event);
+        event_base_set (base, &service->now_event);
+    }
+    service->next = services;
+    services = service;
+    return service;
+}
+
+void
+ccnet_timer_set_event_base (struct event_base *base)
+{
+    cur_service = get_service (base);
 }
 
 void
@@ -48,12 +334,16 @@ ccnet_timer_free (CcnetTimer **ptimer)
     timer = *ptimer;
     *ptimer = NULL;
 
-    /* destroy the timer directly or via the command queue */
-    if (timer && !timer->inCallback)
-    {
-        event_del (&timer->event);
-        g_free (timer);
+    if (!timer)
+        return;
+
+    /* A running timer is freed once its callback returns. */
+    if (timer->inCallback) {
+        timer->cancelled = 1;
+        return;
     }
+    list_unlink (timer);
+    g_free (timer);
 }
 
 CcnetTimer*
@@ -63,12 +353,14 @@ ccnet_timer_new (TimerCB         func,
 {
     CcnetTimer *timer = g_new0 (CcnetTimer, 1);
 
-    timer->tv = timeval_from_msec (interval_milliseconds);
+    if (!cur_service)
+        cur_service = get_service (NULL);
+
+    timer->service = cur_service;
+    timer->interval = interval_milliseconds;
     timer->func = func;
     timer->user_data = user_data;
-
-    evtimer_set (&timer->event, timer_callback, timer);
-    evtimer_add (&timer->event, &timer->tv);
+    schedule (timer->service, timer);
 
     return timer;
 }
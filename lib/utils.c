@@ -3,6 +3,7 @@
 #include <config.h>
 
 #include "utils.h"
+#include "hex-util.h"
 
 #ifdef WIN32
     #include <winsock2.h>
@@ -42,6 +43,10 @@
 #include <json-glib/json-glib.h>
 #include <searpc-utils.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
 extern int inet_pton(int af, const char *src, void *dst);
 
 
@@ -58,40 +63,13 @@ timeval_from_msec (uint64_t milliseconds)
 void
 rawdata_to_hex (const unsigned char *rawdata, char *hex_str, int n_bytes)
 {
-    static const char hex[] = "0123456789abcdef";
-    int i;
-
-    for (i = 0; i < n_bytes; i++) {
-        unsigned int val = *rawdata++;
-        *hex_str++ = hex[val >> 4];
-        *hex_str++ = hex[val & 0xf];
-    }
-    *hex_str = '\0';
-}
-
-static unsigned hexval(char c)
-{
-    if (c >= '0' && c <= '9')
-        return c - '0';
-    if (c >= 'a' && c <= 'f')
-        return c - 'a' + 10;
-    if (c >= 'A' && c <= 'F')
-        return c - 'A' + 10;
-    return ~0;
+    hex_encode (rawdata, hex_str, n_bytes);
 }
 
 int
 hex_to_rawdata (const char *hex_str, unsigned char *rawdata, int n_bytes)
 {
-    int i;
-    for (i = 0; i < n_bytes; i++) {
-        unsigned int val = (hexval(hex_str[0]) << 4) | hexval(hex_str[1]);
-        if (val & ~0xff)
-            return -1;
-        *rawdata++ = val;
-        hex_str += 2;
-    }
-    return 0;
+    return hex_decode (hex_str, rawdata, n_bytes);
 }
 
 size_t
@@ -773,12 +751,22 @@ string_list_is_exists (GList *str_list, const char *string)
 GList*
 string_list_append (GList *str_list, const char *string)
 {
+    GList *ptr, *last = NULL;
+
     g_return_val_if_fail (string != NULL, str_list);
 
-    if (string_list_is_exists(str_list, string))
-        return str_list;
+    /* One pass, finding the end of the list on the way. */
+    for (ptr = str_list; ptr; last = ptr, ptr = ptr->next) {
+        if (g_strcmp0(string, ptr->data) == 0)
+            return str_list;
+    }
 
-    str_list = g_list_append (str_list, g_strdup(string));
+    ptr = g_list_alloc ();
+    ptr->data = g_strdup(string);
+    ptr->prev = last;
+    if (!last)
+        return ptr;
+    last->next = ptr;
     return str_list;
 }
 
@@ -888,6 +876,201 @@ string_list_sorted_is_equal (GList *list1, GList *list2)
     return FALSE;
 }
 
+/* String sets */
+
+#define STR_SET_HASH_MIN  16
+
+static int
+str_set_find (const CcnetStrSet *set, const char *string, gboolean *found)
+{
+    int lo = 0, hi = set->len, mid, cmp;
+
+    *found = FALSE;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        cmp = strcmp (string, set->items[mid]);
+        if (cmp == 0) {
+            *found = TRUE;
+            return mid;
+        }
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+const char *
+ccnet_str_set_lookup (const CcnetStrSet *set, const char *string)
+{
+    gboolean found;
+    int i;
+
+    if (!string)
+        return NULL;
+    if (set->index)
+        return g_hash_table_lookup (set->index, string);
+
+    i = str_set_find (set, string, &found);
+    return found ? set->items[i] : NULL;
+}
+
+typedef struct {
+    int  ref_count;
+    char str[0];
+} RefString;
+
+G_LOCK_DEFINE_STATIC (ref_strings);
+static GHashTable *ref_strings;     /* str -> RefString */
+
+const char *
+ccnet_str_ref (const char *string)
+{
+    RefString *rs;
+    int len;
+
+    if (!string)
+        return NULL;
+
+    G_LOCK (ref_strings);
+    if (!ref_strings)
+        ref_strings = g_hash_table_new (g_str_hash, g_str_equal);
+
+    rs = g_hash_table_lookup (ref_strings, string);
+    if (rs) {
+        rs->ref_count++;
+    } else {
+        len = strlen (string);
+        rs = g_malloc (sizeof(RefString) + len + 1);
+        rs->ref_count = 1;
+        memcpy (rs->str, string, len + 1);
+        g_hash_table_insert (ref_strings, rs->str, rs);
+    }
+    G_UNLOCK (ref_strings);
+
+    return rs->str;
+}
+
+void
+ccnet_str_unref (const char *string)
+{
+    RefString *rs;
+
+    if (!string)
+        return;
+
+    rs = (RefString *)(string - G_STRUCT_OFFSET (RefString, str));
+    G_LOCK (ref_strings);
+    if (--rs->ref_count == 0) {
+        g_hash_table_remove (ref_strings, rs->str);
+        g_free (rs);
+    }
+    G_UNLOCK (ref_strings);
+}
+
+const char *
+ccnet_str_set_add (CcnetStrSet *set, const char *string)
+{
+    gboolean found;
+    guint i, j;
+
+    g_return_val_if_fail (string != NULL, NULL);
+
+    i = str_set_find (set, string, &found);
+    if (found)
+        return NULL;
+
+    if (set->len == set->alloc) {
+        set->alloc = set->alloc ? set->alloc * 2 : 4;
+        set->items = g_renew (const char *, set->items, set->alloc);
+    }
+    string = g_intern_string (string);
+    memmove (&set->items[i + 1], &set->items[i],
+             (set->len - i) * sizeof(char *));
+    set->items[i] = string;
+    set->len++;
+
+    if (set->index)
+        g_hash_table_insert (set->index, (gpointer)string, (gpointer)string);
+    else if (set->len > STR_SET_HASH_MIN) {
+        set->index = g_hash_table_new (g_str_hash, g_str_equal);
+        for (j = 0; j < set->len; ++j)
+            g_hash_table_insert (set->index, (gpointer)set->items[j],
+                                 (gpointer)set->items[j]);
+    }
+    return string;
+}
+
+const char *
+ccnet_str_set_remove (CcnetStrSet *set, const char *string)
+{
+    gboolean found;
+    guint i;
+
+    g_return_val_if_fail (string != NULL, NULL);
+
+    i = str_set_find (set, string, &found);
+    if (!found)
+        return NULL;
+
+    string = set->items[i];
+    set->len--;
+    memmove (&set->items[i], &set->items[i + 1],
+             (set->len - i) * sizeof(char *));
+    if (set->index)
+        g_hash_table_remove (set->index, string);
+    return string;
+}
+
+void
+ccnet_str_set_clear (CcnetStrSet *set)
+{
+    g_free (set->items);
+    if (set->index)
+        g_hash_table_destroy (set->index);
+    memset (set, 0, sizeof(CcnetStrSet));
+}
+
+void
+ccnet_str_set_parse (CcnetStrSet *set, const char *list_in_str,
+                     const char *seperator)
+{
+    char **array, **ptr;
+
+    ccnet_str_set_clear (set);
+    if (!list_in_str)
+        return;
+
+    array = g_strsplit (list_in_str, seperator, 0);
+    for (ptr = array; *ptr; ptr++) {
+        if (**ptr != '\0')
+            ccnet_str_set_add (set, *ptr);
+    }
+    g_strfreev (array);
+}
+
+void
+ccnet_str_set_join (const CcnetStrSet *set, GString *str,
+                    const char *seperator)
+{
+    guint i;
+
+    for (i = 0; i < set->len; ++i) {
+        if (i > 0)
+            g_string_append (str, seperator);
+        g_string_append (str, set->items[i]);
+    }
+}
+
+gboolean
+ccnet_str_set_equal (const CcnetStrSet *set1, const CcnetStrSet *set2)
+{
+    /* Both sorted and interned. */
+    return set1->len == set2->len &&
+        memcmp (set1->items, set2->items, set1->len * sizeof(char *)) == 0;
+}
+
 char **
 ncopy_string_array (char **orig, int n)
 {
@@ -933,33 +1116,295 @@ key_value_list_to_json(const char *first, ...)
     return ret;
 }
 
+/* Streaming JSON writer */
+
+void
+ccnet_json_writer_init (CcnetJsonWriter *writer, GString *buf)
+{
+    writer->buf = buf;
+    writer->need_comma = FALSE;
+}
+
+static void
+json_append_string (GString *buf, const char *str)
+{
+    const char *run = str, *p;
+    char esc[8];
+
+    g_string_append_c (buf, '"');
+    for (p = str; *p; p++) {
+        unsigned char c = *p;
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        g_string_append_len (buf, run, p - run);
+        run = p + 1;
+        switch (c) {
+        case '"':  g_string_append (buf, "\\\""); break;
+        case '\\': g_string_append (buf, "\\\\"); break;
+        case '\b': g_string_append (buf, "\\b"); break;
+        case '\f': g_string_append (buf, "\\f"); break;
+        case '\n': g_string_append (buf, "\\n"); break;
+        case '\r': g_string_append (buf, "\\r"); break;
+        case '\t': g_string_append (buf, "\\t"); break;
+        default:
+            snprintf (esc, sizeof(esc), "\\u%04x", c);
+            g_string_append (buf, esc);
+            break;
+        }
+    }
+    g_string_append_len (buf, run, p - run);
+    g_string_append_c (buf, '"');
+}
+
+static void
+json_append_key (CcnetJsonWriter *writer, const char *key)
+{
+    if (writer->need_comma)
+        g_string_append_c (writer->buf, ',');
+    writer->need_comma = TRUE;
+    if (key) {
+        json_append_string (writer->buf, key);
+        g_string_append_c (writer->buf, ':');
+    }
+}
+
+void
+ccnet_json_begin_object (CcnetJsonWriter *writer, const char *key)
+{
+    json_append_key (writer, key);
+    g_string_append_c (writer->buf, '{');
+    writer->need_comma = FALSE;
+}
+
+void
+ccnet_json_end_object (CcnetJsonWriter *writer)
+{
+    g_string_append_c (writer->buf, '}');
+    writer->need_comma = TRUE;
+}
+
+void
+ccnet_json_add_string (CcnetJsonWriter *writer, const char *key,
+                       const char *value)
+{
+    json_append_key (writer, key);
+    if (value)
+        json_append_string (writer->buf, value);
+    else
+        g_string_append (writer->buf, "null");
+}
+
+void
+ccnet_json_add_int (CcnetJsonWriter *writer, const char *key, gint64 value)
+{
+    json_append_key (writer, key);
+    g_string_append_printf (writer->buf, "%" G_GINT64_FORMAT, value);
+}
+
+void
+ccnet_json_add_bool (CcnetJsonWriter *writer, const char *key,
+                     gboolean value)
+{
+    json_append_key (writer, key);
+    g_string_append (writer->buf, value ? "true" : "false");
+}
+
+static void
+json_args_skip_space (CcnetJsonArgs *args)
+{
+    while (args->p < args->end && g_ascii_isspace (*args->p))
+        ++args->p;
+}
+
+static int
+json_hex4 (const char *p)
+{
+    int i, v = 0;
+
+    for (i = 0; i < 4; ++i) {
+        if (!g_ascii_isxdigit (p[i]))
+            return -1;
+        v = (v << 4) | g_ascii_xdigit_value (p[i]);
+    }
+    return v;
+}
+
+/* Unescape the string at args->p, after the quote, in place. */
+static char *
+json_args_read_string (CcnetJsonArgs *args)
+{
+    char *start = args->p, *out = args->p, *p = args->p;
+    gunichar c;
+    int lo;
+
+    while (p < args->end && *p != '"') {
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+        if (++p >= args->end)
+            goto error;
+        switch (*p++) {
+        case '"':  *out++ = '"'; break;
+        case '\\': *out++ = '\\'; break;
+        case '/':  *out++ = '/'; break;
+        case 'b':  *out++ = '\b'; break;
+        case 'f':  *out++ = '\f'; break;
+        case 'n':  *out++ = '\n'; break;
+        case 'r':  *out++ = '\r'; break;
+        case 't':  *out++ = '\t'; break;
+        case 'u':
+            if (args->end - p < 4 || (int)(c = json_hex4 (p)) < 0)
+                goto error;
+            p += 4;
+            if (c >= 0xD800 && c < 0xDC00) {
+                if (args->end - p < 6 || p[0] != '\\' || p[1] != 'u' ||
+                    (lo = json_hex4 (p + 2)) < 0xDC00 || lo >= 0xE000)
+                    goto error;
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                p += 6;
+            } else if (c >= 0xDC00 && c < 0xE000)
+                goto error;
+            /* \uXXXX takes 6 bytes, its UTF-8 at most 4. */
+            out += g_unichar_to_utf8 (c, out);
+            break;
+        default:
+            goto error;
+        }
+    }
+    if (p >= args->end)
+        goto error;
+
+    *out = '\0';
+    args->p = p + 1;
+    return start;
+
+error:
+    args->error = TRUE;
+    return NULL;
+}
+
+int
+ccnet_json_args_init (CcnetJsonArgs *args, const char *fcall, gsize len)
+{
+    if (len < sizeof(args->stack))
+        args->buf = args->stack;
+    else
+        args->buf = g_malloc (len + 1);
+    memcpy (args->buf, fcall, len);
+    args->buf[len] = '\0';
+    args->p = args->buf;
+    args->end = args->buf + len;
+    args->error = FALSE;
+
+    json_args_skip_space (args);
+    if (args->p >= args->end || *args->p++ != '[')
+        goto error;
+    json_args_skip_space (args);
+    if (args->p >= args->end || *args->p++ != '"')
+        goto error;
+    if (!json_args_read_string (args))
+        goto error;
+    return 0;
+
+error:
+    ccnet_json_args_free (args);
+    return -1;
+}
+
+/* Skip the comma before the next argument. */
+static gboolean
+json_args_next (CcnetJsonArgs *args)
+{
+    if (args->error)
+        return FALSE;
+    json_args_skip_space (args);
+    if (args->p >= args->end || *args->p++ != ',') {
+        args->error = TRUE;
+        return FALSE;
+    }
+    json_args_skip_space (args);
+    return TRUE;
+}
+
+gint64
+ccnet_json_args_get_int (CcnetJsonArgs *args)
+{
+    char *end;
+    gint64 v;
+
+    if (!json_args_next (args))
+        return 0;
+    if (args->p >= args->end ||
+        !(g_ascii_isdigit (*args->p) || *args->p == '-')) {
+        args->error = TRUE;
+        return 0;
+    }
+    /* The buffer is NUL terminated. */
+    v = g_ascii_strtoll (args->p, &end, 10);
+    if (end == args->p || *end == '.' || *end == 'e' || *end == 'E') {
+        args->error = TRUE;
+        return 0;
+    }
+    args->p = end;
+    return v;
+}
+
+const char *
+ccnet_json_args_get_string (CcnetJsonArgs *args)
+{
+    if (!json_args_next (args))
+        return NULL;
+    if (args->end - args->p >= 4 && memcmp (args->p, "null", 4) == 0) {
+        args->p += 4;
+        return NULL;
+    }
+    if (args->p >= args->end || *args->p++ != '"') {
+        args->error = TRUE;
+        return NULL;
+    }
+    return json_args_read_string (args);
+}
+
+gboolean
+ccnet_json_args_end (CcnetJsonArgs *args)
+{
+    if (args->error)
+        return FALSE;
+    json_args_skip_space (args);
+    return args->p < args->end && *args->p == ']';
+}
+
+void
+ccnet_json_args_free (CcnetJsonArgs *args)
+{
+    if (args->buf != args->stack)
+        g_free (args->buf);
+    args->buf = NULL;
+}
+
 gchar *
 key_value_list_to_json_v(const char *first, va_list args)
 {
     if (!first)
         return NULL;
 
-    JsonNode *root = json_node_new (JSON_NODE_OBJECT);
-    JsonGenerator *generator = json_generator_new ();
-    JsonObject *jobj = json_object_new ();
+    CcnetJsonWriter writer;
     const char *key = first, *value;
-    gchar *data;
 
+    ccnet_json_writer_init (&writer, g_string_sized_new (128));
+    ccnet_json_begin_object (&writer, NULL);
     while (key) {
         value = va_arg(args, char *);
-        json_object_set_string_member (jobj, key, value);
+        ccnet_json_add_string (&writer, key, value);
 
         key = va_arg(args, char *);
     }
+    ccnet_json_end_object (&writer);
 
-    json_node_take_object (root, jobj);
-    json_generator_set_root (generator, root);
-    g_object_set (generator, "pretty", FALSE, NULL);
-
-    data = json_generator_to_data (generator, NULL);
-    json_node_free (root);
-    g_object_unref (generator);
-    return data;
+    return g_string_free (writer.buf, FALSE);
 }
 
 /* format char:
@@ -985,42 +1430,33 @@ json_vprintf(const char *format, va_list args)
     if (!format)
         return NULL;
 
-    JsonObject *jobj = json_object_new ();
-    const char *key = format, *strv;
+    CcnetJsonWriter writer;
+    const char *key, *strv;
     gint64 intv;
-    gchar *data;
     const char *p;
 
+    ccnet_json_writer_init (&writer, g_string_sized_new (128));
+    ccnet_json_begin_object (&writer, NULL);
     for (p=format; *p; p++) {
         key = va_arg(args, char *);
         switch (*p) {
         case 's':
             strv = va_arg(args, char *);
-            json_object_set_string_or_null_member (jobj, key, strv);
+            ccnet_json_add_string (&writer, key, strv);
             break;
         case 'i':
             intv = va_arg(args, gint64);
-            json_object_set_int_member (jobj, key, intv);
+            ccnet_json_add_int (&writer, key, intv);
             break;
         default:
             g_warning ("unknown format %c\n", *p);
-            json_object_unref (jobj);
+            g_string_free (writer.buf, TRUE);
             return NULL;
         }
     }
+    ccnet_json_end_object (&writer);
 
-    JsonNode *root = json_node_new (JSON_NODE_OBJECT);
-    JsonGenerator *generator = json_generator_new ();
-
-    json_node_take_object (root, jobj);
-    json_generator_set_root (generator, root);
-    g_object_set (generator, "pretty", FALSE, NULL);
-
-    data = json_generator_to_data (generator, NULL);
-
-    json_node_free (root);
-    g_object_unref (generator);
-    return data;
+    return g_string_free (writer.buf, FALSE);
 }
 
 #ifdef WIN32
@@ -1292,6 +1728,296 @@ dec_error:
     return -1;
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x1000100fL
+#define HAVE_AES_GCM 1
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
+    !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+#define HAVE_CHACHA20_POLY1305 1
+#endif
+
+static const char *cipher_names[] = {
+    "aes-256-cbc",
+    "aes-256-gcm",
+    "chacha20-poly1305",
+    NULL
+};
+
+const char *
+ccnet_cipher_to_string (int cipher)
+{
+    if (cipher < 0 || cipher > CCNET_CIPHER_CHACHA20_POLY1305)
+        return NULL;
+    return cipher_names[cipher];
+}
+
+int
+ccnet_cipher_from_string (const char *name)
+{
+    int i;
+
+    if (!name)
+        return -1;
+    for (i = 0; cipher_names[i]; i++)
+        if (strcmp (cipher_names[i], name) == 0)
+            return i;
+    return -1;
+}
+
+static const EVP_CIPHER *
+get_evp_cipher (int cipher)
+{
+    switch (cipher) {
+    case CCNET_CIPHER_AES_256_CBC:
+        return EVP_aes_256_cbc();
+#ifdef HAVE_AES_GCM
+    case CCNET_CIPHER_AES_256_GCM:
+        return EVP_aes_256_gcm();
+#endif
+#ifdef HAVE_CHACHA20_POLY1305
+    case CCNET_CIPHER_CHACHA20_POLY1305:
+        return EVP_chacha20_poly1305();
+#endif
+    default:
+        return NULL;
+    }
+}
+
+gboolean
+ccnet_cipher_is_supported (int cipher)
+{
+    return get_evp_cipher (cipher) != NULL;
+}
+
+EVP_CIPHER_CTX *
+ccnet_cipher_ctx_new (int cipher,
+                      int enc,
+                      const unsigned char *key,
+                      const unsigned char *iv)
+{
+    EVP_CIPHER_CTX *ctx;
+    const EVP_CIPHER *evp_cipher = get_evp_cipher (cipher);
+
+    if (evp_cipher == NULL || key == NULL || iv == NULL) {
+        g_warning ("Invalid params.\n");
+        return NULL;
+    }
+
+    ctx = EVP_CIPHER_CTX_new ();
+    if (ctx == NULL) {
+        g_warning ("failed to allocate EVP_CIPHER_CTX.\n");
+        return NULL;
+    }
+
+    /* AEAD ciphers get their nonce per packet, only set the key here. */
+    if (EVP_CipherInit_ex (ctx, evp_cipher, NULL, key,
+                           CCNET_CIPHER_IS_AEAD(cipher) ? NULL : iv,
+                           enc) == ENC_FAILURE) {
+        g_warning ("error init\n");
+        EVP_CIPHER_CTX_free (ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void
+ccnet_cipher_ctx_free (EVP_CIPHER_CTX *ctx)
+{
+    if (ctx)
+        EVP_CIPHER_CTX_free (ctx);
+}
+
+int
+ccnet_encrypt_with_ctx (EVP_CIPHER_CTX *ctx,
+                        const unsigned char *iv,
+                        char *data_out,
+                        int *out_len,
+                        const char *data_in,
+                        const int in_len)
+{
+    int update_len, final_len;
+
+    *out_len = -1;
+
+    if (ctx == NULL || data_in == NULL || in_len <= 0) {
+        g_warning ("Invalid params.\n");
+        return -1;
+    }
+
+    /* Only reset the IV, the key schedule is kept in ctx. */
+    if (EVP_EncryptInit_ex (ctx, NULL, NULL, NULL, iv) == ENC_FAILURE)
+        return -1;
+
+    if (EVP_EncryptUpdate (ctx,
+                           (unsigned char*)data_out,
+                           &update_len,
+                           (unsigned char*)data_in,
+                           in_len) == ENC_FAILURE)
+        return -1;
+
+    if (EVP_EncryptFinal_ex (ctx,
+                             (unsigned char*)data_out + update_len,
+                             &final_len) == ENC_FAILURE)
+        return -1;
+
+    *out_len = update_len + final_len;
+    return 0;
+}
+
+int
+ccnet_decrypt_with_ctx (EVP_CIPHER_CTX *ctx,
+                        const unsigned char *iv,
+                        char *data_out,
+                        int *out_len,
+                        const char *data_in,
+                        const int in_len)
+{
+    int update_len, final_len;
+
+    *out_len = -1;
+
+    /* Because padding is always used, in_len must be a multiple of
+     * BLK_SIZE */
+    if (ctx == NULL || data_in == NULL || in_len <= 0 ||
+        in_len % BLK_SIZE != 0) {
+        g_warning ("Invalid param(s).\n");
+        return -1;
+    }
+
+    if (EVP_DecryptInit_ex (ctx, NULL, NULL, NULL, iv) == DEC_FAILURE)
+        return -1;
+
+    if (EVP_DecryptUpdate (ctx,
+                           (unsigned char*)data_out,
+                           &update_len,
+                           (unsigned char*)data_in,
+                           in_len) == DEC_FAILURE)
+        return -1;
+
+    if (EVP_DecryptFinal_ex (ctx,
+                             (unsigned char*)data_out + update_len,
+                             &final_len) == DEC_FAILURE)
+        return -1;
+
+    *out_len = update_len + final_len;
+    return 0;
+}
+
+#ifdef HAVE_AES_GCM
+
+int
+ccnet_aead_encrypt_with_ctx (EVP_CIPHER_CTX *ctx,
+                             const unsigned char *nonce,
+                             char *data_out,
+                             int *out_len,
+                             const char *data_in,
+                             const int in_len)
+{
+    int update_len, final_len;
+
+    *out_len = -1;
+
+    if (ctx == NULL || nonce == NULL || data_in == NULL || in_len <= 0) {
+        g_warning ("Invalid params.\n");
+        return -1;
+    }
+
+    if (EVP_EncryptInit_ex (ctx, NULL, NULL, NULL, nonce) == ENC_FAILURE)
+        return -1;
+
+    if (EVP_EncryptUpdate (ctx,
+                           (unsigned char*)data_out,
+                           &update_len,
+                           (unsigned char*)data_in,
+                           in_len) == ENC_FAILURE)
+        return -1;
+
+    if (EVP_EncryptFinal_ex (ctx,
+                             (unsigned char*)data_out + update_len,
+                             &final_len) == ENC_FAILURE)
+        return -1;
+
+    if (EVP_CIPHER_CTX_ctrl (ctx, EVP_CTRL_GCM_GET_TAG, CCNET_AEAD_TAG_SIZE,
+                             data_out + update_len + final_len) == ENC_FAILURE)
+        return -1;
+
+    *out_len = update_len + final_len + CCNET_AEAD_TAG_SIZE;
+    return 0;
+}
+
+int
+ccnet_aead_decrypt_with_ctx (EVP_CIPHER_CTX *ctx,
+                             const unsigned char *nonce,
+                             char *data_out,
+                             int *out_len,
+                             const char *data_in,
+                             const int in_len)
+{
+    int update_len, final_len;
+    int clen = in_len - CCNET_AEAD_TAG_SIZE;
+
+    *out_len = -1;
+
+    if (ctx == NULL || nonce == NULL || data_in == NULL || clen <= 0) {
+        g_warning ("Invalid param(s).\n");
+        return -1;
+    }
+
+    if (EVP_DecryptInit_ex (ctx, NULL, NULL, NULL, nonce) == DEC_FAILURE)
+        return -1;
+
+    /* Set the expected tag before decrypting, data_out may overlap it. */
+    if (EVP_CIPHER_CTX_ctrl (ctx, EVP_CTRL_GCM_SET_TAG, CCNET_AEAD_TAG_SIZE,
+                             (void *)(data_in + clen)) == DEC_FAILURE)
+        return -1;
+
+    if (EVP_DecryptUpdate (ctx,
+                           (unsigned char*)data_out,
+                           &update_len,
+                           (unsigned char*)data_in,
+                           clen) == DEC_FAILURE)
+        return -1;
+
+    /* Fails if the tag does not match. */
+    if (EVP_DecryptFinal_ex (ctx,
+                             (unsigned char*)data_out + update_len,
+                             &final_len) == DEC_FAILURE)
+        return -1;
+
+    *out_len = update_len + final_len;
+    return 0;
+}
+
+#else
+
+int
+ccnet_aead_encrypt_with_ctx (EVP_CIPHER_CTX *ctx,
+                             const unsigned char *nonce,
+                             char *data_out,
+                             int *out_len,
+                             const char *data_in,
+                             const int in_len)
+{
+    *out_len = -1;
+    return -1;
+}
+
+int
+ccnet_aead_decrypt_with_ctx (EVP_CIPHER_CTX *ctx,
+                             const unsigned char *nonce,
+                             char *data_out,
+                             int *out_len,
+                             const char *data_in,
+                             const int in_len)
+{
+    *out_len = -1;
+    return -1;
+}
+
+#endif  /* HAVE_AES_GCM */
+
 /* convert locale specific input to utf8 encoded string  */
 char *ccnet_locale_to_utf8 (const gchar *src)
 {
@@ -1681,7 +2407,8 @@ calc_recursively (const char *path, GError **calc_error)
         } else if (S_ISREG(sb.st_mode)) {
             sum += sb.st_size;
             g_free(full_path);
-        }
+        } else
+            g_free(full_path);
     }
 
     g_dir_close (folder);
@@ -1694,3 +2421,327 @@ ccnet_calc_directory_size (const char *path, GError **error)
     return calc_recursively (path, error);
 }
 
+
+/*
+ * Directory size cache.
+ *
+ * The size of each directory is kept in a tree of nodes: the regular
+ * files directly inside it plus the totals of its subdirectories. A
+ * directory whose entries may have changed is re-read, the others are
+ * reused as they are.
+ *
+ * With inotify every directory is watched and only the directories it
+ * reports are re-read, so a query costs nothing when nothing changed.
+ * Without it, or once the watch limit is reached, the directories are
+ * stat-ed on each query and re-read when their mtime moved. That only
+ * notices entries being added, removed or renamed; a file growing in
+ * place is counted when its directory next changes.
+ */
+
+typedef struct DirNode DirNode;
+
+struct DirNode {
+    char        *path;
+    DirNode     *parent;
+    GHashTable  *subdirs;       /* name -> DirNode */
+    gint64       mtime;         /* of the directory when read, or -1 */
+    gint64       files;         /* regular files directly inside */
+    gint64       total;
+    int          wd;            /* inotify watch, or -1 */
+    guint        dirty : 1;     /* re-read the entries */
+    guint        below : 1;     /* something under it is dirty */
+};
+
+struct CcnetDirSizeCache {
+    DirNode     *root;
+    int          inotify_fd;    /* -1 when polling mtimes */
+    GHashTable  *watches;       /* wd -> DirNode */
+};
+
+static void free_dir_node (CcnetDirSizeCache *cache, DirNode *node);
+
+static DirNode *
+dir_node_new (const char *path, DirNode *parent)
+{
+    DirNode *node = g_new0 (DirNode, 1);
+
+    node->path = g_strdup (path);
+    node->parent = parent;
+    node->subdirs = g_hash_table_new (g_str_hash, g_str_equal);
+    node->mtime = -1;
+    node->wd = -1;
+    node->dirty = 1;
+    return node;
+}
+
+static void
+free_subdirs (CcnetDirSizeCache *cache, GHashTable *subdirs)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init (&iter, subdirs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        g_free (key);
+        free_dir_node (cache, value);
+    }
+    g_hash_table_destroy (subdirs);
+}
+
+static void
+free_dir_node (CcnetDirSizeCache *cache, DirNode *node)
+{
+#ifdef __linux__
+    if (node->wd >= 0) {
+        g_hash_table_remove (cache->watches, GINT_TO_POINTER(node->wd));
+        inotify_rm_watch (cache->inotify_fd, node->wd);
+    }
+#endif
+    free_subdirs (cache, node->subdirs);
+    g_free (node->path);
+    g_free (node);
+}
+
+static void
+mark_dirty (DirNode *node)
+{
+    node->dirty = 1;
+    for (; node && !node->below; node = node->parent)
+        node->below = 1;
+}
+
+#ifdef __linux__
+
+#define DIR_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+                          IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+                          IN_MOVE_SELF | IN_ONLYDIR)
+
+static void
+mark_all_dirty (DirNode *node)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    node->dirty = node->below = 1;
+    g_hash_table_iter_init (&iter, node->subdirs);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        mark_all_dirty (value);
+}
+
+static void
+clear_watches (DirNode *node)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    node->wd = -1;
+    g_hash_table_iter_init (&iter, node->subdirs);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        clear_watches (value);
+}
+
+/* Go on by polling mtimes, e.g. when out of watches. */
+static void
+stop_inotify (CcnetDirSizeCache *cache)
+{
+    g_warning ("Stop watching %s: %s\n", cache->root->path, strerror(errno));
+    close (cache->inotify_fd);
+    cache->inotify_fd = -1;
+    g_hash_table_remove_all (cache->watches);
+    clear_watches (cache->root);
+    mark_all_dirty (cache->root);
+}
+
+static void
+add_watch (CcnetDirSizeCache *cache, DirNode *node)
+{
+    if (cache->inotify_fd < 0 || node->wd >= 0)
+        return;
+
+    node->wd = inotify_add_watch (cache->inotify_fd, node->path,
+                                  DIR_WATCH_EVENTS);
+    if (node->wd < 0) {
+        if (errno == ENOSPC || errno == ENOMEM)
+            stop_inotify (cache);
+        return;
+    }
+    g_hash_table_insert (cache->watches, GINT_TO_POINTER(node->wd), node);
+}
+
+static void
+read_events (CcnetDirSizeCache *cache)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    DirNode *node;
+    ssize_t n;
+    char *ptr;
+
+    while (cache->inotify_fd >= 0 &&
+           (n = read (cache->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (ptr = buf; ptr < buf + n;
+             ptr += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *)ptr;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                mark_all_dirty (cache->root);
+                continue;
+            }
+            node = g_hash_table_lookup (cache->watches,
+                                        GINT_TO_POINTER(ev->wd));
+            if (!node)
+                continue;
+            if (ev->mask & IN_IGNORED) {
+                /* Gone, the parent drops the node when re-read. */
+                g_hash_table_remove (cache->watches, GINT_TO_POINTER(ev->wd));
+                node->wd = -1;
+            }
+            mark_dirty (node);
+            if (node->parent &&
+                (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)))
+                mark_dirty (node->parent);
+        }
+    }
+}
+
+#endif  /* __linux__ */
+
+/* Re-read the entries of @node, keeping the nodes of the subdirectories
+ * which are still there. */
+static int
+read_dir_node (CcnetDirSizeCache *cache, DirNode *node, GError **error)
+{
+    GHashTable *old = node->subdirs;
+    GError *err = NULL;
+    STAT_STRUCT sb;
+    const char *name;
+    char *full_path;
+    DirNode *sub;
+    gpointer key;
+    GDir *dir;
+
+#ifdef __linux__
+    /* Watch before reading, so no change is lost in between. */
+    add_watch (cache, node);
+#endif
+
+    if (STAT_FUNC (node->path, &sb) < 0) {
+        g_set_error (error, CCNET_DOMAIN, 0, "failed to stat on %s: %s\n",
+                     node->path, strerror(errno));
+        return -1;
+    }
+    dir = g_dir_open (node->path, 0, &err);
+    if (!dir) {
+        g_set_error (error, CCNET_DOMAIN, 0,
+                     "g_open() dir %s failed:%s\n", node->path, err->message);
+        g_clear_error (&err);
+        return -1;
+    }
+
+    /* Changed in this very second, it may change again unseen. */
+    node->mtime = (sb.st_mtime >= time(NULL)) ? -1 : sb.st_mtime;
+    node->files = 0;
+    node->subdirs = g_hash_table_new (g_str_hash, g_str_equal);
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        full_path = g_build_filename (node->path, name, NULL);
+        if (STAT_FUNC (full_path, &sb) < 0) {
+            /* removed since read, the next event or mtime catches it */
+            g_free (full_path);
+            continue;
+        }
+
+        if (S_ISREG(sb.st_mode))
+            node->files += sb.st_size;
+        else if (S_ISDIR(sb.st_mode)) {
+            if (g_hash_table_lookup_extended (old, name, &key,
+                                              (gpointer *)&sub))
+                g_hash_table_steal (old, name);
+            else {
+                key = g_strdup (name);
+                sub = dir_node_new (full_path, node);
+            }
+            g_hash_table_insert (node->subdirs, key, sub);
+        }
+        g_free (full_path);
+    }
+    g_dir_close (dir);
+
+    free_subdirs (cache, old);
+    node->dirty = 0;
+    return 0;
+}
+
+static int
+refresh_dir_node (CcnetDirSizeCache *cache, DirNode *node, GError **error)
+{
+    GHashTableIter iter;
+    gpointer value;
+    DirNode *sub;
+    STAT_STRUCT sb;
+
+    if (cache->inotify_fd < 0) {
+        if (STAT_FUNC (node->path, &sb) < 0 ||
+            node->mtime != (gint64)sb.st_mtime)
+            node->dirty = 1;
+        node->below = 1;
+    }
+    if (!node->dirty && !node->below)
+        return 0;
+
+    if (node->dirty && read_dir_node (cache, node, error) < 0)
+        return -1;
+
+    node->total = node->files;
+    g_hash_table_iter_init (&iter, node->subdirs);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        sub = value;
+        if (refresh_dir_node (cache, sub, error) < 0)
+            return -1;
+        node->total += sub->total;
+    }
+    node->below = 0;
+    return 0;
+}
+
+CcnetDirSizeCache *
+ccnet_dir_size_cache_new (const char *path)
+{
+    CcnetDirSizeCache *cache = g_new0 (CcnetDirSizeCache, 1);
+
+    cache->root = dir_node_new (path, NULL);
+    cache->watches = g_hash_table_new (g_direct_hash, g_direct_equal);
+#ifdef __linux__
+    cache->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+#else
+    cache->inotify_fd = -1;
+#endif
+    return cache;
+}
+
+gint64
+ccnet_dir_size_cache_get (CcnetDirSizeCache *cache, GError **error)
+{
+#ifdef __linux__
+    read_events (cache);
+#endif
+    if (refresh_dir_node (cache, cache->root, error) < 0) {
+        /* Try again from scratch next time. */
+        mark_dirty (cache->root);
+        return -1;
+    }
+    return cache->root->total;
+}
+
+void
+ccnet_dir_size_cache_free (CcnetDirSizeCache *cache)
+{
+    if (!cache)
+        return;
+    free_dir_node (cache, cache->root);
+#ifdef __linux__
+    if (cache->inotify_fd >= 0)
+        close (cache->inotify_fd);
+#endif
+    g_hash_table_destroy (cache->watches);
+    g_free (cache);
+}
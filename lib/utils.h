@@ -11,6 +11,7 @@
 #include <glib-object.h>
 #include <stdlib.h>
 #include <evutil.h>
+#include <openssl/evp.h>
 
 #ifdef WIN32
 #include <errno.h>
@@ -159,9 +160,95 @@ GList *string_list_parse (const char *list_in_str, const char *seperator);
 GList *string_list_parse_sorted (const char *list_in_str, const char *seperator);
 gboolean string_list_sorted_is_equal (GList *list1, GList *list2);
 
+/*
+ * Interned strings with a reference count, for names coming from peers
+ * and clients, such as message apps. Unlike g_intern_string() they are
+ * freed with their last reference, so arbitrary names don't pile up.
+ * Equal strings share one copy and can be compared as pointers.
+ * NULL is passed through. Thread safe.
+ */
+const char *ccnet_str_ref (const char *string);
+void ccnet_str_unref (const char *string);
+
+/*
+ * A sorted set of interned strings, for lists such as roles which are
+ * looked up far more often than changed. Members are shared and never
+ * freed. Above a few members a hash table indexes them. A zeroed
+ * struct is an empty set.
+ */
+typedef struct CcnetStrSet {
+    const char **items;
+    guint        len;
+    guint        alloc;
+    GHashTable  *index;
+} CcnetStrSet;
+
+#define ccnet_str_set_size(set) ((set)->len)
+#define ccnet_str_set_index(set,i) ((set)->items[(i)])
+
+/* The interned member equal to @string, or NULL. */
+const char *ccnet_str_set_lookup (const CcnetStrSet *set, const char *string);
+/* The interned string if it was added, NULL if it was there already. */
+const char *ccnet_str_set_add (CcnetStrSet *set, const char *string);
+/* The interned string if it was removed, NULL if it wasn't there. */
+const char *ccnet_str_set_remove (CcnetStrSet *set, const char *string);
+void ccnet_str_set_clear (CcnetStrSet *set);
+void ccnet_str_set_parse (CcnetStrSet *set, const char *list_in_str,
+                          const char *seperator);
+void ccnet_str_set_join (const CcnetStrSet *set, GString *strbuf,
+                         const char *seperator);
+gboolean ccnet_str_set_equal (const CcnetStrSet *set1,
+                              const CcnetStrSet *set2);
+
 char** ncopy_string_array (char **orig, int n);
 void nfree_string_array (char **array, int n);
 
+/*
+ * Writes JSON straight into a GString, without building a tree.
+ * Members come out in call order, so keys must not repeat. A NULL key
+ * is for the top-level value.
+ */
+typedef struct CcnetJsonWriter {
+    GString  *buf;
+    gboolean  need_comma;
+} CcnetJsonWriter;
+
+void ccnet_json_writer_init (CcnetJsonWriter *writer, GString *buf);
+void ccnet_json_begin_object (CcnetJsonWriter *writer, const char *key);
+void ccnet_json_end_object (CcnetJsonWriter *writer);
+/* A NULL @value is written as null. */
+void ccnet_json_add_string (CcnetJsonWriter *writer, const char *key,
+                            const char *value);
+void ccnet_json_add_int (CcnetJsonWriter *writer, const char *key,
+                         gint64 value);
+void ccnet_json_add_bool (CcnetJsonWriter *writer, const char *key,
+                          gboolean value);
+
+/*
+ * Reads the arguments of a searpc call ["fname", arg, ...] without
+ * building a tree. The call is copied once, and the strings returned
+ * point into the copy, so they live until ccnet_json_args_free().
+ * Anything other than integers, strings and null sets @error.
+ */
+#define CCNET_JSON_ARGS_STACK   512
+
+typedef struct CcnetJsonArgs {
+    char     *buf;
+    char     *p;
+    char     *end;
+    gboolean  error;
+    char      stack[CCNET_JSON_ARGS_STACK];
+} CcnetJsonArgs;
+
+/* Returns -1, with nothing to free, if @fcall doesn't start like a
+ * call. */
+int ccnet_json_args_init (CcnetJsonArgs *args, const char *fcall, gsize len);
+gint64 ccnet_json_args_get_int (CcnetJsonArgs *args);
+/* null is returned as NULL. */
+const char *ccnet_json_args_get_string (CcnetJsonArgs *args);
+/* TRUE if there was no error and all arguments were read. */
+gboolean ccnet_json_args_end (CcnetJsonArgs *args);
+void ccnet_json_args_free (CcnetJsonArgs *args);
 
 gchar *
 key_value_list_to_json(const char *first, ...) G_GNUC_NULL_TERMINATED;
@@ -203,6 +290,82 @@ ccnet_decrypt_with_key (char **data_out,
                         const unsigned char *key,
                         const unsigned char *iv);
 
+/*
+ * Persistent cipher contexts for encrypted channels. The key is expanded
+ * once in ccnet_cipher_ctx_new(); each call below only resets the IV
+ * (or nonce), so no allocation or key setup happens per packet.
+ *
+ * data_out must have room for in_len + CCNET_CIPHER_BLOCK_SIZE bytes when
+ * encrypting, which covers both the CBC padding and the AEAD tag.
+ * Decryption may be done in place (data_out == data_in).
+ */
+#define CCNET_CIPHER_BLOCK_SIZE 16
+#define CCNET_AEAD_TAG_SIZE     16
+#define CCNET_AEAD_NONCE_SIZE   12
+
+enum {
+    CCNET_CIPHER_AES_256_CBC = 0,
+    CCNET_CIPHER_AES_256_GCM,
+    CCNET_CIPHER_CHACHA20_POLY1305,
+};
+
+#define CCNET_CIPHER_IS_AEAD(c) ((c) != CCNET_CIPHER_AES_256_CBC)
+
+const char *
+ccnet_cipher_to_string (int cipher);
+
+/* Returns -1 if the name is unknown. */
+int
+ccnet_cipher_from_string (const char *name);
+
+/* Whether the linked OpenSSL provides the cipher. */
+gboolean
+ccnet_cipher_is_supported (int cipher);
+
+EVP_CIPHER_CTX *
+ccnet_cipher_ctx_new (int cipher,
+                      int enc,
+                      const unsigned char *key,
+                      const unsigned char *iv);
+
+void
+ccnet_cipher_ctx_free (EVP_CIPHER_CTX *ctx);
+
+int
+ccnet_encrypt_with_ctx (EVP_CIPHER_CTX *ctx,
+                        const unsigned char *iv,
+                        char *data_out,
+                        int *out_len,
+                        const char *data_in,
+                        const int in_len);
+
+int
+ccnet_decrypt_with_ctx (EVP_CIPHER_CTX *ctx,
+                        const unsigned char *iv,
+                        char *data_out,
+                        int *out_len,
+                        const char *data_in,
+                        const int in_len);
+
+/* The tag is appended to the ciphertext on encryption, and checked and
+ * stripped on decryption. nonce is CCNET_AEAD_NONCE_SIZE bytes.
+ */
+int
+ccnet_aead_encrypt_with_ctx (EVP_CIPHER_CTX *ctx,
+                             const unsigned char *nonce,
+                             char *data_out,
+                             int *out_len,
+                             const char *data_in,
+                             const int in_len);
+
+int
+ccnet_aead_decrypt_with_ctx (EVP_CIPHER_CTX *ctx,
+                             const unsigned char *nonce,
+                             char *data_out,
+                             int *out_len,
+                             const char *data_in,
+                             const int in_len);
+
 int
 ccnet_encrypt (char **data_out,
                int *out_len,
@@ -337,4 +500,14 @@ char* ccnet_object_type_from_id (const char *object_id);
 
 gint64 ccnet_calc_directory_size (const char *path, GError **error);
 
+/*
+ * Size of a directory tree for callers which ask repeatedly. Only what
+ * changed since the last call is walked again; see utils.c.
+ */
+typedef struct CcnetDirSizeCache CcnetDirSizeCache;
+
+CcnetDirSizeCache *ccnet_dir_size_cache_new (const char *path);
+gint64 ccnet_dir_size_cache_get (CcnetDirSizeCache *cache, GError **error);
+void ccnet_dir_size_cache_free (CcnetDirSizeCache *cache);
+
 #endif
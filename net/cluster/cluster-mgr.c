@@ -3,6 +3,8 @@
 #include "common.h"
 
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <dirent.h>
 #include <stdio.h>
 #include <glib/gstdio.h>
@@ -16,20 +18,128 @@
 #include "connect-mgr.h"
 
 #include "message.h"
+#include "peermgr-message.h"
+#include "proc-factory.h"
+#include "algorithms.h"
 #include "utils.h"
+#include "cache-bus.h"
 
 #define DEBUG_FLAG  CCNET_DEBUG_PEER
 #include "log.h"
 
 extern CcnetSession  *session;
 extern CcnetSession  *inner_session;
+extern CcnetClusterManager *cluster_mgr;
 
 
+#define LOAD_REPORT_INTERVAL  5000    /* 5s */
+#define LOAD_REPORT_STALE     30      /* seconds */
+#define PROCS_PER_PEER        8       /* processors weighing as much as a peer */
+#define RING_POINTS           64      /* hash ring points per unit of weight */
+#define FLUSH_INTERVAL        100     /* ms, for batched inner messages */
+#define LOCATION_BATCH        700     /* peer ids per location message */
+#define FORWARD_BATCH_BYTES   (32 * 1024)
+
+enum {
+    POLICY_RANDOM,
+    POLICY_LEAST_LOADED,
+    POLICY_TWO_CHOICES,
+    POLICY_HASH,
+};
+
+/* Last load report of a member, see send_load_reports(). */
+typedef struct MemberLoad {
+    int     peers;              /* connected peers */
+    int     procs;              /* processors alive */
+    int     cpu;                /* permille of a cpu */
+    int     weight;
+    time_t  updated;
+    int     pending;            /* redirected to it since the report */
+} MemberLoad;
+
+typedef struct RingPoint {
+    guint32    hash;
+    CcnetPeer *peer;
+} RingPoint;
+
 struct CcnetClusterManagerPriv {
-    int dummy;
+    int          policy;
+    int          weight;        /* of this node, sent in load reports */
+    gboolean     handoff;       /* send peer state along with redirects */
+    gboolean     cache_bus;     /* pass cache invalidations around */
+
+    GHashTable  *loads;         /* member -> MemberLoad */
+
+    /* member -> its link in manager->members, for O(1) removal */
+    GHashTable  *member_links;
+
+    GArray      *ring;          /* RingPoint sorted by hash, NULL if stale */
+
+    /* for the cpu usage of this process */
+    struct timeval  last_wall;
+    struct timeval  last_cpu;
+
+    /* Peers connected to other nodes: peer id -> member. */
+    GHashTable  *locations;
+
+    /* "+<id>" and "-<id>" lines not yet announced */
+    GString     *location_updates;
+    int          n_location_updates;
+
+    /* member -> GString of messages to forward, see flush_forwards() */
+    GHashTable  *forward_queues;
 };
 
 
+static void
+free_gstring (GString *buf)
+{
+    g_string_free (buf, TRUE);
+}
+
+static void
+init_config (CcnetClusterManager *manager)
+{
+    CcnetClusterManagerPriv *priv = manager->priv;
+    GKeyFile *keyf = inner_session->keyf;
+    char *policy;
+
+    priv->policy = POLICY_TWO_CHOICES;
+    priv->weight = 1;
+    priv->handoff = TRUE;
+    priv->cache_bus = TRUE;
+
+    policy = g_key_file_get_string (keyf, "Cluster", "REDIRECT_POLICY", NULL);
+    if (policy) {
+        if (g_strcmp0 (policy, "random") == 0)
+            priv->policy = POLICY_RANDOM;
+        else if (g_strcmp0 (policy, "least-loaded") == 0)
+            priv->policy = POLICY_LEAST_LOADED;
+        else if (g_strcmp0 (policy, "two-choices") == 0)
+            priv->policy = POLICY_TWO_CHOICES;
+        else if (g_strcmp0 (policy, "hash") == 0)
+            priv->policy = POLICY_HASH;
+        else
+            ccnet_warning ("Unknown redirect policy %s\n", policy);
+        g_free (policy);
+    }
+
+    if (g_key_file_has_key (keyf, "Cluster", "WEIGHT", NULL))
+        priv->weight = g_key_file_get_integer (keyf, "Cluster", "WEIGHT", NULL);
+    if (priv->weight <= 0)
+        priv->weight = 1;
+
+    if (g_key_file_has_key (keyf, "Cluster", "REDIRECT_HANDOFF", NULL))
+        priv->handoff = g_key_file_get_boolean (keyf, "Cluster",
+                                                "REDIRECT_HANDOFF", NULL);
+
+    if (g_key_file_has_key (keyf, "Cluster", "CACHE_INVALIDATION", NULL))
+        priv->cache_bus = g_key_file_get_boolean (keyf, "Cluster",
+                                                  "CACHE_INVALIDATION", NULL);
+    if (priv->cache_bus)
+        ccnet_cache_bus_enable ();
+}
+
 CcnetClusterManager*
 ccnet_cluster_manager_new ()
 {
@@ -38,6 +148,16 @@ ccnet_cluster_manager_new ()
     manager = g_new0 (CcnetClusterManager, 1);
 
     manager->priv = g_new0 (CcnetClusterManagerPriv, 1);
+    manager->priv->loads = g_hash_table_new_full (g_direct_hash,
+                                                  g_direct_equal,
+                                                  NULL, g_free);
+    manager->priv->member_links = g_hash_table_new (g_direct_hash,
+                                                    g_direct_equal);
+    manager->priv->locations = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      g_free, NULL);
+    manager->priv->location_updates = g_string_new (NULL);
+    manager->priv->forward_queues = g_hash_table_new_full (
+        g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)free_gstring);
 
     return manager;
 }
@@ -48,12 +168,33 @@ ccnet_cluster_manager_free (CcnetClusterManager *manager)
     g_object_unref (manager);
 }
 
+static void
+invalidate_ring (CcnetClusterManager *manager)
+{
+    if (manager->priv->ring) {
+        g_array_free (manager->priv->ring, TRUE);
+        manager->priv->ring = NULL;
+    }
+}
+
+static int send_load_reports (void *vmanager);
+static int get_cpu_usage (CcnetClusterManager *manager);
+static int flush_pulse (void *vmanager);
+static void forget_node (CcnetClusterManager *manager, CcnetPeer *member);
+static void flush_cache_events (CcnetClusterManager *manager,
+                                gboolean heartbeat);
+
 void
 ccnet_cluster_manager_start (CcnetClusterManager *manager)
 {
     /* find peers with role ClusterMemeber and add to list */
     GList *peers, *ptr;
 
+    init_config (manager);
+    get_cpu_usage (manager);
+    ccnet_timer_new (send_load_reports, manager, LOAD_REPORT_INTERVAL);
+    ccnet_timer_new (flush_pulse, manager, FLUSH_INTERVAL);
+
     peers = ccnet_peer_manager_get_peers_with_role (
         inner_session->peer_mgr, "ClusterMember");
     for (ptr = peers; ptr; ptr = ptr->next) {
@@ -72,30 +213,58 @@ ccnet_cluster_manager_start (CcnetClusterManager *manager)
     g_list_free (peers);
 }
 
+static gboolean
+is_member (CcnetClusterManager *manager, CcnetPeer *peer)
+{
+    return g_hash_table_lookup (manager->priv->member_links, peer) != NULL;
+}
+
+static void
+add_to_members (CcnetClusterManager *manager, CcnetPeer *peer)
+{
+    if (is_member (manager, peer))
+        return;
+    manager->members = g_list_prepend (manager->members, peer);
+    g_hash_table_insert (manager->priv->member_links, peer, manager->members);
+    g_object_ref (peer);
+    invalidate_ring (manager);
+}
+
+static gboolean
+remove_from_members (CcnetClusterManager *manager, CcnetPeer *peer)
+{
+    GList *link = g_hash_table_lookup (manager->priv->member_links, peer);
+
+    if (!link)
+        return FALSE;
+    manager->members = g_list_delete_link (manager->members, link);
+    g_hash_table_remove (manager->priv->member_links, peer);
+    g_hash_table_remove (manager->priv->loads, peer);
+    forget_node (manager, peer);
+    invalidate_ring (manager);
+    g_object_unref (peer);
+    return TRUE;
+}
+
 void
 ccnet_cluster_manager_add_member (CcnetClusterManager *manager,
                                   CcnetPeer *peer)
 {
-    manager->members = g_list_prepend (manager->members, peer);
-    g_object_ref (peer);
+    add_to_members (manager, peer);
 }
 
 void
 ccnet_cluster_manager_remove_member (CcnetClusterManager *manager,
                                      CcnetPeer *peer)
 {
-    if (!g_list_find (manager->members, peer))
-        return;
-    manager->members = g_list_remove (manager->members, peer);
-    g_object_unref (peer);
+    remove_from_members (manager, peer);
 }
 
 void
 ccnet_cluster_manager_add_master (CcnetClusterManager *manager,
                                   CcnetPeer *peer)
 {
-    manager->members = g_list_prepend (manager->members, peer);
-    g_object_ref (peer);
+    add_to_members (manager, peer);
     ccnet_conn_manager_add_to_conn_list (
         inner_session->connMgr, peer);
 }
@@ -104,46 +273,715 @@ void
 ccnet_cluster_manager_remove_master (CcnetClusterManager *manager,
                                      CcnetPeer *peer)
 {
-    if (!g_list_find (manager->members, peer))
+    if (!remove_from_members (manager, peer))
         return;
-    manager->members = g_list_remove (manager->members, peer);
-    g_object_unref (peer);
 
     ccnet_conn_manager_remove_from_conn_list (
         inner_session->connMgr, peer);
 }
 
+/* -------- redirect destination -------- */
+
+static MemberLoad *
+get_load (CcnetClusterManager *manager, CcnetPeer *member)
+{
+    MemberLoad *load = g_hash_table_lookup (manager->priv->loads, member);
+
+    if (!load) {
+        load = g_new0 (MemberLoad, 1);
+        load->weight = 1;
+        g_hash_table_insert (manager->priv->loads, member, load);
+    }
+    return load;
+}
+
+/* Lower is better. Members we have no fresh report of only count the
+ * peers we sent them. */
+static double
+load_score (CcnetClusterManager *manager, CcnetPeer *member, time_t now)
+{
+    MemberLoad *load = get_load (manager, member);
+    double n = load->pending;
+
+    if (load->updated + LOAD_REPORT_STALE < now)
+        return n / load->weight;
+
+    n += load->peers + (double)load->procs / PROCS_PER_PEER;
+    return n * (1000 + load->cpu) / 1000 / load->weight;
+}
+
+static gint
+compare_ring_point (gconstpointer a, gconstpointer b)
+{
+    guint32 x = ((const RingPoint *)a)->hash, y = ((const RingPoint *)b)->hash;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static guint32
+ring_hash (const char *str)
+{
+    unsigned char sha1[20];
+
+    calculate_sha1 (sha1, str);
+    return (guint32)sha1[0] << 24 | sha1[1] << 16 | sha1[2] << 8 | sha1[3];
+}
+
+static void
+build_ring (CcnetClusterManager *manager)
+{
+    GArray *ring = g_array_new (FALSE, FALSE, sizeof(RingPoint));
+    GList *ptr;
+    char buf[64];
+    int i;
+
+    for (ptr = manager->members; ptr; ptr = ptr->next) {
+        CcnetPeer *member = ptr->data;
+        int n = RING_POINTS * get_load (manager, member)->weight;
+
+        for (i = 0; i < n; i++) {
+            RingPoint point;
+
+            snprintf (buf, sizeof(buf), "%s-%d", member->id, i);
+            point.hash = ring_hash (buf);
+            point.peer = member;
+            g_array_append_val (ring, point);
+        }
+    }
+    g_array_sort (ring, compare_ring_point);
+    manager->priv->ring = ring;
+}
+
+/* First connected member after the hash of @peer's id on the ring, so
+ * that a peer keeps landing on the same node. */
+static CcnetPeer *
+find_by_hash (CcnetClusterManager *manager, CcnetPeer *peer)
+{
+    GArray *ring;
+    guint32 hash;
+    guint lo, hi, i;
+
+    if (!manager->priv->ring)
+        build_ring (manager);
+    ring = manager->priv->ring;
+    if (ring->len == 0)
+        return NULL;
+
+    hash = ring_hash (peer->id);
+    lo = 0;
+    hi = ring->len;
+    while (lo < hi) {
+        guint mid = (lo + hi) / 2;
+        if (g_array_index (ring, RingPoint, mid).hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (i = 0; i < ring->len; i++) {
+        CcnetPeer *member = g_array_index (ring, RingPoint,
+                                           (lo + i) % ring->len).peer;
+        if (member->net_state == PEER_CONNECTED)
+            return member;
+    }
+    return NULL;
+}
+
 CcnetPeer*
 ccnet_cluster_manager_find_redirect_dest (CcnetClusterManager *manager,
                                           CcnetPeer *peer)
 {
+    CcnetClusterManagerPriv *priv = manager->priv;
     GList *ptr;
-    GList *cands = NULL;
-    int n = 0;
-    CcnetPeer *res;
+    GPtrArray *cands;
+    CcnetPeer *res = NULL;
+    time_t now = time(NULL);
+    guint i;
 
+    if (priv->policy == POLICY_HASH) {
+        res = find_by_hash (manager, peer);
+        goto out;
+    }
+
+    cands = g_ptr_array_new ();
     for (ptr = manager->members; ptr; ptr = ptr->next) {
         CcnetPeer *p = ptr->data;
 
-        if (p->net_state == PEER_CONNECTED) {
-            cands = g_list_prepend (cands, p);
-            n++;
+        if (p->net_state == PEER_CONNECTED)
+            g_ptr_array_add (cands, p);
+    }
+
+    if (cands->len == 0) {
+        g_ptr_array_free (cands, TRUE);
+        return NULL;
+    }
+
+    switch (priv->policy) {
+    case POLICY_RANDOM:
+        res = g_ptr_array_index (cands, rand() % cands->len);
+        break;
+    case POLICY_LEAST_LOADED:
+        res = g_ptr_array_index (cands, 0);
+        for (i = 1; i < cands->len; i++) {
+            CcnetPeer *p = g_ptr_array_index (cands, i);
+            if (load_score (manager, p, now) < load_score (manager, res, now))
+                res = p;
         }
+        break;
+    default: {
+        /* power of two choices */
+        CcnetPeer *a = g_ptr_array_index (cands, rand() % cands->len);
+        CcnetPeer *b = g_ptr_array_index (cands, rand() % cands->len);
+
+        res = load_score (manager, a, now) <= load_score (manager, b, now)
+            ? a : b;
+        break;
     }
+    }
+    g_ptr_array_free (cands, TRUE);
+
+out:
+    if (!res)
+        return NULL;
+    get_load (manager, res)->pending++;
+    g_object_ref (res);
+    return res;
+}
+
+/* -------- load reporting -------- */
 
-    if (n) {
-        int i = rand() % n;
-        res = g_list_nth_data(cands, i);
-        g_object_ref (res);
-        return res;
+static long
+timeval_diff_ms (const struct timeval *a, const struct timeval *b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000 + (a->tv_usec - b->tv_usec) / 1000;
+}
+
+/* Cpu used by this process since the last call, in permille. */
+static int
+get_cpu_usage (CcnetClusterManager *manager)
+{
+    CcnetClusterManagerPriv *priv = manager->priv;
+    struct rusage usage;
+    struct timeval now, cpu;
+    long wall_ms, cpu_ms;
+
+    if (getrusage (RUSAGE_SELF, &usage) < 0)
+        return 0;
+    gettimeofday (&now, NULL);
+    timeradd (&usage.ru_utime, &usage.ru_stime, &cpu);
+
+    wall_ms = timeval_diff_ms (&now, &priv->last_wall);
+    cpu_ms = timeval_diff_ms (&cpu, &priv->last_cpu);
+    priv->last_wall = now;
+    priv->last_cpu = cpu;
+
+    if (wall_ms <= 0)
+        return 0;
+    return (int)(cpu_ms * 1000 / wall_ms);
+}
+
+/* Tell the other cluster nodes how loaded we are, as
+ * "<peers> <processors> <cpu> <weight>" in a LOAD_REPORT message. */
+static int
+send_load_reports (void *vmanager)
+{
+    CcnetClusterManager *manager = vmanager;
+    char buf[256];
+    GList *ptr;
+
+    snprintf (buf, sizeof(buf), "v%d\n%s\n%u %d %d %d\n",
+              PEERMGR_VERSION, LOAD_REPORT,
+              session->peer_mgr->connected_peer,
+              session->proc_factory->procs_alive_cnt,
+              get_cpu_usage (manager), manager->priv->weight);
+
+    for (ptr = manager->members; ptr; ptr = ptr->next) {
+        CcnetPeer *member = ptr->data;
+        CcnetMessage *msg;
+
+        if (member->net_state != PEER_CONNECTED)
+            continue;
+        msg = ccnet_message_new (inner_session->base.id, member->id,
+                                 IPEERMGR_APP, buf, 0);
+        ccnet_send_message (inner_session, msg);
+        ccnet_message_unref (msg);
     }
 
+    /* lets the others notice lost invalidations */
+    flush_cache_events (manager, TRUE);
+
+    return TRUE;
+}
+
+/* -------- peer locations and forwarding -------- */
+
+static CcnetPeer *
+find_member (CcnetClusterManager *manager, const char *id)
+{
+    GList *ptr;
+
+    for (ptr = manager->members; ptr; ptr = ptr->next) {
+        if (strcmp (((CcnetPeer *)ptr->data)->id, id) == 0)
+            return ptr->data;
+    }
     return NULL;
 }
 
+static void
+send_to_member (CcnetPeer *member, const char *type, const char *body)
+{
+    CcnetMessage *msg;
+    GString *buf = g_string_new (NULL);
+
+    g_string_printf (buf, "v%d\n%s\n%s", PEERMGR_VERSION, type, body);
+    msg = ccnet_message_new (inner_session->base.id, member->id,
+                             IPEERMGR_APP, buf->str, 0);
+    ccnet_send_message (inner_session, msg);
+    ccnet_message_unref (msg);
+    g_string_free (buf, TRUE);
+}
+
+static void
+broadcast (CcnetClusterManager *manager, const char *type, const char *body)
+{
+    GList *ptr;
+
+    for (ptr = manager->members; ptr; ptr = ptr->next) {
+        CcnetPeer *member = ptr->data;
+
+        if (member->net_state == PEER_CONNECTED)
+            send_to_member (member, type, body);
+    }
+}
+
+static void
+flush_location_updates (CcnetClusterManager *manager)
+{
+    CcnetClusterManagerPriv *priv = manager->priv;
+
+    if (priv->n_location_updates == 0)
+        return;
+
+    broadcast (manager, PEER_LOCATION, priv->location_updates->str);
+    g_string_truncate (priv->location_updates, 0);
+    priv->n_location_updates = 0;
+}
+
+static void
+add_location_update (CcnetClusterManager *manager, char op, CcnetPeer *peer)
+{
+    CcnetClusterManagerPriv *priv = manager->priv;
+
+    g_string_append_printf (priv->location_updates, "%c%s\n", op, peer->id);
+    if (++priv->n_location_updates >= LOCATION_BATCH)
+        flush_location_updates (manager);
+}
+
+typedef struct {
+    CcnetPeer *member;
+    GString   *buf;
+    int        n;
+} LocationSnapshot;
+
+static gboolean
+add_peer_location (CcnetPeer *peer, void *vsnap)
+{
+    LocationSnapshot *snap = vsnap;
+
+    if (peer->is_local || peer->is_self)
+        return TRUE;
+    g_string_append_printf (snap->buf, "+%s\n", peer->id);
+    if (++snap->n % LOCATION_BATCH == 0) {
+        send_to_member (snap->member, PEER_LOCATION, snap->buf->str);
+        g_string_truncate (snap->buf, 0);
+    }
+    return TRUE;
+}
+
+/* Tell a member which just came up about all our peers. The first line
+ * "=" drops what it knew about us before. */
+static void
+send_location_snapshot (CcnetClusterManager *manager, CcnetPeer *member)
+{
+    LocationSnapshot snap;
+
+    snap.member = member;
+    snap.buf = g_string_new ("=\n");
+    snap.n = 0;
+    ccnet_peer_manager_foreach_connected (session->peer_mgr,
+                                          add_peer_location, &snap);
+
+    if (snap.buf->len > 0)
+        send_to_member (member, PEER_LOCATION, snap.buf->str);
+    g_string_free (snap.buf, TRUE);
+}
+
+static gboolean
+is_at_node (gpointer key, gpointer value, gpointer member)
+{
+    return value == member;
+}
+
+static void
+forget_node (CcnetClusterManager *manager, CcnetPeer *member)
+{
+    g_hash_table_foreach_remove (manager->priv->locations,
+                                 is_at_node, member);
+    g_hash_table_remove (manager->priv->forward_queues, member);
+    ccnet_cache_bus_forget_node (member->id);
+}
+
+static void
+handle_location_message (CcnetClusterManager *manager, CcnetPeer *member,
+                         char *body)
+{
+    GHashTable *locations = manager->priv->locations;
+    char **lines, **line;
+
+    lines = g_strsplit (body, "\n", -1);
+    for (line = lines; *line; line++) {
+        char *id = *line + 1;
+
+        if (**line == '=') {
+            forget_node (manager, member);
+        } else if (**line == '+' && strlen (id) == 40) {
+            g_hash_table_replace (locations, g_strdup (id), member);
+        } else if (**line == '-' && strlen (id) == 40) {
+            /* the peer may have moved to another node already */
+            if (g_hash_table_lookup (locations, id) == member)
+                g_hash_table_remove (locations, id);
+        }
+    }
+    g_strfreev (lines);
+}
+
+void
+ccnet_cluster_manager_on_peer_up (CcnetClusterManager *manager,
+                                  CcnetPeerManager *peer_mgr,
+                                  CcnetPeer *peer)
+{
+    if (!manager)
+        return;
+
+    if (peer_mgr == inner_session->peer_mgr) {
+        if (is_member (manager, peer))
+            send_location_snapshot (manager, peer);
+    } else if (!peer->is_local)
+        add_location_update (manager, '+', peer);
+}
+
+void
+ccnet_cluster_manager_on_peer_down (CcnetClusterManager *manager,
+                                    CcnetPeerManager *peer_mgr,
+                                    CcnetPeer *peer)
+{
+    if (!manager || peer->is_self || peer->is_local)
+        return;
+
+    if (peer_mgr == inner_session->peer_mgr)
+        forget_node (manager, peer);
+    else
+        add_location_update (manager, '-', peer);
+}
+
+static void
+flush_forward_queue (CcnetPeer *member, GString *queue)
+{
+    if (queue->len == 0)
+        return;
+    if (member->net_state == PEER_CONNECTED)
+        send_to_member (member, FORWARD_MESSAGES, queue->str);
+    g_string_truncate (queue, 0);
+}
+
+static void
+flush_one_queue (gpointer key, gpointer value, gpointer user_data)
+{
+    flush_forward_queue (key, value);
+}
+
+/* -------- cache invalidation -------- */
+
+/* Writes on this node go to the others, which share the database. */
+static void
+flush_cache_events (CcnetClusterManager *manager, gboolean heartbeat)
+{
+    GString *buf;
+
+    if (!manager->priv->cache_bus)
+        return;
+
+    buf = g_string_new (NULL);
+    if (ccnet_cache_bus_take_events (buf, heartbeat))
+        broadcast (manager, CACHE_INVALIDATE, buf->str);
+    g_string_free (buf, TRUE);
+}
+
+static int
+flush_pulse (void *vmanager)
+{
+    CcnetClusterManager *manager = vmanager;
+
+    flush_cache_events (manager, FALSE);
+    flush_location_updates (manager);
+    g_hash_table_foreach (manager->priv->forward_queues, flush_one_queue, NULL);
+    return TRUE;
+}
+
+gboolean
+ccnet_cluster_manager_route_message (CcnetClusterManager *manager,
+                                     CcnetSession *from_session,
+                                     CcnetMessage *msg)
+{
+    CcnetClusterManagerPriv *priv;
+    CcnetPeer *member, *local;
+    GString *queue, *buf;
+
+    if (!manager || from_session != session)
+        return FALSE;
+    priv = manager->priv;
+
+    member = g_hash_table_lookup (priv->locations, msg->to);
+    if (!member || member->net_state != PEER_CONNECTED)
+        return FALSE;
+
+    /* prefer a local connection */
+    local = ccnet_peer_manager_get_peer (session->peer_mgr, msg->to);
+    if (local) {
+        gboolean connected = (local->net_state == PEER_CONNECTED);
+        g_object_unref (local);
+        if (connected)
+            return FALSE;
+    }
+
+    queue = g_hash_table_lookup (priv->forward_queues, member);
+    if (!queue) {
+        queue = g_string_new (NULL);
+        g_hash_table_insert (priv->forward_queues, member, queue);
+    }
+
+    /* records are "<len>\n<message>" */
+    buf = g_string_new (NULL);
+    ccnet_message_to_string_buf (msg, buf);
+    if (queue->len + buf->len + 16 > FORWARD_BATCH_BYTES)
+        flush_forward_queue (member, queue);
+    g_string_append_printf (queue, "%u\n", (guint)buf->len);
+    g_string_append_len (queue, buf->str, buf->len);
+    g_string_free (buf, TRUE);
+
+    return TRUE;
+}
+
+static void
+deliver_forwarded (char *str, int len)
+{
+    char *copy = g_strndup (str, len);
+    CcnetMessage *msg;
+    CcnetPeer *peer;
+
+    msg = ccnet_message_from_string (copy, len + 1);
+    g_free (copy);
+    if (!msg)
+        return;
+
+    /* no forwarding again, that could loop between nodes */
+    peer = ccnet_peer_manager_get_peer (session->peer_mgr, msg->to);
+    if (peer && peer->net_state == PEER_CONNECTED)
+        ccnet_send_message (session, msg);
+    else
+        ccnet_debug ("Drop forwarded message for %.8s\n", msg->to);
+    if (peer)
+        g_object_unref (peer);
+    ccnet_message_unref (msg);
+}
+
+static void
+handle_forward_message (char *body)
+{
+    char *p = body, *end;
+    char *body_end = body + strlen (body);
+
+    while (*p) {
+        long len = strtol (p, &end, 10);
+
+        if (end == p || *end != '\n' || len <= 0 ||
+            len > body_end - (end + 1)) {
+            ccnet_message ("Bad forwarded message batch\n");
+            return;
+        }
+        deliver_forwarded (end + 1, len);
+        p = end + 1 + len;
+    }
+}
+
+/* -------- redirect handoff -------- */
+
+/*
+ * A PEER_HANDOFF body is
+ *
+ *   <peer id> <resume secret or -> <expire>
+ *   <roles>
+ *   <pubinfo>
+ *
+ * The peer was verified by the sending node, which we trust as much as
+ * ourselves, so its pubinfo is taken as is.
+ */
+void
+ccnet_cluster_manager_handoff_peer (CcnetClusterManager *manager,
+                                    CcnetPeer *peer,
+                                    CcnetPeer *dest)
+{
+    GString *buf;
+    GString *info;
+    char hex[CCNET_RESUME_SECRET_LEN * 2 + 1];
+
+    if (!manager->priv->handoff || dest->net_state != PEER_CONNECTED)
+        return;
+
+    ccnet_peer_save_resume_secret (peer);
+    buf = g_string_new (NULL);
+    if (ccnet_peer_can_resume (peer)) {
+        rawdata_to_hex (peer->resume_secret, hex, CCNET_RESUME_SECRET_LEN);
+        g_string_printf (buf, "%s %s %" G_GINT64_FORMAT "\n", peer->id,
+                         hex, (gint64)peer->resume_expire);
+    } else
+        g_string_printf (buf, "%s - 0\n", peer->id);
+
+    ccnet_peer_get_roles_str (peer, buf);
+    g_string_append_c (buf, '\n');
+    info = ccnet_peer_to_string (peer);
+    g_string_append (buf, info->str);
+    g_string_free (info, TRUE);
+
+    send_to_member (dest, PEER_HANDOFF, buf->str);
+    g_string_free (buf, TRUE);
+}
+
+static CcnetPeer *
+adopt_peer (const char *id, char *info)
+{
+    CcnetPeer *peer;
+
+    peer = ccnet_peer_manager_get_peer (session->peer_mgr, id);
+    if (peer)
+        return peer;
+
+    peer = ccnet_peer_from_string (info);
+    if (!peer)
+        return NULL;
+    if (strcmp (peer->id, id) != 0 || !peer->pubkey) {
+        g_object_unref (peer);
+        return NULL;
+    }
+    ccnet_peer_manager_add_peer (session->peer_mgr, peer);
+    return peer;
+}
+
+static void
+handle_handoff_message (CcnetClusterManager *manager, CcnetPeer *member,
+                        char *body)
+{
+    char *roles, *info;
+    char **tokens, **role;
+    CcnetPeer *peer;
+
+    if (!(roles = strchr (body, '\n')) || !(info = strchr (roles + 1, '\n')))
+        goto bad;
+    *roles++ = '\0';
+    *info++ = '\0';
+
+    tokens = g_strsplit (body, " ", 3);
+    if (g_strv_length (tokens) != 3 || !peer_id_valid (tokens[0])) {
+        g_strfreev (tokens);
+        goto bad;
+    }
+
+    peer = adopt_peer (tokens[0], info);
+    if (!peer) {
+        g_strfreev (tokens);
+        goto bad;
+    }
+
+    if (*roles) {
+        char **role_list = g_strsplit (roles, ",", -1);
+        for (role = role_list; *role; role++) {
+            if (!ccnet_peer_has_role (peer, *role))
+                ccnet_peer_manager_add_role (session->peer_mgr, peer, *role);
+        }
+        g_strfreev (role_list);
+    }
+
+    /* A connection of its own has a fresher key than the one handed. */
+    if (peer->net_state != PEER_CONNECTED &&
+        strlen (tokens[1]) == CCNET_RESUME_SECRET_LEN * 2) {
+        if (hex_to_rawdata (tokens[1], peer->resume_secret,
+                            CCNET_RESUME_SECRET_LEN) == 0)
+            peer->resume_expire =
+                (time_t)g_ascii_strtoll (tokens[2], NULL, 10);
+        else
+            ccnet_peer_clear_resume_secret (peer);
+    }
+
+    ccnet_debug ("[Cluster] Peer %.8s handed off by %.8s\n",
+                 peer->id, member->id);
+    g_object_unref (peer);
+    g_strfreev (tokens);
+    return;
+
+bad:
+    ccnet_message ("Bad handoff message from %.8s\n", member->id);
+}
+
 /* -------- cluster message handling -------- */
+static void
+handle_load_report (CcnetClusterManager *cmgr, CcnetPeer *member,
+                    CcnetMessage *msg, const char *body)
+{
+    MemberLoad *load;
+    unsigned int peers;
+    int procs, cpu, weight;
+
+    if (sscanf (body, "%u %d %d %d", &peers, &procs, &cpu, &weight) != 4) {
+        ccnet_message ("Bad load report from %.8s\n", msg->from);
+        return;
+    }
+
+    load = get_load (cmgr, member);
+    load->peers = peers;
+    load->procs = procs;
+    load->cpu = cpu;
+    if (weight > 0 && weight != load->weight) {
+        load->weight = weight;
+        invalidate_ring (cmgr);
+    }
+    load->updated = time(NULL);
+    load->pending = 0;
+}
+
 void
 ccnet_cluster_manager_receive_message (CcnetPeerManager *manager,
-                                       CcnetMessage *msg)
+                                       CcnetMessage *msg,
+                                       const char *type,
+                                       char *body)
 {
+    CcnetPeer *member;
+
+    if (!cluster_mgr)
+        return;
+
+    /* only cluster members can talk to us */
+    member = find_member (cluster_mgr, msg->from);
+    if (!member)
+        return;
+
+    if (strcmp (type, LOAD_REPORT) == 0)
+        handle_load_report (cluster_mgr, member, msg, body);
+    else if (strcmp (type, PEER_LOCATION) == 0)
+        handle_location_message (cluster_mgr, member, body);
+    else if (strcmp (type, FORWARD_MESSAGES) == 0)
+        handle_forward_message (body);
+    else if (strcmp (type, PEER_HANDOFF) == 0)
+        handle_handoff_message (cluster_mgr, member, body);
+    else if (strcmp (type, CACHE_INVALIDATE) == 0)
+        ccnet_cache_bus_receive (member->id, body);
 }
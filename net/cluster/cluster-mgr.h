@@ -6,6 +6,9 @@
 #include <glib.h>
 
 #include "peer.h"
+#include "message.h"
+
+struct _CcnetPeerManager;
 
 
 typedef struct _CcnetClusterManager CcnetClusterManager;
@@ -38,9 +41,56 @@ void ccnet_cluster_manager_add_master (CcnetClusterManager *manager,
 void ccnet_cluster_manager_remove_master (CcnetClusterManager *manager,
                                           CcnetPeer *peer);
 
+/*
+ * Pick the member to redirect @peer to, as set by [Cluster]
+ * REDIRECT_POLICY: two-choices (default), least-loaded, hash (the same
+ * member for the same peer id) or random. Members are weighted by their
+ * [Cluster] WEIGHT.
+ */
 CcnetPeer*
 ccnet_cluster_manager_find_redirect_dest (CcnetClusterManager *manager,
                                           CcnetPeer *peer);
 
+/*
+ * Pass what we know about @peer to @dest before redirecting it there:
+ * its pubinfo, roles and a resume secret derived from the current
+ * session key. The peer then resumes its session on @dest instead of
+ * redoing the RSA exchange. Disabled by [Cluster] REDIRECT_HANDOFF=false.
+ */
+void
+ccnet_cluster_manager_handoff_peer (CcnetClusterManager *manager,
+                                    CcnetPeer *peer,
+                                    CcnetPeer *dest);
+
+/* Handle a peermgr message of @type from another cluster node. */
+void
+ccnet_cluster_manager_receive_message (struct _CcnetPeerManager *manager,
+                                       CcnetMessage *msg,
+                                       const char *type,
+                                       char *body);
+
+/*
+ * Peers of the outer session are announced to the other nodes, which
+ * keep a peer id -> node directory. @peer_mgr tells which session the
+ * peer belongs to. A cluster member coming up gets all our peers.
+ */
+void
+ccnet_cluster_manager_on_peer_up (CcnetClusterManager *manager,
+                                  struct _CcnetPeerManager *peer_mgr,
+                                  CcnetPeer *peer);
+void
+ccnet_cluster_manager_on_peer_down (CcnetClusterManager *manager,
+                                    struct _CcnetPeerManager *peer_mgr,
+                                    CcnetPeer *peer);
+
+/*
+ * Queue @msg of @session for the node the destination is connected to.
+ * Returns FALSE if the destination is not on another node.
+ */
+gboolean
+ccnet_cluster_manager_route_message (CcnetClusterManager *manager,
+                                     struct _CcnetSession *session,
+                                     CcnetMessage *msg);
+
 
 #endif
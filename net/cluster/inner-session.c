@@ -24,6 +24,9 @@
 #include "ccnet-config.h"
 
 #include "proc-factory.h"
+#include "cluster-mgr.h"
+
+extern CcnetClusterManager *cluster_mgr;
 
 
 G_DEFINE_TYPE (CcnetInnerSession, ccnet_inner_session, CCNET_TYPE_SESSION);
@@ -71,4 +74,5 @@ static void
 on_peer_auth_done (CcnetSession *session, CcnetPeer *peer)
 {
     ccnet_peer_manager_send_ready_message (session->peer_mgr, peer);
+    ccnet_cluster_manager_on_peer_up (cluster_mgr, session->peer_mgr, peer);
 }
@@ -52,6 +52,8 @@ redirect_peer (CcnetPeerManager *manager,
     dest = ccnet_cluster_manager_find_redirect_dest (
         cluster_mgr, peer);
     if (dest) {
+        /* The state must get there before the peer does. */
+        ccnet_cluster_manager_handoff_peer (cluster_mgr, peer, dest);
         ccnet_peer_manager_redirect_peer (manager, peer, dest);
         g_object_unref (dest);
     } else {
@@ -64,6 +66,8 @@ redirect_peer (CcnetPeerManager *manager,
 static void on_peer_auth_done (CcnetSession *session,
                                CcnetPeer *peer)
 {
+    ccnet_cluster_manager_on_peer_up (cluster_mgr, session->peer_mgr, peer);
+
     if (!cluster_mgr->redirect) {
         ccnet_peer_manager_send_ready_message (session->peer_mgr, peer);
         return;
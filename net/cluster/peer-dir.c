@@ -0,0 +1,91 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "peer.h"
+#include "peer-mgr.h"
+#include "peer-dir.h"
+
+#define DEBUG_FLAG  CCNET_DEBUG_PEER
+#include "log.h"
+
+/* id -> GSList of peers, one per session. Holds no references, peers
+ * are removed before their peer manager drops them. */
+G_LOCK_DEFINE_STATIC (peer_dir);
+static GHashTable *peer_dir;
+
+void
+ccnet_peer_dir_add (CcnetPeer *peer)
+{
+    GSList *peers;
+
+    G_LOCK (peer_dir);
+    if (!peer_dir)
+        peer_dir = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, NULL);
+    peers = g_hash_table_lookup (peer_dir, peer->id);
+    if (!g_slist_find (peers, peer)) {
+        peers = g_slist_prepend (peers, peer);
+        g_hash_table_replace (peer_dir, g_strdup (peer->id), peers);
+    }
+    G_UNLOCK (peer_dir);
+}
+
+void
+ccnet_peer_dir_remove (CcnetPeer *peer)
+{
+    GSList *peers;
+
+    G_LOCK (peer_dir);
+    if (peer_dir && (peers = g_hash_table_lookup (peer_dir, peer->id))) {
+        peers = g_slist_remove (peers, peer);
+        if (peers)
+            g_hash_table_replace (peer_dir, g_strdup (peer->id), peers);
+        else
+            g_hash_table_remove (peer_dir, peer->id);
+    }
+    G_UNLOCK (peer_dir);
+}
+
+CcnetPeer *
+ccnet_peer_dir_lookup (const char *id, struct _CcnetPeerManager *except)
+{
+    GSList *ptr;
+    CcnetPeer *res = NULL;
+
+    G_LOCK (peer_dir);
+    if (peer_dir) {
+        for (ptr = g_hash_table_lookup (peer_dir, id); ptr; ptr = ptr->next) {
+            CcnetPeer *peer = ptr->data;
+
+            if (peer->manager != except && peer->pubkey) {
+                res = g_object_ref (peer);
+                break;
+            }
+        }
+    }
+    G_UNLOCK (peer_dir);
+
+    return res;
+}
+
+gboolean
+ccnet_peer_dir_fill (CcnetPeer *peer)
+{
+    CcnetPeer *other;
+    GString *info;
+
+    other = ccnet_peer_dir_lookup (peer->id, peer->manager);
+    if (!other)
+        return FALSE;
+
+    info = ccnet_peer_to_string (other);
+    ccnet_peer_update_from_string (peer, info->str);
+    g_string_free (info, TRUE);
+    g_object_unref (other);
+
+    if (peer->pubkey)
+        ccnet_debug ("[PeerDir] Took the pubinfo of %.8s from another "
+                     "session\n", peer->id);
+    return peer->pubkey != NULL;
+}
@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_PEER_DIR_H
+#define CCNET_PEER_DIR_H
+
+#include "peer.h"
+
+struct _CcnetPeerManager;
+
+/*
+ * The peers of all the sessions of the process by id, i.e. of the inner
+ * and the outer session of a cluster server.
+ *
+ * Each peer manager stays the view of its own session: roles, addresses
+ * and the connection belong to the session. What is shared is the
+ * identity of a peer, its pubinfo. A session meeting a peer which
+ * another session knows copies the pubinfo over instead of asking the
+ * peer, and the decoded key is shared through the key cache.
+ *
+ * All functions may be called from any thread.
+ */
+
+/* Called by the peer managers as peers enter and leave their tables. */
+void ccnet_peer_dir_add (CcnetPeer *peer);
+void ccnet_peer_dir_remove (CcnetPeer *peer);
+
+/*
+ * Returns a new reference to a peer with @id and a pubkey in a session
+ * other than that of @except, or NULL.
+ */
+CcnetPeer *ccnet_peer_dir_lookup (const char *id,
+                                  struct _CcnetPeerManager *except);
+
+/* Take the pubinfo of @peer from another session. Returns TRUE if
+ * @peer has a pubkey now. */
+gboolean ccnet_peer_dir_fill (CcnetPeer *peer);
+
+#endif
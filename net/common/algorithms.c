@@ -11,8 +11,15 @@
 
 #include "proc-factory.h"
 #include "processors/sendmsg-proc.h"
+#include "processors/sendmsgs-proc.h"
 
 #include "algorithms.h"
+#include "outbox.h"
+
+#ifdef CCNET_CLUSTER
+#include "cluster-mgr.h"
+extern CcnetClusterManager *cluster_mgr;
+#endif
 
 #define DEBUG_FLAG CCNET_DEBUG_MESSAGE
 #include "log.h"
@@ -53,16 +60,37 @@ ccnet_send_msg_to_peer (CcnetSession *session, CcnetPeer *peer,
 
     g_assert (!peer->is_self);
 
-    if (peer->net_state == PEER_CONNECTED) {
-        processor = ccnet_proc_factory_create_master_processor 
-            (factory, "send-msg", peer);
-        g_assert (processor);
+    if (peer->net_state != PEER_CONNECTED) {
+        if (session->outbox)
+            ccnet_outbox_put (session->outbox, msg);
+        return;
+    }
 
-        ccnet_sendmsg_proc_set_msg (CCNET_SENDMSG_PROC(processor), msg);
-        /* g_signal_connect (processor, "done", */
-        /*                   G_CALLBACK(msg_cb), msg); */
-        ccnet_processor_start (processor, 0, NULL);
+    /* Stream messages over one processor per peer if it supports it. */
+    if (!peer->no_msg_stream) {
+        if (!peer->msg_stream) {
+            processor = ccnet_proc_factory_create_master_processor
+                (factory, "send-msgs", peer);
+            g_assert (processor);
+            peer->msg_stream = processor;
+            ccnet_processor_start (processor, 0, NULL);
+        }
+        /* cleared if the processor failed to start */
+        if (peer->msg_stream) {
+            ccnet_sendmsgs_proc_put_message (
+                CCNET_SENDMSGS_PROC(peer->msg_stream), msg);
+            return;
+        }
     }
+
+    processor = ccnet_proc_factory_create_master_processor 
+        (factory, "send-msg", peer);
+    g_assert (processor);
+
+    ccnet_sendmsg_proc_set_msg (CCNET_SENDMSG_PROC(processor), msg);
+    /* g_signal_connect (processor, "done", */
+    /*                   G_CALLBACK(msg_cb), msg); */
+    ccnet_processor_start (processor, 0, NULL);
 }
 
 void
@@ -70,6 +98,12 @@ ccnet_send_message (CcnetSession *session, CcnetMessage *msg)
 {
     CcnetPeer *peer;
 
+#ifdef CCNET_CLUSTER
+    /* the peer is connected to another node of the cluster */
+    if (ccnet_cluster_manager_route_message (cluster_mgr, session, msg))
+        return;
+#endif
+
     peer = ccnet_peer_manager_get_peer (session->peer_mgr, msg->to);
     if (peer) {
         if (peer->is_self)
@@ -83,9 +117,37 @@ ccnet_send_message (CcnetSession *session, CcnetMessage *msg)
         g_warning ("Invalid peer id %s\n", msg->to);
 }
 
+void
+ccnet_send_message_view (CcnetSession *session, const CcnetMessageView *view)
+{
+    CcnetMessage *msg;
+    CcnetPeer *peer;
+
+#ifndef CCNET_CLUSTER
+    /* Only messages to ourself can be dispatched from the view. In a
+     * cluster the peer may be connected to another node. */
+    peer = ccnet_peer_manager_get_peer (session->peer_mgr, view->to);
+    if (!peer) {
+        g_warning ("Invalid peer id %s\n", view->to);
+        return;
+    }
+    if (peer->is_self) {
+        ccnet_message_manager_add_msg_view (session->msg_mgr,
+                                            view, MSG_TYPE_RECV);
+        g_object_unref (peer);
+        return;
+    }
+    g_object_unref (peer);
+#endif
+
+    msg = ccnet_message_view_materialize (view);
+    ccnet_send_message (session, msg);
+    ccnet_message_unref (msg);
+}
+
 
 static gboolean
-check_message_permission (CcnetSession *session, CcnetMessage *msg)
+check_message_permission (CcnetSession *session, const CcnetMessageView *msg)
 {
     CcnetPeerManager *peer_mgr = session->peer_mgr;
     CcnetPeer *from;
@@ -117,11 +179,24 @@ int
 ccnet_recv_message (CcnetSession *session, CcnetMessage *msg)
 {
     CcnetMessageManager *msg_mgr = session->msg_mgr;
+    CcnetMessageView view;
 
-    if (check_message_permission(session, msg) == FALSE)
+    ccnet_message_view_init (&view, msg);
+    if (check_message_permission(session, &view) == FALSE)
         return -1;
 
     ccnet_message_manager_add_msg (msg_mgr, msg, MSG_TYPE_RECV);
 
     return 0;
 }
+
+int
+ccnet_recv_message_view (CcnetSession *session, const CcnetMessageView *view)
+{
+    if (check_message_permission(session, view) == FALSE)
+        return -1;
+
+    ccnet_message_manager_add_msg_view (session->msg_mgr, view, MSG_TYPE_RECV);
+
+    return 0;
+}
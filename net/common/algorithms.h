@@ -3,8 +3,17 @@
 #ifndef CCNET_ALGORITHMS_H
 #define CCNET_ALGORITHMS_H
 
+#include "message.h"
+
 void ccnet_send_message (CcnetSession *session, CcnetMessage *msg);
 int ccnet_recv_message (CcnetSession *session, CcnetMessage *msg);
 
+/* For messages parsed in place from a packet. The view is only turned
+ * into a CcnetMessage when it has to be queued or forwarded. */
+void ccnet_send_message_view (CcnetSession *session,
+                              const CcnetMessageView *view);
+int ccnet_recv_message_view (CcnetSession *session,
+                             const CcnetMessageView *view);
+
 
 #endif
@@ -2,7 +2,24 @@
 
 #include "common.h"
 
+#include "timer.h"
+
 #include "ccnet-config.h"
+#include "ccnet-db.h"
+#include "message.h"
+#include "message-manager.h"
+
+#define DEBUG_FLAG  CCNET_DEBUG_OTHER
+#include "log.h"
+
+/* Changes are written this long after the first one, together. */
+#define CONFIG_FLUSH_MSEC  500
+
+struct CcnetConfigCache {
+    GHashTable *values;         /* key -> value, the whole Config table */
+    GHashTable *dirty;          /* keys changed since the last flush */
+    CcnetTimer *flush_timer;
+};
 
 static gboolean
 get_value (sqlite3_stmt *stmt, void *data)
@@ -30,10 +47,105 @@ config_get_string (sqlite3 *config_db, const char *key)
     return value;
 }
 
+static gboolean
+load_value (sqlite3_stmt *stmt, void *data)
+{
+    const char *key = (const char *) sqlite3_column_text (stmt, 0);
+    const char *value = (const char *) sqlite3_column_text (stmt, 1);
+
+    if (key && value)
+        g_hash_table_replace (data, g_strdup (key), g_strdup (value));
+    return TRUE;
+}
+
+int
+ccnet_session_config_load (CcnetSession *session)
+{
+    struct CcnetConfigCache *cache;
+
+    cache = g_new0 (struct CcnetConfigCache, 1);
+    cache->values = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, g_free);
+    cache->dirty = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, NULL);
+
+    if (sqlite_foreach_selected_row (session->config_db,
+                                     "SELECT key, value FROM Config",
+                                     load_value, cache->values) < 0) {
+        ccnet_warning ("Failed to load config db.\n");
+        g_hash_table_destroy (cache->values);
+        g_hash_table_destroy (cache->dirty);
+        g_free (cache);
+        return -1;
+    }
+
+    session->config_cache = cache;
+    return 0;
+}
+
+void
+ccnet_session_config_flush (CcnetSession *session)
+{
+    struct CcnetConfigCache *cache = session->config_cache;
+    GHashTableIter iter;
+    gpointer key;
+    const char *value;
+
+    if (!cache || g_hash_table_size (cache->dirty) == 0)
+        return;
+
+    sqlite_begin_transaction (session->config_db);
+    g_hash_table_iter_init (&iter, cache->dirty);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        value = g_hash_table_lookup (cache->values, key);
+        if (sqlite_statement_query (session->config_db,
+                                    "REPLACE INTO Config VALUES (?, ?)",
+                                    2, "string", key,
+                                    "string", value) < 0)
+            ccnet_warning ("Failed to save config %s.\n", (char *)key);
+    }
+    if (sqlite_end_transaction (session->config_db) < 0)
+        ccnet_warning ("Failed to commit config changes.\n");
+
+    g_hash_table_remove_all (cache->dirty);
+}
+
+static int
+flush_pulse (void *vsession)
+{
+    CcnetSession *session = vsession;
+
+    ccnet_session_config_flush (session);
+    session->config_cache->flush_timer = NULL;
+    return FALSE;
+}
+
+/* Local clients subscribed to "System" may cache values, tell them to
+ * read @key again. */
+static void
+notify_config_changed (CcnetSession *session, const char *key)
+{
+    CcnetMessage *message;
+    char *buf;
+
+    if (!session->msg_mgr)
+        return;
+
+    buf = g_strdup_printf ("config-changed %s\n", key);
+    message = ccnet_message_new (session->base.id, session->base.id,
+                                 "System", buf, 0);
+    ccnet_message_manager_add_msg (session->msg_mgr, message, MSG_TYPE_SYS);
+    ccnet_message_unref (message);
+    g_free (buf);
+}
+
 char *
 ccnet_session_config_get_string (CcnetSession *session,
                                  const char *key)
 {
+    if (session->config_cache)
+        return g_strdup (g_hash_table_lookup (session->config_cache->values,
+                                              key));
     return (config_get_string (session->config_db, key));
 }
 
@@ -45,7 +157,7 @@ ccnet_session_config_get_int (CcnetSession *session,
     char *value;
     int ret;
 
-    value = config_get_string (session->config_db, key);
+    value = ccnet_session_config_get_string (session, key);
     if (!value) {
         *exists = FALSE;
         return -1;
@@ -62,14 +174,27 @@ ccnet_session_config_set_string (CcnetSession *session,
                                  const char *key,
                                  const char *value)
 {
-    char sql[256];
+    struct CcnetConfigCache *cache = session->config_cache;
+
+    if (!cache) {
+        if (sqlite_statement_query (session->config_db,
+                                    "REPLACE INTO Config VALUES (?, ?)",
+                                    2, "string", key,
+                                    "string", value) < 0)
+            return -1;
+        return 0;
+    }
 
-    snprintf (sql, sizeof(sql),
-              "REPLACE INTO Config VALUES ('%s', '%s');",
-              key, value);
-    if (sqlite_query_exec (session->config_db, sql) < 0)
-        return -1;
+    if (g_strcmp0 (g_hash_table_lookup (cache->values, key), value) == 0)
+        return 0;
+
+    g_hash_table_replace (cache->values, g_strdup (key), g_strdup (value));
+    g_hash_table_replace (cache->dirty, g_strdup (key), NULL);
+    if (!cache->flush_timer)
+        cache->flush_timer = ccnet_timer_new (flush_pulse, session,
+                                              CONFIG_FLUSH_MSEC);
 
+    notify_config_changed (session, key);
     return 0;
 }
 
@@ -78,15 +203,10 @@ ccnet_session_config_set_int (CcnetSession *session,
                               const char *key,
                               int value)
 {
-    char sql[256];
-
-    snprintf (sql, sizeof(sql),
-              "REPLACE INTO Config VALUES ('%s', %d);",
-              key, value);
-    if (sqlite_query_exec (session->config_db, sql) < 0)
-        return -1;
+    char buf[16];
 
-    return 0;
+    snprintf (buf, sizeof(buf), "%d", value);
+    return ccnet_session_config_set_string (session, key, buf);
 }
 
 sqlite3 *
@@ -109,6 +229,9 @@ ccnet_session_config_open_db (const char *ccnet_dir)
         "key TEXT PRIMARY KEY, "
         "value TEXT);";
     sqlite_query_exec (db, sql);
+#ifndef CCNET_SERVER
+    sqlite_enable_read_pool (db, CCNET_DB_READ_CONNECTIONS);
+#endif
 
     return db;
 }
@@ -36,4 +36,18 @@ ccnet_session_config_set_int (CcnetSession *session,
 sqlite3 *
 ccnet_session_config_open_db (const char *ccnet_dir);
 
+/*
+ * Keep the Config table in memory. Afterwards values are read from
+ * there, and changes are written back together in one transaction
+ * shortly after, so a set can't fail on the database. Every change is
+ * announced to local clients by a "config-changed <key>" System
+ * message.
+ */
+int
+ccnet_session_config_load (CcnetSession *session);
+
+/* Write the pending changes now, done on exit. */
+void
+ccnet_session_config_flush (CcnetSession *session);
+
 #endif
@@ -3,15 +3,82 @@
 #include "common.h"
 
 #include <zdb.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include "ccnet-db.h"
+#include "job-mgr.h"
+#include "metrics.h"
 
-#define MAX_GET_CONNECTION_RETRIES 3
+CcnetDBPoolConfig ccnet_db_pool_config = {
+    .min_connections = 5,           /* zdb defaults */
+    .max_connections = 20,
+    .idle_timeout = 90,
+    .wait_timeout_ms = 500,
+};
+
+CcnetDBSqliteConfig ccnet_db_sqlite_config;
+
+CcnetDBReplicaConfig ccnet_db_replica_config = {
+    .max_lag = 10,
+    .check_interval = 5,
+    .sticky_seconds = 5,
+};
+
+typedef struct DBReplica {
+    struct CcnetDB *db;
+    char           *host;
+    /* under the lock of the primary */
+    gboolean        healthy;
+    gboolean        checking;
+    int             lag;            /* seconds, -1 if unknown */
+    gint64          next_check;     /* monotonic time */
+    gint64          n_reads;
+} DBReplica;
 
 struct CcnetDB {
     int type;
     ConnectionPool_T pool;
+    int wait_timeout_ms;
+
+    /* Callers wait here when all connections are in use. */
+    pthread_mutex_t lock;
+    pthread_cond_t  released;
+    int             n_waiting;
+    gint64          n_waits;        /* statistics, under lock */
+    gint64          n_wait_timeouts;
+    gint64          total_wait_us;
+    gint64          max_wait_us;
+
+    /* Runs the asynchronous queries, created on first use. */
+    CcnetJobManager *jobs;
+
+    /* Set by ccnet_db_register_metrics() */
+    CcnetMetric     *metric_acquired;
+    CcnetMetric     *metric_wait;
+
+    /* DBReplica, reads go round-robin to the healthy ones. */
+    GPtrArray       *replicas;
+    guint            next_replica;      /* under lock */
 };
 
+static void
+setup_pool (CcnetDB *db)
+{
+    CcnetDBPoolConfig *config = &ccnet_db_pool_config;
+
+    if (config->max_connections > 0)
+        ConnectionPool_setMaxConnections (db->pool, config->max_connections);
+    if (config->min_connections > 0)
+        ConnectionPool_setInitialConnections (
+            db->pool, MIN (config->min_connections, config->max_connections));
+    if (config->idle_timeout > 0)
+        ConnectionPool_setConnectionTimeout (db->pool, config->idle_timeout);
+    db->wait_timeout_ms = config->wait_timeout_ms;
+
+    pthread_mutex_init (&db->lock, NULL);
+    pthread_cond_init (&db->released, NULL);
+}
+
 struct CcnetDBRow {
     ResultSet_T res;
 };
@@ -49,12 +116,46 @@ ccnet_db_new_mysql (const char *host,
         return NULL;
     }
 
+    setup_pool (db);
     ConnectionPool_start (db->pool);
     db->type = CCNET_DB_TYPE_MYSQL;
 
     return db;
 }
 
+/* zdb runs "PRAGMA name = value" for each URL parameter of a new
+ * SQLite connection. */
+static void
+append_sqlite_pragmas (GString *url)
+{
+    CcnetDBSqliteConfig *config = &ccnet_db_sqlite_config;
+    char sep = '?';
+
+    if (config->journal_mode) {
+        g_string_append_printf (url, "%cjournal_mode=%s",
+                                sep, config->journal_mode);
+        sep = '&';
+    }
+    if (config->synchronous) {
+        g_string_append_printf (url, "%csynchronous=%s",
+                                sep, config->synchronous);
+        sep = '&';
+    }
+    if (config->mmap_size > 0) {
+        g_string_append_printf (url, "%cmmap_size=%" G_GINT64_FORMAT,
+                                sep, config->mmap_size);
+        sep = '&';
+    }
+    if (config->cache_size != 0) {
+        g_string_append_printf (url, "%ccache_size=%d",
+                                sep, config->cache_size);
+        sep = '&';
+    }
+    if (config->busy_timeout_ms > 0)
+        g_string_append_printf (url, "%cbusy_timeout=%d",
+                                sep, config->busy_timeout_ms);
+}
+
 CcnetDB *
 ccnet_db_new_sqlite (const char *db_path)
 {
@@ -70,6 +171,7 @@ ccnet_db_new_sqlite (const char *db_path)
 
     url = g_string_new ("");
     g_string_append_printf (url, "sqlite://%s", db_path);
+    append_sqlite_pragmas (url);
 
     zdb_url = URL_new (url->str);
     db->pool = ConnectionPool_new (zdb_url);
@@ -80,6 +182,7 @@ ccnet_db_new_sqlite (const char *db_path)
         return NULL;
     }
 
+    setup_pool (db);
     ConnectionPool_start (db->pool);
     db->type = CCNET_DB_TYPE_SQLITE;
 
@@ -89,8 +192,23 @@ ccnet_db_new_sqlite (const char *db_path)
 void
 ccnet_db_free (CcnetDB *db)
 {
+    DBReplica *r;
+    guint i;
+
+    for (i = 0; db->replicas && i < db->replicas->len; ++i) {
+        r = g_ptr_array_index (db->replicas, i);
+        ccnet_db_free (r->db);
+        g_free (r->host);
+        g_free (r);
+    }
+    if (db->replicas)
+        g_ptr_array_free (db->replicas, TRUE);
+    if (db->jobs)
+        ccnet_job_manager_free (db->jobs);
     ConnectionPool_stop (db->pool);
     ConnectionPool_free (&db->pool);
+    pthread_cond_destroy (&db->released);
+    pthread_mutex_destroy (&db->lock);
     g_free (db);
 }
 
@@ -100,48 +218,392 @@ ccnet_db_type (CcnetDB *db)
     return db->type;
 }
 
+/*
+ * If max_connections of the pool has been reached, wait up to
+ * wait_timeout_ms for another caller to release a connection, instead
+ * of polling the pool.
+ */
 static Connection_T
 get_db_connection (CcnetDB *db)
 {
     Connection_T conn;
-    int retries = 0;
+    struct timespec deadline;
+    struct timeval now;
+    gint64 start, waited;
+
+    if (db->metric_acquired)
+        ccnet_metric_inc (db->metric_acquired);
 
     conn = ConnectionPool_getConnection (db->pool);
-    /* If max_connections of the pool has been reached, retry 3 times
-     * and then return NULL.
-     */
-    while (!conn) {
-        if (retries++ == MAX_GET_CONNECTION_RETRIES) {
-            g_warning ("Too many concurrent connections. "
-                       "Failed to create new connection.\n");
-            goto out;
+    if (conn || db->wait_timeout_ms <= 0)
+        goto out;
+
+    start = g_get_monotonic_time ();
+    gettimeofday (&now, NULL);
+    deadline.tv_sec = now.tv_sec + db->wait_timeout_ms / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 +
+        (long)(db->wait_timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock (&db->lock);
+    db->n_waiting++;
+    /* A release between getConnection and the wait can't be missed,
+     * since release_db_connection signals under the lock. */
+    while (!(conn = ConnectionPool_getConnection (db->pool))) {
+        if (pthread_cond_timedwait (&db->released, &db->lock,
+                                    &deadline) != 0) {
+            conn = ConnectionPool_getConnection (db->pool);
+            break;
         }
-        sleep (1);
-        conn = ConnectionPool_getConnection (db->pool);
     }
+    db->n_waiting--;
 
+    waited = g_get_monotonic_time () - start;
+    db->n_waits++;
+    db->total_wait_us += waited;
+    if (waited > db->max_wait_us)
+        db->max_wait_us = waited;
     if (!conn)
-        g_warning ("Failed to create new connection.\n");
+        db->n_wait_timeouts++;
+    pthread_mutex_unlock (&db->lock);
+
+    if (db->metric_wait)
+        ccnet_metric_observe (db->metric_wait, waited / 1e6);
 
 out:
+    if (!conn)
+        g_warning ("Too many concurrent connections. "
+                   "Failed to create new connection.\n");
     return conn;
 }
 
+static void
+release_db_connection (CcnetDB *db, Connection_T conn)
+{
+    Connection_close (conn);
+
+    pthread_mutex_lock (&db->lock);
+    if (db->n_waiting > 0)
+        pthread_cond_signal (&db->released);
+    pthread_mutex_unlock (&db->lock);
+}
+
+/* Read replicas */
+
+int
+ccnet_db_add_mysql_replica (CcnetDB *db,
+                            const char *host,
+                            const char *user,
+                            const char *passwd,
+                            const char *db_name)
+{
+    DBReplica *r;
+    CcnetDB *rdb;
+
+    g_return_val_if_fail (db->type == CCNET_DB_TYPE_MYSQL, -1);
+
+    rdb = ccnet_db_new_mysql (host, user, passwd, db_name, NULL);
+    if (!rdb) {
+        g_warning ("Failed to open read replica %s.\n", host);
+        return -1;
+    }
+
+    r = g_new0 (DBReplica, 1);
+    r->db = rdb;
+    r->host = g_strdup (host);
+    r->lag = -1;
+    /* Unhealthy until the first check, on the first read. */
+
+    if (!db->replicas)
+        db->replicas = g_ptr_array_new ();
+    g_ptr_array_add (db->replicas, r);
+    return 0;
+}
+
+/* Monotonic time of the last write of this thread. */
+static pthread_key_t last_write_key;
+static pthread_once_t last_write_once = PTHREAD_ONCE_INIT;
+
+static void
+create_last_write_key (void)
+{
+    pthread_key_create (&last_write_key, g_free);
+}
+
+static void
+note_write (CcnetDB *db)
+{
+    gint64 *last;
+
+    if (!db->replicas)
+        return;
+
+    pthread_once (&last_write_once, create_last_write_key);
+    last = pthread_getspecific (last_write_key);
+    if (!last) {
+        last = g_new (gint64, 1);
+        pthread_setspecific (last_write_key, last);
+    }
+    *last = g_get_monotonic_time ();
+}
+
+static gboolean
+reads_pinned_to_primary (gint64 now)
+{
+    gint64 *last;
+
+    pthread_once (&last_write_once, create_last_write_key);
+    last = pthread_getspecific (last_write_key);
+    return last &&
+        *last + ccnet_db_replica_config.sticky_seconds * G_USEC_PER_SEC > now;
+}
+
+/* Seconds_Behind_Master of @rdb, or -1 if it isn't replicating. */
+static int
+get_replica_lag (CcnetDB *rdb)
+{
+    Connection_T conn;
+    ResultSet_T result;
+    const char *s;
+    int lag = -1;
+
+    conn = ConnectionPool_getConnection (rdb->pool);
+    if (!conn)
+        return -1;
+
+    TRY
+        result = Connection_executeQuery (conn, "SHOW SLAVE STATUS");
+        if (!ResultSet_next (result))
+            lag = 0;            /* not a slave, e.g. a promoted standby */
+        else if ((s = ResultSet_getStringByName (result,
+                                                 "Seconds_Behind_Master")))
+            lag = atoi (s);
+    CATCH (SQLException)
+        g_warning ("Failed to check replica: %s.\n", Exception_frame.message);
+    END_TRY;
+
+    release_db_connection (rdb, conn);
+    return lag;
+}
+
+static void
+check_replica (CcnetDB *db, DBReplica *r)
+{
+    int lag = get_replica_lag (r->db);
+    gboolean healthy = lag >= 0 && lag <= ccnet_db_replica_config.max_lag;
+
+    pthread_mutex_lock (&db->lock);
+    if (healthy != r->healthy) {
+        if (healthy)
+            g_message ("Read replica %s is up, %d s behind.\n", r->host, lag);
+        else
+            g_warning ("Read replica %s is down or behind (%d s), "
+                       "reading from the primary.\n", r->host, lag);
+    }
+    r->healthy = healthy;
+    r->lag = lag;
+    r->next_check = g_get_monotonic_time () +
+        (gint64)ccnet_db_replica_config.check_interval * G_USEC_PER_SEC;
+    r->checking = FALSE;
+    pthread_mutex_unlock (&db->lock);
+}
+
+/* The next healthy replica, checking one that is due on the way. */
+static DBReplica *
+pick_replica (CcnetDB *db)
+{
+    gint64 now = g_get_monotonic_time ();
+    DBReplica *r, *due = NULL, *ret = NULL;
+    guint i, n;
+
+    pthread_mutex_lock (&db->lock);
+    n = db->replicas->len;
+    for (i = 0; i < n; ++i) {
+        r = g_ptr_array_index (db->replicas, (db->next_replica + i) % n);
+        if (!due && !r->checking && r->next_check <= now) {
+            r->checking = TRUE;
+            due = r;
+        } else if (!ret && r->healthy)
+            ret = r;
+    }
+    db->next_replica++;
+    pthread_mutex_unlock (&db->lock);
+
+    if (due) {
+        check_replica (db, due);
+        pthread_mutex_lock (&db->lock);
+        if (!ret && due->healthy)
+            ret = due;
+        pthread_mutex_unlock (&db->lock);
+    }
+    return ret;
+}
+
+/*
+ * A connection for a read on @*db. If it comes from a replica, @*db is
+ * set to the replica, which the connection must be released to.
+ */
+static Connection_T
+get_read_connection (CcnetDB **pdb)
+{
+    CcnetDB *db = *pdb;
+    DBReplica *r;
+    Connection_T conn;
+
+    if (!db->replicas || reads_pinned_to_primary (g_get_monotonic_time ()))
+        return get_db_connection (db);
+
+    r = pick_replica (db);
+    if (r) {
+        conn = get_db_connection (r->db);
+        pthread_mutex_lock (&db->lock);
+        if (conn)
+            r->n_reads++;
+        else
+            r->healthy = FALSE;     /* until the next check */
+        pthread_mutex_unlock (&db->lock);
+        if (conn) {
+            *pdb = r->db;
+            return conn;
+        }
+    }
+    return get_db_connection (db);
+}
+
+char *
+ccnet_db_get_pool_stats (CcnetDB *db)
+{
+    GString *buf;
+    DBReplica *r;
+    guint i;
+
+    pthread_mutex_lock (&db->lock);
+    buf = g_string_new (NULL);
+    g_string_append_printf (buf, "size %d\nactive %d\nmax %d\nwaiting %d\n"
+                            "waits %" G_GINT64_FORMAT "\n"
+                            "wait_timeouts %" G_GINT64_FORMAT "\n"
+                            "avg_wait_ms %" G_GINT64_FORMAT "\n"
+                            "max_wait_ms %" G_GINT64_FORMAT "\n",
+                            ConnectionPool_size (db->pool),
+                            ConnectionPool_active (db->pool),
+                            ConnectionPool_getMaxConnections (db->pool),
+                            db->n_waiting, db->n_waits, db->n_wait_timeouts,
+                            db->n_waits ? db->total_wait_us / db->n_waits / 1000 : 0,
+                            db->max_wait_us / 1000);
+    for (i = 0; db->replicas && i < db->replicas->len; ++i) {
+        r = g_ptr_array_index (db->replicas, i);
+        g_string_append_printf (buf, "replica %s healthy %d lag %d "
+                                "reads %" G_GINT64_FORMAT "\n",
+                                r->host, r->healthy, r->lag, r->n_reads);
+    }
+    pthread_mutex_unlock (&db->lock);
+
+    return g_string_free (buf, FALSE);
+}
+
+static gint64
+read_pool_size (void *db)
+{
+    return ConnectionPool_size (((CcnetDB *)db)->pool);
+}
+
+static gint64
+read_pool_active (void *db)
+{
+    return ConnectionPool_active (((CcnetDB *)db)->pool);
+}
+
+static gint64
+read_pool_max (void *db)
+{
+    return ConnectionPool_getMaxConnections (((CcnetDB *)db)->pool);
+}
+
+static gint64
+read_pool_waiting (void *vdb)
+{
+    CcnetDB *db = vdb;
+    int n;
+
+    pthread_mutex_lock (&db->lock);
+    n = db->n_waiting;
+    pthread_mutex_unlock (&db->lock);
+    return n;
+}
+
+void
+ccnet_db_register_metrics (CcnetDB *db)
+{
+    static const double wait_bounds[] = {
+        0.001, 0.01, 0.05, 0.1, 0.25, 0.5, 1,
+    };
+
+    ccnet_metrics_gauge_func ("ccnet_db_connections", "state=\"open\"",
+                              "Database connections by state",
+                              read_pool_size, db);
+    ccnet_metrics_gauge_func ("ccnet_db_connections", "state=\"active\"",
+                              "Database connections by state",
+                              read_pool_active, db);
+    ccnet_metrics_gauge_func ("ccnet_db_connections", "state=\"max\"",
+                              "Database connections by state",
+                              read_pool_max, db);
+    ccnet_metrics_gauge_func ("ccnet_db_waiting_callers", NULL,
+                              "Callers waiting for a free connection",
+                              read_pool_waiting, db);
+
+    db->metric_acquired = ccnet_metrics_counter (
+        "ccnet_db_connections_acquired_total", NULL,
+        "Connections taken from the pool");
+    db->metric_wait = ccnet_metrics_histogram (
+        "ccnet_db_wait_seconds", NULL,
+        "Time waited for a connection when the pool was exhausted",
+        wait_bounds, G_N_ELEMENTS (wait_bounds));
+}
+
 int
 ccnet_db_query (CcnetDB *db, const char *sql)
 {
     Connection_T conn = get_db_connection (db);
     if (!conn)
         return -1;
+    note_write (db);
 
     /* Handle zdb "exception"s. */
     TRY
         Connection_execute (conn, "%s", sql);
-        Connection_close (conn);
+        release_db_connection (db, conn);
         RETURN (0);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn);
+        return -1;
+    END_TRY;
+
+    /* Should not be reached. */
+    return 0;
+}
+
+gint64
+ccnet_db_query_changes (CcnetDB *db, const char *sql)
+{
+    Connection_T conn = get_db_connection (db);
+    gint64 changes;
+
+    if (!conn)
+        return -1;
+    note_write (db);
+
+    TRY
+        Connection_execute (conn, "%s", sql);
+        changes = (gint64) Connection_rowsChanged (conn);
+        release_db_connection (db, conn);
+        RETURN (changes);
+    CATCH (SQLException)
+        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
+        release_db_connection (db, conn);
         return -1;
     END_TRY;
 
@@ -156,7 +618,7 @@ ccnet_db_check_for_existence (CcnetDB *db, const char *sql)
     ResultSet_T result;
     gboolean ret = TRUE;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (&db);
     if (!conn) {
         return FALSE;
     }
@@ -165,7 +627,7 @@ ccnet_db_check_for_existence (CcnetDB *db, const char *sql)
         result = Connection_executeQuery (conn, "%s", sql);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn);
         return FALSE;
     END_TRY;
 
@@ -174,11 +636,11 @@ ccnet_db_check_for_existence (CcnetDB *db, const char *sql)
             ret = FALSE;
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn);
         return FALSE;
     END_TRY;
 
-    Connection_close (conn);
+    release_db_connection (db, conn);
 
     return ret;
 }
@@ -192,7 +654,7 @@ ccnet_db_foreach_selected_row (CcnetDB *db, const char *sql,
     CcnetDBRow ccnet_row;
     int n_rows = 0;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (&db);
     if (!conn)
         return -1;
 
@@ -200,7 +662,7 @@ ccnet_db_foreach_selected_row (CcnetDB *db, const char *sql,
         result = Connection_executeQuery (conn, "%s", sql);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn);
         return -1;
     END_TRY;
 
@@ -213,14 +675,77 @@ ccnet_db_foreach_selected_row (CcnetDB *db, const char *sql,
         }
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn);
         return -1;
     END_TRY;
 
-    Connection_close (conn);
+    release_db_connection (db, conn);
     return n_rows;
 }
 
+/* Cursors */
+
+struct CcnetDBCursor {
+    CcnetDB      *db;           /* that the connection belongs to */
+    Connection_T  conn;
+    CcnetDBRow    row;
+    char         *sql;
+};
+
+CcnetDBCursor *
+ccnet_db_cursor_open (CcnetDB *db, const char *sql)
+{
+    CcnetDBCursor *cursor;
+    Connection_T conn;
+    ResultSet_T result;
+
+    conn = get_read_connection (&db);
+    if (!conn)
+        return NULL;
+
+    TRY
+        result = Connection_executeQuery (conn, "%s", sql);
+    CATCH (SQLException)
+        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
+        release_db_connection (db, conn);
+        return NULL;
+    END_TRY;
+
+    cursor = g_new0 (CcnetDBCursor, 1);
+    cursor->db = db;
+    cursor->conn = conn;
+    cursor->row.res = result;
+    cursor->sql = g_strdup (sql);
+    return cursor;
+}
+
+int
+ccnet_db_cursor_next (CcnetDBCursor *cursor, CcnetDBRow **row)
+{
+    int ret = 0;
+
+    TRY
+        if (ResultSet_next (cursor->row.res))
+            ret = 1;
+    CATCH (SQLException)
+        g_warning ("Error exec query %s: %s.\n", cursor->sql,
+                   Exception_frame.message);
+        ret = -1;
+    END_TRY;
+
+    if (ret > 0)
+        *row = &cursor->row;
+    return ret;
+}
+
+void
+ccnet_db_cursor_close (CcnetDBCursor *cursor)
+{
+    release_db_connection (cursor->db, cursor->conn);
+    g_free (cursor->sql);
+    g_free (cursor);
+}
+
 const char *
 ccnet_db_row_get_column_text (CcnetDBRow *row, guint32 idx)
 {
@@ -245,6 +770,12 @@ ccnet_db_row_get_column_int64 (CcnetDBRow *row, guint32 idx)
     return ResultSet_getLLong (row->res, idx+1);
 }
 
+int
+ccnet_db_row_get_column_count (CcnetDBRow *row)
+{
+    return ResultSet_getColumnCount (row->res);
+}
+
 int
 ccnet_db_get_int (CcnetDB *db, const char *sql)
 {
@@ -253,7 +784,7 @@ ccnet_db_get_int (CcnetDB *db, const char *sql)
     ResultSet_T result;
     CcnetDBRow ccnet_row;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (&db);
     if (!conn)
         return -1;
 
@@ -261,7 +792,7 @@ ccnet_db_get_int (CcnetDB *db, const char *sql)
         result = Connection_executeQuery (conn, "%s", sql);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn);
         return -1;
     END_TRY;
 
@@ -272,11 +803,11 @@ ccnet_db_get_int (CcnetDB *db, const char *sql)
             ret = ccnet_db_row_get_column_int (&ccnet_row, 0);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn);
         return -1;
     END_TRY;
 
-    Connection_close (conn);
+    release_db_connection (db, conn);
     return ret;
 }
 
@@ -288,7 +819,7 @@ ccnet_db_get_int64 (CcnetDB *db, const char *sql)
     ResultSet_T result;
     CcnetDBRow ccnet_row;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (&db);
     if (!conn)
         return -1;
 
@@ -296,7 +827,7 @@ ccnet_db_get_int64 (CcnetDB *db, const char *sql)
         result = Connection_executeQuery (conn, "%s", sql);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn);
         return -1;
     END_TRY;
 
@@ -307,11 +838,11 @@ ccnet_db_get_int64 (CcnetDB *db, const char *sql)
             ret = ccnet_db_row_get_column_int64 (&ccnet_row, 0);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn);
         return -1;
     END_TRY;
 
-    Connection_close (conn);
+    release_db_connection (db, conn);
     return ret;
 }
 
@@ -324,7 +855,7 @@ ccnet_db_get_string (CcnetDB *db, const char *sql)
     ResultSet_T result;
     CcnetDBRow ccnet_row;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (&db);
     if (!conn)
         return NULL;
 
@@ -332,7 +863,7 @@ ccnet_db_get_string (CcnetDB *db, const char *sql)
         result = Connection_executeQuery (conn, "%s", sql);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn);
         return NULL;
     END_TRY;
 
@@ -345,10 +876,651 @@ ccnet_db_get_string (CcnetDB *db, const char *sql)
         }
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn);
         return NULL;
     END_TRY;
 
-    Connection_close (conn);
+    release_db_connection (db, conn);
+    return ret;
+}
+
+/* Statements with bound parameters. */
+
+static PreparedStatement_T
+prepare_statement (Connection_T conn, const char *sql, int n, va_list args)
+{
+    PreparedStatement_T stmt;
+    const char *type;
+    int i;
+
+    TRY
+        stmt = Connection_prepareStatement (conn, "%s", sql);
+        /* stmt is reset on a bad type; no break out of TRY */
+        for (i = 0; i < n && stmt; i++) {
+            type = va_arg (args, const char *);
+            if (strcmp (type, "int") == 0)
+                PreparedStatement_setInt (stmt, i + 1, va_arg (args, int));
+            else if (strcmp (type, "int64") == 0)
+                PreparedStatement_setLLong (stmt, i + 1,
+                                            va_arg (args, gint64));
+            else if (strcmp (type, "string") == 0)
+                PreparedStatement_setString (stmt, i + 1,
+                                             va_arg (args, const char *));
+            else {
+                g_warning ("BUG: invalid parameter type %s.\n", type);
+                stmt = NULL;
+            }
+        }
+    CATCH (SQLException)
+        g_warning ("Error prepare statement %s: %s.\n", sql,
+                   Exception_frame.message);
+        return NULL;
+    END_TRY;
+
+    return stmt;
+}
+
+/* Run @stmt prepared on @conn and release @conn. */
+static int
+foreach_statement_row (CcnetDB *db, Connection_T conn,
+                       PreparedStatement_T stmt, const char *sql,
+                       CcnetDBRowFunc callback, void *data)
+{
+    ResultSet_T result;
+    CcnetDBRow ccnet_row;
+    int n_rows = 0;
+
+    TRY
+        result = PreparedStatement_executeQuery (stmt);
+    CATCH (SQLException)
+        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
+        release_db_connection (db, conn);
+        return -1;
+    END_TRY;
+
+    ccnet_row.res = result;
+    TRY
+        while (ResultSet_next (result)) {
+            n_rows++;
+            if (!callback || !callback (&ccnet_row, data))
+                break;
+        }
+    CATCH (SQLException)
+        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
+        release_db_connection (db, conn);
+        return -1;
+    END_TRY;
+
+    /* also frees the statement */
+    release_db_connection (db, conn);
+    return n_rows;
+}
+
+static int
+statement_foreach_row (CcnetDB *db, const char *sql,
+                       CcnetDBRowFunc callback, void *data,
+                       int n, va_list args)
+{
+    Connection_T conn;
+    PreparedStatement_T stmt;
+
+    conn = get_read_connection (&db);
+    if (!conn)
+        return -1;
+
+    stmt = prepare_statement (conn, sql, n, args);
+    if (!stmt) {
+        release_db_connection (db, conn);
+        return -1;
+    }
+
+    return foreach_statement_row (db, conn, stmt, sql, callback, data);
+}
+
+int
+ccnet_db_statement_foreach_row_strv (CcnetDB *db, const char *sql,
+                                     CcnetDBRowFunc callback, void *data,
+                                     char **params, int n)
+{
+    Connection_T conn;
+    PreparedStatement_T stmt;
+    int i;
+
+    conn = get_read_connection (&db);
+    if (!conn)
+        return -1;
+
+    TRY
+        stmt = Connection_prepareStatement (conn, "%s", sql);
+        for (i = 0; i < n; i++)
+            PreparedStatement_setString (stmt, i + 1, params[i]);
+    CATCH (SQLException)
+        g_warning ("Error prepare statement %s: %s.\n", sql,
+                   Exception_frame.message);
+        release_db_connection (db, conn);
+        return -1;
+    END_TRY;
+
+    return foreach_statement_row (db, conn, stmt, sql, callback, data);
+}
+
+int
+ccnet_db_statement_query (CcnetDB *db, const char *sql, int n, ...)
+{
+    Connection_T conn;
+    PreparedStatement_T stmt;
+    va_list args;
+
+    conn = get_db_connection (db);
+    if (!conn)
+        return -1;
+    note_write (db);
+
+    va_start (args, n);
+    stmt = prepare_statement (conn, sql, n, args);
+    va_end (args);
+    if (!stmt) {
+        release_db_connection (db, conn);
+        return -1;
+    }
+
+    TRY
+        PreparedStatement_execute (stmt);
+        release_db_connection (db, conn);
+        RETURN (0);
+    CATCH (SQLException)
+        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
+        release_db_connection (db, conn);
+        return -1;
+    END_TRY;
+
+    /* Should not be reached. */
+    return 0;
+}
+
+gboolean
+ccnet_db_statement_exists (CcnetDB *db, const char *sql, int n, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start (args, n);
+    ret = statement_foreach_row (db, sql, NULL, NULL, n, args);
+    va_end (args);
+
+    return ret > 0;
+}
+
+int
+ccnet_db_statement_foreach_row (CcnetDB *db, const char *sql,
+                                CcnetDBRowFunc callback, void *data,
+                                int n, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start (args, n);
+    ret = statement_foreach_row (db, sql, callback, data, n, args);
+    va_end (args);
+
+    return ret;
+}
+
+static gboolean
+get_int_cb (CcnetDBRow *row, void *data)
+{
+    *(int *)data = ccnet_db_row_get_column_int (row, 0);
+    return FALSE;
+}
+
+int
+ccnet_db_statement_get_int (CcnetDB *db, const char *sql, int n, ...)
+{
+    va_list args;
+    int ret = -1;
+
+    va_start (args, n);
+    statement_foreach_row (db, sql, get_int_cb, &ret, n, args);
+    va_end (args);
+
     return ret;
 }
+
+static gboolean
+get_string_cb (CcnetDBRow *row, void *data)
+{
+    *(char **)data = g_strdup (ccnet_db_row_get_column_text (row, 0));
+    return FALSE;
+}
+
+char *
+ccnet_db_statement_get_string (CcnetDB *db, const char *sql, int n, ...)
+{
+    va_list args;
+    char *ret = NULL;
+
+    va_start (args, n);
+    statement_foreach_row (db, sql, get_string_cb, &ret, n, args);
+    va_end (args);
+
+    return ret;
+}
+
+/* Schema versions */
+
+int
+ccnet_db_get_schema_version (CcnetDB *db, const char *name)
+{
+    /* Created here, so looking up a new db doesn't log an error. */
+    if (ccnet_db_query (db, "CREATE TABLE IF NOT EXISTS SchemaVersion ("
+                        "name VARCHAR(64) PRIMARY KEY, version INTEGER)") < 0)
+        return -1;
+
+    return ccnet_db_statement_get_int (
+        db, "SELECT version FROM SchemaVersion WHERE name=?",
+        1, "string", name);
+}
+
+int
+ccnet_db_set_schema_version (CcnetDB *db, const char *name, int version)
+{
+    return ccnet_db_statement_query (
+        db, "REPLACE INTO SchemaVersion (name, version) VALUES (?, ?)",
+        2, "string", name, "int", version);
+}
+
+int
+ccnet_db_index_exists (CcnetDB *db, const char *table, const char *index)
+{
+    if (db->type == CCNET_DB_TYPE_MYSQL)
+        return ccnet_db_statement_exists (
+            db, "SELECT 1 FROM information_schema.statistics WHERE "
+            "table_schema=DATABASE() AND table_name=? AND index_name=?",
+            2, "string", table, "string", index);
+
+    return ccnet_db_statement_exists (
+        db, "SELECT 1 FROM sqlite_master WHERE type='index' AND "
+        "tbl_name=? AND name=?", 2, "string", table, "string", index);
+}
+
+/* Transactions */
+
+struct CcnetDBTrans {
+    CcnetDB *db;
+    Connection_T conn;
+};
+
+CcnetDBTrans *
+ccnet_db_begin_transaction (CcnetDB *db)
+{
+    Connection_T conn;
+    CcnetDBTrans *trans;
+
+    conn = get_db_connection (db);
+    if (!conn)
+        return NULL;
+    note_write (db);
+
+    TRY
+        Connection_beginTransaction (conn);
+    CATCH (SQLException)
+        g_warning ("Failed to begin transaction: %s.\n", Exception_frame.message);
+        release_db_connection (db, conn);
+        return NULL;
+    END_TRY;
+
+    trans = g_new0 (CcnetDBTrans, 1);
+    trans->db = db;
+    trans->conn = conn;
+    return trans;
+}
+
+int
+ccnet_db_trans_query_strv (CcnetDBTrans *trans, const char *sql,
+                           char **params, int n)
+{
+    PreparedStatement_T stmt;
+    int i;
+
+    TRY
+        stmt = Connection_prepareStatement (trans->conn, "%s", sql);
+        for (i = 0; i < n; i++)
+            PreparedStatement_setString (stmt, i + 1, params[i]);
+        PreparedStatement_execute (stmt);
+        RETURN (0);
+    CATCH (SQLException)
+        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
+        return -1;
+    END_TRY;
+
+    /* Should not be reached. */
+    return 0;
+}
+
+int
+ccnet_db_commit (CcnetDBTrans *trans)
+{
+    int ret = 0;
+
+    TRY
+        Connection_commit (trans->conn);
+    CATCH (SQLException)
+        g_warning ("Failed to commit transaction: %s.\n",
+                   Exception_frame.message);
+        ret = -1;
+    END_TRY;
+
+    if (ret < 0) {
+        ccnet_db_rollback (trans);
+        return -1;
+    }
+
+    release_db_connection (trans->db, trans->conn);
+    g_free (trans);
+    return 0;
+}
+
+void
+ccnet_db_rollback (CcnetDBTrans *trans)
+{
+    TRY
+        Connection_rollback (trans->conn);
+    CATCH (SQLException)
+        g_warning ("Failed to roll back transaction: %s.\n",
+                   Exception_frame.message);
+    END_TRY;
+
+    release_db_connection (trans->db, trans->conn);
+    g_free (trans);
+}
+
+/* Asynchronous queries */
+
+CcnetJobManager *
+ccnet_db_get_job_manager (CcnetDB *db)
+{
+    int n_threads;
+
+    /* More threads than connections would only queue in get_db_connection. */
+    if (!db->jobs) {
+        n_threads = ccnet_db_pool_config.max_connections;
+        if (n_threads <= 0)
+            n_threads = 20;
+        db->jobs = ccnet_job_manager_new (n_threads);
+    }
+    return db->jobs;
+}
+
+typedef struct DBAsyncJob {
+    CcnetDB *db;
+    CcnetDBJobFunc func;
+    CcnetDBJobDone done;
+    void *data;
+    void *result;
+} DBAsyncJob;
+
+static void *
+db_job_thread (void *vjob)
+{
+    DBAsyncJob *job = vjob;
+
+    job->result = job->func (job->db, job->data);
+    return job;
+}
+
+static void
+db_job_done (void *vjob)
+{
+    DBAsyncJob *job = vjob;
+
+    if (job->done)
+        job->done (job->result, job->data);
+    g_free (job);
+}
+
+int
+ccnet_db_run_async (CcnetDB *db, CcnetDBJobFunc func,
+                    CcnetDBJobDone done, void *data)
+{
+    DBAsyncJob *job;
+
+    job = g_new0 (DBAsyncJob, 1);
+    job->db = db;
+    job->func = func;
+    job->done = done;
+    job->data = data;
+
+    ccnet_job_manager_schedule_job (ccnet_db_get_job_manager (db),
+                                    db_job_thread, db_job_done, job);
+    return 0;
+}
+
+typedef struct QueryAsyncData {
+    char *sql;
+    CcnetDBRowFunc row_func;
+    CcnetDBQueryDone done;
+    void *data;
+    int ret;
+} QueryAsyncData;
+
+static void *
+query_thread (CcnetDB *db, void *vdata)
+{
+    QueryAsyncData *qdata = vdata;
+
+    if (qdata->row_func)
+        qdata->ret = ccnet_db_foreach_selected_row (db, qdata->sql,
+                                                    qdata->row_func,
+                                                    qdata->data);
+    else
+        qdata->ret = ccnet_db_query (db, qdata->sql);
+    return qdata;
+}
+
+static void
+query_done (void *result, void *vdata)
+{
+    QueryAsyncData *qdata = vdata;
+
+    if (qdata->done)
+        qdata->done (qdata->ret, qdata->data);
+    g_free (qdata->sql);
+    g_free (qdata);
+}
+
+static int
+schedule_query (CcnetDB *db, const char *sql, CcnetDBRowFunc row_func,
+                CcnetDBQueryDone done, void *data)
+{
+    QueryAsyncData *qdata;
+
+    qdata = g_new0 (QueryAsyncData, 1);
+    qdata->sql = g_strdup (sql);
+    qdata->row_func = row_func;
+    qdata->done = done;
+    qdata->data = data;
+
+    return ccnet_db_run_async (db, query_thread, query_done, qdata);
+}
+
+int
+ccnet_db_query_async (CcnetDB *db, const char *sql,
+                      CcnetDBQueryDone done, void *data)
+{
+    return schedule_query (db, sql, NULL, done, data);
+}
+
+int
+ccnet_db_foreach_selected_row_async (CcnetDB *db, const char *sql,
+                                     CcnetDBRowFunc callback,
+                                     CcnetDBQueryDone done, void *data)
+{
+    g_return_val_if_fail (callback != NULL, -1);
+
+    return schedule_query (db, sql, callback, done, data);
+}
+
+/* Org shards */
+
+struct CcnetDBShards {
+    CcnetDB         *directory;
+    GPtrArray       *dbs;           /* by shard number, 0 the directory */
+
+    pthread_mutex_t  lock;
+    GHashTable      *by_org;        /* org id -> shard number + 1 */
+    GArray          *n_orgs;        /* int, by shard number */
+};
+
+CcnetDBShards *
+ccnet_db_shards_new (CcnetDB *directory)
+{
+    CcnetDBShards *shards;
+    const char *sql;
+    int zero = 0;
+
+    sql = (directory->type == CCNET_DB_TYPE_MYSQL) ?
+        "CREATE TABLE IF NOT EXISTS OrgShard (org_id INTEGER PRIMARY KEY,"
+        " shard INTEGER, INDEX (shard)) ENGINE=INNODB" :
+        "CREATE TABLE IF NOT EXISTS OrgShard (org_id INTEGER PRIMARY KEY,"
+        " shard INTEGER)";
+    if (ccnet_db_query (directory, sql) < 0)
+        return NULL;
+
+    shards = g_new0 (CcnetDBShards, 1);
+    shards->directory = directory;
+    shards->dbs = g_ptr_array_new ();
+    g_ptr_array_add (shards->dbs, directory);
+    pthread_mutex_init (&shards->lock, NULL);
+    shards->by_org = g_hash_table_new (g_direct_hash, g_direct_equal);
+    shards->n_orgs = g_array_new (FALSE, TRUE, sizeof(int));
+    g_array_append_val (shards->n_orgs, zero);
+
+    return shards;
+}
+
+int
+ccnet_db_shards_add (CcnetDBShards *shards, CcnetDB *db)
+{
+    int shard = shards->dbs->len;
+    int n;
+
+    n = ccnet_db_statement_get_int (shards->directory,
+                                    "SELECT COUNT(*) FROM OrgShard "
+                                    "WHERE shard=?", 1, "int", shard);
+    if (n < 0)
+        return -1;
+
+    pthread_mutex_lock (&shards->lock);
+    g_ptr_array_add (shards->dbs, db);
+    g_array_append_val (shards->n_orgs, n);
+    pthread_mutex_unlock (&shards->lock);
+
+    return shard;
+}
+
+int
+ccnet_db_shards_count (CcnetDBShards *shards)
+{
+    return shards->dbs->len - 1;
+}
+
+CcnetDB *
+ccnet_db_shards_get_db (CcnetDBShards *shards, int shard)
+{
+    if (shard < 0 || shard >= (int)shards->dbs->len)
+        return NULL;
+    return g_ptr_array_index (shards->dbs, shard);
+}
+
+CcnetDB *
+ccnet_db_shards_for_org (CcnetDBShards *shards, int org_id)
+{
+    gpointer value;
+    int shard;
+
+    pthread_mutex_lock (&shards->lock);
+    value = g_hash_table_lookup (shards->by_org, GINT_TO_POINTER(org_id));
+    pthread_mutex_unlock (&shards->lock);
+    if (value)
+        return ccnet_db_shards_get_db (shards, GPOINTER_TO_INT(value) - 1);
+
+    shard = ccnet_db_statement_get_int (shards->directory,
+                                        "SELECT shard FROM OrgShard "
+                                        "WHERE org_id=?", 1, "int", org_id);
+    if (shard < 0)
+        return shards->directory;
+    if (shard >= (int)shards->dbs->len) {
+        g_warning ("Org %d is on shard %d, which is not configured.\n",
+                   org_id, shard);
+        return NULL;
+    }
+
+    pthread_mutex_lock (&shards->lock);
+    g_hash_table_insert (shards->by_org, GINT_TO_POINTER(org_id),
+                         GINT_TO_POINTER(shard + 1));
+    pthread_mutex_unlock (&shards->lock);
+
+    return ccnet_db_shards_get_db (shards, shard);
+}
+
+CcnetDB *
+ccnet_db_shards_assign (CcnetDBShards *shards, int org_id)
+{
+    int shard, best = 0;
+    guint i;
+
+    /* The counts are this node's view, close enough for balancing. */
+    pthread_mutex_lock (&shards->lock);
+    for (i = 1; i < shards->n_orgs->len; ++i)
+        if (best == 0 || g_array_index (shards->n_orgs, int, i) <
+            g_array_index (shards->n_orgs, int, best))
+            best = i;
+    pthread_mutex_unlock (&shards->lock);
+
+    shard = best;
+    if (ccnet_db_statement_query (shards->directory,
+                                  "INSERT INTO OrgShard (org_id, shard) "
+                                  "VALUES (?, ?)",
+                                  2, "int", org_id, "int", shard) < 0)
+        return NULL;
+
+    pthread_mutex_lock (&shards->lock);
+    g_array_index (shards->n_orgs, int, shard)++;
+    g_hash_table_insert (shards->by_org, GINT_TO_POINTER(org_id),
+                         GINT_TO_POINTER(shard + 1));
+    pthread_mutex_unlock (&shards->lock);
+
+    return ccnet_db_shards_get_db (shards, shard);
+}
+
+void
+ccnet_db_shards_forget (CcnetDBShards *shards, int org_id)
+{
+    gpointer value;
+    int shard;
+
+    pthread_mutex_lock (&shards->lock);
+    value = g_hash_table_lookup (shards->by_org, GINT_TO_POINTER(org_id));
+    g_hash_table_remove (shards->by_org, GINT_TO_POINTER(org_id));
+    if (value) {
+        shard = GPOINTER_TO_INT(value) - 1;
+        if (g_array_index (shards->n_orgs, int, shard) > 0)
+            g_array_index (shards->n_orgs, int, shard)--;
+    }
+    pthread_mutex_unlock (&shards->lock);
+
+    ccnet_db_statement_query (shards->directory,
+                              "DELETE FROM OrgShard WHERE org_id=?",
+                              1, "int", org_id);
+}
+
+void
+ccnet_db_shards_foreach (CcnetDBShards *shards, CcnetDBShardFunc func,
+                         void *data)
+{
+    guint i;
+
+    for (i = 0; i < shards->dbs->len; ++i)
+        if (!func (g_ptr_array_index (shards->dbs, i), i, data))
+            break;
+}
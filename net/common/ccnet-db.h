@@ -21,6 +21,44 @@ typedef struct CcnetDBRow CcnetDBRow;
 
 typedef gboolean (*CcnetDBRowFunc) (CcnetDBRow *, void *);
 
+/* Connection pool settings, applied to databases opened afterwards. */
+typedef struct CcnetDBPoolConfig {
+    int min_connections;
+    int max_connections;
+    int idle_timeout;           /* seconds before idle connections close */
+    int wait_timeout_ms;        /* how long to wait for a free connection */
+} CcnetDBPoolConfig;
+
+extern CcnetDBPoolConfig ccnet_db_pool_config;
+
+/*
+ * Pragmas set on every new SQLite connection. NULL or 0 leaves the
+ * SQLite default.
+ */
+typedef struct CcnetDBSqliteConfig {
+    char   *journal_mode;       /* e.g. "wal" */
+    char   *synchronous;        /* e.g. "normal" */
+    gint64  mmap_size;          /* bytes */
+    int     cache_size;         /* pages, or KiB if negative */
+    int     busy_timeout_ms;
+} CcnetDBSqliteConfig;
+
+extern CcnetDBSqliteConfig ccnet_db_sqlite_config;
+
+/*
+ * MySQL read replicas, see ccnet_db_add_mysql_replica(). A replica
+ * serves reads while its Seconds_Behind_Master, checked every
+ * check_interval seconds, is at most max_lag. A thread that wrote reads
+ * from the primary for the next sticky_seconds, so it sees its writes.
+ */
+typedef struct CcnetDBReplicaConfig {
+    int max_lag;
+    int check_interval;
+    int sticky_seconds;
+} CcnetDBReplicaConfig;
+
+extern CcnetDBReplicaConfig ccnet_db_replica_config;
+
 CcnetDB *
 ccnet_db_new_mysql (const char *host,
                     const char *user,
@@ -28,6 +66,19 @@ ccnet_db_new_mysql (const char *host,
                     const char *db,
                     const char *unix_socket);
 
+/*
+ * Route the reads of @db, a MySQL database, to a replica too. Reads are
+ * ccnet_db_check_for_existence(), ccnet_db_foreach_selected_row(), the
+ * get functions and the statement versions of all these. If no replica
+ * is healthy they go to the primary.
+ */
+int
+ccnet_db_add_mysql_replica (CcnetDB *db,
+                            const char *host,
+                            const char *user,
+                            const char *passwd,
+                            const char *db_name);
+
 CcnetDB *
 ccnet_db_new_sqlite (const char *db_path);
 
@@ -37,9 +88,21 @@ ccnet_db_free (CcnetDB *db);
 int
 ccnet_db_type (CcnetDB *db);
 
+/* Pool size, utilisation and wait times, one "name value" per line. */
+char *
+ccnet_db_get_pool_stats (CcnetDB *db);
+
+/* Export the pool usage of @db, the main database, as metrics. */
+void
+ccnet_db_register_metrics (CcnetDB *db);
+
 int
 ccnet_db_query (CcnetDB *db, const char *sql);
 
+/* Like ccnet_db_query(), but returns the number of rows changed. */
+gint64
+ccnet_db_query_changes (CcnetDB *db, const char *sql);
+
 gboolean
 ccnet_db_check_for_existence (CcnetDB *db, const char *sql);
 
@@ -47,6 +110,23 @@ int
 ccnet_db_foreach_selected_row (CcnetDB *db, const char *sql,
                                CcnetDBRowFunc callback, void *data);
 
+/*
+ * The rows of a SELECT, read one at a time. The cursor holds a
+ * connection until it is closed, and a row is valid until the next
+ * call.
+ */
+typedef struct CcnetDBCursor CcnetDBCursor;
+
+CcnetDBCursor *
+ccnet_db_cursor_open (CcnetDB *db, const char *sql);
+
+/* 1 and @row set for a row, 0 after the last one, -1 on error. */
+int
+ccnet_db_cursor_next (CcnetDBCursor *cursor, CcnetDBRow **row);
+
+void
+ccnet_db_cursor_close (CcnetDBCursor *cursor);
+
 const char *
 ccnet_db_row_get_column_text (CcnetDBRow *row, guint32 idx);
 
@@ -56,6 +136,9 @@ ccnet_db_row_get_column_int (CcnetDBRow *row, guint32 idx);
 gint64
 ccnet_db_row_get_column_int64 (CcnetDBRow *row, guint32 idx);
 
+int
+ccnet_db_row_get_column_count (CcnetDBRow *row);
+
 int
 ccnet_db_get_int (CcnetDB *db, const char *sql);
 
@@ -65,13 +148,164 @@ ccnet_db_get_int64 (CcnetDB *db, const char *sql);
 char *
 ccnet_db_get_string (CcnetDB *db, const char *sql);
 
+/*
+ * Queries with '?' placeholders and bound parameters. The @n
+ * parameters follow as pairs of a type name ("int", "int64" or
+ * "string") and a value.
+ */
+int
+ccnet_db_statement_query (CcnetDB *db, const char *sql, int n, ...);
+
+gboolean
+ccnet_db_statement_exists (CcnetDB *db, const char *sql, int n, ...);
+
+int
+ccnet_db_statement_foreach_row (CcnetDB *db, const char *sql,
+                                CcnetDBRowFunc callback, void *data,
+                                int n, ...);
+
+/* Same, binding the @n strings in @params, for lists built at runtime. */
+int
+ccnet_db_statement_foreach_row_strv (CcnetDB *db, const char *sql,
+                                     CcnetDBRowFunc callback, void *data,
+                                     char **params, int n);
+
+int
+ccnet_db_statement_get_int (CcnetDB *db, const char *sql, int n, ...);
+
+char *
+ccnet_db_statement_get_string (CcnetDB *db, const char *sql, int n, ...);
+
+/*
+ * Several statements on one connection in a single transaction.
+ * ccnet_db_commit() and ccnet_db_rollback() release @trans; a failed
+ * commit is rolled back.
+ */
+typedef struct CcnetDBTrans CcnetDBTrans;
+
+CcnetDBTrans *
+ccnet_db_begin_transaction (CcnetDB *db);
+
+/* Bind the @n strings in @params to the placeholders of @sql. */
+int
+ccnet_db_trans_query_strv (CcnetDBTrans *trans, const char *sql,
+                           char **params, int n);
+
+int
+ccnet_db_commit (CcnetDBTrans *trans);
+
+void
+ccnet_db_rollback (CcnetDBTrans *trans);
+
+/*
+ * Versions of the tables of each manager, kept in the SchemaVersion
+ * table, so the CREATE statements are only run when they changed.
+ * Returns -1 if no version is stored for @name.
+ */
+int
+ccnet_db_get_schema_version (CcnetDB *db, const char *name);
+
+int
+ccnet_db_set_schema_version (CcnetDB *db, const char *name, int version);
+
+/* 1 if @table has an index named @index, for migrations adding indexes
+ * to existing tables, which MySQL has no IF NOT EXISTS for. */
+int
+ccnet_db_index_exists (CcnetDB *db, const char *table, const char *index);
+
+/*
+ * Asynchronous variants. The query runs in a thread pool owned by @db
+ * and @done is called in the main loop afterwards. Row callbacks run
+ * in the worker thread, so they must only collect data for @done.
+ */
+struct _CcnetJobManager;
+
+typedef void *(*CcnetDBJobFunc) (CcnetDB *db, void *data);
+typedef void (*CcnetDBJobDone) (void *result, void *data);
+typedef void (*CcnetDBQueryDone) (int ret, void *data);
+
+/* The thread pool, for callers running several queries in one job. */
+struct _CcnetJobManager *
+ccnet_db_get_job_manager (CcnetDB *db);
+
+int
+ccnet_db_run_async (CcnetDB *db, CcnetDBJobFunc func,
+                    CcnetDBJobDone done, void *data);
+
+int
+ccnet_db_query_async (CcnetDB *db, const char *sql,
+                      CcnetDBQueryDone done, void *data);
+
+/* @ret passed to @done is the number of rows, or -1 on error. */
+int
+ccnet_db_foreach_selected_row_async (CcnetDB *db, const char *sql,
+                                     CcnetDBRowFunc callback,
+                                     CcnetDBQueryDone done, void *data);
+
+/*
+ * Org sharding. The org-scoped rows of an organization live in one
+ * database, its shard, while global tables stay in the directory, the
+ * main database. The OrgShard table of the directory maps org ids to
+ * shard numbers. Shard 0 is the directory itself, which is where orgs
+ * without a row are. This covers the orgs created before sharding was
+ * turned on. The shards added with ccnet_db_shards_add() are numbered
+ * from 1 in the order they are added, so that order must not change
+ * once orgs are assigned. New orgs go to the shard with the fewest orgs.
+ *
+ * Mappings never change once made, so they are cached. Orgs without a
+ * row are not cached, since another node may be creating them.
+ */
+typedef struct CcnetDBShards CcnetDBShards;
+
+CcnetDBShards *
+ccnet_db_shards_new (CcnetDB *directory);
+
+/* Returns the number of the new shard, -1 on error. */
+int
+ccnet_db_shards_add (CcnetDBShards *shards, CcnetDB *db);
+
+/* Shards besides the directory, 0 when sharding is off. */
+int
+ccnet_db_shards_count (CcnetDBShards *shards);
+
+/* @shard from 0, the directory, to ccnet_db_shards_count(). */
+CcnetDB *
+ccnet_db_shards_get_db (CcnetDBShards *shards, int shard);
+
+/* The shard of @org_id. NULL if OrgShard names a shard that isn't
+ * configured here. */
+CcnetDB *
+ccnet_db_shards_for_org (CcnetDBShards *shards, int org_id);
+
+/* Place a new org, before any of its rows are written. */
+CcnetDB *
+ccnet_db_shards_assign (CcnetDBShards *shards, int org_id);
+
+/* Drop the mapping of a removed org. */
+void
+ccnet_db_shards_forget (CcnetDBShards *shards, int org_id);
+
+/*
+ * Cross-shard fan-out, for admin listings only: @func is called for
+ * the directory and then every shard, until it returns FALSE.
+ */
+typedef gboolean (*CcnetDBShardFunc) (CcnetDB *db, int shard, void *data);
+
+void
+ccnet_db_shards_foreach (CcnetDBShards *shards, CcnetDBShardFunc func,
+                         void *data);
+
 #else
 
 #define CcnetDB sqlite3
 #define CcnetDBRow sqlite3_stmt
 
+/* Read connections of the daemon's databases, see lib/db.h. */
+#define CCNET_DB_READ_CONNECTIONS 4
+
 #define ccnet_db_query sqlite_query_exec
 #define ccnet_db_free sqlite_close_db
+#define ccnet_db_enable_read_pool sqlite_enable_read_pool
 #define ccnet_db_begin_transaction sqlite_begin_transaction
 #define ccnet_db_end_transaction sqlite_end_transaction
 #define ccnet_db_check_for_existence sqlite_check_for_existence
@@ -79,9 +313,15 @@ ccnet_db_get_string (CcnetDB *db, const char *sql);
 #define ccnet_db_row_get_column_text  sqlite3_column_text
 #define ccnet_db_row_get_column_int   sqlite3_column_int
 #define ccnet_db_row_get_column_int64 sqlite3_column_int64
+#define ccnet_db_row_get_column_count sqlite3_column_count
 #define ccnet_db_get_int sqlite_get_int
 #define ccnet_db_get_int64 sqlite_get_int64
 #define ccnet_db_get_string sqlite_get_string
+#define ccnet_db_statement_query sqlite_statement_query
+#define ccnet_db_statement_exists sqlite_statement_exists
+#define ccnet_db_statement_foreach_row sqlite_statement_foreach_row
+#define ccnet_db_statement_get_int sqlite_statement_get_int
+#define ccnet_db_statement_get_string sqlite_statement_get_string
 
 #define ccnet_sql_printf sqlite3_mprintf
 #define ccnet_sql_free sqlite3_free
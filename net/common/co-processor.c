@@ -0,0 +1,130 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "peer.h"
+#include "co-processor.h"
+
+#ifdef CCNET_SERVER
+#include "job-mgr.h"
+#endif
+
+#include "log.h"
+
+G_DEFINE_TYPE (CcnetCoProcessor, ccnet_co_processor, CCNET_TYPE_PROCESSOR)
+
+static void
+resume (CcnetCoProcessor *co, char *code, char *code_msg,
+        char *content, int clen)
+{
+    co->code = code;
+    co->code_msg = code_msg;
+    co->content = content;
+    co->clen = clen;
+
+    /* run() may finish the processor, don't touch it afterwards. */
+    CCNET_CO_PROCESSOR_GET_CLASS (co)->run (co);
+}
+
+static int
+start (CcnetProcessor *processor, int argc, char **argv)
+{
+    CcnetCoProcessor *co = CCNET_CO_PROCESSOR (processor);
+
+    co->argc = argc;
+    co->argv = argv;
+    resume (co, NULL, NULL, NULL, 0);
+
+    return 0;
+}
+
+static void
+handle_packet (CcnetProcessor *processor,
+               char *code, char *code_msg,
+               char *content, int clen)
+{
+    CcnetCoProcessor *co = CCNET_CO_PROCESSOR (processor);
+
+    if (processor->thread_running) {
+        /* run() is waiting for its thread, not for a packet. */
+        ccnet_warning ("[%s] unexpected packet %s from peer %.10s\n",
+                       GET_PNAME(processor), code, processor->peer->id);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    co->argc = 0;
+    co->argv = NULL;
+    resume (co, code, code_msg, content, clen);
+}
+
+static void
+release_resource (CcnetProcessor *processor)
+{
+    CcnetCoProcessor *co = CCNET_CO_PROCESSOR (processor);
+
+    co->co_line = 0;
+    co->argc = 0;
+    co->argv = NULL;
+    co->code = co->code_msg = co->content = NULL;
+    co->clen = 0;
+
+    CCNET_PROCESSOR_CLASS (ccnet_co_processor_parent_class)->release_resource (processor);
+}
+
+static void
+ccnet_co_processor_class_init (CcnetCoProcessorClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->start = start;
+    proc_class->handle_response = handle_packet;
+    proc_class->handle_update = handle_packet;
+    proc_class->release_resource = release_resource;
+}
+
+static void
+ccnet_co_processor_init (CcnetCoProcessor *co)
+{
+}
+
+#ifdef CCNET_SERVER
+
+typedef struct {
+    CcnetCoProcessor *co;
+    void *(*func) (void *);
+} CoThreadData;
+
+/* The data is freed here, as the done callback is skipped when the
+ * processor was shut down meanwhile. */
+static void *
+co_thread_func (void *vdata)
+{
+    CoThreadData *tdata = vdata;
+    CcnetCoProcessor *co = tdata->co;
+
+    tdata->func (co);
+    g_free (tdata);
+    return co;
+}
+
+static void
+co_thread_done (void *vco)
+{
+    resume (vco, NULL, NULL, NULL, 0);
+}
+
+void
+ccnet_co_processor_thread_create (CcnetCoProcessor *co,
+                                  CcnetJobManager *job_mgr,
+                                  void *(*func) (void *))
+{
+    CoThreadData *tdata = g_new (CoThreadData, 1);
+
+    tdata->co = co;
+    tdata->func = func;
+    ccnet_processor_thread_create (CCNET_PROCESSOR(co), job_mgr,
+                                   co_thread_func, co_thread_done, tdata);
+}
+
+#endif  /* CCNET_SERVER */
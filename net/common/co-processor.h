@@ -0,0 +1,122 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_CO_PROCESSOR_H
+#define CCNET_CO_PROCESSOR_H
+
+#include "processor.h"
+
+/*
+ * A processor written as one sequential function instead of a state
+ * machine spread over start, handle_response and handle_update.
+ *
+ * The subclass implements run(). It is called at start, and again for
+ * each response (master) or update (slave), continuing after the
+ * CO_AWAIT_* it stopped at:
+ *
+ *   static void
+ *   run (CcnetCoProcessor *co)
+ *   {
+ *       CO_BEGIN (co);
+ *       ccnet_processor_send_request (CCNET_PROCESSOR(co), "put-pubinfo");
+ *       CO_AWAIT_PACKET (co);
+ *       if (!co_code_is (co, SC_OK))
+ *           CO_DONE (co, FALSE);
+ *       ...
+ *       CO_END (co);
+ *   }
+ *
+ * The coroutines are stackless: the resume point is a line number kept
+ * in the instance, so local variables don't survive an await. Whatever
+ * has to is a field of the subclass instance, which also replaces the
+ * GObject private struct. Don't put two awaits on one line, and don't
+ * await inside a switch of your own.
+ *
+ * The keepalive and error codes are handled by the base processor as
+ * usual, run() only sees the other packets.
+ */
+
+#define CCNET_TYPE_CO_PROCESSOR                  (ccnet_co_processor_get_type ())
+#define CCNET_CO_PROCESSOR(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), CCNET_TYPE_CO_PROCESSOR, CcnetCoProcessor))
+#define CCNET_IS_CO_PROCESSOR(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), CCNET_TYPE_CO_PROCESSOR))
+#define CCNET_CO_PROCESSOR_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), CCNET_TYPE_CO_PROCESSOR, CcnetCoProcessorClass))
+#define CCNET_CO_PROCESSOR_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), CCNET_TYPE_CO_PROCESSOR, CcnetCoProcessorClass))
+
+typedef struct _CcnetCoProcessor CcnetCoProcessor;
+typedef struct _CcnetCoProcessorClass CcnetCoProcessorClass;
+
+struct _CcnetCoProcessor {
+    CcnetProcessor  parent_instance;
+
+    /* where run() continues, 0 before start */
+    int             co_line;
+
+    /* The arguments while run() starts, NULL afterwards. */
+    int             argc;
+    char          **argv;
+
+    /* The packet run() was resumed with, NULL after a thread. */
+    char           *code;
+    char           *code_msg;
+    char           *content;
+    int             clen;
+};
+
+struct _CcnetCoProcessorClass {
+    CcnetProcessorClass parent_class;
+
+    void      (*run)             (CcnetCoProcessor *co);
+};
+
+GType ccnet_co_processor_get_type ();
+
+#define CO_BEGIN(co)    switch ((co)->co_line) { case 0:
+
+/* Return to the event loop, and continue here when run() is resumed. */
+#define CO_YIELD(co)                            \
+    do {                                        \
+        (co)->co_line = __LINE__;               \
+        return;                                 \
+    case __LINE__:;                             \
+    } while (0)
+
+/* Wait for the next response or update, in co->code and so on. */
+#define CO_AWAIT_PACKET(co)     CO_YIELD(co)
+
+/* Finish the processor. @co may be freed, so we return at once. */
+#define CO_DONE(co, success)                                    \
+    do {                                                        \
+        ccnet_processor_done (CCNET_PROCESSOR(co), (success));  \
+        return;                                                 \
+    } while (0)
+
+/* Falling off the end finishes the processor successfully. */
+#define CO_END(co)                                      \
+        ccnet_processor_done (CCNET_PROCESSOR(co), TRUE);   \
+    }
+
+#define co_code_is(co, sc)  ((co)->code && memcmp ((co)->code, (sc), 3) == 0)
+
+#ifdef CCNET_SERVER
+
+struct _CcnetJobManager;
+
+/* Run @func (@co) in a thread of @job_mgr, or the session's job
+ * manager if it's NULL, and resume run() when it returns. */
+void ccnet_co_processor_thread_create (CcnetCoProcessor *co,
+                                       struct _CcnetJobManager *job_mgr,
+                                       void *(*func) (void *));
+
+#define CO_AWAIT_THREAD(co, job_mgr, func)                      \
+    do {                                                        \
+        ccnet_co_processor_thread_create ((co), (job_mgr), (func)); \
+        CO_YIELD(co);                                           \
+    } while (0)
+
+#else
+
+/* Without a thread pool the work is done in place. */
+#define CO_AWAIT_THREAD(co, job_mgr, func)      (func) (co)
+
+#endif
+
+#endif
@@ -0,0 +1,191 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "packet.h"
+
+#include "compress.h"
+
+/* zstd favours speed here, packets are compressed on the event loop. */
+#define ZSTD_LEVEL 1
+
+/* The buffer for decompressed packets is dropped after a larger one. */
+#define OUT_KEEP_MAX (256 * 1024)
+
+struct CcnetCompressCtx {
+    void        *lz4_state;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx   *zstd_cctx;
+    ZSTD_DCtx   *zstd_dctx;
+#endif
+    GByteArray  *out;
+};
+
+guint32
+ccnet_compress_caps (void)
+{
+    guint32 caps = 0;
+
+#ifdef HAVE_LZ4
+    caps |= CCNET_CAP_COMPRESS_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+    caps |= CCNET_CAP_COMPRESS_ZSTD;
+#endif
+    return caps;
+}
+
+int
+ccnet_compress_choose (int preferred, guint32 peer_caps)
+{
+    if (preferred == CCNET_COMPRESS_LZ4 &&
+        (peer_caps & ccnet_compress_caps () & CCNET_CAP_COMPRESS_LZ4))
+        return CCNET_COMPRESS_LZ4;
+    if (preferred == CCNET_COMPRESS_ZSTD &&
+        (peer_caps & ccnet_compress_caps () & CCNET_CAP_COMPRESS_ZSTD))
+        return CCNET_COMPRESS_ZSTD;
+    return CCNET_COMPRESS_NONE;
+}
+
+int
+ccnet_compress_from_string (const char *name)
+{
+    if (g_strcmp0 (name, "none") == 0)
+        return CCNET_COMPRESS_NONE;
+#ifdef HAVE_LZ4
+    if (g_strcmp0 (name, "lz4") == 0)
+        return CCNET_COMPRESS_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+    if (g_strcmp0 (name, "zstd") == 0)
+        return CCNET_COMPRESS_ZSTD;
+#endif
+    return -1;
+}
+
+CcnetCompressCtx *
+ccnet_compress_ctx_new (void)
+{
+    return g_new0 (CcnetCompressCtx, 1);
+}
+
+void
+ccnet_compress_ctx_free (CcnetCompressCtx *ctx)
+{
+    if (!ctx)
+        return;
+    g_free (ctx->lz4_state);
+#ifdef HAVE_ZSTD
+    if (ctx->zstd_cctx)
+        ZSTD_freeCCtx (ctx->zstd_cctx);
+    if (ctx->zstd_dctx)
+        ZSTD_freeDCtx (ctx->zstd_dctx);
+#endif
+    if (ctx->out)
+        g_byte_array_free (ctx->out, TRUE);
+    g_free (ctx);
+}
+
+int
+ccnet_compress_bound (int algo, int len)
+{
+    switch (algo) {
+#ifdef HAVE_LZ4
+    case CCNET_COMPRESS_LZ4:
+        return LZ4_compressBound (len);
+#endif
+#ifdef HAVE_ZSTD
+    case CCNET_COMPRESS_ZSTD:
+        return ZSTD_compressBound (len);
+#endif
+    default:
+        return len;
+    }
+}
+
+int
+ccnet_compress (CcnetCompressCtx *ctx, int algo,
+                const char *src, int len, char *dst, int cap)
+{
+    int ret = -1;
+
+    switch (algo) {
+#ifdef HAVE_LZ4
+    case CCNET_COMPRESS_LZ4:
+        /* The state is kept, LZ4_compress_default() puts 16K on the
+         * stack each time. */
+        if (!ctx->lz4_state)
+            ctx->lz4_state = g_malloc (LZ4_sizeofState ());
+        ret = LZ4_compress_fast_extState (ctx->lz4_state, src, dst,
+                                          len, cap, 1);
+        if (ret <= 0)
+            ret = -1;
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case CCNET_COMPRESS_ZSTD: {
+        size_t n;
+
+        if (!ctx->zstd_cctx && !(ctx->zstd_cctx = ZSTD_createCCtx ()))
+            return -1;
+        n = ZSTD_compressCCtx (ctx->zstd_cctx, dst, cap, src, len, ZSTD_LEVEL);
+        ret = ZSTD_isError (n) ? -1 : (int)n;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+
+    if (ret >= len)
+        return -1;
+    return ret;
+}
+
+char *
+ccnet_decompress (CcnetCompressCtx *ctx, int algo,
+                  const char *src, int len, int orig_len)
+{
+    char *dst;
+    int ret = -1;
+
+    if (!ctx->out)
+        ctx->out = g_byte_array_new ();
+    else if (ctx->out->len > OUT_KEEP_MAX && orig_len <= OUT_KEEP_MAX) {
+        g_byte_array_free (ctx->out, TRUE);
+        ctx->out = g_byte_array_new ();
+    }
+    if (ctx->out->len < orig_len)
+        g_byte_array_set_size (ctx->out, orig_len);
+    dst = (char *)ctx->out->data;
+
+    switch (algo) {
+#ifdef HAVE_LZ4
+    case CCNET_COMPRESS_LZ4:
+        ret = LZ4_decompress_safe (src, dst, len, orig_len);
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case CCNET_COMPRESS_ZSTD: {
+        size_t n;
+
+        if (!ctx->zstd_dctx && !(ctx->zstd_dctx = ZSTD_createDCtx ()))
+            return NULL;
+        n = ZSTD_decompressDCtx (ctx->zstd_dctx, dst, orig_len, src, len);
+        ret = ZSTD_isError (n) ? -1 : (int)n;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+
+    return ret == orig_len ? dst : NULL;
+}
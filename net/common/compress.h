@@ -0,0 +1,58 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_COMPRESS_H
+#define CCNET_COMPRESS_H
+
+#include <glib.h>
+
+/*
+ * Payload compression of peer packets.
+ *
+ * Peers announce the algorithms they can decompress with
+ * CCNET_CAP_COMPRESS_XXX in the handshake. Packets above [Network]
+ * COMPRESS_THRESHOLD then go out with CCNET_MSG_COMPRESSED set in their
+ * type, and a payload of
+ *
+ *   algorithm (1 byte) | original length (4 bytes) | compressed data
+ *
+ * before they are corked and encrypted. Smaller packets, and the ones
+ * that don't shrink, are sent as they are.
+ */
+
+enum {
+    CCNET_COMPRESS_NONE = 0,
+    CCNET_COMPRESS_LZ4,
+    CCNET_COMPRESS_ZSTD,
+};
+
+#define CCNET_COMPRESS_HEADER_LEN 5
+
+typedef struct CcnetCompressCtx CcnetCompressCtx;
+
+/* The CCNET_CAP_COMPRESS_XXX bits of the algorithms built in. */
+guint32 ccnet_compress_caps (void);
+
+/* Our @preferred algorithm if the peer announced it in @peer_caps, or
+ * CCNET_COMPRESS_NONE. */
+int ccnet_compress_choose (int preferred, guint32 peer_caps);
+
+/* "none", "lz4" or "zstd", -1 for unknown or not built in. */
+int ccnet_compress_from_string (const char *name);
+
+CcnetCompressCtx *ccnet_compress_ctx_new (void);
+void ccnet_compress_ctx_free (CcnetCompressCtx *ctx);
+
+/* Room @dst needs for compressing @len bytes. */
+int ccnet_compress_bound (int algo, int len);
+
+/* Compress @src into @dst, of @cap bytes, and return the length.
+ * Returns -1 on error or if the result isn't smaller than @len. */
+int ccnet_compress (CcnetCompressCtx *ctx, int algo,
+                    const char *src, int len, char *dst, int cap);
+
+/* Decompress @src into a buffer of @ctx, valid until the next call.
+ * Returns NULL unless it gives exactly @orig_len bytes. */
+char *ccnet_decompress (CcnetCompressCtx *ctx, int algo,
+                        const char *src, int len, int orig_len);
+
+#endif
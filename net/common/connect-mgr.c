@@ -4,6 +4,8 @@
 
 #include <stdio.h>
 #include <event2/util.h>
+#include <event2/dns.h>
+#include <event2/dns_compat.h>
 
 #include "net.h"
 #include "packet.h"
@@ -11,22 +13,45 @@
 #include "peer.h"
 #include "session.h"
 #include "handshake.h"
+#include "fast-setup.h"
 #include "message.h"
 #include "peer-mgr.h"
 #include "connect-mgr.h"
 #include "message-manager.h"
 #include "proc-factory.h"
+#include "metrics.h"
+#ifdef CCNET_SERVER
+#include "handover.h"
+#endif
 
 
-#define MAX_RECONNECTIONS_PER_PULSE  5
-#define LISTEN_INTERVAL 1000        /* 1s */
-#define RECONNECT_PERIOD_MSEC             10000
+#define MAX_CONNECTS_IN_FLIGHT       32
+#define LISTEN_BACKLOG  SOMAXCONN
+#define MAX_ACCEPTS_PER_EVENT  64   /* let established peers run too */
+#define MAX_INCOMING_HANDSHAKES      128
+/* Beyond this many queued, connections are left in the kernel backlog. */
+#define MAX_ACCEPT_QUEUE             1024
+/* Peers give up on handshakes after 10s, older connections are dropped. */
+#define ACCEPT_QUEUE_MAX_AGE         10
+#define ACCEPT_RETRY_MSEC            1000
+/* handshakes per second and burst allowed to an address */
+#define HANDSHAKE_RATE               10
+#define HANDSHAKE_BURST              50
+#define BUSY_RETRY_AFTER             30
+#define BUCKET_GC_SECS               60
+#define RECONNECT_PULSE_MSEC         1000
+#define RECONNECT_BASE_SECS          10
+#define RECONNECT_MAX_SECS           600
 
 
 #define DEBUG_FLAG CCNET_DEBUG_CONNECTION
 #include "log.h"
 
 extern void ccnet_peer_set_net_state (CcnetPeer *peer, int net_state);
+
+static void schedule_reconnect (CcnetConnManager *manager, CcnetPeer *peer,
+                                int delay);
+static void gc_handshake_buckets (CcnetConnManager *manager, time_t now);
 extern gboolean
 ccnet_peer_manager_on_peer_resolved (CcnetPeerManager *manager,
                                      CcnetPeer *peer);
@@ -36,6 +61,20 @@ ccnet_peer_manager_on_peer_resolve_failed (CcnetPeerManager *manager,
 
 static void dns_lookup_peer (CcnetPeer* peer);
 
+/* Recorded for the peers in the conn list, NULL @error for success. */
+static void
+note_conn_result (CcnetConnManager *manager, CcnetPeer *peer,
+                  const char *error)
+{
+    CcnetConnEntry *entry = g_hash_table_lookup (manager->conn_index, peer);
+
+    if (!entry)
+        return;
+    entry->last_error = error;
+    if (error)
+        entry->last_error_time = time(NULL);
+}
+
 CcnetConnManager *
 ccnet_conn_manager_new (CcnetSession *session)
 {
@@ -43,6 +82,13 @@ ccnet_conn_manager_new (CcnetSession *session)
 
     manager = g_new0 (CcnetConnManager, 1);
     manager->session = session;
+    manager->reconnect_queue = g_sequence_new (NULL);
+    manager->conn_index = g_hash_table_new (g_direct_hash, g_direct_equal);
+    INIT_LIST_HEAD (&manager->conn_list);
+    manager->accept_queue = g_queue_new ();
+    manager->handshake_buckets = g_hash_table_new_full (g_str_hash,
+                                                        g_str_equal,
+                                                        g_free, g_free);
 
     return manager;
 }
@@ -87,12 +133,18 @@ void start_keepalive (CcnetPeer *peer)
     ccnet_processor_startl (processor, NULL);
 }
 
-static void on_peer_connected (CcnetPeer *peer, CcnetPacketIO *io)
+static void on_peer_connected (CcnetPeer *peer, CcnetPacketIO *io,
+                               CcnetHandshake *handshake)
 {
     g_assert (peer->net_state == PEER_DOWN);
 
     ccnet_peer_set_io (peer, io);
     ccnet_peer_set_net_state (peer, PEER_CONNECTED);
+    if (handshake->fast_done)
+        ccnet_fast_setup_apply (peer, handshake);
+    /* The handshake checked the key of its certificate. */
+    if (io->tls && peer->pubkey)
+        peer->fast_verified = 1;
     start_keepalive (peer);
 }
 
@@ -186,12 +238,51 @@ static void set_peer_address_from_socket(CcnetPeer *peer, CcnetPacketIO *io)
     if (peer->addr_str)
         g_free (peer->addr_str);
 
-    struct sockaddr_in addr;
-    socklen_t len = sizeof(struct sockaddr_in);
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
     int socket = io->socket;
-    getsockname (socket, (struct sockaddr *)&addr, &len);
-    char *p = inet_ntoa (addr.sin_addr);
-    peer->addr_str = strdup(p);
+    const char *p = NULL;
+
+    if (getsockname (socket, (struct sockaddr *)&addr, &len) == 0)
+        p = sock_ntop ((struct sockaddr *)&addr, len);
+    peer->addr_str = p ? g_strdup (p) : NULL;
+}
+
+/*
+ * The server refused us with CCNET_MSG_BUSY. Try the server it
+ * redirects to, or back off for the time it asks, randomized so the
+ * refused peers don't come back together.
+ */
+static void
+on_server_busy (CcnetConnManager *manager, CcnetPeer *peer,
+                CcnetHandshake *handshake)
+{
+    int delay = handshake->retry_after;
+    char *p;
+    int port;
+
+    if (handshake->redirect && !peer->redirected &&
+        (p = strrchr (handshake->redirect, ':')) != NULL &&
+        (port = atoi (p + 1)) > 0) {
+        char *addr = handshake->redirect;
+
+        *p = '\0';
+        if (addr[0] == '[' && p[-1] == ']') {
+            p[-1] = '\0';
+            ++addr;
+        }
+        ccnet_message ("[Conn] Peer %s(%.10s) is busy, redirected to %s:%d\n",
+                       peer->name, peer->id, addr, port);
+        ccnet_peer_set_redirect (peer, addr, port);
+        peer->num_fails = 0;
+        schedule_reconnect (manager, peer, g_random_int_range (1, 4));
+        return;
+    }
+
+    delay += g_random_int_range (0, delay + 1);
+    ccnet_message ("[Conn] Peer %s(%.10s) is busy, retry in %d s\n",
+                   peer->name, peer->id, delay);
+    schedule_reconnect (manager, peer, delay);
 }
 
 static void
@@ -232,12 +323,21 @@ myHandshakeDoneCB (CcnetHandshake *handshake,
         ccnet_packet_io_free (io);
 
         peer->num_fails++;
+        note_conn_result (manager, peer, handshake->retry_after ?
+                          "server busy" : "handshake failed");
+        if (peer->in_connection)
+            manager->n_connecting--;
         peer->in_connection = 0;
+
+        if (handshake->retry_after)
+            on_server_busy (manager, peer, handshake);
         return;
     }
 
     if (!ccnet_packet_io_is_incoming (io)) {
         peer = handshake->peer;
+        if (peer->in_connection)
+            manager->n_connecting--;
         peer->in_connection = 0;
         
         if (peer->to_resolve) {
@@ -289,11 +389,297 @@ myHandshakeDoneCB (CcnetHandshake *handshake,
     ccnet_message ("[Conn] Peer %s (%.10s) connected\n",
                    peer->name, peer->id);
     peer->num_fails = 0;
-    on_peer_connected (peer, io);
+    note_conn_result (manager, peer, NULL);
+    on_peer_connected (peer, io, handshake);
     g_object_unref (peer);
 }
 
 
+/*
+ * Host name resolution. Lookups go through the evdns base set up by
+ * evdns_init() in main, so they never occupy a job thread. Answers are
+ * cached per host name, shared by every peer using that name, and the
+ * addresses are handed out in turn so that reconnects try each of them.
+ */
+
+#define DNS_POSITIVE_TTL   300      /* seconds */
+#define DNS_NEGATIVE_TTL   30
+
+typedef struct DNSCacheEntry {
+    CcnetConnManager *manager;
+    char        *host;
+    GPtrArray   *addrs;             /* IPv4 and IPv6 address strings */
+    guint        next;              /* address for the next connect */
+    time_t       expire;
+    gboolean     pending;
+    GList       *waiters;           /* peers (ref'ed) waiting for the answer */
+} DNSCacheEntry;
+
+static DNSCacheEntry *
+dns_cache_lookup (CcnetConnManager *manager, const char *host)
+{
+    DNSCacheEntry *entry;
+
+    if (!manager->dns_cache)
+        return NULL;
+    entry = g_hash_table_lookup (manager->dns_cache, host);
+    if (!entry || entry->pending || entry->expire <= time(NULL))
+        return NULL;
+    return entry;
+}
+
+/*
+ * Connection racing. When a peer has several candidate addresses (all
+ * resolved addresses, the literal public or redirect address, and the
+ * address last used), TCP connects to them are started RACE_STAGGER_MSEC
+ * apart, alternating address families, without waiting for the earlier
+ * ones to fail. The first socket to connect is handed to the handshake
+ * and the others are closed.
+ */
+
+#define RACE_STAGGER_MSEC    250
+#define RACE_TIMEOUT_SECS    10
+#define RACE_MAX_CANDIDATES  4
+
+typedef struct ConnRace ConnRace;
+
+typedef struct RaceAttempt {
+    ConnRace        *race;
+    char            *addr;
+    struct sockaddr_storage sa;
+    evutil_socket_t  sock;          /* -1 unless connecting */
+    struct event     event;
+} RaceAttempt;
+
+struct ConnRace {
+    CcnetConnManager *manager;
+    CcnetPeer   *peer;
+    uint16_t     port;
+    RaceAttempt  attempts[RACE_MAX_CANDIDATES];
+    int          n_attempts;
+    int          next;              /* next attempt to start */
+    int          n_running;
+    CcnetTimer  *timer;
+    time_t       deadline;
+};
+
+static void
+race_add_candidate (ConnRace *race, const char *addr)
+{
+    RaceAttempt *attempt;
+    int i;
+
+    if (!addr || race->n_attempts == RACE_MAX_CANDIDATES)
+        return;
+    for (i = 0; i < race->n_attempts; i++)
+        if (strcmp (race->attempts[i].addr, addr) == 0)
+            return;
+
+    attempt = &race->attempts[race->n_attempts];
+    memset (&attempt->sa, 0, sizeof(attempt->sa));
+    if (sock_pton (addr, race->port, &attempt->sa) < 0)
+        return;
+    attempt->race = race;
+    attempt->addr = g_strdup (addr);
+    attempt->sock = -1;
+    race->n_attempts++;
+}
+
+/* Move the first candidate of the other family to the second place. */
+static void
+race_interleave_families (ConnRace *race)
+{
+    RaceAttempt tmp;
+    int i;
+
+    for (i = 1; i < race->n_attempts; i++) {
+        if (race->attempts[i].sa.ss_family != race->attempts[0].sa.ss_family)
+            break;
+    }
+    if (i <= 1 || i == race->n_attempts)
+        return;
+
+    tmp = race->attempts[i];
+    memmove (&race->attempts[2], &race->attempts[1],
+             (i - 1) * sizeof(RaceAttempt));
+    race->attempts[1] = tmp;
+}
+
+static void
+race_close_attempt (RaceAttempt *attempt)
+{
+    if (attempt->sock < 0)
+        return;
+    event_del (&attempt->event);
+    evutil_closesocket (attempt->sock);
+    attempt->sock = -1;
+    attempt->race->n_running--;
+}
+
+static void
+race_free (ConnRace *race)
+{
+    int i;
+
+    for (i = 0; i < race->n_attempts; i++) {
+        race_close_attempt (&race->attempts[i]);
+        g_free (race->attempts[i].addr);
+    }
+    if (race->timer)
+        ccnet_timer_free (&race->timer);
+    g_object_unref (race->peer);
+    g_free (race);
+}
+
+static void
+race_lost (ConnRace *race)
+{
+    CcnetPeer *peer = race->peer;
+
+    ccnet_debug ("[Conn] All %d addresses of %s(%.10s) failed\n",
+                 race->n_attempts, peer->name, peer->id);
+    race->manager->n_connecting--;
+    peer->in_connection = 0;
+    peer->num_fails++;
+    note_conn_result (race->manager, peer, "no address reachable");
+    g_free (peer->dns_addr);
+    peer->dns_addr = NULL;
+    peer->dns_done = 0;
+    race_free (race);
+}
+
+static void race_connected (evutil_socket_t fd, short event, void *vattempt);
+
+/* Returns FALSE if there is nothing left to start. */
+static gboolean
+race_start_next (ConnRace *race)
+{
+    RaceAttempt *attempt;
+
+    while (race->next < race->n_attempts) {
+        attempt = &race->attempts[race->next++];
+        attempt->sock = ccnet_net_open_tcp ((struct sockaddr *)&attempt->sa,
+                                            TRUE);
+        if (attempt->sock < 0)
+            continue;
+
+        ccnet_debug ("[Conn] Racing connect to %s(%.10s) %s:%d\n",
+                     race->peer->name, race->peer->id,
+                     attempt->addr, race->port);
+        race->n_running++;
+        event_set (&attempt->event, attempt->sock, EV_WRITE,
+                   race_connected, attempt);
+        event_add (&attempt->event, NULL);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+race_connected (evutil_socket_t fd, short event, void *vattempt)
+{
+    RaceAttempt *attempt = vattempt;
+    ConnRace *race = attempt->race;
+    CcnetPeer *peer = race->peer;
+    CcnetPacketIO *io;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt (fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) < 0 ||
+        err != 0) {
+        race_close_attempt (attempt);
+        /* don't wait for the stagger timer once an attempt fails */
+        if (!race_start_next (race) && race->n_running == 0)
+            race_lost (race);
+        return;
+    }
+
+    /* The winner: keep its socket, drop the others. */
+    event_del (&attempt->event);
+    attempt->sock = -1;
+    race->n_running--;
+
+    ccnet_message ("[Conn] Connected to %s(%.10s) at %s:%d\n",
+                   peer->name, peer->id, attempt->addr, race->port);
+    ccnet_peer_update_address (peer, attempt->addr, race->port);
+    io = ccnet_packet_io_new_connected (race->manager->session,
+                                        &attempt->sa, fd);
+    ccnet_handshake_new (race->manager->session, peer, io,
+                         myHandshakeDoneCB, race->manager);
+    race_free (race);
+}
+
+static int
+race_pulse (void *vrace)
+{
+    ConnRace *race = vrace;
+
+    if (time(NULL) >= race->deadline) {
+        /* the timer frees itself when we return FALSE */
+        race->timer = NULL;
+        race_lost (race);
+        return FALSE;
+    }
+
+    if (!race_start_next (race) && race->n_running == 0) {
+        race->timer = NULL;
+        race_lost (race);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Returns FALSE if the peer has only one address to try. */
+static gboolean
+start_connect_race (CcnetConnManager *manager, CcnetPeer *peer,
+                    const char *addr, uint16_t port)
+{
+    ConnRace *race;
+    DNSCacheEntry *entry;
+    const char *host;
+    guint i;
+
+    race = g_new0 (ConnRace, 1);
+    race->manager = manager;
+    race->peer = peer;
+    race->port = port;
+
+    race_add_candidate (race, addr);
+
+    host = peer->redirected ? peer->redirect_addr : peer->public_addr;
+    if (host && is_valid_ipaddr (host))
+        race_add_candidate (race, host);
+    else if (host && (entry = dns_cache_lookup (manager, host)) != NULL) {
+        for (i = 0; i < entry->addrs->len; i++)
+            race_add_candidate (race, g_ptr_array_index (entry->addrs, i));
+    }
+
+    /* the address which worked last time */
+    if (peer->addr_str && peer->port == port && is_valid_ipaddr (peer->addr_str))
+        race_add_candidate (race, peer->addr_str);
+
+    if (race->n_attempts < 2) {
+        for (i = 0; i < race->n_attempts; i++)
+            g_free (race->attempts[i].addr);
+        g_free (race);
+        return FALSE;
+    }
+
+    race_interleave_families (race);
+    g_object_ref (peer);
+    peer->in_connection = 1;
+    manager->n_connecting++;
+    race->deadline = time(NULL) + RACE_TIMEOUT_SECS;
+
+    if (!race_start_next (race)) {
+        race_lost (race);
+        return TRUE;
+    }
+    race->timer = ccnet_timer_new (race_pulse, race, RACE_STAGGER_MSEC);
+    return TRUE;
+}
+
 /**
  * return %TRUE if an outgoing connection is started, %FALSE otherwise.
  *
@@ -348,6 +734,12 @@ ccnet_conn_manager_connect_peer (CcnetConnManager *manager, CcnetPeer *peer)
     else
         port = peer->redirect_port;
 
+    if (manager->race_connects && start_connect_race (manager, peer, addr, port)) {
+        ccnet_debug ("[Conn] Start racing connects to %s(%.10s)\n",
+                     peer->name, peer->id);
+        return TRUE;
+    }
+
     ccnet_peer_update_address (peer, addr, port);
 
     /* interval = get_reconnect_interval_secs (peer); */
@@ -372,9 +764,14 @@ ccnet_conn_manager_connect_peer (CcnetConnManager *manager, CcnetPeer *peer)
     if (io == NULL) {
         /* ccnet_warning ("Failed to create socket for peer %s (%.10s)\n", 
            peer->name, peer->id); */
+        /* try the next resolved address next time */
+        g_free (peer->dns_addr);
+        peer->dns_addr = NULL;
+        peer->dns_done = 0;
         goto err_connect;
     } else {
         peer->in_connection = 1;
+        manager->n_connecting++;
         ccnet_handshake_new (manager->session, peer, io, 
                              myHandshakeDoneCB, manager);
         return TRUE;
@@ -382,9 +779,69 @@ ccnet_conn_manager_connect_peer (CcnetConnManager *manager, CcnetPeer *peer)
 
 err_connect:
     peer->num_fails++;
+    note_conn_result (manager, peer, "socket error");
     return FALSE;
 }
 
+/*
+ * Reconnects are driven from a queue of peers sorted by the time of
+ * their next attempt. Each pulse only pops the peers that are due, and
+ * starts at most MAX_CONNECTS_IN_FLIGHT handshakes at a time. Failed
+ * attempts back off exponentially; all delays are jittered so that
+ * peers dropped at the same moment do not come back at the same moment.
+ */
+
+static gint
+compare_reconnect_time (gconstpointer a, gconstpointer b, gpointer unused)
+{
+    const CcnetPeer *pa = a, *pb = b;
+
+    if (pa->next_reconnect < pb->next_reconnect)
+        return -1;
+    return pa->next_reconnect > pb->next_reconnect;
+}
+
+/* Random delay in [secs/2, secs]. */
+static int
+jitter (int secs)
+{
+    return g_random_int_range (secs / 2, secs + 1);
+}
+
+static int
+reconnect_backoff_secs (const CcnetPeer *peer)
+{
+    int secs = RECONNECT_BASE_SECS;
+    int n = MIN (peer->num_fails, 8);
+
+    while (n-- > 0 && secs < RECONNECT_MAX_SECS)
+        secs *= 2;
+    return jitter (MIN (secs, RECONNECT_MAX_SECS));
+}
+
+static void
+schedule_reconnect (CcnetConnManager *manager, CcnetPeer *peer, int delay)
+{
+    if (peer->reconnect_iter)
+        g_sequence_remove (peer->reconnect_iter);
+    else
+        g_object_ref (peer);
+
+    peer->next_reconnect = time(NULL) + delay;
+    peer->reconnect_iter = g_sequence_insert_sorted (
+        manager->reconnect_queue, peer, compare_reconnect_time, NULL);
+}
+
+static void
+unschedule_reconnect (CcnetConnManager *manager, CcnetPeer *peer)
+{
+    if (!peer->reconnect_iter)
+        return;
+    g_sequence_remove (peer->reconnect_iter);
+    peer->reconnect_iter = NULL;
+    g_object_unref (peer);
+}
+
 static void
 reconnect_peer (CcnetConnManager *manager, CcnetPeer *peer)
 {
@@ -397,85 +854,375 @@ reconnect_peer (CcnetConnManager *manager, CcnetPeer *peer)
         return;
     }
 */
+    if (peer->redirected) {
+        if (peer->num_fails > 2)
+            ccnet_peer_unset_redirect (peer);
+    }
+
+    peer->connect_attempts++;
+    peer->last_connect_attempt = time(NULL);
+    ccnet_debug ("[Conn] Reconnect %s(%.10s), attempt %u, %d fails\n",
+                 peer->name, peer->id, peer->connect_attempts,
+                 peer->num_fails);
     ccnet_conn_manager_connect_peer (manager, peer);
 }
 
-static int reconnect_pulse (void *vmanager)
+#ifndef CCNET_SERVER
+/*
+ * Relays are ranked by the round trip of their keepalives, see
+ * keepalive2-proc.c. Relays which are down are reconnected best first,
+ * and the best connected one is made the default relay of the session,
+ * which clients send their rpc calls over.
+ */
+
+#define RELAY_SWITCH_PERCENT  80    /* a new default must be this fast */
+
+static gboolean
+collect_relay (CcnetPeer *peer, void *vlist)
 {
-    CcnetConnManager *manager = vmanager;
-    /* int conn = 0; */
-    GList  *ptr;
+    GList **relays = vlist;
 
-#ifndef CCNET_SERVER
-    GList *peers = ccnet_peer_manager_get_peers_with_role (
-        manager->session->peer_mgr, "MyRelay");
-    for (ptr = peers; ptr; ptr = ptr->next) {
-        CcnetPeer *peer = ptr->data;
-        if (peer->redirected) {
-            if (peer->num_fails > 2)
-                ccnet_peer_unset_redirect (peer);
-        }
-        reconnect_peer (manager, peer);
-        g_object_unref (peer);
+    *relays = g_list_prepend (*relays, g_object_ref (peer));
+    return TRUE;
+}
+
+/* Known round trips first, fastest first, then by fewest fails. */
+static gint
+compare_relays (gconstpointer a, gconstpointer b)
+{
+    const CcnetPeer *pa = a, *pb = b;
+
+    if (pa->rtt_ms != pb->rtt_ms) {
+        if (!pa->rtt_ms || !pb->rtt_ms)
+            return pa->rtt_ms ? -1 : 1;
+        return pa->rtt_ms < pb->rtt_ms ? -1 : 1;
     }
-    g_list_free (peers);
-#endif
+    return pa->num_fails - pb->num_fails;
+}
 
-    for (ptr = manager->conn_list; ptr; ptr = ptr->next) {
-        CcnetPeer *peer = ptr->data;
-        if (peer->redirected) {
-            if (peer->num_fails > 2)
-                ccnet_peer_unset_redirect (peer);
-        }
-        reconnect_peer (manager, peer);
+/* @relays is sorted. The default is kept while no relay is up, and
+ * only changed for one clearly faster, so that close round trips don't
+ * make it flap. */
+static void
+choose_default_relay (CcnetConnManager *manager, GList *relays)
+{
+    CcnetSessionBase *base = &manager->session->base;
+    CcnetPeer *best = NULL, *cur = NULL, *peer;
+    GList *ptr;
+
+    for (ptr = relays; ptr; ptr = ptr->next) {
+        peer = ptr->data;
+        if (peer->net_state != PEER_CONNECTED || !peer->is_ready)
+            continue;
+        if (!best)
+            best = peer;
+        if (base->relay_id && strcmp (base->relay_id, peer->id) == 0)
+            cur = peer;
     }
+    if (!best || best == cur)
+        return;
+    if (cur && (!best->rtt_ms || (cur->rtt_ms &&
+                best->rtt_ms * 100 > cur->rtt_ms * RELAY_SWITCH_PERCENT)))
+        return;
 
-    /*
-    peers = ccnet_peer_manager_get_peers_with_role (
-        manager->session->peer_mgr, "MyPeer");
-    for (ptr = peers; ptr; ptr = ptr->next) {
+    ccnet_message ("[Conn] Default relay is now %s(%.8s), %d ms\n",
+                   best->name, best->id, best->rtt_ms);
+    g_free (base->relay_id);
+    base->relay_id = g_strdup (best->id);
+}
+
+static void
+schedule_relays (CcnetConnManager *manager)
+{
+    GList *relays = NULL, *ptr;
+    int delay = 0;
+
+    ccnet_peer_manager_foreach_with_role (manager->session->peer_mgr,
+                                          "MyRelay", collect_relay, &relays);
+    relays = g_list_sort (relays, compare_relays);
+
+    /* a second apart, so the better ones go first */
+    for (ptr = relays; ptr; ptr = ptr->next) {
         CcnetPeer *peer = ptr->data;
+        if (!peer->reconnect_iter)
+            schedule_reconnect (manager, peer, delay++);
+    }
 
-        if (peer->is_self)
-            continue;
+    choose_default_relay (manager, relays);
 
-        if (!peer->is_relay && !ccnet_peer_is_mypeer(peer))
-            continue;
+    for (ptr = relays; ptr; ptr = ptr->next)
+        g_object_unref (ptr->data);
+    g_list_free (relays);
+}
+#endif
 
-        if (ccnet_conn_manager_connect_peer (manager, peer) == FALSE)
-            continue;
+static int reconnect_pulse (void *vmanager)
+{
+    CcnetConnManager *manager = vmanager;
+    GSequenceIter *iter;
+    time_t now = time(NULL);
 
-        if (++conn >= MAX_RECONNECTIONS_PER_PULSE)
+    gc_handshake_buckets (manager, now);
+
+#ifndef CCNET_SERVER
+    schedule_relays (manager);
+#endif
+
+    while (manager->n_connecting < MAX_CONNECTS_IN_FLIGHT) {
+        CcnetPeer *peer;
+
+        iter = g_sequence_get_begin_iter (manager->reconnect_queue);
+        if (g_sequence_iter_is_end (iter))
+            break;
+        peer = g_sequence_get (iter);
+        if (peer->next_reconnect > now)
             break;
+
+#ifndef CCNET_SERVER
+        /* relays which lost the role are dropped here */
+        if (!ccnet_peer_has_role (peer, "MyRelay") &&
+            !g_hash_table_lookup (manager->conn_index, peer)) {
+            unschedule_reconnect (manager, peer);
+            continue;
+        }
+#endif
+
+        reconnect_peer (manager, peer);
+
+        /* Connected peers are looked at again after the base period,
+         * in case they go down. */
+        if (peer->net_state == PEER_CONNECTED)
+            schedule_reconnect (manager, peer, jitter (RECONNECT_BASE_SECS));
+        else
+            schedule_reconnect (manager, peer, reconnect_backoff_secs (peer));
     }
-    g_list_free (peers);
-    */
 
     /* TODO: teer down connections */
     
     return TRUE;
 }
 
+typedef struct AcceptedConn {
+    evutil_socket_t         socket;
+    struct sockaddr_storage addr;
+    time_t                  time;
+} AcceptedConn;
+
+static void admit_incoming (CcnetConnManager *manager);
+
+static void
+incomingHandshakeDoneCB (CcnetHandshake *handshake,
+                         CcnetPacketIO  *io,
+                         int             is_connected,
+                         const char     *peer_id,
+                         void           *vmanager)
+{
+    CcnetConnManager *manager = vmanager;
+
+    manager->n_handshaking--;
+    myHandshakeDoneCB (handshake, io, is_connected, peer_id, vmanager);
+    admit_incoming (manager);
+}
+
+static void
+start_incoming (CcnetConnManager *manager, struct sockaddr_storage *cliaddr,
+                evutil_socket_t socket)
+{
+    CcnetPacketIO *io;
+
+    manager->n_handshaking++;
+    io = ccnet_packet_io_new_incoming (manager->session, cliaddr, socket);
+    ccnet_handshake_new (manager->session, NULL, io,
+                         incomingHandshakeDoneCB, manager);
+}
+
 void
 ccnet_conn_manager_add_incoming (CcnetConnManager    *manager,
                                  struct sockaddr_storage *cliaddr,
                                  size_t            addrlen,
                                  evutil_socket_t   socket)
 {
-    CcnetPacketIO *io;
-    
-    io = ccnet_packet_io_new_incoming (manager->session, cliaddr, socket);
-    ccnet_handshake_new (manager->session, NULL, io,
-                         myHandshakeDoneCB, manager);
+    AcceptedConn *conn;
+
+    if (manager->n_handshaking < manager->max_handshaking &&
+        g_queue_is_empty (manager->accept_queue)) {
+        start_incoming (manager, cliaddr, socket);
+        return;
+    }
+
+    conn = g_new0 (AcceptedConn, 1);
+    conn->socket = socket;
+    memcpy (&conn->addr, cliaddr, MIN (addrlen, sizeof(conn->addr)));
+    conn->time = time(NULL);
+    g_queue_push_tail (manager->accept_queue, conn);
+}
+
+static void
+pause_accepting (CcnetConnManager *manager)
+{
+    if (manager->listening && !manager->accept_paused) {
+        event_del (&manager->listen_event);
+        manager->accept_paused = 1;
+    }
+}
+
+static void
+resume_accepting (CcnetConnManager *manager)
+{
+    if (manager->accept_paused) {
+        manager->accept_paused = 0;
+        if (manager->listening)
+            event_add (&manager->listen_event, NULL);
+    }
+}
+
+/* Start the queued handshakes there is room for. */
+static void
+admit_incoming (CcnetConnManager *manager)
+{
+    time_t now = time(NULL);
+    AcceptedConn *conn;
+
+    while (manager->n_handshaking < manager->max_handshaking &&
+           (conn = g_queue_pop_head (manager->accept_queue)) != NULL) {
+        if (conn->time + ACCEPT_QUEUE_MAX_AGE < now)
+            evutil_closesocket (conn->socket);
+        else
+            start_incoming (manager, &conn->addr, conn->socket);
+        g_free (conn);
+    }
+
+    if (g_queue_get_length (manager->accept_queue) < MAX_ACCEPT_QUEUE / 2 &&
+        !manager->accept_timer)
+        resume_accepting (manager);
 }
 
+typedef struct HandshakeBucket {
+    double  tokens;
+    gint64  last;               /* usec, monotonic */
+} HandshakeBucket;
+
+static CcnetMetric *metric_refused_rate;
+static CcnetMetric *metric_refused_busy;
+
+static void
+refuse_connection (evutil_socket_t socket, int retry_after,
+                   const char *redirect)
+{
+    char buf[CCNET_PACKET_LENGTH_HEADER + 256];
+    ccnet_packet *packet = (ccnet_packet *)buf;
+    int len = redirect ? MIN (strlen (redirect), 256) : 0;
+    char discard[256];
+
+    packet->header.version = 1;
+    packet->header.type = CCNET_MSG_BUSY;
+    packet->header.length = htons (len);
+    packet->header.id = htonl (retry_after);
+    memcpy (packet->data, redirect, len);
+
+    /* Best effort, the send buffer of a new connection is empty. The
+     * handshake the peer may have sent already is read, so that the
+     * close doesn't reset the connection before our reply arrives. */
+    send (socket, buf, CCNET_PACKET_LENGTH_HEADER + len, 0);
+    recv (socket, discard, sizeof(discard), 0);
+    evutil_closesocket (socket);
+}
+
+/*
+ * Incoming connections are refused with CCNET_MSG_BUSY, before anything
+ * is allocated for them, when their address connects faster than
+ * HANDSHAKE_RATE per second, or when HANDSHAKE_QUEUE_BUSY connections
+ * already wait for a handshake. Returns FALSE if refused, the socket is
+ * closed then.
+ */
+static gboolean
+admit_connection (CcnetConnManager *manager, evutil_socket_t socket,
+                  struct sockaddr_storage *addr, socklen_t len)
+{
+    HandshakeBucket *bucket;
+    const char *ip, *redirect = NULL;
+    gint64 now;
+    int n;
+
+    if (manager->handshake_rate > 0 &&
+        (ip = sock_ntop ((struct sockaddr *)addr, len)) != NULL) {
+        now = g_get_monotonic_time ();
+        bucket = g_hash_table_lookup (manager->handshake_buckets, ip);
+        if (!bucket) {
+            bucket = g_new0 (HandshakeBucket, 1);
+            bucket->tokens = manager->handshake_burst;
+            g_hash_table_insert (manager->handshake_buckets,
+                                 g_strdup (ip), bucket);
+        } else
+            bucket->tokens = MIN (manager->handshake_burst, bucket->tokens +
+                                  (now - bucket->last) / 1e6
+                                  * manager->handshake_rate);
+        bucket->last = now;
+
+        if (bucket->tokens < 1) {
+            ccnet_metric_inc (metric_refused_rate);
+            refuse_connection (socket,
+                               (int)((1 - bucket->tokens)
+                                     / manager->handshake_rate) + 1, NULL);
+            return FALSE;
+        }
+        bucket->tokens -= 1;
+    }
+
+    if (g_queue_get_length (manager->accept_queue) >= manager->busy_queue) {
+        n = manager->busy_redirects ? g_strv_length (manager->busy_redirects)
+            : 0;
+        if (n > 0)
+            redirect = manager->busy_redirects[manager->next_redirect++ % n];
+        ccnet_metric_inc (metric_refused_busy);
+        refuse_connection (socket, manager->busy_retry_after, redirect);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+bucket_is_full (gpointer key, gpointer value, gpointer vmanager)
+{
+    CcnetConnManager *manager = vmanager;
+    HandshakeBucket *bucket = value;
+    double elapsed = (g_get_monotonic_time () - bucket->last) / 1e6;
+
+    return bucket->tokens + elapsed * manager->handshake_rate
+        >= manager->handshake_burst;
+}
+
+/* Full buckets are as good as none. */
+static void
+gc_handshake_buckets (CcnetConnManager *manager, time_t now)
+{
+    if (manager->last_bucket_gc + BUCKET_GC_SECS > now)
+        return;
+    manager->last_bucket_gc = now;
+    g_hash_table_foreach_remove (manager->handshake_buckets,
+                                 bucket_is_full, manager);
+}
 
 static int
-listen_pulse (void * vmanager)
+accept_retry (void *vmanager)
+{
+    CcnetConnManager *manager = vmanager;
+
+    manager->accept_timer = NULL;
+    if (g_queue_get_length (manager->accept_queue) < MAX_ACCEPT_QUEUE / 2)
+        resume_accepting (manager);
+    return FALSE;
+}
+
+static void
+accept_peers (evutil_socket_t fd, short event, void *vmanager)
 {
     CcnetConnManager *manager = vmanager;
+    int n;
 
-    for ( ;; ) /* check for new incoming peer connections */    
+    /* Until the backlog is empty, but let established peers run too. */
+    for (n = 0; n < MAX_ACCEPTS_PER_EVENT; n++)
     {
         evutil_socket_t socket;
         struct sockaddr_storage cliaddr;
@@ -484,14 +1231,29 @@ listen_pulse (void * vmanager)
         if (manager->bind_socket < 0)
             break;
 
+        if (g_queue_get_length (manager->accept_queue) >= MAX_ACCEPT_QUEUE) {
+            pause_accepting (manager);
+            break;
+        }
+
         if ((socket = ccnet_net_accept (manager->bind_socket, 
-                                        &cliaddr, &len, 1)) < 0)
+                                        &cliaddr, &len, 1)) < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                /* The listener stays readable, don't spin on it. */
+                ccnet_warning ("[Conn] Out of file descriptors, stop "
+                               "accepting for a while\n");
+                pause_accepting (manager);
+                if (!manager->accept_timer)
+                    manager->accept_timer = ccnet_timer_new (
+                        accept_retry, manager, ACCEPT_RETRY_MSEC);
+            }
             break;
+        }
 
+        if (!admit_connection (manager, socket, &cliaddr, len))
+            continue;
         ccnet_conn_manager_add_incoming (manager, &cliaddr, len, socket);
     }
- 
-    return TRUE;
 }
 
 
@@ -502,7 +1264,7 @@ listen_pulse (void * vmanager)
 void
 ccnet_conn_listen_init (CcnetConnManager *manager)
 {
-    evutil_socket_t socket;
+    evutil_socket_t socket = -1;
     CcnetSession *session = manager->session;
 
     if (session->base.public_port == 0) {
@@ -510,12 +1272,18 @@ ccnet_conn_listen_init (CcnetConnManager *manager)
         return;
     }
 
-    socket = ccnet_net_bind_tcp (session->base.public_port, 1);
+#ifdef CCNET_SERVER
+    socket = ccnet_handover_get_listener ("peer");
+#endif
     if (socket >= 0) {
+        ccnet_message ("Took over port %d to listen for "
+                       "incoming peer connections\n", session->base.public_port);
+        manager->bind_socket = socket;
+    } else if ((socket = ccnet_net_bind_tcp (session->base.public_port, 1)) >= 0) {
         ccnet_message ("Opened port %d to listen for "
                        "incoming peer connections\n", session->base.public_port);
         manager->bind_socket = socket;
-        listen (manager->bind_socket, 5);
+        listen (manager->bind_socket, manager->listen_backlog);
     } else {
         ccnet_error ("Couldn't open port %d to listen for "
                      "incoming peer connections (errno %d - %s)",
@@ -523,166 +1291,297 @@ ccnet_conn_listen_init (CcnetConnManager *manager)
         exit (1);
     }
 
-    manager->listen_timer = ccnet_timer_new (listen_pulse, manager,
-                                             LISTEN_INTERVAL);
+    /* Accept as soon as connections arrive instead of polling. */
+    event_set (&manager->listen_event, manager->bind_socket,
+               EV_READ | EV_PERSIST, accept_peers, manager);
+    event_add (&manager->listen_event, NULL);
+    manager->listening = 1;
+    manager->accept_paused = 0;
 }
 
-typedef struct DNSLookupData {
-    CcnetPeer *peer;
-    char *addr_str;
-} DNSLookupData;
-
-static void *
-dns_lookup (void *vdata)
+static void
+dns_cache_entry_free (DNSCacheEntry *entry)
 {
-    DNSLookupData *data = vdata;
-    struct evutil_addrinfo hints;
-    struct evutil_addrinfo *answer = NULL;
-    int err;
-    void *addr;
-    char *addr_str;
-    socklen_t size;
-
-    /* Build the hints to tell getaddrinfo how to act. */
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET; /* only use IPv4 now. */
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP; /* We want a TCP socket */
-    /* Only return addresses we can use. */
-    hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
-
-    /* Look up the hostname. */
-    err = evutil_getaddrinfo(data->peer->public_addr, NULL, &hints, &answer);
-    if (err != 0) {
-          ccnet_warning("Error while resolving '%s': %s\n",
-                        data->peer->public_addr, evutil_gai_strerror(err));
-          return vdata;
-    }
-
-    /* just use the first answer */
-    if (answer->ai_family == AF_INET) {
-        size = INET_ADDRSTRLEN;
-        addr = &((struct sockaddr_in *)(answer->ai_addr))->sin_addr;
-    } else if (answer->ai_family == AF_INET6) {
-        size = INET6_ADDRSTRLEN;
-        addr = &((struct sockaddr_in6 *)(answer->ai_addr))->sin6_addr;
-    } else
-        goto out;
+    g_free (entry->host);
+    g_ptr_array_free (entry->addrs, TRUE);
+    g_free (entry);
+}
 
-    addr_str = (char *)calloc(size, sizeof(char));
-    if (addr_str == NULL) {
-        ccnet_error("Out of memory\n");
-        goto out;
-    }
+/* Returns FALSE if the host has no address. */
+static gboolean
+dns_assign_address (DNSCacheEntry *entry, CcnetPeer *peer)
+{
+    const char *addr;
 
-    if (!inet_ntop(answer->ai_family, addr, addr_str, size)) {
-        ccnet_warning("Peer %s domain name %s lookup fail\n",
-                      data->peer->name, data->peer->public_addr);
-        free(addr_str);
-        goto out;
-    }
+    if (entry->addrs->len == 0)
+        return FALSE;
 
-    data->addr_str = addr_str;
+    addr = g_ptr_array_index (entry->addrs, entry->next % entry->addrs->len);
+    entry->next++;
 
-out:
-    evutil_freeaddrinfo (answer);
-    return vdata;
+    g_free (peer->dns_addr);
+    peer->dns_addr = g_strdup (addr);
+    peer->dns_done = 1;
+    return TRUE;
 }
 
 static void
-dns_lookup_cb (void *result)
+dns_lookup_cb (int result, struct evutil_addrinfo *answer, void *arg)
 {
-    DNSLookupData *data = result;
-    CcnetPeer *peer = data->peer;
+    DNSCacheEntry *entry = arg;
+    struct evutil_addrinfo *ai;
+    char buf[INET6_ADDRSTRLEN];
+    void *addr;
+    GList *waiters, *ptr;
+    guint i;
 
-    if (!data->addr_str) {
-        ccnet_warning ("DNS lookup failed for peer %.10s(%s).\n",
-                       data->peer->id, data->peer->public_addr);
-        g_free (data);
-        return;
+    g_ptr_array_set_size (entry->addrs, 0);
+    entry->next = 0;
+
+    if (result != 0) {
+        ccnet_warning ("Error while resolving '%s': %s\n",
+                       entry->host, evutil_gai_strerror(result));
     }
 
-    g_free(peer->dns_addr);
-    peer->dns_addr = g_strdup (data->addr_str);
-    peer->dns_done = 1;
-    ccnet_conn_manager_connect_peer (peer->manager->session->connMgr, peer);
+    for (ai = answer; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET)
+            addr = &((struct sockaddr_in *)(ai->ai_addr))->sin_addr;
+        else if (ai->ai_family == AF_INET6)
+            addr = &((struct sockaddr_in6 *)(ai->ai_addr))->sin6_addr;
+        else
+            continue;
+
+        if (!evutil_inet_ntop (ai->ai_family, addr, buf, sizeof(buf)))
+            continue;
+
+        for (i = 0; i < entry->addrs->len; i++)
+            if (strcmp (g_ptr_array_index (entry->addrs, i), buf) == 0)
+                break;
+        if (i == entry->addrs->len)
+            g_ptr_array_add (entry->addrs, g_strdup (buf));
+    }
+    if (answer)
+        evutil_freeaddrinfo (answer);
+
+    if (result == EVUTIL_EAI_CANCEL) {
+        /* the base is going away, just drop the waiters */
+        entry->expire = 0;
+    } else if (entry->addrs->len > 0) {
+        entry->expire = time(NULL) + DNS_POSITIVE_TTL;
+    } else {
+        entry->expire = time(NULL) + DNS_NEGATIVE_TTL;
+    }
+    entry->pending = FALSE;
+
+    waiters = entry->waiters;
+    entry->waiters = NULL;
+    for (ptr = waiters; ptr; ptr = ptr->next) {
+        CcnetPeer *peer = ptr->data;
 
-    free(data->addr_str);
-    g_free (data);
+        if (result != EVUTIL_EAI_CANCEL && !peer->in_connection &&
+            peer->net_state == PEER_DOWN) {
+            if (dns_assign_address (entry, peer))
+                ccnet_conn_manager_connect_peer (entry->manager, peer);
+            else {
+                ccnet_warning ("DNS lookup failed for peer %.10s(%s).\n",
+                               peer->id, entry->host);
+                peer->num_fails++;
+                note_conn_result (entry->manager, peer, "dns lookup failed");
+            }
+        }
+        g_object_unref (peer);
+    }
+    g_list_free (waiters);
 }
 
 static void
 dns_lookup_peer (CcnetPeer* peer)
 {
-    DNSLookupData *data;
+    CcnetConnManager *manager = peer->manager->session->connMgr;
+    struct evutil_addrinfo hints;
+    DNSCacheEntry *entry;
+    const char *host;
 
     if (peer->dns_done)
         return;
 
-    data = g_new0 (DNSLookupData, 1);
-    data->peer = peer;
-    ccnet_job_manager_schedule_job (peer->manager->session->job_mgr,
-                                    dns_lookup,
-                                    dns_lookup_cb,
-                                    data);
+    host = peer->redirected ? peer->redirect_addr : peer->public_addr;
+
+    if (!manager->dns_cache)
+        manager->dns_cache = g_hash_table_new_full (
+            g_str_hash, g_str_equal, NULL,
+            (GDestroyNotify)dns_cache_entry_free);
+
+    entry = g_hash_table_lookup (manager->dns_cache, host);
+    if (!entry) {
+        entry = g_new0 (DNSCacheEntry, 1);
+        entry->manager = manager;
+        entry->host = g_strdup (host);
+        entry->addrs = g_ptr_array_new_with_free_func (g_free);
+        g_hash_table_insert (manager->dns_cache, entry->host, entry);
+    }
+
+    if (entry->pending) {
+        if (!g_list_find (entry->waiters, peer))
+            entry->waiters = g_list_prepend (entry->waiters,
+                                             g_object_ref (peer));
+        return;
+    }
+
+    if (entry->expire > time(NULL)) {
+        if (dns_assign_address (entry, peer))
+            ccnet_conn_manager_connect_peer (manager, peer);
+        else {
+            peer->num_fails++;
+            note_conn_result (manager, peer, "dns lookup failed");
+        }
+        return;
+    }
+
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP; /* We want a TCP socket */
+    /* Only return addresses we can use. */
+    hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+
+    entry->pending = TRUE;
+    entry->waiters = g_list_prepend (entry->waiters, g_object_ref (peer));
+    /* The callback may run before this returns, e.g. for names
+     * in the hosts file. */
+    evdns_getaddrinfo (evdns_get_global_base (), host, NULL,
+                       &hints, dns_lookup_cb, entry);
 }
 
 void
 ccnet_conn_manager_start (CcnetConnManager *manager)
 {
+    GKeyFile *keyf = manager->session->keyf;
+
+    manager->listen_backlog = LISTEN_BACKLOG;
+    if (g_key_file_has_key (keyf, "Network", "LISTEN_BACKLOG", NULL))
+        manager->listen_backlog = g_key_file_get_integer (
+            keyf, "Network", "LISTEN_BACKLOG", NULL);
+    manager->max_handshaking = MAX_INCOMING_HANDSHAKES;
+    if (g_key_file_has_key (keyf, "Network", "MAX_INCOMING_HANDSHAKES", NULL))
+        manager->max_handshaking = g_key_file_get_integer (
+            keyf, "Network", "MAX_INCOMING_HANDSHAKES", NULL);
+    if (manager->max_handshaking <= 0)
+        manager->max_handshaking = MAX_INCOMING_HANDSHAKES;
+
+    manager->handshake_rate = HANDSHAKE_RATE;
+    if (g_key_file_has_key (keyf, "Network", "HANDSHAKE_RATE", NULL))
+        manager->handshake_rate = g_key_file_get_double (
+            keyf, "Network", "HANDSHAKE_RATE", NULL);
+    manager->handshake_burst = HANDSHAKE_BURST;
+    if (g_key_file_has_key (keyf, "Network", "HANDSHAKE_BURST", NULL))
+        manager->handshake_burst = g_key_file_get_double (
+            keyf, "Network", "HANDSHAKE_BURST", NULL);
+    if (manager->handshake_burst < 1)
+        manager->handshake_burst = 1;
+    manager->busy_queue = manager->max_handshaking * 2;
+    if (g_key_file_has_key (keyf, "Network", "HANDSHAKE_QUEUE_BUSY", NULL))
+        manager->busy_queue = g_key_file_get_integer (
+            keyf, "Network", "HANDSHAKE_QUEUE_BUSY", NULL);
+    manager->busy_retry_after = BUSY_RETRY_AFTER;
+    if (g_key_file_has_key (keyf, "Network", "BUSY_RETRY_AFTER", NULL))
+        manager->busy_retry_after = g_key_file_get_integer (
+            keyf, "Network", "BUSY_RETRY_AFTER", NULL);
+    g_strfreev (manager->busy_redirects);
+    manager->busy_redirects = g_key_file_get_string_list (
+        keyf, "Network", "BUSY_REDIRECT", NULL, NULL);
+
+    metric_refused_rate = ccnet_metrics_counter (
+        "ccnet_connections_refused_total", "reason=\"rate\"",
+        "Incoming connections refused with a busy reply");
+    metric_refused_busy = ccnet_metrics_counter (
+        "ccnet_connections_refused_total", "reason=\"busy\"",
+        "Incoming connections refused with a busy reply");
+
 #ifdef CCNET_SERVER
     ccnet_conn_listen_init (manager);
 #endif
+    manager->race_connects = g_key_file_get_boolean (
+        manager->session->keyf, "Network", "CONNECT_RACING", NULL);
     manager->reconnect_timer = ccnet_timer_new (reconnect_pulse, manager,
-                                                RECONNECT_PERIOD_MSEC);
+                                                RECONNECT_PULSE_MSEC);
 }
 
 void
 ccnet_conn_manager_stop (CcnetConnManager *manager)
 {
+    AcceptedConn *conn;
+
+    if (manager->listening) {
+        event_del (&manager->listen_event);
+        manager->listening = 0;
+    }
     evutil_closesocket (manager->bind_socket);
     manager->bind_socket = 0;
 
+    ccnet_timer_free (&manager->accept_timer);
+    while ((conn = g_queue_pop_head (manager->accept_queue)) != NULL) {
+        evutil_closesocket (conn->socket);
+        g_free (conn);
+    }
+
     ccnet_timer_free (&manager->reconnect_timer);
-    ccnet_timer_free (&manager->listen_timer);
 }
 
 void
 ccnet_conn_manager_add_to_conn_list (CcnetConnManager *manager,
                                      CcnetPeer *peer)
 {
-    if (g_list_find (manager->conn_list, peer)) {
+    CcnetConnEntry *entry;
+
+    if (g_hash_table_lookup (manager->conn_index, peer)) {
         ccnet_warning ("[Conn] peer %s(%.8s) is already in conn_list\n",
                        peer->name, peer->id);
         return;
     }
-    manager->conn_list = g_list_prepend (manager->conn_list, peer);
-    g_object_ref (peer);
+    entry = g_new0 (CcnetConnEntry, 1);
+    entry->peer = g_object_ref (peer);
+    entry->added = time(NULL);
+    list_add_tail (&entry->list, &manager->conn_list);
+    g_hash_table_insert (manager->conn_index, peer, entry);
+
+    /* jittered, so that a batch of peers added together is spread out */
+    schedule_reconnect (manager, peer, g_random_int_range (0, RECONNECT_BASE_SECS));
 }
 
 void
 ccnet_conn_manager_remove_from_conn_list (CcnetConnManager *manager,
                                           CcnetPeer *peer)
 {
-    /* we can't directly use g_list_remove, since we have to call
-     * g_object_unref, if the peer is actually in the list
-     */
-    if (!g_list_find (manager->conn_list, peer))
+    CcnetConnEntry *entry = g_hash_table_lookup (manager->conn_index, peer);
+
+    if (!entry)
         return;
-    manager->conn_list = g_list_remove (manager->conn_list, peer);
+    g_hash_table_remove (manager->conn_index, peer);
+    list_del (&entry->list);
+    g_free (entry);
+    unschedule_reconnect (manager, peer);
     g_object_unref (peer);
 }
 
+CcnetConnEntry *
+ccnet_conn_manager_lookup_conn (CcnetConnManager *manager, CcnetPeer *peer)
+{
+    return g_hash_table_lookup (manager->conn_index, peer);
+}
+
+/* Rare, an rpc: a walk of the list is fine. */
 void
 ccnet_conn_manager_cancel_conn (CcnetConnManager *manager,
                                 const char *addr, int port)
 {
-    GList *ptr;
+    CcnetConnEntry *entry;
 
-    for (ptr = manager->conn_list; ptr; ptr = ptr->next) {
-        CcnetPeer *peer = ptr->data;
+    list_for_each_entry (entry, &manager->conn_list, list) {
+        CcnetPeer *peer = entry->peer;
         if (g_strcmp0(peer->public_addr, addr) == 0 && peer->public_port == port) {
-            manager->conn_list = g_list_delete_link (manager->conn_list, ptr);
+            g_object_ref (peer);
+            ccnet_conn_manager_remove_from_conn_list (manager, peer);
             if (peer->to_resolve) {
                 ccnet_peer_manager_on_peer_resolve_failed (
                     manager->session->peer_mgr, peer);
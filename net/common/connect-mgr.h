@@ -6,19 +6,61 @@
 #include <event.h>
 
 #include "timer.h"
+#include "list.h"
 
 typedef struct CcnetConnManager CcnetConnManager;
 
+/*
+ * A peer in the conn list, kept connected. The reconnect schedule is
+ * on the peer itself, since relays are scheduled without being here.
+ */
+typedef struct CcnetConnEntry {
+    CcnetPeer        *peer;         /* referenced */
+    struct list_head  list;         /* in conn_list, oldest first */
+    time_t            added;
+    const char       *last_error;   /* of the last attempt, static */
+    time_t            last_error_time;
+} CcnetConnEntry;
+
 struct CcnetConnManager
 {
     CcnetSession    *session;
 
     CcnetTimer      *reconnect_timer;
-    CcnetTimer      *listen_timer;
 
     evutil_socket_t  bind_socket;
+    struct event     listen_event;
+    unsigned int     listening : 1;
+    unsigned int     accept_paused : 1; /* listen_event is deleted */
+    int              listen_backlog;    /* [Network] LISTEN_BACKLOG */
+    CcnetTimer      *accept_timer;      /* resumes accepting after EMFILE */
+
+    /* Incoming handshakes in flight, at most max_handshaking. The
+     * connections accepted beyond are queued. */
+    int              n_handshaking;
+    int              max_handshaking;   /* [Network] MAX_INCOMING_HANDSHAKES */
+    GQueue          *accept_queue;
+
+    /* Refusing incoming connections when overloaded, see
+     * admit_connection(). */
+    GHashTable      *handshake_buckets; /* ip -> token bucket */
+    double           handshake_rate;    /* [Network] HANDSHAKE_RATE */
+    double           handshake_burst;   /* [Network] HANDSHAKE_BURST */
+    time_t           last_bucket_gc;
+    int              busy_queue;        /* [Network] HANDSHAKE_QUEUE_BUSY */
+    int              busy_retry_after;  /* [Network] BUSY_RETRY_AFTER */
+    char           **busy_redirects;    /* [Network] BUSY_REDIRECT */
+    guint            next_redirect;
+
+    GHashTable      *conn_index;    /* peer -> CcnetConnEntry */
+    struct list_head conn_list;
+
+    GHashTable      *dns_cache;     /* host name -> resolved addresses */
+
+    GSequence       *reconnect_queue;   /* peers sorted by next_reconnect */
+    int              n_connecting;      /* outgoing handshakes in flight */
 
-    GList           *conn_list;
+    gboolean         race_connects;     /* [Network] CONNECT_RACING */
 };
 
 CcnetConnManager *ccnet_conn_manager_new (CcnetSession *session);
@@ -30,6 +72,9 @@ void ccnet_conn_manager_add_to_conn_list (CcnetConnManager *manager,
                                           CcnetPeer *peer);
 void ccnet_conn_manager_remove_from_conn_list (CcnetConnManager *manager,
                                                CcnetPeer *peer);
+/* NULL if @peer is not in the conn list. */
+CcnetConnEntry *ccnet_conn_manager_lookup_conn (CcnetConnManager *manager,
+                                                CcnetPeer *peer);
 void ccnet_conn_manager_cancel_conn (CcnetConnManager *manager,
                                      const char *addr, int port);
 
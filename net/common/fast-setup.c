@@ -0,0 +1,402 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#ifdef WIN32
+    #include <winsock2.h>
+#else
+    #include <netinet/in.h>
+#endif
+
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include "peer.h"
+#include "peer-mgr.h"
+#include "packet-io.h"
+#include "session.h"
+#include "handshake.h"
+#include "fast-setup.h"
+#include "rsa.h"
+#include "utils.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_CONNECTION
+#include "log.h"
+
+#define MAC_LEN CCNET_RESUME_SECRET_LEN   /* HMAC-SHA1 */
+
+/* HMAC(key, label nonce_a nonce_b) with the 40 hex digit session key. */
+static void
+key_mac (CcnetHandshake *handshake, const char *label, unsigned char *mac)
+{
+    int label_len = strlen(label);
+    unsigned char buf[32 + 2 * CCNET_SETUP_NONCE_LEN];
+    unsigned int mac_len;
+
+    g_assert (label_len <= 32);
+    memcpy (buf, label, label_len);
+    memcpy (buf + label_len, handshake->nonce_a, CCNET_SETUP_NONCE_LEN);
+    memcpy (buf + label_len + CCNET_SETUP_NONCE_LEN, handshake->nonce_b,
+            CCNET_SETUP_NONCE_LEN);
+    HMAC (EVP_sha1(), handshake->fast_key, 40,
+          buf, label_len + 2 * CCNET_SETUP_NONCE_LEN, mac, &mac_len);
+}
+
+/* The same with the resume secret of @peer. */
+static void
+resume_mac (CcnetHandshake *handshake, CcnetPeer *peer, const char *label,
+            unsigned char *mac)
+{
+    unsigned char nonces[2 * CCNET_SETUP_NONCE_LEN];
+
+    memcpy (nonces, handshake->nonce_a, CCNET_SETUP_NONCE_LEN);
+    memcpy (nonces + CCNET_SETUP_NONCE_LEN, handshake->nonce_b,
+            CCNET_SETUP_NONCE_LEN);
+    ccnet_peer_resume_mac (peer, label, nonces, sizeof(nonces), mac);
+}
+
+static void
+resume_key (CcnetHandshake *handshake, CcnetPeer *peer)
+{
+    unsigned char key[MAC_LEN];
+
+    resume_mac (handshake, peer, "setup-key", key);
+    rawdata_to_hex (key, handshake->fast_key, MAC_LEN);
+}
+
+/* What the master signs in 'R' mode. */
+static GByteArray *
+signed_data (CcnetHandshake *handshake, const unsigned char *enc, int enc_len,
+             const char *master_id, const char *slave_id)
+{
+    GByteArray *data = g_byte_array_new ();
+
+    g_byte_array_append (data, (guint8 *)"ccnet-setup", strlen("ccnet-setup"));
+    g_byte_array_append (data, handshake->nonce_a, CCNET_SETUP_NONCE_LEN);
+    g_byte_array_append (data, enc, enc_len);
+    g_byte_array_append (data, (guint8 *)master_id, 40);
+    g_byte_array_append (data, (guint8 *)slave_id, 40);
+    return data;
+}
+
+/* The ciphers we accept, in order of preference, "" if we don't
+ * encrypt the channel. */
+static char *
+get_cipher_offer (CcnetSession *session)
+{
+    static const int ciphers[] = {
+        CCNET_CIPHER_AES_256_GCM,
+        CCNET_CIPHER_CHACHA20_POLY1305,
+        CCNET_CIPHER_AES_256_CBC,
+    };
+    GString *buf = g_string_new (NULL);
+    int i;
+
+    if (!ccnet_session_should_encrypt_channel (session))
+        return g_string_free (buf, FALSE);
+
+    for (i = 0; i < G_N_ELEMENTS(ciphers); i++) {
+        if (!ccnet_cipher_is_supported (ciphers[i]))
+            continue;
+        if (buf->len > 0)
+            g_string_append_c (buf, ',');
+        g_string_append (buf, ccnet_cipher_to_string (ciphers[i]));
+    }
+    return g_string_free (buf, FALSE);
+}
+
+static int
+choose_cipher (CcnetSession *session, const char *offer)
+{
+    char **names;
+    int i, cipher = -1;
+
+    if (!ccnet_session_should_encrypt_channel (session))
+        return -1;
+
+    names = g_strsplit (offer, ",", -1);
+    for (i = 0; names[i]; i++) {
+        int c = ccnet_cipher_from_string (names[i]);
+        if (c >= 0 && ccnet_cipher_is_supported (c)) {
+            cipher = c;
+            break;
+        }
+    }
+    g_strfreev (names);
+    return cipher;
+}
+
+/* Length of the NUL terminated string at @p, or -1. */
+static int
+get_string (const unsigned char *p, int len)
+{
+    const unsigned char *end = memchr (p, '\0', len);
+
+    return end ? end - p : -1;
+}
+
+int
+ccnet_fast_setup_offer (CcnetHandshake *handshake, GByteArray *buf)
+{
+    CcnetSession *session = handshake->session;
+    CcnetPeer *peer = handshake->peer;
+    unsigned char random_buf[40], sha1[20];
+    unsigned char *enc, *sig;
+    int enc_len;
+    unsigned int sig_len;
+    uint16_t n;
+    GByteArray *data;
+    char *ciphers;
+    char mode;
+
+    if (!session->fast_setup || !peer || !peer->fast_setup ||
+        peer->to_resolve)
+        return -1;
+
+    if (ccnet_peer_can_resume (peer))
+        mode = 'S';
+    else if (peer->pubkey)
+        mode = 'R';
+    else
+        return -1;
+
+    RAND_pseudo_bytes (handshake->nonce_a, CCNET_SETUP_NONCE_LEN);
+
+    if (mode == 'S') {
+        ciphers = get_cipher_offer (session);
+        g_byte_array_append (buf, (guint8 *)&mode, 1);
+        g_byte_array_append (buf, handshake->nonce_a, CCNET_SETUP_NONCE_LEN);
+        g_byte_array_append (buf, (guint8 *)ciphers, strlen(ciphers) + 1);
+        g_free (ciphers);
+        handshake->fast_mode = mode;
+        return 0;
+    }
+
+    /* A new key, as send-skey2 makes it. */
+    RAND_pseudo_bytes (random_buf, sizeof(random_buf));
+    SHA1 (random_buf, sizeof(random_buf), sha1);
+    rawdata_to_hex (sha1, handshake->fast_key, 20);
+
+    enc = public_key_encrypt (peer->pubkey, (unsigned char *)handshake->fast_key,
+                              40, &enc_len);
+    if (enc_len <= 0) {
+        g_free (enc);
+        return -1;
+    }
+    data = signed_data (handshake, enc, enc_len, session->base.id, peer->id);
+    sig = private_key_sign (session->privkey, data->data, data->len, &sig_len);
+    g_byte_array_free (data, TRUE);
+    if (!sig) {
+        g_free (enc);
+        return -1;
+    }
+
+    ciphers = get_cipher_offer (session);
+    n = htons (enc_len);
+    g_byte_array_append (buf, (guint8 *)&mode, 1);
+    g_byte_array_append (buf, handshake->nonce_a, CCNET_SETUP_NONCE_LEN);
+    g_byte_array_append (buf, (guint8 *)ciphers, strlen(ciphers) + 1);
+    g_byte_array_append (buf, (guint8 *)&n, 2);
+    g_byte_array_append (buf, enc, enc_len);
+    g_byte_array_append (buf, sig, sig_len);
+    g_free (ciphers);
+    g_free (enc);
+    g_free (sig);
+
+    handshake->fast_mode = mode;
+    return 0;
+}
+
+/* 'R' mode: check the signature and decrypt the key. */
+static int
+answer_rsa (CcnetHandshake *handshake, CcnetPeer *peer,
+            const unsigned char *p, int len)
+{
+    CcnetSession *session = handshake->session;
+    GByteArray *data;
+    unsigned char *key;
+    int enc_len, key_len;
+    uint16_t n;
+    gboolean ok;
+
+    if (!peer->pubkey || len < 2)
+        return -1;
+    memcpy (&n, p, 2);
+    enc_len = ntohs (n);
+    p += 2;
+    len -= 2;
+    if (enc_len == 0 || enc_len >= len)
+        return -1;
+
+    data = signed_data (handshake, p, enc_len, handshake->id, session->base.id);
+    ok = public_key_verify (peer->pubkey, data->data, data->len,
+                            p + enc_len, len - enc_len);
+    g_byte_array_free (data, TRUE);
+    if (!ok) {
+        ccnet_warning ("[Conn] Bad setup signature from %.10s\n",
+                       handshake->id);
+        return -1;
+    }
+
+    key = private_key_decrypt (session->privkey, (unsigned char *)p,
+                               enc_len, &key_len);
+    if (key_len != 40) {
+        g_free (key);
+        return -1;
+    }
+    memcpy (handshake->fast_key, key, 40);
+    handshake->fast_key[40] = '\0';
+    g_free (key);
+    return 0;
+}
+
+int
+ccnet_fast_setup_answer (CcnetHandshake *handshake,
+                         const unsigned char *offer, int len,
+                         GByteArray *buf)
+{
+    CcnetSession *session = handshake->session;
+    CcnetPeer *peer;
+    unsigned char proof[MAC_LEN];
+    const char *cipher_name;
+    char mode;
+    int slen, ret = -1;
+
+    if (!session->fast_setup || len < 1 + CCNET_SETUP_NONCE_LEN)
+        return -1;
+    mode = offer[0];
+    memcpy (handshake->nonce_a, offer + 1, CCNET_SETUP_NONCE_LEN);
+    offer += 1 + CCNET_SETUP_NONCE_LEN;
+    len -= 1 + CCNET_SETUP_NONCE_LEN;
+    if ((slen = get_string (offer, len)) < 0)
+        return -1;
+
+    peer = ccnet_peer_manager_get_peer (session->peer_mgr, handshake->id);
+    if (!peer)
+        return -1;
+    if (peer->net_state == PEER_CONNECTED)
+        goto out;
+
+    RAND_pseudo_bytes (handshake->nonce_b, CCNET_SETUP_NONCE_LEN);
+
+    if (mode == 'S') {
+        if (!ccnet_peer_can_resume (peer))
+            goto out;
+        resume_key (handshake, peer);
+        resume_mac (handshake, peer, "setup-b", proof);
+    } else if (mode == 'R') {
+        if (answer_rsa (handshake, peer,
+                        offer + slen + 1, len - slen - 1) < 0)
+            goto out;
+        key_mac (handshake, "setup-b", proof);
+    } else
+        goto out;
+
+    handshake->fast_cipher = choose_cipher (session, (const char *)offer);
+    cipher_name = handshake->fast_cipher >= 0 ?
+        ccnet_cipher_to_string (handshake->fast_cipher) : "";
+
+    g_byte_array_append (buf, (guint8 *)&mode, 1);
+    g_byte_array_append (buf, handshake->nonce_b, CCNET_SETUP_NONCE_LEN);
+    g_byte_array_append (buf, (guint8 *)cipher_name, strlen(cipher_name) + 1);
+    g_byte_array_append (buf, proof, MAC_LEN);
+
+    handshake->fast_mode = mode;
+    handshake->fast_done = 1;
+    ret = 0;
+
+out:
+    g_object_unref (peer);
+    return ret;
+}
+
+int
+ccnet_fast_setup_check (CcnetHandshake *handshake,
+                        const unsigned char *answer, int len)
+{
+    CcnetPeer *peer = handshake->peer;
+    unsigned char proof[MAC_LEN];
+    int slen, cipher = -1;
+    char *offer;
+
+    if (len < 1 + CCNET_SETUP_NONCE_LEN || answer[0] != handshake->fast_mode)
+        return -1;
+    memcpy (handshake->nonce_b, answer + 1, CCNET_SETUP_NONCE_LEN);
+    answer += 1 + CCNET_SETUP_NONCE_LEN;
+    len -= 1 + CCNET_SETUP_NONCE_LEN;
+    if ((slen = get_string (answer, len)) < 0 ||
+        len - slen - 1 != MAC_LEN)
+        return -1;
+
+    if (handshake->fast_mode == 'S') {
+        if (!ccnet_peer_can_resume (peer))
+            return -1;
+        resume_key (handshake, peer);
+        resume_mac (handshake, peer, "setup-b", proof);
+    } else
+        key_mac (handshake, "setup-b", proof);
+
+    if (CRYPTO_memcmp (proof, answer + slen + 1, MAC_LEN) != 0) {
+        ccnet_warning ("[Conn] Bad setup proof from %s(%.10s)\n",
+                       peer->name, peer->id);
+        return -1;
+    }
+
+    if (slen > 0) {
+        /* It has to be one we offered. */
+        offer = get_cipher_offer (handshake->session);
+        cipher = ccnet_cipher_from_string ((const char *)answer);
+        if (cipher < 0 || !strstr (offer, (const char *)answer)) {
+            g_free (offer);
+            return -1;
+        }
+        g_free (offer);
+    }
+
+    handshake->fast_cipher = cipher;
+    handshake->fast_done = 1;
+    return 0;
+}
+
+void
+ccnet_fast_setup_ack_mac (CcnetHandshake *handshake, unsigned char *mac)
+{
+    key_mac (handshake, "setup-ack", mac);
+}
+
+int
+ccnet_fast_setup_check_ack (CcnetHandshake *handshake,
+                            const unsigned char *data, int len)
+{
+    unsigned char mac[MAC_LEN];
+
+    if (len != MAC_LEN)
+        return -1;
+    key_mac (handshake, "setup-ack", mac);
+    return CRYPTO_memcmp (mac, data, MAC_LEN) == 0 ? 0 : -1;
+}
+
+void
+ccnet_fast_setup_apply (CcnetPeer *peer, CcnetHandshake *handshake)
+{
+    gboolean incoming = ccnet_packet_io_is_incoming (handshake->io);
+
+    ccnet_debug ("[Conn] Set up %s(%.10s) in one round trip (%c)\n",
+                 peer->name, peer->id, handshake->fast_mode);
+
+    g_free (peer->session_key);
+    peer->session_key = g_strndup (handshake->fast_key, 40);
+    peer->fast_verified = 1;
+
+    /* The master made the key, as the sender of send-skey2 does. */
+    if (handshake->fast_cipher >= 0 &&
+        ccnet_peer_prepare_channel_encryption (peer, handshake->fast_cipher,
+                                               !incoming) < 0)
+        ccnet_warning ("Error in prepare channel encryption\n");
+
+    if (incoming)
+        ccnet_peer_manager_on_peer_session_key_received (peer->manager, peer);
+    else
+        ccnet_peer_manager_on_peer_session_key_sent (peer->manager, peer);
+}
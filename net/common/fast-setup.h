@@ -0,0 +1,69 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_FAST_SETUP_H
+#define CCNET_FAST_SETUP_H
+
+#include <glib.h>
+
+/*
+ * Setting up a connection in one round trip.
+ *
+ * Normally the handshake only exchanges the peer ids, then keepalive2
+ * challenges the peer and send-skey2 agrees on a session key, several
+ * round trips before the first request. If the peer announced
+ * CCNET_CAP_FAST_SETUP on the last connection, the master appends an
+ * offer to its handshake packet, after its id:
+ *
+ *   'S' nonce_a ciphers\0                   it holds a resume secret
+ *   'R' nonce_a ciphers\0 len enc sig       it knows the peer's pubkey
+ *
+ * where enc is a new session key encrypted with the slave's pubkey, and
+ * sig the master's RSA signature over "ccnet-setup" nonce_a enc and both
+ * ids. The slave appends its answer to its own handshake packet:
+ *
+ *   mode nonce_b cipher\0 proof
+ *
+ * with the cipher it picked from the offer ("" for a plain channel). In
+ * 'S' mode the key and proof are HMACs of the nonces under the resume
+ * secret, in 'R' mode the proof is an HMAC under the decrypted key, so
+ * only the owner of the key pair can make it. The master's ack then
+ * carries HMAC(key, "setup-ack" nonce_a nonce_b), which proves to the
+ * slave that the offer was not replayed.
+ *
+ * Both sides then start with the session key set and the peer
+ * verified. A slave that can't answer (an unknown master, no secret
+ * left, or an old version) sends a plain handshake packet and the
+ * usual sequence runs.
+ */
+
+#define CCNET_SETUP_NONCE_LEN 20
+
+struct CcnetHandshake;
+struct _CcnetPeer;
+
+/* Master: append the offer for handshake->peer to @buf. Returns -1,
+ * with nothing appended, if the peer can't be set up this way. */
+int  ccnet_fast_setup_offer (struct CcnetHandshake *handshake,
+                             GByteArray *buf);
+
+/* Slave: check the offer of handshake->id and append the answer to
+ * @buf. Returns -1, with nothing appended, to run the usual sequence. */
+int  ccnet_fast_setup_answer (struct CcnetHandshake *handshake,
+                              const unsigned char *offer, int len,
+                              GByteArray *buf);
+
+/* Master: check the answer, -1 if the peer failed to prove who it is. */
+int  ccnet_fast_setup_check (struct CcnetHandshake *handshake,
+                             const unsigned char *answer, int len);
+
+/* The content of the master's ack, and the slave's check of it. */
+void ccnet_fast_setup_ack_mac (struct CcnetHandshake *handshake,
+                               unsigned char *mac);
+int  ccnet_fast_setup_check_ack (struct CcnetHandshake *handshake,
+                                 const unsigned char *data, int len);
+
+/* Install the agreed session key once @peer is connected. */
+void ccnet_fast_setup_apply (struct _CcnetPeer *peer,
+                             struct CcnetHandshake *handshake);
+
+#endif
@@ -0,0 +1,761 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "net.h"
+#include "utils.h"
+#include "session.h"
+#include "peer.h"
+#include "peer-mgr.h"
+#include "packet-io.h"
+#include "connect-mgr.h"
+#include "processor.h"
+#include "processors/keepalive2-proc.h"
+#include "handover.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_CONNECTION
+#include "log.h"
+
+#define HANDOVER_SOCKET         "handover.sock"
+/* seconds the new process waits for the old one */
+#define HANDOVER_TIMEOUT        30
+#define HANDOVER_PULSE_MSEC     100
+/* seconds the old process waits for busy peers to become idle */
+#define HANDOVER_GRACE          5
+#define HANDOVER_MAX_MSG        65536
+
+/*
+ * Messages are a 4 byte length in network order and the text, some
+ * with a file descriptor attached:
+ *
+ *   takeover                       new -> old
+ *   listener <name>                with the listening socket
+ *   peer\n<key value lines>\n\n<pubinfo>
+ *                                  with the connection
+ *   resume <id> <secret> <expire>  a peer which reconnects
+ *   done
+ *
+ * The old process closes the connection when it has exited.
+ */
+
+static const char *listener_names[] = { "peer", "local", "unix" };
+static evutil_socket_t listeners[] = { -1, -1, -1 };
+
+typedef struct {
+    char             *record;
+    evutil_socket_t   fd;
+} PeerRecord;
+
+/* Received by the new process, adopted once the session has started. */
+static GList *peer_records;
+
+typedef struct {
+    CcnetSession     *session;
+    evutil_socket_t   fd;
+    CcnetTimer       *pulse;
+    time_t            deadline;
+    GHashTable       *handed;   /* ids of the peers handed over */
+} Handover;
+
+static struct event accept_event;
+static Handover *handover;
+
+static void
+set_timeout (evutil_socket_t fd, int secs)
+{
+    struct timeval tv;
+
+    tv.tv_sec = secs;
+    tv.tv_usec = 0;
+    setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int
+send_msg (evutil_socket_t fd, const char *data, guint32 len,
+          evutil_socket_t passfd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    guint32 total = len + 4;
+    char *buf;
+    ssize_t n;
+    int ret = 0;
+
+    buf = g_malloc (total);
+    *(guint32 *)buf = htonl (len);
+    memcpy (buf + 4, data, len);
+
+    memset (&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = total;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (passfd >= 0) {
+        memset (control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR (&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN (sizeof(int));
+        memcpy (CMSG_DATA (cmsg), &passfd, sizeof(int));
+    }
+
+    n = sendmsg (fd, &msg, 0);
+    if (n < 0 ||
+        (n < total && writen (fd, buf + n, total - n) != (ssize_t)(total - n)))
+        ret = -1;
+
+    g_free (buf);
+    return ret;
+}
+
+/* Returns the text in @data, or -1. @passfd is -1 if none came with it. */
+static int
+recv_msg (evutil_socket_t fd, char **data, evutil_socket_t *passfd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    guint32 hdr, len;
+    ssize_t n;
+    char *buf;
+
+    *passfd = -1;
+
+    /* The descriptor arrives with the first byte of the message. */
+    memset (&msg, 0, sizeof(msg));
+    iov.iov_base = &hdr;
+    iov.iov_len = 4;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    n = recvmsg (fd, &msg, 0);
+    if (n <= 0)
+        return -1;
+    for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy (passfd, CMSG_DATA (cmsg), sizeof(int));
+
+    if (n < 4 && readn (fd, (char *)&hdr + n, 4 - n) != 4 - n)
+        goto error;
+    len = ntohl (hdr);
+    if (len > HANDOVER_MAX_MSG)
+        goto error;
+
+    buf = g_malloc (len + 1);
+    if (readn (fd, buf, len) != (ssize_t)len) {
+        g_free (buf);
+        goto error;
+    }
+    buf[len] = '\0';
+    *data = buf;
+    return len;
+
+error:
+    if (*passfd >= 0) {
+        close (*passfd);
+        *passfd = -1;
+    }
+    return -1;
+}
+
+static int
+send_text (evutil_socket_t fd, const char *text, evutil_socket_t passfd)
+{
+    return send_msg (fd, text, strlen(text), passfd);
+}
+
+/* ------------ the old process ------------ */
+
+/*
+ * A peer can be handed over when nothing is buffered for it and its
+ * only processors are the verified keepalive2 pair. Anything else,
+ * like a message stream or a TLS session, would need its state carried
+ * over, and io_uring keeps reading a socket until its ring is done.
+ */
+static gboolean
+peer_is_idle (CcnetPeer *peer, CcnetProcessor **master, int *count,
+              CcnetProcessor **slave)
+{
+    struct evbuffer *input, *output;
+    GList *procs, *ptr;
+    gboolean idle = TRUE;
+
+    if (!peer->session_key || peer->in_shutdown || peer->shutdown_scheduled
+        || peer->write_cbs || peer->flush_scheduled || peer->msg_stream
+        || peer->io->handling || peer->io->tls || peer->io->uring)
+        return FALSE;
+
+    input = bufferevent_get_input (peer->io->bufev);
+    output = bufferevent_get_output (peer->io->bufev);
+    if (evbuffer_get_length (peer->cork) > 0 ||
+        evbuffer_get_length (peer->cork_ctl) > 0 ||
+        evbuffer_get_length (peer->packet) > 0 ||
+        evbuffer_get_length (input) > 0 ||
+        evbuffer_get_length (output) > 0)
+        return FALSE;
+
+    *master = *slave = NULL;
+    procs = ccnet_peer_get_processor_list (peer);
+    for (ptr = procs; ptr && idle; ptr = ptr->next) {
+        CcnetProcessor *processor = ptr->data;
+
+        if (strcmp (GET_PNAME(processor), "keepalive2-proc") != 0)
+            idle = FALSE;
+        else if (IS_SLAVE(processor)) {
+            if (*slave)
+                idle = FALSE;
+            *slave = processor;
+        } else {
+            if (*master ||
+                ccnet_keepalive2_proc_export (processor, count) < 0)
+                idle = FALSE;
+            *master = processor;
+        }
+    }
+    g_list_free (procs);
+
+    return idle && *master;
+}
+
+static int
+send_peer (Handover *h, CcnetPeer *peer, CcnetProcessor *master, int count,
+           CcnetProcessor *slave)
+{
+    GString *buf = g_string_new ("peer\n");
+    GString *pubinfo;
+    int ret;
+
+    g_string_append_printf (buf, "id %s\n", peer->id);
+    if (peer->addr_str)
+        g_string_append_printf (buf, "addr %s\nport %d\n",
+                                peer->addr_str, peer->port);
+    g_string_append_printf (buf, "incoming %d\n", peer->io->is_incoming);
+    g_string_append_printf (buf, "jumbo %d\n", peer->io->jumbo);
+    g_string_append_printf (buf, "batch %d\n", peer->io->batch_enc);
+    g_string_append_printf (buf, "trace %d\n", peer->io->trace);
+    g_string_append_printf (buf, "compress %d\n", peer->io->compress);
+    g_string_append_printf (buf, "session-key %s\n", peer->session_key);
+    if (peer->crypt) {
+        g_string_append_printf (buf, "cipher %s\n",
+                                ccnet_cipher_to_string (peer->crypt->cipher));
+        g_string_append_printf (buf, "initiator %d\n",
+                                peer->crypt->initiator ? 1 : 0);
+        g_string_append_printf (buf, "send-seq %" G_GUINT64_FORMAT "\n",
+                                peer->crypt->send_seq);
+        g_string_append_printf (buf, "recv-seq %" G_GUINT64_FORMAT "\n",
+                                peer->crypt->recv_seq);
+    }
+    g_string_append (buf, "roles ");
+    ccnet_peer_get_roles_str (peer, buf);
+    g_string_append_c (buf, '\n');
+    g_string_append_printf (buf, "ready %d\n", peer->is_ready);
+    g_string_append_printf (buf, "req-id %d\n", peer->reqID);
+    g_string_append_printf (buf, "ka-master %u\n", master->id);
+    g_string_append_printf (buf, "ka-count %d\n", count);
+    if (slave)
+        g_string_append_printf (buf, "ka-slave %u\n", slave->id);
+    g_string_append_c (buf, '\n');
+
+    pubinfo = ccnet_peer_to_string (peer);
+    g_string_append (buf, pubinfo->str);
+    g_string_free (pubinfo, TRUE);
+
+    ret = send_msg (h->fd, buf->str, buf->len, peer->io->socket);
+    g_string_free (buf, TRUE);
+    if (ret < 0) {
+        ccnet_warning ("[Handover] Failed to send peer %.8s: %s\n",
+                       peer->id, strerror(errno));
+        return -1;
+    }
+
+    /* The new process reads and writes the connection from now on. */
+    bufferevent_disable (peer->io->bufev, EV_READ | EV_WRITE);
+    g_hash_table_insert (h->handed, g_strdup (peer->id), peer);
+    ccnet_debug ("[Handover] Handed over peer %s(%.8s)\n", peer->name,
+                 peer->id);
+    return 0;
+}
+
+static void
+finish_handover (Handover *h)
+{
+    CcnetPeerTableIter iter;
+    CcnetPeer *peer;
+    char hex[CCNET_RESUME_SECRET_LEN * 2 + 1];
+    char *msg;
+    int n_resume = 0;
+
+    ccnet_peer_table_iter_init (&iter, h->session->peer_mgr->peer_table);
+    while (ccnet_peer_table_iter_next (&iter, &peer)) {
+        if (g_hash_table_lookup (h->handed, peer->id))
+            continue;
+        /* The busy peers reconnect to the new process. */
+        if (peer->net_state == PEER_CONNECTED)
+            ccnet_peer_save_resume_secret (peer);
+        if (!ccnet_peer_can_resume (peer))
+            continue;
+
+        rawdata_to_hex (peer->resume_secret, hex, CCNET_RESUME_SECRET_LEN);
+        msg = g_strdup_printf ("resume %s %s %" G_GINT64_FORMAT, peer->id,
+                               hex, (gint64)peer->resume_expire);
+        if (send_text (h->fd, msg, -1) == 0)
+            ++n_resume;
+        g_free (msg);
+    }
+    send_text (h->fd, "done", -1);
+
+    ccnet_message ("[Handover] Handed over %d connections and %d resumable "
+                   "sessions, exiting\n",
+                   g_hash_table_size (h->handed), n_resume);
+
+    /* The new process waits for us to close the connection on exit. */
+    ccnet_session_on_exit (h->session);
+    exit (0);
+}
+
+static int
+handover_pulse (void *vh)
+{
+    Handover *h = vh;
+    CcnetPeerTableIter iter;
+    CcnetPeer *peer;
+    CcnetProcessor *master, *slave;
+    int count, n_busy = 0;
+
+    ccnet_peer_table_iter_init (&iter, h->session->peer_mgr->peer_table);
+    while (ccnet_peer_table_iter_next (&iter, &peer)) {
+        if (peer->net_state != PEER_CONNECTED || peer->is_local ||
+            g_hash_table_lookup (h->handed, peer->id))
+            continue;
+
+        if (!peer_is_idle (peer, &master, &count, &slave)) {
+            ++n_busy;
+            continue;
+        }
+        if (send_peer (h, peer, master, count, slave) < 0) {
+            /* Whatever the new process has got, it reconnects the rest. */
+            n_busy = 0;
+            break;
+        }
+    }
+
+    if (n_busy > 0 && time(NULL) < h->deadline)
+        return TRUE;
+
+    h->pulse = NULL;
+    finish_handover (h);
+    return FALSE;
+}
+
+static int
+send_listener (Handover *h, const char *name, evutil_socket_t fd)
+{
+    char *msg;
+    int ret;
+
+    msg = g_strdup_printf ("listener %s", name);
+    ret = send_text (h->fd, msg, fd);
+    g_free (msg);
+    return ret;
+}
+
+static void
+start_handover (CcnetSession *session, evutil_socket_t fd)
+{
+    CcnetConnManager *connMgr = session->connMgr;
+    Handover *h;
+
+    ccnet_message ("[Handover] Handing over to a new process\n");
+
+    h = g_new0 (Handover, 1);
+    h->session = session;
+    h->fd = fd;
+    h->handed = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, NULL);
+    handover = h;
+
+    /* Stop accepting, the connections queued on the listeners are
+     * accepted by the new process. */
+    event_del (&accept_event);
+    if (connMgr->listening) {
+        event_del (&connMgr->listen_event);
+        connMgr->listening = 0;
+        send_listener (h, "peer", connMgr->bind_socket);
+    }
+    if (event_initialized (&session->local_event)) {
+        event_del (&session->local_event);
+        send_listener (h, "local", event_get_fd (&session->local_event));
+    }
+    if (event_initialized (&session->un_event)) {
+        event_del (&session->un_event);
+        send_listener (h, "unix", event_get_fd (&session->un_event));
+    }
+
+    h->deadline = time(NULL) + HANDOVER_GRACE;
+    h->pulse = ccnet_timer_new (handover_pulse, h, HANDOVER_PULSE_MSEC);
+}
+
+static void
+accept_takeover (evutil_socket_t fd, short event, void *vsession)
+{
+    CcnetSession *session = vsession;
+    evutil_socket_t connfd, passfd = -1;
+    char *request = NULL;
+    uid_t uid;
+
+    connfd = accept (fd, NULL, 0);
+    if (connfd < 0)
+        return;
+
+    if (ccnet_net_get_peer_uid (connfd, &uid) < 0 || uid != getuid()) {
+        ccnet_warning ("[Handover] Refused a process of another user\n");
+        close (connfd);
+        return;
+    }
+
+    set_timeout (connfd, HANDOVER_GRACE);
+    if (handover || recv_msg (connfd, &request, &passfd) < 0 ||
+        strcmp (request, "takeover") != 0) {
+        ccnet_warning ("[Handover] Bad takeover request\n");
+        if (passfd >= 0)
+            close (passfd);
+        g_free (request);
+        close (connfd);
+        return;
+    }
+    g_free (request);
+
+    start_handover (session, connfd);
+}
+
+int
+ccnet_handover_listen (CcnetSession *session)
+{
+    evutil_socket_t sockfd;
+    char *path;
+
+    if (!g_key_file_get_boolean (session->keyf, "Network", "HANDOVER", NULL))
+        return 0;
+
+    path = g_build_filename (session->config_dir, HANDOVER_SOCKET, NULL);
+    sockfd = ccnet_net_bind_unix (path);
+    if (sockfd < 0) {
+        ccnet_warning ("[Handover] Failed to listen on %s\n", path);
+        g_free (path);
+        return -1;
+    }
+    chmod (path, 0600);
+    ccnet_message ("[Handover] Listen on %s\n", path);
+    g_free (path);
+
+    listen (sockfd, 1);
+    event_set (&accept_event, sockfd, EV_READ | EV_PERSIST,
+               accept_takeover, session);
+    event_add (&accept_event, NULL);
+    return 0;
+}
+
+/* ------------ the new process ------------ */
+
+static int
+apply_resume (CcnetSession *session, const char *line)
+{
+    char **tokens = g_strsplit (line, " ", 3);
+    CcnetPeer *peer;
+    int ret = -1;
+
+    if (g_strv_length (tokens) != 3 ||
+        strlen (tokens[1]) != CCNET_RESUME_SECRET_LEN * 2)
+        goto out;
+
+    peer = ccnet_peer_manager_get_peer (session->peer_mgr, tokens[0]);
+    if (!peer)
+        goto out;
+    if (hex_to_rawdata (tokens[1], peer->resume_secret,
+                        CCNET_RESUME_SECRET_LEN) == 0) {
+        peer->resume_expire = (time_t)g_ascii_strtoll (tokens[2], NULL, 10);
+        ret = 0;
+    } else
+        ccnet_peer_clear_resume_secret (peer);
+    g_object_unref (peer);
+
+out:
+    g_strfreev (tokens);
+    return ret;
+}
+
+static void
+free_received (void)
+{
+    GList *ptr;
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(listeners); ++i)
+        if (listeners[i] >= 0) {
+            close (listeners[i]);
+            listeners[i] = -1;
+        }
+
+    for (ptr = peer_records; ptr; ptr = ptr->next) {
+        PeerRecord *rec = ptr->data;
+        if (rec->fd >= 0)
+            close (rec->fd);
+        g_free (rec->record);
+        g_free (rec);
+    }
+    g_list_free (peer_records);
+    peer_records = NULL;
+}
+
+static void
+handle_msg (CcnetSession *session, char *msg, evutil_socket_t *passfd,
+            int *n_resume)
+{
+    PeerRecord *rec;
+    int i;
+
+    if (strncmp (msg, "listener ", 9) == 0 && *passfd >= 0) {
+        for (i = 0; i < G_N_ELEMENTS(listeners); ++i)
+            if (strcmp (msg + 9, listener_names[i]) == 0 && listeners[i] < 0) {
+                listeners[i] = *passfd;
+                *passfd = -1;
+            }
+    } else if (strncmp (msg, "peer\n", 5) == 0 && *passfd >= 0) {
+        rec = g_new0 (PeerRecord, 1);
+        rec->record = g_strdup (msg + 5);
+        rec->fd = *passfd;
+        *passfd = -1;
+        peer_records = g_list_prepend (peer_records, rec);
+    } else if (strncmp (msg, "resume ", 7) == 0) {
+        if (apply_resume (session, msg + 7) == 0)
+            ++(*n_resume);
+    } else
+        ccnet_warning ("[Handover] Unknown message %.20s\n", msg);
+}
+
+int
+ccnet_handover_receive (CcnetSession *session)
+{
+    struct sockaddr_un addr;
+    evutil_socket_t fd, passfd;
+    char *path, *msg;
+    int n_resume = 0, done = 0;
+    char c;
+
+    path = g_build_filename (session->config_dir, HANDOVER_SOCKET, NULL);
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ccnet_warning ("[Handover] Socket path too long: %s\n", path);
+        g_free (path);
+        return -1;
+    }
+
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+    g_free (path);
+
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect (fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ccnet_warning ("[Handover] No process to take over from: %s\n",
+                       strerror(errno));
+        close (fd);
+        return -1;
+    }
+
+    set_timeout (fd, HANDOVER_TIMEOUT);
+    if (send_text (fd, "takeover", -1) < 0)
+        goto error;
+
+    while (!done && recv_msg (fd, &msg, &passfd) >= 0) {
+        if (strcmp (msg, "done") == 0)
+            done = 1;
+        else
+            handle_msg (session, msg, &passfd, &n_resume);
+        if (passfd >= 0)
+            close (passfd);
+        g_free (msg);
+    }
+    if (!done)
+        goto error;
+
+    /* By now the old process has saved its peers and removed its
+     * pidfile. */
+    while (read (fd, &c, 1) > 0)
+        ;
+    close (fd);
+
+    ccnet_message ("[Handover] Took over %d connections and %d resumable "
+                   "sessions\n", g_list_length (peer_records), n_resume);
+    return 0;
+
+error:
+    ccnet_warning ("[Handover] Takeover failed, starting afresh\n");
+    free_received ();
+    close (fd);
+    return -1;
+}
+
+evutil_socket_t
+ccnet_handover_get_listener (const char *name)
+{
+    evutil_socket_t fd;
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(listeners); ++i)
+        if (strcmp (name, listener_names[i]) == 0) {
+            fd = listeners[i];
+            listeners[i] = -1;
+            return fd;
+        }
+    return -1;
+}
+
+static void
+collect_kv (void *vkv, const char *key, char *value)
+{
+    g_hash_table_insert ((GHashTable *)vkv, (gpointer)key, value);
+}
+
+static int
+kv_int (GHashTable *kv, const char *key)
+{
+    const char *value = g_hash_table_lookup (kv, key);
+
+    return value ? atoi (value) : 0;
+}
+
+static int
+adopt_peer (CcnetSession *session, PeerRecord *rec)
+{
+    GHashTable *kv;
+    CcnetPeer *peer = NULL;
+    CcnetPacketIO *io;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char *pubinfo;
+    const char *id, *session_key, *master, *slave, *value;
+    int cipher, ret = -1;
+
+    /* The key value lines must end with "\n\0". */
+    pubinfo = strstr (rec->record, "\n\n");
+    if (!pubinfo)
+        return -1;
+    pubinfo[1] = '\0';
+    pubinfo += 2;
+
+    kv = g_hash_table_new (g_str_hash, g_str_equal);
+    parse_key_value_pairs (rec->record, collect_kv, kv);
+
+    id = g_hash_table_lookup (kv, "id");
+    session_key = g_hash_table_lookup (kv, "session-key");
+    master = g_hash_table_lookup (kv, "ka-master");
+    slave = g_hash_table_lookup (kv, "ka-slave");
+    if (!id || !peer_id_valid (id) || !session_key || !master)
+        goto out;
+
+    peer = ccnet_peer_manager_get_peer (session->peer_mgr, id);
+    if (!peer) {
+        peer = ccnet_peer_from_string (pubinfo);
+        if (!peer)
+            goto out;
+        if (strcmp (peer->id, id) != 0) {
+            g_object_unref (peer);
+            peer = NULL;
+            goto out;
+        }
+        ccnet_peer_manager_add_peer (session->peer_mgr, peer);
+    }
+    if (peer->net_state != PEER_DOWN) {
+        ccnet_warning ("[Handover] Peer %.8s is already connected\n", id);
+        goto out;
+    }
+
+    if (getpeername (rec->fd, (struct sockaddr *)&addr, &addrlen) < 0)
+        goto out;
+    if (kv_int (kv, "incoming"))
+        io = ccnet_packet_io_new_incoming (session, &addr, rec->fd);
+    else
+        io = ccnet_packet_io_new_connected (session, &addr, rec->fd);
+    rec->fd = -1;               /* closed with the io */
+    io->jumbo = kv_int (kv, "jumbo");
+    io->batch_enc = kv_int (kv, "batch");
+    io->trace = kv_int (kv, "trace");
+    io->compress = kv_int (kv, "compress");
+
+    if ((value = g_hash_table_lookup (kv, "addr")) != NULL)
+        ccnet_peer_update_address (peer, value, kv_int (kv, "port"));
+
+    ccnet_peer_set_io (peer, io);
+    ccnet_peer_set_net_state (peer, PEER_CONNECTED);
+    peer->last_up = peer->last_recv = time(NULL);
+    peer->session_key = g_strdup (session_key);
+
+    if ((value = g_hash_table_lookup (kv, "cipher")) != NULL) {
+        cipher = ccnet_cipher_from_string (value);
+        if (cipher < 0 ||
+            ccnet_peer_prepare_channel_encryption (
+                peer, cipher, kv_int (kv, "initiator")) < 0)
+            goto shutdown;
+        value = g_hash_table_lookup (kv, "send-seq");
+        peer->crypt->send_seq = value ? g_ascii_strtoull (value, NULL, 10) : 0;
+        value = g_hash_table_lookup (kv, "recv-seq");
+        peer->crypt->recv_seq = value ? g_ascii_strtoull (value, NULL, 10) : 0;
+    }
+
+    value = g_hash_table_lookup (kv, "roles");
+    ccnet_peer_set_roles (peer, value ? value : "");
+    peer->is_ready = kv_int (kv, "ready");
+    peer->reqID = MAX (peer->reqID, kv_int (kv, "req-id"));
+
+    if (ccnet_keepalive2_proc_adopt (
+            peer, strtoul (master, NULL, 10), kv_int (kv, "ka-count"),
+            slave ? strtoul (slave, NULL, 10) : 0) < 0)
+        goto shutdown;
+
+    ccnet_debug ("[Handover] Adopted peer %s(%.8s)\n", peer->name, peer->id);
+    ret = 0;
+    goto out;
+
+shutdown:
+    ccnet_warning ("[Handover] Failed to adopt peer %.8s\n", peer->id);
+    ccnet_peer_shutdown (peer);
+out:
+    if (peer)
+        g_object_unref (peer);
+    g_hash_table_destroy (kv);
+    return ret;
+}
+
+void
+ccnet_handover_adopt_peers (CcnetSession *session)
+{
+    GList *ptr;
+    int n_peers, n_adopted = 0;
+
+    if (!peer_records)
+        return;
+
+    n_peers = g_list_length (peer_records);
+    peer_records = g_list_reverse (peer_records);
+    for (ptr = peer_records; ptr; ptr = ptr->next)
+        if (adopt_peer (session, ptr->data) == 0)
+            ++n_adopted;
+    free_received ();
+
+    ccnet_message ("[Handover] Adopted %d of %d connections\n",
+                   n_adopted, n_peers);
+}
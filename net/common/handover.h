@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_HANDOVER_H
+#define CCNET_HANDOVER_H
+
+#include <event2/util.h>
+
+/*
+ * Restarting the server without dropping connections.
+ *
+ * With [Network] HANDOVER=true the server listens on
+ * <config_dir>/handover.sock. A new server started with --takeover
+ * connects to it, and the old one passes over its listening sockets
+ * and the connections of idle peers, together with their session keys,
+ * then exits. The peers which were busy reconnect and resume their
+ * sessions without RSA.
+ *
+ * Only processes of the same user may take over.
+ */
+
+struct CcnetSession;
+
+/* In the old process, called once the session has started. */
+int ccnet_handover_listen (struct CcnetSession *session);
+
+/* In the new process, before listening. Returns -1 if there is no old
+ * process to take over from, in which case the session starts as
+ * usual. */
+int ccnet_handover_receive (struct CcnetSession *session);
+
+/* A listening socket received from the old process, "peer", "local"
+ * or "unix", or -1. */
+evutil_socket_t ccnet_handover_get_listener (const char *name);
+
+/* In the new process, once the session has started. */
+void ccnet_handover_adopt_peers (struct CcnetSession *session);
+
+#endif
@@ -12,6 +12,9 @@
 #include "packet-io.h"
 #include "session.h"
 #include "handshake.h"
+#include "fast-setup.h"
+#include "compress.h"
+#include "tls.h"
 
 #define DEBUG_FLAG CCNET_DEBUG_CONNECTION
 #include "log.h"
@@ -36,31 +39,52 @@
              ---------------------------->
    DONE                                      DONE 
 
+   With CCNET_CAP_FAST_SETUP the id packets and the ack also carry an
+   offer, answer and proof that replace keepalive2's challenge and the
+   session key processors, see fast-setup.h.
+
+   With CCNET_CAP_TLS the slave starts TLS after sending its id, and the
+   master after reading it. The ack then goes over TLS, once the master
+   checked the slave's certificate, see tls.h.
+
  */
 
 enum {
     UNKNOWN = 0,
     INIT,
     ID_SENT,
-    ID_RECEIVED
+    ID_RECEIVED,
+    TLS_WAIT                    /* master, for the TLS handshake */
 };
 
 static void ccnet_handshake_done (CcnetHandshake *handshake, int isOK);
 
+/* @extra is the fast setup offer or answer, after our id. */
 static void
-send_handshake_message (CcnetHandshake *handshake)
+send_handshake_message (CcnetHandshake *handshake, GByteArray *extra)
 {
     const char *id = handshake->session->base.id;
-    char buf[256];
-    ccnet_packet *packet = (ccnet_packet *)buf;
+    ccnet_packet *packet;
+    int len = 40 + (extra ? extra->len : 0);
 
+    packet = g_malloc (CCNET_PACKET_LENGTH_HEADER + len);
     packet->header.version = 1;
     packet->header.type = CCNET_MSG_HANDSHAKE;
     memcpy (packet->data, id, 40);
-    packet->header.length = 40;
-    packet->header.id = 0;
+    if (extra)
+        memcpy (packet->data + 40, extra->data, extra->len);
+    packet->header.length = len;
+    /* Our capabilities. Old peers ignore the id of handshake packets. */
+    packet->header.id = CCNET_CAP_JUMBO_PACKET | CCNET_CAP_BATCH_ENCPACKET |
+        CCNET_CAP_TRACE;
+    if (handshake->session->fast_setup)
+        packet->header.id |= CCNET_CAP_FAST_SETUP;
+    packet->header.id |= ccnet_compress_caps ();
+    if (handshake->session->tls_ctx)
+        packet->header.id |= CCNET_CAP_TLS;
     
     ccnet_packet_io_write_packet (handshake->io, packet);
+    g_free (packet);
 
     if (handshake->peer)
         ccnet_debug ("[Conn] Outgoing: Send my id to %s(%.10s)\n",
@@ -73,40 +97,125 @@ send_handshake_message (CcnetHandshake *handshake)
 static void
 send_ack (CcnetHandshake *handshake)
 {
-    ccnet_packet packet;
-    packet.header.version = 1;
-    packet.header.type = CCNET_MSG_OK;
-    packet.header.length = 0;
-    packet.header.id = 0;
+    char buf[CCNET_PACKET_LENGTH_HEADER + CCNET_RESUME_SECRET_LEN];
+    ccnet_packet *packet = (ccnet_packet *)buf;
+
+    packet->header.version = 1;
+    packet->header.type = CCNET_MSG_OK;
+    packet->header.length = 0;
+    packet->header.id = 0;
+    if (handshake->fast_done) {
+        ccnet_fast_setup_ack_mac (handshake, (unsigned char *)packet->data);
+        packet->header.length = CCNET_RESUME_SECRET_LEN;
+    }
     
-    ccnet_packet_io_write_packet (handshake->io, &packet);
+    ccnet_packet_io_write_packet (handshake->io, packet);
 
     ccnet_debug ("[Conn] Outgoing: Send ack to %s(%.10s)\n", 
                  handshake->peer->name, handshake->peer->id);
 }
 
+/* The certificate's key must be the one of the claimed id. */
+static int
+check_tls_peer (CcnetHandshake *handshake)
+{
+    char *id = ccnet_tls_peer_id (handshake->io);
+    int ret = 0;
+
+    if (!id || strcmp (id, handshake->id) != 0) {
+        ccnet_warning ("[Conn] TLS certificate doesn't match peer %.10s\n",
+                       handshake->id);
+        ret = -1;
+    }
+    g_free (id);
+    return ret;
+}
+
+static void
+tls_ready (CcnetPacketIO *io, void *arg)
+{
+    CcnetHandshake *handshake = arg;
+
+    if (check_tls_peer (handshake) < 0) {
+        ccnet_handshake_done (handshake, FALSE);
+        return;
+    }
+    send_ack (handshake);
+    ccnet_handshake_done (handshake, TRUE);
+}
+
 static void
 read_peer_id (CcnetHandshake *handshake, ccnet_packet *packet)
 {
     uint16_t len;
     char *id;
-
-    /* get id */
+    gboolean fast = (packet->header.id & CCNET_CAP_FAST_SETUP) != 0;
+    gboolean tls = handshake->session->tls_ctx &&
+        (packet->header.id & CCNET_CAP_TLS);
+    const unsigned char *extra = NULL;
+    int extra_len = 0;
+    GByteArray *answer;
+
+    /* get id, followed by the fast setup data of new peers */
     len = packet->header.length;
+    if (fast && len > 40) {
+        extra = (unsigned char *)packet->data + 40;
+        extra_len = len - 40;
+        len = 40;
+    }
     id = g_malloc (len + 1);
     memcpy (id, packet->data, len);
     id[len] = '\0';
     handshake->id = id;
 
+    handshake->io->jumbo = (packet->header.id & CCNET_CAP_JUMBO_PACKET) != 0;
+    handshake->io->batch_enc =
+        (packet->header.id & CCNET_CAP_BATCH_ENCPACKET) != 0;
+    handshake->io->trace = (packet->header.id & CCNET_CAP_TRACE) != 0;
+    handshake->io->compress =
+        ccnet_compress_choose (handshake->session->compress_algo,
+                               packet->header.id);
+
     if (handshake->state == INIT) {
         /* we are the slave */
         ccnet_debug ("[Conn] Incoming: Read peer id %.8s\n", id);
-        send_handshake_message (handshake);
+        answer = g_byte_array_new ();
+        if (extra)
+            ccnet_fast_setup_answer (handshake, extra, extra_len, answer);
+        send_handshake_message (handshake, answer);
+        g_byte_array_free (answer, TRUE);
         handshake->state = ID_RECEIVED;
+        if (tls && ccnet_packet_io_start_tls (handshake->io, TRUE, NULL) < 0) {
+            ccnet_warning ("[Conn] Failed to start TLS with %.10s\n", id);
+            ccnet_handshake_done (handshake, FALSE);
+        }
     } else if (handshake->state == ID_SENT) {
         /* we are the master */
         ccnet_debug ("[Conn] Outgoing: Read peer %s id %.8s\n",
                      handshake->peer->name, id);
+        handshake->peer->fast_setup = fast;
+        if (handshake->fast_mode && !fast) {
+            /* Downgraded, it took our offer for a part of the id. */
+            ccnet_message ("[Conn] Peer %s(%.10s) lost fast setup, "
+                           "reconnecting\n",
+                           handshake->peer->name, handshake->peer->id);
+            ccnet_handshake_done (handshake, FALSE);
+            return;
+        }
+        if (extra && ccnet_fast_setup_check (handshake, extra, extra_len) < 0) {
+            ccnet_handshake_done (handshake, FALSE);
+            return;
+        }
+        if (tls) {
+            if (ccnet_packet_io_start_tls (handshake->io, FALSE,
+                                           tls_ready) < 0) {
+                ccnet_warning ("[Conn] Failed to start TLS with %.10s\n", id);
+                ccnet_handshake_done (handshake, FALSE);
+                return;
+            }
+            handshake->state = TLS_WAIT;
+            return;
+        }
         send_ack (handshake);
         ccnet_handshake_done (handshake, TRUE);
     } else
@@ -120,6 +229,14 @@ read_ok (CcnetHandshake *handshake, ccnet_packet *packet)
     if (packet->header.type != CCNET_MSG_OK) {
         ccnet_warning ("[Conn] Read wrong ack format\n");
         ccnet_handshake_done (handshake, FALSE);
+    } else if (handshake->io->tls && check_tls_peer (handshake) < 0) {
+        ccnet_handshake_done (handshake, FALSE);
+    } else if (handshake->fast_done &&
+               ccnet_fast_setup_check_ack (handshake,
+                                           (unsigned char *)packet->data,
+                                           packet->header.length) < 0) {
+        ccnet_warning ("[Conn] Bad setup ack from %.10s\n", handshake->id);
+        ccnet_handshake_done (handshake, FALSE);
     } else  {
         ccnet_debug ("[Conn] Incoming: Read ack (%.10s)\n", handshake->id);
         ccnet_handshake_done (handshake, TRUE);
@@ -129,12 +246,30 @@ read_ok (CcnetHandshake *handshake, ccnet_packet *packet)
 }
 
 
+static void
+read_busy (CcnetHandshake *handshake, ccnet_packet *packet)
+{
+    handshake->retry_after = CLAMP (packet->header.id, 1, 3600);
+    if (packet->header.length > 0)
+        handshake->redirect = g_strndup (packet->data, packet->header.length);
+
+    ccnet_debug ("[Conn] Outgoing: %s(%.10s) is busy, retry after %d s\n",
+                 handshake->peer->name, handshake->peer->id,
+                 handshake->retry_after);
+    ccnet_handshake_done (handshake, FALSE);
+}
+
 static void
 canRead (ccnet_packet *packet, void *arg)
 {
     CcnetHandshake *handshake = (CcnetHandshake *)arg;
     ccnet_debug("current state is %d\n", handshake->state);
 
+    if (packet->header.type == CCNET_MSG_BUSY && handshake->state == ID_SENT) {
+        read_busy (handshake, packet);
+        return;
+    }
+
     switch (handshake->state) {
     case INIT:
         read_peer_id (handshake, packet);
@@ -145,6 +280,10 @@ canRead (ccnet_packet *packet, void *arg)
     case ID_RECEIVED:
         read_ok (handshake, packet);
         break;
+    case TLS_WAIT:
+        ccnet_warning ("[Conn] Unexpected packet before TLS is up\n");
+        ccnet_handshake_done (handshake, FALSE);
+        break;
     default: g_assert(0) ;
     }
 }
@@ -170,10 +309,12 @@ ccnet_handshake_done (CcnetHandshake *handshake, int isOK)
     ccnet_debug ("[Conn] HandshakeDone %s\n", isOK ? "connected" : "aborting");
 
     ccnet_packet_io_set_iofuncs (handshake->io, NULL, NULL, NULL, NULL);
+    handshake->io->tlsReady = NULL;
     fire_done_func (handshake, isOK);
     if (handshake->peer)
         g_object_unref (handshake->peer);
     g_free (handshake->id);
+    g_free (handshake->redirect);
     g_free (handshake);
 }
 
@@ -225,7 +366,11 @@ ccnet_handshake_new (CcnetSession     *session,
     if (ccnet_packet_io_is_incoming (handshake->io))
         handshake->state = INIT;
     else {
-        send_handshake_message (handshake);
+        GByteArray *offer = g_byte_array_new ();
+
+        ccnet_fast_setup_offer (handshake, offer);
+        send_handshake_message (handshake, offer);
+        g_byte_array_free (offer, TRUE);
         handshake->state = ID_SENT;
     }
 
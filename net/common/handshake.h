@@ -26,6 +26,19 @@ struct CcnetHandshake
 
     handshakeDoneCB doneCB;
     void   *doneUserData;
+
+    /* set when the server answered CCNET_MSG_BUSY */
+    int     retry_after;
+    char   *redirect;           /* "addr:port" or NULL */
+
+    /* The one round trip setup, see fast-setup.h. fast_mode is set
+     * once offered or answered, fast_done once the key is agreed. */
+    char    fast_mode;
+    int     fast_done;
+    int     fast_cipher;        /* -1 for a plain channel */
+    unsigned char nonce_a[20];
+    unsigned char nonce_b[20];
+    char    fast_key[41];
 };
 
 CcnetHandshake* ccnet_handshake_new (CcnetSession *session,
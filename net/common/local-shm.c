@@ -0,0 +1,394 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <event.h>
+#include <errno.h>
+#include <string.h>
+
+#ifdef HAVE_MEMFD_CREATE
+#include <event2/bufferevent.h>
+#include <sys/socket.h>
+#endif
+
+#include "session.h"
+#include "packet-io.h"
+#include "timer.h"
+#include "shm-ring.h"
+#include "local-shm.h"
+
+#include "log.h"
+
+#ifdef HAVE_MEMFD_CREATE
+
+/* Copied out of the receive ring per call. */
+#define RX_CHUNK        (64 * 1024)
+
+/* Reading the ring pauses when this much waits for the CcnetPacketIO,
+ * and the client blocks once the ring is full. */
+#define RX_PAUSE_LEN    (1024 * 1024)
+
+/* At most this much is moved over from the CcnetPacketIO at a time. */
+#define TX_MAX          (256 * 1024)
+
+struct CcnetShmConn {
+    CcnetShm           *shm;
+    struct bufferevent *sock_bev;       /* only to see the client go */
+    struct bufferevent *bev;            /* our end of the pair */
+    struct evbuffer    *rx_buf;
+    struct evbuffer_cb_entry *in_cb;
+
+    struct event        rx_event;       /* data in the receive ring */
+    struct event        tx_event;       /* space in the send ring */
+    CcnetTimer         *refill_timer;
+
+    int                 holds;
+    unsigned int        rx_paused : 1;
+    unsigned int        tx_waiting : 1;
+    unsigned int        in_tx : 1;
+    unsigned int        tx_again : 1;
+    unsigned int        closing : 1;
+};
+
+static void
+conn_free (CcnetShmConn *conn)
+{
+    ccnet_timer_free (&conn->refill_timer);
+    event_del (&conn->rx_event);
+    event_del (&conn->tx_event);
+    bufferevent_free (conn->sock_bev);
+    bufferevent_free (conn->bev);
+    evbuffer_free (conn->rx_buf);
+    ccnet_shm_free (conn->shm);
+    g_free (conn);
+}
+
+/* Keeps @conn while calling out, the callbacks may close it. */
+static void
+conn_hold (CcnetShmConn *conn)
+{
+    conn->holds++;
+}
+
+static void
+conn_release (CcnetShmConn *conn)
+{
+    if (--conn->holds == 0 && conn->closing)
+        conn_free (conn);
+}
+
+static void
+report_event (CcnetShmConn *conn, short what)
+{
+    struct bufferevent *partner = bufferevent_pair_get_partner (conn->bev);
+
+    if (partner)
+        bufferevent_trigger_event (partner, what, 0);
+}
+
+/* Move the receive ring over to the CcnetPacketIO. */
+static void
+pump_rx (CcnetShmConn *conn)
+{
+    struct evbuffer *output = bufferevent_get_output (conn->bev);
+    struct evbuffer_iovec vec;
+    int n;
+
+    if (conn->closing)
+        return;
+
+    /* Cleared first, so a write after the last read signals again. */
+    ccnet_shm_clear (conn->shm->rx_data);
+    conn->rx_paused = 0;
+    for (;;) {
+        if (evbuffer_get_length (output) +
+            evbuffer_get_length (conn->rx_buf) >= RX_PAUSE_LEN) {
+            /* The client isn't signalled again while the ring holds
+             * data, the refill picks it up. */
+            conn->rx_paused = 1;
+            break;
+        }
+        if (evbuffer_reserve_space (conn->rx_buf, RX_CHUNK, &vec, 1) < 1)
+            break;
+        n = ccnet_shm_read (conn->shm, vec.iov_base, vec.iov_len);
+        vec.iov_len = n;
+        evbuffer_commit_space (conn->rx_buf, &vec, 1);
+        if (n == 0)
+            break;
+    }
+
+    if (evbuffer_get_length (conn->rx_buf) > 0) {
+        conn_hold (conn);
+        bufferevent_write_buffer (conn->bev, conn->rx_buf);
+        conn_release (conn);
+    }
+}
+
+/* Copy what the CcnetPacketIO wrote into the send ring. */
+static void
+pump_tx (CcnetShmConn *conn)
+{
+    struct evbuffer *input = bufferevent_get_input (conn->bev);
+    struct evbuffer_iovec vec;
+    int n;
+
+    if (conn->closing)
+        return;
+
+    /* Pulling more over below calls back in here. */
+    if (conn->in_tx) {
+        conn->tx_again = 1;
+        return;
+    }
+
+    conn_hold (conn);
+    conn->in_tx = 1;
+    do {
+        conn->tx_again = 0;
+        while (!conn->tx_waiting &&
+               evbuffer_peek (input, -1, NULL, &vec, 1) > 0) {
+            n = ccnet_shm_write (conn->shm, vec.iov_base, vec.iov_len);
+            if (n <= 0) {
+                conn->tx_waiting = 1;
+                event_add (&conn->tx_event, NULL);
+                break;
+            }
+            evbuffer_drain (input, n);
+        }
+        if (!conn->tx_waiting && !conn->closing)
+            bufferevent_enable (conn->bev, EV_READ);
+    } while (conn->tx_again && !conn->tx_waiting && !conn->closing);
+    conn->in_tx = 0;
+    conn_release (conn);
+}
+
+static void
+on_rx_data (int fd, short event, void *vconn)
+{
+    pump_rx (vconn);
+}
+
+static void
+on_tx_space (int fd, short event, void *vconn)
+{
+    CcnetShmConn *conn = vconn;
+
+    ccnet_shm_clear (conn->shm->tx_space);
+    conn->tx_waiting = 0;
+    pump_tx (conn);
+}
+
+/* The end of the loop iteration after the CcnetPacketIO took data:
+ * move more over, and read the ring again if it was paused. */
+static int
+refill (void *vconn)
+{
+    CcnetShmConn *conn = vconn;
+    struct bufferevent *partner;
+
+    conn->refill_timer = NULL;
+    conn_hold (conn);
+    partner = bufferevent_pair_get_partner (conn->bev);
+    if (partner && (bufferevent_get_enabled (partner) & EV_READ))
+        bufferevent_enable (partner, EV_READ);
+    if (conn->rx_paused)
+        pump_rx (conn);
+    conn_release (conn);
+    return FALSE;
+}
+
+static void
+schedule_refill (CcnetShmConn *conn)
+{
+    if (!conn->refill_timer && !conn->closing)
+        conn->refill_timer = ccnet_timer_new (refill, conn, 0);
+}
+
+/* The CcnetPacketIO wrote to its end. */
+static void
+conn_readcb (struct bufferevent *bev, void *vconn)
+{
+    pump_tx (vconn);
+}
+
+/* The CcnetPacketIO took enough to resume reading the ring. */
+static void
+conn_writecb (struct bufferevent *bev, void *vconn)
+{
+    CcnetShmConn *conn = vconn;
+
+    if (conn->rx_paused)
+        schedule_refill (conn);
+}
+
+/* Like a socket bufferevent reading again below its high watermark,
+ * the pair has to be told to move more over. */
+static void
+on_input_drained (struct evbuffer *buf, const struct evbuffer_cb_info *info,
+                  void *vconn)
+{
+    CcnetShmConn *conn = vconn;
+
+    if (info->n_deleted == 0 ||
+        evbuffer_get_length (bufferevent_get_output (conn->bev)) == 0)
+        return;
+    schedule_refill (conn);
+}
+
+/* The client sends nothing on the socket any more. */
+static void
+sock_readcb (struct bufferevent *bev, void *vconn)
+{
+    CcnetShmConn *conn = vconn;
+    struct evbuffer *input = bufferevent_get_input (bev);
+
+    ccnet_warning ("Local client wrote to the socket after switching to "
+                   "shared memory\n");
+    evbuffer_drain (input, evbuffer_get_length (input));
+    report_event (conn, BEV_EVENT_READING | BEV_EVENT_ERROR);
+}
+
+static void
+sock_eventcb (struct bufferevent *bev, short what, void *vconn)
+{
+    CcnetShmConn *conn = vconn;
+
+    /* What the client wrote before closing is handled first. */
+    conn_hold (conn);
+    pump_rx (conn);
+    if (!conn->closing)
+        report_event (conn, what);
+    conn_release (conn);
+}
+
+CcnetShmConn *
+ccnet_shm_conn_new (CcnetShm *shm, struct bufferevent *sock_bev,
+                    struct bufferevent **bev)
+{
+    struct bufferevent *pair[2];
+    CcnetShmConn *conn;
+
+    if (bufferevent_pair_new (NULL, 0, pair) < 0)
+        return NULL;
+
+    conn = g_new0 (CcnetShmConn, 1);
+    conn->shm = shm;
+    conn->sock_bev = sock_bev;
+    conn->bev = pair[1];
+    conn->rx_buf = evbuffer_new ();
+
+    bufferevent_setcb (sock_bev, sock_readcb, NULL, sock_eventcb, conn);
+    bufferevent_setwatermark (sock_bev, EV_READ, 0, 0);
+    bufferevent_disable (sock_bev, EV_WRITE);
+    bufferevent_enable (sock_bev, EV_READ);
+    bufferevent_settimeout (sock_bev, 0, 0);
+
+    bufferevent_setcb (pair[1], conn_readcb, conn_writecb, NULL, conn);
+    bufferevent_setwatermark (pair[1], EV_READ, 0, TX_MAX);
+    bufferevent_setwatermark (pair[1], EV_WRITE, RX_PAUSE_LEN / 2, 0);
+    bufferevent_enable (pair[1], EV_READ | EV_WRITE);
+    conn->in_cb = evbuffer_add_cb (bufferevent_get_input (pair[0]),
+                                   on_input_drained, conn);
+
+    event_set (&conn->rx_event, shm->rx_data, EV_READ | EV_PERSIST,
+               on_rx_data, conn);
+    event_set (&conn->tx_event, shm->tx_space, EV_READ, on_tx_space, conn);
+    event_add (&conn->rx_event, NULL);
+
+    *bev = pair[0];
+    return conn;
+}
+
+void
+ccnet_shm_conn_close (CcnetShmConn *conn)
+{
+    struct bufferevent *partner = bufferevent_pair_get_partner (conn->bev);
+
+    if (partner)
+        evbuffer_remove_cb_entry (bufferevent_get_input (partner),
+                                  conn->in_cb);
+    conn->closing = 1;
+    if (conn->holds == 0)
+        conn_free (conn);
+}
+
+static int
+is_unix_socket (evutil_socket_t fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname (fd, (struct sockaddr *)&addr, &len) < 0)
+        return 0;
+    return addr.ss_family == AF_UNIX;
+}
+
+void
+ccnet_local_shm_accept (CcnetPacketIO *io, guint32 caps)
+{
+    ccnet_header header;
+    CcnetShm *shm = NULL;
+
+    if (!(caps & CCNET_CAP_SHM_RING))
+        return;
+
+    /* The answer has to be the next thing on the socket, and the client
+     * waits for it before sending more. */
+    if (io->session->shm_transport && io->handling && !io->uring &&
+        !io->shm && !io->shm_pending && is_unix_socket (io->socket) &&
+        evbuffer_get_length (bufferevent_get_output (io->bufev)) == 0 &&
+        evbuffer_get_length (bufferevent_get_input (io->bufev))
+        == CCNET_PACKET_LENGTH_HEADER)
+        shm = ccnet_shm_create ();
+
+    header.version = 1;
+    header.type = CCNET_MSG_HANDSHAKE;
+    header.length = 0;
+    header.id = htonl (shm ? CCNET_CAP_SHM_RING : 0);
+
+    /* A refusal goes after what is queued for the client. */
+    if (!shm) {
+        bufferevent_write (io->bufev, &header, sizeof(header));
+        return;
+    }
+
+    if (ccnet_shm_send_fds (io->socket, &header, sizeof(header), shm) < 0) {
+        ccnet_warning ("Failed to answer local client: %s\n",
+                       strerror(errno));
+        ccnet_shm_free (shm);
+        return;
+    }
+    ccnet_packet_io_switch_to_shm (io, shm);
+}
+
+#else
+
+void
+ccnet_local_shm_accept (struct CcnetPacketIO *io, guint32 caps)
+{
+    ccnet_header header;
+
+    if (!(caps & CCNET_CAP_SHM_RING))
+        return;
+
+    /* The client waits for an answer, send it a refusal. */
+    header.version = 1;
+    header.type = CCNET_MSG_HANDSHAKE;
+    header.length = 0;
+    header.id = 0;
+    bufferevent_write (io->bufev, &header, sizeof(header));
+}
+
+CcnetShmConn *
+ccnet_shm_conn_new (struct CcnetShm *shm, struct bufferevent *sock_bev,
+                    struct bufferevent **bev)
+{
+    return NULL;
+}
+
+void
+ccnet_shm_conn_close (CcnetShmConn *conn)
+{
+}
+
+#endif  /* HAVE_MEMFD_CREATE */
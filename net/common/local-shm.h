@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_LOCAL_SHM_H
+#define CCNET_LOCAL_SHM_H
+
+#include <glib.h>
+
+/*
+ * The daemon side of the shared memory transport for local clients, see
+ * lib/shm-ring.h.
+ *
+ * Like the io_uring backend, the CcnetPacketIO gets one end of a
+ * bufferevent pair once the client is switched over. The other end is
+ * copied to and from the rings when their eventfds fire. The socket
+ * bufferevent is kept to notice the client going away.
+ */
+
+struct bufferevent;
+struct CcnetShm;
+struct CcnetPacketIO;
+
+typedef struct CcnetShmConn CcnetShmConn;
+
+/* Answer a local client's handshake with @caps. If it asked for the
+ * rings and [Client] SHM_TRANSPORT is set, the switch is made after the
+ * handshake packet. */
+void ccnet_local_shm_accept (struct CcnetPacketIO *io, guint32 caps);
+
+/* Take over @sock_bev and return the end of the pair for the
+ * CcnetPacketIO in @bev. */
+CcnetShmConn *ccnet_shm_conn_new (struct CcnetShm *shm,
+                                  struct bufferevent *sock_bev,
+                                  struct bufferevent **bev);
+
+/* Free the rings and close the socket, call it before freeing the
+ * bufferevent. */
+void ccnet_shm_conn_close (CcnetShmConn *conn);
+
+#endif
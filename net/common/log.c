@@ -3,11 +3,14 @@
 #include "common.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <glib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "log.h"
 #include "utils.h"
+#include "cpu-set.h"
 
 #include "session.h"
 
@@ -16,10 +19,276 @@
 
 extern CcnetSession  *session;
 
-/* message with greater log levels will be ignored */
-static int ccnet_log_level;
+/* message with greater log levels will be ignored; the most verbose
+ * of the module levels */
+static volatile gint ccnet_log_level;
 static FILE *logfp;
 
+/* Everything passes until ccnet_log_init(), as before it. */
+volatile gint ccnet_log_levels[CCNET_LOG_N_MODULES] = {
+    G_LOG_LEVEL_DEBUG, G_LOG_LEVEL_DEBUG, G_LOG_LEVEL_DEBUG, G_LOG_LEVEL_DEBUG,
+    G_LOG_LEVEL_DEBUG, G_LOG_LEVEL_DEBUG, G_LOG_LEVEL_DEBUG, G_LOG_LEVEL_DEBUG,
+};
+
+/* The level set for a module, 0 to follow the global one, which is at
+ * index 0. Only written by the main thread. */
+static int module_levels[CCNET_LOG_N_MODULES];
+
+/*
+ * Asynchronous mode.
+ *
+ * Callers copy the message into a bounded ring (Vyukov's MPMC queue, only
+ * ever drained by one thread) and return. The writer thread formats the
+ * timestamps, folds runs of an identical message into one "last message
+ * repeated" line and flushes the stream when enough data is buffered or
+ * once per second. When the ring is full the message is counted and
+ * dropped rather than blocking the caller.
+ */
+
+#define LOG_RING_SIZE     2048          /* power of 2 */
+#define LOG_RING_MASK     (LOG_RING_SIZE - 1)
+#define LOG_RECORD_LEN    1024
+#define LOG_FLUSH_BYTES   (64 * 1024)
+#define LOG_IDLE_USEC     20000
+
+typedef struct LogRecord {
+    volatile gint seq;
+    time_t        time;
+    int           len;
+    char          text[LOG_RECORD_LEN];
+} LogRecord;
+
+static LogRecord *log_ring;
+static volatile gint log_enqueue_pos;
+static gint log_dequeue_pos;            /* writer thread only */
+static volatile gint log_dropped;
+static volatile gint log_async;
+static volatile gint log_stopping;
+static pthread_t log_writer;
+
+/* Only touched by the thread which writes to logfp. */
+static time_t ts_time = -1;
+static char ts_buf[64];
+static int ts_len;
+
+static const char *
+cached_timestamp (time_t t)
+{
+    struct tm tm;
+
+    if (t != ts_time) {
+        localtime_r (&t, &tm);
+        ts_len = strftime (ts_buf, sizeof(ts_buf), "[%x %X] ", &tm);
+        ts_time = t;
+    }
+    return ts_buf;
+}
+
+static gboolean
+log_ring_push (const char *message, time_t t)
+{
+    LogRecord *rec;
+    gint pos, seq, diff;
+    int len;
+
+    pos = g_atomic_int_get (&log_enqueue_pos);
+    while (1) {
+        rec = &log_ring[pos & LOG_RING_MASK];
+        seq = g_atomic_int_get (&rec->seq);
+        diff = (gint)((guint)seq - (guint)pos);
+        if (diff == 0) {
+            if (g_atomic_int_compare_and_exchange (&log_enqueue_pos,
+                                                   pos, pos + 1))
+                break;
+            pos = g_atomic_int_get (&log_enqueue_pos);
+        } else if (diff < 0) {
+            return FALSE;       /* full */
+        } else
+            pos = g_atomic_int_get (&log_enqueue_pos);
+    }
+
+    len = strlen (message);
+    if (len >= LOG_RECORD_LEN) {
+        /* keep the newline so that lines don't run together */
+        len = LOG_RECORD_LEN - 1;
+        memcpy (rec->text, message, len - 1);
+        rec->text[len - 1] = '\n';
+    } else
+        memcpy (rec->text, message, len);
+    rec->text[len] = '\0';
+    rec->len = len;
+    rec->time = t;
+
+    g_atomic_int_set (&rec->seq, pos + 1);
+    return TRUE;
+}
+
+static LogRecord *
+log_ring_peek (void)
+{
+    LogRecord *rec = &log_ring[log_dequeue_pos & LOG_RING_MASK];
+
+    if (g_atomic_int_get (&rec->seq) != log_dequeue_pos + 1)
+        return NULL;
+    return rec;
+}
+
+static void
+log_ring_pop (LogRecord *rec)
+{
+    g_atomic_int_set (&rec->seq, log_dequeue_pos + LOG_RING_SIZE);
+    ++log_dequeue_pos;
+}
+
+typedef struct WriterState {
+    char    last[LOG_RECORD_LEN];
+    int     last_len;
+    time_t  last_time;
+    int     repeats;
+    size_t  unflushed;
+    time_t  last_flush;
+} WriterState;
+
+static void
+write_line (WriterState *ws, time_t t, const char *text, int len)
+{
+    fputs (cached_timestamp (t), logfp);
+    fwrite (text, 1, len, logfp);
+    ws->unflushed += ts_len + len;
+}
+
+static void
+write_repeats (WriterState *ws, time_t t)
+{
+    char buf[64];
+    int n;
+
+    if (ws->repeats == 0)
+        return;
+    n = snprintf (buf, sizeof(buf), "last message repeated %d times\n",
+                  ws->repeats);
+    write_line (ws, t, buf, n);
+    ws->repeats = 0;
+}
+
+static void
+write_record (WriterState *ws, LogRecord *rec)
+{
+    /* Identical messages within a second of the first one are only
+     * counted. */
+    if (rec->len == ws->last_len && rec->time - ws->last_time <= 1 &&
+        memcmp (rec->text, ws->last, rec->len) == 0) {
+        ++ws->repeats;
+        return;
+    }
+
+    write_repeats (ws, rec->time);
+    write_line (ws, rec->time, rec->text, rec->len);
+    memcpy (ws->last, rec->text, rec->len);
+    ws->last_len = rec->len;
+    ws->last_time = rec->time;
+}
+
+static void
+writer_flush (WriterState *ws, time_t now)
+{
+    char buf[64];
+    int n, dropped;
+
+    dropped = g_atomic_int_get (&log_dropped);
+    if (dropped > 0) {
+        g_atomic_int_add (&log_dropped, -dropped);
+        n = snprintf (buf, sizeof(buf), "%d log messages dropped\n", dropped);
+        write_line (ws, now, buf, n);
+    }
+
+    if (ws->unflushed > 0)
+        fflush (logfp);
+    ws->unflushed = 0;
+    ws->last_flush = now;
+}
+
+static void *
+log_writer_thread (void *vdata)
+{
+    WriterState ws;
+    LogRecord *rec;
+    time_t now;
+
+    memset (&ws, 0, sizeof(ws));
+    ws.last_len = -1;
+
+    while (1) {
+        while ((rec = log_ring_peek ()) != NULL) {
+            now = rec->time;
+            write_record (&ws, rec);
+            log_ring_pop (rec);
+            if (ws.unflushed >= LOG_FLUSH_BYTES)
+                writer_flush (&ws, now);
+        }
+
+        now = time(NULL);
+        if (ws.repeats > 0 && now - ws.last_time > 1) {
+            write_repeats (&ws, now);
+            ws.last_len = -1;
+        }
+        if (now != ws.last_flush || g_atomic_int_get (&log_stopping))
+            writer_flush (&ws, now);
+
+        if (g_atomic_int_get (&log_stopping) && !log_ring_peek ())
+            break;
+        g_usleep (LOG_IDLE_USEC);
+    }
+
+    write_repeats (&ws, time(NULL));
+    fflush (logfp);
+    return NULL;
+}
+
+void
+ccnet_log_pin_writer (const CcnetCpuSet *cpus)
+{
+    if (g_atomic_int_get (&log_async))
+        ccnet_cpu_set_pin (log_writer, cpus, -1);
+}
+
+static void
+ccnet_log_stop_async (void)
+{
+    if (!g_atomic_int_get (&log_async))
+        return;
+    g_atomic_int_set (&log_stopping, 1);
+    pthread_join (log_writer, NULL);
+    g_atomic_int_set (&log_async, 0);
+}
+
+int
+ccnet_log_start_async (void)
+{
+    int i;
+
+    if (g_atomic_int_get (&log_async) || !logfp)
+        return 0;
+
+    if (!log_ring) {
+        log_ring = g_new0 (LogRecord, LOG_RING_SIZE);
+        for (i = 0; i < LOG_RING_SIZE; ++i)
+            log_ring[i].seq = i;
+    }
+
+    /* the writer thread is the only one touching the stream from now on */
+    fflush (logfp);
+    ts_time = -1;
+    if (pthread_create (&log_writer, NULL, log_writer_thread, NULL) != 0) {
+        g_warning ("Failed to start log writer thread.\n");
+        return -1;
+    }
+    g_atomic_int_set (&log_async, 1);
+    atexit (ccnet_log_stop_async);
+
+    return 0;
+}
+
 static void 
 ccnet_log (const gchar *log_domain, GLogLevelFlags log_level,
            const gchar *message,    gpointer user_data)
@@ -30,10 +299,20 @@ ccnet_log (const gchar *log_domain, GLogLevelFlags log_level,
     /* CcnetMessage *ccnet_message; */
     int len;
 
-    if (log_level > ccnet_log_level)
+    if (log_level > g_atomic_int_get (&ccnet_log_level))
         return;
 
     t = time(NULL);
+
+    /* Fatal messages are followed by an abort, the writer thread would
+     * never get to them. */
+    if (g_atomic_int_get (&log_async) &&
+        !(log_level & (G_LOG_FLAG_FATAL | G_LOG_LEVEL_ERROR))) {
+        if (!log_ring_push (message, t))
+            g_atomic_int_inc (&log_dropped);
+        return;
+    }
+
     tm = localtime(&t);
     len = strftime (buf, 256, "[%x %X] ", tm);
     fputs (buf, logfp);
@@ -64,11 +343,39 @@ get_debug_level(const char *str, int default_level)
         return G_LOG_LEVEL_DEBUG;
     if (strcmp(str, "info") == 0)
         return G_LOG_LEVEL_INFO;
+    if (strcmp(str, "message") == 0)
+        return G_LOG_LEVEL_MESSAGE;
     if (strcmp(str, "warning") == 0)
         return G_LOG_LEVEL_WARNING;
     return default_level;
 }
 
+static const char *
+level_name (int level)
+{
+    switch (level) {
+    case G_LOG_LEVEL_DEBUG:     return "debug";
+    case G_LOG_LEVEL_INFO:      return "info";
+    case G_LOG_LEVEL_MESSAGE:   return "message";
+    default:                    return "warning";
+    }
+}
+
+static void
+update_levels (void)
+{
+    int i, level, max = module_levels[0];
+
+    g_atomic_int_set (&ccnet_log_levels[0], module_levels[0]);
+    for (i = 1; i < CCNET_LOG_N_MODULES; ++i) {
+        level = module_levels[i] ? module_levels[i] : module_levels[0];
+        g_atomic_int_set (&ccnet_log_levels[i], level);
+        if (level > max)
+            max = level;
+    }
+    g_atomic_int_set (&ccnet_log_level, max);
+}
+
 int
 ccnet_log_init (const char *logfile, const char *debug_level_str)
 {
@@ -79,7 +386,8 @@ ccnet_log_init (const char *logfile, const char *debug_level_str)
     g_log_set_handler ("Ccnet", G_LOG_LEVEL_WARNING, ccnet_log, NULL);
 
     /* record all log message */
-    ccnet_log_level = get_debug_level(debug_level_str, G_LOG_LEVEL_INFO);
+    module_levels[0] = get_debug_level(debug_level_str, G_LOG_LEVEL_INFO);
+    update_levels ();
 
     if (strcmp(logfile, "-") == 0)
         logfp = stdout;
@@ -95,7 +403,7 @@ ccnet_log_init (const char *logfile, const char *debug_level_str)
     return 0;
 }
 
-static CcnetDebugFlags debug_flags = 0;
+volatile gint ccnet_debug_flags = 0;
 
 static GDebugKey debug_keys[] = {
   { "Peer", CCNET_DEBUG_PEER },
@@ -109,14 +417,15 @@ static GDebugKey debug_keys[] = {
 gboolean
 ccnet_debug_flag_is_set (CcnetDebugFlags flag)
 {
-    return (debug_flags & flag) != 0;
+    return (g_atomic_int_get (&ccnet_debug_flags) & flag) != 0;
 }
 
 void
 ccnet_debug_set_flags (CcnetDebugFlags flags)
 {
     ccnet_message ("Set debug flags %#x\n", flags);
-    debug_flags |= flags;
+    g_atomic_int_set (&ccnet_debug_flags,
+                      g_atomic_int_get (&ccnet_debug_flags) | flags);
 }
 
 void
@@ -132,10 +441,53 @@ ccnet_debug_set_flags_string (const gchar *flags_string)
 void
 ccnet_debug_impl (CcnetDebugFlags flag, const gchar *format, ...)
 {
-    if (flag & debug_flags) {
+    if (flag & g_atomic_int_get (&ccnet_debug_flags)) {
         va_list args;
         va_start (args, format);
         g_logv (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, format, args);
         va_end (args);
     }
 }
+
+int
+ccnet_log_set_module_level (const char *module, const char *level)
+{
+    int i, module_idx = 0, lvl;
+
+    if (module && *module && g_ascii_strcasecmp (module, "all") != 0) {
+        for (i = 0; i < G_N_ELEMENTS (debug_keys); ++i)
+            if (g_ascii_strcasecmp (module, debug_keys[i].key) == 0)
+                module_idx = ccnet_log_module (debug_keys[i].value);
+        if (module_idx == 0)
+            return -1;
+    }
+
+    if (strcmp (level, "default") == 0) {
+        if (module_idx == 0)
+            return -1;
+        lvl = 0;
+    } else if ((lvl = get_debug_level (level, 0)) == 0)
+        return -1;
+
+    module_levels[module_idx] = lvl;
+    update_levels ();
+    ccnet_message ("Set log level of %s to %s\n",
+                   module_idx ? module : "all", level);
+    return 0;
+}
+
+char *
+ccnet_log_get_levels (void)
+{
+    GString *buf = g_string_new (NULL);
+    int i, idx;
+
+    g_string_append_printf (buf, "all=%s", level_name (module_levels[0]));
+    for (i = 0; i < G_N_ELEMENTS (debug_keys); ++i) {
+        idx = ccnet_log_module (debug_keys[i].value);
+        if (module_levels[idx])
+            g_string_append_printf (buf, " %s=%s", debug_keys[i].key,
+                                    level_name (module_levels[idx]));
+    }
+    return g_string_free (buf, FALSE);
+}
@@ -17,6 +17,14 @@
 
 int ccnet_log_init (const char *logfile, const char *log_level_str);
 
+/* Hand messages to a writer thread instead of writing them in the
+ * caller. Must be called after ccnet_log_init() and after daemonizing. */
+int ccnet_log_start_async (void);
+
+/* Run the writer thread of the async log on @cpus. */
+struct CcnetCpuSet;
+void ccnet_log_pin_writer (const struct CcnetCpuSet *cpus);
+
 typedef enum
 {
     CCNET_DEBUG_PEER = 1 << 1,
@@ -33,11 +41,73 @@ void ccnet_debug_set_flags_string (const gchar *flags_string);
 
 void ccnet_debug_impl (CcnetDebugFlags flag, const gchar *format, ...);
 
+/*
+ * The macros below check the level before formatting anything. Each
+ * module, i.e. debug flag, has a level of its own, which is the global
+ * one unless set with ccnet_log_set_module_level(). Files without a
+ * DEBUG_FLAG use the global level.
+ */
+
+#define CCNET_LOG_N_MODULES 8
+
+extern volatile gint ccnet_log_levels[CCNET_LOG_N_MODULES];
+extern volatile gint ccnet_debug_flags;
+
+static inline int
+ccnet_log_module (int flag)
+{
+    /* Constant for a constant flag. */
+    switch (flag) {
+    case CCNET_DEBUG_PEER:          return 1;
+    case CCNET_DEBUG_PROCESSOR:     return 2;
+    case CCNET_DEBUG_NETIO:         return 3;
+    case CCNET_DEBUG_CONNECTION:    return 4;
+    case CCNET_DEBUG_MESSAGE:       return 5;
+    case CCNET_DEBUG_OTHER:         return 6;
+    default:                        return 0;
+    }
+}
+
+#define ccnet_log_enabled(flag, level)                                  \
+    ((int)(level) <= g_atomic_int_get (&ccnet_log_levels[ccnet_log_module (flag)]))
+
+#define ccnet_debug_enabled(flag)                                       \
+    ((g_atomic_int_get (&ccnet_debug_flags) & (flag)) &&                \
+     ccnet_log_enabled (flag, G_LOG_LEVEL_DEBUG))
+
+/* @module is a debug key like "Peer", NULL or "all" for the global
+ * level. @level is "debug", "info", "message" or "warning", or
+ * "default" to follow the global level again. */
+int ccnet_log_set_module_level (const char *module, const char *level);
+
+/* e.g. "all=info Peer=debug", newly allocated. */
+char *ccnet_log_get_levels (void);
+
 #define ccnet_debug(format, ...)
 
 
 #endif  /* CCNET_LOG_H */
 
+#undef CCNET_LOG_FLAG
+#ifdef DEBUG_FLAG
+#define CCNET_LOG_FLAG DEBUG_FLAG
+#else
+#define CCNET_LOG_FLAG 0
+#endif
+
+/* lib/utils.h has the ungated ones. */
+#undef ccnet_warning
+#define ccnet_warning(fmt, ...)                                         \
+    (ccnet_log_enabled (CCNET_LOG_FLAG, G_LOG_LEVEL_WARNING) ?          \
+     g_log (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "%s(%d): " fmt,          \
+            __FILE__, __LINE__, ##__VA_ARGS__) : (void)0)
+
+#undef ccnet_message
+#define ccnet_message(fmt, ...)                                         \
+    (ccnet_log_enabled (CCNET_LOG_FLAG, G_LOG_LEVEL_MESSAGE) ?          \
+     g_log (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, "%s(%d): " fmt,          \
+            __FILE__, __LINE__, ##__VA_ARGS__) : (void)0)
+
 #undef ccnet_debug
 #define ccnet_debug(format, ...)
 
@@ -45,8 +115,10 @@ void ccnet_debug_impl (CcnetDebugFlags flag, const gchar *format, ...);
 #ifdef ENABLE_DEBUG
 
 #undef ccnet_debug
-#define ccnet_debug(fmt, ...)  \
-    ccnet_debug_impl (DEBUG_FLAG, "%.15s(%d): " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
+#define ccnet_debug(fmt, ...)                                           \
+    (ccnet_debug_enabled (DEBUG_FLAG) ?                                 \
+     ccnet_debug_impl (DEBUG_FLAG, "%.15s(%d): " fmt,                   \
+                       __FILE__, __LINE__, ##__VA_ARGS__) : (void)0)
 
 #endif  /* ENABLE_DEBUG */
 #endif  /* DEBUG_FLAG */
@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "timer.h"
+#include "loop-monitor.h"
+#include "metrics.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_OTHER
+#include "log.h"
+
+#define DEFAULT_SLOW_CALLBACK_MS   100
+#define LAG_CHECK_INTERVAL         500      /* ms */
+
+gint64 ccnet_slow_callback_usec;
+
+static CcnetTimer *lag_timer;
+static gint64 lag_expected;
+static CcnetMetric *metric_lag;
+
+void
+ccnet_loop_monitor_report (const char *what, const char *name,
+                           const char *peer_id, gint64 usec)
+{
+    char labels[64];
+
+    if (peer_id)
+        ccnet_warning ("[Loop] Slow %s of %s for peer %.10s: %d ms\n",
+                       what, name, peer_id, (int)(usec / 1000));
+    else
+        ccnet_warning ("[Loop] Slow %s %s: %d ms\n",
+                       what, name, (int)(usec / 1000));
+
+    /* Registering returns the existing counter, and this path is rare. */
+    g_snprintf (labels, sizeof(labels), "what=\"%s\"", what);
+    ccnet_metric_inc (ccnet_metrics_counter (
+                          "ccnet_slow_callbacks_total", labels,
+                          "Callbacks over the slow callback threshold"));
+}
+
+static void
+report_lib_callback (const char *what, void *func, int64_t usec)
+{
+    char name[32];
+
+    g_snprintf (name, sizeof(name), "%p", func);
+    ccnet_loop_monitor_report (what, name, NULL, usec);
+}
+
+/* How late the loop runs this timer is how long other events delayed it. */
+static int
+check_lag (void *unused)
+{
+    gint64 now = g_get_monotonic_time ();
+    gint64 lag = MAX (now - lag_expected, 0);
+
+    ccnet_metric_observe (metric_lag, lag / 1e6);
+    if (lag >= ccnet_slow_callback_usec)
+        ccnet_warning ("[Loop] Event loop lagged %d ms\n", (int)(lag / 1000));
+
+    lag_expected = now + LAG_CHECK_INTERVAL * 1000;
+    return TRUE;
+}
+
+int
+ccnet_loop_monitor_start (GKeyFile *keyf)
+{
+    static const double lag_bounds[] = {
+        0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5,
+    };
+    int ms = DEFAULT_SLOW_CALLBACK_MS;
+
+    if (lag_timer)
+        return 0;
+
+    if (g_key_file_has_key (keyf, "Metrics", "SLOW_CALLBACK_MS", NULL))
+        ms = g_key_file_get_integer (keyf, "Metrics", "SLOW_CALLBACK_MS", NULL);
+    if (ms <= 0) {
+        ccnet_message ("[Loop] Slow callback detection disabled\n");
+        return 0;
+    }
+    ccnet_slow_callback_usec = (gint64)ms * 1000;
+
+    ccnet_set_slow_callback_hook (report_lib_callback,
+                                  ccnet_slow_callback_usec);
+
+    metric_lag = ccnet_metrics_histogram (
+        "ccnet_loop_lag_seconds", NULL,
+        "How late the event loop ran a periodic timer",
+        lag_bounds, G_N_ELEMENTS (lag_bounds));
+
+    lag_expected = g_get_monotonic_time () + LAG_CHECK_INTERVAL * 1000;
+    lag_timer = ccnet_timer_new (check_lag, NULL, LAG_CHECK_INTERVAL);
+    return 0;
+}
@@ -0,0 +1,29 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_LOOP_MONITOR_H
+#define CCNET_LOOP_MONITOR_H
+
+#include <glib.h>
+
+/*
+ * Everything runs on one event loop, so a slow handler delays every
+ * peer. Handlers running longer than [Metrics] SLOW_CALLBACK_MS are
+ * logged and counted, and a periodic timer measures how late the loop
+ * gets to it.
+ */
+
+/* The threshold in microseconds, 0 when monitoring is off. */
+extern gint64 ccnet_slow_callback_usec;
+
+void ccnet_loop_monitor_report (const char *what, const char *name,
+                                const char *peer_id, gint64 usec);
+
+#define ccnet_loop_monitor_check(what, name, peer_id, usec)             \
+    do {                                                                \
+        if (ccnet_slow_callback_usec && (usec) >= ccnet_slow_callback_usec) \
+            ccnet_loop_monitor_report ((what), (name), (peer_id), (usec)); \
+    } while (0)
+
+int ccnet_loop_monitor_start (GKeyFile *keyf);
+
+#endif
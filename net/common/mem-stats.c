@@ -0,0 +1,149 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "session.h"
+#include "peer.h"
+#include "peer-mgr.h"
+#include "processor.h"
+#include "proc-factory.h"
+#include "rpc-cache.h"
+#include "mem-stats.h"
+#include "processors/mqserver-proc.h"
+
+typedef struct {
+    guint  n;
+    gsize  bytes;
+} MemUsage;
+
+typedef struct {
+    MemUsage    peers;
+    MemUsage    buffers;
+    MemUsage    queues;
+    GHashTable *classes;        /* class name -> MemUsage */
+} MemStats;
+
+static gsize
+instance_size (GType type)
+{
+    GTypeQuery query;
+
+    g_type_query (type, &query);
+    return query.instance_size;
+}
+
+static gboolean
+add_peer (CcnetPeer *peer, void *vstats)
+{
+    MemStats *stats = vstats;
+    gsize buffered = ccnet_peer_get_buffered_bytes (peer);
+
+    stats->peers.n++;
+    stats->peers.bytes += instance_size (G_OBJECT_TYPE (peer));
+    if (peer->stats)
+        stats->peers.bytes += sizeof(CcnetPeerStats);
+    stats->peers.bytes += (peer->procs[0].mask + peer->procs[1].mask + 2) *
+        sizeof(CcnetProcessor *);
+    if (buffered) {
+        stats->buffers.n++;
+        stats->buffers.bytes += buffered;
+    }
+    return TRUE;
+}
+
+static gboolean
+add_processor (CcnetProcessor *processor, void *vstats)
+{
+    MemStats *stats = vstats;
+    const char *name = GET_PNAME (processor);
+    MemUsage *usage;
+
+    usage = g_hash_table_lookup (stats->classes, name);
+    if (!usage) {
+        usage = g_new0 (MemUsage, 1);
+        g_hash_table_insert (stats->classes, (gpointer)name, usage);
+    }
+    usage->n++;
+    usage->bytes += instance_size (G_OBJECT_TYPE (processor));
+
+    if (CCNET_IS_MQSERVER_PROC (processor)) {
+        stats->queues.n++;
+        stats->queues.bytes += ccnet_mqserver_proc_get_queued_bytes (processor);
+    }
+    return TRUE;
+}
+
+static void
+append_usage (GString *buf, const char *what, guint n, gsize bytes)
+{
+    g_string_append_printf (buf, "%s\t%u\t%" G_GSIZE_FORMAT "\n",
+                            what, n, bytes);
+}
+
+static void
+append_class (gpointer key, gpointer value, gpointer vbuf)
+{
+    MemUsage *usage = value;
+    char what[128];
+
+    g_snprintf (what, sizeof(what), "proc %s", (char *)key);
+    append_usage (vbuf, what, usage->n, usage->bytes);
+}
+
+/* The resident size of the process, to compare the rest with. */
+static void
+append_rss (GString *buf)
+{
+#ifdef __linux__
+    FILE *fp = fopen ("/proc/self/statm", "r");
+    unsigned long size, resident;
+
+    if (!fp)
+        return;
+    if (fscanf (fp, "%lu %lu", &size, &resident) == 2)
+        append_usage (buf, "rss", 1,
+                      (gsize)resident * sysconf (_SC_PAGESIZE));
+    fclose (fp);
+#endif
+}
+
+char *
+ccnet_mem_stats_format (CcnetSession *session)
+{
+    GString *buf = g_string_new (NULL);
+    CcnetProcCursor *cursor;
+    MemStats stats;
+    guint n;
+    gsize bytes;
+    gint64 cached;
+
+    memset (&stats, 0, sizeof(stats));
+    stats.classes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, g_free);
+
+    ccnet_peer_manager_foreach (session->peer_mgr, add_peer, &stats);
+
+    cursor = ccnet_proc_factory_open_cursor (session->proc_factory,
+                                             NULL, NULL, 0);
+    ccnet_proc_cursor_step (cursor, G_MAXINT, add_processor, &stats);
+    ccnet_proc_cursor_close (cursor);
+
+    append_rss (buf);
+    append_usage (buf, "peers", stats.peers.n, stats.peers.bytes);
+    append_usage (buf, "peer_buffers", stats.buffers.n, stats.buffers.bytes);
+    append_usage (buf, "message_queues", stats.queues.n, stats.queues.bytes);
+
+    ccnet_proc_factory_get_pool_usage (session->proc_factory, &n, &bytes);
+    append_usage (buf, "proc_pool", n, bytes);
+
+    cached = ccnet_rpc_cache_get_bytes (&n);
+    append_usage (buf, "rpc_cache", n, (gsize)cached);
+
+    g_hash_table_foreach (stats.classes, append_class, buf);
+    g_hash_table_destroy (stats.classes);
+
+    return g_string_free (buf, FALSE);
+}
@@ -0,0 +1,17 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_MEM_STATS_H
+#define CCNET_MEM_STATS_H
+
+struct CcnetSession;
+
+/*
+ * Where the memory of the daemon goes, one line per subsystem or
+ * processor class: "<what>\t<count>\t<bytes>". The sizes are collected
+ * when asked for, by walking the peers, processors and queues, so
+ * nothing is spent on them otherwise. They are estimates: instance
+ * sizes and buffered data, not every string hanging off an object.
+ */
+char *ccnet_mem_stats_format (struct CcnetSession *session);
+
+#endif
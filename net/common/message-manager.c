@@ -2,6 +2,7 @@
 
 #include "common.h"
 
+#include "bloom-filter.h"
 #include "ccnet-db.h"
 #include "timer.h"
 
@@ -12,13 +13,56 @@
 #include "message.h"
 #include "message-manager.h"
 #include "peer-mgr.h"
+#include "metrics.h"
 
 #define DEBUG_FLAG CCNET_DEBUG_MESSAGE
 #include "log.h"
 
 
+#define DEFAULT_QUEUE_DEPTH 1000
+#define MATCH_CACHE_MAX     4096
+
+/*
+ * Group messages may reach us along several relay paths. Ids seen in
+ * the last one or two windows are kept in a pair of Bloom filters; on
+ * rotation the older one is cleared and becomes the current one.
+ */
+#define DEFAULT_DEDUP_WINDOW   300      /* seconds */
+#define DEDUP_CAPACITY         (64 * 1024)  /* ids per window */
+#define DEDUP_BITS             (DEDUP_CAPACITY * 12)
+#define DEDUP_K                8
+
+typedef struct DedupFilter {
+    BlockedBloom *gen[2];       /* gen[cur] is written, both are tested */
+    int           cur;
+    guint         n_added;      /* to gen[cur] */
+    time_t        rotated;
+    int           window;
+
+    guint64       n_checked;
+    guint64       n_dropped;
+} DedupFilter;
+
+/*
+ * An app name ending with '*' subscribes to every app starting with
+ * the rest of it ("*" alone to all apps). Such subscriptions live in a
+ * trie on the prefix, exact ones in the subscribers table. The merged
+ * list for an app is cached until the next (un)subscription.
+ */
+typedef struct TopicNode {
+    GHashTable *children;       /* char -> TopicNode, created on demand */
+    GList      *subscribers;
+} TopicNode;
+
 struct MessageManagerPriv {
     GHashTable *subscribers;
+    TopicNode  *topics;
+    GHashTable *match_cache;    /* app -> GList of subscribers */
+
+    int         queue_depth;
+    GHashTable *coalesce_apps;
+
+    DedupFilter dedup;
 
 #ifdef CCNET_SERVER
     
@@ -30,6 +74,11 @@ struct MessageManagerPriv {
 
 G_DEFINE_TYPE (CcnetMessageManager, ccnet_message_manager, G_TYPE_OBJECT);
 
+/* See metrics.h */
+static CcnetMetric *metric_recv;
+static CcnetMetric *metric_sys;
+static CcnetMetric *metric_dup;
+static CcnetMetric *metric_delivered;
 
 static void
 ccnet_message_manager_class_init (CcnetMessageManagerClass *class)
@@ -37,6 +86,18 @@ ccnet_message_manager_class_init (CcnetMessageManagerClass *class)
     /* GObjectClass *object_class; */
 
     g_type_class_add_private (class, sizeof (MessageManagerPriv));
+
+    metric_recv = ccnet_metrics_counter ("ccnet_messages_total",
+                                         "type=\"recv\"",
+                                         "Messages handled by type");
+    metric_sys = ccnet_metrics_counter ("ccnet_messages_total",
+                                        "type=\"sys\"",
+                                        "Messages handled by type");
+    metric_dup = ccnet_metrics_counter ("ccnet_messages_duplicate_total", NULL,
+                                        "Group messages dropped as duplicates");
+    metric_delivered = ccnet_metrics_counter (
+        "ccnet_message_deliveries_total", NULL,
+        "Messages queued to subscribers");
 }
 
 static void
@@ -55,68 +116,369 @@ ccnet_message_manager_new (CcnetSession *session)
 
     manager->priv->subscribers = g_hash_table_new_full (
         g_str_hash, g_str_equal, g_free, NULL);
+    manager->priv->topics = g_new0 (TopicNode, 1);
+    manager->priv->match_cache = g_hash_table_new_full (
+        g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_list_free);
+    manager->priv->coalesce_apps = g_hash_table_new_full (
+        g_str_hash, g_str_equal, g_free, NULL);
+    manager->priv->queue_depth = DEFAULT_QUEUE_DEPTH;
+    manager->priv->dedup.window = DEFAULT_DEDUP_WINDOW;
 
     return manager;
 }
 
+static void
+dedup_rotate (DedupFilter *dedup, time_t now)
+{
+    int old = !dedup->cur;
+
+    blocked_bloom_destroy (dedup->gen[old]);
+    dedup->gen[old] = blocked_bloom_create (DEDUP_BITS, DEDUP_K);
+    dedup->cur = old;
+    dedup->n_added = 0;
+    dedup->rotated = now;
+}
+
+/* TRUE if the message id was already seen; otherwise remembers it. */
+static gboolean
+dedup_check (DedupFilter *dedup, const char *id)
+{
+    time_t now;
+
+    if (!dedup->gen[0] || !id || id[0] == '\0')
+        return FALSE;
+
+    now = time (NULL);
+    if (now - dedup->rotated >= dedup->window ||
+        dedup->n_added >= DEDUP_CAPACITY)
+        dedup_rotate (dedup, now);
+
+    dedup->n_checked++;
+    if (blocked_bloom_test (dedup->gen[dedup->cur], id) ||
+        blocked_bloom_test (dedup->gen[!dedup->cur], id)) {
+        dedup->n_dropped++;
+        return TRUE;
+    }
+
+    blocked_bloom_add (dedup->gen[dedup->cur], id);
+    dedup->n_added++;
+    return FALSE;
+}
+
+static void
+dedup_init (DedupFilter *dedup)
+{
+    dedup->gen[0] = blocked_bloom_create (DEDUP_BITS, DEDUP_K);
+    dedup->gen[1] = blocked_bloom_create (DEDUP_BITS, DEDUP_K);
+    if (!dedup->gen[0] || !dedup->gen[1]) {
+        ccnet_warning ("Failed to create message dedup filter.\n");
+        if (dedup->gen[0])
+            blocked_bloom_destroy (dedup->gen[0]);
+        if (dedup->gen[1])
+            blocked_bloom_destroy (dedup->gen[1]);
+        dedup->gen[0] = dedup->gen[1] = NULL;
+        return;
+    }
+    dedup->cur = 0;
+    dedup->rotated = time (NULL);
+}
+
+static void
+load_queue_config (CcnetMessageManager *manager)
+{
+    MessageManagerPriv *priv = manager->priv;
+    GKeyFile *keyf = manager->session->keyf;
+    char **apps;
+    gsize i, n_apps;
+
+    if (g_key_file_has_key (keyf, "Message", "QUEUE_DEPTH", NULL)) {
+        priv->queue_depth = g_key_file_get_integer (keyf, "Message",
+                                                    "QUEUE_DEPTH", NULL);
+        if (priv->queue_depth <= 0)
+            priv->queue_depth = DEFAULT_QUEUE_DEPTH;
+    }
+
+    apps = g_key_file_get_string_list (keyf, "Message", "COALESCE_APPS",
+                                       &n_apps, NULL);
+    for (i = 0; apps && i < n_apps; ++i) {
+        g_strstrip (apps[i]);
+        if (apps[i][0] != '\0')
+            g_hash_table_replace (priv->coalesce_apps,
+                                  g_strdup (apps[i]), GINT_TO_POINTER(1));
+    }
+    g_strfreev (apps);
+
+    if (g_key_file_has_key (keyf, "Message", "DEDUP_WINDOW", NULL)) {
+        priv->dedup.window = g_key_file_get_integer (keyf, "Message",
+                                                     "DEDUP_WINDOW", NULL);
+        if (priv->dedup.window <= 0)
+            priv->dedup.window = DEFAULT_DEDUP_WINDOW;
+    }
+}
+
 int
 ccnet_message_manager_start (CcnetMessageManager *manager)
 {
+    load_queue_config (manager);
+    dedup_init (&manager->priv->dedup);
     return 0;
 }
 
+void
+ccnet_message_manager_get_dedup_stats (CcnetMessageManager *manager,
+                                       guint64 *n_checked,
+                                       guint64 *n_dropped,
+                                       double *fp_rate)
+{
+    DedupFilter *dedup = &manager->priv->dedup;
+    double x, empty, p;
+    int i;
+
+    *n_checked = dedup->n_checked;
+    *n_dropped = dedup->n_dropped;
+
+    /* (1 - e^(-kn/m))^k, a new id being tested against both
+     * generations and the older one being full at worst. e^-x is
+     * taken as (1 - x/1024)^1024 to stay off libm. */
+    x = (double)DEDUP_K * (dedup->n_added + DEDUP_CAPACITY) /
+        (2.0 * DEDUP_BITS);
+    empty = 1 - x / 1024;
+    for (i = 0; i < 10; ++i)
+        empty *= empty;
+    p = 1;
+    for (i = 0; i < DEDUP_K; ++i)
+        p *= 1 - empty;
+    *fp_rate = p;
+}
+
+int
+ccnet_message_manager_get_queue_depth (CcnetMessageManager *manager)
+{
+    return manager->priv->queue_depth;
+}
+
+int
+ccnet_message_manager_get_queue_policy (CcnetMessageManager *manager,
+                                        const char *app)
+{
+    if (g_hash_table_lookup (manager->priv->coalesce_apps, app))
+        return MQ_POLICY_COALESCE;
+    return MQ_POLICY_DROP_OLDEST;
+}
+
 static gboolean 
 handle_inner_message (CcnetMessageManager *manager,
-                      CcnetMessage *msg)
+                      CcnetMessage *msg,
+                      const CcnetMessageView *view)
 {
-    if (strcmp(msg->app, IPEERMGR_APP) == 0) {
+    CcnetMessage *copy;
+
+    if (strcmp(view->app, IPEERMGR_APP) != 0)
+        return FALSE;
+
+    if (msg) {
         ccnet_peer_manager_receive_message (manager->session->peer_mgr, msg);
         return TRUE;
     }
 
-    return FALSE;
+    copy = ccnet_message_view_materialize (view);
+    ccnet_peer_manager_receive_message (manager->session->peer_mgr, copy);
+    ccnet_message_unref (copy);
+    return TRUE;
 }
 
-int 
-ccnet_message_manager_add_msg(CcnetMessageManager *manager,
-                              CcnetMessage *msg,
-                              int msg_type)
+/* The message is encoded once and the same packet is queued to every
+ * subscriber. */
+static void
+deliver_message (GList *subscribers, const CcnetMessageView *view)
+{
+    CcnetSharedPacket *packet;
+    GList *ptr;
+
+    if (!subscribers)
+        return;
+
+    packet = ccnet_mqserver_proc_encode_message (view);
+    if (!packet) {
+        ccnet_warning ("Failed to encode message for app %s\n", view->app);
+        return;
+    }
+
+    for (ptr = subscribers; ptr; ptr = ptr->next) {
+        ccnet_mqserver_proc_put_packet (ptr->data, view, packet);
+        ccnet_metric_inc (metric_delivered);
+    }
+
+    ccnet_shared_packet_unref (packet);
+}
+
+static gboolean
+is_prefix_pattern (const char *app, int *prefix_len)
+{
+    int len = strlen (app);
+
+    if (len == 0 || app[len - 1] != '*')
+        return FALSE;
+    *prefix_len = len - 1;
+    return TRUE;
+}
+
+static TopicNode *
+topic_child (TopicNode *node, char c, gboolean create)
+{
+    TopicNode *child = NULL;
+
+    if (node->children)
+        child = g_hash_table_lookup (node->children, GINT_TO_POINTER(c));
+    if (child || !create)
+        return child;
+
+    if (!node->children)
+        node->children = g_hash_table_new (g_direct_hash, g_direct_equal);
+    child = g_new0 (TopicNode, 1);
+    g_hash_table_insert (node->children, GINT_TO_POINTER(c), child);
+    return child;
+}
+
+static void
+topic_subscribe (TopicNode *root, const char *prefix, int len,
+                 CcnetProcessor *mq_proc)
+{
+    TopicNode *node = root;
+    int i;
+
+    for (i = 0; i < len; ++i)
+        node = topic_child (node, prefix[i], TRUE);
+    node->subscribers = g_list_prepend (node->subscribers, mq_proc);
+}
+
+static int
+topic_unsubscribe (TopicNode *root, const char *prefix, int len,
+                   CcnetProcessor *mq_proc)
+{
+    TopicNode **path;
+    TopicNode *node = root;
+    int i;
+
+    path = g_new (TopicNode *, len + 1);
+    path[0] = root;
+    for (i = 0; i < len; ++i) {
+        node = topic_child (node, prefix[i], FALSE);
+        if (!node) {
+            g_free (path);
+            return -1;
+        }
+        path[i + 1] = node;
+    }
+    if (!g_list_find (node->subscribers, mq_proc)) {
+        g_free (path);
+        return -1;
+    }
+    node->subscribers = g_list_remove (node->subscribers, mq_proc);
+
+    /* prune the branch which is now empty */
+    for (i = len; i > 0; --i) {
+        node = path[i];
+        if (node->subscribers ||
+            (node->children && g_hash_table_size (node->children) > 0))
+            break;
+        g_hash_table_remove (path[i - 1]->children,
+                             GINT_TO_POINTER(prefix[i - 1]));
+        if (node->children)
+            g_hash_table_destroy (node->children);
+        g_free (node);
+    }
+
+    g_free (path);
+    return 0;
+}
+
+static GList *
+merge_subscribers (GList *list, GList *subscribers)
+{
+    GList *ptr;
+
+    for (ptr = subscribers; ptr; ptr = ptr->next)
+        if (!g_list_find (list, ptr->data))
+            list = g_list_prepend (list, ptr->data);
+    return list;
+}
+
+static GList *
+get_subscribers (MessageManagerPriv *priv, const char *app)
+{
+    GList *list;
+    TopicNode *node;
+    const char *p;
+
+    if (g_hash_table_lookup_extended (priv->match_cache, app,
+                                      NULL, (gpointer *)&list))
+        return list;
+
+    list = g_list_copy (g_hash_table_lookup (priv->subscribers, app));
+
+    /* every node on the path of the app is a matching prefix */
+    node = priv->topics;
+    p = app;
+    while (node) {
+        list = merge_subscribers (list, node->subscribers);
+        if (*p == '\0')
+            break;
+        node = topic_child (node, *p++, FALSE);
+    }
+
+    if (g_hash_table_size (priv->match_cache) >= MATCH_CACHE_MAX)
+        g_hash_table_remove_all (priv->match_cache);
+    g_hash_table_insert (priv->match_cache, g_strdup (app), list);
+    return list;
+}
+
+static void
+add_msg (CcnetMessageManager *manager, CcnetMessage *msg,
+         const CcnetMessageView *view, int msg_type)
 {
     MessageManagerPriv *priv = manager->priv;
-    GList *app_subscribers, *ptr;
-    CcnetProcessor *processor;
 
     switch (msg_type) {
     case MSG_TYPE_RECV:
-        if (handle_inner_message(manager, msg))
+        ccnet_metric_inc (metric_recv);
+        if ((view->flags & FLAG_TO_GROUP) &&
+            dedup_check (&priv->dedup, view->id)) {
+            ccnet_debug ("Drop duplicate group message %s.\n", view->id);
+            ccnet_metric_inc (metric_dup);
             break;
+        }
 
-        app_subscribers = g_hash_table_lookup (priv->subscribers,
-                                               msg->app);
-        if (!app_subscribers)
+        if (handle_inner_message(manager, msg, view))
             break;
 
-        ptr = app_subscribers;
-        while (ptr) {
-            processor = ptr->data;
-            ccnet_mqserver_proc_put_message (processor, msg);
-            ptr = ptr->next;
-        }
+        deliver_message (get_subscribers (priv, view->app), view);
         break;
     case MSG_TYPE_SYS:
-        app_subscribers = g_hash_table_lookup (priv->subscribers, msg->app);
-        if (!app_subscribers)
-            break;
-
-        ptr = app_subscribers;
-        while (ptr) {
-            processor = ptr->data;
-            ccnet_mqserver_proc_put_message (processor, msg);
-            ptr = ptr->next;
-        }
+        ccnet_metric_inc (metric_sys);
+        deliver_message (get_subscribers (priv, view->app), view);
         break;
     }
+}
+
+int 
+ccnet_message_manager_add_msg(CcnetMessageManager *manager,
+                              CcnetMessage *msg,
+                              int msg_type)
+{
+    CcnetMessageView view;
+
+    ccnet_message_view_init (&view, msg);
+    add_msg (manager, msg, &view, msg_type);
+    return 0;
+}
 
+int
+ccnet_message_manager_add_msg_view (CcnetMessageManager *manager,
+                                    const CcnetMessageView *view,
+                                    int msg_type)
+{
+    add_msg (manager, NULL, view, msg_type);
     return 0;
 }
 
@@ -127,11 +489,18 @@ ccnet_message_manager_subscribe_app (CcnetMessageManager *manager,
 {
     MessageManagerPriv *priv = manager->priv;
     GList *app_subscribers;
-    int i;
+    int i, prefix_len;
+
+    g_hash_table_remove_all (priv->match_cache);
 
     for (i = 0; i < n_app; ++i) {
         ccnet_debug ("[Msg] subscribe app %s\n", apps[i]);
 
+        if (is_prefix_pattern (apps[i], &prefix_len)) {
+            topic_subscribe (priv->topics, apps[i], prefix_len, mq_proc);
+            continue;
+        }
+
         app_subscribers = g_hash_table_lookup (priv->subscribers, apps[i]);
         app_subscribers = g_list_prepend (app_subscribers, mq_proc);
         g_hash_table_replace (priv->subscribers, g_strdup (apps[i]),
@@ -148,10 +517,22 @@ ccnet_message_manager_unsubscribe_app (CcnetMessageManager *manager,
 {
     MessageManagerPriv *priv = manager->priv;
     GList *app_subscribers;
-    int i;
+    int i, prefix_len;
     int ret = 0; 
 
+    g_hash_table_remove_all (priv->match_cache);
+
     for (i = 0; i < n_app; ++i) {
+        if (is_prefix_pattern (apps[i], &prefix_len)) {
+            if (topic_unsubscribe (priv->topics, apps[i], prefix_len,
+                                   mq_proc) < 0) {
+                ccnet_warning ("cannot unsubscribe from apps %s, "
+                               "not subscribed.\n", apps[i]);
+                ret = -1;
+            }
+            continue;
+        }
+
         app_subscribers = g_hash_table_lookup (priv->subscribers, apps[i]);
         if (!app_subscribers) {
             ccnet_warning ("cannot unsubscribe from app %s, "
@@ -40,6 +40,12 @@ int ccnet_message_manager_add_msg(CcnetMessageManager *manager,
                                   CcnetMessage *msg,
                                   int msg_type);
 
+/* Same as above, without turning the view into a message unless it has
+ * to be kept. */
+int ccnet_message_manager_add_msg_view (CcnetMessageManager *manager,
+                                        const CcnetMessageView *view,
+                                        int msg_type);
+
 int ccnet_message_manager_subscribe_app (CcnetMessageManager *manager,
                                          CcnetProcessor *mq_proc,
                                          int n_app, char **apps);
@@ -48,5 +54,25 @@ int ccnet_message_manager_unsubscribe_app (CcnetMessageManager *manager,
                                            CcnetProcessor *mq_proc,
                                            int n_app, char **apps);
 
+/* What a subscriber whose connection is congested does with new
+ * messages, once it has [Message] QUEUE_DEPTH of them queued. */
+enum {
+    MQ_POLICY_DROP_OLDEST,
+    MQ_POLICY_COALESCE,         /* also replace queued messages by key */
+};
+
+int ccnet_message_manager_get_queue_depth (CcnetMessageManager *manager);
+
+int ccnet_message_manager_get_queue_policy (CcnetMessageManager *manager,
+                                            const char *app);
+
+/* Received group messages whose id was seen within [Message]
+ * DEDUP_WINDOW seconds are dropped. @fp_rate is the estimated chance
+ * that a new message is taken for a duplicate. */
+void ccnet_message_manager_get_dedup_stats (CcnetMessageManager *manager,
+                                            guint64 *n_checked,
+                                            guint64 *n_dropped,
+                                            double *fp_rate);
+
 
 #endif
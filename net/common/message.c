@@ -28,7 +28,7 @@ ccnet_message_new_full (const char *from,
     message->from[40] = '\0';
     memcpy (message->to, to, 40); /* ok if strlen(to) == 36 */
     message->to[40] = '\0';
-    message->app = g_intern_string(app);
+    message->app = ccnet_str_ref (app);
     message->body = g_strdup(body);
     message->ctime = (ctime ? ctime : time(NULL));
     message->rtime = rtime;
@@ -65,6 +65,7 @@ ccnet_message_unref (CcnetMessage *message)
 void
 ccnet_message_free (CcnetMessage *message)
 {
+    ccnet_str_unref (message->app);
     g_free (message->id);
     g_free (message->body);
     g_free (message);
@@ -73,14 +74,10 @@ ccnet_message_free (CcnetMessage *message)
 void
 ccnet_message_to_string_buf_local (CcnetMessage *msg, GString *buf)
 {
-    g_string_printf (buf, "%d %s %s %s %d %d %s %s", msg->flags,
-                     msg->from, 
-                     msg->to,
-                     msg->id,
-                     (int)msg->ctime,
-                     (int)msg->rtime,
-                     msg->app,
-                     msg->body);
+    CcnetMessageView view;
+
+    ccnet_message_view_init (&view, msg);
+    ccnet_message_view_to_string_buf_local (&view, buf);
 }
 
 void
@@ -96,129 +93,117 @@ ccnet_message_to_string_buf (CcnetMessage *msg, GString *buf)
 }
 
 
-CcnetMessage *
-ccnet_message_from_string (char *buf, int len)
+/* Cut the next field ending with a space, of @fixed chars if not 0. */
+static char *
+next_field (char **pp, int fixed)
 {
-    char flags;
-    char *from_id, *to_id, *msg_id, *body, *p, *time, *app;
-    int ctime, rcv_time = 0;
-    CcnetMessage *message;
-
-    g_return_val_if_fail (END_0(buf,len), NULL);
+    char *field = *pp, *p = field;
 
-    p = buf;
-    while (*p != ' ' && *p) ++p;
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
-    flags = atoi (buf);
-
-    from_id = ++p;
-    p += 40;
+    if (fixed)
+        p += fixed;
+    else
+        while (*p != ' ' && *p) ++p;
     if (*p != ' ')
-        goto error;
+        return NULL;
     *p = '\0';
+    *pp = p + 1;
+    return field;
+}
 
-    to_id = ++p;
-    p += 40;                /* SHA-1 */
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
+int
+ccnet_message_view_parse (CcnetMessageView *view, char *buf, int len,
+                          gboolean local)
+{
+    char *p = buf, *field;
+
+    g_return_val_if_fail (len > 0 && END_0(buf,len), -1);
+
+    if (!(field = next_field (&p, 0)))
+        return -1;
+    view->flags = atoi (field);
+
+    /* the fixed-size fields are only safe to skip inside the buffer */
+    if (p + 40 + 40 + 36 + 3 > buf + len - 1)
+        return -1;
+    if (!(view->from = next_field (&p, 40)))
+        return -1;
+    if (!(view->to = next_field (&p, 40)))      /* SHA-1 */
+        return -1;
+    if (!(view->id = next_field (&p, 36)))
+        return -1;
+
+    if (!(field = next_field (&p, 0)))
+        return -1;
+    view->ctime = atoi (field);
+
+    view->rtime = 0;
+    if (local) {
+        if (!(field = next_field (&p, 0)))
+            return -1;
+        view->rtime = atoi (field);
+    }
+
+    if (!(view->app = next_field (&p, 0)))
+        return -1;
+    view->body = p;
+
+    return 0;
+}
 
-    msg_id = ++p;
-    p += 36;
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
+void
+ccnet_message_view_init (CcnetMessageView *view, CcnetMessage *msg)
+{
+    view->flags = msg->flags;
+    view->from = msg->from;
+    view->to = msg->to;
+    view->id = msg->id;
+    view->ctime = msg->ctime;
+    view->rtime = msg->rtime;
+    view->app = msg->app;
+    view->body = msg->body;
+}
 
-    time = ++p;
-    while (*p != ' ' && *p) ++p;
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
-    ctime = atoi (time);
+CcnetMessage *
+ccnet_message_view_materialize (const CcnetMessageView *view)
+{
+    return ccnet_message_new_full (view->from, view->to,
+                                   view->app, view->body,
+                                   view->ctime, view->rtime,
+                                   view->id, view->flags);
+}
 
-    app = ++p;
-    while (*p != ' ' && *p) ++p;
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
-    body = p + 1;
+void
+ccnet_message_view_to_string_buf_local (const CcnetMessageView *view,
+                                        GString *buf)
+{
+    g_string_printf (buf, "%d %s %s %s %d %d %s %s", view->flags,
+                     view->from, 
+                     view->to,
+                     view->id,
+                     view->ctime,
+                     view->rtime,
+                     view->app,
+                     view->body);
+}
 
-    message = ccnet_message_new_full (from_id, to_id,
-                                      app, body,
-                                      ctime, rcv_time,
-                                      msg_id, flags);
-    return message;
+CcnetMessage *
+ccnet_message_from_string (char *buf, int len)
+{
+    CcnetMessageView view;
 
-error:
-    return NULL;
+    if (ccnet_message_view_parse (&view, buf, len, FALSE) < 0)
+        return NULL;
+    return ccnet_message_view_materialize (&view);
 }
 
 CcnetMessage *
 ccnet_message_from_string_local (char *buf, int len)
 {
-    int flags;
-    char *from_id, *to_id, *msg_id, *body, *p, *time, *app;
-    int ctime, rcv_time = 0;
-    CcnetMessage *message;
-
-    g_return_val_if_fail (END_0(buf,len), NULL);
-
-    p = buf;
-    while (*p != ' ' && *p) ++p;
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
-    flags = atoi (buf);
-
-    from_id = ++p;
-    p += 40;
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
+    CcnetMessageView view;
 
-    to_id = ++p;
-    p += 40;                /* SHA-1 */
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
-
-    msg_id = ++p;
-    p += 36;
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
-
-    time = ++p;
-    while (*p != ' ' && *p) ++p;
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
-    ctime = atoi (time);
-
-    time = ++p;
-    while (*p != ' ' && *p) ++p;
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
-    rcv_time = atoi (time);
-
-    app = ++p;
-    while (*p != ' ' && *p) ++p;
-    if (*p != ' ')
-        goto error;
-    *p = '\0';
-    body = p + 1;
-
-    message = ccnet_message_new_full (from_id, to_id,
-                                      app, body,
-                                      ctime, rcv_time,
-                                      msg_id, flags);
-    return message;
-
-error:
-    return NULL;
+    if (ccnet_message_view_parse (&view, buf, len, TRUE) < 0)
+        return NULL;
+    return ccnet_message_view_materialize (&view);
 }
 
 #if 0
@@ -240,8 +225,7 @@ ccnet_message_from_db_stmt (CcnetDBRow *stmt)
     rtime = ccnet_db_row_get_column_int (stmt, MSG_DB_COLUMN_RTIME);
     app = (char *)ccnet_db_row_get_column_text (stmt, MSG_DB_COLUMN_APP);
     body = (char *)ccnet_db_row_get_column_text (stmt, MSG_DB_COLUMN_BODY);
-    
-    app = g_intern_string(app);
+
 
     message = ccnet_message_new_full (from, to,
                                       app, body,
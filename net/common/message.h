@@ -44,7 +44,7 @@ struct _CcnetMessage {
     int      ctime;             /* creation time */
 	int 	 rtime;             /* receive time */
 
-    const char *app;            /* application */
+    const char *app;            /* application, see ccnet_str_ref() */
     char       *body;
 };
 
@@ -66,5 +66,34 @@ void ccnet_message_to_string_buf_local (CcnetMessage *msg, GString *buf);
 CcnetMessage *ccnet_message_from_string (char *buf, int len);
 CcnetMessage *ccnet_message_from_string_local (char *buf, int len);
 
+/*
+ * A message parsed in place: the fields point into the buffer it was
+ * parsed from, or into the message it was made from, and are only
+ * valid as long as that is. Used on the receive-dispatch path, where
+ * most messages are re-encoded for the subscribers and then dropped.
+ * Call ccnet_message_view_materialize() to keep one.
+ */
+typedef struct _CcnetMessageView {
+    char        flags;
+    const char *from;
+    const char *to;
+    const char *id;
+    int         ctime;
+    int         rtime;
+    const char *app;            /* not interned */
+    const char *body;
+} CcnetMessageView;
+
+/* @buf is modified. The local form also carries the receive time. */
+int ccnet_message_view_parse (CcnetMessageView *view, char *buf, int len,
+                              gboolean local);
+
+void ccnet_message_view_init (CcnetMessageView *view, CcnetMessage *msg);
+
+CcnetMessage *ccnet_message_view_materialize (const CcnetMessageView *view);
+
+void ccnet_message_view_to_string_buf_local (const CcnetMessageView *view,
+                                             GString *buf);
+
 
 #endif
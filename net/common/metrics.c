@@ -0,0 +1,366 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <evhttp.h>
+
+#include "metrics.h"
+#include "utils.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_OTHER
+#include "log.h"
+
+#define METRIC_SHARDS        16
+#define CACHE_LINE_INT64S     8     /* 64 bytes */
+
+/* Histogram sums are kept in millionths, so they can be added atomically. */
+#define SUM_SCALE       1000000.0
+
+enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_GAUGE_FUNC,
+    METRIC_HISTOGRAM,
+};
+
+static const char *type_names[] = {
+    "counter", "gauge", "gauge", "histogram",
+};
+
+struct CcnetMetric {
+    char        *name;
+    char        *labels;
+    char        *help;
+    int          type;
+
+    /* METRIC_SHARDS rows of stride values, each row on its own cache
+     * lines. A histogram row holds the bucket counts, the +Inf bucket
+     * and the sum; the other metrics use the first value only. */
+    gint64      *cells;
+    int          stride;
+
+    double      *bounds;
+    int          n_bounds;
+
+    CcnetMetricReadFunc func;
+    void        *data;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static GPtrArray *registry;
+
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+static int next_shard;
+
+static void
+shard_key_init (void)
+{
+    pthread_key_create (&shard_key, NULL);
+}
+
+/* The shard of the calling thread. Threads are spread round robin. */
+static inline int
+get_shard (void)
+{
+    long shard;
+
+    pthread_once (&shard_once, shard_key_init);
+    shard = (long)pthread_getspecific (shard_key);
+    if (shard == 0) {
+        shard = __sync_fetch_and_add (&next_shard, 1) % METRIC_SHARDS + 1;
+        pthread_setspecific (shard_key, (void *)shard);
+    }
+    return shard - 1;
+}
+
+static gint64
+read_cell (gint64 *cell)
+{
+    return __sync_add_and_fetch (cell, 0);
+}
+
+/* Sum of value @idx over all the shards. */
+static gint64
+sum_shards (CcnetMetric *metric, int idx)
+{
+    gint64 total = 0;
+    int i;
+
+    for (i = 0; i < METRIC_SHARDS; ++i)
+        total += read_cell (&metric->cells[i * metric->stride + idx]);
+    return total;
+}
+
+static CcnetMetric *
+register_metric (const char *name, const char *labels, const char *help,
+                 int type, int n_values)
+{
+    CcnetMetric *metric;
+    guint i;
+
+    pthread_mutex_lock (&registry_lock);
+
+    if (!registry)
+        registry = g_ptr_array_new ();
+
+    for (i = 0; i < registry->len; ++i) {
+        metric = g_ptr_array_index (registry, i);
+        if (strcmp (metric->name, name) == 0 &&
+            g_strcmp0 (metric->labels, labels) == 0) {
+            pthread_mutex_unlock (&registry_lock);
+            if (metric->type != type) {
+                ccnet_warning ("[Metrics] %s registered with another type\n",
+                               name);
+                return NULL;
+            }
+            return metric;
+        }
+    }
+
+    metric = g_new0 (CcnetMetric, 1);
+    metric->name = g_strdup (name);
+    metric->labels = g_strdup (labels);
+    metric->help = g_strdup (help);
+    metric->type = type;
+    metric->stride = (n_values + CACHE_LINE_INT64S - 1)
+        / CACHE_LINE_INT64S * CACHE_LINE_INT64S;
+    /* Never freed, so the alignment slack doesn't need keeping. */
+    metric->cells = (gint64 *)(((gsize)g_malloc0 (
+        (METRIC_SHARDS * metric->stride + CACHE_LINE_INT64S) * sizeof(gint64))
+        + CACHE_LINE_INT64S * sizeof(gint64) - 1)
+        & ~(gsize)(CACHE_LINE_INT64S * sizeof(gint64) - 1));
+    g_ptr_array_add (registry, metric);
+
+    pthread_mutex_unlock (&registry_lock);
+    return metric;
+}
+
+CcnetMetric *
+ccnet_metrics_counter (const char *name, const char *labels,
+                       const char *help)
+{
+    return register_metric (name, labels, help, METRIC_COUNTER, 1);
+}
+
+CcnetMetric *
+ccnet_metrics_gauge (const char *name, const char *labels, const char *help)
+{
+    return register_metric (name, labels, help, METRIC_GAUGE, 1);
+}
+
+CcnetMetric *
+ccnet_metrics_gauge_func (const char *name, const char *labels,
+                          const char *help,
+                          CcnetMetricReadFunc func, void *data)
+{
+    CcnetMetric *metric;
+
+    metric = register_metric (name, labels, help, METRIC_GAUGE_FUNC, 1);
+    if (metric) {
+        metric->func = func;
+        metric->data = data;
+    }
+    return metric;
+}
+
+CcnetMetric *
+ccnet_metrics_histogram (const char *name, const char *labels,
+                         const char *help,
+                         const double *bounds, int n_bounds)
+{
+    CcnetMetric *metric;
+
+    metric = register_metric (name, labels, help, METRIC_HISTOGRAM,
+                              n_bounds + 2);
+    if (metric && !metric->bounds) {
+        metric->bounds = g_memdup (bounds, n_bounds * sizeof(double));
+        metric->n_bounds = n_bounds;
+    }
+    return metric;
+}
+
+void
+ccnet_metric_add (CcnetMetric *metric, gint64 n)
+{
+    __sync_fetch_and_add (&metric->cells[get_shard () * metric->stride], n);
+}
+
+void
+ccnet_metric_set (CcnetMetric *metric, gint64 value)
+{
+    __sync_lock_test_and_set (&metric->cells[0], value);
+}
+
+void
+ccnet_metric_observe (CcnetMetric *metric, double value)
+{
+    gint64 *row = &metric->cells[get_shard () * metric->stride];
+    int i;
+
+    for (i = 0; i < metric->n_bounds && value > metric->bounds[i]; ++i)
+        ;
+    __sync_fetch_and_add (&row[i], 1);
+    __sync_fetch_and_add (&row[metric->n_bounds + 1],
+                          (gint64)(value * SUM_SCALE));
+}
+
+static void
+append_series (GString *buf, CcnetMetric *metric, const char *suffix,
+               const char *extra_label)
+{
+    const char *labels = metric->labels;
+
+    g_string_append (buf, metric->name);
+    g_string_append (buf, suffix);
+    if (labels || extra_label) {
+        g_string_append_c (buf, '{');
+        if (labels)
+            g_string_append (buf, labels);
+        if (labels && extra_label)
+            g_string_append_c (buf, ',');
+        if (extra_label)
+            g_string_append (buf, extra_label);
+        g_string_append_c (buf, '}');
+    }
+    g_string_append_c (buf, ' ');
+}
+
+static void
+format_metric (GString *buf, CcnetMetric *metric)
+{
+    gint64 count = 0;
+    char le[64];
+    int i;
+
+    switch (metric->type) {
+    case METRIC_COUNTER:
+        append_series (buf, metric, "", NULL);
+        g_string_append_printf (buf, "%" G_GINT64_FORMAT "\n",
+                                sum_shards (metric, 0));
+        break;
+    case METRIC_GAUGE:
+        append_series (buf, metric, "", NULL);
+        g_string_append_printf (buf, "%" G_GINT64_FORMAT "\n",
+                                read_cell (&metric->cells[0]));
+        break;
+    case METRIC_GAUGE_FUNC:
+        append_series (buf, metric, "", NULL);
+        g_string_append_printf (buf, "%" G_GINT64_FORMAT "\n",
+                                metric->func (metric->data));
+        break;
+    case METRIC_HISTOGRAM:
+        for (i = 0; i <= metric->n_bounds; ++i) {
+            count += sum_shards (metric, i);
+            if (i < metric->n_bounds)
+                g_snprintf (le, sizeof(le), "le=\"%g\"", metric->bounds[i]);
+            else
+                g_strlcpy (le, "le=\"+Inf\"", sizeof(le));
+            append_series (buf, metric, "_bucket", le);
+            g_string_append_printf (buf, "%" G_GINT64_FORMAT "\n", count);
+        }
+        append_series (buf, metric, "_sum", NULL);
+        g_string_append_printf (
+            buf, "%.6f\n",
+            sum_shards (metric, metric->n_bounds + 1) / SUM_SCALE);
+        append_series (buf, metric, "_count", NULL);
+        g_string_append_printf (buf, "%" G_GINT64_FORMAT "\n", count);
+        break;
+    }
+}
+
+char *
+ccnet_metrics_format (void)
+{
+    GString *buf = g_string_new (NULL);
+    GHashTable *done;
+    CcnetMetric *metric, *other;
+    guint i, j;
+
+    pthread_mutex_lock (&registry_lock);
+    if (!registry)
+        goto out;
+
+    /* The series of a name are written together, under one header. */
+    done = g_hash_table_new (g_str_hash, g_str_equal);
+    for (i = 0; i < registry->len; ++i) {
+        metric = g_ptr_array_index (registry, i);
+        if (g_hash_table_lookup (done, metric->name))
+            continue;
+        g_hash_table_insert (done, metric->name, metric);
+
+        if (metric->help)
+            g_string_append_printf (buf, "# HELP %s %s\n",
+                                    metric->name, metric->help);
+        g_string_append_printf (buf, "# TYPE %s %s\n",
+                                metric->name, type_names[metric->type]);
+        for (j = i; j < registry->len; ++j) {
+            other = g_ptr_array_index (registry, j);
+            if (strcmp (other->name, metric->name) == 0)
+                format_metric (buf, other);
+        }
+    }
+    g_hash_table_destroy (done);
+
+out:
+    pthread_mutex_unlock (&registry_lock);
+    return g_string_free (buf, FALSE);
+}
+
+static void
+serve_metrics (struct evhttp_request *req, void *arg)
+{
+    struct evbuffer *body;
+    char *text;
+
+    if (evhttp_request_get_command (req) != EVHTTP_REQ_GET) {
+        evhttp_send_error (req, 405, "Method Not Allowed");
+        return;
+    }
+
+    text = ccnet_metrics_format ();
+    body = evbuffer_new ();
+    evbuffer_add (body, text, strlen (text));
+    g_free (text);
+
+    evhttp_add_header (evhttp_request_get_output_headers (req),
+                       "Content-Type", "text/plain; version=0.0.4");
+    evhttp_send_reply (req, HTTP_OK, "OK", body);
+    evbuffer_free (body);
+}
+
+int
+ccnet_metrics_start_server (GKeyFile *keyf)
+{
+    static struct evhttp *http;
+    char *address;
+    int port;
+
+    if (http || !g_key_file_has_key (keyf, "Metrics", "PORT", NULL))
+        return 0;
+
+    port = g_key_file_get_integer (keyf, "Metrics", "PORT", NULL);
+    if (port <= 0 || port > 65535) {
+        ccnet_warning ("[Metrics] Invalid port %d\n", port);
+        return -1;
+    }
+
+    /* Local only unless told otherwise. */
+    address = ccnet_key_file_get_string (keyf, "Metrics", "ADDRESS");
+    if (!address)
+        address = g_strdup ("127.0.0.1");
+
+    http = evhttp_start (address, port);
+    if (!http) {
+        ccnet_warning ("[Metrics] Failed to listen on %s:%d\n", address, port);
+        g_free (address);
+        return -1;
+    }
+    evhttp_set_cb (http, "/metrics", serve_metrics, NULL);
+
+    ccnet_message ("[Metrics] Serving on http://%s:%d/metrics\n",
+                   address, port);
+    g_free (address);
+    return 0;
+}
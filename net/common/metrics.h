@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_METRICS_H
+#define CCNET_METRICS_H
+
+#include <glib.h>
+
+/*
+ * A registry of counters, gauges and histograms, served in the
+ * Prometheus text format at http://ADDRESS:PORT/metrics when the
+ * [Metrics] section of ccnet.conf sets a PORT.
+ *
+ * Counters and histograms may be updated from any thread. Each thread
+ * adds to its own shard of the value, so hot paths don't contend on a
+ * cache line; the shards are summed when the metrics are read.
+ */
+
+typedef struct CcnetMetric CcnetMetric;
+
+/* Reads a gauge when the metrics are served, in the main thread. */
+typedef gint64 (*CcnetMetricReadFunc) (void *data);
+
+/*
+ * @labels are the label pairs of the series without the braces, e.g.
+ * "type=\"request\"", or NULL. Registering the same name and labels
+ * again returns the existing metric.
+ */
+CcnetMetric *
+ccnet_metrics_counter (const char *name, const char *labels,
+                       const char *help);
+
+CcnetMetric *
+ccnet_metrics_gauge (const char *name, const char *labels, const char *help);
+
+CcnetMetric *
+ccnet_metrics_gauge_func (const char *name, const char *labels,
+                          const char *help,
+                          CcnetMetricReadFunc func, void *data);
+
+/* @bounds are the upper bounds of the buckets, in increasing order. */
+CcnetMetric *
+ccnet_metrics_histogram (const char *name, const char *labels,
+                         const char *help,
+                         const double *bounds, int n_bounds);
+
+void ccnet_metric_add (CcnetMetric *metric, gint64 n);
+
+#define ccnet_metric_inc(metric) ccnet_metric_add ((metric), 1)
+
+void ccnet_metric_set (CcnetMetric *metric, gint64 value);
+
+void ccnet_metric_observe (CcnetMetric *metric, double value);
+
+/* All metrics in the Prometheus text format. */
+char *ccnet_metrics_format (void);
+
+/* Serve the metrics if configured, returns -1 on error. */
+int ccnet_metrics_start_server (GKeyFile *keyf);
+
+#endif
@@ -0,0 +1,438 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "timer.h"
+#include "utils.h"
+
+#include "session.h"
+#include "peer.h"
+#include "peer-mgr.h"
+#include "message.h"
+#include "algorithms.h"
+#include "processors/sendmsgs-proc.h"
+#include "outbox.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_MESSAGE
+#include "log.h"
+
+/*
+ * Messages for a peer which is down are appended to segment files
+ * <dir>/<peer id>/<n>.seg as "<len>\n<message>\n" records, the message
+ * in the form of ccnet_message_to_string_buf(). Appends are written
+ * behind: the records of a box are gathered in memory and written and
+ * synced in groups, after SYNC_BATCH messages, FLUSH_BYTES bytes or
+ * SYNC_INTERVAL ms, whichever comes first. ccnet_outbox_sync() writes
+ * them out right away.
+ *
+ * When the peer is back the segments are replayed through its
+ * send-msgs stream, and removed once the stream has acked all of them.
+ * If the stream breaks before that they are replayed again on the next
+ * connection, so a message may be delivered twice.
+ */
+
+#define SEGMENT_MAX_SIZE  (1 << 20)
+#define SYNC_INTERVAL     200           /* ms */
+#define SYNC_BATCH        64
+#define FLUSH_BYTES       (256 << 10)
+
+typedef struct PeerBox {
+    char     peer_id[41];
+    char    *path;
+    int      fd;                /* segment being appended, -1 if none */
+    guint    first_seg;         /* oldest segment on disk */
+    guint    next_seg;          /* next segment to create */
+    gint64   size;              /* bytes on disk */
+    gint64   seg_size;          /* bytes in the open segment */
+    GString *pending;           /* records not written to it yet */
+    int      unsynced;
+    guint    replay_end;        /* segments before it are being replayed */
+} PeerBox;
+
+struct _CcnetOutbox {
+    CcnetSession *session;
+    char         *dir;
+    gint64        max_bytes;
+    GHashTable   *boxes;        /* peer id -> PeerBox */
+    int           unsynced;
+    gsize         pending_bytes;
+    CcnetTimer   *sync_timer;
+};
+
+typedef struct ReplayData {
+    CcnetOutbox *outbox;
+    char         peer_id[41];
+    guint        end;
+} ReplayData;
+
+static char *
+segment_path (PeerBox *box, guint seg)
+{
+    char name[32];
+
+    snprintf (name, sizeof(name), "%010u.seg", seg);
+    return g_build_filename (box->path, name, NULL);
+}
+
+/* Write the pending records to the open segment. The segment is given
+ * up if that fails, its torn tail is skipped by the replay. */
+static void
+flush_box (PeerBox *box)
+{
+    gsize len = box->pending->len;
+
+    if (box->fd < 0 || len == 0)
+        return;
+
+    if (writen (box->fd, box->pending->str, len) != (ssize_t)len) {
+        ccnet_warning ("Failed to write outbox of %.8s: %s\n",
+                       box->peer_id, strerror(errno));
+        box->size -= len;
+        close (box->fd);
+        box->fd = -1;
+        box->unsynced = 0;
+        box->seg_size = 0;
+    }
+    g_string_truncate (box->pending, 0);
+}
+
+static void
+close_segment (PeerBox *box)
+{
+    flush_box (box);
+    if (box->fd < 0)
+        return;
+    if (box->unsynced > 0)
+        fsync (box->fd);
+    close (box->fd);
+    box->fd = -1;
+    box->unsynced = 0;
+    box->seg_size = 0;
+}
+
+static void
+free_box (PeerBox *box)
+{
+    close_segment (box);
+    g_string_free (box->pending, TRUE);
+    g_free (box->path);
+    g_free (box);
+}
+
+/* Find the segments left by a previous run. */
+static void
+scan_box (PeerBox *box)
+{
+    GDir *dir;
+    const char *name;
+    char *path;
+    guint seg;
+    gboolean found = FALSE;
+    struct stat st;
+
+    dir = g_dir_open (box->path, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (!g_str_has_suffix (name, ".seg"))
+            continue;
+        seg = strtoul (name, NULL, 10);
+        if (!found || seg < box->first_seg)
+            box->first_seg = seg;
+        if (!found || seg >= box->next_seg)
+            box->next_seg = seg + 1;
+        found = TRUE;
+
+        path = g_build_filename (box->path, name, NULL);
+        if (g_stat (path, &st) == 0)
+            box->size += st.st_size;
+        g_free (path);
+    }
+    g_dir_close (dir);
+}
+
+static PeerBox *
+get_box (CcnetOutbox *outbox, const char *peer_id, gboolean create)
+{
+    PeerBox *box;
+    char *path;
+
+    box = g_hash_table_lookup (outbox->boxes, peer_id);
+    if (box)
+        return box;
+
+    path = g_build_filename (outbox->dir, peer_id, NULL);
+    if (!create && !g_file_test (path, G_FILE_TEST_IS_DIR)) {
+        g_free (path);
+        return NULL;
+    }
+    if (create && checkdir_with_mkdir (path) < 0) {
+        ccnet_warning ("Failed to create outbox %s\n", path);
+        g_free (path);
+        return NULL;
+    }
+
+    box = g_new0 (PeerBox, 1);
+    memcpy (box->peer_id, peer_id, 40);
+    box->path = path;
+    box->fd = -1;
+    box->pending = g_string_new (NULL);
+    scan_box (box);
+    g_hash_table_insert (outbox->boxes, box->peer_id, box);
+
+    return box;
+}
+
+CcnetOutbox *
+ccnet_outbox_new (CcnetSession *session, const char *dir, gint64 max_bytes)
+{
+    CcnetOutbox *outbox;
+
+    if (checkdir_with_mkdir (dir) < 0) {
+        ccnet_warning ("Failed to create outbox dir %s\n", dir);
+        return NULL;
+    }
+
+    outbox = g_new0 (CcnetOutbox, 1);
+    outbox->session = session;
+    outbox->dir = g_strdup (dir);
+    outbox->max_bytes = max_bytes;
+    outbox->boxes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, (GDestroyNotify)free_box);
+    return outbox;
+}
+
+void
+ccnet_outbox_free (CcnetOutbox *outbox)
+{
+    ccnet_outbox_sync (outbox);
+    ccnet_timer_free (&outbox->sync_timer);
+    g_hash_table_destroy (outbox->boxes);
+    g_free (outbox->dir);
+    g_free (outbox);
+}
+
+static void
+sync_box (gpointer key, gpointer value, gpointer user_data)
+{
+    PeerBox *box = value;
+
+    flush_box (box);
+    if (box->fd >= 0 && box->unsynced > 0) {
+        fsync (box->fd);
+        box->unsynced = 0;
+    }
+}
+
+void
+ccnet_outbox_sync (CcnetOutbox *outbox)
+{
+    if (outbox->unsynced == 0)
+        return;
+    g_hash_table_foreach (outbox->boxes, sync_box, NULL);
+    outbox->unsynced = 0;
+    outbox->pending_bytes = 0;
+}
+
+static int
+sync_timer_cb (void *vdata)
+{
+    CcnetOutbox *outbox = vdata;
+
+    outbox->sync_timer = NULL;
+    ccnet_outbox_sync (outbox);
+    return FALSE;
+}
+
+static int
+open_segment (PeerBox *box)
+{
+    char *path = segment_path (box, box->next_seg);
+
+    box->fd = g_open (path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (box->fd < 0) {
+        ccnet_warning ("Failed to open %s: %s\n", path, strerror(errno));
+        g_free (path);
+        return -1;
+    }
+    g_free (path);
+
+    ++box->next_seg;
+    box->seg_size = 0;
+    return 0;
+}
+
+int
+ccnet_outbox_put (CcnetOutbox *outbox, CcnetMessage *msg)
+{
+    PeerBox *box;
+    GString *buf;
+    char hdr[16];
+
+    /* peer manager messages are only meaningful on a live connection */
+    if (strcmp (msg->app, IPEERMGR_APP) == 0)
+        return -1;
+
+    box = get_box (outbox, msg->to, TRUE);
+    if (!box)
+        return -1;
+
+    buf = g_string_new (NULL);
+    ccnet_message_to_string_buf (msg, buf);
+    snprintf (hdr, sizeof(hdr), "%u\n", (unsigned)buf->len);
+    g_string_prepend (buf, hdr);
+    g_string_append_c (buf, '\n');
+
+    if (box->size + buf->len > outbox->max_bytes) {
+        ccnet_warning ("Outbox of %.8s is full, message dropped\n", msg->to);
+        g_string_free (buf, TRUE);
+        return -1;
+    }
+
+    if (box->fd >= 0 && box->seg_size >= SEGMENT_MAX_SIZE)
+        close_segment (box);
+    if (box->fd < 0 && open_segment (box) < 0) {
+        g_string_free (buf, TRUE);
+        return -1;
+    }
+
+    g_string_append_len (box->pending, buf->str, buf->len);
+    box->seg_size += buf->len;
+    box->size += buf->len;
+    outbox->pending_bytes += buf->len;
+    g_string_free (buf, TRUE);
+
+    ++box->unsynced;
+    if (++outbox->unsynced >= SYNC_BATCH ||
+        outbox->pending_bytes >= FLUSH_BYTES) {
+        ccnet_timer_free (&outbox->sync_timer);
+        ccnet_outbox_sync (outbox);
+    } else if (!outbox->sync_timer)
+        outbox->sync_timer = ccnet_timer_new (sync_timer_cb, outbox,
+                                              SYNC_INTERVAL);
+
+    return 0;
+}
+
+static void
+remove_segments (PeerBox *box, guint end)
+{
+    struct stat st;
+    char *path;
+    guint seg;
+
+    for (seg = box->first_seg; seg != end; ++seg) {
+        path = segment_path (box, seg);
+        if (g_stat (path, &st) == 0)
+            box->size -= st.st_size;
+        g_unlink (path);
+        g_free (path);
+    }
+    box->first_seg = end;
+    if (box->size < 0 || box->first_seg == box->next_seg)
+        box->size = 0;
+}
+
+static void
+on_replay_acked (gboolean acked, void *vdata)
+{
+    ReplayData *data = vdata;
+    PeerBox *box;
+
+    box = g_hash_table_lookup (data->outbox->boxes, data->peer_id);
+    if (box && box->replay_end == data->end) {
+        if (acked) {
+            ccnet_debug ("[msg] Outbox of %.8s delivered\n", data->peer_id);
+            remove_segments (box, data->end);
+        }
+        box->replay_end = 0;
+    }
+    g_free (data);
+}
+
+/* Returns the number of messages sent from the segment. */
+static int
+replay_segment (CcnetOutbox *outbox, PeerBox *box, guint seg)
+{
+    char *path, *contents, *p, *end, *endptr;
+    gsize len;
+    long n;
+    int count = 0;
+    CcnetMessage *msg;
+
+    path = segment_path (box, seg);
+    if (!g_file_get_contents (path, &contents, &len, NULL)) {
+        g_free (path);
+        return 0;
+    }
+
+    p = contents;
+    end = contents + len;
+    while (p < end) {
+        n = strtol (p, &endptr, 10);
+        if (endptr == p || *endptr != '\n' || n <= 0 ||
+            n >= end - (endptr + 1)) {
+            /* a torn append at the end, or garbage */
+            if (end - p > 0)
+                ccnet_warning ("Bad record in %s, skipping the rest\n", path);
+            break;
+        }
+        p = endptr + 1;
+        if (p[n] != '\n')
+            break;
+        p[n] = '\0';
+        msg = ccnet_message_from_string (p, n + 1);
+        if (msg) {
+            ccnet_send_message (outbox->session, msg);
+            ccnet_message_unref (msg);
+            ++count;
+        }
+        p += n + 1;
+    }
+
+    g_free (contents);
+    g_free (path);
+    return count;
+}
+
+void
+ccnet_outbox_replay (CcnetOutbox *outbox, CcnetPeer *peer)
+{
+    PeerBox *box;
+    ReplayData *data;
+    guint seg, end;
+    int count = 0;
+
+    box = get_box (outbox, peer->id, FALSE);
+    if (!box || box->replay_end || box->first_seg == box->next_seg)
+        return;
+
+    /* later messages go to a new segment */
+    close_segment (box);
+    end = box->next_seg;
+
+    for (seg = box->first_seg; seg != end; ++seg)
+        count += replay_segment (outbox, box, seg);
+    ccnet_message ("Replayed %d queued messages to %s(%.8s)\n",
+                   count, peer->name, peer->id);
+
+    if (!peer->msg_stream) {
+        /* no acks from peers without message streams */
+        remove_segments (box, end);
+        return;
+    }
+
+    box->replay_end = end;
+    data = g_new0 (ReplayData, 1);
+    data->outbox = outbox;
+    memcpy (data->peer_id, peer->id, 40);
+    data->end = end;
+    ccnet_sendmsgs_proc_wait_ack (CCNET_SENDMSGS_PROC(peer->msg_stream),
+                                  on_replay_acked, data);
+}
@@ -0,0 +1,29 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_OUTBOX_H
+#define CCNET_OUTBOX_H
+
+#include "message.h"
+
+struct CcnetSession;
+struct _CcnetPeer;
+
+/* Durable queue of messages for peers which are down, see outbox.c */
+typedef struct _CcnetOutbox CcnetOutbox;
+
+CcnetOutbox *ccnet_outbox_new (struct CcnetSession *session,
+                               const char *dir, gint64 max_bytes);
+void ccnet_outbox_free (CcnetOutbox *outbox);
+
+/* Returns -1 if the message is not kept (internal or over the limit).
+ * It is written out later, see ccnet_outbox_sync(). */
+int ccnet_outbox_put (CcnetOutbox *outbox, CcnetMessage *msg);
+
+/* Send the messages kept for @peer, which must be connected. */
+void ccnet_outbox_replay (CcnetOutbox *outbox, struct _CcnetPeer *peer);
+
+/* Write out and sync everything appended so far, for callers which
+ * need the messages on disk before they go on. */
+void ccnet_outbox_sync (CcnetOutbox *outbox);
+
+#endif
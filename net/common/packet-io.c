@@ -15,6 +15,10 @@
 
 #include <event.h>
 /* #include <event2/event.h> */
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#include <event2/bufferevent_ssl.h>
+#endif
 #include <glib.h>
 #include <errno.h>
 #include <string.h>
@@ -22,6 +26,10 @@
 
 #include "session.h"
 #include "packet-io.h"
+#include "timer.h"
+#include "uring.h"
+#include "local-shm.h"
+#include "shm-ring.h"
 
 #include "log.h"
 
@@ -30,9 +38,19 @@
 /* The watermark of the underlying evbuffer. When there are more data than
  * this value is remained in evbuffer, the read event will be removed.
  * So, it must be greater than the max length of a single ccnet packet.
+ * It's raised temporarily while a larger (jumbo or encrypted) packet
+ * is being read.
  */
 #define CCNET_RDBUF 100000
 
+/* Jumbo payload, plus headers and the encryption overhead. */
+#define CCNET_MAX_FRAME_LEN (CCNET_PACKET_MAX_JUMBO_PAYLOAD_LEN + 64)
+
+void bufferevent_setwatermark(struct bufferevent *, short, size_t, size_t);
+
+static int switch_to_tls (CcnetPacketIO *io);
+static int switch_to_shm (CcnetPacketIO *io);
+
 static void
 didWriteWrapper (struct bufferevent *e, void *user_data)
 {
@@ -41,38 +59,92 @@ didWriteWrapper (struct bufferevent *e, void *user_data)
         c->didWrite (e, c->user_data);
 }
 
+/*
+ * A connection handles at most session->read_budget_pkts packets or
+ * read_budget_bytes bytes per wakeup. If complete packets are left in
+ * its input, it joins the ready queue, which is served round robin
+ * from a timer, so one busy peer doesn't hold up the others.
+ */
+static GQueue ready_queue = G_QUEUE_INIT;
+static CcnetTimer *ready_timer;
+
+static int serve_ready_queue (void *unused);
+
 static void
-canReadWrapper (struct bufferevent *e, void *user_data)
+queue_ready (CcnetPacketIO *c)
 {
-    CcnetPacketIO *c = user_data;
-    ccnet_packet *packet;
-    uint32_t len;
+    g_queue_push_tail (&ready_queue, c);
+    c->ready_link = ready_queue.tail;
+    if (!ready_timer)
+        ready_timer = ccnet_timer_new (serve_ready_queue, NULL, 0);
+}
 
-    g_assert (sizeof(ccnet_header) == CCNET_PACKET_LENGTH_HEADER);
+static void
+unqueue_ready (CcnetPacketIO *c)
+{
+    if (c->ready_link) {
+        g_queue_delete_link (&ready_queue, c->ready_link);
+        c->ready_link = NULL;
+    }
+}
+
+/* Returns 1 if the budget ran out with packets left, otherwise 0. */
+static int
+read_packets (CcnetPacketIO *c, struct bufferevent *e)
+{
+    CcnetSession *session = c->session;
+    ccnet_packet *packet;
+    uint32_t len, hdr_len;
+    int n_pkts = 0, n_bytes = 0;
+    int ret = 0;
 
     c->handling = 1;
 
-    /* We have set up the low watermark. The following must be true. */
-    g_assert (EVBUFFER_LENGTH (e->input) >= CCNET_PACKET_LENGTH_HEADER);
+    while (EVBUFFER_LENGTH (e->input) >= CCNET_PACKET_LENGTH_HEADER) {
+        if ((session->read_budget_pkts > 0 &&
+             n_pkts >= session->read_budget_pkts) ||
+            (session->read_budget_bytes > 0 &&
+             n_bytes >= session->read_budget_bytes)) {
+            ret = 1;
+            break;
+        }
 
-    if (c->canRead == NULL) {
-        c->handling = 0;
-        return;
-    }
-    
-    while (1) {
         packet = (ccnet_packet *) EVBUFFER_DATA (e->input);
+        hdr_len = CCNET_PACKET_LENGTH_HEADER;
 
         if (packet->header.type == CCNET_MSG_ENCPACKET)
             len = ntohl (packet->header.id);
-        else
+        else if (packet->header.version == CCNET_PACKET_VERSION_JUMBO) {
+            if (EVBUFFER_LENGTH (e->input) < CCNET_PACKET_LENGTH_JUMBO_HEADER)
+                break;             /* wait for more data */
+            hdr_len = CCNET_PACKET_LENGTH_JUMBO_HEADER;
+            len = ntohl (((ccnet_jumbo_header *)packet)->length);
+        } else
             len = ntohs (packet->header.length);
 
-        if (EVBUFFER_LENGTH (e->input) - CCNET_PACKET_LENGTH_HEADER < len)
+        if (len > CCNET_MAX_FRAME_LEN) {
+            ccnet_warning ("Packet too large: %u bytes\n", len);
+            c->handling = 0;
+            if (c->gotError)
+                c->gotError (e, EVBUFFER_READ | EVBUFFER_ERROR, c->user_data);
+            return 0;
+        }
+
+        if (EVBUFFER_LENGTH (e->input) - hdr_len < len) {
+            if (len + hdr_len > CCNET_RDBUF && !c->rdbuf_raised) {
+                bufferevent_setwatermark (e, EV_READ, CCNET_PACKET_LENGTH_HEADER,
+                                          len + hdr_len);
+                c->rdbuf_raised = 1;
+            }
             break;                 /* wait for more data */
+        }
 
         /* byte order, from network to host */
-        packet->header.length = len;
+        if (hdr_len == CCNET_PACKET_LENGTH_JUMBO_HEADER) {
+            ((ccnet_jumbo_header *)packet)->length = len;
+            packet->header.length = 0;
+        } else
+            packet->header.length = len;
         packet->header.id = ntohl (packet->header.id);
         c->canRead (packet, c->user_data);
 
@@ -81,30 +153,117 @@ canReadWrapper (struct bufferevent *e, void *user_data)
             c->schedule_free = 0;
             c->handling = 0;
             ccnet_packet_io_free (c);
-            break;
+            return 0;
+        }
+
+        evbuffer_drain (e->input, len + hdr_len);
+        ++n_pkts;
+        n_bytes += len + hdr_len;
+
+        if (c->rdbuf_raised) {
+            bufferevent_setwatermark (e, EV_READ, CCNET_PACKET_LENGTH_HEADER,
+                                      CCNET_RDBUF);
+            c->rdbuf_raised = 0;
         }
 
-        evbuffer_drain (e->input, len + CCNET_PACKET_LENGTH_HEADER);
+        /* The handshake started TLS, @e may be gone after the switch. */
+        if (c->tls_ssl) {
+            c->handling = 0;
+            if (switch_to_tls (c) < 0 && c->gotError)
+                c->gotError (c->bufev, BEV_EVENT_ERROR, c->user_data);
+            return 0;
+        }
 
-        if(EVBUFFER_LENGTH(e->input) >= CCNET_PACKET_LENGTH_HEADER)
-            continue;
-        
-        break;
+        /* Likewise, the client sends nothing more on the socket. */
+        if (c->shm_pending) {
+            c->handling = 0;
+            if (switch_to_shm (c) < 0 && c->gotError)
+                c->gotError (c->bufev, BEV_EVENT_ERROR, c->user_data);
+            return 0;
+        }
+
+        if (c->canRead == NULL)
+            break;
     }
 
     c->handling = 0;
+    return ret;
+}
+
+/* Give each queued connection one more budget, in the order they ran
+ * out. Those which run out again go to the back. */
+static int
+serve_ready_queue (void *unused)
+{
+    guint n = g_queue_get_length (&ready_queue);
+    CcnetPacketIO *c;
+
+    while (n-- > 0 && !g_queue_is_empty (&ready_queue)) {
+        c = g_queue_pop_head (&ready_queue);
+        c->ready_link = NULL;
+        if (c->canRead && read_packets (c, c->bufev) == 1)
+            queue_ready (c);
+    }
+
+    if (g_queue_is_empty (&ready_queue)) {
+        ready_timer = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+canReadWrapper (struct bufferevent *e, void *user_data)
+{
+    CcnetPacketIO *c = user_data;
+
+    g_assert (sizeof(ccnet_header) == CCNET_PACKET_LENGTH_HEADER);
+
+    /* We have set up the low watermark. The following must be true. */
+    g_assert (EVBUFFER_LENGTH (e->input) >= CCNET_PACKET_LENGTH_HEADER);
+
+    if (c->canRead == NULL)
+        return;
+
+    /* Waiting for its turn, the new data is read with the rest. */
+    if (c->ready_link)
+        return;
+
+    if (read_packets (c, e) == 1)
+        queue_ready (c);
 }
 
 static void
 gotErrorWrapper (struct bufferevent *e, short what, void *user_data)
 {
     CcnetPacketIO *c = user_data;
+
+    if (what & BEV_EVENT_CONNECTED) {
+        ccnet_tls_ready_cb ready = c->tlsReady;
+
+        c->tlsReady = NULL;
+        if (ready)
+            ready (c, c->user_data);
+        return;
+    }
+
     if (c->gotError)
         c->gotError (e, what, c->user_data);
 }
 
 
-void bufferevent_setwatermark(struct bufferevent *, short, size_t, size_t);
+static void
+setup_bufev (CcnetPacketIO *io)
+{
+    bufferevent_setcb (io->bufev, canReadWrapper,
+                       didWriteWrapper, gotErrorWrapper, io);
+    bufferevent_enable (io->bufev, EV_READ | EV_WRITE);
+    bufferevent_setwatermark (io->bufev, EV_READ, CCNET_PACKET_LENGTH_HEADER, 
+                              CCNET_RDBUF);
+
+    /* the write callback fires once the output drains to out_low */
+    bufferevent_setwatermark (io->bufev, EV_WRITE, io->out_low, 0);
+}
 
 static CcnetPacketIO*
 ccnet_packet_io_new (struct CcnetSession     *session,
@@ -124,12 +283,20 @@ ccnet_packet_io_new (struct CcnetSession     *session,
         memcpy (io->addr, addr, sizeof(struct sockaddr_storage));
     }
 
-    io->bufev = bufferevent_socket_new (NULL, io->socket, BEV_OPT_CLOSE_ON_FREE);
-    bufferevent_setcb (io->bufev, canReadWrapper,
-                       didWriteWrapper, gotErrorWrapper, io);
-    bufferevent_enable (io->bufev, EV_READ | EV_WRITE);
-    bufferevent_setwatermark (io->bufev, EV_READ, CCNET_PACKET_LENGTH_HEADER, 
-                              CCNET_RDBUF);
+    /* Local clients come without an address, over loopback or a unix
+     * socket. */
+    if (addr && session->sock_opts[is_incoming ? 1 : 0])
+        ccnet_net_set_sockopts (socket, session->sock_opts[is_incoming ? 1 : 0]);
+
+    io->out_high = session->out_high_wm;
+    io->out_low = session->out_low_wm;
+    if (addr && session->uring)
+        io->uring = ccnet_uring_conn_new (session->uring, io->socket,
+                                          &io->bufev);
+    if (!io->uring)
+        io->bufev = bufferevent_socket_new (NULL, io->socket,
+                                            BEV_OPT_CLOSE_ON_FREE);
+    setup_bufev (io);
 
     /* do not BEV_OPT_CLOSE_ON_FREE, since ccnet_packet_io_free() will
      * handle it */
@@ -183,6 +350,15 @@ ccnet_packet_io_new_outgoing (CcnetSession *session,
 }
 
 
+CcnetPacketIO *
+ccnet_packet_io_new_connected (CcnetSession *session,
+                               struct sockaddr_storage *addr,
+                               evutil_socket_t socket)
+{
+    return ccnet_packet_io_new (session, addr, FALSE, socket);
+}
+
+
 void
 ccnet_packet_io_free (CcnetPacketIO *io)
 {
@@ -192,6 +368,12 @@ ccnet_packet_io_free (CcnetPacketIO *io)
             return;
         }
 
+        unqueue_ready (io);
+
+#ifdef HAVE_TLS
+        if (io->tls_ssl)
+            SSL_free (io->tls_ssl);
+#endif
         if (io->addr)
             g_free (io->addr);
             
@@ -199,6 +381,11 @@ ccnet_packet_io_free (CcnetPacketIO *io)
         io->didWrite = NULL;
         io->gotError = NULL;
 
+        if (io->uring)
+            ccnet_uring_conn_close (io->uring);
+        if (io->shm)
+            ccnet_shm_conn_close (io->shm);
+        ccnet_shm_free (io->shm_pending);
         bufferevent_free (io->bufev);
         /* fprintf (stderr, "close fd %d\n", io->socket); */
         /* close (io->socket); */
@@ -262,6 +449,125 @@ ccnet_packet_io_set_timeout_secs (CcnetPacketIO *io, int secs)
     /*     bufferevent_set_timeouts (io->bufev, NULL, NULL); */
 }
 
+static int
+switch_to_shm (CcnetPacketIO *io)
+{
+    struct CcnetShm *shm = io->shm_pending;
+    struct bufferevent *bev;
+
+    io->shm_pending = NULL;
+    io->shm = ccnet_shm_conn_new (shm, io->bufev, &bev);
+    if (!io->shm) {
+        ccnet_shm_free (shm);
+        return -1;
+    }
+
+    io->bufev = bev;
+    io->rdbuf_raised = 0;
+    setup_bufev (io);
+    bufferevent_settimeout (io->bufev, io->timeout, io->timeout);
+
+    return 0;
+}
+
+void
+ccnet_packet_io_switch_to_shm (CcnetPacketIO *io, struct CcnetShm *shm)
+{
+    g_return_if_fail (io->handling && !io->shm && !io->shm_pending);
+
+    io->shm_pending = shm;
+}
+
+#ifdef HAVE_TLS
+
+static int
+switch_to_tls (CcnetPacketIO *io)
+{
+    struct evbuffer *output = bufferevent_get_output (io->bufev);
+    struct evbuffer *input = bufferevent_get_input (io->bufev);
+    enum bufferevent_ssl_state state = io->tls_server
+        ? BUFFEREVENT_SSL_ACCEPTING : BUFFEREVENT_SSL_CONNECTING;
+    struct bufferevent *bev;
+    SSL *ssl = io->tls_ssl;
+
+    /* Freed by libevent from now on, even if it fails. */
+    io->tls_ssl = NULL;
+
+    /* Kernel TLS needs the SSL on the socket itself, which is possible
+     * once our handshake packet is out and nothing more was read. The
+     * peer waits for that packet before it starts TLS, so this is the
+     * rule, otherwise TLS runs on top of the plain bufferevent, or of
+     * the io_uring pair. */
+    while (!io->uring && evbuffer_get_length (output) > 0 &&
+           evbuffer_write (output, io->socket) > 0)
+        ;
+    if (!io->uring && evbuffer_get_length (output) == 0 &&
+        evbuffer_get_length (input) == 0) {
+        bev = bufferevent_openssl_socket_new (NULL, io->socket, ssl, state,
+                                              BEV_OPT_CLOSE_ON_FREE);
+        if (!bev)
+            return -1;
+        bufferevent_disable (io->bufev, EV_READ | EV_WRITE);
+        bufferevent_setfd (io->bufev, -1);
+        bufferevent_free (io->bufev);
+    } else {
+        bev = bufferevent_openssl_filter_new (NULL, io->bufev, ssl, state,
+                                              BEV_OPT_CLOSE_ON_FREE);
+        if (!bev)
+            return -1;
+    }
+
+    io->bufev = bev;
+    io->rdbuf_raised = 0;
+    setup_bufev (io);
+    bufferevent_settimeout (io->bufev, io->timeout, io->timeout);
+
+    return 0;
+}
+
+int
+ccnet_packet_io_start_tls (CcnetPacketIO *io, gboolean server,
+                           ccnet_tls_ready_cb ready)
+{
+    SSL *ssl;
+
+    ssl = SSL_new (io->session->tls_ctx);
+    if (!ssl)
+        return -1;
+
+    io->tls_ssl = ssl;
+    io->tls_server = server ? 1 : 0;
+    io->tls = 1;
+    io->tlsReady = ready;
+
+    if (io->handling)
+        return 0;               /* see read_packets() */
+    return switch_to_tls (io);
+}
+
+#else
+
+static int
+switch_to_tls (CcnetPacketIO *io)
+{
+    return -1;
+}
+
+int
+ccnet_packet_io_start_tls (CcnetPacketIO *io, gboolean server,
+                           ccnet_tls_ready_cb ready)
+{
+    return -1;
+}
+
+#endif  /* HAVE_TLS */
+
+size_t
+ccnet_packet_io_output_length (CcnetPacketIO *io)
+{
+    return evbuffer_get_length (bufferevent_get_output (io->bufev));
+}
+
 void
 ccnet_packet_io_write_packet (CcnetPacketIO *io, ccnet_packet *packet)
 {
@@ -13,6 +13,9 @@ struct evbuffer;
 struct bufferevent;
 struct CcnetSession;
 struct ccnet_packet;
+struct CcnetUringConn;
+struct CcnetShm;
+struct CcnetShmConn;
 
 typedef void (*ccnet_can_read_cb)(struct ccnet_packet *, void* user_data);
 typedef void (*ccnet_did_write_cb)(struct bufferevent *, void *);
@@ -20,14 +23,32 @@ typedef void (*ccnet_net_error_cb)(struct bufferevent *, short what, void *);
 
 typedef struct CcnetPacketIO CcnetPacketIO;
 
+typedef void (*ccnet_tls_ready_cb)(CcnetPacketIO *, void *user_data);
+
 struct CcnetPacketIO
 {
     unsigned int          is_incoming : 1;
     unsigned int          handling : 1;      /* handling event from this IO */
     unsigned int          schedule_free : 1;
+    unsigned int          jumbo : 1;         /* peer accepts jumbo packets */
+    unsigned int          batch_enc : 1;     /* and batched ENCPACKETs */
+    unsigned int          compress : 2;      /* CCNET_COMPRESS_XXX to send */
+    unsigned int          rdbuf_raised : 1;  /* reading a packet larger
+                                              * than CCNET_RDBUF */
+    unsigned int          tls : 1;           /* packets go over TLS */
+    unsigned int          tls_server : 1;
+    unsigned int          trace : 1;         /* peer takes trace tokens */
+
+    /* in the queue of connections with packets left over */
+    GList                *ready_link;
  
     int                   timeout;
 
+    /* Writers are asked to pause when the output grows beyond out_high,
+     * and resumed when it drains to out_low. */
+    size_t                out_high;
+    size_t                out_low;
+
     struct sockaddr      *addr;
     evutil_socket_t       socket;
 
@@ -35,10 +56,23 @@ struct CcnetPacketIO
   
     struct bufferevent   *bufev;
 
+    /* set if io_uring drives the socket, see uring.h */
+    struct CcnetUringConn *uring;
+
+    /* A local client on shared memory, and the rings to switch to
+     * after the packet being read, see local-shm.h. */
+    struct CcnetShmConn  *shm;
+    struct CcnetShm      *shm_pending;
+
     ccnet_can_read_cb     canRead;
     ccnet_did_write_cb    didWrite;
     ccnet_net_error_cb    gotError;
     void                 *user_data;
+
+    /* The SSL to switch to after the packet being read, and the
+     * callback for BEV_EVENT_CONNECTED once the TLS handshake is done. */
+    struct ssl_st        *tls_ssl;
+    ccnet_tls_ready_cb    tlsReady;
 };
 
 
@@ -48,6 +82,12 @@ ccnet_packet_io_new_outgoing (struct CcnetSession *session,
                               const char *addr_str, uint16_t port);
 
 
+/* For an outgoing socket which is already connected. */
+CcnetPacketIO*
+ccnet_packet_io_new_connected (struct CcnetSession      *session,
+                               struct sockaddr_storage  *addr,
+                               evutil_socket_t socket);
+
 CcnetPacketIO*
 ccnet_packet_io_new_incoming (struct CcnetSession      *session,
                               struct sockaddr_storage  *addr,
@@ -68,10 +108,25 @@ void  ccnet_packet_io_set_timeout_secs (CcnetPacketIO *io, int secs);
 
 void  ccnet_packet_io_write_packet (CcnetPacketIO *io, ccnet_packet *packet);
 
+/* bytes waiting in the output buffer */
+size_t ccnet_packet_io_output_length (CcnetPacketIO *io);
+
 void  ccnet_packet_io_set_iofuncs (CcnetPacketIO *io,
                                    ccnet_can_read_cb  readcb,
                                    ccnet_did_write_cb writecb,
                                    ccnet_net_error_cb errcb,
                                    void *user_data);
 
+/* Run the connection over TLS from now on (after the packet being read,
+ * if called from canRead), as the server or the client of
+ * session->tls_ctx, see tls.h. The packets written before still go out
+ * in plain. @ready is called with the io's user data once the TLS
+ * handshake is done. */
+int   ccnet_packet_io_start_tls (CcnetPacketIO *io, gboolean server,
+                                 ccnet_tls_ready_cb ready);
+
+/* Move a local client to @shm after the packet being read, it must be
+ * called from canRead. */
+void  ccnet_packet_io_switch_to_shm (CcnetPacketIO *io, struct CcnetShm *shm);
+
 #endif
@@ -6,25 +6,40 @@
 #include <dirent.h>
 #include <stdio.h>
 #include <glib/gstdio.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <pthread.h>
 
 #include "timer.h"
 #include "ccnet-db.h"
 #include "net.h"
 
 #include "peer.h"
+#include "peer-table.h"
 #include "session.h"
 #include "ccnet-config.h"
 #include "peer-mgr.h"
+#include "peer-snapshot.h"
 #include "peermgr-message.h"
 #include "connect-mgr.h"
 
 #include "algorithms.h"
 #include "utils.h"
+#include "rsa.h"
+#include "job-mgr.h"
+#include "processors/keepalive2-proc.h"
 
 #ifdef CCNET_DAEMON
 #include "daemon-session.h"
 #endif
 
+#ifdef CCNET_CLUSTER
+#include "cluster-mgr.h"
+#include "peer-dir.h"
+extern CcnetClusterManager *cluster_mgr;
+#endif
+
 #define DEBUG_FLAG  CCNET_DEBUG_PEER
 #include "log.h"
 
@@ -32,8 +47,21 @@
 #define DEFAULT_NOTIFY_INTERVAL      86400 * 2
 
 #define SAVING_INTERVAL_MSEC 10000
+#define DEFAULT_ADDR_SAVE_DELAY 5     /* seconds without changes */
+#define ADDR_SAVE_MAX_DELAY    60     /* for addresses which keep changing */
 #define PEER_GC_TIMEOUT      3*60
+#define DEFAULT_PEER_GC_BUDGET 1000   /* peers collected per pulse */
+#define KEEPALIVE_PULSE        1000   /* one wheel slot per second */
+#define KEEPALIVE_WHEEL_SIZE   256    /* must be a power of 2 */
+#define DEFAULT_KEEPALIVE_INTERVAL 180   /* 3min */
+#define TRIM_PULSE_MSEC        60000
+#define VIEW_PULSE_MSEC        100
+#define DEFAULT_VIEW_MAX_AGE   1000     /* msec */
+#define VIEW_IDLE_TIME         300      /* dropped after 5min unused */
+#define DEFAULT_IDLE_TRIM_SECS 300   /* without new processors */
 #define PEERDB_NAME       "peer-db"
+#define SNAPSHOT_NAME     "peer-snapshot"       /* in PeerMgr */
+#define SNAPSHOT_INTERVAL 300   /* at most every 5min, and on exit */
 
 struct CcnetPeerManagerPriv {
     CcnetDB     *db;
@@ -41,8 +69,75 @@ struct CcnetPeerManagerPriv {
 
     /* the list of peers to be resolved */
     GList       *resolve_peers;
+
+    /* Peers with unsaved changes, keyed by id and holding a
+     * reference. Visited by save_pulse(). */
+    GHashTable  *dirty_peers;
+
+    /* Addresses to be written to PeerAddr, id -> PendingAddr. Written
+     * together by save_pulse() once they stop changing. */
+    GHashTable  *pending_addrs;
+    int          addr_save_delay;
+
+    /* Down peers which may have to be collected, ordered by
+     * gc_deadline and holding a reference. See collect_peers(). */
+    GSequence   *gc_queue;
+    int          gc_budget;     /* <= 0 for no limit */
+
+    /* With LAZY_PEER_LOAD, peers in peer-db which are not loaded yet,
+     * id -> PeerRecord. See materialize_peer(). */
+    GHashTable  *unloaded;
+
+    /* With PEER_SNAPSHOT, peers in the snapshot are loaded on first
+     * use like the unloaded ones. snap_taken holds the ids which are
+     * not to be loaded from it any more. See peer-snapshot.h. */
+    gboolean     use_snapshot;
+    CcnetPeerSnapshot *snapshot;
+    GHashTable  *snap_taken;
+    CcnetPeerSnapshotSources snap_src;
+    char        *snap_path;
+    gboolean     snap_dirty;
+    time_t       snap_written;
+
+    /* Peers of peer_table by role: interned role -> (id -> peer). */
+    GHashTable  *role_index;
+
+    /* Keepalive2 processors hashed by deadline in seconds, so that all
+     * peers are served by one timer. Deadlines further than a revolution
+     * away are checked and put back once per revolution. */
+    struct list_head  ka_wheel[KEEPALIVE_WHEEL_SIZE];
+    time_t            ka_wheel_time;    /* next second to be processed */
+    int               keepalive_interval;
+    int               idle_trim_secs;   /* <= 0 to never trim */
+
+#ifdef CCNET_SERVER
+    /* The view of the peers for other threads, rebuilt by view_pulse()
+     * when a reader finds it older than view_max_age. view_lock guards
+     * the fields, not the view. */
+    pthread_mutex_t   view_lock;
+    pthread_cond_t    view_cond;
+    CcnetPeerView    *view;
+    gboolean          view_wanted;
+    gint64            view_taken;       /* usec */
+    gint64            view_max_age;     /* usec */
+#endif
+    GHashTable       *role_keepalive;   /* interned role -> seconds */
 };
 
+/* Address and roles of a peer, from PeerAddr and PeerRole. */
+typedef struct PeerRecord {
+    char    *roles;
+    char    *addr;
+    int      port;
+} PeerRecord;
+
+typedef struct PendingAddr {
+    char    *addr;          /* NULL to delete the row */
+    int      port;
+    time_t   first_change;
+    time_t   last_change;
+} PendingAddr;
+
 
 enum {
     ADDED_SIG,
@@ -60,9 +155,16 @@ static guint signals[LAST_SIGNAL] = { 0 };
 
 /* static int notify_pulse (CcnetPeerManager *manager); */
 static int open_db (CcnetPeerManager *manager);
-static void save_peer_addr(CcnetPeerManager *manager, CcnetPeer *peer);
+static void pending_addr_free (gpointer data);
+static void queue_peer_addr (CcnetPeerManager *manager, CcnetPeer *peer);
+static void write_peer_addrs (CcnetPeerManager *manager, gboolean all);
 static void remove_peer_roles(CcnetPeerManager *manager, char *peer_id);
+static CcnetPeer *materialize_peer (CcnetPeerManager *manager,
+                                    const char *peer_id);
+static void materialize_peers (CcnetPeerManager *manager, const char *role);
 void ccnet_peer_manager_load_peerdb (CcnetPeerManager *manager);
+static void load_snapshot (CcnetPeerManager *manager);
+static void write_snapshot (CcnetPeerManager *manager);
 
 
 static void
@@ -99,7 +201,157 @@ ccnet_peer_manager_class_init (CcnetPeerManagerClass *klass)
 static void
 ccnet_peer_manager_init (CcnetPeerManager *manager)
 {
+    int i;
+
     manager->priv = GET_PRIV (manager);
+    manager->priv->dirty_peers = g_hash_table_new_full (
+        g_str_hash, g_str_equal, NULL, g_object_unref);
+    manager->priv->gc_queue = g_sequence_new (NULL);
+    manager->priv->gc_budget = DEFAULT_PEER_GC_BUDGET;
+    manager->priv->pending_addrs = g_hash_table_new_full (
+        g_str_hash, g_str_equal, g_free, pending_addr_free);
+    manager->priv->addr_save_delay = DEFAULT_ADDR_SAVE_DELAY;
+    manager->priv->role_index = g_hash_table_new_full (
+        g_direct_hash, g_direct_equal, NULL,
+        (GDestroyNotify)g_hash_table_destroy);
+
+    for (i = 0; i < KEEPALIVE_WHEEL_SIZE; i++)
+        INIT_LIST_HEAD (&manager->priv->ka_wheel[i]);
+    manager->priv->keepalive_interval = DEFAULT_KEEPALIVE_INTERVAL;
+    manager->priv->idle_trim_secs = DEFAULT_IDLE_TRIM_SECS;
+#ifdef CCNET_SERVER
+    pthread_mutex_init (&manager->priv->view_lock, NULL);
+    pthread_cond_init (&manager->priv->view_cond, NULL);
+    manager->priv->view_max_age = DEFAULT_VIEW_MAX_AGE * 1000;
+#endif
+    manager->priv->role_keepalive = g_hash_table_new (g_direct_hash,
+                                                      g_direct_equal);
+}
+
+/* @role must be interned. The index doesn't hold references, peers
+ * are unindexed before they leave peer_table. */
+static void
+index_role (CcnetPeerManager *manager, CcnetPeer *peer, const char *role)
+{
+    GHashTable *peers;
+
+    peers = g_hash_table_lookup (manager->priv->role_index, role);
+    if (!peers) {
+        peers = g_hash_table_new (g_str_hash, g_str_equal);
+        g_hash_table_insert (manager->priv->role_index, (gpointer)role, peers);
+    }
+    g_hash_table_insert (peers, peer->id, peer);
+}
+
+static void
+unindex_role (CcnetPeerManager *manager, CcnetPeer *peer, const char *role)
+{
+    GHashTable *peers;
+
+    peers = g_hash_table_lookup (manager->priv->role_index, role);
+    if (peers && g_hash_table_lookup (peers, peer->id) == peer)
+        g_hash_table_remove (peers, peer->id);
+}
+
+static void
+index_peer_roles (CcnetPeerManager *manager, CcnetPeer *peer, gboolean add)
+{
+    const char *role;
+    guint i;
+
+    for (i = 0; i < ccnet_str_set_size (&peer->roles); ++i) {
+        role = ccnet_str_set_index (&peer->roles, i);
+        if (add)
+            index_role (manager, peer, role);
+        else
+            unindex_role (manager, peer, role);
+    }
+}
+
+void
+ccnet_peer_manager_on_role_changed (CcnetPeerManager *manager,
+                                    CcnetPeer *peer,
+                                    const char *role,
+                                    gboolean added)
+{
+    /* Only peers in peer_table are listed by role. */
+    if (ccnet_peer_table_lookup_raw (manager->peer_table, peer->raw_id) != peer)
+        return;
+
+    manager->priv->snap_dirty = TRUE;
+    if (added)
+        index_role (manager, peer, role);
+    else
+        unindex_role (manager, peer, role);
+}
+
+static void
+track_peer (GHashTable *set, CcnetPeer *peer)
+{
+    if (!g_hash_table_lookup (set, peer->id))
+        g_hash_table_insert (set, peer->id, g_object_ref (peer));
+}
+
+void
+ccnet_peer_manager_mark_dirty (CcnetPeerManager *manager, CcnetPeer *peer)
+{
+    peer->need_saving = 1;
+    if (!peer->is_self) {
+        track_peer (manager->priv->dirty_peers, peer);
+        manager->priv->snap_dirty = TRUE;
+    }
+}
+
+static gint
+compare_gc_deadline (gconstpointer a, gconstpointer b, gpointer unused)
+{
+    const CcnetPeer *pa = a, *pb = b;
+
+    if (pa->gc_deadline < pb->gc_deadline)
+        return -1;
+    return pa->gc_deadline > pb->gc_deadline;
+}
+
+static void
+schedule_gc (CcnetPeerManager *manager, CcnetPeer *peer, time_t deadline)
+{
+    if (peer->gc_iter)
+        g_sequence_remove (peer->gc_iter);
+    else
+        g_object_ref (peer);
+
+    peer->gc_deadline = deadline;
+    peer->gc_iter = g_sequence_insert_sorted (
+        manager->priv->gc_queue, peer, compare_gc_deadline, NULL);
+}
+
+static void
+unschedule_gc (CcnetPeerManager *manager, CcnetPeer *peer)
+{
+    if (!peer->gc_iter)
+        return;
+    g_sequence_remove (peer->gc_iter);
+    peer->gc_iter = NULL;
+    g_object_unref (peer);
+}
+
+void
+ccnet_peer_manager_on_peer_down (CcnetPeerManager *manager, CcnetPeer *peer)
+{
+#ifdef CCNET_SERVER
+    if (!peer->is_self && !peer->is_local)
+        schedule_gc (manager, peer, peer->last_down + PEER_GC_TIMEOUT);
+#endif
+#ifdef CCNET_CLUSTER
+    ccnet_cluster_manager_on_peer_down (cluster_mgr, manager, peer);
+#endif
+}
+
+static void
+untrack_peer (CcnetPeerManager *manager, CcnetPeer *peer)
+{
+    g_hash_table_remove (manager->priv->dirty_peers, peer->id);
+    unschedule_gc (manager, peer);
 }
 
 
@@ -112,7 +364,7 @@ ccnet_peer_manager_new (CcnetSession *session)
 
     manager->session = session;
 
-    manager->peer_hash = g_hash_table_new (g_str_hash, g_str_equal);
+    manager->peer_table = ccnet_peer_table_new ();
 
     return manager;
 }
@@ -128,22 +380,34 @@ ccnet_peer_manager_prepare (CcnetPeerManager *manager)
     peer->name = (char *)session->base.name;
     peer->public_port = session->base.public_port;
     peer->port = session->base.public_port;
-    peer->service_url = session->base.service_url;
+    peer->service_url = (char *)ccnet_str_ref (session->base.service_url);
     peer->pubkey = session->pubkey;
     /* set to -1 so it will not be saved in to_string() */
     peer->net_state = -1;
     peer->is_self = 1;
     peer->manager = manager;
     
-    g_hash_table_insert (manager->peer_hash, peer->id, peer);
+    ccnet_peer_table_insert (manager->peer_table, peer);
     session->myself = peer;
 
+    if (g_key_file_get_boolean (session->keyf, "Network", "PEER_SNAPSHOT",
+                                NULL))
+        load_snapshot (manager);
+
     return 0;
 }
 
 void
 ccnet_peer_manager_free (CcnetPeerManager *manager)
 {
+    CcnetPeerManagerPriv *priv = manager->priv;
+
+    ccnet_peer_snapshot_close (priv->snapshot);
+    if (priv->snap_taken)
+        g_hash_table_destroy (priv->snap_taken);
+    g_free (priv->snap_src.peerdb_dir);
+    g_free (priv->snap_src.db_path);
+    g_free (priv->snap_path);
     g_free (manager->peerdb_path);
     g_object_unref (manager);
 }
@@ -151,7 +415,59 @@ ccnet_peer_manager_free (CcnetPeerManager *manager)
 GList *
 ccnet_peer_manager_get_peer_list (CcnetPeerManager *manager)
 {
-    return g_hash_table_get_values (manager->peer_hash);
+    materialize_peers (manager, NULL);
+    return ccnet_peer_table_get_values (manager->peer_table);
+}
+
+static void
+foreach_peer (CcnetPeerManager *manager, const char *role,
+              gboolean connected, CcnetPeerFunc func, void *data)
+{
+    CcnetPeerTableIter iter;
+    CcnetPeer *peer;
+
+    ccnet_peer_table_freeze (manager->peer_table);
+    ccnet_peer_table_iter_init (&iter, manager->peer_table);
+    while (ccnet_peer_table_iter_next (&iter, &peer)) {
+        if (connected && peer->net_state != PEER_CONNECTED)
+            continue;
+        if (role && !ccnet_peer_has_role (peer, role))
+            continue;
+        if (!func (peer, data))
+            break;
+    }
+    ccnet_peer_table_thaw (manager->peer_table);
+}
+
+void
+ccnet_peer_manager_foreach (CcnetPeerManager *manager,
+                            CcnetPeerFunc func, void *data)
+{
+    materialize_peers (manager, NULL);
+    foreach_peer (manager, NULL, FALSE, func, data);
+}
+
+/* Peers not loaded yet are never connected. */
+void
+ccnet_peer_manager_foreach_connected (CcnetPeerManager *manager,
+                                      CcnetPeerFunc func, void *data)
+{
+    foreach_peer (manager, NULL, TRUE, func, data);
+}
+
+void
+ccnet_peer_manager_foreach_with_role (CcnetPeerManager *manager,
+                                      const char *role,
+                                      CcnetPeerFunc func, void *data)
+{
+    GQuark quark;
+
+    materialize_peers (manager, role);
+
+    /* Roles which were never interned have no peers. */
+    quark = g_quark_try_string (role);
+    if (quark)
+        foreach_peer (manager, g_quark_to_string (quark), FALSE, func, data);
 }
 
 GList*
@@ -160,16 +476,25 @@ ccnet_peer_manager_get_peers_with_role (CcnetPeerManager *manager,
 {
     GHashTableIter iter;
     gpointer key, value;
-    CcnetPeer *peer;
+    GHashTable *peers;
+    GQuark quark;
     GList *list = 0;
 
-    g_hash_table_iter_init (&iter, manager->peer_hash);
+    materialize_peers (manager, role);
+
+    /* Roles which were never interned have no peers. */
+    quark = g_quark_try_string (role);
+    if (!quark)
+        return NULL;
+    peers = g_hash_table_lookup (manager->priv->role_index,
+                                 g_quark_to_string (quark));
+    if (!peers)
+        return NULL;
+
+    g_hash_table_iter_init (&iter, peers);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
-        peer = value;
-        if (ccnet_peer_has_role(peer, role)) {
-            list = g_list_prepend (list, peer);
-            g_object_ref (peer);
-        }
+        list = g_list_prepend (list, value);
+        g_object_ref (value);
     }
     return list;
 }
@@ -178,14 +503,36 @@ ccnet_peer_manager_get_peers_with_role (CcnetPeerManager *manager,
 static void
 add_peer (CcnetPeerManager *manager, CcnetPeer *peer)
 {
+    CcnetPeer *old;
+
     peer->manager = manager;
 
     g_assert (peer->id != NULL);
+    old = ccnet_peer_table_lookup (manager->peer_table, peer->id);
+    if (old && old != peer) {
+        index_peer_roles (manager, old, FALSE);
+#ifdef CCNET_CLUSTER
+        ccnet_peer_dir_remove (old);
+#endif
+    }
     g_object_ref (peer);
-    g_hash_table_insert (manager->peer_hash, peer->id, peer);
+    ccnet_peer_table_insert (manager->peer_table, peer);
+    index_peer_roles (manager, peer, TRUE);
+#ifdef CCNET_CLUSTER
+    ccnet_peer_dir_add (peer);
+#endif
+    if (manager->priv->unloaded)
+        g_hash_table_remove (manager->priv->unloaded, peer->id);
+    if (manager->priv->snap_taken)
+        g_hash_table_add (manager->priv->snap_taken, g_strdup (peer->id));
 
     if (!peer->is_self) {
+        manager->priv->snap_dirty = TRUE;
         g_signal_emit (manager, signals[ADDED_SIG], 0, peer);
+        if (peer->need_saving)
+            track_peer (manager->priv->dirty_peers, peer);
+        if (peer->net_state == PEER_DOWN)
+            ccnet_peer_manager_on_peer_down (manager, peer);
     }
 }
 
@@ -193,7 +540,7 @@ void
 ccnet_peer_manager_add_peer (CcnetPeerManager *manager, CcnetPeer *peer)
 {
     add_peer (manager, peer);
-    peer->need_saving = 1;
+    ccnet_peer_manager_mark_dirty (manager, peer);
 }
 
 static void
@@ -206,8 +553,17 @@ delete_peer(CcnetPeerManager *manager, CcnetPeer *peer)
 
     if (g_unlink(path) < 0)
         ccnet_warning("delete file %s error\n", path);
+    if (manager->priv->use_snapshot) {
+        ccnet_peer_snapshot_sources_update (&manager->priv->snap_src);
+        manager->priv->snap_dirty = TRUE;
+    }
 
-    g_hash_table_remove (manager->peer_hash, peer->id);
+    index_peer_roles (manager, peer, FALSE);
+    ccnet_peer_table_remove (manager->peer_table, peer);
+#ifdef CCNET_CLUSTER
+    ccnet_peer_dir_remove (peer);
+#endif
+    untrack_peer (manager, peer);
     remove_peer_roles (manager, peer->id);
     g_signal_emit (manager, signals[DELETING_SIG], 0, peer);
 
@@ -278,7 +634,7 @@ ccnet_peer_manager_on_peer_resolved (CcnetPeerManager *manager,
     peer->to_resolve = 0;
     ccnet_conn_manager_remove_from_conn_list (manager->session->connMgr, peer);
 
-    save_peer_addr (manager, peer);
+    queue_peer_addr (manager, peer);
     CcnetPeer *old_peer;
     
     old_peer = ccnet_peer_manager_get_peer (manager, peer->id);
@@ -333,7 +689,7 @@ static void check_db_table (CcnetDB *db)
     char *sql;
 
     sql = "CREATE TABLE IF NOT EXISTS PeerAddr (peer_id CHAR(41) "
-        "PRIMARY KEY, addr VARCHAR(15), port INTEGER)";
+        "PRIMARY KEY, addr VARCHAR(64), port INTEGER)";
     ccnet_db_query (db, sql);
 
     sql = "CREATE TABLE IF NOT EXISTS PeerRole (peer_id CHAR(41) PRIMARY KEY,"
@@ -365,6 +721,8 @@ open_sqlite_db (CcnetPeerManager *manager)
 #else
     if (sqlite_open_db (db_path, &db) < 0)
         db = NULL;
+    else
+        ccnet_db_enable_read_pool (db, CCNET_DB_READ_CONNECTIONS);
 #endif
     g_free (db_path);
 
@@ -411,23 +769,132 @@ load_peer_addr(CcnetPeerManager *manager, CcnetPeer *peer)
 }
 
 static void
-save_peer_addr(CcnetPeerManager *manager, CcnetPeer *peer)
+pending_addr_free (gpointer data)
 {
-    /*
-    char sql[256];
+    PendingAddr *pa = data;
+
+    g_free (pa->addr);
+    g_free (pa);
+}
+
+/* Address changes come in waves when NATs rebind, so they are not
+ * written right away. Only the last address of a peer is kept. */
+static void
+queue_peer_addr (CcnetPeerManager *manager, CcnetPeer *peer)
+{
+    PendingAddr *pa;
+    time_t now = time (NULL);
 
     if (!peer || !peer->id)
         return;
 
-    if (peer->public_addr) {
-        snprintf (sql, 256, "REPLACE INTO PeerAddr VALUES ('%s', '%s', '%d')",
-                  peer->id, peer->public_addr, peer->public_port);
-    } else {
-        snprintf (sql, 256, "DELETE FROM PeerAddr WHERE peer_id='%s'",
-                  peer->id);
+    pa = g_hash_table_lookup (manager->priv->pending_addrs, peer->id);
+    if (!pa) {
+        pa = g_new0 (PendingAddr, 1);
+        pa->first_change = now;
+        g_hash_table_insert (manager->priv->pending_addrs,
+                             g_strdup (peer->id), pa);
     }
-    ccnet_db_query (manager->priv->db, sql);
-    */
+    g_free (pa->addr);
+    pa->addr = g_strdup (peer->public_addr);
+    pa->port = peer->public_port;
+    pa->last_change = now;
+}
+
+static gboolean
+addr_due (CcnetPeerManager *manager, PendingAddr *pa, time_t now)
+{
+    return now - pa->last_change >= manager->priv->addr_save_delay ||
+        now - pa->first_change >= ADDR_SAVE_MAX_DELAY;
+}
+
+#ifdef CCNET_SERVER
+/* Bound, as the address may be an IPv6 literal or a host name. */
+static int
+write_peer_addr (CcnetDBTrans *trans, const char *id, PendingAddr *pa)
+{
+    char port[16];
+    char *params[3];
+
+    params[0] = (char *)id;
+    if (!pa->addr)
+        return ccnet_db_trans_query_strv (trans,
+                                          "DELETE FROM PeerAddr WHERE peer_id=?",
+                                          params, 1);
+
+    snprintf (port, sizeof(port), "%d", pa->port);
+    params[1] = pa->addr;
+    params[2] = port;
+    return ccnet_db_trans_query_strv (trans,
+                                      "REPLACE INTO PeerAddr VALUES (?, ?, ?)",
+                                      params, 3);
+}
+#endif
+
+/* Write the addresses which have settled, or all of them, in one
+ * transaction. They are kept for the next pulse if it fails. */
+static void
+write_peer_addrs (CcnetPeerManager *manager, gboolean all)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *due = NULL, *ptr;
+    time_t now = time (NULL);
+
+    g_hash_table_iter_init (&iter, manager->priv->pending_addrs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (all || addr_due (manager, value, now))
+            due = g_list_prepend (due, key);
+    }
+    if (!due)
+        return;
+
+#ifdef CCNET_SERVER
+    CcnetDBTrans *trans = ccnet_db_begin_transaction (manager->priv->db);
+    if (!trans)
+        goto error;
+    for (ptr = due; ptr; ptr = ptr->next) {
+        PendingAddr *pa = g_hash_table_lookup (manager->priv->pending_addrs,
+                                               ptr->data);
+        if (write_peer_addr (trans, ptr->data, pa) < 0) {
+            ccnet_db_rollback (trans);
+            goto error;
+        }
+    }
+    if (ccnet_db_commit (trans) < 0)
+        goto error;
+#else
+    for (ptr = due; ptr; ptr = ptr->next) {
+        PendingAddr *pa = g_hash_table_lookup (manager->priv->pending_addrs,
+                                               ptr->data);
+        if (pa->addr)
+            ccnet_db_statement_query (manager->priv->db,
+                                      "REPLACE INTO PeerAddr VALUES (?, ?, ?)",
+                                      3, "string", ptr->data,
+                                      "string", pa->addr,
+                                      "int", pa->port);
+        else
+            ccnet_db_statement_query (manager->priv->db,
+                                      "DELETE FROM PeerAddr WHERE peer_id=?",
+                                      1, "string", ptr->data);
+    }
+#endif
+
+    ccnet_debug ("[Peer] Saved %u peer addresses\n", g_list_length (due));
+    for (ptr = due; ptr; ptr = ptr->next)
+        g_hash_table_remove (manager->priv->pending_addrs, ptr->data);
+    if (manager->priv->use_snapshot) {
+        ccnet_peer_snapshot_sources_update (&manager->priv->snap_src);
+        manager->priv->snap_dirty = TRUE;
+    }
+    g_list_free (due);
+    return;
+
+#ifdef CCNET_SERVER
+error:
+    ccnet_warning ("Failed to save %u peer addresses\n", g_list_length (due));
+    g_list_free (due);
+#endif
 }
 
 static gboolean load_peer_role_cb (CcnetDBRow *row, void *data)
@@ -452,8 +919,84 @@ static void load_peer_role(CcnetPeerManager *manager, CcnetPeer *peer)
                                    load_peer_role_cb, peer);
 }
 
+static void
+peer_record_free (gpointer data)
+{
+    PeerRecord *rec = data;
+
+    g_free (rec->roles);
+    g_free (rec->addr);
+    g_free (rec);
+}
+
+static PeerRecord *
+get_peer_record (GHashTable *records, const char *peer_id)
+{
+    PeerRecord *rec = g_hash_table_lookup (records, peer_id);
+
+    if (!rec) {
+        rec = g_new0 (PeerRecord, 1);
+        g_hash_table_insert (records, g_strdup (peer_id), rec);
+    }
+    return rec;
+}
+
+static gboolean
+load_record_role_cb (CcnetDBRow *row, void *data)
+{
+    const char *peer_id = (const char *) ccnet_db_row_get_column_text (row, 0);
+    const char *roles = (const char *) ccnet_db_row_get_column_text (row, 1);
+    PeerRecord *rec;
+
+    if (!peer_id)
+        return TRUE;
+    rec = get_peer_record (data, peer_id);
+    g_free (rec->roles);
+    rec->roles = g_strdup (roles);
+    return TRUE;
+}
+
+static gboolean
+load_record_addr_cb (CcnetDBRow *row, void *data)
+{
+    const char *peer_id = (const char *) ccnet_db_row_get_column_text (row, 0);
+    const char *addr = (const char *) ccnet_db_row_get_column_text (row, 1);
+    PeerRecord *rec;
+
+    if (!peer_id)
+        return TRUE;
+    rec = get_peer_record (data, peer_id);
+    g_free (rec->addr);
+    rec->addr = g_strdup (addr);
+    rec->port = ccnet_db_row_get_column_int (row, 2);
+    return TRUE;
+}
+
+/* Roles and addresses of all peers, with one query per table instead
+ * of two per peer. */
+static GHashTable *
+load_peer_records (CcnetPeerManager *manager)
+{
+    GHashTable *records;
+
+    records = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                     g_free, peer_record_free);
+    ccnet_db_foreach_selected_row (manager->priv->db,
+                                   "SELECT peer_id, roles FROM PeerRole",
+                                   load_record_role_cb, records);
+    ccnet_db_foreach_selected_row (manager->priv->db,
+                                   "SELECT peer_id, addr, port FROM PeerAddr",
+                                   load_record_addr_cb, records);
+    return records;
+}
+
+static void install_peer (CcnetPeerManager *manager, CcnetPeer *peer,
+                          PeerRecord *rec);
+
+/* Load the peer stored at @path. Its address and roles come from @rec,
+ * or are queried if @rec is NULL. */
 static CcnetPeer*
-_load_peer (CcnetPeerManager *manager, const char *path)
+_load_peer (CcnetPeerManager *manager, const char *path, PeerRecord *rec)
 {
     GError *error = NULL;
     CcnetPeer *peer;
@@ -473,14 +1016,31 @@ _load_peer (CcnetPeerManager *manager, const char *path)
         return NULL;
     }
 
-    load_peer_addr (manager, peer);
-    load_peer_role (manager, peer);
-    add_peer (manager, peer);
-    peer->last_down = time(NULL);
+    install_peer (manager, peer, rec);
     g_free (content);
     return peer;
 }
 
+/* Set the address and roles from @rec, or query them if it's NULL,
+ * and add @peer. */
+static void
+install_peer (CcnetPeerManager *manager, CcnetPeer *peer, PeerRecord *rec)
+{
+    if (!rec) {
+        load_peer_addr (manager, peer);
+        load_peer_role (manager, peer);
+    } else {
+        if (rec->addr) {
+            peer->public_addr = g_strdup (rec->addr);
+            peer->public_port = rec->port;
+        }
+        if (rec->roles)
+            ccnet_peer_set_roles (peer, rec->roles);
+    }
+    add_peer (manager, peer);
+    peer->last_down = time(NULL);
+}
+
 void
 ccnet_peer_manager_set_peer_public_addr (CcnetPeerManager *manager,
                                          CcnetPeer *peer,
@@ -506,7 +1066,7 @@ ccnet_peer_manager_set_peer_public_addr (CcnetPeerManager *manager,
         need_save = 1;
     }
     if (need_save)
-        save_peer_addr (manager, peer);
+        queue_peer_addr (manager, peer);
 }
 
 
@@ -558,6 +1118,231 @@ void ccnet_peer_manager_remove_role (CcnetPeerManager *manager,
 {
     ccnet_peer_remove_role (peer, role);
     save_peer_roles (manager, peer);
+    if (peer->net_state == PEER_DOWN)
+        ccnet_peer_manager_on_peer_down (manager, peer);
+}
+
+/*
+ * Bulk import. The records are split and their keys decoded in slices
+ * on worker threads, the peers then go in here in the main thread.
+ */
+
+#define IMPORT_SLICE_SIZE 64
+
+typedef struct {
+    int          line_no;
+    char       **fields;        /* id, addr[:port], roles[, pubkey] */
+    char       **roles;
+    const char  *addr;
+    int          port;
+    RSA         *pubkey;
+    const char  *error;         /* NULL if the record is good */
+} ImportItem;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             pending;
+} ImportBatch;
+
+typedef struct {
+    ImportBatch *batch;
+    ImportItem  *items;
+    int          n_items;
+} ImportSlice;
+
+static void
+parse_import_item (ImportItem *item)
+{
+    char **f = item->fields;
+    char *p;
+    int i;
+
+    if (g_strv_length (f) < 3) {
+        item->error = "Too few fields";
+        return;
+    }
+    if (!peer_id_valid (f[0])) {
+        item->error = "Invalid peer ID";
+        return;
+    }
+
+    if (strcmp (f[1], "-") != 0) {
+        item->addr = f[1];
+        item->port = DEFAULT_PORT;
+        if ((p = strrchr (f[1], ':')) != NULL) {
+            *p = '\0';
+            item->port = atoi (p + 1);
+            if (item->port <= 0 || item->port > 65535) {
+                item->error = "Invalid address";
+                return;
+            }
+        }
+    }
+
+    if (strcmp (f[2], "-") != 0) {
+        item->roles = g_strsplit (f[2], ",", -1);
+        for (i = 0; item->roles[i]; i++) {
+            if (item->roles[i][0] == '\0') {
+                item->error = "Invalid role";
+                return;
+            }
+        }
+    }
+
+    if (f[3]) {
+        item->pubkey = public_key_from_string_cached (f[3]);
+        if (!item->pubkey)
+            item->error = "Wrong public key format";
+    }
+}
+
+static void *
+parse_import_slice (void *vslice)
+{
+    ImportSlice *slice = vslice;
+    ImportBatch *batch = slice->batch;
+    int i;
+
+    for (i = 0; i < slice->n_items; i++)
+        parse_import_item (&slice->items[i]);
+
+    /* the batch is on the caller's stack, this is our last access */
+    pthread_mutex_lock (&batch->lock);
+    if (--batch->pending == 0)
+        pthread_cond_signal (&batch->cond);
+    pthread_mutex_unlock (&batch->lock);
+
+    return NULL;
+}
+
+static void
+parse_import_items (ImportItem *items, int n_items, CcnetJobManager *job_mgr)
+{
+    ImportSlice *slices;
+    ImportBatch batch;
+    int n_slices, i;
+
+    if (!job_mgr || n_items <= IMPORT_SLICE_SIZE) {
+        for (i = 0; i < n_items; i++)
+            parse_import_item (&items[i]);
+        return;
+    }
+
+    n_slices = (n_items + IMPORT_SLICE_SIZE - 1) / IMPORT_SLICE_SIZE;
+    slices = g_new0 (ImportSlice, n_slices);
+
+    pthread_mutex_init (&batch.lock, NULL);
+    pthread_cond_init (&batch.cond, NULL);
+    batch.pending = n_slices;
+
+    for (i = 0; i < n_slices; i++) {
+        slices[i].batch = &batch;
+        slices[i].items = items + i * IMPORT_SLICE_SIZE;
+        slices[i].n_items = MIN (IMPORT_SLICE_SIZE,
+                                 n_items - i * IMPORT_SLICE_SIZE);
+        ccnet_job_manager_schedule_job (job_mgr, parse_import_slice,
+                                        NULL, &slices[i]);
+    }
+
+    pthread_mutex_lock (&batch.lock);
+    while (batch.pending > 0)
+        pthread_cond_wait (&batch.cond, &batch.lock);
+    pthread_mutex_unlock (&batch.lock);
+    pthread_cond_destroy (&batch.cond);
+    pthread_mutex_destroy (&batch.lock);
+
+    g_free (slices);
+}
+
+static void
+import_item (CcnetPeerManager *manager, ImportItem *item)
+{
+    CcnetPeer *peer;
+    int i;
+
+    peer = ccnet_peer_manager_get_peer (manager, item->fields[0]);
+    if (!peer) {
+        /* Given its roles before it is added, so that add_peer()
+         * indexes them all at once. */
+        peer = ccnet_peer_new (item->fields[0]);
+        for (i = 0; item->roles && item->roles[i]; i++)
+            ccnet_peer_add_role (peer, item->roles[i]);
+        if (item->pubkey)
+            ccnet_peer_take_pubkey (peer, item->pubkey, item->fields[3]);
+        item->pubkey = NULL;
+        ccnet_peer_manager_add_peer (manager, peer);
+    } else {
+        for (i = 0; item->roles && item->roles[i]; i++)
+            ccnet_peer_manager_add_role (manager, peer, item->roles[i]);
+        if (item->pubkey &&
+            g_strcmp0 (item->fields[3], peer->pubkey_str) != 0) {
+            ccnet_peer_take_pubkey (peer, item->pubkey, item->fields[3]);
+            item->pubkey = NULL;
+        }
+        ccnet_peer_manager_mark_dirty (manager, peer);
+    }
+
+    if (item->addr)
+        ccnet_peer_manager_set_peer_public_addr (manager, peer,
+                                                 item->addr, item->port);
+    g_object_unref (peer);
+}
+
+int
+ccnet_peer_manager_import_peers (CcnetPeerManager *manager,
+                                 const char *records,
+                                 CcnetJobManager *job_mgr,
+                                 GString *errors)
+{
+    char **lines;
+    ImportItem *items;
+    int n_lines, n_items = 0, imported = 0, i;
+
+    lines = g_strsplit (records, "\n", -1);
+    n_lines = g_strv_length (lines);
+    items = g_new0 (ImportItem, MAX(n_lines, 1));
+
+    for (i = 0; i < n_lines; i++) {
+        g_strstrip (lines[i]);
+        if (lines[i][0] == '\0' || lines[i][0] == '#')
+            continue;
+        items[n_items].line_no = i + 1;
+        items[n_items].fields = g_strsplit (lines[i], " ", 4);
+        n_items++;
+    }
+
+    parse_import_items (items, n_items, job_mgr);
+
+    for (i = 0; i < n_items; i++) {
+        if (items[i].error) {
+            if (errors)
+                g_string_append_printf (errors, "%d %s\n",
+                                        items[i].line_no, items[i].error);
+        } else {
+            import_item (manager, &items[i]);
+            imported++;
+        }
+        if (items[i].pubkey)
+            RSA_free (items[i].pubkey);
+        g_strfreev (items[i].roles);
+        g_strfreev (items[i].fields);
+    }
+
+    /* One transaction for the addresses and one snapshot for the
+     * peers, instead of a write per peer on the next pulses. */
+    if (imported > 0) {
+        write_peer_addrs (manager, TRUE);
+        if (manager->priv->use_snapshot)
+            write_snapshot (manager);
+    }
+
+    ccnet_message ("Imported %d peers, %d records rejected\n",
+                   imported, n_items - imported);
+
+    g_free (items);
+    g_strfreev (lines);
+    return imported;
 }
 
 CcnetPeer*
@@ -570,25 +1355,145 @@ ccnet_peer_manager_load_peer_by_id (CcnetPeerManager *manager,
 
     sprintf (path, "%s" G_DIR_SEPARATOR_S "%s", manager->peerdb_path, peer_id);
 
-    return _load_peer (manager, path);
+    return _load_peer (manager, path, NULL);
 }
 
-static void prune_peers (CcnetPeerManager *manager)
+/* Load a peer from the snapshot; returns a new reference or NULL. */
+static CcnetPeer *
+materialize_snapshot_peer (CcnetPeerManager *manager, const char *peer_id)
 {
-    GList *peers, *ptr;
+    CcnetPeerManagerPriv *priv = manager->priv;
+    CcnetPeerSnapshotEntry entry;
+    PeerRecord rec;
+    CcnetPeer *peer;
+    char *info;
+    int i;
 
-    peers = g_hash_table_get_values (manager->peer_hash);
-    for (ptr = peers; ptr; ptr = ptr->next) {
-        CcnetPeer *peer = ptr->data;
-        if (peer->is_self)
-            continue;
-        if (peer->role_list == NULL) {
-            ccnet_debug ("Removed peer %s\n", peer->id);
-            delete_peer (manager, peer);
+    if (!priv->snapshot || g_hash_table_contains (priv->snap_taken, peer_id))
+        return NULL;
+    if ((i = ccnet_peer_snapshot_find (priv->snapshot, peer_id)) < 0)
+        return NULL;
+
+    /* Not tried again, add_peer() marks it as well. */
+    g_hash_table_add (priv->snap_taken, g_strdup (peer_id));
+    if (!ccnet_peer_snapshot_get (priv->snapshot, i, &entry)) {
+        ccnet_warning ("Peer %.8s is damaged in the snapshot\n", peer_id);
+        return NULL;
+    }
+
+    info = g_strdup (entry.pubinfo);
+    peer = ccnet_peer_from_string (info);
+    g_free (info);
+    if (!peer || strcmp (peer->id, entry.id) != 0) {
+        ccnet_warning ("Peer %.8s is damaged in the snapshot\n", peer_id);
+        if (peer)
+            g_object_unref (peer);
+        return NULL;
+    }
+
+    rec.addr = (char *)entry.addr;
+    rec.port = entry.port;
+    rec.roles = (char *)entry.roles;
+    install_peer (manager, peer, &rec);
+    return peer;
+}
+
+/* Load an unloaded peer; returns a new reference or NULL. */
+static CcnetPeer *
+materialize_peer (CcnetPeerManager *manager, const char *peer_id)
+{
+    GHashTable *unloaded = manager->priv->unloaded;
+    PeerRecord *rec;
+    CcnetPeer *peer;
+    char *id, *path;
+
+    if (!unloaded || !(rec = g_hash_table_lookup (unloaded, peer_id)))
+        return materialize_snapshot_peer (manager, peer_id);
+
+    /* add_peer() drops the record, @peer_id may be its key. */
+    id = g_strdup (peer_id);
+    path = g_build_filename (manager->peerdb_path, id, NULL);
+    peer = _load_peer (manager, path, rec);
+    if (!peer)
+        g_hash_table_remove (unloaded, id);
+    g_free (path);
+    g_free (id);
+
+    return peer;
+}
+
+static gboolean
+record_has_role (PeerRecord *rec, const char *role)
+{
+    char **roles;
+    gboolean ret = FALSE;
+    int i;
+
+    if (!rec->roles)
+        return FALSE;
+
+    roles = g_strsplit (rec->roles, ",", -1);
+    for (i = 0; roles[i] && !ret; i++)
+        ret = (strcmp (roles[i], role) == 0);
+    g_strfreev (roles);
+
+    return ret;
+}
+
+/* Load the unloaded peers having @role, or all of them if @role is
+ * NULL. */
+static void
+materialize_peers (CcnetPeerManager *manager, const char *role)
+{
+    CcnetPeerManagerPriv *priv = manager->priv;
+    CcnetPeerSnapshotEntry entry;
+    PeerRecord rec = { NULL, NULL, 0 };
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ids = NULL, *ptr;
+    CcnetPeer *peer;
+    guint i, n;
+
+    if (priv->unloaded) {
+        g_hash_table_iter_init (&iter, priv->unloaded);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            if (!role || record_has_role (value, role))
+                ids = g_list_prepend (ids, g_strdup (key));
         }
     }
 
-    g_list_free (peers);
+    n = priv->snapshot ? ccnet_peer_snapshot_size (priv->snapshot) : 0;
+    for (i = 0; i < n; ++i) {
+        if (!ccnet_peer_snapshot_get (priv->snapshot, i, &entry) ||
+            g_hash_table_contains (priv->snap_taken, entry.id))
+            continue;
+        rec.roles = (char *)entry.roles;
+        if (!role || record_has_role (&rec, role))
+            ids = g_list_prepend (ids, g_strdup (entry.id));
+    }
+
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        peer = materialize_peer (manager, ptr->data);
+        if (peer)
+            g_object_unref (peer);
+        g_free (ptr->data);
+    }
+    g_list_free (ids);
+}
+
+static gboolean
+prune_peer (CcnetPeer *peer, void *vmanager)
+{
+    if (!peer->is_self && ccnet_str_set_size (&peer->roles) == 0) {
+        ccnet_debug ("Removed peer %s\n", peer->id);
+        delete_peer (vmanager, peer);
+    }
+    return TRUE;
+}
+
+static void prune_peers (CcnetPeerManager *manager)
+{
+    foreach_peer (manager, NULL, FALSE, prune_peer, manager);
 }
 
 void
@@ -598,11 +1503,22 @@ ccnet_peer_manager_load_peerdb (CcnetPeerManager *manager)
     GDir *dp;
     char buf[PATH_MAX];
 
-    manager->peerdb_path = g_build_filename (manager->session->config_dir,
-                                             PEERDB_NAME, NULL);
+    GHashTable *records;
+    PeerRecord *rec;
+    gpointer key;
+    gboolean lazy;
+
+    /* Already set up when falling back from the snapshot. */
+    if (!manager->peerdb_path)
+        manager->peerdb_path = g_build_filename (manager->session->config_dir,
+                                                 PEERDB_NAME, NULL);
     char *peerdb = manager->peerdb_path;
 
-    open_db(manager);
+    if (!manager->priv->db)
+        open_db(manager);
+
+    lazy = g_key_file_get_boolean (manager->session->keyf,
+                                   "Network", "LAZY_PEER_LOAD", NULL);
 
     if (checkdir_with_mkdir(peerdb) < 0) {
         ccnet_warning ("Could not open or make peer-db.\n");
@@ -615,6 +1531,11 @@ ccnet_peer_manager_load_peerdb (CcnetPeerManager *manager)
         return;
     }
 
+    records = load_peer_records (manager);
+    if (lazy)
+        manager->priv->unloaded = g_hash_table_new_full (
+            g_str_hash, g_str_equal, g_free, peer_record_free);
+
     while ((dname = g_dir_read_name(dp)) != NULL) {
         if (strlen(dname) != 40)
             continue;
@@ -625,12 +1546,157 @@ ccnet_peer_manager_load_peerdb (CcnetPeerManager *manager)
             continue;
         }
 
-        CcnetPeer *peer = _load_peer (manager, buf);
-        g_object_unref (peer);
+        if (!g_hash_table_lookup_extended (records, dname, &key,
+                                           (gpointer *)&rec))
+            rec = NULL;
+
+        if (lazy) {
+            /* Only index the peer. Peers without roles would be pruned
+             * right after loading, so just remove them. */
+            if (!rec || !rec->roles || rec->roles[0] == '\0') {
+                ccnet_debug ("Removed peer %s\n", dname);
+                if (g_unlink (buf) < 0)
+                    ccnet_warning ("delete file %s error\n", buf);
+                continue;
+            }
+            g_hash_table_steal (records, dname);
+            g_hash_table_insert (manager->priv->unloaded, key, rec);
+            continue;
+        }
+
+        if (!rec)
+            rec = get_peer_record (records, dname);
+        CcnetPeer *peer = _load_peer (manager, buf, rec);
+        if (peer)
+            g_object_unref (peer);
     }
     g_dir_close(dp);
+    g_hash_table_destroy (records);
+
+    if (lazy)
+        ccnet_message ("Indexed %u peers, they are loaded on first use\n",
+                       g_hash_table_size (manager->priv->unloaded));
+    else
+        prune_peers (manager);
+}
+
+static void
+load_snapshot (CcnetPeerManager *manager)
+{
+    CcnetPeerManagerPriv *priv = manager->priv;
+    const char *config_dir = manager->session->config_dir;
+
+    priv->use_snapshot = TRUE;
+    if (!manager->peerdb_path)
+        manager->peerdb_path = g_build_filename (config_dir, PEERDB_NAME, NULL);
+    if (!priv->db)
+        open_db (manager);
+
+    priv->snap_src.peerdb_dir = g_strdup (manager->peerdb_path);
+    priv->snap_src.db_path = g_build_filename (config_dir, "PeerMgr",
+                                               "peermgr.db", NULL);
+    priv->snap_path = g_build_filename (config_dir, "PeerMgr",
+                                        SNAPSHOT_NAME, NULL);
+
+    priv->snapshot = ccnet_peer_snapshot_open (priv->snap_path,
+                                               &priv->snap_src);
+    if (priv->snapshot) {
+        priv->snap_taken = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, NULL);
+        ccnet_message ("Mapped %u peers from the snapshot\n",
+                       ccnet_peer_snapshot_size (priv->snapshot));
+        return;
+    }
+
+    ccnet_peer_manager_load_peerdb (manager);
+    /* Loading may have removed role-less peers. */
+    ccnet_peer_snapshot_sources_update (&priv->snap_src);
+    priv->snap_dirty = TRUE;
+}
+
+static void
+add_snapshot_entry (CcnetPeerSnapshotWriter *writer, const char *id,
+                    const char *addr, int port, const char *roles,
+                    const char *pubinfo)
+{
+    CcnetPeerSnapshotEntry entry;
+
+    g_strlcpy (entry.id, id, sizeof(entry.id));
+    entry.addr = addr;
+    entry.port = port;
+    entry.roles = roles;
+    entry.pubinfo = pubinfo;
+    ccnet_peer_snapshot_writer_add (writer, &entry);
+}
+
+/* Takes the loaded peers from the table, the unloaded ones from their
+ * records and the untouched ones from the old snapshot. */
+static void
+write_snapshot (CcnetPeerManager *manager)
+{
+    CcnetPeerManagerPriv *priv = manager->priv;
+    CcnetPeerSnapshotWriter *writer;
+    CcnetPeerSnapshotEntry entry;
+    CcnetPeerTableIter titer;
+    GHashTableIter iter;
+    gpointer key, value;
+    CcnetPeer *peer;
+    GString *roles, *info;
+    char *path, *content;
+    guint i, n;
+
+    if (ccnet_peer_snapshot_sources_changed (&priv->snap_src)) {
+        ccnet_message ("Peer database changed by another process, "
+                       "not writing the peer snapshot\n");
+        g_unlink (priv->snap_path);
+        priv->use_snapshot = FALSE;
+        return;
+    }
+
+    writer = ccnet_peer_snapshot_writer_new ();
+    roles = g_string_new (NULL);
+
+    ccnet_peer_table_iter_init (&titer, manager->peer_table);
+    while (ccnet_peer_table_iter_next (&titer, &peer)) {
+        if (peer->is_self || peer->is_local ||
+            ccnet_str_set_size (&peer->roles) == 0)
+            continue;
+        g_string_truncate (roles, 0);
+        ccnet_peer_get_roles_str (peer, roles);
+        info = ccnet_peer_to_string (peer);
+        add_snapshot_entry (writer, peer->id, peer->public_addr,
+                            peer->public_port, roles->str, info->str);
+        g_string_free (info, TRUE);
+    }
+    g_string_free (roles, TRUE);
+
+    if (priv->unloaded) {
+        g_hash_table_iter_init (&iter, priv->unloaded);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            PeerRecord *rec = value;
+
+            path = g_build_filename (manager->peerdb_path, key, NULL);
+            if (g_file_get_contents (path, &content, NULL, NULL)) {
+                add_snapshot_entry (writer, key, rec->addr, rec->port,
+                                    rec->roles, content);
+                g_free (content);
+            }
+            g_free (path);
+        }
+    }
+
+    n = priv->snapshot ? ccnet_peer_snapshot_size (priv->snapshot) : 0;
+    for (i = 0; i < n; ++i) {
+        if (ccnet_peer_snapshot_get (priv->snapshot, i, &entry) &&
+            !g_hash_table_contains (priv->snap_taken, entry.id))
+            ccnet_peer_snapshot_writer_add (writer, &entry);
+    }
 
-    prune_peers (manager);
+    if (ccnet_peer_snapshot_writer_commit (writer, priv->snap_path,
+                                           &priv->snap_src) < 0)
+        return;
+    priv->snap_dirty = FALSE;
+    priv->snap_written = time (NULL);
 }
 
 CcnetPeer *
@@ -639,9 +1705,11 @@ ccnet_peer_manager_get_peer (CcnetPeerManager *manager,
 {
     CcnetPeer *peer;
 
-    peer = g_hash_table_lookup (manager->peer_hash, peer_id);
+    peer = ccnet_peer_table_lookup (manager->peer_table, peer_id);
     if (peer)
         g_object_ref (peer);
+    else
+        peer = materialize_peer (manager, peer_id);
     return peer;
 }
 
@@ -649,12 +1717,13 @@ CcnetPeer*
 ccnet_peer_manager_get_peer_by_name (CcnetPeerManager *manager,
                                      const char *name)
 {
-    GHashTableIter iter;
-    gpointer key, value;
+    CcnetPeerTableIter iter;
+    CcnetPeer *peer;
 
-    g_hash_table_iter_init (&iter, manager->peer_hash);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        CcnetPeer *peer = value;
+    materialize_peers (manager, NULL);
+
+    ccnet_peer_table_iter_init (&iter, manager->peer_table);
+    while (ccnet_peer_table_iter_next (&iter, &peer)) {
         if (peer->name == NULL)
             continue;
         if (strcmp(name, peer->name) == 0) {
@@ -711,31 +1780,76 @@ err:
     */
 }
 
+#ifdef CCNET_SERVER
+/*
+ * Clean role-less peers in memory which have been down for a while.
+ * Only the expired head of gc_queue is visited, at most gc_budget
+ * peers per pulse.
+ */
+static void
+collect_peers (CcnetPeerManager *manager)
+{
+    CcnetPeerManagerPriv *priv = manager->priv;
+    GSequenceIter *iter;
+    CcnetPeer *peer;
+    time_t now = time(NULL);
+    int n = 0;
+
+    while (priv->gc_budget <= 0 || n < priv->gc_budget) {
+        iter = g_sequence_get_begin_iter (priv->gc_queue);
+        if (g_sequence_iter_is_end (iter))
+            break;
+        peer = g_sequence_get (iter);
+        if (peer->gc_deadline > now)
+            break;
+        ++n;
+
+        /* Scheduled again when it goes down or loses its roles. */
+        if (ccnet_str_set_size (&peer->roles) != 0 ||
+            peer->net_state != PEER_DOWN) {
+            unschedule_gc (manager, peer);
+            continue;
+        }
+        if (peer->in_shutdown || peer->in_connection) {
+            schedule_gc (manager, peer, now + SAVING_INTERVAL_MSEC / 1000);
+            continue;
+        }
+        if (now < peer->last_down + PEER_GC_TIMEOUT) {
+            schedule_gc (manager, peer, peer->last_down + PEER_GC_TIMEOUT);
+            continue;
+        }
+
+        g_hash_table_remove (priv->dirty_peers, peer->id);
+        ccnet_peer_table_remove (manager->peer_table, peer);
+        index_peer_roles (manager, peer, FALSE);
+#ifdef CCNET_CLUSTER
+        ccnet_peer_dir_remove (peer);
+#endif
+        g_object_unref (peer);          /* ref of peer_table */
+        unschedule_gc (manager, peer);
+    }
+}
+#endif
+
 static int save_pulse (void * vmanager)
 {
     CcnetPeerManager *manager = vmanager;
     GHashTableIter iter;
     gpointer key, value;
 
-    g_hash_table_iter_init (&iter, manager->peer_hash);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        CcnetPeer *peer = value;
-
 #ifdef CCNET_SERVER
-        /* clean peers in memory */
-        if (peer->role_list == NULL) {
-            if (peer->net_state == PEER_DOWN && !peer->in_shutdown
-                && !peer->in_connection) {
-                time_t now = time(NULL);
-                if (now < peer->last_down + PEER_GC_TIMEOUT)
-                    continue;
-                g_hash_table_iter_remove (&iter);
-                g_object_unref (peer);
-            }
-        }
+    collect_peers (manager);
 #endif
 
-        if (peer->role_list == NULL)
+    write_peer_addrs (manager, FALSE);
+
+    /* Only peers with changes are visited. Role-less ones are not
+     * saved, they stay dirty until they get a role. */
+    g_hash_table_iter_init (&iter, manager->priv->dirty_peers);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        CcnetPeer *peer = value;
+
+        if (ccnet_str_set_size (&peer->roles) == 0)
             continue;
         
         if (peer->need_saving) {
@@ -744,36 +1858,271 @@ static int save_pulse (void * vmanager)
             save_peer (manager, peer);
             peer->need_saving = 0;
         }
-
+        g_hash_table_iter_remove (&iter);
     }
+
+    if (manager->priv->use_snapshot && manager->priv->snap_dirty &&
+        time (NULL) - manager->priv->snap_written >= SNAPSHOT_INTERVAL)
+        write_snapshot (manager);
     
     return TRUE;
 }
 
+void
+ccnet_peer_manager_schedule_keepalive (CcnetPeerManager *manager,
+                                       CcnetProcessor *processor,
+                                       time_t deadline)
+{
+    CcnetPeerManagerPriv *priv = manager->priv;
+
+    list_del_init (&processor->wheel_list);
+    if (deadline < priv->ka_wheel_time)
+        deadline = priv->ka_wheel_time;
+    list_add_tail (&processor->wheel_list,
+                   &priv->ka_wheel[deadline & (KEEPALIVE_WHEEL_SIZE - 1)]);
+}
+
+void
+ccnet_peer_manager_cancel_keepalive (CcnetPeerManager *manager,
+                                     CcnetProcessor *processor)
+{
+    list_del_init (&processor->wheel_list);
+}
+
+int
+ccnet_peer_manager_get_keepalive_interval (CcnetPeerManager *manager,
+                                           CcnetPeer *peer)
+{
+    int interval = manager->priv->keepalive_interval;
+    guint i;
+
+    for (i = 0; i < ccnet_str_set_size (&peer->roles); ++i) {
+        int v = GPOINTER_TO_INT (g_hash_table_lookup (
+                                     manager->priv->role_keepalive,
+                                     ccnet_str_set_index (&peer->roles, i)));
+        if (v > 0 && v < interval)
+            interval = v;
+    }
+
+    return interval;
+}
+
+static int
+keepalive_pulse (CcnetPeerManager *manager)
+{
+    CcnetPeerManagerPriv *priv = manager->priv;
+    time_t now = time(NULL);
+    struct list_head due, *slot;
+    CcnetProcessor *processor;
+    int n = 0;
+
+    /* Catch up on slots missed while the loop was busy, but never go
+     * around more than once. */
+    if (now - priv->ka_wheel_time >= KEEPALIVE_WHEEL_SIZE)
+        priv->ka_wheel_time = now - KEEPALIVE_WHEEL_SIZE + 1;
+
+    while (priv->ka_wheel_time <= now && n++ < KEEPALIVE_WHEEL_SIZE) {
+        slot = &priv->ka_wheel[priv->ka_wheel_time & (KEEPALIVE_WHEEL_SIZE - 1)];
+        priv->ka_wheel_time++;
+
+        /* A timed out peer takes its processors down, so take entries
+         * off one at a time. */
+        INIT_LIST_HEAD (&due);
+        list_splice_init (slot, &due);
+        while (!list_empty (&due)) {
+            processor = list_entry (due.next, CcnetProcessor, wheel_list);
+            list_del_init (&processor->wheel_list);
+            ccnet_keepalive2_proc_check (processor, now);
+        }
+    }
+
+    /* Everything queued now is sent out at the end of this loop. */
+    return TRUE;
+}
+
+/* [Keepalive] <role> = <seconds> */
+static void
+load_keepalive_config (CcnetPeerManager *manager, GKeyFile *keyf)
+{
+    char **roles;
+    gsize n, i;
+
+    if (g_key_file_has_key (keyf, "Network", "KEEPALIVE_INTERVAL", NULL)) {
+        int v = g_key_file_get_integer (keyf, "Network",
+                                        "KEEPALIVE_INTERVAL", NULL);
+        if (v > 0)
+            manager->priv->keepalive_interval = v;
+    }
+
+    roles = g_key_file_get_keys (keyf, "Keepalive", &n, NULL);
+    if (!roles)
+        return;
+    for (i = 0; i < n; i++) {
+        int v = g_key_file_get_integer (keyf, "Keepalive", roles[i], NULL);
+        if (v <= 0) {
+            ccnet_warning ("Bad keepalive interval for role %s\n", roles[i]);
+            continue;
+        }
+        g_hash_table_insert (manager->priv->role_keepalive,
+                             (gpointer)g_intern_string (roles[i]),
+                             GINT_TO_POINTER(v));
+    }
+    g_strfreev (roles);
+}
+
+typedef struct TrimData {
+    time_t  idle_since;
+    int     n_trimmed;
+} TrimData;
+
+static gboolean
+trim_peer (CcnetPeer *peer, void *vdata)
+{
+    TrimData *data = vdata;
+
+    if (!peer->trimmed && !peer->is_self &&
+        peer->last_active < data->idle_since && ccnet_peer_trim (peer))
+        data->n_trimmed++;
+    return TRUE;
+}
+
+/* Connected peers which have been quiet for a while, keepalives aside,
+ * give back what they hold for traffic, see ccnet_peer_trim(). The
+ * peers trimmed stay so until they get a new processor. */
+static int
+trim_pulse (void *vmanager)
+{
+    CcnetPeerManager *manager = vmanager;
+    TrimData data;
+
+    data.idle_since = time (NULL) - manager->priv->idle_trim_secs;
+    data.n_trimmed = 0;
+    foreach_peer (manager, NULL, TRUE, trim_peer, &data);
+
+    if (data.n_trimmed > 0) {
+        ccnet_debug ("[Peer] Trimmed %d idle peers\n", data.n_trimmed);
+#ifdef __GLIBC__
+        /* The freed contexts are scattered over the heap. */
+        malloc_trim (0);
+#endif
+    }
+    return TRUE;
+}
+
+#ifdef CCNET_SERVER
+CcnetPeerView *
+ccnet_peer_manager_get_view (CcnetPeerManager *manager)
+{
+    CcnetPeerManagerPriv *priv = manager->priv;
+    CcnetPeerView *view;
+    gint64 now = g_get_monotonic_time ();
+
+    pthread_mutex_lock (&priv->view_lock);
+    if (!priv->view ||
+        now - ccnet_peer_view_get_time (priv->view) > priv->view_max_age)
+        priv->view_wanted = TRUE;
+    while (!priv->view)
+        pthread_cond_wait (&priv->view_cond, &priv->view_lock);
+    view = ccnet_peer_view_ref (priv->view);
+    priv->view_taken = now;
+    pthread_mutex_unlock (&priv->view_lock);
+
+    return view;
+}
+
+static int
+view_pulse (void *vmanager)
+{
+    CcnetPeerManager *manager = vmanager;
+    CcnetPeerManagerPriv *priv = manager->priv;
+    CcnetPeerView *old, *view;
+    gint64 now = g_get_monotonic_time ();
+    gboolean wanted, idle;
+
+    /* Only this thread changes priv->view, so old stays valid. */
+    pthread_mutex_lock (&priv->view_lock);
+    wanted = priv->view_wanted;
+    old = priv->view;
+    idle = old && !wanted &&
+        now - priv->view_taken > (gint64) VIEW_IDLE_TIME * G_USEC_PER_SEC;
+    if (idle)
+        priv->view = NULL;
+    pthread_mutex_unlock (&priv->view_lock);
+
+    if (idle) {
+        /* Not worth a copy of every peer without readers. */
+        ccnet_peer_view_unref (old);
+        return TRUE;
+    }
+    if (!wanted)
+        return TRUE;
+
+    materialize_peers (manager, NULL);
+    view = ccnet_peer_view_build (manager->peer_table, old);
+
+    pthread_mutex_lock (&priv->view_lock);
+    priv->view = view;
+    priv->view_wanted = FALSE;
+    pthread_cond_broadcast (&priv->view_cond);
+    pthread_mutex_unlock (&priv->view_lock);
+
+    ccnet_peer_view_unref (old);
+    return TRUE;
+}
+#endif
+
 void
 ccnet_peer_manager_start (CcnetPeerManager *manager)
 {
+    GKeyFile *keyf = manager->session->keyf;
+
+    if (g_key_file_has_key (keyf, "Network", "PEER_GC_BUDGET", NULL))
+        manager->priv->gc_budget = g_key_file_get_integer (
+            keyf, "Network", "PEER_GC_BUDGET", NULL);
+    if (g_key_file_has_key (keyf, "Network", "PEER_ADDR_SAVE_DELAY", NULL))
+        manager->priv->addr_save_delay = g_key_file_get_integer (
+            keyf, "Network", "PEER_ADDR_SAVE_DELAY", NULL);
+    if (g_key_file_has_key (keyf, "Network", "IDLE_TRIM_SECS", NULL))
+        manager->priv->idle_trim_secs = g_key_file_get_integer (
+            keyf, "Network", "IDLE_TRIM_SECS", NULL);
+    load_keepalive_config (manager, keyf);
+
     ccnet_timer_new (save_pulse, manager, SAVING_INTERVAL_MSEC);
+    if (manager->priv->idle_trim_secs > 0)
+        ccnet_timer_new (trim_pulse, manager, TRIM_PULSE_MSEC);
+
+#ifdef CCNET_SERVER
+    if (g_key_file_has_key (keyf, "Network", "PEER_VIEW_MAX_AGE", NULL))
+        manager->priv->view_max_age = (gint64) 1000 * g_key_file_get_integer (
+            keyf, "Network", "PEER_VIEW_MAX_AGE", NULL);
+    ccnet_timer_new (view_pulse, manager, VIEW_PULSE_MSEC);
+#endif
+
+    manager->priv->ka_wheel_time = time (NULL);
+    ccnet_timer_new ((TimerCB) keepalive_pulse, manager, KEEPALIVE_PULSE);
 
     /* manager->priv->notify_timer = ccnet_timer_new ((TimerCB)notify_pulse, */
     /*                                                manager, NOTIFY_MSEC); */
 }
 
 
-static void
-shutdown_peer (gpointer key, gpointer value, gpointer user_data)
+static gboolean
+shutdown_peer (CcnetPeer *peer, void *data)
 {
-    CcnetPeer *peer = value;
-
     if (!peer->is_self)
         ccnet_peer_shutdown (peer);
+    return TRUE;
 }
 
 
 void ccnet_peer_manager_on_exit (CcnetPeerManager *manager)
 {
+    write_peer_addrs (manager, TRUE);
     save_pulse (manager);
-    g_hash_table_foreach (manager->peer_hash, shutdown_peer, manager);
+    if (manager->priv->use_snapshot && manager->priv->snap_dirty)
+        write_snapshot (manager);
+
+    foreach_peer (manager, NULL, FALSE, shutdown_peer, NULL);
 }
 
 
@@ -863,11 +2212,12 @@ handle_role_notify_message (CcnetPeerManager *manager,
         return;
     }
 
-    GList *role_list = string_list_parse_sorted (roles, ",");
-    if (!string_list_sorted_is_equal (role_list, peer->myrole_list)) {
+    CcnetStrSet role_set = { 0 };
+    ccnet_str_set_parse (&role_set, roles, ",");
+    if (!ccnet_str_set_equal (&role_set, &peer->myroles)) {
         ccnet_peer_set_myroles (peer, roles);
     }
-    string_list_free (role_list);
+    ccnet_str_set_clear (&role_set);
     g_object_unref (peer);
 }
 
@@ -910,7 +2260,7 @@ handle_redirect_message (CcnetPeerManager *manager,
     body[len-1] = '\0';
 
     addr = body;
-    if ( (p = strchr(body, ':')) == NULL) {
+    if ( (p = strrchr(body, ':')) == NULL) {
         ccnet_message ("[PeerMgr] Bad formatted redirect msg: port missing\n");
         return;
     }
@@ -920,6 +2270,10 @@ handle_redirect_message (CcnetPeerManager *manager,
         ccnet_message ("[PeerMgr] Bad formatted redirect msg: wrong port\n");
         return;
     }
+    if (addr[0] == '[' && p[-1] == ']') {
+        p[-1] = '\0';
+        ++addr;
+    }
 
 
     from = ccnet_peer_manager_get_peer (manager, msg->from);
@@ -956,6 +2310,13 @@ ccnet_peer_manager_receive_message (CcnetPeerManager *manager,
         handle_service_ready_message (manager, msg, body);
     else if (strcmp(type, PEER_REDIRECT) == 0)
         handle_redirect_message (manager, msg, body);
+#ifdef CCNET_CLUSTER
+    else if (strcmp(type, LOAD_REPORT) == 0 ||
+             strcmp(type, PEER_LOCATION) == 0 ||
+             strcmp(type, FORWARD_MESSAGES) == 0 ||
+             strcmp(type, PEER_HANDOFF) == 0)
+        ccnet_cluster_manager_receive_message (manager, msg, type, body);
+#endif
 }
 
 
@@ -971,8 +2332,13 @@ send_redirect_message (CcnetPeerManager *manager, CcnetPeer *peer,
                        to->name, to->id);
         return;
     }
-    snprintf (buf, 256, "v%d\n%s\n%s:%d\n", PEERMGR_VERSION, PEER_REDIRECT,
-              to->public_addr, to->public_port);
+    /* IPv6 addresses are bracketed, as in URLs */
+    if (strchr (to->public_addr, ':'))
+        snprintf (buf, 256, "v%d\n%s\n[%s]:%d\n", PEERMGR_VERSION,
+                  PEER_REDIRECT, to->public_addr, to->public_port);
+    else
+        snprintf (buf, 256, "v%d\n%s\n%s:%d\n", PEERMGR_VERSION,
+                  PEER_REDIRECT, to->public_addr, to->public_port);
 
     msg = ccnet_message_new (manager->session->base.id,
                              peer->id, IPEERMGR_APP,
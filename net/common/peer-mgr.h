@@ -7,6 +7,15 @@
 #include <glib-object.h>
 
 #include "peer.h"
+#include "peer-table.h"
+#ifdef CCNET_SERVER
+#include "peer-view.h"
+#endif
+
+/*
+ * The peer manager and the peers are only used in the main thread,
+ * except for ccnet_peer_manager_get_view().
+ */
 
 #define CCNET_TYPE_PEER_MANAGER                  (ccnet_peer_manager_get_type ())
 #define CCNET_PEER_MANAGER(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), CCNET_TYPE_PEER_MANAGER, CcnetPeerManager))
@@ -29,7 +38,7 @@ struct _CcnetPeerManager
     
     char           *peerdb_path;
 
-    GHashTable     *peer_hash;
+    CcnetPeerTable *peer_table;     /* owns a reference of each peer */
 
     GList          *local_peers;
 
@@ -56,6 +65,35 @@ void ccnet_peer_manager_start (CcnetPeerManager *manager);
 void ccnet_peer_manager_on_exit (CcnetPeerManager *manager);
 
 void ccnet_peer_manager_add_peer (CcnetPeerManager *manager, CcnetPeer *peer);
+
+/* Schedule @peer for the next periodic save. */
+void ccnet_peer_manager_mark_dirty (CcnetPeerManager *manager,
+                                    CcnetPeer *peer);
+
+/* Called by the peer when @role (interned) is added or removed. */
+void ccnet_peer_manager_on_role_changed (CcnetPeerManager *manager,
+                                         CcnetPeer *peer,
+                                         const char *role,
+                                         gboolean added);
+
+/*
+ * Keepalive scheduling. A keepalive2 master processor is put on a wheel
+ * through its wheel_list, and ccnet_keepalive2_proc_check() is called for
+ * it at some point after @deadline (in seconds).
+ */
+void ccnet_peer_manager_schedule_keepalive (CcnetPeerManager *manager,
+                                            CcnetProcessor *processor,
+                                            time_t deadline);
+void ccnet_peer_manager_cancel_keepalive (CcnetPeerManager *manager,
+                                          CcnetProcessor *processor);
+
+/* Keepalive interval of @peer in seconds, the smallest of its roles. */
+int ccnet_peer_manager_get_keepalive_interval (CcnetPeerManager *manager,
+                                               CcnetPeer *peer);
+
+/* Called by the peer when its connection goes down. */
+void ccnet_peer_manager_on_peer_down (CcnetPeerManager *manager,
+                                      CcnetPeer *peer);
 void ccnet_peer_manager_remove_peer (CcnetPeerManager *manager, CcnetPeer *peer);
 
 CcnetPeer* ccnet_peer_manager_get_peer (CcnetPeerManager *manager,
@@ -68,10 +106,40 @@ GList* ccnet_peer_manager_get_peer_list (CcnetPeerManager *manager);
 GList* ccnet_peer_manager_get_peers_with_role (CcnetPeerManager *manager,
                                                const char *role);
 
+/*
+ * Call @func for the peers, without building a list. Return FALSE from
+ * @func to stop. @func may remove the peer, or others, from the
+ * manager; peers added meanwhile may or may not be visited.
+ */
+typedef gboolean (*CcnetPeerFunc) (CcnetPeer *peer, void *data);
+
+void ccnet_peer_manager_foreach (CcnetPeerManager *manager,
+                                 CcnetPeerFunc func, void *data);
+void ccnet_peer_manager_foreach_connected (CcnetPeerManager *manager,
+                                           CcnetPeerFunc func, void *data);
+void ccnet_peer_manager_foreach_with_role (CcnetPeerManager *manager,
+                                           const char *role,
+                                           CcnetPeerFunc func, void *data);
+
 void ccnet_peer_manager_add_role (CcnetPeerManager *manager,
                                   CcnetPeer *peer,
                                   const char *role);
 
+/*
+ * Add or update the peers of @records, a line
+ * "<peer_id> <addr>[:<port>]|- <role>[,<role>...]|- [<pubkey>]" each.
+ * Keys are decoded on the threads of @job_mgr, or here if it is NULL.
+ * New peers get all their roles indexed at once, and the addresses and
+ * the snapshot are written once for the lot. "<line> <reason>\n" is
+ * appended to @errors for each record left out.
+ *
+ * Returns the number of peers imported.
+ */
+int ccnet_peer_manager_import_peers (CcnetPeerManager *manager,
+                                     const char *records,
+                                     struct _CcnetJobManager *job_mgr,
+                                     GString *errors);
+
 void ccnet_peer_manager_remove_role (CcnetPeerManager *manager,
                                      CcnetPeer *peer,
                                      const char *role);
@@ -100,6 +168,15 @@ void
 ccnet_peer_manager_send_bind_status (CcnetPeerManager *manager,
                                      const char *peer_id,
                                      const char *result);
+
+/*
+ * Any thread but the main one. A reference on the latest view of the
+ * peers, see peer-view.h. It may be up to [Network] PEER_VIEW_MAX_AGE
+ * msec old, taking an older one has the main loop build a new one for
+ * the next readers. Only the first reader after the view was dropped
+ * for lack of readers waits for the main loop.
+ */
+CcnetPeerView *ccnet_peer_manager_get_view (CcnetPeerManager *manager);
 #endif /* CCNET_SERVER */
 
 /* function of resolving peer */
@@ -0,0 +1,319 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib/gstdio.h>
+
+#include "peer-snapshot.h"
+
+#include "log.h"
+
+#define SNAPSHOT_MAGIC      "CCPEERS"
+#define SNAPSHOT_VERSION    1
+
+typedef struct SnapHeader {
+    char        magic[8];
+    guint32     version;        /* also tells the byte order */
+    guint32     n_peers;
+    guint64     peerdb_stamp;
+    guint64     db_stamp;
+    guint64     wal_stamp;
+} SnapHeader;
+
+typedef struct SnapIndex {
+    char        id[40];
+    guint32     off;            /* from the start of the file */
+    guint32     len;
+} SnapIndex;
+
+struct CcnetPeerSnapshot {
+    GMappedFile        *file;
+    const char         *data;
+    gsize               len;
+    const SnapHeader   *header;
+    const SnapIndex    *index;
+};
+
+struct CcnetPeerSnapshotWriter {
+    GArray             *index;
+    GByteArray         *records;
+};
+
+/* Modification time of @path, 0 if it doesn't exist. */
+static guint64
+file_stamp (const char *path)
+{
+    GStatBuf st;
+
+    if (!path || g_stat (path, &st) < 0)
+        return 0;
+#ifdef __linux__
+    return (guint64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    return (guint64)st.st_mtime;
+#endif
+}
+
+static void
+get_stamps (const CcnetPeerSnapshotSources *src, SnapHeader *header)
+{
+    char *wal = g_strconcat (src->db_path, "-wal", NULL);
+
+    header->peerdb_stamp = file_stamp (src->peerdb_dir);
+    header->db_stamp = file_stamp (src->db_path);
+    header->wal_stamp = file_stamp (wal);
+    g_free (wal);
+}
+
+static gboolean
+stamps_equal (const CcnetPeerSnapshotSources *src, const SnapHeader *header)
+{
+    return src->peerdb_stamp == header->peerdb_stamp &&
+        src->db_stamp == header->db_stamp &&
+        src->wal_stamp == header->wal_stamp;
+}
+
+void
+ccnet_peer_snapshot_sources_update (CcnetPeerSnapshotSources *src)
+{
+    SnapHeader now;
+
+    get_stamps (src, &now);
+    src->peerdb_stamp = now.peerdb_stamp;
+    src->db_stamp = now.db_stamp;
+    src->wal_stamp = now.wal_stamp;
+}
+
+gboolean
+ccnet_peer_snapshot_sources_changed (CcnetPeerSnapshotSources *src)
+{
+    SnapHeader now;
+
+    get_stamps (src, &now);
+    return !stamps_equal (src, &now);
+}
+
+CcnetPeerSnapshot *
+ccnet_peer_snapshot_open (const char *path, CcnetPeerSnapshotSources *src)
+{
+    CcnetPeerSnapshot *snap;
+    GMappedFile *file;
+    const SnapHeader *header;
+    gsize len;
+
+    file = g_mapped_file_new (path, FALSE, NULL);
+    if (!file)
+        return NULL;
+
+    len = g_mapped_file_get_length (file);
+    header = (const SnapHeader *) g_mapped_file_get_contents (file);
+    if (len < sizeof(SnapHeader) ||
+        memcmp (header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        (len - sizeof(SnapHeader)) / sizeof(SnapIndex) < header->n_peers) {
+        ccnet_warning ("Peer snapshot %s is damaged\n", path);
+        g_mapped_file_unref (file);
+        return NULL;
+    }
+
+    ccnet_peer_snapshot_sources_update (src);
+    if (!stamps_equal (src, header)) {
+        ccnet_message ("Peer snapshot is older than the peer database\n");
+        g_mapped_file_unref (file);
+        return NULL;
+    }
+
+    snap = g_new0 (CcnetPeerSnapshot, 1);
+    snap->file = file;
+    snap->data = (const char *) header;
+    snap->len = len;
+    snap->header = header;
+    snap->index = (const SnapIndex *) (header + 1);
+    return snap;
+}
+
+void
+ccnet_peer_snapshot_close (CcnetPeerSnapshot *snap)
+{
+    if (!snap)
+        return;
+    g_mapped_file_unref (snap->file);
+    g_free (snap);
+}
+
+guint
+ccnet_peer_snapshot_size (CcnetPeerSnapshot *snap)
+{
+    return snap->header->n_peers;
+}
+
+int
+ccnet_peer_snapshot_find (CcnetPeerSnapshot *snap, const char *id)
+{
+    int lo = 0, hi = snap->header->n_peers - 1, mid, cmp;
+
+    if (strlen (id) != 40)
+        return -1;
+
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = memcmp (id, snap->index[mid].id, 40);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return -1;
+}
+
+/* The NUL terminated string at *p within end, which is then skipped. */
+static const char *
+next_string (const char **p, const char *end)
+{
+    const char *s = *p, *nul;
+
+    if (s >= end || !(nul = memchr (s, '\0', end - s)))
+        return NULL;
+    *p = nul + 1;
+    return s;
+}
+
+gboolean
+ccnet_peer_snapshot_get (CcnetPeerSnapshot *snap, guint i,
+                         CcnetPeerSnapshotEntry *entry)
+{
+    const SnapIndex *idx;
+    const char *p, *end;
+    guint32 port;
+
+    if (i >= snap->header->n_peers)
+        return FALSE;
+    idx = &snap->index[i];
+    if (idx->off > snap->len ||
+        idx->len > snap->len - idx->off || idx->len < sizeof(port))
+        return FALSE;
+
+    p = snap->data + idx->off;
+    end = p + idx->len;
+    memcpy (&port, p, sizeof(port));
+    p += sizeof(port);
+
+    memcpy (entry->id, idx->id, 40);
+    entry->id[40] = '\0';
+    entry->port = port;
+    if (!(entry->addr = next_string (&p, end)) ||
+        !(entry->roles = next_string (&p, end)) ||
+        !(entry->pubinfo = next_string (&p, end)))
+        return FALSE;
+    if (entry->addr[0] == '\0')
+        entry->addr = NULL;
+    return TRUE;
+}
+
+CcnetPeerSnapshotWriter *
+ccnet_peer_snapshot_writer_new (void)
+{
+    CcnetPeerSnapshotWriter *writer = g_new0 (CcnetPeerSnapshotWriter, 1);
+
+    writer->index = g_array_new (FALSE, FALSE, sizeof(SnapIndex));
+    writer->records = g_byte_array_new ();
+    return writer;
+}
+
+static void
+append_string (GByteArray *buf, const char *str)
+{
+    if (!str)
+        str = "";
+    g_byte_array_append (buf, (const guint8 *)str, strlen(str) + 1);
+}
+
+void
+ccnet_peer_snapshot_writer_add (CcnetPeerSnapshotWriter *writer,
+                                const CcnetPeerSnapshotEntry *entry)
+{
+    SnapIndex idx;
+    guint32 port = entry->port;
+
+    memcpy (idx.id, entry->id, 40);
+    idx.off = writer->records->len;      /* made absolute when written */
+    g_byte_array_append (writer->records, (const guint8 *)&port, sizeof(port));
+    append_string (writer->records, entry->addr);
+    append_string (writer->records, entry->roles);
+    append_string (writer->records, entry->pubinfo);
+    idx.len = writer->records->len - idx.off;
+    g_array_append_val (writer->index, idx);
+}
+
+static gint
+compare_index (gconstpointer a, gconstpointer b)
+{
+    return memcmp (((const SnapIndex *)a)->id, ((const SnapIndex *)b)->id, 40);
+}
+
+static void
+writer_free (CcnetPeerSnapshotWriter *writer)
+{
+    g_array_free (writer->index, TRUE);
+    g_byte_array_free (writer->records, TRUE);
+    g_free (writer);
+}
+
+int
+ccnet_peer_snapshot_writer_commit (CcnetPeerSnapshotWriter *writer,
+                                   const char *path,
+                                   CcnetPeerSnapshotSources *src)
+{
+    SnapHeader header;
+    guint32 base;
+    char *tmp_path;
+    FILE *fp;
+    guint i;
+    int ret = -1;
+
+    memset (&header, 0, sizeof(header));
+    memcpy (header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.n_peers = writer->index->len;
+    get_stamps (src, &header);
+    if (!stamps_equal (src, &header)) {
+        writer_free (writer);
+        return -1;
+    }
+
+    g_array_sort (writer->index, compare_index);
+    base = sizeof(header) + writer->index->len * sizeof(SnapIndex);
+    for (i = 0; i < writer->index->len; ++i)
+        g_array_index (writer->index, SnapIndex, i).off += base;
+
+    tmp_path = g_strconcat (path, ".tmp", NULL);
+    if ((fp = g_fopen (tmp_path, "wb")) == NULL) {
+        ccnet_warning ("Failed to write %s: %s\n", tmp_path, strerror(errno));
+        goto out;
+    }
+    fwrite (&header, sizeof(header), 1, fp);
+    fwrite (writer->index->data, sizeof(SnapIndex), writer->index->len, fp);
+    fwrite (writer->records->data, 1, writer->records->len, fp);
+    if (ferror (fp) | fclose (fp)) {
+        ccnet_warning ("Failed to write %s: %s\n", tmp_path, strerror(errno));
+        g_unlink (tmp_path);
+        goto out;
+    }
+
+    if (g_rename (tmp_path, path) < 0) {
+        ccnet_warning ("Failed to rename %s: %s\n", tmp_path, strerror(errno));
+        g_unlink (tmp_path);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    g_free (tmp_path);
+    writer_free (writer);
+    return ret;
+}
@@ -0,0 +1,77 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_PEER_SNAPSHOT_H
+#define CCNET_PEER_SNAPSHOT_H
+
+#include <glib.h>
+
+/*
+ * A memory-mapped snapshot of the peer table, written by the peer
+ * manager with [Network] PEER_SNAPSHOT = true, so that the daemon
+ * starts without reading peer-db or querying PeerMgr/peermgr.db.
+ *
+ * The file is a header, an index of (id, offset, length) sorted by id,
+ * and the records: port, address, roles and the public info of the
+ * peer as in its peer-db file, each string NUL terminated. The header
+ * holds the modification times of peer-db and peermgr.db when it was
+ * written. If either changed since, e.g. by an admin tool while the
+ * daemon was down, the snapshot is stale and the peers are loaded from
+ * the database. The times are also taken after the daemon's own
+ * writes, so a change by another process while it runs is noticed as
+ * well, and no snapshot is written then.
+ */
+
+typedef struct CcnetPeerSnapshot CcnetPeerSnapshot;
+typedef struct CcnetPeerSnapshotWriter CcnetPeerSnapshotWriter;
+
+typedef struct CcnetPeerSnapshotEntry {
+    char         id[41];
+    const char  *addr;          /* NULL if not known */
+    int          port;
+    const char  *roles;
+    const char  *pubinfo;
+} CcnetPeerSnapshotEntry;
+
+/* The files the snapshot is made from. */
+typedef struct CcnetPeerSnapshotSources {
+    char        *peerdb_dir;
+    char        *db_path;
+
+    /* as of the last open, commit or update */
+    guint64      peerdb_stamp;
+    guint64      db_stamp;
+    guint64      wal_stamp;
+} CcnetPeerSnapshotSources;
+
+/* Take the times again after writing to the sources. */
+void ccnet_peer_snapshot_sources_update (CcnetPeerSnapshotSources *src);
+
+/* Whether another process wrote to the sources since. */
+gboolean ccnet_peer_snapshot_sources_changed (CcnetPeerSnapshotSources *src);
+
+/* NULL if the snapshot is missing, corrupt or stale. */
+CcnetPeerSnapshot *ccnet_peer_snapshot_open (const char *path,
+                                             CcnetPeerSnapshotSources *src);
+void ccnet_peer_snapshot_close (CcnetPeerSnapshot *snap);
+
+guint ccnet_peer_snapshot_size (CcnetPeerSnapshot *snap);
+
+/* Index of the peer @id, or -1. */
+int ccnet_peer_snapshot_find (CcnetPeerSnapshot *snap, const char *id);
+
+/* The strings of @entry point into the map. FALSE if the record is
+ * damaged. */
+gboolean ccnet_peer_snapshot_get (CcnetPeerSnapshot *snap, guint i,
+                                  CcnetPeerSnapshotEntry *entry);
+
+CcnetPeerSnapshotWriter *ccnet_peer_snapshot_writer_new (void);
+void ccnet_peer_snapshot_writer_add (CcnetPeerSnapshotWriter *writer,
+                                     const CcnetPeerSnapshotEntry *entry);
+
+/* Write the snapshot to @path, replacing the old one atomically, and
+ * free @writer. Fails if the sources changed. */
+int ccnet_peer_snapshot_writer_commit (CcnetPeerSnapshotWriter *writer,
+                                       const char *path,
+                                       CcnetPeerSnapshotSources *src);
+
+#endif
@@ -0,0 +1,219 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "peer.h"
+#include "peer-table.h"
+#include "utils.h"
+
+#define MIN_CAPACITY 64
+
+/* Left in the slot of a peer removed while the table is frozen. */
+static char removed_slot;
+#define REMOVED ((CcnetPeer *)&removed_slot)
+
+struct CcnetPeerTable {
+    CcnetPeer **slots;
+    guint       mask;           /* capacity - 1, capacity a power of 2 */
+    guint       count;
+    guint       n_removed;      /* REMOVED slots */
+    int         frozen;
+};
+
+static inline guint
+raw_id_hash (const unsigned char *raw_id)
+{
+    guint64 h;
+
+    memcpy (&h, raw_id, sizeof(h));
+    return (guint)(h ^ (h >> 32));
+}
+
+static inline gboolean
+raw_id_equal (const CcnetPeer *peer, const unsigned char *raw_id)
+{
+    return memcmp (peer->raw_id, raw_id, CCNET_PEER_RAW_ID_LEN) == 0;
+}
+
+CcnetPeerTable *
+ccnet_peer_table_new (void)
+{
+    CcnetPeerTable *table = g_new0 (CcnetPeerTable, 1);
+
+    table->slots = g_new0 (CcnetPeer *, MIN_CAPACITY);
+    table->mask = MIN_CAPACITY - 1;
+
+    return table;
+}
+
+void
+ccnet_peer_table_free (CcnetPeerTable *table)
+{
+    if (!table)
+        return;
+    g_free (table->slots);
+    g_free (table);
+}
+
+guint
+ccnet_peer_table_size (CcnetPeerTable *table)
+{
+    return table->count;
+}
+
+/* Slot holding @raw_id, or the empty slot ending its probe sequence. */
+static guint
+find_slot (CcnetPeerTable *table, const unsigned char *raw_id)
+{
+    guint i = raw_id_hash (raw_id) & table->mask;
+
+    while (table->slots[i] && (table->slots[i] == REMOVED ||
+                               !raw_id_equal (table->slots[i], raw_id)))
+        i = (i + 1) & table->mask;
+    return i;
+}
+
+static void
+resize (CcnetPeerTable *table, guint capacity)
+{
+    CcnetPeer **old = table->slots;
+    guint old_capacity = table->mask + 1, i;
+
+    table->slots = g_new0 (CcnetPeer *, capacity);
+    table->mask = capacity - 1;
+    table->n_removed = 0;
+    for (i = 0; i < old_capacity; i++) {
+        if (old[i] && old[i] != REMOVED)
+            table->slots[find_slot (table, old[i]->raw_id)] = old[i];
+    }
+    g_free (old);
+}
+
+CcnetPeer *
+ccnet_peer_table_insert (CcnetPeerTable *table, CcnetPeer *peer)
+{
+    CcnetPeer *old;
+    guint i;
+
+    hex_to_rawdata (peer->id, peer->raw_id, CCNET_PEER_RAW_ID_LEN);
+
+    /* Keep the load factor under 3/4. A frozen table only grows when
+     * it's full, and then a walk over it may see peers twice. */
+    if (!table->frozen ? (table->count + 1) * 4 > (table->mask + 1) * 3
+        : (table->count + table->n_removed + 2) > table->mask + 1)
+        resize (table, (table->mask + 1) * 2);
+
+    i = find_slot (table, peer->raw_id);
+    old = table->slots[i];
+    table->slots[i] = peer;
+    if (!old)
+        table->count++;
+
+    return old == peer ? NULL : old;
+}
+
+gboolean
+ccnet_peer_table_remove (CcnetPeerTable *table, CcnetPeer *peer)
+{
+    guint i, j, home;
+
+    i = find_slot (table, peer->raw_id);
+    if (table->slots[i] != peer)
+        return FALSE;
+
+    if (table->frozen) {
+        table->slots[i] = REMOVED;
+        table->n_removed++;
+        table->count--;
+        return TRUE;
+    }
+
+    /* Shift the following entries back instead of leaving a tombstone,
+     * so that lookups never probe further than needed. */
+    j = i;
+    while (1) {
+        j = (j + 1) & table->mask;
+        if (!table->slots[j])
+            break;
+        home = raw_id_hash (table->slots[j]->raw_id) & table->mask;
+        /* Move slots[j] unless its home lies cyclically in (i, j]. */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        table->slots[i] = table->slots[j];
+        i = j;
+    }
+    table->slots[i] = NULL;
+    table->count--;
+
+    return TRUE;
+}
+
+CcnetPeer *
+ccnet_peer_table_lookup_raw (CcnetPeerTable *table,
+                             const unsigned char *raw_id)
+{
+    return table->slots[find_slot (table, raw_id)];
+}
+
+CcnetPeer *
+ccnet_peer_table_lookup (CcnetPeerTable *table, const char *peer_id)
+{
+    unsigned char raw_id[CCNET_PEER_RAW_ID_LEN];
+
+    if (!peer_id || strlen (peer_id) != 40 ||
+        hex_to_rawdata (peer_id, raw_id, CCNET_PEER_RAW_ID_LEN) < 0)
+        return NULL;
+
+    return ccnet_peer_table_lookup_raw (table, raw_id);
+}
+
+GList *
+ccnet_peer_table_get_values (CcnetPeerTable *table)
+{
+    GList *ret = NULL;
+    guint i;
+
+    for (i = 0; i <= table->mask; i++) {
+        if (table->slots[i] && table->slots[i] != REMOVED)
+            ret = g_list_prepend (ret, table->slots[i]);
+    }
+    return ret;
+}
+
+void
+ccnet_peer_table_freeze (CcnetPeerTable *table)
+{
+    table->frozen++;
+}
+
+void
+ccnet_peer_table_thaw (CcnetPeerTable *table)
+{
+    g_return_if_fail (table->frozen > 0);
+
+    /* Rehash in place to drop the REMOVED slots. */
+    if (--table->frozen == 0 && table->n_removed > 0)
+        resize (table, table->mask + 1);
+}
+
+void
+ccnet_peer_table_iter_init (CcnetPeerTableIter *iter, CcnetPeerTable *table)
+{
+    iter->table = table;
+    iter->pos = 0;
+}
+
+gboolean
+ccnet_peer_table_iter_next (CcnetPeerTableIter *iter, CcnetPeer **peer)
+{
+    CcnetPeerTable *table = iter->table;
+
+    while (iter->pos <= table->mask) {
+        CcnetPeer *p = table->slots[iter->pos++];
+        if (p && p != REMOVED) {
+            *peer = p;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
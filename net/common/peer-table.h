@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_PEER_TABLE_H
+#define CCNET_PEER_TABLE_H
+
+#include <glib.h>
+
+struct _CcnetPeer;
+
+/*
+ * Peers keyed by their binary 20-byte id. An open addressing table of
+ * peer pointers; the key is the peer's own raw_id, so a slot costs one
+ * pointer. Ids are SHA1 hashes, their first bytes are a good enough
+ * hash. Hex ids are only converted at the API boundary.
+ *
+ * The table doesn't hold references.
+ */
+typedef struct CcnetPeerTable CcnetPeerTable;
+
+CcnetPeerTable *ccnet_peer_table_new (void);
+void ccnet_peer_table_free (CcnetPeerTable *table);
+
+guint ccnet_peer_table_size (CcnetPeerTable *table);
+
+/* Sets peer->raw_id from peer->id. Returns the peer which had the same
+ * id before, or NULL. */
+struct _CcnetPeer *ccnet_peer_table_insert (CcnetPeerTable *table,
+                                            struct _CcnetPeer *peer);
+
+/* Removes @peer if it is the one stored under its id. */
+gboolean ccnet_peer_table_remove (CcnetPeerTable *table,
+                                  struct _CcnetPeer *peer);
+
+struct _CcnetPeer *ccnet_peer_table_lookup (CcnetPeerTable *table,
+                                            const char *peer_id);
+struct _CcnetPeer *ccnet_peer_table_lookup_raw (CcnetPeerTable *table,
+                                                const unsigned char *raw_id);
+
+/* The returned list must be freed with g_list_free(). */
+GList *ccnet_peer_table_get_values (CcnetPeerTable *table);
+
+/*
+ * While the table is frozen, removed peers leave a marker in their slot
+ * and the table doesn't grow unless it's nearly full, so slots keep
+ * their positions. Freezing nests.
+ */
+void ccnet_peer_table_freeze (CcnetPeerTable *table);
+void ccnet_peer_table_thaw (CcnetPeerTable *table);
+
+/* The table must not be changed while iterating, unless it's frozen.
+ * Then peers may be removed, and peers added may or may not be seen. */
+typedef struct CcnetPeerTableIter {
+    CcnetPeerTable *table;
+    guint           pos;
+} CcnetPeerTableIter;
+
+void ccnet_peer_table_iter_init (CcnetPeerTableIter *iter,
+                                 CcnetPeerTable *table);
+gboolean ccnet_peer_table_iter_next (CcnetPeerTableIter *iter,
+                                     struct _CcnetPeer **peer);
+
+#endif
@@ -0,0 +1,357 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "peer.h"
+#include "peer-table.h"
+#include "peer-view.h"
+
+#define DEBUG_FLAG  CCNET_DEBUG_PEER
+#include "log.h"
+
+/*
+ * A copy holds the values of the CcnetPeer properties. Which properties
+ * there are is taken from the CcnetPeer class, so the copies serialize
+ * like peers do. They only have int, boolean and string ones.
+ */
+
+#define CCNET_TYPE_PEER_COPY    (ccnet_peer_copy_get_type ())
+
+typedef struct CcnetPeerCopy {
+    GObject       parent_instance;
+
+    char          id[41];
+    guint64       stamp;        /* of the peer when copied */
+    const char   *name;         /* in values */
+    const char  **roles;        /* interned */
+    guint         n_roles;
+    GValue       *values;       /* by property id - 1 */
+} CcnetPeerCopy;
+
+typedef struct CcnetPeerCopyClass {
+    GObjectClass  parent_class;
+} CcnetPeerCopyClass;
+
+GType ccnet_peer_copy_get_type (void);
+
+G_DEFINE_TYPE (CcnetPeerCopy, ccnet_peer_copy, G_TYPE_OBJECT);
+
+static GParamSpec **peer_props;
+static guint        n_peer_props;
+static int          name_prop = -1;
+
+struct CcnetPeerView {
+    gint          ref;
+    gint64        time;
+    GPtrArray    *peers;        /* holds the references */
+    GHashTable   *by_id;
+    GHashTable   *by_name;      /* the first peer of each name */
+    GHashTable   *by_role;      /* interned role -> GPtrArray of copies */
+};
+
+static void
+copy_get_property (GObject *object, guint property_id,
+                   GValue *v, GParamSpec *pspec)
+{
+    CcnetPeerCopy *copy = (CcnetPeerCopy *)object;
+
+    if (property_id == 0 || property_id > n_peer_props) {
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        return;
+    }
+    g_value_copy (&copy->values[property_id - 1], v);
+}
+
+static void
+copy_finalize (GObject *object)
+{
+    CcnetPeerCopy *copy = (CcnetPeerCopy *)object;
+    guint i;
+
+    for (i = 0; i < n_peer_props; i++)
+        g_value_unset (&copy->values[i]);
+    g_free (copy->values);
+    g_free (copy->roles);
+
+    G_OBJECT_CLASS (ccnet_peer_copy_parent_class)->finalize (object);
+}
+
+static GParamSpec *
+clone_pspec (GParamSpec *pspec)
+{
+    const char *name = g_param_spec_get_name (pspec);
+    GType type = G_PARAM_SPEC_VALUE_TYPE (pspec);
+
+    if (type == G_TYPE_INT) {
+        GParamSpecInt *p = G_PARAM_SPEC_INT (pspec);
+        return g_param_spec_int (name, NULL, NULL, p->minimum, p->maximum,
+                                 p->default_value, G_PARAM_READABLE);
+    }
+    if (type == G_TYPE_BOOLEAN)
+        return g_param_spec_boolean (name, NULL, NULL, FALSE,
+                                     G_PARAM_READABLE);
+    g_assert (type == G_TYPE_STRING);
+    return g_param_spec_string (name, NULL, NULL, NULL, G_PARAM_READABLE);
+}
+
+static void
+ccnet_peer_copy_class_init (CcnetPeerCopyClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+    GObjectClass *peer_class = g_type_class_ref (CCNET_TYPE_PEER);
+    guint i;
+
+    gobject_class->get_property = copy_get_property;
+    gobject_class->finalize = copy_finalize;
+
+    peer_props = g_object_class_list_properties (peer_class, &n_peer_props);
+    for (i = 0; i < n_peer_props; i++) {
+        if (strcmp (g_param_spec_get_name (peer_props[i]), "name") == 0)
+            name_prop = i;
+        g_object_class_install_property (gobject_class, i + 1,
+                                         clone_pspec (peer_props[i]));
+    }
+}
+
+static void
+ccnet_peer_copy_init (CcnetPeerCopy *copy)
+{
+}
+
+/*
+ * A hash of everything the properties of @peer are made of, so that
+ * unchanged peers are found without formatting their properties.
+ * Roles are interned, their pointers will do.
+ */
+
+#define FNV_OFFSET  14695981039346656037ULL
+#define FNV_PRIME   1099511628211ULL
+
+static guint64
+hash_bytes (guint64 h, const void *data, gsize len)
+{
+    const unsigned char *p = data;
+    gsize i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static guint64
+hash_str (guint64 h, const char *s)
+{
+    if (!s)
+        return hash_bytes (h, "\xff", 1);
+    return hash_bytes (h, s, strlen (s) + 1);
+}
+
+static guint64
+hash_int (guint64 h, gint64 v)
+{
+    return hash_bytes (h, &v, sizeof(v));
+}
+
+static guint64
+hash_str_set (guint64 h, const CcnetStrSet *set)
+{
+    h = hash_int (h, set->len);
+    return hash_bytes (h, set->items, set->len * sizeof(char *));
+}
+
+static guint64
+peer_stamp (CcnetPeer *peer)
+{
+    guint64 h = FNV_OFFSET;
+    gint64 flags;
+
+    h = hash_str (h, peer->name);
+    h = hash_str (h, peer->public_addr);
+    h = hash_int (h, peer->public_port);
+    h = hash_str (h, peer->service_url);
+    h = hash_str (h, peer->addr_str);
+    h = hash_int (h, peer->port);
+    h = hash_int (h, peer->net_state);
+    h = hash_int (h, (gint64)(gintptr)peer->pubkey);
+    h = hash_str (h, peer->pubkey_str);
+    h = hash_str (h, peer->session_key);
+    flags = peer->is_self | peer->can_connect << 1 |
+        peer->in_local_network << 2 | peer->in_connection << 3 |
+        peer->is_ready << 4 | peer->encrypt_channel << 5;
+    h = hash_int (h, flags);
+    h = hash_str_set (h, &peer->roles);
+    return hash_str_set (h, &peer->myroles);
+}
+
+static CcnetPeerCopy *
+copy_peer (CcnetPeer *peer, guint64 stamp)
+{
+    CcnetPeerCopy *copy = g_object_new (CCNET_TYPE_PEER_COPY, NULL);
+    guint i;
+
+    memcpy (copy->id, peer->id, 41);
+    copy->stamp = stamp;
+    copy->values = g_new0 (GValue, n_peer_props);
+    for (i = 0; i < n_peer_props; i++) {
+        g_value_init (&copy->values[i],
+                      G_PARAM_SPEC_VALUE_TYPE (peer_props[i]));
+        g_object_get_property ((GObject *)peer,
+                               g_param_spec_get_name (peer_props[i]),
+                               &copy->values[i]);
+    }
+    if (name_prop >= 0)
+        copy->name = g_value_get_string (&copy->values[name_prop]);
+
+    copy->n_roles = ccnet_str_set_size (&peer->roles);
+    copy->roles = g_memdup (peer->roles.items,
+                            copy->n_roles * sizeof(char *));
+    return copy;
+}
+
+static void
+free_copy_array (gpointer array)
+{
+    g_ptr_array_free (array, TRUE);
+}
+
+static void
+add_copy (CcnetPeerView *view, CcnetPeerCopy *copy)
+{
+    GPtrArray *with_role;
+    guint i;
+
+    g_ptr_array_add (view->peers, copy);
+    g_hash_table_insert (view->by_id, copy->id, copy);
+    if (copy->name && !g_hash_table_lookup (view->by_name, copy->name))
+        g_hash_table_insert (view->by_name, (gpointer)copy->name, copy);
+
+    for (i = 0; i < copy->n_roles; i++) {
+        with_role = g_hash_table_lookup (view->by_role, copy->roles[i]);
+        if (!with_role) {
+            with_role = g_ptr_array_new ();
+            g_hash_table_insert (view->by_role, (gpointer)copy->roles[i],
+                                 with_role);
+        }
+        g_ptr_array_add (with_role, copy);
+    }
+}
+
+CcnetPeerView *
+ccnet_peer_view_build (CcnetPeerTable *table, CcnetPeerView *prev)
+{
+    CcnetPeerView *view = g_new0 (CcnetPeerView, 1);
+    CcnetPeerTableIter iter;
+    CcnetPeer *peer;
+    guint reused = 0;
+
+    view->ref = 1;
+    view->time = g_get_monotonic_time ();
+    view->peers = g_ptr_array_sized_new (ccnet_peer_table_size (table));
+    view->by_id = g_hash_table_new (g_str_hash, g_str_equal);
+    view->by_name = g_hash_table_new (g_str_hash, g_str_equal);
+    view->by_role = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                           NULL, free_copy_array);
+
+    ccnet_peer_table_iter_init (&iter, table);
+    while (ccnet_peer_table_iter_next (&iter, &peer)) {
+        guint64 stamp = peer_stamp (peer);
+        CcnetPeerCopy *copy = NULL;
+
+        if (prev)
+            copy = g_hash_table_lookup (prev->by_id, peer->id);
+        if (copy && copy->stamp == stamp) {
+            g_object_ref (copy);
+            reused++;
+        } else {
+            copy = copy_peer (peer, stamp);
+        }
+        add_copy (view, copy);
+    }
+
+    ccnet_debug ("[Peer] Built a view of %u peers, %u copied\n",
+                 view->peers->len, view->peers->len - reused);
+    return view;
+}
+
+CcnetPeerView *
+ccnet_peer_view_ref (CcnetPeerView *view)
+{
+    g_atomic_int_inc (&view->ref);
+    return view;
+}
+
+void
+ccnet_peer_view_unref (CcnetPeerView *view)
+{
+    guint i;
+
+    if (!view || !g_atomic_int_dec_and_test (&view->ref))
+        return;
+
+    g_hash_table_destroy (view->by_role);
+    g_hash_table_destroy (view->by_name);
+    g_hash_table_destroy (view->by_id);
+    for (i = 0; i < view->peers->len; i++)
+        g_object_unref (g_ptr_array_index (view->peers, i));
+    g_ptr_array_free (view->peers, TRUE);
+    g_free (view);
+}
+
+gint64
+ccnet_peer_view_get_time (CcnetPeerView *view)
+{
+    return view->time;
+}
+
+static GObject *
+ref_copy (CcnetPeerCopy *copy)
+{
+    return copy ? g_object_ref (copy) : NULL;
+}
+
+GObject *
+ccnet_peer_view_lookup (CcnetPeerView *view, const char *peer_id)
+{
+    return ref_copy (g_hash_table_lookup (view->by_id, peer_id));
+}
+
+GObject *
+ccnet_peer_view_lookup_by_name (CcnetPeerView *view, const char *name)
+{
+    return ref_copy (g_hash_table_lookup (view->by_name, name));
+}
+
+GList *
+ccnet_peer_view_get_peers_with_role (CcnetPeerView *view, const char *role)
+{
+    GPtrArray *with_role;
+    GQuark quark;
+    GList *list = NULL;
+    guint i;
+
+    /* Roles which were never interned have no peers. */
+    quark = g_quark_try_string (role);
+    if (!quark)
+        return NULL;
+    with_role = g_hash_table_lookup (view->by_role,
+                                     g_quark_to_string (quark));
+    if (!with_role)
+        return NULL;
+
+    for (i = with_role->len; i > 0; i--)
+        list = g_list_prepend (list, ref_copy (with_role->pdata[i - 1]));
+    return list;
+}
+
+void
+ccnet_peer_view_append_ids (CcnetPeerView *view, GString *buf)
+{
+    guint i;
+
+    for (i = 0; i < view->peers->len; i++) {
+        CcnetPeerCopy *copy = g_ptr_array_index (view->peers, i);
+        g_string_append_printf (buf, "%s\n", copy->id);
+    }
+}
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_PEER_VIEW_H
+#define CCNET_PEER_VIEW_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "peer-table.h"
+
+/*
+ * Read-only copies of the peers, for threads other than the main one.
+ *
+ * Peers and the peer manager belong to the main thread. Readers in
+ * other threads, such as threaded rpc functions, use a view instead: an
+ * immutable snapshot of the peers published by the main thread, see
+ * ccnet_peer_manager_get_view(). A reader holds a reference on a view
+ * and uses it without locks for as long as it likes. Views are never
+ * changed once built; the main thread publishes a new one, and the old
+ * one is freed with its last reference.
+ *
+ * The peers of a view are GObjects with the properties of CcnetPeer, so
+ * rpc functions can return them as they are. A peer which didn't change
+ * from one view to the next keeps its copy.
+ *
+ * All of it may be called from any thread but ccnet_peer_view_build().
+ */
+
+typedef struct CcnetPeerView CcnetPeerView;
+
+/* Main thread only. A view of the peers in @table, reusing the copies
+ * in @prev, if not NULL, of the peers which haven't changed. */
+CcnetPeerView *ccnet_peer_view_build (CcnetPeerTable *table,
+                                      CcnetPeerView *prev);
+
+CcnetPeerView *ccnet_peer_view_ref (CcnetPeerView *view);
+void ccnet_peer_view_unref (CcnetPeerView *view);
+
+/* When the view was built, in g_get_monotonic_time() usec. */
+gint64 ccnet_peer_view_get_time (CcnetPeerView *view);
+
+/* A new reference on the copy of the peer, or NULL. */
+GObject *ccnet_peer_view_lookup (CcnetPeerView *view, const char *peer_id);
+GObject *ccnet_peer_view_lookup_by_name (CcnetPeerView *view,
+                                         const char *name);
+
+/* The copies of the peers with @role, each with a new reference. */
+GList *ccnet_peer_view_get_peers_with_role (CcnetPeerView *view,
+                                            const char *role);
+
+/* Append "<id>\n" for every peer. */
+void ccnet_peer_view_append_ids (CcnetPeerView *view, GString *buf);
+
+#endif
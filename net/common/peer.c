@@ -5,6 +5,7 @@
 #include <event.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #ifdef WIN32
     #include <winsock2.h>
@@ -29,10 +30,18 @@
 #include "processor.h"
 #include "proc-factory.h"
 #include "processors/service-proxy-proc.h"
+#include "processors/service-stub-proc.h"
 #include "connect-mgr.h"
+#include "metrics.h"
+#include "compress.h"
+#include "local-shm.h"
+#include "trace.h"
 
 #include "utils.h"
 
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
 #define DEBUG_FLAG  CCNET_DEBUG_PEER
 #include "log.h"
 
@@ -51,17 +60,44 @@ static guint signals[LAST_SIGNAL] = { 0 };
 
 #define OBJECT_TYPE_STRING "peer"
 
+#define PEER_ROLES_INTERNED
 #include "../lib/peer-common.h"
 
 void ccnet_peer_set_net_state (CcnetPeer *peer, int net_state);
 static void ccnet_peer_finalize (GObject *object);
 
 static void shutdown_processors (CcnetPeer *peer);
+static void proc_slots_init (CcnetProcSlots *t);
+
+static void peer_crypt_free (CcnetPeerCrypt *crypt);
+
+void ccnet_peer_packet_prepare (const CcnetPeer *peer, int type, int id);
+void ccnet_peer_packet_finish_send (const CcnetPeer *peer);
+static void flush_corks (CcnetPeer *peer, gboolean force);
+
+static void set_pubkey_from_string (CcnetPeer *peer, const char *str);
 
 static void
 set_property (GObject *object, guint property_id, 
               const GValue *v, GParamSpec *pspec)
 {
+    CcnetPeer *peer = (CcnetPeer *)object;
+
+    switch (property_id) {
+    case P_PUBKEY:
+        set_pubkey_from_string (peer, g_value_get_string (v));
+        return;
+    case P_SERVICE_URL:
+        ccnet_str_unref (peer->service_url);
+        peer->service_url = (char *)ccnet_str_ref (g_value_get_string (v));
+        g_free (peer->pubinfo);
+        peer->pubinfo = NULL;
+        return;
+    case P_NAME:
+        g_free (peer->pubinfo);
+        peer->pubinfo = NULL;
+        break;
+    }
     set_property_common (object, property_id, v, pspec);
 }
 
@@ -72,10 +108,24 @@ ccnet_peer_finalize (GObject *object)
 
     g_free (peer->name);
     g_free (peer->addr_str);
-    g_free (peer->service_url);
-    g_hash_table_unref (peer->processors);
+    ccnet_str_unref (peer->service_url);
+    g_free (peer->pubkey_str);
+    g_free (peer->pubinfo);
+    g_free (peer->procs[0].slots);
+    g_free (peer->procs[1].slots);
+    if (peer->proc_overflow)
+        g_hash_table_unref (peer->proc_overflow);
     g_free (peer->session_key);
+    g_free (peer->stats);
+    ccnet_str_set_clear (&peer->roles);
+    ccnet_str_set_clear (&peer->myroles);
+    peer_crypt_free (peer->crypt);
+    ccnet_compress_ctx_free (peer->zctx);
     evbuffer_free (peer->packet);
+    evbuffer_free (peer->cork);
+    evbuffer_free (peer->cork_ctl);
+    if (peer->inproc_in)
+        evbuffer_free (peer->inproc_in);
 
     if (peer->pubkey)
         RSA_free (peer->pubkey);
@@ -90,11 +140,30 @@ ccnet_peer_free (CcnetPeer *peer)
     g_object_unref (peer);
 }
 
+/* Totals over all peers, see metrics.h. */
+static CcnetMetric *metric_pkts_in;
+static CcnetMetric *metric_bytes_in;
+static CcnetMetric *metric_pkts_out;
+static CcnetMetric *metric_bytes_out;
+static CcnetMetric *metric_bytes_saved;
+
 static void
 ccnet_peer_class_init (CcnetPeerClass *klass)
 {
     GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
+    metric_pkts_in = ccnet_metrics_counter (
+        "ccnet_packets_received_total", NULL, "Packets received from peers");
+    metric_bytes_in = ccnet_metrics_counter (
+        "ccnet_received_bytes_total", NULL, "Bytes of packets received");
+    metric_pkts_out = ccnet_metrics_counter (
+        "ccnet_packets_sent_total", NULL, "Packets sent to peers");
+    metric_bytes_out = ccnet_metrics_counter (
+        "ccnet_sent_bytes_total", NULL, "Bytes of packets sent");
+    metric_bytes_saved = ccnet_metrics_counter (
+        "ccnet_compression_saved_bytes_total", NULL,
+        "Bytes saved by compressing packets");
+
     gobject_class->finalize = ccnet_peer_finalize;
     gobject_class->get_property = get_property;
     gobject_class->set_property = set_property;
@@ -147,11 +216,13 @@ ccnet_peer_new (const char *id)
     peer->net_state = PEER_DOWN;
     peer->public_port = 0;
 
-    peer->processors = g_hash_table_new_full (g_direct_hash,  g_direct_equal, 
-                                              NULL, NULL);
+    proc_slots_init (&peer->procs[0]);
+    proc_slots_init (&peer->procs[1]);
     peer->reqID = CCNET_USER_ID_START;
 
     peer->packet = evbuffer_new ();
+    peer->cork = evbuffer_new ();
+    peer->cork_ctl = evbuffer_new ();
 
     return peer;
 }
@@ -178,9 +249,34 @@ inline static void append_int64_property (GString *buf, const char *name,
 }
 
 
+/*
+ * The pubinfo text and the encoded public key are kept, so a peer
+ * which is sent over and over, or sends the same pubinfo again, costs
+ * no RSA encoding or decoding. Both are dropped when a field in them
+ * changes.
+ */
+
+static void
+set_pubkey_from_string (CcnetPeer *peer, const char *str)
+{
+    if (str && peer->pubkey && g_strcmp0 (str, peer->pubkey_str) == 0)
+        return;
+
+    if (peer->pubkey)
+        RSA_free(peer->pubkey);
+    peer->pubkey = public_key_from_string_cached (str);
+    g_free (peer->pubkey_str);
+    peer->pubkey_str = peer->pubkey ? g_strdup (str) : NULL;
+    g_free (peer->pubinfo);
+    peer->pubinfo = NULL;
+}
+
 GString*
 ccnet_peer_to_string (CcnetPeer *peer)
 {
+    if (peer->pubinfo)
+        return g_string_new (peer->pubinfo);
+
     GString *buf = g_string_new (NULL);
     g_string_append (buf, "peer/");
     g_string_append (buf, peer->id);
@@ -190,33 +286,48 @@ ccnet_peer_to_string (CcnetPeer *peer)
     append_string_property (buf, "service-url", peer->service_url);
 
     if (peer->pubkey) {
-        GString *str = public_key_to_gstring(peer->pubkey);
-        g_string_append_printf (buf, "%s %s\n", "pubkey", str->str);
-        g_string_free(str, TRUE);
+        if (!peer->pubkey_str) {
+            GString *str = public_key_to_gstring(peer->pubkey);
+            peer->pubkey_str = g_string_free (str, FALSE);
+        }
+        g_string_append_printf (buf, "%s %s\n", "pubkey", peer->pubkey_str);
     }
 
+    peer->pubinfo = g_strdup (buf->str);
     return buf;
 }
 
+static void
+replace_string_field (CcnetPeer *peer, char **field, const char *value)
+{
+    if (g_strcmp0 (*field, value) == 0)
+        return;
+    g_free (*field);
+    *field = g_strdup(value);
+    g_free (peer->pubinfo);
+    peer->pubinfo = NULL;
+}
 
 static void parse_field (CcnetPeer *peer, const char *key, char *value)
 {
     if (strcmp(key, "name") == 0) {
-        g_free (peer->name);
-        peer->name = g_strdup(value);
+        replace_string_field (peer, &peer->name, value);
         return;
     }
     
     if (strcmp(key, "service-url") == 0) {
-        g_free (peer->service_url);
-        peer->service_url = g_strdup(value);
+        if (g_strcmp0 (peer->service_url, value) != 0) {
+            /* Most peers of a relay share a few urls. */
+            ccnet_str_unref (peer->service_url);
+            peer->service_url = (char *)ccnet_str_ref (value);
+            g_free (peer->pubinfo);
+            peer->pubinfo = NULL;
+        }
         return;
     }
 
     if (strcmp(key, "pubkey") == 0) {
-        if (peer->pubkey)
-            RSA_free(peer->pubkey);
-        peer->pubkey = public_key_from_string (value);
+        set_pubkey_from_string (peer, value);
         return;
     }
 }
@@ -272,7 +383,10 @@ ccnet_peer_update_from_string (CcnetPeer *peer, char *content)
     parse_key_value_pairs (
         start, (KeyValueFunc)parse_field, peer);
 
-    peer->need_saving = 1;
+    if (peer->manager)
+        ccnet_peer_manager_mark_dirty (peer->manager, peer);
+    else
+        peer->need_saving = 1;
 out:
     g_free (object_type);
 }
@@ -293,17 +407,21 @@ ccnet_peer_set_net_state (CcnetPeer *peer, int net_state)
 
     if (net_state == PEER_DOWN) {
         g_assert (peer->io == NULL);
-        g_assert (g_hash_table_size(peer->processors) == 0);
+        g_assert (peer->n_processors == 0);
+        peer->rtt_sent = 0;
         if (!peer->is_local)
             --peer->manager->connected_peer;
     } else
         if (!peer->is_local)
             ++peer->manager->connected_peer;
 
-    if (net_state == PEER_CONNECTED && !peer->io->is_incoming)
+    if (net_state == PEER_CONNECTED && peer->io && !peer->io->is_incoming)
         g_object_set (peer, "can-connect", 1, NULL);
 
     g_object_set (peer, "net-state", net_state, NULL);
+
+    if (net_state == PEER_DOWN && peer->manager)
+        ccnet_peer_manager_on_peer_down (peer->manager, peer);
 }
 
 static void
@@ -339,32 +457,151 @@ void ccnet_peer_set_pubkey (CcnetPeer *peer, char *str)
     g_object_set (peer, "pubkey", str, NULL);
     if (!peer->pubkey)
         ccnet_warning("Wrong public key format\n");
-    peer->need_saving = 1;
+    if (peer->manager)
+        ccnet_peer_manager_mark_dirty (peer->manager, peer);
+    else
+        peer->need_saving = 1;
+}
+
+void ccnet_peer_take_pubkey (CcnetPeer *peer, RSA *key, const char *str)
+{
+    if (peer->pubkey)
+        RSA_free (peer->pubkey);
+    peer->pubkey = key;
+    g_free (peer->pubkey_str);
+    peer->pubkey_str = g_strdup (str);
+    g_free (peer->pubinfo);
+    peer->pubinfo = NULL;
+    if (peer->manager)
+        ccnet_peer_manager_mark_dirty (peer->manager, peer);
+    else
+        peer->need_saving = 1;
+}
+
+static void
+peer_crypt_free (CcnetPeerCrypt *crypt)
+{
+    if (!crypt)
+        return;
+    ccnet_cipher_ctx_free (crypt->enc_ctx);
+    ccnet_cipher_ctx_free (crypt->dec_ctx);
+    g_free (crypt);
 }
 
 int
-ccnet_peer_prepare_channel_encryption (CcnetPeer *peer)
+ccnet_peer_prepare_channel_encryption (CcnetPeer *peer,
+                                       int cipher,
+                                       gboolean initiator)
 {
+    CcnetPeerCrypt *crypt;
+
     if (!peer->session_key)
         return -1;
 
+    /* Both sides skip it, TLS already encrypts the connection. */
+    if (peer->io && peer->io->tls)
+        return 0;
+
+    /* Corked packets must go out with the old settings. */
+    ccnet_peer_flush (peer);
+
     if ( ccnet_generate_cipher(peer->session_key, strlen(peer->session_key),
                                peer->key, peer->iv) < 0)
         return -1;
 
+    crypt = g_new0 (CcnetPeerCrypt, 1);
+    crypt->cipher = cipher;
+    crypt->initiator = initiator;
+    crypt->enc_ctx = ccnet_cipher_ctx_new (cipher, 1, peer->key, peer->iv);
+    crypt->dec_ctx = ccnet_cipher_ctx_new (cipher, 0, peer->key, peer->iv);
+    if (!crypt->enc_ctx || !crypt->dec_ctx) {
+        peer_crypt_free (crypt);
+        return -1;
+    }
+
+    peer_crypt_free (peer->crypt);
+    peer->crypt = crypt;
+
+    ccnet_debug ("[Peer] Encrypt channel to %s(%.8s) with %s\n",
+                 peer->name, peer->id, ccnet_cipher_to_string (cipher));
+
     peer->encrypt_channel = 1;
     return 0;
 }
 
+/*
+ * Both directions share the key, so the first nonce byte tells who sent
+ * the packet, and the sequence number makes each nonce unique. It is not
+ * transmitted, TCP keeps both sides in step.
+ */
+static void
+make_channel_nonce (const CcnetPeer *peer, gboolean outgoing,
+                    guint64 seq, unsigned char *nonce)
+{
+    uint8_t *ptr = nonce + 4;
+    gboolean from_initiator = outgoing ? peer->crypt->initiator
+                                       : !peer->crypt->initiator;
+
+    nonce[0] = from_initiator ? 1 : 0;
+    memcpy (nonce + 1, peer->iv + 1, 3);
+    put64bit (&ptr, seq);
+}
+
+static int
+peer_decrypt (CcnetPeer *peer, char *data, int *out_len, int in_len)
+{
+    CcnetPeerCrypt *crypt = peer->crypt;
+    unsigned char nonce[CCNET_AEAD_NONCE_SIZE];
+
+    if (!CCNET_CIPHER_IS_AEAD(crypt->cipher))
+        return ccnet_decrypt_with_ctx (crypt->dec_ctx, peer->iv,
+                                       data, out_len, data, in_len);
+
+    make_channel_nonce (peer, FALSE, crypt->recv_seq++, nonce);
+    return ccnet_aead_decrypt_with_ctx (crypt->dec_ctx, nonce,
+                                        data, out_len, data, in_len);
+}
+
+static int
+peer_encrypt (const CcnetPeer *peer, char *data_out, int *out_len,
+              const char *data_in, int in_len)
+{
+    CcnetPeerCrypt *crypt = peer->crypt;
+    unsigned char nonce[CCNET_AEAD_NONCE_SIZE];
+
+    if (!CCNET_CIPHER_IS_AEAD(crypt->cipher))
+        return ccnet_encrypt_with_ctx (crypt->enc_ctx, peer->iv,
+                                       data_out, out_len, data_in, in_len);
+
+    make_channel_nonce (peer, TRUE, crypt->send_seq++, nonce);
+    return ccnet_aead_encrypt_with_ctx (crypt->enc_ctx, nonce,
+                                        data_out, out_len, data_in, in_len);
+}
+
 /* -------- role management -------- */
 
+/*
+ * Roles are interned by their CcnetStrSet, so they are shared between
+ * peers and the role index of the peer manager and can be compared as
+ * pointers. They are never freed.
+ */
+
+static void
+role_changed (CcnetPeer *peer, const char *role, gboolean added)
+{
+    peer->perm_mask_valid = 0;
+    if (peer->manager)
+        ccnet_peer_manager_on_role_changed (peer->manager, peer,
+                                            role, added);
+}
+
 void
 ccnet_peer_add_role (CcnetPeer *peer, const char *role)
 {
-    if (!ccnet_peer_has_role(peer, role)) {
-        peer->role_list = string_list_append_sorted (
-            peer->role_list, role);
-    }
+    g_return_if_fail (role != NULL);
+
+    if ((role = ccnet_str_set_add (&peer->roles, role)) != NULL)
+        role_changed (peer, role, TRUE);
 }
 
 void
@@ -372,38 +609,39 @@ ccnet_peer_remove_role (CcnetPeer *peer, const char *role)
 {
     g_return_if_fail (role != NULL);
 
-    if (!string_list_is_exists(peer->role_list, role))
-        return;
-
-    peer->role_list = string_list_remove (peer->role_list, role);
+    if ((role = ccnet_str_set_remove (&peer->roles, role)) != NULL)
+        role_changed (peer, role, FALSE);
 }
 
 gboolean
 ccnet_peer_has_role (CcnetPeer *peer, const char *role)
 {
-    return string_list_is_exists(peer->role_list, role);
+    return ccnet_str_set_lookup (&peer->roles, role) != NULL;
 }
 
 gboolean
 ccnet_peer_has_my_role (CcnetPeer *peer, const char *role)
 {
-    return string_list_is_exists(peer->myrole_list, role);
+    return ccnet_str_set_lookup (&peer->myroles, role) != NULL;
 }
 
 void
 ccnet_peer_set_roles (CcnetPeer *peer, const char *roles)
 {
-    GList *role_list = string_list_parse_sorted (roles, ",");
-    string_list_free (peer->role_list);
-    peer->role_list = role_list;
+    guint i;
+
+    for (i = 0; i < ccnet_str_set_size (&peer->roles); ++i)
+        role_changed (peer, ccnet_str_set_index (&peer->roles, i), FALSE);
+
+    ccnet_str_set_parse (&peer->roles, roles, ",");
+    for (i = 0; i < ccnet_str_set_size (&peer->roles); ++i)
+        role_changed (peer, ccnet_str_set_index (&peer->roles, i), TRUE);
 }
 
 void
 ccnet_peer_set_myroles (CcnetPeer *peer, const char *roles)
 {
-    GList *role_list = string_list_parse_sorted (roles, ",");
-    string_list_free (peer->myrole_list);
-    peer->myrole_list = role_list;
+    ccnet_str_set_parse (&peer->myroles, roles, ",");
 
     /* ccnet_debug ("[Peer] Myrole on %s(%.8s) is set to %s\n",  */
     /*              peer->id, peer->name, roles); */
@@ -412,16 +650,75 @@ ccnet_peer_set_myroles (CcnetPeer *peer, const char *roles)
 void
 ccnet_peer_get_roles_str (CcnetPeer *peer, GString* buf)
 {
-    string_list_join (peer->role_list, buf, ",");
+    ccnet_str_set_join (&peer->roles, buf, ",");
 }
 
 void
 ccnet_peer_get_myroles_str (CcnetPeer *peer, GString* buf)
 {
-    string_list_join (peer->myrole_list, buf, ",");
+    ccnet_str_set_join (&peer->myroles, buf, ",");
+}
+
+
+
+/* ----------- Session Resumption   --------------------- */
+
+void
+ccnet_peer_save_resume_secret (CcnetPeer *peer)
+{
+    int ttl;
+    SHA_CTX s;
+
+    if (!peer->session_key || !peer->manager)
+        return;
+
+    ttl = peer->manager->session->resume_ttl;
+    if (ttl <= 0)
+        return;
+
+    SHA1_Init (&s);
+    SHA1_Update (&s, "ccnet-resume", strlen("ccnet-resume"));
+    SHA1_Update (&s, peer->session_key, strlen(peer->session_key));
+    SHA1_Final (peer->resume_secret, &s);
+    peer->resume_expire = time(NULL) + ttl;
+}
+
+gboolean
+ccnet_peer_can_resume (CcnetPeer *peer)
+{
+    if (peer->resume_expire == 0)
+        return FALSE;
+
+    if (peer->resume_expire < time(NULL)) {
+        ccnet_peer_clear_resume_secret (peer);
+        return FALSE;
+    }
+
+    return TRUE;
 }
 
+void
+ccnet_peer_clear_resume_secret (CcnetPeer *peer)
+{
+    memset (peer->resume_secret, 0, CCNET_RESUME_SECRET_LEN);
+    peer->resume_expire = 0;
+}
 
+void
+ccnet_peer_resume_mac (CcnetPeer *peer, const char *label,
+                       const unsigned char *data, int len,
+                       unsigned char *mac)
+{
+    int label_len = strlen(label);
+    unsigned char *buf = g_malloc (label_len + len);
+    unsigned int mac_len;
+
+    memcpy (buf, label, label_len);
+    memcpy (buf + label_len, data, len);
+    HMAC (EVP_sha1(), peer->resume_secret, CCNET_RESUME_SECRET_LEN,
+          buf, label_len + len, mac, &mac_len);
+    g_free (buf);
+}
 
 /* ----------- Packet Handling & Networking   --------------------- */
 
@@ -434,24 +731,44 @@ static void remove_write_callbacks (CcnetPeer *peer)
 static void
 _peer_shutdown (CcnetPeer *peer)
 {
+    CcnetPeer *other;
+
     g_assert (!peer->in_processor_call);
     peer->in_shutdown = 1;
 
     if (peer->net_state == PEER_CONNECTED) {
+        /* Last words of the processors, with the held back ones. */
+        flush_corks (peer, TRUE);
         peer->last_down = time(NULL);
         ccnet_packet_io_free (peer->io);
         peer->io = NULL;
         g_object_set (peer, "can-connect", 0, NULL);
     }
+
+    if ((other = peer->inproc) != NULL) {
+        peer->inproc = NULL;
+        other->inproc = NULL;
+        ccnet_peer_local_down (other);
+    }
     peer->is_ready = 0;
+    peer->congested = 0;
+    peer->ctl_burst = 0;
+    peer->no_msg_stream = 0;
+    peer->no_proc_alive = 0;
+    peer->fast_verified = 0;
     g_free (peer->dns_addr);
     peer->dns_addr = NULL;
     peer->dns_done = 0;
 
     /* clear session key when peer down  */
+    ccnet_peer_save_resume_secret (peer);
     peer->encrypt_channel = 0;
     g_free (peer->session_key);
     peer->session_key = NULL;
+    peer_crypt_free (peer->crypt);
+    peer->crypt = NULL;
+    ccnet_compress_ctx_free (peer->zctx);
+    peer->zctx = NULL;
 
     ccnet_debug ("Shutdown all processors for peer %s\n", peer->name);
     shutdown_processors (peer);
@@ -491,6 +808,17 @@ ccnet_peer_shutdown (CcnetPeer *peer)
     schedule_shutdown (peer);
 }
 
+void
+ccnet_peer_local_down (CcnetPeer *peer)
+{
+    g_assert (peer->is_local);
+
+    ccnet_message ("Local peer down\n");
+    ccnet_peer_shutdown (peer);
+    ccnet_session_unregister_service (peer->manager->session, peer);
+    ccnet_peer_manager_remove_local_peer (peer->manager, peer);
+}
+
 
 static void
 create_remote_processor (CcnetPeer *peer, CcnetPeer *remote_peer,
@@ -512,7 +840,7 @@ create_local_processor (CcnetPeer *peer, int req_id, int argc, char **argv)
     CcnetProcessor *processor;
     CcnetProcFactory *factory = peer->manager->session->proc_factory;
 
-    processor = ccnet_proc_factory_create_slave_processor (
+    processor = ccnet_proc_factory_create_slave_processor_fast (
         factory, argv[0], peer, req_id);
 
     if (processor) {
@@ -579,26 +907,69 @@ static void create_processor (CcnetPeer *peer, int req_id,
     create_local_processor (peer, req_id, argc, argv);
 }
 
+#define MAX_REQUEST_ARGS     10
+#define REQUEST_STACK_BUF  1024
+
+/*
+ * Split buf in place into at most max_args words, the same way as
+ * g_strsplit_set (buf, " \t", max_args): separators are not merged
+ * and the last word takes the rest of the line.
+ * argv must have room for max_args + 1 pointers, it is NULL terminated.
+ */
+static int
+split_request (char *buf, char **argv, int max_args)
+{
+    int argc = 0;
+    char *p;
+
+    if (*buf == '\0') {
+        argv[0] = NULL;
+        return 0;
+    }
+
+    argv[argc++] = buf;
+    for (p = buf; *p && argc < max_args; p++) {
+        if (*p == ' ' || *p == '\t') {
+            *p = '\0';
+            argv[argc++] = p + 1;
+        }
+    }
+    argv[argc] = NULL;
+
+    return argc;
+}
+
 static void
 handle_request (CcnetPeer *peer, int req_id, char *data, int len)
 {
-    char *msg;
-    gchar **commands;
-    gchar **pcmd;
+    char stack_buf[REQUEST_STACK_BUF];
+    char *msg, *req;
+    char *commands[MAX_REQUEST_ARGS + 1];
     int  i, perm;
+    CcnetTraceContext trace = { 0, 0 }, saved;
 
-    /* TODO: remove string copy */
     if (len < 1)
         return;
-    msg = g_malloc (len+1);
+
+    /* The packet is not NUL terminated and the byte behind it may
+     * belong to the next packet, so the line is split in a copy. Requests
+     * are short, the stack will do for almost all of them.
+     */
+    if (len < REQUEST_STACK_BUF)
+        msg = stack_buf;
+    else
+        msg = g_malloc (len + 1);
     memcpy (msg, data, len);
     msg[len] = '\0';
 
-    commands = g_strsplit_set (msg, " \t", 10);
-    for (i=0, pcmd = commands; *pcmd; pcmd++)
-        i++;
-    if (i <= 0) return;
-    g_free (msg);
+    /* Taken off even if tracing is off here, see trace.h. */
+    req = msg;
+    if (*req == '@' && !ccnet_trace_parse (&req, &trace))
+        trace.trace_id = 0;
+
+    i = split_request (req, commands, MAX_REQUEST_ARGS);
+    if (i <= 0)
+        goto ret;
 
     /* permission checking */
     if (!peer->is_local) {
@@ -629,10 +1000,45 @@ handle_request (CcnetPeer *peer, int req_id, char *data, int len)
         goto ret;
     }
 
+    ccnet_trace_set_current (&trace, &saved);
     create_processor (peer, req_id, i, commands);
+    ccnet_trace_set_current (&saved, NULL);
 
 ret:
-    g_strfreev (commands);
+    if (msg != stack_buf)
+        g_free (msg);
+}
+
+/*
+ * Pass a response or update on to processor->forward by rewriting the
+ * header, without parsing the payload. The control codes, 1xx, and the
+ * errors, which end the processors, still go through the processors.
+ * Returns FALSE if the packet was not forwarded.
+ */
+static gboolean
+forward_packet (CcnetProcessor *processor, int type, char *data, int len)
+{
+    CcnetProcessor *target = processor->forward;
+    CcnetPeer *peer = target->peer;
+
+    if (len < 4 || data[0] == '1' || data[0] == '4' || data[0] == '5')
+        return FALSE;
+    if (target->state == STATE_IN_SHUTDOWN ||
+        len > ccnet_peer_max_payload_len (peer))
+        return FALSE;
+
+    processor->t_packet_recv = time(NULL);
+    target->t_packet_recv = processor->t_packet_recv;
+
+    /* the stub is the master, it gets the responses */
+    if (type == CCNET_MSG_UPDATE ? target->pooled : processor->pooled)
+        ccnet_service_stub_count (type == CCNET_MSG_UPDATE ? target : processor,
+                                  type, data, len);
+
+    ccnet_peer_packet_prepare (peer, type, REQUEST_ID (target->id));
+    evbuffer_add (peer->packet, data, len);
+    ccnet_peer_packet_finish_send (peer);
+    return TRUE;
 }
 
 static void
@@ -643,6 +1049,11 @@ handle_response (CcnetPeer *peer, int req_id, char *data, int len)
     int clen;
     char *ptr, *end;
 
+    processor = ccnet_peer_get_processor (peer, MASTER_ID (req_id));
+    if (processor && processor->forward &&
+        forward_packet (processor, CCNET_MSG_RESPONSE, data, len))
+        return;
+
     if (len < 4)
         goto error;
 
@@ -676,7 +1087,6 @@ handle_response (CcnetPeer *peer, int req_id, char *data, int len)
     clen = len - (ptr - data);
     
 parsed:
-    processor = ccnet_peer_get_processor (peer, MASTER_ID (req_id));
     if (processor == NULL) {
         /* do nothing if receiving SC_PROC_DEAD and the processor on
          * this side is also not present. Otherwise send SC_PROC_DEAD
@@ -695,9 +1105,14 @@ parsed:
     /*                  GET_PNAME(processor), PRINT_ID(processor->id), */
     /*                  code, code_msg); */
 
+    CcnetProcessorClass *klass = CCNET_PROCESSOR_GET_CLASS (processor);
+    gint64 start = g_get_monotonic_time ();
+
     peer->in_processor_call = 1;
     ccnet_processor_handle_response (processor, code, code_msg, content, clen);
     peer->in_processor_call = 0;
+    ccnet_processor_class_account (klass, "response", peer->id,
+                                   g_get_monotonic_time () - start);
     return;
 
 error:
@@ -712,6 +1127,11 @@ handle_update (CcnetPeer *peer, int req_id, char *data, int len)
     int clen;
     char *ptr, *end;
 
+    processor = ccnet_peer_get_processor (peer, SLAVE_ID(req_id));
+    if (processor && processor->forward &&
+        forward_packet (processor, CCNET_MSG_UPDATE, data, len))
+        return;
+
     if (len < 4)
         goto error;
     
@@ -745,7 +1165,6 @@ handle_update (CcnetPeer *peer, int req_id, char *data, int len)
     clen = len - (ptr - data);
     
 parsed:
-    processor = ccnet_peer_get_processor (peer, SLAVE_ID(req_id));
     if (processor == NULL) {
         if (memcmp(code, SC_PROC_DEAD, 3) != 0 
             && memcmp(code, SC_PROC_DONE, 3) != 0) {
@@ -762,9 +1181,14 @@ parsed:
     /*     ccnet_debug ("[RECV] handle_update %s id is %d, %s %s\n", */
     /*                  GET_PNAME(processor), PRINT_ID(processor->id), */
     /*                  code, code_msg); */
+    CcnetProcessorClass *klass = CCNET_PROCESSOR_GET_CLASS (processor);
+    gint64 start = g_get_monotonic_time ();
+
     peer->in_processor_call = 1;
     ccnet_processor_handle_update (processor, code, code_msg, content, clen);
     peer->in_processor_call = 0;
+    ccnet_processor_class_account (klass, "update", peer->id,
+                                   g_get_monotonic_time () - start);
     return;
 
 error:
@@ -772,25 +1196,139 @@ error:
 }
 
 
+/*
+ * Payload length of a packet still in network byte order, of which
+ * avail bytes are at hand. Returns -1 if it doesn't fit.
+ */
+static int
+frame_payload_len (ccnet_packet *packet, int avail, int *hdr_len)
+{
+    int len;
+
+    if (avail < CCNET_PACKET_LENGTH_HEADER)
+        return -1;
+
+    if (packet->header.version == CCNET_PACKET_VERSION_JUMBO) {
+        if (avail < CCNET_PACKET_LENGTH_JUMBO_HEADER)
+            return -1;
+        *hdr_len = CCNET_PACKET_LENGTH_JUMBO_HEADER;
+        len = ntohl (((ccnet_jumbo_header *)packet)->length);
+    } else {
+        *hdr_len = CCNET_PACKET_LENGTH_HEADER;
+        len = ntohs (packet->header.length);
+    }
+
+    if (len < 0 || len > avail - *hdr_len)
+        return -1;
+    return len;
+}
+
+static inline CcnetPeerStats *
+peer_stats (const CcnetPeer *peer)
+{
+    CcnetPeer *p = (CcnetPeer *)peer;
+
+    if (G_UNLIKELY (!p->stats))
+        p->stats = g_new0 (CcnetPeerStats, 1);
+    return p->stats;
+}
+
+static inline void
+trace_packet (CcnetPeer *peer, int out, const ccnet_header *header,
+              const char *data, uint32_t len)
+{
+    CcnetPeerStats *stats = peer_stats (peer);
+    CcnetPacketTrace *t = &stats->trace[stats->trace_pos++ &
+                                        (CCNET_PEER_TRACE_SIZE - 1)];
+
+    t->time = g_get_real_time ();
+    t->id = header->id;
+    t->len = len;
+    t->out = out;
+    t->type = header->type;
+    if ((header->type == CCNET_MSG_RESPONSE ||
+         header->type == CCNET_MSG_UPDATE) && len >= 3)
+        memcpy (t->code, data, 3);
+    else
+        t->code[0] = '\0';
+}
+
+/* The payload of a CCNET_MSG_COMPRESSED packet, see compress.h. */
+static char *
+decompress_payload (CcnetPeer *peer, const char *data, uint32_t *len)
+{
+    uint32_t orig_len;
+    char *out;
+
+    if (*len < CCNET_COMPRESS_HEADER_LEN)
+        return NULL;
+    memcpy (&orig_len, data + 1, 4);
+    orig_len = ntohl (orig_len);
+    if (orig_len > CCNET_PACKET_MAX_JUMBO_PAYLOAD_LEN)
+        return NULL;
+
+    if (!peer->zctx) {
+        peer->zctx = ccnet_compress_ctx_new ();
+        peer->trimmed = 0;
+    }
+    out = ccnet_decompress (peer->zctx, (unsigned char)data[0],
+                            data + CCNET_COMPRESS_HEADER_LEN,
+                            *len - CCNET_COMPRESS_HEADER_LEN, orig_len);
+    *len = orig_len;
+    return out;
+}
+
 static void
 handle_packet (ccnet_packet *packet, CcnetPeer *peer)
 {
-    switch (packet->header.type) {
+    char *data = ccnet_packet_get_data (packet);
+    uint32_t len = ccnet_packet_get_length (packet);
+    uint32_t wire_len = data - (char *)packet + len;
+    ccnet_header header = packet->header;
+    int type;
+    gint64 start = g_get_monotonic_time ();
+
+    if (header.type & CCNET_MSG_COMPRESSED) {
+        data = decompress_payload (peer, data, &len);
+        if (!data) {
+            ccnet_warning ("Bad compressed packet from %s(%.8s)\n",
+                           peer->name, peer->id);
+            return;
+        }
+        header.type &= ~CCNET_MSG_COMPRESSED;
+    }
+    type = header.type;
+
+    if (type < CCNET_PEER_N_MSG_TYPES) {
+        peer_stats (peer)->traffic.pkts_in[type]++;
+        peer->stats->traffic.bytes_in[type] += wire_len;
+    }
+    ccnet_metric_inc (metric_pkts_in);
+    ccnet_metric_add (metric_bytes_in, wire_len);
+    trace_packet (peer, 0, &header, data, len);
+
+    switch (type) {
     case CCNET_MSG_REQUEST:
-        handle_request (peer, packet->header.id, 
-                       packet->data, packet->header.length);
+        handle_request (peer, header.id, data, len);
         break;
     case CCNET_MSG_RESPONSE:
-        handle_response (peer, packet->header.id, 
-                        packet->data, packet->header.length);
+        handle_response (peer, header.id, data, len);
         break;
     case CCNET_MSG_UPDATE:
-        handle_update (peer, packet->header.id, 
-                      packet->data, packet->header.length);
+        handle_update (peer, header.id, data, len);
+        break;
+    case CCNET_MSG_HANDSHAKE:
+        /* Local clients announce their capabilities in the id field. */
+        if (peer->is_local && peer->io) {
+            peer->io->jumbo = (header.id & CCNET_CAP_JUMBO_PACKET) != 0;
+            ccnet_local_shm_accept (peer->io, header.id);
+        }
         break;
     default: 
-        ccnet_warning ("Unknown header type %d\n", packet->header.type);
+        ccnet_warning ("Unknown header type %d\n", type);
     };
+
+    peer_stats (peer)->traffic.handler_usec += g_get_monotonic_time () - start;
 }
 
 static void
@@ -806,33 +1344,64 @@ canRead (ccnet_packet *packet, void *vpeer)
     if (packet->header.id == 0)
         return;
 
+    peer->last_recv = time(NULL);
+
     if (packet->header.type != CCNET_MSG_ENCPACKET) {
         handle_packet (packet, peer);
     } else {
         /* ccnet_debug ("receive an encrypt packet\n"); */
 
-        if (!peer->session_key) {
+        if (!peer->session_key || !peer->crypt) {
             ccnet_debug("Receive a encrypted packet from %s(%.8s) while "
                         "not having session key \n", peer->name, peer->id);
             goto out;
         }
 
-        char *data;
         int len;
         int ret;
-        ret = ccnet_decrypt_with_key (&data, &len, packet->data, packet->header.id,
-                                      peer->key, peer->iv);
-        if (ret < 0)
+        gint64 start = g_get_monotonic_time ();
+        /* Decrypt in place. The packet is drained from the input buffer
+         * after this callback returns, so its memory can be reused.
+         */
+        ret = peer_decrypt (peer, packet->data, &len, packet->header.id);
+        peer_stats (peer)->traffic.decrypt_usec +=
+            g_get_monotonic_time () - start;
+        if (ret < 0 || len < CCNET_PACKET_LENGTH_HEADER) {
             ccnet_warning ("[SEND] decryption error for peer %s(%.8s) \n",
                            peer->name, peer->id);
-        else {
-            ccnet_packet *new_pac = (ccnet_packet *)data;
-            /* byte order, from network to host */
-            new_pac->header.length = ntohs(new_pac->header.length);
-            new_pac->header.id = ntohl (new_pac->header.id);
-
-            handle_packet (new_pac, peer);
-            g_free (data);
+            /* With an AEAD cipher this means the packet was tampered
+             * with, or the nonces are out of step. Either way the
+             * channel can't be used any more.
+             */
+            if (CCNET_CIPHER_IS_AEAD(peer->crypt->cipher))
+                ccnet_peer_shutdown (peer);
+        } else {
+            /* A batch may hold several packets, see ccnet_peer_flush(). */
+            char *ptr = packet->data;
+            int hdr_len, plen;
+
+            while (len > 0) {
+                ccnet_packet *new_pac = (ccnet_packet *)ptr;
+
+                plen = frame_payload_len (new_pac, len, &hdr_len);
+                if (plen < 0) {
+                    ccnet_warning ("Bad packet in encrypted batch from "
+                                   "%s(%.8s)\n", peer->name, peer->id);
+                    break;
+                }
+
+                /* byte order, from network to host */
+                if (hdr_len == CCNET_PACKET_LENGTH_JUMBO_HEADER)
+                    ((ccnet_jumbo_header *)new_pac)->length = plen;
+                else
+                    new_pac->header.length = plen;
+                new_pac->header.id = ntohl (new_pac->header.id);
+
+                handle_packet (new_pac, peer);
+
+                ptr += hdr_len + plen;
+                len -= hdr_len + plen;
+            }
         }
     }
 
@@ -883,6 +1452,124 @@ ccnet_peer_remove_write_callback (CcnetPeer *peer,
 }
 
 
+static void
+notify_flow_control (CcnetPeer *peer, gboolean paused)
+{
+    GList *procs, *ptr;
+    unsigned int in_call = peer->in_processor_call;
+
+    /* Processors may finish in the callback. */
+    procs = ccnet_peer_get_processor_list (peer);
+    g_list_foreach (procs, (GFunc)g_object_ref, NULL);
+
+    peer->in_processor_call = 1;
+    for (ptr = procs; ptr; ptr = ptr->next) {
+        CcnetProcessor *processor = ptr->data;
+        if (!processor->detached)
+            ccnet_processor_flow_control (processor, paused);
+    }
+    peer->in_processor_call = in_call;
+
+    g_list_foreach (procs, (GFunc)g_object_unref, NULL);
+    g_list_free (procs);
+}
+
+static void
+check_congestion (CcnetPeer *peer)
+{
+    size_t len;
+
+    if (!peer->io)
+        return;
+
+    len = ccnet_packet_io_output_length (peer->io);
+    if (len > peer_stats (peer)->traffic.max_out_queue)
+        peer->stats->traffic.max_out_queue = len;
+    if (!peer->congested && len >= peer->io->out_high) {
+        ccnet_debug ("[Peer] Output to %s(%.8s) congested, %u bytes queued\n",
+                     peer->name, peer->id, (unsigned)len);
+        peer->congested = 1;
+        notify_flow_control (peer, TRUE);
+    } else if (peer->congested && len <= peer->io->out_low) {
+        peer->congested = 0;
+        notify_flow_control (peer, FALSE);
+    }
+}
+
+gboolean
+ccnet_peer_is_congested (const CcnetPeer *peer)
+{
+    return peer->congested;
+}
+
+static const char *msg_type_names[CCNET_PEER_N_MSG_TYPES] = {
+    "ok", "handshake", "request", "response", "update", "relay", "encpacket",
+};
+
+static void
+append_traffic (GString *buf, const char *dir,
+                const guint64 *pkts, const guint64 *bytes)
+{
+    int i;
+
+    g_string_append (buf, dir);
+    for (i = 0; i < CCNET_PEER_N_MSG_TYPES; ++i) {
+        if (pkts[i] == 0)
+            continue;
+        g_string_append_printf (buf, " %s %" G_GUINT64_FORMAT
+                                "/%" G_GUINT64_FORMAT,
+                                msg_type_names[i], pkts[i], bytes[i]);
+    }
+}
+
+void
+ccnet_peer_format_traffic (CcnetPeer *peer, GString *buf)
+{
+    static const CcnetPeerTraffic none;
+    const CcnetPeerTraffic *t = peer->stats ? &peer->stats->traffic : &none;
+    size_t queued = peer->io ? ccnet_packet_io_output_length (peer->io) : 0;
+
+    g_string_append_printf (buf, "peer %.8s %s ", peer->id,
+                            peer->name ? peer->name : "-");
+    append_traffic (buf, "in", t->pkts_in, t->bytes_in);
+    append_traffic (buf, " out", t->pkts_out, t->bytes_out);
+    g_string_append_printf (buf, " encrypt_usec %" G_GUINT64_FORMAT
+                            " decrypt_usec %" G_GUINT64_FORMAT
+                            " handler_usec %" G_GUINT64_FORMAT
+                            " out_queue %u max_out_queue %u procs %u\n",
+                            t->encrypt_usec, t->decrypt_usec, t->handler_usec,
+                            (unsigned)queued, (unsigned)t->max_out_queue,
+                            ccnet_peer_get_processor_count (peer));
+}
+
+void
+ccnet_peer_format_trace (CcnetPeer *peer, GString *buf)
+{
+    CcnetPeerStats *stats = peer->stats;
+    CcnetPacketTrace *t;
+    guint i, start = 0;
+    time_t secs;
+    char tbuf[32];
+
+    if (!stats)
+        return;
+    if (stats->trace_pos > CCNET_PEER_TRACE_SIZE)
+        start = stats->trace_pos - CCNET_PEER_TRACE_SIZE;
+
+    for (i = start; i != stats->trace_pos; ++i) {
+        t = &stats->trace[i & (CCNET_PEER_TRACE_SIZE - 1)];
+        secs = t->time / G_USEC_PER_SEC;
+        strftime (tbuf, sizeof(tbuf), "%H:%M:%S", localtime (&secs));
+        g_string_append_printf (buf, "%s.%06d %s %s %d %u %.3s\n",
+                                tbuf, (int)(t->time % G_USEC_PER_SEC),
+                                t->out ? "out" : "in",
+                                t->type < CCNET_PEER_N_MSG_TYPES ?
+                                msg_type_names[t->type] : "?",
+                                PRINT_ID(t->id), t->len,
+                                t->code[0] ? t->code : "-");
+    }
+}
+
 static void
 didWrite(struct bufferevent * evin, void * vpeer)
 {
@@ -890,6 +1577,13 @@ didWrite(struct bufferevent * evin, void * vpeer)
     GList *ptr;
 
     g_object_ref (peer);
+
+    /* The bulk packets held back while the output was full. */
+    if (EVBUFFER_LENGTH (peer->cork) > 0)
+        ccnet_peer_flush (peer);
+    else
+        check_congestion (peer);
+
     peer->in_writecb = 1;
 
     for (ptr = peer->write_cbs; ptr; ) {
@@ -929,11 +1623,7 @@ gotError (struct bufferevent *evbuf, short what, void *vpeer)
             ccnet_warning ("libevent got an error! what=%hd, errno=%d (%s)\n",
                            what, errno, strerror(errno));
         if (peer->is_local) {
-             ccnet_message ("Local peer down\n");
-             ccnet_peer_shutdown (peer);
-             ccnet_session_unregister_service (peer->manager->session, peer);
-             ccnet_peer_manager_remove_local_peer (peer->manager,
-                                                   peer);
+            ccnet_peer_local_down (peer);
         } else {
             ccnet_message ("[Net Error] Peer %s (%.10s) down\n", peer->name, peer->id);
             peer->num_fails++;
@@ -965,10 +1655,37 @@ ccnet_peer_set_io (CcnetPeer *peer, CcnetPacketIO *io)
 }
 
 
+static inline void
+advance_request_id (CcnetPeer *peer)
+{
+    /* Ids must stay clear of SLAVE_MASK. */
+    if (peer->reqID >= REQUEST_ID_MASK)
+        peer->reqID = CCNET_USER_ID_START;
+    else
+        peer->reqID++;
+}
+
+/*
+ * The next master id that no live processor uses. Ids keep advancing
+ * rather than reusing the lowest free one, so late responses to a
+ * finished processor don't reach a new one. Ids whose slot in the
+ * processor table is taken are skipped, so masters never go to the
+ * overflow table; as it is at most half full this is a probe or two.
+ * Only once every slot has been tried does any id that is not live do.
+ */
 int
 ccnet_peer_get_request_id (CcnetPeer *peer)
 {
-    return (++peer->reqID);
+    CcnetProcSlots *t = &peer->procs[0];
+    guint tries;
+
+    for (tries = 0; ; tries++) {
+        advance_request_id (peer);
+        if (tries <= t->mask && t->slots[peer->reqID & t->mask])
+            continue;
+        if (!ccnet_peer_get_processor (peer, MASTER_ID (peer->reqID)))
+            return peer->reqID;
+    }
 }
 
 
@@ -976,6 +1693,13 @@ ccnet_peer_get_request_id (CcnetPeer *peer)
 /* #define DEBUG_FLAG  CCNET_DEBUG_NETIO */
 #include "log.h"
 
+/* Flush the cork right away once this much is queued. */
+#define CCNET_CORK_MAX 65536
+
+/* Control packets written while bulk ones are held back, before the
+ * bulk ones are let through anyway. */
+#define CCNET_CONTROL_BURST_MAX (256 * 1024)
+
 void
 ccnet_peer_packet_prepare (const CcnetPeer *peer, int type, int id)
 {
@@ -1003,53 +1727,449 @@ void
 ccnet_peer_packet_finish (const CcnetPeer *peer)
 {
     ccnet_header *header;
-    header = (ccnet_header *) EVBUFFER_DATA(peer->packet);
-    header->length = htons (EVBUFFER_LENGTH(peer->packet)
-                          - CCNET_PACKET_LENGTH_HEADER);
+    ccnet_jumbo_header jumbo;
+    uint32_t len;
+
+    /* Only the header, which prepare() put in the first chain, the
+     * payload may be large or referenced and isn't pulled up. */
+    header = (ccnet_header *) evbuffer_pullup (peer->packet,
+                                               CCNET_PACKET_LENGTH_HEADER);
+    len = EVBUFFER_LENGTH(peer->packet) - CCNET_PACKET_LENGTH_HEADER;
+    if (len <= CCNET_PACKET_MAX_PAYLOAD_LEN) {
+        header->length = htons (len);
+        return;
+    }
+
+    /* Doesn't fit in 16 bits, switch to the jumbo header. */
+    memcpy (&jumbo.header, header, sizeof(ccnet_header));
+    jumbo.header.version = CCNET_PACKET_VERSION_JUMBO;
+    jumbo.header.length = 0;
+    jumbo.length = htonl (len);
+    evbuffer_drain (peer->packet, CCNET_PACKET_LENGTH_HEADER);
+    evbuffer_prepend (peer->packet, &jumbo, sizeof(jumbo));
+}
+
+gsize
+ccnet_peer_get_buffered_bytes (const CcnetPeer *peer)
+{
+    gsize n = 0;
+
+    if (peer->packet)
+        n += EVBUFFER_LENGTH (peer->packet);
+    if (peer->cork)
+        n += EVBUFFER_LENGTH (peer->cork) + EVBUFFER_LENGTH (peer->cork_ctl);
+    if (peer->inproc_in)
+        n += EVBUFFER_LENGTH (peer->inproc_in);
+    if (peer->io && peer->io->bufev) {
+        n += evbuffer_get_length (bufferevent_get_input (peer->io->bufev));
+        n += evbuffer_get_length (bufferevent_get_output (peer->io->bufev));
+    }
+    return n;
+}
+
+int
+ccnet_peer_max_payload_len (const CcnetPeer *peer)
+{
+    if (peer->inproc || (peer->io && peer->io->jumbo))
+        return CCNET_PACKET_MAX_JUMBO_PAYLOAD_LEN;
+    return CCNET_PACKET_MAX_PAYLOAD_LEN;
 }
 
+/*
+ * Encrypt data straight into the output buffer of the connection,
+ * so no intermediate ciphertext buffer is allocated.
+ */
+static int
+write_encrypted_packet (const CcnetPeer *peer, const char *data, int len)
+{
+    struct evbuffer *output = bufferevent_get_output (peer->io->bufev);
+    struct evbuffer_iovec vec;
+    ccnet_header enc_header;
+    int enc_len, ret;
+    gint64 start;
+
+    if (evbuffer_reserve_space (output, CCNET_PACKET_LENGTH_HEADER + len
+                                + CCNET_CIPHER_BLOCK_SIZE, &vec, 1) < 1)
+        return -1;
+
+    start = g_get_monotonic_time ();
+    ret = peer_encrypt (peer, (char *)vec.iov_base + CCNET_PACKET_LENGTH_HEADER,
+                        &enc_len, data, len);
+    peer_stats (peer)->traffic.encrypt_usec +=
+        g_get_monotonic_time () - start;
+    if (ret < 0)
+        return -1;
+
+    enc_header.version = 1;
+    enc_header.type = CCNET_MSG_ENCPACKET;
+    enc_header.length = 0;
+    enc_header.id = htonl(enc_len);
+    memcpy (vec.iov_base, &enc_header, sizeof(enc_header));
+
+    vec.iov_len = CCNET_PACKET_LENGTH_HEADER + enc_len;
+    return evbuffer_commit_space (output, &vec, 1);
+}
+
+/*
+ * The input of the cipher has to be contiguous. When the corked packets
+ * are spread over several chains they are copied into a buffer of the
+ * thread, reused from one flush to the next, rather than pulling up the
+ * cork, which allocates a new chain every time. The buffer is dropped
+ * after an unusually large flush.
+ */
+#define SCRATCH_KEEP_MAX (4 * CCNET_CORK_MAX)
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void
+scratch_destroy (void *scratch)
+{
+    g_byte_array_free (scratch, TRUE);
+}
+
+static void
+scratch_key_init (void)
+{
+    pthread_key_create (&scratch_key, scratch_destroy);
+}
+
+static GByteArray *
+get_scratch (void)
+{
+    GByteArray *scratch;
+
+    pthread_once (&scratch_once, scratch_key_init);
+    scratch = pthread_getspecific (scratch_key);
+    if (!scratch) {
+        scratch = g_byte_array_sized_new (CCNET_CORK_MAX);
+        pthread_setspecific (scratch_key, scratch);
+    }
+    return scratch;
+}
+
+/* The first @len bytes of @cork in one piece, copied at most once. */
+static char *
+cork_data (struct evbuffer *cork, size_t len)
+{
+    GByteArray *scratch;
+
+    if (evbuffer_get_contiguous_space (cork) >= len)
+        return (char *)evbuffer_pullup (cork, len);
+
+    scratch = get_scratch ();
+    g_byte_array_set_size (scratch, len);
+    evbuffer_copyout (cork, scratch->data, len);
+    return (char *)scratch->data;
+}
+
+static void
+release_cork_data (void)
+{
+    GByteArray *scratch = pthread_getspecific (scratch_key);
+
+    if (scratch && scratch->len > SCRATCH_KEEP_MAX) {
+        scratch_destroy (scratch);
+        pthread_setspecific (scratch_key, NULL);
+    }
+}
+
+/* -------- in-process pairs -------- */
+
 void
-ccnet_peer_packet_send (const CcnetPeer *peer)
+ccnet_peer_link_inproc (CcnetPeer *a, CcnetPeer *b)
+{
+    g_assert (a->is_local && b->is_local && !a->io && !b->io);
+
+    a->inproc = b;
+    b->inproc = a;
+    a->inproc_in = evbuffer_new ();
+    b->inproc_in = evbuffer_new ();
+}
+
+/* Handle the packets the other end of the pair has sent us, as
+ * canRead() does for the ones read from a socket. */
+static int
+inproc_deliver (CcnetPeer *peer)
+{
+    struct evbuffer *in = evbuffer_new ();
+    ccnet_packet *packet;
+    int hdr_len, plen;
+
+    peer->inproc_scheduled = 0;
+
+    /* Taken out, the handlers may queue more. */
+    evbuffer_add_buffer (in, peer->inproc_in);
+
+    while (peer->net_state == PEER_CONNECTED &&
+           EVBUFFER_LENGTH (in) >= CCNET_PACKET_LENGTH_HEADER) {
+        packet = (ccnet_packet *)evbuffer_pullup (in, CCNET_PACKET_LENGTH_HEADER);
+        if (packet->header.version == CCNET_PACKET_VERSION_JUMBO) {
+            hdr_len = CCNET_PACKET_LENGTH_JUMBO_HEADER;
+            packet = (ccnet_packet *)evbuffer_pullup (in, hdr_len);
+            plen = ntohl (((ccnet_jumbo_header *)packet)->length);
+        } else {
+            hdr_len = CCNET_PACKET_LENGTH_HEADER;
+            plen = ntohs (packet->header.length);
+        }
+        packet = (ccnet_packet *)evbuffer_pullup (in, hdr_len + plen);
+        g_assert (packet != NULL);
+
+        /* byte order, from network to host */
+        if (hdr_len == CCNET_PACKET_LENGTH_JUMBO_HEADER)
+            ((ccnet_jumbo_header *)packet)->length = plen;
+        else
+            packet->header.length = plen;
+        packet->header.id = ntohl (packet->header.id);
+
+        peer->last_recv = time(NULL);
+        handle_packet (packet, peer);
+        evbuffer_drain (in, hdr_len + plen);
+    }
+
+    evbuffer_free (in);
+    g_object_unref (peer);
+    return FALSE;
+}
+
+/* Like the socket, the other end reads the packets from the event
+ * loop, never while we are sending. */
+static void
+inproc_send (CcnetPeer *peer, struct evbuffer *cork)
+{
+    CcnetPeer *other = peer->inproc;
+
+    evbuffer_add_buffer (other->inproc_in, cork);
+    if (!other->inproc_scheduled) {
+        g_object_ref (other);
+        ccnet_timer_new ((TimerCB)inproc_deliver, other, 0);
+        other->inproc_scheduled = 1;
+    }
+}
+
+/*
+ * Write out the packets of @cork. They were queued in the order they
+ * were sent, and all with the encryption state of cork_encrypted.
+ */
+static int
+write_cork (CcnetPeer *peer, struct evbuffer *cork)
 {
+    char *data;
+    int len, plen, hdr_len, chunk;
     int ret = 0;
-    if (peer->is_local) {
-        bufferevent_write_buffer (peer->io->bufev, peer->packet);
+
+    if (!peer->cork_encrypted) {
+        ret = bufferevent_write_buffer (peer->io->bufev, cork);
+    } else if (!peer->crypt) {
+        ret = -1;
+    } else {
+        len = EVBUFFER_LENGTH (cork);
+        data = cork_data (cork, len);
+        while (len > 0 && ret >= 0) {
+            /* The peer expects one packet per ENCPACKET, or batches.
+             * A cork held back may have grown large, it's cut into
+             * batches of about CCNET_CORK_MAX. */
+            chunk = 0;
+            do {
+                plen = frame_payload_len ((ccnet_packet *)(data + chunk),
+                                          len - chunk, &hdr_len);
+                g_assert (plen >= 0);
+                chunk += hdr_len + plen;
+            } while (peer->io->batch_enc && chunk < len &&
+                     chunk < CCNET_CORK_MAX);
+            ret = write_encrypted_packet (peer, data, chunk);
+            data += chunk;
+            len -= chunk;
+        }
+        release_cork_data ();
+    }
+    evbuffer_drain (cork, EVBUFFER_LENGTH (cork));
+    return ret;
+}
+
+static gboolean
+bulk_may_go (CcnetPeer *peer)
+{
+    return ccnet_packet_io_output_length (peer->io) < peer->io->out_high ||
+        peer->ctl_burst >= CCNET_CONTROL_BURST_MAX;
+}
+
+/* With @force the bulk packets are written even above the high
+ * watermark, as when the encryption state changes. */
+static void
+flush_corks (CcnetPeer *peer, gboolean force)
+{
+    size_t n_ctl = EVBUFFER_LENGTH (peer->cork_ctl);
+    size_t n_bulk = EVBUFFER_LENGTH (peer->cork);
+    int ret = 0;
+
+    if (n_ctl == 0 && n_bulk == 0)
+        return;
+
+    if (peer->inproc) {
+        if (n_ctl > 0)
+            inproc_send (peer, peer->cork_ctl);
+        if (n_bulk > 0)
+            inproc_send (peer, peer->cork);
         return;
     }
 
-    if (peer->net_state == PEER_CONNECTED) {
-        if (!peer->encrypt_channel) {
-            ret = bufferevent_write_buffer (peer->io->bufev, peer->packet);
-        } else {
-            ccnet_header enc_header;
-            char *data = (char *)EVBUFFER_DATA(peer->packet);
-            uint32_t len = EVBUFFER_LENGTH(peer->packet);
-            char *enc_data;
-            int enc_len;
-            ret = ccnet_encrypt_with_key (&enc_data, &enc_len, data, len,
-                                          peer->key, peer->iv);
-            if (ret < 0) {
-                ccnet_warning ("[SEND] encryption error for sending packet "
-                               "to peer %s(%.8s) \n", peer->name, peer->id);
-                evbuffer_drain (peer->packet, EVBUFFER_LENGTH(peer->packet));
-                return;
-            }
+    if (!peer->io || (!peer->is_local && peer->net_state != PEER_CONNECTED)) {
+        ccnet_warning ("Unable to send packet when peer is not connected.\n");
+        evbuffer_drain (peer->cork_ctl, n_ctl);
+        evbuffer_drain (peer->cork, n_bulk);
+        return;
+    }
 
-            enc_header.version = 1;
-            enc_header.type = CCNET_MSG_ENCPACKET;
-            enc_header.length = 0;
-            enc_header.id = htonl(enc_len);
-            bufferevent_write (peer->io->bufev, &enc_header, sizeof (enc_header));
-            bufferevent_write (peer->io->bufev, enc_data, enc_len);
-            g_free (enc_data);
-            evbuffer_drain (peer->packet, EVBUFFER_LENGTH(peer->packet));
-        }
-        if (ret < 0)
-            ccnet_warning ("[SEND] bufferevent failed to send packet to peer(%.8s) \n",
-                peer->id);
-    } else {
+    if (n_ctl > 0) {
+        ret = write_cork (peer, peer->cork_ctl);
+        if (n_bulk > 0)
+            peer->ctl_burst += n_ctl;
+    }
+
+    if (ret >= 0 && n_bulk > 0 && (force || bulk_may_go (peer))) {
+        ret = write_cork (peer, peer->cork);
+        peer->ctl_burst = 0;
+    }
+
+    if (ret < 0)
+        ccnet_warning ("[SEND] failed to send packets to peer %s(%.8s) \n",
+                       peer->name, peer->id);
+
+    check_congestion (peer);
+}
+
+void
+ccnet_peer_flush (CcnetPeer *peer)
+{
+    flush_corks (peer, FALSE);
+}
+
+/*
+ * Replace the payload of peer->packet by its compressed form, unless
+ * it doesn't shrink. Compressed before corking, so a batch of
+ * ENCPACKETs encrypts the smaller data.
+ */
+static void
+compress_packet (CcnetPeer *peer, const ccnet_header *header, int hdr_len)
+{
+    int algo = peer->io->compress;
+    int len = EVBUFFER_LENGTH (peer->packet) - hdr_len;
+    int cap = CCNET_COMPRESS_HEADER_LEN + ccnet_compress_bound (algo, len);
+    struct evbuffer *out;
+    struct evbuffer_iovec vec;
+    uint32_t orig_len = htonl (len);
+    char *src;
+    int n;
+
+    if (!peer->zctx) {
+        peer->zctx = ccnet_compress_ctx_new ();
+        peer->trimmed = 0;
+    }
+
+    out = evbuffer_new ();
+    if (evbuffer_reserve_space (out, cap, &vec, 1) < 1) {
+        evbuffer_free (out);
+        return;
+    }
+    src = cork_data (peer->packet, hdr_len + len) + hdr_len;
+    n = ccnet_compress (peer->zctx, algo, src, len,
+                        (char *)vec.iov_base + CCNET_COMPRESS_HEADER_LEN,
+                        cap - CCNET_COMPRESS_HEADER_LEN);
+    release_cork_data ();
+    if (n < 0 || n + CCNET_COMPRESS_HEADER_LEN >= len) {
+        evbuffer_free (out);
+        return;
+    }
+
+    ((char *)vec.iov_base)[0] = algo;
+    memcpy ((char *)vec.iov_base + 1, &orig_len, 4);
+    vec.iov_len = CCNET_COMPRESS_HEADER_LEN + n;
+    evbuffer_commit_space (out, &vec, 1);
+
+    evbuffer_drain (peer->packet, EVBUFFER_LENGTH (peer->packet));
+    ccnet_peer_packet_prepare (peer, header->type | CCNET_MSG_COMPRESSED,
+                               header->id);
+    evbuffer_add_buffer (peer->packet, out);
+    ccnet_peer_packet_finish (peer);
+    evbuffer_free (out);
+
+    ccnet_metric_add (metric_bytes_saved, len - CCNET_COMPRESS_HEADER_LEN - n);
+}
+
+static int
+flush_cork (CcnetPeer *peer)
+{
+    peer->flush_scheduled = 0;
+    ccnet_peer_flush (peer);
+    g_object_unref (peer);
+    return FALSE;
+}
+
+/*
+ * Packets are corked and written out together once the current
+ * event loop iteration is over, so a burst of small responses ends up
+ * in one write (and with encryption, in one ENCPACKET if the peer
+ * supports batches).
+ */
+void
+ccnet_peer_packet_send (const CcnetPeer *peer)
+{
+    CcnetPeer *p = (CcnetPeer *)peer;
+    int encrypted = !peer->is_local && peer->encrypt_channel;
+    char head[CCNET_PACKET_LENGTH_JUMBO_HEADER + 3];
+    ccnet_header header;
+    struct evbuffer *cork;
+    int hdr_len;
+
+    if (!peer->is_local && peer->net_state != PEER_CONNECTED) {
         ccnet_warning ("Unable to send packet when peer is not connected.\n");
         evbuffer_drain (peer->packet, EVBUFFER_LENGTH(peer->packet));
+        p->send_control = 0;
+        return;
+    }
+
+    cork = peer->send_control ? peer->cork_ctl : peer->cork;
+    p->send_control = 0;
+
+    if ((EVBUFFER_LENGTH (peer->cork) > 0 ||
+         EVBUFFER_LENGTH (peer->cork_ctl) > 0) &&
+        p->cork_encrypted != encrypted)
+        flush_corks (p, TRUE);
+    p->cork_encrypted = encrypted;
+
+    /* Copied out, the payload may be a reference not to be pulled up. */
+    evbuffer_copyout (peer->packet, head, sizeof(head));
+    memcpy (&header, head, sizeof(header));
+    hdr_len = header.version == CCNET_PACKET_VERSION_JUMBO ?
+        CCNET_PACKET_LENGTH_JUMBO_HEADER : CCNET_PACKET_LENGTH_HEADER;
+    header.id = ntohl (header.id);
+    trace_packet (p, 1, &header, head + hdr_len,
+                  EVBUFFER_LENGTH (peer->packet) - hdr_len);
+    if (header.type < CCNET_PEER_N_MSG_TYPES) {
+        peer_stats (p)->traffic.pkts_out[header.type]++;
+        p->stats->traffic.bytes_out[header.type] += EVBUFFER_LENGTH (peer->packet);
+    }
+    ccnet_metric_inc (metric_pkts_out);
+    ccnet_metric_add (metric_bytes_out, EVBUFFER_LENGTH (peer->packet));
+
+    if (!peer->is_local && peer->io && peer->io->compress &&
+        header.type >= CCNET_MSG_REQUEST && header.type <= CCNET_MSG_UPDATE &&
+        EVBUFFER_LENGTH (peer->packet) - hdr_len >=
+        peer->manager->session->compress_threshold)
+        compress_packet (p, &header, hdr_len);
+
+    evbuffer_add_buffer (cork, peer->packet);
+
+    if (EVBUFFER_LENGTH (cork) >= CCNET_CORK_MAX) {
+        ccnet_peer_flush (p);
+        return;
+    }
+
+    if (!peer->flush_scheduled) {
+        g_object_ref (p);
+        ccnet_timer_new ((TimerCB)flush_cork, p, 0);
+        p->flush_scheduled = 1;
     }
 }
 
@@ -1083,7 +2203,7 @@ ccnet_peer_send_response (const CcnetPeer *peer, int req_id,
         return;
     }
 
-    g_return_if_fail (clen < 65536);
+    g_return_if_fail (clen <= ccnet_peer_max_payload_len (peer));
 
     ccnet_peer_packet_prepare (peer, CCNET_MSG_RESPONSE, req_id);
 
@@ -1112,6 +2232,8 @@ ccnet_peer_send_update (const CcnetPeer *peer, int req_id,
 {
     g_assert (req_id > 0);
 
+    g_return_if_fail (clen <= ccnet_peer_max_payload_len (peer));
+
     ccnet_peer_packet_prepare (peer, CCNET_MSG_UPDATE, req_id);
 
     /* code line */
@@ -1132,6 +2254,119 @@ ccnet_peer_send_update (const CcnetPeer *peer, int req_id,
                      req_id, code, reason?reason:"NULL");
 }
 
+CcnetSharedPacket *
+ccnet_shared_packet_new (int type, const char *code, const char *reason,
+                         const char *content, int clen)
+{
+    CcnetSharedPacket *packet;
+    ccnet_header *header;
+    ccnet_jumbo_header *jumbo;
+    uint32_t len;
+    int hdr_len, rlen = reason ? strlen(reason) + 1 : 0;
+    char *p;
+
+    if (strlen(code) != 3) {
+        ccnet_warning ("Bad code number\n");
+        return NULL;
+    }
+    if (!content)
+        clen = 0;
+
+    len = 3 + rlen + 1 + clen;
+    if (len > CCNET_PACKET_MAX_JUMBO_PAYLOAD_LEN)
+        return NULL;
+    hdr_len = len > CCNET_PACKET_MAX_PAYLOAD_LEN ?
+        CCNET_PACKET_LENGTH_JUMBO_HEADER : CCNET_PACKET_LENGTH_HEADER;
+
+    packet = g_malloc (sizeof(CcnetSharedPacket) + hdr_len + len);
+    packet->ref_count = 1;
+    packet->hdr_len = hdr_len;
+    packet->len = hdr_len + len;
+
+    header = (ccnet_header *)packet->data;
+    header->type = type;
+    header->id = 0;
+    if (hdr_len == CCNET_PACKET_LENGTH_HEADER) {
+        header->version = 1;
+        header->length = htons (len);
+    } else {
+        jumbo = (ccnet_jumbo_header *)packet->data;
+        header->version = CCNET_PACKET_VERSION_JUMBO;
+        header->length = 0;
+        jumbo->length = htonl (len);
+    }
+
+    p = packet->data + hdr_len;
+    memcpy (p, code, 3);
+    p += 3;
+    if (reason) {
+        *p++ = ' ';
+        memcpy (p, reason, rlen - 1);
+        p += rlen - 1;
+    }
+    *p++ = '\n';
+    if (clen)
+        memcpy (p, content, clen);
+
+    return packet;
+}
+
+void
+ccnet_shared_packet_ref (CcnetSharedPacket *packet)
+{
+    ++packet->ref_count;
+}
+
+void
+ccnet_shared_packet_unref (CcnetSharedPacket *packet)
+{
+    if (--packet->ref_count == 0)
+        g_free (packet);
+}
+
+const char *
+ccnet_shared_packet_get_content (const CcnetSharedPacket *packet, int *clen)
+{
+    const char *p = packet->data + packet->hdr_len;
+    const char *end = packet->data + packet->len;
+
+    p = memchr (p, '\n', end - p);
+    g_assert (p != NULL);
+    ++p;
+    *clen = end - p;
+    return p;
+}
+
+static void
+shared_packet_cleanup (const void *data, size_t len, void *packet)
+{
+    ccnet_shared_packet_unref (packet);
+}
+
+void
+ccnet_peer_send_shared_packet (const CcnetPeer *peer, int req_id,
+                               CcnetSharedPacket *packet)
+{
+    char header[CCNET_PACKET_LENGTH_JUMBO_HEADER];
+
+    g_assert (req_id > 0);
+    g_assert (peer->packet && EVBUFFER_LENGTH(peer->packet) == 0);
+
+    g_return_if_fail (packet->len - packet->hdr_len <=
+                      ccnet_peer_max_payload_len (peer));
+
+    memcpy (header, packet->data, packet->hdr_len);
+    ((ccnet_header *)header)->id = htonl (req_id);
+    evbuffer_add (peer->packet, header, packet->hdr_len);
+
+    ccnet_shared_packet_ref (packet);
+    evbuffer_add_reference (peer->packet, packet->data + packet->hdr_len,
+                            packet->len - packet->hdr_len,
+                            shared_packet_cleanup, packet);
+
+    ccnet_peer_packet_send (peer);
+}
+
 
 /* ----------------  Processors ---------------- */
 
@@ -1139,31 +2374,241 @@ ccnet_peer_send_update (const CcnetPeer *peer, int req_id,
 #define DEBUG_FLAG  CCNET_DEBUG_PROCESSOR
 #include "log.h"
 
+#define PROC_SLOTS_INIT      64
+#define PROC_SLOTS_IDLE      4      /* keepalive and a spare */
+#define PROC_SLOTS_MAX       65536
+
+#define PROC_SLOTS(peer, id) (&(peer)->procs[((id) & SLAVE_MASK) != 0])
+
+static void
+proc_slots_init (CcnetProcSlots *t)
+{
+    t->slots = g_new0 (CcnetProcessor *, PROC_SLOTS_INIT);
+    t->mask = PROC_SLOTS_INIT - 1;
+    t->count = 0;
+}
+
+/* Double the table. Entries in different slots stay apart, since the
+ * index only gains a bit. */
+static void
+proc_slots_grow (CcnetProcSlots *t)
+{
+    CcnetProcessor **slots;
+    guint i, mask = t->mask * 2 + 1;
+
+    slots = g_new0 (CcnetProcessor *, mask + 1);
+    for (i = 0; i <= t->mask; i++) {
+        if (t->slots[i])
+            slots[t->slots[i]->id & mask] = t->slots[i];
+    }
+    g_free (t->slots);
+    t->slots = slots;
+    t->mask = mask;
+}
+
+/* Shrink the table to @size slots, unless its processors would have
+ * to share one. */
+static void
+proc_slots_shrink (CcnetProcSlots *t, guint size)
+{
+    CcnetProcessor **slots;
+    guint i, mask = size - 1;
+
+    if (t->mask <= mask || t->count > size / 2)
+        return;
+
+    slots = g_new0 (CcnetProcessor *, size);
+    for (i = 0; i <= t->mask; i++) {
+        if (!t->slots[i])
+            continue;
+        if (slots[t->slots[i]->id & mask]) {
+            g_free (slots);
+            return;
+        }
+        slots[t->slots[i]->id & mask] = t->slots[i];
+    }
+    g_free (t->slots);
+    t->slots = slots;
+    t->mask = mask;
+}
+
+void
+ccnet_peer_update_rtt (CcnetPeer *peer, int sample_ms)
+{
+    if (sample_ms < 1)
+        sample_ms = 1;
+    if (peer->rtt_ms == 0)
+        peer->rtt_ms = sample_ms;
+    else
+        peer->rtt_ms += (sample_ms - peer->rtt_ms) / 8;
+    peer->rtt_time = time (NULL);
+}
+
+gboolean
+ccnet_peer_trim (CcnetPeer *peer)
+{
+    if (peer->in_processor_call || peer->in_writecb ||
+        ccnet_peer_get_buffered_bytes (peer) != 0)
+        return FALSE;
+
+    ccnet_compress_ctx_free (peer->zctx);
+    peer->zctx = NULL;
+
+    if (peer->proc_overflow && g_hash_table_size (peer->proc_overflow) == 0) {
+        g_hash_table_unref (peer->proc_overflow);
+        peer->proc_overflow = NULL;
+    }
+    if (!peer->proc_overflow) {
+        proc_slots_shrink (&peer->procs[0], PROC_SLOTS_IDLE);
+        proc_slots_shrink (&peer->procs[1], PROC_SLOTS_IDLE);
+    }
+
+    peer->trimmed = 1;
+    return TRUE;
+}
+
+/* Move overflowed processors back to their slots if they fit now. */
+static void
+proc_overflow_settle (CcnetPeer *peer)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init (&iter, peer->proc_overflow);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        CcnetProcessor *processor = value;
+        CcnetProcSlots *t = PROC_SLOTS (peer, processor->id);
+        guint idx = processor->id & t->mask;
+
+        if (!t->slots[idx]) {
+            t->slots[idx] = processor;
+            t->count++;
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+}
+
 void
 ccnet_peer_add_processor (CcnetPeer *peer, CcnetProcessor *processor)
 {
+    CcnetProcSlots *t = PROC_SLOTS (peer, processor->id);
+    CcnetProcessor *old;
+    gboolean grown = FALSE;
+
     if (!peer->is_local)
         ccnet_debug ("[Proc] Add %s(%d) to peer %s\n", GET_PNAME(processor),
                      PRINT_ID(processor->id), peer->name);
-    g_hash_table_insert (peer->processors, (gpointer)(long)processor->id, processor);
+
+    /* Keep the table at most half full, so that live ids which are
+     * far apart rarely share a slot. */
+    if (t->count * 2 >= t->mask + 1 && t->mask + 1 < PROC_SLOTS_MAX) {
+        proc_slots_grow (t);
+        grown = TRUE;
+    }
+
+    while (1) {
+        old = t->slots[processor->id & t->mask];
+        if (!old || old->id == processor->id)
+            break;
+        if (t->mask + 1 >= PROC_SLOTS_MAX)
+            break;
+        proc_slots_grow (t);
+        grown = TRUE;
+    }
+
+    if (!old) {
+        t->slots[processor->id & t->mask] = processor;
+        t->count++;
+        peer->n_processors++;
+    } else if (old->id == processor->id) {
+        /* replaces the processor with the same id */
+        t->slots[processor->id & t->mask] = processor;
+    } else {
+        if (!peer->proc_overflow)
+            peer->proc_overflow = g_hash_table_new (g_direct_hash,
+                                                    g_direct_equal);
+        if (!g_hash_table_lookup (peer->proc_overflow,
+                                  (gpointer)(long)processor->id))
+            peer->n_processors++;
+        g_hash_table_insert (peer->proc_overflow,
+                             (gpointer)(long)processor->id, processor);
+    }
+
+    if (grown && peer->proc_overflow)
+        proc_overflow_settle (peer);
+
     processor->detached = 0;
+    peer->last_active = time (NULL);
+    peer->trimmed = 0;
 }
 
 
 void
 ccnet_peer_remove_processor (CcnetPeer *peer, CcnetProcessor *processor)
 {
+    CcnetProcSlots *t = PROC_SLOTS (peer, processor->id);
+    guint idx = processor->id & t->mask;
+
     /* ccnet_debug ("[Proc] Remove %s(%d) from peer %s\n", GET_PNAME(processor),  */
     /*              PRINT_ID(processor->id), peer->name); */
-    g_hash_table_remove (peer->processors, (gpointer)(long)processor->id);
+    if (t->slots[idx] == processor) {
+        t->slots[idx] = NULL;
+        t->count--;
+        peer->n_processors--;
+    } else if (peer->proc_overflow &&
+               g_hash_table_lookup (peer->proc_overflow,
+                                    (gpointer)(long)processor->id) == processor) {
+        g_hash_table_remove (peer->proc_overflow,
+                             (gpointer)(long)processor->id);
+        peer->n_processors--;
+    }
     processor->detached = 1;
 }
 
 
+/*
+ * A single indexed load in the common case. The id stored in the
+ * processor is compared too, so a stale id whose slot has been reused
+ * by a newer processor resolves to NULL.
+ */
 CcnetProcessor *
 ccnet_peer_get_processor (CcnetPeer *peer, unsigned int id)
 {
-    return g_hash_table_lookup (peer->processors, (gpointer)(long)id);
+    CcnetProcSlots *t = PROC_SLOTS (peer, id);
+    CcnetProcessor *processor = t->slots[id & t->mask];
+
+    if (processor && processor->id == id)
+        return processor;
+    if (peer->proc_overflow)
+        return g_hash_table_lookup (peer->proc_overflow, (gpointer)(long)id);
+    return NULL;
+}
+
+GList *
+ccnet_peer_get_processor_list (CcnetPeer *peer)
+{
+    GList *list = NULL;
+    guint i, j;
+
+    for (i = 0; i < 2; i++) {
+        CcnetProcSlots *t = &peer->procs[i];
+        for (j = 0; j <= t->mask; j++)
+            if (t->slots[j])
+                list = g_list_prepend (list, t->slots[j]);
+    }
+
+    if (peer->proc_overflow) {
+        GList *values = g_hash_table_get_values (peer->proc_overflow);
+        list = g_list_concat (list, values);
+    }
+
+    return list;
+}
+
+guint
+ccnet_peer_get_processor_count (CcnetPeer *peer)
+{
+    return peer->n_processors;
 }
 
 
@@ -7,7 +7,9 @@
 #include <glib.h>
 #include <glib-object.h>
 #include <openssl/rsa.h>
+#include <openssl/evp.h>
 
+#include "packet.h"
 #include "processor.h"
 
 
@@ -33,41 +35,99 @@ struct CcnetPacketIO;
 
 #define NON_RESOLVED_PEERID  "0000000000000000000000000000000000000000"
 
+#define CCNET_PEER_RAW_ID_LEN 20
+
+#define CCNET_RESUME_SECRET_LEN 20
+
 struct _CcnetUser;
 
+/* Cipher state of an encrypted channel. Kept out of CcnetPeer so that
+ * the packet send functions can advance the nonce on a const peer.
+ */
+typedef struct _CcnetPeerCrypt {
+    int             cipher;     /* CCNET_CIPHER_XXX */
+    gboolean        initiator;  /* we sent the session key */
+    EVP_CIPHER_CTX *enc_ctx;
+    EVP_CIPHER_CTX *dec_ctx;
+
+    /* AEAD ciphers use <direction, iv[1..3], seq> as per-packet nonce */
+    guint64         send_seq;
+    guint64         recv_seq;
+} CcnetPeerCrypt;
+
+/* Traffic of a peer, indexed by packet type. Only updated and read in
+ * the main thread. Encrypted packets are counted as the packets they
+ * carry. */
+#define CCNET_PEER_N_MSG_TYPES  (CCNET_MSG_ENCPACKET + 1)
+
+typedef struct _CcnetPeerTraffic {
+    guint64     pkts_in[CCNET_PEER_N_MSG_TYPES];
+    guint64     bytes_in[CCNET_PEER_N_MSG_TYPES];
+    guint64     pkts_out[CCNET_PEER_N_MSG_TYPES];
+    guint64     bytes_out[CCNET_PEER_N_MSG_TYPES];
+
+    guint64     encrypt_usec;
+    guint64     decrypt_usec;
+    guint64     handler_usec;   /* handling the packets received */
+    size_t      max_out_queue;  /* bytes, highest seen */
+} CcnetPeerTraffic;
+
+/* The last packets sent and received, always recorded, dumped with
+ * ccnet_peer_format_trace(). */
+#define CCNET_PEER_TRACE_SIZE   128     /* power of 2 */
+
+typedef struct _CcnetPacketTrace {
+    gint64      time;           /* usec, wall clock */
+    guint32     id;
+    guint32     len;            /* payload */
+    guint8      out;
+    guint8      type;
+    char        code[3];        /* of responses and updates */
+} CcnetPacketTrace;
+
+typedef struct _CcnetProcSlots {
+    struct _CcnetProcessor **slots;
+    guint                    mask;      /* number of slots - 1 */
+    guint                    count;
+} CcnetProcSlots;
+
+/* Counters and the packet trace of a peer. Allocated with its first
+ * packet, so the many peers a relay only knows of don't carry them. */
+typedef struct _CcnetPeerStats {
+    CcnetPeerTraffic traffic;
+    CcnetPacketTrace trace[CCNET_PEER_TRACE_SIZE];
+    guint            trace_pos;     /* total recorded */
+} CcnetPeerStats;
+
+/*
+ * The fields touched for every packet come first, so the packet path
+ * stays within the first two cache lines of the peer. Anything not
+ * used per packet goes below them.
+ */
 struct _CcnetPeer
 {
     GObject       parent_instance;
 
-    /* fields from pubinfo */
-    char          id[41];
-
-    RSA          *pubkey;
-    char         *session_key;
-    unsigned char key[32];
-    unsigned char iv[32];
-
-    char         *name;         /* hostname */
-    char         *public_addr;
-    uint16_t      public_port;  /* port from pubinfo */
-    char         *service_url;
-
-    /* fields not from pubinfo */
-    char         *addr_str;     /* hold the ip actually used in connection */
-    uint16_t      port;
-
-    char         *redirect_addr;
-    uint16_t      redirect_port;
+    /* -------- hot -------- */
 
-    char         *dns_addr;     /* address solved by dns */
+    struct CcnetPacketIO  *io;
+    CcnetPeerCrypt *crypt;      /* set up in prepare_channel_encryption */
+    struct CcnetCompressCtx *zctx;  /* with the first compressed packet */
+    struct evbuffer      *packet;
+    struct evbuffer      *cork;     /* packets waiting to be flushed */
+    struct evbuffer      *cork_ctl; /* the same for control processors */
+    guint                 ctl_burst; /* bytes of cork_ctl written while
+                                        * cork was held back */
+
+    /* Live processors, master ones in procs[0] and slave ones in
+     * procs[1]. Ids are handed out in sequence, so they are indexed by
+     * their low bits. See ccnet_peer_get_processor() and
+     * ccnet_peer_get_request_id(). */
+    CcnetProcSlots procs[2];
+    guint          n_processors;
 
     int           net_state;
 
-    GList        *role_list;
-    GList        *myrole_list;  /* my role on this peer */
-
-    char         *intend_role;  /* used in peer resolving */
-
     unsigned int  is_self : 1;
     unsigned int  is_local : 1;
     unsigned int  can_connect : 1;
@@ -94,11 +154,76 @@ struct _CcnetPeer
     unsigned int  cluster_member : 1;
 
     unsigned int  in_processor_call : 1;
+    unsigned int  perm_mask_valid : 1;
 
     unsigned int  encrypt_channel : 1;
 
-    struct CcnetPacketIO  *io;
+    unsigned int  cork_encrypted : 1; /* packets in cork to be encrypted */
+    unsigned int  flush_scheduled : 1;
+    unsigned int  send_control : 1;   /* next packet goes to cork_ctl */
+    unsigned int  congested : 1;      /* output above the high watermark */
+    unsigned int  no_msg_stream : 1;  /* peer lacks receive-msgs */
+    unsigned int  no_proc_alive : 1;  /* peer lacks proc-alive */
+    unsigned int  fast_setup : 1;     /* announced CCNET_CAP_FAST_SETUP */
+    unsigned int  fast_verified : 1;  /* by the handshake, see fast-setup.h
+                                       * and tls.h */
+    unsigned int  inproc_scheduled : 1;
+    unsigned int  trimmed : 1;        /* by ccnet_peer_trim() */
+
+    time_t   last_recv;         /* last packet, saves keepalives */
+
+    /* Service groups permitted to the roles, see perm-mgr.c. */
+    guint64       perm_mask;
+
+    /* Instead of io, the other end of an in-process pair, see
+     * ccnet_peer_link_inproc(), and the packets it sent us which have
+     * not been handled yet. */
+    struct _CcnetPeer     *inproc;
 
+    CcnetPeerStats *stats;      /* NULL before the first packet */
+
+    /* -------- cold -------- */
+
+    struct evbuffer       *inproc_in;
+    GHashTable    *proc_overflow;  /* ids colliding in full tables */
+
+    /* fields from pubinfo */
+    char          id[41];
+    unsigned char raw_id[CCNET_PEER_RAW_ID_LEN]; /* set by the peer table */
+
+    RSA          *pubkey;
+    char         *session_key;
+    unsigned char key[32];
+    unsigned char iv[32];
+
+    /* Derived from the last session key when the peer goes down. Lets
+     * keepalive2 and the session key processors skip RSA on reconnect.
+     */
+    unsigned char resume_secret[CCNET_RESUME_SECRET_LEN];
+    time_t        resume_expire;
+
+    char         *name;         /* hostname */
+    char         *public_addr;
+    uint16_t      public_port;  /* port from pubinfo */
+    char         *service_url;  /* see ccnet_str_ref() */
+
+    /* Encodings kept until the fields change, see peer.c */
+    char         *pubkey_str;
+    char         *pubinfo;
+
+    /* fields not from pubinfo */
+    char         *addr_str;     /* hold the ip actually used in connection */
+    uint16_t      port;
+
+    char         *redirect_addr;
+    uint16_t      redirect_port;
+
+    char         *dns_addr;     /* address solved by dns */
+
+    CcnetStrSet   roles;
+    CcnetStrSet   myroles;      /* my role on this peer */
+
+    char         *intend_role;  /* used in peer resolving */
 
     int      last_net_state;
 
@@ -106,20 +231,34 @@ struct _CcnetPeer
     time_t   last_down;         /* for peer gc in relay */
     int      num_fails;
 
+    /* reconnect scheduling, see connect-mgr.c */
+    GSequenceIter *reconnect_iter;
+    time_t   next_reconnect;
+    time_t   last_connect_attempt;
+    guint    connect_attempts;
+
+    /* garbage collection of down peers, see peer-mgr.c */
+    GSequenceIter *gc_iter;
+    time_t   gc_deadline;
+
     int      reqID;
 
     struct _CcnetPeerManager *manager;
 
-    struct evbuffer      *packet;
-    
-    GHashTable *processors;
-
     GList      *write_cbs;
 
+    struct _CcnetProcessor *msg_stream; /* send-msgs processor */
+
     int         last_mult_recv;
 
     /* statistics */
     time_t      last_up;
+    time_t      last_active;    /* last processor added */
+
+    /* Round trip of keepalives, see ccnet_peer_update_rtt() */
+    int         rtt_ms;         /* smoothed, 0 if not known yet */
+    gint64      rtt_sent;       /* usec, of the keepalive in flight */
+    time_t      rtt_time;       /* of the last sample */
 };
 
 struct _CcnetPeerClass
@@ -138,6 +277,17 @@ void        ccnet_peer_free (CcnetPeer *peer);
 
 void        ccnet_peer_shutdown (CcnetPeer *peer);
 
+/* Shut down a local peer whose client has gone, and drop it. */
+void        ccnet_peer_local_down (CcnetPeer *peer);
+
+/**
+ * Connect two local peers of this process to each other. What one of
+ * them sends is handled by the other, queued in memory rather than
+ * written to a socket. When one of them is shut down, the other goes
+ * down as a local peer whose client has gone.
+ */
+void        ccnet_peer_link_inproc (CcnetPeer *a, CcnetPeer *b);
+
 int         ccnet_peer_get_request_id (CcnetPeer *peer);
 
 void        ccnet_peer_add_processor (CcnetPeer *peer, 
@@ -146,6 +296,9 @@ void        ccnet_peer_remove_processor (CcnetPeer *peer,
                                          CcnetProcessor *processor);
 CcnetProcessor *
             ccnet_peer_get_processor (CcnetPeer *peer, unsigned int id);
+/* The returned list must be freed with g_list_free(). */
+GList      *ccnet_peer_get_processor_list (CcnetPeer *peer);
+guint       ccnet_peer_get_processor_count (CcnetPeer *peer);
 
 void        ccnet_peer_set_net_state (CcnetPeer *peer, int net_state);
 
@@ -155,7 +308,34 @@ void        ccnet_peer_update_address (CcnetPeer *peer,
 
 void        ccnet_peer_set_pubkey (CcnetPeer *peer, char *str);
 
-int         ccnet_peer_prepare_channel_encryption (CcnetPeer *peer);
+/* Set a key already decoded from @str, taking the reference on @key. */
+void        ccnet_peer_take_pubkey (CcnetPeer *peer, RSA *key,
+                                    const char *str);
+
+/**
+ * @cipher: one of CCNET_CIPHER_XXX, as negotiated by the session
+ *          key processors.
+ * @initiator: TRUE on the side which sent the session key. The two
+ *          sides must pass different values.
+ */
+int         ccnet_peer_prepare_channel_encryption (CcnetPeer *peer,
+                                                   int cipher,
+                                                   gboolean initiator);
+
+/* session resumption */
+gboolean    ccnet_peer_can_resume (CcnetPeer *peer);
+/* Keep a secret derived from the current session key, done when the
+ * peer goes down. */
+void        ccnet_peer_save_resume_secret (CcnetPeer *peer);
+void        ccnet_peer_clear_resume_secret (CcnetPeer *peer);
+
+/**
+ * HMAC-SHA1 of @label and @data under the resume secret. @mac must have
+ * room for CCNET_RESUME_SECRET_LEN bytes.
+ */
+void        ccnet_peer_resume_mac (CcnetPeer *peer, const char *label,
+                                   const unsigned char *data, int len,
+                                   unsigned char *mac);
 
 /* role management */
 void
@@ -205,6 +385,67 @@ void        ccnet_peer_send_update (const CcnetPeer *peer, int req_id,
                                     const char *code, const char *reason,
                                     const char *content, int clen);
 
+/*
+ * A packet encoded once and sent to several peers, e.g. a message
+ * delivered to all its subscribers. Only the id in the header differs
+ * between the copies; the payload is referenced, not copied, by the
+ * output buffers.
+ */
+typedef struct _CcnetSharedPacket {
+    int       ref_count;
+    int       hdr_len;
+    uint32_t  len;              /* header + payload */
+    char      data[0];
+} CcnetSharedPacket;
+
+CcnetSharedPacket *
+            ccnet_shared_packet_new (int type, const char *code,
+                                     const char *reason,
+                                     const char *content, int clen);
+void        ccnet_shared_packet_ref (CcnetSharedPacket *packet);
+void        ccnet_shared_packet_unref (CcnetSharedPacket *packet);
+/* The content of @packet, after the code and reason. */
+const char *ccnet_shared_packet_get_content (const CcnetSharedPacket *packet,
+                                             int *clen);
+
+void        ccnet_peer_send_shared_packet (const CcnetPeer *peer, int req_id,
+                                           CcnetSharedPacket *packet);
+
+/* Bytes held in the packet, cork and connection buffers of @peer. */
+gsize       ccnet_peer_get_buffered_bytes (const CcnetPeer *peer);
+
+/* Give back what an idle peer holds for traffic: the compression
+ * contexts, and processor tables larger than its processors need. They
+ * come back with the next packet. Returns FALSE if the peer is busy. */
+gboolean    ccnet_peer_trim (CcnetPeer *peer);
+
+/* Fold a keepalive round trip of @sample_ms into peer->rtt_ms, smoothed
+ * like TCP's srtt. */
+void        ccnet_peer_update_rtt (CcnetPeer *peer, int sample_ms);
+
+/* TRUE if processors should hold back output to the peer. */
+gboolean    ccnet_peer_is_congested (const CcnetPeer *peer);
+
+/*
+ * Write out corked packets now instead of at the end of the loop.
+ *
+ * The packets of control processors (see CcnetProcessorClass) are
+ * written first. The others are held back in the cork while the
+ * connection output is above its high watermark, so that a keepalive
+ * waits for at most that much bulk data, and are written out as it
+ * drains.
+ */
+void        ccnet_peer_flush (CcnetPeer *peer);
+
+/* Largest content the peer accepts in a single packet. */
+int         ccnet_peer_max_payload_len (const CcnetPeer *peer);
+
+/* Append a line with the traffic counters of the peer to @buf. */
+void        ccnet_peer_format_traffic (CcnetPeer *peer, GString *buf);
+
+/* Append the packet trace of the peer to @buf, oldest first. */
+void        ccnet_peer_format_trace (CcnetPeer *peer, GString *buf);
+
 /* middle level IO */
 
 void        ccnet_peer_set_io (CcnetPeer *peer, struct CcnetPacketIO *io);
@@ -12,6 +12,12 @@
 #define ROLE_NOTIFY        "role-notify"
 #define SERVICE_READY      "service-ready"
 #define PEER_REDIRECT      "redirect"
+/* between cluster nodes */
+#define LOAD_REPORT        "load-report"
+#define PEER_LOCATION      "peer-location"
+#define FORWARD_MESSAGES   "forward"
+#define PEER_HANDOFF       "peer-handoff"
+#define CACHE_INVALIDATE   "cache-invalidate"
 
 int parse_peermgr_message (CcnetMessage *msg, guint16 *version,
                            char **type, char **body);
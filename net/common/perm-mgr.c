@@ -10,16 +10,30 @@
 #define DEBUG_FLAG CCNET_DEBUG_OTHER
 #include "log.h"
 
-/* Give an user and a service, for each role of this user:
-      1. find the service group,
-      2. use hash table 'role2groups' to find the permitted groups to this role,
-      3. check whether the given group in the list of groups.
+/* Service groups are interned into small ids. Every role has a
+   bitmask of the groups permitted to it, and every peer caches the
+   union of the masks of its roles in peer->perm_mask, which is dropped
+   when its roles change. Given a user and a service:
+      1. find the group id of the service,
+      2. test the bit of the group in the peer's mask.
 */
 
+/* Ids of the groups with fixed meanings, they have no bit. */
+enum {
+    GROUP_BASIC,
+    GROUP_INNER,
+    GROUP_SELF,
+    GROUP_FIRST_ROLE_GROUP,
+};
+
+#define MAX_GROUPS (GROUP_FIRST_ROLE_GROUP + 64)
+#define GROUP_BIT(id) ((guint64)1 << ((id) - GROUP_FIRST_ROLE_GROUP))
+
 struct _CcnetPermManagerPriv {
-    GHashTable   *serv2group;       /* service to group map */
-    GHashTable   *role2groups;      /* role -> list of groups */
-    GList        *anonymous_groups; /* permitted groups to anonymous user. */
+    GHashTable   *group_ids;        /* group -> id + 1 */
+    int           n_groups;
+    GHashTable   *serv2group;       /* service -> group id + 1 */
+    GHashTable   *role2groups;      /* role -> RolePermList */
 };
 
 struct ServiceGroup {
@@ -36,6 +50,7 @@ struct ServiceGroup service_groups[] = {
     { "receive-session-key",            "basic" },
     { "receive-skey2",                  "basic" },
     { "receive-msg",                    "basic" },
+    { "receive-msgs",                   "basic" },
     { "echo",                           "basic" },
     { "ccnet-rpcserver",                "rpc-inner" },
 #ifdef CCNET_SERVER
@@ -52,7 +67,8 @@ struct RolePerm {
 };
 
 typedef struct RolePermList {
-    GList *list;
+    CcnetStrSet groups;
+    guint64     mask;
 } RolePermList;
 
 struct RolePerm role_perms[] = {
@@ -70,11 +86,62 @@ ccnet_perm_manager_new (CcnetSession *session)
     CcnetPermManager *mgr = g_new0 (CcnetPermManager, 1);
     mgr->priv = g_new0 (CcnetPermManagerPriv, 1);
     mgr->session = session;
+    mgr->priv->group_ids = g_hash_table_new (g_str_hash, g_str_equal);
     mgr->priv->serv2group = g_hash_table_new (g_str_hash, g_str_equal);
     mgr->priv->role2groups = g_hash_table_new (g_str_hash, g_str_equal);
     return mgr;
 }
 
+/* The id of @group, a new one if it is not known yet. -1 if there are
+ * too many groups. */
+static int
+intern_group (CcnetPermManager *mgr, const char *group)
+{
+    CcnetPermManagerPriv *priv = mgr->priv;
+    gpointer value;
+    int id;
+
+    value = g_hash_table_lookup (priv->group_ids, group);
+    if (value)
+        return GPOINTER_TO_INT (value) - 1;
+
+    if (priv->n_groups == 0) {
+        /* The fixed groups come first. */
+        g_hash_table_insert (priv->group_ids, g_strdup ("basic"),
+                             GINT_TO_POINTER (GROUP_BASIC + 1));
+        g_hash_table_insert (priv->group_ids, g_strdup ("inner"),
+                             GINT_TO_POINTER (GROUP_INNER + 1));
+        g_hash_table_insert (priv->group_ids, g_strdup ("self"),
+                             GINT_TO_POINTER (GROUP_SELF + 1));
+        priv->n_groups = GROUP_FIRST_ROLE_GROUP;
+        return intern_group (mgr, group);
+    }
+
+    if (priv->n_groups >= MAX_GROUPS) {
+        ccnet_warning ("[perm-mgr] Too many service groups, %s is ignored\n",
+                       group);
+        return -1;
+    }
+
+    id = priv->n_groups++;
+    g_hash_table_insert (priv->group_ids, g_strdup (group),
+                         GINT_TO_POINTER (id + 1));
+    return id;
+}
+
+static void
+map_service (CcnetPermManager *mgr, const char *service, const char *group)
+{
+    int id = intern_group (mgr, group);
+
+    /* A service in a group we can't tell apart is left out, so it is
+     * only open to local peers. */
+    if (id < 0)
+        return;
+    g_hash_table_insert (mgr->priv->serv2group, g_strdup(service),
+                         GINT_TO_POINTER (id + 1));
+}
+
 static void populate_default_items(CcnetPermManager *mgr);
 
 int
@@ -88,10 +155,8 @@ static void
 populate_default_items (CcnetPermManager *mgr)
 {
     struct ServiceGroup *sg;
-    for (sg = service_groups; sg->service; sg++) {
-        g_hash_table_insert (mgr->priv->serv2group, g_strdup(sg->service),
-                             g_strdup(sg->group));
-    }
+    for (sg = service_groups; sg->service; sg++)
+        map_service (mgr, sg->service, sg->group);
 
     struct RolePerm *rp;
     for (rp = role_perms; rp->role; rp++) {
@@ -102,30 +167,56 @@ populate_default_items (CcnetPermManager *mgr)
             g_hash_table_insert (mgr->priv->role2groups, g_strdup(rp->role),
                                  list);
         }
-        list->list = g_list_prepend (list->list, g_strdup(rp->group));
+        ccnet_str_set_add (&list->groups, rp->group);
+
+        int id = intern_group (mgr, rp->group);
+        if (id >= GROUP_FIRST_ROLE_GROUP)
+            list->mask |= GROUP_BIT (id);
     }
 }
 
-static inline const char *
+/* The group id of @service, -1 if it is unknown. */
+static inline int
 get_service_group(CcnetPermManager *mgr, const char *service)
 {
-    return g_hash_table_lookup (mgr->priv->serv2group, service);
+    return GPOINTER_TO_INT (g_hash_table_lookup (mgr->priv->serv2group,
+                                                 service)) - 1;
 }
 
-int
-check_role_permission(CcnetPermManager *mgr, const char *role, const char *group)
+static guint64
+role_mask (CcnetPermManager *mgr, const char *role)
 {
     RolePermList *rplist;
-    GList *ptr;
 
     rplist = g_hash_table_lookup (mgr->priv->role2groups, role);
-    if (!rplist)
-        return PERM_CHECK_ERROR;
+    return rplist ? rplist->mask : 0;
+}
 
-    for (ptr = rplist->list; ptr; ptr = ptr->next) {
-        if (strcmp(ptr->data, group) == 0)
-            return PERM_CHECK_OK;
+static guint64
+peer_perm_mask (CcnetPermManager *mgr, CcnetPeer *peer)
+{
+    guint i;
+
+    if (!peer->perm_mask_valid) {
+        peer->perm_mask = 0;
+        for (i = 0; i < ccnet_str_set_size (&peer->roles); ++i)
+            peer->perm_mask |= role_mask (
+                mgr, ccnet_str_set_index (&peer->roles, i));
+        peer->perm_mask_valid = 1;
     }
+    return peer->perm_mask;
+}
+
+int
+check_role_permission(CcnetPermManager *mgr, const char *role, const char *group)
+{
+    gpointer value = g_hash_table_lookup (mgr->priv->group_ids, group);
+    int id = GPOINTER_TO_INT (value) - 1;
+
+    if (id < GROUP_FIRST_ROLE_GROUP)
+        return PERM_CHECK_ERROR;
+    if (role_mask (mgr, role) & GROUP_BIT (id))
+        return PERM_CHECK_OK;
     return PERM_CHECK_ERROR;
 }
 
@@ -144,20 +235,20 @@ ccnet_perm_manager_check_permission (CcnetPermManager *mgr,
                                      int req_id,
                                      int argc, char **argv)
 {
-    const char *group = get_service_group (mgr, req);
-    if (!group)
+    int group = get_service_group (mgr, req);
+    if (group < 0)
         return PERM_CHECK_NOSERVICE;
 
-    if (g_strcmp0(group, "basic") == 0)
+    if (group == GROUP_BASIC)
         return PERM_CHECK_OK;
 
     if (peer->is_local)
         return PERM_CHECK_OK;
 
-    if (g_strcmp0(group, "inner") == 0)
+    if (group == GROUP_INNER)
         return PERM_CHECK_ERROR;
 
-    if (g_strcmp0 (group, "self") == 0) {
+    if (group == GROUP_SELF) {
         if (g_strcmp0 (peer->id, mgr->session->base.id) == 0)
             /* myself user */
             return PERM_CHECK_OK;
@@ -165,11 +256,8 @@ ccnet_perm_manager_check_permission (CcnetPermManager *mgr,
             return PERM_CHECK_ERROR;
     }
 
-    GList *ptr;
-    for (ptr = peer->role_list; ptr; ptr = ptr->next) {
-        if (check_role_permission(mgr, ptr->data, group) == PERM_CHECK_OK)
-            return PERM_CHECK_OK;
-    }
+    if (peer_perm_mask (mgr, peer) & GROUP_BIT (group))
+        return PERM_CHECK_OK;
 
     return PERM_CHECK_ERROR;
 }
@@ -187,7 +275,6 @@ ccnet_perm_manager_register_service (CcnetPermManager *mgr,
         return -1;
 
     ccnet_debug ("[perm-mgr] register service %s %s\n", service, group);
-    g_hash_table_insert (mgr->priv->serv2group, g_strdup(service),
-                         g_strdup(group));
+    map_service (mgr, service, group);
     return 0;
 }
@@ -19,6 +19,7 @@
 #include "processors/recvsessionkey-proc.h"
 #include "processors/sendsessionkey-v2-proc.h"
 #include "processors/recvsessionkey-v2-proc.h"
+#include "processors/procalive-proc.h"
 
 
 #define DEBUG_FLAG  CCNET_DEBUG_PROCESSOR
@@ -36,19 +37,104 @@
 
 /* The timeout of keepalive-proc is 180s now. */
 #define DEFAULT_NO_PACKET_TIMEOUT    10   /* 10 seconds */
-#define KEEPALIVE_PULSE              5 * 1000 /* 5 seconds */
+#define KEEPALIVE_PULSE              1000 /* one wheel slot per second */
 #define CONNECTION_TIMEOUT           182
-#define MAX_PROCS_KEEPALIVE          5    /* we check 5 proc for each peer at most */
+#define KEEPALIVE_WHEEL_SIZE         256  /* must be a power of 2 */
+#define DEFAULT_POOL_SIZE            64
+#define DEFAULT_HISTORY_SIZE         256
+#define KEEPALIVE_ALIGN              8    /* seconds, see align_deadline() */
+#define PROC_ALIVE_BATCH             1000 /* processors per proc-alive */
 
+/* Released processors of one reusable type. */
 typedef struct {
-    GHashTable *proc_type_table;
+    const char *name;
+    GSList     *free;
+    guint       n_free;
+    guint64     reused;
+    guint64     created;
+    guint64     dropped;            /* finalized since the pool was full */
+} ProcPool;
+
+/* A registered service. The class is kept referenced from registration
+ * on, so creating a processor needs neither a class lookup nor a pool
+ * lookup. */
+typedef struct {
+    const char          *name;      /* interned */
+    GType                type;
+    CcnetProcessorClass *klass;
+    ProcPool            *pool;      /* NULL if not reusable */
+} ProcType;
+
+/* Services most requests are for, tried before the type table by
+ * ccnet_proc_factory_create_slave_processor_fast(). */
+static const char *hot_names[] = {
+    "ccnet-rpcserver", "ccnet-threaded-rpcserver", "mq-server", "keepalive2",
+};
+#define N_HOT_TYPES  G_N_ELEMENTS (hot_names)
+
+/* A finished processor, see "Processor History" below. */
+typedef struct {
+    const char *name;               /* of the class, never freed */
+    char        peer_id[41];
+    gint32      ctime;
+    gint32      dtime;
+    gint32      failure;
+} ProcRecord;
+
+/* Processors of a peer due for keepalive in this pulse. */
+typedef struct {
+    GString    *ids;            /* as the peer knows them */
+    int         n;
+} KeepaliveBatch;
+
+typedef struct {
+    GHashTable *proc_type_table;    /* interned name -> ProcType */
+    ProcType   *hot_types[N_HOT_TYPES];
+    GHashTable *pools;              /* GType -> ProcPool */
+    guint       pool_size;
+
+    /* Processors waiting for a keepalive deadline, hashed by deadline
+     * in seconds. Deadlines further than a revolution away are checked
+     * and put back once per revolution. */
+    struct list_head  wheel[KEEPALIVE_WHEEL_SIZE];
+    time_t            wheel_time;    /* next second to be processed */
+    gboolean          keepalive_on;
+    GHashTable       *class_timeouts;   /* class name -> seconds */
+    GHashTable       *ka_batches;       /* peer -> KeepaliveBatch */
+
+    ProcRecord       *history;
+    guint             history_size;
+    guint64           history_count;  /* records ever written */
+    guint             history_sample;
+    guint64           history_seen;
+    GHashTable       *history_names;  /* classes to record, NULL for all */
+
+    GHashTable       *cursor_markers; /* list_head -> CcnetProcCursor */
 } CcnetProcFactoryPriv;
 
+struct CcnetProcCursor {
+    struct list_head  marker;       /* in procs_list, before the next one */
+    CcnetProcFactory *factory;
+    char             *class_name;
+    char             *peer_id;
+    time_t            started_before;
+    int               position;
+};
+
 #define GET_PRIV(o)  \
    (G_TYPE_INSTANCE_GET_PRIVATE ((o), CCNET_TYPE_PROC_FACTORY, CcnetProcFactoryPriv))
 
 G_DEFINE_TYPE (CcnetProcFactory, ccnet_proc_factory, G_TYPE_OBJECT);
 
+static void
+free_batch (gpointer data)
+{
+    KeepaliveBatch *batch = data;
+
+    g_string_free (batch->ids, TRUE);
+    g_free (batch);
+}
+
 static void
 ccnet_proc_factory_class_init (CcnetProcFactoryClass *klass)
 {
@@ -60,24 +146,59 @@ ccnet_proc_factory_init (CcnetProcFactory *factory)
 {
     CcnetProcFactoryPriv *priv = GET_PRIV (factory);
 
+    int i;
+
     priv->proc_type_table = g_hash_table_new_full (
-        g_str_hash, g_str_equal, g_free, NULL);
+        g_str_hash, g_str_equal, NULL, g_free);
+    priv->pools = g_hash_table_new_full (
+        g_direct_hash, g_direct_equal, NULL, g_free);
+    priv->pool_size = DEFAULT_POOL_SIZE;
+
+    priv->history_size = DEFAULT_HISTORY_SIZE;
+    priv->history = g_new0 (ProcRecord, priv->history_size);
+    priv->history_sample = 1;
+    priv->cursor_markers = g_hash_table_new (g_direct_hash, g_direct_equal);
+    priv->class_timeouts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, NULL);
+    priv->ka_batches = g_hash_table_new_full (
+        g_direct_hash, g_direct_equal, g_object_unref, free_batch);
+
+    for (i = 0; i < KEEPALIVE_WHEEL_SIZE; i++)
+        INIT_LIST_HEAD (&priv->wheel[i]);
 }
 
+static ProcPool *get_pool (CcnetProcFactory *factory, GType type);
+
 void
 ccnet_proc_factory_register_processor (CcnetProcFactory *factory,
                                        const char *serv_name,
                                        GType type)
 {
     CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    ProcType *ptype;
+    guint i;
 
     CcnetProcessorClass *proc_class = 
         (CcnetProcessorClass *)g_type_class_ref(type);
     g_assert (proc_class->start != NULL);
-    g_type_class_unref (proc_class);
 
-    g_hash_table_insert (priv->proc_type_table, g_strdup (serv_name), 
-                         (gpointer) type);
+    ptype = g_hash_table_lookup (priv->proc_type_table, serv_name);
+    if (ptype) {
+        /* registered again, maybe with another type */
+        g_type_class_unref (ptype->klass);
+    } else {
+        ptype = g_new0 (ProcType, 1);
+        ptype->name = g_intern_string (serv_name);
+        g_hash_table_insert (priv->proc_type_table, (gpointer)ptype->name,
+                             ptype);
+    }
+    ptype->type = type;
+    ptype->klass = proc_class;
+    ptype->pool = proc_class->reusable ? get_pool (factory, type) : NULL;
+
+    for (i = 0; i < N_HOT_TYPES; i++)
+        if (strcmp (hot_names[i], serv_name) == 0)
+            priv->hot_types[i] = ptype;
 }
 
 
@@ -86,6 +207,8 @@ GType ccnet_putpubinfo_proc_get_type ();
 
 GType ccnet_sendmsg_proc_get_type ();
 GType ccnet_rcvmsg_proc_get_type ();
+GType ccnet_sendmsgs_proc_get_type ();
+GType ccnet_rcvmsgs_proc_get_type ();
 
 GType ccnet_rcvcmd_proc_get_type ();
 GType ccnet_getperm_proc_get_type ();
@@ -102,6 +225,7 @@ GType ccnet_sync_relay_slave_proc_get_type ();
 
 GType ccnet_rpcserver_proc_get_type ();
 GType ccnet_echo_proc_get_type ();
+GType ccnet_procalive_proc_get_type ();
 
 CcnetProcFactory *
 ccnet_proc_factory_new (CcnetSession *session)
@@ -112,7 +236,6 @@ ccnet_proc_factory_new (CcnetSession *session)
     factory->session = session;
     factory->no_packet_timeout = DEFAULT_NO_PACKET_TIMEOUT;
     INIT_LIST_HEAD(&(factory->procs_list));
-    factory->procs = NULL;
 
     /* register fundamental processors */
     /* FIXME: These processor types shall be regitered by managers */
@@ -125,14 +248,22 @@ ccnet_proc_factory_new (CcnetSession *session)
                                            ccnet_sendmsg_proc_get_type ());
     ccnet_proc_factory_register_processor (factory, "receive-msg",
                                            ccnet_rcvmsg_proc_get_type ());
+    ccnet_proc_factory_register_processor (factory, "send-msgs",
+                                           ccnet_sendmsgs_proc_get_type ());
+    ccnet_proc_factory_register_processor (factory, "receive-msgs",
+                                           ccnet_rcvmsgs_proc_get_type ());
 
     ccnet_proc_factory_register_processor (factory, "receive-cmd",
                                            ccnet_rcvcmd_proc_get_type ());
+    ccnet_proc_factory_register_processor (factory, "run-cmd",
+                                           ccnet_rcvcmd_proc_get_type ());
     /* ccnet_proc_factory_register_processor (factory, "receive-event", */
     /*                                        ccnet_rcvevent_proc_get_type ()); */
     
     ccnet_proc_factory_register_processor (factory, "keepalive2",
                                            ccnet_keepalive2_proc_get_type ());
+    ccnet_proc_factory_register_processor (factory, "proc-alive",
+                                           ccnet_procalive_proc_get_type ());
 
     ccnet_proc_factory_register_processor (factory, "send-session-key",
                                            ccnet_sendsessionkey_proc_get_type());
@@ -175,37 +306,150 @@ ccnet_proc_factory_new (CcnetSession *session)
     return factory;
 }
 
+static int keepalive_pulse (CcnetProcFactory *factory);
+
 void
 ccnet_proc_factory_start (CcnetProcFactory *factory)
 {
-    /* factory->keepalive_timer = ccnet_timer_new ( */
-    /*     (TimerCB) keepalive_pulse, factory, KEEPALIVE_PULSE); */
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    GKeyFile *keyf = factory->session->keyf;
+    char *pool_str;
+    char **names;
+    gsize n_names = 0, i;
+    int history_size = DEFAULT_HISTORY_SIZE, sample = 1;
+
+    pool_str = ccnet_key_file_get_string (keyf, "Processor", "POOL_SIZE");
+    if (pool_str) {
+        ccnet_proc_factory_set_pool_size (factory, atoi(pool_str));
+        g_free (pool_str);
+    }
+
+    if (g_key_file_has_key (keyf, "Processor", "HISTORY_SIZE", NULL))
+        history_size = g_key_file_get_integer (keyf, "Processor",
+                                               "HISTORY_SIZE", NULL);
+    if (g_key_file_has_key (keyf, "Processor", "HISTORY_SAMPLE", NULL))
+        sample = g_key_file_get_integer (keyf, "Processor",
+                                         "HISTORY_SAMPLE", NULL);
+    names = g_key_file_get_string_list (keyf, "Processor",
+                                        "HISTORY_PROCESSORS", &n_names, NULL);
+    for (i = 0; names && i < n_names; ++i) {
+        g_strstrip (names[i]);
+        if (names[i][0] == '\0')
+            continue;
+        if (!priv->history_names)
+            priv->history_names = g_hash_table_new_full (
+                g_str_hash, g_str_equal, g_free, NULL);
+        g_hash_table_replace (priv->history_names, g_strdup (names[i]), NULL);
+    }
+    g_strfreev (names);
+    ccnet_proc_factory_set_history (factory, history_size, sample);
+
+    /* "<class>=<seconds>", e.g. mqserver-proc=600 */
+    names = g_key_file_get_string_list (keyf, "Processor",
+                                        "KEEPALIVE_TIMEOUTS", &n_names, NULL);
+    for (i = 0; names && i < n_names; ++i) {
+        char *eq = strchr (names[i], '=');
+        if (!eq)
+            continue;
+        *eq = '\0';
+        g_strstrip (names[i]);
+        ccnet_proc_factory_set_class_keepalive_timeout (factory, names[i],
+                                                        atoi (eq + 1));
+    }
+    g_strfreev (names);
+
+    priv->wheel_time = time (NULL);
+    factory->keepalive_timer = ccnet_timer_new (
+        (TimerCB) keepalive_pulse, factory, KEEPALIVE_PULSE);
 }
 
-static GType
+static ProcType *
 ccnet_proc_factory_get_proc_type (CcnetProcFactory *factory,
                                   const char *serv_name)
 {
     CcnetProcFactoryPriv *priv = GET_PRIV (factory);
 
-    return (GType) g_hash_table_lookup (priv->proc_type_table, serv_name);
+    return g_hash_table_lookup (priv->proc_type_table, serv_name);
 }
 
-static inline CcnetProcessor *
-create_processor_common (CcnetProcFactory *factory,
-                         const char *serv_name,
-                         CcnetPeer *peer,
-                         int req_id)
+static ProcPool *
+get_pool (CcnetProcFactory *factory, GType type)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    ProcPool *pool;
+
+    pool = g_hash_table_lookup (priv->pools, (gpointer)type);
+    if (!pool) {
+        pool = g_new0 (ProcPool, 1);
+        pool->name = g_type_name (type);
+        g_hash_table_insert (priv->pools, (gpointer)type, pool);
+    }
+    return pool;
+}
+
+/* Processors have no construct properties, g_object_newv() saves
+ * g_object_new() parsing an empty argument list. */
+static CcnetProcessor *
+new_processor (CcnetProcFactory *factory, ProcType *ptype)
 {
-    GType type;
     CcnetProcessor *processor;
+    ProcPool *pool = ptype->pool;
 
-    type = ccnet_proc_factory_get_proc_type (factory, serv_name);
-    if (type == 0) {
-        return NULL;
+    if (!pool)
+        return g_object_newv (ptype->type, 0, NULL);
+
+    if (!pool->free) {
+        pool->created++;
+        return g_object_newv (ptype->type, 0, NULL);
     }
 
-    processor = g_object_new (type, NULL);
+    processor = pool->free->data;
+    pool->free = g_slist_delete_link (pool->free, pool->free);
+    pool->n_free--;
+    pool->reused++;
+    return processor;
+}
+
+/* Put a released processor back in its pool, or finalize it. */
+static void
+free_processor (CcnetProcFactory *factory, CcnetProcessor *processor)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    ProcPool *pool;
+
+    if (!CCNET_PROCESSOR_GET_CLASS (processor)->reusable ||
+        G_OBJECT(processor)->ref_count != 1) {
+        g_object_unref (processor);
+        return;
+    }
+
+    pool = get_pool (factory, G_OBJECT_TYPE (processor));
+    if (pool->n_free >= priv->pool_size) {
+        pool->dropped++;
+        g_object_unref (processor);
+        return;
+    }
+
+    /* release_resource() has dropped the peer, name and timers, and
+     * reset the subclass. Clear the rest so it looks newly created. */
+    g_signal_handlers_destroy (processor);
+    memset ((char *)processor + sizeof(GObject), 0,
+            sizeof(CcnetProcessor) - sizeof(GObject));
+    INIT_LIST_HEAD (&processor->wheel_list);
+
+    pool->free = g_slist_prepend (pool->free, processor);
+    pool->n_free++;
+}
+
+static inline CcnetProcessor *
+create_processor_of_type (CcnetProcFactory *factory,
+                          ProcType *ptype,
+                          CcnetPeer *peer,
+                          int req_id)
+{
+    CcnetProcessor *processor;
+
+    processor = new_processor (factory, ptype);
     processor->peer = peer;
     g_object_ref (peer);
     processor->session = factory->session;
@@ -213,7 +457,7 @@ create_processor_common (CcnetProcFactory *factory,
     /* Set the real processor name.
      * This may be different from the processor class name.
      */
-    processor->name = g_strdup(serv_name);
+    processor->name = g_strdup(ptype->name);
 
     if (!peer->is_local)
         ccnet_debug ("Create processor %s(%d) %s\n", GET_PNAME(processor),
@@ -226,6 +470,44 @@ create_processor_common (CcnetProcFactory *factory,
     return processor;
 }
 
+static inline CcnetProcessor *
+create_processor_common (CcnetProcFactory *factory,
+                         const char *serv_name,
+                         CcnetPeer *peer,
+                         int req_id)
+{
+    ProcType *ptype;
+
+    ptype = ccnet_proc_factory_get_proc_type (factory, serv_name);
+    if (!ptype)
+        return NULL;
+
+    return create_processor_of_type (factory, ptype, peer, req_id);
+}
+
+CcnetProcessor *
+ccnet_proc_factory_create_slave_processor_fast (CcnetProcFactory *factory,
+                                                const char *serv_name,
+                                                CcnetPeer *peer,
+                                                int req_id)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    ProcType *ptype;
+    guint i;
+
+    for (i = 0; i < N_HOT_TYPES; i++) {
+        ptype = priv->hot_types[i];
+        if (ptype && (ptype->name == serv_name ||
+                      (ptype->name[0] == serv_name[0] &&
+                       strcmp (ptype->name, serv_name) == 0)))
+            return create_processor_of_type (factory, ptype, peer,
+                                             SLAVE_ID (req_id));
+    }
+
+    return create_processor_common (factory, serv_name,
+                                    peer, SLAVE_ID (req_id));
+}
+
 CcnetProcessor *
 ccnet_proc_factory_create_slave_processor (CcnetProcFactory *factory,
                                            const char *serv_name,
@@ -247,27 +529,216 @@ ccnet_proc_factory_create_master_processor (CcnetProcFactory *factory,
         peer, MASTER_ID(ccnet_peer_get_request_id (peer)) );
 }
 
+CcnetProcessor *
+ccnet_proc_factory_create_processor_with_id (CcnetProcFactory *factory,
+                                             const char *serv_name,
+                                             CcnetPeer *peer,
+                                             unsigned int id)
+{
+    return create_processor_common (factory, serv_name, peer, id);
+}
+
+/* -------- Processor History ---------------- */
+
+/*
+ * The last history_size finished processors are kept in a ring, the
+ * newest at history_count - 1. Only every history_sample-th processor
+ * of the classes in [Processor] HISTORY_PROCESSORS is recorded; without
+ * that list every class but rpcserver-proc is.
+ */
+
+static void
+history_add (CcnetProcFactory *factory, CcnetProcessor *processor)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    const char *name = GET_PNAME(processor);
+    ProcRecord *rec;
+
+    if (priv->history_size == 0)
+        return;
+    if (priv->history_names) {
+        if (!g_hash_table_lookup_extended (priv->history_names, name,
+                                           NULL, NULL))
+            return;
+    } else if (strcmp (name, "rpcserver-proc") == 0)
+        return;
+    if (priv->history_seen++ % priv->history_sample != 0)
+        return;
+
+    rec = &priv->history[priv->history_count++ % priv->history_size];
+    rec->name = name;
+    g_strlcpy (rec->peer_id, processor->peer->id, sizeof(rec->peer_id));
+    rec->ctime = (gint32) processor->start_time;
+    rec->dtime = (gint32) time(NULL);
+    rec->failure = processor->failure;
+}
+
+void
+ccnet_proc_factory_set_history (CcnetProcFactory *factory,
+                                int size, int sample)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+
+    if (size < 0)
+        size = 0;
+    if ((guint)size != priv->history_size) {
+        g_free (priv->history);
+        priv->history = g_new0 (ProcRecord, size);
+        priv->history_size = size;
+        priv->history_count = 0;
+    }
+    priv->history_sample = sample > 0 ? sample : 1;
+}
+
+int
+ccnet_proc_factory_count_history (CcnetProcFactory *factory)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+
+    return (int) MIN (priv->history_count, (guint64) priv->history_size);
+}
+
+GList *
+ccnet_proc_factory_get_history (CcnetProcFactory *factory,
+                                int offset, int limit)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    int count = ccnet_proc_factory_count_history (factory);
+    GList *ret = NULL;
+    ProcRecord *rec;
+    CcnetPeer *peer;
+    CcnetProc *proc;
+    int i, end;
+
+    if (offset < 0)
+        offset = 0;
+    end = (limit < 0 || limit > count - offset) ? count : offset + limit;
+
+    for (i = offset; i < end; ++i) {
+        rec = &priv->history[(priv->history_count - 1 - i) % priv->history_size];
+        peer = ccnet_peer_manager_get_peer (factory->session->peer_mgr,
+                                            rec->peer_id);
+        proc = ccnet_proc_new ();
+        g_object_set (proc, "name", rec->name,
+                      "peer-name", (peer && peer->name) ? peer->name
+                                                        : rec->peer_id,
+                      "ctime", rec->ctime, "dtime", rec->dtime,
+                      "failure", rec->failure, NULL);
+        if (peer)
+            g_object_unref (peer);
+        ret = g_list_prepend (ret, proc);
+    }
+
+    return g_list_reverse (ret);
+}
+
+/* -------- Cursors over Live Processors ---------------- */
+
+/*
+ * New processors are added at the head of procs_list, so a walk from
+ * the head sees those alive when it started, less the ones which died
+ * since. A cursor keeps its place with a marker node in the list,
+ * which lets a listing be resumed in O(1) and spread over many loop
+ * iterations. Walks over procs_list must skip the markers, so they all
+ * go through cursors.
+ */
+
+CcnetProcCursor *
+ccnet_proc_factory_open_cursor (CcnetProcFactory *factory,
+                                const char *class_name,
+                                const char *peer_id,
+                                int min_age)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    CcnetProcCursor *cursor = g_new0 (CcnetProcCursor, 1);
+
+    cursor->factory = factory;
+    cursor->class_name = g_strdup (class_name);
+    cursor->peer_id = g_strdup (peer_id);
+    cursor->started_before = min_age > 0 ? time(NULL) - min_age : 0;
+
+    list_add (&cursor->marker, &factory->procs_list);
+    g_hash_table_insert (priv->cursor_markers, &cursor->marker, cursor);
+
+    return cursor;
+}
+
+static gboolean
+cursor_matches (CcnetProcCursor *cursor, CcnetProcessor *processor)
+{
+    if (cursor->class_name &&
+        strcmp (GET_PNAME(processor), cursor->class_name) != 0)
+        return FALSE;
+    if (cursor->peer_id && strcmp (processor->peer->id, cursor->peer_id) != 0)
+        return FALSE;
+    if (cursor->started_before &&
+        processor->start_time > cursor->started_before)
+        return FALSE;
+    return TRUE;
+}
+
+int
+ccnet_proc_cursor_step (CcnetProcCursor *cursor, int max_visit,
+                        CcnetProcCursorFunc func, void *data)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (cursor->factory);
+    struct list_head *head = &cursor->factory->procs_list;
+    struct list_head *pos;
+    CcnetProcessor *processor;
+    gboolean more = TRUE;
+
+    while (more && max_visit-- > 0) {
+        pos = cursor->marker.next;
+        if (pos == head)
+            return 0;
+
+        /* step over pos */
+        list_del (&cursor->marker);
+        list_add (&cursor->marker, pos);
+
+        if (g_hash_table_lookup (priv->cursor_markers, pos))
+            continue;
+        processor = list_entry (pos, CcnetProcessor, list);
+        if (!cursor_matches (cursor, processor))
+            continue;
+        cursor->position++;
+        more = func (processor, data);
+    }
+
+    return cursor->marker.next != head;
+}
+
+int
+ccnet_proc_cursor_position (CcnetProcCursor *cursor)
+{
+    return cursor->position;
+}
+
+void
+ccnet_proc_cursor_close (CcnetProcCursor *cursor)
+{
+    CcnetProcFactoryPriv *priv;
+
+    if (!cursor)
+        return;
+    priv = GET_PRIV (cursor->factory);
+    g_hash_table_remove (priv->cursor_markers, &cursor->marker);
+    list_del (&cursor->marker);
+    g_free (cursor->class_name);
+    g_free (cursor->peer_id);
+    g_free (cursor);
+}
+
 static void inline
 recycle (CcnetProcFactory *factory, CcnetProcessor *processor)
 {
     list_del (&processor->list);
+    list_del_init (&processor->wheel_list);
     factory->procs_alive_cnt--;
 
-#ifdef DEBUG_PROC
-    if (strcmp(GET_PNAME(processor), "rpcserver-proc") != 0) {
-        /* ignore rpcserver-proc */
+    history_add (factory, processor);
 
-        CcnetProc *proc = ccnet_proc_new();
-        g_object_set (proc, "name", GET_PNAME(processor),
-                      "peer-name", processor->peer->name,
-                      "ctime", (int) processor->start_time,
-                      "dtime", (int) time(NULL), NULL);
-        factory->procs = g_list_prepend (factory->procs, proc);
-    }
-#endif
-
-    /* TODO: implement processor pool */
-    g_object_unref (processor);
+    free_processor (factory, processor);
 }
 
 void
@@ -277,6 +748,68 @@ ccnet_proc_factory_recycle (CcnetProcFactory *factory,
     recycle (factory, processor);
 }
 
+void
+ccnet_proc_factory_set_pool_size (CcnetProcFactory *factory, int size)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    priv->pool_size = size > 0 ? size : 0;
+
+    /* trim pools which are now too large */
+    g_hash_table_iter_init (&iter, priv->pools);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        ProcPool *pool = value;
+        while (pool->n_free > priv->pool_size) {
+            g_object_unref (pool->free->data);
+            pool->free = g_slist_delete_link (pool->free, pool->free);
+            pool->n_free--;
+        }
+    }
+}
+
+char *
+ccnet_proc_factory_get_pool_stats (CcnetProcFactory *factory)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    GHashTableIter iter;
+    gpointer key, value;
+    GString *buf = g_string_new (NULL);
+
+    g_hash_table_iter_init (&iter, priv->pools);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        ProcPool *pool = value;
+        g_string_append_printf (buf, "%s\t%u\t%" G_GUINT64_FORMAT
+                                "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\n",
+                                pool->name, pool->n_free, pool->reused,
+                                pool->created, pool->dropped);
+    }
+
+    return g_string_free (buf, FALSE);
+}
+
+void
+ccnet_proc_factory_get_pool_usage (CcnetProcFactory *factory,
+                                   guint *n_free, gsize *bytes)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    GHashTableIter iter;
+    gpointer key, value;
+    GTypeQuery query;
+
+    *n_free = 0;
+    *bytes = 0;
+    g_hash_table_iter_init (&iter, priv->pools);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        ProcPool *pool = value;
+
+        g_type_query ((GType)key, &query);
+        *n_free += pool->n_free;
+        *bytes += (gsize)pool->n_free * query.instance_size;
+    }
+}
+
 static void
 shutdown_processor (CcnetProcessor *processor,
                     char *code, char *code_msg)
@@ -302,13 +835,13 @@ ccnet_proc_factory_shutdown_processors (CcnetProcFactory *factory,
     char *code = g_strdup (SC_NETDOWN);
     char *code_msg = g_strdup (SS_NETDOWN);
 
-    list = g_hash_table_get_values (peer->processors);
+    list = ccnet_peer_get_processor_list (peer);
     for (ptr = list; ptr; ptr = ptr->next) {
         processor = CCNET_PROCESSOR (ptr->data);
-        processor->detached = TRUE;
+        /* also marks it detached */
+        ccnet_peer_remove_processor (peer, processor);
         shutdown_processor (processor, code, code_msg);
     }
-    g_hash_table_remove_all (peer->processors);
     g_list_free (list);
 
     g_free (code);
@@ -319,19 +852,38 @@ void
 ccnet_proc_factory_set_keepalive_timeout (CcnetProcFactory *factory,
                                           int timeout)
 {
-    factory->no_packet_timeout = timeout;
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+
+    if (timeout > 0)
+        factory->no_packet_timeout = timeout;
+    priv->keepalive_on = (timeout > 0);
 }
 
-/* Don't send keepalive or reclaim inactive processors. */
+void
+ccnet_proc_factory_set_class_keepalive_timeout (CcnetProcFactory *factory,
+                                                const char *class_name,
+                                                int timeout)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
 
-#if 0
+    if (timeout > 0)
+        g_hash_table_replace (priv->class_timeouts, g_strdup (class_name),
+                              GINT_TO_POINTER (timeout));
+    else
+        g_hash_table_remove (priv->class_timeouts, class_name);
+}
 
-static gint
-compare_procs (gconstpointer a, gconstpointer b)
+static int
+keepalive_timeout (CcnetProcFactory *factory, CcnetProcessor *processor)
 {
-    const CcnetProcessor *proc_a = a, *proc_b = b;
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    gpointer timeout;
 
-    return (proc_a->t_keepalive_sent - proc_b->t_keepalive_sent);
+    if (g_hash_table_size (priv->class_timeouts) > 0 &&
+        (timeout = g_hash_table_lookup (priv->class_timeouts,
+                                        GET_PNAME(processor))) != NULL)
+        return GPOINTER_TO_INT (timeout);
+    return factory->no_packet_timeout;
 }
 
 /* keep processors alive by sending keepalive packets. 
@@ -352,118 +904,234 @@ compare_procs (gconstpointer a, gconstpointer b)
    1. send SC_PROC_ALIVE back, then the `processor->t_packet_recv`
       is updated.
    2. send SC_PROC_DEAD back, then shutdown the processor.
-   3. no response, then when if `no_packet_timeout + 30`
+   3. no response, then when if `no_packet_timeout + CONNECTION_TIMEOUT`
       threshold is reached, shutdown the processor.
+
+   Receiving a packet only updates `t_packet_recv`. The wheel entry is
+   left alone and the deadline is recomputed when it comes due, so each
+   processor is looked at about once per timeout, not once per pulse.
+
+   The timeout can be set per processor class with [Processor]
+   KEEPALIVE_TIMEOUTS. Both ends should use the same values, as the
+   server doesn't send keepalives and takes silence for death.
+
+   The keepalives due in a pulse are sent per peer, as one proc-alive
+   listing all the processors, see procalive-proc.c. Its answer counts
+   as a packet for each of them on both ends. So that a peer's
+   processors come due in the same pulse, keepalive deadlines are
+   aligned to a grid of KEEPALIVE_ALIGN seconds.
 */
 
+/* Round @t up to the grid of @processor's peer. The grid is shifted per
+ * peer so all peers don't come due at once. */
+static time_t
+align_deadline (CcnetProcessor *processor, time_t t)
+{
+    int phase = processor->peer->raw_id[0] % KEEPALIVE_ALIGN;
+
+    return t + (KEEPALIVE_ALIGN - (t + phase) % KEEPALIVE_ALIGN)
+        % KEEPALIVE_ALIGN;
+}
+
+/* First second at which the processor needs attention. */
+static time_t
+keepalive_deadline (CcnetProcFactory *factory, CcnetProcessor *processor)
+{
+    time_t last = processor->t_packet_recv;
+    int timeout = keepalive_timeout (factory, processor);
+
+    /* The server don't send keep alive. */
+#ifndef CCNET_SERVER
+    /* a just started master processor */
+    if (last == 0)
+        return processor->start_time + CONNECTION_TIMEOUT;
+
+    if (processor->t_keepalive_sent <= last)
+        return align_deadline (processor, last + timeout + 1);
+#else
+    if (last == 0)
+        last = processor->start_time;
+#endif
+
+    return last + timeout + CONNECTION_TIMEOUT + 1;
+}
+
 static void
-peer_processors_keepalive (CcnetProcFactory *factory, CcnetPeer *peer)
+wheel_insert (CcnetProcFactory *factory, CcnetProcessor *processor,
+              time_t deadline)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+
+    if (deadline < priv->wheel_time)
+        deadline = priv->wheel_time;
+    list_add_tail (&processor->wheel_list,
+                   &priv->wheel[deadline & (KEEPALIVE_WHEEL_SIZE - 1)]);
+}
+
+void
+ccnet_proc_factory_watch_processor (CcnetProcFactory *factory,
+                                    CcnetProcessor *processor)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+
+    if (!priv->keepalive_on || !list_empty (&processor->wheel_list))
+        return;
+
+    if (CCNET_IS_KEEPALIVE2_PROC(processor))
+        return;
+
+    /* No need to call keepalive to local peer */
+    if (processor->peer->is_local)
+        return;
+
+    wheel_insert (factory, processor,
+                  keepalive_deadline (factory, processor));
+}
+
+#ifndef CCNET_SERVER
+static void
+flush_batch (CcnetProcFactory *factory, CcnetPeer *peer,
+             KeepaliveBatch *batch)
 {
-    time_t now = time(NULL);
-    const int no_packet_timeout1 = factory->no_packet_timeout;
-    const int no_packet_timeout2 = factory->no_packet_timeout + CONNECTION_TIMEOUT;
-    struct list_head *pos, *tmp;
     CcnetProcessor *processor;
-    int count = 0;
-    char *code, *code_msg;
-    GList *keepalive_list = NULL, *ptr;
+    char *argv[1];
 
-    /*
-     * Use list_for_each_safe since we may delete an entry when looping. 
-     */
-    list_for_each_safe (pos, tmp, &(peer->procs_list)) {
-        processor = list_entry (pos, CcnetProcessor, per_peer_list);
+    if (batch->n == 0 || peer->net_state != PEER_CONNECTED)
+        return;
 
-        if (CCNET_IS_KEEPALIVE2_PROC(processor))
-            continue;
+    processor = ccnet_proc_factory_create_master_processor (
+        factory, "proc-alive", peer);
+    if (processor) {
+        argv[0] = batch->ids->str;
+        ccnet_processor_start (processor, 1, argv);
+    } else
+        ccnet_warning ("Create proc-alive processor failed\n");
 
-        if (processor->peer->is_local) {
-            /* No need to call keepalive to local peer */
-            continue;
-        }
+    g_string_truncate (batch->ids, 0);
+    batch->n = 0;
+}
 
-        /* The server don't send keep alive. */
-#ifndef CCNET_SERVER        
-        /* a just started master processor */
-        if (processor->t_packet_recv == 0) {
-            g_assert (processor->start_time != 0);
-            if (now - processor->start_time >= CONNECTION_TIMEOUT) {
-                ccnet_debug ("[proc-fact] Shutdown processsor %s(%d) when connect timeout %ds\n",
-                             GET_PNAME(processor), PRINT_ID(processor->id),
-                             now - processor->start_time);
-                code = g_strdup (SC_CON_TIMEOUT);
-                code_msg = g_strdup (SS_CON_TIMEOUT);
-                shutdown_processor (processor, code, code_msg);
-                g_free (code);
-                g_free (code_msg);
-            }
-            continue;
-        }
+static void
+flush_one_batch (gpointer key, gpointer value, gpointer factory)
+{
+    flush_batch (factory, key, value);
+}
 
-        if (now - processor->t_packet_recv <= no_packet_timeout1)
-            continue;
+static void
+queue_keepalive (CcnetProcFactory *factory, CcnetProcessor *processor)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    CcnetPeer *peer = processor->peer;
+    KeepaliveBatch *batch;
 
-        if (processor->t_keepalive_sent <= processor->t_packet_recv) {
-            /* has not send a keepalive packet yet */
-            keepalive_list = g_list_prepend (keepalive_list, processor);
+    /* A proc-alive waiting for its answer is kept alive the old way. */
+    if (peer->no_proc_alive || CCNET_IS_PROCALIVE_PROC (processor)) {
+        ccnet_processor_keep_alive (processor);
+        return;
+    }
 
-            continue;
-        }
+    batch = g_hash_table_lookup (priv->ka_batches, peer);
+    if (!batch) {
+        batch = g_new0 (KeepaliveBatch, 1);
+        batch->ids = g_string_new (NULL);
+        g_hash_table_insert (priv->ka_batches, g_object_ref (peer), batch);
+    }
+    if (batch->n++ > 0)
+        g_string_append_c (batch->ids, ',');
+    g_string_append_printf (batch->ids, "%u", PROC_REMOTE_ID (processor->id));
+    processor->t_keepalive_sent = time (NULL);
+
+    if (batch->n >= PROC_ALIVE_BATCH)
+        flush_batch (factory, peer, batch);
+}
 #endif
 
-        /* if keepalive is already sent and timeout */
-        if (now - processor->t_packet_recv > no_packet_timeout2) {
-            ccnet_debug ("Shutdown processsor %s(%d) when timeout\n", 
-                         GET_PNAME(processor), PRINT_ID(processor->id));
-            /* receive command processor should only be called by 
-               local, and they may only timeout when debuging. */
-            /* g_assert (!CCNET_IS_RCVCMD_PROC(processor)); */
-            code = g_strdup (SC_KEEPALIVE_TIMEOUT);
-            code_msg = g_strdup (SS_KEEPALIVE_TIMEOUT);
-            shutdown_processor (processor, code, code_msg);
-            g_free (code);
-            g_free (code_msg);
-            continue;
-        }
-    }
+static void
+check_processor (CcnetProcFactory *factory, CcnetProcessor *processor,
+                 time_t now)
+{
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    time_t deadline;
+    char *code, *code_msg;
 
-    /* Sort the processors that need keep alive by its last
-     * keepalive sent time, so that no processor is starved.
-     */
-    keepalive_list = g_list_sort (keepalive_list, compare_procs);
-    for (ptr = keepalive_list; ptr; ptr = ptr->next) {
-        processor = ptr->data;
+    /* dropped from the wheel if detached or keepalive turned off */
+    if (processor->detached || !priv->keepalive_on)
+        return;
+
+    deadline = keepalive_deadline (factory, processor);
+    if (deadline > now) {
+        wheel_insert (factory, processor, deadline);
+        return;
+    }
 
-        if (++count > MAX_PROCS_KEEPALIVE)
-            break;
+#ifndef CCNET_SERVER
+    if (processor->t_packet_recv == 0) {
+        ccnet_debug ("[proc-fact] Shutdown processsor %s(%d) when connect timeout %ds\n",
+                     GET_PNAME(processor), PRINT_ID(processor->id),
+                     (int)(now - processor->start_time));
+        code = g_strdup (SC_CON_TIMEOUT);
+        code_msg = g_strdup (SS_CON_TIMEOUT);
+        shutdown_processor (processor, code, code_msg);
+        g_free (code);
+        g_free (code_msg);
+        return;
+    }
 
+    if (processor->t_keepalive_sent <= processor->t_packet_recv) {
+        /* has not send a keepalive packet yet */
         ccnet_debug ("sending keepalive, %s(%d), last sent: %d.\n",
                      GET_PNAME(processor), PRINT_ID(processor->id),
                      (int)processor->t_keepalive_sent);
-        ccnet_processor_keep_alive (processor);
+        queue_keepalive (factory, processor);
+        wheel_insert (factory, processor,
+                      keepalive_deadline (factory, processor));
+        return;
     }
-    g_list_free (keepalive_list);
+#endif
+
+    /* if keepalive is already sent and timeout */
+    ccnet_debug ("Shutdown processsor %s(%d) when timeout\n", 
+                 GET_PNAME(processor), PRINT_ID(processor->id));
+    code = g_strdup (SC_KEEPALIVE_TIMEOUT);
+    code_msg = g_strdup (SS_KEEPALIVE_TIMEOUT);
+    shutdown_processor (processor, code, code_msg);
+    g_free (code);
+    g_free (code_msg);
 }
 
 static int
 keepalive_pulse (CcnetProcFactory *factory)
 {
-    GList *peers, *ptr;
-    CcnetPeer *peer;
-
-    /* Maintain a separate processor keep-alive list for each peer.
-     * So we don't need to worry about removing proxy proc and stub
-     * proc from the same list in one loop, since they are bound to
-     * different peers.
-     */
-    peers = ccnet_peer_manager_get_peer_list (factory->session->peer_mgr);
-    for (ptr = peers; ptr != NULL; ptr = ptr->next) {
-        peer = ptr->data;
-        peer_processors_keepalive (factory, peer);
+    CcnetProcFactoryPriv *priv = GET_PRIV (factory);
+    time_t now = time(NULL);
+    struct list_head due, *slot;
+    CcnetProcessor *processor;
+    int n = 0;
+
+    /* Catch up on slots missed while the loop was busy, but never go
+     * around more than once. */
+    if (now - priv->wheel_time >= KEEPALIVE_WHEEL_SIZE)
+        priv->wheel_time = now - KEEPALIVE_WHEEL_SIZE + 1;
+
+    while (priv->wheel_time <= now && n++ < KEEPALIVE_WHEEL_SIZE) {
+        slot = &priv->wheel[priv->wheel_time & (KEEPALIVE_WHEEL_SIZE - 1)];
+        priv->wheel_time++;
+
+        /* Shutting down a processor may recycle others in the same
+         * slot, so take entries off one at a time. */
+        INIT_LIST_HEAD (&due);
+        list_splice_init (slot, &due);
+        while (!list_empty (&due)) {
+            processor = list_entry (due.next, CcnetProcessor, wheel_list);
+            list_del_init (&processor->wheel_list);
+            check_processor (factory, processor, now);
+        }
     }
-    g_list_free (peers);
+
+#ifndef CCNET_SERVER
+    g_hash_table_foreach (priv->ka_batches, flush_one_batch, factory);
+    g_hash_table_remove_all (priv->ka_batches);
+#endif
 
     return TRUE;
 }
-
-#endif  /* 0 */
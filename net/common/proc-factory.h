@@ -28,11 +28,8 @@ struct _CcnetProcFactory
     int                   procs_alive_cnt; /*number of processors alive*/
     struct CcnetTimer    *keepalive_timer;
 
-    GList                *procs;   /* TODO: need to recyle the space
-                                    * when it grows verylarge  */
-
     /* do keepalive if not receiving packet in `no_packet_timeout`,
-     * default is 30 seconds */
+     * default is 10 seconds */
     int                   no_packet_timeout;
 };
 
@@ -53,6 +50,54 @@ void ccnet_proc_factory_register_processor (CcnetProcFactory *facotry,
 void ccnet_proc_factory_recycle(CcnetProcFactory *factory,
                                 CcnetProcessor *processor);
 
+/* Keep at most @size released processors of each reusable type. */
+void ccnet_proc_factory_set_pool_size (CcnetProcFactory *factory, int size);
+
+/* One line per pooled type: "name free reused created dropped". */
+char *ccnet_proc_factory_get_pool_stats (CcnetProcFactory *factory);
+
+/* The number and instance size of the pooled processors. */
+void ccnet_proc_factory_get_pool_usage (CcnetProcFactory *factory,
+                                        guint *n_free, gsize *bytes);
+
+/* Keep the last @size finished processors, recording one in @sample.
+ * Changing the size clears the history. */
+void ccnet_proc_factory_set_history (CcnetProcFactory *factory,
+                                     int size, int sample);
+
+int ccnet_proc_factory_count_history (CcnetProcFactory *factory);
+
+/* The finished processors from @offset, newest first, as CcnetProc. */
+GList *ccnet_proc_factory_get_history (CcnetProcFactory *factory,
+                                       int offset, int limit);
+
+/*
+ * A walk over the processors alive when the cursor was opened, newest
+ * first, which can be resumed later. Only processors of class
+ * @class_name, of @peer_id and alive for @min_age seconds, if given,
+ * are passed to the step function.
+ */
+typedef struct CcnetProcCursor CcnetProcCursor;
+
+/* Return FALSE to stop the step. */
+typedef gboolean (*CcnetProcCursorFunc) (CcnetProcessor *processor,
+                                         void *data);
+
+CcnetProcCursor *ccnet_proc_factory_open_cursor (CcnetProcFactory *factory,
+                                                 const char *class_name,
+                                                 const char *peer_id,
+                                                 int min_age);
+
+/* Visit at most @max_visit processors. Returns 0 at the end of the
+ * list, 1 otherwise. */
+int ccnet_proc_cursor_step (CcnetProcCursor *cursor, int max_visit,
+                            CcnetProcCursorFunc func, void *data);
+
+/* Number of processors passed to the step function so far. */
+int ccnet_proc_cursor_position (CcnetProcCursor *cursor);
+
+void ccnet_proc_cursor_close (CcnetProcCursor *cursor);
+
 void ccnet_proc_factory_shutdown_processors (
     CcnetProcFactory *factory, CcnetPeer *peer);
 
@@ -64,7 +109,31 @@ CcnetProcessor *ccnet_proc_factory_create_slave_processor (
     CcnetProcFactory *factory, const char *serv_name,
     CcnetPeer *peer, int req_id);
 
+/* Like create_slave_processor(), but the services most requests are
+ * for (rpc servers, mq-server, keepalive2) are matched before the type
+ * table is looked up. */
+CcnetProcessor *ccnet_proc_factory_create_slave_processor_fast (
+    CcnetProcFactory *factory, const char *serv_name,
+    CcnetPeer *peer, int req_id);
+
+/* With the full processor @id, master or slave, for processors taken
+ * over from another process. */
+CcnetProcessor *ccnet_proc_factory_create_processor_with_id (
+    CcnetProcFactory *factory, const char *serv_name,
+    CcnetPeer *peer, unsigned int id);
+
+/* A timeout <= 0 turns processor keepalive off, which is the default. */
 void ccnet_proc_factory_set_keepalive_timeout (CcnetProcFactory *factory,
                                                int timeout);
 
+/* Keepalive timeout of the processors of @class_name, e.g.
+ * "mqserver-proc". A timeout <= 0 goes back to the global one. */
+void ccnet_proc_factory_set_class_keepalive_timeout (CcnetProcFactory *factory,
+                                                     const char *class_name,
+                                                     int timeout);
+
+/* Called when a processor starts, to check it for keepalive. */
+void ccnet_proc_factory_watch_processor (CcnetProcFactory *factory,
+                                         CcnetProcessor *processor);
+
 #endif
@@ -10,6 +10,9 @@
 #include "connect-mgr.h"
 #include "proc-factory.h"
 #include "utils.h"
+#include "metrics.h"
+#include "loop-monitor.h"
+#include "trace.h"
 
 #ifdef CCNET_SERVER
 #include "server-session.h"
@@ -35,6 +38,113 @@ G_DEFINE_TYPE (CcnetProcessor, ccnet_processor, G_TYPE_OBJECT);
 static void default_shutdown (CcnetProcessor *processor);
 static void default_release_resource (CcnetProcessor *processor);
 
+/* Bucket i counts latencies below 2^i ms, the last one the rest. */
+#define LATENCY_BUCKETS 16
+
+typedef struct ProcClassStats {
+    guint64 n_started;
+    guint64 n_calls;            /* handler calls, start() included */
+    guint64 handler_usec;
+    guint64 n_latency;
+    guint64 latency_usec;
+    guint64 latency[LATENCY_BUCKETS];
+} ProcClassStats;
+
+/* class name -> ProcClassStats, only used in the main thread */
+static GHashTable *class_stats;
+
+/* The same latencies over all classes, see metrics.h. */
+static CcnetMetric *metric_latency;
+static const double latency_bounds[] = {
+    0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10,
+};
+
+static ProcClassStats *
+get_class_stats (CcnetProcessorClass *klass)
+{
+    const char *name = klass->name ? klass->name : G_OBJECT_CLASS_NAME (klass);
+    ProcClassStats *stats;
+
+    if (!class_stats)
+        class_stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, g_free);
+
+    stats = g_hash_table_lookup (class_stats, name);
+    if (!stats) {
+        stats = g_new0 (ProcClassStats, 1);
+        g_hash_table_insert (class_stats, g_strdup (name), stats);
+    }
+    return stats;
+}
+
+void
+ccnet_processor_class_account (CcnetProcessorClass *klass,
+                               const char *what, const char *peer_id,
+                               gint64 usec)
+{
+    ProcClassStats *stats = get_class_stats (klass);
+
+    stats->n_calls++;
+    stats->handler_usec += usec;
+
+    ccnet_loop_monitor_check (what, klass->name, peer_id, usec);
+}
+
+/* Record the latency of the first response of @processor. */
+static void
+account_first_response (CcnetProcessor *processor)
+{
+    ProcClassStats *stats;
+    gint64 usec, ms;
+    int i;
+
+    if (processor->t_request == 0)
+        return;
+
+    usec = g_get_monotonic_time () - processor->t_request;
+    processor->t_request = 0;
+    ccnet_trace_mark_response (processor, usec);
+
+    stats = get_class_stats (CCNET_PROCESSOR_GET_CLASS (processor));
+    stats->n_latency++;
+    stats->latency_usec += usec;
+    for (i = 0, ms = usec / 1000; ms > 0 && i < LATENCY_BUCKETS - 1; ms >>= 1)
+        ++i;
+    stats->latency[i]++;
+
+    ccnet_metric_observe (metric_latency, usec / 1e6);
+}
+
+static void
+append_class_stats (gpointer key, gpointer value, gpointer vbuf)
+{
+    ProcClassStats *stats = value;
+    GString *buf = vbuf;
+    int i;
+
+    g_string_append_printf (buf, "proc %s started %" G_GUINT64_FORMAT
+                            " calls %" G_GUINT64_FORMAT
+                            " handler_usec %" G_GUINT64_FORMAT
+                            " responses %" G_GUINT64_FORMAT
+                            " latency_usec %" G_GUINT64_FORMAT " latency_ms",
+                            (char *)key, stats->n_started, stats->n_calls,
+                            stats->handler_usec, stats->n_latency,
+                            stats->latency_usec);
+    for (i = 0; i < LATENCY_BUCKETS; ++i)
+        g_string_append_printf (buf, " %" G_GUINT64_FORMAT, stats->latency[i]);
+    g_string_append_c (buf, '\n');
+}
+
+char *
+ccnet_processor_get_class_stats (void)
+{
+    GString *buf = g_string_new (NULL);
+
+    if (class_stats)
+        g_hash_table_foreach (class_stats, append_class_stats, buf);
+    return g_string_free (buf, FALSE);
+}
+
 static void
 ccnet_processor_class_init (CcnetProcessorClass *klass)
 {
@@ -46,6 +156,11 @@ ccnet_processor_class_init (CcnetProcessorClass *klass)
     klass->shutdown = default_shutdown;
     klass->release_resource = default_release_resource;
 
+    metric_latency = ccnet_metrics_histogram (
+        "ccnet_request_latency_seconds", NULL,
+        "Time from a request to its first response",
+        latency_bounds, G_N_ELEMENTS (latency_bounds));
+
     signals[DONE_SIG] = 
         g_signal_new ("done", CCNET_TYPE_PROCESSOR, 
                       G_SIGNAL_RUN_LAST,
@@ -58,7 +173,7 @@ ccnet_processor_class_init (CcnetProcessorClass *klass)
 static void
 ccnet_processor_init (CcnetProcessor *processor)
 {
-    
+    INIT_LIST_HEAD (&processor->wheel_list);
 }
 
 int ccnet_processor_start (CcnetProcessor *processor, int argc, char **argv)
@@ -86,8 +201,31 @@ int ccnet_processor_start (CcnetProcessor *processor, int argc, char **argv)
         return -1;
     }
 
-    return CCNET_PROCESSOR_GET_CLASS (processor)->start (
-        processor, argc, argv);
+    ccnet_proc_factory_watch_processor (processor->session->proc_factory,
+                                        processor);
+
+    CcnetProcessorClass *klass = CCNET_PROCESSOR_GET_CLASS (processor);
+    gint64 t_start = g_get_monotonic_time ();
+    /* The processor may be freed by start. */
+    char peer_id[CCNET_PEERID_LEN+1];
+    CcnetTraceContext saved;
+    int ret;
+
+    g_strlcpy (peer_id, processor->peer->id, sizeof(peer_id));
+
+    if (IS_SLAVE(processor))
+        processor->t_request = t_start;
+    get_class_stats (klass)->n_started++;
+
+    if (ccnet_trace_enabled) {
+        ccnet_trace_begin (processor, &saved);
+        ret = klass->start (processor, argc, argv);
+        ccnet_trace_set_current (&saved, NULL);
+    } else
+        ret = klass->start (processor, argc, argv);
+    ccnet_processor_class_account (klass, "start", peer_id,
+                                   g_get_monotonic_time () - t_start);
+    return ret;
 }
 
 int ccnet_processor_startl (CcnetProcessor *processor, ...)
@@ -161,6 +299,9 @@ void
 ccnet_processor_done (CcnetProcessor *processor, gboolean success)
 {
     if (processor->thread_running) {
+        /* Let the processor tell its thread to stop early. */
+        if (!processor->delay_shutdown)
+            CCNET_PROCESSOR_GET_CLASS (processor)->shutdown (processor);
         processor->delay_shutdown = TRUE;
         processor->was_success = success;
         return;
@@ -191,6 +332,8 @@ ccnet_processor_done (CcnetProcessor *processor, gboolean success)
      * twice. */
     g_signal_emit (processor, signals[DONE_SIG], 0, success);
 
+    ccnet_trace_end (processor, success);
+
     if (!processor->detached) {
         ccnet_peer_remove_processor (processor->peer, processor);
     }
@@ -213,9 +356,9 @@ ccnet_processor_error (CcnetProcessor *processor,
 
 static void ccnet_processor_keep_alive_response (CcnetProcessor *processor);
 
-void ccnet_processor_handle_update (CcnetProcessor *processor, 
-                                    char *code, char *code_msg,
-                                    char *content, int clen)
+static void
+handle_update (CcnetProcessor *processor,
+               char *code, char *code_msg, char *content, int clen)
 {
     if (code[0] == '5' || code[0] == '4') {
         ccnet_warning ("[Proc] Shutdown processor %s(%d) for bad update: %s %s\n",
@@ -285,10 +428,12 @@ void ccnet_processor_handle_update (CcnetProcessor *processor,
                                                               content, clen);
 }
 
-void ccnet_processor_handle_response (CcnetProcessor *processor, 
-                                      char *code, char *code_msg,
-                                      char *content, int clen)
+static void
+handle_response (CcnetProcessor *processor,
+                 char *code, char *code_msg, char *content, int clen)
 {
+    account_first_response (processor);
+
     if ((code[0] == '5' || code[0] == '4') &&
         !CCNET_IS_KEEPALIVE2_PROC(processor))
     {
@@ -345,18 +490,73 @@ void ccnet_processor_handle_response (CcnetProcessor *processor,
                                                                 content, clen);
 }
 
+/* Requests made by the handlers belong to the span of the processor. */
+void ccnet_processor_handle_update (CcnetProcessor *processor,
+                                    char *code, char *code_msg,
+                                    char *content, int clen)
+{
+    CcnetTraceContext saved;
+
+    if (!processor->trace_id) {
+        handle_update (processor, code, code_msg, content, clen);
+        return;
+    }
+    ccnet_trace_enter (processor, &saved);
+    handle_update (processor, code, code_msg, content, clen);
+    ccnet_trace_set_current (&saved, NULL);
+}
+
+void ccnet_processor_handle_response (CcnetProcessor *processor,
+                                      char *code, char *code_msg,
+                                      char *content, int clen)
+{
+    CcnetTraceContext saved;
+
+    if (!processor->trace_id) {
+        handle_response (processor, code, code_msg, content, clen);
+        return;
+    }
+    ccnet_trace_enter (processor, &saved);
+    handle_response (processor, code, code_msg, content, clen);
+    ccnet_trace_set_current (&saved, NULL);
+}
+
 void ccnet_processor_handle_sigchld (CcnetProcessor *processor, int status)
 {
     CCNET_PROCESSOR_GET_CLASS (processor)->handle_sigchld (processor, 
                                                            status);
 }
 
+void ccnet_processor_flow_control (CcnetProcessor *processor,
+                                   gboolean paused)
+{
+    if (CCNET_PROCESSOR_GET_CLASS (processor)->flow_control)
+        CCNET_PROCESSOR_GET_CLASS (processor)->flow_control (processor,
+                                                             paused);
+}
+
+/* Route the next packet to the control cork of the peer if the
+ * processor is a control one. */
+#define SET_SEND_CLASS(processor)                                       \
+    ((processor)->peer->send_control |=                                 \
+     CCNET_PROCESSOR_GET_CLASS (processor)->control)
+
 void
 ccnet_processor_send_request (CcnetProcessor *processor,
                               const char *request)
 {
+    const char *token = ccnet_trace_token (processor, processor->peer);
+    char *buf = NULL;
+
+    SET_SEND_CLASS (processor);
+    processor->t_request = g_get_monotonic_time ();
+    if (token)
+        request = buf = g_strconcat (token, request, NULL);
     ccnet_peer_send_request (processor->peer, REQUEST_ID (processor->id), 
                              request);
+    g_free (buf);
+    if (processor->no_cork)
+        ccnet_peer_flush (processor->peer);
 }
 
 void
@@ -364,8 +564,11 @@ ccnet_processor_send_request_l (CcnetProcessor *processor, ...)
 {
     va_list ap;
     GString *buf = g_string_new(NULL);
+    const char *token = ccnet_trace_token (processor, processor->peer);
     char *arg;
     
+    if (token)
+        g_string_append (buf, token);
     va_start (ap, processor);
     arg = va_arg (ap, char *);
     while (arg) {
@@ -374,8 +577,12 @@ ccnet_processor_send_request_l (CcnetProcessor *processor, ...)
     }
     va_end (ap);
 
+    processor->t_request = g_get_monotonic_time ();
+    SET_SEND_CLASS (processor);
     ccnet_peer_send_request (processor->peer,
                              REQUEST_ID (processor->id), buf->str); 
+    if (processor->no_cork)
+        ccnet_peer_flush (processor->peer);
     g_string_free (buf, TRUE);
 }
 
@@ -386,8 +593,11 @@ ccnet_processor_send_update (CcnetProcessor *processor,
                              const char *code_msg,
                              const char *content, int clen)
 {
+    SET_SEND_CLASS (processor);
     ccnet_peer_send_update (processor->peer, UPDATE_ID(processor->id),
                             code, code_msg, content, clen);
+    if (processor->no_cork)
+        ccnet_peer_flush (processor->peer);
 }
 
 void
@@ -395,8 +605,11 @@ ccnet_processor_send_error_update (CcnetProcessor *processor,
                                    const char *code,
                                    const char *code_msg)
 {
+    SET_SEND_CLASS (processor);
     ccnet_peer_send_update (processor->peer, UPDATE_ID(processor->id),
                             code, code_msg, NULL, 0);
+    if (processor->no_cork)
+        ccnet_peer_flush (processor->peer);
 }
 
 void
@@ -405,12 +618,18 @@ ccnet_processor_send_response (CcnetProcessor *processor,
                              const char *code_msg,
                              const char *content, int clen)
 {
+    account_first_response (processor);
+    SET_SEND_CLASS (processor);
     ccnet_peer_send_response (processor->peer, RESPONSE_ID (processor->id), 
                               code, code_msg, content, clen);
+    if (processor->no_cork)
+        ccnet_peer_flush (processor->peer);
 }
 
 void ccnet_processor_keep_alive (CcnetProcessor *processor)
 {
+    /* Answered in time only if it doesn't wait behind bulk data. */
+    processor->peer->send_control = 1;
     if (IS_SLAVE (processor))
         ccnet_processor_send_response (processor, SC_PROC_KEEPALIVE, 
                                        SS_PROC_KEEPALIVE, NULL, 0);
@@ -422,6 +641,7 @@ void ccnet_processor_keep_alive (CcnetProcessor *processor)
 
 static void ccnet_processor_keep_alive_response (CcnetProcessor *processor)
 {
+    processor->peer->send_control = 1;
     if (IS_SLAVE (processor))
         ccnet_processor_send_response (processor, SC_PROC_ALIVE, 
                                        SS_PROC_ALIVE, NULL, 0);
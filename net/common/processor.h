@@ -56,10 +56,35 @@ struct _CcnetProcessor {
 
     time_t                 start_time;    
 
-    /* Set to 1 if removed from peer->processors */
+    /* Monotonic time in usec when the request was sent (master) or
+     * received (slave). Cleared at the first response. */
+    gint64                 t_request;
+
+    /* The span of the processor if it is traced, see trace.h. */
+    guint64                trace_id;        /* 0 when not traced */
+    guint64                span_id;
+    guint64                parent_span;
+    gint64                 t_span_start;    /* wall clock usec */
+    gint64                 t_span_mono;
+    gint64                 t_span_first;    /* to the first response */
+
+    /* Set to 1 if removed from the peer processor table */
     unsigned int           detached  : 1;
 
+    /* Set to 1 to write packets out immediately, bypassing the
+     * peer's output cork. */
+    unsigned int           no_cork  : 1;
+
+    /* A service stub that may be reused, see service-stub-proc.c. */
+    unsigned int           pooled  : 1;
+
     struct list_head       list;
+    struct list_head       wheel_list;  /* in the factory's keepalive wheel */
+
+    /* Responses and updates for this processor are passed on to
+     * forward as they are, without being parsed, see forward_packet()
+     * in peer.c. Set for the service proxy and stub pair. */
+    struct _CcnetProcessor *forward;
 
     /* last time when a packet received  */
     time_t                 t_packet_recv;
@@ -112,6 +137,14 @@ struct _CcnetProcessorClass {
 
     char          *name;
 
+    /* Set if release_resource() leaves the instance as new, so that
+     * the factory may hand it out again instead of finalizing it. */
+    gboolean       reusable;
+
+    /* Set for the keepalives and session setup, whose packets are
+     * written ahead of the bulk data queued for the peer. */
+    gboolean       control;
+
     /* pure virtual function */
     int       (*start)           (CcnetProcessor *processor, 
                                   int argc, char **argv);
@@ -127,6 +160,11 @@ struct _CcnetProcessorClass {
 
     void      (*shutdown)        (CcnetProcessor *processor);
 
+    /* Called with paused == TRUE when the output to the peer is
+     * congested, and with FALSE once it has drained. Optional. */
+    void      (*flow_control)    (CcnetProcessor *processor,
+                                  gboolean paused);
+
     void      (*release_resource) (CcnetProcessor *processor);
 
 };
@@ -152,6 +190,9 @@ void ccnet_processor_handle_response (CcnetProcessor *processor,
 void ccnet_processor_handle_sigchld (CcnetProcessor *processor,
                                      int status);
 
+void ccnet_processor_flow_control (CcnetProcessor *processor,
+                                   gboolean paused);
+
 void ccnet_processor_error (CcnetProcessor *processor,
                             const char *error_code,
                             const char *error_string);
@@ -179,6 +220,16 @@ void ccnet_processor_send_response(CcnetProcessor *processor,
 
 void ccnet_processor_keep_alive (CcnetProcessor *processor);
 
+/* Add @usec spent in the @what handler of @klass to its statistics,
+ * and report it if the handler was slow. */
+void ccnet_processor_class_account (CcnetProcessorClass *klass,
+                                    const char *what, const char *peer_id,
+                                    gint64 usec);
+
+/* A line for each processor class with its handler time and the
+ * request to first response latency histogram. */
+char *ccnet_processor_get_class_stats (void);
+
 /*
   The thread func should return the result back by
      return (void *)result;
@@ -45,6 +45,7 @@ ccnet_echo_proc_class_init (CcnetEchoProcClass *klass)
     CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
 
     proc_class->name = "echo-proc";
+    proc_class->reusable = TRUE;
     proc_class->start = echo_start;
     proc_class->handle_response = handle_response;
     proc_class->shutdown = echo_shutdown;
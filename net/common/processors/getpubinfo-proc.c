@@ -29,6 +29,7 @@ ccnet_getpubinfo_proc_class_init (CcnetGetpubinfoProcClass *klass)
     /* GObjectClass *gobject_class = G_OBJECT_CLASS (klass); */
 
     proc_class->name = "getpubinfo-proc";
+    proc_class->reusable = TRUE;
     proc_class->start = get_pubinfo_start;
     proc_class->handle_response = handle_response;
 }
@@ -170,6 +170,7 @@ ccnet_keepalive_proc_class_init (CcnetKeepaliveProcClass *klass)
     CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
 
     proc_class->name = "keepalive-proc";
+    proc_class->control = TRUE;
     proc_class->start = keepalive_start;
     proc_class->handle_response = handle_response;
     proc_class->handle_update = handle_update;
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <openssl/rand.h>
+#include <openssl/crypto.h>
 
 
 #include "keepalive2-proc.h"
@@ -12,6 +13,9 @@
 #include "peer.h"
 #include "session.h"
 #include "peer-mgr.h"
+#ifdef CCNET_CLUSTER
+#include "peer-dir.h"
+#endif
 
 #include "processor.h"
 #include "proc-factory.h"
@@ -25,14 +29,16 @@
 #define DEBUG_FLAG CCNET_DEBUG_CONNECTION
 #include "log.h"
 
-/* Since we use only tcp, packet should not be lost,
-   set a large time (3min). */
-#define KEEPALIVE_INTERVAL                180000 /* 3min */
+/* Since we use only tcp, packet should not be lost, so the interval
+   is large (3min by default, see
+   ccnet_peer_manager_get_keepalive_interval()). Timeouts of all peers
+   are driven by the peer manager's keepalive wheel. */
 
 enum {
     INIT,
     WAIT_PUBKEY,
     WAIT_CHALLENGE,
+    WAIT_RESUME,
     WAIT_KEEPALIVE,
     FULL
 };
@@ -55,6 +61,14 @@ enum {
  WAIT_CHALLENGE ----------------->
                <-----------------
 
+  If the OK carries "resume", the slave still holds a resume secret for
+  us from the last connection, and the RSA challenge is replaced by
+
+                  312 nonce
+  WAIT_RESUME   ----------------->
+               <-----------------
+                  312 HMAC(secret, nonce)  Or  313 (fall back to 311)
+
   
                   300  <msg>
  WAIT_KEEPALIVE -----------------> 
@@ -71,6 +85,9 @@ enum {
      FULL (keepalive interval)
 
      ....
+
+  No keepalive is sent if a packet came from the peer during the last
+  interval, the connection is known to be alive then.
  */
 
 
@@ -80,13 +97,24 @@ enum {
 #define SS_BAD_CHALLENGE "Bad challenge format"
 #define SC_DECRYPT_ERROR "412"
 #define SS_DECRYPT_ERROR "Decrypt error"
+#define SC_RESUME "312"
+#define SC_NO_RESUME "313"
+#define SS_NO_RESUME "Can not resume"
+#define SS_OK_RESUME "OK resume"
+
+#define RESUME_LABEL "keepalive"
+
+#define RELAY_PROBE_SECS  60    /* longest a relay goes without a sample */
 
 
 typedef struct  {
     unsigned char random_buf[40];
     int count;
+    time_t deadline;            /* of the current state */
 } CcnetKeepalive2ProcPriv;
 
+#define RESUME_NONCE_LEN 20
+
 extern CcnetSession *session;
 
 #define GET_PRIV(o)  \
@@ -126,6 +154,7 @@ static void proc_shutdown (CcnetProcessor *processor)
 static void
 release_resource(CcnetProcessor *processor)
 {
+    ccnet_peer_manager_cancel_keepalive (processor->peer->manager, processor);
     processor->peer->keepalive_sending = 0;
     
     /* should always chain up */
@@ -138,6 +167,7 @@ ccnet_keepalive2_proc_class_init (CcnetKeepalive2ProcClass *klass)
     CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
 
     proc_class->name = "keepalive2-proc";
+    proc_class->control = TRUE;
     proc_class->start = keepalive2_start;
     proc_class->handle_response = handle_response;
     proc_class->handle_update = handle_update;
@@ -161,6 +191,9 @@ static void send_keepalive(CcnetProcessor *processor)
     sprintf(cntstr, "%d", priv->count++);
     ccnet_processor_send_update (processor, "300", cntstr,
                                  NULL, 0);
+    /* timed until the response, one at a time */
+    if (!processor->peer->rtt_sent)
+        processor->peer->rtt_sent = g_get_monotonic_time ();
     /* ccnet_debug ("[Keepalive] Send keepavlie to peer %.8s #%s\n", */
     /*              processor->peer->id, cntstr->str); */
 
@@ -186,44 +219,105 @@ static void close_processor_in_timeout(CcnetProcessor *processor)
     peer->num_fails++;
 }
 
-static int timeout_cb(CcnetProcessor *processor)
+static void set_deadline(CcnetProcessor *processor, time_t deadline)
 {
-    if (processor->state == FULL) {
-        send_keepalive(processor);
-        return TRUE;
-    }
+    USE_PRIV;
 
-    close_processor_in_timeout(processor);
-    return FALSE;
+    priv->deadline = deadline;
+    ccnet_peer_manager_schedule_keepalive (processor->peer->manager,
+                                           processor, deadline);
 }
 
 static void reset_timeout(CcnetProcessor *processor)
 {
-    if (processor->retry_timer)
-        ccnet_timer_free(&processor->retry_timer);
-    processor->retry_timer = ccnet_timer_new ((TimerCB)timeout_cb, processor,
-                                             KEEPALIVE_INTERVAL);
+    int interval = ccnet_peer_manager_get_keepalive_interval (
+        processor->peer->manager, processor->peer);
+
+    set_deadline (processor, time(NULL) + interval);
+}
+
+void
+ccnet_keepalive2_proc_check (CcnetProcessor *processor, time_t now)
+{
+    USE_PRIV;
+    CcnetPeer *peer = processor->peer;
+    int interval;
+
+    if (priv->deadline > now) {
+        set_deadline (processor, priv->deadline);
+        return;
+    }
+
+    if (processor->state != FULL) {
+        close_processor_in_timeout(processor);
+        return;
+    }
+
+    interval = ccnet_peer_manager_get_keepalive_interval (peer->manager, peer);
+#ifndef CCNET_SERVER
+    /* Relays are ranked by round trip, so they get a keepalive now and
+     * then even when busy, to keep the samples fresh. */
+    if (ccnet_peer_has_role (peer, "MyRelay")) {
+        if (now - peer->rtt_time >= RELAY_PROBE_SECS) {
+            send_keepalive(processor);
+            set_deadline (processor, now + MIN (interval, RELAY_PROBE_SECS));
+            return;
+        }
+        interval = MIN (interval, RELAY_PROBE_SECS);
+        if (peer->last_recv + interval > now) {
+            set_deadline (processor,
+                          MIN (peer->last_recv + interval,
+                               peer->rtt_time + RELAY_PROBE_SECS));
+            return;
+        }
+    }
+#endif
+    if (peer->last_recv + interval > now) {
+        set_deadline (processor, peer->last_recv + interval);
+        return;
+    }
+
+    send_keepalive(processor);
+    set_deadline (processor, now + interval);
 }
 
 static void close_processor(CcnetProcessor *processor)
 {
     CcnetPeer *peer = processor->peer;
 
-    ccnet_timer_free (&processor->retry_timer);
+    ccnet_peer_manager_cancel_keepalive (peer->manager, processor);
     ccnet_processor_done (processor, FALSE);
     ccnet_peer_shutdown (peer);
     peer->num_fails++;
 }
 
 
+/* Set while ccnet_keepalive2_proc_adopt() starts the processors. */
+static gboolean adopting;
+static int adopt_count;
+
 static int keepalive2_start (CcnetProcessor *processor, 
                             int argc, char **argv)
 {
     CcnetKeepalive2ProcPriv *priv = GET_PRIV (processor);
 
+    if (adopting) {
+        /* The old process has verified the peer, nothing to send. */
+        if (IS_SLAVE(processor))
+            return 0;
+        priv->count = adopt_count;
+        processor->state = FULL;
+        processor->peer->keepalive_sending = 1;
+        reset_timeout (processor);
+        return 0;
+    }
+
     if (IS_SLAVE(processor)) {
-        ccnet_processor_send_response (processor, 
-                                       SC_OK, SS_OK, NULL, 0);
+        /* old masters ignore the reason */
+        ccnet_processor_send_response (
+            processor, SC_OK,
+            ccnet_peer_can_resume (processor->peer) ? SS_OK_RESUME : SS_OK,
+            NULL, 0);
         return 0;
     }
 
@@ -277,11 +371,19 @@ static void verify_challenge(CcnetProcessor *processor,
                              char *code, char *code_msg,
                              char *content, int clen);
 
+static void verify_resume(CcnetProcessor *processor, 
+                          char *code, char *code_msg,
+                          char *content, int clen);
+
+static void on_peer_verified (CcnetProcessor *processor);
+
 static struct Handler rsp_handler_tab[] = {
     { "200", recv_ok }, 
     { "300", recv_keepalive_rsp },
     { "310", recv_pubkey },
     { "311", verify_challenge },
+    { SC_RESUME, verify_resume },
+    { SC_NO_RESUME, verify_resume },
     { 0 },
 };
 
@@ -332,6 +434,37 @@ static void get_pubkey(CcnetProcessor *processor)
     reset_timeout(processor);
 }
 
+static void send_resume(CcnetProcessor *processor)
+{
+    USE_PRIV;
+
+    ccnet_debug ("[Keepalive] Resume session with %s(%.8s)\n",
+                 processor->peer->name, processor->peer->id);
+
+    RAND_pseudo_bytes (priv->random_buf, RESUME_NONCE_LEN);
+    ccnet_processor_send_update (processor, SC_RESUME, NULL,
+                                 (char *)priv->random_buf, RESUME_NONCE_LEN);
+    processor->state = WAIT_RESUME;
+    reset_timeout (processor);
+}
+
+static void start_auth(CcnetProcessor *processor)
+{
+#ifdef CCNET_CLUSTER
+    /* Another session of this process may know the peer. The challenge
+     * below still checks that it holds the key. */
+    if (!processor->peer->pubkey)
+        ccnet_peer_dir_fill (processor->peer);
+#endif
+    if (processor->peer->pubkey) {
+        ccnet_debug ("[Keepalive] Send challenge\n");
+        send_challenge(processor);
+    } else {
+        ccnet_debug ("[Keepalive] Get pubkey\n");
+        get_pubkey(processor);
+    }
+}
+
 static void recv_ok(CcnetProcessor *processor, 
                     char *code, char *code_msg,
                     char *content, int clen)
@@ -340,14 +473,20 @@ static void recv_ok(CcnetProcessor *processor,
         close_processor(processor);
         return;
     }
-    
-    if (processor->peer->pubkey) {
-        ccnet_debug ("[Keepalive] Receive ok, send challenge\n");
-        send_challenge(processor);
-    } else {
-        ccnet_debug ("[Keepalive] Receive ok, get pubkey\n");
-        get_pubkey(processor);
+
+    /* The handshake has already checked the peer and agreed on a key. */
+    if (processor->peer->fast_verified) {
+        on_peer_verified (processor);
+        return;
+    }
+
+    if (g_strcmp0 (code_msg, SS_OK_RESUME) == 0 &&
+        ccnet_peer_can_resume (processor->peer)) {
+        send_resume (processor);
+        return;
     }
+
+    start_auth (processor);
 }
 
 static void recv_pubkey(CcnetProcessor *processor, 
@@ -381,9 +520,16 @@ static void recv_keepalive_rsp(CcnetProcessor *processor,
                                char *code, char *code_msg,
                                char *content, int clen)
 {
+    CcnetPeer *peer = processor->peer;
+
     /* ccnet_debug ("[Keepalive] Receive keepalive responese from peer %.8s #%s\n", */
     /*              processor->peer->id, code_msg); */
     processor->state = FULL;
+    if (peer->rtt_sent) {
+        ccnet_peer_update_rtt (
+            peer, (g_get_monotonic_time () - peer->rtt_sent) / 1000);
+        peer->rtt_sent = 0;
+    }
 }
 
 static void on_send_skey_done (CcnetProcessor *processor,
@@ -447,19 +593,56 @@ static void verify_challenge(CcnetProcessor *processor,
 {
     CcnetKeepalive2ProcPriv *priv = GET_PRIV (processor);
 
-    if (clen != 40 || memcmp(content, priv->random_buf, 40) != 0) {
+    if (processor->state != WAIT_CHALLENGE ||
+        clen != 40 || memcmp(content, priv->random_buf, 40) != 0) {
         ccnet_debug ("[Conn] Peer Challenge failed\n");
         close_processor(processor);
         return;
     }
 
     ccnet_debug ("[Keepalive] Verify Peer Challenge\n");
+    on_peer_verified (processor);
+}
+
+static void verify_resume(CcnetProcessor *processor, 
+                          char *code, char *code_msg,
+                          char *content, int clen)
+{
+    USE_PRIV;
+    unsigned char mac[CCNET_RESUME_SECRET_LEN];
+
+    if (processor->state != WAIT_RESUME) {
+        close_processor(processor);
+        return;
+    }
+
+    if (strcmp (code, SC_RESUME) == 0 && clen == CCNET_RESUME_SECRET_LEN &&
+        ccnet_peer_can_resume (processor->peer)) {
+        ccnet_peer_resume_mac (processor->peer, RESUME_LABEL,
+                               priv->random_buf, RESUME_NONCE_LEN, mac);
+        if (CRYPTO_memcmp (mac, content, CCNET_RESUME_SECRET_LEN) == 0) {
+            ccnet_debug ("[Keepalive] Resumed session with %.8s\n",
+                         processor->peer->id);
+            on_peer_verified (processor);
+            return;
+        }
+    }
 
+    /* The secrets don't match, don't try them again. */
+    ccnet_debug ("[Keepalive] Can't resume session with %.8s\n",
+                 processor->peer->id);
+    ccnet_peer_clear_resume_secret (processor->peer);
+    start_auth (processor);
+}
+
+static void on_peer_verified (CcnetProcessor *processor)
+{
     get_peer_pubinfo (processor->peer);
     /* ccnet_peer_manager_notify_peer_role (processor->peer->manager,  */
     /*                                      processor->peer); */
 
-    if (strcmp(session->base.id, processor->peer->id) < 0)
+    if (!processor->peer->session_key &&
+        strcmp(session->base.id, processor->peer->id) < 0)
         send_session_key (processor->peer);
         
     send_keepalive (processor);
@@ -504,11 +687,16 @@ static void response_challenge(CcnetProcessor *processor,
                                char *code, char *code_msg,
                                char *content, int clen);
 
+static void response_resume(CcnetProcessor *processor, 
+                            char *code, char *code_msg,
+                            char *content, int clen);
+
 
 static struct Handler update_handler_tab[] = {
     { "300", receive_keepalive },
     { "310", send_pubkey },
     { "311", response_challenge },
+    { SC_RESUME, response_resume },
     { 0 },
 };
 
@@ -535,6 +723,48 @@ static void handle_update (CcnetProcessor *processor,
     handler->handler(processor, code, code_msg, content, clen);
 }
 
+int
+ccnet_keepalive2_proc_export (CcnetProcessor *processor, int *count)
+{
+    USE_PRIV;
+
+    if (IS_SLAVE(processor))
+        return 0;
+
+    /* A keepalive in flight is answered to the new process. */
+    if (processor->state != FULL && processor->state != WAIT_KEEPALIVE)
+        return -1;
+    *count = priv->count;
+    return 0;
+}
+
+int
+ccnet_keepalive2_proc_adopt (CcnetPeer *peer, unsigned int master_id,
+                             int count, unsigned int slave_id)
+{
+    CcnetProcFactory *factory = peer->manager->session->proc_factory;
+    CcnetProcessor *processor;
+    int ret = 0;
+
+    adopting = TRUE;
+    adopt_count = count;
+
+    processor = ccnet_proc_factory_create_processor_with_id (
+        factory, "keepalive2", peer, master_id);
+    if (!processor || ccnet_processor_startl (processor, NULL) < 0)
+        ret = -1;
+
+    if (ret == 0 && slave_id) {
+        processor = ccnet_proc_factory_create_processor_with_id (
+            factory, "keepalive2", peer, slave_id);
+        if (!processor || ccnet_processor_startl (processor, NULL) < 0)
+            ret = -1;
+    }
+
+    adopting = FALSE;
+    return ret;
+}
+
 static void get_peer_pubinfo (CcnetPeer *peer)
 {
     CcnetProcessor *newp;
@@ -598,3 +828,21 @@ static void response_challenge(CcnetProcessor *processor,
             processor, code, "", (char *)buf, decrypt_len);
     g_free(buf);
 }
+
+static void response_resume(CcnetProcessor *processor, 
+                            char *code, char *code_msg,
+                            char *content, int clen)
+{
+    unsigned char mac[CCNET_RESUME_SECRET_LEN];
+
+    if (clen != RESUME_NONCE_LEN || !ccnet_peer_can_resume (processor->peer)) {
+        ccnet_processor_send_response (
+            processor, SC_NO_RESUME, SS_NO_RESUME, NULL, 0);
+        return;
+    }
+
+    ccnet_peer_resume_mac (processor->peer, RESUME_LABEL,
+                           (unsigned char *)content, clen, mac);
+    ccnet_processor_send_response (processor, SC_RESUME, "",
+                                   (char *)mac, CCNET_RESUME_SECRET_LEN);
+}
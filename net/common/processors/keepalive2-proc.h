@@ -26,4 +26,20 @@ struct _CcnetKeepalive2ProcClass {
 
 GType ccnet_keepalive2_proc_get_type ();
 
+/* Called from the peer manager's keepalive wheel. */
+void ccnet_keepalive2_proc_check (CcnetProcessor *processor, time_t now);
+
+/*
+ * Handing a connection over to another process, see handover.h.
+ * export() returns -1 while the master is still verifying the peer,
+ * adopt() recreates both processors, already verified, with the ids
+ * they had in the old process. @slave_id may be 0.
+ */
+int ccnet_keepalive2_proc_export (CcnetProcessor *processor, int *count);
+
+struct _CcnetPeer;
+int ccnet_keepalive2_proc_adopt (struct _CcnetPeer *peer,
+                                 unsigned int master_id, int count,
+                                 unsigned int slave_id);
+
 #endif
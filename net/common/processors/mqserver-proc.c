@@ -8,21 +8,61 @@
 #include "message-manager.h"
 #include "mqserver-proc.h"
 #include "algorithms.h"
+#include "mq-filter.h"
+#include "timer.h"
 
 #define DEBUG_FLAG CCNET_DEBUG_MESSAGE
 #include "log.h"
 
 #define SC_MSG "300"
+#define SC_MSG_BATCH "303"
+#define SC_BAD_FILTER "400"
+#define SS_BAD_FILTER "Bad filter"
+
+/* A subscriber started with --batch gets the messages of one loop
+ * iteration in one SC_MSG_BATCH response, each NUL terminated. */
+#define MSG_BATCH_MAX 64
+#define MSG_BATCH_MAX_LEN (CCNET_PACKET_MAX_PAYLOAD_LEN / 2)
 
 enum {
     INIT,
     READY
 };
 
+/*
+ * Messages go straight to the client while its connection keeps up.
+ * Once the output is congested they are held in a queue bounded by
+ * [Message] QUEUE_DEPTH: the oldest message is dropped when it is full,
+ * and for apps listed in [Message] COALESCE_APPS a new message replaces
+ * a queued one with the same key (the app and the first word of the
+ * body). The queue is drained when the connection comes back under its
+ * low watermark.
+ */
+typedef struct {
+    CcnetSharedPacket *packet;
+    char              *key;     /* set for coalesced apps */
+} QueuedMessage;
+
 typedef struct {
     int n_app;
     char **apps;
     int subscribed : 1;
+
+    GQueue     *queue;
+    GHashTable *keyed;          /* key -> link in queue */
+    int         depth;
+    gsize       queued_bytes;
+    guint       n_dropped;
+    guint       n_coalesced;
+
+    /* set by the subscriber with SC_FILTER */
+    CcnetMqFilter *filter;
+    guint       n_filtered;
+
+    int         batch : 1;
+    GString    *batch_buf;
+    int         n_batched;
+    CcnetTimer *flush_timer;
 } MqserverProcPriv;
 
 #define GET_PRIV(o)  \
@@ -33,6 +73,7 @@ static int mq_server_start (CcnetProcessor *processor, int argc, char **argv);
 static void handle_update (CcnetProcessor *processor,
                            char *code, char *code_msg,
                            char *content, int clen);
+static void flow_control (CcnetProcessor *processor, gboolean paused);
 
 G_DEFINE_TYPE (CcnetMqserverProc, ccnet_mqserver_proc, CCNET_TYPE_PROCESSOR)
 
@@ -57,6 +98,14 @@ static void unsubscribe_message (CcnetProcessor *processor)
                                                priv->n_app, priv->apps);    
 }
 
+static void
+free_queued_message (QueuedMessage *qm)
+{
+    ccnet_shared_packet_unref (qm->packet);
+    g_free (qm->key);
+    g_free (qm);
+}
+
 static void release_resource (CcnetProcessor *processor)
 {
     int i;
@@ -68,6 +117,26 @@ static void release_resource (CcnetProcessor *processor)
         g_free (priv->apps[i]);
     g_free (priv->apps);
 
+    if (priv->n_dropped || priv->n_coalesced)
+        ccnet_message ("Subscriber %d dropped %u and coalesced %u messages\n",
+                       PRINT_ID(processor->id),
+                       priv->n_dropped, priv->n_coalesced);
+    if (priv->n_filtered)
+        ccnet_debug ("Subscriber %d filtered out %u messages\n",
+                     PRINT_ID(processor->id), priv->n_filtered);
+
+    ccnet_mq_filter_free (priv->filter);
+    if (priv->flush_timer)
+        ccnet_timer_free (&priv->flush_timer);
+    if (priv->batch_buf)
+        g_string_free (priv->batch_buf, TRUE);
+
+    if (priv->queue) {
+        g_queue_foreach (priv->queue, (GFunc)free_queued_message, NULL);
+        g_queue_free (priv->queue);
+        g_hash_table_destroy (priv->keyed);
+    }
+
     memset (priv, 0, sizeof(MqserverProcPriv));
 
     CCNET_PROCESSOR_CLASS(ccnet_mqserver_proc_parent_class)->release_resource(processor);
@@ -84,6 +153,7 @@ ccnet_mqserver_proc_class_init (CcnetMqserverProcClass *klass)
     proc_class->name = "mqserver-proc";
     proc_class->start = mq_server_start;
     proc_class->handle_update = handle_update;
+    proc_class->flow_control = flow_control;
     proc_class->release_resource = release_resource;
 
     g_type_class_add_private (klass, sizeof (MqserverProcPriv));
@@ -101,42 +171,299 @@ mq_server_start (CcnetProcessor *processor, int argc, char **argv)
     MqserverProcPriv *priv = GET_PRIV (processor);
     int i;
 
-    priv->n_app = argc;
     priv->apps = g_new (char*, argc);
-    for (i = 0; i < argc; ++i)
-        priv->apps[i] = g_strdup (argv[i]);
+    for (i = 0; i < argc; ++i) {
+        if (strcmp (argv[i], "--batch") == 0) {
+            priv->batch = 1;
+            continue;
+        }
+        priv->apps[priv->n_app++] = g_strdup (argv[i]);
+    }
+    if (priv->batch)
+        priv->batch_buf = g_string_new (NULL);
+
+    priv->queue = g_queue_new ();
+    priv->keyed = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         NULL, NULL);
+    priv->depth = ccnet_message_manager_get_queue_depth (
+        processor->session->msg_mgr);
 
     subscribe_message (processor);
 
-    ccnet_processor_send_response (processor, "200", "OK", NULL, 0);
+    /* Tells the client it may send batches as well. */
+    ccnet_processor_send_response (processor, "200",
+                                   priv->batch ? "OK batch" : "OK", NULL, 0);
     return 0;
 }
 
-static void send_message (CcnetProcessor *processor, CcnetMessage *message)
+CcnetSharedPacket *
+ccnet_mqserver_proc_encode_message (const CcnetMessageView *message)
 {
     GString *buf = g_string_new (NULL);
+    CcnetSharedPacket *packet;
 
-    ccnet_message_to_string_buf_local (message, buf);
-    ccnet_processor_send_response (processor, SC_MSG, NULL,
-                                   buf->str, buf->len+1);
+    ccnet_message_view_to_string_buf_local (message, buf);
+    packet = ccnet_shared_packet_new (CCNET_MSG_RESPONSE, SC_MSG, NULL,
+                                      buf->str, buf->len+1);
     g_string_free (buf, TRUE);
+
+    return packet;
+}
+
+static void
+send_packet (CcnetProcessor *processor, CcnetSharedPacket *packet)
+{
+    ccnet_peer_send_shared_packet (processor->peer,
+                                   RESPONSE_ID (processor->id), packet);
+    if (processor->no_cork)
+        ccnet_peer_flush (processor->peer);
+}
+
+static void
+flush_batch (CcnetProcessor *processor)
+{
+    MqserverProcPriv *priv = GET_PRIV (processor);
+
+    if (priv->n_batched == 0)
+        return;
+
+    ccnet_processor_send_response (processor, SC_MSG_BATCH, NULL,
+                                   priv->batch_buf->str, priv->batch_buf->len);
+    g_string_truncate (priv->batch_buf, 0);
+    priv->n_batched = 0;
+}
+
+static int
+flush_batch_cb (void *vprocessor)
+{
+    CcnetProcessor *processor = vprocessor;
+
+    GET_PRIV (processor)->flush_timer = NULL;
+    flush_batch (processor);
+    return FALSE;
+}
+
+static void
+batch_packet (CcnetProcessor *processor, CcnetSharedPacket *packet)
+{
+    MqserverProcPriv *priv = GET_PRIV (processor);
+    const char *content;
+    int clen;
+
+    content = ccnet_shared_packet_get_content (packet, &clen);
+    if (priv->batch_buf->len + clen > MSG_BATCH_MAX_LEN)
+        flush_batch (processor);
+    if (clen > MSG_BATCH_MAX_LEN) {
+        send_packet (processor, packet);
+        return;
+    }
+
+    g_string_append_len (priv->batch_buf, content, clen);
+    if (++priv->n_batched >= MSG_BATCH_MAX) {
+        flush_batch (processor);
+        return;
+    }
+
+    if (!priv->flush_timer)
+        priv->flush_timer = ccnet_timer_new (flush_batch_cb, processor, 0);
+}
+
+static void
+deliver_packet (CcnetProcessor *processor, CcnetSharedPacket *packet)
+{
+    if (GET_PRIV (processor)->batch)
+        batch_packet (processor, packet);
+    else
+        send_packet (processor, packet);
+}
+
+static char *
+coalesce_key (const CcnetMessageView *message)
+{
+    const char *body = message->body ? message->body : "";
+    int n = strcspn (body, " \t\n");
+
+    return g_strdup_printf ("%s %.*s", message->app, n, body);
+}
+
+static void
+drop_oldest (MqserverProcPriv *priv)
+{
+    QueuedMessage *qm = g_queue_pop_head (priv->queue);
+
+    if (qm->key)
+        g_hash_table_remove (priv->keyed, qm->key);
+    priv->queued_bytes -= qm->packet->len;
+    free_queued_message (qm);
+
+    if (priv->n_dropped++ == 0)
+        ccnet_warning ("Subscriber is too slow, dropping messages\n");
+}
+
+static void
+queue_packet (CcnetProcessor *processor, const CcnetMessageView *message,
+              CcnetSharedPacket *packet)
+{
+    MqserverProcPriv *priv = GET_PRIV (processor);
+    CcnetMessageManager *msg_mgr = processor->session->msg_mgr;
+    QueuedMessage *qm;
+    GList *link;
+    char *key = NULL;
+
+    if (ccnet_message_manager_get_queue_policy (msg_mgr, message->app)
+        == MQ_POLICY_COALESCE) {
+        key = coalesce_key (message);
+        link = g_hash_table_lookup (priv->keyed, key);
+        if (link) {
+            qm = link->data;
+            priv->queued_bytes += packet->len - qm->packet->len;
+            ccnet_shared_packet_unref (qm->packet);
+            ccnet_shared_packet_ref (packet);
+            qm->packet = packet;
+            ++priv->n_coalesced;
+            g_free (key);
+            return;
+        }
+    }
+
+    if (g_queue_get_length (priv->queue) >= priv->depth)
+        drop_oldest (priv);
+
+    qm = g_new0 (QueuedMessage, 1);
+    ccnet_shared_packet_ref (packet);
+    qm->packet = packet;
+    priv->queued_bytes += packet->len;
+    qm->key = key;
+    g_queue_push_tail (priv->queue, qm);
+    if (key)
+        g_hash_table_insert (priv->keyed, key, priv->queue->tail);
+}
+
+static void
+drain_queue (CcnetProcessor *processor)
+{
+    MqserverProcPriv *priv = GET_PRIV (processor);
+    QueuedMessage *qm;
+
+    while (!g_queue_is_empty (priv->queue) &&
+           !ccnet_peer_is_congested (processor->peer)) {
+        qm = g_queue_pop_head (priv->queue);
+        if (qm->key)
+            g_hash_table_remove (priv->keyed, qm->key);
+        priv->queued_bytes -= qm->packet->len;
+        deliver_packet (processor, qm->packet);
+        free_queued_message (qm);
+    }
+    flush_batch (processor);
+}
+
+static void
+flow_control (CcnetProcessor *processor, gboolean paused)
+{
+    if (!paused)
+        drain_queue (processor);
+}
+
+void
+ccnet_mqserver_proc_put_packet (CcnetProcessor *processor,
+                                const CcnetMessageView *message,
+                                CcnetSharedPacket *packet)
+{
+    MqserverProcPriv *priv = GET_PRIV (processor);
+
+    if (!priv->queue)
+        return;
+
+    if (priv->filter &&
+        !ccnet_mq_filter_match (priv->filter, message->from, message->to,
+                                message->app, message->body)) {
+        ++priv->n_filtered;
+        return;
+    }
+
+    if (g_queue_is_empty (priv->queue) &&
+        !ccnet_peer_is_congested (processor->peer)) {
+        deliver_packet (processor, packet);
+        return;
+    }
+
+    queue_packet (processor, message, packet);
+}
+
+gsize
+ccnet_mqserver_proc_get_queued_bytes (CcnetProcessor *processor)
+{
+    MqserverProcPriv *priv = GET_PRIV (processor);
+    gsize n = priv->queued_bytes;
+
+    if (priv->queue)
+        n += g_queue_get_length (priv->queue) * (sizeof(QueuedMessage) +
+                                                 sizeof(GList));
+    if (priv->batch_buf)
+        n += priv->batch_buf->allocated_len;
+    return n;
 }
 
 void
 ccnet_mqserver_proc_put_message (CcnetProcessor *processor,
                                  CcnetMessage *message)
 {
-    send_message (processor, message);
+    CcnetSharedPacket *packet;
+    CcnetMessageView view;
+
+    ccnet_message_view_init (&view, message);
+    packet = ccnet_mqserver_proc_encode_message (&view);
+    if (!packet)
+        return;
+    ccnet_mqserver_proc_put_packet (processor, &view, packet);
+    ccnet_shared_packet_unref (packet);
 }
 
 
+static void
+send_message_batch (CcnetProcessor *processor, char *content, int clen)
+{
+    CcnetMessageView view;
+    char *p = content, *end = content + clen, *next;
+
+    while (p < end) {
+        next = memchr (p, '\0', end - p);
+        if (!next) {
+            ccnet_warning ("received bad message batch from local client\n");
+            return;
+        }
+        ++next;
+        if (ccnet_message_view_parse (&view, p, next - p, TRUE) < 0)
+            ccnet_warning ("received bad message from local client\n");
+        else
+            ccnet_send_message_view (processor->session, &view);
+        p = next;
+    }
+}
+
+static int
+set_filter (CcnetProcessor *processor, char *content, int clen)
+{
+    MqserverProcPriv *priv = GET_PRIV (processor);
+    CcnetMqFilter *filter = NULL;
+
+    if (clen > 0) {
+        if (content[clen-1] != '\0')
+            return -1;
+        filter = ccnet_mq_filter_new (content);
+        if (!filter)
+            return -1;
+    }
+
+    ccnet_mq_filter_free (priv->filter);
+    priv->filter = filter;
+    return 0;
+}
+
 static void handle_update (CcnetProcessor *processor,
                            char *code, char *code_msg,
                            char *content, int clen)
 {
-    /* MqserverProcPriv *priv = GET_PRIV (processor); */
-    /* CcnetMessageManager *msg_mgr = processor->session->messageMgr; */
-
     if (code[0] != '3') {
         ccnet_warning ("received bad update: %s %s", code, code_msg);
         return;
@@ -144,17 +471,31 @@ static void handle_update (CcnetProcessor *processor,
 
     if (code[2] == '0') {
         /* SC_MSG */
-        CcnetMessage *msg;
-        msg = ccnet_message_from_string_local (content, clen);
+        CcnetMessageView view;
+
+        if (ccnet_message_view_parse (&view, content, clen, TRUE) < 0) {
+            ccnet_warning ("received bad message from local client\n");
+            ccnet_processor_send_response (processor, "200", "OK", NULL, 0);
+            return;
+        }
 
-        /* ccnet_debug ("[msg] send msg: %.10s\n", msg->body); */
+        /* ccnet_debug ("[msg] send msg: %.10s\n", view.body); */
 
-        ccnet_send_message (processor->session, msg);
-        ccnet_message_unref (msg);
+        ccnet_send_message_view (processor->session, &view);
     } else if (code[2] == '1') {
         /* SC_UNSUBSCRIBE */
         ccnet_processor_done (processor, TRUE);
         return;
+    } else if (code[2] == '2') {
+        /* SC_FILTER, an empty one removes the filter */
+        if (set_filter (processor, content, clen) < 0) {
+            ccnet_processor_send_response (processor, SC_BAD_FILTER,
+                                           SS_BAD_FILTER, NULL, 0);
+            return;
+        }
+    } else if (code[2] == '3') {
+        /* SC_MSG_BATCH */
+        send_message_batch (processor, content, clen);
     }
 
     ccnet_processor_send_response (processor, "200", "OK", NULL, 0);
@@ -7,6 +7,7 @@
 
 #include "processor.h"
 #include "message.h"
+#include "peer.h"
 
 #define CCNET_TYPE_MQSERVER_PROC                  (ccnet_mqserver_proc_get_type ())
 #define CCNET_MQSERVER_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), CCNET_TYPE_MQSERVER_PROC, CcnetMqserverProc))
@@ -31,4 +32,18 @@ GType ccnet_mqserver_proc_get_type ();
 void ccnet_mqserver_proc_put_message (CcnetProcessor *processor,
                                       CcnetMessage *message);
 
+/* Encode @message once for delivery to any number of subscribers. */
+CcnetSharedPacket *
+ccnet_mqserver_proc_encode_message (const CcnetMessageView *message);
+
+/* @packet must be the encoding of @message. It is queued if the
+ * subscriber can't keep up. */
+void ccnet_mqserver_proc_put_packet (CcnetProcessor *processor,
+                                     const CcnetMessageView *message,
+                                     CcnetSharedPacket *packet);
+
+/* The messages waiting for the subscriber. Their packets may be shared
+ * with other subscribers. */
+gsize ccnet_mqserver_proc_get_queued_bytes (CcnetProcessor *processor);
+
 #endif
@@ -0,0 +1,214 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "peer.h"
+#include "session.h"
+
+#include "procalive-proc.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_PROCESSOR
+#include "log.h"
+
+/*
+  One keepalive for many processors of a peer.
+
+                 proc-alive <id>,<id>,...
+      INIT    ----------------------------->
+             <-----------------------------
+                 300  <dead id>,<dead id>,...
+
+  The ids are those of the processors on the slave side. The slave
+  counts the request as a packet for each listed processor it has and
+  answers with the ones it doesn't have; the master takes the answer as
+  a packet for all the others and shuts down its end of the dead ones.
+
+  A peer without proc-alive is marked no_proc_alive and its processors
+  get one SC_PROC_KEEPALIVE each, as before.
+ */
+
+#define SC_BAD_REQUEST "400"
+#define SS_BAD_REQUEST "Bad proc-alive request"
+
+enum {
+    INIT,
+    REQUEST_SENT,
+};
+
+typedef struct {
+    char *ids;                  /* as sent */
+} CcnetProcaliveProcPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), CCNET_TYPE_PROCALIVE_PROC, CcnetProcaliveProcPriv))
+
+G_DEFINE_TYPE (CcnetProcaliveProc, ccnet_procalive_proc, CCNET_TYPE_PROCESSOR);
+
+static int procalive_start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_response (CcnetProcessor *processor,
+                             char *code, char *code_msg,
+                             char *content, int clen);
+
+/* The processor of @peer which the peer knows as @remote_id. */
+static CcnetProcessor *
+get_local_processor (CcnetPeer *peer, const char *remote_id)
+{
+    unsigned int id = (unsigned int) strtoul (remote_id, NULL, 10);
+
+    return ccnet_peer_get_processor (peer, PROC_REMOTE_ID (id));
+}
+
+static void
+fall_back (CcnetProcessor *processor)
+{
+    CcnetProcaliveProcPriv *priv = GET_PRIV (processor);
+    CcnetProcessor *proc;
+    char **ids, **id;
+
+    ccnet_debug ("[Proc] %.8s doesn't support proc-alive\n",
+                 processor->peer->id);
+    processor->peer->no_proc_alive = 1;
+
+    ids = g_strsplit (priv->ids, ",", -1);
+    for (id = ids; *id; id++) {
+        proc = get_local_processor (processor->peer, *id);
+        if (proc && !proc->detached)
+            ccnet_processor_keep_alive (proc);
+    }
+    g_strfreev (ids);
+}
+
+static void
+release_resource(CcnetProcessor *processor)
+{
+    CcnetProcaliveProcPriv *priv = GET_PRIV (processor);
+
+    if (processor->state == REQUEST_SENT &&
+        processor->failure == PROC_NO_SERVICE && priv->ids)
+        fall_back (processor);
+
+    g_free (priv->ids);
+    priv->ids = NULL;
+
+    CCNET_PROCESSOR_CLASS(ccnet_procalive_proc_parent_class)->release_resource (processor);
+}
+
+static void
+ccnet_procalive_proc_class_init (CcnetProcaliveProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "procalive-proc";
+    proc_class->control = TRUE;
+    proc_class->reusable = TRUE;
+    proc_class->start = procalive_start;
+    proc_class->handle_response = handle_response;
+    proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof (CcnetProcaliveProcPriv));
+}
+
+static void
+ccnet_procalive_proc_init (CcnetProcaliveProc *processor)
+{
+}
+
+static void
+answer (CcnetProcessor *processor, char *list)
+{
+    CcnetPeer *peer = processor->peer;
+    CcnetProcessor *proc;
+    GString *dead = g_string_new (NULL);
+    time_t now = time(NULL);
+    char **ids, **id;
+
+    ids = g_strsplit (list, ",", -1);
+    for (id = ids; *id; id++) {
+        proc = get_local_processor (peer, *id);
+        if (proc && !proc->detached) {
+            proc->t_packet_recv = now;
+            continue;
+        }
+        if (dead->len > 0)
+            g_string_append_c (dead, ',');
+        g_string_append (dead, *id);
+    }
+    g_strfreev (ids);
+
+    ccnet_processor_send_response (processor, "300", "", dead->str,
+                                   dead->len + 1);
+    g_string_free (dead, TRUE);
+    ccnet_processor_done (processor, TRUE);
+}
+
+static int
+procalive_start (CcnetProcessor *processor, int argc, char **argv)
+{
+    CcnetProcaliveProcPriv *priv = GET_PRIV (processor);
+
+    if (argc != 1) {
+        if (IS_SLAVE(processor))
+            ccnet_processor_send_response (processor, SC_BAD_REQUEST,
+                                           SS_BAD_REQUEST, NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return -1;
+    }
+
+    if (IS_SLAVE(processor)) {
+        answer (processor, argv[0]);
+        return 0;
+    }
+
+    priv->ids = g_strdup (argv[0]);
+    ccnet_processor_send_request_l (processor, "proc-alive ", argv[0], NULL);
+    processor->state = REQUEST_SENT;
+    return 0;
+}
+
+static void
+handle_response (CcnetProcessor *processor,
+                 char *code, char *code_msg,
+                 char *content, int clen)
+{
+    CcnetProcaliveProcPriv *priv = GET_PRIV (processor);
+    CcnetPeer *peer = processor->peer;
+    CcnetProcessor *proc;
+    GHashTable *dead;
+    time_t now = time(NULL);
+    char **ids, **id;
+
+    if (memcmp (code, "300", 3) != 0 || clen < 1 || content[clen-1] != '\0') {
+        ccnet_warning ("Bad proc-alive response from %s(%.8s): %s %s\n",
+                       peer->name, peer->id, code, code_msg);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    dead = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    ids = g_strsplit (content, ",", -1);
+    for (id = ids; *id; id++)
+        if (**id)
+            g_hash_table_replace (dead, g_strdup (*id), NULL);
+    g_strfreev (ids);
+
+    ids = g_strsplit (priv->ids, ",", -1);
+    for (id = ids; *id; id++) {
+        proc = get_local_processor (peer, *id);
+        if (!proc || proc->detached)
+            continue;
+        if (!g_hash_table_lookup_extended (dead, *id, NULL, NULL)) {
+            proc->t_packet_recv = now;
+            continue;
+        }
+        ccnet_debug ("[Proc] Shutdown processor %s(%d) when remote "
+                     "processor dies\n",
+                     GET_PNAME(proc), PRINT_ID(proc->id));
+        proc->failure = PROC_REMOTE_DEAD;
+        ccnet_processor_done (proc, FALSE);
+    }
+    g_strfreev (ids);
+    g_hash_table_destroy (dead);
+
+    processor->state = INIT;
+    ccnet_processor_done (processor, TRUE);
+}
@@ -0,0 +1,33 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_PROCALIVE_PROC_H
+#define CCNET_PROCALIVE_PROC_H
+
+#include <glib-object.h>
+
+#include "processor.h"
+
+#define CCNET_TYPE_PROCALIVE_PROC                  (ccnet_procalive_proc_get_type ())
+#define CCNET_PROCALIVE_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), CCNET_TYPE_PROCALIVE_PROC, CcnetProcaliveProc))
+#define CCNET_IS_PROCALIVE_PROC(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), CCNET_TYPE_PROCALIVE_PROC))
+#define CCNET_PROCALIVE_PROC_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), CCNET_TYPE_PROCALIVE_PROC, CcnetProcaliveProcClass))
+#define CCNET_IS_PROCALIVE_PROC_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), CCNET_TYPE_PROCALIVE_PROC))
+#define CCNET_PROCALIVE_PROC_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), CCNET_TYPE_PROCALIVE_PROC, CcnetProcaliveProcClass))
+
+typedef struct _CcnetProcaliveProc CcnetProcaliveProc;
+typedef struct _CcnetProcaliveProcClass CcnetProcaliveProcClass;
+
+struct _CcnetProcaliveProc {
+    CcnetProcessor parent_instance;
+};
+
+struct _CcnetProcaliveProcClass {
+    CcnetProcessorClass parent_class;
+};
+
+GType ccnet_procalive_proc_get_type ();
+
+/* The id the peer knows the processor @id of ours by, and back. */
+#define PROC_REMOTE_ID(id) (((id) & SLAVE_MASK) ? REQUEST_ID (id) : SLAVE_ID (id))
+
+#endif
@@ -13,8 +13,10 @@
 #include "peer-mgr.h"
 #include "connect-mgr.h"
 #include "proc-factory.h"
+#include "timer.h"
 #include "message.h"
 #include "message-manager.h"
+#include "profiler.h"
 
 #include "algorithms.h"
 #include "utils.h"
@@ -43,8 +45,12 @@
 #define SS_NO_PROCESSOR "No Such Processor"
 #define SC_NO_USER "413"
 #define SS_NO_USER "No Such User"
+#define SC_BUSY "414"
+#define SS_BUSY "Busy"
 #define SC_NO_GROUP "430"
 #define SS_NO_GROUP "No Such Group"
+#define SC_PROFILER "440"
+#define SS_PROFILER "Profiler Error"
 
 #define PARSE_OPTIONS                                               \
     do {                                                            \
@@ -62,6 +68,15 @@ enum {
 
 typedef struct  {
     int    persist : 1;
+
+    /* A list-proc or show-proc in progress, see list_step(). */
+    CcnetProcCursor *cursor;
+    GString         *listing;
+    CcnetTimer      *list_timer;
+    gboolean         listing_verbose;
+
+    /* The lines after the command line, while its handler runs. */
+    char            *body;
 } CcnetRcvcmdProcPriv;
 
 #define GET_PRIV(o)                                                     \
@@ -69,6 +84,7 @@ typedef struct  {
 
 
 static int rcv_cmd_start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_command (CcnetProcessor *processor, char *line);
 static void handle_update (CcnetProcessor *processor, 
                            char *code, char *code_msg,
                            char *content, int clen);
@@ -76,6 +92,23 @@ static void handle_update (CcnetProcessor *processor,
 
 G_DEFINE_TYPE (CcnetRcvcmdProc, ccnet_rcvcmd_proc, CCNET_TYPE_PROCESSOR)
 
+static void
+release_resource (CcnetProcessor *processor)
+{
+    CcnetRcvcmdProcPriv *priv = GET_PRIV (processor);
+
+    if (priv->list_timer)
+        ccnet_timer_free (&priv->list_timer);
+    ccnet_proc_cursor_close (priv->cursor);
+    priv->cursor = NULL;
+    if (priv->listing) {
+        g_string_free (priv->listing, TRUE);
+        priv->listing = NULL;
+    }
+
+    CCNET_PROCESSOR_CLASS(ccnet_rcvcmd_proc_parent_class)->release_resource (processor);
+}
+
 static void
 ccnet_rcvcmd_proc_class_init (CcnetRcvcmdProcClass *klass)
 {
@@ -84,6 +117,7 @@ ccnet_rcvcmd_proc_class_init (CcnetRcvcmdProcClass *klass)
     proc_class->name = "rcvcmd-proc";
     proc_class->start = rcv_cmd_start;
     proc_class->handle_update = handle_update;
+    proc_class->release_resource = release_resource;
 
     g_type_class_add_private (klass, sizeof (CcnetRcvcmdProcPriv));
 }
@@ -111,6 +145,24 @@ static int rcv_cmd_start (CcnetProcessor *processor, int argc, char **argv)
         argc--; argv++;
     }
 
+    /* "run-cmd [-p] <command>" carries the first command in the
+     * request, and its result is the first response.
+     */
+    if (strcmp (processor->name, "run-cmd") == 0 && argc > 0) {
+        GString *line = g_string_new (argv[0]);
+        int i;
+
+        for (i = 1; i < argc; i++) {
+            g_string_append_c (line, ' ');
+            g_string_append (line, argv[i]);
+        }
+        handle_command (processor, line->str);
+        g_string_free (line, TRUE);
+        if (!priv->persist && !priv->cursor)
+            ccnet_processor_done (processor, TRUE);
+        return 0;
+    }
+
     ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
     return 0;
 }
@@ -131,12 +183,15 @@ static int set_timeout (CcnetProcessor *, int, char **);
 static int add_role  (CcnetProcessor *, int, char **);
 static int set_addr  (CcnetProcessor *, int, char **);
 static int add_peer    (CcnetProcessor *, int, char **);
+static int import_peers (CcnetProcessor *, int, char **);
 static int delete_peer (CcnetProcessor *, int, char **);
 static int delete_role (CcnetProcessor *, int, char **);
 static int connect_peer           (CcnetProcessor *, int, char **);
 static int disconnect_peer        (CcnetProcessor *, int, char **);
 static int conn_cancel (CcnetProcessor *, int, char **);
 static int invoke_echo (CcnetProcessor *, int, char **);
+static int trace_peer (CcnetProcessor *, int, char **);
+static int profile (CcnetProcessor *, int, char **);
 
 
 #ifdef CCNET_CLUSTER
@@ -159,6 +214,7 @@ static struct cmd cmdtab[] =  {
     { "set-timeout", set_timeout },
     { "add-role", add_role },
     { "add-peer", add_peer },
+    { "import-peers", import_peers },
     { "del-peer", delete_peer },
     { "del-role", delete_role },
     { "set-addr", set_addr },
@@ -182,6 +238,8 @@ static struct cmd cmdtab[] =  {
     { "disconnect", disconnect_peer },
     { "conn-cancel", conn_cancel },
     { "invoke-echo", invoke_echo },
+    { "trace", trace_peer },
+    { "profile", profile },
     { 0 },
 };
 
@@ -217,11 +275,16 @@ getcmd (char *name)
 
 static void handle_command (CcnetProcessor *processor, char *line)
 {
+    CcnetRcvcmdProcPriv *priv = GET_PRIV (processor);
     gchar **commands;
     gchar **pcmd;
     struct cmd *c;
+    char *body;
     int i;
 
+    if ((body = strchr (line, '\n')) != NULL)
+        *body++ = '\0';
+
     commands = g_strsplit_set (line, " \t", 10);
     for (i=0, pcmd = commands; *pcmd; pcmd++)
         i++;
@@ -236,9 +299,13 @@ static void handle_command (CcnetProcessor *processor, char *line)
     if (c == NULL) {
         ccnet_processor_send_response (processor, SC_UNKNONW_CMD, 
                                        SS_UNKNONW_CMD, NULL, 0);
+        g_strfreev (commands);
         return;
-    } else
+    } else {
+        priv->body = body;
         c->handler (processor, i, commands);
+        priv->body = NULL;
+    }
 
     g_strfreev (commands);
 }
@@ -259,7 +326,7 @@ static void handle_update (CcnetProcessor *processor,
     }
     
     handle_command (processor, content);
-    if (!priv->persist)
+    if (!priv->persist && !priv->cursor)
         ccnet_processor_done (processor, TRUE);
 }
 
@@ -325,66 +392,204 @@ static int echo (CcnetProcessor *processor,
     return 0;
 }
 
+/*
+ * Listing a server's processors may take long, so it's done
+ * LIST_PROC_STEP processors per loop iteration from a cursor, and the
+ * response is sent at the end.
+ */
+#define LIST_PROC_STEP 1000
+
+static gboolean
+list_append (CcnetProcessor *proc, void *vprocessor)
+{
+    CcnetRcvcmdProcPriv *priv = GET_PRIV (vprocessor);
+
+    if (priv->listing_verbose)
+        g_string_append_printf (priv->listing, "%d\t%s\t%s\t%d\n",
+                                PRINT_ID(proc->id), GET_PNAME(proc),
+                                proc->peer->id,
+                                (int)(time(NULL) - proc->start_time));
+    else
+        g_string_append_printf (priv->listing, "%d\t%s\n",
+                                PRINT_ID(proc->id), GET_PNAME(proc));
+    return TRUE;
+}
+
+static int
+list_step (void *vprocessor)
+{
+    CcnetProcessor *processor = vprocessor;
+    CcnetRcvcmdProcPriv *priv = GET_PRIV (processor);
+    GString *buf;
+
+    if (ccnet_proc_cursor_step (priv->cursor, LIST_PROC_STEP,
+                                list_append, processor))
+        return TRUE;
+
+    /* the timer is freed when this returns FALSE */
+    priv->list_timer = NULL;
+    ccnet_proc_cursor_close (priv->cursor);
+    priv->cursor = NULL;
+    buf = priv->listing;
+    priv->listing = NULL;
+
+    /* list-proc has always been sent without the trailing nul */
+    ccnet_processor_send_response (processor, SC_OK, SS_OK, buf->str,
+                                   priv->listing_verbose ? buf->len
+                                                         : buf->len+1);
+    g_string_free (buf, TRUE);
+
+    if (!priv->persist)
+        ccnet_processor_done (processor, TRUE);
+    return FALSE;
+}
+
+static int
+start_listing (CcnetProcessor *processor, const char *class_name,
+               const char *peer_id, int min_age, gboolean verbose)
+{
+    CcnetRcvcmdProcPriv *priv = GET_PRIV (processor);
+
+    if (priv->cursor) {
+        ccnet_processor_send_response (processor, SC_BUSY, SS_BUSY, NULL, 0);
+        return -1;
+    }
+
+    priv->cursor = ccnet_proc_factory_open_cursor (
+        processor->session->proc_factory, class_name, peer_id, min_age);
+    priv->listing = g_string_new (NULL);
+    priv->listing_verbose = verbose;
+
+    /* small lists are answered at once */
+    if (ccnet_proc_cursor_step (priv->cursor, LIST_PROC_STEP,
+                                list_append, processor))
+        priv->list_timer = ccnet_timer_new (list_step, processor, 0);
+    else
+        list_step (processor);
+    return 0;
+}
+
+/* "list-proc [-c <class>] [-p <peer-id>] [-a <min-age>]": id, class,
+ * peer and age in seconds of the live processors. */
 static int
 list_proc (CcnetProcessor *processor, int argc, char **argv)
 {
+    const char *class_name = NULL, *peer_id = NULL;
+    int min_age = 0;
+
     argc--;
     argv++;
 
-    CcnetPeerManager *peerMgr;
-    CcnetPeer *peer;
-    CcnetProcessor *proc;
-    GList *peerlist, *peeriter;
-    GList *proclist, *prociter;
-    GString *buf = g_string_new (NULL);
-    
-    peerMgr = processor->session->peer_mgr;
-    peerlist = ccnet_peer_manager_get_peer_list (peerMgr);
-    
-    for (peeriter=peerlist; peeriter; peeriter=peeriter->next) {
-        peer = (CcnetPeer *)(peeriter->data);
-        proclist = g_hash_table_get_values (peer->processors);
-        
-        for (prociter=proclist; prociter; prociter = prociter->next) {
-            proc = (CcnetProcessor *)(prociter->data);
-            g_string_append_printf (buf, "%d\t%s\n", PRINT_ID(proc->id),
-                                    GET_PNAME(proc));
+    while (argc >= 2 && argv[0][0] == '-') {
+        switch (argv[0][1]) {
+        case 'c':
+            class_name = argv[1];
+            break;
+        case 'p':
+            peer_id = argv[1];
+            break;
+        case 'a':
+            min_age = atoi (argv[1]);
+            break;
+        default:
+            ccnet_processor_send_response (processor, SC_BAD_CMD_FMT,
+                                           SS_BAD_CMD_FMT, NULL, 0);
+            return -1;
         }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 0) {
+        ccnet_processor_send_response (processor, SC_BAD_CMD_FMT,
+                                       SS_BAD_CMD_FMT, NULL, 0);
+        return -1;
+    }
+
+    return start_listing (processor, class_name, peer_id, min_age, TRUE);
+}
+
+static int
+show_proc (CcnetProcessor *processor, int argc, char **argv)
+{
+    return start_listing (processor, NULL, NULL, 0, FALSE);
+}
+
+/* "trace <peer-id>": the last packets exchanged with the peer. */
+static int
+trace_peer (CcnetProcessor *processor, int argc, char **argv)
+{
+    argc--;
+    argv++;
+
+    CcnetPeer *peer;
+    GString *buf;
 
-        g_list_free (proclist);
+    if (argc != 1 || strlen(argv[0]) != 40) {
+        ccnet_processor_send_response (processor, SC_BAD_CMD_FMT,
+                                       SS_BAD_CMD_FMT, NULL, 0);
+        return -1;
     }
-    g_list_free (peerlist);
 
-    ccnet_processor_send_response (processor, SC_OK, SS_OK, 
-                                   buf->str, buf->len);
-    
+    peer = ccnet_peer_manager_get_peer (processor->session->peer_mgr, argv[0]);
+    if (!peer) {
+        ccnet_processor_send_response (processor, SC_NO_PEER, SS_NO_PEER,
+                                       NULL, 0);
+        return -1;
+    }
+
+    buf = g_string_new (NULL);
+    ccnet_peer_format_trace (peer, buf);
+    ccnet_processor_send_response (processor, SC_OK, SS_OK,
+                                   buf->str, buf->len+1);
     g_string_free (buf, TRUE);
-    
+    g_object_unref (peer);
     return 0;
 }
 
+/*
+ * profile start [<hz>] | stop | status
+ *
+ * See profiler.h. stop responds with the path of the profile, status
+ * with ccnet_profiler_get_status().
+ */
 static int
-show_proc (CcnetProcessor *processor, int argc, char **argv)
+profile (CcnetProcessor *processor, int argc, char **argv)
 {
+    char *result = NULL;
+
     argc--;
     argv++;
-    
-    CcnetProcessor *proc;
-    GString *buf = g_string_new (NULL);
-    struct list_head *pos;
-    CcnetProcFactory *factory = processor->session->proc_factory;
-
-    list_for_each (pos, &(factory->procs_list)) {
-        proc = (CcnetProcessor *) list_entry (pos, CcnetProcessor, list);
-        g_string_append_printf (buf, "%d\t%s\n", PRINT_ID(proc->id),
-                                GET_PNAME(proc));
+
+    if (argc < 1) {
+        ccnet_processor_send_response (processor, SC_BAD_CMD_FMT,
+                                       SS_BAD_CMD_FMT, NULL, 0);
+        return -1;
     }
-    ccnet_processor_send_response (processor, SC_OK, SS_OK, 
-                                   buf->str, buf->len+1);
 
-    g_string_free (buf, TRUE);
+    if (strcmp (argv[0], "start") == 0) {
+        if (ccnet_profiler_start (argc > 1 ? atoi (argv[1]) : 0) < 0)
+            goto error;
+        result = ccnet_profiler_get_status ();
+    } else if (strcmp (argv[0], "stop") == 0) {
+        if (!(result = ccnet_profiler_stop ()))
+            goto error;
+    } else if (strcmp (argv[0], "status") == 0) {
+        result = ccnet_profiler_get_status ();
+    } else {
+        ccnet_processor_send_response (processor, SC_BAD_CMD_FMT,
+                                       SS_BAD_CMD_FMT, NULL, 0);
+        return -1;
+    }
 
+    ccnet_processor_send_response (processor, SC_OK, SS_OK,
+                                   result, strlen (result) + 1);
+    g_free (result);
     return 0;
+
+error:
+    ccnet_processor_send_response (processor, SC_PROFILER, SS_PROFILER,
+                                   NULL, 0);
+    return -1;
 }
 
 static int 
@@ -770,6 +975,39 @@ out:
 }
 
 
+/*
+ * "import-peers" followed by a peer record per line, see
+ * ccnet_peer_manager_import_peers(). Responds with the number of peers
+ * imported on the first line and the rejected records after it.
+ */
+static int
+import_peers (CcnetProcessor *processor, int argc, char **argv)
+{
+    CcnetRcvcmdProcPriv *priv = GET_PRIV (processor);
+    CcnetSession *session = processor->session;
+    GString *errors, *result;
+    int n;
+
+    if (argc != 1 || !priv->body) {
+        ccnet_processor_send_response (processor, SC_BAD_CMD_FMT,
+                                       SS_BAD_CMD_FMT, NULL, 0);
+        return -1;
+    }
+
+    errors = g_string_new (NULL);
+    n = ccnet_peer_manager_import_peers (session->peer_mgr, priv->body,
+                                         session->crypto_job_mgr, errors);
+    result = g_string_new (NULL);
+    g_string_printf (result, "%d\n%s", n, errors->str);
+    ccnet_processor_send_response (processor, SC_OK, SS_OK,
+                                   result->str, result->len + 1);
+
+    g_string_free (result, TRUE);
+    g_string_free (errors, TRUE);
+    return 0;
+}
+
+
 static int
 delete_peer (CcnetProcessor *processor, int argc, char **argv)
 {
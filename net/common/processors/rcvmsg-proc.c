@@ -46,30 +46,32 @@ static void handle_update (CcnetProcessor *processor,
                            char *code, char *code_msg,
                            char *content, int clen)
 {
-    CcnetMessage *msg;
+    CcnetMessageView view;
+    gboolean local = processor->peer->is_local;
 
-    if (processor->peer->is_local) {
-        msg = ccnet_message_from_string_local (content, clen);
-        ccnet_send_message (processor->session, msg);
-        ccnet_message_unref (msg);
+    if (!content ||
+        ccnet_message_view_parse (&view, content, clen, local) < 0) {
+        ccnet_warning ("[msg] Bad message from %.8s\n", processor->peer->id);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    if (local) {
+        ccnet_send_message_view (processor->session, &view);
     } else {
-        msg = ccnet_message_from_string (content, clen);
-        msg->rtime = time(NULL);
+        view.rtime = time(NULL);
         ccnet_debug ("[msg] Received a message : %s - %.10s\n", 
-                     msg->app, msg->body);
+                     view.app, view.body);
 
-        int ret = ccnet_recv_message (processor->session, msg);
+        int ret = ccnet_recv_message_view (processor->session, &view);
         if (ret == -1) {
             ccnet_message ("[msg] Message from %.8s permission error\n", 
-                           msg->from);
+                           view.from);
             ccnet_processor_send_response (processor, SC_PERM_ERR,
                                            SS_PERM_ERR, NULL, 0);
             ccnet_processor_done (processor, TRUE);
-            ccnet_message_unref (msg);
             return;
         }
-
-        ccnet_message_unref (msg);
     }
 
     ccnet_processor_send_response (processor, "200", "OK", NULL, 0);
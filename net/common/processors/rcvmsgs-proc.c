@@ -0,0 +1,149 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "timer.h"
+
+#include "peer.h"
+#include "message.h"
+#include "session.h"
+#include "rcvmsgs-proc.h"
+#include "algorithms.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_MESSAGE
+#include "log.h"
+
+/* Slave side of a message stream, see sendmsgs-proc.c */
+
+#define SC_MSG  "301"
+#define SC_ACK  "302"
+
+/* Acks are sent once per event loop iteration, or every ACK_BATCH
+ * messages within one iteration. */
+#define ACK_BATCH 64
+
+typedef struct  {
+    guint32     n_handled;
+    guint32     n_acked;
+    CcnetTimer *ack_timer;
+} CcnetRcvmsgsProcPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), CCNET_TYPE_RCVMSGS_PROC, CcnetRcvmsgsProcPriv))
+
+static int rcv_msgs_start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_update (CcnetProcessor *processor,
+                           char *code, char *code_msg,
+                           char *content, int clen);
+
+G_DEFINE_TYPE (CcnetRcvmsgsProc, ccnet_rcvmsgs_proc, CCNET_TYPE_PROCESSOR)
+
+static void
+release_resource(CcnetProcessor *processor)
+{
+    CcnetRcvmsgsProcPriv *priv = GET_PRIV (processor);
+
+    ccnet_timer_free (&priv->ack_timer);
+    memset (priv, 0, sizeof(CcnetRcvmsgsProcPriv));
+
+    CCNET_PROCESSOR_CLASS (ccnet_rcvmsgs_proc_parent_class)->release_resource (processor);
+}
+
+static void
+ccnet_rcvmsgs_proc_class_init (CcnetRcvmsgsProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "rcvmsgs-proc";
+    proc_class->start = rcv_msgs_start;
+    proc_class->handle_update = handle_update;
+    proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof (CcnetRcvmsgsProcPriv));
+}
+
+static void
+ccnet_rcvmsgs_proc_init (CcnetRcvmsgsProc *processor)
+{
+}
+
+static int rcv_msgs_start (CcnetProcessor *processor, int argc, char **argv)
+{
+    ccnet_processor_send_response (processor, "200", "OK", NULL, 0);
+    return 0;
+}
+
+static void
+send_ack (CcnetProcessor *processor)
+{
+    CcnetRcvmsgsProcPriv *priv = GET_PRIV (processor);
+    char buf[16];
+    int len;
+
+    len = snprintf (buf, sizeof(buf), "%u", priv->n_handled);
+    ccnet_processor_send_response (processor, SC_ACK, NULL, buf, len + 1);
+    priv->n_acked = priv->n_handled;
+}
+
+static int
+ack_timer_cb (void *vprocessor)
+{
+    CcnetProcessor *processor = vprocessor;
+    CcnetRcvmsgsProcPriv *priv = GET_PRIV (processor);
+
+    priv->ack_timer = NULL;
+    if (priv->n_acked != priv->n_handled)
+        send_ack (processor);
+    return FALSE;
+}
+
+static void
+handle_message (CcnetProcessor *processor, char *content, int clen)
+{
+    CcnetMessageView view;
+    gboolean local = processor->peer->is_local;
+
+    if (ccnet_message_view_parse (&view, content, clen, local) < 0) {
+        ccnet_warning ("[msg] Bad message from %.8s\n", processor->peer->id);
+        return;
+    }
+
+    if (local) {
+        ccnet_send_message_view (processor->session, &view);
+        return;
+    }
+
+    view.rtime = time(NULL);
+    ccnet_debug ("[msg] Received a message : %s - %.10s\n",
+                 view.app, view.body);
+
+    if (ccnet_recv_message_view (processor->session, &view) < 0)
+        ccnet_message ("[msg] Message from %.8s permission error\n",
+                       view.from);
+}
+
+static void handle_update (CcnetProcessor *processor,
+                           char *code, char *code_msg,
+                           char *content, int clen)
+{
+    CcnetRcvmsgsProcPriv *priv = GET_PRIV (processor);
+
+    if (memcmp (code, SC_MSG, 3) != 0) {
+        ccnet_warning ("[msg] Bad update from %.8s: %s %s\n",
+                       processor->peer->id, code, code_msg);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    /* Permission errors and bad messages drop the message only, the
+     * sender counts it as handled anyway. */
+    if (content && clen > 0)
+        handle_message (processor, content, clen);
+    ++priv->n_handled;
+
+    if (priv->n_handled - priv->n_acked >= ACK_BATCH) {
+        ccnet_timer_free (&priv->ack_timer);
+        send_ack (processor);
+    } else if (!priv->ack_timer)
+        priv->ack_timer = ccnet_timer_new (ack_timer_cb, processor, 0);
+}
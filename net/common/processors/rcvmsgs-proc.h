@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_RCVMSGS_PROC_H
+#define CCNET_RCVMSGS_PROC_H
+
+#include <glib-object.h>
+
+#include "processor.h"
+
+#define CCNET_TYPE_RCVMSGS_PROC                  (ccnet_rcvmsgs_proc_get_type ())
+#define CCNET_RCVMSGS_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), CCNET_TYPE_RCVMSGS_PROC, CcnetRcvmsgsProc))
+#define CCNET_IS_RCVMSGS_PROC(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), CCNET_TYPE_RCVMSGS_PROC))
+#define CCNET_RCVMSGS_PROC_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), CCNET_TYPE_RCVMSGS_PROC, CcnetRcvmsgsProcClass))
+#define CCNET_IS_RCVMSGS_PROC_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), CCNET_TYPE_RCVMSGS_PROC))
+#define CCNET_RCVMSGS_PROC_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), CCNET_TYPE_RCVMSGS_PROC, CcnetRcvmsgsProcClass))
+
+typedef struct _CcnetRcvmsgsProc CcnetRcvmsgsProc;
+typedef struct _CcnetRcvmsgsProcClass CcnetRcvmsgsProcClass;
+
+struct _CcnetRcvmsgsProc {
+    CcnetProcessor parent_instance;
+};
+
+struct _CcnetRcvmsgsProcClass {
+    CcnetProcessorClass parent_class;
+};
+
+GType ccnet_rcvmsgs_proc_get_type ();
+
+#endif
@@ -19,6 +19,20 @@ extern CcnetSession *session;
 #define SC_BAD_KEY "302"
 #define SS_BAD_KEY "bad session key"
 
+typedef struct  {
+    /* the encrypted key, kept for the crypto thread */
+    unsigned char *enc_key;
+    int            enc_len;
+    char          *key;
+    int            key_len;
+} CcnetRecvsessionkeyProcPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), CCNET_TYPE_RECVSESSIONKEY_PROC, CcnetRecvsessionkeyProcPriv))
+
+#define USE_PRIV \
+    CcnetRecvsessionkeyProcPriv *priv = GET_PRIV(processor);
+
 G_DEFINE_TYPE (CcnetRecvsessionkeyProc, ccnet_recvsessionkey_proc, CCNET_TYPE_PROCESSOR)
 
 static int start (CcnetProcessor *processor, int argc, char **argv);
@@ -29,6 +43,10 @@ static void handle_update (CcnetProcessor *processor,
 static void
 release_resource(CcnetProcessor *processor)
 {
+    USE_PRIV;
+
+    g_free (priv->enc_key);
+    g_free (priv->key);
     CCNET_PROCESSOR_CLASS (ccnet_recvsessionkey_proc_parent_class)->release_resource (processor);
 }
 
@@ -39,9 +57,12 @@ ccnet_recvsessionkey_proc_class_init (CcnetRecvsessionkeyProcClass *klass)
     CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
 
     proc_class->name = "receive-session-key";
+    proc_class->control = TRUE;
     proc_class->start = start;
     proc_class->handle_update = handle_update;
     proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof (CcnetRecvsessionkeyProcPriv));
 }
 
 static void
@@ -75,46 +96,59 @@ start (CcnetProcessor *processor, int argc, char **argv)
     return 0;
 }
 
-static unsigned char *
-decrypt_data (CcnetPeer *peer, const char *content, int clen, int *len_p)
+/* May run in a crypto thread, only touches the priv. */
+static void *
+decrypt_session_key (void *vprocessor)
 {
-    RSA *privkey = session->privkey;
+    CcnetProcessor *processor = vprocessor;
+    USE_PRIV;
     unsigned char *buf;
+    int len = 0;
 
-    buf = private_key_decrypt(privkey, (unsigned char *)content,
-                              clen, len_p);
-    if (*len_p <= 0) {
-        ccnet_warning ("failed to decrypt session key from peer %.10s",
-                       peer->id);
+    buf = private_key_decrypt (session->privkey, priv->enc_key,
+                               priv->enc_len, &len);
+    if (len <= 0) {
         g_free (buf);
-        buf = NULL;
+        return vprocessor;
     }
 
-    return buf;
+    priv->key = g_strndup ((char *)buf, len);
+    priv->key_len = len;
+    g_free (buf);
+
+    return vprocessor;
 }
 
-static gboolean
-update_peer_session_key (CcnetPeer *peer,
-                         const char *content,
-                         int clen)
+static void
+on_session_key_decrypted (void *vprocessor)
 {
-    char *buf;
-    int key_len = 0;
+    CcnetProcessor *processor = vprocessor;
+    USE_PRIV;
 
-    if (peer->session_key) {
-        ccnet_warning ("[recv session key] peer %.10s already has a session key",
-                       peer->id);
-        return FALSE;
-    }
+    if (processor->peer->session_key) {
+        ccnet_processor_send_response (processor,
+                                       SC_ALREADY_HAS_KEY,
+                                       SS_ALREADY_HAS_KEY,
+                                       NULL, 0);
+        ccnet_processor_done (processor, TRUE);
 
-    buf = (char *)decrypt_data (peer, content, clen, &key_len);
-    if (buf) {
-        peer->session_key = g_strndup(buf, key_len);
-        g_free (buf);
-        return TRUE;
+    } else if (priv->key) {
+        processor->peer->session_key = g_strndup (priv->key, priv->key_len);
+        ccnet_processor_send_response (processor,
+                                       SC_OK, SS_OK,
+                                       NULL, 0);
+
+        ccnet_peer_manager_on_peer_session_key_received (processor->peer->manager,
+                                                         processor->peer);
+
+        ccnet_processor_done (processor, TRUE);
     } else {
-        ccnet_warning ("faied to decrypt session key"); 
-        return FALSE;
+        ccnet_warning ("failed to decrypt session key from peer %.10s\n",
+                       processor->peer->id);
+        ccnet_processor_send_response (processor,
+                                       SC_BAD_KEY, SS_BAD_KEY,
+                                       NULL, 0);
+        ccnet_processor_done (processor, FALSE);
     }
 }
 
@@ -123,6 +157,8 @@ handle_update (CcnetProcessor *processor,
                char *code, char *code_msg,
                char *content, int clen)
 {
+    USE_PRIV;
+
     if (strcmp(code, SC_SESSION_KEY) == 0) {
         if (processor->peer->session_key) {
             ccnet_processor_send_response (processor,
@@ -130,23 +166,29 @@ handle_update (CcnetProcessor *processor,
                                            SS_ALREADY_HAS_KEY,
                                            NULL, 0);
             ccnet_processor_done (processor, TRUE);
-            
-        } else if (update_peer_session_key (processor->peer, content, clen)) {
-            ccnet_processor_send_response (processor,
-                                           SC_OK, SS_OK,
-                                           NULL, 0);
-
-            ccnet_peer_manager_on_peer_session_key_received (processor->peer->manager,
-                                                             processor->peer);
+            return;
+        }
 
-            ccnet_processor_done (processor, TRUE);
-        } else {
-            ccnet_processor_send_response (processor,
-                                           SC_BAD_KEY, SS_BAD_KEY,
-                                           NULL, 0);
-            ccnet_processor_done (processor, FALSE);
+        if (processor->thread_running || priv->enc_key) {
+            ccnet_warning ("[recv session key] duplicate session key\n");
+            return;
         }
-        
+
+        priv->enc_key = g_memdup (content, clen);
+        priv->enc_len = clen;
+
+#ifdef CCNET_SERVER
+        /* RSA decryption is slow, keep it off the main loop */
+        ccnet_processor_thread_create (processor,
+                                       processor->session->crypto_job_mgr,
+                                       decrypt_session_key,
+                                       on_session_key_decrypted,
+                                       processor);
+#else
+        decrypt_session_key (processor);
+        on_session_key_decrypted (processor);
+#endif
+
     } else {
         ccnet_warning ("[recv session key] bad update %s:%s\n",
                        code, code_msg);
@@ -8,6 +8,9 @@
 #include "log.h"
 #include "rsa.h"
 
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
 #include "recvsessionkey-v2-proc.h"
 
 extern CcnetSession *session;
@@ -16,14 +19,30 @@ extern CcnetSession *session;
 #define SS_SESSION_KEY "session key"
 #define SC_ALREADY_HAS_KEY "301"
 #define SS_ALREADY_HAS_KEY "already has your session key"
+#define SC_OK_CIPHER "302"
 #define SC_NO_ENCRYPT "303"
 #define SS_NO_ENCRYPT "Donot encrypt channel"
+#define SC_SESSION_KEY_RESUME "304"
+#define SC_RESUME_FAILED "305"
+#define SS_RESUME_FAILED "can not resume session key"
+#define SC_SESSION_KEY_X25519 "306"
 #define SC_BAD_KEY "400"
 #define SS_BAD_KEY "bad session key"
 
 
+#define RESUME_NONCE_LEN 20
+
 typedef struct  {
     int encrypt_channel;
+    gboolean can_resume;
+    unsigned char nonce[RESUME_NONCE_LEN];
+
+    /* the encrypted key and cipher offer, kept for the crypto thread */
+    unsigned char *enc_key;
+    int            enc_len;
+    char          *code_msg;
+    char          *key;
+    int            key_len;
 } CcnetRecvskey2ProcPriv;
 
 #define GET_PRIV(o)  \
@@ -45,6 +64,11 @@ static void handle_update (CcnetProcessor *processor,
 static void
 release_resource(CcnetProcessor *processor)
 {
+    USE_PRIV;
+
+    g_free (priv->enc_key);
+    g_free (priv->code_msg);
+    g_free (priv->key);
     CCNET_PROCESSOR_CLASS (ccnet_recvskey2_proc_parent_class)->release_resource (processor);
 }
 
@@ -55,6 +79,7 @@ ccnet_recvskey2_proc_class_init (CcnetRecvskey2ProcClass *klass)
     CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
 
     proc_class->name = "receive-skey2";
+    proc_class->control = TRUE;
     proc_class->start = start;
     proc_class->handle_update = handle_update;
     proc_class->release_resource = release_resource;
@@ -72,6 +97,8 @@ static int
 start (CcnetProcessor *processor, int argc, char **argv)
 {
     USE_PRIV;
+    GString *reason;
+    GString *content = NULL;
 
     if (processor->peer->session_key) {
         ccnet_processor_send_response (processor,
@@ -87,48 +114,199 @@ start (CcnetProcessor *processor, int argc, char **argv)
     else
         priv->encrypt_channel = 0;
 
+    reason = g_string_new (SS_SESSION_KEY);
+
+    /* offer a nonce for session resumption, see sendsessionkey-v2-proc.c */
+    if (ccnet_peer_can_resume (processor->peer)) {
+        char hex[RESUME_NONCE_LEN * 2 + 1];
+
+        RAND_pseudo_bytes (priv->nonce, RESUME_NONCE_LEN);
+        rawdata_to_hex (priv->nonce, hex, RESUME_NONCE_LEN);
+        g_string_append_printf (reason, " resume=%s", hex);
+        priv->can_resume = TRUE;
+    }
+
+    /* and our signed x25519 key, which old peers ignore */
+    if (session->x25519_key) {
+        g_string_append (reason, " x25519");
+        content = g_string_new_len ((char *)session->x25519_pub,
+                                    CCNET_X25519_KEY_LEN);
+        g_string_append_len (content, (char *)session->x25519_sig,
+                             session->x25519_sig_len);
+    }
+
     ccnet_processor_send_response (processor,
-                                   SC_SESSION_KEY, SS_SESSION_KEY,
-                                   NULL, 0);
+                                   SC_SESSION_KEY, reason->str,
+                                   content ? content->str : NULL,
+                                   content ? content->len : 0);
+    g_string_free (reason, TRUE);
+    if (content)
+        g_string_free (content, TRUE);
 
     return 0;
 }
 
-static unsigned char *
-decrypt_data (CcnetPeer *peer, const char *content, int clen, int *len_p)
+/* content is <nonce_a><proof>, see sendsessionkey-v2-proc.c */
+static gboolean
+resume_session_key (CcnetProcessor *processor, const char *content, int clen)
+{
+    USE_PRIV;
+    unsigned char nonces[RESUME_NONCE_LEN * 2];
+    unsigned char mac[CCNET_RESUME_SECRET_LEN];
+
+    if (!priv->can_resume || !ccnet_peer_can_resume (processor->peer) ||
+        clen != RESUME_NONCE_LEN + CCNET_RESUME_SECRET_LEN)
+        return FALSE;
+
+    memcpy (nonces, content, RESUME_NONCE_LEN);
+    memcpy (nonces + RESUME_NONCE_LEN, priv->nonce, RESUME_NONCE_LEN);
+
+    ccnet_peer_resume_mac (processor->peer, "skey-proof",
+                           nonces, sizeof(nonces), mac);
+    if (CRYPTO_memcmp (mac, content + RESUME_NONCE_LEN,
+                       CCNET_RESUME_SECRET_LEN) != 0)
+        return FALSE;
+
+    ccnet_peer_resume_mac (processor->peer, "session-key",
+                           nonces, sizeof(nonces), mac);
+    priv->key = g_malloc (CCNET_RESUME_SECRET_LEN * 2 + 1);
+    rawdata_to_hex (mac, priv->key, CCNET_RESUME_SECRET_LEN);
+    priv->key_len = CCNET_RESUME_SECRET_LEN * 2;
+
+    return TRUE;
+}
+
+#ifdef HAVE_X25519
+/* content is A's ephemeral x25519 key, see sendsessionkey-v2-proc.c */
+static gboolean
+agree_session_key (CcnetProcessor *processor, const char *content, int clen)
+{
+    USE_PRIV;
+    unsigned char secret[CCNET_X25519_KEY_LEN];
+
+    if (!session->x25519_key || clen != CCNET_X25519_KEY_LEN)
+        return FALSE;
+
+    if (x25519_derive (session->x25519_key, (const unsigned char *)content,
+                       secret) < 0)
+        return FALSE;
+
+    priv->key = g_malloc (41);
+    x25519_session_key (secret, (const unsigned char *)content,
+                        session->x25519_pub, priv->key);
+    priv->key_len = 40;
+    OPENSSL_cleanse (secret, sizeof(secret));
+
+    return TRUE;
+}
+#endif
+
+/* May run in a crypto thread, only touches the priv. */
+static void *
+decrypt_session_key (void *vprocessor)
 {
-    RSA *privkey = session->privkey;
+    CcnetProcessor *processor = vprocessor;
+    USE_PRIV;
     unsigned char *buf;
+    int len = 0;
 
-    buf = private_key_decrypt(privkey, (unsigned char *)content,
-                              clen, len_p);
-    if (*len_p <= 0) {
-        ccnet_warning ("failed to decrypt session key from peer %.10s",
-                       peer->id);
+    buf = private_key_decrypt (session->privkey, priv->enc_key,
+                               priv->enc_len, &len);
+    if (len <= 0) {
         g_free (buf);
-        buf = NULL;
+        return vprocessor;
     }
 
-    return buf;
+    priv->key = g_strndup ((char *)buf, len);
+    priv->key_len = len;
+    g_free (buf);
+
+    return vprocessor;
 }
 
-static gboolean
-update_peer_session_key (CcnetPeer *peer,
-                         const char *content,
-                         int clen)
+/* Pick the first cipher we support from "session key ciphers=a,b".
+ * Peers that don't offer any only speak AES-256-CBC.
+ */
+static int
+choose_cipher (const char *code_msg)
+{
+    const char *offer;
+    char **names;
+    int i, cipher = CCNET_CIPHER_AES_256_CBC;
+
+    if (!code_msg || !(offer = strstr (code_msg, "ciphers=")))
+        return cipher;
+
+    names = g_strsplit (offer + strlen("ciphers="), ",", -1);
+    for (i = 0; names[i]; i++) {
+        int c = ccnet_cipher_from_string (g_strstrip(names[i]));
+        if (c >= 0 && CCNET_CIPHER_IS_AEAD(c) && ccnet_cipher_is_supported (c)) {
+            cipher = c;
+            break;
+        }
+    }
+    g_strfreev (names);
+
+    return cipher;
+}
+
+static void
+on_session_key_decrypted (void *vprocessor)
 {
-    char *buf;
-    int key_len = 0;
+    CcnetProcessor *processor = vprocessor;
+    USE_PRIV;
 
-    buf = (char *)decrypt_data (peer, content, clen, &key_len);
-    if (buf) {
-        peer->session_key = g_strndup(buf, key_len);
-        g_free (buf);
-        return TRUE;
-    } else {
-        ccnet_warning ("faied to decrypt session key"); 
-        return FALSE;
+    /* another processor may have got the key in the meantime */
+    if (processor->peer->session_key) {
+        ccnet_processor_send_response (processor,
+                                       SC_ALREADY_HAS_KEY,
+                                       SS_ALREADY_HAS_KEY,
+                                       NULL, 0);
+        ccnet_processor_done (processor, TRUE);
+        return;
     }
+
+    if (!priv->key) {
+        ccnet_warning ("failed to decrypt session key from peer %.10s\n",
+                       processor->peer->id);
+        ccnet_processor_send_response (processor,
+                                       SC_BAD_KEY, SS_BAD_KEY,
+                                       NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    processor->peer->session_key = g_strndup (priv->key, priv->key_len);
+
+    if (priv->encrypt_channel) {
+        /* peer ask to encrypt channel, check whether we want it too */
+        if (ccnet_session_should_encrypt_channel(processor->session)) {
+            int cipher = choose_cipher (priv->code_msg);
+
+            /* send the ok reply first */
+            if (cipher == CCNET_CIPHER_AES_256_CBC)
+                ccnet_processor_send_response (processor,
+                                               SC_OK, SS_OK,
+                                               NULL, 0);
+            else
+                ccnet_processor_send_response (
+                    processor, SC_OK_CIPHER,
+                    ccnet_cipher_to_string (cipher), NULL, 0);
+            /* now setup encryption */
+            if (ccnet_peer_prepare_channel_encryption (processor->peer,
+                                                       cipher, FALSE) < 0)
+                /* this is very rare, we just print a warning */
+                ccnet_warning ("Error in prepare channel encryption\n");
+        } else
+            ccnet_processor_send_response (
+                processor, SC_NO_ENCRYPT, SS_NO_ENCRYPT, NULL, 0);
+    } else
+        ccnet_processor_send_response (
+            processor, SC_OK, SS_OK, NULL, 0);
+
+    ccnet_peer_manager_on_peer_session_key_received (processor->peer->manager,
+                                                     processor->peer);
+    ccnet_processor_done (processor, TRUE);
 }
 
 static void
@@ -148,37 +326,79 @@ handle_update (CcnetProcessor *processor,
             return;
         }
 
-        if (update_peer_session_key (processor->peer, content, clen) < 0) {
+        if (processor->thread_running || priv->enc_key) {
+            ccnet_warning ("[recv session key] duplicate session key\n");
+            return;
+        }
+
+        priv->can_resume = FALSE;
+        priv->enc_key = g_memdup (content, clen);
+        priv->enc_len = clen;
+        priv->code_msg = g_strdup (code_msg);
+
+#ifdef CCNET_SERVER
+        /* RSA decryption is slow, keep it off the main loop */
+        ccnet_processor_thread_create (processor,
+                                       processor->session->crypto_job_mgr,
+                                       decrypt_session_key,
+                                       on_session_key_decrypted,
+                                       processor);
+#else
+        decrypt_session_key (processor);
+        on_session_key_decrypted (processor);
+#endif
+        return;
+    }
+
+    if (strcmp(code, SC_SESSION_KEY_RESUME) == 0) {
+        if (processor->peer->session_key || priv->key) {
+            ccnet_processor_send_response (processor,
+                                           SC_ALREADY_HAS_KEY,
+                                           SS_ALREADY_HAS_KEY,
+                                           NULL, 0);
+            ccnet_processor_done (processor, TRUE);
+            return;
+        }
+
+        if (!resume_session_key (processor, content, clen)) {
+            /* the peer then sends the key with SC_SESSION_KEY */
+            ccnet_peer_clear_resume_secret (processor->peer);
+            priv->can_resume = FALSE;
             ccnet_processor_send_response (processor,
-                                           SC_BAD_KEY, SS_BAD_KEY,
+                                           SC_RESUME_FAILED, SS_RESUME_FAILED,
                                            NULL, 0);
-            ccnet_processor_done (processor, FALSE);
             return;
         }
 
-        if (priv->encrypt_channel) {
-            /* peer ask to encrypt channel, check whether we want it too */
-            if (ccnet_session_should_encrypt_channel(processor->session)) {
-                /* send the ok reply first */
-                ccnet_processor_send_response (processor,
-                                               SC_OK, SS_OK,
-                                               NULL, 0);
-                /* now setup encryption */
-                if (ccnet_peer_prepare_channel_encryption (processor->peer) < 0)
-                    /* this is very rare, we just print a warning */
-                    ccnet_warning ("Error in prepare channel encryption\n");
-            } else
-                ccnet_processor_send_response (
-                    processor, SC_NO_ENCRYPT, SS_NO_ENCRYPT, NULL, 0);
-        } else
-            ccnet_processor_send_response (
-                processor, SC_OK, SS_OK, NULL, 0);
+        priv->code_msg = g_strdup (code_msg);
+        on_session_key_decrypted (processor);
+        return;
+    }
 
-        ccnet_peer_manager_on_peer_session_key_received (processor->peer->manager,
-                                                         processor->peer);
-        ccnet_processor_done (processor, TRUE);
+#ifdef HAVE_X25519
+    if (strcmp(code, SC_SESSION_KEY_X25519) == 0) {
+        if (processor->peer->session_key) {
+            ccnet_processor_send_response (processor,
+                                           SC_ALREADY_HAS_KEY,
+                                           SS_ALREADY_HAS_KEY,
+                                           NULL, 0);
+            ccnet_processor_done (processor, TRUE);
+            return;
+        }
+
+        if (processor->thread_running || priv->key) {
+            ccnet_warning ("[recv session key] duplicate session key\n");
+            return;
+        }
+
+        /* the key agreement is cheap, no need for a thread */
+        priv->can_resume = FALSE;
+        agree_session_key (processor, content, clen);
+        priv->code_msg = g_strdup (code_msg);
+        on_session_key_decrypted (processor);
         return;
     }
+#endif
      
     ccnet_warning ("[recv session key] bad update %s:%s\n",
                    code, code_msg);
@@ -5,6 +5,11 @@
 #include <searpc-server.h>
 #include "rpcserver-proc.h"
 #include "rpc-common.h"
+#include "session.h"
+#include "rpc-service.h"
+#include "rpc-cache.h"
+#include "rpc-capture.h"
+#include "peer.h"
 
 #define DEBUG_FLAG CCNET_DEBUG_PEER
 #include "log.h"
@@ -13,6 +18,9 @@ typedef struct {
     char *buf;
     int   len;
     int   off;
+    int   stream;               /* push the result without SC_CLIENT_MORE */
+    int   credits;              /* chunks we may send before next credit */
+    int   paused;               /* output to the peer is congested */
     /* struct timeval start; */
 } CcnetRpcserverProcPriv;
 
@@ -21,7 +29,12 @@ typedef struct {
 
 G_DEFINE_TYPE (CcnetRpcserverProc, ccnet_rpcserver_proc, CCNET_TYPE_PROCESSOR)
 
+/* Chunk size for the result, jumbo packets allow larger chunks. */
+#define max_transfer_length(processor) \
+    (ccnet_peer_max_payload_len ((processor)->peer) - MESSAGE_HEADER)
+
 static int start (CcnetProcessor *processor, int argc, char **argv);
+static void flow_control (CcnetProcessor *processor, gboolean paused);
 static void handle_update (CcnetProcessor *processor,
                            char *code, char *code_msg,
                            char *content, int clen);
@@ -29,13 +42,17 @@ static void handle_update (CcnetProcessor *processor,
 static void
 release_resource(CcnetProcessor *processor)
 {
-    /* CcnetRpcserverProcPriv *priv = GET_PRIV (processor); */
+    CcnetRpcserverProcPriv *priv = GET_PRIV (processor);
     /* struct timeval end, intv; */
 
     /* gettimeofday(&end, NULL); */
     /* timersub(&end, &priv->start, &intv); */
     /* fprintf (stdout, "[rpcserver] Time spend in proc: %ds %dus\n", */
     /*          intv.tv_sec, intv.tv_usec); */
+
+    /* reset for reuse */
+    g_free (priv->buf);
+    memset (priv, 0, sizeof(CcnetRpcserverProcPriv));
     
     CCNET_PROCESSOR_CLASS (ccnet_rpcserver_proc_parent_class)->release_resource (processor);
 }
@@ -49,7 +66,9 @@ ccnet_rpcserver_proc_class_init (CcnetRpcserverProcClass *klass)
     proc_class->start = start;
     proc_class->handle_update = handle_update;
     proc_class->release_resource = release_resource;
+    proc_class->flow_control = flow_control;
     proc_class->name = "rpcserver-proc";
+    proc_class->reusable = TRUE;
 
     g_type_class_add_private (klass, sizeof(CcnetRpcserverProcPriv));
 }
@@ -71,6 +90,95 @@ start (CcnetProcessor *processor, int argc, char **argv)
 }
 
 
+/* Return the window asked for in a SC_CLIENT_CALL, or 0 for the
+ * stop-and-wait mode.
+ */
+static int
+parse_stream_window (const char *code_msg)
+{
+    int window;
+
+    if (!code_msg || strncmp (code_msg, SS_CLIENT_CALL_STREAM,
+                              strlen(SS_CLIENT_CALL_STREAM)) != 0)
+        return 0;
+
+    window = atoi (code_msg + strlen(SS_CLIENT_CALL_STREAM));
+    if (window <= 0)
+        window = RPC_STREAM_WINDOW;
+    return MIN (window, RPC_STREAM_MAX_WINDOW);
+}
+
+/* Send as many chunks as the credits allow, and the last one when
+ * it's reached.
+ */
+static void
+send_stream_chunks (CcnetProcessor *processor)
+{
+    CcnetRpcserverProcPriv *priv = GET_PRIV (processor);
+    int chunk = max_transfer_length (processor);
+
+    if (priv->paused)
+        return;
+
+    while (priv->credits > 0 && priv->off + chunk < priv->len) {
+        ccnet_processor_send_response (
+            processor, SC_SERVER_STREAM, SS_SERVER_STREAM,
+            priv->buf + priv->off, chunk);
+        priv->off += chunk;
+        priv->credits--;
+        /* set by flow_control() while sending */
+        if (priv->paused)
+            return;
+    }
+
+    if (priv->off + chunk >= priv->len) {
+        ccnet_processor_send_response (
+            processor, SC_SERVER_RET, SS_SERVER_RET,
+            priv->buf + priv->off, priv->len - priv->off);
+        g_free (priv->buf);
+        priv->buf = NULL;
+    }
+}
+
+static void
+flow_control (CcnetProcessor *processor, gboolean paused)
+{
+    CcnetRpcserverProcPriv *priv = GET_PRIV (processor);
+
+    priv->paused = paused;
+    if (!paused && priv->stream && priv->buf)
+        send_stream_chunks (processor);
+}
+
+/* Run the calls of a SC_CLIENT_BATCH, NULL if it is malformed. */
+static char *
+call_batch (const char *svc_name, const char *content, int clen,
+            gint64 t_capture, gsize *ret_len)
+{
+    const char *ptr = content, *end = content + clen, *fcall;
+    GString *buf = g_string_new (NULL);
+    gsize len, rlen;
+    char *ret;
+    int n = 0;
+
+    while (ptr < end) {
+        if (++n > RPC_BATCH_MAX ||
+            rpc_batch_next (&ptr, end, &fcall, &len) < 0) {
+            g_string_free (buf, TRUE);
+            return NULL;
+        }
+        ret = ccnet_rpc_cache_call (svc_name, (char *)fcall, len, &rlen);
+        if (t_capture)
+            ccnet_rpc_capture_record (svc_name, fcall, len, t_capture,
+                                      rlen, TRUE);
+        rpc_batch_append (buf, ret, rlen);
+        g_free (ret);
+    }
+
+    *ret_len = buf->len;
+    return g_string_free (buf, FALSE);
+}
+
 static void
 handle_update (CcnetProcessor *processor,
                char *code, char *code_msg,
@@ -78,13 +186,29 @@ handle_update (CcnetProcessor *processor,
 {
     CcnetRpcserverProcPriv *priv = GET_PRIV (processor);
 
-    if (memcmp (code, SC_CLIENT_CALL, 3) == 0) {
+    if (memcmp (code, SC_CLIENT_CALL, 3) == 0 ||
+        memcmp (code, SC_CLIENT_BATCH, 3) == 0 ||
+        memcmp (code, SC_CLIENT_BINARY, 3) == 0) {
+        gint64 t_capture = ccnet_rpc_capture_sample ();
         gsize ret_len;
         char *svc_name = processor->name;
-        char *ret = searpc_server_call_function (svc_name, content, clen, &ret_len);
+        char *ret;
+
+        if (memcmp (code, SC_CLIENT_BATCH, 3) == 0) {
+            ret = call_batch (svc_name, content, clen, t_capture, &ret_len);
+            if (!ret)
+                goto bad_update;
+        } else if (memcmp (code, SC_CLIENT_BINARY, 3) == 0)
+            ret = ccnet_rpc_binary_call (svc_name, content, clen, &ret_len);
+        else {
+            ret = ccnet_rpc_cache_call (svc_name, content, clen, &ret_len);
+            if (t_capture)
+                ccnet_rpc_capture_record (svc_name, content, clen, t_capture,
+                                          ret_len, FALSE);
+        }
 
         g_assert (ret);
-        if (ret_len < MAX_TRANSFER_LENGTH) {
+        if (ret_len < max_transfer_length (processor)) {
             ccnet_processor_send_response (
                 processor, SC_SERVER_RET, SS_SERVER_RET, ret, ret_len);
             g_free (ret);
@@ -93,37 +217,58 @@ handle_update (CcnetProcessor *processor,
         }
 
         /* we need to split data into multiple segments */
+        g_free (priv->buf);
         priv->buf = ret;
         priv->len = ret_len;
         priv->off = 0;
+        priv->credits = parse_stream_window (code_msg);
+        priv->stream = (priv->credits > 0);
+        priv->paused = ccnet_peer_is_congested (processor->peer);
+
+        if (priv->stream) {
+            send_stream_chunks (processor);
+            return;
+        }
         
         /* fprintf (stderr, "Send %d\n", MAX_TRANSFER_LENGTH); */
         ccnet_processor_send_response (processor, SC_SERVER_MORE,
                                        SS_SERVER_MORE, priv->buf,
-                                       MAX_TRANSFER_LENGTH);
-        priv->off = MAX_TRANSFER_LENGTH;
+                                       max_transfer_length (processor));
+        priv->off = max_transfer_length (processor);
 
         return;
     }
 
+    if (memcmp (code, SC_CLIENT_CREDIT, 3) == 0) {
+        /* Credits may still arrive after the last chunk was sent. */
+        if (priv->stream && priv->buf) {
+            priv->credits += atoi (code_msg ? code_msg : "");
+            priv->credits = MIN (priv->credits, RPC_STREAM_MAX_WINDOW);
+            send_stream_chunks (processor);
+        }
+        return;
+    }
+
     if (memcmp (code, SC_CLIENT_MORE, 3) == 0) {
-        if (priv->off + MAX_TRANSFER_LENGTH < priv->len) {
+        if (priv->off + max_transfer_length (processor) < priv->len) {
             /* fprintf (stderr, "Send %d\n", MAX_TRANSFER_LENGTH); */
             ccnet_processor_send_response (
                 processor, SC_SERVER_MORE, SS_SERVER_MORE,
-                priv->buf + priv->off, MAX_TRANSFER_LENGTH);
-            priv->off += MAX_TRANSFER_LENGTH;
+                priv->buf + priv->off, max_transfer_length (processor));
+            priv->off += max_transfer_length (processor);
         } else {
             /* fprintf (stderr, "Send %d\n", priv->len - priv->off); */
             ccnet_processor_send_response (
                 processor, SC_SERVER_RET, SS_SERVER_RET,
                 priv->buf + priv->off, priv->len - priv->off);
             g_free (priv->buf);
+            priv->buf = NULL;
             /* ccnet_processor_done (processor, TRUE); */
         }
         return;
     }
 
+bad_update:
     ccnet_processor_send_response (processor, SC_BAD_UPDATE_CODE,
                                    SS_BAD_UPDATE_CODE, NULL, 0);
 
@@ -131,5 +276,6 @@ handle_update (CcnetProcessor *processor,
 
     if (priv->buf)
         g_free (priv->buf);
+    priv->buf = NULL;
     ccnet_processor_done (processor, FALSE);
 }
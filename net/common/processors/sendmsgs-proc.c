@@ -0,0 +1,281 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "timer.h"
+
+#include "session.h"
+#include "peer.h"
+#include "message.h"
+#include "sendmsgs-proc.h"
+#include "algorithms.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_MESSAGE
+#include "log.h"
+
+/*
+ * Streams messages to a peer over one long-lived processor, instead of
+ * a send-msg processor per message.
+ *
+ *   Master                       Slave
+ *            receive-msgs
+ *        ----------------------->
+ *            200 OK
+ *        <-----------------------
+ *            301 <message>        at most MAX_IN_FLIGHT not acked
+ *        ----------------------->
+ *            302 <n>              n messages handled so far
+ *        <-----------------------
+ *
+ * The stream is closed after IDLE_TIMEOUT seconds without messages. If
+ * the peer doesn't know receive-msgs, the queued messages are sent
+ * again with send-msg and the peer is marked so.
+ */
+
+#define SC_MSG  "301"
+#define SC_ACK  "302"
+
+#define MAX_IN_FLIGHT      256
+#define IDLE_TIMEOUT       60           /* seconds */
+#define IDLE_CHECK_INTERVAL 15000       /* ms */
+
+enum {
+    REQUEST_SENT,
+    STREAMING
+};
+
+typedef struct {
+    guint32       seq;
+    SendmsgsAckCB cb;
+    void         *data;
+} AckWaiter;
+
+typedef struct  {
+    GQueue     *pending;
+    GString    *buf;
+    guint32     n_queued;
+    guint32     n_sent;
+    guint32     n_acked;
+    GList      *waiters;
+    time_t      last_activity;
+    CcnetTimer *idle_timer;
+} CcnetSendmsgsProcPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), CCNET_TYPE_SENDMSGS_PROC, CcnetSendmsgsProcPriv))
+
+static int send_msgs_start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_response (CcnetProcessor *processor,
+                             char *code, char *code_msg,
+                             char *content, int clen);
+
+G_DEFINE_TYPE (CcnetSendmsgsProc, ccnet_sendmsgs_proc, CCNET_TYPE_PROCESSOR)
+
+static void
+release_resource(CcnetProcessor *processor)
+{
+    CcnetSendmsgsProcPriv *priv = GET_PRIV (processor);
+    CcnetPeer *peer = processor->peer;
+    CcnetMessage *msg;
+    gboolean resend = FALSE;
+    GList *ptr;
+
+    if (peer->msg_stream == processor)
+        peer->msg_stream = NULL;
+
+    if (processor->state == REQUEST_SENT &&
+        processor->failure == PROC_NO_SERVICE) {
+        ccnet_debug ("[msg] %.8s doesn't support message streams\n",
+                     peer->id);
+        peer->no_msg_stream = 1;
+        resend = TRUE;
+    }
+
+    ccnet_timer_free (&priv->idle_timer);
+
+    for (ptr = priv->waiters; ptr; ptr = ptr->next) {
+        AckWaiter *w = ptr->data;
+        w->cb (FALSE, w->data);
+        g_free (w);
+    }
+    g_list_free (priv->waiters);
+
+    if (priv->pending) {
+        while ((msg = g_queue_pop_head (priv->pending)) != NULL) {
+            if (resend)
+                ccnet_send_message (processor->session, msg);
+            ccnet_message_unref (msg);
+        }
+        g_queue_free (priv->pending);
+    }
+    if (priv->buf)
+        g_string_free (priv->buf, TRUE);
+
+    memset (priv, 0, sizeof(CcnetSendmsgsProcPriv));
+
+    CCNET_PROCESSOR_CLASS (ccnet_sendmsgs_proc_parent_class)->release_resource (processor);
+}
+
+static void
+ccnet_sendmsgs_proc_class_init (CcnetSendmsgsProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "sendmsgs-proc";
+    proc_class->start = send_msgs_start;
+    proc_class->handle_response = handle_response;
+    proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof (CcnetSendmsgsProcPriv));
+}
+
+static void
+ccnet_sendmsgs_proc_init (CcnetSendmsgsProc *processor)
+{
+}
+
+static int
+check_idle (void *vprocessor)
+{
+    CcnetProcessor *processor = vprocessor;
+    CcnetSendmsgsProcPriv *priv = GET_PRIV (processor);
+
+    if (processor->state != STREAMING ||
+        !g_queue_is_empty (priv->pending) ||
+        priv->n_acked != priv->n_sent ||
+        time(NULL) - priv->last_activity < IDLE_TIMEOUT)
+        return TRUE;
+
+    priv->idle_timer = NULL;
+    ccnet_processor_done (processor, TRUE);
+    return FALSE;
+}
+
+static int
+send_msgs_start (CcnetProcessor *processor, int argc, char **argv)
+{
+    CcnetSendmsgsProcPriv *priv = GET_PRIV (processor);
+
+    if (!priv->pending)
+        priv->pending = g_queue_new ();
+    priv->buf = g_string_new (NULL);
+    priv->last_activity = time(NULL);
+    priv->idle_timer = ccnet_timer_new (check_idle, processor,
+                                        IDLE_CHECK_INTERVAL);
+
+    ccnet_processor_send_request (processor, "receive-msgs");
+    processor->state = REQUEST_SENT;
+
+    return 0;
+}
+
+static void
+send_pending (CcnetProcessor *processor)
+{
+    CcnetSendmsgsProcPriv *priv = GET_PRIV (processor);
+    CcnetMessage *msg;
+
+    while (priv->n_sent - priv->n_acked < MAX_IN_FLIGHT &&
+           (msg = g_queue_pop_head (priv->pending)) != NULL) {
+        ccnet_message_to_string_buf (msg, priv->buf);
+        ccnet_processor_send_update (processor, SC_MSG, NULL,
+                                     priv->buf->str,
+                                     priv->buf->len+1); /* including '\0' */
+        ccnet_message_unref (msg);
+        ++priv->n_sent;
+    }
+}
+
+static void
+notify_waiters (CcnetSendmsgsProcPriv *priv)
+{
+    GList *ptr = priv->waiters, *next;
+    AckWaiter *w;
+
+    while (ptr) {
+        next = ptr->next;
+        w = ptr->data;
+        if ((gint32)(priv->n_acked - w->seq) >= 0) {
+            priv->waiters = g_list_delete_link (priv->waiters, ptr);
+            w->cb (TRUE, w->data);
+            g_free (w);
+        }
+        ptr = next;
+    }
+}
+
+static void
+handle_response (CcnetProcessor *processor,
+                 char *code, char *code_msg,
+                 char *content, int clen)
+{
+    CcnetSendmsgsProcPriv *priv = GET_PRIV (processor);
+    guint32 acked;
+
+    switch (processor->state) {
+    case REQUEST_SENT:
+        if (memcmp (code, "200", 3) != 0) {
+            ccnet_processor_done (processor, FALSE);
+            return;
+        }
+        processor->state = STREAMING;
+        send_pending (processor);
+        break;
+    case STREAMING:
+        if (memcmp (code, SC_ACK, 3) != 0 || !content ||
+            content[clen - 1] != '\0') {
+            ccnet_warning ("[msg] Bad response from %.8s: %s %s\n",
+                           processor->peer->id, code, code_msg);
+            ccnet_processor_done (processor, FALSE);
+            return;
+        }
+        acked = strtoul (content, NULL, 10);
+        /* acks are cumulative, compared modulo 2^32 */
+        if ((gint32)(acked - priv->n_acked) > 0 &&
+            (gint32)(priv->n_sent - acked) >= 0)
+            priv->n_acked = acked;
+        notify_waiters (priv);
+        send_pending (processor);
+        break;
+    default:
+        break;
+    }
+}
+
+void
+ccnet_sendmsgs_proc_put_message (CcnetSendmsgsProc *proc,
+                                 CcnetMessage *msg)
+{
+    CcnetProcessor *processor = CCNET_PROCESSOR (proc);
+    CcnetSendmsgsProcPriv *priv = GET_PRIV (proc);
+
+    if (!priv->pending)
+        priv->pending = g_queue_new ();
+
+    ccnet_message_ref (msg);
+    g_queue_push_tail (priv->pending, msg);
+    ++priv->n_queued;
+    priv->last_activity = time(NULL);
+
+    if (processor->state == STREAMING)
+        send_pending (processor);
+}
+
+void
+ccnet_sendmsgs_proc_wait_ack (CcnetSendmsgsProc *proc,
+                              SendmsgsAckCB cb, void *data)
+{
+    CcnetSendmsgsProcPriv *priv = GET_PRIV (proc);
+    AckWaiter *w;
+
+    if (priv->n_acked == priv->n_queued) {
+        cb (TRUE, data);
+        return;
+    }
+
+    w = g_new0 (AckWaiter, 1);
+    w->seq = priv->n_queued;
+    w->cb = cb;
+    w->data = data;
+    priv->waiters = g_list_append (priv->waiters, w);
+}
@@ -0,0 +1,43 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_SENDMSGS_PROC_H
+#define CCNET_SENDMSGS_PROC_H
+
+#include <glib-object.h>
+
+#include "processor.h"
+#include "message.h"
+
+#define CCNET_TYPE_SENDMSGS_PROC                  (ccnet_sendmsgs_proc_get_type ())
+#define CCNET_SENDMSGS_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), CCNET_TYPE_SENDMSGS_PROC, CcnetSendmsgsProc))
+#define CCNET_IS_SENDMSGS_PROC(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), CCNET_TYPE_SENDMSGS_PROC))
+#define CCNET_SENDMSGS_PROC_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), CCNET_TYPE_SENDMSGS_PROC, CcnetSendmsgsProcClass))
+#define CCNET_IS_SENDMSGS_PROC_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), CCNET_TYPE_SENDMSGS_PROC))
+#define CCNET_SENDMSGS_PROC_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), CCNET_TYPE_SENDMSGS_PROC, CcnetSendmsgsProcClass))
+
+typedef struct _CcnetSendmsgsProc CcnetSendmsgsProc;
+typedef struct _CcnetSendmsgsProcClass CcnetSendmsgsProcClass;
+
+struct _CcnetSendmsgsProc {
+    CcnetProcessor parent_instance;
+};
+
+struct _CcnetSendmsgsProcClass {
+    CcnetProcessorClass parent_class;
+};
+
+GType ccnet_sendmsgs_proc_get_type ();
+
+/* Queue @msg on the stream. It is sent as soon as the stream is
+ * accepted by the peer and the window allows. */
+void ccnet_sendmsgs_proc_put_message (CcnetSendmsgsProc *proc,
+                                      CcnetMessage *msg);
+
+typedef void (*SendmsgsAckCB) (gboolean acked, void *data);
+
+/* Call @cb once the messages queued so far are all acked, or with
+ * FALSE if the stream ends before that. */
+void ccnet_sendmsgs_proc_wait_ack (CcnetSendmsgsProc *proc,
+                                   SendmsgsAckCB cb, void *data);
+
+#endif
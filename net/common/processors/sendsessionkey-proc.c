@@ -77,6 +77,7 @@ ccnet_sendsessionkey_proc_class_init (CcnetSendsessionkeyProcClass *klass)
     CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
 
     proc_class->name = "send-session-key";
+    proc_class->control = TRUE;
     proc_class->start = start;
     proc_class->handle_response = handle_response;
     proc_class->release_resource = release_resource;
@@ -11,11 +11,36 @@
              SC_SESSION_KEY
         <-------------------------------
 
-             SC_SESSION_KEY <key> (encrypted with B's pubkey)
+             SC_SESSION_KEY [ciphers=<c1>,<c2>] <key> (encrypted with B's pubkey)
         ---------------------------->
 
-             SC_OK_ENCRYPT Or SC_NO_ENCRYPT
+             SC_OK_ENCRYPT, SC_OK_CIPHER <cipher> Or SC_NO_ENCRYPT
         <------------------------------------------
+
+  The AEAD ciphers A supports are offered in the status message of the
+  session key update, which old peers ignore. B answers SC_OK_CIPHER with
+  the cipher it picked, or a plain SC_OK, which means AES-256-CBC.
+
+  If B still has a resume secret for A, its SC_SESSION_KEY carries
+  "resume=<nonce_b>". When A has the secret too, it skips RSA:
+
+             SC_SESSION_KEY_RESUME [ciphers=...] <nonce_a><proof>
+        ---------------------------->
+
+  where proof = HMAC(secret, "skey-proof" nonce_a nonce_b), and both sides
+  use hex(HMAC(secret, "session-key" nonce_a nonce_b)) as the key. B
+  answers as above, or SC_RESUME_FAILED after which A sends SC_SESSION_KEY.
+
+  B may also add "x25519" to its SC_SESSION_KEY, with <pub_b><sig> as
+  content: a static X25519 key and an RSA signature over it made once at
+  startup. If the signature checks out with B's pubkey, A agrees on the
+  key instead of encrypting one with RSA:
+
+             SC_SESSION_KEY_X25519 [ciphers=...] <pub_a> (ephemeral)
+        ---------------------------->
+
+  and both sides use hex(SHA1(X25519(a, pub_b) pub_a pub_b)), so neither
+  does an RSA private key operation. Resumption is still preferred.
 */
 
 #include <openssl/sha.h>
@@ -23,7 +48,7 @@
 
 #include "session.h"
 #include "common.h"
-#include "processor.h"
+#include "co-processor.h"
 #include "peer-mgr.h"
 #include "peer.h"
 #include "log.h"
@@ -35,40 +60,32 @@
 #define SS_SESSION_KEY "session key"
 #define SC_ALREADY_HAS_KEY "301"
 #define SS_ALREADY_HAS_KEY "already has your session key"
+#define SC_OK_CIPHER "302"
 #define SC_NO_ENCRYPT "303"
 #define SS_NO_ENCRYPT "Donot encrypt channel"
+#define SC_SESSION_KEY_RESUME "304"
+#define SC_RESUME_FAILED "305"
+#define SC_SESSION_KEY_X25519 "306"
 #define SC_BAD_KEY "400"
 #define SS_BAD_KEY "bad session key"
 
 
-enum {
-    INIT = 0,
-    REQUEST_SENT,
-    SESSION_KEY_SENT,
-};
-
-typedef struct  {
-    char key[40];
-    int state;
-} CcnetSendskey2ProcPriv;
-
-#define GET_PRIV(o)  \
-   (G_TYPE_INSTANCE_GET_PRIVATE ((o), CCNET_TYPE_SENDSKEY2_PROC, CcnetSendskey2ProcPriv))
+#define RESUME_NONCE_LEN 20
 
-#define USE_PRIV \
-    CcnetSendskey2ProcPriv *priv = GET_PRIV(processor);
+G_DEFINE_TYPE (CcnetSendskey2Proc, ccnet_sendskey2_proc, CCNET_TYPE_CO_PROCESSOR)
 
-
-G_DEFINE_TYPE (CcnetSendskey2Proc, ccnet_sendskey2_proc, CCNET_TYPE_PROCESSOR)
-
-static int start (CcnetProcessor *processor, int argc, char **argv);
-static void handle_response (CcnetProcessor *processor,
-                             char *code, char *code_msg,
-                             char *content, int clen);
+static void run (CcnetCoProcessor *co);
 
 static void
 release_resource(CcnetProcessor *processor)
 {
+    CcnetSendskey2Proc *proc = CCNET_SENDSKEY2_PROC (processor);
+
+    if (proc->pubkey)
+        RSA_free (proc->pubkey);
+    proc->pubkey = NULL;
+    g_free (proc->enc_out);
+    proc->enc_out = NULL;
     CCNET_PROCESSOR_CLASS (ccnet_sendskey2_proc_parent_class)->release_resource (processor);
 }
 
@@ -77,13 +94,12 @@ static void
 ccnet_sendskey2_proc_class_init (CcnetSendskey2ProcClass *klass)
 {
     CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+    CcnetCoProcessorClass *co_class = CCNET_CO_PROCESSOR_CLASS (klass);
 
     proc_class->name = "send-skey2";
-    proc_class->start = start;
-    proc_class->handle_response = handle_response;
+    proc_class->control = TRUE;
     proc_class->release_resource = release_resource;
-
-    g_type_class_add_private (klass, sizeof (CcnetSendskey2ProcPriv));
+    co_class->run = run;
 }
 
 static void
@@ -91,38 +107,17 @@ ccnet_sendskey2_proc_init (CcnetSendskey2Proc *processor)
 {
 }
 
-
-static int
-start (CcnetProcessor *processor, int argc, char **argv)
+/* random bytes -> sha1 -> pubkey_encrypt -> transmit to peer.
+ * May run in a crypto thread, so it only touches the instance fields.
+ */
+static void *
+generate_session_key (void *vproc)
 {
-    USE_PRIV;
-    if (argc != 0) {
-        ccnet_processor_done (processor, FALSE);
-        return -1;
-    }
-
-    gboolean encrypt_channel = ccnet_session_should_encrypt_channel (
-        processor->session);
-
-    if (encrypt_channel)
-        ccnet_processor_send_request (processor, "receive-skey2 --enc-channel");
-    else
-        ccnet_processor_send_request (processor, "receive-skey2");
-
-    priv->state = REQUEST_SENT;
-
-    return 0;
-}
-
-/* random bytes -> sha1 -> pubkey_encrypt -> transmit to peer */
-static unsigned char *
-generate_session_key (CcnetProcessor *processor, int *len_p)
-{
-    USE_PRIV;
-    CcnetPeer *peer = processor->peer;
+    CcnetSendskey2Proc *proc = vproc;
     unsigned char sha1[20];
     unsigned char *enc_out = NULL; 
     unsigned char random_buf[40];
+    int len = 0;
     SHA_CTX s;
 
     RAND_pseudo_bytes (random_buf, sizeof(random_buf));
@@ -131,67 +126,270 @@ generate_session_key (CcnetProcessor *processor, int *len_p)
     SHA1_Update (&s, random_buf, sizeof(random_buf));
     SHA1_Final (sha1, &s);
 
-    rawdata_to_hex (sha1, priv->key, 20);
+    rawdata_to_hex (sha1, proc->key, 20);
 
-    enc_out = public_key_encrypt (peer->pubkey, (unsigned char *)priv->key,
-                                  40, len_p);
+    enc_out = public_key_encrypt (proc->pubkey, (unsigned char *)proc->key,
+                                  40, &len);
 
-    if (*len_p <= 0) {
+    if (len <= 0) {
         g_free (enc_out);
-        return NULL;
+        return vproc;
+    }
+
+    proc->enc_out = enc_out;
+    proc->enc_len = len;
+
+    return vproc;
+}
+
+/* AEAD ciphers we can offer, in order of preference. */
+static char *
+get_cipher_offer ()
+{
+    static const int ciphers[] = {
+        CCNET_CIPHER_AES_256_GCM,
+        CCNET_CIPHER_CHACHA20_POLY1305,
+    };
+    GString *buf = g_string_new (SS_SESSION_KEY);
+    gboolean first = TRUE;
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(ciphers); i++) {
+        if (!ccnet_cipher_is_supported (ciphers[i]))
+            continue;
+        g_string_append (buf, first ? " ciphers=" : ",");
+        g_string_append (buf, ccnet_cipher_to_string (ciphers[i]));
+        first = FALSE;
+    }
+
+    return g_string_free (buf, FALSE);
+}
+
+static char *
+get_key_reason (CcnetProcessor *processor)
+{
+    if (ccnet_session_should_encrypt_channel (processor->session))
+        return get_cipher_offer ();
+    else
+        return g_strdup (SS_SESSION_KEY);
+}
+
+/* "session key resume=<hex>" from peers holding a resume secret */
+static gboolean
+parse_resume_nonce (const char *code_msg, unsigned char *nonce)
+{
+    const char *p;
+
+    if (!code_msg || !(p = strstr (code_msg, "resume=")))
+        return FALSE;
+    p += strlen("resume=");
+    if (strlen(p) < RESUME_NONCE_LEN * 2)
+        return FALSE;
+
+    return hex_to_rawdata (p, nonce, RESUME_NONCE_LEN) == 0;
+}
+
+static void
+send_resume_key (CcnetSendskey2Proc *proc, const unsigned char *nonce_b)
+{
+    CcnetProcessor *processor = CCNET_PROCESSOR (proc);
+    unsigned char nonces[RESUME_NONCE_LEN * 2];
+    unsigned char buf[RESUME_NONCE_LEN + CCNET_RESUME_SECRET_LEN];
+    unsigned char key[CCNET_RESUME_SECRET_LEN];
+    char *reason;
+
+    RAND_pseudo_bytes (nonces, RESUME_NONCE_LEN);
+    memcpy (nonces + RESUME_NONCE_LEN, nonce_b, RESUME_NONCE_LEN);
+
+    memcpy (buf, nonces, RESUME_NONCE_LEN);
+    ccnet_peer_resume_mac (processor->peer, "skey-proof",
+                           nonces, sizeof(nonces), buf + RESUME_NONCE_LEN);
+    ccnet_peer_resume_mac (processor->peer, "session-key",
+                           nonces, sizeof(nonces), key);
+    rawdata_to_hex (key, proc->key, CCNET_RESUME_SECRET_LEN);
+
+    reason = get_key_reason (processor);
+    ccnet_processor_send_update (processor, SC_SESSION_KEY_RESUME, reason,
+                                 (char *)buf, sizeof(buf));
+    g_free (reason);
+}
+
+/* B's key from a "x25519" SC_SESSION_KEY. Checking the signature is a
+ * public key operation, cheap enough for the main loop. */
+static gboolean
+parse_x25519_offer (CcnetSendskey2Proc *proc)
+{
+#ifdef HAVE_X25519
+    CcnetProcessor *processor = CCNET_PROCESSOR (proc);
+    CcnetCoProcessor *co = CCNET_CO_PROCESSOR (proc);
+    const unsigned char *content = (const unsigned char *)co->content;
+
+    if (!processor->session->x25519_key || !processor->peer->pubkey)
+        return FALSE;
+    if (!co->code_msg || !strstr (co->code_msg, " x25519") ||
+        co->clen <= CCNET_X25519_KEY_LEN)
+        return FALSE;
+
+    if (!x25519_verify_pub (processor->peer->pubkey, content,
+                            content + CCNET_X25519_KEY_LEN,
+                            co->clen - CCNET_X25519_KEY_LEN)) {
+        ccnet_warning ("bad x25519 key signature from peer %.10s\n",
+                       processor->peer->id);
+        return FALSE;
     }
 
-    return enc_out;
+    memcpy (proc->x_pub, content, CCNET_X25519_KEY_LEN);
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+static gboolean
+send_x25519_key (CcnetSendskey2Proc *proc)
+{
+#ifdef HAVE_X25519
+    CcnetProcessor *processor = CCNET_PROCESSOR (proc);
+    unsigned char pub[CCNET_X25519_KEY_LEN];
+    unsigned char secret[CCNET_X25519_KEY_LEN];
+    EVP_PKEY *key;
+    char *reason;
+    int ret;
+
+    if (!(key = x25519_generate_key (pub)))
+        return FALSE;
+    ret = x25519_derive (key, proc->x_pub, secret);
+    EVP_PKEY_free (key);
+    if (ret < 0)
+        return FALSE;
+
+    x25519_session_key (secret, pub, proc->x_pub, proc->key);
+    OPENSSL_cleanse (secret, sizeof(secret));
+
+    reason = get_key_reason (processor);
+    ccnet_processor_send_update (processor, SC_SESSION_KEY_X25519, reason,
+                                 (char *)pub, sizeof(pub));
+    g_free (reason);
+    return TRUE;
+#else
+    return FALSE;
+#endif
 }
 
 static void
-handle_response (CcnetProcessor *processor,
-                 char *code, char *code_msg,
-                 char *content, int clen)
+send_session_key (CcnetSendskey2Proc *proc)
 {
-    USE_PRIV;
-    if (strcmp(code, SC_SESSION_KEY) == 0 && priv->state == REQUEST_SENT) {
-        unsigned char *enc_out = NULL;
-        int len = 0;
-
-        enc_out = generate_session_key(processor, &len);
-        if (enc_out) {
-            ccnet_processor_send_update (processor,
-                                         SC_SESSION_KEY,
-                                         SS_SESSION_KEY,
-                                         (char *)enc_out, len);
-            g_free (enc_out);
-            priv->state = SESSION_KEY_SENT;
-            
-        } else {
-            ccnet_warning ("failed to generate session key for peer %.10s\n",
+    CcnetProcessor *processor = CCNET_PROCESSOR (proc);
+    char *reason = get_key_reason (processor);
+
+    ccnet_processor_send_update (processor,
+                                 SC_SESSION_KEY,
+                                 reason,
+                                 (char *)proc->enc_out, proc->enc_len);
+    g_free (reason);
+    g_free (proc->enc_out);
+    proc->enc_out = NULL;
+}
+
+static void
+on_key_accepted (CcnetSendskey2Proc *proc, int cipher)
+{
+    CcnetProcessor *processor = CCNET_PROCESSOR (proc);
+
+    processor->peer->session_key = g_strndup(proc->key, 40);
+
+    if (cipher >= 0 &&
+        ccnet_session_should_encrypt_channel (processor->session))
+        ccnet_peer_prepare_channel_encryption (processor->peer, cipher, TRUE);
+
+    ccnet_peer_manager_on_peer_session_key_sent (processor->peer->manager,
+                                                 processor->peer);
+}
+
+static void
+run (CcnetCoProcessor *co)
+{
+    CcnetProcessor *processor = CCNET_PROCESSOR (co);
+    CcnetSendskey2Proc *proc = CCNET_SENDSKEY2_PROC (co);
+    unsigned char nonce_b[RESUME_NONCE_LEN];
+    int cipher;
+
+    CO_BEGIN (co);
+
+    if (co->argc != 0)
+        CO_DONE (co, FALSE);
+
+    if (ccnet_session_should_encrypt_channel (processor->session))
+        ccnet_processor_send_request (processor, "receive-skey2 --enc-channel");
+    else
+        ccnet_processor_send_request (processor, "receive-skey2");
+
+    CO_AWAIT_PACKET (co);
+    if (co_code_is (co, SC_ALREADY_HAS_KEY))
+        CO_DONE (co, TRUE);
+    if (!co_code_is (co, SC_SESSION_KEY))
+        goto bad_response;
+
+    proc->x25519 = parse_x25519_offer (proc);
+    proc->resuming = ccnet_peer_can_resume (processor->peer) &&
+        parse_resume_nonce (co->code_msg, nonce_b);
+    if (proc->resuming) {
+        send_resume_key (proc, nonce_b);
+        CO_AWAIT_PACKET (co);
+        if (co_code_is (co, SC_RESUME_FAILED)) {
+            ccnet_peer_clear_resume_secret (processor->peer);
+            proc->resuming = FALSE;
+        }
+    }
+
+    if (!proc->resuming && proc->x25519 && send_x25519_key (proc)) {
+        CO_AWAIT_PACKET (co);
+    } else if (!proc->resuming) {
+        if (!processor->peer->pubkey) {
+            ccnet_warning ("no public key of peer %.10s\n",
                            processor->peer->id);
-            ccnet_processor_done (processor, FALSE);
+            CO_DONE (co, FALSE);
         }
 
-    } else if (strcmp(code, SC_OK) == 0 && priv->state == SESSION_KEY_SENT) {
-        processor->peer->session_key = g_strndup(priv->key, 40);
+        /* the peer may get a new pubkey while we are encrypting */
+        RSA_up_ref (processor->peer->pubkey);
+        proc->pubkey = processor->peer->pubkey;
 
-        if (ccnet_session_should_encrypt_channel (processor->session))
-            ccnet_peer_prepare_channel_encryption (processor->peer);
+        CO_AWAIT_THREAD (co, processor->session->crypto_job_mgr,
+                         generate_session_key);
+        if (!proc->enc_out) {
+            ccnet_warning ("failed to generate session key for peer %.10s\n",
+                           processor->peer->id);
+            CO_DONE (co, FALSE);
+        }
 
-        ccnet_peer_manager_on_peer_session_key_sent (processor->peer->manager,
-                                                     processor->peer);
+        send_session_key (proc);
+        CO_AWAIT_PACKET (co);
+    }
 
-        ccnet_processor_done (processor, TRUE);
-        
-    } else if (strcmp(code, SC_ALREADY_HAS_KEY) == 0) {
+    if (co_code_is (co, SC_OK)) {
+        cipher = CCNET_CIPHER_AES_256_CBC;
+    } else if (co_code_is (co, SC_OK_CIPHER)) {
+        cipher = ccnet_cipher_from_string (co->code_msg);
+        if (cipher < 0 || !ccnet_cipher_is_supported (cipher)) {
+            ccnet_warning ("[send session key] peer chose unknown cipher %s\n",
+                           co->code_msg);
+            CO_DONE (co, FALSE);
+        }
+    } else if (co_code_is (co, SC_NO_ENCRYPT)) {
+        cipher = -1;
+    } else if (co_code_is (co, SC_ALREADY_HAS_KEY)) {
         /* already has session key, skip */
-        ccnet_processor_done (processor, TRUE);
-        
-    } else if (strcmp(code, SC_NO_ENCRYPT) == 0) {
-        processor->peer->session_key = g_strndup(priv->key, 40);
-        ccnet_peer_manager_on_peer_session_key_sent (processor->peer->manager,
-                                                     processor->peer);
-        ccnet_processor_done (processor, TRUE);
-    } else {
-        ccnet_warning ("[send session key] bad response %s:%s\n",
-                       code, code_msg);
-        ccnet_processor_done (processor, FALSE);
-    }
+        CO_DONE (co, TRUE);
+    } else
+        goto bad_response;
+
+    on_key_accepted (proc, cipher);
+    CO_END (co);
+    return;
+
+bad_response:
+    ccnet_warning ("[send session key] bad response %s:%s\n",
+                   co->code, co->code_msg);
+    ccnet_processor_done (processor, FALSE);
 }
@@ -4,6 +4,10 @@
 #define CCNET_SENDSKEY2_PROC_H
 
 #include <glib-object.h>
+#include <openssl/rsa.h>
+
+#include "rsa.h"
+#include "co-processor.h"
 
 
 #define CCNET_TYPE_SENDSKEY2_PROC                  (ccnet_sendskey2_proc_get_type ())
@@ -17,11 +21,23 @@ typedef struct _CcnetSendskey2Proc CcnetSendskey2Proc;
 typedef struct _CcnetSendskey2ProcClass CcnetSendskey2ProcClass;
 
 struct _CcnetSendskey2Proc {
-    CcnetProcessor parent_instance;
+    CcnetCoProcessor parent_instance;
+
+    char key[41];
+    gboolean resuming;
+
+    /* the peer's signed x25519 key, if it offered one */
+    gboolean x25519;
+    unsigned char x_pub[CCNET_X25519_KEY_LEN];
+
+    /* for the crypto thread */
+    RSA *pubkey;
+    unsigned char *enc_out;
+    int enc_len;
 };
 
 struct _CcnetSendskey2ProcClass {
-    CcnetProcessorClass parent_class;
+    CcnetCoProcessorClass parent_class;
 };
 
 GType ccnet_sendskey2_proc_get_type ();
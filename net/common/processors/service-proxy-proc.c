@@ -27,6 +27,9 @@ typedef struct {
 
 static int service_proxy_start (CcnetProcessor *processor, int argc, char **argv);
 
+static void link_stub (CcnetProcessor *processor,
+                       CcnetServiceStubProc *stub_proc);
+
 static void handle_update (CcnetProcessor *processor,
                            char *code, char *code_msg,
                            char *content, int clen);
@@ -46,6 +49,15 @@ release_resource(CcnetProcessor *processor)
         free (priv->name);
         priv->name = NULL;
     }
+    if (priv->stub_proc) {
+        if (CCNET_PROCESSOR(priv->stub_proc)->forward == processor)
+            CCNET_PROCESSOR(priv->stub_proc)->forward = NULL;
+        /* back to the pool, or ended if it can't be reused */
+        if (CCNET_PROCESSOR(priv->stub_proc)->pooled)
+            ccnet_service_stub_release (priv->stub_proc);
+        priv->stub_proc = NULL;
+    }
+    processor->forward = NULL;
 
     /* should always chain up */
     CCNET_PROCESSOR_CLASS(ccnet_service_proxy_proc_parent_class)->release_resource (processor);
@@ -114,19 +126,35 @@ ccnet_service_proxy_invoke_remote (CcnetProcessor *processor,
     
     priv->name = proc_name_strjoin_n(" ", argc, argv);
 
-    stub_proc = CCNET_SERVICE_STUB_PROC (
-        ccnet_proc_factory_create_master_processor (
-            processor->session->proc_factory, "service-stub", remote)
-        );
-    priv->stub_proc = stub_proc;
-    ccnet_service_stub_proc_set_proxy_proc (stub_proc, processor);
-
-    /* Start can fail if the remote end is not connected. */
-    if (ccnet_processor_start (CCNET_PROCESSOR(stub_proc), argc, argv) < 0) {
+    stub_proc = ccnet_service_stub_open (processor, remote, argc, argv);
+    if (!stub_proc) {
         ccnet_processor_send_response (processor, SC_PROC_DEAD, SS_PROC_DEAD,
                                        NULL, 0);
         ccnet_processor_done (processor, FALSE);
+        return;
     }
+    priv->stub_proc = stub_proc;
+    link_stub (processor, stub_proc);
+}
+
+void
+ccnet_service_proxy_stub_gone (CcnetProcessor *processor)
+{
+    ServiceProxyPriv *priv = GET_PRIV (processor);
+
+    priv->stub_proc = NULL;
+    processor->forward = NULL;
+}
+
+/*
+ * Once both ends are set up, the packets of the pair are passed on
+ * without going through the processors.
+ */
+static void
+link_stub (CcnetProcessor *processor, CcnetServiceStubProc *stub_proc)
+{
+    processor->forward = CCNET_PROCESSOR(stub_proc);
+    CCNET_PROCESSOR(stub_proc)->forward = processor;
 }
 
 /* TODO: the same as above, can use one function instead */
@@ -154,7 +182,9 @@ ccnet_service_proxy_invoke_local (CcnetProcessor *processor,
     priv->stub_proc = stub_proc;
     ccnet_service_stub_proc_set_proxy_proc (stub_proc, processor);
 
-    ccnet_processor_start (CCNET_PROCESSOR(stub_proc), argc, argv);
+    if (ccnet_processor_start (CCNET_PROCESSOR(stub_proc), argc, argv) < 0)
+        return;
+    link_stub (processor, stub_proc);
 }
 
 static void handle_update (CcnetProcessor *processor,
@@ -167,6 +197,20 @@ static void handle_update (CcnetProcessor *processor,
                      GET_PNAME(processor), PRINT_ID(processor->id),
                      priv->name, code, code_msg);
 
+    if (!priv->stub_proc)
+        return;
+
+    /* The client is done: keep the stub for the next call instead of
+     * ending it upstream. */
+    if (memcmp (code, SC_PROC_DONE, 3) == 0 &&
+        CCNET_PROCESSOR(priv->stub_proc)->pooled) {
+        CCNET_PROCESSOR(priv->stub_proc)->forward = NULL;
+        ccnet_service_stub_release (priv->stub_proc);
+        priv->stub_proc = NULL;
+        processor->forward = NULL;
+        return;
+    }
+
     ccnet_processor_handle_update ((CcnetProcessor *)priv->stub_proc,
                                    code, code_msg, content, clen);
 }
@@ -35,4 +35,7 @@ void ccnet_service_proxy_invoke_local (CcnetProcessor *processor,
                                        CcnetPeer *local,
                                        int argc, char **argv);
 
+/* Called by the stub of @processor when it goes away. */
+void ccnet_service_proxy_stub_gone (CcnetProcessor *processor);
+
 #endif
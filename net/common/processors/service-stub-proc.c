@@ -3,14 +3,46 @@
 #include "common.h"
 
 #include "peer.h"
+#include "session.h"
+#include "proc-factory.h"
+#include "timer.h"
+#include "metrics.h"
+#include "rpc-common.h"
 #include "service-stub-proc.h"
 #include "service-proxy-proc.h"
 
 #define DEBUG_FLAG CCNET_DEBUG_OTHER
 #include "log.h"
 
+/*
+ * Stubs of "remote <peer> <service>" calls to rpc services are kept
+ * after their proxy is done and handed to the next proxy for the
+ * same peer and service, so that call does not open a new processor
+ * on the upstream link. A stub goes back to the pool only when every
+ * call passed through it was answered; anything else it sees that an
+ * rpc server would not send ends it for good.
+ */
+
+#define DEFAULT_POOL_SIZE       4   /* idle stubs per peer and service */
+#define POOL_IDLE_SECS          60
+#define POOL_PRUNE_MSEC         (10 * 1000)
+
+static const char *default_pool_services[] = {
+    "ccnet-rpcserver", "ccnet-threaded-rpcserver", NULL
+};
+
 typedef struct {
     CcnetServiceProxyProc *proxy_proc;
+
+    /* for pooled stubs */
+    char      *pool_key;        /* "<peer id> <command>" */
+    GQueue    *pool;            /* that the stub is idle in, or NULL */
+    GList     *pool_link;
+    time_t     idle_since;
+    int        calls;           /* passed on and not answered yet */
+    char      *start_msg;       /* of the first "200" response */
+    unsigned   started : 1;
+    unsigned   reusable : 1;
 } ServiceStubPriv;
 
 #define GET_PRIV(o)  \
@@ -28,6 +60,37 @@ static void handle_response (CcnetProcessor *processor,
 
 G_DEFINE_TYPE (CcnetServiceStubProc, ccnet_service_stub_proc, CCNET_TYPE_PROCESSOR)
 
+static GHashTable *pools;       /* pool key -> GQueue of idle stubs */
+static char **pool_services;
+static int pool_size = -1;      /* not read yet */
+static CcnetTimer *prune_timer;
+static CcnetMetric *metric_stub_new;
+static CcnetMetric *metric_stub_reused;
+
+static void
+release_resource (CcnetProcessor *processor)
+{
+    ServiceStubPriv *priv = GET_PRIV (processor);
+
+    if (priv->pool) {
+        g_queue_delete_link (priv->pool, priv->pool_link);
+        priv->pool = NULL;
+        priv->pool_link = NULL;
+    }
+    g_free (priv->pool_key);
+    priv->pool_key = NULL;
+    g_free (priv->start_msg);
+    priv->start_msg = NULL;
+
+    if (priv->proxy_proc) {
+        if (CCNET_PROCESSOR(priv->proxy_proc)->forward == processor)
+            CCNET_PROCESSOR(priv->proxy_proc)->forward = NULL;
+        ccnet_service_proxy_stub_gone (CCNET_PROCESSOR(priv->proxy_proc));
+    }
+    processor->forward = NULL;
+
+    CCNET_PROCESSOR_CLASS (ccnet_service_stub_proc_parent_class)->release_resource (processor);
+}
 
 static void
 ccnet_service_stub_proc_class_init (CcnetServiceStubProcClass *klass)
@@ -39,6 +102,7 @@ ccnet_service_stub_proc_class_init (CcnetServiceStubProcClass *klass)
     proc_class->start = service_stub_start;
     proc_class->handle_update = handle_update;
     proc_class->handle_response = handle_response;
+    proc_class->release_resource = release_resource;
 
     g_type_class_add_private (klass, sizeof (ServiceStubPriv));
 }
@@ -97,6 +161,219 @@ ccnet_service_stub_proc_set_proxy_proc (CcnetServiceStubProc *proc,
     priv->proxy_proc = (CcnetServiceProxyProc *)proxy_proc;
 }
 
+/* -------- pool -------- */
+
+static int
+prune_pools (void *unused)
+{
+    GHashTableIter iter;
+    gpointer value;
+    time_t now = time(NULL);
+
+    g_hash_table_iter_init (&iter, pools);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        GQueue *pool = value;
+        CcnetProcessor *stub;
+
+        /* the oldest are at the tail */
+        while ((stub = g_queue_peek_tail (pool)) != NULL &&
+               now - GET_PRIV(stub)->idle_since > POOL_IDLE_SECS) {
+            g_queue_pop_tail (pool);
+            GET_PRIV(stub)->pool = NULL;
+            GET_PRIV(stub)->pool_link = NULL;
+            ccnet_processor_done (stub, TRUE);
+        }
+    }
+    return 1;
+}
+
+static void
+init_pools (CcnetSession *session)
+{
+    GKeyFile *keyf = session->keyf;
+
+    pool_size = DEFAULT_POOL_SIZE;
+    if (g_key_file_has_key (keyf, "Network", "PROXY_POOL_SIZE", NULL))
+        pool_size = g_key_file_get_integer (keyf, "Network",
+                                            "PROXY_POOL_SIZE", NULL);
+    if (g_key_file_has_key (keyf, "Network", "PROXY_POOL_SERVICES", NULL))
+        pool_services = g_key_file_get_string_list (
+            keyf, "Network", "PROXY_POOL_SERVICES", NULL, NULL);
+    else
+        pool_services = g_strdupv ((char **)default_pool_services);
+    if (pool_size <= 0)
+        return;
+
+    /* The queues are freed with their last stub gone, never: there is
+     * one per peer and service used. */
+    pools = g_hash_table_new (g_str_hash, g_str_equal);
+    prune_timer = ccnet_timer_new (prune_pools, NULL, POOL_PRUNE_MSEC);
+    metric_stub_new = ccnet_metrics_counter (
+        "ccnet_proxy_stubs_total", "source=\"new\"",
+        "Upstream stubs used by remote service calls");
+    metric_stub_reused = ccnet_metrics_counter (
+        "ccnet_proxy_stubs_total", "source=\"pool\"",
+        "Upstream stubs used by remote service calls");
+}
+
+static gboolean
+is_pooled_service (const char *service)
+{
+    char **p;
+
+    for (p = pool_services; p && *p; ++p)
+        if (strcmp (g_strstrip (*p), service) == 0)
+            return TRUE;
+    return FALSE;
+}
+
+static char *
+make_pool_key (CcnetPeer *remote, int argc, char **argv)
+{
+    GString *buf;
+
+    if (pool_size <= 0 || argc < 1 || !is_pooled_service (argv[0]))
+        return NULL;
+
+    buf = g_string_new (remote->id);
+    g_string_append_c (buf, ' ');
+    strnjoin (argc, argv, buf);
+    return g_string_free (buf, FALSE);
+}
+
+CcnetServiceStubProc *
+ccnet_service_stub_open (CcnetProcessor *proxy, CcnetPeer *remote,
+                         int argc, char **argv)
+{
+    CcnetProcessor *stub;
+    ServiceStubPriv *priv;
+    GQueue *pool;
+    char *key;
+
+    if (pool_size < 0)
+        init_pools (proxy->session);
+
+    key = make_pool_key (remote, argc, argv);
+    if (key && (pool = g_hash_table_lookup (pools, key)) != NULL &&
+        (stub = g_queue_pop_head (pool)) != NULL) {
+        priv = GET_PRIV (stub);
+        priv->pool = NULL;
+        priv->pool_link = NULL;
+        priv->proxy_proc = (CcnetServiceProxyProc *)proxy;
+        g_free (key);
+
+        /* what the service said when the stub was started */
+        ccnet_processor_send_response (proxy, SC_OK, priv->start_msg,
+                                       NULL, 0);
+        ccnet_metric_inc (metric_stub_reused);
+        return CCNET_SERVICE_STUB_PROC (stub);
+    }
+
+    stub = ccnet_proc_factory_create_master_processor (
+        proxy->session->proc_factory, "service-stub", remote);
+    priv = GET_PRIV (stub);
+    priv->proxy_proc = (CcnetServiceProxyProc *)proxy;
+    if (key) {
+        stub->pooled = 1;
+        priv->pool_key = key;
+        priv->reusable = 1;
+        ccnet_metric_inc (metric_stub_new);
+    }
+
+    /* Start can fail if the remote end is not connected. */
+    if (ccnet_processor_start (stub, argc, argv) < 0)
+        return NULL;
+    return CCNET_SERVICE_STUB_PROC (stub);
+}
+
+void
+ccnet_service_stub_release (CcnetServiceStubProc *proc)
+{
+    CcnetProcessor *stub = CCNET_PROCESSOR (proc);
+    ServiceStubPriv *priv = GET_PRIV (proc);
+    GQueue *pool;
+
+    priv->proxy_proc = NULL;
+    stub->forward = NULL;
+
+    if (stub->state == STATE_IN_SHUTDOWN)
+        return;
+
+    if (!stub->pooled || !priv->reusable || !priv->started ||
+        priv->calls != 0) {
+        ccnet_processor_done (stub, TRUE);
+        return;
+    }
+
+    pool = g_hash_table_lookup (pools, priv->pool_key);
+    if (!pool) {
+        pool = g_queue_new ();
+        g_hash_table_insert (pools, g_strdup (priv->pool_key), pool);
+    }
+    if (g_queue_get_length (pool) >= pool_size) {
+        ccnet_processor_done (stub, TRUE);
+        return;
+    }
+
+    g_queue_push_head (pool, stub);
+    priv->pool = pool;
+    priv->pool_link = pool->head;
+    priv->idle_since = time(NULL);
+}
+
+/* @msg is @msg_len bytes, not terminated. */
+static void
+count_packet (CcnetProcessor *stub, int type, const char *code,
+              const char *msg, int msg_len, int clen)
+{
+    ServiceStubPriv *priv = GET_PRIV (stub);
+
+    if (type == CCNET_MSG_UPDATE) {
+        if (memcmp (code, SC_CLIENT_CALL, 3) == 0 ||
+            memcmp (code, SC_CLIENT_BATCH, 3) == 0 ||
+            memcmp (code, SC_CLIENT_BINARY, 3) == 0)
+            ++priv->calls;
+        return;
+    }
+
+    if (!priv->started) {
+        priv->started = 1;
+        /* replayed to later proxies as "200 <msg>" without content */
+        if (memcmp (code, SC_OK, 3) != 0 || clen > 0)
+            priv->reusable = 0;
+        else
+            priv->start_msg = g_strndup (msg ? msg : "", msg_len);
+        return;
+    }
+
+    if (memcmp (code, SC_SERVER_RET, 3) == 0)
+        --priv->calls;
+    else if (memcmp (code, SC_SERVER_MORE, 3) != 0 &&
+             memcmp (code, SC_SERVER_STREAM, 3) != 0)
+        priv->reusable = 0;
+}
+
+void
+ccnet_service_stub_count (CcnetProcessor *stub, int type,
+                          const char *data, int len)
+{
+    const char *msg = NULL, *end;
+    int msg_len = 0;
+
+    if (len < 4)
+        return;
+    end = memchr (data, '\n', len);
+    if (!end)
+        return;
+    if (data[3] == ' ') {
+        msg = data + 4;
+        msg_len = end - msg;
+    }
+    count_packet (stub, type, data, msg, msg_len, len - (end + 1 - data));
+}
+
+/* -------- handlers -------- */
+
 static void handle_response (CcnetProcessor *processor,
                              char *code, char *code_msg,
                              char *content, int clen)
@@ -105,6 +382,16 @@ static void handle_response (CcnetProcessor *processor,
 
     /* ccnet_debug ("[Svc Stub] %d handle response: %s %s\n", */
     /*              PRINT_ID(processor->id), code, code_msg); */
+    if (processor->pooled)
+        count_packet (processor, CCNET_MSG_RESPONSE, code, code_msg,
+                      code_msg ? strlen (code_msg) : 0, clen);
+
+    if (!priv->proxy_proc) {
+        /* idle in the pool, nothing should come */
+        if (code[0] == '2' || code[0] == '3')
+            ccnet_processor_done (processor, FALSE);
+        return;
+    }
     ccnet_processor_handle_response ((CcnetProcessor *)priv->proxy_proc,
                                      code, code_msg, content, clen);
 }
@@ -118,5 +405,7 @@ void handle_update (CcnetProcessor *processor,
 
     /* ccnet_debug ("[Svc Stub] %d handle update: %s %s\n", */
     /*              PRINT_ID(processor->id), code, code_msg); */
+    if (processor->pooled)
+        count_packet (processor, CCNET_MSG_UPDATE, code, NULL, 0, clen);
     ccnet_processor_send_update (processor, code, code_msg, content, clen);
 }
@@ -37,4 +37,24 @@ void ccnet_service_stub_proc_send_update (CcnetServiceStubProc *proc,
                                           char *code, char *code_msg,
                                           char *content, int clen);
 
+/*
+ * A started stub of @argv on @remote for @proxy. For the services in
+ * [Network] PROXY_POOL_SERVICES (the ccnet rpc servers by default) it
+ * is an idle one from the pool if there is one, which answers @proxy
+ * with the "200" the service started with. NULL if it can't be started.
+ */
+CcnetServiceStubProc *ccnet_service_stub_open (CcnetProcessor *proxy,
+                                               CcnetPeer *remote,
+                                               int argc, char **argv);
+
+/* The proxy is done with @proc: pooled if every call through it was
+ * answered and there are fewer than [Network] PROXY_POOL_SIZE (4) idle
+ * for its service, ended otherwise. */
+void ccnet_service_stub_release (CcnetServiceStubProc *proc);
+
+/* Called by forward_packet() in peer.c for pooled stubs, with a
+ * packet passed through @stub without being parsed. */
+void ccnet_service_stub_count (CcnetProcessor *stub, int type,
+                               const char *data, int len);
+
 #endif
@@ -6,7 +6,37 @@
 #include "threaded-rpcserver-proc.h"
 #include "searpc-server.h"
 #include "rpc-common.h"
+#include "rpc-service.h"
+#include "rpc-cache.h"
+#include "rpc-capture.h"
+#include "rpc-pool.h"
+#include "rpc-binary.h"
+#include "peer.h"
 #include "job-mgr.h"
+#include "cevent.h"
+
+/*
+ * A result streamed while the call runs, see ccnet_rpc_stream_call().
+ * The worker queues chunks, waiting while STREAM_QUEUE_MAX are queued,
+ * and the main loop sends them as the credits allow.
+ */
+#define STREAM_QUEUE_MAX    4
+
+typedef struct RpcStream {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;           /* room in the queue, or cancelled */
+    GQueue         *chunks;         /* GString */
+    gboolean        notified;       /* an event is on its way */
+    gboolean        cancelled;
+    gboolean        used;           /* the call was streamed */
+    gboolean        finished;       /* all chunks are queued */
+    gsize           chunk_size;
+    int             ref;            /* under lock */
+    CcnetProcessor *processor;      /* main loop only, NULL once gone */
+} RpcStream;
+
+static CEventManager *stream_events;
+static uint32_t stream_event_id;
 
 typedef struct {
     char *call_buf;
@@ -14,6 +44,14 @@ typedef struct {
     char *buf;
     gsize len;
     int   off;
+    int   stream;               /* push the result without SC_CLIENT_MORE */
+    int   credits;              /* chunks we may send before next credit */
+    int   paused;               /* output to the peer is congested */
+    int   batch;                /* call_buf holds a SC_CLIENT_BATCH */
+    int   binary;               /* call_buf holds a SC_CLIENT_BINARY */
+    gint64 t_capture;           /* arrival if recorded, see rpc-capture.h */
+    RpcLane *lane;              /* the worker lane running the call */
+    RpcStream *rstream;         /* for a call in stream mode */
     char *error_message;
 } CcnetThreadedRpcserverProcPriv;
 
@@ -22,30 +60,144 @@ typedef struct {
 
 G_DEFINE_TYPE (CcnetThreadedRpcserverProc, ccnet_threaded_rpcserver_proc, CCNET_TYPE_PROCESSOR)
 
+/* Chunk size for the result, jumbo packets allow larger chunks. */
+#define max_transfer_length(processor) \
+    (ccnet_peer_max_payload_len ((processor)->peer) - MESSAGE_HEADER)
+
 static int start (CcnetProcessor *processor, int argc, char **argv);
+static void flow_control (CcnetProcessor *processor, gboolean paused);
 static void handle_update (CcnetProcessor *processor,
                            char *code, char *code_msg,
                            char *content, int clen);
 
+static void send_stream_queue (CcnetProcessor *processor);
+
+static RpcStream *
+rpc_stream_new (CcnetProcessor *processor)
+{
+    RpcStream *s = g_new0 (RpcStream, 1);
+
+    pthread_mutex_init (&s->lock, NULL);
+    pthread_cond_init (&s->cond, NULL);
+    s->chunks = g_queue_new ();
+    s->chunk_size = max_transfer_length (processor);
+    s->ref = 1;
+    s->processor = processor;
+    return s;
+}
+
+static void
+rpc_stream_unref (RpcStream *s)
+{
+    GString *chunk;
+    int ref;
+
+    pthread_mutex_lock (&s->lock);
+    ref = --s->ref;
+    pthread_mutex_unlock (&s->lock);
+    if (ref > 0)
+        return;
+
+    while ((chunk = g_queue_pop_head (s->chunks)))
+        g_string_free (chunk, TRUE);
+    g_queue_free (s->chunks);
+    pthread_cond_destroy (&s->cond);
+    pthread_mutex_destroy (&s->lock);
+    g_free (s);
+}
+
+/* The processor is going away, stop the worker. */
+static void
+rpc_stream_cancel (RpcStream *s)
+{
+    pthread_mutex_lock (&s->lock);
+    s->cancelled = TRUE;
+    s->processor = NULL;
+    pthread_cond_broadcast (&s->cond);
+    pthread_mutex_unlock (&s->lock);
+}
+
+static void
+stream_event_cb (CEvent *event, void *handler_data)
+{
+    RpcStream *s = event->data;
+
+    pthread_mutex_lock (&s->lock);
+    s->notified = FALSE;
+    pthread_mutex_unlock (&s->lock);
+
+    if (s->processor)
+        send_stream_queue (s->processor);
+    rpc_stream_unref (s);
+}
+
+/* In the worker, see CcnetRpcStreamFunc. */
+static int
+stream_emit (GString *chunk, void *vstream)
+{
+    RpcStream *s = vstream;
+    gboolean notify = FALSE;
+
+    pthread_mutex_lock (&s->lock);
+    while (!s->cancelled &&
+           g_queue_get_length (s->chunks) >= STREAM_QUEUE_MAX)
+        pthread_cond_wait (&s->cond, &s->lock);
+    if (s->cancelled) {
+        pthread_mutex_unlock (&s->lock);
+        g_string_free (chunk, TRUE);
+        return -1;
+    }
+    g_queue_push_tail (s->chunks, chunk);
+    s->used = TRUE;
+    if (!s->notified) {
+        s->notified = notify = TRUE;
+        s->ref++;
+    }
+    pthread_mutex_unlock (&s->lock);
+
+    if (notify)
+        cevent_manager_add_event (stream_events, stream_event_id, s);
+    return 0;
+}
+
 static void
 release_resource(CcnetProcessor *processor)
 {
     CcnetThreadedRpcserverProcPriv *priv = GET_PRIV (processor);
 
     g_free (priv->buf);
+    if (priv->rstream) {
+        rpc_stream_cancel (priv->rstream);
+        rpc_stream_unref (priv->rstream);
+        priv->rstream = NULL;
+    }
 
     CCNET_PROCESSOR_CLASS (ccnet_threaded_rpcserver_proc_parent_class)->release_resource (processor);
 }
 
 
+/* Called while the worker runs, see ccnet_processor_done(). */
+static void
+proc_shutdown (CcnetProcessor *processor)
+{
+    CcnetThreadedRpcserverProcPriv *priv = GET_PRIV (processor);
+
+    if (priv->rstream)
+        rpc_stream_cancel (priv->rstream);
+
+    CCNET_PROCESSOR_CLASS (ccnet_threaded_rpcserver_proc_parent_class)->shutdown (processor);
+}
+
 static void
 ccnet_threaded_rpcserver_proc_class_init (CcnetThreadedRpcserverProcClass *klass)
 {
     CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
 
     proc_class->start = start;
+    proc_class->shutdown = proc_shutdown;
     proc_class->handle_update = handle_update;
     proc_class->release_resource = release_resource;
+    proc_class->flow_control = flow_control;
     proc_class->name = "threaded-rpcserver-proc";
 
     g_type_class_add_private (klass, sizeof(CcnetThreadedRpcserverProcPriv));
@@ -65,6 +217,128 @@ start (CcnetProcessor *processor, int argc, char **argv)
     return 0;
 }
 
+/* Return the window asked for in a SC_CLIENT_CALL, or 0 for the
+ * stop-and-wait mode.
+ */
+static int
+parse_stream_window (const char *code_msg)
+{
+    int window;
+
+    if (!code_msg || strncmp (code_msg, SS_CLIENT_CALL_STREAM,
+                              strlen(SS_CLIENT_CALL_STREAM)) != 0)
+        return 0;
+
+    window = atoi (code_msg + strlen(SS_CLIENT_CALL_STREAM));
+    if (window <= 0)
+        window = RPC_STREAM_WINDOW;
+    return MIN (window, RPC_STREAM_MAX_WINDOW);
+}
+
+/* Send as many chunks as the credits allow, and the last one when
+ * it's reached.
+ */
+static void
+send_stream_chunks (CcnetProcessor *processor)
+{
+    CcnetThreadedRpcserverProcPriv *priv = GET_PRIV (processor);
+    int chunk = max_transfer_length (processor);
+
+    if (priv->paused)
+        return;
+
+    while (priv->credits > 0 && priv->off + chunk < priv->len) {
+        ccnet_processor_send_response (
+            processor, SC_SERVER_STREAM, SS_SERVER_STREAM,
+            priv->buf + priv->off, chunk);
+        priv->off += chunk;
+        priv->credits--;
+        /* set by flow_control() while sending */
+        if (priv->paused)
+            return;
+    }
+
+    if (priv->off + chunk >= priv->len) {
+        ccnet_processor_send_response (
+            processor, SC_SERVER_RET, SS_SERVER_RET,
+            priv->buf + priv->off, priv->len - priv->off);
+        g_free (priv->buf);
+        priv->buf = NULL;
+    }
+}
+
+/* Send the queued chunks of priv->rstream as the credits allow, and the
+ * last one once the call is finished. */
+static void
+send_stream_queue (CcnetProcessor *processor)
+{
+    CcnetThreadedRpcserverProcPriv *priv = GET_PRIV (processor);
+    RpcStream *s = priv->rstream;
+    GString *chunk;
+    gboolean last;
+
+    while (s && !priv->paused) {
+        pthread_mutex_lock (&s->lock);
+        last = s->finished && g_queue_get_length (s->chunks) <= 1;
+        chunk = NULL;
+        if (priv->credits > 0 || last) {
+            chunk = g_queue_pop_head (s->chunks);
+            pthread_cond_signal (&s->cond);
+        }
+        pthread_mutex_unlock (&s->lock);
+
+        if (last) {
+            ccnet_processor_send_response (
+                processor, SC_SERVER_RET, SS_SERVER_RET,
+                chunk ? chunk->str : NULL, chunk ? chunk->len : 0);
+            if (chunk)
+                g_string_free (chunk, TRUE);
+            rpc_stream_unref (s);
+            priv->rstream = NULL;
+            return;
+        }
+        if (!chunk)
+            return;
+
+        ccnet_processor_send_response (processor, SC_SERVER_STREAM,
+                                       SS_SERVER_STREAM,
+                                       chunk->str, chunk->len);
+        g_string_free (chunk, TRUE);
+        priv->credits--;
+        /* flow_control() may have run while sending */
+        s = priv->rstream;
+    }
+}
+
+/* Run the calls of a SC_CLIENT_BATCH, NULL if it is malformed. */
+static char *
+call_batch (const char *svc_name, const char *content, int clen,
+            gint64 t_capture, gsize *ret_len)
+{
+    const char *ptr = content, *end = content + clen, *fcall;
+    GString *buf = g_string_new (NULL);
+    gsize len, rlen;
+    char *ret;
+    int n = 0;
+
+    while (ptr < end) {
+        if (++n > RPC_BATCH_MAX ||
+            rpc_batch_next (&ptr, end, &fcall, &len) < 0) {
+            g_string_free (buf, TRUE);
+            return NULL;
+        }
+        ret = ccnet_rpc_cache_call (svc_name, (char *)fcall, len, &rlen);
+        if (t_capture)
+            ccnet_rpc_capture_record (svc_name, fcall, len, t_capture,
+                                      rlen, TRUE);
+        rpc_batch_append (buf, ret, rlen);
+        g_free (ret);
+    }
+
+    *ret_len = buf->len;
+    return g_string_free (buf, FALSE);
+}
+
 static void *
 call_function_job (void *vprocessor)
 {
@@ -72,9 +346,27 @@ call_function_job (void *vprocessor)
     CcnetThreadedRpcserverProcPriv *priv = GET_PRIV(processor);
     char *svc_name = processor->name;
 
-    priv->buf = searpc_server_call_function (svc_name, priv->call_buf, priv->call_len,
-                                             &priv->len);
+    if (priv->batch) {
+        priv->buf = call_batch (svc_name, priv->call_buf, priv->call_len,
+                                priv->t_capture, &priv->len);
+        if (!priv->buf)
+            priv->error_message = g_strdup ("Malformed batch call");
+    } else if (priv->binary)
+        priv->buf = ccnet_rpc_binary_call (svc_name, priv->call_buf,
+                                           priv->call_len, &priv->len);
+    else if (!priv->rstream ||
+             ccnet_rpc_stream_call (svc_name, priv->call_buf, priv->call_len,
+                                    priv->rstream->chunk_size,
+                                    stream_emit, priv->rstream) < 0)
+        priv->buf = ccnet_rpc_cache_call (svc_name, priv->call_buf,
+                                          priv->call_len, &priv->len);
+    /* Streamed results are not counted. */
+    if (priv->t_capture && !priv->batch && !priv->binary)
+        ccnet_rpc_capture_record (svc_name, priv->call_buf, priv->call_len,
+                                  priv->t_capture, priv->buf ? priv->len : 0,
+                                  FALSE);
     g_free (priv->call_buf);
+    ccnet_rpc_lane_release (priv->lane);
 
     return vprocessor;
 }
@@ -85,8 +377,19 @@ call_function_done (void *vprocessor)
     CcnetProcessor *processor = vprocessor;
     CcnetThreadedRpcserverProcPriv *priv = GET_PRIV(processor);
 
+    if (priv->rstream) {
+        /* Only the worker touched it until now. */
+        if (priv->rstream->used) {
+            priv->rstream->finished = TRUE;
+            send_stream_queue (processor);
+            return;
+        }
+        rpc_stream_unref (priv->rstream);
+        priv->rstream = NULL;
+    }
+
     if (priv->buf) {
-        if (priv->len < MAX_TRANSFER_LENGTH) {
+        if (priv->len < max_transfer_length (processor)) {
             ccnet_processor_send_response (processor, SC_SERVER_RET, SS_SERVER_RET,
                                            priv->buf, priv->len);
             g_free (priv->buf);
@@ -96,10 +399,16 @@ call_function_done (void *vprocessor)
         }
 
         /* we need to split data into multiple segments */
+        priv->off = 0;
+        if (priv->stream) {
+            send_stream_chunks (processor);
+            return;
+        }
+
         ccnet_processor_send_response (processor, SC_SERVER_MORE,
                                        SS_SERVER_MORE, priv->buf,
-                                       MAX_TRANSFER_LENGTH);
-        priv->off = MAX_TRANSFER_LENGTH;
+                                       max_transfer_length (processor));
+        priv->off = max_transfer_length (processor);
     } else {
         char *message = priv->error_message ? priv->error_message : "";
         ccnet_processor_send_response (processor, SC_SERVER_ERR, 
@@ -110,6 +419,49 @@ call_function_done (void *vprocessor)
     }
 }
 
+/* The result of a call turned away because its lane is full, in the
+ * form the client expects for the call. NULL for a malformed batch.
+ */
+static char *
+busy_result (CcnetThreadedRpcserverProcPriv *priv, gsize *ret_len)
+{
+    const char *busy = "{\"err_code\": " G_STRINGIFY(RPC_ERR_BUSY)
+        ", \"err_msg\": \"" RPC_ERR_BUSY_MSG "\"}";
+    const char *ptr, *end, *fcall;
+    GString *buf = g_string_new (NULL);
+    gsize len;
+
+    if (priv->binary) {
+        rpc_bin_put_error (buf, RPC_ERR_BUSY, RPC_ERR_BUSY_MSG);
+    } else if (priv->batch) {
+        ptr = priv->call_buf;
+        end = priv->call_buf + priv->call_len;
+        while (ptr < end) {
+            if (rpc_batch_next (&ptr, end, &fcall, &len) < 0) {
+                g_string_free (buf, TRUE);
+                return NULL;
+            }
+            rpc_batch_append (buf, busy, strlen(busy));
+        }
+    } else
+        g_string_append (buf, busy);
+
+    *ret_len = buf->len;
+    return g_string_free (buf, FALSE);
+}
+
+static void
+flow_control (CcnetProcessor *processor, gboolean paused)
+{
+    CcnetThreadedRpcserverProcPriv *priv = GET_PRIV (processor);
+
+    priv->paused = paused;
+    if (!paused && priv->stream && priv->buf)
+        send_stream_chunks (processor);
+    else if (!paused && priv->rstream)
+        send_stream_queue (processor);
+}
+
 static void
 handle_update (CcnetProcessor *processor,
                char *code, char *code_msg,
@@ -117,23 +469,68 @@ handle_update (CcnetProcessor *processor,
 {
     CcnetThreadedRpcserverProcPriv *priv = GET_PRIV (processor);
 
-    if (memcmp (code, SC_CLIENT_CALL, 3) == 0) {
+    if (memcmp (code, SC_CLIENT_CALL, 3) == 0 ||
+        memcmp (code, SC_CLIENT_BATCH, 3) == 0 ||
+        memcmp (code, SC_CLIENT_BINARY, 3) == 0) {
         priv->call_buf = g_memdup (content, clen);
         priv->call_len = (gsize)clen;
+        priv->batch = (memcmp (code, SC_CLIENT_BATCH, 3) == 0);
+        priv->binary = (memcmp (code, SC_CLIENT_BINARY, 3) == 0);
+        priv->t_capture = ccnet_rpc_capture_sample ();
+        priv->credits = parse_stream_window (code_msg);
+        priv->stream = (priv->credits > 0);
+        priv->paused = ccnet_peer_is_congested (processor->peer);
+
+        priv->lane = ccnet_rpc_pool_acquire (
+            processor->name, priv->binary ? NULL : priv->call_buf,
+            priv->call_len, priv->batch);
+        if (!priv->lane) {
+            priv->buf = busy_result (priv, &priv->len);
+            if (!priv->buf)
+                priv->error_message = g_strdup ("Malformed batch call");
+            g_free (priv->call_buf);
+            call_function_done (processor);
+            return;
+        }
+
+        /* Listings may be streamed as the rows are read. */
+        if (priv->stream && !priv->batch && !priv->binary) {
+            if (!stream_events) {
+                stream_events = cevent_manager_new ();
+                cevent_manager_start (stream_events);
+                stream_event_id = cevent_manager_register (
+                    stream_events, stream_event_cb, NULL);
+            }
+            priv->rstream = rpc_stream_new (processor);
+        }
+
         ccnet_processor_thread_create (processor,
-                                       NULL,
+                                       ccnet_rpc_lane_get_job_manager (priv->lane),
                                        call_function_job,
                                        call_function_done,
                                        processor);
         return;
     }
 
+    if (memcmp (code, SC_CLIENT_CREDIT, 3) == 0) {
+        /* Credits may still arrive after the last chunk was sent. */
+        if (priv->stream && (priv->buf || priv->rstream)) {
+            priv->credits += atoi (code_msg ? code_msg : "");
+            priv->credits = MIN (priv->credits, RPC_STREAM_MAX_WINDOW);
+            if (priv->buf)
+                send_stream_chunks (processor);
+            else
+                send_stream_queue (processor);
+        }
+        return;
+    }
+
     if (memcmp (code, SC_CLIENT_MORE, 3) == 0) {
-        if (priv->off + MAX_TRANSFER_LENGTH < priv->len) {
+        if (priv->off + max_transfer_length (processor) < priv->len) {
             ccnet_processor_send_response (
                 processor, SC_SERVER_MORE, SS_SERVER_MORE,
-                priv->buf + priv->off, MAX_TRANSFER_LENGTH);
-            priv->off += MAX_TRANSFER_LENGTH;
+                priv->buf + priv->off, max_transfer_length (processor));
+            priv->off += max_transfer_length (processor);
         } else {
             ccnet_processor_send_response (
                 processor, SC_SERVER_RET, SS_SERVER_RET,
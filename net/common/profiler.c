@@ -0,0 +1,349 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifdef __linux__
+/* for dladdr */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include "common.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <glib/gstdio.h>
+
+#ifdef __linux__
+#include <signal.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#endif
+
+#include "timer.h"
+#include "profiler.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_OTHER
+#include "log.h"
+
+#define DEFAULT_HZ              99
+#define MAX_HZ                  1000
+#define DEFAULT_MAX_SECONDS     300
+
+/* 8MB while running: a minute at 500 Hz, five at the default. */
+#define MAX_SAMPLES             (1 << 15)
+#define MAX_DEPTH               32
+/* the handler and the signal trampoline */
+#define SKIP_FRAMES             2
+
+typedef struct {
+    int          depth;
+    void        *pcs[MAX_DEPTH];
+} Sample;
+
+static struct {
+    char        *config_dir;
+    int          max_seconds;
+
+    /* Shared with the handler, which runs in any thread. */
+    gint         running;
+    gint         in_handler;
+    gint         next;
+    gint         dropped;
+    Sample      *samples;
+
+    int          hz;
+    gint64       started;
+    char        *path;
+    CcnetTimer  *stop_timer;
+#ifdef __linux__
+    gboolean     installed;
+    timer_t      timer;
+#endif
+} prof;
+
+void
+ccnet_profiler_init (GKeyFile *keyf, const char *config_dir)
+{
+    prof.config_dir = g_strdup (config_dir);
+    prof.max_seconds = DEFAULT_MAX_SECONDS;
+    if (g_key_file_has_key (keyf, "Profiler", "MAX_SECONDS", NULL))
+        prof.max_seconds = g_key_file_get_integer (keyf, "Profiler",
+                                                   "MAX_SECONDS", NULL);
+}
+
+#ifdef __linux__
+
+/*
+ * backtrace() is not async-signal-safe on its first call only, when it
+ * loads the unwinder; start calls it once before arming the timer.
+ */
+static void
+on_sigprof (int sig, siginfo_t *info, void *ctx)
+{
+    int saved_errno = errno;
+    int idx;
+
+    g_atomic_int_inc (&prof.in_handler);
+    if (g_atomic_int_get (&prof.running)) {
+        idx = g_atomic_int_add (&prof.next, 1);
+        if (idx < MAX_SAMPLES)
+            prof.samples[idx].depth = backtrace (prof.samples[idx].pcs,
+                                                 MAX_DEPTH);
+        else
+            g_atomic_int_inc (&prof.dropped);
+    }
+    g_atomic_int_add (&prof.in_handler, -1);
+    errno = saved_errno;
+}
+
+/* The handler stays installed once it was, so that a SIGPROF still
+ * pending after the timer is deleted can't kill the process. */
+static int
+install_handler (void)
+{
+    struct sigaction sa;
+
+    if (prof.installed)
+        return 0;
+
+    memset (&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset (&sa.sa_mask);
+    if (sigaction (SIGPROF, &sa, NULL) < 0) {
+        ccnet_warning ("[Profiler] Failed to install SIGPROF handler: %s\n",
+                       strerror (errno));
+        return -1;
+    }
+    prof.installed = TRUE;
+    return 0;
+}
+
+static int
+auto_stop (void *unused)
+{
+    char *path;
+
+    prof.stop_timer = NULL;
+    ccnet_message ("[Profiler] Stopping after %d seconds\n",
+                   prof.max_seconds);
+    path = ccnet_profiler_stop ();
+    g_free (path);
+    return FALSE;
+}
+
+static char *
+profile_path (void)
+{
+    char stamp[32];
+    time_t now = time (NULL);
+    struct tm tm;
+
+    localtime_r (&now, &tm);
+    strftime (stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    return g_strdup_printf ("%s/profile-%s.folded", prof.config_dir, stamp);
+}
+
+int
+ccnet_profiler_start (int hz)
+{
+    struct sigevent sev;
+    struct itimerspec its;
+    void *warmup[4];
+
+    if (prof.samples) {
+        ccnet_warning ("[Profiler] Already running\n");
+        return -1;
+    }
+    if (hz <= 0)
+        hz = DEFAULT_HZ;
+    hz = MIN (hz, MAX_HZ);
+
+    if (install_handler () < 0)
+        return -1;
+    backtrace (warmup, G_N_ELEMENTS (warmup));
+
+    prof.samples = g_try_new (Sample, MAX_SAMPLES);
+    if (!prof.samples) {
+        ccnet_warning ("[Profiler] Out of memory for the sample buffer\n");
+        return -1;
+    }
+    prof.next = 0;
+    prof.dropped = 0;
+
+    memset (&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGPROF;
+    if (timer_create (CLOCK_PROCESS_CPUTIME_ID, &sev, &prof.timer) < 0) {
+        ccnet_warning ("[Profiler] Failed to create timer: %s\n",
+                       strerror (errno));
+        g_free (prof.samples);
+        prof.samples = NULL;
+        return -1;
+    }
+
+    g_atomic_int_set (&prof.running, 1);
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 1000000000L / hz;
+    its.it_value = its.it_interval;
+    timer_settime (prof.timer, 0, &its, NULL);
+
+    prof.hz = hz;
+    prof.started = g_get_monotonic_time ();
+    g_free (prof.path);
+    prof.path = profile_path ();
+    if (prof.max_seconds > 0)
+        prof.stop_timer = ccnet_timer_new (auto_stop, NULL,
+                                           (uint64_t)prof.max_seconds * 1000);
+
+    ccnet_message ("[Profiler] Sampling at %d Hz for %s\n", hz, prof.path);
+    return 0;
+}
+
+static const char *
+frame_name (GHashTable *names, void *pc)
+{
+    char *name = g_hash_table_lookup (names, pc);
+    const char *module;
+    Dl_info info;
+
+    if (name)
+        return name;
+
+    if (!dladdr (pc, &info) || !info.dli_fname) {
+        name = g_strdup_printf ("%p", pc);
+    } else if (info.dli_sname) {
+        name = g_strdup (info.dli_sname);
+    } else {
+        module = strrchr (info.dli_fname, '/');
+        module = module ? module + 1 : info.dli_fname;
+        name = g_strdup_printf ("%s+0x%lx", module,
+                                (unsigned long)((char *)pc -
+                                                (char *)info.dli_fbase));
+    }
+    g_hash_table_insert (names, pc, name);
+    return name;
+}
+
+static int
+write_profile (const char *path, int n_samples)
+{
+    GHashTable *names, *stacks;
+    GHashTableIter iter;
+    gpointer key, value;
+    GString *stack;
+    FILE *fp;
+    int i, j;
+
+    names = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                   NULL, g_free);
+    stacks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    stack = g_string_new (NULL);
+
+    for (i = 0; i < n_samples; ++i) {
+        Sample *s = &prof.samples[i];
+
+        if (s->depth <= SKIP_FRAMES)
+            continue;
+        g_string_truncate (stack, 0);
+        for (j = s->depth - 1; j >= SKIP_FRAMES; --j) {
+            g_string_append (stack, frame_name (names, s->pcs[j]));
+            if (j > SKIP_FRAMES)
+                g_string_append_c (stack, ';');
+        }
+        value = g_hash_table_lookup (stacks, stack->str);
+        if (value)
+            g_hash_table_replace (stacks, g_strdup (stack->str),
+                                  GINT_TO_POINTER (GPOINTER_TO_INT (value) + 1));
+        else
+            g_hash_table_insert (stacks, g_strdup (stack->str),
+                                 GINT_TO_POINTER (1));
+    }
+
+    fp = g_fopen (path, "w");
+    if (fp) {
+        g_hash_table_iter_init (&iter, stacks);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            fprintf (fp, "%s %d\n", (char *)key, GPOINTER_TO_INT (value));
+        if (fclose (fp) != 0) {
+            ccnet_warning ("[Profiler] Failed to write %s\n", path);
+            fp = NULL;
+        }
+    } else {
+        ccnet_warning ("[Profiler] Failed to open %s: %s\n",
+                       path, strerror (errno));
+    }
+
+    g_string_free (stack, TRUE);
+    g_hash_table_destroy (stacks);
+    g_hash_table_destroy (names);
+    return fp ? 0 : -1;
+}
+
+char *
+ccnet_profiler_stop (void)
+{
+    int n_samples, res;
+
+    if (!prof.samples)
+        return NULL;
+
+    timer_delete (prof.timer);
+    g_atomic_int_set (&prof.running, 0);
+    /* a handler which saw running set finishes its sample first */
+    while (g_atomic_int_get (&prof.in_handler))
+        g_thread_yield ();
+
+    if (prof.stop_timer)
+        ccnet_timer_free (&prof.stop_timer);
+
+    n_samples = MIN (g_atomic_int_get (&prof.next), MAX_SAMPLES);
+    ccnet_message ("[Profiler] Writing %d samples (%d dropped) to %s\n",
+                   n_samples, prof.dropped, prof.path);
+
+    res = write_profile (prof.path, n_samples);
+    g_free (prof.samples);
+    prof.samples = NULL;
+    return res < 0 ? NULL : g_strdup (prof.path);
+}
+
+#else
+
+int
+ccnet_profiler_start (int hz)
+{
+    ccnet_warning ("[Profiler] Not supported on this platform\n");
+    return -1;
+}
+
+char *
+ccnet_profiler_stop (void)
+{
+    return NULL;
+}
+
+#endif  /* __linux__ */
+
+char *
+ccnet_profiler_get_status (void)
+{
+    GString *buf = g_string_new (NULL);
+    gboolean running = prof.samples != NULL;
+
+    g_string_append_printf (buf, "running\t%d\n", running);
+    if (running) {
+        g_string_append_printf (buf, "hz\t%d\n", prof.hz);
+        g_string_append_printf (buf, "seconds\t%d\n", (int)
+                                ((g_get_monotonic_time () - prof.started)
+                                 / G_USEC_PER_SEC));
+        g_string_append_printf (buf, "samples\t%d\n",
+                                MIN (g_atomic_int_get (&prof.next),
+                                     MAX_SAMPLES));
+        g_string_append_printf (buf, "dropped\t%d\n",
+                                g_atomic_int_get (&prof.dropped));
+    }
+    if (prof.path)
+        g_string_append_printf (buf, "file\t%s\n", prof.path);
+
+    return g_string_free (buf, FALSE);
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_PROFILER_H
+#define CCNET_PROFILER_H
+
+#include <glib.h>
+
+/*
+ * A sampling cpu profiler, started and stopped on a running server by
+ * the "profile" rcvcmd command or the profile rpc. While it runs, a
+ * process cpu time timer sends SIGPROF at the given rate and the
+ * handler records the stack of whichever thread was running into a
+ * preallocated buffer. Nothing is installed until the first start, and
+ * a stopped profiler costs nothing.
+ *
+ * On stop the stacks are written in collapsed form, "f1;f2;f3 <count>"
+ * per line with the outermost frame first, as flamegraph.pl reads
+ * them, to <config dir>/profile-<time>.folded. Frames are named with
+ * dladdr(): functions not in the dynamic symbol table show up as
+ * <module>+0x<offset>, for addr2line.
+ *
+ *   [Profiler]
+ *   MAX_SECONDS = 300      (it stops by itself after that, 0 never)
+ *
+ * Linux only; elsewhere start fails. Main thread only.
+ */
+
+void ccnet_profiler_init (GKeyFile *keyf, const char *config_dir);
+
+/* @hz <= 0 for the default of 99. -1 if it is running already. */
+int ccnet_profiler_start (int hz);
+
+/* Writes the profile. Returns its path, NULL if it wasn't running or
+ * the file can't be written. */
+char *ccnet_profiler_stop (void);
+
+/* "<key>\t<value>" lines: running, hz, seconds, samples, dropped, file. */
+char *ccnet_profiler_get_status (void);
+
+#endif
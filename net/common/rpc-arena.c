@@ -0,0 +1,160 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "rpc-arena.h"
+
+#define RPC_ARENA_CHUNK_SIZE (16 << 10)
+#define ARENA_ALIGN          8
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    gsize              size;
+    gsize              used;
+    /* the data follows, aligned by the size of the header */
+} ArenaChunk;
+
+#define CHUNK_HEADER ((sizeof(ArenaChunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define CHUNK_DATA(c) ((char *)(c) + CHUNK_HEADER)
+
+struct CcnetArena {
+    ArenaChunk *chunks;         /* the newest first */
+    gsize       chunk_size;
+};
+
+static ArenaChunk *
+new_chunk (gsize size)
+{
+    ArenaChunk *chunk = g_malloc (CHUNK_HEADER + size);
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+CcnetArena *
+ccnet_arena_new (gsize chunk_size)
+{
+    CcnetArena *arena = g_new0 (CcnetArena, 1);
+
+    arena->chunk_size = chunk_size;
+    return arena;
+}
+
+void
+ccnet_arena_free (CcnetArena *arena)
+{
+    ArenaChunk *chunk, *next;
+
+    if (!arena)
+        return;
+    for (chunk = arena->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        g_free (chunk);
+    }
+    g_free (arena);
+}
+
+void *
+ccnet_arena_alloc (CcnetArena *arena, gsize size)
+{
+    ArenaChunk *chunk = arena->chunks;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(gsize)(ARENA_ALIGN - 1);
+    if (!chunk || chunk->used + size > chunk->size) {
+        /* Large blocks get a chunk of their own, behind the current
+         * one, so that its space is still used. */
+        if (size > arena->chunk_size / 4 && chunk) {
+            ArenaChunk *big = new_chunk (size);
+            big->used = size;
+            big->next = chunk->next;
+            chunk->next = big;
+            return CHUNK_DATA (big);
+        }
+        chunk = new_chunk (MAX (size, arena->chunk_size));
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    p = CHUNK_DATA (chunk) + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+char *
+ccnet_arena_strdup (CcnetArena *arena, const char *str)
+{
+    gsize len;
+    char *copy;
+
+    if (!str)
+        return NULL;
+    len = strlen (str) + 1;
+    copy = ccnet_arena_alloc (arena, len);
+    memcpy (copy, str, len);
+    return copy;
+}
+
+void
+ccnet_arena_reset (CcnetArena *arena)
+{
+    ArenaChunk *chunk, *next, *keep = NULL;
+
+    for (chunk = arena->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        if (!keep && chunk->size == arena->chunk_size) {
+            keep = chunk;
+            continue;
+        }
+        g_free (chunk);
+    }
+    if (keep) {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    arena->chunks = keep;
+}
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void
+arena_destroy (void *arena)
+{
+    ccnet_arena_free (arena);
+}
+
+static void
+arena_key_init (void)
+{
+    pthread_key_create (&arena_key, arena_destroy);
+}
+
+CcnetArena *
+ccnet_rpc_arena (void)
+{
+    CcnetArena *arena;
+
+    pthread_once (&arena_once, arena_key_init);
+    arena = pthread_getspecific (arena_key);
+    if (!arena) {
+        arena = ccnet_arena_new (RPC_ARENA_CHUNK_SIZE);
+        pthread_setspecific (arena_key, arena);
+    }
+    return arena;
+}
+
+void
+ccnet_rpc_arena_reset (void)
+{
+    CcnetArena *arena;
+
+    pthread_once (&arena_once, arena_key_init);
+    arena = pthread_getspecific (arena_key);
+    if (arena)
+        ccnet_arena_reset (arena);
+}
@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_RPC_ARENA_H
+#define CCNET_RPC_ARENA_H
+
+#include <glib.h>
+
+/*
+ * A bump allocator for the temporaries of an rpc call. Allocations are
+ * never freed one by one; the whole arena is reset once the result has
+ * been serialized, and its first chunk is kept for the next call.
+ *
+ * Each thread has an arena of its own, see ccnet_rpc_arena(), which is
+ * reset by the rpc entry points after the functions and the encoders
+ * are done with it. Nothing from it may be kept past the call.
+ */
+
+typedef struct CcnetArena CcnetArena;
+
+CcnetArena *ccnet_arena_new (gsize chunk_size);
+void ccnet_arena_free (CcnetArena *arena);
+
+/* Aligned for any type. */
+void *ccnet_arena_alloc (CcnetArena *arena, gsize size);
+
+/* NULL for NULL. */
+char *ccnet_arena_strdup (CcnetArena *arena, const char *str);
+
+/* Drop everything allocated so far. */
+void ccnet_arena_reset (CcnetArena *arena);
+
+/* The arena of the calling thread. */
+CcnetArena *ccnet_rpc_arena (void);
+
+/* Reset the arena of the calling thread, if it has one. */
+void ccnet_rpc_arena_reset (void);
+
+#endif
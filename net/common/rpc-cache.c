@@ -0,0 +1,291 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <searpc-server.h>
+
+#include "rpc-cache.h"
+#include "rpc-service.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_OTHER
+#include "log.h"
+
+#define DEFAULT_MAX_ENTRIES  4096
+#define MAX_WRITERS          4
+
+/*
+ * A function that may be cached, and the functions changing its
+ * results. Bumping gen invalidates all cached results of the function.
+ */
+typedef struct CachedFunc {
+    const char *name;
+    const char *writers[MAX_WRITERS];
+    int         ttl;
+    guint       gen;
+} CachedFunc;
+
+static CachedFunc cached_funcs[] = {
+    { "get_peer", { "update_peer_address", "add_role", "remove_role" } },
+    { "get_config", { "set_config" } },
+    { "get_group", { "create_group", "create_org_group", "remove_group" } },
+    { "get_all_groups",
+      { "create_group", "create_org_group", "remove_group" } },
+    { "get_all_groups_after",
+      { "create_group", "create_org_group", "remove_group" } },
+    { "get_org_by_url_prefix", { "create_org", "remove_org" } },
+    { "get_org_by_id", { "create_org", "remove_org" } },
+};
+
+typedef struct CacheEntry {
+    char       *ret;
+    gsize       len;
+    time_t      expire;
+    guint       gen;
+    CachedFunc *func;
+} CacheEntry;
+
+static struct {
+    gboolean        enabled;
+    pthread_mutex_t lock;
+    GHashTable     *readers;    /* name -> CachedFunc, enabled ones */
+    GHashTable     *writers;    /* name -> GList of CachedFunc */
+    GHashTable     *entries;    /* "<service>\n<fcall>" -> CacheEntry */
+    int             max_entries;
+    gint64          hits;
+    gint64          misses;
+    gint64          invalidations;
+    gint64          bytes;      /* of the entries and results */
+} cache;
+
+static void
+cache_entry_free (gpointer data)
+{
+    CacheEntry *e = data;
+
+    cache.bytes -= sizeof(CacheEntry) + e->len;
+    g_free (e->ret);
+    g_free (e);
+}
+
+void
+ccnet_rpc_cache_init (GKeyFile *keyf)
+{
+    CachedFunc *f;
+    GList *list;
+    int i, j;
+
+    cache.max_entries = DEFAULT_MAX_ENTRIES;
+    if (g_key_file_has_key (keyf, "RPC Cache", "MAX_ENTRIES", NULL))
+        cache.max_entries = g_key_file_get_integer (keyf, "RPC Cache",
+                                                    "MAX_ENTRIES", NULL);
+    if (cache.max_entries <= 0)
+        return;
+
+    cache.readers = g_hash_table_new (g_str_hash, g_str_equal);
+    cache.writers = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < G_N_ELEMENTS(cached_funcs); ++i) {
+        f = &cached_funcs[i];
+        f->ttl = g_key_file_get_integer (keyf, "RPC Cache", f->name, NULL);
+        if (f->ttl <= 0)
+            continue;
+
+        g_hash_table_insert (cache.readers, (gpointer)f->name, f);
+        for (j = 0; j < MAX_WRITERS && f->writers[j]; ++j) {
+            list = g_hash_table_lookup (cache.writers, f->writers[j]);
+            list = g_list_prepend (list, f);
+            g_hash_table_insert (cache.writers, (gpointer)f->writers[j], list);
+        }
+        ccnet_message ("[RPC Cache] Cache %s for %d seconds.\n",
+                       f->name, f->ttl);
+        cache.enabled = TRUE;
+    }
+
+    if (!cache.enabled)
+        return;
+
+    pthread_mutex_init (&cache.lock, NULL);
+    cache.entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, cache_entry_free);
+}
+
+gboolean
+ccnet_rpc_parse_fname (const char *fcall, gsize len, char *name)
+{
+    const char *p = fcall, *end = fcall + len;
+    int n = 0;
+
+    while (p < end && g_ascii_isspace (*p))
+        ++p;
+    if (p >= end || *p++ != '[')
+        return FALSE;
+    while (p < end && g_ascii_isspace (*p))
+        ++p;
+    if (p >= end || *p++ != '"')
+        return FALSE;
+
+    while (p < end && *p != '"') {
+        if (n + 1 >= RPC_MAX_FNAME_LEN || *p == '\\')
+            return FALSE;
+        name[n++] = *p++;
+    }
+    if (p >= end)
+        return FALSE;
+
+    name[n] = '\0';
+    return TRUE;
+}
+
+static gboolean
+remove_expired (gpointer key, gpointer value, gpointer now)
+{
+    CacheEntry *e = value;
+
+    return e->expire <= *(time_t *)now || e->gen != e->func->gen;
+}
+
+static void
+cache_store (char *key, CachedFunc *f, guint gen,
+             const char *ret, gsize len)
+{
+    CacheEntry *e;
+    time_t now = time(NULL);
+
+    if (g_hash_table_size (cache.entries) >= cache.max_entries) {
+        g_hash_table_foreach_remove (cache.entries, remove_expired, &now);
+        if (g_hash_table_size (cache.entries) >= cache.max_entries)
+            g_hash_table_remove_all (cache.entries);
+    }
+
+    e = g_new0 (CacheEntry, 1);
+    e->ret = g_memdup (ret, len);
+    e->len = len;
+    e->expire = now + f->ttl;
+    e->gen = gen;
+    e->func = f;
+    cache.bytes += sizeof(CacheEntry) + len;
+    g_hash_table_replace (cache.entries, key, e);
+}
+
+/* searpc, unless the function has a faster JSON version. */
+static char *
+call_function (const char *svc_name, char *fcall, gsize fcall_len,
+               gsize *ret_len)
+{
+    char *ret = ccnet_rpc_json_call (svc_name, fcall, fcall_len, ret_len);
+
+    if (ret)
+        return ret;
+    return searpc_server_call_function (svc_name, fcall, fcall_len, ret_len);
+}
+
+char *
+ccnet_rpc_cache_call (const char *svc_name, char *fcall, gsize fcall_len,
+                      gsize *ret_len)
+{
+    char fname[RPC_MAX_FNAME_LEN];
+    CachedFunc *f;
+    CacheEntry *e;
+    GList *ptr;
+    char *key, *ret;
+    guint gen;
+
+    if (!cache.enabled || !ccnet_rpc_parse_fname (fcall, fcall_len, fname))
+        return call_function (svc_name, fcall, fcall_len, ret_len);
+
+    f = g_hash_table_lookup (cache.readers, fname);
+    if (!f) {
+        ret = call_function (svc_name, fcall, fcall_len, ret_len);
+        /* Readers that started before this point store their results
+         * under the old generation, so nothing stale survives. */
+        ptr = g_hash_table_lookup (cache.writers, fname);
+        if (ptr) {
+            pthread_mutex_lock (&cache.lock);
+            for (; ptr; ptr = ptr->next)
+                ((CachedFunc *)ptr->data)->gen++;
+            cache.invalidations++;
+            pthread_mutex_unlock (&cache.lock);
+        }
+        return ret;
+    }
+
+    key = g_strdup_printf ("%s\n%.*s", svc_name, (int)fcall_len, fcall);
+
+    pthread_mutex_lock (&cache.lock);
+    e = g_hash_table_lookup (cache.entries, key);
+    if (e && e->gen == f->gen && e->expire > time(NULL)) {
+        ret = g_memdup (e->ret, e->len);
+        *ret_len = e->len;
+        cache.hits++;
+        pthread_mutex_unlock (&cache.lock);
+        g_free (key);
+        return ret;
+    }
+    cache.misses++;
+    gen = f->gen;
+    pthread_mutex_unlock (&cache.lock);
+
+    ret = call_function (svc_name, fcall, fcall_len, ret_len);
+
+    /* Errors are not cached. */
+    if (!ret || g_strstr_len (ret, *ret_len, "\"err_code\"") != NULL) {
+        g_free (key);
+        return ret;
+    }
+
+    pthread_mutex_lock (&cache.lock);
+    cache_store (key, f, gen, ret, *ret_len);
+    pthread_mutex_unlock (&cache.lock);
+
+    return ret;
+}
+
+gint64
+ccnet_rpc_cache_get_bytes (guint *n_entries)
+{
+    gint64 bytes;
+
+    *n_entries = 0;
+    if (!cache.enabled)
+        return 0;
+
+    pthread_mutex_lock (&cache.lock);
+    *n_entries = g_hash_table_size (cache.entries);
+    bytes = cache.bytes;
+    pthread_mutex_unlock (&cache.lock);
+    return bytes;
+}
+
+char *
+ccnet_rpc_cache_get_stats (void)
+{
+    GString *buf = g_string_new (NULL);
+    gint64 total;
+    int i;
+
+    if (!cache.enabled) {
+        g_string_append (buf, "enabled 0\n");
+        return g_string_free (buf, FALSE);
+    }
+
+    pthread_mutex_lock (&cache.lock);
+    total = cache.hits + cache.misses;
+    g_string_append_printf (buf, "enabled 1\nentries %u\nmax %d\n"
+                            "hits %" G_GINT64_FORMAT "\n"
+                            "misses %" G_GINT64_FORMAT "\n"
+                            "hit_rate %.1f\n"
+                            "invalidations %" G_GINT64_FORMAT "\n",
+                            g_hash_table_size (cache.entries),
+                            cache.max_entries, cache.hits, cache.misses,
+                            total ? 100.0 * cache.hits / total : 0.0,
+                            cache.invalidations);
+    for (i = 0; i < G_N_ELEMENTS(cached_funcs); ++i) {
+        if (cached_funcs[i].ttl > 0)
+            g_string_append_printf (buf, "ttl %s %d\n", cached_funcs[i].name,
+                                    cached_funcs[i].ttl);
+    }
+    pthread_mutex_unlock (&cache.lock);
+
+    return g_string_free (buf, FALSE);
+}
@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_RPC_CACHE_H
+#define CCNET_RPC_CACHE_H
+
+#include <glib.h>
+
+/*
+ * Results of read-only rpc functions, keyed on the service and the
+ * serialized call. Caching is turned on per function in the
+ * [RPC Cache] section of ccnet.conf, by giving it a ttl in seconds:
+ *
+ *   [RPC Cache]
+ *   get_group = 60
+ *   get_org_by_url_prefix = 300
+ *
+ * The write functions that change a cached result drop it at once.
+ * Changes made outside the rpc, e.g. a peer going down, are only seen
+ * after the ttl.
+ */
+
+void  ccnet_rpc_cache_init (GKeyFile *keyf);
+
+/* searpc_server_call_function() with the cache in front of it. */
+char *ccnet_rpc_cache_call (const char *svc_name, char *fcall,
+                            gsize fcall_len, gsize *ret_len);
+
+char *ccnet_rpc_cache_get_stats (void);
+
+/* The size of the cached results. */
+gint64 ccnet_rpc_cache_get_bytes (guint *n_entries);
+
+#define RPC_MAX_FNAME_LEN 64
+
+/* The function name of a searpc call, which is ["<name>", args...]. */
+gboolean ccnet_rpc_parse_fname (const char *fcall, gsize len, char *name);
+
+#endif
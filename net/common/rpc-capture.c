@@ -0,0 +1,207 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <glib/gstdio.h>
+
+#include "timer.h"
+#include "rpc-cache.h"
+#include "rpc-capture.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_OTHER
+#include "log.h"
+
+#define CAPTURE_MAGIC       "CCNET-RPC-CAPTURE 1\n"
+#define DEFAULT_MAX_SIZE    1024                /* MB */
+#define FLUSH_INTERVAL      1000                /* ms */
+
+/* The functions taking passwords. */
+static const char *default_redact[] = {
+    "add_emailuser", "validate_emailuser", "update_emailuser", NULL,
+};
+
+static struct {
+    gboolean        enabled;
+    double          sample_rate;
+    gboolean        redact_all;
+    GHashTable     *redact;     /* function names */
+    pthread_mutex_t lock;
+    FILE           *fp;
+    gint64          size;
+    gint64          max_size;
+    CcnetTimer     *flush_timer;
+} capture = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int
+flush_capture (void *unused)
+{
+    pthread_mutex_lock (&capture.lock);
+    if (capture.fp)
+        fflush (capture.fp);
+    pthread_mutex_unlock (&capture.lock);
+    return TRUE;
+}
+
+void
+ccnet_rpc_capture_init (GKeyFile *keyf, const char *config_dir)
+{
+    char *path, **names;
+    int i, size_mb = DEFAULT_MAX_SIZE;
+
+    if (capture.enabled || !g_key_file_has_group (keyf, "RPC Capture"))
+        return;
+
+    capture.sample_rate = 1;
+    if (g_key_file_has_key (keyf, "RPC Capture", "SAMPLE_RATE", NULL))
+        capture.sample_rate = g_key_file_get_double (keyf, "RPC Capture",
+                                                     "SAMPLE_RATE", NULL);
+    capture.sample_rate = CLAMP (capture.sample_rate, 0, 1);
+    if (g_key_file_has_key (keyf, "RPC Capture", "MAX_SIZE", NULL))
+        size_mb = g_key_file_get_integer (keyf, "RPC Capture", "MAX_SIZE",
+                                          NULL);
+    capture.max_size = (gint64)MAX (size_mb, 1) << 20;
+
+    capture.redact = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+    names = g_key_file_get_string_list (keyf, "RPC Capture", "REDACT",
+                                        NULL, NULL);
+    if (names) {
+        for (i = 0; names[i]; ++i) {
+            g_strstrip (names[i]);
+            if (strcmp (names[i], "*") == 0)
+                capture.redact_all = TRUE;
+            else if (names[i][0])
+                g_hash_table_add (capture.redact, g_strdup (names[i]));
+        }
+        g_strfreev (names);
+    } else {
+        for (i = 0; default_redact[i]; ++i)
+            g_hash_table_add (capture.redact, g_strdup (default_redact[i]));
+    }
+
+    path = g_key_file_get_string (keyf, "RPC Capture", "FILE", NULL);
+    if (!path)
+        path = g_build_filename (config_dir, "rpc.cap", NULL);
+    capture.fp = g_fopen (path, "ab");
+    if (!capture.fp) {
+        ccnet_warning ("[RPC Capture] Failed to open %s: %s\n",
+                       path, strerror(errno));
+        g_free (path);
+        return;
+    }
+    fseek (capture.fp, 0, SEEK_END);
+    capture.size = ftell (capture.fp);
+    if (capture.size <= 0) {
+        fputs (CAPTURE_MAGIC, capture.fp);
+        capture.size = strlen (CAPTURE_MAGIC);
+    }
+
+    ccnet_message ("[RPC Capture] Recording calls to %s, sample rate %g\n",
+                   path, capture.sample_rate);
+    g_free (path);
+
+    capture.flush_timer = ccnet_timer_new (flush_capture, NULL,
+                                           FLUSH_INTERVAL);
+    capture.enabled = TRUE;
+}
+
+gint64
+ccnet_rpc_capture_sample (void)
+{
+    if (!capture.enabled)
+        return 0;
+    if (capture.sample_rate < 1 && g_random_double () >= capture.sample_rate)
+        return 0;
+    return g_get_monotonic_time ();
+}
+
+/*
+ * Replace the string arguments, all strings after the function name,
+ * by hex digits of their hash. The length stays the same, and so do
+ * the result sizes of most lookups.
+ */
+static void
+redact_strings (char *fcall, gsize len)
+{
+    char *p = fcall, *end = fcall + len, *s;
+    char hex[9];
+    guint32 h;
+    gboolean fname = TRUE;
+    gsize i;
+
+    while (p < end) {
+        if (*p++ != '"')
+            continue;
+        for (s = p; p < end && *p != '"'; ++p)
+            if (*p == '\\' && p + 1 < end)
+                ++p;
+        if (fname) {
+            fname = FALSE;
+        } else {
+            h = 2166136261u;
+            for (i = 0; i < p - s; ++i)
+                h = (h ^ (guchar)s[i]) * 16777619u;
+            g_snprintf (hex, sizeof(hex), "%08x", h);
+            for (i = 0; i < p - s; ++i)
+                s[i] = hex[i % 8];
+        }
+        ++p;
+    }
+}
+
+static gboolean
+should_redact (const char *fcall, gsize len)
+{
+    char fname[RPC_MAX_FNAME_LEN];
+
+    if (capture.redact_all)
+        return TRUE;
+    /* Unparsable calls fail anyway, but may hold anything. */
+    if (!ccnet_rpc_parse_fname (fcall, len, fname))
+        return TRUE;
+    return g_hash_table_contains (capture.redact, fname);
+}
+
+void
+ccnet_rpc_capture_record (const char *svc_name,
+                          const char *fcall, gsize len,
+                          gint64 t_arrival, gsize ret_len,
+                          gboolean in_batch)
+{
+    gint64 now = g_get_monotonic_time ();
+    gint64 t_wall = g_get_real_time () - (now - t_arrival);
+    char *copy = NULL;
+    int n;
+
+    if (!capture.enabled)
+        return;
+
+    if (should_redact (fcall, len)) {
+        fcall = copy = g_memdup (fcall, len);
+        redact_strings (copy, len);
+    }
+
+    pthread_mutex_lock (&capture.lock);
+    if (capture.enabled) {
+        n = fprintf (capture.fp, "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+                     " %" G_GSIZE_FORMAT " %c %s %" G_GSIZE_FORMAT "\n",
+                     t_wall, now - t_arrival, ret_len, in_batch ? 'B' : 'C',
+                     svc_name, len);
+        fwrite (fcall, 1, len, capture.fp);
+        fputc ('\n', capture.fp);
+        capture.size += MAX (n, 0) + len + 1;
+
+        if (capture.size >= capture.max_size) {
+            ccnet_message ("[RPC Capture] Size limit reached, stopped\n");
+            capture.enabled = FALSE;
+            fclose (capture.fp);
+            capture.fp = NULL;
+        }
+    }
+    pthread_mutex_unlock (&capture.lock);
+
+    g_free (copy);
+}
@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_RPC_CAPTURE_H
+#define CCNET_RPC_CAPTURE_H
+
+#include <glib.h>
+
+/*
+ * Records the rpc calls served by the rpcserver processors, so that a
+ * production mix can be replayed against a test server with
+ * tools/ccnet-rpcreplay.py. Turned on by the [RPC Capture] section:
+ *
+ *   [RPC Capture]
+ *   FILE = /var/tmp/ccnet-rpc.cap      (default <config dir>/rpc.cap)
+ *   SAMPLE_RATE = 0.1                  (of the calls, default 1)
+ *   REDACT = validate_emailuser;...    ("*" for all functions)
+ *   MAX_SIZE = 1024                    (MB, capturing stops there)
+ *
+ * The file starts with "CCNET-RPC-CAPTURE 1\n" and has a record
+ *
+ *   <arrival usec> <duration usec> <result len> <C|B> <service> <len>\n
+ *   <len bytes of the call>\n
+ *
+ * per call, B for the calls of a batch, which share its arrival time.
+ * The duration includes the wait for a worker. The string arguments of
+ * redacted functions are replaced by hashes of the same length, so
+ * equal values stay equal. Binary calls are not recorded.
+ */
+
+void ccnet_rpc_capture_init (GKeyFile *keyf, const char *config_dir);
+
+/* The arrival time of a call arriving now if it is to be recorded,
+ * 0 if not. The calls of a batch are sampled together. */
+gint64 ccnet_rpc_capture_sample (void);
+
+/* Called from any thread once the call returned. */
+void ccnet_rpc_capture_record (const char *svc_name,
+                               const char *fcall, gsize len,
+                               gint64 t_arrival, gsize ret_len,
+                               gboolean in_batch);
+
+#endif
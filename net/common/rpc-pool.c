@@ -0,0 +1,243 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "rpc-pool.h"
+#include "rpc-cache.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_OTHER
+#include "log.h"
+
+#define DEFAULT_THREADS        16
+#define DEFAULT_QUEUE         256
+#define DEFAULT_BATCH_THREADS   4
+#define DEFAULT_BATCH_QUEUE    64
+
+/* Listing functions, which may walk the whole user db or LDAP. */
+static const char *default_batch_funcs =
+    "get_emailusers, get_emailusers_after, count_emailusers, "
+    "get_all_groups, get_all_groups_after, get_all_orgs, "
+    "get_all_orgs_after, get_org_emailusers";
+
+enum {
+    LANE_INTERACTIVE,
+    LANE_BATCH,
+    N_LANES
+};
+
+struct RpcLane {
+    const char      *name;
+    CcnetJobManager *job_mgr;
+    int              threads;
+    int              max_pending;   /* running and queued calls */
+    volatile gint    pending;
+    gint64           calls;
+    gint64           rejected;
+};
+
+typedef struct RpcPool {
+    char       *svc_name;
+    RpcLane     lanes[N_LANES];
+    GHashTable *batch_funcs;
+} RpcPool;
+
+/* Pools are created and looked up only in the main thread. */
+static GKeyFile   *pool_conf;
+static GHashTable *pools;       /* service name -> RpcPool */
+
+void
+ccnet_rpc_pool_init (GKeyFile *keyf)
+{
+    pool_conf = keyf;
+    pools = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+/* "<service>.<key>" if it is set, otherwise "<key>". */
+static char *
+conf_key (const char *svc_name, const char *key)
+{
+    char *svc_key = g_strconcat (svc_name, ".", key, NULL);
+
+    if (pool_conf &&
+        g_key_file_has_key (pool_conf, "RPC Pool", svc_key, NULL))
+        return svc_key;
+    g_free (svc_key);
+
+    if (pool_conf && g_key_file_has_key (pool_conf, "RPC Pool", key, NULL))
+        return g_strdup (key);
+    return NULL;
+}
+
+static int
+conf_get_int (const char *svc_name, const char *key, int def)
+{
+    char *k = conf_key (svc_name, key);
+    int value = def;
+
+    if (k) {
+        value = g_key_file_get_integer (pool_conf, "RPC Pool", k, NULL);
+        g_free (k);
+    }
+    return value;
+}
+
+static void
+conf_get_cpus (const char *svc_name, const char *key, CcnetCpuSet *set)
+{
+    char *k = conf_key (svc_name, key);
+
+    if (k) {
+        ccnet_cpu_set_load (set, pool_conf, "RPC Pool", k);
+        g_free (k);
+    }
+}
+
+static void
+lane_init (RpcLane *lane, const char *svc_name, const char *name,
+           int threads, int queue, const CcnetCpuSet *cpus)
+{
+    CcnetJobManagerOptions options;
+    char *placement;
+
+    if (threads <= 0)
+        threads = 1;
+    if (queue < 0)
+        queue = 0;
+
+    lane->name = name;
+    lane->threads = threads;
+    lane->max_pending = threads + queue;
+
+    memset (&options, 0, sizeof(options));
+    options.max_threads = threads;
+    options.cpus = *cpus;
+    lane->job_mgr = ccnet_job_manager_new_full (&options);
+
+    placement = g_strdup_printf ("rpc %s %s", svc_name, name);
+    ccnet_cpu_set_record (placement, cpus);
+    g_free (placement);
+}
+
+static RpcPool *
+rpc_pool_new (const char *svc_name)
+{
+    RpcPool *pool = g_new0 (RpcPool, 1);
+    CcnetCpuSet cpus, batch_cpus;
+    char *k, *funcs;
+    char **names, **p;
+
+    /* The batch lane runs where the other one does unless told. */
+    memset (&cpus, 0, sizeof(cpus));
+    conf_get_cpus (svc_name, "CPUS", &cpus);
+    batch_cpus = cpus;
+    conf_get_cpus (svc_name, "BATCH_CPUS", &batch_cpus);
+
+    pool->svc_name = g_strdup (svc_name);
+    lane_init (&pool->lanes[LANE_INTERACTIVE], svc_name, "interactive",
+               conf_get_int (svc_name, "THREADS", DEFAULT_THREADS),
+               conf_get_int (svc_name, "QUEUE", DEFAULT_QUEUE), &cpus);
+    lane_init (&pool->lanes[LANE_BATCH], svc_name, "batch",
+               conf_get_int (svc_name, "BATCH_THREADS", DEFAULT_BATCH_THREADS),
+               conf_get_int (svc_name, "BATCH_QUEUE", DEFAULT_BATCH_QUEUE),
+               &batch_cpus);
+
+    k = conf_key (svc_name, "BATCH_FUNCTIONS");
+    if (k) {
+        funcs = g_key_file_get_string (pool_conf, "RPC Pool", k, NULL);
+        g_free (k);
+    } else
+        funcs = g_strdup (default_batch_funcs);
+
+    pool->batch_funcs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+    names = g_strsplit (funcs ? funcs : "", ",", -1);
+    for (p = names; *p; ++p) {
+        g_strstrip (*p);
+        if (**p)
+            g_hash_table_insert (pool->batch_funcs, g_strdup (*p),
+                                 GINT_TO_POINTER (1));
+    }
+    g_strfreev (names);
+    g_free (funcs);
+
+    ccnet_message ("RPC pool for %s: %d+%d threads, %d batch functions\n",
+                   svc_name, pool->lanes[LANE_INTERACTIVE].threads,
+                   pool->lanes[LANE_BATCH].threads,
+                   g_hash_table_size (pool->batch_funcs));
+    return pool;
+}
+
+RpcLane *
+ccnet_rpc_pool_acquire (const char *svc_name,
+                        const char *fcall, gsize fcall_len,
+                        gboolean batch)
+{
+    char fname[RPC_MAX_FNAME_LEN];
+    RpcPool *pool;
+    RpcLane *lane;
+
+    pool = g_hash_table_lookup (pools, svc_name);
+    if (!pool) {
+        pool = rpc_pool_new (svc_name);
+        g_hash_table_insert (pools, pool->svc_name, pool);
+    }
+
+    if (batch ||
+        (fcall && ccnet_rpc_parse_fname (fcall, fcall_len, fname) &&
+         g_hash_table_lookup (pool->batch_funcs, fname)))
+        lane = &pool->lanes[LANE_BATCH];
+    else
+        lane = &pool->lanes[LANE_INTERACTIVE];
+
+    lane->calls++;
+    if (g_atomic_int_get (&lane->pending) >= lane->max_pending) {
+        lane->rejected++;
+        ccnet_debug ("[RPC Pool] %s %s lane is full\n", svc_name, lane->name);
+        return NULL;
+    }
+
+    g_atomic_int_inc (&lane->pending);
+    return lane;
+}
+
+CcnetJobManager *
+ccnet_rpc_lane_get_job_manager (RpcLane *lane)
+{
+    return lane->job_mgr;
+}
+
+void
+ccnet_rpc_lane_release (RpcLane *lane)
+{
+    g_atomic_int_add (&lane->pending, -1);
+}
+
+static void
+append_pool_stats (gpointer key, gpointer value, gpointer vbuf)
+{
+    RpcPool *pool = value;
+    GString *buf = vbuf;
+    RpcLane *lane;
+    int i;
+
+    for (i = 0; i < N_LANES; ++i) {
+        lane = &pool->lanes[i];
+        g_string_append_printf (buf, "%s %s threads %d queue %d pending %d "
+                                "calls %" G_GINT64_FORMAT
+                                " rejected %" G_GINT64_FORMAT "\n",
+                                pool->svc_name, lane->name, lane->threads,
+                                lane->max_pending - lane->threads,
+                                g_atomic_int_get (&lane->pending),
+                                lane->calls, lane->rejected);
+    }
+}
+
+char *
+ccnet_rpc_pool_get_stats (void)
+{
+    GString *buf = g_string_new (NULL);
+
+    if (pools)
+        g_hash_table_foreach (pools, append_pool_stats, buf);
+    return g_string_free (buf, FALSE);
+}
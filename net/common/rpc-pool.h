@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_RPC_POOL_H
+#define CCNET_RPC_POOL_H
+
+#include <glib.h>
+
+#include "job-mgr.h"
+
+/*
+ * Worker threads for the threaded rpc services. Every service gets
+ * its own pool, so a slow service can't hold up the others or the
+ * processor threads on session->job_mgr.
+ *
+ * A pool has two lanes. Batch calls and the functions listed in
+ * BATCH_FUNCTIONS go to the batch lane, all other calls to the
+ * interactive lane. A call that finds its lane's queue full is
+ * answered at once with the error RPC_ERR_BUSY.
+ *
+ *   [RPC Pool]
+ *   THREADS = 16
+ *   QUEUE = 256
+ *   BATCH_THREADS = 4
+ *   BATCH_QUEUE = 64
+ *   BATCH_FUNCTIONS = get_emailusers, count_emailusers
+ *
+ * A key prefixed with "<service>." is for that service only, e.g.
+ * "ccnet-threaded-rpcserver.THREADS = 32".
+ */
+
+typedef struct RpcLane RpcLane;
+
+void ccnet_rpc_pool_init (GKeyFile *keyf);
+
+/*
+ * Take a place on the lane for a call to @svc_name, NULL if the lane
+ * is full. The place is held till ccnet_rpc_lane_release().
+ */
+RpcLane *ccnet_rpc_pool_acquire (const char *svc_name,
+                                 const char *fcall, gsize fcall_len,
+                                 gboolean batch);
+
+CcnetJobManager *ccnet_rpc_lane_get_job_manager (RpcLane *lane);
+
+/* May be called from the worker thread. */
+void ccnet_rpc_lane_release (RpcLane *lane);
+
+char *ccnet_rpc_pool_get_stats (void);
+
+#endif
@@ -21,9 +21,19 @@
 #endif
 #include "searpc-server.h"
 #include "ccnet-config.h"
+#include "rpc-binary.h"
+#include "rpc-cache.h"
+#include "rpc-capture.h"
+#include "rpc-arena.h"
+#include "cpu-set.h"
+#include "mem-stats.h"
+#include "profiler.h"
 
 #ifdef CCNET_SERVER
+#include <pthread.h>
+
 #include "server-session.h"
+#include "rpc-pool.h"
 #endif
 
 #define DEBUG_FLAG CCNET_DEBUG_OTHER
@@ -37,11 +47,17 @@ extern CcnetSession *session;
 
 #include "searpc-signature.h"
 #include "searpc-marshal.h"
+#include "rpc-fast-marshal.h"
+
+static void register_function (const char *svc_name, void *func,
+                               const char *fname, gchar *signature);
 
 void
 ccnet_start_rpc(CcnetSession *session)
 {
     searpc_server_init (register_marshals);
+    ccnet_rpc_cache_init (session->keyf);
+    ccnet_rpc_capture_init (session->keyf, session->config_dir);
 
     searpc_create_service ("ccnet-rpcserver");
     ccnet_proc_factory_register_processor (session->proc_factory,
@@ -49,298 +65,441 @@ ccnet_start_rpc(CcnetSession *session)
                                            CCNET_TYPE_RPCSERVER_PROC);
 
 #ifdef CCNET_SERVER
+    ccnet_rpc_pool_init (session->keyf);
     searpc_create_service ("ccnet-threaded-rpcserver");
     ccnet_proc_factory_register_processor (session->proc_factory,
                                            "ccnet-threaded-rpcserver",
                                            CCNET_TYPE_THREADED_RPCSERVER_PROC);
 #endif
 
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_list_peers,
-                                     "list_peers",
-                                     searpc_signature_string__void());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_list_resolving_peers,
-                                     "list_resolving_peers",
-                                     searpc_signature_objlist__void());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_peers_by_role,
-                                     "get_peers_by_role",
-                                     searpc_signature_objlist__string());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_peer,
-                                     "get_peer",
-                                     searpc_signature_object__string());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_peer_by_idname,
-                                     "get_peer_by_idname",
-                                     searpc_signature_object__string());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_update_peer_address,
-                                     "update_peer_address",
-                                     searpc_signature_int__string_string_int());
-
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_session_info,
-                                     "get_session_info",
-                                     searpc_signature_object__void());
-
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_add_client,
-                                     "add_client",
-                                     searpc_signature_int__string());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_add_role,
-                                     "add_role",
-                                     searpc_signature_int__string_string());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_remove_role,
-                                     "remove_role",
-                                     searpc_signature_int__string_string());
-
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_procs_alive,
-                                     "get_procs_alive",
-                                     searpc_signature_objlist__int_int());
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_count_procs_alive,
-                                     "count_procs_alive",
-                                     searpc_signature_int__void());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_procs_dead,
-                                     "get_procs_dead",
-                                     searpc_signature_objlist__int_int());
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_count_procs_dead,
-                                     "count_procs_dead",
-                                     searpc_signature_int__void());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_list_peers,
+                       "list_peers",
+                       searpc_signature_string__void());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_list_resolving_peers,
+                       "list_resolving_peers",
+                       searpc_signature_objlist__void());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_peers_by_role,
+                       "get_peers_by_role",
+                       searpc_signature_objlist__string());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_peer,
+                       "get_peer",
+                       searpc_signature_object__string());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_peer_by_idname,
+                       "get_peer_by_idname",
+                       searpc_signature_object__string());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_update_peer_address,
+                       "update_peer_address",
+                       searpc_signature_int__string_string_int());
+
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_session_info,
+                       "get_session_info",
+                       searpc_signature_object__void());
+
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_add_client,
+                       "add_client",
+                       searpc_signature_int__string());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_add_role,
+                       "add_role",
+                       searpc_signature_int__string_string());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_remove_role,
+                       "remove_role",
+                       searpc_signature_int__string_string());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_import_peers,
+                       "import_peers",
+                       searpc_signature_string__string());
+
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_procs_alive,
+                       "get_procs_alive",
+                       searpc_signature_objlist__int_int());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_count_procs_alive,
+                       "count_procs_alive",
+                       searpc_signature_int__void());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_procs_dead,
+                       "get_procs_dead",
+                       searpc_signature_objlist__int_int());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_count_procs_dead,
+                       "count_procs_dead",
+                       searpc_signature_int__void());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_proc_pool_stats,
+                       "get_proc_pool_stats",
+                       searpc_signature_string__void());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_memory_stats,
+                       "get_memory_stats",
+                       searpc_signature_string__void());
     
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_config,
-                                     "get_config",
-                                     searpc_signature_string__string());
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_set_config,
-                                     "set_config",
-                                     searpc_signature_int__string_string());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_config,
+                       "get_config",
+                       searpc_signature_string__string());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_set_config,
+                       "set_config",
+                       searpc_signature_int__string_string());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_rpc_cache_stats,
+                       "get_rpc_cache_stats",
+                       searpc_signature_string__void());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_set_log_level,
+                       "set_log_level",
+                       searpc_signature_int__string_string());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_log_levels,
+                       "get_log_levels",
+                       searpc_signature_string__void());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_profile,
+                       "profile",
+                       searpc_signature_string__string_int());
 
 
 #ifdef CCNET_SERVER
 
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_list_peer_stat,
-                                     "list_peer_stat",
-                                     searpc_signature_objlist__void());
-
-
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_add_emailuser,
-                                     "add_emailuser",
-                                     searpc_signature_int__string_string_int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_emailuser,
-                                     "remove_emailuser",
-                                     searpc_signature_int__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_validate_emailuser,
-                                     "validate_emailuser",
-                                     searpc_signature_int__string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_emailuser,
-                                     "get_emailuser",
-                                     searpc_signature_object__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_emailuser_by_id,
-                                     "get_emailuser_by_id",
-                                     searpc_signature_object__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_emailusers,
-                                     "get_emailusers",
-                                     searpc_signature_objlist__int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_count_emailusers,
-                                     "count_emailusers",
-                                     searpc_signature_int64__void());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_update_emailuser,
-                                     "update_emailuser",
-                                     searpc_signature_int__int_string_int_int());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_list_peer_stat,
+                       "list_peer_stat",
+                       searpc_signature_objlist__void());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_traffic_stats,
+                       "get_traffic_stats",
+                       searpc_signature_string__void());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_rpc_pool_stats,
+                       "get_rpc_pool_stats",
+                       searpc_signature_string__void());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_placement_stats,
+                       "get_placement_stats",
+                       searpc_signature_string__void());
+
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_db_pool_stats,
+                       "get_db_pool_stats",
+                       searpc_signature_string__void());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_user_cache_stats,
+                       "get_user_cache_stats",
+                       searpc_signature_string__void());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_org_cache_stats,
+                       "get_org_cache_stats",
+                       searpc_signature_string__void());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_org_shard_stats,
+                       "get_org_shard_stats",
+                       searpc_signature_string__void());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_get_preload_stats,
+                       "get_preload_stats",
+                       searpc_signature_string__void());
+
+
+    /* Peer lookups which don't go through the main loop. */
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_view_list_peers,
+                       "list_peers",
+                       searpc_signature_string__void());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_view_get_peers_by_role,
+                       "get_peers_by_role",
+                       searpc_signature_objlist__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_view_get_peer,
+                       "get_peer",
+                       searpc_signature_object__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_view_get_peer_by_idname,
+                       "get_peer_by_idname",
+                       searpc_signature_object__string());
+
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_add_emailuser,
+                       "add_emailuser",
+                       searpc_signature_int__string_string_int_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_remove_emailuser,
+                       "remove_emailuser",
+                       searpc_signature_int__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_validate_emailuser,
+                       "validate_emailuser",
+                       searpc_signature_int__string_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_emailuser,
+                       "get_emailuser",
+                       searpc_signature_object__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_emailuser_by_id,
+                       "get_emailuser_by_id",
+                       searpc_signature_object__int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_emailusers,
+                       "get_emailusers",
+                       searpc_signature_objlist__int_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_emailusers_after,
+                       "get_emailusers_after",
+                       searpc_signature_objlist__int_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_search_emailusers,
+                       "search_emailusers",
+                       searpc_signature_objlist__string_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_count_emailusers,
+                       "count_emailusers",
+                       searpc_signature_int64__void());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_update_emailuser,
+                       "update_emailuser",
+                       searpc_signature_int__int_string_int_int());
+
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_add_binding,
+                       "add_binding",
+                       searpc_signature_int__string_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_binding_email,
+                       "get_binding_email",
+                       searpc_signature_string__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_binding_peerids,
+                       "get_binding_peerids",
+                       searpc_signature_string__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_remove_binding,
+                       "remove_binding",
+                       searpc_signature_int__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_remove_one_binding,
+                       "remove_one_binding",
+                       searpc_signature_int__string_string());
 
     /* RSA sign a message with my private key. */
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_sign_message,
-                                     "sign_message",
-                                     searpc_signature_string__string());
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_sign_message,
+                       "sign_message",
+                       searpc_signature_string__string());
+#ifdef CCNET_SERVER
+    /* Same, without blocking the main loop. */
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_sign_message,
+                       "sign_message",
+                       searpc_signature_string__string());
+#endif
 
     /* Verify a message with a peer's public key */
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_verify_message,
-                                     "verify_message",
-                                     searpc_signature_int__string_string_string());
-
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_create_group,
-                                     "create_group",
-                                     searpc_signature_int__string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_create_org_group,
-                                     "create_org_group",
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_verify_message,
+                       "verify_message",
+                       searpc_signature_int__string_string_string());
+    /* The same for many messages, on the crypto threads */
+    register_function ("ccnet-rpcserver",
+                       ccnet_rpc_verify_messages,
+                       "verify_messages",
+                       searpc_signature_string__string());
+
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_create_group,
+                       "create_group",
+                       searpc_signature_int__string_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_create_org_group,
+                       "create_org_group",
                                  searpc_signature_int__int_string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_group,
-                                     "remove_group",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_group_add_member,
-                                     "group_add_member",
-                                     searpc_signature_int__int_string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_group_remove_member,
-                                     "group_remove_member",
-                                     searpc_signature_int__int_string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_group_set_admin,
-                                     "group_set_admin",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_group_unset_admin,
-                                     "group_unset_admin",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_quit_group,
-                                     "quit_group",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_groups,
-                                     "get_groups",
-                                     searpc_signature_objlist__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_all_groups,
-                                     "get_all_groups",
-                                     searpc_signature_objlist__int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_group,
-                                     "get_group",
-                                     searpc_signature_object__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_group_members,
-                                     "get_group_members",
-                                     searpc_signature_objlist__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_check_group_staff,
-                                     "check_group_staff",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_group_user,
-                                     "remove_group_user",
-                                     searpc_signature_int__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_is_group_user,
-                                     "is_group_user",
-                                     searpc_signature_int__int_string());
-
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_create_org,
-                                     "create_org",
-                                     searpc_signature_int__string_string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_org,
-                                     "remove_org",
-                                     searpc_signature_int__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_all_orgs,
-                                     "get_all_orgs",
-                                     searpc_signature_objlist__int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_org_by_url_prefix,
-                                     "get_org_by_url_prefix",
-                                     searpc_signature_object__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_org_by_id,
-                                     "get_org_by_id",
-                                     searpc_signature_object__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_add_org_user,
-                                     "add_org_user",
-                                     searpc_signature_int__int_string_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_org_user,
-                                     "remove_org_user",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_orgs_by_user,
-                                     "get_orgs_by_user",
-                                     searpc_signature_objlist__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_org_emailusers,
-                                     "get_org_emailusers",
-                                     searpc_signature_objlist__string_int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_add_org_group,
-                                     "add_org_group",
-                                     searpc_signature_int__int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_org_group,
-                                     "remove_org_group",
-                                     searpc_signature_int__int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_is_org_group,
-                                     "is_org_group",
-                                     searpc_signature_int__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_org_id_by_group,
-                                     "get_org_id_by_group",
-                                     searpc_signature_int__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_org_groups,
-                                     "get_org_groups",
-                                     searpc_signature_objlist__int_int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_org_user_exists,
-                                     "org_user_exists",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_is_org_staff,
-                                     "is_org_staff",
-                                     searpc_signature_int__int_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_remove_group,
+                       "remove_group",
+                       searpc_signature_int__int_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_group_add_member,
+                       "group_add_member",
+                       searpc_signature_int__int_string_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_group_remove_member,
+                       "group_remove_member",
+                       searpc_signature_int__int_string_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_group_add_members,
+                       "group_add_members",
+                       searpc_signature_string__int_string_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_group_remove_members,
+                       "group_remove_members",
+                       searpc_signature_string__int_string_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_group_set_admin,
+                       "group_set_admin",
+                       searpc_signature_int__int_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_group_unset_admin,
+                       "group_unset_admin",
+                       searpc_signature_int__int_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_quit_group,
+                       "quit_group",
+                       searpc_signature_int__int_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_groups,
+                       "get_groups",
+                       searpc_signature_objlist__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_groups_by_users,
+                       "get_groups_by_users",
+                       searpc_signature_objlist__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_all_groups,
+                       "get_all_groups",
+                       searpc_signature_objlist__int_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_all_groups_after,
+                       "get_all_groups_after",
+                       searpc_signature_objlist__int_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_group,
+                       "get_group",
+                       searpc_signature_object__int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_group_members,
+                       "get_group_members",
+                       searpc_signature_objlist__int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_count_group_members,
+                       "count_group_members",
+                       searpc_signature_int__int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_changes_since,
+                       "get_changes_since",
+                       searpc_signature_string__int64_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_check_group_staff,
+                       "check_group_staff",
+                       searpc_signature_int__int_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_remove_group_user,
+                       "remove_group_user",
+                       searpc_signature_int__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_is_group_user,
+                       "is_group_user",
+                       searpc_signature_int__int_string());
+
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_create_org,
+                       "create_org",
+                       searpc_signature_int__string_string_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_remove_org,
+                       "remove_org",
+                       searpc_signature_int__int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_all_orgs,
+                       "get_all_orgs",
+                       searpc_signature_objlist__int_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_all_orgs_after,
+                       "get_all_orgs_after",
+                       searpc_signature_objlist__int_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_org_by_url_prefix,
+                       "get_org_by_url_prefix",
+                       searpc_signature_object__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_org_by_id,
+                       "get_org_by_id",
+                       searpc_signature_object__int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_add_org_user,
+                       "add_org_user",
+                       searpc_signature_int__int_string_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_remove_org_user,
+                       "remove_org_user",
+                       searpc_signature_int__int_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_orgs_by_user,
+                       "get_orgs_by_user",
+                       searpc_signature_objlist__string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_org_emailusers,
+                       "get_org_emailusers",
+                       searpc_signature_objlist__string_int_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_add_org_group,
+                       "add_org_group",
+                       searpc_signature_int__int_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_remove_org_group,
+                       "remove_org_group",
+                       searpc_signature_int__int_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_is_org_group,
+                       "is_org_group",
+                       searpc_signature_int__int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_org_id_by_group,
+                       "get_org_id_by_group",
+                       searpc_signature_int__int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_get_org_groups,
+                       "get_org_groups",
+                       searpc_signature_objlist__int_int_int());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_org_user_exists,
+                       "org_user_exists",
+                       searpc_signature_int__int_string());
+    register_function ("ccnet-threaded-rpcserver",
+                       ccnet_rpc_is_org_staff,
+                       "is_org_staff",
+                       searpc_signature_int__int_string());
 
 #endif  /* CCNET_SERVER */
 
 }
 
+static gboolean
+append_peer_id (CcnetPeer *peer, void *result)
+{
+    g_string_append_printf (result, "%s\n", peer->id);
+    return TRUE;
+}
+
 char *
 ccnet_rpc_list_peers(GError **error)
 {
-    CcnetPeerManager *peer_mgr = session->peer_mgr;
-    GList *peer_list, *ptr;
-    GString *result;
-    CcnetPeer *peer;
+    GString *result = g_string_new("");
 
-    peer_list = ccnet_peer_manager_get_peer_list(peer_mgr);
-    if (peer_list == NULL) {
-        g_set_error(error, CCNET_DOMAIN, CCNET_ERR_INTERNAL, "Failed to get peer list");
-        return NULL;
-    }
-
-    result = g_string_new("");
-    ptr = peer_list;
-    while (ptr) {
-        peer = ptr->data;
-        g_string_append_printf(result, "%s\n", peer->id);
-        ptr = ptr->next;
-    }
-    g_list_free(peer_list);
+    ccnet_peer_manager_foreach (session->peer_mgr, append_peer_id, result);
 
     return g_string_free(result, FALSE);
 }
@@ -438,6 +597,33 @@ ccnet_rpc_add_client(const char *peer_id, GError **error)
     return 0;
 }
 
+/*
+ * @records as for ccnet_peer_manager_import_peers(). Returns the number
+ * of peers imported on the first line and "<line> <reason>" for each
+ * record left out after it.
+ */
+char *
+ccnet_rpc_import_peers (const char *records, GError **error)
+{
+    GString *errors, *result;
+    int n;
+
+    if (!records) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Records can not be NULL");
+        return NULL;
+    }
+
+    errors = g_string_new (NULL);
+    n = ccnet_peer_manager_import_peers (session->peer_mgr, records,
+                                         session->crypto_job_mgr, errors);
+    result = g_string_new (NULL);
+    g_string_printf (result, "%d\n%s", n, errors->str);
+    g_string_free (errors, TRUE);
+
+    return g_string_free (result, FALSE);
+}
+
 int
 ccnet_rpc_add_role(const char *peer_id, const char *role, GError **error)
 {
@@ -494,29 +680,76 @@ ccnet_rpc_remove_role(const char *peer_id, const char *role, GError **error)
 }
 
 
+typedef struct {
+    GList *res;
+    int    skip;
+    int    limit;
+} ProcsAliveData;
+
+static gboolean
+collect_proc_alive (CcnetProcessor *processor, void *vdata)
+{
+    ProcsAliveData *data = vdata;
+    CcnetProc *proc;
+
+    if (data->skip > 0) {
+        --data->skip;
+        return TRUE;
+    }
+
+    proc = ccnet_proc_new();
+    g_object_set (proc, "name", GET_PNAME(processor),
+                  "peer-name", processor->peer->name,
+                  "ctime", (int) processor->start_time,
+                  "dtime", 0, NULL);
+    data->res = g_list_prepend (data->res, proc);
+    return --data->limit != 0;
+}
+
+/*
+ * Paging through the list usually asks for the page after the last one,
+ * which continues the last cursor instead of skipping @offset entries.
+ * A cursor older than PROCS_ALIVE_CURSOR_TTL is not continued, it would
+ * miss the processors created since.
+ */
+#define PROCS_ALIVE_CURSOR_TTL 60
+
+static CcnetProcCursor *procs_alive_cursor;
+static time_t procs_alive_time;
+
 GList *
 ccnet_rpc_get_procs_alive(int offset, int limit, GError **error)
 {
-    GList *res = NULL;
-    struct list_head *pos, *tmp;
-    struct list_head *list = &(session->proc_factory->procs_list);
-    CcnetProcessor *processor;
-    int index = 0, cnt = 0;
-    
-    list_for_each_safe (pos, tmp, list) {
-        if (index++ < offset) continue;
-        if (limit >= 0 && cnt >= limit) break;
-
-        processor = list_entry (pos, CcnetProcessor, list);
-        CcnetProc *proc = ccnet_proc_new();
-        g_object_set (proc, "name", GET_PNAME(processor),
-                      "peer-name", processor->peer->name,
-                      "ctime", (int) processor->start_time,
-                      "dtime", 0, NULL);
-        res = g_list_prepend (res, proc);
-        ++cnt;
+    ProcsAliveData data;
+
+    if (limit == 0)
+        return NULL;
+
+    if (procs_alive_cursor &&
+        (offset <= 0 ||
+         ccnet_proc_cursor_position (procs_alive_cursor) != offset ||
+         time(NULL) - procs_alive_time > PROCS_ALIVE_CURSOR_TTL)) {
+        ccnet_proc_cursor_close (procs_alive_cursor);
+        procs_alive_cursor = NULL;
     }
-    return g_list_reverse (res);
+
+    memset (&data, 0, sizeof(data));
+    if (!procs_alive_cursor) {
+        procs_alive_cursor = ccnet_proc_factory_open_cursor (
+            session->proc_factory, NULL, NULL, 0);
+        procs_alive_time = time(NULL);
+        data.skip = offset > 0 ? offset : 0;
+    }
+    data.limit = limit;
+
+    /* the skipped ones are counted in the position */
+    if (!ccnet_proc_cursor_step (procs_alive_cursor, G_MAXINT,
+                                 collect_proc_alive, &data)) {
+        ccnet_proc_cursor_close (procs_alive_cursor);
+        procs_alive_cursor = NULL;
+    }
+
+    return g_list_reverse (data.res);
 }
 
 int
@@ -528,27 +761,26 @@ ccnet_rpc_count_procs_alive(GError **error)
 GList *
 ccnet_rpc_get_procs_dead(int offset, int limit, GError **error)
 {
-    GList *procs = session->proc_factory->procs;
-    GList *res = NULL, *ptr;
-    int index = 0, cnt = 0;
-
-    for (ptr = procs; ptr; ptr = ptr->next, index++) {
-        if (index < offset) continue;
-        if (limit >= 0 && cnt >= limit) break;
-
-        CcnetProc *proc = (CcnetProc *)ptr->data;
-        g_object_ref (proc);
-        res = g_list_prepend (res, proc);
-        ++cnt;
-    }
-
-    return g_list_reverse (res);
+    return ccnet_proc_factory_get_history (session->proc_factory,
+                                           offset, limit);
 }
 
 int
 ccnet_rpc_count_procs_dead(GError **error)
 {
-    return g_list_length (session->proc_factory->procs); 
+    return ccnet_proc_factory_count_history (session->proc_factory);
+}
+
+char *
+ccnet_rpc_get_proc_pool_stats (GError **error)
+{
+    return ccnet_proc_factory_get_pool_stats (session->proc_factory);
+}
+
+char *
+ccnet_rpc_get_memory_stats (GError **error)
+{
+    return ccnet_mem_stats_format (session);
 }
 
 
@@ -564,54 +796,231 @@ ccnet_rpc_set_config (const char *key, const char *value, GError **error)
     return ccnet_session_config_set_string (session, key, value);
 }
 
+char *
+ccnet_rpc_get_rpc_cache_stats (GError **error)
+{
+    return ccnet_rpc_cache_get_stats ();
+}
+
+int
+ccnet_rpc_set_log_level (const char *module, const char *level,
+                         GError **error)
+{
+    if (!level || ccnet_log_set_module_level (module, level) < 0) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Invalid module or log level");
+        return -1;
+    }
+    return 0;
+}
+
+char *
+ccnet_rpc_get_log_levels (GError **error)
+{
+    return ccnet_log_get_levels ();
+}
+
+/*
+ * @cmd is "start", with @hz, "stop" or "status", see profiler.h. The
+ * ccnet-rpcserver service runs in the main thread, as the profiler
+ * needs.
+ */
+char *
+ccnet_rpc_profile (const char *cmd, int hz, GError **error)
+{
+    char *result = NULL;
+
+    if (g_strcmp0 (cmd, "start") == 0) {
+        if (ccnet_profiler_start (hz) == 0)
+            result = ccnet_profiler_get_status ();
+    } else if (g_strcmp0 (cmd, "stop") == 0) {
+        result = ccnet_profiler_stop ();
+    } else if (g_strcmp0 (cmd, "status") == 0) {
+        return ccnet_profiler_get_status ();
+    } else {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Unknown profile command");
+        return NULL;
+    }
+
+    if (!result)
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Profiler failed, see the log");
+    return result;
+}
+
 
 #ifdef CCNET_SERVER
 
 #include "user-mgr.h"
 #include "group-mgr.h"
 #include "org-mgr.h"
+#include "change-log.h"
+
+char *
+ccnet_rpc_get_db_pool_stats (GError **error)
+{
+    return ccnet_db_get_pool_stats (session->db);
+}
+
+char *
+ccnet_rpc_get_rpc_pool_stats (GError **error)
+{
+    return ccnet_rpc_pool_get_stats ();
+}
+
+char *
+ccnet_rpc_get_placement_stats (GError **error)
+{
+    return ccnet_cpu_set_get_placement ();
+}
+
+char *
+ccnet_rpc_get_user_cache_stats (GError **error)
+{
+    CcnetUserManager *user_mgr = 
+        ((CcnetServerSession *)session)->user_mgr;
+
+    return ccnet_user_manager_get_cache_stats (user_mgr);
+}
+
+char *
+ccnet_rpc_get_org_cache_stats (GError **error)
+{
+    CcnetOrgManager *org_mgr = 
+        ((CcnetServerSession *)session)->org_mgr;
+
+    return ccnet_org_manager_get_cache_stats (org_mgr);
+}
+
+char *
+ccnet_rpc_get_org_shard_stats (GError **error)
+{
+    CcnetOrgManager *org_mgr = 
+        ((CcnetServerSession *)session)->org_mgr;
+
+    return ccnet_org_manager_get_shard_stats (org_mgr);
+}
+
+char *
+ccnet_rpc_get_preload_stats (GError **error)
+{
+    return ccnet_server_session_get_preload_stats (
+        (CcnetServerSession *)session);
+}
+
+static gboolean
+add_peer_stat (CcnetPeer *peer, void *vres)
+{
+    GList **res = vres;
+    CcnetPeerStat *stat;
+
+    if (peer->is_self)
+        return TRUE;
+
+    stat = ccnet_peer_stat_new ();
+    g_object_set (stat, "id", peer->id,
+                  "name", peer->name,
+                  "ip", peer->addr_str,
+                  "encrypt", peer->encrypt_channel,
+                  "last_up", (gint64) peer->last_up,
+                  "proc_num", (int)ccnet_peer_get_processor_count (peer),
+                  NULL);
+    *res = g_list_prepend (*res, stat);
+    return TRUE;
+}
+
+char *
+ccnet_rpc_view_list_peers (GError **error)
+{
+    CcnetPeerView *view = ccnet_peer_manager_get_view (session->peer_mgr);
+    GString *result = g_string_new ("");
 
+    ccnet_peer_view_append_ids (view, result);
+    ccnet_peer_view_unref (view);
+    return g_string_free (result, FALSE);
+}
 
 GList *
-ccnet_rpc_list_peer_stat (GError **error)
+ccnet_rpc_view_get_peers_by_role (const char *role, GError **error)
 {
-    GList *res = NULL;
-    GList *ptr, *peer_list;
-    CcnetPeer *peer;
-    CcnetPeerManager *peer_mgr = session->peer_mgr;
+    CcnetPeerView *view;
+    GList *peers;
 
-    peer_list = ccnet_peer_manager_get_peer_list(peer_mgr);
-    if (peer_list == NULL) {
-        g_set_error(error, CCNET_DOMAIN, CCNET_ERR_INTERNAL, "Failed to get peer list");
+    if (!role)
         return NULL;
-    }
 
-    ptr = peer_list;
-    while (ptr) {
-        peer = ptr->data;
-        if (peer->is_self) {
-            ptr = ptr->next;
-            continue;
-        }
-        
-        guint proc_num = g_hash_table_size (peer->processors);
-
-        CcnetPeerStat* stat = ccnet_peer_stat_new ();
-        g_object_set (stat, "id", peer->id,
-                      "name", peer->name,
-                      "ip", peer->addr_str,
-                      "encrypt", peer->encrypt_channel,
-                      "last_up", (gint64) peer->last_up,
-                      "proc_num", (int)proc_num,
-                      NULL);
-        res = g_list_prepend (res, stat);
-        ptr = ptr->next;
-    }
-    g_list_free(peer_list);
+    view = ccnet_peer_manager_get_view (session->peer_mgr);
+    peers = ccnet_peer_view_get_peers_with_role (view, role);
+    ccnet_peer_view_unref (view);
+    return peers;
+}
+
+GObject *
+ccnet_rpc_view_get_peer (const char *peer_id, GError **error)
+{
+    CcnetPeerView *view;
+    GObject *peer;
+
+    if (!peer_id)
+        return NULL;
+
+    view = ccnet_peer_manager_get_view (session->peer_mgr);
+    peer = ccnet_peer_view_lookup (view, peer_id);
+    ccnet_peer_view_unref (view);
+    return peer;
+}
+
+GObject *
+ccnet_rpc_view_get_peer_by_idname (const char *idname, GError **error)
+{
+    CcnetPeerView *view;
+    GObject *peer;
+
+    if (!idname)
+        return NULL;
+
+    view = ccnet_peer_manager_get_view (session->peer_mgr);
+    peer = ccnet_peer_view_lookup (view, idname);
+    if (!peer)
+        peer = ccnet_peer_view_lookup_by_name (view, idname);
+    ccnet_peer_view_unref (view);
+    return peer;
+}
+
+GList *
+ccnet_rpc_list_peer_stat (GError **error)
+{
+    GList *res = NULL;
+
+    ccnet_peer_manager_foreach (session->peer_mgr, add_peer_stat, &res);
 
     return g_list_reverse (res);
 }
 
+static gboolean
+format_peer_traffic (CcnetPeer *peer, void *buf)
+{
+    if (!peer->is_self)
+        ccnet_peer_format_traffic (peer, buf);
+    return TRUE;
+}
+
+char *
+ccnet_rpc_get_traffic_stats (GError **error)
+{
+    GString *buf = g_string_new (NULL);
+    char *procs;
+
+    ccnet_peer_manager_foreach (session->peer_mgr, format_peer_traffic, buf);
+
+    procs = ccnet_processor_get_class_stats ();
+    g_string_append (buf, procs);
+    g_free (procs);
+
+    return g_string_free (buf, FALSE);
+}
+
 
 int
 ccnet_rpc_add_emailuser (const char *email, const char *passwd,
@@ -702,6 +1111,37 @@ ccnet_rpc_get_emailusers (int start, int limit, GError **error)
     return emailusers;
 }
 
+GList*
+ccnet_rpc_get_emailusers_after (int last_id, int limit, GError **error)
+{
+    CcnetUserManager *user_mgr = 
+        ((CcnetServerSession *)session)->user_mgr;
+
+    if (limit <= 0) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL, "Bad arguments");
+        return NULL;
+    }
+
+    return ccnet_user_manager_get_emailusers_after (user_mgr, last_id, limit);
+}
+
+#define MAX_SEARCH_RESULTS 100
+
+GList*
+ccnet_rpc_search_emailusers (const char *prefix, int limit, GError **error)
+{
+    CcnetUserManager *user_mgr = 
+        ((CcnetServerSession *)session)->user_mgr;
+
+    if (!prefix || limit <= 0) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL, "Bad arguments");
+        return NULL;
+    }
+
+    return ccnet_user_manager_search_emailusers (user_mgr, prefix,
+                                                 MIN (limit, MAX_SEARCH_RESULTS));
+}
+
 gint64
 ccnet_rpc_count_emailusers (GError **error)
 {
@@ -721,6 +1161,93 @@ ccnet_rpc_update_emailuser (int id, const char* passwd, int is_staff, int is_act
     return ccnet_user_manager_update_emailuser(user_mgr, id, passwd, is_staff, is_active);
 }
 
+int
+ccnet_rpc_add_binding (const char *email, const char *peer_id, GError **error)
+{
+    CcnetUserManager *user_mgr = 
+        ((CcnetServerSession *)session)->user_mgr;
+
+    if (!email || !peer_id) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Email and peer id can not be NULL");
+        return -1;
+    }
+
+    return ccnet_user_manager_add_binding (user_mgr, email, peer_id);
+}
+
+char *
+ccnet_rpc_get_binding_email (const char *peer_id, GError **error)
+{
+    CcnetUserManager *user_mgr = 
+        ((CcnetServerSession *)session)->user_mgr;
+
+    if (!peer_id) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Peer id can not be NULL");
+        return NULL;
+    }
+
+    return ccnet_user_manager_get_binding_email (user_mgr, peer_id);
+}
+
+/* The peer ids, one per line. */
+char *
+ccnet_rpc_get_binding_peerids (const char *email, GError **error)
+{
+    CcnetUserManager *user_mgr = 
+        ((CcnetServerSession *)session)->user_mgr;
+    GList *peer_ids, *ptr;
+    GString *buf;
+
+    if (!email) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Email can not be NULL");
+        return NULL;
+    }
+
+    peer_ids = ccnet_user_manager_get_binding_peerids (user_mgr, email);
+    buf = g_string_new (NULL);
+    for (ptr = peer_ids; ptr; ptr = ptr->next) {
+        g_string_append_printf (buf, "%s\n", (char *)ptr->data);
+        g_free (ptr->data);
+    }
+    g_list_free (peer_ids);
+
+    return g_string_free (buf, FALSE);
+}
+
+int
+ccnet_rpc_remove_binding (const char *email, GError **error)
+{
+    CcnetUserManager *user_mgr = 
+        ((CcnetServerSession *)session)->user_mgr;
+
+    if (!email) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Email can not be NULL");
+        return -1;
+    }
+
+    return ccnet_user_manager_remove_binding (user_mgr, email);
+}
+
+int
+ccnet_rpc_remove_one_binding (const char *email, const char *peer_id,
+                              GError **error)
+{
+    CcnetUserManager *user_mgr = 
+        ((CcnetServerSession *)session)->user_mgr;
+
+    if (!email || !peer_id) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Email and peer id can not be NULL");
+        return -1;
+    }
+
+    return ccnet_user_manager_remove_one_binding (user_mgr, email, peer_id);
+}
+
 
 char *
 ccnet_rpc_sign_message (const char *message, GError **error)
@@ -734,6 +1261,7 @@ ccnet_rpc_sign_message (const char *message, GError **error)
     if (!RSA_sign (NID_sha1, (const unsigned char *)message, strlen(message),
                    sig, &sig_len, session->privkey)) {
         g_warning ("Failed to sign message: %lu.\n", ERR_get_error());
+        g_free (sig);
         return NULL;
     }
 
@@ -771,6 +1299,173 @@ ccnet_rpc_verify_message (const char *message,
     return 0;
 }
 
+/* Messages verified by one crypto job. */
+#define VERIFY_SLICE_SIZE 16
+
+typedef struct {
+    const char    *message;
+    unsigned char *sig;
+    gsize          sig_len;
+    RSA           *pubkey;          /* NULL if the peer is unknown */
+    gboolean       ok;
+} VerifyItem;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             pending;        /* slices not verified yet */
+} VerifyBatch;
+
+typedef struct {
+    VerifyBatch *batch;
+    VerifyItem  *items;
+    int          n_items;
+} VerifySlice;
+
+static void *
+verify_slice (void *vslice)
+{
+    VerifySlice *slice = vslice;
+    VerifyBatch *batch = slice->batch;
+    int i;
+
+    for (i = 0; i < slice->n_items; i++) {
+        VerifyItem *item = &slice->items[i];
+
+        item->ok = item->pubkey &&
+            RSA_verify (NID_sha1, (const unsigned char *)item->message,
+                        strlen(item->message), item->sig,
+                        (guint)item->sig_len, item->pubkey);
+    }
+
+    /* the batch is on the caller's stack, this is our last access */
+    pthread_mutex_lock (&batch->lock);
+    if (--batch->pending == 0)
+        pthread_cond_signal (&batch->cond);
+    pthread_mutex_unlock (&batch->lock);
+
+    return NULL;
+}
+
+/* The pubkey of @peer_id, shared by all its messages of the batch. */
+static RSA *
+get_batch_pubkey (GHashTable *keys, const char *peer_id)
+{
+    CcnetPeer *peer;
+    RSA *pubkey;
+
+    if (g_hash_table_lookup_extended (keys, peer_id, NULL, (gpointer *)&pubkey))
+        return pubkey;
+
+    pubkey = NULL;
+    peer = ccnet_peer_manager_get_peer (session->peer_mgr, peer_id);
+    if (peer) {
+        if (peer->pubkey) {
+            RSA_up_ref (peer->pubkey);
+            pubkey = peer->pubkey;
+        }
+        g_object_unref (peer);
+    } else
+        g_warning ("Cannot find peer %s.\n", peer_id);
+
+    g_hash_table_insert (keys, g_strdup(peer_id), pubkey);
+    return pubkey;
+}
+
+static void
+free_batch_pubkey (gpointer pubkey)
+{
+    if (pubkey)
+        RSA_free (pubkey);
+}
+
+/*
+ * @messages has a line "<peer_id> <signature> <message>" per message, the
+ * message being the rest of the line. Returns a character per line, '1'
+ * if the signature is valid and '0' if not.
+ *
+ * The peers are looked up here, in the main loop, and the verifications
+ * are spread over the crypto threads. We wait for them, so the main
+ * loop is held up for about a core's share of the work.
+ */
+char *
+ccnet_rpc_verify_messages (const char *messages, GError **error)
+{
+    char **lines;
+    VerifyItem *items;
+    VerifySlice *slices;
+    VerifyBatch batch;
+    GHashTable *keys;
+    char *result;
+    int n_lines, n_slices, i;
+
+    if (!messages) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Messages can not be NULL");
+        return NULL;
+    }
+
+    lines = g_strsplit (messages, "\n", -1);
+    n_lines = g_strv_length (lines);
+    /* a trailing newline doesn't start another message */
+    if (n_lines > 0 && lines[n_lines - 1][0] == '\0')
+        n_lines--;
+
+    items = g_new0 (VerifyItem, MAX(n_lines, 1));
+    keys = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  g_free, free_batch_pubkey);
+
+    for (i = 0; i < n_lines; i++) {
+        char **parts = g_strsplit (lines[i], " ", 3);
+
+        if (g_strv_length (parts) == 3) {
+            items[i].pubkey = get_batch_pubkey (keys, parts[0]);
+            items[i].sig = g_base64_decode (parts[1], &items[i].sig_len);
+            /* points into lines[i], which outlives the batch */
+            items[i].message = lines[i] + strlen(parts[0]) + strlen(parts[1]) + 2;
+        } else
+            items[i].message = "";
+        g_strfreev (parts);
+    }
+
+    n_slices = (n_lines + VERIFY_SLICE_SIZE - 1) / VERIFY_SLICE_SIZE;
+    slices = g_new0 (VerifySlice, MAX(n_slices, 1));
+
+    pthread_mutex_init (&batch.lock, NULL);
+    pthread_cond_init (&batch.cond, NULL);
+    batch.pending = n_slices;
+
+    for (i = 0; i < n_slices; i++) {
+        slices[i].batch = &batch;
+        slices[i].items = items + i * VERIFY_SLICE_SIZE;
+        slices[i].n_items = MIN (VERIFY_SLICE_SIZE,
+                                 n_lines - i * VERIFY_SLICE_SIZE);
+        ccnet_job_manager_schedule_job (session->crypto_job_mgr,
+                                        verify_slice, NULL, &slices[i]);
+    }
+
+    pthread_mutex_lock (&batch.lock);
+    while (batch.pending > 0)
+        pthread_cond_wait (&batch.cond, &batch.lock);
+    pthread_mutex_unlock (&batch.lock);
+    pthread_cond_destroy (&batch.cond);
+    pthread_mutex_destroy (&batch.lock);
+
+    result = g_malloc (n_lines + 1);
+    for (i = 0; i < n_lines; i++) {
+        result[i] = items[i].ok ? '1' : '0';
+        g_free (items[i].sig);
+    }
+    result[n_lines] = '\0';
+
+    g_free (slices);
+    g_free (items);
+    g_hash_table_destroy (keys);
+    g_strfreev (lines);
+
+    return result;
+}
+
 int
 ccnet_rpc_create_group (const char *group_name, const char *user_name,
                         GError **error)
@@ -842,30 +1537,112 @@ ccnet_rpc_group_add_member (int group_id, const char *user_name,
         return -1;
     }
 
-    ret = ccnet_group_manager_add_member (group_mgr, group_id, user_name, member_name,
-                                          error);
-
-    return ret;
+    ret = ccnet_group_manager_add_member (group_mgr, group_id, user_name, member_name,
+                                          error);
+
+    return ret;
+}
+
+int
+ccnet_rpc_group_remove_member (int group_id, const char *user_name,
+                               const char *member_name, GError **error)
+{
+    CcnetGroupManager *group_mgr = 
+        ((CcnetServerSession *)session)->group_mgr;
+    int ret;
+
+    if (!user_name || !member_name) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "User name and member name can not be NULL");
+        return -1;
+    }
+
+    ret = ccnet_group_manager_remove_member (group_mgr, group_id, user_name,
+                                             member_name, error);
+
+    return ret;
+}
+
+typedef int (*BulkMemberFunc) (CcnetGroupManager *, int, const char *,
+                               char **, int, int *, GError **);
+
+/* Split a newline separated list, dropping blank entries. */
+static char **
+split_name_list (const char *list, int *n_names)
+{
+    char **names;
+    int i, n = 0;
+
+    names = g_strsplit (list, "\n", -1);
+    for (i = 0; names[i]; i++) {
+        g_strstrip (names[i]);
+        if (names[i][0] != '\0')
+            names[n++] = names[i];
+        else
+            g_free (names[i]);
+    }
+    names[n] = NULL;
+
+    *n_names = n;
+    return names;
 }
 
-int
-ccnet_rpc_group_remove_member (int group_id, const char *user_name,
-                               const char *member_name, GError **error)
+/* @members is a newline separated list; returns "<member> <status>"
+ * lines, status being one of ok, skipped or failed. Fails as a whole
+ * if the batch could not be applied. */
+static char *
+change_group_members (BulkMemberFunc func, int group_id,
+                      const char *user_name, const char *members,
+                      GError **error)
 {
     CcnetGroupManager *group_mgr = 
         ((CcnetServerSession *)session)->group_mgr;
-    int ret;
+    char **names;
+    int *results;
+    int i, n = 0;
+    GString *buf;
 
-    if (!user_name || !member_name) {
+    if (group_id <= 0 || !user_name || !members) {
         g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
-                     "User name and member name can not be NULL");
-        return -1;
+                     "Group id and user name and members can not be NULL");
+        return NULL;
     }
 
-    ret = ccnet_group_manager_remove_member (group_mgr, group_id, user_name,
-                                             member_name, error);
+    names = split_name_list (members, &n);
 
-    return ret;
+    results = g_new0 (int, n ? n : 1);
+    if (func (group_mgr, group_id, user_name, names, n, results, error) < 0) {
+        g_free (results);
+        g_strfreev (names);
+        return NULL;
+    }
+
+    buf = g_string_new (NULL);
+    for (i = 0; i < n; i++)
+        g_string_append_printf (buf, "%s %s\n", names[i],
+                                results[i] == GROUP_MEMBER_OK ? "ok" :
+                                results[i] == GROUP_MEMBER_SKIPPED ? "skipped" :
+                                "failed");
+
+    g_free (results);
+    g_strfreev (names);
+    return g_string_free (buf, FALSE);
+}
+
+char *
+ccnet_rpc_group_add_members (int group_id, const char *user_name,
+                             const char *members, GError **error)
+{
+    return change_group_members (ccnet_group_manager_add_members,
+                                 group_id, user_name, members, error);
+}
+
+char *
+ccnet_rpc_group_remove_members (int group_id, const char *user_name,
+                                const char *members, GError **error)
+{
+    return change_group_members (ccnet_group_manager_remove_members,
+                                 group_id, user_name, members, error);
 }
 
 int
@@ -967,6 +1744,29 @@ ccnet_rpc_get_groups (const char *username, GError **error)
     return ret;
 }
 
+GList *
+ccnet_rpc_get_groups_by_users (const char *users, GError **error)
+{
+    CcnetGroupManager *group_mgr = 
+        ((CcnetServerSession *)session)->group_mgr;
+    char **names;
+    int n;
+    GList *ret;
+
+    if (!users) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "User names can not be NULL");
+        return NULL;
+    }
+
+    names = split_name_list (users, &n);
+    ret = ccnet_group_manager_get_group_users_by_users (group_mgr, names, n,
+                                                        error);
+    g_strfreev (names);
+
+    return ret;
+}
+
 GList *
 ccnet_rpc_get_all_groups (int start, int limit, GError **error)
 {
@@ -979,6 +1779,21 @@ ccnet_rpc_get_all_groups (int start, int limit, GError **error)
     return ret;
 }
 
+GList *
+ccnet_rpc_get_all_groups_after (int last_id, int limit, GError **error)
+{
+    CcnetGroupManager *group_mgr = 
+        ((CcnetServerSession *)session)->group_mgr;
+
+    if (limit <= 0) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL, "Bad arguments");
+        return NULL;
+    }
+
+    return ccnet_group_manager_get_all_groups_after (group_mgr, last_id,
+                                                     limit, error);
+}
+
 GObject *
 ccnet_rpc_get_group (int group_id, GError **error)
 {
@@ -1010,6 +1825,26 @@ ccnet_rpc_get_group_members (int group_id, GError **error)
     return g_list_reverse (ret);
 }
 
+char *
+ccnet_rpc_get_changes_since (gint64 version, int limit, GError **error)
+{
+    return ccnet_change_log_get_since (version, limit);
+}
+
+int
+ccnet_rpc_count_group_members (int group_id, GError **error)
+{
+    CcnetGroupManager *group_mgr = 
+        ((CcnetServerSession *)session)->group_mgr;
+    int ret;
+
+    ret = ccnet_group_manager_count_group_members (group_mgr, group_id);
+    if (ret < 0)
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Failed to count group members");
+    return ret;
+}
+
 int
 ccnet_rpc_check_group_staff (int group_id, const char *user_name,
                              GError **error)
@@ -1119,6 +1954,19 @@ ccnet_rpc_get_all_orgs (int start, int limit, GError **error)
     return ret;
 }
 
+GList *
+ccnet_rpc_get_all_orgs_after (int last_id, int limit, GError **error)
+{
+    CcnetOrgManager *org_mgr = ((CcnetServerSession *)session)->org_mgr;
+
+    if (limit <= 0) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL, "Bad arguments");
+        return NULL;
+    }
+
+    return ccnet_org_manager_get_all_orgs_after (org_mgr, last_id, limit);
+}
+
 GObject *
 ccnet_rpc_get_org_by_url_prefix (const char *url_prefix, GError **error)
 {
@@ -1341,3 +2189,600 @@ ccnet_rpc_is_org_staff (int org_id, const char *email, GError **error)
 
 
 #endif  /* CCNET_SERVER */
+
+/*
+ * Binary versions of the hot functions, see rpc-binary.h. Each one
+ * reads its arguments from @args and writes the result to @ret unless
+ * it fails.
+ */
+
+typedef void (*BinaryFunc) (RpcBinReader *args, GString *ret, GError **error);
+
+typedef struct BinaryFunction {
+    const char *svc_name;
+    const char *fname;
+    BinaryFunc  func;
+} BinaryFunction;
+
+static void
+put_peer (GString *buf, GObject *obj)
+{
+    CcnetPeer *peer = (CcnetPeer *)obj;
+    GString *roles = g_string_new (NULL);
+    guint flags = 0;
+
+    if (peer->is_self)
+        flags |= RPC_BIN_PEER_IS_SELF;
+    if (peer->can_connect)
+        flags |= RPC_BIN_PEER_CAN_CONNECT;
+    if (peer->in_local_network)
+        flags |= RPC_BIN_PEER_IN_LOCAL_NETWORK;
+    if (peer->in_connection)
+        flags |= RPC_BIN_PEER_IN_CONNECTION;
+    if (peer->is_ready)
+        flags |= RPC_BIN_PEER_IS_READY;
+    if (peer->encrypt_channel)
+        flags |= RPC_BIN_PEER_ENCRYPT_CHANNEL;
+
+    rpc_bin_put_string (buf, peer->id);
+    rpc_bin_put_string (buf, peer->name);
+    rpc_bin_put_string (buf, peer->public_addr);
+    rpc_bin_put_uint (buf, peer->public_port);
+    rpc_bin_put_string (buf, peer->service_url);
+    rpc_bin_put_string (buf, peer->addr_str);
+    rpc_bin_put_uint (buf, peer->port);
+    rpc_bin_put_int (buf, peer->net_state);
+    rpc_bin_put_uint (buf, flags);
+
+    ccnet_str_set_join (&peer->roles, roles, ",");
+    rpc_bin_put_string (buf, roles->str);
+    g_string_truncate (roles, 0);
+    ccnet_str_set_join (&peer->myroles, roles, ",");
+    rpc_bin_put_string (buf, roles->str);
+    g_string_free (roles, TRUE);
+
+    rpc_bin_put_string (buf, peer->session_key);
+}
+
+static void
+bin_get_peer (RpcBinReader *args, GString *ret, GError **error)
+{
+    const char *peer_id = rpc_bin_get_string (args);
+    GObject *peer;
+
+    if (args->error)
+        return;
+
+    peer = ccnet_rpc_get_peer (peer_id, error);
+    rpc_bin_put_object_result (ret, peer, put_peer);
+    if (peer)
+        g_object_unref (peer);
+}
+
+#ifdef CCNET_SERVER
+
+static void
+bin_get_emailuser (RpcBinReader *args, GString *ret, GError **error)
+{
+    const char *email = rpc_bin_get_string (args);
+    GObject *user;
+
+    if (args->error)
+        return;
+
+    user = ccnet_rpc_get_emailuser (email, error);
+    rpc_bin_put_object_result (ret, user, rpc_bin_put_emailuser);
+    if (user)
+        g_object_unref (user);
+}
+
+static void
+bin_get_groups (RpcBinReader *args, GString *ret, GError **error)
+{
+    const char *username = rpc_bin_get_string (args);
+    GList *groups, *ptr;
+
+    if (args->error)
+        return;
+
+    groups = ccnet_rpc_get_groups (username, error);
+    rpc_bin_put_objlist_result (ret, groups, rpc_bin_put_group);
+    for (ptr = groups; ptr; ptr = ptr->next)
+        g_object_unref (ptr->data);
+    g_list_free (groups);
+}
+
+static void
+bin_is_group_user (RpcBinReader *args, GString *ret, GError **error)
+{
+    int group_id = (int) rpc_bin_get_int (args);
+    const char *user = rpc_bin_get_string (args);
+    int res;
+
+    if (args->error)
+        return;
+
+    res = ccnet_rpc_is_group_user (group_id, user, error);
+    rpc_bin_put_int_result (ret, res);
+}
+
+static void
+bin_get_org_by_url_prefix (RpcBinReader *args, GString *ret, GError **error)
+{
+    const char *url_prefix = rpc_bin_get_string (args);
+    GObject *org;
+
+    if (args->error)
+        return;
+
+    org = ccnet_rpc_get_org_by_url_prefix (url_prefix, error);
+    rpc_bin_put_object_result (ret, org, rpc_bin_put_organization);
+    if (org)
+        g_object_unref (org);
+}
+
+/*
+ * The list functions below fill plain records, which are encoded
+ * without making a GObject for each item.
+ */
+
+static GArray *
+get_emailuser_recs (int start, int limit, GError **error)
+{
+    CcnetUserManager *user_mgr = 
+        ((CcnetServerSession *)session)->user_mgr;
+
+    return ccnet_user_manager_get_emailuser_recs (user_mgr, start, limit);
+}
+
+static GArray *
+get_group_member_recs (int group_id, GError **error)
+{
+    CcnetGroupManager *group_mgr = 
+        ((CcnetServerSession *)session)->group_mgr;
+
+    return ccnet_group_manager_get_group_member_recs (group_mgr, group_id,
+                                                      error);
+}
+
+/* The strings are in the rpc arena, only the array is to be freed. */
+static gboolean
+add_peer_stat_rec (CcnetPeer *peer, void *recs)
+{
+    CcnetArena *arena = ccnet_rpc_arena ();
+    CcnetPeerStatRec rec;
+
+    if (peer->is_self)
+        return TRUE;
+    rec.id = ccnet_arena_strdup (arena, peer->id);
+    rec.name = ccnet_arena_strdup (arena, peer->name);
+    rec.ip = ccnet_arena_strdup (arena, peer->addr_str);
+    rec.encrypt = peer->encrypt_channel;
+    rec.last_up = peer->last_up;
+    rec.proc_num = ccnet_peer_get_processor_count (peer);
+    g_array_append_val ((GArray *)recs, rec);
+    return TRUE;
+}
+
+static GArray *
+list_peer_stat_recs (GError **error)
+{
+    GArray *recs;
+
+    recs = g_array_new (FALSE, FALSE, sizeof(CcnetPeerStatRec));
+    ccnet_peer_manager_foreach (session->peer_mgr, add_peer_stat_rec, recs);
+
+    return recs;
+}
+
+static void
+free_arena_recs (GArray *recs)
+{
+    g_array_free (recs, TRUE);
+}
+
+static void
+bin_get_emailusers (RpcBinReader *args, GString *ret, GError **error)
+{
+    int start = (int) rpc_bin_get_int (args);
+    int limit = (int) rpc_bin_get_int (args);
+    GArray *recs;
+
+    if (args->error)
+        return;
+
+    recs = get_emailuser_recs (start, limit, error);
+    rpc_bin_put_reclist_result (ret, recs, sizeof(CcnetEmailUserRec),
+                                rpc_bin_put_emailuser_rec);
+    ccnet_email_user_rec_array_free (recs);
+}
+
+static void
+bin_get_group_members (RpcBinReader *args, GString *ret, GError **error)
+{
+    int group_id = (int) rpc_bin_get_int (args);
+    GArray *recs;
+
+    if (args->error)
+        return;
+
+    recs = get_group_member_recs (group_id, error);
+    rpc_bin_put_reclist_result (ret, recs, sizeof(CcnetGroupUserRec),
+                                rpc_bin_put_groupuser_rec);
+    ccnet_group_user_rec_array_free (recs);
+}
+
+static void
+bin_list_peer_stat (RpcBinReader *args, GString *ret, GError **error)
+{
+    GArray *recs = list_peer_stat_recs (error);
+
+    if (!recs)
+        return;
+    rpc_bin_put_reclist_result (ret, recs, sizeof(CcnetPeerStatRec),
+                                rpc_bin_put_peerstat_rec);
+    free_arena_recs (recs);
+}
+
+#endif  /* CCNET_SERVER */
+
+static BinaryFunction binary_functions[] = {
+    { "ccnet-rpcserver", "get_peer", bin_get_peer },
+#ifdef CCNET_SERVER
+    { "ccnet-threaded-rpcserver", "get_emailuser", bin_get_emailuser },
+    { "ccnet-threaded-rpcserver", "get_groups", bin_get_groups },
+    { "ccnet-threaded-rpcserver", "is_group_user", bin_is_group_user },
+    { "ccnet-threaded-rpcserver", "get_org_by_url_prefix",
+      bin_get_org_by_url_prefix },
+    { "ccnet-threaded-rpcserver", "get_emailusers", bin_get_emailusers },
+    { "ccnet-threaded-rpcserver", "get_group_members",
+      bin_get_group_members },
+    { "ccnet-rpcserver", "list_peer_stat", bin_list_peer_stat },
+#endif
+    { NULL, NULL, NULL },
+};
+
+char *
+ccnet_rpc_binary_call (const char *svc_name, const char *content, int clen,
+                       gsize *ret_len)
+{
+    RpcBinReader args;
+    GString *ret = g_string_new (NULL);
+    GError *error = NULL;
+    BinaryFunction *f;
+    const char *fname;
+
+    rpc_bin_reader_init (&args, content, clen);
+    fname = rpc_bin_get_string (&args);
+
+    for (f = binary_functions; fname && f->fname; ++f) {
+        if (strcmp (f->fname, fname) == 0 && strcmp (f->svc_name, svc_name) == 0)
+            break;
+    }
+
+    if (!fname || !f->fname) {
+        rpc_bin_put_error (ret, RPC_BIN_ERR_NO_FUNCTION, "No such function");
+    } else {
+        f->func (&args, ret, &error);
+        if (args.error || error) {
+            g_string_truncate (ret, 0);
+            rpc_bin_put_error (ret, error ? error->code : CCNET_ERR_INTERNAL,
+                               error ? error->message : "Bad arguments");
+            g_clear_error (&error);
+        }
+    }
+    ccnet_rpc_arena_reset ();
+
+    *ret_len = ret->len;
+    return g_string_free (ret, FALSE);
+}
+
+/*
+ * Faster JSON calls. The functions of the signatures in rpc_table.py
+ * which return an int, an int64 or a string have stubs generated by
+ * rpc_fast_codegen.py, which read the arguments in place, see
+ * CcnetJsonArgs. The list functions below encode plain records.
+ * Everything else, and calls these can't parse, go through searpc.
+ */
+
+typedef struct FastFunction {
+    void             *func;
+    CcnetFastMarshal  marshal;
+} FastFunction;
+
+/* "svc/fname" -> FastFunction, only written in ccnet_start_rpc(). */
+static GHashTable *fast_functions;
+
+static CcnetFastMarshal
+lookup_fast_marshal (const char *signature)
+{
+    static char **signatures;
+    int i, n = G_N_ELEMENTS (ccnet_fast_marshals);
+
+    if (!signatures) {
+        signatures = g_new0 (char *, n);
+        for (i = 0; i < n; ++i)
+            signatures[i] = ccnet_fast_marshals[i].signature ();
+    }
+    for (i = 0; i < n; ++i)
+        if (strcmp (signatures[i], signature) == 0)
+            return ccnet_fast_marshals[i].marshal;
+    return NULL;
+}
+
+static void
+register_function (const char *svc_name, void *func, const char *fname,
+                   gchar *signature)
+{
+    CcnetFastMarshal marshal = lookup_fast_marshal (signature);
+    FastFunction *f;
+
+    searpc_server_register_function (svc_name, func, fname, signature);
+    if (!marshal)
+        return;
+
+    if (!fast_functions)
+        fast_functions = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_free);
+    f = g_new0 (FastFunction, 1);
+    f->func = func;
+    f->marshal = marshal;
+    g_hash_table_replace (fast_functions,
+                          g_strconcat (svc_name, "/", fname, NULL), f);
+}
+
+#ifdef CCNET_SERVER
+
+typedef GArray *(*RecListFunc) (CcnetJsonArgs *args, GError **error);
+
+typedef struct JsonListFunction {
+    const char *svc_name;
+    const char *fname;
+    RecListFunc func;
+    gsize       size;
+    void        (*to_json) (CcnetJsonWriter *writer, const void *rec);
+    void        (*free) (GArray *recs);
+} JsonListFunction;
+
+static GArray *
+json_get_emailusers (CcnetJsonArgs *args, GError **error)
+{
+    int start = (int) ccnet_json_args_get_int (args);
+    int limit = (int) ccnet_json_args_get_int (args);
+
+    if (!ccnet_json_args_end (args))
+        return NULL;
+    return get_emailuser_recs (start, limit, error);
+}
+
+static GArray *
+json_get_group_members (CcnetJsonArgs *args, GError **error)
+{
+    int group_id = (int) ccnet_json_args_get_int (args);
+
+    if (!ccnet_json_args_end (args))
+        return NULL;
+    return get_group_member_recs (group_id, error);
+}
+
+static GArray *
+json_list_peer_stat (CcnetJsonArgs *args, GError **error)
+{
+    if (!ccnet_json_args_end (args))
+        return NULL;
+    return list_peer_stat_recs (error);
+}
+
+static JsonListFunction json_functions[] = {
+    { "ccnet-threaded-rpcserver", "get_emailusers", json_get_emailusers,
+      sizeof(CcnetEmailUserRec), ccnet_email_user_rec_to_json,
+      ccnet_email_user_rec_array_free },
+    { "ccnet-threaded-rpcserver", "get_group_members",
+      json_get_group_members,
+      sizeof(CcnetGroupUserRec), ccnet_group_user_rec_to_json,
+      ccnet_group_user_rec_array_free },
+    { "ccnet-rpcserver", "list_peer_stat", json_list_peer_stat,
+      sizeof(CcnetPeerStatRec), ccnet_peer_stat_rec_to_json,
+      free_arena_recs },
+    { NULL, NULL, NULL, 0, NULL, NULL },
+};
+
+static char *
+call_json_list_function (JsonListFunction *f, CcnetJsonArgs *args,
+                         gsize *ret_len)
+{
+    CcnetJsonWriter writer;
+    GString *buf;
+    GError *error = NULL;
+    GArray *recs;
+    guint i;
+
+    /* Errors are left to searpc, which formats them. */
+    recs = f->func (args, &error);
+    if (!recs) {
+        g_clear_error (&error);
+        return NULL;
+    }
+
+    buf = g_string_sized_new (64 + recs->len * 128);
+    if (recs->len == 0) {
+        g_string_append (buf, "{\"ret\":null}");
+    } else {
+        g_string_append (buf, "{\"ret\":[");
+        ccnet_json_writer_init (&writer, buf);
+        for (i = 0; i < recs->len; ++i)
+            f->to_json (&writer, recs->data + i * f->size);
+        g_string_append (buf, "]}");
+    }
+    f->free (recs);
+    ccnet_rpc_arena_reset ();
+
+    *ret_len = buf->len;
+    return g_string_free (buf, FALSE);
+}
+
+/*
+ * Listings that are streamed from a cursor, so the memory they take
+ * doesn't grow with the number of rows.
+ */
+
+typedef struct StreamFunction {
+    const char     *svc_name;
+    const char     *fname;
+    CcnetDBCursor *(*open) (CcnetJsonArgs *args);
+    void          (*row_to_json) (CcnetDBRow *row, CcnetJsonWriter *writer);
+} StreamFunction;
+
+static CcnetDBCursor *
+open_emailusers (CcnetJsonArgs *args)
+{
+    CcnetUserManager *user_mgr = 
+        ((CcnetServerSession *)session)->user_mgr;
+    int start = (int) ccnet_json_args_get_int (args);
+    int limit = (int) ccnet_json_args_get_int (args);
+
+    if (!ccnet_json_args_end (args))
+        return NULL;
+    return ccnet_user_manager_open_emailusers (user_mgr, start, limit);
+}
+
+static void
+emailuser_row_to_json (CcnetDBRow *row, CcnetJsonWriter *writer)
+{
+    CcnetEmailUserRec rec;
+
+    ccnet_user_manager_emailuser_rec_from_row (row, &rec);
+    ccnet_email_user_rec_to_json (writer, &rec);
+    ccnet_email_user_rec_clear (&rec);
+}
+
+static CcnetDBCursor *
+open_all_groups (CcnetJsonArgs *args)
+{
+    CcnetGroupManager *group_mgr = 
+        ((CcnetServerSession *)session)->group_mgr;
+    int start = (int) ccnet_json_args_get_int (args);
+    int limit = (int) ccnet_json_args_get_int (args);
+
+    if (!ccnet_json_args_end (args))
+        return NULL;
+    return ccnet_group_manager_open_all_groups (group_mgr, start, limit);
+}
+
+static void
+group_row_to_json (CcnetDBRow *row, CcnetJsonWriter *writer)
+{
+    CcnetGroupRec rec;
+
+    ccnet_group_manager_group_rec_from_row (row, &rec);
+    ccnet_group_rec_to_json (writer, &rec);
+    ccnet_group_rec_clear (&rec);
+}
+
+static StreamFunction stream_functions[] = {
+    { "ccnet-threaded-rpcserver", "get_emailusers", open_emailusers,
+      emailuser_row_to_json },
+    { "ccnet-threaded-rpcserver", "get_all_groups", open_all_groups,
+      group_row_to_json },
+    { NULL, NULL, NULL, NULL },
+};
+
+int
+ccnet_rpc_stream_call (const char *svc_name, const char *fcall, gsize len,
+                       gsize chunk_size, CcnetRpcStreamFunc emit, void *data)
+{
+    char fname[RPC_MAX_FNAME_LEN];
+    CcnetJsonArgs args;
+    CcnetJsonWriter writer;
+    CcnetDBCursor *cursor;
+    CcnetDBRow *row;
+    StreamFunction *f;
+    GString *buf;
+    int n = 0, ret;
+
+    if (!ccnet_rpc_parse_fname (fcall, len, fname))
+        return -1;
+    for (f = stream_functions; f->fname; ++f) {
+        if (strcmp (f->fname, fname) == 0 && strcmp (f->svc_name, svc_name) == 0)
+            break;
+    }
+    if (!f->fname || ccnet_json_args_init (&args, fcall, len) < 0)
+        return -1;
+    cursor = f->open (&args);
+    ccnet_json_args_free (&args);
+    if (!cursor)
+        return -1;
+
+    buf = g_string_sized_new (chunk_size + 256);
+    ccnet_json_writer_init (&writer, buf);
+    while ((ret = ccnet_db_cursor_next (cursor, &row)) > 0) {
+        if (n++ == 0)
+            g_string_append (buf, "{\"ret\":[");
+        f->row_to_json (row, &writer);
+        if (buf->len >= chunk_size) {
+            if (emit (buf, data) < 0) {
+                ccnet_db_cursor_close (cursor);
+                return 0;
+            }
+            buf = g_string_sized_new (chunk_size + 256);
+            writer.buf = buf;
+        }
+    }
+    ccnet_db_cursor_close (cursor);
+
+    /* Part of the result may be out, so an error comes at the end. */
+    if (n == 0)
+        g_string_append (buf, "{\"ret\":null");
+    else
+        g_string_append_c (buf, ']');
+    if (ret < 0)
+        g_string_append_printf (buf, ",\"err_code\":%d,"
+                                "\"err_msg\":\"Failed to read rows\"",
+                                CCNET_ERR_INTERNAL);
+    g_string_append_c (buf, '}');
+    emit (buf, data);
+
+    return 0;
+}
+
+#endif  /* CCNET_SERVER */
+
+char *
+ccnet_rpc_json_call (const char *svc_name, const char *fcall, gsize len,
+                     gsize *ret_len)
+{
+    char fname[RPC_MAX_FNAME_LEN];
+    char key[128];
+    CcnetJsonArgs args;
+    FastFunction *fast;
+    char *ret = NULL;
+#ifdef CCNET_SERVER
+    JsonListFunction *f;
+#endif
+
+    if (!fast_functions || !ccnet_rpc_parse_fname (fcall, len, fname))
+        return NULL;
+
+#ifdef CCNET_SERVER
+    for (f = json_functions; f->fname; ++f) {
+        if (strcmp (f->fname, fname) == 0 && strcmp (f->svc_name, svc_name) == 0)
+            break;
+    }
+    if (f->fname) {
+        if (ccnet_json_args_init (&args, fcall, len) < 0)
+            return NULL;
+        ret = call_json_list_function (f, &args, ret_len);
+        ccnet_json_args_free (&args);
+        return ret;
+    }
+#endif
+
+    snprintf (key, sizeof(key), "%s/%s", svc_name, fname);
+    fast = g_hash_table_lookup (fast_functions, key);
+    if (!fast || ccnet_json_args_init (&args, fcall, len) < 0)
+        return NULL;
+    ret = fast->marshal (fast->func, &args, ret_len);
+    ccnet_json_args_free (&args);
+
+    return ret;
+}
@@ -8,6 +8,34 @@ struct CcnetSession;
 void ccnet_start_rpc(CcnetSession *session);
 
 char *ccnet_rpc_list_peers(GError **error);
+
+/*
+ * Run a SC_CLIENT_BINARY call on @svc_name. Failures, including calls
+ * without a binary version, are returned as an error result.
+ */
+char *ccnet_rpc_binary_call (const char *svc_name, const char *content,
+                             int clen, gsize *ret_len);
+/*
+ * Run a searpc JSON call which has a faster version. Returns NULL if it
+ * doesn't, or if it can't be run that way, so searpc should run it.
+ */
+char *ccnet_rpc_json_call (const char *svc_name, const char *fcall,
+                           gsize len, gsize *ret_len);
+
+#ifdef CCNET_SERVER
+/* Takes @chunk. Returns -1 to stop the call. */
+typedef int (*CcnetRpcStreamFunc) (GString *chunk, void *data);
+
+/*
+ * Run a JSON call whose result is produced as the rows are read,
+ * handing each chunk of about @chunk_size bytes to @emit. Put together
+ * the chunks are the whole result. Returns -1, having done nothing, if
+ * the function can't be streamed.
+ */
+int ccnet_rpc_stream_call (const char *svc_name, const char *fcall,
+                           gsize len, gsize chunk_size,
+                           CcnetRpcStreamFunc emit, void *data);
+#endif
 GList *ccnet_rpc_list_resolving_peers (GError **error);
 
 
@@ -41,6 +69,9 @@ ccnet_rpc_add_client(const char *user_id, GError **error);
 int
 ccnet_rpc_add_role(const char *user_id, const char *role, GError **error);
 
+char *
+ccnet_rpc_import_peers (const char *records, GError **error);
+
 int
 ccnet_rpc_remove_role(const char *user_id, const char *role, GError **error);
 
@@ -54,6 +85,11 @@ int ccnet_rpc_count_procs_alive(GError **error);
 GList *ccnet_rpc_get_procs_dead(int offset, int limit, GError **error);
 int ccnet_rpc_count_procs_dead(GError **error);
 
+char *ccnet_rpc_get_proc_pool_stats (GError **error);
+
+/* See mem-stats.h. */
+char *ccnet_rpc_get_memory_stats (GError **error);
+
 
 /**
  * ccnet_get_config:
@@ -71,6 +107,22 @@ ccnet_rpc_get_config (const char *key, GError **error);
 int
 ccnet_rpc_set_config (const char *key, const char *value, GError **error);
 
+/* Counters of the rpc result cache, see rpc-cache.h. */
+char *
+ccnet_rpc_get_rpc_cache_stats (GError **error);
+
+/* Runtime log levels, see ccnet_log_set_module_level(). */
+int
+ccnet_rpc_set_log_level (const char *module, const char *level,
+                         GError **error);
+
+char *
+ccnet_rpc_get_log_levels (GError **error);
+
+/* Sampling cpu profiler, see profiler.h. */
+char *
+ccnet_rpc_profile (const char *cmd, int hz, GError **error);
+
 
 /**
  * ccnet_rpc_upload_profile:
@@ -82,9 +134,48 @@ ccnet_rpc_upload_profile (const char *relay_id, GError **error);
 
 #ifdef CCNET_SERVER
 
+/*
+ * The peer lookups of ccnet-rpcserver for ccnet-threaded-rpcserver,
+ * served from the view of the peers, see peer-view.h. They don't wait
+ * on the main loop, and may be a second behind it.
+ */
+char *ccnet_rpc_view_list_peers (GError **error);
+GList *ccnet_rpc_view_get_peers_by_role (const char *role, GError **error);
+GObject *ccnet_rpc_view_get_peer (const char *peer_id, GError **error);
+GObject *ccnet_rpc_view_get_peer_by_idname (const char *idname,
+                                            GError **error);
+
 GList *
 ccnet_rpc_list_peer_stat (GError **error);
 
+/* Per peer traffic, and per processor class handler time and latency. */
+char *
+ccnet_rpc_get_traffic_stats (GError **error);
+
+char *
+ccnet_rpc_get_db_pool_stats (GError **error);
+
+/* Worker lanes of the threaded rpc services, see rpc-pool.h. */
+char *
+ccnet_rpc_get_rpc_pool_stats (GError **error);
+
+/* The cpus the threads are pinned to, see cpu-set.h. */
+char *
+ccnet_rpc_get_placement_stats (GError **error);
+
+char *
+ccnet_rpc_get_user_cache_stats (GError **error);
+
+char *
+ccnet_rpc_get_org_cache_stats (GError **error);
+
+char *
+ccnet_rpc_get_org_shard_stats (GError **error);
+
+/* See ccnet_server_session_get_preload_stats(). */
+char *
+ccnet_rpc_get_preload_stats (GError **error);
+
 int
 ccnet_rpc_add_emailuser (const char *email, const char *passwd,
                          int is_staff, int is_active, GError **error);
@@ -104,6 +195,14 @@ ccnet_rpc_get_emailuser_by_id (int id, GError **error);
 GList*
 ccnet_rpc_get_emailusers (int start, int limit, GError **error);
 
+/* Keyset paging: pass -1, then the id of the last user returned. */
+GList*
+ccnet_rpc_get_emailusers_after (int last_id, int limit, GError **error);
+
+/* Users whose email starts with @prefix, at most @limit (capped at 100). */
+GList*
+ccnet_rpc_search_emailusers (const char *prefix, int limit, GError **error);
+
 /* Get total counts of email users. */
 gint64
 ccnet_rpc_count_emailusers (GError **error);
@@ -140,6 +239,9 @@ ccnet_rpc_verify_message (const char *message,
                           const char *peer_id,
                           GError **error);
 
+char *
+ccnet_rpc_verify_messages (const char *messages, GError **error);
+
 int
 ccnet_rpc_create_group (const char *group_name, const char *user_name,
                         GError **error);
@@ -158,6 +260,19 @@ int
 ccnet_rpc_group_remove_member (int group_id, const char *user_name,
                                const char *member_name, GError **error);
 
+/*
+ * Bulk variants taking a newline separated list of members. Return one
+ * "<member> <status>" line per member, status being ok, skipped (already
+ * or not a member) or failed.
+ */
+char *
+ccnet_rpc_group_add_members (int group_id, const char *user_name,
+                             const char *members, GError **error);
+
+char *
+ccnet_rpc_group_remove_members (int group_id, const char *user_name,
+                                const char *members, GError **error);
+
 int
 ccnet_rpc_group_set_admin (int group_id, const char *member_name,
                            GError **error);
@@ -172,15 +287,32 @@ ccnet_rpc_quit_group (int group_id, const char *user_name, GError **error);
 GList *
 ccnet_rpc_get_groups (const char *username, GError **error);
 
+/*
+ * Memberships of a newline separated list of users, as GroupUser
+ * objects, so that a page of users needs a single call.
+ */
+GList *
+ccnet_rpc_get_groups_by_users (const char *users, GError **error);
+
 GList *
 ccnet_rpc_get_all_groups (int start, int limit, GError **error);
 
+GList *
+ccnet_rpc_get_all_groups_after (int last_id, int limit, GError **error);
+
 GObject *
 ccnet_rpc_get_group (int group_id, GError **error);
 
 GList *
 ccnet_rpc_get_group_members (int group_id, GError **error);
 
+int
+ccnet_rpc_count_group_members (int group_id, GError **error);
+
+/* Changes to users, groups and orgs after @version, see change-log.h */
+char *
+ccnet_rpc_get_changes_since (gint64 version, int limit, GError **error);
+
 int
 ccnet_rpc_check_group_staff (int group_id, const char *user_name,
                              GError **error);
@@ -201,6 +333,9 @@ ccnet_rpc_remove_org (int org_id, GError **error);
 GList *
 ccnet_rpc_get_all_orgs (int start, int limit, GError **error);
 
+GList *
+ccnet_rpc_get_all_orgs_after (int last_id, int limit, GError **error);
+
 GObject *
 ccnet_rpc_get_org_by_url_prefix (const char *url_prefix, GError **error);
 
@@ -23,11 +23,40 @@
 #include "message-manager.h"
 #include "algorithms.h"
 #include "proc-factory.h"
+#include "metrics.h"
+#include "compress.h"
+#include "tls.h"
+#include "uring.h"
+#include "loop-monitor.h"
+#include "trace.h"
+#include "profiler.h"
+#ifdef CCNET_SERVER
+#include "handover.h"
+#endif
 
 #define DEBUG_FLAG CCNET_DEBUG_OTHER
+#include "outbox.h"
 #include "log.h"
 
+#if defined(CCNET_SERVER) && OPENSSL_VERSION_NUMBER < 0x10100000L
+#include <pthread.h>
+#include <openssl/crypto.h>
+#endif
+
 #define THREAD_POOL_SIZE 50
+#define THREAD_MAX_IDLE  10
+#define THREAD_IDLE_TIMEOUT 15000 /* ms */
+#define CRYPTO_POOL_SIZE 4
+
+#define CCNET_OUTPUT_HIGH_WATERMARK (4 * 1024 * 1024)
+#define CCNET_OUTPUT_LOW_WATERMARK  (1024 * 1024)
+
+#define DEFAULT_SESSION_RESUME_TTL 600
+#define DEFAULT_READ_BUDGET_PACKETS 64
+#define DEFAULT_READ_BUDGET_BYTES   (256 * 1024)
+#define DEFAULT_COMPRESS_THRESHOLD  1024
+
+#define DEFAULT_OUTBOX_MAX_SIZE 16      /* MB per peer */
 
 static void ccnet_service_free (CcnetService *service);
 
@@ -43,6 +72,43 @@ ccnet_session_class_init (CcnetSessionClass *klass)
     /* GObjectClass *gobject_class = G_OBJECT_CLASS (klass); */
 }
 
+#if defined(CCNET_SERVER) && OPENSSL_VERSION_NUMBER < 0x10100000L
+/* Old OpenSSL needs locking callbacks before RSA keys are shared
+ * between threads.
+ */
+static pthread_mutex_t *ssl_locks;
+
+static void
+ssl_locking_cb (int mode, int n, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK)
+        pthread_mutex_lock (&ssl_locks[n]);
+    else
+        pthread_mutex_unlock (&ssl_locks[n]);
+}
+
+static unsigned long
+ssl_thread_id_cb (void)
+{
+    return (unsigned long)pthread_self ();
+}
+
+static void
+setup_ssl_locking ()
+{
+    int i;
+
+    if (ssl_locks || CRYPTO_get_locking_callback ())
+        return;
+
+    ssl_locks = g_new (pthread_mutex_t, CRYPTO_num_locks ());
+    for (i = 0; i < CRYPTO_num_locks (); i++)
+        pthread_mutex_init (&ssl_locks[i], NULL);
+    CRYPTO_set_id_callback (ssl_thread_id_cb);
+    CRYPTO_set_locking_callback (ssl_locking_cb);
+}
+#endif
+
 static void
 ccnet_session_init (CcnetSession *session)
 {
@@ -56,6 +122,9 @@ ccnet_session_init (CcnetSession *session)
     session->msg_mgr = ccnet_message_manager_new (session);
     session->perm_mgr = ccnet_perm_manager_new (session);
     session->job_mgr = ccnet_job_manager_new (THREAD_POOL_SIZE);
+#if defined(CCNET_SERVER) && OPENSSL_VERSION_NUMBER < 0x10100000L
+    setup_ssl_locking ();
+#endif
 }
 
 static int load_rsakey(CcnetSession *session)
@@ -81,7 +150,41 @@ static int load_rsakey(CcnetSession *session)
     return 0; 
 }
 
+/* The X25519 key lives as long as the process. Signing it costs one RSA
+ * operation here instead of one per incoming session key. */
+static void
+setup_x25519_key (CcnetSession *session)
+{
+#ifdef HAVE_X25519
+    EVP_PKEY *key;
+
+    if (g_key_file_has_key (session->keyf, "Network", "X25519_SESSION_KEY",
+                            NULL) &&
+        !g_key_file_get_boolean (session->keyf, "Network",
+                                 "X25519_SESSION_KEY", NULL))
+        return;
+
+    key = x25519_generate_key (session->x25519_pub);
+    if (!key) {
+        ccnet_warning ("Failed to generate x25519 key\n");
+        return;
+    }
+
+    session->x25519_sig = x25519_sign_pub (session->privkey,
+                                           session->x25519_pub,
+                                           &session->x25519_sig_len);
+    if (!session->x25519_sig) {
+        ccnet_warning ("Failed to sign x25519 key\n");
+        EVP_PKEY_free (key);
+        return;
+    }
+
+    session->x25519_key = key;
+#endif
+}
+
 static void listen_on_localhost (CcnetSession *session);
+static void listen_on_unix_socket (CcnetSession *session);
 static void save_pubinfo (CcnetSession *session);
 
 CcnetSession *
@@ -90,19 +193,91 @@ ccnet_session_new ()
     return g_object_new (CCNET_TYPE_SESSION, NULL);
 }
 
+/* The role group overrides [Socket]. */
+static gboolean
+sock_opt_has (GKeyFile *keyf, const char *role, const char *key,
+              const char **group)
+{
+    if (g_key_file_has_key (keyf, role, key, NULL))
+        *group = role;
+    else if (g_key_file_has_key (keyf, "Socket", key, NULL))
+        *group = "Socket";
+    else
+        return FALSE;
+    return TRUE;
+}
+
+static int
+sock_opt_int (GKeyFile *keyf, const char *role, const char *key, int def)
+{
+    const char *group;
+
+    if (!sock_opt_has (keyf, role, key, &group))
+        return def;
+    return g_key_file_get_integer (keyf, group, key, NULL);
+}
+
+static int
+sock_opt_bool (GKeyFile *keyf, const char *role, const char *key, int def)
+{
+    const char *group;
+
+    if (!sock_opt_has (keyf, role, key, &group))
+        return def;
+    return g_key_file_get_boolean (keyf, group, key, NULL);
+}
+
+/*
+ * Socket options of the peer connections, from [Socket], overridden by
+ * [Socket.incoming] or [Socket.outgoing]:
+ *
+ *   NODELAY          disable Nagle, default true
+ *   SNDBUF, RCVBUF   buffer sizes in bytes, default from the system
+ *   KEEPALIVE        detect dead peers with kernel keepalive probes,
+ *                    default false
+ *   KEEPIDLE, KEEPINTVL, KEEPCNT
+ *                    probe after 60 idle seconds, every 10 seconds,
+ *                    drop after 6 lost
+ *   USER_TIMEOUT     msec sent data may stay unacked before the
+ *                    connection drops, by default the keepalive timeout
+ *                    when KEEPALIVE is set
+ */
+static CcnetSockOpts *
+load_sock_opts (GKeyFile *keyf, const char *role)
+{
+    CcnetSockOpts *opts = g_new0 (CcnetSockOpts, 1);
+
+    opts->nodelay = sock_opt_bool (keyf, role, "NODELAY", TRUE);
+    opts->sndbuf = sock_opt_int (keyf, role, "SNDBUF", 0);
+    opts->rcvbuf = sock_opt_int (keyf, role, "RCVBUF", 0);
+    opts->keepalive = sock_opt_bool (keyf, role, "KEEPALIVE", FALSE);
+    if (opts->keepalive) {
+        opts->keepidle = sock_opt_int (keyf, role, "KEEPIDLE", 60);
+        opts->keepintvl = sock_opt_int (keyf, role, "KEEPINTVL", 10);
+        opts->keepcnt = sock_opt_int (keyf, role, "KEEPCNT", 6);
+    }
+    opts->user_timeout = sock_opt_int (
+        keyf, role, "USER_TIMEOUT",
+        (opts->keepidle + opts->keepintvl * opts->keepcnt) * 1000);
+
+    return opts;
+}
+
 int
 ccnet_session_load_config (CcnetSession *session, const char *config_dir_r)
 {
     int ret = 0;
     char *config_file, *config_dir;
     char *id = 0, *name = 0, *port_str = 0, *lport_str,
-        *user_name = 0;
+        *user_name = 0, *un_path = 0, *high_wm_str = 0, *low_wm_str = 0,
+        *compress;
 #ifdef CCNET_SERVER
     char *service_url;
 #endif
     int port, local_port = 0;
     unsigned char sha1[20];
     GKeyFile *key_file;
+    CcnetCpuSet cpus;
 
     config_dir = ccnet_expand_path (config_dir_r);
 
@@ -130,6 +305,11 @@ ccnet_session_load_config (CcnetSession *session, const char *config_dir_r)
 #endif
     port_str = ccnet_key_file_get_string (key_file, "Network", "PORT");
     lport_str = ccnet_key_file_get_string (key_file, "Client", "PORT");
+    un_path = ccnet_key_file_get_string (key_file, "Client", "UNIX_SOCKET");
+    high_wm_str = ccnet_key_file_get_string (key_file, "Network",
+                                             "OUTPUT_HIGH_WATERMARK");
+    low_wm_str = ccnet_key_file_get_string (key_file, "Network",
+                                            "OUTPUT_LOW_WATERMARK");
     
     if (port_str == NULL)
         port = DEFAULT_PORT;
@@ -159,7 +339,90 @@ ccnet_session_load_config (CcnetSession *session, const char *config_dir_r)
     session->local_port = local_port;
     session->keyf = key_file;
 
+    session->out_high_wm = high_wm_str ? atoi (high_wm_str)
+        : CCNET_OUTPUT_HIGH_WATERMARK;
+    session->out_low_wm = low_wm_str ? atoi (low_wm_str)
+        : CCNET_OUTPUT_LOW_WATERMARK;
+    if (session->out_low_wm >= session->out_high_wm)
+        session->out_low_wm = session->out_high_wm / 4;
+
+    if (g_key_file_has_key (key_file, "Network", "SESSION_RESUME_TTL", NULL))
+        session->resume_ttl = g_key_file_get_integer (
+            key_file, "Network", "SESSION_RESUME_TTL", NULL);
+    else
+        session->resume_ttl = DEFAULT_SESSION_RESUME_TTL;
+
+    if (g_key_file_has_key (key_file, "Network", "FAST_SETUP", NULL))
+        session->fast_setup = g_key_file_get_boolean (
+            key_file, "Network", "FAST_SETUP", NULL);
+    else
+        session->fast_setup = TRUE;
+
+    compress = ccnet_key_file_get_string (key_file, "Network", "COMPRESSION");
+    if (compress) {
+        session->compress_algo = ccnet_compress_from_string (compress);
+        if (session->compress_algo < 0) {
+            ccnet_warning ("Compression %s is not supported\n", compress);
+            session->compress_algo = CCNET_COMPRESS_NONE;
+        }
+        g_free (compress);
+    } else if (ccnet_compress_from_string ("lz4") > 0)
+        session->compress_algo = CCNET_COMPRESS_LZ4;
+    if (g_key_file_has_key (key_file, "Network", "COMPRESS_THRESHOLD", NULL))
+        session->compress_threshold = g_key_file_get_integer (
+            key_file, "Network", "COMPRESS_THRESHOLD", NULL);
+    else
+        session->compress_threshold = DEFAULT_COMPRESS_THRESHOLD;
+
+    if (g_key_file_has_key (key_file, "Network", "READ_BUDGET_PACKETS", NULL))
+        session->read_budget_pkts = g_key_file_get_integer (
+            key_file, "Network", "READ_BUDGET_PACKETS", NULL);
+    else
+        session->read_budget_pkts = DEFAULT_READ_BUDGET_PACKETS;
+    if (g_key_file_has_key (key_file, "Network", "READ_BUDGET_BYTES", NULL))
+        session->read_budget_bytes = g_key_file_get_integer (
+            key_file, "Network", "READ_BUDGET_BYTES", NULL);
+    else
+        session->read_budget_bytes = DEFAULT_READ_BUDGET_BYTES;
+
+    session->sock_opts[0] = load_sock_opts (key_file, "Socket.outgoing");
+    session->sock_opts[1] = load_sock_opts (key_file, "Socket.incoming");
+
+    /* The main loop is pinned before the peers and buffers are set
+     * up, so that they are on its NUMA node, see cpu-set.h. */
+    memset (&cpus, 0, sizeof(cpus));
+    ccnet_cpu_set_load (&cpus, key_file, "General", "MAIN_CPUS");
+    ccnet_cpu_set_pin (pthread_self (), &cpus, -1);
+    ccnet_cpu_set_record ("main", &cpus);
+
+    if (g_key_file_get_boolean (key_file, "Log", "ASYNC", NULL) &&
+        ccnet_log_start_async () == 0) {
+        memset (&cpus, 0, sizeof(cpus));
+        ccnet_cpu_set_load (&cpus, key_file, "Log", "WRITER_CPUS");
+        ccnet_log_pin_writer (&cpus);
+        ccnet_cpu_set_record ("log-writer", &cpus);
+    }
+
+    if (un_path) {
+        /* relative paths are relative to the config dir */
+        if (g_path_is_absolute (un_path))
+            session->un_path = g_strdup (un_path);
+        else
+            session->un_path = g_build_filename (config_dir, un_path, NULL);
+        session->un_allowed_uids = g_key_file_get_integer_list (
+            key_file, "Client", "UNIX_SOCKET_ALLOWED_UIDS",
+            &session->n_un_allowed_uids, NULL);
+        if (g_key_file_has_key (key_file, "Client", "SHM_TRANSPORT", NULL))
+            session->shm_transport = g_key_file_get_boolean (
+                key_file, "Client", "SHM_TRANSPORT", NULL);
+    }
+
     load_rsakey(session);
+    setup_x25519_key (session);
+    ccnet_tls_init (session);
+    if (g_key_file_has_key (key_file, "Network", "IO_URING", NULL) &&
+        g_key_file_get_boolean (key_file, "Network", "IO_URING", NULL))
+        session->uring = ccnet_uring_new ();
 
     ret = 0;
 
@@ -168,6 +431,9 @@ onerror:
     g_free (name);
     g_free (user_name);
     g_free (port_str);
+    g_free (un_path);
+    g_free (high_wm_str);
+    g_free (low_wm_str);
 #ifdef CCNET_SERVER
     g_free (service_url);
 #endif
@@ -178,23 +444,102 @@ void
 ccnet_session_free (CcnetSession *session)
 {
     ccnet_peer_manager_free (session->peer_mgr);
+    /* after the peer manager, replays may still be waiting for acks */
+    if (session->outbox)
+        ccnet_outbox_free (session->outbox);
 
     g_object_unref (session);
 }
 
+static void
+open_outbox (CcnetSession *session)
+{
+    int max_size = DEFAULT_OUTBOX_MAX_SIZE;
+    char *dir;
+
+    if (g_key_file_has_key (session->keyf, "Message", "OUTBOX_MAX_SIZE", NULL))
+        max_size = g_key_file_get_integer (session->keyf, "Message",
+                                           "OUTBOX_MAX_SIZE", NULL);
+    if (max_size <= 0)
+        max_size = DEFAULT_OUTBOX_MAX_SIZE;
+
+    dir = g_build_filename (session->config_dir, "outbox", NULL);
+    session->outbox = ccnet_outbox_new (session, dir,
+                                        (gint64)max_size << 20);
+    g_free (dir);
+}
+
+/* Append the time since *@start to @timings and restart the clock. */
+static void
+startup_phase (GString *timings, const char *name, gint64 *start)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    g_string_append_printf (timings, "%s%s %d ms", timings->len ? ", " : "",
+                            name, (int)((now - *start) / 1000));
+    *start = now;
+}
 
 int
 ccnet_session_prepare (CcnetSession *session, const char *config_dir_r)
 {
     char *misc_path;
     int ret;
+#ifdef CCNET_SERVER
+    int crypto_threads = CRYPTO_POOL_SIZE;
+#endif
+    gint64 begin = g_get_monotonic_time (), start = begin;
+    GString *timings;
 
     if (ccnet_session_load_config (session, config_dir_r) < 0)
         return -1;
 
+    timings = g_string_new (NULL);
+    startup_phase (timings, "config", &start);
+
+    /* The job manager may be set up in the [Job Manager] section, see
+     * CcnetJobManagerOptions. */
+    if (g_key_file_has_group (session->keyf, "Job Manager")) {
+        CcnetJobManagerOptions options;
+
+        memset (&options, 0, sizeof(options));
+        options.max_threads = THREAD_POOL_SIZE;
+        options.max_idle_threads = THREAD_MAX_IDLE;
+        options.idle_timeout = THREAD_IDLE_TIMEOUT;
+        ccnet_job_manager_options_load (&options, session->keyf,
+                                        "Job Manager");
+        if (options.max_threads <= 0)
+            options.max_threads = THREAD_POOL_SIZE;
+
+        ccnet_job_manager_free (session->job_mgr);
+        session->job_mgr = ccnet_job_manager_new_full (&options);
+    }
+
+    ccnet_cpu_set_record ("jobs", &session->job_mgr->cpus);
+
+#ifdef CCNET_SERVER
+    {
+        CcnetJobManagerOptions options;
+
+        if (g_key_file_has_key (session->keyf, "Network", "CRYPTO_THREADS", NULL))
+            crypto_threads = g_key_file_get_integer (
+                session->keyf, "Network", "CRYPTO_THREADS", NULL);
+        if (crypto_threads <= 0)
+            crypto_threads = CRYPTO_POOL_SIZE;
+
+        memset (&options, 0, sizeof(options));
+        options.max_threads = crypto_threads;
+        ccnet_cpu_set_load (&options.cpus, session->keyf,
+                            "Network", "CRYPTO_CPUS");
+        session->crypto_job_mgr = ccnet_job_manager_new_full (&options);
+        ccnet_cpu_set_record ("crypto", &options.cpus);
+    }
+#endif
+
     misc_path = g_build_filename (session->config_dir, "misc", NULL);
     if (checkdir_with_mkdir (misc_path) < 0) {
         ccnet_error ("mkdir %s error", misc_path);
+        g_string_free (timings, TRUE);
         return -1;
     }
 
@@ -202,18 +547,28 @@ ccnet_session_prepare (CcnetSession *session, const char *config_dir_r)
     session->config_db = ccnet_session_config_open_db (misc_path);
     if (!session->config_db) {
         ccnet_warning ("Failed to open config db.\n");
+        g_string_free (timings, TRUE);
         return -1;
     }
+    ccnet_session_config_load (session);
+
+    if (g_key_file_get_boolean (session->keyf, "Message", "OUTBOX", NULL))
+        open_outbox (session);
+    startup_phase (timings, "config db", &start);
     
     /* call subclass prepare */
     ret = CCNET_SESSION_GET_CLASS (session)->prepare(session);
-    if (ret < 0)
+    if (ret < 0) {
+        g_string_free (timings, TRUE);
         return ret;
+    }
+    startup_phase (timings, "managers", &start);
 
     /* peer */
     ccnet_peer_manager_prepare(session->peer_mgr);
     g_signal_connect (session->peer_mgr, "peer-auth-done",
                       G_CALLBACK(on_peer_auth_done), session);
+    startup_phase (timings, "peers", &start);
 
     /* permission manager */
     ccnet_perm_manager_prepare (session->perm_mgr);
@@ -221,14 +576,27 @@ ccnet_session_prepare (CcnetSession *session, const char *config_dir_r)
     g_free (misc_path);
 
 
+#ifdef CCNET_SERVER
+    /* Before listening, the old process passes its sockets over. */
+    if (session->takeover)
+        ccnet_handover_receive (session);
+#endif
+
     /* Open localhost, if failed, then the program will exists. This is used
      * to prevent two instance of ccnet on the same port.
      */
     listen_on_localhost (session);
+    listen_on_unix_socket (session);
+    startup_phase (timings, "listen", &start);
 
     /* refresh pubinfo on every startup */
     save_pubinfo (session);
 
+    ccnet_message ("[Startup] Session prepared in %d ms (%s)\n",
+                   (int)((g_get_monotonic_time () - begin) / 1000),
+                   timings->str);
+    g_string_free (timings, TRUE);
+
     return 0;
 }
 
@@ -328,6 +696,7 @@ ccnet_session_on_exit (CcnetSession *session)
 
     ccnet_peer_manager_on_exit (session->peer_mgr);
     ccnet_session_save (session);
+    ccnet_session_config_flush (session);
 
     t = time(NULL);
     ccnet_message ("Exit at %s\n", ctime(&t));
@@ -349,17 +718,12 @@ static const char *net_status_string (int status)
     }
 }
 
-static void accept_local_client (int fd, short event, void *vsession)
+static int local_id = 0;
+
+static void add_local_client (CcnetSession *session, int connfd)
 {
-    CcnetSession *session = vsession;
     CcnetPacketIO *io;
-    int connfd;
     CcnetPeer *peer;
-    static int local_id = 0;
-
-    connfd = accept (fd, NULL, 0);
-
-    ccnet_message ("Accepted a local client\n");
 
     io = ccnet_packet_io_new_incoming (session, NULL, connfd);
     peer = ccnet_peer_new (session->base.id);
@@ -371,15 +735,112 @@ static void accept_local_client (int fd, short event, void *vsession)
     g_object_unref (peer);
 }
 
+CcnetPeer *
+ccnet_session_connect_inproc (CcnetSession *session)
+{
+    CcnetPeer *peer, *client;
+    int id = local_id++;
+
+    /* The daemon's end, as add_local_client() makes it. */
+    peer = ccnet_peer_new (session->base.id);
+    peer->name = g_strdup_printf ("local-%d", id);
+    peer->is_local = TRUE;
+
+    client = ccnet_peer_new (session->base.id);
+    client->name = g_strdup_printf ("inproc-%d", id);
+    client->is_local = TRUE;
+
+    ccnet_peer_link_inproc (peer, client);
+    ccnet_peer_set_net_state (peer, PEER_CONNECTED);
+    ccnet_peer_set_net_state (client, PEER_CONNECTED);
+    ccnet_peer_manager_add_local_peer (session->peer_mgr, peer);
+    ccnet_peer_manager_add_local_peer (session->peer_mgr, client);
+    g_object_unref (peer);
+
+    return client;
+}
+
+void
+ccnet_session_disconnect_inproc (CcnetSession *session, CcnetPeer *peer)
+{
+    g_return_if_fail (peer->inproc != NULL);
+
+    /* The daemon's end follows when this one is shut down. */
+    ccnet_peer_local_down (peer);
+}
+
+static void accept_local_client (int fd, short event, void *vsession)
+{
+    CcnetSession *session = vsession;
+    int connfd;
+
+    connfd = accept (fd, NULL, 0);
+
+    ccnet_message ("Accepted a local client\n");
+
+    add_local_client (session, connfd);
+}
+
+#ifndef WIN32
+/* Clients of our own user and root are always allowed. */
+static gboolean
+unix_client_allowed (CcnetSession *session, uid_t uid)
+{
+    gsize i;
+
+    if (uid == getuid() || uid == 0)
+        return TRUE;
+
+    for (i = 0; i < session->n_un_allowed_uids; i++)
+        if (session->un_allowed_uids[i] == (int)uid)
+            return TRUE;
+    return FALSE;
+}
+
+static void accept_unix_client (int fd, short event, void *vsession)
+{
+    CcnetSession *session = vsession;
+    int connfd;
+    uid_t uid;
+
+    connfd = accept (fd, NULL, 0);
+    if (connfd < 0)
+        return;
+
+    if (ccnet_net_get_peer_uid (connfd, &uid) < 0) {
+        ccnet_warning ("Failed to get credentials of unix socket client: %s\n",
+                       strerror(errno));
+        close (connfd);
+        return;
+    }
+
+    if (!unix_client_allowed (session, uid)) {
+        ccnet_warning ("Refused local client of uid %d\n", (int)uid);
+        close (connfd);
+        return;
+    }
+
+    ccnet_message ("Accepted a local client on unix socket\n");
+
+    add_local_client (session, connfd);
+}
+#endif
+
 static void listen_on_localhost (CcnetSession *session)
 {
-    int sockfd;
+    int sockfd = -1;
 
-    if ( (sockfd = ccnet_net_bind_v4 ("127.0.0.1", &session->local_port)) < 0) {
+#ifdef CCNET_SERVER
+    sockfd = ccnet_handover_get_listener ("local");
+#endif
+    if (sockfd >= 0)
+        ccnet_message ("Took over the listener on 127.0.0.1 %d\n",
+                       session->local_port);
+    else if ( (sockfd = ccnet_net_bind_v4 ("127.0.0.1", &session->local_port)) < 0) {
         printf ("listen on localhost failed\n");
         exit (1);
-    }
-    ccnet_message ("Listen on 127.0.0.1 %d\n", session->local_port);
+    } else
+        ccnet_message ("Listen on 127.0.0.1 %d\n", session->local_port);
 
     listen (sockfd, 5);
     event_set (&session->local_event, sockfd, EV_READ | EV_PERSIST, 
@@ -387,6 +848,35 @@ static void listen_on_localhost (CcnetSession *session)
     event_add (&session->local_event, NULL);
 }
 
+static void listen_on_unix_socket (CcnetSession *session)
+{
+#ifndef WIN32
+    int sockfd = -1;
+
+    if (!session->un_path)
+        return;
+
+#ifdef CCNET_SERVER
+    sockfd = ccnet_handover_get_listener ("unix");
+#endif
+    if (sockfd >= 0)
+        ccnet_message ("Took over the listener on %s\n", session->un_path);
+    else if ( (sockfd = ccnet_net_bind_unix (session->un_path)) < 0) {
+        /* Not fatal, clients fall back to the tcp port. */
+        ccnet_warning ("listen on %s failed\n", session->un_path);
+        return;
+    } else {
+        chmod (session->un_path, 0666);
+        ccnet_message ("Listen on %s\n", session->un_path);
+    }
+
+    listen (sockfd, 5);
+    event_set (&session->un_event, sockfd, EV_READ | EV_PERSIST,
+               accept_unix_client, session);
+    event_add (&session->un_event, NULL);
+#endif
+}
+
 void
 ccnet_session_start_network (CcnetSession *session)
 {
@@ -395,15 +885,17 @@ ccnet_session_start_network (CcnetSession *session)
     session->myself->addr_str = NULL;
 }
 
+static gboolean
+shutdown_peer_cb (CcnetPeer *peer, void *data)
+{
+    ccnet_peer_shutdown (peer);
+    return TRUE;
+}
+
 void
 ccnet_session_shutdown_network (CcnetSession *session)
 {
-    GList *peers, *ptr;
-    
-    peers = ccnet_peer_manager_get_peer_list(session->peer_mgr);
-    for (ptr = peers; ptr; ptr = ptr->next)
-        ccnet_peer_shutdown ((CcnetPeer *)ptr->data);
-    g_list_free (peers);
+    ccnet_peer_manager_foreach (session->peer_mgr, shutdown_peer_cb, NULL);
 
     ccnet_conn_manager_stop (session->connMgr);
 }
@@ -425,18 +917,75 @@ restart_network (CcnetSession *session)
     return TRUE;
 }
 
+static gint64
+read_procs_alive (void *vsession)
+{
+    return ((CcnetSession *)vsession)->proc_factory->procs_alive_cnt;
+}
+
+static gint64
+read_procs_dead (void *vsession)
+{
+    return ccnet_proc_factory_count_history (
+        ((CcnetSession *)vsession)->proc_factory);
+}
+
+static gint64
+read_connected_peers (void *vsession)
+{
+    return ((CcnetSession *)vsession)->peer_mgr->connected_peer;
+}
+
+static gint64
+read_jobs (void *vsession)
+{
+    return g_hash_table_size (((CcnetSession *)vsession)->job_mgr->jobs);
+}
+
+/* Gauges read from the managers when the metrics are served. */
+static void
+register_session_metrics (CcnetSession *session)
+{
+    ccnet_metrics_gauge_func ("ccnet_processors", "state=\"alive\"",
+                              "Processors by state",
+                              read_procs_alive, session);
+    ccnet_metrics_gauge_func ("ccnet_processors", "state=\"dead\"",
+                              "Processors by state",
+                              read_procs_dead, session);
+    ccnet_metrics_gauge_func ("ccnet_connected_peers", NULL,
+                              "Peers connected now",
+                              read_connected_peers, session);
+    ccnet_metrics_gauge_func ("ccnet_jobs", NULL,
+                              "Jobs queued or running in the job manager",
+                              read_jobs, session);
+}
+
 void
 ccnet_session_start (CcnetSession *session)
 {
     ccnet_proc_factory_start (session->proc_factory);
     ccnet_message_manager_start (session->msg_mgr);
 
+    register_session_metrics (session);
+    ccnet_metrics_start_server (session->keyf);
+    ccnet_loop_monitor_start (session->keyf);
+    ccnet_trace_init (session->keyf, session->config_dir);
+    ccnet_profiler_init (session->keyf, session->config_dir);
+
     ccnet_session_start_network (session);
     if (session->base.net_status == NET_STATUS_DOWN) {
         ccnet_timer_new ((TimerCB)restart_network, session, 10000);
     }
 
     ccnet_peer_manager_start (session->peer_mgr);
+
+#ifdef CCNET_SERVER
+    ccnet_handover_adopt_peers (session);
+    ccnet_handover_listen (session);
+#endif
+
+    if (CCNET_SESSION_GET_CLASS (session)->start)
+        CCNET_SESSION_GET_CLASS (session)->start (session);
 }
 
 
@@ -511,6 +1060,9 @@ static void on_peer_auth_done (CcnetPeerManager *manager,
     CcnetSession *session = (CcnetSession *)user_data;
     
     CCNET_SESSION_GET_CLASS (session)->on_peer_auth_done(session, peer);
+
+    if (session->outbox)
+        ccnet_outbox_replay (session->outbox, peer);
 }
 
 
@@ -40,6 +40,7 @@ typedef struct _CcnetService {
 } CcnetService;
 
 #include <openssl/rsa.h>
+#include "rsa.h"
 
 
 struct CcnetSession
@@ -61,25 +62,79 @@ struct CcnetSession
 
     struct _CcnetMessageManager *msg_mgr;
 
+    /* messages for peers which are down, NULL if disabled */
+    struct _CcnetOutbox        *outbox;
+
     struct _CcnetProcFactory   *proc_factory;
 
     struct _CcnetPermManager   *perm_mgr;
 
     struct _CcnetJobManager    *job_mgr;
+    /* RSA work of the session key processors, see
+     * ccnet_processor_thread_create() */
+    struct _CcnetJobManager    *crypto_job_mgr;
 
     GHashTable                 *service_hash;
 
     unsigned int                saving : 1;
     unsigned int                saving_pub : 1;
     unsigned int                encrypt_channel : 1;
+    /* take the sockets over from a running server, see handover.h */
+    unsigned int                takeover : 1;
 
     int                         local_port;
     struct event                local_event;
 
+    /* output watermarks of peer connections, in bytes */
+    int                         out_high_wm;
+    int                         out_low_wm;
+
+    /* packets and bytes handled for a connection before the others get
+     * their turn, see packet-io.c. 0 for no limit. */
+    int                         read_budget_pkts;
+    int                         read_budget_bytes;
+
+    /* socket options of peer connections, [0] for the ones we open,
+     * [1] for the accepted ones, see load_sock_opts() */
+    struct CcnetSockOpts       *sock_opts[2];
+
+    /* seconds a down peer's session can be resumed, 0 to disable */
+    int                         resume_ttl;
+
+    /* offer and answer the one round trip setup, see fast-setup.h */
+    gboolean                    fast_setup;
+
+    /* CCNET_COMPRESS_XXX we send with, and the smallest payload
+     * compressed, see compress.h */
+    int                         compress_algo;
+    int                         compress_threshold;
+
+    /* Our X25519 key for session key agreement and an RSA signature
+     * over it, see sendsessionkey-v2-proc.c. NULL if disabled. */
+    EVP_PKEY                   *x25519_key;
+    unsigned char               x25519_pub[CCNET_X25519_KEY_LEN];
+    unsigned char              *x25519_sig;
+    unsigned int                x25519_sig_len;
+
+    /* SSL_CTX of the TLS transport, NULL if disabled, see tls.h */
+    struct ssl_ctx_st          *tls_ctx;
+
+    /* drives the peer sockets if set, see uring.h */
+    struct CcnetUring          *uring;
+
+    /* optional unix domain socket for local clients */
+    char                       *un_path;
+    struct event                un_event;
+    int                        *un_allowed_uids;
+    gsize                       n_un_allowed_uids;
+    /* offer local clients the shared memory rings, see local-shm.h */
+    gboolean                    shm_transport;
+
     int                         start_failure;  /* how many times failed 
                                                    to start the network */
 
     sqlite3                    *config_db;
+    struct CcnetConfigCache    *config_cache;   /* see ccnet-config.h */
 
     CcnetDB                    *db;
 };
@@ -120,6 +175,17 @@ CcnetService* ccnet_session_get_service (CcnetSession *session,
 void ccnet_session_unregister_service (CcnetSession *session,
                                        struct _CcnetPeer *peer);
 
+/*
+ * A local client living in this process, such as a plugin. It talks to
+ * the daemon through the returned peer as a local client does through
+ * its socket: it creates master processors on it, and may register
+ * services, whose requests come in on it. Packets are passed in memory.
+ * The caller owns a reference, and calls disconnect when it is done.
+ */
+struct _CcnetPeer *ccnet_session_connect_inproc (CcnetSession *session);
+void ccnet_session_disconnect_inproc (CcnetSession *session,
+                                      struct _CcnetPeer *peer);
+
 gboolean ccnet_session_should_encrypt_channel (CcnetSession *session);
 
 #endif
@@ -0,0 +1,151 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <event2/bufferevent_ssl.h>
+#endif
+
+#include "session.h"
+#include "packet-io.h"
+#include "rsa.h"
+#include "tls.h"
+
+#include "log.h"
+
+#ifdef HAVE_TLS
+
+#define CERT_DAYS 3650
+
+/* Any certificate will do here, the key is checked against the peer id
+ * in the handshake instead. */
+static int
+accept_any_cert (int ok, X509_STORE_CTX *store)
+{
+    return 1;
+}
+
+static X509 *
+make_cert (EVP_PKEY *pkey, const char *id)
+{
+    X509 *cert;
+    X509_NAME *name;
+
+    cert = X509_new ();
+    if (!cert)
+        return NULL;
+
+    X509_set_version (cert, 2);
+    ASN1_INTEGER_set (X509_get_serialNumber (cert), 1);
+    X509_gmtime_adj (X509_getm_notBefore (cert), -86400);
+    X509_gmtime_adj (X509_getm_notAfter (cert), (long)CERT_DAYS * 86400);
+    X509_set_pubkey (cert, pkey);
+
+    name = X509_get_subject_name (cert);
+    X509_NAME_add_entry_by_txt (name, "CN", MBSTRING_ASC,
+                                (const unsigned char *)id, -1, -1, 0);
+    X509_set_issuer_name (cert, name);
+
+    if (!X509_sign (cert, pkey, EVP_sha256 ())) {
+        X509_free (cert);
+        return NULL;
+    }
+    return cert;
+}
+
+int
+ccnet_tls_init (CcnetSession *session)
+{
+    EVP_PKEY *pkey = NULL;
+    X509 *cert = NULL;
+    SSL_CTX *ctx = NULL;
+
+    if (!g_key_file_has_key (session->keyf, "Network", "TLS", NULL) ||
+        !g_key_file_get_boolean (session->keyf, "Network", "TLS", NULL))
+        return 0;
+
+    pkey = EVP_PKEY_new ();
+    if (!pkey || !EVP_PKEY_set1_RSA (pkey, session->privkey))
+        goto error;
+    if (!(cert = make_cert (pkey, session->base.id)))
+        goto error;
+
+    ctx = SSL_CTX_new (TLS_method ());
+    if (!ctx)
+        goto error;
+    SSL_CTX_set_min_proto_version (ctx, TLS1_3_VERSION);
+    SSL_CTX_set_verify (ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+                        accept_any_cert);
+    /* Every connection is authenticated in full, no resumption. */
+    SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_num_tickets (ctx, 0);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options (ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    if (SSL_CTX_use_certificate (ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey (ctx, pkey) != 1)
+        goto error;
+
+    X509_free (cert);
+    EVP_PKEY_free (pkey);
+    session->tls_ctx = ctx;
+    return 0;
+
+error:
+    ccnet_warning ("Failed to set up TLS, peer connections go without it\n");
+    if (ctx)
+        SSL_CTX_free (ctx);
+    if (cert)
+        X509_free (cert);
+    if (pkey)
+        EVP_PKEY_free (pkey);
+    return -1;
+}
+
+char *
+ccnet_tls_peer_id (CcnetPacketIO *io)
+{
+    SSL *ssl;
+    X509 *cert;
+    EVP_PKEY *pkey;
+    RSA *rsa = NULL;
+    char *id = NULL;
+
+    if (!io->tls || !(ssl = bufferevent_openssl_get_ssl (io->bufev)))
+        return NULL;
+    if (!(cert = SSL_get_peer_certificate (ssl)))
+        return NULL;
+
+    pkey = X509_get_pubkey (cert);
+    if (pkey)
+        rsa = EVP_PKEY_get1_RSA (pkey);
+    if (rsa) {
+        id = id_from_pubkey (rsa);
+        RSA_free (rsa);
+    }
+
+    EVP_PKEY_free (pkey);
+    X509_free (cert);
+    return id;
+}
+
+#else
+
+int
+ccnet_tls_init (CcnetSession *session)
+{
+    if (g_key_file_has_key (session->keyf, "Network", "TLS", NULL) &&
+        g_key_file_get_boolean (session->keyf, "Network", "TLS", NULL))
+        ccnet_warning ("TLS is not supported by this build\n");
+    return 0;
+}
+
+char *
+ccnet_tls_peer_id (CcnetPacketIO *io)
+{
+    return NULL;
+}
+
+#endif  /* HAVE_TLS */
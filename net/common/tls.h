@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_TLS_H
+#define CCNET_TLS_H
+
+/*
+ * TLS 1.3 transport for peer connections.
+ *
+ * With [Network] TLS = true, peers that both announce CCNET_CAP_TLS
+ * switch to TLS right after exchanging their ids in the handshake: the
+ * slave once it sent its id, the master once it read it. The master's
+ * ack is the first packet inside TLS. The packet framing stays the same
+ * on top, so the processors don't notice, and the ENCPACKET channel
+ * encryption is skipped as TLS already provides it.
+ *
+ * Each side presents a self-signed certificate of its RSA peer key and
+ * requires one from the other. There is no CA: the handshake checks
+ * that the key of the certificate hashes to the id the peer claimed,
+ * which also verifies the peer for keepalive2.
+ *
+ * Where OpenSSL and the kernel support it, the record layer is offloaded
+ * to the kernel (kTLS).
+ */
+
+struct CcnetSession;
+struct CcnetPacketIO;
+
+/* Set up session->tls_ctx, unless TLS is off or not built in. */
+int   ccnet_tls_init (struct CcnetSession *session);
+
+/* The peer id of the certificate the peer presented, or NULL. */
+char *ccnet_tls_peer_id (struct CcnetPacketIO *io);
+
+#endif
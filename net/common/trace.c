@@ -0,0 +1,227 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <glib/gstdio.h>
+
+#include "timer.h"
+#include "peer.h"
+#include "processor.h"
+#include "session.h"
+#include "packet-io.h"
+#include "trace.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_OTHER
+#include "log.h"
+
+#define EXPORT_INTERVAL     1000                /* ms */
+#define MAX_EXPORT_BUF      (1024 * 1024)       /* spans beyond are dropped */
+
+gboolean ccnet_trace_enabled;
+
+static double sample_rate;
+static FILE *export_fp;
+static GString *export_buf;
+static guint64 n_dropped;
+static CcnetTimer *export_timer;
+
+/* The span the main thread is working for. */
+static CcnetTraceContext current;
+
+static guint64
+new_id (void)
+{
+    guint64 id;
+
+    do {
+        id = ((guint64)g_random_int () << 32) | g_random_int ();
+    } while (id == 0);
+    return id;
+}
+
+static int
+export_spans (void *unused)
+{
+    if (n_dropped) {
+        ccnet_warning ("[Trace] Dropped %" G_GUINT64_FORMAT " spans\n",
+                       n_dropped);
+        n_dropped = 0;
+    }
+    if (export_buf->len == 0)
+        return TRUE;
+
+    if (fwrite (export_buf->str, 1, export_buf->len, export_fp)
+        != export_buf->len || fflush (export_fp) != 0)
+        ccnet_warning ("[Trace] Failed to write spans: %s\n", strerror(errno));
+    g_string_truncate (export_buf, 0);
+    return TRUE;
+}
+
+int
+ccnet_trace_init (GKeyFile *keyf, const char *config_dir)
+{
+    char *path;
+
+    if (export_timer || !g_key_file_has_group (keyf, "Trace"))
+        return 0;
+
+    if (g_key_file_has_key (keyf, "Trace", "SAMPLE_RATE", NULL))
+        sample_rate = g_key_file_get_double (keyf, "Trace", "SAMPLE_RATE",
+                                             NULL);
+    sample_rate = CLAMP (sample_rate, 0, 1);
+
+    path = g_key_file_get_string (keyf, "Trace", "EXPORT_FILE", NULL);
+    if (!path)
+        path = g_build_filename (config_dir, "trace.log", NULL);
+    export_fp = g_fopen (path, "a");
+    if (!export_fp) {
+        ccnet_warning ("[Trace] Failed to open %s: %s\n", path, strerror(errno));
+        g_free (path);
+        return -1;
+    }
+    ccnet_message ("[Trace] Writing spans to %s, sample rate %g\n",
+                   path, sample_rate);
+    g_free (path);
+
+    export_buf = g_string_new (NULL);
+    export_timer = ccnet_timer_new (export_spans, NULL, EXPORT_INTERVAL);
+    ccnet_trace_enabled = TRUE;
+    return 0;
+}
+
+static gboolean
+parse_hex64 (const char *s, guint64 *ret)
+{
+    guint64 v = 0;
+    int i, d;
+
+    for (i = 0; i < 16; ++i) {
+        if ((d = g_ascii_xdigit_value (s[i])) < 0)
+            return FALSE;
+        v = (v << 4) | d;
+    }
+    *ret = v;
+    return TRUE;
+}
+
+gboolean
+ccnet_trace_parse (char **req, CcnetTraceContext *ctx)
+{
+    char *p = *req;
+    const int plen = sizeof(CCNET_TRACE_PREFIX) - 1;
+
+    if (strncmp (p, CCNET_TRACE_PREFIX, plen) != 0)
+        return FALSE;
+    p += plen;
+    if (strnlen (p, 33) < 33 || p[16] != '-' ||
+        !parse_hex64 (p, &ctx->trace_id) ||
+        !parse_hex64 (p + 17, &ctx->span_id))
+        return FALSE;
+    p += 33;
+    if (*p != ' ' && *p != '\0')
+        return FALSE;
+
+    while (*p == ' ')
+        ++p;
+    *req = p;
+    return TRUE;
+}
+
+void
+ccnet_trace_set_current (const CcnetTraceContext *ctx,
+                         CcnetTraceContext *saved)
+{
+    if (saved)
+        *saved = current;
+    current = *ctx;
+}
+
+void
+ccnet_trace_enter (CcnetProcessor *processor, CcnetTraceContext *saved)
+{
+    *saved = current;
+    current.trace_id = processor->trace_id;
+    current.span_id = processor->span_id;
+}
+
+void
+ccnet_trace_begin (CcnetProcessor *processor, CcnetTraceContext *saved)
+{
+    *saved = current;
+
+    if (current.trace_id) {
+        processor->trace_id = current.trace_id;
+        processor->parent_span = current.span_id;
+    } else if (IS_SLAVE (processor) && processor->peer->is_local &&
+               sample_rate > 0 && g_random_double () < sample_rate) {
+        processor->trace_id = new_id ();
+        processor->parent_span = 0;
+    } else {
+        processor->trace_id = 0;
+        return;
+    }
+    processor->span_id = new_id ();
+    processor->t_span_start = g_get_real_time ();
+    processor->t_span_mono = g_get_monotonic_time ();
+    processor->t_span_first = -1;
+
+    current.trace_id = processor->trace_id;
+    current.span_id = processor->span_id;
+}
+
+void
+ccnet_trace_mark_response (CcnetProcessor *processor, gint64 usec)
+{
+    if (processor->trace_id && processor->t_span_first < 0)
+        processor->t_span_first = usec;
+}
+
+void
+ccnet_trace_end (CcnetProcessor *processor, gboolean success)
+{
+    if (!processor->trace_id)
+        return;
+
+    if (export_buf->len >= MAX_EXPORT_BUF) {
+        ++n_dropped;
+    } else {
+        g_string_append_printf (
+            export_buf,
+            "{\"trace\":\"%016" G_GINT64_MODIFIER "x\","
+            "\"span\":\"%016" G_GINT64_MODIFIER "x\","
+            "\"parent\":\"%016" G_GINT64_MODIFIER "x\","
+            "\"name\":\"%s\",\"slave\":%s,"
+            "\"node\":\"%.8s\",\"peer\":\"%.8s\","
+            "\"start_us\":%" G_GINT64_FORMAT ","
+            "\"dur_us\":%" G_GINT64_FORMAT ","
+            "\"first_us\":%" G_GINT64_FORMAT ","
+            "\"ok\":%s,\"failure\":%d}\n",
+            processor->trace_id, processor->span_id, processor->parent_span,
+            GET_PNAME (processor), IS_SLAVE (processor) ? "true" : "false",
+            processor->session->base.id, processor->peer->id,
+            processor->t_span_start,
+            g_get_monotonic_time () - processor->t_span_mono,
+            processor->t_span_first,
+            success ? "true" : "false", processor->failure);
+    }
+
+    /* Reused processors start untraced. */
+    processor->trace_id = 0;
+}
+
+const char *
+ccnet_trace_token (CcnetProcessor *processor, CcnetPeer *peer)
+{
+    static char token[CCNET_TRACE_TOKEN_LEN + 2];
+
+    if (!processor->trace_id || !peer->io || !peer->io->trace)
+        return NULL;
+
+    g_snprintf (token, sizeof(token),
+                CCNET_TRACE_PREFIX "%016" G_GINT64_MODIFIER "x-%016"
+                G_GINT64_MODIFIER "x ",
+                processor->trace_id, processor->span_id);
+    return token;
+}
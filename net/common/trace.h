@@ -0,0 +1,69 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_TRACE_H
+#define CCNET_TRACE_H
+
+#include <glib.h>
+
+struct _CcnetProcessor;
+struct _CcnetPeer;
+
+/*
+ * Request tracing. A traced request starts with a token
+ *
+ *   @trace=<trace id>-<parent span id> <request...>
+ *
+ * in 16 hex digits each, which the receiving daemon takes off before
+ * splitting the request. Every processor of a trace is a span: slaves
+ * are children of the span in the token, masters of the span whose
+ * handler started them. Updates and responses belong to the span of
+ * their processor. The token is only sent to peers which announced
+ * CCNET_CAP_TRACE, so the trace is cut at older daemons.
+ *
+ * Requests of local clients without a token start a trace with the
+ * probability [Trace] SAMPLE_RATE. Spans are written when their
+ * processor is done, as JSON lines to [Trace] EXPORT_FILE.
+ */
+
+typedef struct CcnetTraceContext {
+    guint64     trace_id;       /* 0 when not traced */
+    guint64     span_id;
+} CcnetTraceContext;
+
+#define CCNET_TRACE_PREFIX      "@trace="
+#define CCNET_TRACE_TOKEN_LEN   (sizeof(CCNET_TRACE_PREFIX) - 1 + 33)
+
+/* Set if tracing is configured. */
+extern gboolean ccnet_trace_enabled;
+
+int ccnet_trace_init (GKeyFile *keyf, const char *config_dir);
+
+/* Takes the token off the start of @req, which is then moved past it.
+ * Returns FALSE and leaves @req alone if it has none. */
+gboolean ccnet_trace_parse (char **req, CcnetTraceContext *ctx);
+
+/* The span which requests made now belong to. */
+void ccnet_trace_set_current (const CcnetTraceContext *ctx,
+                              CcnetTraceContext *saved);
+
+/* Enters the span of @processor, if any, for the calls of its
+ * handlers. */
+void ccnet_trace_enter (struct _CcnetProcessor *processor,
+                        CcnetTraceContext *saved);
+
+/* Begins the span of @processor when it starts, and enters it for the
+ * calls of its start(). */
+void ccnet_trace_begin (struct _CcnetProcessor *processor,
+                        CcnetTraceContext *saved);
+
+/* The time to the first response of the span. */
+void ccnet_trace_mark_response (struct _CcnetProcessor *processor,
+                                gint64 usec);
+
+void ccnet_trace_end (struct _CcnetProcessor *processor, gboolean success);
+
+/* The token to put before requests of @processor to @peer, or NULL. */
+const char *ccnet_trace_token (struct _CcnetProcessor *processor,
+                               struct _CcnetPeer *peer);
+
+#endif
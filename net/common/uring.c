@@ -0,0 +1,589 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <event.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <event2/bufferevent.h>
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#endif
+
+#include "timer.h"
+#include "uring.h"
+
+#include "log.h"
+
+#ifdef HAVE_LIBURING
+
+#define URING_ENTRIES   4096
+#define BUF_GROUP       0
+#define BUF_COUNT       512             /* a power of 2 */
+#define BUF_SIZE        16384
+#define SEND_IOV_MAX    64
+#define SEND_MAX        (256 * 1024)    /* handed to one sendmsg */
+
+/* Receiving pauses when this much waits for the CcnetPacketIO, and
+ * resumes at half of it. */
+#define RECV_PAUSE_LEN  (1024 * 1024)
+
+/* The low bits of the user data, the rest is the conn. */
+enum {
+    OP_RECV = 0,
+    OP_SEND,
+    OP_CANCEL,
+};
+#define OP_MASK 3
+
+struct CcnetUring {
+    struct io_uring     ring;
+    struct io_uring_buf_ring *br;
+    char               *bufs;
+    int                 efd;
+    struct event        event;
+
+    GQueue              dirty;          /* conns to send or refill */
+    CcnetTimer         *flush_timer;
+};
+
+struct CcnetUringConn {
+    CcnetUring         *uring;
+    int                 fd;
+    struct bufferevent *bev;            /* our end of the pair */
+    struct evbuffer_cb_entry *in_cb;
+
+    /* with the kernel until the sendmsg completes */
+    struct evbuffer    *sending;
+    struct msghdr       msg;
+    struct iovec        iov[SEND_IOV_MAX];
+
+    GList              *dirty_link;
+    int                 ops;            /* in flight, and holds */
+    unsigned int        recv_armed : 1;
+    unsigned int        send_armed : 1;
+    unsigned int        paused : 1;
+    unsigned int        refill : 1;     /* the CcnetPacketIO took data */
+    unsigned int        closing : 1;
+};
+
+static int flush (void *vuring);
+
+static void
+schedule_flush (CcnetUring *u)
+{
+    if (!u->flush_timer)
+        u->flush_timer = ccnet_timer_new (flush, u, 0);
+}
+
+static struct io_uring_sqe *
+get_sqe (CcnetUring *u)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe (&u->ring);
+
+    if (!sqe) {
+        io_uring_submit (&u->ring);
+        sqe = io_uring_get_sqe (&u->ring);
+    }
+    if (sqe)
+        schedule_flush (u);
+    else
+        ccnet_warning ("[Uring] No submission entry left\n");
+    return sqe;
+}
+
+static void
+set_op (struct io_uring_sqe *sqe, CcnetUringConn *conn, int op)
+{
+    io_uring_sqe_set_data64 (sqe, (guint64)(uintptr_t)conn | op);
+    conn->ops++;
+}
+
+static void
+conn_free (CcnetUringConn *conn)
+{
+    if (conn->dirty_link)
+        g_queue_delete_link (&conn->uring->dirty, conn->dirty_link);
+    bufferevent_free (conn->bev);
+    evbuffer_free (conn->sending);
+    close (conn->fd);
+    g_free (conn);
+}
+
+/* Keeps @conn while calling out, the callbacks may close it. */
+static void
+conn_hold (CcnetUringConn *conn)
+{
+    conn->ops++;
+}
+
+static void
+conn_release (CcnetUringConn *conn)
+{
+    if (--conn->ops == 0 && conn->closing)
+        conn_free (conn);
+}
+
+static void
+mark_dirty (CcnetUringConn *conn)
+{
+    CcnetUring *u = conn->uring;
+
+    if (conn->dirty_link || conn->closing)
+        return;
+    g_queue_push_tail (&u->dirty, conn);
+    conn->dirty_link = u->dirty.tail;
+    schedule_flush (u);
+}
+
+static void
+arm_recv (CcnetUringConn *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe (conn->uring);
+
+    if (!sqe)
+        return;
+    io_uring_prep_recv_multishot (sqe, conn->fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    set_op (sqe, conn, OP_RECV);
+    conn->recv_armed = 1;
+}
+
+static void
+cancel_recv (CcnetUringConn *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe (conn->uring);
+
+    if (!sqe)
+        return;
+    io_uring_prep_cancel64 (sqe, (guint64)(uintptr_t)conn | OP_RECV, 0);
+    set_op (sqe, conn, OP_CANCEL);
+}
+
+static void
+arm_send (CcnetUringConn *conn)
+{
+    struct evbuffer *input = bufferevent_get_input (conn->bev);
+    struct evbuffer_iovec vec[SEND_IOV_MAX];
+    struct io_uring_sqe *sqe;
+    int i, n;
+
+    if (evbuffer_get_length (conn->sending) == 0) {
+        evbuffer_remove_buffer (input, conn->sending, SEND_MAX);
+        /* The pair moves more over once there's room. */
+        bufferevent_enable (conn->bev, EV_READ);
+        if (evbuffer_get_length (conn->sending) == 0)
+            return;
+    }
+
+    sqe = get_sqe (conn->uring);
+    if (!sqe)
+        return;
+
+    n = evbuffer_peek (conn->sending, -1, NULL, vec, SEND_IOV_MAX);
+    if (n > SEND_IOV_MAX)
+        n = SEND_IOV_MAX;
+    for (i = 0; i < n; ++i) {
+        conn->iov[i].iov_base = vec[i].iov_base;
+        conn->iov[i].iov_len = vec[i].iov_len;
+    }
+    memset (&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = n;
+
+    io_uring_prep_sendmsg (sqe, conn->fd, &conn->msg, MSG_NOSIGNAL);
+    set_op (sqe, conn, OP_SEND);
+    conn->send_armed = 1;
+}
+
+static void
+report_error (CcnetUringConn *conn, int err, short what)
+{
+    struct bufferevent *partner = bufferevent_pair_get_partner (conn->bev);
+
+    if (!partner)
+        return;
+    EVUTIL_SET_SOCKET_ERROR (err);
+    bufferevent_trigger_event (partner, BEV_EVENT_ERROR | what, 0);
+}
+
+static void
+recv_done (CcnetUringConn *conn, int res, unsigned int flags)
+{
+    CcnetUring *u = conn->uring;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buf = u->bufs + (size_t)bid * BUF_SIZE;
+
+        /* Copied out, so the buffer goes back to the ring at once. */
+        if (res > 0 && !conn->closing)
+            bufferevent_write (conn->bev, buf, res);
+        io_uring_buf_ring_add (u->br, buf, BUF_SIZE, bid,
+                               io_uring_buf_ring_mask (BUF_COUNT), 0);
+        io_uring_buf_ring_advance (u->br, 1);
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+        conn->recv_armed = 0;
+    if (conn->closing)
+        return;
+
+    if (res == 0) {
+        /* Hands over what's left, then EOF. */
+        bufferevent_flush (conn->bev, EV_WRITE, BEV_FINISHED);
+        return;
+    }
+    if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        report_error (conn, -res, BEV_EVENT_READING);
+        return;
+    }
+
+    if (!conn->paused && evbuffer_get_length (
+            bufferevent_get_output (conn->bev)) > RECV_PAUSE_LEN) {
+        conn->paused = 1;
+        if (conn->recv_armed)
+            cancel_recv (conn);
+    } else if (!conn->paused && !conn->recv_armed)
+        arm_recv (conn);
+}
+
+static void
+send_done (CcnetUringConn *conn, int res)
+{
+    conn->send_armed = 0;
+    if (conn->closing)
+        return;
+
+    if (res < 0) {
+        report_error (conn, -res, BEV_EVENT_WRITING);
+        return;
+    }
+    evbuffer_drain (conn->sending, res);
+    /* The rest of a short send, or the next batch. */
+    arm_send (conn);
+}
+
+static void
+on_completions (int fd, short event, void *vuring)
+{
+    CcnetUring *u = vuring;
+    struct io_uring_cqe *cqe;
+    CcnetUringConn *conn;
+    guint64 data, count;
+    unsigned int flags;
+    int res;
+
+    if (read (u->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        ccnet_warning ("[Uring] Failed to read eventfd: %s\n",
+                       strerror(errno));
+
+    while (io_uring_peek_cqe (&u->ring, &cqe) == 0) {
+        data = io_uring_cqe_get_data64 (cqe);
+        res = cqe->res;
+        flags = cqe->flags;
+        io_uring_cqe_seen (&u->ring, cqe);
+
+        conn = (CcnetUringConn *)(uintptr_t)(data & ~(guint64)OP_MASK);
+        switch (data & OP_MASK) {
+        case OP_RECV:
+            recv_done (conn, res, flags);
+            break;
+        case OP_SEND:
+            send_done (conn, res);
+            break;
+        default:
+            break;
+        }
+        if (!(flags & IORING_CQE_F_MORE))
+            conn_release (conn);
+    }
+
+    /* The re-armed receives go out now, the sends at the flush. */
+    if (io_uring_sq_ready (&u->ring) > 0)
+        io_uring_submit (&u->ring);
+}
+
+/* The end of the loop iteration: send what the peers wrote meanwhile,
+ * with one io_uring_enter() for all of them. */
+static int
+flush (void *vuring)
+{
+    CcnetUring *u = vuring;
+    CcnetUringConn *conn;
+    struct bufferevent *partner;
+    guint n = g_queue_get_length (&u->dirty);
+
+    while (n-- > 0 && (conn = g_queue_pop_head (&u->dirty)) != NULL) {
+        conn->dirty_link = NULL;
+        conn_hold (conn);
+        if (conn->refill) {
+            conn->refill = 0;
+            partner = bufferevent_pair_get_partner (conn->bev);
+            if (partner && (bufferevent_get_enabled (partner) & EV_READ))
+                bufferevent_enable (partner, EV_READ);
+        }
+        if (!conn->closing && !conn->send_armed)
+            arm_send (conn);
+        conn_release (conn);
+    }
+
+    u->flush_timer = NULL;
+    if (!g_queue_is_empty (&u->dirty))
+        schedule_flush (u);
+    if (io_uring_sq_ready (&u->ring) > 0)
+        io_uring_submit (&u->ring);
+    return FALSE;
+}
+
+/* The peer code wrote to its end. */
+static void
+conn_readcb (struct bufferevent *bev, void *vconn)
+{
+    CcnetUringConn *conn = vconn;
+
+    if (!conn->send_armed)
+        mark_dirty (conn);
+}
+
+/* The CcnetPacketIO took enough to resume receiving. */
+static void
+conn_writecb (struct bufferevent *bev, void *vconn)
+{
+    CcnetUringConn *conn = vconn;
+
+    if (conn->paused && !conn->closing) {
+        conn->paused = 0;
+        if (!conn->recv_armed)
+            arm_recv (conn);
+    }
+}
+
+/* Like a socket bufferevent reading again below its high watermark,
+ * the pair has to be told to move more over. */
+static void
+on_input_drained (struct evbuffer *buf, const struct evbuffer_cb_info *info,
+                  void *vconn)
+{
+    CcnetUringConn *conn = vconn;
+
+    if (info->n_deleted == 0 || conn->refill ||
+        evbuffer_get_length (bufferevent_get_output (conn->bev)) == 0)
+        return;
+    conn->refill = 1;
+    mark_dirty (conn);
+}
+
+CcnetUringConn *
+ccnet_uring_conn_new (CcnetUring *u, int fd, struct bufferevent **bev)
+{
+    struct bufferevent *pair[2];
+    CcnetUringConn *conn;
+
+    if (bufferevent_pair_new (NULL, 0, pair) < 0)
+        return NULL;
+
+    conn = g_new0 (CcnetUringConn, 1);
+    conn->uring = u;
+    conn->fd = fd;
+    conn->bev = pair[1];
+    conn->sending = evbuffer_new ();
+
+    bufferevent_setcb (pair[1], conn_readcb, conn_writecb, NULL, conn);
+    bufferevent_setwatermark (pair[1], EV_READ, 0, SEND_MAX);
+    bufferevent_setwatermark (pair[1], EV_WRITE, RECV_PAUSE_LEN / 2, 0);
+    bufferevent_enable (pair[1], EV_READ | EV_WRITE);
+    conn->in_cb = evbuffer_add_cb (bufferevent_get_input (pair[0]),
+                                   on_input_drained, conn);
+
+    arm_recv (conn);
+
+    *bev = pair[0];
+    return conn;
+}
+
+void
+ccnet_uring_conn_close (CcnetUringConn *conn)
+{
+    struct bufferevent *partner = bufferevent_pair_get_partner (conn->bev);
+    struct io_uring_sqe *sqe;
+
+    if (partner)
+        evbuffer_remove_cb_entry (bufferevent_get_input (partner),
+                                  conn->in_cb);
+    if (conn->dirty_link) {
+        g_queue_delete_link (&conn->uring->dirty, conn->dirty_link);
+        conn->dirty_link = NULL;
+    }
+    conn->closing = 1;
+
+    if (conn->ops == 0) {
+        conn_free (conn);
+        return;
+    }
+
+    /* Freed when the last operation on the socket completes. */
+    sqe = get_sqe (conn->uring);
+    if (sqe) {
+        io_uring_prep_cancel_fd (sqe, conn->fd, IORING_ASYNC_CANCEL_ALL);
+        set_op (sqe, conn, OP_CANCEL);
+    }
+}
+
+/* Multishot receives with provided buffers need Linux 6.0, check them
+ * on a socket pair. */
+static gboolean
+probe_multishot_recv (CcnetUring *u)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int fds[2], res = -1;
+    unsigned int flags = 0;
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return FALSE;
+
+    if (write (fds[1], "x", 1) == 1 &&
+        (sqe = io_uring_get_sqe (&u->ring)) != NULL) {
+        io_uring_prep_recv_multishot (sqe, fds[0], NULL, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUF_GROUP;
+        io_uring_sqe_set_data64 (sqe, 0);
+        io_uring_submit (&u->ring);
+        if (io_uring_wait_cqe (&u->ring, &cqe) == 0) {
+            res = cqe->res;
+            flags = cqe->flags;
+            io_uring_cqe_seen (&u->ring, cqe);
+        }
+    }
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        io_uring_buf_ring_add (u->br, u->bufs + (size_t)bid * BUF_SIZE,
+                               BUF_SIZE, bid,
+                               io_uring_buf_ring_mask (BUF_COUNT), 0);
+        io_uring_buf_ring_advance (u->br, 1);
+    }
+
+    /* Cancel the receive and reap both completions before going on,
+     * they carry no conn. */
+    if ((flags & IORING_CQE_F_MORE) &&
+        (sqe = io_uring_get_sqe (&u->ring)) != NULL) {
+        int pending = 2;
+
+        io_uring_prep_cancel64 (sqe, 0, 0);
+        io_uring_sqe_set_data64 (sqe, 1);
+        io_uring_submit (&u->ring);
+        while (pending > 0 && io_uring_wait_cqe (&u->ring, &cqe) == 0) {
+            if (io_uring_cqe_get_data64 (cqe) == 1 ||
+                !(cqe->flags & IORING_CQE_F_MORE))
+                --pending;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+                io_uring_buf_ring_add (u->br, u->bufs + (size_t)bid * BUF_SIZE,
+                                       BUF_SIZE, bid,
+                                       io_uring_buf_ring_mask (BUF_COUNT), 0);
+                io_uring_buf_ring_advance (u->br, 1);
+            }
+            io_uring_cqe_seen (&u->ring, cqe);
+        }
+    }
+    close (fds[0]);
+    close (fds[1]);
+
+    return res == 1;
+}
+
+CcnetUring *
+ccnet_uring_new (void)
+{
+    struct io_uring_params params;
+    CcnetUring *u;
+    int ret, i;
+
+    u = g_new0 (CcnetUring, 1);
+    u->efd = -1;
+
+    memset (&params, 0, sizeof(params));
+#ifdef IORING_SETUP_COOP_TASKRUN
+    params.flags |= IORING_SETUP_COOP_TASKRUN;
+#endif
+    ret = io_uring_queue_init_params (URING_ENTRIES, &u->ring, &params);
+    if (ret < 0) {
+        ccnet_warning ("[Uring] Failed to set up io_uring: %s\n",
+                       strerror(-ret));
+        g_free (u);
+        return NULL;
+    }
+
+    u->br = io_uring_setup_buf_ring (&u->ring, BUF_COUNT, BUF_GROUP, 0, &ret);
+    if (!u->br) {
+        ccnet_warning ("[Uring] Failed to set up buffer ring: %s\n",
+                       strerror(-ret));
+        goto error;
+    }
+    u->bufs = g_malloc ((size_t)BUF_COUNT * BUF_SIZE);
+    for (i = 0; i < BUF_COUNT; ++i)
+        io_uring_buf_ring_add (u->br, u->bufs + (size_t)i * BUF_SIZE,
+                               BUF_SIZE, i, io_uring_buf_ring_mask (BUF_COUNT),
+                               i);
+    io_uring_buf_ring_advance (u->br, BUF_COUNT);
+
+    if (!probe_multishot_recv (u)) {
+        ccnet_warning ("[Uring] Multishot receive is not supported\n");
+        goto error;
+    }
+
+    u->efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (u->efd < 0 || io_uring_register_eventfd (&u->ring, u->efd) < 0) {
+        ccnet_warning ("[Uring] Failed to set up eventfd: %s\n",
+                       strerror(errno));
+        goto error;
+    }
+
+    g_queue_init (&u->dirty);
+    event_set (&u->event, u->efd, EV_READ | EV_PERSIST, on_completions, u);
+    event_add (&u->event, NULL);
+
+    ccnet_message ("[Uring] Using io_uring for peer connections\n");
+    return u;
+
+error:
+    if (u->efd >= 0)
+        close (u->efd);
+    if (u->br)
+        io_uring_free_buf_ring (&u->ring, u->br, BUF_COUNT, BUF_GROUP);
+    g_free (u->bufs);
+    io_uring_queue_exit (&u->ring);
+    g_free (u);
+    return NULL;
+}
+
+#else
+
+CcnetUring *
+ccnet_uring_new (void)
+{
+    ccnet_warning ("io_uring is not supported by this build\n");
+    return NULL;
+}
+
+CcnetUringConn *
+ccnet_uring_conn_new (CcnetUring *uring, int fd, struct bufferevent **bev)
+{
+    return NULL;
+}
+
+void
+ccnet_uring_conn_close (CcnetUringConn *conn)
+{
+}
+
+#endif  /* HAVE_LIBURING */
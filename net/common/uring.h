@@ -0,0 +1,41 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_URING_H
+#define CCNET_URING_H
+
+/*
+ * io_uring backend for peer sockets, with [Network] IO_URING = true on
+ * Linux.
+ *
+ * The CcnetPacketIO gets one end of a bufferevent pair instead of a
+ * socket bufferevent, so its watermarks, timeouts and callbacks work as
+ * before. The other end belongs to the ring: a multishot recv per
+ * socket fills it from a provided buffer ring, and whatever the peer
+ * code wrote is sent by one sendmsg per socket, all submitted together
+ * at the end of the loop iteration. Completions come in through one
+ * eventfd, so idle peers cost nothing, and a burst of events is one
+ * wakeup and one io_uring_enter().
+ *
+ * Receiving pauses while the CcnetPacketIO doesn't take the data, like
+ * the read watermark of a socket bufferevent. TLS runs as a filter over
+ * the pair, without the kernel offload of tls.h.
+ */
+
+struct bufferevent;
+
+typedef struct CcnetUring CcnetUring;
+typedef struct CcnetUringConn CcnetUringConn;
+
+/* NULL if io_uring is not built in or not supported by the kernel. */
+CcnetUring *ccnet_uring_new (void);
+
+/* Start reading @fd, which the ring closes in ccnet_uring_conn_close().
+ * Returns the end of the pair for the CcnetPacketIO in @bev. */
+CcnetUringConn *ccnet_uring_conn_new (CcnetUring *uring, int fd,
+                                      struct bufferevent **bev);
+
+/* Drop the unsent data and close the socket, call it before freeing
+ * the bufferevent. */
+void ccnet_uring_conn_close (CcnetUringConn *conn);
+
+#endif
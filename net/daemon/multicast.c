@@ -5,131 +5,303 @@
 #define CCNET_MULTICAST_ADDR   "224.0.1.4"
 #define CCNET_MULTICAST_PORT   "10002"
 
+/*
+ * Announcements are told apart by the header id. The text one carries
+ * "<id> <port>\n<pubinfo>" and is what old daemons send. The compact one
+ * carries the raw id, the port and the sha1 of the pubinfo text, so a
+ * receiver that already knows the peer has nothing to parse. A receiver
+ * that sees an unknown hash multicasts a request, which the peer answers
+ * with one text announcement.
+ */
+#define MC_TEXT        0
+#define MC_COMPACT     1
+#define MC_REQUEST     2
+
+typedef struct {
+    unsigned char id[20];
+    guint16       port;
+    unsigned char info_hash[20];
+} __attribute__((__packed__)) McCompact;
+
+typedef struct {
+    unsigned char id[20];
+} McRequest;
+
+/* Every this many compact announcements a text one is sent for old
+ * daemons, which can't request it. */
+#define MC_TEXT_EVERY           10
+/* Don't answer requests or ask for the same peer more often. */
+#define MC_INFO_MIN_INTERVAL     5
+
+/* The announce interval grows with the number of peers on the LAN, so
+ * the total rate stays around MC_LAN_RATE packets per second, but it
+ * stays well below MULT_RECV_TIMEOUT. */
+#define MC_MIN_INTERVAL         10
+#define MC_MAX_INTERVAL         (MULT_RECV_TIMEOUT / 3)
+#define MC_LAN_RATE              2
+
+static char *mc_info;
+static unsigned char mc_info_hash[20];
+static int mc_n_sent;
+static int mc_last_text;
+static int mc_lan_peers;
+
+typedef struct {
+    unsigned char info_hash[20];
+    int           last_request;
+} McPeerInfo;
+
+/* Peer id -> McPeerInfo, the pubinfo hash we accepted for a peer. */
+static GHashTable *mc_known;
+
+static McPeerInfo *
+get_peer_info (const char *id)
+{
+    McPeerInfo *info;
+
+    if (!mc_known)
+        mc_known = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, g_free);
+    info = g_hash_table_lookup (mc_known, id);
+    if (!info) {
+        info = g_new0 (McPeerInfo, 1);
+        g_hash_table_insert (mc_known, g_strdup (id), info);
+    }
+    return info;
+}
+
 static void check_peers_in_lan (CcnetConnManager *manager)
 {
     int timeout = time(NULL) - MULT_RECV_TIMEOUT;
-    GHashTableIter iter;
-    gpointer key, value;
+    CcnetPeerTableIter iter;
     CcnetPeer *peer;
+    int n = 0;
 
-    g_hash_table_iter_init (&iter, manager->session->peer_mgr->peer_hash);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        peer = value;
+    ccnet_peer_table_iter_init (&iter, manager->session->peer_mgr->peer_table);
+    while (ccnet_peer_table_iter_next (&iter, &peer)) {
         if (peer->in_local_network && peer->last_mult_recv < timeout)
             peer->in_local_network = 0;
+        if (peer->in_local_network)
+            ++n;
     }
+    mc_lan_peers = n;
 }
 
-static void send_multicast_packet (CcnetConnManager *manager)
+static void
+mc_send (CcnetConnManager *manager, int type, const void *data, int len)
 {
-    int len;
-    const char *id = manager->session->base.id;
     char buf[MULTICAST_PACKET_LEN];
-    static char *msg = NULL;
     ccnet_packet *packet = (ccnet_packet *)buf;
 
-    if (!msg) {
-        GString *str = ccnet_peer_to_string (manager->session->myself);
-        msg = str->str;
-        g_string_free (str, FALSE);
-    }
-
     packet->header.version = 1;
     packet->header.type = CCNET_MSG_HANDSHAKE;
-    /* note, if we use snprintf(packet->data, ...) here, We would receive
-     * a warning when use CFLAGS="-g -O2": 
-     *   call to __builtin___snprintf_chk will always overflow destination buffer
-     * This warning will cause runtime buffer overflow.
-     */
-    len = snprintf (buf + sizeof(struct ccnet_header), 
-                    MULTICAST_PACKET_LEN - sizeof(struct ccnet_header),
-                    "%s %d\n%s", id,
-                    manager->session->base.public_port, msg);
-    if (len >= MULTICAST_PACKET_LEN) {
+    packet->header.length = htons (len + CCNET_PACKET_LENGTH_HEADER);
+    packet->header.id = htonl (type);
+    memcpy (packet->data, data, len);
+
+    if (sendto (manager->mcsnd_socket, buf, len + CCNET_PACKET_LENGTH_HEADER,
+                0, manager->mc_sasend, manager->mc_salen) < 0) {
+        ccnet_warning ("multicast send error: %s\n", strerror(errno));
+        manager->multicast_error = 1;
+    }
+}
+
+static void send_text_announcement (CcnetConnManager *manager)
+{
+    char data[MULTICAST_PACKET_LEN];
+    int len;
+
+    len = snprintf (data, MULTICAST_PACKET_LEN - CCNET_PACKET_LENGTH_HEADER,
+                    "%s %d\n%s", manager->session->base.id,
+                    manager->session->base.public_port, mc_info);
+    if (len >= MULTICAST_PACKET_LEN - CCNET_PACKET_LENGTH_HEADER) {
         /* see the man of snprintf() */
         ccnet_warning ("packet length exceeds multicast limitation.\n");
         return;
     }
-    len += CCNET_PACKET_LENGTH_HEADER;
-    packet->header.length = htons (len);
-    packet->header.id = 0;
+    mc_send (manager, MC_TEXT, data, len);
+    mc_last_text = time(NULL);
+}
 
-    if (sendto (manager->mcsnd_socket, buf, len, 0,
-                manager->mc_sasend, manager->mc_salen) < 0) {
-        ccnet_warning ("multicast send error: %s\n", strerror(errno));
-        manager->multicast_error = 1;
+/*
+ * Announce ourself. Returns the number of seconds until the next
+ * announcement, with some jitter so the peers of a LAN don't line up.
+ */
+static int send_multicast_packet (CcnetConnManager *manager)
+{
+    McCompact compact;
+    int interval;
+
+    if (!mc_info) {
+        GString *str = ccnet_peer_to_string (manager->session->myself);
+        mc_info = g_string_free (str, FALSE);
+        calculate_sha1 (mc_info_hash, mc_info);
+    }
+
+    if (mc_n_sent++ % MC_TEXT_EVERY == 0)
+        send_text_announcement (manager);
+    else {
+        hex_to_sha1 (manager->session->base.id, compact.id);
+        compact.port = htons (manager->session->base.public_port);
+        memcpy (compact.info_hash, mc_info_hash, 20);
+        mc_send (manager, MC_COMPACT, &compact, sizeof(compact));
     }
 
     check_peers_in_lan (manager);
-    /* ccnet_debug ("[Conn] Send multicast packet %d\n", len); */
+
+    interval = CLAMP ((mc_lan_peers + 1) / MC_LAN_RATE,
+                      MC_MIN_INTERVAL, MC_MAX_INTERVAL);
+    return interval - interval / 4 + g_random_int_range (0, interval / 2 + 1);
 }
 
 static void
-multicast_recv (evutil_socket_t fd, short event, void *vmanager)
+found_peer_in_lan (CcnetConnManager *manager, CcnetPeer *peer,
+                   struct sockaddr_storage *from, int len,
+                   unsigned short port)
+{
+    peer->last_mult_recv = time(NULL);
+
+    if (peer->is_self || peer->net_state == PEER_CONNECTED)
+        return;
+
+    if (!peer->in_local_network) {
+        notify_found_peer (manager->session, peer);
+        peer->in_local_network = 1;
+    }
+    ccnet_peer_update_address (peer,
+             sock_ntop((struct sockaddr *)from, len), port);
+}
+
+static void
+handle_text (CcnetConnManager *manager, char *data, int n,
+             struct sockaddr_storage *from, int len)
 {
-    CcnetConnManager *manager = vmanager;
-    struct sockaddr_storage from;
-    int len = sizeof (struct sockaddr_storage);
-    int n;
-    char buf[MULTICAST_PACKET_LEN];
-    ccnet_packet *packet = (ccnet_packet *)buf;
     char *id, *ptr, *end, *info;
     unsigned short port;
-    
-    /* fprintf (stderr, "Recv a multicast message\n"); */
-
-    n = recvfrom (fd, buf, MULTICAST_PACKET_LEN, 0,
-                  (struct sockaddr *)&from, (socklen_t *)&len);
-    buf[n] = '\0';
+    CcnetPeer *peer;
+    CcnetPeerManager *peerMgr = manager->session->peer_mgr;
+    McPeerInfo *pinfo;
+    unsigned char hash[20];
 
-    if (G_UNLIKELY (n < 42 + CCNET_PACKET_LENGTH_HEADER 
-                    || packet->data[40] != ' ')) {
+    if (G_UNLIKELY (n < 42 || data[40] != ' ')) {
         ccnet_warning ("Bad broadcast message from %s %.10s\n",
-                       sock_ntop((struct sockaddr *)&from, len), buf);
+                       sock_ntop((struct sockaddr *)from, len), data);
         return;
     }
 
-    id = packet->data;
-    packet->data[40] = '\0';
-    end = buf + n;
-    for (ptr = packet->data + 40; *ptr != '\n' && ptr < end; ++ptr);
+    id = data;
+    data[40] = '\0';
+    end = data + n;
+    for (ptr = data + 40; *ptr != '\n' && ptr < end; ++ptr);
     if (ptr == end) {
         ccnet_warning ("Bad broadcast message from %s\n",
-                       sock_ntop((struct sockaddr *)&from, len));
+                       sock_ntop((struct sockaddr *)from, len));
         return;
     }
     *ptr = '\0';
-    port = atoi (packet->data + 41);
+    port = atoi (data + 41);
     info = ptr+1;
 
-    if (port != 0) {
-        CcnetPeer *peer;
-        CcnetPeerManager *peerMgr = manager->session->peer_mgr;
+    if (port == 0)
+        return;
 
-        peer = ccnet_peer_manager_get_peer (peerMgr, id);
+    peer = ccnet_peer_manager_get_peer (peerMgr, id);
+    if (!peer) {
+        peer = ccnet_peer_from_string (info);
         if (!peer) {
-            peer = ccnet_peer_from_string (info);
-            if (!peer) {
-                ccnet_debug ("[Conn] Multicast packet containing bad peer info\n");
-                return;
-            }
-            ccnet_peer_manager_add_peer (peerMgr, peer);
+            ccnet_debug ("[Conn] Multicast packet containing bad peer info\n");
+            return;
         }
+        ccnet_peer_manager_add_peer (peerMgr, peer);
+    }
 
-        peer->last_mult_recv = time(NULL);
+    /* Remember the hash, so the compact announcements of the peer
+     * match. The peer's own id is checked when it connects. */
+    calculate_sha1 (hash, info);
+    pinfo = get_peer_info (id);
+    memcpy (pinfo->info_hash, hash, 20);
 
-        if (peer->is_self || peer->net_state == PEER_CONNECTED) {
-            g_object_unref (peer);
-            return;
-        }
+    found_peer_in_lan (manager, peer, from, len, port);
+    g_object_unref (peer);
+}
+
+static void
+handle_compact (CcnetConnManager *manager, McCompact *compact,
+                struct sockaddr_storage *from, int len)
+{
+    char id[41];
+    CcnetPeer *peer;
+    McPeerInfo *pinfo;
+    McRequest req;
+    int now = time(NULL);
 
-        if (!peer->in_local_network) {
-            notify_found_peer (manager->session, peer);
-            peer->in_local_network = 1;
+    sha1_to_hex (compact->id, id);
+    if (strcmp (id, manager->session->base.id) == 0)
+        return;
+
+    pinfo = get_peer_info (id);
+    peer = ccnet_peer_manager_get_peer (manager->session->peer_mgr, id);
+    if (!peer || memcmp (pinfo->info_hash, compact->info_hash, 20) != 0) {
+        /* Unknown or changed, ask for the text announcement. */
+        if (pinfo->last_request + MC_INFO_MIN_INTERVAL <= now) {
+            pinfo->last_request = now;
+            memcpy (req.id, compact->id, 20);
+            mc_send (manager, MC_REQUEST, &req, sizeof(req));
         }
-        ccnet_peer_update_address (peer, 
-                 sock_ntop((struct sockaddr *)&from, len), port);
-        g_object_unref (peer);
+    }
+    if (!peer)
+        return;
+
+    if (ntohs (compact->port) != 0)
+        found_peer_in_lan (manager, peer, from, len, ntohs (compact->port));
+    g_object_unref (peer);
+}
+
+static void
+handle_request (CcnetConnManager *manager, McRequest *req)
+{
+    unsigned char myid[20];
+
+    hex_to_sha1 (manager->session->base.id, myid);
+    if (memcmp (req->id, myid, 20) != 0 || !mc_info)
+        return;
+
+    /* Several receivers may ask at once, one answer serves them all. */
+    if (mc_last_text + MC_INFO_MIN_INTERVAL <= time(NULL))
+        send_text_announcement (manager);
+}
+
+static void
+multicast_recv (evutil_socket_t fd, short event, void *vmanager)
+{
+    CcnetConnManager *manager = vmanager;
+    struct sockaddr_storage from;
+    int len = sizeof (struct sockaddr_storage);
+    int n;
+    char buf[MULTICAST_PACKET_LEN];
+    ccnet_packet *packet = (ccnet_packet *)buf;
+
+    /* fprintf (stderr, "Recv a multicast message\n"); */
+
+    n = recvfrom (fd, buf, MULTICAST_PACKET_LEN - 1, 0,
+                  (struct sockaddr *)&from, (socklen_t *)&len);
+    if (n < CCNET_PACKET_LENGTH_HEADER)
+        return;
+    buf[n] = '\0';
+    n -= CCNET_PACKET_LENGTH_HEADER;
+
+    switch (ntohl (packet->header.id)) {
+    case MC_TEXT:
+        handle_text (manager, packet->data, n, &from, len);
+        break;
+    case MC_COMPACT:
+        if (n == sizeof(McCompact))
+            handle_compact (manager, (McCompact *)packet->data, &from, len);
+        break;
+    case MC_REQUEST:
+        if (n == sizeof(McRequest))
+            handle_request (manager, (McRequest *)packet->data);
+        break;
     }
 }
 
@@ -142,7 +314,7 @@ void multicast_start (CcnetConnManager *manager)
 
     ccnet_message ("[Conn] Multicast start\n");
 
-    sendfd = udp_client (CCNET_MULTICAST_ADDR, CCNET_MULTICAST_PORT, 
+    sendfd = udp_client (CCNET_MULTICAST_ADDR, CCNET_MULTICAST_PORT,
                          &sasend, &salen);
 
     if (sendfd < 0) {
@@ -154,7 +326,7 @@ void multicast_start (CcnetConnManager *manager)
     if (recvfd < 0)
         return;
 
-    event_set(&manager->mc_event, recvfd, EV_READ | EV_PERSIST, 
+    event_set(&manager->mc_event, recvfd, EV_READ | EV_PERSIST,
               multicast_recv, manager);
     event_add(&manager->mc_event, NULL);
 
@@ -0,0 +1,197 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "cache-bus.h"
+
+#define DEBUG_FLAG  CCNET_DEBUG_OTHER
+#include "log.h"
+
+#define MAX_SUBSCRIBERS     16
+#define MAX_PENDING_EVENTS  1000    /* more are sent as one flush */
+
+/*
+ * A batch of events is
+ *
+ *   <epoch> <seq>
+ *   <domain> <key>
+ *   <domain>
+ *   ...
+ *
+ * where seq counts the batches of the node since it started and epoch
+ * tells its runs apart. A line without a key is for the whole domain,
+ * "*" for everything. A heartbeat is a batch without lines, carrying
+ * the seq of the last batch sent.
+ */
+
+typedef struct Subscriber {
+    char                 *domain;
+    CcnetCacheBusHandler  handler;
+    void                 *data;
+} Subscriber;
+
+typedef struct NodeState {
+    guint32     epoch;
+    guint64     seq;
+} NodeState;
+
+static Subscriber subscribers[MAX_SUBSCRIBERS];
+static int n_subscribers;
+
+/* The main thread sets it once at startup. */
+static gboolean enabled;
+
+static pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+static guint32  epoch;
+static guint64  seq;
+static GString *pending;
+static int      n_pending;
+
+/* Last batch of other nodes, main thread only. */
+static GHashTable *nodes;
+
+void
+ccnet_cache_bus_subscribe (const char *domain,
+                           CcnetCacheBusHandler handler, void *data)
+{
+    Subscriber *sub;
+
+    if (n_subscribers >= MAX_SUBSCRIBERS) {
+        ccnet_warning ("Too many cache subscribers\n");
+        return;
+    }
+    sub = &subscribers[n_subscribers++];
+    sub->domain = g_strdup (domain);
+    sub->handler = handler;
+    sub->data = data;
+}
+
+void
+ccnet_cache_bus_publish (const char *domain, const char *key)
+{
+    if (!enabled)
+        return;
+
+    if (key && strchr (key, '\n'))
+        key = NULL;
+
+    pthread_mutex_lock (&bus_lock);
+    if (n_pending < MAX_PENDING_EVENTS) {
+        if (key)
+            g_string_append_printf (pending, "%s %s\n", domain, key);
+        else
+            g_string_append_printf (pending, "%s\n", domain);
+    } else if (n_pending == MAX_PENDING_EVENTS) {
+        g_string_assign (pending, "*\n");
+    }
+    ++n_pending;
+    pthread_mutex_unlock (&bus_lock);
+}
+
+void
+ccnet_cache_bus_enable (void)
+{
+    pending = g_string_new (NULL);
+    nodes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    epoch = g_random_int ();
+    enabled = TRUE;
+}
+
+gboolean
+ccnet_cache_bus_take_events (GString *buf, gboolean heartbeat)
+{
+    if (!enabled)
+        return FALSE;
+
+    pthread_mutex_lock (&bus_lock);
+    if (n_pending == 0 && !heartbeat) {
+        pthread_mutex_unlock (&bus_lock);
+        return FALSE;
+    }
+
+    if (n_pending > 0)
+        ++seq;
+    g_string_append_printf (buf, "%u %" G_GUINT64_FORMAT "\n", epoch, seq);
+    g_string_append (buf, pending->str);
+    g_string_truncate (pending, 0);
+    n_pending = 0;
+    pthread_mutex_unlock (&bus_lock);
+
+    return TRUE;
+}
+
+static void
+deliver (const char *domain, const char *key)
+{
+    int i;
+
+    for (i = 0; i < n_subscribers; ++i) {
+        if (strcmp (subscribers[i].domain, domain) == 0 ||
+            strcmp (domain, "*") == 0)
+            subscribers[i].handler (subscribers[i].domain,
+                                    strcmp (domain, "*") == 0 ? NULL : key,
+                                    subscribers[i].data);
+    }
+}
+
+void
+ccnet_cache_bus_receive (const char *node, char *body)
+{
+    NodeState *state;
+    guint32 node_epoch;
+    guint64 node_seq;
+    char *lines, *line, *next, *key;
+    gboolean has_events, missed = FALSE;
+
+    if (!enabled)
+        return;
+
+    lines = strchr (body, '\n');
+    if (!lines ||
+        sscanf (body, "%u %" G_GUINT64_FORMAT, &node_epoch, &node_seq) != 2) {
+        ccnet_message ("Bad cache invalidation from %.8s\n", node);
+        return;
+    }
+    ++lines;
+    has_events = (*lines != '\0');
+
+    state = g_hash_table_lookup (nodes, node);
+    if (!state) {
+        state = g_new0 (NodeState, 1);
+        g_hash_table_insert (nodes, g_strdup (node), state);
+        missed = TRUE;
+    } else if (state->epoch != node_epoch ||
+               node_seq != state->seq + (has_events ? 1 : 0)) {
+        missed = TRUE;
+    }
+    state->epoch = node_epoch;
+    state->seq = node_seq;
+
+    if (missed) {
+        ccnet_debug ("[Cache] Flushing caches, may have missed "
+                     "invalidations from %.8s\n", node);
+        deliver ("*", NULL);
+        return;
+    }
+
+    for (line = lines; *line; line = next) {
+        next = strchr (line, '\n');
+        if (!next)
+            break;
+        *next++ = '\0';
+
+        key = strchr (line, ' ');
+        if (key)
+            *key++ = '\0';
+        deliver (line, key);
+    }
+}
+
+void
+ccnet_cache_bus_forget_node (const char *node)
+{
+    if (enabled)
+        g_hash_table_remove (nodes, node);
+}
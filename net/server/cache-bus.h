@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_CACHE_BUS_H
+#define CCNET_CACHE_BUS_H
+
+#include <glib.h>
+
+/*
+ * Invalidation of the user, binding and org caches across nodes which
+ * share one database. The managers publish what they changed as a
+ * domain ("user", "binding", ...) and a key, NULL for all of the
+ * domain, and subscribe to the domains they cache.
+ *
+ * Without a transport, as in a standalone server, publishing does
+ * nothing. The cluster manager takes the published events from the
+ * main loop, numbered per node, and sends them to the other nodes.
+ * A node seeing a gap in the numbers of another, or hearing from it
+ * for the first time, flushes all its caches.
+ */
+
+typedef void (*CcnetCacheBusHandler) (const char *domain, const char *key,
+                                      void *data);
+
+/* Called in the main thread, with @key NULL for a flush. */
+void ccnet_cache_bus_subscribe (const char *domain,
+                                CcnetCacheBusHandler handler, void *data);
+
+/* May be called from any thread. */
+void ccnet_cache_bus_publish (const char *domain, const char *key);
+
+/* The transport. */
+
+void ccnet_cache_bus_enable (void);
+
+/* Move the published events to @buf, or only the current number if
+ * there are none and @heartbeat is set. FALSE if nothing was added. */
+gboolean ccnet_cache_bus_take_events (GString *buf, gboolean heartbeat);
+
+/* Events of @node as taken there. */
+void ccnet_cache_bus_receive (const char *node, char *body);
+
+/* @node went away, what it sends next may have gaps we can't see. */
+void ccnet_cache_bus_forget_node (const char *node);
+
+#endif
@@ -0,0 +1,811 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Times the public calls of the user, group and org managers against a
+ * synthetic dataset, to see what schema, index and cache changes do
+ * without production data.
+ *
+ * The database is the one configured in the ccnet.conf of -c, SQLite or
+ * MySQL, which must be empty: a config dir made by ccnet-init just for
+ * this. The dataset is generated into it first:
+ *
+ *   -u  users, all with the password of validate_emailuser
+ *   -g  groups. Each user joins 1 to 2*-m - 1 of them, picked with a
+ *       Zipf distribution of exponent -z, so a few groups are huge and
+ *       most are small, as in real deployments.
+ *   -o  orgs. User i is a member of org i % -o, the first of each
+ *       org its staff, and every tenth group is an org group.
+ *
+ * Everything is generated again from the seed -S, so with -k a dataset
+ * left by an earlier run with the same options is used as it is.
+ *
+ * Each benchmark then runs for -t ms and is reported as one JSON object
+ * per line, like ccnet-bench:
+ *
+ *   {"bench": "get_groupids_by_user", "ops": 48210,
+ *    "ops_per_sec": 24105.0, "p50_us": 38, "p99_us": 112, "max_us": 2210}
+ *
+ * Before that the plans of the org membership queries are checked with
+ * EXPLAIN, one line each:
+ *
+ *   {"explain": "is_org_staff", "index_only": true}
+ *
+ * A plan reading more than indexes and primary keys is printed to
+ * stderr, and the exit status is 1. -x stops after the check.
+ *
+ * Usage: ccnet-mgrbench -c conf-dir [-u users] [-g groups] [-o orgs]
+ *                       [-m memberships] [-z exponent] [-S seed]
+ *                       [-t ms] [-k] [-x] [pattern]
+ */
+
+#include "common.h"
+
+#include <math.h>
+#include <getopt.h>
+#include <event.h>
+
+#include "utils.h"
+#include "ccnet-db.h"
+#include "server-session.h"
+#include "user-mgr.h"
+#include "group-mgr.h"
+#include "org-mgr.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_OTHER
+#include "log.h"
+
+#define BENCH_PASSWD        "mgrbench-passwd"
+#define BENCH_EMAIL_FMT     "mgrbench-%d@example.com"
+#define BENCH_ORG_FMT       "mgrbench-org-%d"
+#define ROWS_PER_TRANS      1000
+#define PAGE_SIZE           100
+
+/* Used by rpc-service.c and log.c. */
+CcnetSession *session;
+
+typedef struct Dataset {
+    int         n_users;
+    int         n_groups;
+    int         n_orgs;
+    int         memberships;
+    double      zipf_s;
+    guint32     seed;
+
+    /* The groups of user i are groups[offsets[i]] up to offsets[i+1]. */
+    int        *offsets;
+    int        *groups;
+
+    int        *org_ids;
+} Dataset;
+
+typedef struct Bench {
+    const char  *name;
+    /* One call, FALSE if it failed. */
+    gboolean   (*func) (Dataset *ds, GRand *rand);
+} Bench;
+
+static CcnetUserManager *user_mgr;
+static CcnetGroupManager *group_mgr;
+static CcnetOrgManager *org_mgr;
+
+/* The databases of the managers, separate files with SQLite. */
+static CcnetDB *user_db;
+static CcnetDB *group_db;
+static CcnetDB *org_db;
+
+/* Dataset */
+
+static double *
+zipf_cdf (int n, double s)
+{
+    double *cdf = g_new (double, n);
+    double sum = 0;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        sum += 1.0 / pow (i + 1, s);
+        cdf[i] = sum;
+    }
+    for (i = 0; i < n; ++i)
+        cdf[i] /= sum;
+    return cdf;
+}
+
+static int
+zipf_pick (const double *cdf, int n, GRand *rand)
+{
+    double x = g_rand_double (rand);
+    int lo = 0, hi = n - 1, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* The memberships, the same for the same options. Group ids start at 1
+ * in an empty database. */
+static void
+generate_memberships (Dataset *ds)
+{
+    GRand *rand = g_rand_new_with_seed (ds->seed);
+    double *cdf = zipf_cdf (ds->n_groups, ds->zipf_s);
+    GArray *groups = g_array_new (FALSE, FALSE, sizeof(int));
+    int i, j, k, n, g;
+
+    ds->offsets = g_new (int, ds->n_users + 1);
+    for (i = 0; i < ds->n_users; ++i) {
+        ds->offsets[i] = groups->len;
+        n = g_rand_int_range (rand, 1, 2 * ds->memberships);
+        for (j = 0; j < n; ++j) {
+            g = zipf_pick (cdf, ds->n_groups, rand) + 1;
+            for (k = ds->offsets[i]; k < groups->len; ++k)
+                if (g_array_index (groups, int, k) == g)
+                    break;
+            if (k == groups->len)
+                g_array_append_val (groups, g);
+        }
+    }
+    ds->offsets[i] = groups->len;
+    ds->groups = (int *) g_array_free (groups, FALSE);
+
+    g_free (cdf);
+    g_rand_free (rand);
+}
+
+/* Run @sql once per row in transactions of ROWS_PER_TRANS rows. */
+typedef struct Inserter {
+    CcnetDB        *db;
+    CcnetDBTrans   *trans;
+    int             rows;
+} Inserter;
+
+static int
+insert_done (Inserter *ins)
+{
+    CcnetDBTrans *trans = ins->trans;
+
+    ins->trans = NULL;
+    return trans ? ccnet_db_commit (trans) : 0;
+}
+
+static int
+insert_row (Inserter *ins, const char *sql, char **params, int n)
+{
+    if (!ins->trans && !(ins->trans = ccnet_db_begin_transaction (ins->db)))
+        return -1;
+    if (ccnet_db_trans_query_strv (ins->trans, sql, params, n) < 0) {
+        ccnet_db_rollback (ins->trans);
+        ins->trans = NULL;
+        return -1;
+    }
+    if (++ins->rows % ROWS_PER_TRANS == 0)
+        return insert_done (ins);
+    return 0;
+}
+
+static int
+load_org_ids (Dataset *ds)
+{
+    char prefix[64];
+    int i;
+
+    ds->org_ids = g_new (int, ds->n_orgs);
+    for (i = 0; i < ds->n_orgs; ++i) {
+        g_snprintf (prefix, sizeof(prefix), BENCH_ORG_FMT, i);
+        ds->org_ids[i] = ccnet_db_statement_get_int (
+            org_db, "SELECT org_id FROM Organization WHERE url_prefix=?",
+            1, "string", prefix);
+        if (ds->org_ids[i] < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+generate_dataset (Dataset *ds)
+{
+    Inserter ins = { user_db };
+    char email[64], id[16], org_id[16], ctime[32], *passwd;
+    char *params[5];
+    int i, j;
+    gint64 start = g_get_monotonic_time ();
+
+    /* The first user goes through the manager for the password hash,
+     * which the others copy. */
+    g_snprintf (email, sizeof(email), BENCH_EMAIL_FMT, 0);
+    if (ccnet_user_manager_add_emailuser (user_mgr, email, BENCH_PASSWD,
+                                          0, 1) < 0)
+        return -1;
+    passwd = ccnet_db_statement_get_string (
+        user_db, "SELECT passwd FROM EmailUser WHERE email=?",
+        1, "string", email);
+    if (!passwd)
+        return -1;
+
+    g_snprintf (ctime, sizeof(ctime), "%" G_GINT64_FORMAT, get_current_time ());
+    for (i = 1; i < ds->n_users; ++i) {
+        g_snprintf (email, sizeof(email), BENCH_EMAIL_FMT, i);
+        params[0] = email;
+        params[1] = passwd;
+        params[2] = ctime;
+        if (insert_row (&ins, "INSERT INTO EmailUser (email, passwd, "
+                        "is_staff, is_active, ctime) VALUES (?, ?, 0, 1, ?)",
+                        params, 3) < 0)
+            goto error;
+    }
+    if (insert_done (&ins) < 0)
+        goto error;
+
+    ins.db = group_db;
+    for (i = 1; i <= ds->n_groups; ++i) {
+        g_snprintf (id, sizeof(id), "%d", i);
+        g_snprintf (email, sizeof(email), "mgrbench-group-%d", i);
+        params[0] = id;
+        params[1] = email;
+        params[2] = "mgrbench-0@example.com";
+        params[3] = ctime;
+        if (insert_row (&ins, "INSERT INTO `Group` (`group_id`, "
+                        "`group_name`, `creator_name`, `timestamp`) "
+                        "VALUES (?, ?, ?, ?)", params, 4) < 0)
+            goto error;
+    }
+    if (insert_done (&ins) < 0)
+        goto error;
+
+    for (i = 0; i < ds->n_users; ++i) {
+        g_snprintf (email, sizeof(email), BENCH_EMAIL_FMT, i);
+        for (j = ds->offsets[i]; j < ds->offsets[i + 1]; ++j) {
+            g_snprintf (id, sizeof(id), "%d", ds->groups[j]);
+            params[0] = id;
+            params[1] = email;
+            if (insert_row (&ins, "INSERT INTO `GroupUser` (`group_id`, "
+                            "`user_name`, `is_staff`) VALUES (?, ?, 0)",
+                            params, 2) < 0)
+                goto error;
+        }
+    }
+    if (insert_done (&ins) < 0)
+        goto error;
+
+    /* Few enough to go through the manager. */
+    for (i = 0; i < ds->n_orgs; ++i) {
+        g_snprintf (email, sizeof(email), BENCH_ORG_FMT, i);
+        if (ccnet_org_manager_create_org (org_mgr, email, email,
+                                          "mgrbench-0@example.com",
+                                          NULL) < 0)
+            goto error;
+    }
+    if (load_org_ids (ds) < 0)
+        goto error;
+
+    ins.db = org_db;
+    for (i = 0; i < ds->n_users; ++i) {
+        g_snprintf (email, sizeof(email), BENCH_EMAIL_FMT, i);
+        g_snprintf (org_id, sizeof(org_id), "%d",
+                    ds->org_ids[i % ds->n_orgs]);
+        params[0] = org_id;
+        params[1] = email;
+        params[2] = i < ds->n_orgs ? "1" : "0";
+        if (insert_row (&ins, "INSERT INTO OrgUser (org_id, email, is_staff) "
+                        "VALUES (?, ?, ?)", params, 3) < 0)
+            goto error;
+    }
+    for (i = 10; i <= ds->n_groups; i += 10) {
+        g_snprintf (org_id, sizeof(org_id), "%d",
+                    ds->org_ids[i / 10 % ds->n_orgs]);
+        g_snprintf (id, sizeof(id), "%d", i);
+        params[0] = org_id;
+        params[1] = id;
+        if (insert_row (&ins, "INSERT INTO OrgGroup (org_id, group_id) "
+                        "VALUES (?, ?)", params, 2) < 0)
+            goto error;
+    }
+    if (insert_done (&ins) < 0)
+        goto error;
+
+    fprintf (stderr, "Generated %d users, %d groups with %d memberships, "
+             "%d orgs in %.1f s\n", ds->n_users, ds->n_groups,
+             ds->offsets[ds->n_users], ds->n_orgs,
+             (g_get_monotonic_time () - start) / 1e6);
+    g_free (passwd);
+    return 0;
+
+error:
+    if (ins.trans)
+        ccnet_db_rollback (ins.trans);
+    g_free (passwd);
+    return -1;
+}
+
+static int
+prepare_dataset (Dataset *ds, gboolean keep)
+{
+    gint64 n_users = ccnet_db_get_int64 (user_db,
+                                         "SELECT COUNT(*) FROM EmailUser");
+    gint64 n_bench = ccnet_db_get_int64 (
+        user_db,
+        "SELECT COUNT(*) FROM EmailUser WHERE email LIKE 'mgrbench-%'");
+
+    generate_memberships (ds);
+
+    if (n_users == 0)
+        return generate_dataset (ds);
+    if (keep && n_bench == n_users && n_users == ds->n_users)
+        return load_org_ids (ds);
+
+    fprintf (stderr, "The database is not empty%s\n",
+             n_bench == n_users ?
+             ", and the dataset in it was made with other options" : "");
+    return -1;
+}
+
+/* Benchmarks */
+
+static void
+email_of (char *buf, int user)
+{
+    g_snprintf (buf, 64, BENCH_EMAIL_FMT, user);
+}
+
+static gboolean
+bench_get_groupids_by_user (Dataset *ds, GRand *rand)
+{
+    char email[64];
+    GList *ids;
+
+    email_of (email, g_rand_int_range (rand, 0, ds->n_users));
+    ids = ccnet_group_manager_get_groupids_by_user (group_mgr, email, NULL);
+    g_list_free (ids);
+    return TRUE;
+}
+
+/* Half of them members. */
+static gboolean
+bench_is_group_user (Dataset *ds, GRand *rand)
+{
+    int user = g_rand_int_range (rand, 0, ds->n_users);
+    int first = ds->offsets[user], n = ds->offsets[user + 1] - first;
+    int group;
+    char email[64];
+
+    if (g_rand_boolean (rand))
+        group = ds->groups[first + g_rand_int_range (rand, 0, n)];
+    else
+        group = g_rand_int_range (rand, 1, ds->n_groups + 1);
+
+    email_of (email, user);
+    ccnet_group_manager_is_group_user (group_mgr, group, email);
+    return TRUE;
+}
+
+static gboolean
+bench_get_org_by_url_prefix (Dataset *ds, GRand *rand)
+{
+    char prefix[64];
+    CcnetOrganization *org;
+
+    g_snprintf (prefix, sizeof(prefix), BENCH_ORG_FMT,
+                g_rand_int_range (rand, 0, ds->n_orgs));
+    org = ccnet_org_manager_get_org_by_url_prefix (org_mgr, prefix, NULL);
+    if (!org)
+        return FALSE;
+    g_object_unref (org);
+    return TRUE;
+}
+
+static gboolean
+bench_get_orgs_by_user (Dataset *ds, GRand *rand)
+{
+    char email[64];
+    GList *orgs, *ptr;
+
+    email_of (email, g_rand_int_range (rand, 0, ds->n_users));
+    orgs = ccnet_org_manager_get_orgs_by_user (org_mgr, email, NULL);
+    if (!orgs)
+        return FALSE;
+    for (ptr = orgs; ptr; ptr = ptr->next)
+        g_object_unref (ptr->data);
+    g_list_free (orgs);
+    return TRUE;
+}
+
+static gboolean
+bench_get_org_emailusers (Dataset *ds, GRand *rand)
+{
+    char prefix[64];
+    GList *emails, *ptr;
+
+    g_snprintf (prefix, sizeof(prefix), BENCH_ORG_FMT,
+                g_rand_int_range (rand, 0, ds->n_orgs));
+    emails = ccnet_org_manager_get_org_emailusers (org_mgr, prefix,
+                                                   0, PAGE_SIZE);
+    if (!emails)
+        return FALSE;
+    for (ptr = emails; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (emails);
+    return TRUE;
+}
+
+/* Half of them in the org. */
+static int
+pick_org_user (Dataset *ds, GRand *rand, char *email)
+{
+    int user = g_rand_int_range (rand, 0, ds->n_users);
+
+    email_of (email, user);
+    if (g_rand_boolean (rand))
+        return ds->org_ids[user % ds->n_orgs];
+    return ds->org_ids[g_rand_int_range (rand, 0, ds->n_orgs)];
+}
+
+static gboolean
+bench_org_user_exists (Dataset *ds, GRand *rand)
+{
+    char email[64];
+    int org_id = pick_org_user (ds, rand, email);
+
+    ccnet_org_manager_org_user_exists (org_mgr, org_id, email, NULL);
+    return TRUE;
+}
+
+static gboolean
+bench_is_org_staff (Dataset *ds, GRand *rand)
+{
+    char email[64];
+    int org_id = pick_org_user (ds, rand, email);
+
+    ccnet_org_manager_is_org_staff (org_mgr, org_id, email, NULL);
+    return TRUE;
+}
+
+static gboolean
+bench_get_org_groups (Dataset *ds, GRand *rand)
+{
+    int org_id = ds->org_ids[g_rand_int_range (rand, 0, ds->n_orgs)];
+
+    g_list_free (ccnet_org_manager_get_org_groups (org_mgr, org_id, -1, -1));
+    return TRUE;
+}
+
+static gboolean
+bench_get_emailusers_page (Dataset *ds, GRand *rand)
+{
+    int start = g_rand_int_range (rand, 0, MAX (ds->n_users - PAGE_SIZE, 1));
+    GList *users, *ptr;
+
+    users = ccnet_user_manager_get_emailusers (user_mgr, start, PAGE_SIZE);
+    if (!users)
+        return FALSE;
+    for (ptr = users; ptr; ptr = ptr->next)
+        g_object_unref (ptr->data);
+    g_list_free (users);
+    return TRUE;
+}
+
+static gboolean
+bench_validate_emailuser (Dataset *ds, GRand *rand)
+{
+    char email[64];
+
+    email_of (email, g_rand_int_range (rand, 0, ds->n_users));
+    return ccnet_user_manager_validate_emailuser (user_mgr, email,
+                                                  BENCH_PASSWD) == 0;
+}
+
+/* Query plans */
+
+static gboolean
+collect_plan_cb (CcnetDBRow *row, void *data)
+{
+    GString *plan = data;
+    int i, n = ccnet_db_row_get_column_count (row);
+    const char *value;
+
+    for (i = 0; i < n; ++i) {
+        value = ccnet_db_row_get_column_text (row, i);
+        g_string_append_printf (plan, "%s%s", i ? "\t" : "",
+                                value ? value : "NULL");
+    }
+    g_string_append_c (plan, '\n');
+    return TRUE;
+}
+
+/* "Using index" but not "Using index condition", which reads rows. */
+static gboolean
+mysql_covering (const char *line)
+{
+    const char *p = line;
+
+    while ((p = strstr (p, "Using index")) != NULL) {
+        p += strlen ("Using index");
+        if (!g_str_has_prefix (p, " condition"))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Every table read from a covering index or by primary key, no scans,
+ * no sorts. One line of @plan per step. */
+static gboolean
+line_index_only (const char *line, gboolean mysql)
+{
+    if (mysql) {
+        if (strstr (line, "\tALL\t") || strstr (line, "Using filesort") ||
+            strstr (line, "Using temporary"))
+            return FALSE;
+        return mysql_covering (line) || strstr (line, "\teq_ref\t") ||
+            strstr (line, "\tconst\t") || strstr (line, "const table") ||
+            strstr (line, "Impossible WHERE") ||
+            strstr (line, "optimized away");
+    }
+
+    if (strstr (line, "TEMP B-TREE"))
+        return FALSE;
+    if (!strstr (line, "SCAN") && !strstr (line, "SEARCH"))
+        return TRUE;            /* subquery headers and such */
+    return strstr (line, "COVERING INDEX") || strstr (line, "PRIMARY KEY");
+}
+
+static gboolean
+explain_query (const char *name, const char *sql)
+{
+    gboolean mysql = (ccnet_db_type (org_db) == CCNET_DB_TYPE_MYSQL);
+    GString *plan = g_string_new (NULL);
+    char *explain, **lines, **line;
+    gboolean ok = TRUE;
+
+    explain = g_strconcat (mysql ? "EXPLAIN " : "EXPLAIN QUERY PLAN ",
+                           sql, NULL);
+    if (ccnet_db_foreach_selected_row (org_db, explain, collect_plan_cb,
+                                       plan) <= 0)
+        ok = FALSE;
+
+    lines = g_strsplit (plan->str, "\n", -1);
+    for (line = lines; ok && *line; ++line)
+        if (**line && !line_index_only (*line, mysql))
+            ok = FALSE;
+
+    printf ("{\"explain\": \"%s\", \"index_only\": %s}\n",
+            name, ok ? "true" : "false");
+    fflush (stdout);
+    if (!ok)
+        fprintf (stderr, "%s\n%s", sql, plan->str);
+
+    g_strfreev (lines);
+    g_free (explain);
+    g_string_free (plan, TRUE);
+    return ok;
+}
+
+/* The queries of org-mgr.c, with values from the dataset. */
+static gboolean
+check_org_plans (Dataset *ds)
+{
+    const char *email = "mgrbench-0@example.com";
+    int org_id = ds->org_ids[0];
+    gboolean ok = TRUE;
+    char *sql;
+
+    sql = g_strdup_printf ("SELECT t1.org_id, org_name, url_prefix,"
+                           " creator, ctime, is_staff FROM OrgUser t1,"
+                           " Organization t2 WHERE t1.org_id = t2.org_id"
+                           " AND email = '%s'", email);
+    ok = explain_query ("get_orgs_by_user", sql) && ok;
+    g_free (sql);
+
+    sql = g_strdup_printf ("SELECT email FROM OrgUser WHERE org_id ="
+                           " (SELECT org_id FROM Organization WHERE"
+                           " url_prefix = '" BENCH_ORG_FMT "')"
+                           " ORDER BY email LIMIT %d, %d", 0, 0, PAGE_SIZE);
+    ok = explain_query ("get_org_emailusers", sql) && ok;
+    g_free (sql);
+
+    sql = g_strdup_printf ("SELECT 1 FROM OrgUser WHERE org_id = %d"
+                           " AND email = '%s'", org_id, email);
+    ok = explain_query ("org_user_exists", sql) && ok;
+    g_free (sql);
+
+    sql = g_strdup_printf ("SELECT is_staff FROM OrgUser WHERE org_id=%d"
+                           " AND email='%s'", org_id, email);
+    ok = explain_query ("is_org_staff", sql) && ok;
+    g_free (sql);
+
+    sql = g_strdup_printf ("SELECT group_id FROM OrgGroup WHERE org_id = %d"
+                           " ORDER BY group_id", org_id);
+    ok = explain_query ("get_org_groups", sql) && ok;
+    g_free (sql);
+
+    sql = g_strdup_printf ("SELECT org_id FROM OrgGroup WHERE group_id = %d",
+                           10);
+    ok = explain_query ("get_org_id_by_group", sql) && ok;
+    g_free (sql);
+
+    return ok;
+}
+
+/* Driver */
+
+static int
+compare_usec (const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+run_bench (Bench *b, Dataset *ds, int min_ms)
+{
+    GRand *rand = g_rand_new_with_seed (ds->seed);
+    GArray *usecs = g_array_new (FALSE, FALSE, sizeof(gint64));
+    gint64 start = g_get_monotonic_time (), t, usec, end;
+    int errors = 0;
+    guint n;
+
+    end = start + (gint64)min_ms * 1000;
+    do {
+        t = g_get_monotonic_time ();
+        if (!b->func (ds, rand))
+            ++errors;
+        usec = g_get_monotonic_time () - t;
+        g_array_append_val (usecs, usec);
+    } while (t + usec < end || usecs->len < 10);
+    usec = g_get_monotonic_time () - start;
+
+    n = usecs->len;
+    qsort (usecs->data, n, sizeof(gint64), compare_usec);
+    printf ("{\"bench\": \"%s\", \"ops\": %u, \"ops_per_sec\": %.1f, "
+            "\"p50_us\": %" G_GINT64_FORMAT ", \"p99_us\": %" G_GINT64_FORMAT
+            ", \"max_us\": %" G_GINT64_FORMAT ", \"errors\": %d}\n",
+            b->name, n, n * 1e6 / usec,
+            g_array_index (usecs, gint64, n / 2),
+            g_array_index (usecs, gint64, MIN (n - 1, n * 99 / 100)),
+            g_array_index (usecs, gint64, n - 1), errors);
+    fflush (stdout);
+
+    g_array_free (usecs, TRUE);
+    g_rand_free (rand);
+}
+
+/* The db a manager uses: the session one with MySQL, else its own file,
+ * at the path the manager opens it from. */
+static CcnetDB *
+open_manager_db (const char *dir, const char *file)
+{
+    CcnetDB *db;
+    char *path;
+
+    if (ccnet_db_type (session->db) == CCNET_DB_TYPE_MYSQL)
+        return session->db;
+
+    path = g_build_filename (session->config_dir, dir, file, NULL);
+    db = ccnet_db_new_sqlite (path);
+    g_free (path);
+    return db;
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr, "Usage: %s -c conf-dir [-u users] [-g groups] "
+             "[-o orgs] [-m memberships] [-z exponent] [-S seed] [-t ms] "
+             "[-k] [-x] [pattern]\n", prog);
+}
+
+int
+main (int argc, char **argv)
+{
+    Dataset ds = { 10000, 1000, 100, 3, 1.0, 1 };
+    const char *config_dir = NULL, *pattern = NULL;
+    gboolean keep = FALSE, check_only = FALSE, plans_ok;
+    int min_ms = 2000;
+    char *log_file;
+    int c, i;
+
+    Bench benches[] = {
+        { "get_groupids_by_user", bench_get_groupids_by_user },
+        { "is_group_user", bench_is_group_user },
+        { "get_org_by_url_prefix", bench_get_org_by_url_prefix },
+        { "get_orgs_by_user", bench_get_orgs_by_user },
+        { "get_org_emailusers", bench_get_org_emailusers },
+        { "org_user_exists", bench_org_user_exists },
+        { "is_org_staff", bench_is_org_staff },
+        { "get_org_groups", bench_get_org_groups },
+        { "get_emailusers_page", bench_get_emailusers_page },
+        { "validate_emailuser", bench_validate_emailuser },
+    };
+
+    while ((c = getopt (argc, argv, "c:u:g:o:m:z:S:t:kx")) != -1) {
+        switch (c) {
+        case 'c':
+            config_dir = optarg;
+            break;
+        case 'u':
+            ds.n_users = atoi (optarg);
+            break;
+        case 'g':
+            ds.n_groups = atoi (optarg);
+            break;
+        case 'o':
+            ds.n_orgs = atoi (optarg);
+            break;
+        case 'm':
+            ds.memberships = atoi (optarg);
+            break;
+        case 'z':
+            ds.zipf_s = atof (optarg);
+            break;
+        case 'S':
+            ds.seed = strtoul (optarg, NULL, 10);
+            break;
+        case 't':
+            min_ms = atoi (optarg);
+            break;
+        case 'k':
+            keep = TRUE;
+            break;
+        case 'x':
+            check_only = TRUE;
+            break;
+        default:
+            usage (argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        pattern = argv[optind];
+    if (!config_dir || ds.n_users < 1 || ds.n_groups < 1 || ds.n_orgs < 1 ||
+        ds.memberships < 1) {
+        usage (argv[0]);
+        return 1;
+    }
+
+    g_type_init ();
+    config_dir = ccnet_expand_path (config_dir);
+    log_file = g_build_filename (config_dir, "mgrbench.log", NULL);
+    if (ccnet_log_init (log_file, "info") < 0) {
+        fprintf (stderr, "Failed to open %s\n", log_file);
+        return 1;
+    }
+
+    event_init ();
+    session = (CcnetSession *)ccnet_server_session_new ();
+    if (ccnet_session_prepare (session, config_dir) < 0) {
+        fprintf (stderr, "Failed to prepare the session, see %s\n", log_file);
+        return 1;
+    }
+    user_mgr = ((CcnetServerSession *)session)->user_mgr;
+    group_mgr = ((CcnetServerSession *)session)->group_mgr;
+    org_mgr = ((CcnetServerSession *)session)->org_mgr;
+
+    user_db = open_manager_db ("PeerMgr", "usermgr.db");
+    group_db = open_manager_db ("GroupMgr", "groupmgr.db");
+    org_db = open_manager_db ("OrgMgr", "orgmgr.db");
+    if (!user_db || !group_db || !org_db) {
+        fprintf (stderr, "Failed to open the databases, see %s\n", log_file);
+        return 1;
+    }
+
+    if (prepare_dataset (&ds, keep) < 0) {
+        fprintf (stderr, "Failed to prepare the dataset, see %s\n", log_file);
+        return 1;
+    }
+
+    plans_ok = check_org_plans (&ds);
+    if (check_only)
+        return plans_ok ? 0 : 1;
+
+    for (i = 0; i < G_N_ELEMENTS (benches); ++i) {
+        if (pattern && !strstr (benches[i].name, pattern))
+            continue;
+        run_bench (&benches[i], &ds, min_ms);
+    }
+
+    return plans_ok ? 0 : 1;
+}
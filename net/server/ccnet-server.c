@@ -85,7 +85,7 @@ on_ccnet_exit(void)
 }
 
 
-static const char *short_options = "hvdc:D:f:P:";
+static const char *short_options = "hvdc:D:f:P:T";
 static struct option long_options[] = {
     { "help", no_argument, NULL, 'h', }, 
     { "version", no_argument, NULL, 'v', }, 
@@ -94,6 +94,7 @@ static struct option long_options[] = {
     { "debug", required_argument, NULL, 'D' },
     { "daemon", no_argument, NULL, 'd' },
     { "pidfile", required_argument, NULL, 'P' },
+    { "takeover", no_argument, NULL, 'T' },
     { NULL, 0, NULL, 0, },
 };
 
@@ -117,7 +118,10 @@ static void usage()
 "    -f LOG_FILE\n"
 "        Log file path\n"
 "    -P PIDFILE\n"
-"        Specify the file to store pid\n",
+"        Specify the file to store pid\n"
+"    -T\n"
+"        Take the connections over from the running server, which\n"
+"        must have [Network] HANDOVER enabled\n",
         stdout);
 }
 
@@ -129,6 +133,7 @@ main (int argc, char **argv)
     char *log_file = 0;
     const char *debug_str = 0;
     int daemon_mode = 0;
+    int takeover = 0;
     const char *log_level_str = "debug";
 
     config_dir = DEFAULT_CONFIG_DIR;
@@ -159,6 +164,9 @@ main (int argc, char **argv)
         case 'P':
             pidfile = optarg;
             break;
+        case 'T':
+            takeover = 1;
+            break;
         default:
             fprintf (stderr, "unknown option \"-%c\"\n", (char)c);
             usage();
@@ -207,6 +215,7 @@ main (int argc, char **argv)
                "see log file for the detail.\n", stderr);
         return -1;
     }
+    session->takeover = takeover;
 
     event_init ();
     evdns_init ();
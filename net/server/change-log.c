@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "change-log.h"
+
+#define DEBUG_FLAG  CCNET_DEBUG_OTHER
+#include "log.h"
+
+#define DEFAULT_CHANGE_LOG_SIZE  10000
+#define MAX_CHANGES_PER_CALL     1000
+
+typedef struct Change {
+    const char *domain;         /* static */
+    const char *op;             /* static */
+    char       *key;            /* "<key>" or "<key> <arg>" */
+} Change;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static Change  *ring;
+static int      ring_size;
+static gint64   first_version;  /* of this run */
+static gint64   next_version;
+
+void
+ccnet_change_log_init (GKeyFile *keyf)
+{
+    int size = DEFAULT_CHANGE_LOG_SIZE;
+
+    if (g_key_file_has_key (keyf, "General", "CHANGE_LOG_SIZE", NULL))
+        size = g_key_file_get_integer (keyf, "General", "CHANGE_LOG_SIZE",
+                                       NULL);
+
+    first_version = next_version = (gint64)time(NULL) << 20;
+    if (size <= 0)
+        return;
+
+    ring_size = size;
+    ring = g_new0 (Change, ring_size);
+    ccnet_message ("[Change Log] Keeping the last %d changes from %"
+                   G_GINT64_FORMAT"\n", ring_size, first_version);
+}
+
+void
+ccnet_change_log_record (const char *domain, const char *op,
+                         const char *key, const char *arg)
+{
+    Change *change;
+
+    if (!ring || !key)
+        return;
+
+    pthread_mutex_lock (&log_lock);
+    change = &ring[next_version % ring_size];
+    g_free (change->key);
+    change->domain = domain;
+    change->op = op;
+    change->key = arg ? g_strconcat (key, " ", arg, NULL) : g_strdup (key);
+    next_version++;
+    pthread_mutex_unlock (&log_lock);
+}
+
+char *
+ccnet_change_log_get_since (gint64 since, int limit)
+{
+    GString *buf = g_string_new (NULL);
+    gint64 v, oldest, last;
+
+    if (limit <= 0 || limit > MAX_CHANGES_PER_CALL)
+        limit = MAX_CHANGES_PER_CALL;
+
+    pthread_mutex_lock (&log_lock);
+    last = next_version - 1;
+    oldest = MAX (first_version, next_version - ring_size);
+
+    /* Without a ring there is no telling what changed. */
+    if (!ring || since < oldest - 1 || since > last) {
+        g_string_append_printf (buf, "reset %"G_GINT64_FORMAT"\n", last);
+        pthread_mutex_unlock (&log_lock);
+        return g_string_free (buf, FALSE);
+    }
+
+    last = MIN (last, since + limit);
+    g_string_append_printf (buf, "%"G_GINT64_FORMAT"\n", last);
+    for (v = since + 1; v <= last; v++) {
+        Change *change = &ring[v % ring_size];
+        g_string_append_printf (buf, "%"G_GINT64_FORMAT" %s %s %s\n",
+                                v, change->domain, change->op, change->key);
+    }
+    pthread_mutex_unlock (&log_lock);
+
+    return g_string_free (buf, FALSE);
+}
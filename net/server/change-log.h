@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_CHANGE_LOG_H
+#define CCNET_CHANGE_LOG_H
+
+#include <glib.h>
+
+/*
+ * The last changes made to users, groups and orgs through this daemon,
+ * so that services caching them can ask what changed instead of loading
+ * everything again. Every change gets a version, one more than the one
+ * before. Versions of a run start at its start time << 20, so they grow
+ * across restarts too.
+ *
+ * The log is a ring in memory of [General] CHANGE_LOG_SIZE entries,
+ * 10000 by default, 0 to turn it off. Changes made by other daemons on
+ * the same database are not in it.
+ *
+ *   user         add, remove <email>     update <id>
+ *   group        create, remove <group id>
+ *   group-member add, remove, update <group id> <email>
+ *                remove <email> for all the groups of a user
+ *   org          create, remove <org id>
+ *   org-user     add, remove <org id> <email>
+ *   org-group    add, remove <org id> <group id>
+ */
+
+void ccnet_change_log_init (GKeyFile *keyf);
+
+/* May be called from any thread. @arg may be NULL. */
+void ccnet_change_log_record (const char *domain, const char *op,
+                              const char *key, const char *arg);
+
+/*
+ * At most @limit changes after @since, "<version> <domain> <op> <key>
+ * [<arg>]" a line, after a first line "<version>" with the version to
+ * ask from next time. The first line is "reset <version>" instead if
+ * changes after @since were dropped from the ring, or @since is from
+ * another run; the caller should load everything again and go on from
+ * that version.
+ */
+char *ccnet_change_log_get_since (gint64 since, int limit);
+
+#endif
@@ -2,17 +2,42 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include "server-session.h"
 
 #include "ccnet-db.h"
 #include "group-mgr.h"
 #include "org-mgr.h"
+#include "change-log.h"
 
 #include "utils.h"
 #include "log.h"
+#include "ccnetobj-codec.h"
+
+typedef struct {
+    int group_id;
+    int is_staff;
+} Membership;
+
+typedef struct {
+    int    count;
+    time_t expire;
+} MemberCount;
 
 struct _CcnetGroupManagerPriv {
     CcnetDB	*db;
+
+    /* Optional copy of GroupUser, see "Membership Index" below. */
+    gboolean          use_index;
+    gboolean          index_loaded;
+    pthread_rwlock_t  index_lock;
+    GHashTable       *user_groups;      /* user -> Membership array */
+    GHashTable       *group_members;    /* group id -> set of users */
+
+    /* See "Member Counts" below. */
+    pthread_mutex_t   count_lock;
+    GHashTable       *member_counts;    /* group id -> MemberCount */
 };
 
 static int open_db (CcnetGroupManager *manager);
@@ -31,6 +56,16 @@ CcnetGroupManager* ccnet_group_manager_new (CcnetSession *session)
 int
 ccnet_group_manager_prepare (CcnetGroupManager *manager)
 {
+    CcnetGroupManagerPriv *priv = manager->priv;
+
+    priv->use_index = g_key_file_get_boolean (manager->session->keyf,
+                                              "Group", "MEMBERSHIP_INDEX",
+                                              NULL);
+    pthread_rwlock_init (&priv->index_lock, NULL);
+    pthread_mutex_init (&priv->count_lock, NULL);
+    priv->member_counts = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                 NULL, g_free);
+
     return open_db(manager);
 }
 
@@ -85,10 +120,16 @@ open_db (CcnetGroupManager *manager)
 
 /* -------- Group Database Management ---------------- */
 
+/* Bump when the tables below change, so existing dbs are checked again. */
+#define GROUP_SCHEMA_VERSION 1
+
 static int check_db_table (CcnetDB *db)
 {
     char *sql;
 
+    if (ccnet_db_get_schema_version (db, "group") == GROUP_SCHEMA_VERSION)
+        return 0;
+
     int db_type = ccnet_db_type (db);
     if (db_type == CCNET_DB_TYPE_MYSQL) {
         sql = "CREATE TABLE IF NOT EXISTS `Group` (`group_id` INTEGER"
@@ -127,7 +168,470 @@ static int check_db_table (CcnetDB *db)
             return -1;
     }
 
-    return 0;
+    return ccnet_db_set_schema_version (db, "group", GROUP_SCHEMA_VERSION);
+}
+
+/* -------- Membership Index ---------------- */
+
+/*
+ * With [Group] MEMBERSHIP_INDEX enabled the whole GroupUser table is
+ * loaded on first use, and membership checks no longer go to the
+ * database. Each user maps to an array of its groups sorted by id, each
+ * group to the set of its members. Writes through this manager update
+ * the index after updating the table; since updates are idempotent, a
+ * write racing with the initial load is applied either way. The index
+ * assumes no other process writes GroupUser.
+ */
+
+static void
+free_membership_array (gpointer data)
+{
+    g_array_free ((GArray *)data, TRUE);
+}
+
+/* Position of @group_id in @groups, or -(insert position + 1). */
+static int
+membership_find (GArray *groups, int group_id)
+{
+    int lo = 0, hi = (int)groups->len - 1, mid, id;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        id = g_array_index (groups, Membership, mid).group_id;
+        if (id == group_id)
+            return mid;
+        if (id < group_id)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -(lo + 1);
+}
+
+static void
+index_add_locked (CcnetGroupManagerPriv *priv, int group_id,
+                  const char *user, int is_staff)
+{
+    GArray *groups;
+    GHashTable *members;
+    Membership m;
+    int pos;
+
+    groups = g_hash_table_lookup (priv->user_groups, user);
+    if (!groups) {
+        groups = g_array_new (FALSE, FALSE, sizeof(Membership));
+        g_hash_table_insert (priv->user_groups, g_strdup(user), groups);
+    }
+    pos = membership_find (groups, group_id);
+    if (pos >= 0) {
+        g_array_index (groups, Membership, pos).is_staff = is_staff;
+    } else {
+        m.group_id = group_id;
+        m.is_staff = is_staff;
+        g_array_insert_val (groups, -pos - 1, m);
+    }
+
+    members = g_hash_table_lookup (priv->group_members,
+                                   GINT_TO_POINTER(group_id));
+    if (!members) {
+        members = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, NULL);
+        g_hash_table_insert (priv->group_members,
+                             GINT_TO_POINTER(group_id), members);
+    }
+    g_hash_table_replace (members, g_strdup(user), NULL);
+}
+
+static void
+index_remove_locked (CcnetGroupManagerPriv *priv, int group_id,
+                     const char *user)
+{
+    GArray *groups;
+    GHashTable *members;
+    int pos;
+
+    groups = g_hash_table_lookup (priv->user_groups, user);
+    if (groups) {
+        pos = membership_find (groups, group_id);
+        if (pos >= 0)
+            g_array_remove_index (groups, pos);
+        if (groups->len == 0)
+            g_hash_table_remove (priv->user_groups, user);
+    }
+
+    members = g_hash_table_lookup (priv->group_members,
+                                   GINT_TO_POINTER(group_id));
+    if (members) {
+        g_hash_table_remove (members, user);
+        if (g_hash_table_size (members) == 0)
+            g_hash_table_remove (priv->group_members,
+                                 GINT_TO_POINTER(group_id));
+    }
+}
+
+static gboolean
+load_index_cb (CcnetDBRow *row, void *data)
+{
+    CcnetGroupManagerPriv *priv = data;
+    int group_id = ccnet_db_row_get_column_int (row, 0);
+    const char *user = ccnet_db_row_get_column_text (row, 1);
+    int is_staff = ccnet_db_row_get_column_int (row, 2);
+
+    if (user)
+        index_add_locked (priv, group_id, user, is_staff);
+    return TRUE;
+}
+
+/* Called with the write lock held. */
+static void
+load_index (CcnetGroupManager *mgr)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+
+    priv->user_groups = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, free_membership_array);
+    priv->group_members = g_hash_table_new_full (
+        g_direct_hash, g_direct_equal, NULL,
+        (GDestroyNotify)g_hash_table_destroy);
+
+    if (ccnet_db_foreach_selected_row (priv->db,
+                                       "SELECT `group_id`, `user_name`, "
+                                       "`is_staff` FROM `GroupUser`",
+                                       load_index_cb, priv) < 0) {
+        ccnet_warning ("Failed to load group membership index.
+");
+        g_hash_table_destroy (priv->user_groups);
+        g_hash_table_destroy (priv->group_members);
+        priv->user_groups = priv->group_members = NULL;
+        return;
+    }
+
+    ccnet_message ("Loaded memberships of %u users in %u groups.
+",
+                   g_hash_table_size (priv->user_groups),
+                   g_hash_table_size (priv->group_members));
+    priv->index_loaded = TRUE;
+}
+
+/*
+ * Take the read lock on the index, loading it first if needed. Returns
+ * FALSE without holding the lock if the index can't be used, in which
+ * case the caller falls back to the database.
+ */
+static gboolean
+index_read_lock (CcnetGroupManager *mgr)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+
+    if (!priv->use_index)
+        return FALSE;
+
+    pthread_rwlock_rdlock (&priv->index_lock);
+    if (priv->index_loaded)
+        return TRUE;
+    pthread_rwlock_unlock (&priv->index_lock);
+
+    pthread_rwlock_wrlock (&priv->index_lock);
+    if (!priv->index_loaded)
+        load_index (mgr);
+    pthread_rwlock_unlock (&priv->index_lock);
+
+    pthread_rwlock_rdlock (&priv->index_lock);
+    if (priv->index_loaded)
+        return TRUE;
+    pthread_rwlock_unlock (&priv->index_lock);
+    return FALSE;
+}
+
+static void
+index_unlock (CcnetGroupManager *mgr)
+{
+    pthread_rwlock_unlock (&mgr->priv->index_lock);
+}
+
+/* Update calls are no-ops until the index is loaded. */
+
+static void
+index_add (CcnetGroupManager *mgr, int group_id, const char *user,
+           int is_staff)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+
+    if (!priv->use_index)
+        return;
+    pthread_rwlock_wrlock (&priv->index_lock);
+    if (priv->index_loaded)
+        index_add_locked (priv, group_id, user, is_staff);
+    pthread_rwlock_unlock (&priv->index_lock);
+}
+
+static void
+index_remove (CcnetGroupManager *mgr, int group_id, const char *user)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+
+    if (!priv->use_index)
+        return;
+    pthread_rwlock_wrlock (&priv->index_lock);
+    if (priv->index_loaded)
+        index_remove_locked (priv, group_id, user);
+    pthread_rwlock_unlock (&priv->index_lock);
+}
+
+static void
+index_set_staff (CcnetGroupManager *mgr, int group_id, const char *user,
+                 int is_staff)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    GArray *groups;
+    int pos;
+
+    if (!priv->use_index)
+        return;
+    pthread_rwlock_wrlock (&priv->index_lock);
+    if (priv->index_loaded) {
+        groups = g_hash_table_lookup (priv->user_groups, user);
+        pos = groups ? membership_find (groups, group_id) : -1;
+        if (pos >= 0)
+            g_array_index (groups, Membership, pos).is_staff = is_staff;
+    }
+    pthread_rwlock_unlock (&priv->index_lock);
+}
+
+static void
+index_remove_group (CcnetGroupManager *mgr, int group_id)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    GHashTable *members;
+    GList *users, *ptr;
+
+    if (!priv->use_index)
+        return;
+    pthread_rwlock_wrlock (&priv->index_lock);
+    if (priv->index_loaded) {
+        members = g_hash_table_lookup (priv->group_members,
+                                       GINT_TO_POINTER(group_id));
+        if (members) {
+            /* Copy the names, index_remove_locked() destroys the set
+             * with its last member. */
+            users = g_hash_table_get_keys (members);
+            for (ptr = users; ptr; ptr = ptr->next)
+                ptr->data = g_strdup (ptr->data);
+            for (ptr = users; ptr; ptr = ptr->next) {
+                index_remove_locked (priv, group_id, ptr->data);
+                g_free (ptr->data);
+            }
+            g_list_free (users);
+        }
+    }
+    pthread_rwlock_unlock (&priv->index_lock);
+}
+
+static void
+index_remove_user (CcnetGroupManager *mgr, const char *user)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    GArray *groups;
+
+    if (!priv->use_index)
+        return;
+    pthread_rwlock_wrlock (&priv->index_lock);
+    if (priv->index_loaded) {
+        groups = g_hash_table_lookup (priv->user_groups, user);
+        while (groups && groups->len > 0) {
+            index_remove_locked (priv,
+                                 g_array_index (groups, Membership, 0).group_id,
+                                 user);
+            groups = g_hash_table_lookup (priv->user_groups, user);
+        }
+    }
+    pthread_rwlock_unlock (&priv->index_lock);
+}
+
+/* Returns -1 if not a member, otherwise the is_staff bit. Only valid
+ * with the read lock held. */
+static int
+index_lookup_locked (CcnetGroupManagerPriv *priv, int group_id,
+                     const char *user)
+{
+    GArray *groups;
+    int pos;
+
+    groups = g_hash_table_lookup (priv->user_groups, user);
+    if (!groups)
+        return -1;
+    pos = membership_find (groups, group_id);
+    if (pos < 0)
+        return -1;
+    return g_array_index (groups, Membership, pos).is_staff;
+}
+
+/* -------- Member Counts ---------------- */
+
+/*
+ * Counting the members of a group no longer lists them. With the
+ * membership index the count is the size of the member set. Otherwise
+ * counts are kept per group, adjusted by the writes through this
+ * manager and recounted after MEMBER_COUNT_TTL seconds, since other
+ * nodes may write GroupUser too.
+ */
+
+#define MEMBER_COUNT_TTL            300
+#define MEMBER_COUNT_MAX_ENTRIES    10000
+
+static void
+count_adjust (CcnetGroupManager *mgr, int group_id, int delta)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    MemberCount *mc;
+
+    pthread_mutex_lock (&priv->count_lock);
+    mc = g_hash_table_lookup (priv->member_counts, GINT_TO_POINTER(group_id));
+    if (mc)
+        mc->count = MAX (mc->count + delta, 0);
+    pthread_mutex_unlock (&priv->count_lock);
+}
+
+/* Drop the count of @group_id, or all of them if it's -1. */
+static void
+count_forget (CcnetGroupManager *mgr, int group_id)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+
+    pthread_mutex_lock (&priv->count_lock);
+    if (group_id < 0)
+        g_hash_table_remove_all (priv->member_counts);
+    else
+        g_hash_table_remove (priv->member_counts, GINT_TO_POINTER(group_id));
+    pthread_mutex_unlock (&priv->count_lock);
+}
+
+int
+ccnet_group_manager_count_group_members (CcnetGroupManager *mgr,
+                                         int group_id)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    GHashTable *members;
+    MemberCount *mc;
+    time_t now = time(NULL);
+    int count = -1;
+
+    if (index_read_lock (mgr)) {
+        members = g_hash_table_lookup (priv->group_members,
+                                       GINT_TO_POINTER(group_id));
+        count = members ? (int)g_hash_table_size (members) : 0;
+        index_unlock (mgr);
+        return count;
+    }
+
+    pthread_mutex_lock (&priv->count_lock);
+    mc = g_hash_table_lookup (priv->member_counts, GINT_TO_POINTER(group_id));
+    if (mc && mc->expire > now)
+        count = mc->count;
+    pthread_mutex_unlock (&priv->count_lock);
+    if (count >= 0)
+        return count;
+
+    count = ccnet_db_statement_get_int (priv->db, "SELECT COUNT(*) FROM "
+                                        "`GroupUser` WHERE `group_id`=?",
+                                        1, "int", group_id);
+    if (count < 0)
+        return -1;
+
+    mc = g_new0 (MemberCount, 1);
+    mc->count = count;
+    mc->expire = now + MEMBER_COUNT_TTL;
+    pthread_mutex_lock (&priv->count_lock);
+    if (g_hash_table_size (priv->member_counts) >= MEMBER_COUNT_MAX_ENTRIES)
+        g_hash_table_remove_all (priv->member_counts);
+    g_hash_table_replace (priv->member_counts, GINT_TO_POINTER(group_id), mc);
+    pthread_mutex_unlock (&priv->count_lock);
+
+    return count;
+}
+
+static gboolean
+preload_count_cb (CcnetDBRow *row, void *data)
+{
+    GArray *counts = data;
+    int pair[2];
+
+    pair[0] = ccnet_db_row_get_column_int (row, 0);
+    pair[1] = ccnet_db_row_get_column_int (row, 1);
+    g_array_append_vals (counts, pair, 2);
+    return TRUE;
+}
+
+/*
+ * Without the index, the counts of the newest groups, which are the
+ * likeliest to be in use. Counts already there are newer and kept.
+ */
+static int
+preload_counts (CcnetGroupManager *mgr)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    GArray *counts;
+    MemberCount *mc;
+    char sql[256];
+    time_t expire = time(NULL) + MEMBER_COUNT_TTL;
+    guint i;
+    int n = 0;
+
+    counts = g_array_new (FALSE, FALSE, sizeof(int));
+    snprintf (sql, sizeof(sql), "SELECT `group_id`, COUNT(*) FROM `GroupUser`"
+              " GROUP BY `group_id` ORDER BY `group_id` DESC LIMIT %d",
+              MEMBER_COUNT_MAX_ENTRIES / 2);
+    if (ccnet_db_foreach_selected_row (priv->db, sql, preload_count_cb,
+                                       counts) < 0) {
+        g_array_free (counts, TRUE);
+        return -1;
+    }
+
+    pthread_mutex_lock (&priv->count_lock);
+    for (i = 0; i + 1 < counts->len; i += 2) {
+        int group_id = g_array_index (counts, int, i);
+
+        if (g_hash_table_lookup (priv->member_counts,
+                                 GINT_TO_POINTER(group_id)))
+            continue;
+        mc = g_new0 (MemberCount, 1);
+        mc->count = g_array_index (counts, int, i + 1);
+        mc->expire = expire;
+        g_hash_table_insert (priv->member_counts, GINT_TO_POINTER(group_id),
+                             mc);
+        ++n;
+    }
+    pthread_mutex_unlock (&priv->count_lock);
+
+    g_array_free (counts, TRUE);
+    return n;
+}
+
+int
+ccnet_group_manager_preload (CcnetGroupManager *mgr)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    int n;
+
+    if (!priv->use_index)
+        return preload_counts (mgr);
+
+    if (!index_read_lock (mgr))
+        return -1;
+    n = g_hash_table_size (priv->user_groups);
+    index_unlock (mgr);
+    return n;
+}
+
+/* See change-log.h */
+static void
+log_group_change (const char *domain, const char *op, int group_id,
+                  const char *user)
+{
+    char buf[16];
+
+    snprintf (buf, sizeof(buf), "%d", group_id);
+    ccnet_change_log_record (domain, op, buf, user);
 }
 
 static int
@@ -167,6 +671,9 @@ create_group_common (CcnetGroupManager *mgr,
         g_set_error (error, CCNET_DOMAIN, 0, "Failed to create group");
         return -1;
     }
+    index_add (mgr, group_id, user_name, 1);
+    count_forget (mgr, group_id);
+    log_group_change ("group", "create", group_id, NULL);
     
     return group_id;
 }
@@ -283,9 +790,17 @@ int ccnet_group_manager_create_org_group (CcnetGroupManager *mgr,
 }
 
 static gboolean
-check_group_staff (CcnetDB *db, int group_id, const char *user_name)
+check_group_staff (CcnetGroupManager *mgr, int group_id, const char *user_name)
 {
+    CcnetDB *db = mgr->priv->db;
     char sql[512];
+    gboolean ret;
+
+    if (index_read_lock (mgr)) {
+        ret = (index_lookup_locked (mgr->priv, group_id, user_name) == 1);
+        index_unlock (mgr);
+        return ret;
+    }
 
     snprintf (sql, sizeof(sql), "SELECT `group_id` FROM `GroupUser` WHERE "
               "`group_id` = %d AND `user_name` = '%s' AND `is_staff` = 1",
@@ -313,6 +828,9 @@ int ccnet_group_manager_remove_group (CcnetGroupManager *mgr,
     snprintf (sql, sizeof(sql), "DELETE FROM `GroupUser` WHERE `group_id`=%d",
               group_id);
     ccnet_db_query (db, sql);
+    index_remove_group (mgr, group_id);
+    count_forget (mgr, group_id);
+    log_group_change ("group", "remove", group_id, NULL);
     
     return 0;
 }
@@ -338,7 +856,7 @@ int ccnet_group_manager_add_member (CcnetGroupManager *mgr,
     char sql[512];
 
     /* check whether user is the staff of the group */
-    if (!check_group_staff (db, group_id, user_name)) {
+    if (!check_group_staff (mgr, group_id, user_name)) {
         g_set_error (error, CCNET_DOMAIN, 0,
                      "Permission error: only group staff can add member");
         return -1; 
@@ -365,6 +883,9 @@ int ccnet_group_manager_add_member (CcnetGroupManager *mgr,
         g_set_error (error, CCNET_DOMAIN, 0, "Failed to add member to group");
         return -1;
     }
+    index_add (mgr, group_id, member_name, 0);
+    count_adjust (mgr, group_id, 1);
+    log_group_change ("group-member", "add", group_id, member_name);
 
     return 0;
 }
@@ -377,9 +898,10 @@ int ccnet_group_manager_remove_member (CcnetGroupManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[512];
+    gint64 changes;
 
     /* check whether user is the staff of the group */
-    if (!check_group_staff (db, group_id, user_name)) {
+    if (!check_group_staff (mgr, group_id, user_name)) {
         g_set_error (error, CCNET_DOMAIN, 0,
                      "Only group staff can remove member");
         return -1; 
@@ -399,11 +921,233 @@ int ccnet_group_manager_remove_member (CcnetGroupManager *mgr,
 
     snprintf (sql, sizeof(sql), "DELETE FROM `GroupUser` WHERE `group_id`=%d AND "
               "`user_name`='%s'", group_id, member_name);
-    ccnet_db_query (db, sql);
+    changes = ccnet_db_query_changes (db, sql);
+    if (changes >= 0)
+        index_remove (mgr, group_id, member_name);
+    if (changes > 0) {
+        count_adjust (mgr, group_id, -changes);
+        log_group_change ("group-member", "remove", group_id, member_name);
+    }
 
     return 0;
 }
 
+/* -------- Bulk membership changes ---------------- */
+
+#define BULK_ROWS_PER_QUERY 100
+
+static gboolean
+collect_member_cb (CcnetDBRow *row, void *data)
+{
+    GHashTable *members = data;
+    const char *user = ccnet_db_row_get_column_text (row, 0);
+
+    if (user)
+        g_hash_table_replace (members, g_strdup(user), NULL);
+    return TRUE;
+}
+
+static GHashTable *
+get_member_set (CcnetDB *db, int group_id)
+{
+    GHashTable *members;
+
+    members = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    if (ccnet_db_statement_foreach_row (db, "SELECT `user_name` FROM "
+                                        "`GroupUser` WHERE `group_id`=?",
+                                        collect_member_cb, members,
+                                        1, "int", group_id) < 0) {
+        g_hash_table_destroy (members);
+        return NULL;
+    }
+    return members;
+}
+
+/*
+ * Insert or delete the members marked GROUP_MEMBER_OK, up to
+ * BULK_ROWS_PER_QUERY of them per statement.
+ */
+static int
+bulk_execute (CcnetDBTrans *trans, int group_id, char **members,
+              int *results, int n, gboolean add)
+{
+    GString *sql = g_string_new (NULL);
+    char *params[BULK_ROWS_PER_QUERY];
+    int i, j, n_params = 0;
+
+    for (i = 0; i <= n; i++) {
+        if (i < n && results[i] == GROUP_MEMBER_OK)
+            params[n_params++] = members[i];
+        if (n_params < BULK_ROWS_PER_QUERY && !(i == n && n_params > 0))
+            continue;
+
+        if (add) {
+            g_string_assign (sql, "INSERT INTO `GroupUser` VALUES ");
+            for (j = 0; j < n_params; j++)
+                g_string_append_printf (sql, "%s(%d, ?, 0)",
+                                        j ? ", " : "", group_id);
+        } else {
+            g_string_printf (sql, "DELETE FROM `GroupUser` WHERE "
+                             "`group_id`=%d AND `user_name` IN (", group_id);
+            for (j = 0; j < n_params; j++)
+                g_string_append (sql, j ? ", ?" : "?");
+            g_string_append (sql, ")");
+        }
+
+        if (ccnet_db_trans_query_strv (trans, sql->str, params, n_params) < 0) {
+            g_string_free (sql, TRUE);
+            return -1;
+        }
+        n_params = 0;
+    }
+
+    g_string_free (sql, TRUE);
+    return 0;
+}
+
+/* Run the changes marked in @results in one transaction. */
+static int
+bulk_commit (CcnetGroupManager *mgr, int group_id, char **members,
+             int *results, int n, gboolean add, GError **error)
+{
+    CcnetDBTrans *trans;
+    int i, n_done = 0;
+
+    trans = ccnet_db_begin_transaction (mgr->priv->db);
+    if (trans && bulk_execute (trans, group_id, members, results, n, add) < 0) {
+        ccnet_db_rollback (trans);
+        trans = NULL;
+    }
+    if (!trans || ccnet_db_commit (trans) < 0) {
+        for (i = 0; i < n; i++)
+            if (results[i] == GROUP_MEMBER_OK)
+                results[i] = GROUP_MEMBER_FAILED;
+        g_set_error (error, CCNET_DOMAIN, 0, "Failed to update group members");
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (results[i] != GROUP_MEMBER_OK)
+            continue;
+        if (add)
+            index_add (mgr, group_id, members[i], 0);
+        else
+            index_remove (mgr, group_id, members[i]);
+        log_group_change ("group-member", add ? "add" : "remove",
+                          group_id, members[i]);
+        ++n_done;
+    }
+    count_adjust (mgr, group_id, add ? n_done : -n_done);
+    return 0;
+}
+
+static int
+bulk_check_group (CcnetGroupManager *mgr, int group_id,
+                  const char *user_name, GError **error)
+{
+    if (!check_group_staff (mgr, group_id, user_name)) {
+        g_set_error (error, CCNET_DOMAIN, 0,
+                     "Permission error: only group staff can change members");
+        return -1;
+    }
+    if (!check_group_exists (mgr->priv->db, group_id)) {
+        g_set_error (error, CCNET_DOMAIN, 0, "Group not exists");
+        return -1;
+    }
+    return 0;
+}
+
+int
+ccnet_group_manager_add_members (CcnetGroupManager *mgr,
+                                 int group_id,
+                                 const char *user_name,
+                                 char **members,
+                                 int n_members,
+                                 int *results,
+                                 GError **error)
+{
+    GHashTable *current;
+    int i, n_ok = 0;
+
+    for (i = 0; i < n_members; i++)
+        results[i] = GROUP_MEMBER_FAILED;
+
+    if (bulk_check_group (mgr, group_id, user_name, error) < 0)
+        return -1;
+
+    current = get_member_set (mgr->priv->db, group_id);
+    if (!current) {
+        g_set_error (error, CCNET_DOMAIN, 0, "Failed to get group members");
+        return -1;
+    }
+
+    for (i = 0; i < n_members; i++) {
+        if (!members[i] || members[i][0] == '\0')
+            continue;
+        if (g_hash_table_lookup_extended (current, members[i], NULL, NULL)) {
+            results[i] = GROUP_MEMBER_SKIPPED;
+            continue;
+        }
+        /* also skips duplicates in @members */
+        g_hash_table_replace (current, g_strdup(members[i]), NULL);
+        results[i] = GROUP_MEMBER_OK;
+        ++n_ok;
+    }
+    g_hash_table_destroy (current);
+
+    if (n_ok > 0 &&
+        bulk_commit (mgr, group_id, members, results, n_members,
+                     TRUE, error) < 0)
+        return -1;
+
+    return n_ok;
+}
+
+int
+ccnet_group_manager_remove_members (CcnetGroupManager *mgr,
+                                    int group_id,
+                                    const char *user_name,
+                                    char **members,
+                                    int n_members,
+                                    int *results,
+                                    GError **error)
+{
+    GHashTable *current;
+    int i, n_ok = 0;
+
+    for (i = 0; i < n_members; i++)
+        results[i] = GROUP_MEMBER_FAILED;
+
+    if (bulk_check_group (mgr, group_id, user_name, error) < 0)
+        return -1;
+
+    current = get_member_set (mgr->priv->db, group_id);
+    if (!current) {
+        g_set_error (error, CCNET_DOMAIN, 0, "Failed to get group members");
+        return -1;
+    }
+
+    for (i = 0; i < n_members; i++) {
+        /* can not remove myself */
+        if (!members[i] || g_strcmp0 (members[i], user_name) == 0)
+            continue;
+        if (!g_hash_table_remove (current, members[i])) {
+            results[i] = GROUP_MEMBER_SKIPPED;
+            continue;
+        }
+        results[i] = GROUP_MEMBER_OK;
+        ++n_ok;
+    }
+    g_hash_table_destroy (current);
+
+    if (n_ok > 0 &&
+        bulk_commit (mgr, group_id, members, results, n_members,
+                     FALSE, error) < 0)
+        return -1;
+
+    return n_ok;
+}
+
 int ccnet_group_manager_set_admin (CcnetGroupManager *mgr,
                                    int group_id,
                                    const char *member_name,
@@ -415,7 +1159,10 @@ int ccnet_group_manager_set_admin (CcnetGroupManager *mgr,
     snprintf (sql, sizeof(sql), "UPDATE `GroupUser` SET `is_staff` = 1 "
               "WHERE `group_id` = %d and `user_name` = '%s'",
               group_id, member_name);
-    ccnet_db_query (db, sql);
+    if (ccnet_db_query (db, sql) == 0) {
+        index_set_staff (mgr, group_id, member_name, 1);
+        log_group_change ("group-member", "update", group_id, member_name);
+    }
 
     return 0;
 }
@@ -431,7 +1178,10 @@ int ccnet_group_manager_unset_admin (CcnetGroupManager *mgr,
     snprintf (sql, sizeof(sql), "UPDATE `GroupUser` SET `is_staff` = 0 "
               "WHERE `group_id` = %d and `user_name` = '%s'",
               group_id, member_name);
-    ccnet_db_query (db, sql);
+    if (ccnet_db_query (db, sql) == 0) {
+        index_set_staff (mgr, group_id, member_name, 0);
+        log_group_change ("group-member", "update", group_id, member_name);
+    }
 
     return 0;
 }
@@ -443,9 +1193,10 @@ int ccnet_group_manager_quit_group (CcnetGroupManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[512];
+    gint64 changes;
     
     /* check where user is the staff of the group */
-    if (check_group_staff (db, group_id, user_name)) {
+    if (check_group_staff (mgr, group_id, user_name)) {
         g_set_error (error, CCNET_DOMAIN, 0,
                      "Group staff can not quit group");
         return -1; 
@@ -459,7 +1210,13 @@ int ccnet_group_manager_quit_group (CcnetGroupManager *mgr,
     
     snprintf (sql, sizeof(sql), "DELETE FROM `GroupUser` WHERE `group_id`=%d "
               "AND `user_name`='%s'", group_id, user_name);
-    ccnet_db_query (db, sql);
+    changes = ccnet_db_query_changes (db, sql);
+    if (changes >= 0)
+        index_remove (mgr, group_id, user_name);
+    if (changes > 0) {
+        count_adjust (mgr, group_id, -changes);
+        log_group_change ("group-member", "remove", group_id, user_name);
+    }
 
     return 0;
 }
@@ -482,14 +1239,24 @@ ccnet_group_manager_get_groupids_by_user (CcnetGroupManager *mgr,
                                           GError **error)
 {
     CcnetDB *db = mgr->priv->db;
-    char sql[512];
     GList *group_ids = NULL;
+    GArray *groups;
+    int i;
+
+    if (index_read_lock (mgr)) {
+        groups = g_hash_table_lookup (mgr->priv->user_groups, user_name);
+        for (i = groups ? (int)groups->len - 1 : -1; i >= 0; --i)
+            group_ids = g_list_prepend (
+                group_ids,
+                (gpointer)(long)g_array_index (groups, Membership, i).group_id);
+        index_unlock (mgr);
+        return group_ids;
+    }
 
-    snprintf (sql, sizeof(sql), "SELECT `group_id` FROM `GroupUser` "
-              "WHERE `user_name`='%s'", user_name);
-
-    if (ccnet_db_foreach_selected_row (db, sql, get_group_ids_cb,
-                                       &group_ids) < 0) {
+    if (ccnet_db_statement_foreach_row (db, "SELECT `group_id` FROM `GroupUser` "
+                                        "WHERE `user_name`=?",
+                                        get_group_ids_cb, &group_ids,
+                                        1, "string", user_name) < 0) {
         g_list_free (group_ids);
         return NULL;
     }
@@ -497,6 +1264,74 @@ ccnet_group_manager_get_groupids_by_user (CcnetGroupManager *mgr,
     return g_list_reverse (group_ids);
 }
 
+static gboolean
+get_group_users_cb (CcnetDBRow *row, void *data)
+{
+    GList **plist = data;
+    CcnetGroupUser *group_user;
+
+    group_user = g_object_new (CCNET_TYPE_GROUP_USER,
+                               "group_id", ccnet_db_row_get_column_int (row, 0),
+                               "user_name", ccnet_db_row_get_column_text (row, 1),
+                               "is_staff", ccnet_db_row_get_column_int (row, 2),
+                               NULL);
+    *plist = g_list_prepend (*plist, group_user);
+
+    return TRUE;
+}
+
+GList *
+ccnet_group_manager_get_group_users_by_users (CcnetGroupManager *mgr,
+                                              char **users,
+                                              int n_users,
+                                              GError **error)
+{
+    GList *ret = NULL;
+    GArray *groups;
+    GString *sql;
+    int i, j, n;
+
+    if (index_read_lock (mgr)) {
+        for (i = 0; i < n_users; i++) {
+            groups = g_hash_table_lookup (mgr->priv->user_groups, users[i]);
+            for (j = 0; groups && j < (int)groups->len; j++) {
+                Membership *m = &g_array_index (groups, Membership, j);
+                ret = g_list_prepend (ret, g_object_new (CCNET_TYPE_GROUP_USER,
+                                                         "group_id", m->group_id,
+                                                         "user_name", users[i],
+                                                         "is_staff", m->is_staff,
+                                                         NULL));
+            }
+        }
+        index_unlock (mgr);
+        return g_list_reverse (ret);
+    }
+
+    sql = g_string_new (NULL);
+    for (i = 0; i < n_users; i += n) {
+        n = MIN (n_users - i, BULK_ROWS_PER_QUERY);
+        g_string_assign (sql, "SELECT `group_id`, `user_name`, `is_staff` "
+                         "FROM `GroupUser` WHERE `user_name` IN (");
+        for (j = 0; j < n; j++)
+            g_string_append (sql, j ? ", ?" : "?");
+        g_string_append (sql, ")");
+
+        if (ccnet_db_statement_foreach_row_strv (mgr->priv->db, sql->str,
+                                                 get_group_users_cb, &ret,
+                                                 users + i, n) < 0) {
+            g_set_error (error, CCNET_DOMAIN, 0, "Failed to get groups");
+            while (ret) {
+                g_object_unref (ret->data);
+                ret = g_list_delete_link (ret, ret);
+            }
+            break;
+        }
+    }
+    g_string_free (sql, TRUE);
+
+    return g_list_reverse (ret);
+}
+
 static gboolean
 get_ccnetgroup_cb (CcnetDBRow *row, void *data)
 {
@@ -577,12 +1412,45 @@ ccnet_group_manager_get_group_members (CcnetGroupManager *mgr, int group_id,
     return g_list_reverse (group_users);
 }
 
+static gboolean
+get_groupuser_recs_cb (CcnetDBRow *row, void *data)
+{
+    GArray *recs = data;
+    CcnetGroupUserRec rec;
+
+    rec.group_id = ccnet_db_row_get_column_int (row, 0);
+    rec.user_name = g_strdup (ccnet_db_row_get_column_text (row, 1));
+    rec.is_staff = ccnet_db_row_get_column_int (row, 2);
+    g_array_append_val (recs, rec);
+
+    return TRUE;
+}
+
+GArray *
+ccnet_group_manager_get_group_member_recs (CcnetGroupManager *mgr,
+                                           int group_id, GError **error)
+{
+    CcnetDB *db = mgr->priv->db;
+    GArray *recs = g_array_new (FALSE, FALSE, sizeof(CcnetGroupUserRec));
+    char sql[512];
+
+    snprintf (sql, sizeof(sql),
+              "SELECT * FROM `GroupUser` WHERE `group_id` = %d", group_id);
+    if (ccnet_db_foreach_selected_row (db, sql, get_groupuser_recs_cb,
+                                       recs) < 0) {
+        ccnet_group_user_rec_array_free (recs);
+        return NULL;
+    }
+
+    return recs;
+}
+
 int
 ccnet_group_manager_check_group_staff (CcnetGroupManager *mgr,
                                        int group_id,
                                        const char *user_name)
 {
-    return check_group_staff (mgr->priv->db, group_id, user_name);
+    return check_group_staff (mgr, group_id, user_name);
 }
 
 int
@@ -594,7 +1462,13 @@ ccnet_group_manager_remove_group_user (CcnetGroupManager *mgr,
 
     snprintf (sql, sizeof(sql), "DELETE FROM `GroupUser` "
               "WHERE `user_name` = '%s'", user);
-    return ccnet_db_query (db, sql);
+    if (ccnet_db_query (db, sql) < 0)
+        return -1;
+    index_remove_user (mgr, user);
+    /* The groups of @user aren't known here. */
+    count_forget (mgr, -1);
+    ccnet_change_log_record ("group-member", "remove", user, NULL);
+    return 0;
 }
 
 int
@@ -604,6 +1478,13 @@ ccnet_group_manager_is_group_user (CcnetGroupManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[512];
+    int ret;
+
+    if (index_read_lock (mgr)) {
+        ret = (index_lookup_locked (mgr->priv, group_id, user) >= 0);
+        index_unlock (mgr);
+        return ret;
+    }
 
     snprintf (sql, sizeof(sql), "SELECT group_id FROM `GroupUser` "
               "WHERE `group_id`=%d AND `user_name`='%s'", group_id, user);
@@ -636,21 +1517,46 @@ get_all_ccnetgroups_cb (CcnetDBRow *row, void *data)
     return TRUE;
 }
 
-GList*
-ccnet_group_manager_get_all_groups (CcnetGroupManager *mgr,
-                                    int start, int limit, GError **error)
+static void
+all_groups_sql (char *sql, size_t size, int start, int limit)
 {
-    GList *ret = NULL;
-    char sql[256];
-
     if (start == -1 && limit == -1) {
-        snprintf (sql, sizeof(sql), "SELECT group_id, group_name, "
+        snprintf (sql, size, "SELECT group_id, group_name, "
                   "creator_name, timestamp FROM `Group`");
     } else {
-        snprintf (sql, sizeof(sql), "SELECT group_id, group_name, "
+        snprintf (sql, size, "SELECT group_id, group_name, "
                   "creator_name, timestamp FROM `Group` LIMIT %d, %d",
                   start, limit);
     }
+}
+
+CcnetDBCursor *
+ccnet_group_manager_open_all_groups (CcnetGroupManager *mgr,
+                                     int start, int limit)
+{
+    char sql[256];
+
+    all_groups_sql (sql, sizeof(sql), start, limit);
+    return ccnet_db_cursor_open (mgr->priv->db, sql);
+}
+
+void
+ccnet_group_manager_group_rec_from_row (CcnetDBRow *row, CcnetGroupRec *rec)
+{
+    rec->id = ccnet_db_row_get_column_int (row, 0);
+    rec->group_name = g_strdup (ccnet_db_row_get_column_text (row, 1));
+    rec->creator_name = g_strdup (ccnet_db_row_get_column_text (row, 2));
+    rec->timestamp = ccnet_db_row_get_column_int64 (row, 3);
+}
+
+GList*
+ccnet_group_manager_get_all_groups (CcnetGroupManager *mgr,
+                                    int start, int limit, GError **error)
+{
+    GList *ret = NULL;
+    char sql[256];
+
+    all_groups_sql (sql, sizeof(sql), start, limit);
 
     if (ccnet_db_foreach_selected_row (mgr->priv->db, sql,
                                        get_all_ccnetgroups_cb, &ret) < 0) 
@@ -658,3 +1564,27 @@ ccnet_group_manager_get_all_groups (CcnetGroupManager *mgr,
 
     return g_list_reverse (ret);
 }
+
+GList*
+ccnet_group_manager_get_all_groups_after (CcnetGroupManager *mgr,
+                                          int last_id, int limit,
+                                          GError **error)
+{
+    GList *ret = NULL;
+
+    if (ccnet_db_statement_foreach_row (mgr->priv->db,
+                                        "SELECT group_id, group_name, "
+                                        "creator_name, timestamp FROM `Group` "
+                                        "WHERE group_id > ? "
+                                        "ORDER BY group_id LIMIT ?",
+                                        get_all_ccnetgroups_cb, &ret,
+                                        2, "int", last_id, "int", limit) < 0) {
+        while (ret != NULL) {
+            g_object_unref (ret->data);
+            ret = g_list_delete_link (ret, ret);
+        }
+        return NULL;
+    }
+
+    return g_list_reverse (ret);
+}
@@ -52,6 +52,34 @@ int ccnet_group_manager_remove_member (CcnetGroupManager *mgr,
                                        const char *member_name,
                                        GError **error);
 
+enum {
+    GROUP_MEMBER_FAILED = -1,
+    GROUP_MEMBER_OK = 0,
+    GROUP_MEMBER_SKIPPED,       /* already (or not) a member */
+};
+
+/*
+ * Add or remove @n_members members in one transaction. @results gets
+ * one GROUP_MEMBER_XXX per member. Returns the number of members added
+ * or removed, or -1 if the group can't be changed or the transaction
+ * failed; nothing is changed in that case.
+ */
+int ccnet_group_manager_add_members (CcnetGroupManager *mgr,
+                                     int group_id,
+                                     const char *user_name,
+                                     char **members,
+                                     int n_members,
+                                     int *results,
+                                     GError **error);
+
+int ccnet_group_manager_remove_members (CcnetGroupManager *mgr,
+                                        int group_id,
+                                        const char *user_name,
+                                        char **members,
+                                        int n_members,
+                                        int *results,
+                                        GError **error);
+
 int ccnet_group_manager_set_admin (CcnetGroupManager *mgr,
                                    int group_id,
                                    const char *member_name,
@@ -67,6 +95,13 @@ int ccnet_group_manager_quit_group (CcnetGroupManager *mgr,
                                     const char *user_name,
                                     GError **error);
 
+/* Memberships of several users at once, as CcnetGroupUser objects. */
+GList *
+ccnet_group_manager_get_group_users_by_users (CcnetGroupManager *mgr,
+                                              char **users,
+                                              int n_users,
+                                              GError **error);
+
 GList *
 ccnet_group_manager_get_groupids_by_user (CcnetGroupManager *mgr,
                                           const char *user_name,
@@ -80,6 +115,36 @@ GList *
 ccnet_group_manager_get_group_members (CcnetGroupManager *mgr, int group_id,
                                        GError **error);
 
+/* The members as a GArray of CcnetGroupUserRec, see
+ * ccnet_group_user_rec_array_free(). */
+GArray *
+ccnet_group_manager_get_group_member_recs (CcnetGroupManager *mgr,
+                                           int group_id, GError **error);
+
+/* Returns -1 on error. */
+int
+ccnet_group_manager_count_group_members (CcnetGroupManager *mgr,
+                                         int group_id);
+
+/* For the startup preload: load the membership index, or without it
+ * the member counts of the newest groups. Returns the number of users
+ * or groups loaded, -1 on error. Any thread. */
+int
+ccnet_group_manager_preload (CcnetGroupManager *mgr);
+
+struct CcnetDBCursor;
+struct CcnetDBRow;
+struct CcnetGroupRec;
+
+/* The rows of get_all_groups one at a time, for large listings. */
+struct CcnetDBCursor *
+ccnet_group_manager_open_all_groups (CcnetGroupManager *mgr,
+                                     int start, int limit);
+
+void
+ccnet_group_manager_group_rec_from_row (struct CcnetDBRow *row,
+                                        struct CcnetGroupRec *rec);
+
 int
 ccnet_group_manager_check_group_staff (CcnetGroupManager *mgr,
                                        int group_id,
@@ -98,5 +163,12 @@ GList*
 ccnet_group_manager_get_all_groups (CcnetGroupManager *mgr,
                                     int start, int limit, GError **error);
 
+/* Groups with id greater than @last_id, see
+ * ccnet_user_manager_get_emailusers_after(). */
+GList*
+ccnet_group_manager_get_all_groups_after (CcnetGroupManager *mgr,
+                                          int last_id, int limit,
+                                          GError **error);
+
 #endif /* GROUP_MGR_H */
 
@@ -0,0 +1,1162 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#ifdef HAVE_LDAP
+
+#include <event.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define LDAP_DEPRECATED 1
+#include <ldap.h>
+
+#include "utils.h"
+#include "ldap-async.h"
+
+#define DEBUG_FLAG  CCNET_DEBUG_PEER
+#include "log.h"
+
+#define LDAP_CONNECT_TIMEOUT    5       /* opening is done in the loop */
+#define LDAP_OP_TIMEOUT         30
+#define SEARCH_CONN_BUSY        16      /* open another one beyond this */
+#define LDAP_PAGE_SIZE          500     /* below AD's MaxPageSize */
+#define LDAP_CURSOR_TTL         60
+
+typedef enum {
+    OP_SEARCH,
+    OP_VERIFY,
+    OP_LIST,
+} OpType;
+
+typedef struct LdapConn LdapConn;
+
+typedef struct LdapOp {
+    OpType      type;
+    char       *uid;
+    char       *password;
+    char       *dn;             /* of the user, once found */
+    CcnetLdapSearchCB search_cb;
+    CcnetLdapVerifyCB verify_cb;
+    void       *data;
+
+    LdapConn   *conn;           /* NULL while queued */
+    int         msgid;
+    int         tries;
+    time_t      deadline;
+
+    /* OP_LIST: the entries wanted, how far the paged search got and
+     * what it found so far. OP_SEARCH: the size limit, 0 for none. */
+    int         start;
+    int         limit;
+    int         offset;
+    struct berval cookie;
+    GList      *emails;
+    int         n_found;
+} LdapOp;
+
+struct LdapConn {
+    CcnetLdapAsync *la;
+    LDAP       *ld;
+    gboolean    for_bind;
+    gboolean    dispatching;    /* in on_readable() */
+    gboolean    broken;         /* detached, freed after dispatching */
+    struct event read_event;
+    GHashTable *ops;            /* msgid -> LdapOp */
+};
+
+struct CcnetLdapAsync {
+    char       *host;
+    char       *base;
+    char       *user_dn;
+    char       *password;
+    char       *login_attr;
+    int         max_conns;
+
+    pthread_t   thread;
+    struct event_base *ev_base;
+    ccnet_pipe_t pipefd[2];
+    struct event wake_event;
+    struct event sweep_event;
+
+    /* Requests from other threads, under lock. */
+    pthread_mutex_t lock;
+    GQueue      incoming;
+    gboolean    stopping;
+
+    /* Only used in the LDAP thread. */
+    GList      *search_conns;
+    GList      *bind_conns;
+    GQueue      idle_bind_conns;
+    GQueue      bind_waiting;   /* verifies waiting for a bind connection */
+
+    gboolean    sort_checked;
+    gboolean    can_sort;       /* server side sorting on login_attr */
+    LDAPSortKey **sort_keys;
+
+    /* Where the last listing stopped, so that the next page picks up
+     * the paged search there instead of skipping to it again. */
+    LdapConn   *cursor_conn;
+    int         cursor_offset;
+    struct berval cursor_cookie;
+    time_t      cursor_expire;
+};
+
+static void submit (CcnetLdapAsync *la, LdapOp *op);
+
+static gboolean
+is_conn_error (int res)
+{
+    return (res == LDAP_SERVER_DOWN || res == LDAP_CONNECT_ERROR ||
+            res == LDAP_UNAVAILABLE || res == LDAP_TIMEOUT ||
+            res == LDAP_BUSY);
+}
+
+static void
+op_free (LdapOp *op)
+{
+    g_free (op->uid);
+    if (op->password) {
+        memset (op->password, 0, strlen(op->password));
+        g_free (op->password);
+    }
+    ldap_memfree (op->dn);
+    ldap_memfree (op->cookie.bv_val);
+    string_list_free (op->emails);
+    g_free (op);
+}
+
+static void
+finish_op (LdapOp *op, int res, GList *emails)
+{
+    if (op->type != OP_VERIFY)
+        op->search_cb (res, emails, op->data);
+    else
+        op->verify_cb (res, op->data);
+    op_free (op);
+}
+
+/* --- connections --- */
+
+static void on_readable (int fd, short what, void *vconn);
+
+static LDAP *
+open_ld (CcnetLdapAsync *la)
+{
+    struct timeval timeout = { LDAP_CONNECT_TIMEOUT, 0 };
+    int version = LDAP_VERSION3;
+    struct berval cred;
+    LDAP *ld;
+    int res;
+
+    res = ldap_initialize (&ld, la->host);
+    if (res != LDAP_SUCCESS) {
+        ccnet_warning ("ldap_initialize failed: %s.\n", ldap_err2string(res));
+        return NULL;
+    }
+    ldap_set_option (ld, LDAP_OPT_PROTOCOL_VERSION, &version);
+    ldap_set_option (ld, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+
+    /* Connects as well, so the socket is there to watch. */
+    cred.bv_val = la->password;
+    cred.bv_len = la->password ? strlen(la->password) : 0;
+    res = ldap_sasl_bind_s (ld, la->user_dn, LDAP_SASL_SIMPLE, &cred,
+                            NULL, NULL, NULL);
+    if (res != LDAP_SUCCESS) {
+        ccnet_warning ("ldap_bind failed: %s.\n", ldap_err2string(res));
+        ldap_unbind_ext_s (ld, NULL, NULL);
+        return NULL;
+    }
+    return ld;
+}
+
+/* Whether the root DSE lists the sort control. Checked on the first
+ * connection only, it's the same server. */
+static void
+check_sort_support (CcnetLdapAsync *la, LDAP *ld)
+{
+    char *attrs[] = { "supportedControl", NULL };
+    struct timeval timeout = { LDAP_CONNECT_TIMEOUT, 0 };
+    LDAPMessage *msg = NULL, *entry;
+    char **vals;
+    int i;
+
+    la->sort_checked = TRUE;
+    if (ldap_search_ext_s (ld, "", LDAP_SCOPE_BASE, "(objectClass=*)",
+                           attrs, 0, NULL, NULL, &timeout, 1,
+                           &msg) != LDAP_SUCCESS) {
+        ldap_msgfree (msg);
+        return;
+    }
+
+    entry = ldap_first_entry (ld, msg);
+    vals = entry ? ldap_get_values (ld, entry, "supportedControl") : NULL;
+    for (i = 0; vals && vals[i]; ++i)
+        if (strcmp (vals[i], LDAP_CONTROL_SORTREQUEST) == 0)
+            la->can_sort = TRUE;
+    ldap_value_free (vals);
+    ldap_msgfree (msg);
+
+    if (la->can_sort &&
+        ldap_create_sort_keylist (&la->sort_keys, la->login_attr) != 0) {
+        la->sort_keys = NULL;
+        la->can_sort = FALSE;
+    }
+    ccnet_debug ("LDAP: server side sorting %s.\n",
+                 la->can_sort ? "available" : "not available");
+}
+
+static LdapConn *
+conn_open (CcnetLdapAsync *la, gboolean for_bind)
+{
+    LdapConn *conn;
+    LDAP *ld;
+    int fd;
+
+    if (!(ld = open_ld (la)))
+        return NULL;
+    if (!la->sort_checked)
+        check_sort_support (la, ld);
+    if (ldap_get_option (ld, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS ||
+        fd < 0) {
+        ccnet_warning ("LDAP: no socket after connecting.\n");
+        ldap_unbind_ext_s (ld, NULL, NULL);
+        return NULL;
+    }
+
+    conn = g_new0 (LdapConn, 1);
+    conn->la = la;
+    conn->ld = ld;
+    conn->for_bind = for_bind;
+    conn->ops = g_hash_table_new (g_direct_hash, g_direct_equal);
+    event_set (&conn->read_event, fd, EV_READ | EV_PERSIST, on_readable, conn);
+    event_base_set (la->ev_base, &conn->read_event);
+    event_add (&conn->read_event, NULL);
+
+    if (for_bind)
+        la->bind_conns = g_list_prepend (la->bind_conns, conn);
+    else
+        la->search_conns = g_list_prepend (la->search_conns, conn);
+    return conn;
+}
+
+static void
+conn_detach (LdapConn *conn)
+{
+    CcnetLdapAsync *la = conn->la;
+
+    event_del (&conn->read_event);
+    if (la->cursor_conn == conn) {
+        ldap_memfree (la->cursor_cookie.bv_val);
+        la->cursor_cookie.bv_val = NULL;
+        la->cursor_cookie.bv_len = 0;
+        la->cursor_conn = NULL;
+    }
+    if (conn->for_bind) {
+        g_queue_remove (&la->idle_bind_conns, conn);
+        la->bind_conns = g_list_remove (la->bind_conns, conn);
+    } else
+        la->search_conns = g_list_remove (la->search_conns, conn);
+}
+
+static void
+conn_free (LdapConn *conn)
+{
+    ldap_unbind_ext_s (conn->ld, NULL, NULL);
+    g_hash_table_destroy (conn->ops);
+    g_free (conn);
+}
+
+static void
+retry_or_fail (CcnetLdapAsync *la, LdapOp *op, int res)
+{
+    op->conn = NULL;
+    if (op->tries < 2)
+        submit (la, op);
+    else {
+        ccnet_warning ("ldap request failed: %s.\n", ldap_err2string(res));
+        finish_op (op, res, NULL);
+    }
+}
+
+static void start_bind (CcnetLdapAsync *la, LdapOp *op);
+
+/* Hand a bind connection on to a waiting verify, or keep it. */
+static void
+release_bind_conn (CcnetLdapAsync *la, LdapConn *conn)
+{
+    LdapOp *op;
+
+    if (g_queue_get_length (&la->bind_waiting) > 0) {
+        op = g_queue_pop_head (&la->bind_waiting);
+        op->conn = conn;
+        start_bind (la, op);
+        return;
+    }
+    g_queue_push_head (&la->idle_bind_conns, conn);
+}
+
+/* The connection is gone: drop it and retry what was on it. */
+static void
+conn_broken (LdapConn *conn, int res)
+{
+    CcnetLdapAsync *la = conn->la;
+    GList *ops, *ptr;
+    gboolean for_bind = conn->for_bind;
+
+    if (conn->broken)
+        return;
+    ccnet_debug ("LDAP: dropping dead connection.\n");
+    ops = g_hash_table_get_values (conn->ops);
+    g_hash_table_remove_all (conn->ops);
+    conn_detach (conn);
+    conn->broken = TRUE;
+    if (!conn->dispatching)
+        conn_free (conn);
+
+    for (ptr = ops; ptr; ptr = ptr->next)
+        retry_or_fail (la, ptr->data, res);
+    g_list_free (ops);
+
+    /* A verify may wait for the connection just closed. */
+    if (for_bind && g_queue_get_length (&la->bind_waiting) > 0 &&
+        (int)g_list_length (la->bind_conns) < la->max_conns) {
+        LdapConn *c = conn_open (la, TRUE);
+        if (c)
+            release_bind_conn (la, c);
+    }
+}
+
+/* --- operations --- */
+
+static void
+start_bind (CcnetLdapAsync *la, LdapOp *op)
+{
+    LdapConn *conn = op->conn;
+    struct berval cred;
+    int res;
+
+    cred.bv_val = op->password;
+    cred.bv_len = strlen(op->password);
+    res = ldap_sasl_bind (conn->ld, op->dn, LDAP_SASL_SIMPLE, &cred,
+                          NULL, NULL, &op->msgid);
+    if (res == LDAP_SUCCESS) {
+        g_hash_table_insert (conn->ops, GINT_TO_POINTER(op->msgid), op);
+        return;
+    }
+
+    op->conn = NULL;
+    if (is_conn_error (res)) {
+        /* Retried from the search, the dn may be stale as well. */
+        ldap_memfree (op->dn);
+        op->dn = NULL;
+        conn_broken (conn, res);
+        retry_or_fail (la, op, res);
+    } else {
+        release_bind_conn (la, conn);
+        finish_op (op, res, NULL);
+    }
+}
+
+static void
+queue_bind (CcnetLdapAsync *la, LdapOp *op)
+{
+    LdapConn *conn = g_queue_pop_head (&la->idle_bind_conns);
+
+    if (!conn && (int)g_list_length (la->bind_conns) < la->max_conns)
+        conn = conn_open (la, TRUE);
+    if (!conn) {
+        if (!la->bind_conns) {
+            finish_op (op, LDAP_SERVER_DOWN, NULL);
+            return;
+        }
+        g_queue_push_tail (&la->bind_waiting, op);
+        return;
+    }
+    op->conn = conn;
+    start_bind (la, op);
+}
+
+static LdapConn *
+get_search_conn (CcnetLdapAsync *la)
+{
+    LdapConn *best = NULL, *conn;
+    GList *ptr;
+
+    for (ptr = la->search_conns; ptr; ptr = ptr->next) {
+        conn = ptr->data;
+        if (!best || g_hash_table_size (conn->ops) <
+            g_hash_table_size (best->ops))
+            best = conn;
+    }
+    if ((!best || g_hash_table_size (best->ops) >= SEARCH_CONN_BUSY) &&
+        (int)g_list_length (la->search_conns) < la->max_conns) {
+        conn = conn_open (la, FALSE);
+        if (conn)
+            return conn;
+    }
+    return best;
+}
+
+static void start_list (CcnetLdapAsync *la, LdapOp *op);
+
+static void
+submit (CcnetLdapAsync *la, LdapOp *op)
+{
+    LdapConn *conn;
+    char *filter;
+    char *attrs[2];
+    int res;
+
+    op->tries++;
+    if (op->type == OP_LIST) {
+        start_list (la, op);
+        return;
+    }
+    if (!(conn = get_search_conn (la))) {
+        finish_op (op, LDAP_SERVER_DOWN, NULL);
+        return;
+    }
+
+    filter = g_strdup_printf ("(%s=%s)", la->login_attr, op->uid);
+    attrs[0] = la->login_attr;
+    attrs[1] = NULL;
+    res = ldap_search_ext (conn->ld, la->base, LDAP_SCOPE_SUBTREE, filter,
+                           attrs, 0, NULL, NULL, NULL, op->limit, &op->msgid);
+    g_free (filter);
+
+    if (res == LDAP_SUCCESS) {
+        op->conn = conn;
+        g_hash_table_insert (conn->ops, GINT_TO_POINTER(op->msgid), op);
+    } else if (is_conn_error (res)) {
+        conn_broken (conn, res);
+        retry_or_fail (la, op, res);
+    } else {
+        ccnet_warning ("ldap_search failed: %s.\n", ldap_err2string(res));
+        finish_op (op, res, NULL);
+    }
+}
+
+/*
+ * Listings use the paged results control (RFC 2696), so the server
+ * never has to return more than a page at once and its size limit is
+ * not hit. The control only has a cursor, not an offset: the pages
+ * before @start are fetched and skipped, unless the last listing
+ * stopped there or before, which is the usual case of an admin paging
+ * through the users. Page sizes are cut so a listing ends on its last
+ * entry and the search can be picked up there.
+ */
+
+static void
+release_cursor (CcnetLdapAsync *la)
+{
+    LDAPControl *ctrls[2] = { NULL, NULL };
+    int msgid;
+
+    if (!la->cursor_conn)
+        return;
+
+    /* A page size of 0 tells the server to drop the search. The answer
+     * has no operation and is thrown away. */
+    if (ldap_create_page_control (la->cursor_conn->ld, 0, &la->cursor_cookie,
+                                  0, &ctrls[0]) == LDAP_SUCCESS) {
+        char *attrs[] = { LDAP_NO_ATTRS, NULL };
+        char *filter = g_strdup_printf ("(%s=*)", la->login_attr);
+
+        ldap_search_ext (la->cursor_conn->ld, la->base, LDAP_SCOPE_SUBTREE,
+                         filter, attrs, 0, ctrls, NULL, NULL, 0, &msgid);
+        ldap_control_free (ctrls[0]);
+        g_free (filter);
+    }
+
+    ldap_memfree (la->cursor_cookie.bv_val);
+    la->cursor_cookie.bv_val = NULL;
+    la->cursor_cookie.bv_len = 0;
+    la->cursor_conn = NULL;
+}
+
+static void
+send_page (CcnetLdapAsync *la, LdapConn *conn, LdapOp *op)
+{
+    LDAPControl *ctrls[3] = { NULL, NULL, NULL };
+    char *attrs[2];
+    char *filter;
+    int size = LDAP_PAGE_SIZE;
+    int res;
+
+    if (op->offset < op->start)
+        size = MIN (size, op->start - op->offset);
+    else if (op->limit >= 0)
+        size = MIN (size, op->start + op->limit - op->offset);
+
+    res = ldap_create_page_control (conn->ld, size,
+                                    op->cookie.bv_len ? &op->cookie : NULL,
+                                    0, &ctrls[0]);
+    if (res == LDAP_SUCCESS && la->can_sort)
+        res = ldap_create_sort_control (conn->ld, la->sort_keys, 0, &ctrls[1]);
+    if (res != LDAP_SUCCESS) {
+        ccnet_warning ("LDAP: failed to create controls: %s.\n",
+                       ldap_err2string(res));
+        ldap_control_free (ctrls[0]);
+        finish_op (op, res, NULL);
+        return;
+    }
+
+    filter = g_strdup_printf ("(%s=*)", la->login_attr);
+    attrs[0] = la->login_attr;
+    attrs[1] = NULL;
+    res = ldap_search_ext (conn->ld, la->base, LDAP_SCOPE_SUBTREE, filter,
+                           attrs, 0, ctrls, NULL, NULL, 0, &op->msgid);
+    g_free (filter);
+    ldap_control_free (ctrls[0]);
+    if (ctrls[1])
+        ldap_control_free (ctrls[1]);
+
+    if (res == LDAP_SUCCESS) {
+        op->conn = conn;
+        op->deadline = time(NULL) + LDAP_OP_TIMEOUT;
+        g_hash_table_insert (conn->ops, GINT_TO_POINTER(op->msgid), op);
+    } else if (is_conn_error (res)) {
+        conn_broken (conn, res);
+        retry_or_fail (la, op, res);
+    } else {
+        ccnet_warning ("ldap_search failed: %s.\n", ldap_err2string(res));
+        finish_op (op, res, NULL);
+    }
+}
+
+static void
+start_list (CcnetLdapAsync *la, LdapOp *op)
+{
+    LdapConn *conn;
+
+    if (op->limit == 0) {
+        finish_op (op, LDAP_SUCCESS, NULL);
+        return;
+    }
+
+    /* From the beginning on a retry. */
+    string_list_free (op->emails);
+    op->emails = NULL;
+    op->n_found = 0;
+    op->offset = 0;
+    ldap_memfree (op->cookie.bv_val);
+    op->cookie.bv_val = NULL;
+    op->cookie.bv_len = 0;
+
+    if (la->cursor_conn && op->start > 0 &&
+        la->cursor_offset <= op->start && time(NULL) < la->cursor_expire) {
+        conn = la->cursor_conn;
+        op->offset = la->cursor_offset;
+        op->cookie = la->cursor_cookie;
+        la->cursor_cookie.bv_val = NULL;
+        la->cursor_cookie.bv_len = 0;
+        la->cursor_conn = NULL;
+    } else if (!(conn = get_search_conn (la))) {
+        finish_op (op, LDAP_SERVER_DOWN, NULL);
+        return;
+    }
+    send_page (la, conn, op);
+}
+
+static void
+handle_list_result (LdapConn *conn, LdapOp *op, LDAPMessage *msg)
+{
+    CcnetLdapAsync *la = conn->la;
+    LDAPControl **ctrls = NULL, *ctrl;
+    LDAPMessage *entry;
+    struct berval cookie = { 0, NULL };
+    ber_int_t estimate;
+    char **vals;
+    GList *emails;
+    int res, err;
+
+    res = ldap_parse_result (conn->ld, msg, &err, NULL, NULL, NULL, &ctrls, 0);
+    if (res == LDAP_SUCCESS)
+        res = err;
+    if (res != LDAP_SUCCESS) {
+        ldap_controls_free (ctrls);
+        ldap_msgfree (msg);
+        ccnet_warning ("ldap_search failed: %s.\n", ldap_err2string(res));
+        finish_op (op, res, NULL);
+        return;
+    }
+
+    for (entry = ldap_first_entry (conn->ld, msg); entry;
+         entry = ldap_next_entry (conn->ld, entry), ++op->offset) {
+        if (op->offset < op->start ||
+            (op->limit >= 0 && op->n_found >= op->limit))
+            continue;
+        vals = ldap_get_values (conn->ld, entry, la->login_attr);
+        if (vals && vals[0]) {
+            op->emails = g_list_prepend (op->emails, g_strdup (vals[0]));
+            ++op->n_found;
+        }
+        ldap_value_free (vals);
+    }
+
+    /* No control back if the server doesn't page: it sent everything. */
+    ctrl = ldap_control_find (LDAP_CONTROL_PAGEDRESULTS, ctrls, NULL);
+    if (ctrl)
+        ldap_parse_pageresponse_control (conn->ld, ctrl, &estimate, &cookie);
+    ldap_controls_free (ctrls);
+    ldap_msgfree (msg);
+    ldap_memfree (op->cookie.bv_val);
+    op->cookie = cookie;
+
+    if (op->cookie.bv_len > 0 &&
+        (op->limit < 0 || op->offset < op->start + op->limit)) {
+        send_page (la, conn, op);
+        return;
+    }
+
+    if (op->cookie.bv_len > 0) {
+        release_cursor (la);
+        la->cursor_conn = conn;
+        la->cursor_offset = op->offset;
+        la->cursor_cookie = op->cookie;
+        la->cursor_expire = time(NULL) + LDAP_CURSOR_TTL;
+        op->cookie.bv_val = NULL;
+        op->cookie.bv_len = 0;
+    }
+
+    emails = g_list_reverse (op->emails);
+    op->emails = NULL;
+    finish_op (op, LDAP_SUCCESS, emails);
+}
+
+static GList *
+collect_emails (CcnetLdapAsync *la, LDAP *ld, LDAPMessage *msg)
+{
+    LDAPMessage *entry;
+    GList *emails = NULL;
+    char **vals;
+
+    for (entry = ldap_first_entry (ld, msg); entry;
+         entry = ldap_next_entry (ld, entry)) {
+        vals = ldap_get_values (ld, entry, la->login_attr);
+        if (vals && vals[0])
+            emails = g_list_prepend (emails, g_strdup (vals[0]));
+        ldap_value_free (vals);
+    }
+    return emails;
+}
+
+static void
+handle_search_result (LdapConn *conn, LdapOp *op, LDAPMessage *msg)
+{
+    CcnetLdapAsync *la = conn->la;
+    LDAPMessage *entry;
+    int res, err;
+
+    if (op->type == OP_LIST) {
+        handle_list_result (conn, op, msg);
+        return;
+    }
+
+    res = ldap_parse_result (conn->ld, msg, &err, NULL, NULL, NULL, NULL, 0);
+    if (res == LDAP_SUCCESS)
+        res = err;
+    /* The entries up to the limit are there. */
+    if (res == LDAP_SIZELIMIT_EXCEEDED && op->limit > 0)
+        res = LDAP_SUCCESS;
+    if (res != LDAP_SUCCESS) {
+        ldap_msgfree (msg);
+        ccnet_warning ("ldap_search failed: %s.\n", ldap_err2string(res));
+        finish_op (op, res, NULL);
+        return;
+    }
+
+    if (op->type == OP_SEARCH) {
+        GList *emails = collect_emails (la, conn->ld, msg);
+        ldap_msgfree (msg);
+        finish_op (op, LDAP_SUCCESS, emails);
+        return;
+    }
+
+    entry = ldap_first_entry (conn->ld, msg);
+    if (!entry) {
+        ldap_msgfree (msg);
+        ccnet_warning ("user with uid %s not found in LDAP.\n", op->uid);
+        finish_op (op, LDAP_NO_SUCH_OBJECT, NULL);
+        return;
+    }
+    op->dn = ldap_get_dn (conn->ld, entry);
+    ldap_msgfree (msg);
+    queue_bind (la, op);
+}
+
+static void
+handle_bind_result (LdapConn *conn, LdapOp *op, LDAPMessage *msg)
+{
+    CcnetLdapAsync *la = conn->la;
+    int res, err;
+
+    res = ldap_parse_result (conn->ld, msg, &err, NULL, NULL, NULL, NULL, 1);
+    if (res == LDAP_SUCCESS)
+        res = err;
+    op->conn = NULL;
+    if (res != LDAP_SUCCESS)
+        ccnet_warning ("Password check for %s failed.\n", op->uid);
+
+    /* Whoever the connection is bound as now, the next bind changes it. */
+    release_bind_conn (la, conn);
+    finish_op (op, res, NULL);
+}
+
+static void
+on_readable (int fd, short what, void *vconn)
+{
+    LdapConn *conn = vconn;
+    struct timeval zero = { 0, 0 };
+    LDAPMessage *msg;
+    LdapOp *op;
+    int rc = 0, err = LDAP_SERVER_DOWN;
+    int n_results = 0;
+
+    /* libldap may have read more than one result already. Handling one
+     * may resubmit an operation, which may find this connection broken,
+     * so it's only freed once done here. */
+    conn->dispatching = TRUE;
+    while (!conn->broken &&
+           (rc = ldap_result (conn->ld, LDAP_RES_ANY, LDAP_MSG_ALL,
+                              &zero, &msg)) > 0) {
+        ++n_results;
+        op = g_hash_table_lookup (conn->ops, GINT_TO_POINTER(ldap_msgid(msg)));
+        if (!op) {
+            /* abandoned after a timeout */
+            ldap_msgfree (msg);
+            continue;
+        }
+        g_hash_table_remove (conn->ops, GINT_TO_POINTER(op->msgid));
+        if (conn->for_bind) {
+            /* Bind connections have one operation, and may have been
+             * handed on to the next. */
+            handle_bind_result (conn, op, msg);
+            break;
+        }
+        handle_search_result (conn, op, msg);
+    }
+    conn->dispatching = FALSE;
+
+    if (conn->broken) {
+        conn_free (conn);
+        return;
+    }
+    /* Readable with nothing to read and nothing asked: closed by the
+     * server. */
+    if (rc < 0 || (n_results == 0 && g_hash_table_size (conn->ops) == 0)) {
+        ldap_get_option (conn->ld, LDAP_OPT_RESULT_CODE, &err);
+        conn_broken (conn, err);
+    }
+}
+
+/* --- the LDAP thread --- */
+
+static void
+on_wake (int fd, short what, void *vla)
+{
+    CcnetLdapAsync *la = vla;
+    char buf[64];
+    GQueue ops = G_QUEUE_INIT;
+    gboolean stopping;
+    LdapOp *op;
+
+    if (piperead (la->pipefd[0], buf, sizeof(buf)) < 0)
+        ccnet_warning ("LDAP: read pipe error: %s\n", strerror(errno));
+
+    pthread_mutex_lock (&la->lock);
+    ops = la->incoming;
+    g_queue_init (&la->incoming);
+    stopping = la->stopping;
+    pthread_mutex_unlock (&la->lock);
+
+    while ((op = g_queue_pop_head (&ops)) != NULL) {
+        if (stopping)
+            finish_op (op, LDAP_SERVER_DOWN, NULL);
+        else
+            submit (la, op);
+    }
+    if (stopping)
+        event_base_loopbreak (la->ev_base);
+}
+
+static gboolean
+op_expired (gpointer key, gpointer value, gpointer vlist)
+{
+    LdapOp *op = value;
+    GList **expired = vlist;
+
+    if (time(NULL) < op->deadline)
+        return FALSE;
+    *expired = g_list_prepend (*expired, op);
+    return TRUE;
+}
+
+static void
+on_sweep (int fd, short what, void *vla)
+{
+    CcnetLdapAsync *la = vla;
+    GList *conns, *ptr, *expired = NULL;
+    LdapConn *conn;
+    LdapOp *op;
+
+    conns = g_list_copy (la->search_conns);
+    for (ptr = conns; ptr; ptr = ptr->next) {
+        conn = ptr->data;
+        g_hash_table_foreach_steal (conn->ops, op_expired, &expired);
+    }
+    g_list_free (conns);
+
+    while ((op = g_queue_peek_head (&la->bind_waiting)) != NULL &&
+           time(NULL) >= op->deadline)
+        expired = g_list_prepend (expired, g_queue_pop_head (&la->bind_waiting));
+
+    if (la->cursor_conn && time(NULL) >= la->cursor_expire)
+        release_cursor (la);
+
+    /* Binds in flight are left to the connection: the server answers
+     * them or the connection breaks. */
+    for (ptr = expired; ptr; ptr = ptr->next) {
+        op = ptr->data;
+        if (op->conn)
+            ldap_abandon_ext (op->conn->ld, op->msgid, NULL, NULL);
+        ccnet_warning ("LDAP request for %s timed out.\n", op->uid);
+        finish_op (op, LDAP_TIMEOUT, NULL);
+    }
+    g_list_free (expired);
+}
+
+static void
+close_all (CcnetLdapAsync *la)
+{
+    LdapConn *conn;
+    LdapOp *op;
+    GList *all = NULL, *ptr;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    while ((op = g_queue_pop_head (&la->bind_waiting)) != NULL)
+        all = g_list_prepend (all, op);
+    while (la->search_conns) {
+        conn = la->search_conns->data;
+        g_hash_table_iter_init (&iter, conn->ops);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            all = g_list_prepend (all, value);
+        conn_detach (conn);
+        conn_free (conn);
+    }
+    while (la->bind_conns) {
+        conn = la->bind_conns->data;
+        g_hash_table_iter_init (&iter, conn->ops);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            all = g_list_prepend (all, value);
+        conn_detach (conn);
+        conn_free (conn);
+    }
+
+    for (ptr = all; ptr; ptr = ptr->next)
+        finish_op (ptr->data, LDAP_SERVER_DOWN, NULL);
+    g_list_free (all);
+}
+
+static void *
+ldap_thread (void *vla)
+{
+    CcnetLdapAsync *la = vla;
+
+    event_base_dispatch (la->ev_base);
+    close_all (la);
+    return NULL;
+}
+
+CcnetLdapAsync *
+ccnet_ldap_async_new (const char *host, const char *base,
+                      const char *user_dn, const char *password,
+                      const char *login_attr, int max_conns)
+{
+    CcnetLdapAsync *la = g_new0 (CcnetLdapAsync, 1);
+    struct timeval sweep = { 1, 0 };
+
+    la->host = g_strdup (host);
+    la->base = g_strdup (base);
+    la->user_dn = g_strdup (user_dn);
+    la->password = g_strdup (password);
+    la->login_attr = g_strdup (login_attr);
+    la->max_conns = max_conns > 0 ? max_conns : 1;
+    pthread_mutex_init (&la->lock, NULL);
+    g_queue_init (&la->incoming);
+    g_queue_init (&la->idle_bind_conns);
+    g_queue_init (&la->bind_waiting);
+
+    if (ccnet_pipe (la->pipefd) < 0) {
+        ccnet_warning ("LDAP: failed to create pipe: %s\n", strerror(errno));
+        goto error;
+    }
+    la->ev_base = event_base_new ();
+    event_set (&la->wake_event, la->pipefd[0], EV_READ | EV_PERSIST,
+               on_wake, la);
+    event_base_set (la->ev_base, &la->wake_event);
+    event_add (&la->wake_event, NULL);
+    event_set (&la->sweep_event, -1, EV_PERSIST, on_sweep, la);
+    event_base_set (la->ev_base, &la->sweep_event);
+    event_add (&la->sweep_event, &sweep);
+
+    if (pthread_create (&la->thread, NULL, ldap_thread, la) != 0) {
+        ccnet_warning ("LDAP: failed to start thread.\n");
+        event_base_free (la->ev_base);
+        pipeclose (la->pipefd[0]);
+        pipeclose (la->pipefd[1]);
+        goto error;
+    }
+    return la;
+
+error:
+    g_free (la->host);
+    g_free (la->base);
+    g_free (la->user_dn);
+    g_free (la->password);
+    g_free (la->login_attr);
+    g_free (la);
+    return NULL;
+}
+
+static void
+wake (CcnetLdapAsync *la)
+{
+    if (pipewrite (la->pipefd[1], "a", 1) != 1)
+        ccnet_warning ("LDAP: write to pipe error: %s\n", strerror(errno));
+}
+
+void
+ccnet_ldap_async_free (CcnetLdapAsync *la)
+{
+    if (!la)
+        return;
+
+    pthread_mutex_lock (&la->lock);
+    la->stopping = TRUE;
+    pthread_mutex_unlock (&la->lock);
+    wake (la);
+    pthread_join (la->thread, NULL);
+
+    event_del (&la->wake_event);
+    event_del (&la->sweep_event);
+    event_base_free (la->ev_base);
+    pipeclose (la->pipefd[0]);
+    pipeclose (la->pipefd[1]);
+    pthread_mutex_destroy (&la->lock);
+    if (la->sort_keys)
+        ldap_free_sort_keylist (la->sort_keys);
+    g_free (la->host);
+    g_free (la->base);
+    g_free (la->user_dn);
+    g_free (la->password);
+    g_free (la->login_attr);
+    g_free (la);
+}
+
+static void
+queue_op (CcnetLdapAsync *la, LdapOp *op)
+{
+    gboolean stopping, first;
+
+    op->deadline = time(NULL) + LDAP_OP_TIMEOUT;
+
+    pthread_mutex_lock (&la->lock);
+    stopping = la->stopping;
+    first = g_queue_get_length (&la->incoming) == 0;
+    if (!stopping)
+        g_queue_push_tail (&la->incoming, op);
+    pthread_mutex_unlock (&la->lock);
+
+    if (stopping)
+        finish_op (op, LDAP_SERVER_DOWN, NULL);
+    else if (first)
+        wake (la);
+}
+
+void
+ccnet_ldap_async_search (CcnetLdapAsync *la, const char *uid,
+                         CcnetLdapSearchCB cb, void *data)
+{
+    LdapOp *op = g_new0 (LdapOp, 1);
+
+    op->type = OP_SEARCH;
+    op->uid = g_strdup (uid);
+    op->search_cb = cb;
+    op->data = data;
+    queue_op (la, op);
+}
+
+/* RFC 4515 escaping of an assertion value. */
+static char *
+escape_filter_value (const char *value)
+{
+    GString *buf = g_string_new (NULL);
+    const char *p;
+
+    for (p = value; *p; ++p) {
+        if (*p == '*' || *p == '(' || *p == ')' || *p == '\\')
+            g_string_append_printf (buf, "\\%02x", (guchar)*p);
+        else
+            g_string_append_c (buf, *p);
+    }
+    return g_string_free (buf, FALSE);
+}
+
+void
+ccnet_ldap_async_search_prefix (CcnetLdapAsync *la, const char *prefix,
+                                int limit, CcnetLdapSearchCB cb, void *data)
+{
+    LdapOp *op = g_new0 (LdapOp, 1);
+    char *value = escape_filter_value (prefix);
+
+    op->type = OP_SEARCH;
+    op->uid = g_strconcat (value, "*", NULL);
+    op->limit = MAX (limit, 0);
+    op->search_cb = cb;
+    op->data = data;
+    queue_op (la, op);
+    g_free (value);
+}
+
+void
+ccnet_ldap_async_list (CcnetLdapAsync *la, int start, int limit,
+                       CcnetLdapSearchCB cb, void *data)
+{
+    LdapOp *op = g_new0 (LdapOp, 1);
+
+    op->type = OP_LIST;
+    op->uid = g_strdup ("*");
+    op->start = start > 0 ? start : 0;
+    op->limit = limit;
+    op->search_cb = cb;
+    op->data = data;
+    queue_op (la, op);
+}
+
+void
+ccnet_ldap_async_verify (CcnetLdapAsync *la, const char *uid,
+                         const char *password,
+                         CcnetLdapVerifyCB cb, void *data)
+{
+    LdapOp *op = g_new0 (LdapOp, 1);
+
+    op->type = OP_VERIFY;
+    op->uid = g_strdup (uid);
+    op->password = g_strdup (password);
+    op->verify_cb = cb;
+    op->data = data;
+    queue_op (la, op);
+}
+
+/* --- blocking wrappers --- */
+
+typedef struct SyncCall {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    gboolean        done;
+    int             res;
+    GList          *emails;
+} SyncCall;
+
+static void
+sync_call_init (SyncCall *call)
+{
+    memset (call, 0, sizeof(*call));
+    pthread_mutex_init (&call->lock, NULL);
+    pthread_cond_init (&call->cond, NULL);
+}
+
+static void
+sync_call_wait (SyncCall *call)
+{
+    pthread_mutex_lock (&call->lock);
+    while (!call->done)
+        pthread_cond_wait (&call->cond, &call->lock);
+    pthread_mutex_unlock (&call->lock);
+    pthread_mutex_destroy (&call->lock);
+    pthread_cond_destroy (&call->cond);
+}
+
+static void
+sync_call_done (SyncCall *call, int res, GList *emails)
+{
+    pthread_mutex_lock (&call->lock);
+    call->res = res;
+    call->emails = emails;
+    call->done = TRUE;
+    pthread_cond_signal (&call->cond);
+    pthread_mutex_unlock (&call->lock);
+}
+
+static void
+sync_search_done (int res, GList *emails, void *vcall)
+{
+    sync_call_done (vcall, res, emails);
+}
+
+static void
+sync_verify_done (int res, void *vcall)
+{
+    sync_call_done (vcall, res, NULL);
+}
+
+int
+ccnet_ldap_async_search_sync (CcnetLdapAsync *la, const char *uid,
+                              GList **emails)
+{
+    SyncCall call;
+
+    sync_call_init (&call);
+    ccnet_ldap_async_search (la, uid, sync_search_done, &call);
+    sync_call_wait (&call);
+
+    *emails = call.emails;
+    return call.res == LDAP_SUCCESS ? 0 : -1;
+}
+
+int
+ccnet_ldap_async_search_prefix_sync (CcnetLdapAsync *la, const char *prefix,
+                                     int limit, GList **emails)
+{
+    SyncCall call;
+
+    sync_call_init (&call);
+    ccnet_ldap_async_search_prefix (la, prefix, limit, sync_search_done,
+                                    &call);
+    sync_call_wait (&call);
+
+    *emails = call.emails;
+    return call.res == LDAP_SUCCESS ? 0 : -1;
+}
+
+int
+ccnet_ldap_async_list_sync (CcnetLdapAsync *la, int start, int limit,
+                            GList **emails)
+{
+    SyncCall call;
+
+    sync_call_init (&call);
+    ccnet_ldap_async_list (la, start, limit, sync_search_done, &call);
+    sync_call_wait (&call);
+
+    *emails = call.emails;
+    return call.res == LDAP_SUCCESS ? 0 : -1;
+}
+
+int
+ccnet_ldap_async_verify_sync (CcnetLdapAsync *la, const char *uid,
+                              const char *password)
+{
+    SyncCall call;
+
+    sync_call_init (&call);
+    ccnet_ldap_async_verify (la, uid, password, sync_verify_done, &call);
+    sync_call_wait (&call);
+
+    return call.res == LDAP_SUCCESS ? 0 : -1;
+}
+
+#endif  /* HAVE_LDAP */
@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_LDAP_ASYNC_H
+#define CCNET_LDAP_ASYNC_H
+
+#include <glib.h>
+
+/*
+ * LDAP lookups without a thread per request. One LDAP thread runs an
+ * event loop with the sockets of a few connections, each of which has
+ * any number of searches in flight, told apart by their message ids.
+ * Password checks bind on connections of their own, one bind at a time
+ * each, since a bind changes who the connection is.
+ *
+ * Requests may be made from any thread. Callbacks are called in the
+ * LDAP thread and must not block. Connection errors are retried once
+ * on another connection, like the old handle pool did.
+ */
+
+typedef struct CcnetLdapAsync CcnetLdapAsync;
+
+/* @res is an LDAP result code. @emails are the values of the login
+ * attribute of the entries found, owned by the callee. */
+typedef void (*CcnetLdapSearchCB) (int res, GList *emails, void *data);
+
+/* LDAP_SUCCESS if the password is right. */
+typedef void (*CcnetLdapVerifyCB) (int res, void *data);
+
+/* @user_dn NULL for anonymous. At most @max_conns connections of each
+ * kind are opened. */
+CcnetLdapAsync *ccnet_ldap_async_new (const char *host, const char *base,
+                                      const char *user_dn,
+                                      const char *password,
+                                      const char *login_attr,
+                                      int max_conns);
+
+/* Fails what is in flight with LDAP_SERVER_DOWN and joins the thread. */
+void ccnet_ldap_async_free (CcnetLdapAsync *la);
+
+/* Entries whose login attribute is @uid, "*" for all. */
+void ccnet_ldap_async_search (CcnetLdapAsync *la, const char *uid,
+                              CcnetLdapSearchCB cb, void *data);
+
+/* At most @limit entries whose login attribute starts with @prefix, in
+ * no order. */
+void ccnet_ldap_async_search_prefix (CcnetLdapAsync *la, const char *prefix,
+                                     int limit,
+                                     CcnetLdapSearchCB cb, void *data);
+
+/* All entries ordered by the login attribute if the server can sort,
+ * @limit of them from @start, -1 for all. Fetched in pages. */
+void ccnet_ldap_async_list (CcnetLdapAsync *la, int start, int limit,
+                            CcnetLdapSearchCB cb, void *data);
+
+void ccnet_ldap_async_verify (CcnetLdapAsync *la, const char *uid,
+                              const char *password,
+                              CcnetLdapVerifyCB cb, void *data);
+
+/* Blocking versions for worker threads, never call them in the LDAP
+ * thread. */
+int ccnet_ldap_async_search_sync (CcnetLdapAsync *la, const char *uid,
+                                  GList **emails);
+
+int ccnet_ldap_async_search_prefix_sync (CcnetLdapAsync *la,
+                                         const char *prefix, int limit,
+                                         GList **emails);
+
+int ccnet_ldap_async_list_sync (CcnetLdapAsync *la, int start, int limit,
+                                GList **emails);
+
+int ccnet_ldap_async_verify_sync (CcnetLdapAsync *la, const char *uid,
+                                  const char *password);
+
+#endif
@@ -2,25 +2,323 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include "ccnet-db.h"
 #include "org-mgr.h"
+#include "server-session.h"
+#include "cache-bus.h"
+#include "change-log.h"
 
 #include "log.h"
 
+#define DEFAULT_DIR_CACHE_SIZE 10000
+#define DEFAULT_DIR_CACHE_TTL  60
+
+/* One organization, as needed to rebuild a CcnetOrganization.
+ * is_staff is only meaningful in the per-user lists. */
+typedef struct OrgInfo {
+    int     org_id;
+    int     is_staff;
+    char   *org_name;
+    char   *url_prefix;
+    char   *creator;
+    gint64  ctime;
+} OrgInfo;
+
+/* Entry of the org directory. Which field is used depends on the map:
+ * org for url prefixes (NULL if no such org), org_id for groups (-1 if
+ * not an org group) and orgs for users. */
+typedef struct DirEntry {
+    time_t   expire;
+    OrgInfo *org;
+    int      org_id;
+    GList   *orgs;
+} DirEntry;
+
 struct _CcnetOrgManagerPriv
 {
     CcnetDB	*db;
+    /* Where OrgUser and OrgGroup rows are, NULL if all in db. */
+    CcnetDBShards  *shards;
+
+    /* In-memory org directory, see dir_lookup(). */
+    pthread_mutex_t dir_lock;
+    GHashTable     *dir_by_prefix;
+    GHashTable     *dir_by_group;
+    GHashTable     *dir_by_user;
+    int             dir_size;   /* max entries per map, 0 disables */
+    int             dir_ttl;
+    guint           dir_gen;
+    gint64          dir_hits;
+    gint64          dir_misses;
 };
 
 static int open_db (CcnetOrgManager *manager);
 static int check_db_table (CcnetDB *db);
+static int open_shards (CcnetOrgManager *manager);
+
+static void
+org_info_free (OrgInfo *info)
+{
+    if (!info)
+        return;
+    g_free (info->org_name);
+    g_free (info->url_prefix);
+    g_free (info->creator);
+    g_free (info);
+}
+
+static void
+dir_entry_free (gpointer data)
+{
+    DirEntry *entry = data;
+    GList *ptr;
+
+    org_info_free (entry->org);
+    for (ptr = entry->orgs; ptr; ptr = ptr->next)
+        org_info_free (ptr->data);
+    g_list_free (entry->orgs);
+    g_free (entry);
+}
+
+static OrgInfo *
+org_info_from_row (CcnetDBRow *row, int is_staff)
+{
+    OrgInfo *info = g_new0 (OrgInfo, 1);
+
+    info->org_id = ccnet_db_row_get_column_int (row, 0);
+    info->org_name = g_strdup (ccnet_db_row_get_column_text (row, 1));
+    info->url_prefix = g_strdup (ccnet_db_row_get_column_text (row, 2));
+    info->creator = g_strdup (ccnet_db_row_get_column_text (row, 3));
+    info->ctime = ccnet_db_row_get_column_int64 (row, 4);
+    info->is_staff = is_staff;
+
+    return info;
+}
+
+static CcnetOrganization *
+org_info_to_org (const OrgInfo *info, const char *email)
+{
+    if (email)
+        return g_object_new (CCNET_TYPE_ORGANIZATION,
+                             "org_id", info->org_id,
+                             "email", email,
+                             "is_staff", info->is_staff,
+                             "org_name", info->org_name,
+                             "url_prefix", info->url_prefix,
+                             "creator", info->creator,
+                             "ctime", info->ctime,
+                             NULL);
+
+    return g_object_new (CCNET_TYPE_ORGANIZATION,
+                         "org_id", info->org_id,
+                         "org_name", info->org_name,
+                         "url_prefix", info->url_prefix,
+                         "creator", info->creator,
+                         "ctime", info->ctime,
+                         NULL);
+}
+
+/*
+ * Look up @key in one of the directory maps. On a hit @func is called
+ * with the entry under the lock and TRUE is returned. On a miss *gen is
+ * set for the following dir_insert(), so that a result read from the
+ * database before an invalidation is not cached.
+ */
+static gboolean
+dir_lookup (CcnetOrgManagerPriv *priv, GHashTable *map, gconstpointer key,
+            void (*func) (DirEntry *entry, void *data), void *data,
+            guint *gen)
+{
+    DirEntry *entry;
+
+    if (priv->dir_size <= 0)
+        return FALSE;
+
+    pthread_mutex_lock (&priv->dir_lock);
+
+    entry = g_hash_table_lookup (map, key);
+    if (entry && entry->expire <= time(NULL)) {
+        g_hash_table_remove (map, key);
+        entry = NULL;
+    }
+    if (!entry) {
+        ++priv->dir_misses;
+        *gen = priv->dir_gen;
+        pthread_mutex_unlock (&priv->dir_lock);
+        return FALSE;
+    }
+
+    ++priv->dir_hits;
+    func (entry, data);
+
+    pthread_mutex_unlock (&priv->dir_lock);
+    return TRUE;
+}
+
+/* Takes ownership of @key and @entry. */
+static void
+dir_insert (CcnetOrgManagerPriv *priv, GHashTable *map, gpointer key,
+            DirEntry *entry, guint gen, GDestroyNotify free_key)
+{
+    pthread_mutex_lock (&priv->dir_lock);
+
+    if (priv->dir_size <= 0 || gen != priv->dir_gen) {
+        pthread_mutex_unlock (&priv->dir_lock);
+        if (free_key)
+            free_key (key);
+        dir_entry_free (entry);
+        return;
+    }
+
+    /* Org data is small; simply start over when a map is full. */
+    if (g_hash_table_size (map) >= (guint)priv->dir_size)
+        g_hash_table_remove_all (map);
+
+    entry->expire = time(NULL) + priv->dir_ttl;
+    g_hash_table_replace (map, key, entry);
+
+    pthread_mutex_unlock (&priv->dir_lock);
+}
+
+/* Drop @key from @map, or everything if @map is NULL. */
+static void
+dir_drop (CcnetOrgManagerPriv *priv, GHashTable *map, gconstpointer key)
+{
+    pthread_mutex_lock (&priv->dir_lock);
+
+    ++priv->dir_gen;
+    if (map) {
+        g_hash_table_remove (map, key);
+    } else {
+        g_hash_table_remove_all (priv->dir_by_prefix);
+        g_hash_table_remove_all (priv->dir_by_group);
+        g_hash_table_remove_all (priv->dir_by_user);
+    }
+
+    pthread_mutex_unlock (&priv->dir_lock);
+}
+
+/* Drop it here and on the other nodes. */
+static void
+dir_invalidate (CcnetOrgManagerPriv *priv, GHashTable *map,
+                gconstpointer key)
+{
+    char buf[16];
+
+    dir_drop (priv, map, key);
+    if (map == priv->dir_by_user) {
+        ccnet_cache_bus_publish ("org-user", key);
+    } else if (map == priv->dir_by_group) {
+        snprintf (buf, sizeof(buf), "%d", GPOINTER_TO_INT(key));
+        ccnet_cache_bus_publish ("org-group", buf);
+    } else {
+        ccnet_cache_bus_publish ("org", NULL);
+    }
+}
+
+/* A write on another node, see cache-bus.h. */
+static void
+on_cache_event (const char *domain, const char *key, void *vmanager)
+{
+    CcnetOrgManagerPriv *priv = ((CcnetOrgManager *)vmanager)->priv;
+
+    if (!key || strcmp (domain, "org") == 0)
+        dir_drop (priv, NULL, NULL);
+    else if (strcmp (domain, "org-user") == 0)
+        dir_drop (priv, priv->dir_by_user, key);
+    else if (strcmp (domain, "org-group") == 0)
+        dir_drop (priv, priv->dir_by_group, GINT_TO_POINTER(atoi (key)));
+}
+
+char *
+ccnet_org_manager_get_cache_stats (CcnetOrgManager *mgr)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    gint64 total;
+    char *ret;
+
+    pthread_mutex_lock (&priv->dir_lock);
+    total = priv->dir_hits + priv->dir_misses;
+    ret = g_strdup_printf ("url_prefixes %u\ngroups %u\nusers %u\n"
+                           "max %d\nttl %d\n"
+                           "hits %" G_GINT64_FORMAT "\n"
+                           "misses %" G_GINT64_FORMAT "\n"
+                           "hit_rate %.1f\n",
+                           g_hash_table_size (priv->dir_by_prefix),
+                           g_hash_table_size (priv->dir_by_group),
+                           g_hash_table_size (priv->dir_by_user),
+                           priv->dir_size, priv->dir_ttl,
+                           priv->dir_hits, priv->dir_misses,
+                           total ? 100.0 * priv->dir_hits / total : 0.0);
+    pthread_mutex_unlock (&priv->dir_lock);
+
+    return ret;
+}
+
+static gboolean
+append_shard_stats (CcnetDB *db, int shard, void *data)
+{
+    GString *buf = data;
+
+    g_string_append_printf (buf, "shard%d orgs %d users %d groups %d\n",
+                            shard,
+                            ccnet_db_get_int (db, "SELECT COUNT(DISTINCT org_id)"
+                                              " FROM OrgUser"),
+                            ccnet_db_get_int (db, "SELECT COUNT(*) FROM OrgUser"),
+                            ccnet_db_get_int (db, "SELECT COUNT(*) FROM OrgGroup"));
+    return TRUE;
+}
+
+char *
+ccnet_org_manager_get_shard_stats (CcnetOrgManager *mgr)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    GString *buf = g_string_new (NULL);
+
+    if (!priv->shards) {
+        g_string_append (buf, "shards 0\n");
+        return g_string_free (buf, FALSE);
+    }
+
+    g_string_append_printf (buf, "shards %d\n",
+                            ccnet_db_shards_count (priv->shards));
+    ccnet_db_shards_foreach (priv->shards, append_shard_stats, buf);
+    return g_string_free (buf, FALSE);
+}
+
+static void
+load_cache_config (CcnetOrgManager *manager)
+{
+    CcnetOrgManagerPriv *priv = manager->priv;
+    GKeyFile *keyf = manager->session->keyf;
+
+    if (g_key_file_has_key (keyf, "Organization", "CACHE_SIZE", NULL))
+        priv->dir_size = g_key_file_get_integer (keyf, "Organization",
+                                                 "CACHE_SIZE", NULL);
+    if (g_key_file_has_key (keyf, "Organization", "CACHE_TTL", NULL))
+        priv->dir_ttl = g_key_file_get_integer (keyf, "Organization",
+                                                "CACHE_TTL", NULL);
+}
 
 CcnetOrgManager* ccnet_org_manager_new (CcnetSession *session)
 {
     CcnetOrgManager *manager = g_new0 (CcnetOrgManager, 1);
+    CcnetOrgManagerPriv *priv;
 
     manager->session = session;
-    manager->priv = g_new0 (CcnetOrgManagerPriv, 1);
+    manager->priv = priv = g_new0 (CcnetOrgManagerPriv, 1);
+
+    pthread_mutex_init (&priv->dir_lock, NULL);
+    priv->dir_by_prefix = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, dir_entry_free);
+    priv->dir_by_group = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                NULL, dir_entry_free);
+    priv->dir_by_user = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, dir_entry_free);
+    priv->dir_size = DEFAULT_DIR_CACHE_SIZE;
+    priv->dir_ttl = DEFAULT_DIR_CACHE_TTL;
 
     return manager;
 }
@@ -28,6 +326,11 @@ CcnetOrgManager* ccnet_org_manager_new (CcnetSession *session)
 int
 ccnet_org_manager_prepare (CcnetOrgManager *manager)
 {
+    load_cache_config (manager);
+
+    ccnet_cache_bus_subscribe ("org", on_cache_event, manager);
+    ccnet_cache_bus_subscribe ("org-user", on_cache_event, manager);
+    ccnet_cache_bus_subscribe ("org-group", on_cache_event, manager);
     return open_db (manager);
 }
 
@@ -73,7 +376,9 @@ open_db (CcnetOrgManager *manager)
     }
     
     manager->priv->db = db;
-    return check_db_table (db);
+    if (check_db_table (db) < 0)
+        return -1;
+    return open_shards (manager);
 }
 
 void ccnet_org_manager_start (CcnetOrgManager *manager)
@@ -82,10 +387,77 @@ void ccnet_org_manager_start (CcnetOrgManager *manager)
 
 /* -------- Group Database Management ---------------- */
 
+/* Bump when the tables below change, so existing dbs are checked again. */
+#define ORG_SCHEMA_VERSION 2
+
+static int
+add_index (CcnetDB *db, const char *table, const char *index,
+           const char *columns)
+{
+    char sql[256];
+
+    if (ccnet_db_index_exists (db, table, index))
+        return 0;
+
+    snprintf (sql, sizeof(sql), "CREATE INDEX %s ON %s (%s)",
+              index, table, columns);
+    return ccnet_db_query (db, sql);
+}
+
+static int
+drop_index (CcnetDB *db, const char *table, const char *index)
+{
+    char sql[256];
+
+    if (!ccnet_db_index_exists (db, table, index))
+        return 0;
+
+    if (ccnet_db_type (db) == CCNET_DB_TYPE_MYSQL)
+        snprintf (sql, sizeof(sql), "DROP INDEX %s ON %s", index, table);
+    else
+        snprintf (sql, sizeof(sql), "DROP INDEX %s", index);
+    return ccnet_db_query (db, sql);
+}
+
+/*
+ * Version 2: indexes covering the per-request lookups, so they are
+ * answered from the index alone. They lead with the same columns as
+ * the single column indexes of version 1, which go.
+ *
+ *   OrgUser (email, org_id, is_staff)   orgs of a user, is_org_staff
+ *   OrgUser (org_id, email)             members of an org, org_user_exists
+ *   OrgGroup (group_id, org_id)         org of a group
+ *   OrgGroup (org_id, group_id)         groups of an org
+ *
+ * The (org_id, ...) ones are the unique indexes of version 1.
+ */
+static int
+upgrade_org_indexes (CcnetDB *db)
+{
+    gboolean mysql = (ccnet_db_type (db) == CCNET_DB_TYPE_MYSQL);
+
+    if (add_index (db, "OrgUser", "email_orgid_staff_indx",
+                   "email, org_id, is_staff") < 0)
+        return -1;
+    if (drop_index (db, "OrgUser", mysql ? "email" : "email_indx") < 0)
+        return -1;
+
+    if (add_index (db, "OrgGroup", "groupid_orgid_indx",
+                   "group_id, org_id") < 0)
+        return -1;
+    if (drop_index (db, "OrgGroup", mysql ? "group_id" : "groupid_indx") < 0)
+        return -1;
+
+    return 0;
+}
+
 static int check_db_table (CcnetDB *db)
 {
     char *sql;
 
+    if (ccnet_db_get_schema_version (db, "org") == ORG_SCHEMA_VERSION)
+        return 0;
+
     int db_type = ccnet_db_type (db);
     if (db_type == CCNET_DB_TYPE_MYSQL) {
         sql = "CREATE TABLE IF NOT EXISTS Organization (org_id INTEGER"
@@ -98,13 +470,14 @@ static int check_db_table (CcnetDB *db)
         
         sql = "CREATE TABLE IF NOT EXISTS OrgUser (org_id INTEGER, "
             "email VARCHAR(255), is_staff BOOL NOT NULL, "
-            "INDEX (email), UNIQUE INDEX (org_id, email))"
+            "INDEX email_orgid_staff_indx (email, org_id, is_staff), "
+            "UNIQUE INDEX (org_id, email))"
             "ENGINE=INNODB";
         if (ccnet_db_query (db, sql) < 0)
             return -1;
 
         sql = "CREATE TABLE IF NOT EXISTS OrgGroup (org_id INTEGER, "
-            "group_id INTEGER, INDEX (group_id), "
+            "group_id INTEGER, INDEX groupid_orgid_indx (group_id, org_id), "
             "UNIQUE INDEX (org_id, group_id))"
             "ENGINE=INNODB";
         if (ccnet_db_query (db, sql) < 0)
@@ -128,11 +501,6 @@ static int check_db_table (CcnetDB *db)
         if (ccnet_db_query (db, sql) < 0)
             return -1;
 
-        sql = "CREATE INDEX IF NOT EXISTS email_indx on "
-            "OrgUser (email)";
-        if (ccnet_db_query (db, sql) < 0)
-            return -1;
-
         sql = "CREATE UNIQUE INDEX IF NOT EXISTS orgid_email_indx on "
             "OrgUser (org_id, email)";
         if (ccnet_db_query (db, sql) < 0)
@@ -143,26 +511,128 @@ static int check_db_table (CcnetDB *db)
         if (ccnet_db_query (db, sql) < 0)
             return -1;
 
-        sql = "CREATE INDEX IF NOT EXISTS groupid_indx on OrgGroup (group_id)";
-        if (ccnet_db_query (db, sql) < 0)
-            return -1;
-
         sql = "CREATE UNIQUE INDEX IF NOT EXISTS org_group_indx on "
             "OrgGroup (org_id, group_id)";
         if (ccnet_db_query (db, sql) < 0)
             return -1;
     }
 
+    if (upgrade_org_indexes (db) < 0)
+        return -1;
+
+    return ccnet_db_set_schema_version (db, "org", ORG_SCHEMA_VERSION);
+}
+
+/*
+ * With [Database] ORG_SHARDS, the OrgUser and OrgGroup rows of an org
+ * are on its shard, see ccnet_db_shards_new(); Organization stays in
+ * the directory. The directory also keeps which orgs each user is in
+ * and which org each group is in. This way the lookups by email and by
+ * group don't have to go to every shard. Rows of orgs still on the
+ * directory are indexed at every start, so sharding can be turned on
+ * for an existing database. Once on, it must stay on: writes made
+ * without it would be missing from the indexes. Sharding is MySQL only.
+ */
+static int
+check_shard_index_tables (CcnetDB *db)
+{
+    if (ccnet_db_query (db, "CREATE TABLE IF NOT EXISTS OrgUserIndex ("
+                        "email VARCHAR(255), org_id INTEGER, "
+                        "UNIQUE INDEX (email, org_id), INDEX (org_id))"
+                        "ENGINE=INNODB") < 0)
+        return -1;
+    if (ccnet_db_query (db, "CREATE TABLE IF NOT EXISTS OrgGroupIndex ("
+                        "group_id INTEGER, org_id INTEGER, "
+                        "UNIQUE INDEX (group_id, org_id), INDEX (org_id))"
+                        "ENGINE=INNODB") < 0)
+        return -1;
+
+    if (ccnet_db_query (db, "INSERT IGNORE INTO OrgUserIndex (email, org_id)"
+                        " SELECT email, org_id FROM OrgUser") < 0)
+        return -1;
+    return ccnet_db_query (db, "INSERT IGNORE INTO OrgGroupIndex"
+                           " (group_id, org_id)"
+                           " SELECT group_id, org_id FROM OrgGroup");
+}
+
+static int
+open_shards (CcnetOrgManager *manager)
+{
+    CcnetOrgManagerPriv *priv = manager->priv;
+    CcnetDBShards *shards;
+    int i;
+
+    shards = ((CcnetServerSession *)manager->session)->org_shards;
+    if (!shards)
+        return 0;
+
+    /* the shards have the same schema, only the org-scoped tables of
+     * it are used there */
+    for (i = 1; i <= ccnet_db_shards_count (shards); ++i)
+        if (check_db_table (ccnet_db_shards_get_db (shards, i)) < 0)
+            return -1;
+    if (check_shard_index_tables (priv->db) < 0)
+        return -1;
+
+    priv->shards = shards;
+    return 0;
+}
+
+/* Where the OrgUser and OrgGroup rows of @org_id are, NULL on error. */
+static CcnetDB *
+org_db (CcnetOrgManagerPriv *priv, int org_id)
+{
+    if (!priv->shards)
+        return priv->db;
+    return ccnet_db_shards_for_org (priv->shards, org_id);
+}
+
+static int
+insert_org_user (CcnetOrgManagerPriv *priv, int org_id, const char *email,
+                 int is_staff)
+{
+    CcnetDB *db = org_db (priv, org_id);
+    char sql[512];
+
+    if (!db)
+        return -1;
+
+    snprintf (sql, sizeof(sql), "INSERT INTO OrgUser values (%d, '%s', %d)",
+              org_id, email, is_staff);
+    if (ccnet_db_query (db, sql) < 0)
+        return -1;
+
+    if (priv->shards &&
+        ccnet_db_statement_query (priv->db, "INSERT IGNORE INTO OrgUserIndex"
+                                  " (email, org_id) VALUES (?, ?)",
+                                  2, "string", email, "int", org_id) < 0) {
+        snprintf (sql, sizeof(sql), "DELETE FROM OrgUser WHERE org_id=%d AND "
+                  "email='%s'", org_id, email);
+        ccnet_db_query (db, sql);
+        return -1;
+    }
     return 0;
 }
 
+/* See change-log.h */
+static void
+log_org_change (const char *domain, const char *op, int org_id,
+                const char *arg)
+{
+    char buf[16];
+
+    snprintf (buf, sizeof(buf), "%d", org_id);
+    ccnet_change_log_record (domain, op, buf, arg);
+}
+
 int ccnet_org_manager_create_org (CcnetOrgManager *mgr,
                                   const char *org_name,
                                   const char *url_prefix,
                                   const char *creator,
                                   GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    CcnetDB *db = priv->db;
     gint64 now = get_current_time();
     char sql[512];
 
@@ -183,15 +653,19 @@ int ccnet_org_manager_create_org (CcnetOrgManager *mgr,
         return -1;
     }
 
-    snprintf (sql, sizeof(sql), "INSERT INTO OrgUser values (%d, '%s', %d)",
-              org_id, creator, 1);
-    if (ccnet_db_query (db, sql) < 0) {
+    if ((priv->shards && !ccnet_db_shards_assign (priv->shards, org_id)) ||
+        insert_org_user (priv, org_id, creator, 1) < 0) {
         snprintf (sql, sizeof(sql), "DELETE FROM Organization WHERE org_id=%d",
                   org_id);
         ccnet_db_query (db, sql);
+        if (priv->shards)
+            ccnet_db_shards_forget (priv->shards, org_id);
         g_set_error (error, CCNET_DOMAIN, 0, "Failed to create organization");
         return -1;
     }
+
+    dir_invalidate (mgr->priv, NULL, NULL);
+    log_org_change ("org", "create", org_id, NULL);
     
     return org_id;
 }
@@ -201,20 +675,36 @@ ccnet_org_manager_remove_org (CcnetOrgManager *mgr,
                               int org_id,
                               GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    CcnetDB *db = org_db (priv, org_id);
     char sql[512];
 
     snprintf (sql, sizeof(sql), "DELETE FROM Organization WHERE org_id = %d",
               org_id);
-    ccnet_db_query (db, sql);
+    ccnet_db_query (priv->db, sql);
 
-    snprintf (sql, sizeof(sql), "DELETE FROM OrgUser WHERE org_id = %d",
-              org_id);
-    ccnet_db_query (db, sql);
+    if (db) {
+        snprintf (sql, sizeof(sql), "DELETE FROM OrgUser WHERE org_id = %d",
+                  org_id);
+        ccnet_db_query (db, sql);
 
-    snprintf (sql, sizeof(sql), "DELETE FROM OrgGroup WHERE org_id = %d",
-              org_id);
-    ccnet_db_query (db, sql);
+        snprintf (sql, sizeof(sql), "DELETE FROM OrgGroup WHERE org_id = %d",
+                  org_id);
+        ccnet_db_query (db, sql);
+    }
+
+    if (priv->shards) {
+        snprintf (sql, sizeof(sql), "DELETE FROM OrgUserIndex "
+                  "WHERE org_id = %d", org_id);
+        ccnet_db_query (priv->db, sql);
+        snprintf (sql, sizeof(sql), "DELETE FROM OrgGroupIndex "
+                  "WHERE org_id = %d", org_id);
+        ccnet_db_query (priv->db, sql);
+        ccnet_db_shards_forget (priv->shards, org_id);
+    }
+
+    dir_invalidate (mgr->priv, NULL, NULL);
+    log_org_change ("org", "remove", org_id, NULL);
 
     return 0;
 }
@@ -268,6 +758,30 @@ ccnet_org_manager_get_all_orgs (CcnetOrgManager *mgr,
     return g_list_reverse (ret);
 }
 
+GList *
+ccnet_org_manager_get_all_orgs_after (CcnetOrgManager *mgr,
+                                      int last_id,
+                                      int limit)
+{
+    GList *ret = NULL;
+
+    if (ccnet_db_statement_foreach_row (mgr->priv->db,
+                                        "SELECT org_id, org_name, url_prefix, "
+                                        "creator, ctime FROM Organization "
+                                        "WHERE org_id > ? "
+                                        "ORDER BY org_id LIMIT ?",
+                                        get_all_orgs_cb, &ret,
+                                        2, "int", last_id, "int", limit) < 0) {
+        while (ret != NULL) {
+            g_object_unref (ret->data);
+            ret = g_list_delete_link (ret, ret);
+        }
+        return NULL;
+    }
+
+    return g_list_reverse (ret);
+}
+
 static gboolean
 get_org_cb (CcnetDBRow *row, void *data)
 {
@@ -294,22 +808,59 @@ get_org_cb (CcnetDBRow *row, void *data)
     return FALSE;
 }
 
+static gboolean
+get_org_info_cb (CcnetDBRow *row, void *data)
+{
+    OrgInfo **p_info = data;
+
+    *p_info = org_info_from_row (row, 0);
+    return FALSE;
+}
+
+static void
+copy_dir_org (DirEntry *entry, void *data)
+{
+    CcnetOrganization **p_org = data;
+
+    *p_org = entry->org ? org_info_to_org (entry->org, NULL) : NULL;
+}
+
 CcnetOrganization *
 ccnet_org_manager_get_org_by_url_prefix (CcnetOrgManager *mgr,
                                          const char *url_prefix,
                                          GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
+    CcnetOrgManagerPriv *priv = mgr->priv;
     char sql[512];
     CcnetOrganization *org = NULL;
+    OrgInfo *info = NULL;
+    DirEntry *entry;
+    guint gen;
+
+    if (!url_prefix)
+        return NULL;
+
+    if (dir_lookup (priv, priv->dir_by_prefix, url_prefix,
+                    copy_dir_org, &org, &gen))
+        return org;
 
     snprintf (sql, sizeof(sql), "SELECT org_id, org_name, url_prefix, creator,"
               " ctime FROM Organization WHERE url_prefix = '%s'", url_prefix);    
 
-    if (ccnet_db_foreach_selected_row (db, sql, get_org_cb, &org) < 0) {
+    if (ccnet_db_foreach_selected_row (priv->db, sql,
+                                       get_org_info_cb, &info) < 0) {
+        org_info_free (info);
         return NULL;
     }
 
+    if (info)
+        org = org_info_to_org (info, NULL);
+
+    entry = g_new0 (DirEntry, 1);
+    entry->org = info;
+    dir_insert (priv, priv->dir_by_prefix, g_strdup (url_prefix),
+                entry, gen, g_free);
+
     return org;
 }
 
@@ -339,13 +890,13 @@ ccnet_org_manager_add_org_user (CcnetOrgManager *mgr,
                                 int is_staff,
                                 GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
-    char sql[512];
-
-    snprintf (sql, sizeof(sql), "INSERT INTO OrgUser values (%d, '%s', %d)",
-              org_id, email, is_staff);
+    int ret;
 
-    return ccnet_db_query (db, sql);
+    ret = insert_org_user (mgr->priv, org_id, email, is_staff);
+    dir_invalidate (mgr->priv, mgr->priv->dir_by_user, email);
+    if (ret == 0)
+        log_org_change ("org-user", "add", org_id, email);
+    return ret;
 }
 
 int
@@ -354,70 +905,139 @@ ccnet_org_manager_remove_org_user (CcnetOrgManager *mgr,
                                    const char *email,
                                    GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    CcnetDB *db = org_db (priv, org_id);
     char sql[512];
+    int ret;
+
+    if (!db)
+        return -1;
 
     snprintf (sql, sizeof(sql), "DELETE FROM OrgUser WHERE org_id=%d AND "
               "email='%s'", org_id, email);
 
-    return ccnet_db_query (db, sql);
+    ret = ccnet_db_query (db, sql);
+    if (ret == 0 && priv->shards)
+        ret = ccnet_db_statement_query (priv->db, "DELETE FROM OrgUserIndex"
+                                        " WHERE email=? AND org_id=?",
+                                        2, "string", email, "int", org_id);
+    dir_invalidate (mgr->priv, mgr->priv->dir_by_user, email);
+    if (ret == 0)
+        log_org_change ("org-user", "remove", org_id, email);
+    return ret;
 }
 
 static gboolean
 get_orgs_by_user_cb (CcnetDBRow *row, void *data)
 {
     GList **p_list = (GList **)data;
-    CcnetOrganization *org = NULL;
-    int org_id;
-    const char *email;
     int is_staff;
-    const char *org_name;
-    const char *url_prefix;
-    const char *creator;
-    gint64 ctime;
 
-    org_id = ccnet_db_row_get_column_int (row, 0);
-    email = (char *) ccnet_db_row_get_column_text (row, 1);
-    is_staff = ccnet_db_row_get_column_int (row, 2);
-    org_name = (char *) ccnet_db_row_get_column_text (row, 3);
-    url_prefix = (char *) ccnet_db_row_get_column_text (row, 4);
-    creator = (char *) ccnet_db_row_get_column_text (row, 5);
-    ctime = ccnet_db_row_get_column_int64 (row, 6);
-    
-    org = g_object_new (CCNET_TYPE_ORGANIZATION,
-                        "org_id", org_id,
-                        "email", email,
-                        "is_staff", is_staff,
-                        "org_name", org_name,
-                        "url_prefix", url_prefix,
-                        "creator", creator,
-                        "ctime", ctime,
-                        NULL);
-    *p_list = g_list_prepend (*p_list, org);
+    is_staff = ccnet_db_row_get_column_int (row, 5);
+    *p_list = g_list_prepend (*p_list, org_info_from_row (row, is_staff));
         
     return TRUE;
 }
 
+/* With shards the orgs come from OrgUserIndex and is_staff from the
+ * OrgUser row on the shard of each org. */
+static gboolean
+collect_org_info_cb (CcnetDBRow *row, void *data)
+{
+    GList **p_list = (GList **)data;
+
+    *p_list = g_list_prepend (*p_list, org_info_from_row (row, 0));
+    return TRUE;
+}
+
+static int
+read_staff_flags (CcnetOrgManagerPriv *priv, GList *infos, const char *email)
+{
+    OrgInfo *info;
+    CcnetDB *db;
+    char sql[512];
+    GList *ptr;
+
+    for (ptr = infos; ptr; ptr = ptr->next) {
+        info = ptr->data;
+        db = org_db (priv, info->org_id);
+        if (!db)
+            return -1;
+        snprintf (sql, sizeof(sql), "SELECT is_staff FROM OrgUser "
+                  "WHERE org_id=%d AND email='%s'", info->org_id, email);
+        info->is_staff = (ccnet_db_get_int (db, sql) == 1);
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *email;
+    GList *orgs;
+} UserOrgsData;
+
+static void
+copy_dir_orgs (DirEntry *entry, void *data)
+{
+    UserOrgsData *d = data;
+    GList *ptr;
+
+    for (ptr = entry->orgs; ptr; ptr = ptr->next)
+        d->orgs = g_list_prepend (d->orgs, org_info_to_org (ptr->data,
+                                                             d->email));
+    d->orgs = g_list_reverse (d->orgs);
+}
+
 GList *
 ccnet_org_manager_get_orgs_by_user (CcnetOrgManager *mgr,
                                    const char *email,
                                    GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
+    CcnetOrgManagerPriv *priv = mgr->priv;
     char sql[512];
-    GList *ret = NULL;
-
-    snprintf (sql, sizeof(sql), "SELECT t1.org_id, email, is_staff, org_name,"
-              " url_prefix, creator, ctime FROM OrgUser t1, Organization t2"
-              " WHERE t1.org_id = t2.org_id AND email = '%s'", email);
+    GList *infos = NULL;
+    UserOrgsData data;
+    DirEntry *entry;
+    guint gen;
 
-    if (ccnet_db_foreach_selected_row (db, sql, get_orgs_by_user_cb,
-                                       &ret) < 0) {
-        g_list_free (ret);
+    if (!email)
         return NULL;
+
+    data.email = email;
+    data.orgs = NULL;
+    if (dir_lookup (priv, priv->dir_by_user, email,
+                    copy_dir_orgs, &data, &gen))
+        return data.orgs;
+
+    entry = g_new0 (DirEntry, 1);
+    if (!priv->shards) {
+        snprintf (sql, sizeof(sql), "SELECT t1.org_id, org_name, url_prefix,"
+                  " creator, ctime, is_staff FROM OrgUser t1, Organization t2"
+                  " WHERE t1.org_id = t2.org_id AND email = '%s'", email);
+        if (ccnet_db_foreach_selected_row (priv->db, sql,
+                                           get_orgs_by_user_cb, &infos) < 0) {
+            entry->orgs = infos;
+            dir_entry_free (entry);
+            return NULL;
+        }
+    } else {
+        snprintf (sql, sizeof(sql), "SELECT t1.org_id, org_name, url_prefix,"
+                  " creator, ctime FROM OrgUserIndex t1, Organization t2"
+                  " WHERE t1.org_id = t2.org_id AND email = '%s'", email);
+        if (ccnet_db_foreach_selected_row (priv->db, sql,
+                                           collect_org_info_cb, &infos) < 0 ||
+            read_staff_flags (priv, infos, email) < 0) {
+            entry->orgs = infos;
+            dir_entry_free (entry);
+            return NULL;
+        }
     }
+    entry->orgs = g_list_reverse (infos);
 
-    return g_list_reverse (ret);
+    copy_dir_orgs (entry, &data);
+    dir_insert (priv, priv->dir_by_user, g_strdup (email),
+                entry, gen, g_free);
+
+    return data.orgs;
 }
 
 static gboolean
@@ -435,13 +1055,28 @@ ccnet_org_manager_get_org_emailusers (CcnetOrgManager *mgr,
                                       const char *url_prefix,
                                       int start, int limit)
 {
-    CcnetDB *db = mgr->priv->db;
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    CcnetDB *db = priv->db;
     char sql[512];
     GList *ret = NULL;
+    int org_id;
 
-    snprintf (sql, sizeof(sql), "SELECT email FROM OrgUser WHERE org_id ="
-              " (SELECT org_id FROM Organization WHERE url_prefix = '%s')"
-              " LIMIT %d, %d", url_prefix, start, limit);
+    /* Ordered, so pages don't overlap; the (org_id, email) index gives
+     * that order for free. */
+    if (!priv->shards) {
+        snprintf (sql, sizeof(sql), "SELECT email FROM OrgUser WHERE org_id ="
+                  " (SELECT org_id FROM Organization WHERE url_prefix = '%s')"
+                  " ORDER BY email LIMIT %d, %d", url_prefix, start, limit);
+    } else {
+        snprintf (sql, sizeof(sql), "SELECT org_id FROM Organization "
+                  "WHERE url_prefix = '%s'", url_prefix);
+        org_id = ccnet_db_get_int (priv->db, sql);
+        if (org_id < 0 || !(db = org_db (priv, org_id)))
+            return NULL;
+        snprintf (sql, sizeof(sql), "SELECT email FROM OrgUser WHERE "
+                  "org_id = %d ORDER BY email LIMIT %d, %d",
+                  org_id, start, limit);
+    }
     
     ccnet_db_foreach_selected_row (db, sql, get_org_emailusers, &ret);
 
@@ -454,13 +1089,35 @@ ccnet_org_manager_add_org_group (CcnetOrgManager *mgr,
                                  int group_id,
                                  GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    CcnetDB *db = org_db (priv, org_id);
     char sql[512];
+    int ret;
+
+    if (!db)
+        return -1;
 
     snprintf (sql, sizeof(sql), "INSERT INTO OrgGroup VALUES (%d, %d)",
               org_id, group_id);
     
-    return ccnet_db_query (db, sql);
+    ret = ccnet_db_query (db, sql);
+    if (ret == 0 && priv->shards) {
+        snprintf (sql, sizeof(sql), "INSERT IGNORE INTO OrgGroupIndex "
+                  "VALUES (%d, %d)", group_id, org_id);
+        if ((ret = ccnet_db_query (priv->db, sql)) < 0) {
+            snprintf (sql, sizeof(sql), "DELETE FROM OrgGroup WHERE "
+                      "org_id=%d AND group_id=%d", org_id, group_id);
+            ccnet_db_query (db, sql);
+        }
+    }
+    dir_invalidate (mgr->priv, mgr->priv->dir_by_group,
+                    GINT_TO_POINTER(group_id));
+    if (ret == 0) {
+        char buf[16];
+        snprintf (buf, sizeof(buf), "%d", group_id);
+        log_org_change ("org-group", "add", org_id, buf);
+    }
+    return ret;
 }
 
 int
@@ -469,13 +1126,74 @@ ccnet_org_manager_remove_org_group (CcnetOrgManager *mgr,
                                     int group_id,
                                     GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    CcnetDB *db = org_db (priv, org_id);
     char sql[512];
+    int ret;
+
+    if (!db)
+        return -1;
 
     snprintf (sql, sizeof(sql), "DELETE FROM OrgGroup WHERE org_id=%d"
               " AND group_id=%d", org_id, group_id);
     
-    return ccnet_db_query (db, sql);
+    ret = ccnet_db_query (db, sql);
+    if (ret == 0 && priv->shards) {
+        snprintf (sql, sizeof(sql), "DELETE FROM OrgGroupIndex WHERE "
+                  "group_id=%d AND org_id=%d", group_id, org_id);
+        ret = ccnet_db_query (priv->db, sql);
+    }
+    dir_invalidate (mgr->priv, mgr->priv->dir_by_group,
+                    GINT_TO_POINTER(group_id));
+    if (ret == 0) {
+        char buf[16];
+        snprintf (buf, sizeof(buf), "%d", group_id);
+        log_org_change ("org-group", "remove", org_id, buf);
+    }
+    return ret;
+}
+
+static gboolean
+get_org_id_cb (CcnetDBRow *row, void *data)
+{
+    int *p_org_id = data;
+
+    *p_org_id = ccnet_db_row_get_column_int (row, 0);
+    return FALSE;
+}
+
+static void
+copy_dir_org_id (DirEntry *entry, void *data)
+{
+    *(int *)data = entry->org_id;
+}
+
+/* Org of @group_id, -1 if it's not an org group or on error. */
+static int
+lookup_group_org (CcnetOrgManager *mgr, int group_id)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    char sql[256];
+    int org_id = -1;
+    DirEntry *entry;
+    guint gen;
+
+    if (dir_lookup (priv, priv->dir_by_group, GINT_TO_POINTER(group_id),
+                    copy_dir_org_id, &org_id, &gen))
+        return org_id;
+
+    snprintf (sql, sizeof(sql), "SELECT org_id FROM %s WHERE group_id = %d",
+              priv->shards ? "OrgGroupIndex" : "OrgGroup", group_id);
+    if (ccnet_db_foreach_selected_row (priv->db, sql,
+                                       get_org_id_cb, &org_id) < 0)
+        return -1;
+
+    entry = g_new0 (DirEntry, 1);
+    entry->org_id = org_id;
+    dir_insert (priv, priv->dir_by_group, GINT_TO_POINTER(group_id),
+                entry, gen, NULL);
+
+    return org_id;
 }
 
 int
@@ -483,13 +1201,7 @@ ccnet_org_manager_is_org_group (CcnetOrgManager *mgr,
                                 int group_id,
                                 GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
-    char sql[256];
-
-    snprintf (sql, sizeof(sql), "SELECT group_id FROM OrgGroup "
-              "WHERE group_id = %d", group_id);
-
-    return ccnet_db_check_for_existence (db, sql);    
+    return lookup_group_org (mgr, group_id) >= 0;
 }
 
 int
@@ -497,12 +1209,7 @@ ccnet_org_manager_get_org_id_by_group (CcnetOrgManager *mgr,
                                        int group_id,
                                        GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
-    char sql[256];
-
-    snprintf (sql, sizeof(sql), "SELECT org_id FROM OrgGroup "
-              "WHERE group_id = %d", group_id);
-    return ccnet_db_get_int (db, sql);
+    return lookup_group_org (mgr, group_id);
 }
 
 static gboolean
@@ -523,16 +1230,20 @@ ccnet_org_manager_get_org_groups (CcnetOrgManager *mgr,
                                   int start,
                                   int limit)
 {
-    CcnetDB *db = mgr->priv->db;
+    CcnetDB *db = org_db (mgr->priv, org_id);
     char sql[512];
     GList *ret = NULL;
 
+    if (!db)
+        return NULL;
+
     if (limit == -1) {
         snprintf (sql, sizeof(sql), "SELECT group_id FROM OrgGroup WHERE "
-                  "org_id = %d", org_id);
+                  "org_id = %d ORDER BY group_id", org_id);
     } else {
         snprintf (sql, sizeof(sql), "SELECT group_id FROM OrgGroup WHERE "
-                  "org_id = %d LIMIT %d, %d", org_id, start, limit);
+                  "org_id = %d ORDER BY group_id LIMIT %d, %d",
+                  org_id, start, limit);
     }
     
     if (ccnet_db_foreach_selected_row (db, sql, get_org_groups, &ret) < 0) {
@@ -549,10 +1260,13 @@ ccnet_org_manager_org_user_exists (CcnetOrgManager *mgr,
                                    const char *email,
                                    GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
+    CcnetDB *db = org_db (mgr->priv, org_id);
     char sql[512];
 
-    snprintf (sql, sizeof(sql), "SELECT org_id FROM OrgUser WHERE "
+    if (!db)
+        return -1;
+
+    snprintf (sql, sizeof(sql), "SELECT 1 FROM OrgUser WHERE "
               "org_id = %d AND email = '%s'", org_id, email);
 
     return ccnet_db_check_for_existence (db, sql);
@@ -578,11 +1292,111 @@ ccnet_org_manager_is_org_staff (CcnetOrgManager *mgr,
                                 const char *email,
                                 GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
+    CcnetDB *db = org_db (mgr->priv, org_id);
     char sql[256];
 
+    if (!db)
+        return -1;
+
     snprintf (sql, sizeof(sql), "SELECT is_staff FROM OrgUser "
               "WHERE org_id=%d AND email='%s'", org_id, email);
 
     return ccnet_db_get_int (db, sql);    
 }
+
+static void
+free_org_infos (GList *infos)
+{
+    GList *ptr;
+
+    for (ptr = infos; ptr; ptr = ptr->next)
+        org_info_free (ptr->data);
+    g_list_free (infos);
+}
+
+static gboolean
+collect_group_org_cb (CcnetDBRow *row, void *data)
+{
+    GArray *pairs = data;
+    int pair[2];
+
+    pair[0] = ccnet_db_row_get_column_int (row, 0);
+    pair[1] = ccnet_db_row_get_column_int (row, 1);
+    g_array_append_vals (pairs, pair, 2);
+    return TRUE;
+}
+
+int
+ccnet_org_manager_preload (CcnetOrgManager *mgr)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    GList *infos = NULL, *ptr;
+    GArray *pairs;
+    DirEntry *entry;
+    OrgInfo *info;
+    char sql[256], group_sql[256];
+    time_t expire;
+    guint gen, i;
+    int n = 0;
+
+    if (priv->dir_size <= 0)
+        return 0;
+
+    pthread_mutex_lock (&priv->dir_lock);
+    gen = priv->dir_gen;
+    pthread_mutex_unlock (&priv->dir_lock);
+
+    /* The newest first, should there be more than the maps hold. */
+    pairs = g_array_new (FALSE, FALSE, sizeof(int));
+    snprintf (sql, sizeof(sql), "SELECT org_id, org_name, url_prefix, creator,"
+              " ctime FROM Organization ORDER BY org_id DESC LIMIT %d",
+              priv->dir_size);
+    snprintf (group_sql, sizeof(group_sql), "SELECT group_id, org_id FROM %s "
+              "ORDER BY group_id DESC LIMIT %d",
+              priv->shards ? "OrgGroupIndex" : "OrgGroup", priv->dir_size);
+    if (ccnet_db_foreach_selected_row (priv->db, sql, collect_org_info_cb,
+                                       &infos) < 0 ||
+        ccnet_db_foreach_selected_row (priv->db, group_sql,
+                                       collect_group_org_cb, pairs) < 0) {
+        free_org_infos (infos);
+        g_array_free (pairs, TRUE);
+        return -1;
+    }
+    infos = g_list_reverse (infos);
+
+    /* What was read before an invalidation may be stale, as in
+     * dir_insert(). Entries looked up meanwhile are newer and kept. */
+    pthread_mutex_lock (&priv->dir_lock);
+    if (gen == priv->dir_gen) {
+        expire = time(NULL) + priv->dir_ttl;
+        for (ptr = infos; ptr; ptr = ptr->next) {
+            info = ptr->data;
+            if (!info->url_prefix ||
+                g_hash_table_lookup (priv->dir_by_prefix, info->url_prefix))
+                continue;
+            entry = g_new0 (DirEntry, 1);
+            entry->org = info;
+            entry->expire = expire;
+            ptr->data = NULL;
+            g_hash_table_insert (priv->dir_by_prefix,
+                                 g_strdup (info->url_prefix), entry);
+            ++n;
+        }
+        for (i = 0; i + 1 < pairs->len; i += 2) {
+            gpointer key = GINT_TO_POINTER(g_array_index (pairs, int, i));
+
+            if (g_hash_table_lookup (priv->dir_by_group, key))
+                continue;
+            entry = g_new0 (DirEntry, 1);
+            entry->org_id = g_array_index (pairs, int, i + 1);
+            entry->expire = expire;
+            g_hash_table_insert (priv->dir_by_group, key, entry);
+            ++n;
+        }
+    }
+    pthread_mutex_unlock (&priv->dir_lock);
+
+    free_org_infos (infos);
+    g_array_free (pairs, TRUE);
+    return n;
+}
@@ -23,6 +23,22 @@ ccnet_org_manager_prepare (CcnetOrgManager *manager);
 void
 ccnet_org_manager_start (CcnetOrgManager *manager);
 
+/* Size and hit rate of the org directory cache, as "<key> <value>"
+ * lines. */
+char *
+ccnet_org_manager_get_cache_stats (CcnetOrgManager *mgr);
+
+/* "shards <n>" and then "shard<i> orgs <n> users <n> groups <n>" for
+ * the directory, shard0, and each shard. */
+char *
+ccnet_org_manager_get_shard_stats (CcnetOrgManager *mgr);
+
+/* For the startup preload: fill the url prefix and group maps of the
+ * directory cache with the newest orgs. Returns the number of entries
+ * cached, -1 on error. Any thread. */
+int
+ccnet_org_manager_preload (CcnetOrgManager *mgr);
+
 int
 ccnet_org_manager_create_org (CcnetOrgManager *mgr,
                               const char *org_name,
@@ -40,6 +56,13 @@ ccnet_org_manager_get_all_orgs (CcnetOrgManager *mgr,
                                 int start,
                                 int limit);
 
+/* Organizations with id greater than @last_id, see
+ * ccnet_user_manager_get_emailusers_after(). */
+GList *
+ccnet_org_manager_get_all_orgs_after (CcnetOrgManager *mgr,
+                                      int last_id,
+                                      int limit);
+
 CcnetOrganization *
 ccnet_org_manager_get_org_by_url_prefix (CcnetOrgManager *mgr,
                                          const char *url_prefix,
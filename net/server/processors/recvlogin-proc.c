@@ -10,6 +10,7 @@
 #include "user-mgr.h" 
 #include "recvlogin-proc.h"
 #include "server-session.h"
+#include "job-mgr.h"
 
 #define SC_ERR_WRONG_PASSWD "301"
 #define SS_ERR_WRONG_PASSWD "wrong password"
@@ -20,6 +21,20 @@
 
 G_DEFINE_TYPE (CcnetRecvloginProc, ccnet_recvlogin_proc, CCNET_TYPE_PROCESSOR)
 
+/* The checks hit the user database, so they run in its thread pool
+ * on a copy of the arguments. */
+typedef struct {
+    CcnetUserManager *user_mgr;
+    char peer_id[41];
+    char *email;
+    char *passwd;
+    const char *code;
+    const char *code_msg;
+} CcnetRecvloginProcPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), CCNET_TYPE_RECVLOGIN_PROC, CcnetRecvloginProcPriv))
+
 static int start (CcnetProcessor *processor, int argc, char **argv);
 static void handle_update (CcnetProcessor *processor,
                            char *code, char *code_msg,
@@ -28,7 +43,10 @@ static void handle_update (CcnetProcessor *processor,
 static void
 release_resource(CcnetProcessor *processor)
 {
-    /* FILL IT */
+    CcnetRecvloginProcPriv *priv = GET_PRIV (processor);
+
+    g_free (priv->email);
+    g_free (priv->passwd);
 
     CCNET_PROCESSOR_CLASS (ccnet_recvlogin_proc_parent_class)->release_resource (processor);
 }
@@ -42,6 +60,8 @@ ccnet_recvlogin_proc_class_init (CcnetRecvloginProcClass *klass)
     proc_class->start = start;
     proc_class->handle_update = handle_update;
     proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof(CcnetRecvloginProcPriv));
 }
 
 static void
@@ -49,60 +69,75 @@ ccnet_recvlogin_proc_init (CcnetRecvloginProc *processor)
 {
 }
 
-static void
-check_emailuser (CcnetProcessor *processor,
-                 const char *email, const char *passwd)
+static void *
+check_emailuser (void *vprocessor)
 {
+    CcnetRecvloginProcPriv *priv = GET_PRIV (vprocessor);
+    CcnetUserManager *user_mgr = priv->user_mgr;
     char *prev_email;
-    CcnetUserManager *user_mgr = 
-        ((CcnetServerSession *)processor->session)->user_mgr;
+
+    priv->code = SC_OK;
+    priv->code_msg = SS_OK;
 
     prev_email = ccnet_user_manager_get_binding_email (user_mgr,
-                                                       processor->peer->id);
+                                                       priv->peer_id);
     if (prev_email) {
         /* This peer id has already been binded to some email address. */
-        ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
-        
+
     } else if (!ccnet_user_manager_validate_emailuser (user_mgr,
-                                               email, passwd)) {
-        
-        ccnet_processor_send_response (processor, SC_ERR_WRONG_PASSWD,
-                                       SS_ERR_WRONG_PASSWD, NULL, 0);
+                                               priv->email, priv->passwd)) {
+        priv->code = SC_ERR_WRONG_PASSWD;
+        priv->code_msg = SS_ERR_WRONG_PASSWD;
 
     } else {
-        CcnetPeer *peer = processor->peer;
         /* ccnet_peer_manager_add_role (session->peer_mgr, peer, "MyClient"); */
         /* ccnet_debug ("add role 'MyClient' for peer %.10s\n", peer->id); */
-        if (ccnet_user_manager_add_binding (user_mgr, email, 
-                                            peer->id) < 0) {
+        if (ccnet_user_manager_add_binding (user_mgr, priv->email,
+                                            priv->peer_id) < 0) {
             ccnet_warning ("Failed to add binding for email(%s), user(%.10s)\n",
-                           email, peer->id);
-
-            ccnet_processor_send_response (processor,
-                                           SC_INTERNAL_ERROR,
-                                           SS_INTERNAL_ERROR,
-                                           NULL, 0);
+                           priv->email, priv->peer_id);
+            priv->code = SC_INTERNAL_ERROR;
+            priv->code_msg = SS_INTERNAL_ERROR;
         }
-        ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
     }
     g_free (prev_email);
+
+    return vprocessor;
+}
+
+static void
+check_emailuser_done (void *vprocessor)
+{
+    CcnetProcessor *processor = vprocessor;
+    CcnetRecvloginProcPriv *priv = GET_PRIV (processor);
+
+    ccnet_processor_send_response (processor, priv->code, priv->code_msg,
+                                   NULL, 0);
+    ccnet_processor_done (processor, TRUE);
 }
 
 static int
 start (CcnetProcessor *processor, int argc, char **argv)
 {
+    CcnetRecvloginProcPriv *priv = GET_PRIV (processor);
+
     if (argc != 2 || !argv[0] || !argv[1]) {
         ccnet_processor_error (processor, SC_BAD_ARGS, SS_BAD_ARGS);
         return -1;
     }
-    char *email = argv[0];
-    char *passwd = argv[1];
     /* ccnet_message ("receive login info from %s : email(%s), passwd(%s)\n", */
-    /*                processor->peer->id, email, passwd); */
-
-    check_emailuser (processor, email, passwd);
-    ccnet_processor_done(processor, TRUE);
-
+    /*                processor->peer->id, argv[0], argv[1]); */
+
+    priv->user_mgr = ((CcnetServerSession *)processor->session)->user_mgr;
+    memcpy (priv->peer_id, processor->peer->id, 41);
+    priv->email = g_strdup (argv[0]);
+    priv->passwd = g_strdup (argv[1]);
+
+    ccnet_processor_thread_create (processor,
+                                   ccnet_user_manager_get_job_manager (priv->user_mgr),
+                                   check_emailuser,
+                                   check_emailuser_done,
+                                   processor);
     return 0;
 }
 
@@ -9,9 +9,19 @@
 #include "peer-mgr.h" 
 #include "user-mgr.h" 
 #include "server-session.h"
+#include "job-mgr.h"
 
 G_DEFINE_TYPE (CcnetRecvlogoutProc, ccnet_recvlogout_proc, CCNET_TYPE_PROCESSOR)
 
+typedef struct {
+    CcnetUserManager *user_mgr;
+    char peer_id[41];
+    gboolean bound;
+} CcnetRecvlogoutProcPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), CCNET_TYPE_RECVLOGOUT_PROC, CcnetRecvlogoutProcPriv))
+
 #define SC_NO_BINDING "301"
 #define SS_NO_BINDING "Not binded yet"
 
@@ -37,6 +47,8 @@ ccnet_recvlogout_proc_class_init (CcnetRecvlogoutProcClass *klass)
     proc_class->start = start;
     proc_class->handle_update = handle_update;
     proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof(CcnetRecvlogoutProcPriv));
 }
 
 static void
@@ -44,34 +56,61 @@ ccnet_recvlogout_proc_init (CcnetRecvlogoutProc *processor)
 {
 }
 
+/* Runs in the thread pool of the user database. */
+static void *
+remove_binding (void *vprocessor)
+{
+    CcnetRecvlogoutProcPriv *priv = GET_PRIV (vprocessor);
+    char *email;
+
+    email = ccnet_user_manager_get_binding_email (priv->user_mgr,
+                                                  priv->peer_id);
+    if (email) {
+        ccnet_user_manager_remove_one_binding (priv->user_mgr,
+                                               email, priv->peer_id);
+        priv->bound = TRUE;
+    }
+
+    g_free (email);
+    return vprocessor;
+}
+
+static void
+remove_binding_done (void *vprocessor)
+{
+    CcnetProcessor *processor = vprocessor;
+    CcnetRecvlogoutProcPriv *priv = GET_PRIV (processor);
+
+    if (!priv->bound)
+        ccnet_processor_send_response (processor, SC_NO_BINDING,
+                                       SS_NO_BINDING, NULL, 0);
+    else
+        ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
+
+    ccnet_processor_done (processor, TRUE);
+}
+
 static int
 start (CcnetProcessor *processor, int argc, char **argv)
 {
-    CcnetUserManager *user_mgr = 
-        ((CcnetServerSession *)processor->session)->user_mgr;
-    
+    CcnetRecvlogoutProcPriv *priv = GET_PRIV (processor);
+
     if (argc != 0) {
         ccnet_processor_error (processor, SC_BAD_ARGS, SS_BAD_ARGS);
         return -1;
     }
 
-    CcnetPeer *peer = processor->peer;
-    char *email;
-
     /* ccnet_peer_manager_remove_role (session->peer_mgr, peer, "MyClient"); */
 
-    email = ccnet_user_manager_get_binding_email (user_mgr, peer->id);
-    if (!email) {
-        ccnet_processor_send_response (processor, SC_NO_BINDING,
-                                       SS_NO_BINDING, NULL, 0);
-    } else {
-        ccnet_user_manager_remove_one_binding (user_mgr,
-                                               email, peer->id);
-        ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
-    }
+    priv->user_mgr = ((CcnetServerSession *)processor->session)->user_mgr;
+    memcpy (priv->peer_id, processor->peer->id, 41);
+    priv->bound = FALSE;
 
-    g_free (email);
-    ccnet_processor_done (processor, TRUE);
+    ccnet_processor_thread_create (processor,
+                                   ccnet_user_manager_get_job_manager (priv->user_mgr),
+                                   remove_binding,
+                                   remove_binding_done,
+                                   processor);
     return 0;
 }
 
@@ -3,6 +3,7 @@
 #include "common.h"
 
 #include <signal.h>
+#include <pthread.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <time.h>
@@ -26,6 +27,7 @@
 #include "user-mgr.h"
 #include "group-mgr.h"
 #include "org-mgr.h"
+#include "change-log.h"
 #include "job-mgr.h"
 
 #define DEBUG_FLAG CCNET_DEBUG_OTHER
@@ -65,6 +67,102 @@ ccnet_server_session_new (const char *config_dir_r)
     return g_object_new (CCNET_TYPE_SERVER_SESSION, NULL);
 }
 
+/*
+ * The managers below have their own tables and don't use each other
+ * while preparing, so with [General] PARALLEL_STARTUP they are prepared
+ * in the job threads at the same time. Mostly this overlaps the round
+ * trips of the schema checks to a remote database.
+ */
+typedef struct PrepareStep {
+    const char *name;
+    int (*prepare) (CcnetServerSession *session);
+    CcnetServerSession *session;
+    int ret;
+    gint64 usec;
+} PrepareStep;
+
+static int
+prepare_user_mgr (CcnetServerSession *session)
+{
+    return ccnet_user_manager_prepare (session->user_mgr);
+}
+
+static int
+prepare_group_mgr (CcnetServerSession *session)
+{
+    return ccnet_group_manager_prepare (session->group_mgr);
+}
+
+static int
+prepare_org_mgr (CcnetServerSession *session)
+{
+    return ccnet_org_manager_prepare (session->org_mgr);
+}
+
+static void *
+run_prepare_step (void *vstep)
+{
+    PrepareStep *step = vstep;
+    gint64 start = g_get_monotonic_time ();
+
+    step->ret = step->prepare (step->session);
+    step->usec = g_get_monotonic_time () - start;
+    return step;
+}
+
+static int
+prepare_managers (CcnetServerSession *session)
+{
+    PrepareStep steps[] = {
+        { "user", prepare_user_mgr, session },
+        { "group", prepare_group_mgr, session },
+        { "org", prepare_org_mgr, session },
+    };
+    int n = G_N_ELEMENTS (steps);
+    int job_ids[G_N_ELEMENTS (steps)];
+    gboolean parallel;
+    gint64 start = g_get_monotonic_time ();
+    GString *timings;
+    int i, ret = 0;
+
+    parallel = g_key_file_get_boolean (session->common_session.keyf,
+                                       "General", "PARALLEL_STARTUP", NULL);
+
+    if (parallel) {
+        for (i = 0; i < n; ++i)
+            job_ids[i] = ccnet_job_manager_schedule_job (
+                session->common_session.job_mgr,
+                run_prepare_step, NULL, &steps[i]);
+        for (i = 0; i < n; ++i)
+            ccnet_job_manager_wait_job (session->common_session.job_mgr,
+                                        job_ids[i]);
+    } else {
+        /* One after another, stopping at the first failure. */
+        for (i = 0; i < n; ++i) {
+            run_prepare_step (&steps[i]);
+            if (steps[i].ret < 0)
+                break;
+        }
+    }
+
+    timings = g_string_new (NULL);
+    for (i = 0; i < n; ++i) {
+        g_string_append_printf (timings, "%s%s %d ms", i ? ", " : "",
+                                steps[i].name, (int)(steps[i].usec / 1000));
+        if (steps[i].ret < 0) {
+            ccnet_warning ("Failed to prepare the %s manager.\n",
+                           steps[i].name);
+            ret = -1;
+        }
+    }
+    ccnet_message ("[Startup] Managers prepared in %d ms%s (%s)\n",
+                   (int)((g_get_monotonic_time () - start) / 1000),
+                   parallel ? " in parallel" : "", timings->str);
+    g_string_free (timings, TRUE);
+
+    return ret;
+}
+
 int
 server_session_prepare (CcnetSession *session)
 {
@@ -88,23 +186,164 @@ server_session_prepare (CcnetSession *session)
         /* encrypt channel on default */
         session->encrypt_channel = 1;
 
-    if (ccnet_user_manager_prepare (server_session->user_mgr) < 0)
-        return -1;
+    ccnet_change_log_init (session->keyf);
 
-    if (ccnet_group_manager_prepare (server_session->group_mgr) < 0)
-        return -1;
+    return prepare_managers (server_session);
+}
 
-    if (ccnet_org_manager_prepare (server_session->org_mgr) < 0)
-        return -1;
+/*
+ * With [General] PRELOAD_CACHES, the binding, group and org caches are
+ * filled by a job once the server is up, with a few large queries,
+ * instead of by the first minutes of requests missing one by one.
+ * Requests are served meanwhile; those coming first miss as before.
+ * get_preload_stats reports how far it got.
+ */
+#define N_PRELOAD_STEPS 3
+
+typedef struct PreloadStep {
+    const char *name;
+    int (*preload) (CcnetServerSession *session);
+    int entries;                /* -1 if it failed */
+    gint64 usec;
+} PreloadStep;
 
-    return 0;
+static int
+preload_bindings (CcnetServerSession *session)
+{
+    return ccnet_user_manager_preload_bindings (session->user_mgr);
+}
+
+static int
+preload_groups (CcnetServerSession *session)
+{
+    return ccnet_group_manager_preload (session->group_mgr);
+}
+
+static int
+preload_orgs (CcnetServerSession *session)
+{
+    return ccnet_org_manager_preload (session->org_mgr);
 }
 
+static struct {
+    pthread_mutex_t lock;
+    gboolean        enabled;
+    int             n_done;     /* steps finished */
+    gint64          started;
+    gint64          finished;   /* 0 while running */
+    PreloadStep     steps[N_PRELOAD_STEPS];
+} preload = {
+    PTHREAD_MUTEX_INITIALIZER, FALSE, 0, 0, 0,
+    {
+        { "bindings", preload_bindings },
+        { "groups", preload_groups },
+        { "orgs", preload_orgs },
+    },
+};
+
+static void *
+preload_thread (void *vsession)
+{
+    CcnetServerSession *session = vsession;
+    gint64 start;
+    int i, entries;
+
+    for (i = 0; i < N_PRELOAD_STEPS; ++i) {
+        start = g_get_monotonic_time ();
+        entries = preload.steps[i].preload (session);
+
+        pthread_mutex_lock (&preload.lock);
+        preload.steps[i].entries = entries;
+        preload.steps[i].usec = g_get_monotonic_time () - start;
+        preload.n_done = i + 1;
+        pthread_mutex_unlock (&preload.lock);
+    }
+    return session;
+}
+
+static void
+preload_done (void *vsession)
+{
+    GString *timings = g_string_new (NULL);
+    int i;
+
+    pthread_mutex_lock (&preload.lock);
+    preload.finished = g_get_monotonic_time ();
+    for (i = 0; i < N_PRELOAD_STEPS; ++i) {
+        PreloadStep *step = &preload.steps[i];
+
+        if (step->entries < 0)
+            ccnet_warning ("[Startup] Failed to preload %s.\n", step->name);
+        g_string_append_printf (timings, "%s%s %d in %d ms", i ? ", " : "",
+                                step->name, step->entries,
+                                (int)(step->usec / 1000));
+    }
+    ccnet_message ("[Startup] Caches preloaded in %d ms (%s)\n",
+                   (int)((preload.finished - preload.started) / 1000),
+                   timings->str);
+    pthread_mutex_unlock (&preload.lock);
+
+    g_string_free (timings, TRUE);
+}
+
+static void
+start_preload (CcnetServerSession *session)
+{
+    if (!g_key_file_get_boolean (session->common_session.keyf,
+                                 "General", "PRELOAD_CACHES", NULL))
+        return;
+
+    pthread_mutex_lock (&preload.lock);
+    preload.enabled = TRUE;
+    preload.started = g_get_monotonic_time ();
+    pthread_mutex_unlock (&preload.lock);
+
+    ccnet_job_manager_schedule_job (session->common_session.job_mgr,
+                                    preload_thread, preload_done, session);
+}
+
+char *
+ccnet_server_session_get_preload_stats (CcnetServerSession *session)
+{
+    GString *buf = g_string_new (NULL);
+    gint64 end;
+    int i;
+
+    pthread_mutex_lock (&preload.lock);
+    if (!preload.enabled) {
+        g_string_append (buf, "state off\n");
+    } else {
+        end = preload.finished ? preload.finished : g_get_monotonic_time ();
+        g_string_append_printf (buf, "state %s\nms %d\n",
+                                preload.finished ? "done" : "running",
+                                (int)((end - preload.started) / 1000));
+        for (i = 0; i < N_PRELOAD_STEPS; ++i) {
+            PreloadStep *step = &preload.steps[i];
+
+            if (i < preload.n_done)
+                g_string_append_printf (buf, "%s entries %d ms %d\n",
+                                        step->name, step->entries,
+                                        (int)(step->usec / 1000));
+            else
+                g_string_append_printf (buf, "%s %s\n", step->name,
+                                        i == preload.n_done ?
+                                        "running" : "pending");
+        }
+    }
+    pthread_mutex_unlock (&preload.lock);
+
+    return g_string_free (buf, FALSE);
+}
+
+/* Called from ccnet_session_start(), when the server listens. Auth
+ * done is dispatched to on_peer_auth_done() by the base session. */
 void
 server_session_start (CcnetSession *session)
 {
-    g_signal_connect (session->peer_mgr, "peer-auth-done",
-                      G_CALLBACK(on_peer_auth_done), NULL);    
+    CcnetServerSession *server_session = (CcnetServerSession *)session;
+
+    ccnet_user_manager_start (server_session->user_mgr);
+    start_preload (server_session);
 }
 
 
@@ -121,6 +360,82 @@ static int init_sqlite_database (CcnetSession *session)
     return 0;
 }
 
+/* READ_REPLICAS is a comma separated list of hosts, with the same user,
+ * password and database as the primary. */
+static void
+add_read_replicas (CcnetSession *session, const char *user,
+                   const char *passwd, const char *db)
+{
+    char *value, **hosts;
+    int i;
+
+    value = ccnet_key_file_get_string (session->keyf,
+                                       "Database", "READ_REPLICAS");
+    if (!value)
+        return;
+
+    hosts = g_strsplit (value, ",", -1);
+    for (i = 0; hosts[i]; ++i) {
+        g_strstrip (hosts[i]);
+        if (*hosts[i] == '\0')
+            continue;
+        if (ccnet_db_add_mysql_replica (session->db, hosts[i],
+                                        user, passwd, db) == 0)
+            ccnet_message ("Reading from replica %s\n", hosts[i]);
+    }
+    g_strfreev (hosts);
+    g_free (value);
+}
+
+/*
+ * ORG_SHARDS is a comma separated list of hosts, with the same user,
+ * password and database as the primary, which becomes the directory.
+ * Hosts may only be appended to the list: orgs are assigned to shards by
+ * their position. See ccnet_db_shards_new().
+ */
+static int
+add_org_shards (CcnetSession *session, const char *user,
+                const char *passwd, const char *db)
+{
+    CcnetServerSession *server_session = (CcnetServerSession *)session;
+    CcnetDBShards *shards;
+    CcnetDB *shard_db;
+    char *value, **hosts;
+    int i, ret = 0;
+
+    value = ccnet_key_file_get_string (session->keyf,
+                                       "Database", "ORG_SHARDS");
+    if (!value)
+        return 0;
+
+    shards = ccnet_db_shards_new (session->db);
+    if (!shards) {
+        g_free (value);
+        return -1;
+    }
+
+    hosts = g_strsplit (value, ",", -1);
+    for (i = 0; hosts[i]; ++i) {
+        g_strstrip (hosts[i]);
+        if (*hosts[i] == '\0')
+            continue;
+        shard_db = ccnet_db_new_mysql (hosts[i], user, passwd, db, NULL);
+        if (!shard_db || ccnet_db_shards_add (shards, shard_db) < 0) {
+            ccnet_warning ("Failed to open org shard %s.\n", hosts[i]);
+            ret = -1;
+            break;
+        }
+        ccnet_message ("Org shard %d on %s\n",
+                       ccnet_db_shards_count (shards), hosts[i]);
+    }
+    g_strfreev (hosts);
+    g_free (value);
+
+    if (ret == 0 && ccnet_db_shards_count (shards) > 0)
+        server_session->org_shards = shards;
+    return ret;
+}
+
 static int init_mysql_database (CcnetSession *session)
 {
     char *host, *user, *passwd, *db, *unix_socket;
@@ -154,8 +469,83 @@ static int init_mysql_database (CcnetSession *session)
         g_warning ("Failed to open database.\n");
         return -1;
     }
+    add_read_replicas (session, user, passwd, db);
 
-   return 0;
+    return add_org_shards (session, user, passwd, db);
+}
+
+static void
+load_db_pool_config (CcnetSession *session)
+{
+    CcnetDBPoolConfig *config = &ccnet_db_pool_config;
+    GKeyFile *keyf = session->keyf;
+
+    if (g_key_file_has_key (keyf, "Database", "MIN_CONNECTIONS", NULL))
+        config->min_connections = g_key_file_get_integer (
+            keyf, "Database", "MIN_CONNECTIONS", NULL);
+    if (g_key_file_has_key (keyf, "Database", "MAX_CONNECTIONS", NULL))
+        config->max_connections = g_key_file_get_integer (
+            keyf, "Database", "MAX_CONNECTIONS", NULL);
+    if (g_key_file_has_key (keyf, "Database", "IDLE_TIMEOUT", NULL))
+        config->idle_timeout = g_key_file_get_integer (
+            keyf, "Database", "IDLE_TIMEOUT", NULL);
+    if (g_key_file_has_key (keyf, "Database", "CONNECTION_WAIT_TIMEOUT", NULL))
+        config->wait_timeout_ms = g_key_file_get_integer (
+            keyf, "Database", "CONNECTION_WAIT_TIMEOUT", NULL);
+
+    if (g_key_file_has_key (keyf, "Database", "REPLICA_MAX_LAG", NULL))
+        ccnet_db_replica_config.max_lag = g_key_file_get_integer (
+            keyf, "Database", "REPLICA_MAX_LAG", NULL);
+    if (g_key_file_has_key (keyf, "Database", "REPLICA_CHECK_INTERVAL", NULL))
+        ccnet_db_replica_config.check_interval = g_key_file_get_integer (
+            keyf, "Database", "REPLICA_CHECK_INTERVAL", NULL);
+    if (g_key_file_has_key (keyf, "Database", "REPLICA_STICKY_SECONDS", NULL))
+        ccnet_db_replica_config.sticky_seconds = g_key_file_get_integer (
+            keyf, "Database", "REPLICA_STICKY_SECONDS", NULL);
+}
+
+/*
+ * SQLITE_PERFORMANCE = true selects WAL journaling, so that readers
+ * don't block the writer, with synchronous=normal, 64MB of mmap and an
+ * 8MB page cache. Each pragma can also be set on its own.
+ */
+static void
+load_sqlite_config (CcnetSession *session)
+{
+    CcnetDBSqliteConfig *config = &ccnet_db_sqlite_config;
+    GKeyFile *keyf = session->keyf;
+    char *value;
+
+    if (g_key_file_get_boolean (keyf, "Database", "SQLITE_PERFORMANCE",
+                                NULL)) {
+        config->journal_mode = g_strdup ("wal");
+        config->synchronous = g_strdup ("normal");
+        config->mmap_size = 64 << 20;
+        config->cache_size = -8192;
+        config->busy_timeout_ms = 5000;
+    }
+
+    value = ccnet_key_file_get_string (keyf, "Database", "SQLITE_JOURNAL_MODE");
+    if (value) {
+        g_free (config->journal_mode);
+        config->journal_mode = value;
+    }
+    value = ccnet_key_file_get_string (keyf, "Database", "SQLITE_SYNCHRONOUS");
+    if (value) {
+        g_free (config->synchronous);
+        config->synchronous = value;
+    }
+    value = ccnet_key_file_get_string (keyf, "Database", "SQLITE_MMAP_SIZE");
+    if (value) {
+        config->mmap_size = g_ascii_strtoll (value, NULL, 10);
+        g_free (value);
+    }
+    if (g_key_file_has_key (keyf, "Database", "SQLITE_CACHE_SIZE", NULL))
+        config->cache_size = g_key_file_get_integer (
+            keyf, "Database", "SQLITE_CACHE_SIZE", NULL);
+    if (g_key_file_has_key (keyf, "Database", "SQLITE_BUSY_TIMEOUT", NULL))
+        config->busy_timeout_ms = g_key_file_get_integer (
+            keyf, "Database", "SQLITE_BUSY_TIMEOUT", NULL);
 }
 
 static int
@@ -164,6 +554,9 @@ load_database_config (CcnetSession *session)
     int ret;
     char *engine;
 
+    load_db_pool_config (session);
+    load_sqlite_config (session);
+
     engine = ccnet_key_file_get_string (session->keyf, "Database", "ENGINE");
     if (!engine || strncasecmp (engine, DB_SQLITE, sizeof(DB_SQLITE)) == 0) {
         ccnet_debug ("Use database sqlite\n");
@@ -172,6 +565,8 @@ load_database_config (CcnetSession *session)
         ccnet_debug ("Use database Mysql\n");
         ret = init_mysql_database (session);
     }
+    if (ret == 0)
+        ccnet_db_register_metrics (session->db);
     return ret;
 }
 
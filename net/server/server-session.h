@@ -22,6 +22,9 @@ struct CcnetServerSession
     struct _CcnetUserManager   *user_mgr;
     struct _CcnetGroupManager  *group_mgr;
     struct _CcnetOrgManager    *org_mgr;
+
+    /* [Database] ORG_SHARDS, NULL if not set. */
+    struct CcnetDBShards       *org_shards;
 };
 
 struct _CcnetServerSessionClass
@@ -33,5 +36,10 @@ GType ccnet_server_session_get_type ();
 
 CcnetServerSession *ccnet_server_session_new ();
 
+/* Progress of the [General] PRELOAD_CACHES startup preload: "state
+ * off|running|done", "ms <n>", then a line per cache, "<name> entries
+ * <n> ms <n>" once loaded, -1 entries if that failed. */
+char *ccnet_server_session_get_preload_stats (CcnetServerSession *session);
+
 
 #endif
@@ -4,29 +4,60 @@
 
 #include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "ccnet-db.h"
 #include "timer.h"
+#include "job-mgr.h"
 #include "utils.h"
+#include "ccnetobj-codec.h"
 
 
 #include "peer.h"
 #include "session.h"
 #include "peer-mgr.h"
 #include "user-mgr.h"
+#include "ldap-async.h"
+#include "cache-bus.h"
+#include "change-log.h"
 
 #include <openssl/sha.h>
-
-#ifdef HAVE_LDAP
-#define LDAP_DEPRECATED 1
-#include <ldap.h>
-#endif
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 
 #define DEBUG_FLAG  CCNET_DEBUG_PEER
 #include "log.h"
 
 #define DEFAULT_SAVING_INTERVAL_MSEC 30000
 
+#define DEFAULT_USER_CACHE_SIZE 10000
+#define DEFAULT_USER_CACHE_TTL  30      /* seconds, other nodes may write */
+#define USER_COUNT_RECONCILE    300     /* recount EmailUser this often */
+
+#define DEFAULT_AUTH_CACHE_TTL  60
+#define BINDING_CACHE_MAX_ENTRIES 100000
+/* Leaves room in the map for the peers looked up after the preload. */
+#define BINDING_PRELOAD_MAX       (BINDING_CACHE_MAX_ENTRIES / 2)
+#define BINDING_PREFETCH_BATCH  100
+#define AUTH_CACHE_MAX_ENTRIES  10000
+#define AUTH_KEY_LEN            32
+
+#ifdef HAVE_LDAP
+#define DEFAULT_LDAP_MAX_CONNECTIONS 10
+
+#define DEFAULT_LDAP_CACHE_TTL       300
+#define LDAP_NEGATIVE_CACHE_TTL      60
+#define LDAP_CACHE_MAX_ENTRIES       10000
+#define LDAP_COUNT_REFRESH           300
+
+/* Result of looking up one uid. LDAP users carry nothing but the
+ * email, so that's all that needs to be kept. */
+typedef struct LdapCacheEntry {
+    char    *email;             /* NULL if the uid was not found */
+    time_t   expire;
+} LdapCacheEntry;
+#endif
+
 
 G_DEFINE_TYPE (CcnetUserManager, ccnet_user_manager, G_TYPE_OBJECT);
 
@@ -41,11 +72,101 @@ static int open_db (CcnetUserManager *manager);
 static int try_load_ldap_settings (CcnetUserManager *manager);
 #endif
 
+typedef struct UserCacheEntry {
+    int      id;
+    char    *email;
+    char     passwd[41];        /* hashed */
+    int      is_staff;
+    int      is_active;
+    gint64   ctime;
+    time_t   expire;
+    GList   *lru_link;
+} UserCacheEntry;
+
+/* The email a peer id is bound to, NULL if it is not bound. */
+typedef struct BindingCacheEntry {
+    char    *email;
+    time_t   expire;
+} BindingCacheEntry;
+
+/* A successful validate_emailuser(), keyed by the hex HMAC of the email
+ * and password under auth_key. */
+typedef struct AuthCacheEntry {
+    char    *email;
+    time_t   expire;
+} AuthCacheEntry;
+
 struct CcnetUserManagerPriv {
     CcnetDB    *db;
+
+    /* EmailUser rows by email and by id, under cache_lock. */
+    pthread_mutex_t cache_lock;
+    GHashTable *cache_by_email;
+    GHashTable *cache_by_id;
+    GQueue      cache_lru;          /* most recently used first */
+    int         cache_size;
+    int         cache_ttl;
+    guint       cache_gen;          /* bumped on every invalidation */
+    gint64      cache_hits;
+    gint64      cache_misses;
+
+    /* Number of EmailUser rows, -1 until counted, under cache_lock. */
+    gint64      user_count;
+    time_t      user_count_time;
+    gboolean    user_count_refreshing;
+
+    /* Bindings by peer id, under cache_lock. */
+    GHashTable *binding_cache;
+    guint       binding_gen;        /* bumped on every binding change */
+
+    /* Recently validated credentials, under cache_lock. */
+    GHashTable *auth_cache;
+    int         auth_cache_ttl;
+    unsigned char auth_key[AUTH_KEY_LEN];
+
+#ifdef HAVE_LDAP
+    CcnetLdapAsync *ldap_async;
+    int         ldap_max;
+
+    /* Lookup results by uid and the user count, under cache_lock. */
+    GHashTable *ldap_cache;
+    int         ldap_cache_ttl;
+    int         ldap_count;
+    time_t      ldap_count_time;
+    gboolean    ldap_count_refreshing;
+#endif
 };
 
 
+static void
+binding_cache_entry_free (gpointer data)
+{
+    BindingCacheEntry *entry = data;
+
+    g_free (entry->email);
+    g_free (entry);
+}
+
+static void
+auth_cache_entry_free (gpointer data)
+{
+    AuthCacheEntry *entry = data;
+
+    g_free (entry->email);
+    g_free (entry);
+}
+
+#ifdef HAVE_LDAP
+static void
+ldap_cache_entry_free (gpointer data)
+{
+    LdapCacheEntry *entry = data;
+
+    g_free (entry->email);
+    g_free (entry);
+}
+#endif
+
 static void
 ccnet_user_manager_class_init (CcnetUserManagerClass *klass)
 {
@@ -56,7 +177,51 @@ ccnet_user_manager_class_init (CcnetUserManagerClass *klass)
 static void
 ccnet_user_manager_init (CcnetUserManager *manager)
 {
-    manager->priv = GET_PRIV(manager);
+    CcnetUserManagerPriv *priv;
+
+    manager->priv = priv = GET_PRIV(manager);
+
+    pthread_mutex_init (&priv->cache_lock, NULL);
+    priv->cache_by_email = g_hash_table_new (g_str_hash, g_str_equal);
+    priv->cache_by_id = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_queue_init (&priv->cache_lru);
+    priv->cache_size = DEFAULT_USER_CACHE_SIZE;
+    priv->cache_ttl = DEFAULT_USER_CACHE_TTL;
+    priv->user_count = -1;
+    priv->binding_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free,
+                                                 binding_cache_entry_free);
+    priv->auth_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, auth_cache_entry_free);
+    priv->auth_cache_ttl = DEFAULT_AUTH_CACHE_TTL;
+    if (RAND_bytes (priv->auth_key, AUTH_KEY_LEN) != 1)
+        priv->auth_cache_ttl = 0;
+
+#ifdef HAVE_LDAP
+    priv->ldap_max = DEFAULT_LDAP_MAX_CONNECTIONS;
+    priv->ldap_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, ldap_cache_entry_free);
+    priv->ldap_cache_ttl = DEFAULT_LDAP_CACHE_TTL;
+    priv->ldap_count = -1;
+#endif
+}
+
+static void
+load_cache_config (CcnetUserManager *manager)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    GKeyFile *keyf = manager->session->keyf;
+
+    if (g_key_file_has_key (keyf, "User", "CACHE_SIZE", NULL))
+        priv->cache_size = g_key_file_get_integer (keyf, "User",
+                                                   "CACHE_SIZE", NULL);
+    if (g_key_file_has_key (keyf, "User", "CACHE_TTL", NULL))
+        priv->cache_ttl = g_key_file_get_integer (keyf, "User",
+                                                  "CACHE_TTL", NULL);
+    if (priv->auth_cache_ttl > 0 &&
+        g_key_file_has_key (keyf, "User", "AUTH_CACHE_TTL", NULL))
+        priv->auth_cache_ttl = g_key_file_get_integer (keyf, "User",
+                                                       "AUTH_CACHE_TTL", NULL);
 }
 
 CcnetUserManager*
@@ -71,6 +236,8 @@ ccnet_user_manager_new (CcnetSession *session)
     return manager;
 }
 
+static void on_cache_event (const char *domain, const char *key, void *vmanager);
+
 int
 ccnet_user_manager_prepare (CcnetUserManager *manager)
 {
@@ -79,6 +246,14 @@ ccnet_user_manager_prepare (CcnetUserManager *manager)
         return -1;
 #endif
 
+    load_cache_config (manager);
+
+    ccnet_cache_bus_subscribe ("user", on_cache_event, manager);
+    ccnet_cache_bus_subscribe ("user-id", on_cache_event, manager);
+    ccnet_cache_bus_subscribe ("user-count", on_cache_event, manager);
+    ccnet_cache_bus_subscribe ("binding", on_cache_event, manager);
+    ccnet_cache_bus_subscribe ("binding-email", on_cache_event, manager);
+
     manager->userdb_path = g_build_filename (manager->session->config_dir,
                                              "user-db", NULL);
     return open_db(manager);
@@ -90,14 +265,20 @@ ccnet_user_manager_free (CcnetUserManager *manager)
     g_object_unref (manager);
 }
 
+static void prefetch_bindings (CcnetUserManager *manager);
+
 void
 ccnet_user_manager_start (CcnetUserManager *manager)
 {
-
+    prefetch_bindings (manager);
 }
 
 void ccnet_user_manager_on_exit (CcnetUserManager *manager)
 {
+#ifdef HAVE_LDAP
+    ccnet_ldap_async_free (manager->priv->ldap_async);
+    manager->priv->ldap_async = NULL;
+#endif
 }
 
 /* -------- LDAP related --------- */
@@ -134,211 +315,249 @@ static int try_load_ldap_settings (CcnetUserManager *manager)
     if (!manager->login_attr)
         manager->login_attr = g_strdup("mail");
 
+    if (g_key_file_has_key (config, "LDAP", "MAX_CONNECTIONS", NULL))
+        manager->priv->ldap_max = g_key_file_get_integer (
+            config, "LDAP", "MAX_CONNECTIONS", NULL);
+    if (g_key_file_has_key (config, "LDAP", "CACHE_TTL", NULL))
+        manager->priv->ldap_cache_ttl = g_key_file_get_integer (
+            config, "LDAP", "CACHE_TTL", NULL);
+
+    manager->priv->ldap_async = ccnet_ldap_async_new (manager->ldap_host,
+                                                      manager->base,
+                                                      manager->user_dn,
+                                                      manager->password,
+                                                      manager->login_attr,
+                                                      manager->priv->ldap_max);
+    if (!manager->priv->ldap_async)
+        return -1;
+
     return 0;
 }
 
-static LDAP *ldap_init_and_bind (const char *host,
-                                 const char *user_dn,
-                                 const char *password)
-{
-    LDAP *ld;
-    int res;
-    int desired_version = LDAP_VERSION3;
-
-    res = ldap_initialize (&ld, host);
-    if (res != LDAP_SUCCESS) {
-        ccnet_warning ("ldap_initialize failed: %s.\n", ldap_err2string(res));
-        return NULL;
-    }
-
-    /* set the LDAP version to be 3 */
-    res = ldap_set_option (ld, LDAP_OPT_PROTOCOL_VERSION, &desired_version);
-    if (res != LDAP_OPT_SUCCESS) {
-        ccnet_warning ("ldap_set_option failed: %s.\n", ldap_err2string(res));
-        return NULL;
-    }
-
-    if (user_dn) {
-        res = ldap_bind_s (ld, user_dn, password, LDAP_AUTH_SIMPLE);
-        if (res != LDAP_SUCCESS ) {
-            ccnet_warning ("ldap_bind failed: %s.\n", ldap_err2string(res));
-            ldap_unbind_s (ld);
-            return NULL;
-        }
-    }
-
-    return ld;
-}
+/*
+ * The lookups go through ldap-async, which multiplexes them on a few
+ * connections in its own thread. The RPC threads calling in here still
+ * wait for the result, but do not hold a connection while they do.
+ */
 
 static int ldap_verify_user_password (CcnetUserManager *manager,
                                       const char *uid,
                                       const char *password)
 {
-    LDAP *ld = NULL;
-    int res;
-    GString *filter;
-    char *filter_str = NULL;
-    char *attrs[2];
-    LDAPMessage *msg = NULL, *entry;
-    char *dn = NULL;
-    int ret = 0;
-
-    /* First search for the DN with the given uid. */
-
-    ld = ldap_init_and_bind (manager->ldap_host,
-                             manager->user_dn,
-                             manager->password);
-    if (!ld)
+    /* A simple bind with an empty password is an anonymous bind and
+     * always succeeds. */
+    if (!password || password[0] == '\0')
+        return -1;
+
+    if (!manager->priv->ldap_async)
         return -1;
+    return ccnet_ldap_async_verify_sync (manager->priv->ldap_async,
+                                         uid, password);
+}
 
-    filter = g_string_new (NULL);
-    g_string_printf (filter, "(%s=%s)", manager->login_attr, uid);
-    filter_str = g_string_free (filter, FALSE);
+static GList *
+emails_to_users (GList *emails)
+{
+    GList *ptr;
+    GList *ret = NULL;
 
-    attrs[0] = manager->login_attr;
-    attrs[1] = NULL;
+    for (ptr = emails; ptr; ptr = ptr->next) {
+        CcnetEmailUser *user;
 
-    res = ldap_search_s (ld, manager->base, LDAP_SCOPE_SUBTREE,
-                         filter_str, attrs, 0, &msg);
-    if (res != LDAP_SUCCESS) {
-        ccnet_warning ("ldap_search failed: %s.\n", ldap_err2string(res));
-        ret = -1;
-        goto out;
+        user = g_object_new (CCNET_TYPE_EMAIL_USER,
+                             "id", 0,
+                             "email", (char *)ptr->data,
+                             "is_staff", FALSE,
+                             "is_active", TRUE,
+                             "ctime", (gint64)0,
+                             NULL);
+        ret = g_list_prepend (ret, user);
+        g_free (ptr->data);
     }
+    g_list_free (emails);
 
-    entry = ldap_first_entry (ld, msg);
-    if (!entry) {
-        ccnet_warning ("user with uid %s not found in LDAP.\n", uid);
-        ret = -1;
-        goto out;
-    }
+    return g_list_reverse (ret);
+}
+
+/*
+ * @uid: user's uid.
+ */
+static GList *ldap_list_users (CcnetUserManager *manager, const char *uid)
+{
+    GList *emails = NULL;
 
-    dn = ldap_get_dn (ld, entry);
+    if (!manager->priv->ldap_async ||
+        ccnet_ldap_async_search_sync (manager->priv->ldap_async,
+                                      uid, &emails) < 0)
+        return NULL;
 
-    /* Then bind the DN with password. */
+    return emails_to_users (emails);
+}
 
-    ldap_unbind_s (ld);
+static GList *ldap_search_users (CcnetUserManager *manager,
+                                 const char *prefix, int limit)
+{
+    GList *emails = NULL;
 
-    ld = ldap_init_and_bind (manager->ldap_host, dn, password);
-    if (!ld) {
-        ccnet_warning ("Password check for %s failed.\n", uid);
-        ret = -1;
-    }
+    if (!manager->priv->ldap_async ||
+        ccnet_ldap_async_search_prefix_sync (manager->priv->ldap_async,
+                                             prefix, limit, &emails) < 0)
+        return NULL;
 
-out:
-    ldap_msgfree (msg);
-    ldap_memfree (dn);
-    g_free (filter_str);
-    if (ld) ldap_unbind_s (ld);
-    return ret;
+    emails = g_list_sort (emails, (GCompareFunc)g_strcmp0);
+    return emails_to_users (emails);
 }
 
 /*
- * @uid: user's uid, list all users if * is passed in.
+ * The whole directory, @limit users from @start, fetched in pages.
  */
-static GList *ldap_list_users (CcnetUserManager *manager, const char *uid)
+static GList *ldap_list_all_users (CcnetUserManager *manager,
+                                   int start, int limit)
 {
-    LDAP *ld = NULL;
-    GList *ret = NULL;
-    int res;
-    GString *filter;
-    char *filter_str;
-    char *attrs[2];
-    LDAPMessage *msg = NULL, *entry;
-
-    ld = ldap_init_and_bind (manager->ldap_host,
-                             manager->user_dn,
-                             manager->password);
-    if (!ld)
+    GList *emails = NULL;
+
+    if (!manager->priv->ldap_async ||
+        ccnet_ldap_async_list_sync (manager->priv->ldap_async,
+                                    start, limit, &emails) < 0)
         return NULL;
 
-    filter = g_string_new (NULL);
-    g_string_printf (filter, "(%s=%s)", manager->login_attr, uid);
-    filter_str = g_string_free (filter, FALSE);
+    return emails_to_users (emails);
+}
+
+static int ldap_count_users (CcnetUserManager *manager)
+{
+    GList *emails = NULL;
+    int count;
+
+    if (!manager->priv->ldap_async ||
+        ccnet_ldap_async_list_sync (manager->priv->ldap_async,
+                                    -1, -1, &emails) < 0)
+        return -1;
+
+    count = g_list_length (emails);
+    string_list_free (emails);
+    return count;
+}
 
-    attrs[0] = manager->login_attr;
-    attrs[1] = NULL;
+/*
+ * Cache of lookups of single users, found or not, so sync bursts asking
+ * for the same users don't each go to the directory. Not-found results
+ * expire sooner to pick up new accounts.
+ */
 
-    res = ldap_search_s (ld, manager->base, LDAP_SCOPE_SUBTREE,
-                         filter_str, attrs, 0, &msg);
-    if (res != LDAP_SUCCESS) {
-        ccnet_warning ("ldap_search failed: %s.\n", ldap_err2string(res));
-        ret = NULL;
-        goto out;
+static gboolean
+ldap_cache_lookup (CcnetUserManager *manager, const char *uid,
+                   CcnetEmailUser **user)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    LdapCacheEntry *entry;
+    gboolean hit = FALSE;
+
+    if (priv->ldap_cache_ttl <= 0)
+        return FALSE;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    entry = g_hash_table_lookup (priv->ldap_cache, uid);
+    if (entry && entry->expire <= time(NULL)) {
+        g_hash_table_remove (priv->ldap_cache, uid);
+        entry = NULL;
     }
+    if (entry) {
+        hit = TRUE;
+        *user = NULL;
+        if (entry->email)
+            *user = g_object_new (CCNET_TYPE_EMAIL_USER,
+                                  "id", 0,
+                                  "email", entry->email,
+                                  "is_staff", FALSE,
+                                  "is_active", TRUE,
+                                  "ctime", (gint64)0,
+                                  NULL);
+        ++priv->cache_hits;
+    } else {
+        ++priv->cache_misses;
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
 
-    for (entry = ldap_first_entry (ld, msg);
-         entry != NULL;
-         entry = ldap_next_entry (ld, entry))
-    {
-        char *attr;
-        char **vals;
-        BerElement *ber;
-        CcnetEmailUser *user;
+    return hit;
+}
 
-        attr = ldap_first_attribute (ld, entry, &ber);
-        vals = ldap_get_values (ld, entry, attr);
+static gboolean
+remove_expired_ldap_entry (gpointer key, gpointer value, gpointer now)
+{
+    LdapCacheEntry *entry = value;
 
-        user = g_object_new (CCNET_TYPE_EMAIL_USER,
-                             "id", 0,
-                             "email", vals[0],
-                             "is_staff", FALSE,
-                             "is_active", TRUE,
-                             "ctime", (gint64)0,
-                             NULL);
-        ret = g_list_prepend (ret, user);
+    return entry->expire <= *(time_t *)now;
+}
 
-        ldap_memfree (attr);
-        ldap_value_free (vals);
-        ber_free (ber, 0);
+/* @user is NULL if @uid was not found. */
+static void
+ldap_cache_insert (CcnetUserManager *manager, const char *uid,
+                   CcnetEmailUser *user)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    LdapCacheEntry *entry;
+    time_t now = time(NULL);
+
+    if (priv->ldap_cache_ttl <= 0)
+        return;
+
+    entry = g_new0 (LdapCacheEntry, 1);
+    if (user) {
+        entry->email = g_strdup (ccnet_email_user_get_email (user));
+        entry->expire = now + priv->ldap_cache_ttl;
+    } else {
+        entry->expire = now + MIN (priv->ldap_cache_ttl,
+                                   LDAP_NEGATIVE_CACHE_TTL);
     }
 
-out:
-    ldap_msgfree (msg);
-    g_free (filter_str);
-    if (ld) ldap_unbind_s (ld);
-    return ret;
+    pthread_mutex_lock (&priv->cache_lock);
+    if (g_hash_table_size (priv->ldap_cache) >= LDAP_CACHE_MAX_ENTRIES) {
+        g_hash_table_foreach_remove (priv->ldap_cache,
+                                     remove_expired_ldap_entry, &now);
+        if (g_hash_table_size (priv->ldap_cache) >= LDAP_CACHE_MAX_ENTRIES)
+            g_hash_table_remove_all (priv->ldap_cache);
+    }
+    g_hash_table_replace (priv->ldap_cache, g_strdup (uid), entry);
+    pthread_mutex_unlock (&priv->cache_lock);
 }
 
 /*
- * @uid: user's uid, list all users if * is passed in.
+ * Counting runs a search over the whole directory. Keep the last count
+ * and let one caller refresh it every LDAP_COUNT_REFRESH seconds while
+ * the others return the old value.
  */
-static int ldap_count_users (CcnetUserManager *manager, const char *uid)
-{
-    LDAP *ld = NULL;
-    int res;
-    GString *filter;
-    char *filter_str;
-    char *attrs[2];
-    LDAPMessage *msg = NULL;
-    int count = -1;
-
-    ld = ldap_init_and_bind (manager->ldap_host,
-                             manager->user_dn,
-                             manager->password);
-    if (!ld)
-        return -1;
+static int
+ldap_count_users_cached (CcnetUserManager *manager)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    gboolean refresh = FALSE;
+    int count;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    count = priv->ldap_count;
+    if ((count < 0 || time(NULL) - priv->ldap_count_time >= LDAP_COUNT_REFRESH)
+        && !priv->ldap_count_refreshing) {
+        priv->ldap_count_refreshing = TRUE;
+        refresh = TRUE;
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
 
-    filter = g_string_new (NULL);
-    g_string_printf (filter, "(%s=%s)", manager->login_attr, uid);
-    filter_str = g_string_free (filter, FALSE);
+    if (!refresh && count >= 0)
+        return count;
+    if (!refresh)
+        return ldap_count_users (manager);
 
-    attrs[0] = manager->login_attr;
-    attrs[1] = NULL;
+    count = ldap_count_users (manager);
 
-    res = ldap_search_s (ld, manager->base, LDAP_SCOPE_SUBTREE,
-                         filter_str, attrs, 0, &msg);
-    if (res != LDAP_SUCCESS) {
-        ccnet_warning ("ldap_search failed: %s.\n", ldap_err2string(res));
-        goto out;
+    pthread_mutex_lock (&priv->cache_lock);
+    if (count >= 0) {
+        priv->ldap_count = count;
+        priv->ldap_count_time = time(NULL);
     }
+    priv->ldap_count_refreshing = FALSE;
+    pthread_mutex_unlock (&priv->cache_lock);
 
-    count = ldap_count_entries (ld, msg);
-
-out:
-    ldap_msgfree (msg);
-    g_free (filter_str);
-    if (ld) ldap_unbind_s (ld);
     return count;
 }
 
@@ -346,10 +565,16 @@ out:
 
 /* -------- DB Operations -------- */
 
+/* Bump when the tables below change, so existing dbs are checked again. */
+#define USER_SCHEMA_VERSION 1
+
 static int check_db_table (CcnetDB *db)
 {
     char *sql;
 
+    if (ccnet_db_get_schema_version (db, "user") == USER_SCHEMA_VERSION)
+        return 0;
+
     int db_type = ccnet_db_type (db);
     if (db_type == CCNET_DB_TYPE_MYSQL) {
         sql = "CREATE TABLE IF NOT EXISTS EmailUser ("
@@ -391,7 +616,7 @@ static int check_db_table (CcnetDB *db)
             return -1;
     }
 
-    return 0;
+    return ccnet_db_set_schema_version (db, "user", USER_SCHEMA_VERSION);
 }
 
 
@@ -443,8 +668,373 @@ open_db (CcnetUserManager *manager)
 }
 
 
+/* -------- EmailUser Cache -------- */
+
+/*
+ * Users are looked up several times per web request, so rows read by
+ * email or id are kept around for cache_ttl seconds. Writes through this
+ * manager drop the entry; the TTL bounds staleness of writes from other
+ * nodes. A reader only inserts its row if no invalidation happened while
+ * it queried the database, so it can't put back an overwritten row.
+ */
+
+static void
+cache_remove_entry (CcnetUserManagerPriv *priv, UserCacheEntry *entry)
+{
+    g_hash_table_remove (priv->cache_by_email, entry->email);
+    g_hash_table_remove (priv->cache_by_id, GINT_TO_POINTER(entry->id));
+    g_queue_delete_link (&priv->cache_lru, entry->lru_link);
+    g_free (entry->email);
+    g_free (entry);
+}
+
+static CcnetEmailUser *
+entry_to_emailuser (UserCacheEntry *entry)
+{
+    return g_object_new (CCNET_TYPE_EMAIL_USER,
+                         "id", entry->id,
+                         "email", entry->email,
+                         "is_staff", entry->is_staff,
+                         "is_active", entry->is_active,
+                         "ctime", entry->ctime,
+                         NULL);
+}
+
+/*
+ * Look up by @email, or by @id if @email is NULL. On a hit the user
+ * object and/or the hashed password are returned through @user and
+ * @passwd, if they are not NULL.
+ */
+static gboolean
+cache_lookup (CcnetUserManager *manager, const char *email, int id,
+              CcnetEmailUser **user, char *passwd)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    UserCacheEntry *entry;
+
+    if (priv->cache_size <= 0)
+        return FALSE;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    if (email)
+        entry = g_hash_table_lookup (priv->cache_by_email, email);
+    else
+        entry = g_hash_table_lookup (priv->cache_by_id, GINT_TO_POINTER(id));
+
+    if (entry && entry->expire <= time(NULL)) {
+        cache_remove_entry (priv, entry);
+        entry = NULL;
+    }
+    if (!entry) {
+        ++priv->cache_misses;
+        pthread_mutex_unlock (&priv->cache_lock);
+        return FALSE;
+    }
+
+    ++priv->cache_hits;
+    g_queue_unlink (&priv->cache_lru, entry->lru_link);
+    g_queue_push_head_link (&priv->cache_lru, entry->lru_link);
+
+    if (user)
+        *user = entry_to_emailuser (entry);
+    if (passwd)
+        memcpy (passwd, entry->passwd, sizeof(entry->passwd));
+
+    pthread_mutex_unlock (&priv->cache_lock);
+    return TRUE;
+}
+
+static guint
+cache_generation (CcnetUserManagerPriv *priv)
+{
+    guint gen;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    gen = priv->cache_gen;
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    return gen;
+}
+
+/* Takes ownership of @entry. */
+static void
+cache_insert (CcnetUserManager *manager, UserCacheEntry *entry, guint gen)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    UserCacheEntry *old;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    if (priv->cache_size <= 0 || gen != priv->cache_gen) {
+        pthread_mutex_unlock (&priv->cache_lock);
+        g_free (entry->email);
+        g_free (entry);
+        return;
+    }
+
+    old = g_hash_table_lookup (priv->cache_by_email, entry->email);
+    if (old)
+        cache_remove_entry (priv, old);
+    old = g_hash_table_lookup (priv->cache_by_id, GINT_TO_POINTER(entry->id));
+    if (old)
+        cache_remove_entry (priv, old);
+
+    entry->expire = time(NULL) + priv->cache_ttl;
+    g_queue_push_head (&priv->cache_lru, entry);
+    entry->lru_link = priv->cache_lru.head;
+    g_hash_table_insert (priv->cache_by_email, entry->email, entry);
+    g_hash_table_insert (priv->cache_by_id, GINT_TO_POINTER(entry->id), entry);
+
+    while (priv->cache_lru.length > (guint)priv->cache_size)
+        cache_remove_entry (priv, priv->cache_lru.tail->data);
+
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+static gboolean
+auth_entry_matches (gpointer key, gpointer value, gpointer email)
+{
+    return g_strcmp0 (((AuthCacheEntry *)value)->email, email) == 0;
+}
+
+/*
+ * Drop the entry for @email, or for @id if @email is NULL. Validated
+ * credentials of @email are dropped too; those of @id can't be found
+ * without the email, so all of them are.
+ */
+static void
+cache_drop (CcnetUserManager *manager, const char *email, int id)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    UserCacheEntry *entry;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    ++priv->cache_gen;
+    if (email)
+        entry = g_hash_table_lookup (priv->cache_by_email, email);
+    else
+        entry = g_hash_table_lookup (priv->cache_by_id, GINT_TO_POINTER(id));
+    if (entry)
+        cache_remove_entry (priv, entry);
+
+    if (email)
+        g_hash_table_foreach_remove (priv->auth_cache, auth_entry_matches,
+                                     (gpointer)email);
+    else
+        g_hash_table_remove_all (priv->auth_cache);
+
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+static void
+cache_drop_all (CcnetUserManager *manager)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    ++priv->cache_gen;
+    while (priv->cache_lru.head)
+        cache_remove_entry (priv, priv->cache_lru.head->data);
+    g_hash_table_remove_all (priv->auth_cache);
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+/* Drop the entry here and on the other nodes. */
+static void
+cache_invalidate (CcnetUserManager *manager, const char *email, int id)
+{
+    char buf[16];
+
+    cache_drop (manager, email, id);
+    if (email) {
+        ccnet_cache_bus_publish ("user", email);
+    } else {
+        snprintf (buf, sizeof(buf), "%d", id);
+        ccnet_cache_bus_publish ("user-id", buf);
+    }
+}
+
+static gboolean
+get_cache_entry_cb (CcnetDBRow *row, void *data)
+{
+    UserCacheEntry *entry = data;
+    const char *passwd;
+
+    entry->id = ccnet_db_row_get_column_int (row, 0);
+    entry->email = g_strdup (ccnet_db_row_get_column_text (row, 1));
+    passwd = ccnet_db_row_get_column_text (row, 2);
+    if (passwd)
+        g_strlcpy (entry->passwd, passwd, sizeof(entry->passwd));
+    entry->is_staff = ccnet_db_row_get_column_int (row, 3);
+    entry->is_active = ccnet_db_row_get_column_int (row, 4);
+    entry->ctime = ccnet_db_row_get_column_int64 (row, 5);
+
+    return FALSE;
+}
+
+/* Same interface as cache_lookup(), reading the row from the database. */
+static gboolean
+load_emailuser (CcnetUserManager *manager, const char *email, int id,
+                CcnetEmailUser **user, char *passwd)
+{
+    CcnetDB *db = manager->priv->db;
+    UserCacheEntry *entry;
+    guint gen;
+    int n;
+
+    gen = cache_generation (manager->priv);
+    entry = g_new0 (UserCacheEntry, 1);
+
+    if (email)
+        n = ccnet_db_statement_foreach_row (db,
+                                            "SELECT id, email, passwd, is_staff, "
+                                            "is_active, ctime FROM EmailUser "
+                                            "WHERE email=?",
+                                            get_cache_entry_cb, entry,
+                                            1, "string", email);
+    else
+        n = ccnet_db_statement_foreach_row (db,
+                                            "SELECT id, email, passwd, is_staff, "
+                                            "is_active, ctime FROM EmailUser "
+                                            "WHERE id=?",
+                                            get_cache_entry_cb, entry,
+                                            1, "int", id);
+    if (n <= 0 || !entry->email) {
+        g_free (entry->email);
+        g_free (entry);
+        return FALSE;
+    }
+
+    if (user)
+        *user = entry_to_emailuser (entry);
+    if (passwd)
+        memcpy (passwd, entry->passwd, sizeof(entry->passwd));
+
+    cache_insert (manager, entry, gen);
+    return TRUE;
+}
+
+static gboolean
+lookup_emailuser (CcnetUserManager *manager, const char *email, int id,
+                  CcnetEmailUser **user, char *passwd)
+{
+    return cache_lookup (manager, email, id, user, passwd) ||
+        load_emailuser (manager, email, id, user, passwd);
+}
+
+char *
+ccnet_user_manager_get_cache_stats (CcnetUserManager *manager)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    char *ret;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    ret = g_strdup_printf ("size %u\nmax %d\nttl %d\n"
+                           "hits %" G_GINT64_FORMAT "\n"
+                           "misses %" G_GINT64_FORMAT "\n"
+                           "bindings %u\n",
+                           priv->cache_lru.length, priv->cache_size,
+                           priv->cache_ttl, priv->cache_hits,
+                           priv->cache_misses,
+                           g_hash_table_size (priv->binding_cache));
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    return ret;
+}
+
+
 /* -------- EmailUser Management -------- */
 
+/*
+ * COUNT(*) scans the whole table on InnoDB. The count is kept in memory
+ * and adjusted by the writes below; since other nodes may write too, it
+ * is recounted every USER_COUNT_RECONCILE seconds by one caller while
+ * the others return the kept value.
+ */
+static void
+user_count_adjust (CcnetUserManager *manager, gint64 delta)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    if (priv->user_count >= 0)
+        priv->user_count = MAX (priv->user_count + delta, 0);
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    ccnet_cache_bus_publish ("user-count", NULL);
+}
+
+static gint64
+user_count_cached (CcnetUserManager *manager)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    gboolean refresh = FALSE;
+    gint64 count;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    count = priv->user_count;
+    if ((count < 0 ||
+         time(NULL) - priv->user_count_time >= USER_COUNT_RECONCILE)
+        && !priv->user_count_refreshing) {
+        priv->user_count_refreshing = TRUE;
+        refresh = TRUE;
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    if (!refresh && count >= 0)
+        return count;
+
+    count = ccnet_db_get_int64 (priv->db, "SELECT COUNT(*) FROM EmailUser");
+    if (!refresh)
+        return count;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    if (count >= 0) {
+        priv->user_count = count;
+        priv->user_count_time = time(NULL);
+    }
+    priv->user_count_refreshing = FALSE;
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    return count;
+}
+
+static void binding_cache_drop (CcnetUserManager *manager,
+                                const char *peer_id);
+static void binding_cache_drop_email (CcnetUserManager *manager,
+                                      const char *email);
+
+/* A write on another node, see cache-bus.h. */
+static void
+on_cache_event (const char *domain, const char *key, void *vmanager)
+{
+    CcnetUserManager *manager = vmanager;
+    CcnetUserManagerPriv *priv = manager->priv;
+
+    if (strcmp (domain, "user") == 0 || strcmp (domain, "user-id") == 0) {
+        if (!key)
+            cache_drop_all (manager);
+        else if (domain[4] == '\0')
+            cache_drop (manager, key, -1);
+        else
+            cache_drop (manager, NULL, atoi (key));
+    } else if (strcmp (domain, "user-count") == 0) {
+        /* recounted by the next caller */
+        pthread_mutex_lock (&priv->cache_lock);
+        priv->user_count_time = 0;
+        pthread_mutex_unlock (&priv->cache_lock);
+    } else if (strcmp (domain, "binding") == 0) {
+        binding_cache_drop (manager, key);
+    } else if (strcmp (domain, "binding-email") == 0) {
+        if (key)
+            binding_cache_drop_email (manager, key);
+        else
+            binding_cache_drop (manager, NULL);
+    }
+}
+
 static void
 hash_password (const char *passwd, char *hashed_passwd)
 {
@@ -467,6 +1057,7 @@ ccnet_user_manager_add_emailuser (CcnetUserManager *manager,
     gint64 now = get_current_time();
     char sql[512];
     char hashed_passwd[41];
+    int ret;
 
 #ifdef HAVE_LDAP
     if (manager->use_ldap)
@@ -480,7 +1071,14 @@ ccnet_user_manager_add_emailuser (CcnetUserManager *manager,
               "%"G_GINT64_FORMAT")", email, hashed_passwd, is_staff,
               is_active, now);
 
-    return ccnet_db_query (db, sql);
+    ret = ccnet_db_query (db, sql);
+    cache_invalidate (manager, email, -1);
+    if (ret == 0) {
+        user_count_adjust (manager, 1);
+        ccnet_change_log_record ("user", "add", email, NULL);
+    }
+
+    return ret;
 }
 
 int
@@ -489,6 +1087,7 @@ ccnet_user_manager_remove_emailuser (CcnetUserManager *manager,
 {
     CcnetDB *db = manager->priv->db;
     char sql[512];
+    gint64 changes;
 
 #ifdef HAVE_LDAP
     if (manager->use_ldap)
@@ -497,7 +1096,14 @@ ccnet_user_manager_remove_emailuser (CcnetUserManager *manager,
 
     snprintf (sql, 512, "DELETE FROM EmailUser WHERE email='%s'", email);
 
-    return ccnet_db_query (db, sql);
+    changes = ccnet_db_query_changes (db, sql);
+    cache_invalidate (manager, email, -1);
+    if (changes > 0) {
+        user_count_adjust (manager, -changes);
+        ccnet_change_log_record ("user", "remove", email, NULL);
+    }
+
+    return changes < 0 ? -1 : 0;
 }
 
 static gboolean
@@ -521,19 +1127,98 @@ get_emailuser_cb (CcnetDBRow *row, void *data)
     return FALSE;
 }
 
-int
-ccnet_user_manager_validate_emailuser (CcnetUserManager *manager,
-                                       const char *email,
-                                       const char *passwd)
+/* -------- Validated Credentials -------- */
+
+/*
+ * Clients re-authenticate on every request. A successful validation is
+ * remembered for [User] AUTH_CACHE_TTL seconds under the HMAC of the
+ * email and password, with a key made at startup, so a repeat skips
+ * both the password hash and the database or LDAP. The password itself
+ * is never stored. Failures are not cached.
+ */
+
+static void
+auth_cache_key (CcnetUserManagerPriv *priv, const char *email,
+                const char *passwd, char *key)
+{
+    int email_len = strlen(email) + 1, passwd_len = strlen(passwd);
+    unsigned char *buf = g_malloc (email_len + passwd_len);
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int mac_len;
+
+    memcpy (buf, email, email_len);
+    memcpy (buf + email_len, passwd, passwd_len);
+    HMAC (EVP_sha256(), priv->auth_key, AUTH_KEY_LEN,
+          buf, email_len + passwd_len, mac, &mac_len);
+    memset (buf, 0, email_len + passwd_len);
+    g_free (buf);
+
+    rawdata_to_hex (mac, key, mac_len);
+}
+
+static gboolean
+auth_cache_lookup (CcnetUserManagerPriv *priv, const char *key)
+{
+    AuthCacheEntry *entry;
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    entry = g_hash_table_lookup (priv->auth_cache, key);
+    if (entry) {
+        if (entry->expire > time(NULL))
+            ret = TRUE;
+        else
+            g_hash_table_remove (priv->auth_cache, key);
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    return ret;
+}
+
+static gboolean
+remove_expired_auth_entry (gpointer key, gpointer value, gpointer now)
+{
+    return ((AuthCacheEntry *)value)->expire <= *(time_t *)now;
+}
+
+/* Only inserts if nothing was invalidated since @gen was read. */
+static void
+auth_cache_insert (CcnetUserManagerPriv *priv, const char *key,
+                   const char *email, guint gen)
+{
+    AuthCacheEntry *entry;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock (&priv->cache_lock);
+    if (gen == priv->cache_gen) {
+        if (g_hash_table_size (priv->auth_cache) >= AUTH_CACHE_MAX_ENTRIES) {
+            g_hash_table_foreach_remove (priv->auth_cache,
+                                         remove_expired_auth_entry, &now);
+            if (g_hash_table_size (priv->auth_cache) >= AUTH_CACHE_MAX_ENTRIES)
+                g_hash_table_remove_all (priv->auth_cache);
+        }
+        entry = g_new0 (AuthCacheEntry, 1);
+        entry->email = g_strdup (email);
+        entry->expire = now + priv->auth_cache_ttl;
+        g_hash_table_replace (priv->auth_cache, g_strdup (key), entry);
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+static int
+validate_emailuser (CcnetUserManager *manager,
+                    const char *email,
+                    const char *passwd)
 {
-    CcnetDB *db = manager->priv->db;
-    char sql[512];
     char hashed_passwd[41];
+    char stored_passwd[41];
 
     hash_password (passwd, hashed_passwd);
 
 #ifdef HAVE_LDAP
     if (manager->use_ldap) {
+        CcnetDB *db = manager->priv->db;
+        char sql[512];
         CcnetEmailUser *emailuser;
 
         snprintf (sql, sizeof(sql), 
@@ -554,42 +1239,69 @@ ccnet_user_manager_validate_emailuser (CcnetUserManager *manager,
     }
 #endif
 
-    snprintf (sql, 512, "SELECT email FROM EmailUser WHERE email='%s' AND "
-              "passwd='%s'", email, hashed_passwd);
-    
-    if (ccnet_db_check_for_existence (db, sql))
+    if (!lookup_emailuser (manager, email, -1, NULL, stored_passwd))
+        return -1;
+    if (strcmp (stored_passwd, hashed_passwd) == 0)
         return 0;
     return -1;
 }
 
+int
+ccnet_user_manager_validate_emailuser (CcnetUserManager *manager,
+                                       const char *email,
+                                       const char *passwd)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    char key[EVP_MAX_MD_SIZE * 2 + 1];
+    guint gen;
+
+    if (priv->auth_cache_ttl <= 0)
+        return validate_emailuser (manager, email, passwd);
+
+    auth_cache_key (priv, email, passwd, key);
+    if (auth_cache_lookup (priv, key))
+        return 0;
+
+    gen = cache_generation (priv);
+    if (validate_emailuser (manager, email, passwd) < 0)
+        return -1;
+    auth_cache_insert (priv, key, email, gen);
+    return 0;
+}
+
 CcnetEmailUser*
 ccnet_user_manager_get_emailuser (CcnetUserManager *manager,
                                   const char *email)
 {
-    CcnetDB *db = manager->priv->db;
-    char sql[512];
     CcnetEmailUser *emailuser = NULL;
 
 #ifdef HAVE_LDAP
     if (manager->use_ldap) {
+        CcnetDB *db = manager->priv->db;
         GList *users, *ptr;
 
         /* Lookup admin first. */
-        snprintf (sql, sizeof(sql), 
-                  "SELECT id, email, is_staff, is_active, ctime"
-                  " FROM EmailUser WHERE email='%s'", email);
-        if (ccnet_db_foreach_selected_row (db, sql,
-                                           get_emailuser_cb, &emailuser) > 0)
+        if (ccnet_db_statement_foreach_row (db,
+                                            "SELECT id, email, is_staff, is_active, ctime"
+                                            " FROM EmailUser WHERE email=?",
+                                            get_emailuser_cb, &emailuser,
+                                            1, "string", email) > 0)
         {
             if (ccnet_email_user_get_is_staff(emailuser))
                 return emailuser;
             g_object_unref (emailuser);
         }
 
+        if (ldap_cache_lookup (manager, email, &emailuser))
+            return emailuser;
+
         users = ldap_list_users (manager, email);
-        if (!users)
+        if (!users) {
+            ldap_cache_insert (manager, email, NULL);
             return NULL;
+        }
         emailuser = users->data;
+        ldap_cache_insert (manager, email, emailuser);
 
         /* Free all except the first user. */
         for (ptr = users->next; ptr; ptr = ptr->next)
@@ -600,11 +1312,7 @@ ccnet_user_manager_get_emailuser (CcnetUserManager *manager,
     }
 #endif
 
-    snprintf (sql, sizeof(sql), 
-              "SELECT id, email, is_staff, is_active, ctime"
-              " FROM EmailUser WHERE email='%s'", email);
-    if (ccnet_db_foreach_selected_row (db, sql, get_emailuser_cb, &emailuser) < 0)
-        return NULL;
+    lookup_emailuser (manager, email, -1, &emailuser, NULL);
     
     return emailuser;
 }
@@ -612,8 +1320,6 @@ ccnet_user_manager_get_emailuser (CcnetUserManager *manager,
 CcnetEmailUser*
 ccnet_user_manager_get_emailuser_by_id (CcnetUserManager *manager, int id)
 {
-    CcnetDB *db = manager->priv->db;
-    char sql[512];
     CcnetEmailUser *emailuser = NULL;
 
 #ifdef HAVE_LDAP
@@ -621,11 +1327,7 @@ ccnet_user_manager_get_emailuser_by_id (CcnetUserManager *manager, int id)
         return NULL;
 #endif
 
-    snprintf (sql, sizeof(sql), 
-              "SELECT id, email, is_staff, is_active, ctime"
-              " FROM EmailUser WHERE id='%d'", id);
-    if (ccnet_db_foreach_selected_row (db, sql, get_emailuser_cb, &emailuser) < 0)
-        return NULL;
+    lookup_emailuser (manager, NULL, id, &emailuser, NULL);
     
     return emailuser;
 }
@@ -667,7 +1369,7 @@ ccnet_user_manager_get_emailusers (CcnetUserManager *manager, int start, int lim
      * is_staff is not set here.
      */
     if (manager->use_ldap)
-        return ldap_list_users (manager, "*");
+        return ldap_list_all_users (manager, start, limit);
 #endif
 
     if (start == -1 && limit == -1)
@@ -687,20 +1389,193 @@ ccnet_user_manager_get_emailusers (CcnetUserManager *manager, int start, int lim
     return g_list_reverse (ret);
 }
 
-gint64
-ccnet_user_manager_count_emailusers (CcnetUserManager *manager)
+void
+ccnet_user_manager_emailuser_rec_from_row (CcnetDBRow *row,
+                                           CcnetEmailUserRec *rec)
 {
-    CcnetDB* db = manager->priv->db;
-    char sql[512];
+    rec->id = ccnet_db_row_get_column_int (row, 0);
+    rec->email = g_strdup (ccnet_db_row_get_column_text (row, 1));
+    rec->is_staff = ccnet_db_row_get_column_int (row, 3);
+    rec->is_active = ccnet_db_row_get_column_int (row, 4);
+    rec->ctime = ccnet_db_row_get_column_int64 (row, 5);
+}
+
+static gboolean
+get_emailuser_recs_cb (CcnetDBRow *row, void *data)
+{
+    GArray *recs = data;
+    CcnetEmailUserRec rec;
+
+    ccnet_user_manager_emailuser_rec_from_row (row, &rec);
+    g_array_append_val (recs, rec);
+
+    return TRUE;
+}
+
+CcnetDBCursor *
+ccnet_user_manager_open_emailusers (CcnetUserManager *manager,
+                                    int start, int limit)
+{
+    char sql[256];
+
+#ifdef HAVE_LDAP
+    if (manager->use_ldap)
+        return NULL;
+#endif
+
+    if (start == -1 && limit == -1)
+        snprintf (sql, 256, "SELECT * FROM EmailUser");
+    else
+        snprintf (sql, 256, "SELECT * FROM EmailUser LIMIT %d, %d",
+                  start, limit);
+
+    return ccnet_db_cursor_open (manager->priv->db, sql);
+}
+
+GArray*
+ccnet_user_manager_get_emailuser_recs (CcnetUserManager *manager,
+                                       int start, int limit)
+{
+    CcnetDB *db = manager->priv->db;
+    GArray *recs = g_array_new (FALSE, FALSE, sizeof(CcnetEmailUserRec));
+    char sql[256];
+
+#ifdef HAVE_LDAP
+    if (manager->use_ldap) {
+        GList *users = ldap_list_all_users (manager, start, limit), *ptr;
+        CcnetEmailUserRec rec;
+
+        for (ptr = users; ptr; ptr = ptr->next) {
+            ccnet_email_user_rec_from_object (&rec, ptr->data);
+            g_array_append_val (recs, rec);
+            g_object_unref (ptr->data);
+        }
+        g_list_free (users);
+        return recs;
+    }
+#endif
+
+    if (start == -1 && limit == -1)
+        snprintf (sql, 256, "SELECT * FROM EmailUser");
+    else
+        snprintf (sql, 256, "SELECT * FROM EmailUser LIMIT %d, %d",
+                  start, limit);    
+
+    if (ccnet_db_foreach_selected_row (db, sql, get_emailuser_recs_cb,
+                                       recs) < 0) {
+        ccnet_email_user_rec_array_free (recs);
+        return NULL;
+    }
+
+    return recs;
+}
+
+GList*
+ccnet_user_manager_get_emailusers_after (CcnetUserManager *manager,
+                                         int last_id, int limit)
+{
+    CcnetDB *db = manager->priv->db;
+    GList *ret = NULL;
+
+#ifdef HAVE_LDAP
+    /* LDAP users have no ids, return everything as one page. */
+    if (manager->use_ldap)
+        return last_id < 0 ? ldap_list_all_users (manager, -1, -1) : NULL;
+#endif
+
+    if (ccnet_db_statement_foreach_row (db,
+                                        "SELECT id, email, passwd, is_staff, "
+                                        "is_active, ctime FROM EmailUser "
+                                        "WHERE id > ? ORDER BY id LIMIT ?",
+                                        get_emailusers_cb, &ret,
+                                        2, "int", last_id, "int", limit) < 0) {
+        while (ret != NULL) {
+            g_object_unref (ret->data);
+            ret = g_list_delete_link (ret, ret);
+        }
+        return NULL;
+    }
+
+    return g_list_reverse (ret);
+}
+
+/* The least string greater than every string starting with @prefix, NULL
+ * if there is none. */
+static char *
+prefix_upper_bound (const char *prefix)
+{
+    char *bound = g_strdup (prefix);
+    int i;
+
+    for (i = strlen (bound) - 1; i >= 0; --i) {
+        if ((guchar)bound[i] < 0xff) {
+            ++bound[i];
+            bound[i + 1] = '\0';
+            return bound;
+        }
+    }
+    g_free (bound);
+    return NULL;
+}
+
+GList*
+ccnet_user_manager_search_emailusers (CcnetUserManager *manager,
+                                      const char *prefix, int limit)
+{
+    CcnetDB *db = manager->priv->db;
+    GList *ret = NULL;
+    char *bound;
+    int rc;
 
 #ifdef HAVE_LDAP
     if (manager->use_ldap)
-        return (gint64) ldap_count_users (manager, "*");
+        return ldap_search_users (manager, prefix, limit);
 #endif
 
-    snprintf (sql, 512, "SELECT COUNT(*) FROM EmailUser");
+    /* A range on email, so the unique index on it is used; LIKE would
+     * need care with '%' and '_' and is not indexed everywhere. */
+    bound = prefix_upper_bound (prefix);
+    if (bound)
+        rc = ccnet_db_statement_foreach_row (db,
+                                             "SELECT id, email, passwd, "
+                                             "is_staff, is_active, ctime "
+                                             "FROM EmailUser WHERE email >= ? "
+                                             "AND email < ? ORDER BY email "
+                                             "LIMIT ?",
+                                             get_emailusers_cb, &ret,
+                                             3, "string", prefix,
+                                             "string", bound, "int", limit);
+    else
+        rc = ccnet_db_statement_foreach_row (db,
+                                             "SELECT id, email, passwd, "
+                                             "is_staff, is_active, ctime "
+                                             "FROM EmailUser WHERE email >= ? "
+                                             "ORDER BY email LIMIT ?",
+                                             get_emailusers_cb, &ret,
+                                             2, "string", prefix,
+                                             "int", limit);
+    g_free (bound);
+
+    if (rc < 0) {
+        while (ret != NULL) {
+            g_object_unref (ret->data);
+            ret = g_list_delete_link (ret, ret);
+        }
+        return NULL;
+    }
 
-    return ccnet_db_get_int64 (db, sql);
+    return g_list_reverse (ret);
+}
+
+gint64
+ccnet_user_manager_count_emailusers (CcnetUserManager *manager)
+{
+#ifdef HAVE_LDAP
+    if (manager->use_ldap)
+        return (gint64) ldap_count_users_cached (manager);
+#endif
+
+    return user_count_cached (manager);
 }
 
 int
@@ -711,6 +1586,7 @@ ccnet_user_manager_update_emailuser (CcnetUserManager *manager,
     CcnetDB* db = manager->priv->db;
     char sql[512];
     char hashed_passwd[41];
+    int ret;
 
 #ifdef HAVE_LDAP
     if (!manager->use_ldap || is_staff) {
@@ -726,7 +1602,14 @@ ccnet_user_manager_update_emailuser (CcnetUserManager *manager,
                       hashed_passwd, is_staff, is_active, id);
         }
         
-        return ccnet_db_query (db, sql);
+        ret = ccnet_db_query (db, sql);
+        cache_invalidate (manager, NULL, id);
+        if (ret == 0) {
+            char buf[16];
+            snprintf (buf, sizeof(buf), "%d", id);
+            ccnet_change_log_record ("user", "update", buf, NULL);
+        }
+        return ret;
 #ifdef HAVE_LDAP
     }
 #endif
@@ -734,3 +1617,401 @@ ccnet_user_manager_update_emailuser (CcnetUserManager *manager,
     return 0;
 }
 
+
+/* -------- Binding -------- */
+
+/*
+ * The email of a peer is looked up for every sync request of the peer,
+ * so the answers, bound or not, are kept for cache_ttl seconds. Changes
+ * through this manager are written through; the TTL bounds staleness of
+ * changes from other nodes. As for EmailUser, a reader doesn't put back
+ * what it read if the bindings changed while it queried the database.
+ */
+
+static gboolean
+remove_expired_binding (gpointer key, gpointer value, gpointer now)
+{
+    return ((BindingCacheEntry *)value)->expire <= *(time_t *)now;
+}
+
+/* Under cache_lock. */
+static void
+binding_cache_set_locked (CcnetUserManagerPriv *priv, const char *peer_id,
+                          const char *email, time_t now)
+{
+    BindingCacheEntry *entry;
+
+    if (priv->cache_ttl <= 0)
+        return;
+
+    if (g_hash_table_size (priv->binding_cache) >= BINDING_CACHE_MAX_ENTRIES) {
+        g_hash_table_foreach_remove (priv->binding_cache,
+                                     remove_expired_binding, &now);
+        if (g_hash_table_size (priv->binding_cache) >= BINDING_CACHE_MAX_ENTRIES)
+            g_hash_table_remove_all (priv->binding_cache);
+    }
+
+    entry = g_new0 (BindingCacheEntry, 1);
+    entry->email = g_strdup (email);
+    entry->expire = now + priv->cache_ttl;
+    g_hash_table_replace (priv->binding_cache, g_strdup (peer_id), entry);
+}
+
+/* Write-through of a change to the binding of @peer_id. */
+static void
+binding_cache_update (CcnetUserManager *manager, const char *peer_id,
+                      const char *email)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    ++priv->binding_gen;
+    binding_cache_set_locked (priv, peer_id, email, time(NULL));
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    ccnet_cache_bus_publish ("binding", peer_id);
+}
+
+/* Returns TRUE on a hit, with a copy of the email, or NULL, in @email. */
+static gboolean
+binding_cache_lookup (CcnetUserManager *manager, const char *peer_id,
+                      char **email, guint *gen)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    BindingCacheEntry *entry;
+    gboolean hit = FALSE;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    entry = g_hash_table_lookup (priv->binding_cache, peer_id);
+    if (entry && entry->expire <= time(NULL)) {
+        g_hash_table_remove (priv->binding_cache, peer_id);
+        entry = NULL;
+    }
+    if (entry) {
+        *email = g_strdup (entry->email);
+        hit = TRUE;
+    }
+    *gen = priv->binding_gen;
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    return hit;
+}
+
+static void
+binding_cache_insert (CcnetUserManager *manager, const char *peer_id,
+                      const char *email, guint gen)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    if (gen == priv->binding_gen)
+        binding_cache_set_locked (priv, peer_id, email, time(NULL));
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+/* Whatever is in the table for @peer_id now, we don't know it. NULL
+ * for all. */
+static void
+binding_cache_drop (CcnetUserManager *manager, const char *peer_id)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    ++priv->binding_gen;
+    if (peer_id)
+        g_hash_table_remove (priv->binding_cache, peer_id);
+    else
+        g_hash_table_remove_all (priv->binding_cache);
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+static gboolean
+binding_matches_email (gpointer key, gpointer value, gpointer email)
+{
+    return g_strcmp0 (((BindingCacheEntry *)value)->email, email) == 0;
+}
+
+static void
+binding_cache_drop_email (CcnetUserManager *manager, const char *email)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    ++priv->binding_gen;
+    g_hash_table_foreach_remove (priv->binding_cache, binding_matches_email,
+                                 (gpointer)email);
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+int
+ccnet_user_manager_add_binding (CcnetUserManager *manager, const char *email,
+                                const char *peer_id)
+{
+    int ret;
+
+    ret = ccnet_db_statement_query (manager->priv->db,
+                                    "INSERT INTO Binding (email, peer_id) "
+                                    "VALUES (?, ?)",
+                                    2, "string", email, "string", peer_id);
+    if (ret < 0) {
+        binding_cache_drop (manager, peer_id);
+        ccnet_cache_bus_publish ("binding", peer_id);
+        return -1;
+    }
+
+    binding_cache_update (manager, peer_id, email);
+    return 0;
+}
+
+int
+ccnet_user_manager_remove_binding (CcnetUserManager *manager, const char *email)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    int ret;
+
+    ret = ccnet_db_statement_query (priv->db,
+                                    "DELETE FROM Binding WHERE email = ?",
+                                    1, "string", email);
+
+    binding_cache_drop_email (manager, email);
+    ccnet_cache_bus_publish ("binding-email", email);
+
+    return ret < 0 ? -1 : 0;
+}
+
+int
+ccnet_user_manager_remove_one_binding (CcnetUserManager *manager,
+                                       const char *email,
+                                       const char *peer_id)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    int ret;
+
+    ret = ccnet_db_statement_query (priv->db,
+                                    "DELETE FROM Binding WHERE email = ? "
+                                    "AND peer_id = ?",
+                                    2, "string", email, "string", peer_id);
+
+    binding_cache_drop (manager, peer_id);
+    ccnet_cache_bus_publish ("binding", peer_id);
+
+    return ret < 0 ? -1 : 0;
+}
+
+char *
+ccnet_user_manager_get_binding_email (CcnetUserManager *manager,
+                                      const char *peer_id)
+{
+    char *email = NULL;
+    guint gen;
+
+    if (binding_cache_lookup (manager, peer_id, &email, &gen))
+        return email;
+
+    email = ccnet_db_statement_get_string (manager->priv->db,
+                                           "SELECT email FROM Binding "
+                                           "WHERE peer_id = ?",
+                                           1, "string", peer_id);
+    binding_cache_insert (manager, peer_id, email, gen);
+
+    return email;
+}
+
+static gboolean
+get_peer_ids_cb (CcnetDBRow *row, void *data)
+{
+    GList **p_list = data;
+    const char *peer_id = ccnet_db_row_get_column_text (row, 0);
+
+    *p_list = g_list_prepend (*p_list, g_strdup (peer_id));
+    return TRUE;
+}
+
+GList *
+ccnet_user_manager_get_binding_peerids (CcnetUserManager *manager,
+                                        const char *email)
+{
+    GList *ret = NULL;
+
+    if (ccnet_db_statement_foreach_row (manager->priv->db,
+                                        "SELECT peer_id FROM Binding "
+                                        "WHERE email = ?",
+                                        get_peer_ids_cb, &ret,
+                                        1, "string", email) < 0) {
+        while (ret) {
+            g_free (ret->data);
+            ret = g_list_delete_link (ret, ret);
+        }
+        return NULL;
+    }
+
+    return g_list_reverse (ret);
+}
+
+/*
+ * At start the bindings of the peers we know are read in a few queries,
+ * so the peers reconnecting after a restart don't each cost one.
+ */
+
+typedef struct BindingPrefetch {
+    CcnetUserManager *manager;
+    GPtrArray *peer_ids;
+    guint gen;
+} BindingPrefetch;
+
+static gboolean
+collect_peer_id (CcnetPeer *peer, void *data)
+{
+    GPtrArray *peer_ids = data;
+
+    if (!peer->is_self)
+        g_ptr_array_add (peer_ids, g_strdup (peer->id));
+    return TRUE;
+}
+
+static gboolean
+prefetch_binding_cb (CcnetDBRow *row, void *data)
+{
+    GHashTable *found = data;
+    const char *email = ccnet_db_row_get_column_text (row, 0);
+    const char *peer_id = ccnet_db_row_get_column_text (row, 1);
+
+    if (peer_id)
+        g_hash_table_replace (found, g_strdup (peer_id), g_strdup (email));
+    return TRUE;
+}
+
+static void *
+prefetch_bindings_thread (void *vdata)
+{
+    BindingPrefetch *data = vdata;
+    CcnetUserManagerPriv *priv = data->manager->priv;
+    char **ids = (char **)data->peer_ids->pdata;
+    guint n_ids = data->peer_ids->len;
+    GHashTable *found;
+    GString *sql;
+    guint i, j, n;
+    time_t now;
+
+    found = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    sql = g_string_new (NULL);
+    for (i = 0; i < n_ids; i += n) {
+        n = MIN (n_ids - i, BINDING_PREFETCH_BATCH);
+        g_string_assign (sql, "SELECT email, peer_id FROM Binding "
+                         "WHERE peer_id IN (");
+        for (j = 0; j < n; j++)
+            g_string_append (sql, j ? ", ?" : "?");
+        g_string_append (sql, ")");
+
+        if (ccnet_db_statement_foreach_row_strv (priv->db, sql->str,
+                                                 prefetch_binding_cb, found,
+                                                 ids + i, n) < 0) {
+            /* What isn't cached is looked up as usual. */
+            n_ids = i;
+            break;
+        }
+    }
+    g_string_free (sql, TRUE);
+
+    now = time(NULL);
+    pthread_mutex_lock (&priv->cache_lock);
+    if (data->gen == priv->binding_gen) {
+        for (i = 0; i < n_ids; i++)
+            binding_cache_set_locked (priv, ids[i],
+                                      g_hash_table_lookup (found, ids[i]),
+                                      now);
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    g_hash_table_destroy (found);
+    return data;
+}
+
+static void
+prefetch_bindings_done (void *vdata)
+{
+    BindingPrefetch *data = vdata;
+
+    ccnet_debug ("[User] Prefetched bindings of %u peers\n",
+                 data->peer_ids->len);
+    g_ptr_array_free (data->peer_ids, TRUE);
+    g_free (data);
+}
+
+static void
+prefetch_bindings (CcnetUserManager *manager)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    BindingPrefetch *data;
+
+    if (priv->cache_ttl <= 0)
+        return;
+
+    data = g_new0 (BindingPrefetch, 1);
+    data->manager = manager;
+    data->peer_ids = g_ptr_array_new_with_free_func (g_free);
+    ccnet_peer_manager_foreach (manager->session->peer_mgr,
+                                collect_peer_id, data->peer_ids);
+    if (data->peer_ids->len == 0) {
+        g_ptr_array_free (data->peer_ids, TRUE);
+        g_free (data);
+        return;
+    }
+
+    pthread_mutex_lock (&priv->cache_lock);
+    data->gen = priv->binding_gen;
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    ccnet_job_manager_schedule_job (ccnet_db_get_job_manager (priv->db),
+                                    prefetch_bindings_thread,
+                                    prefetch_bindings_done, data);
+}
+
+int
+ccnet_user_manager_preload_bindings (CcnetUserManager *manager)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    GHashTable *found;
+    GHashTableIter iter;
+    gpointer key, value;
+    char sql[128];
+    guint gen;
+    int n = 0;
+    time_t now;
+
+    if (priv->cache_ttl <= 0)
+        return 0;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    gen = priv->binding_gen;
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    found = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    snprintf (sql, sizeof(sql), "SELECT email, peer_id FROM Binding LIMIT %d",
+              BINDING_PRELOAD_MAX);
+    if (ccnet_db_foreach_selected_row (priv->db, sql, prefetch_binding_cb,
+                                       found) < 0) {
+        g_hash_table_destroy (found);
+        return -1;
+    }
+
+    now = time(NULL);
+    pthread_mutex_lock (&priv->cache_lock);
+    if (gen == priv->binding_gen) {
+        g_hash_table_iter_init (&iter, found);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            binding_cache_set_locked (priv, key, value, now);
+            ++n;
+        }
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    g_hash_table_destroy (found);
+    return n;
+}
+
+CcnetJobManager *
+ccnet_user_manager_get_job_manager (CcnetUserManager *manager)
+{
+    return ccnet_db_get_job_manager (manager->priv->db);
+}
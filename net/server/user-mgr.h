@@ -80,6 +80,43 @@ ccnet_user_manager_get_emailuser_by_id (CcnetUserManager *manager, int id);
 GList*
 ccnet_user_manager_get_emailusers (CcnetUserManager *manager, int start, int limit);
 
+/* The same as a GArray of CcnetEmailUserRec, without making objects.
+ * Free with ccnet_email_user_rec_array_free(). */
+GArray*
+ccnet_user_manager_get_emailuser_recs (CcnetUserManager *manager,
+                                       int start, int limit);
+
+struct CcnetDBCursor;
+struct CcnetDBRow;
+struct CcnetEmailUserRec;
+
+/* The same rows one at a time, for large listings. NULL with LDAP. */
+struct CcnetDBCursor *
+ccnet_user_manager_open_emailusers (CcnetUserManager *manager,
+                                    int start, int limit);
+
+void
+ccnet_user_manager_emailuser_rec_from_row (struct CcnetDBRow *row,
+                                           struct CcnetEmailUserRec *rec);
+
+/*
+ * Keyset paging: return up to @limit users with id greater than
+ * @last_id, ordered by id. Pass -1 for the first page and the id of the
+ * last user returned for the next one. Unlike @start above, the cost
+ * does not grow with the page number.
+ */
+GList*
+ccnet_user_manager_get_emailusers_after (CcnetUserManager *manager,
+                                         int last_id, int limit);
+
+/*
+ * Up to @limit users whose email starts with @prefix, ordered by email.
+ * Scans a range of the email index rather than the whole table.
+ */
+GList*
+ccnet_user_manager_search_emailusers (CcnetUserManager *manager,
+                                      const char *prefix, int limit);
+
 gint64
 ccnet_user_manager_count_emailusers (CcnetUserManager *manager);
 
@@ -102,10 +139,30 @@ ccnet_user_manager_remove_one_binding (CcnetUserManager *manager,
                                        const char *email,
                                        const char *peer_id);
 
+/* Served from a cache kept in step with the calls above. */
 char *
 ccnet_user_manager_get_binding_email (CcnetUserManager *manager, const char *peer_id);
 
+/* The ids are to be freed with the list. */
 GList *
 ccnet_user_manager_get_binding_peerids (CcnetUserManager *manager, const char *email);
 
+/* For the startup preload: fill the binding cache with one read of the
+ * Binding table, up to a cap. Returns how many were cached, -1 on
+ * error. Any thread. */
+int
+ccnet_user_manager_preload_bindings (CcnetUserManager *manager);
+
+/* Size, hit and miss counts of the EmailUser cache, one "name value"
+ * per line. */
+char *
+ccnet_user_manager_get_cache_stats (CcnetUserManager *manager);
+
+struct _CcnetJobManager;
+
+/* Thread pool of the user database, for running the calls above
+ * outside the main loop. */
+struct _CcnetJobManager *
+ccnet_user_manager_get_job_manager (CcnetUserManager *manager);
+
 #endif
@@ -0,0 +1,260 @@
+#!/usr/bin/env python
+# encoding: utf-8
+
+"""Benchmarks of the Python client against a local ccnet daemon.
+
+  latency     sync rpc round trips on one client, one at a time
+  throughput  rpc calls from -t threads sharing a pool of -n clients
+  large       results of -s bytes, which the Python rpc server sends
+              in SC_SERVER_MORE chunks the client asks for one by one
+  mq          mq-server messages sent by one client, received by another
+
+Each benchmark runs for -d seconds and prints one JSON object:
+
+  {"bench": "latency", "calls": 41213, "errors": 0, "seconds": 5.0,
+   "calls_per_sec": 8242.6, "p50_ms": 0.11, "p90_ms": 0.14,
+   "p99_ms": 0.31, "max_ms": 2.9}
+
+"large" adds "bytes" and "mb_per_sec", "mq" counts messages instead
+of calls. For "large" the script starts itself with "serve" in the
+background, which registers the pybench-rpcserver service with the
+daemon and answers it until killed.
+
+Usage: ccnet-pybench.py [-c conf-dir] [-d seconds] [-n clients]
+                        [-t threads] [-s size] [benchmark...]
+
+With no benchmark named, all of them are run.
+"""
+
+from __future__ import print_function
+
+import json
+import optparse
+import os
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+from pysearpc import searpc_func
+
+from ccnet.pool import ClientPool
+from ccnet.sync_client import SyncClient
+from ccnet.rpc import RpcClientBase, CcnetRpcClient
+
+BENCH_SERVICE = 'pybench-rpcserver'
+MQ_APP = 'pybench'
+BENCHMARKS = ('latency', 'throughput', 'large', 'mq')
+
+
+class BenchRpcClient(RpcClientBase):
+    def __init__(self, pool, *args, **kwargs):
+        RpcClientBase.__init__(self, pool, BENCH_SERVICE, *args, **kwargs)
+
+    @searpc_func('string', ['int'])
+    def blob(self, size):
+        pass
+
+
+def percentile(values, p):
+    if not values:
+        return 0
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+class Stats(object):
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latency = []           # ms
+        self.errors = 0
+
+    def add(self, ms, error=False):
+        with self.lock:
+            self.latency.append(ms)
+            if error:
+                self.errors += 1
+
+    def result(self, bench, elapsed, unit='calls'):
+        lat = sorted(self.latency)
+        return {
+            'bench': bench, unit: len(lat), 'errors': self.errors,
+            'seconds': round(elapsed, 3),
+            unit + '_per_sec': round(len(lat) / elapsed, 1) if elapsed else 0,
+            'p50_ms': round(percentile(lat, 0.5), 3),
+            'p90_ms': round(percentile(lat, 0.9), 3),
+            'p99_ms': round(percentile(lat, 0.99), 3),
+            'max_ms': round(lat[-1], 3) if lat else 0,
+        }
+
+
+def call_for(seconds, func, stats):
+    """Call func until `seconds` from now, timing each call."""
+    deadline = time.time() + seconds
+    while True:
+        start = time.time()
+        if start >= deadline:
+            return
+        try:
+            func()
+            error = False
+        except Exception:
+            error = True
+        stats.add((time.time() - start) * 1000, error)
+
+
+def bench_latency(opts):
+    rpc = CcnetRpcClient(ClientPool(opts.conf_dir, pool_size=1))
+    rpc.count_procs_alive()         # connect and start the service
+    stats = Stats()
+    start = time.time()
+    call_for(opts.seconds, rpc.count_procs_alive, stats)
+    return stats.result('latency', time.time() - start)
+
+
+def bench_throughput(opts):
+    pool = ClientPool(opts.conf_dir, pool_size=opts.clients)
+    rpc = CcnetRpcClient(pool)
+    stats = Stats()
+    threads = [threading.Thread(target=call_for,
+                                args=(opts.seconds, rpc.count_procs_alive,
+                                      stats))
+               for i in range(opts.threads)]
+    start = time.time()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    result = stats.result('throughput', time.time() - start)
+    result['clients'] = opts.clients
+    result['threads'] = opts.threads
+    return result
+
+
+def start_server(opts):
+    server = subprocess.Popen([sys.executable, os.path.abspath(__file__),
+                               '-c', opts.conf_dir, 'serve'])
+    rpc = BenchRpcClient(ClientPool(opts.conf_dir, pool_size=1))
+    # the service is there once the server has registered it
+    for i in range(50):
+        try:
+            if rpc.blob(1) == 'x':
+                return server, rpc
+        except Exception:
+            pass
+        if server.poll() is not None:
+            break
+        time.sleep(0.1)
+    server.kill()
+    raise RuntimeError('%s did not come up' % BENCH_SERVICE)
+
+
+def bench_large(opts):
+    server, rpc = start_server(opts)
+    try:
+        stats = Stats()
+        start = time.time()
+        call_for(opts.seconds, lambda: rpc.blob(opts.size), stats)
+        elapsed = time.time() - start
+    finally:
+        server.kill()
+        server.wait()
+    result = stats.result('large', elapsed)
+    result['bytes'] = opts.size
+    ok = len(stats.latency) - stats.errors
+    result['mb_per_sec'] = round(ok * opts.size / elapsed / (1 << 20), 1) \
+        if elapsed else 0
+    return result
+
+
+def bench_mq(opts):
+    receiver = SyncClient(opts.conf_dir)
+    receiver.connect_daemon()
+    receiver.prepare_recv_message(MQ_APP)
+    # so a sender which died doesn't hang the receive loop
+    receiver._connfd.settimeout(1.0)
+    sender = SyncClient(opts.conf_dir)
+    sender.connect_daemon()
+
+    sent = [0]
+    done = threading.Event()
+
+    def send():
+        try:
+            while not done.is_set():
+                sender.send_message(MQ_APP, 'pybench %d' % sent[0])
+                sent[0] += 1
+        except Exception:
+            stats.errors += 1
+
+    stats = Stats()
+    t = threading.Thread(target=send)
+    t.daemon = True
+    start = time.time()
+    t.start()
+    deadline = start + opts.seconds
+    last = start
+    while last < deadline:
+        # messages carry no send time, so the "latency" of mq is the
+        # gap between two received messages
+        try:
+            receiver.receive_message()
+        except socket.timeout:
+            break
+        now = time.time()
+        stats.add((now - last) * 1000)
+        last = now
+    done.set()
+    result = stats.result('mq', time.time() - start, unit='messages')
+    result['sent'] = sent[0]
+    return result
+
+
+def serve(opts):
+    from pysearpc import searpc_server
+    from ccnet import AsyncClient, RpcServerProc
+
+    def blob(size):
+        return 'x' * size
+
+    session = AsyncClient(opts.conf_dir)
+    session.connect_daemon()
+    searpc_server.create_service(BENCH_SERVICE)
+    searpc_server.register_function(BENCH_SERVICE, blob)
+    session.register_service(BENCH_SERVICE, 'basic', RpcServerProc)
+    session.main_loop()
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] [benchmark...]')
+    parser.add_option('-c', dest='conf_dir',
+                      default=os.path.expanduser('~/.ccnet'),
+                      help='ccnet configuration directory')
+    parser.add_option('-d', dest='seconds', type='float', default=5.0,
+                      help='seconds each benchmark runs')
+    parser.add_option('-n', dest='clients', type='int', default=8,
+                      help='pooled clients for throughput')
+    parser.add_option('-t', dest='threads', type='int', default=8,
+                      help='threads for throughput')
+    parser.add_option('-s', dest='size', type='int', default=1 << 20,
+                      help='result size in bytes for large')
+    opts, args = parser.parse_args()
+
+    if args == ['serve']:
+        serve(opts)
+        return
+
+    for name in args:
+        if name not in BENCHMARKS:
+            parser.error('unknown benchmark %s' % name)
+    for name in args or BENCHMARKS:
+        result = globals()['bench_' + name](opts)
+        print(json.dumps(result))
+        sys.stdout.flush()
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        sys.exit(1)
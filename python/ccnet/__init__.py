@@ -2,6 +2,7 @@ from ccnet.errors import NetworkError
 from ccnet.sync_client import SyncClient
 from ccnet.async_client import AsyncClient
 from ccnet.pool import ClientPool
+from ccnet.mux_client import MuxClient, MuxClientPool
 from ccnet.rpc import RpcClientBase, CcnetRpcClient, CcnetThreadedRpcClient
 
 from ccnet.processor import Processor
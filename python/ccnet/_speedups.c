@@ -0,0 +1,186 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * C versions of the functions called on every packet. The modules import
+ * them when this extension is built and keep their pure Python versions
+ * otherwise, so the two have to behave the same.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <string.h>
+
+#define CCNET_HEADER_LENGTH 8
+
+#define N_MESSAGE_FIELDS 8
+
+/* client.parse_response(body) -> (code, code_msg, content) */
+static PyObject *
+parse_response (PyObject *self, PyObject *args)
+{
+    const char *body, *nl;
+    Py_ssize_t len;
+
+    if (!PyArg_ParseTuple (args, "s#:parse_response", &body, &len))
+        return NULL;
+
+    if (len < 4) {
+        PyErr_SetString (PyExc_IndexError, "string index out of range");
+        return NULL;
+    }
+    if (body[3] == '\n')
+        return Py_BuildValue ("(s#s#s#)", body, (Py_ssize_t)3,
+                              "", (Py_ssize_t)0, body + 4, len - 4);
+
+    nl = memchr (body, '\n', len);
+    if (!nl) {
+        PyErr_SetString (PyExc_ValueError, "substring not found");
+        return NULL;
+    }
+    /* Like body[4:pos] for a newline before the 5th byte. */
+    return Py_BuildValue ("(s#s#s#)", body, (Py_ssize_t)3,
+                          body + 4, nl - body > 4 ? nl - body - 4 : 0,
+                          nl + 1, len - (nl + 1 - body));
+}
+
+/* packet.format_response(code, code_msg, content) -> body */
+static PyObject *
+format_response (PyObject *self, PyObject *args)
+{
+    const char *code, *code_msg = NULL, *content = NULL;
+    Py_ssize_t code_len, msg_len = 0, content_len = 0;
+    PyObject *ret;
+    char *p;
+
+    if (!PyArg_ParseTuple (args, "s#z#z#:format_response", &code, &code_len,
+                           &code_msg, &msg_len, &content, &content_len))
+        return NULL;
+
+    ret = PyBytes_FromStringAndSize (NULL, code_len + (msg_len ? msg_len + 1 : 0)
+                                     + 1 + content_len);
+    if (!ret)
+        return NULL;
+    p = PyBytes_AS_STRING (ret);
+    memcpy (p, code, code_len);
+    p += code_len;
+    if (msg_len) {
+        *p++ = ' ';
+        memcpy (p, code_msg, msg_len);
+        p += msg_len;
+    }
+    *p++ = '\n';
+    if (content_len)
+        memcpy (p, content, content_len);
+    return ret;
+}
+
+/* packet.pack_packet(ptype, id, body) -> header + body, the header as
+ * struct.pack('>BBHI', 1, ptype, len(body), id) */
+static PyObject *
+pack_packet (PyObject *self, PyObject *args)
+{
+    unsigned int ptype;
+    unsigned long id;
+    const char *body;
+    Py_ssize_t len;
+    PyObject *ret;
+    unsigned char *p;
+
+    if (!PyArg_ParseTuple (args, "Iks#:pack_packet", &ptype, &id, &body, &len))
+        return NULL;
+    if (len > 0xffff) {
+        PyErr_SetString (PyExc_ValueError, "packet body too long");
+        return NULL;
+    }
+
+    ret = PyBytes_FromStringAndSize (NULL, CCNET_HEADER_LENGTH + len);
+    if (!ret)
+        return NULL;
+    p = (unsigned char *) PyBytes_AS_STRING (ret);
+    p[0] = 1;
+    p[1] = ptype & 0xff;
+    p[2] = (len >> 8) & 0xff;
+    p[3] = len & 0xff;
+    p[4] = (id >> 24) & 0xff;
+    p[5] = (id >> 16) & 0xff;
+    p[6] = (id >> 8) & 0xff;
+    p[7] = id & 0xff;
+    memcpy (p + CCNET_HEADER_LENGTH, body, len);
+    return ret;
+}
+
+/*
+ * message.message_from_string(s) -> the fields matched by
+ * MESSAGE_PATTERN, or None: flags of digits, six fields without spaces,
+ * then the body up to the end of the line.
+ */
+static PyObject *
+parse_message (PyObject *self, PyObject *args)
+{
+    const char *s, *p, *end, *sp;
+    const char *start[N_MESSAGE_FIELDS];
+    Py_ssize_t len, flen[N_MESSAGE_FIELDS];
+    int i;
+
+    if (!PyArg_ParseTuple (args, "s#:parse_message", &s, &len))
+        return NULL;
+    end = s + len;
+
+    for (p = s; p < end && *p >= '0' && *p <= '9'; ++p)
+        ;
+    if (p == s || p == end || *p != ' ')
+        Py_RETURN_NONE;
+    start[0] = s;
+    flen[0] = p - s;
+    ++p;
+
+    for (i = 1; i < N_MESSAGE_FIELDS - 1; ++i) {
+        sp = memchr (p, ' ', end - p);
+        if (!sp || sp == p)
+            Py_RETURN_NONE;
+        start[i] = p;
+        flen[i] = sp - p;
+        p = sp + 1;
+    }
+
+    sp = memchr (p, '\n', end - p);
+    start[i] = p;
+    flen[i] = (sp ? sp : end) - p;
+
+    return Py_BuildValue ("(s#s#s#s#s#s#s#s#)",
+                          start[0], flen[0], start[1], flen[1],
+                          start[2], flen[2], start[3], flen[3],
+                          start[4], flen[4], start[5], flen[5],
+                          start[6], flen[6], start[7], flen[7]);
+}
+
+static PyMethodDef speedups_methods[] = {
+    { "parse_response", parse_response, METH_VARARGS, NULL },
+    { "format_response", format_response, METH_VARARGS, NULL },
+    { "pack_packet", pack_packet, METH_VARARGS, NULL },
+    { "parse_message", parse_message, METH_VARARGS, NULL },
+    { NULL, NULL, 0, NULL },
+};
+
+#if PY_MAJOR_VERSION >= 3
+
+static struct PyModuleDef speedups_module = {
+    PyModuleDef_HEAD_INIT, "_speedups", NULL, -1, speedups_methods,
+};
+
+PyMODINIT_FUNC
+PyInit__speedups (void)
+{
+    return PyModule_Create (&speedups_module);
+}
+
+#else
+
+PyMODINIT_FUNC
+init_speedups (void)
+{
+    Py_InitModule ("_speedups", speedups_methods);
+}
+
+#endif
@@ -3,7 +3,7 @@ import thread
 
 from ccnet.client import Client, parse_update, parse_response
 
-from ccnet.packet import response_to_packet, write_packet, read_packet
+from ccnet.packet import response_to_packet, write_packet
 from ccnet.packet import to_response_id, to_master_id, to_slave_id,  to_packet_id
 from ccnet.packet import CCNET_MSG_REQUEST, CCNET_MSG_UPDATE, CCNET_MSG_RESPONSE
 
@@ -175,6 +175,6 @@ class AsyncClient(Client):
 
     def main_loop(self):
         while True:
-            pkt = read_packet(self._connfd)
+            pkt = self.read_packet()
             # Would spawn a new greenlet after gevent.monkey.patch_all()
             thread.start_new_thread(self.handle_packet, args=(pkt,))
\ No newline at end of file
@@ -7,7 +7,7 @@ import logging
 
 from ccnet.packet import to_request_id, to_update_id
 from ccnet.packet import request_to_packet, update_to_packet
-from ccnet.packet import write_packet
+from ccnet.packet import write_packet, PacketReader
 
 from ccnet.errors import NetworkError
 
@@ -42,6 +42,13 @@ def parse_update(body):
 
     return code, code_msg, content
 
+try:
+    # the C versions, see _speedups.c
+    from ccnet._speedups import parse_response
+    parse_update = parse_response
+except ImportError:
+    pass
+
 class Client(object):
     '''Base ccnet client class'''
     def __init__(self, config_dir):
@@ -64,6 +71,7 @@ class Client(object):
         self.parse_config()
 
         self._connfd = None
+        self._reader = None
         self._req_id = 1000
 
     def __del__(self):
@@ -88,6 +96,10 @@ class Client(object):
             self._connfd.connect(('127.0.0.1', self.port))
         except:
             raise NetworkError("Can't connect to daemon")
+        self._reader = PacketReader(self._connfd)
+
+    def read_packet(self):
+        return self._reader.read_packet()
 
     def is_connected(self):
         return self._connfd != None
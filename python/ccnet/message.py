@@ -7,6 +7,14 @@ import re
 import uuid
 import time
 
+try:
+    # the C version, see _speedups.c
+    from ccnet._speedups import parse_message as _parse_message
+except ImportError:
+    _parse_message = None
+
+MESSAGE_FIELDS = ('flags', 'from', 'to', 'id', 'ctime', 'rtime', 'app', 'body')
+
 MESSAGE_PATTERN = re.compile(r'(?P<flags>[\d]+) (?P<from>[^ ]+) (?P<to>[^ ]+) (?P<id>[^ ]+) (?P<ctime>[^ ]+) (?P<rtime>[^ ]+) (?P<app>[^ ]+) (?P<body>.*)')
 
 class Message(object):
@@ -21,6 +29,12 @@ class Message(object):
         self.body = d['body']
 
 def message_from_string(s):
+    if _parse_message is not None:
+        fields = _parse_message(s)
+        if fields is None:
+            raise RuntimeError('Bad message: %s' % s)
+        return Message(dict(zip(MESSAGE_FIELDS, fields)))
+
     results = MESSAGE_PATTERN.match(s)
     if results is None:
         raise RuntimeError('Bad message: %s' % s)
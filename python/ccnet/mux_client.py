@@ -0,0 +1,296 @@
+#coding: UTF-8
+
+"""
+A client that multiplexes many requests over one daemon connection.
+
+The connection is read by a background thread, which hands each
+response to the request it belongs to. Calls from several threads can
+be outstanding at the same time, each waiting on its own Future.
+
+MuxClientPool gives the same interface as ClientPool, so the rpc
+clients in ccnet.rpc can use a single connection for all their calls:
+
+    pool = MuxClientPool(conf_dir)
+    rpc = CcnetThreadedRpcClient(pool)
+"""
+
+import collections
+import logging
+import threading
+
+from ccnet.client import Client, parse_response
+from ccnet.packet import to_master_id, CCNET_MSG_RESPONSE
+from ccnet.status_code import SC_PROC_DEAD, SS_PROC_DEAD, \
+    SC_PROC_DONE, SS_PROC_DONE
+from ccnet.sync_client import Response
+from ccnet.errors import NetworkError
+
+class Future(object):
+    '''The result of a request, set by the reader thread.
+
+    Callbacks added with add_done_callback() are run in the reader
+    thread. To use the future from an event loop, hand the result over
+    with the loop's thread safe call, e.g. call_soon_threadsafe().
+    '''
+    def __init__(self):
+        self._cond = threading.Condition()
+        self._done = False
+        self._result = None
+        self._error = None
+        self._callbacks = []
+
+    def done(self):
+        return self._done
+
+    def result(self, timeout=None):
+        with self._cond:
+            if not self._done:
+                self._cond.wait(timeout)
+            if not self._done:
+                raise NetworkError('Timeout waiting for daemon response')
+            if self._error:
+                raise self._error
+            return self._result
+
+    def add_done_callback(self, func):
+        with self._cond:
+            if not self._done:
+                self._callbacks.append(func)
+                return
+        func(self)
+
+    def _finish(self, result, error):
+        with self._cond:
+            if self._done:
+                return
+            self._result = result
+            self._error = error
+            self._done = True
+            self._cond.notify_all()
+            callbacks, self._callbacks = self._callbacks, []
+
+        for func in callbacks:
+            try:
+                func(self)
+            except Exception:
+                logging.exception('error in future callback')
+
+    def set_result(self, result):
+        self._finish(result, None)
+
+    def set_exception(self, error):
+        self._finish(None, error)
+
+
+class _Request(object):
+    '''Responses not read yet, and futures waiting for responses.'''
+    def __init__(self):
+        self.responses = collections.deque()
+        self.waiters = collections.deque()
+
+
+class MuxClient(Client):
+    '''Client with many requests outstanding on one connection'''
+    def __init__(self, config_dir):
+        Client.__init__(self, config_dir)
+        self._lock = threading.Lock()
+        self._send_lock = threading.Lock()
+        self._requests = {}
+        self._error = None
+        self._reader_thread = None
+
+    def connect_daemon(self):
+        Client.connect_daemon(self)
+        self._reader_thread = threading.Thread(target=self._read_loop,
+                                               name='ccnet-mux-reader')
+        self._reader_thread.daemon = True
+        self._reader_thread.start()
+
+    def disconnect_daemon(self):
+        if self.is_connected():
+            try:
+                self._connfd.close()
+            except:
+                pass
+
+    def is_broken(self):
+        return self._error is not None
+
+    def get_request_id(self):
+        with self._lock:
+            self._req_id += 1
+            req_id = self._req_id
+            self._requests[req_id] = _Request()
+        return req_id
+
+    def end_request(self, req_id):
+        '''Forget about @req_id. Its late responses are answered with
+        SC_PROC_DEAD.'''
+        with self._lock:
+            self._requests.pop(req_id, None)
+
+    def send_request(self, id, req):
+        with self._send_lock:
+            Client.send_request(self, id, req)
+
+    def send_update(self, id, code, code_msg, content=''):
+        with self._send_lock:
+            Client.send_update(self, id, code, code_msg, content)
+
+    def response_future(self, req_id):
+        '''A future for the next response of @req_id.'''
+        future = Future()
+        with self._lock:
+            req = self._requests.get(req_id)
+            if self._error:
+                error = self._error
+            elif req is None:
+                error = NetworkError('Unknown request %d' % req_id)
+            elif req.responses:
+                error = None
+                rsp = req.responses.popleft()
+            else:
+                req.waiters.append(future)
+                return future
+
+        if error:
+            future.set_exception(error)
+        else:
+            future.set_result(rsp)
+        return future
+
+    def request_async(self, req_id, req):
+        future = self.response_future(req_id)
+        self.send_request(req_id, req)
+        return future
+
+    def update_async(self, req_id, code, code_msg, content=''):
+        future = self.response_future(req_id)
+        self.send_update(req_id, code, code_msg, content)
+        return future
+
+    def read_response(self, req_id, timeout=None):
+        return self.response_future(req_id).result(timeout)
+
+    def _dispatch(self, pkt):
+        if pkt.header.ptype != CCNET_MSG_RESPONSE:
+            logging.warning('unexpected packet type %d', pkt.header.ptype)
+            return
+
+        req_id = to_master_id(pkt.header.id)
+        code, code_msg, content = parse_response(pkt.body)
+        rsp = Response(code, code_msg, content)
+
+        with self._lock:
+            req = self._requests.get(req_id)
+            if req is None:
+                future = None
+            elif req.waiters:
+                future = req.waiters.popleft()
+            else:
+                req.responses.append(rsp)
+                return
+
+        if future:
+            future.set_result(rsp)
+        elif code != SC_PROC_DEAD:
+            self.send_update(req_id, SC_PROC_DEAD, SS_PROC_DEAD)
+
+    def _read_loop(self):
+        try:
+            while True:
+                self._dispatch(self.read_packet())
+        except Exception as e:
+            if not isinstance(e, NetworkError):
+                logging.exception('mux client reader failed')
+                e = NetworkError('Read from daemon failed: %s' % e)
+
+        with self._lock:
+            self._error = e
+            waiters = []
+            for req in self._requests.itervalues():
+                waiters.extend(req.waiters)
+                req.waiters.clear()
+
+        for future in waiters:
+            future.set_exception(e)
+
+
+class MuxChannel(object):
+    '''One user's view of a MuxClient, with the interface of SyncClient
+    that the rpc clients use. Not to be shared between threads.'''
+    def __init__(self, mux):
+        self.mux = mux
+        self.req_ids = {}
+        self._last_id = None
+        self._owned = set()
+
+    def get_request_id(self):
+        req_id = self.mux.get_request_id()
+        self._owned.add(req_id)
+        return req_id
+
+    def send_request(self, id, req):
+        self._last_id = id
+        self.mux.send_request(id, req)
+
+    def send_update(self, id, code, code_msg, content=''):
+        self._last_id = id
+        self.mux.send_update(id, code, code_msg, content)
+
+    def read_response(self, timeout=None):
+        return self.mux.read_response(self._last_id, timeout)
+
+    def release(self):
+        '''Drop the requests not kept in req_ids.'''
+        keep = set(self.req_ids.itervalues())
+        for req_id in self._owned - keep:
+            self.mux.end_request(req_id)
+        self._owned &= keep
+
+
+class MuxClientPool(object):
+    '''Drop-in replacement of ClientPool on top of one MuxClient.'''
+    def __init__(self, conf_dir, max_idle=16):
+        self.conf_dir = conf_dir
+        self.max_idle = max_idle
+        self._lock = threading.Lock()
+        self._mux = None
+        self._idle = []
+
+    def _get_mux(self):
+        if self._mux is None or self._mux.is_broken():
+            mux = MuxClient(self.conf_dir)
+            mux.connect_daemon()
+            if self._mux:
+                self._mux.disconnect_daemon()
+            self._mux = mux
+            self._idle = []
+        return self._mux
+
+    def get_client(self):
+        with self._lock:
+            mux = self._get_mux()
+            if self._idle:
+                return self._idle.pop()
+            return MuxChannel(mux)
+
+    def return_client(self, channel):
+        channel.release()
+        with self._lock:
+            if channel.mux is not self._mux or channel.mux.is_broken():
+                return
+            if len(self._idle) < self.max_idle:
+                self._idle.append(channel)
+            else:
+                self._close_channel(channel)
+
+    def _close_channel(self, channel):
+        for req_id in channel.req_ids.itervalues():
+            if req_id <= 0:
+                continue
+            try:
+                channel.mux.send_update(req_id, SC_PROC_DONE, SS_PROC_DONE)
+            except NetworkError:
+                pass
+            channel.mux.end_request(req_id)
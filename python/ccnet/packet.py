@@ -12,10 +12,18 @@ About various types of id:
 """
 
 import logging
+import socket
 import struct
 
 from ccnet.utils import recvall, sendall, NetworkError
 
+try:
+    # the C versions, see _speedups.c
+    from ccnet._speedups import pack_packet as _pack_packet
+    from ccnet._speedups import format_response as _format_response
+except ImportError:
+    _pack_packet = _format_response = None
+
 REQUEST_ID_MASK = 0x7fffffff
 SLAVE_BIT_MASK = 0x80000000
 
@@ -82,8 +90,17 @@ def format_response(code, code_msg, content):
 
     return body
 
+if _format_response is not None:
+    format_response = _format_response
+
 format_update = format_response
 
+def trace_request(req, trace_id, span_id):
+    """Make @req part of a trace, see net/common/trace.h. The ids are
+    64-bit ints, @span_id the span of the caller. The daemon records the
+    trace if it has [Trace] configured."""
+    return '@trace=%016x-%016x %s' % (trace_id, span_id, req)
+
 def request_to_packet(id, buf):
     hdr = PacketHeader(1, CCNET_MSG_REQUEST, len(buf), to_request_id(id))
     return Packet(hdr, buf)
@@ -117,7 +134,59 @@ def read_packet(fd):
 
     return Packet(header, body)
 
+class PacketReader(object):
+    """Reads packets from a socket through a buffer.
+
+    Data is received in large chunks straight into a bytearray, and the
+    packets are cut out of it, so a burst of small responses costs one
+    recv instead of two per packet. Only the body is copied out.
+    """
+    def __init__(self, fd, bufsize=65536):
+        self.fd = fd
+        self._buf = bytearray(bufsize)
+        self._start = 0
+        self._end = 0
+
+    def _make_room(self, need):
+        # move the partial packet to the front, and grow for large ones
+        n = self._end - self._start
+        if self._start > 0:
+            self._buf[:n] = self._buf[self._start:self._end]
+            self._start, self._end = 0, n
+        if len(self._buf) < need:
+            self._buf.extend(bytearray(need - len(self._buf)))
+
+    def _fill(self, need):
+        while self._end - self._start < need:
+            if len(self._buf) - self._start < need:
+                self._make_room(need)
+            try:
+                n = self.fd.recv_into(memoryview(self._buf)[self._end:])
+            except socket.error as e:
+                raise NetworkError('Failed to read from socket: %s' % e)
+            if n <= 0:
+                logging.warning('connection to daemon is lost')
+                raise NetworkError('Connection to daemon is lost')
+            self._end += n
+
+    def read_packet(self):
+        self._fill(CCNET_HEADER_LENGTH)
+        ver, ptype, length, id = struct.unpack_from(CCNET_HEADER_FORMAT,
+                                                    self._buf, self._start)
+        total = CCNET_HEADER_LENGTH + length
+        self._fill(total)
+
+        start = self._start + CCNET_HEADER_LENGTH
+        body = memoryview(self._buf)[start:self._start + total].tobytes()
+        self._start += total
+        if self._start == self._end:
+            self._start = self._end = 0
+
+        return Packet(PacketHeader(ver, ptype, length, id), body)
+
 def write_packet(fd, packet):
-    hdr = packet.header.to_string()
-    sendall(fd, hdr)
-    sendall(fd, packet.body)
\ No newline at end of file
+    hdr = packet.header
+    if _pack_packet is not None and hdr.ver == 1:
+        sendall(fd, _pack_packet(hdr.ptype, hdr.id, packet.body))
+    else:
+        sendall(fd, hdr.to_string() + packet.body)
\ No newline at end of file
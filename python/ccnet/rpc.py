@@ -2,7 +2,8 @@ from pysearpc import SearpcClient, searpc_func, SearpcError
 
 from ccnet.status_code import SC_CLIENT_CALL, SS_CLIENT_CALL, \
     SC_CLIENT_MORE, SS_CLIENT_MORE, SC_SERVER_RET, \
-    SC_SERVER_MORE, SC_PROC_DEAD
+    SC_SERVER_MORE, SC_PROC_DEAD, SC_SERVER_STREAM, SC_CLIENT_CREDIT, \
+    SS_CLIENT_CALL_STREAM, RPC_STREAM_WINDOW
 
 from ccnet.errors import NetworkError
 
@@ -12,9 +13,15 @@ class DeadProcError(Exception):
 
 
 class RpcClientBase(SearpcClient):
-    
+    """Calls the functions of `service_name`.
+
+    The service processor started on a client is kept for later calls
+    on the same client, unless `req_pool` is False, and started again
+    when the daemon has dropped it.
+    """
+
     def __init__(self, ccnet_client_pool, service_name, retry_num=1,
-                 is_remote=False, remote_peer_id='', req_pool=False):
+                 is_remote=False, remote_peer_id='', req_pool=True):
         SearpcClient.__init__(self)
         self.pool = ccnet_client_pool
         self.service_name = service_name
@@ -24,44 +31,88 @@ class RpcClientBase(SearpcClient):
         self.req_pool = req_pool
         if self.is_remote and len(self.remote_peer_id) != 40:
             raise ValueError("Invalid remote peer id")
+        self.req_str = self.service_name
+        if self.is_remote:
+            self.req_str = "remote " + self.remote_peer_id + " " + self.service_name
 
     def _start_service(self, client):
         req_id = client.get_request_id()
-        req_str = self.service_name
-        if self.is_remote:
-            req_str = "remote " + self.remote_peer_id + " " + self.service_name
-        client.send_request(req_id, req_str)
+        client.send_request(req_id, self.req_str)
         rsp = client.read_response()
         if rsp.code != "200":
             raise SearpcError("Error received: %s %s (In _start_service)" % (rsp.code, rsp.code_msg))
         return req_id
 
+    def _read_stream(self, client, req_id, chunks):
+        """Server pushes chunks while it has credits, see
+        lib/rpc-common.h."""
+        consumed = 1
+        while True:
+            if consumed == RPC_STREAM_WINDOW // 2:
+                client.send_update(req_id, SC_CLIENT_CREDIT,
+                                   str(consumed), '')
+                consumed = 0
+            rsp = client.read_response()
+            if rsp.code == SC_SERVER_STREAM:
+                chunks.append(rsp.content)
+                consumed += 1
+            elif rsp.code == SC_SERVER_RET:
+                chunks.append(rsp.content)
+                return
+            else:
+                raise SearpcError("Error received: %s %s (In Read Stream)" % (rsp.code, rsp.code_msg))
+
     def _real_call(self, client, req_id, fcall_str):
-        client.send_update(req_id, SC_CLIENT_CALL, SS_CLIENT_CALL, fcall_str)
-                
+        client.send_update(req_id, SC_CLIENT_CALL,
+                           "%s %d" % (SS_CLIENT_CALL_STREAM, RPC_STREAM_WINDOW),
+                           fcall_str)
+
         rsp = client.read_response()
         if rsp.code == SC_SERVER_RET:
             return rsp.content
+        elif rsp.code == SC_SERVER_STREAM:
+            chunks = [rsp.content]
+            self._read_stream(client, req_id, chunks)
+            return ''.join(chunks)
         elif rsp.code == SC_SERVER_MORE:
-            buf = rsp.content
+            # servers without streaming
+            chunks = [rsp.content]
             while True:
                 client.send_update(req_id, SC_CLIENT_MORE,
                                    SS_CLIENT_MORE, '')
                 rsp = client.read_response()
                 if rsp.code == SC_SERVER_MORE:
-                    buf += rsp.content
+                    chunks.append(rsp.content)
                 elif rsp.code == SC_SERVER_RET:
-                    buf += rsp.content
+                    chunks.append(rsp.content)
                     break
                 else:
                     raise SearpcError("Error received: %s %s (In Read More)" % (rsp.code, rsp.code_msg))
 
-            return buf
+            return ''.join(chunks)
         elif rsp.code == SC_PROC_DEAD:
             raise DeadProcError()
         else:
             raise SearpcError("Error received: %s %s" % (rsp.code, rsp.code_msg))
 
+    def _pooled_call(self, client, fcall_str):
+        req_id = client.req_ids.get(self.req_str, -1)
+        if req_id != -1:
+            try:
+                return self._real_call(client, req_id, fcall_str)
+            except DeadProcError:
+                # The daemon dropped the idle service, which is expected
+                # and not counted as a retry.
+                client.req_ids[self.req_str] = -1
+
+        req_id = self._start_service(client)
+        client.req_ids[self.req_str] = req_id
+        try:
+            return self._real_call(client, req_id, fcall_str)
+        except DeadProcError:
+            client.req_ids[self.req_str] = -1
+            raise
+
     def call_remote_func_sync(self, fcall_str):
         """Call remote function `fcall_str` and wait response."""
 
@@ -70,14 +121,9 @@ class RpcClientBase(SearpcClient):
             try:
                 client = self.pool.get_client()
                 if self.req_pool:
-                    req_id = client.req_ids.get(self.service_name, -1)
-                    if req_id == -1:
-                        req_id = self._start_service(client)
-                        client.req_ids[self.service_name] = req_id
                     try:
-                        ret = self._real_call(client, req_id, fcall_str)
+                        ret = self._pooled_call(client, fcall_str)
                     except DeadProcError:
-                        client.req_ids[self.service_name] = -1
                         self.pool.return_client(client)
                         if retried < self.retry_num:
                             retried = retried + 1
@@ -135,6 +181,10 @@ class CcnetRpcClient(RpcClientBase):
     @searpc_func("int", ["string", "string"])
     def add_role(self, peer_id, role):
         pass
+
+    @searpc_func("string", ["string"])
+    def import_peers(self, records):
+        pass
     
     @searpc_func("int", ["string", "string"])
     def remove_role(self, peer_id, role):
@@ -155,6 +205,10 @@ class CcnetRpcClient(RpcClientBase):
     @searpc_func("int", [])
     def count_procs_dead(self):
         pass
+
+    @searpc_func("string", [])
+    def get_proc_pool_stats(self):
+        pass
     
     @searpc_func("string", ["string"])
     def get_config(self, key):
@@ -168,6 +222,54 @@ class CcnetRpcClient(RpcClientBase):
     def list_peer_stat(self, key, value):
         pass
 
+    @searpc_func("string", [])
+    def get_traffic_stats(self):
+        pass
+
+    @searpc_func("string", [])
+    def get_memory_stats(self):
+        pass
+
+    @searpc_func("int", ["string", "string"])
+    def set_log_level(self, module, level):
+        pass
+
+    @searpc_func("string", [])
+    def get_log_levels(self):
+        pass
+
+    @searpc_func("string", ["string", "int"])
+    def profile(self, cmd, hz):
+        pass
+
+    @searpc_func("string", [])
+    def get_db_pool_stats(self):
+        pass
+
+    @searpc_func("string", [])
+    def get_rpc_pool_stats(self):
+        pass
+
+    @searpc_func("string", [])
+    def get_placement_stats(self):
+        pass
+
+    @searpc_func("string", [])
+    def get_user_cache_stats(self):
+        pass
+
+    @searpc_func("string", [])
+    def get_org_cache_stats(self):
+        pass
+
+    @searpc_func("string", [])
+    def get_org_shard_stats(self):
+        pass
+
+    @searpc_func("string", [])
+    def get_preload_stats(self):
+        pass
+
 
 class CcnetThreadedRpcClient(RpcClientBase):
 
@@ -175,6 +277,28 @@ class CcnetThreadedRpcClient(RpcClientBase):
         RpcClientBase.__init__(self, ccnet_client_pool, "ccnet-threaded-rpcserver",
                                *args, **kwargs)
 
+    # Served from a copy of the peers which may be a second old, without
+    # waiting on the daemon's main loop.
+    @searpc_func("string", [])
+    def list_peers(self):
+        pass
+
+    @searpc_func("objlist", ["string"])
+    def get_peers_by_role(self, role):
+        pass
+
+    @searpc_func("object", ["string"])
+    def get_peer(self, peer_id):
+        pass
+
+    @searpc_func("object", ["string"])
+    def get_peer_by_idname(self, idname):
+        pass
+
+    @searpc_func("string", ["string"])
+    def sign_message(self, message):
+        pass
+
     @searpc_func("int", ["string", "string", "int", "int"])
     def add_emailuser(self, email, passwd, is_staff, is_active):
         pass
@@ -199,6 +323,14 @@ class CcnetThreadedRpcClient(RpcClientBase):
     def get_emailusers(self, start, limit):
         pass
 
+    @searpc_func("objlist", ["int", "int"])
+    def get_emailusers_after(self, last_id, limit):
+        pass
+
+    @searpc_func("objlist", ["string", "int"])
+    def search_emailusers(self, prefix, limit):
+        pass
+
     @searpc_func("int64", [])
     def count_emailusers(self):
         pass
@@ -251,6 +383,14 @@ class CcnetThreadedRpcClient(RpcClientBase):
     def group_remove_member(self, group_id, user_name, member_name):
         pass
 
+    @searpc_func("string", ["int", "string", "string"])
+    def group_add_members(self, group_id, user_name, members):
+        pass
+
+    @searpc_func("string", ["int", "string", "string"])
+    def group_remove_members(self, group_id, user_name, members):
+        pass
+
     @searpc_func("int", ["int", "string"])
     def group_set_admin(self, group_id, member_name):
         pass
@@ -267,9 +407,17 @@ class CcnetThreadedRpcClient(RpcClientBase):
     def get_groups(self, user_name):
         pass
 
+    @searpc_func("objlist", ["string"])
+    def get_groups_by_users(self, users):
+        pass
+
     @searpc_func("objlist", ["int", "int"])
     def get_all_groups(self, start, limit):
         pass
+
+    @searpc_func("objlist", ["int", "int"])
+    def get_all_groups_after(self, last_id, limit):
+        pass
     
     @searpc_func("object", ["int"])
     def get_group(self, group_id):
@@ -279,6 +427,14 @@ class CcnetThreadedRpcClient(RpcClientBase):
     def get_group_members(self, group_id):
         pass
 
+    @searpc_func("int", ["int"])
+    def count_group_members(self, group_id):
+        pass
+
+    @searpc_func("string", ["int64", "int"])
+    def get_changes_since(self, version, limit):
+        pass
+
     @searpc_func("int", ["int", "string"])
     def check_group_staff(self, group_id, username):
         pass
@@ -327,6 +483,10 @@ class CcnetThreadedRpcClient(RpcClientBase):
     def get_all_orgs(self, start, limit):
         pass
 
+    @searpc_func("objlist", ["int", "int"])
+    def get_all_orgs_after(self, last_id, limit):
+        pass
+
     @searpc_func("object", ["string"])
     def get_org_by_url_prefix(self, url_prefix):
         pass
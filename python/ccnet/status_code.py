@@ -73,5 +73,12 @@ SC_SERVER_RET  = '311'
 SS_SERVER_RET  = 'SERVER RET'
 SC_SERVER_MORE = '312'
 SS_SERVER_MORE = 'HAS MORE'
+SC_CLIENT_CREDIT = '304'
+SS_CLIENT_CREDIT = 'CREDIT'
+SC_SERVER_STREAM = '313'
+SS_SERVER_STREAM = 'STREAM'
+# see lib/rpc-common.h
+SS_CLIENT_CALL_STREAM = 'CLIENT CALL STREAM'
+RPC_STREAM_WINDOW = 8
 SC_SERVER_ERR  = '411'
 SS_SERVER_ERR  = 'Fail to invoke the function, check the function'
\ No newline at end of file
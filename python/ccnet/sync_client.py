@@ -1,6 +1,6 @@
 from ccnet.client import Client, parse_response
-from ccnet.packet import read_packet, CCNET_MSG_RESPONSE
-from ccnet.status_code import SC_PROC_DONE, SS_PROC_DONE
+from ccnet.packet import CCNET_MSG_RESPONSE
+from ccnet.status_code import SC_PROC_DONE, SS_PROC_DONE, SC_UNKNOWN_SERVICE
 from ccnet.message import message_from_string, gen_inner_message_string
 
 _REQ_ID_START = 1000
@@ -26,7 +26,7 @@ class SyncClient(Client):
                 pass
 
     def read_response(self):
-        packet = read_packet(self._connfd)
+        packet = self.read_packet()
         if packet.header.ptype != CCNET_MSG_RESPONSE:
             raise RuntimeError('Invalid Response')
 
@@ -35,6 +35,18 @@ class SyncClient(Client):
         return Response(code, code_msg, content)
 
     def send_cmd(self, cmd):
+        # the daemon runs the command in the request and is done after
+        # the first response
+        req_id = self.get_request_id()
+        self.send_request(req_id, 'run-cmd ' + cmd)
+        resp = self.read_response()
+        if resp.code == SC_UNKNOWN_SERVICE:
+            return self._send_cmd_compat(cmd)
+        if resp.code != '200':
+            raise RuntimeError('Failed to send-cmd: %s %s' % (resp.code, resp.code_msg))
+        return resp.content
+
+    def _send_cmd_compat(self, cmd):
         req_id = self.get_request_id()
         self.send_request(req_id, 'receive-cmd')
         resp = self.read_response()
@@ -49,6 +61,7 @@ class SyncClient(Client):
             raise RuntimeError('Failed to send-cmd: %s %s' % (resp.code, resp.code_msg))
 
         self.send_update(req_id, SC_PROC_DONE, SS_PROC_DONE, '')
+        return resp.content
 
     def prepare_recv_message(self, msg_type):
         request = 'mq-server %s' % msg_type
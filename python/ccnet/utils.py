@@ -21,15 +21,7 @@ def recvall(fd, total):
     return data
 
 def sendall(fd, data):
-    total = len(data)
-    offset = 0
-    while offset < total:
-        try:
-            n = fd.send(data[offset:])
-        except socket.error as e:
-            raise NetworkError('Failed to write to socket: %s' % e)
-
-        if n <= 0:
-            raise NetworkError('Failed to write to socket')
-        else:
-            offset += n
\ No newline at end of file
+    try:
+        fd.sendall(data)
+    except socket.error as e:
+        raise NetworkError('Failed to write to socket: %s' % e)
\ No newline at end of file
@@ -0,0 +1,211 @@
+#!/usr/bin/env python
+# encoding: utf-8
+
+"""Replay an rpc capture against a running ccnet-server.
+
+The capture is written by the daemon with [RPC Capture] set, see
+net/common/rpc-capture.h. The calls are sent at their recorded pace,
+sped up by -s, from a pool of -n connections. When all of them are
+busy the calls queue up and go out late; how late is reported too.
+
+The results are printed as one JSON object per function, then one for
+the whole run:
+
+  {"func": "get_emailuser", "calls": 1520, "errors": 0,
+   "p50_ms": 0.41, "p90_ms": 0.93, "p99_ms": 4.2, "max_ms": 12.0,
+   "captured_p50_ms": 0.37, "captured_p99_ms": 3.1}
+
+Usage: ccnet-rpcreplay.py [-c conf-dir] [-s speedup] [-n conns]
+                          [-f func-regex] [-l limit] capture-file
+
+A speedup of 0 sends the calls as fast as the connections allow.
+Replaying writes is up to you: use a test server.
+"""
+
+from __future__ import print_function
+
+import json
+import optparse
+import os
+import re
+import sys
+import threading
+import time
+
+try:
+    import queue
+except ImportError:
+    import Queue as queue
+
+from ccnet.pool import ClientPool
+from ccnet.rpc import RpcClientBase
+
+MAGIC = b'CCNET-RPC-CAPTURE 1\n'
+
+
+class Call(object):
+    __slots__ = ('arrival', 'duration', 'ret_len', 'service', 'fcall',
+                 'func')
+
+    def __init__(self, arrival, duration, ret_len, service, fcall):
+        self.arrival = arrival
+        self.duration = duration
+        self.ret_len = ret_len
+        self.service = service
+        self.fcall = fcall
+        try:
+            self.func = json.loads(fcall)[0]
+        except (ValueError, IndexError, TypeError):
+            self.func = '?'
+
+
+def read_capture(path):
+    """The calls of the capture, in the order they were answered."""
+    with open(path, 'rb') as f:
+        if f.readline() != MAGIC:
+            raise ValueError('%s is not an rpc capture' % path)
+        while True:
+            header = f.readline()
+            if not header:
+                return
+            fields = header.split()
+            if len(fields) != 6:
+                raise ValueError('Bad record header: %r' % header)
+            length = int(fields[5])
+            fcall = f.read(length)
+            f.read(1)
+            if len(fcall) != length:
+                return              # cut short while being written
+            yield Call(int(fields[0]), int(fields[1]), int(fields[2]),
+                       fields[4].decode('utf-8'), fcall.decode('utf-8'))
+
+
+def percentile(values, p):
+    if not values:
+        return 0
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+class Stats(object):
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latency = {}           # func -> [ms]
+        self.captured = {}
+        self.errors = {}
+        self.late = []
+
+    def add(self, call, ms, late_ms, error):
+        with self.lock:
+            self.latency.setdefault(call.func, []).append(ms)
+            self.captured.setdefault(call.func, []).append(
+                call.duration / 1000.0)
+            if error:
+                self.errors[call.func] = self.errors.get(call.func, 0) + 1
+            self.late.append(late_ms)
+
+    def report(self, elapsed):
+        total = 0
+        for func in sorted(self.latency):
+            lat = sorted(self.latency[func])
+            cap = sorted(self.captured[func])
+            total += len(lat)
+            print(json.dumps({
+                'func': func, 'calls': len(lat),
+                'errors': self.errors.get(func, 0),
+                'p50_ms': round(percentile(lat, 0.5), 3),
+                'p90_ms': round(percentile(lat, 0.9), 3),
+                'p99_ms': round(percentile(lat, 0.99), 3),
+                'max_ms': round(lat[-1], 3),
+                'captured_p50_ms': round(percentile(cap, 0.5), 3),
+                'captured_p99_ms': round(percentile(cap, 0.99), 3),
+            }))
+        late = sorted(self.late)
+        print(json.dumps({
+            'calls': total, 'errors': sum(self.errors.values()),
+            'seconds': round(elapsed, 3),
+            'calls_per_sec': round(total / elapsed, 1) if elapsed else 0,
+            'late_p50_ms': round(percentile(late, 0.5), 3),
+            'late_p99_ms': round(percentile(late, 0.99), 3),
+        }))
+
+
+def worker(pool, calls, stats):
+    clients = {}
+    while True:
+        item = calls.get()
+        if item is None:
+            return
+        call, due = item
+        client = clients.get(call.service)
+        if not client:
+            client = clients[call.service] = RpcClientBase(pool, call.service)
+        start = time.time()
+        try:
+            ret = client.call_remote_func_sync(call.fcall)
+            error = ret is None or '"err_code"' in ret
+        except Exception:
+            error = True
+        end = time.time()
+        stats.add(call, (end - start) * 1000,
+                  max(start - due, 0) * 1000 if due else 0, error)
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] capture-file')
+    parser.add_option('-c', dest='conf_dir',
+                      default=os.path.expanduser('~/.ccnet'),
+                      help='ccnet configuration directory')
+    parser.add_option('-s', dest='speedup', type='float', default=1.0,
+                      help='replay this many times faster, 0 for no pacing')
+    parser.add_option('-n', dest='conns', type='int', default=16,
+                      help='number of connections')
+    parser.add_option('-f', dest='func', help='only functions matching this')
+    parser.add_option('-l', dest='limit', type='int', default=0,
+                      help='stop after this many calls')
+    opts, args = parser.parse_args()
+    if len(args) != 1:
+        parser.error('need a capture file')
+
+    pool = ClientPool(opts.conf_dir, pool_size=opts.conns)
+    stats = Stats()
+    calls = queue.Queue(opts.conns * 4)
+    threads = [threading.Thread(target=worker, args=(pool, calls, stats))
+               for i in range(opts.conns)]
+    for t in threads:
+        t.daemon = True
+        t.start()
+
+    func_re = re.compile(opts.func) if opts.func else None
+    # The records are in the order the calls finished, which is not far
+    # from the order they arrived in.
+    first = None
+    n = 0
+    start = time.time()
+    for call in read_capture(args[0]):
+        if func_re and not func_re.search(call.func):
+            continue
+        if first is None:
+            first = call.arrival
+        due = 0
+        if opts.speedup > 0:
+            due = start + max(call.arrival - first, 0) / 1e6 / opts.speedup
+            delay = due - time.time()
+            if delay > 0:
+                time.sleep(delay)
+        calls.put((call, due))
+        n += 1
+        if opts.limit and n >= opts.limit:
+            break
+
+    for t in threads:
+        calls.put(None)
+    for t in threads:
+        t.join()
+    stats.report(time.time() - start)
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        sys.exit(1)